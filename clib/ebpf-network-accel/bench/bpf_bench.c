@@ -0,0 +1,831 @@
+/**
+ * Zixiao Hypervisor - eBPF Datapath Benchmark
+ *
+ * Drives the XDP guard, XDP and TC programs through BPF_PROG_TEST_RUN over a fixed
+ * set of packets and map states, checks every verdict, and reports the
+ * cost per packet together with each program's instruction counts.
+ *
+ * Nothing is attached and nothing is pinned: both objects are loaded
+ * privately and their maps seeded per case, so the bench runs next to a
+ * live agent without touching its datapath. Packets enter on loopback,
+ * the only device every host has.
+ *
+ * Usage: bpf_bench [--repeat N] [--rounds N] [--output FILE] [--filter STR]
+ *
+ * Results go to stdout as a table and, with --output, to FILE as JSON.
+ * Exits 1 if any verdict differs from the expected one.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_maps.h"
+#include "xdp_redirect.skel.h"
+#include "tc_filter.skel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <sys/utsname.h>
+#include <linux/pkt_cls.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#define BENCH_REPEAT_DEFAULT    100000
+#define BENCH_ROUNDS_DEFAULT    5
+#define BENCH_ROUNDS_MAX        64
+#define BENCH_PKT_MAX           256
+#define BENCH_PKT_MIN           64      /* Padded to the Ethernet minimum */
+
+/* Rules installed on the bench interface, all /0 in both tries */
+#define BENCH_RULES             64
+#define BENCH_SLOT_SSH          0       /* TCP 22: drop, first candidate */
+#define BENCH_SLOT_VXLAN        62      /* UDP 4789: redirect */
+#define BENCH_SLOT_HTTP         63      /* TCP 80: drop, last candidate */
+#define BENCH_FILLER_PORT       10000   /* UDP 10000 + slot: pass */
+
+/* TCP flags byte, as parsing.h decodes it */
+#define BENCH_TCP_ACK           0x10
+#define BENCH_TCP_PSH           0x08
+
+/* ============================================================================
+ * Packets
+ * ============================================================================ */
+
+typedef enum {
+    PKT_IPV4 = 0,
+    PKT_IPV6,
+    PKT_ARP
+} pkt_family_t;
+
+typedef struct {
+    pkt_family_t family;
+    int vlans;              /* Tags in the frame: 0, 1 or 2 (QinQ) */
+    uint8_t protocol;       /* IPPROTO_TCP or IPPROTO_UDP */
+    uint16_t src_port;
+    uint16_t dst_port;
+} pkt_spec_t;
+
+/* Fixed endpoints: 10.0.0.1 -> 10.0.0.2, fd00::1 -> fd00::2 */
+static const uint8_t bench_src_mac[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x01 };
+static const uint8_t bench_dst_mac[ETH_ALEN] = { 0x52, 0x54, 0x00, 0x00, 0x00, 0x02 };
+
+static void bench_addrs(pkt_family_t family, uint32_t src[4], uint32_t dst[4]) {
+    memset(src, 0, 16);
+    memset(dst, 0, 16);
+    if (family == PKT_IPV6) {
+        src[0] = dst[0] = htonl(0xfd000000);
+        src[3] = htonl(1);
+        dst[3] = htonl(2);
+    } else {
+        src[2] = dst[2] = htonl(0xffff);
+        src[3] = htonl(0x0a000001);
+        dst[3] = htonl(0x0a000002);
+    }
+}
+
+static uint16_t ip_checksum(const void *data, size_t len) {
+    const uint16_t *p = data;
+    uint32_t sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *p++;
+    if (len)
+        sum += *(const uint8_t *)p;
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+static void put_be16(uint8_t *p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+/* Build a frame for spec into buf; returns its length */
+static size_t build_packet(const pkt_spec_t *spec, uint8_t *buf) {
+    uint8_t *cur = buf;
+    size_t l4_len = spec->protocol == IPPROTO_TCP ? sizeof(struct tcphdr)
+                                                  : sizeof(struct udphdr);
+    uint32_t src[4], dst[4];
+
+    memset(buf, 0, BENCH_PKT_MAX);
+    bench_addrs(spec->family, src, dst);
+
+    struct ether_header *eth = (struct ether_header *)cur;
+    memcpy(eth->ether_dhost, bench_dst_mac, ETH_ALEN);
+    memcpy(eth->ether_shost, bench_src_mac, ETH_ALEN);
+    cur += sizeof(*eth);
+
+    /* Tags go outermost first; the ethertype chain ends in the L3 type */
+    uint16_t l3_type = spec->family == PKT_IPV6 ? ETHERTYPE_IPV6 :
+                       spec->family == PKT_ARP ? ETHERTYPE_ARP : ETHERTYPE_IP;
+    uint8_t *type = cur - 2;
+    for (int i = 0; i < spec->vlans; i++) {
+        put_be16(type, i == 0 && spec->vlans > 1 ? 0x88a8 : ETHERTYPE_VLAN);
+        put_be16(cur, 100 + i);
+        type = cur + 2;
+        cur += 4;
+    }
+    put_be16(type, l3_type);
+
+    if (spec->family == PKT_ARP) {
+        /* Ethernet/IPv4 request; the programs only look at the type */
+        static const uint8_t arp[8] = { 0, 1, 8, 0, 6, 4, 0, 1 };
+        memcpy(cur, arp, sizeof(arp));
+        cur += 28;
+    } else if (spec->family == PKT_IPV6) {
+        struct ip6_hdr *ip6 = (struct ip6_hdr *)cur;
+        ip6->ip6_flow = htonl(6U << 28);
+        ip6->ip6_plen = htons(l4_len);
+        ip6->ip6_nxt = spec->protocol;
+        ip6->ip6_hlim = 64;
+        memcpy(&ip6->ip6_src, src, 16);
+        memcpy(&ip6->ip6_dst, dst, 16);
+        cur += sizeof(*ip6);
+    } else {
+        struct iphdr *ip = (struct iphdr *)cur;
+        ip->version = 4;
+        ip->ihl = 5;
+        ip->tot_len = htons(sizeof(*ip) + l4_len);
+        ip->ttl = 64;
+        ip->protocol = spec->protocol;
+        ip->saddr = src[3];
+        ip->daddr = dst[3];
+        ip->check = ip_checksum(ip, sizeof(*ip));
+        cur += sizeof(*ip);
+    }
+
+    if (spec->family != PKT_ARP) {
+        if (spec->protocol == IPPROTO_TCP) {
+            struct tcphdr *tcp = (struct tcphdr *)cur;
+            tcp->source = htons(spec->src_port);
+            tcp->dest = htons(spec->dst_port);
+            tcp->doff = sizeof(*tcp) / 4;
+            /* An established segment, so flow offload takes it */
+            cur[13] = BENCH_TCP_ACK | BENCH_TCP_PSH;
+            tcp->window = htons(65535);
+        } else {
+            struct udphdr *udp = (struct udphdr *)cur;
+            udp->source = htons(spec->src_port);
+            udp->dest = htons(spec->dst_port);
+            udp->len = htons(sizeof(*udp));
+        }
+        cur += l4_len;
+    }
+
+    size_t len = cur - buf;
+    return len < BENCH_PKT_MIN ? BENCH_PKT_MIN : len;
+}
+
+/* ============================================================================
+ * Cases
+ * ============================================================================ */
+
+typedef enum {
+    PROG_XDP_REDIRECT = 0,
+    PROG_XDP_FASTPATH,
+    PROG_XDP_FLOW_OFFLOAD,
+    PROG_XDP_GUARD,
+    PROG_TC_FILTER,
+    PROG_COUNT
+} bench_prog_t;
+
+static const char *const prog_names[PROG_COUNT] = {
+    [PROG_XDP_REDIRECT] = "xdp_redirect_prog",
+    [PROG_XDP_FASTPATH] = "xdp_vm_fastpath",
+    [PROG_XDP_FLOW_OFFLOAD] = "xdp_flow_offload",
+    [PROG_XDP_GUARD] = "xdp_ddos_guard",
+    [PROG_TC_FILTER] = "tc_filter_prog",
+};
+
+/* Map state a case runs against; everything else is reset */
+#define SETUP_REDIRECT          (1U << 0)   /* Redirect rule for the interface */
+#define SETUP_REWRITE           (1U << 1)   /* ... with MAC rewrite */
+#define SETUP_FLOW              (1U << 2)   /* Packet's flow is offloaded */
+#define SETUP_RULES             (1U << 3)   /* TC rule set is live */
+#define SETUP_RATE_CONFORM      (1U << 4)   /* Rate limit never reached */
+#define SETUP_RATE_EXCEED       (1U << 5)   /* Rate limit with no tokens */
+#define SETUP_GUARD             (1U << 6)   /* Guard runs, chaining to redirect */
+#define SETUP_GUARD_SIZE        (1U << 7)   /* ... dropping frames over 60 bytes */
+#define SETUP_GUARD_BLOCK       (1U << 8)   /* Source is blocked from destination */
+#define SETUP_GUARD_FLOOD       (1U << 9)   /* UDP cap with no tokens */
+
+typedef struct {
+    bench_prog_t prog;
+    const char *name;
+    pkt_spec_t pkt;
+    uint32_t setup;
+    uint32_t expect;
+} bench_case_t;
+
+#define TCP4(dport)     { PKT_IPV4, 0, IPPROTO_TCP, 40000, (dport) }
+#define TCP6(dport)     { PKT_IPV6, 0, IPPROTO_TCP, 40000, (dport) }
+#define UDP4(dport)     { PKT_IPV4, 0, IPPROTO_UDP, 40000, (dport) }
+#define VLAN4(dport)    { PKT_IPV4, 1, IPPROTO_TCP, 40000, (dport) }
+#define QINQ6(dport)    { PKT_IPV6, 2, IPPROTO_TCP, 40000, (dport) }
+#define ARP             { PKT_ARP, 0, 0, 0, 0 }
+
+static const bench_case_t bench_cases[] = {
+    { PROG_XDP_REDIRECT, "ipv4-miss", TCP4(8080), 0, XDP_PASS },
+    { PROG_XDP_REDIRECT, "ipv4-hit", TCP4(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_REDIRECT, "ipv4-hit-rewrite", TCP4(8080),
+      SETUP_REDIRECT | SETUP_REWRITE, XDP_REDIRECT },
+    { PROG_XDP_REDIRECT, "ipv6-hit", TCP6(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_REDIRECT, "vlan-hit", VLAN4(8080), SETUP_REDIRECT, XDP_REDIRECT },
+
+    { PROG_XDP_FASTPATH, "ipv4-miss", TCP4(8080), 0, XDP_PASS },
+    { PROG_XDP_FASTPATH, "ipv4-hit", TCP4(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_FASTPATH, "ipv6-hit", TCP6(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_FASTPATH, "qinq-hit", QINQ6(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_FASTPATH, "arp", ARP, SETUP_REDIRECT, XDP_PASS },
+
+    { PROG_XDP_FLOW_OFFLOAD, "ipv4-flow-hit", TCP4(8080), SETUP_FLOW, XDP_REDIRECT },
+    { PROG_XDP_FLOW_OFFLOAD, "ipv6-flow-hit", TCP6(8080), SETUP_FLOW, XDP_REDIRECT },
+    { PROG_XDP_FLOW_OFFLOAD, "ipv4-flow-miss", TCP4(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_FLOW_OFFLOAD, "ipv4-miss", TCP4(8080), 0, XDP_PASS },
+
+    { PROG_XDP_GUARD, "unconfigured", TCP4(8080), SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_GUARD, "ipv4-pass", TCP4(8080), SETUP_GUARD | SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_GUARD, "ipv6-pass", TCP6(8080), SETUP_GUARD | SETUP_REDIRECT, XDP_REDIRECT },
+    { PROG_XDP_GUARD, "oversize", TCP4(8080), SETUP_GUARD | SETUP_GUARD_SIZE, XDP_DROP },
+    { PROG_XDP_GUARD, "blocked", TCP4(8080), SETUP_GUARD | SETUP_GUARD_BLOCK, XDP_DROP },
+    { PROG_XDP_GUARD, "udp-flood", UDP4(53), SETUP_GUARD | SETUP_GUARD_FLOOD, XDP_DROP },
+
+    { PROG_TC_FILTER, "no-rules", TCP4(80), 0, TC_ACT_OK },
+    { PROG_TC_FILTER, "ipv4-first-rule", TCP4(22), SETUP_RULES, TC_ACT_SHOT },
+    { PROG_TC_FILTER, "ipv4-last-rule", TCP4(80), SETUP_RULES, TC_ACT_SHOT },
+    { PROG_TC_FILTER, "ipv6-last-rule", TCP6(80), SETUP_RULES, TC_ACT_SHOT },
+    { PROG_TC_FILTER, "vlan-first-rule", VLAN4(22), SETUP_RULES, TC_ACT_SHOT },
+    { PROG_TC_FILTER, "ipv4-redirect", UDP4(4789), SETUP_RULES, TC_ACT_REDIRECT },
+    { PROG_TC_FILTER, "ipv4-rule-miss", UDP4(53), SETUP_RULES, TC_ACT_OK },
+    { PROG_TC_FILTER, "rate-conform", TCP4(8080), SETUP_RATE_CONFORM, TC_ACT_OK },
+    { PROG_TC_FILTER, "rate-exceed", TCP4(8080), SETUP_RATE_EXCEED, TC_ACT_SHOT },
+};
+
+#define BENCH_CASES (sizeof(bench_cases) / sizeof(bench_cases[0]))
+
+typedef struct {
+    const bench_case_t *bc;
+    size_t pkt_len;
+    uint32_t retval;
+    uint32_t min_ns;
+    uint32_t median_ns;
+    uint32_t max_ns;
+    int error;              /* Negative errno from the run, 0 if it ran */
+} bench_result_t;
+
+typedef struct {
+    int fd;
+    uint32_t xlated_insns;
+    uint32_t jited_bytes;
+    uint32_t verified_insns;
+} bench_prog_info_t;
+
+/* ============================================================================
+ * Loading
+ * ============================================================================ */
+
+static struct {
+    struct xdp_redirect_bpf *xdp;
+    struct tc_filter_bpf *tc;
+    uint32_t nr_cpus;
+    uint32_t ifindex;
+    int table_full;         /* Redirect table holding the bench rule */
+    int table_empty;
+    bench_prog_info_t progs[PROG_COUNT];
+} bench;
+
+/* Keep every map private to this process */
+static void unpin_maps(struct bpf_object *obj) {
+    struct bpf_map *map;
+    bpf_object__for_each_map(map, obj)
+        bpf_map__set_pin_path(map, NULL);
+}
+
+static int load_objects(void) {
+    int err;
+
+    bench.xdp = xdp_redirect_bpf__open();
+    if (!bench.xdp) {
+        fprintf(stderr, "Failed to open XDP object: %s\n", strerror(errno));
+        return -errno;
+    }
+    unpin_maps(bench.xdp->obj);
+    bench.xdp->rodata->nr_cpus = bench.nr_cpus;
+    bpf_map__set_max_entries(bench.xdp->maps.stats_map, STATS_SLOTS * bench.nr_cpus);
+
+    err = xdp_redirect_bpf__load(bench.xdp);
+    if (err) {
+        fprintf(stderr, "Failed to load XDP object: %s\n", strerror(-err));
+        return err;
+    }
+
+    bench.tc = tc_filter_bpf__open();
+    if (!bench.tc) {
+        fprintf(stderr, "Failed to open TC object: %s\n", strerror(errno));
+        return -errno;
+    }
+    unpin_maps(bench.tc->obj);
+    bench.tc->rodata->nr_cpus = bench.nr_cpus;
+    bpf_map__set_max_entries(bench.tc->maps.tc_stats_map, STATS_SLOTS * bench.nr_cpus);
+
+    /* Shared exactly as the loader shares them */
+    err = bpf_map__reuse_fd(bench.tc->maps.if_slots,
+                            bpf_map__fd(bench.xdp->maps.if_slots));
+    if (!err)
+        err = bpf_map__reuse_fd(bench.tc->maps.flow_cache,
+                                bpf_map__fd(bench.xdp->maps.flow_cache));
+    if (!err)
+        err = tc_filter_bpf__load(bench.tc);
+    if (err) {
+        fprintf(stderr, "Failed to load TC object: %s\n", strerror(-err));
+        return err;
+    }
+
+    bench.progs[PROG_XDP_REDIRECT].fd = bpf_program__fd(bench.xdp->progs.xdp_redirect_prog);
+    bench.progs[PROG_XDP_FASTPATH].fd = bpf_program__fd(bench.xdp->progs.xdp_vm_fastpath);
+    bench.progs[PROG_XDP_FLOW_OFFLOAD].fd = bpf_program__fd(bench.xdp->progs.xdp_flow_offload);
+    bench.progs[PROG_XDP_GUARD].fd = bpf_program__fd(bench.xdp->progs.xdp_ddos_guard);
+    bench.progs[PROG_TC_FILTER].fd = bpf_program__fd(bench.tc->progs.tc_filter_prog);
+
+    for (int i = 0; i < PROG_COUNT; i++) {
+        struct bpf_prog_info info = {};
+        uint32_t len = sizeof(info);
+
+        err = bpf_prog_get_info_by_fd(bench.progs[i].fd, &info, &len);
+        if (err) {
+            fprintf(stderr, "Failed to query %s: %s\n", prog_names[i], strerror(errno));
+            return -errno;
+        }
+        bench.progs[i].xlated_insns = info.xlated_prog_len / sizeof(struct bpf_insn);
+        bench.progs[i].jited_bytes = info.jited_prog_len;
+        bench.progs[i].verified_insns = info.verified_insns;
+    }
+
+    return 0;
+}
+
+static void destroy_objects(void) {
+    if (bench.table_full > 0)
+        close(bench.table_full);
+    if (bench.table_empty > 0)
+        close(bench.table_empty);
+    tc_filter_bpf__destroy(bench.tc);
+    xdp_redirect_bpf__destroy(bench.xdp);
+}
+
+/* ============================================================================
+ * Map State
+ * ============================================================================ */
+
+static int create_redirect_table(void) {
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = BPF_F_NO_PREALLOC);
+    int fd = bpf_map_create(BPF_MAP_TYPE_HASH, "redirect_table", sizeof(uint32_t),
+                            sizeof(struct redirect_entry), REDIRECT_MAP_SIZE, &opts);
+    return fd < 0 ? -errno : fd;
+}
+
+static int map_update(int fd, const void *key, const void *value) {
+    return bpf_map_update_elem(fd, key, value, BPF_ANY) ? -errno : 0;
+}
+
+static void flow_key_for(const pkt_spec_t *spec, struct flow_key *key) {
+    memset(key, 0, sizeof(*key));
+    bench_addrs(spec->family, key->src, key->dst);
+    key->ifindex = bench.ifindex;
+    key->src_port = spec->src_port;
+    key->dst_port = spec->dst_port;
+    key->vlan_id = spec->vlans ? 100 + spec->vlans - 1 : 0;
+    key->protocol = spec->protocol;
+}
+
+/*
+ * State every case shares: loopback is its own redirect target, and the
+ * TC rule set sits in generation 0, dormant until if_slots names it.
+ */
+static int seed_maps(void) {
+    uint32_t ifindex = bench.ifindex;
+    int err;
+
+    if ((bench.table_full = create_redirect_table()) < 0 ||
+        (bench.table_empty = create_redirect_table()) < 0) {
+        fprintf(stderr, "Failed to create redirect tables: %s\n",
+                strerror(-(bench.table_full < 0 ? bench.table_full : bench.table_empty)));
+        return -EINVAL;
+    }
+
+    err = map_update(bpf_map__fd(bench.xdp->maps.devmap), &ifindex, &ifindex);
+    if (err) {
+        fprintf(stderr, "Failed to add devmap slot: %s\n", strerror(-err));
+        return err;
+    }
+
+    /* The guard chains to the programs as the loader wires them */
+    static const bench_prog_t chain[GUARD_NEXT_SLOTS] = {
+        [GUARD_NEXT_REDIRECT] = PROG_XDP_REDIRECT,
+        [GUARD_NEXT_FLOW_OFFLOAD] = PROG_XDP_FLOW_OFFLOAD,
+        [GUARD_NEXT_FASTPATH] = PROG_XDP_FASTPATH,
+    };
+    for (uint32_t next = 0; next < GUARD_NEXT_SLOTS && !err; next++)
+        err = map_update(bpf_map__fd(bench.xdp->maps.guard_chain), &next,
+                         &bench.progs[chain[next]].fd);
+    if (err) {
+        fprintf(stderr, "Failed to fill guard chain: %s\n", strerror(-err));
+        return err;
+    }
+
+    struct rule_bitmap all = {};
+    all.bits[0] = ~0ULL;
+    struct lpm_key any = { .prefixlen = 32, .ifindex = RULE_KEY_IFINDEX(ifindex, 0) };
+    err = map_update(bpf_map__fd(bench.tc->maps.lpm_src), &any, &all);
+    if (!err)
+        err = map_update(bpf_map__fd(bench.tc->maps.lpm_dst), &any, &all);
+
+    for (uint32_t slot = 0; slot < BENCH_RULES && !err; slot++) {
+        struct rule_slot_key key = { .ifindex = RULE_KEY_IFINDEX(ifindex, 0), .slot = slot };
+        struct filter_rule rule = {
+            .rule_id = slot + 1,
+            .protocol = IPPROTO_UDP,
+            .action = FILTER_ACTION_PASS,
+            .src_port_max = 65535,
+            .dst_port_min = BENCH_FILLER_PORT + slot,
+            .dst_port_max = BENCH_FILLER_PORT + slot,
+            .priority = slot,
+        };
+
+        if (slot == BENCH_SLOT_SSH || slot == BENCH_SLOT_HTTP) {
+            rule.protocol = IPPROTO_TCP;
+            rule.action = FILTER_ACTION_DROP;
+            rule.dst_port_min = rule.dst_port_max = slot == BENCH_SLOT_SSH ? 22 : 80;
+        } else if (slot == BENCH_SLOT_VXLAN) {
+            rule.action = FILTER_ACTION_REDIRECT;
+            rule.dst_port_min = rule.dst_port_max = 4789;
+            rule.redirect_ifindex = ifindex;
+        }
+        err = map_update(bpf_map__fd(bench.tc->maps.rule_slots), &key, &rule);
+    }
+    if (err)
+        fprintf(stderr, "Failed to install TC rules: %s\n", strerror(-err));
+    return err;
+}
+
+/* Put the maps into the state a case asks for */
+static int apply_setup(const bench_case_t *bc) {
+    uint32_t ifindex = bench.ifindex;
+    uint32_t zero = 0;
+    int err;
+
+    /* Redirect rule */
+    int table = bc->setup & SETUP_REDIRECT ? bench.table_full : bench.table_empty;
+    if (bc->setup & SETUP_REDIRECT) {
+        struct redirect_entry entry = { .dst_ifindex = ifindex };
+        if (bc->setup & SETUP_REWRITE) {
+            memcpy(entry.mac.src_mac, bench_dst_mac, ETH_ALEN);
+            memcpy(entry.mac.dst_mac, bench_src_mac, ETH_ALEN);
+            entry.mac.rewrite = 1;
+        }
+        if ((err = map_update(table, &ifindex, &entry)) < 0)
+            return err;
+    }
+    if ((err = map_update(bpf_map__fd(bench.xdp->maps.redirect_tables), &zero, &table)) < 0)
+        return err;
+
+    /* Offloaded flow; without rewrite so repeated runs see the same frame */
+    struct flow_key fk;
+    flow_key_for(&bc->pkt, &fk);
+    int flows = bpf_map__fd(bench.xdp->maps.flow_cache);
+    if (bc->setup & SETUP_FLOW) {
+        struct flow_entry flow = { .dst_ifindex = ifindex };
+        if ((err = map_update(flows, &fk, &flow)) < 0)
+            return err;
+    } else {
+        bpf_map_delete_elem(flows, &fk);
+    }
+
+    /* TC rules, generation 0 */
+    struct if_slot ifs = { .rules = bc->setup & SETUP_RULES ? IF_RULES_ACTIVE : 0 };
+    if ((err = map_update(bpf_map__fd(bench.xdp->maps.if_slots), &ifindex, &ifs)) < 0)
+        return err;
+
+    /* Guard */
+    int guards = bpf_map__fd(bench.xdp->maps.guard_ifaces);
+    if (bc->setup & SETUP_GUARD) {
+        struct guard_if gif = {
+            .min_len = 60,
+            .max_len = bc->setup & SETUP_GUARD_SIZE ? 60 : 1514,
+            .next = GUARD_NEXT_REDIRECT,
+            .flags = GUARD_F_MALFORMED,
+        };
+        if ((err = map_update(guards, &ifindex, &gif)) < 0)
+            return err;
+    } else {
+        bpf_map_delete_elem(guards, &ifindex);
+    }
+
+    struct guard_block_key bk = { .prefixlen = 128 + 128 };
+    bench_addrs(bc->pkt.family, bk.src, bk.dst);
+    int blocks = bpf_map__fd(bench.xdp->maps.guard_block);
+    if (bc->setup & SETUP_GUARD_BLOCK) {
+        if ((err = map_update(blocks, &bk, &zero)) < 0)
+            return err;
+    } else {
+        bpf_map_delete_elem(blocks, &bk);
+    }
+
+    struct guard_limit_key gk = { .kind = GUARD_KIND_UDP };
+    memcpy(gk.dst, bk.dst, sizeof(gk.dst));
+    int caps = bpf_map__fd(bench.xdp->maps.guard_limits);
+    int caches = bpf_map__fd(bench.xdp->maps.guard_local);
+    if (bc->setup & SETUP_GUARD_FLOOD) {
+        struct rate_limit rl = { .rate = 1, .quantum = 1 };
+        struct rate_local *local = calloc(libbpf_num_possible_cpus(), sizeof(*local));
+        if (!local)
+            return -ENOMEM;
+        err = map_update(caps, &gk, &rl);
+        if (!err)
+            err = map_update(caches, &gk, local);
+        free(local);
+        if (err)
+            return err;
+    } else {
+        bpf_map_delete_elem(caches, &gk);
+        bpf_map_delete_elem(caps, &gk);
+    }
+
+    /* Rate limit */
+    int limits = bpf_map__fd(bench.tc->maps.rate_limits);
+    int locals = bpf_map__fd(bench.tc->maps.rate_local);
+    if (bc->setup & (SETUP_RATE_CONFORM | SETUP_RATE_EXCEED)) {
+        struct rate_limit rl = { .quantum = 64 * 1024 };
+        if (bc->setup & SETUP_RATE_CONFORM) {
+            /* Far more tokens than any run spends */
+            rl.rate = 10ULL * 1000 * 1000 * 1000;
+            rl.burst = 1ULL << 50;
+            rl.tokens = 1LL << 50;
+        } else {
+            rl.rate = 1;
+        }
+
+        struct rate_local *local = calloc(libbpf_num_possible_cpus(), sizeof(*local));
+        if (!local)
+            return -ENOMEM;
+        err = map_update(limits, &ifindex, &rl);
+        if (!err)
+            err = map_update(locals, &ifindex, local);
+        free(local);
+        if (err)
+            return err;
+    } else {
+        bpf_map_delete_elem(limits, &ifindex);
+        bpf_map_delete_elem(locals, &ifindex);
+    }
+
+    return 0;
+}
+
+/* ============================================================================
+ * Running
+ * ============================================================================ */
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void run_case(const bench_case_t *bc, uint32_t repeat, int rounds,
+                     bench_result_t *res) {
+    uint8_t pkt[BENCH_PKT_MAX];
+    uint32_t samples[BENCH_ROUNDS_MAX];
+    struct xdp_md xdp_ctx = { .ingress_ifindex = bench.ifindex };
+    struct __sk_buff skb_ctx = { .ifindex = bench.ifindex };
+
+    memset(res, 0, sizeof(*res));
+    res->bc = bc;
+    res->pkt_len = build_packet(&bc->pkt, pkt);
+
+    res->error = apply_setup(bc);
+    if (res->error)
+        return;
+
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = pkt,
+                .data_size_in = res->pkt_len,
+                .repeat = repeat);
+    if (bc->prog == PROG_TC_FILTER) {
+        opts.ctx_in = &skb_ctx;
+        opts.ctx_size_in = sizeof(skb_ctx);
+    } else {
+        opts.ctx_in = &xdp_ctx;
+        opts.ctx_size_in = sizeof(xdp_ctx);
+    }
+
+    int n = 0;
+    while (n < rounds) {
+        if (bpf_prog_test_run_opts(bench.progs[bc->prog].fd, &opts)) {
+            res->error = -errno;
+            return;
+        }
+        /* The kernel reports the mean over the repeats, in ns */
+        samples[n++] = opts.duration;
+        res->retval = opts.retval;
+        if (res->retval != bc->expect)
+            break;
+    }
+
+    qsort(samples, n, sizeof(samples[0]), cmp_u32);
+    res->min_ns = samples[0];
+    res->median_ns = samples[n / 2];
+    res->max_ns = samples[n - 1];
+}
+
+static const char *verdict_name(bench_prog_t prog, uint32_t retval) {
+    static const char *const xdp[] = { "ABORTED", "DROP", "PASS", "TX", "REDIRECT" };
+
+    if (prog != PROG_TC_FILTER)
+        return retval < 5 ? xdp[retval] : "?";
+    switch ((int)retval) {
+        case TC_ACT_OK:         return "OK";
+        case TC_ACT_SHOT:       return "SHOT";
+        case TC_ACT_REDIRECT:   return "REDIRECT";
+        default:                return "?";
+    }
+}
+
+static int result_ok(const bench_result_t *res) {
+    return !res->error && res->retval == res->bc->expect;
+}
+
+/* ============================================================================
+ * Reporting
+ * ============================================================================ */
+
+static void print_results(const bench_result_t *results, size_t count) {
+    printf("%-20s %-18s %5s %-9s %-9s %8s %8s %8s\n", "program", "case", "bytes",
+           "expect", "verdict", "min_ns", "med_ns", "max_ns");
+
+    for (size_t i = 0; i < count; i++) {
+        const bench_result_t *r = &results[i];
+        if (r->error) {
+            printf("%-20s %-18s error: %s\n", prog_names[r->bc->prog], r->bc->name,
+                   strerror(-r->error));
+            continue;
+        }
+        printf("%-20s %-18s %5zu %-9s %-9s %8u %8u %8u%s\n",
+               prog_names[r->bc->prog], r->bc->name, r->pkt_len,
+               verdict_name(r->bc->prog, r->bc->expect),
+               verdict_name(r->bc->prog, r->retval),
+               r->min_ns, r->median_ns, r->max_ns,
+               result_ok(r) ? "" : "  MISMATCH");
+    }
+
+    printf("\n%-20s %8s %8s %8s\n", "program", "xlated", "jited", "verified");
+    for (int i = 0; i < PROG_COUNT; i++)
+        printf("%-20s %8u %8u %8u\n", prog_names[i], bench.progs[i].xlated_insns,
+               bench.progs[i].jited_bytes, bench.progs[i].verified_insns);
+}
+
+static int write_json(const char *path, const bench_result_t *results, size_t count,
+                      uint32_t repeat, int rounds) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    struct utsname uts;
+    if (uname(&uts) < 0)
+        strcpy(uts.release, "unknown");
+
+    fprintf(f, "{\n  \"kernel\": \"%s\",\n  \"timestamp\": %lld,\n"
+               "  \"nr_cpus\": %u,\n  \"repeat\": %u,\n  \"rounds\": %d,\n",
+            uts.release, (long long)time(NULL), bench.nr_cpus, repeat, rounds);
+
+    fprintf(f, "  \"programs\": [\n");
+    for (int i = 0; i < PROG_COUNT; i++)
+        fprintf(f, "    { \"name\": \"%s\", \"xlated_insns\": %u, \"jited_bytes\": %u, "
+                   "\"verified_insns\": %u }%s\n",
+                prog_names[i], bench.progs[i].xlated_insns, bench.progs[i].jited_bytes,
+                bench.progs[i].verified_insns, i + 1 < PROG_COUNT ? "," : "");
+    fprintf(f, "  ],\n");
+
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < count; i++) {
+        const bench_result_t *r = &results[i];
+        fprintf(f, "    { \"program\": \"%s\", \"case\": \"%s\", \"bytes\": %zu, "
+                   "\"expect\": %u, \"retval\": %u, \"error\": %d, \"pass\": %s, "
+                   "\"min_ns\": %u, \"median_ns\": %u, \"max_ns\": %u }%s\n",
+                prog_names[r->bc->prog], r->bc->name, r->pkt_len, r->bc->expect,
+                r->retval, r->error, result_ok(r) ? "true" : "false",
+                r->min_ns, r->median_ns, r->max_ns, i + 1 < count ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+
+    if (fclose(f)) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Main
+ * ============================================================================ */
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -n, --repeat N     Runs per measurement (default %d)\n"
+            "  -r, --rounds N     Measurements per case (default %d, max %d)\n"
+            "  -o, --output FILE  Write results as JSON\n"
+            "  -f, --filter STR   Only cases whose program or name contains STR\n",
+            prog, BENCH_REPEAT_DEFAULT, BENCH_ROUNDS_DEFAULT, BENCH_ROUNDS_MAX);
+}
+
+int main(int argc, char **argv) {
+    static const struct option options[] = {
+        { "repeat", required_argument, NULL, 'n' },
+        { "rounds", required_argument, NULL, 'r' },
+        { "output", required_argument, NULL, 'o' },
+        { "filter", required_argument, NULL, 'f' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
+    };
+    uint32_t repeat = BENCH_REPEAT_DEFAULT;
+    int rounds = BENCH_ROUNDS_DEFAULT;
+    const char *output = NULL;
+    const char *filter = NULL;
+    int opt, ret = 2;
+
+    while ((opt = getopt_long(argc, argv, "n:r:o:f:h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'n':
+                repeat = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                rounds = atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'h':
+                usage(argv[0]);
+                return 0;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (repeat == 0 || rounds < 1 || rounds > BENCH_ROUNDS_MAX) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    int cpus = libbpf_num_possible_cpus();
+    bench.ifindex = if_nametoindex("lo");
+    if (cpus <= 0 || bench.ifindex == 0) {
+        fprintf(stderr, "Failed to query CPUs or loopback\n");
+        return 2;
+    }
+    bench.nr_cpus = cpus;
+
+    bench_result_t results[BENCH_CASES];
+    size_t count = 0;
+
+    if (load_objects() < 0 || seed_maps() < 0)
+        goto out;
+
+    ret = 0;
+    for (size_t i = 0; i < BENCH_CASES; i++) {
+        const bench_case_t *bc = &bench_cases[i];
+        if (filter && !strstr(prog_names[bc->prog], filter) && !strstr(bc->name, filter))
+            continue;
+
+        run_case(bc, repeat, rounds, &results[count]);
+        if (!result_ok(&results[count]))
+            ret = 1;
+        count++;
+    }
+
+    print_results(results, count);
+    if (output && write_json(output, results, count, repeat, rounds) < 0)
+        ret = 2;
+
+out:
+    destroy_objects();
+    return ret;
+}
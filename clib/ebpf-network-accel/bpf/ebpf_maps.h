@@ -0,0 +1,266 @@
+/**
+ * Zixiao Hypervisor - eBPF Map Layouts
+ *
+ * Key/value layouts shared between the BPF programs and the userspace
+ * loader. Only fixed-width kernel types are used so the same definitions
+ * compile on both sides.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_EBPF_MAPS_H
+#define ZIXIAO_EBPF_MAPS_H
+
+#include <linux/types.h>
+
+/* Map capacities */
+#define REDIRECT_MAP_SIZE       65536   /* Allocated on demand */
+#define DEVMAP_SIZE             1024
+#define IF_SLOTS_SIZE           65536   /* ifindex -> stats slot */
+#define STATS_SLOTS             512     /* Slot 0 collects unassigned ifindexes */
+#define FILTER_RULES_SIZE       65536
+#define LPM_PREFIXES_SIZE       65536
+#define RATE_LIMITS_SIZE        1024
+#define XSK_MAP_SIZE            256     /* AF_XDP sockets */
+#define FLOW_CACHE_SIZE         65536   /* Offloaded flows, LRU */
+#define GUARD_IF_SIZE           1024    /* Interfaces behind the XDP guard */
+#define GUARD_BLOCK_SIZE        65536   /* Blocked (destination, source) prefixes */
+#define GUARD_LIMITS_SIZE       16384   /* Flood caps, per destination and kind */
+
+/*
+ * Rules per interface. Each interface's rules occupy consecutive slots in
+ * priority order, and prefix matches are bitmaps over those slots.
+ */
+#define RULE_WORDS              16
+#define MAX_RULES_PER_IF        (RULE_WORDS * 64)
+
+/* MAC addresses written into redirected frames */
+struct mac_entry {
+    __u8 src_mac[6];
+    __u8 dst_mac[6];
+    __u8 rewrite;
+    __u8 pad;
+};
+
+/*
+ * Redirect table value. Target and MAC rewrite share one entry so a
+ * single update changes both and the datapath needs one lookup.
+ */
+struct redirect_entry {
+    __u32 dst_ifindex;
+    struct mac_entry mac;
+    __u16 pad;
+};
+
+/*
+ * Statistics live in mmap-able arrays of STATS_SLOTS * nr_cpus elements,
+ * indexed by slot * nr_cpus + cpu. Each CPU owns its element, so the
+ * datapath needs no atomics, and the loader sums them through the mapping
+ * without syscalls. Elements are one cache line to avoid false sharing.
+ */
+
+/* if_slots value; array elements are 8-byte aligned */
+struct if_slot {
+    __u32 slot;
+    __u32 rules;            /* IF_RULES_* */
+};
+
+/*
+ * TC rule sets are double buffered: every rule_slots and LPM key carries
+ * a generation bit in its ifindex, and if_slot.rules names the live one.
+ * The loader writes a complete new generation, flips this word with one
+ * store, then deletes the old generation.
+ */
+#define IF_RULES_ACTIVE         (1U << 0)   /* Interface has TC rules */
+#define IF_RULES_GEN            (1U << 1)   /* Live generation is 1 */
+#define IF_RULES_FLAGS          (IF_RULES_ACTIVE | IF_RULES_GEN)
+
+/*
+ * The remaining bits count stores to the word. Flows learned from the TC
+ * verdict record the word they were learned under and are stale once it
+ * moves, so any rule or rate limit change retires them at no cost.
+ */
+#define IF_RULES_EPOCH_SHIFT    2
+#define RULE_GEN_BIT            0x80000000U
+#define RULE_KEY_IFINDEX(ifindex, gen) ((ifindex) | ((gen) ? RULE_GEN_BIT : 0))
+
+/* XDP statistics per interface */
+struct stats {
+    __u64 packets;
+    __u64 bytes;
+    __u64 drops;
+    __u64 redirects;
+    __u64 redirect_bytes;
+    __u64 pad[3];
+};
+
+/* xsk_queues key: AF_XDP sockets bind one (ifindex, rx queue) each */
+struct xsk_key {
+    __u32 ifindex;
+    __u32 queue;
+};
+
+/* xsk_queues value */
+struct xsk_steer {
+    __u32 index;            /* xsks_map index of the socket */
+    __u16 udp_port;         /* UDP destination port; 0 = all traffic */
+    __u16 pad;
+};
+
+/*
+ * flow_cache key: one direction of a connection as it enters ifindex.
+ * Addresses use the v4-mapped form of struct pkt_meta.
+ */
+struct flow_key {
+    __u32 src[4];
+    __u32 dst[4];
+    __u32 ifindex;
+    __u16 src_port;
+    __u16 dst_port;
+    __u16 vlan_id;
+    __u8  protocol;
+    __u8  pad;
+};
+
+#define FLOW_F_LEARNED          (1U << 0)   /* Inserted by tc_filter_prog */
+
+/* flow_cache value */
+struct flow_entry {
+    __u32 dst_ifindex;      /* devmap key to forward to */
+    struct mac_entry mac;
+    __u16 flags;            /* FLOW_F_* */
+    __u32 rules;            /* if_slot.rules when learned */
+};
+
+/* Filter rule actions */
+#define FILTER_ACTION_PASS      0
+#define FILTER_ACTION_DROP      1
+#define FILTER_ACTION_REDIRECT  2
+
+/*
+ * Filter rule, stored per (ifindex, slot). Prefixes are matched through
+ * the LPM tries; the addresses and their lengths are kept so the loader
+ * can rebuild its tables from the pinned maps. Addresses are 128 bits
+ * with IPv4 mapped into ::ffff:0:0/96, and prefix lengths count from the
+ * top of the 128-bit address, so a /0 prefix matches either family.
+ */
+struct filter_rule {
+    __u32 rule_id;          /* Loader-assigned rule ID */
+    __u32 src_addr[4];      /* Source prefix (network order) */
+    __u32 dst_addr[4];      /* Destination prefix (network order) */
+    __u8  src_prefix_len;   /* 0 = any */
+    __u8  dst_prefix_len;   /* 0 = any */
+    __u8  protocol;         /* IP protocol (0 = any) */
+    __u8  action;           /* FILTER_ACTION_* */
+    __u16 src_port_min;     /* Source port range (host order) */
+    __u16 src_port_max;
+    __u16 dst_port_min;     /* Destination port range (host order) */
+    __u16 dst_port_max;
+    __u16 vlan_id;          /* Innermost VLAN ID (0 = any) */
+    __u16 pad;
+    __u32 priority;         /* Rule priority (lower first) */
+    __u32 redirect_ifindex; /* Redirect target (if action=2) */
+};
+
+/* rule_slots key; ifindex carries the generation bit */
+struct rule_slot_key {
+    __u32 ifindex;
+    __u32 slot;
+};
+
+/*
+ * LPM trie key. The ifindex, generation bit included, is always matched
+ * in full, so prefixlen is 32 + the address prefix length. IPv4 uses the
+ * mapped form, so both families share one trie and one lookup.
+ */
+struct lpm_key {
+    __u32 prefixlen;
+    __u32 ifindex;
+    __u32 addr[4];          /* Network order */
+};
+
+/* Rule slots whose prefix covers an LPM entry */
+struct rule_bitmap {
+    __u64 bits[RULE_WORDS];
+};
+
+/* rate_limits keys: ifindex, with the top bit set for egress */
+#define RATE_KEY_EGRESS         0x80000000U
+
+/* Minimum interval between refills of a shared pool */
+#define RATE_REFILL_NS          50000ULL
+
+/*
+ * Shared token pool. CPUs never debit it per packet; they move whole
+ * quanta into their rate_local cache with atomic adds, so the cache line
+ * is touched once per quantum rather than once per packet.
+ */
+struct rate_limit {
+    __u64 rate;             /* Bytes per second */
+    __u64 burst;            /* Pool capacity in bytes */
+    __u64 quantum;          /* Bytes moved to a CPU cache at a time */
+    __s64 tokens;           /* Pool balance, updated atomically */
+    __u64 last_refill;      /* Last refill timestamp (ns), claimed by CAS */
+};
+
+/* Per-CPU token cache for a rate_limits key */
+struct rate_local {
+    __s64 tokens;
+};
+
+/*
+ * XDP early-drop guard. xdp_ddos_guard runs first on an interface and
+ * tail calls the program the interface would otherwise run, through the
+ * guard_chain slot its guard_if names; frames it drops never get an skb.
+ */
+#define GUARD_NEXT_REDIRECT     0       /* xdp_redirect_prog */
+#define GUARD_NEXT_FLOW_OFFLOAD 1       /* xdp_flow_offload */
+#define GUARD_NEXT_FASTPATH     2       /* xdp_vm_fastpath */
+#define GUARD_NEXT_SLOTS        3
+
+#define GUARD_F_MALFORMED       (1U << 0)   /* Drop IP frames that fail to parse */
+
+/* guard_ifaces value */
+struct guard_if {
+    __u16 min_len;          /* Shortest frame accepted, 0 = any */
+    __u16 max_len;          /* Longest frame accepted, 0 = any */
+    __u32 next;             /* GUARD_NEXT_* */
+    __u32 flags;            /* GUARD_F_* */
+};
+
+/*
+ * guard_block key. The destination is always matched in full, so
+ * prefixlen is 128 + the source prefix length; addresses use the
+ * v4-mapped form of struct pkt_meta.
+ */
+struct guard_block_key {
+    __u32 prefixlen;
+    __u32 dst[4];
+    __u32 src[4];
+};
+
+/* Flood kinds capped per destination */
+#define GUARD_KIND_SYN          0       /* TCP SYN without ACK */
+#define GUARD_KIND_UDP          1       /* UDP, fragments included */
+
+/*
+ * guard_limits and guard_local key. Values are struct rate_limit and
+ * struct rate_local as for TC, counted in packets rather than bytes.
+ */
+struct guard_limit_key {
+    __u32 dst[4];
+    __u32 kind;             /* GUARD_KIND_* */
+};
+
+/* TC statistics per interface */
+struct tc_if_stats {
+    __u64 packets_passed;
+    __u64 packets_dropped;
+    __u64 packets_redirected;
+    __u64 bytes_passed;
+    __u64 bytes_dropped;
+    __u64 pad[3];
+};
+
+#endif /* ZIXIAO_EBPF_MAPS_H */
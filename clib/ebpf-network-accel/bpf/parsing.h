@@ -0,0 +1,223 @@
+/**
+ * Zixiao Hypervisor - BPF Header Parsing
+ *
+ * Packet header parser shared by the XDP and TC programs. Handles up to
+ * two VLAN tags (802.1Q and 802.1ad), IPv4, and IPv6 with its extension
+ * headers skipped. Every loop has a constant bound so the verifier
+ * accepts it at any call site.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_BPF_PARSING_H
+#define ZIXIAO_BPF_PARSING_H
+
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/in6.h>
+#include <linux/ip.h>
+#include <linux/ipv6.h>
+#include <linux/tcp.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "ebpf_maps.h"
+
+#define PARSE_VLAN_MAX          2   /* QinQ: S-tag, then C-tag */
+#define PARSE_IPV6_EXT_MAX      6   /* Extension headers skipped */
+
+#define VLAN_VID_MASK           0x0fff
+
+/* TCP flags byte */
+#define PKT_TCP_FIN             0x01
+#define PKT_TCP_SYN             0x02
+#define PKT_TCP_RST             0x04
+#define PKT_TCP_ACK             0x10
+
+/* Not in the UAPI headers */
+struct vlan_tag {
+    __be16 tci;
+    __be16 encap_proto;
+};
+
+struct ipv6_frag {
+    __u8   nexthdr;
+    __u8   reserved;
+    __be16 frag_off;        /* Offset in 8-byte units, then MF */
+    __be32 identification;
+};
+
+/*
+ * Parsed packet. Addresses are 128 bits with IPv4 mapped into
+ * ::ffff:0:0/96, so one key layout serves both families.
+ */
+struct pkt_meta {
+    __u32 src[4];           /* Network order */
+    __u32 dst[4];
+    __u16 l3_proto;         /* ETH_P_IP or ETH_P_IPV6 */
+    __u16 vlan_id;          /* Innermost VLAN ID, 0 = untagged */
+    __u16 src_port;         /* Host order, 0 when absent */
+    __u16 dst_port;
+    __u8  protocol;         /* L4 protocol after extension headers */
+    __u8  fragment;         /* Not the first fragment: no L4 header */
+    __u8  vlan_depth;
+    __u8  tcp_flags;        /* PKT_TCP_* */
+    void  *l3;              /* IP header */
+    void  *l4;              /* L4 header, NULL for non-first fragments */
+};
+
+static __always_inline int is_vlan_proto(__be16 proto) {
+    return proto == bpf_htons(ETH_P_8021Q) || proto == bpf_htons(ETH_P_8021AD);
+}
+
+/*
+ * Skip the Ethernet header and any VLAN tags. Returns the L3 header and
+ * stores its ethertype (network order), or NULL if the frame is short.
+ */
+static __always_inline void *parse_l2(void *data, void *data_end,
+                                      struct pkt_meta *m, __be16 *proto) {
+    struct ethhdr *eth = data;
+    if ((void *)(eth + 1) > data_end)
+        return NULL;
+
+    void *cur = eth + 1;
+    __be16 p = eth->h_proto;
+
+#pragma unroll
+    for (int i = 0; i < PARSE_VLAN_MAX; i++) {
+        if (!is_vlan_proto(p))
+            break;
+        struct vlan_tag *tag = cur;
+        if ((void *)(tag + 1) > data_end)
+            return NULL;
+        m->vlan_id = bpf_ntohs(tag->tci) & VLAN_VID_MASK;
+        m->vlan_depth++;
+        p = tag->encap_proto;
+        cur = tag + 1;
+    }
+
+    *proto = p;
+    return cur;
+}
+
+static __always_inline void *parse_ipv4(struct iphdr *ip, void *data_end,
+                                        struct pkt_meta *m) {
+    if ((void *)(ip + 1) > data_end || ip->ihl < 5)
+        return NULL;
+
+    m->src[2] = m->dst[2] = bpf_htonl(0xffff);
+    m->src[3] = ip->saddr;
+    m->dst[3] = ip->daddr;
+    m->protocol = ip->protocol;
+    m->fragment = (ip->frag_off & bpf_htons(0x1fff)) != 0;
+    return (void *)ip + ip->ihl * 4;
+}
+
+/* Walk the IPv6 extension header chain to the upper-layer header */
+static __always_inline void *parse_ipv6(struct ipv6hdr *ip6, void *data_end,
+                                        struct pkt_meta *m) {
+    if ((void *)(ip6 + 1) > data_end)
+        return NULL;
+
+    __builtin_memcpy(m->src, &ip6->saddr, sizeof(m->src));
+    __builtin_memcpy(m->dst, &ip6->daddr, sizeof(m->dst));
+
+    void *cur = ip6 + 1;
+    __u8 nexthdr = ip6->nexthdr;
+
+#pragma unroll
+    for (int i = 0; i < PARSE_IPV6_EXT_MAX; i++) {
+        if (nexthdr == IPPROTO_HOPOPTS || nexthdr == IPPROTO_ROUTING ||
+            nexthdr == IPPROTO_DSTOPTS) {
+            struct ipv6_opt_hdr *opt = cur;
+            if ((void *)(opt + 1) > data_end)
+                return NULL;
+            nexthdr = opt->nexthdr;
+            cur += (opt->hdrlen + 1) * 8;
+        } else if (nexthdr == IPPROTO_AH) {
+            struct ipv6_opt_hdr *opt = cur;
+            if ((void *)(opt + 1) > data_end)
+                return NULL;
+            nexthdr = opt->nexthdr;
+            cur += (opt->hdrlen + 2) * 4;
+        } else if (nexthdr == IPPROTO_FRAGMENT) {
+            struct ipv6_frag *frag = cur;
+            if ((void *)(frag + 1) > data_end)
+                return NULL;
+            nexthdr = frag->nexthdr;
+            if (frag->frag_off & bpf_htons(0xfff8))
+                m->fragment = 1;
+            cur = frag + 1;
+        } else {
+            break;
+        }
+    }
+
+    m->protocol = nexthdr;
+    return cur;
+}
+
+/*
+ * Parse through L4. Returns 0 for IPv4/IPv6 packets, with ports filled in
+ * for TCP and UDP first fragments, and -1 for anything else or a packet
+ * too short for its headers. m must be zeroed by the caller.
+ */
+static __always_inline int parse_packet(void *data, void *data_end,
+                                        struct pkt_meta *m) {
+    __be16 proto;
+    void *l3 = parse_l2(data, data_end, m, &proto);
+    void *l4;
+
+    if (!l3)
+        return -1;
+    m->l3 = l3;
+
+    if (proto == bpf_htons(ETH_P_IP)) {
+        m->l3_proto = ETH_P_IP;
+        l4 = parse_ipv4(l3, data_end, m);
+    } else if (proto == bpf_htons(ETH_P_IPV6)) {
+        m->l3_proto = ETH_P_IPV6;
+        l4 = parse_ipv6(l3, data_end, m);
+    } else {
+        return -1;
+    }
+
+    if (!l4)
+        return -1;
+    if (m->fragment)
+        return 0;
+    m->l4 = l4;
+
+    if (m->protocol == IPPROTO_TCP) {
+        struct tcphdr *tcp = l4;
+        if ((void *)(tcp + 1) > data_end)
+            return -1;
+        m->src_port = bpf_ntohs(tcp->source);
+        m->dst_port = bpf_ntohs(tcp->dest);
+        m->tcp_flags = ((__u8 *)tcp)[13];
+    } else if (m->protocol == IPPROTO_UDP) {
+        struct udphdr *udp = l4;
+        if ((void *)(udp + 1) > data_end)
+            return -1;
+        m->src_port = bpf_ntohs(udp->source);
+        m->dst_port = bpf_ntohs(udp->dest);
+    }
+    return 0;
+}
+
+/* flow_cache key of a parsed packet entering ifindex */
+static __always_inline void flow_key_of(const struct pkt_meta *m, __u32 ifindex,
+                                        struct flow_key *key) {
+    __builtin_memcpy(key->src, m->src, sizeof(key->src));
+    __builtin_memcpy(key->dst, m->dst, sizeof(key->dst));
+    key->ifindex = ifindex;
+    key->src_port = m->src_port;
+    key->dst_port = m->dst_port;
+    key->vlan_id = m->vlan_id;
+    key->protocol = m->protocol;
+    key->pad = 0;
+}
+
+#endif /* ZIXIAO_BPF_PARSING_H */
@@ -0,0 +1,88 @@
+/**
+ * Zixiao Hypervisor - BPF Token Buckets
+ *
+ * Lock-free token buckets shared by the TC rate limiter and the XDP
+ * flood caps. Each limit is a shared struct rate_limit pool plus a
+ * per-CPU struct rate_local cache; callers pick the unit (bytes or
+ * packets) and charge a cost per packet.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_BPF_RATE_LIMIT_H
+#define ZIXIAO_BPF_RATE_LIMIT_H
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include "ebpf_maps.h"
+
+/*
+ * Credit the pool for the time since the last refill. Only the CPU that
+ * wins the CAS on last_refill adds tokens, so concurrent refills never
+ * double count. Elapsed time is capped at one second, which also bounds
+ * the product below for rates up to ~140 Gbit/s. Time worth less than a
+ * token is left to accrue, or slow rates would never refill under load.
+ */
+static __always_inline void refill_pool(struct rate_limit *rl, __u64 now) {
+    __u64 last = rl->last_refill;
+    if (now - last < RATE_REFILL_NS)
+        return;
+
+    __u64 elapsed = now - last;
+    if (elapsed > 1000000000ULL)
+        elapsed = 1000000000ULL;
+
+    __s64 add = (__s64)((elapsed * rl->rate) / 1000000000ULL);
+    if (add <= 0)
+        return;
+    if (__sync_val_compare_and_swap(&rl->last_refill, last, now) != last)
+        return;
+
+    __s64 before = __sync_fetch_and_add(&rl->tokens, add);
+
+    /* Trim overflow past the burst size */
+    __s64 excess = before + add - (__s64)rl->burst;
+    if (excess > 0)
+        __sync_fetch_and_add(&rl->tokens, -excess);
+}
+
+/*
+ * Move a quantum from the pool into this CPU's cache, or enough for the
+ * current packet if larger (GSO packets can exceed the quantum).
+ */
+static __always_inline void borrow_tokens(struct rate_limit *rl,
+                                          struct rate_local *local,
+                                          __s64 need) {
+    __s64 want = (__s64)rl->quantum;
+    if (want < need)
+        want = need;
+    __s64 avail = __sync_fetch_and_add(&rl->tokens, -want);
+
+    if (avail >= want) {
+        local->tokens += want;
+    } else if (avail > 0) {
+        __sync_fetch_and_add(&rl->tokens, want - avail);
+        local->tokens += avail;
+    } else {
+        __sync_fetch_and_add(&rl->tokens, want);
+    }
+}
+
+/* Fast path: spend tokens already cached on this CPU */
+static __always_inline int rate_spend_local(struct rate_local *local, __u64 cost) {
+    if (local->tokens < (__s64)cost)
+        return 0;
+    local->tokens -= cost;
+    return 1;
+}
+
+/* Slow path: refill this CPU's cache from the pool, then spend */
+static __always_inline int rate_spend(struct rate_limit *rl,
+                                      struct rate_local *local, __u64 cost) {
+    refill_pool(rl, bpf_ktime_get_ns());
+    borrow_tokens(rl, local, (__s64)cost - local->tokens);
+    return rate_spend_local(local, cost);
+}
+
+#endif /* ZIXIAO_BPF_RATE_LIMIT_H */
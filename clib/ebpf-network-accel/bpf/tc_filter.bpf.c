@@ -9,88 +9,105 @@
 
 #include <linux/bpf.h>
 #include <linux/pkt_cls.h>
-#include <linux/if_ether.h>
-#include <linux/ip.h>
-#include <linux/tcp.h>
-#include <linux/udp.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
+#include "ebpf_maps.h"
+#include "parsing.h"
+#include "rate_limit.h"
 
-/* Filter rule structure */
-struct filter_rule {
-    __u32 src_ip;           /* Source IP (0 = any) */
-    __u32 dst_ip;           /* Destination IP (0 = any) */
-    __u16 src_port;         /* Source port (0 = any) */
-    __u16 dst_port;         /* Destination port (0 = any) */
-    __u8  protocol;         /* IP protocol (0 = any) */
-    __u8  action;           /* 0=pass, 1=drop, 2=redirect */
-    __u16 priority;         /* Rule priority */
-    __u32 redirect_ifindex; /* Redirect target (if action=2) */
-};
-
-/* Filter rules map: rule_id -> filter_rule */
+/*
+ * Compiled rules: (ifindex | generation, slot) -> filter_rule, slots in
+ * priority order. Only the generation named by if_slot.rules is live.
+ */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 4096);
-    __type(key, __u32);
+    __uint(max_entries, FILTER_RULES_SIZE);
+    __type(key, struct rule_slot_key);
     __type(value, struct filter_rule);
-} filter_rules SEC(".maps");
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rule_slots SEC(".maps");
 
-/* Per-interface rule list */
+/*
+ * Prefix tries: (ifindex, prefix) -> slots of the rules whose source or
+ * destination prefix covers that prefix. The loader installs a /0 entry
+ * for every interface with rules, so a lookup miss means no rule applies.
+ * IPv4 and IPv6 share the tries through v4-mapped addresses.
+ */
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 256);
-    __type(key, __u32);
-    __type(value, __u32);  /* rule_id */
-} if_rules SEC(".maps");
-
-/* Rate limiting state */
-struct rate_limit {
-    __u64 tokens;           /* Available tokens */
-    __u64 last_update;      /* Last update timestamp (ns) */
-    __u64 rate;             /* Tokens per second */
-    __u64 burst;            /* Maximum burst size */
-};
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, LPM_PREFIXES_SIZE);
+    __type(key, struct lpm_key);
+    __type(value, struct rule_bitmap);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} lpm_src SEC(".maps");
 
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, LPM_PREFIXES_SIZE);
+    __type(key, struct lpm_key);
+    __type(value, struct rule_bitmap);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} lpm_dst SEC(".maps");
+
+/* Rate limiting pools */
 struct {
     __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024);
-    __type(key, __u32);     /* ifindex or flow hash */
+    __uint(max_entries, RATE_LIMITS_SIZE);
+    __type(key, __u32);     /* ifindex | RATE_KEY_EGRESS */
     __type(value, struct rate_limit);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } rate_limits SEC(".maps");
 
-/* Statistics */
-struct tc_stats {
-    __u64 packets_passed;
-    __u64 packets_dropped;
-    __u64 packets_redirected;
-    __u64 bytes_passed;
-    __u64 bytes_dropped;
-};
-
+/* Per-CPU token caches drawing from rate_limits */
 struct {
     __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
-    __uint(max_entries, 256);
+    __uint(max_entries, RATE_LIMITS_SIZE);
+    __type(key, __u32);
+    __type(value, struct rate_local);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} rate_local SEC(".maps");
+
+/* Offloaded flows; not pinned here, the loader shares the XDP object's */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, FLOW_CACHE_SIZE);
+    __type(key, struct flow_key);
+    __type(value, struct flow_entry);
+} flow_cache SEC(".maps");
+
+/* Possible CPUs, set by the loader before load */
+const volatile __u32 nr_cpus = 1;
+
+/*
+ * Dense stats slot per ifindex. Not pinned here: the loader hands this
+ * object the XDP object's if_slots map so both index the same slots.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, IF_SLOTS_SIZE);
     __type(key, __u32);
-    __type(value, struct tc_stats);
+    __type(value, struct if_slot);
+    __uint(map_flags, BPF_F_MMAPABLE);
+} if_slots SEC(".maps");
+
+/* Statistics per (slot, CPU); resized to STATS_SLOTS * nr_cpus at load */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, STATS_SLOTS);
+    __type(key, __u32);
+    __type(value, struct tc_if_stats);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } tc_stats_map SEC(".maps");
 
-static __always_inline void update_tc_stats(__u32 ifindex, __u64 bytes, int action) {
-    struct tc_stats *s = bpf_map_lookup_elem(&tc_stats_map, &ifindex);
-    if (!s) {
-        struct tc_stats new_stats = {0};
-        if (action == TC_ACT_OK) {
-            new_stats.packets_passed = 1;
-            new_stats.bytes_passed = bytes;
-        } else if (action == TC_ACT_SHOT) {
-            new_stats.packets_dropped = 1;
-            new_stats.bytes_dropped = bytes;
-        } else {
-            new_stats.packets_redirected = 1;
-        }
-        bpf_map_update_elem(&tc_stats_map, &ifindex, &new_stats, BPF_ANY);
+static __always_inline void update_tc_stats(const struct if_slot *ifs,
+                                            __u64 bytes, int action) {
+    __u32 idx = (ifs ? ifs->slot : 0) * nr_cpus + bpf_get_smp_processor_id();
+    struct tc_if_stats *s = bpf_map_lookup_elem(&tc_stats_map, &idx);
+    if (!s)
         return;
-    }
 
     if (action == TC_ACT_OK) {
         s->packets_passed++;
@@ -104,116 +121,174 @@ static __always_inline void update_tc_stats(__u32 ifindex, __u64 bytes, int acti
 }
 
 static __always_inline int check_rate_limit(__u32 key, __u64 pkt_len) {
-    struct rate_limit *rl = bpf_map_lookup_elem(&rate_limits, &key);
-    if (!rl)
+    struct rate_local *local = bpf_map_lookup_elem(&rate_local, &key);
+    if (!local)
         return 1;  /* No rate limit, allow */
 
-    __u64 now = bpf_ktime_get_ns();
-    __u64 elapsed = now - rl->last_update;
-
-    /* Refill tokens */
-    __u64 new_tokens = (elapsed * rl->rate) / 1000000000ULL;
-    rl->tokens += new_tokens;
-    if (rl->tokens > rl->burst)
-        rl->tokens = rl->burst;
+    if (rate_spend_local(local, pkt_len))
+        return 1;
 
-    rl->last_update = now;
-
-    /* Check if we have enough tokens */
-    if (rl->tokens >= pkt_len) {
-        rl->tokens -= pkt_len;
-        return 1;  /* Allow */
-    }
+    struct rate_limit *rl = bpf_map_lookup_elem(&rate_limits, &key);
+    if (!rl)
+        return 1;
 
-    return 0;  /* Drop */
+    return rate_spend(rl, local, pkt_len);
 }
 
-static __always_inline int match_rule(struct filter_rule *rule,
-                                       __u32 src_ip, __u32 dst_ip,
-                                       __u16 src_port, __u16 dst_port,
-                                       __u8 protocol) {
-    if (rule->src_ip && rule->src_ip != src_ip)
-        return 0;
-    if (rule->dst_ip && rule->dst_ip != dst_ip)
+/* State shared with the bpf_loop rule walk */
+struct match_ctx {
+    struct rule_bitmap *src;
+    struct rule_bitmap *dst;
+    struct filter_rule *matched;
+    const struct pkt_meta *pkt;
+    __u32 ifindex;
+};
+
+/* Fields not covered by the prefix tries */
+static __always_inline int match_fields(const struct filter_rule *rule,
+                                        const struct pkt_meta *pkt) {
+    if (rule->vlan_id && rule->vlan_id != pkt->vlan_id)
         return 0;
-    if (rule->src_port && rule->src_port != src_port)
+    if (rule->protocol && rule->protocol != pkt->protocol)
         return 0;
-    if (rule->dst_port && rule->dst_port != dst_port)
+    if (pkt->src_port < rule->src_port_min || pkt->src_port > rule->src_port_max)
         return 0;
-    if (rule->protocol && rule->protocol != protocol)
+    if (pkt->dst_port < rule->dst_port_min || pkt->dst_port > rule->dst_port_max)
         return 0;
     return 1;
 }
 
+/*
+ * Examine one 64-slot word of candidates. A slot is a candidate when both
+ * its source and destination prefixes cover the packet; lower slots have
+ * higher priority, so the first L4 match wins.
+ */
+static long match_rule_word(__u32 index, void *data) {
+    struct match_ctx *ctx = data;
+
+    if (index >= RULE_WORDS)
+        return 1;
+
+    __u64 word = ctx->src->bits[index] & ctx->dst->bits[index];
+    struct rule_slot_key key = { .ifindex = ctx->ifindex };
+
+    for (__u32 bit = 0; bit < 64 && word; bit++, word >>= 1) {
+        if (!(word & 1))
+            continue;
+
+        key.slot = index * 64 + bit;
+        struct filter_rule *rule = bpf_map_lookup_elem(&rule_slots, &key);
+        if (rule && match_fields(rule, ctx->pkt)) {
+            ctx->matched = rule;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static __always_inline struct filter_rule *classify(__u32 rules, __u32 ifindex,
+                                                    const struct pkt_meta *pkt) {
+    if (!(rules & IF_RULES_ACTIVE))
+        return NULL;
+    __u32 key_ifindex = RULE_KEY_IFINDEX(ifindex, rules & IF_RULES_GEN);
+
+    struct lpm_key key = {
+        .prefixlen = 32 + 128,
+        .ifindex = key_ifindex,
+    };
+    __builtin_memcpy(key.addr, pkt->src, sizeof(key.addr));
+
+    struct match_ctx ctx = {
+        .pkt = pkt,
+        .ifindex = key_ifindex,
+    };
+
+    ctx.src = bpf_map_lookup_elem(&lpm_src, &key);
+    if (!ctx.src)
+        return NULL;
+
+    __builtin_memcpy(key.addr, pkt->dst, sizeof(key.addr));
+    ctx.dst = bpf_map_lookup_elem(&lpm_dst, &key);
+    if (!ctx.dst)
+        return NULL;
+
+    bpf_loop(RULE_WORDS, match_rule_word, &ctx, 0);
+    return ctx.matched;
+}
+
+/*
+ * Hand an established TCP flow that a rule redirects to the XDP flow
+ * cache. Handshake and teardown segments keep coming through TC, and
+ * flows on rate limited interfaces are never offloaded since XDP would
+ * bypass the limit.
+ */
+static __always_inline void learn_flow(const struct pkt_meta *pkt, __u32 ifindex,
+                                       __u32 rules, __u32 dst_ifindex) {
+    if (pkt->protocol != IPPROTO_TCP || pkt->fragment)
+        return;
+    if ((pkt->tcp_flags & (PKT_TCP_SYN | PKT_TCP_FIN | PKT_TCP_RST)) ||
+        !(pkt->tcp_flags & PKT_TCP_ACK))
+        return;
+    if (bpf_map_lookup_elem(&rate_limits, &ifindex))
+        return;
+
+    struct flow_key key;
+    flow_key_of(pkt, ifindex, &key);
+    struct flow_entry flow = {
+        .dst_ifindex = dst_ifindex,
+        .flags = FLOW_F_LEARNED,
+        .rules = rules,
+    };
+    /* Never overwrite a flow the loader installed */
+    bpf_map_update_elem(&flow_cache, &key, &flow, BPF_NOEXIST);
+}
+
 SEC("tc")
 int tc_filter_prog(struct __sk_buff *skb) {
     void *data = (void *)(long)skb->data;
     void *data_end = (void *)(long)skb->data_end;
     __u32 ifindex = skb->ifindex;
     __u64 pkt_len = skb->len;
+    struct if_slot *ifs = bpf_map_lookup_elem(&if_slots, &ifindex);
+    /* One read picks the rule generation for the whole packet */
+    __u32 rules = ifs ? ifs->rules : 0;
 
-    /* Parse Ethernet header */
-    struct ethhdr *eth = data;
-    if ((void *)(eth + 1) > data_end)
-        return TC_ACT_OK;
-
-    /* Only process IPv4 */
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
-        return TC_ACT_OK;
-
-    /* Parse IP header */
-    struct iphdr *ip = (void *)(eth + 1);
-    if ((void *)(ip + 1) > data_end)
-        return TC_ACT_OK;
-
-    __u32 src_ip = ip->saddr;
-    __u32 dst_ip = ip->daddr;
-    __u8 protocol = ip->protocol;
-    __u16 src_port = 0, dst_port = 0;
-
-    /* Parse L4 header for ports */
-    if (protocol == IPPROTO_TCP) {
-        struct tcphdr *tcp = (void *)ip + (ip->ihl * 4);
-        if ((void *)(tcp + 1) > data_end)
-            return TC_ACT_OK;
-        src_port = bpf_ntohs(tcp->source);
-        dst_port = bpf_ntohs(tcp->dest);
-    } else if (protocol == IPPROTO_UDP) {
-        struct udphdr *udp = (void *)ip + (ip->ihl * 4);
-        if ((void *)(udp + 1) > data_end)
-            return TC_ACT_OK;
-        src_port = bpf_ntohs(udp->source);
-        dst_port = bpf_ntohs(udp->dest);
-    }
+    /*
+     * A tag the device stripped on receive is the outermost one, so any
+     * tag still in the frame is more inner and overrides it.
+     */
+    struct pkt_meta pkt = {};
+    int parsed = parse_packet(data, data_end, &pkt);
+    if (skb->vlan_present && pkt.vlan_depth == 0)
+        pkt.vlan_id = skb->vlan_tci & VLAN_VID_MASK;
 
-    /* Check rate limiting */
+    /* Rate limiting covers all traffic, not just what we can classify */
     if (!check_rate_limit(ifindex, pkt_len)) {
-        update_tc_stats(ifindex, pkt_len, TC_ACT_SHOT);
+        update_tc_stats(ifs, pkt_len, TC_ACT_SHOT);
         return TC_ACT_SHOT;
     }
 
-    /* Check filter rules (simplified - real impl would iterate) */
-    __u32 *rule_id = bpf_map_lookup_elem(&if_rules, &ifindex);
-    if (rule_id) {
-        struct filter_rule *rule = bpf_map_lookup_elem(&filter_rules, rule_id);
-        if (rule && match_rule(rule, src_ip, dst_ip, src_port, dst_port, protocol)) {
-            int action;
-            switch (rule->action) {
-                case 1:  /* Drop */
-                    action = TC_ACT_SHOT;
-                    update_tc_stats(ifindex, pkt_len, action);
-                    return action;
-                case 2:  /* Redirect */
-                    action = bpf_redirect(rule->redirect_ifindex, 0);
-                    update_tc_stats(ifindex, pkt_len, TC_ACT_REDIRECT);
-                    return action;
-                default: /* Pass */
-                    break;
-            }
+    /* Check filter rules, highest priority match first */
+    struct filter_rule *rule = parsed == 0 ? classify(rules, ifindex, &pkt) : NULL;
+    if (rule) {
+        int action;
+        switch (rule->action) {
+            case FILTER_ACTION_DROP:
+                action = TC_ACT_SHOT;
+                update_tc_stats(ifs, pkt_len, action);
+                return action;
+            case FILTER_ACTION_REDIRECT:
+                learn_flow(&pkt, ifindex, rules, rule->redirect_ifindex);
+                action = bpf_redirect(rule->redirect_ifindex, 0);
+                update_tc_stats(ifs, pkt_len, TC_ACT_REDIRECT);
+                return action;
+            default: /* Pass */
+                break;
         }
     }
 
-    update_tc_stats(ifindex, pkt_len, TC_ACT_OK);
+    update_tc_stats(ifs, pkt_len, TC_ACT_OK);
     return TC_ACT_OK;
 }
 
@@ -224,8 +299,9 @@ int tc_egress_filter(struct __sk_buff *skb) {
     __u64 pkt_len = skb->len;
 
     /* Apply egress rate limiting */
-    __u32 egress_key = ifindex | 0x80000000;  /* Mark as egress */
+    __u32 egress_key = ifindex | RATE_KEY_EGRESS;
     if (!check_rate_limit(egress_key, pkt_len)) {
+        update_tc_stats(bpf_map_lookup_elem(&if_slots, &ifindex), pkt_len, TC_ACT_SHOT);
         return TC_ACT_SHOT;
     }
 
@@ -9,78 +9,194 @@
 
 #include <linux/bpf.h>
 #include <linux/if_ether.h>
-#include <linux/ip.h>
-#include <linux/ipv6.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
+#include "ebpf_maps.h"
+#include "parsing.h"
+#include "rate_limit.h"
 
-/* Redirect map: src_ifindex -> dst_ifindex */
-struct {
+/*
+ * All maps are pinned by name under the loader's pin root so that the
+ * datapath survives an agent restart and the loader can resync from it.
+ * The AF_XDP maps are the exception: sockets die with the process that
+ * owns them, so their steering must not outlive it either.
+ */
+
+/* Redirect table: src_ifindex -> target and MAC rewrite */
+struct redirect_table {
     __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024);
+    __uint(max_entries, REDIRECT_MAP_SIZE);
+    __uint(map_flags, BPF_F_NO_PREALLOC);
     __type(key, __u32);
-    __type(value, __u32);
-} redirect_map SEC(".maps");
-
-/* MAC rewrite map: ifindex -> new MAC addresses */
-struct mac_entry {
-    __u8 src_mac[6];
-    __u8 dst_mac[6];
-    __u8 rewrite;
-    __u8 pad;
+    __type(value, struct redirect_entry);
 };
 
+/*
+ * The live redirect table sits at index 0. The loader creates the inner
+ * tables; replacing a whole rule set builds a new one and swaps this
+ * pointer, so packets see either the old set or the new one in full.
+ */
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
-    __uint(max_entries, 1024);
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __uint(max_entries, 1);
     __type(key, __u32);
-    __type(value, struct mac_entry);
-} mac_rewrite_map SEC(".maps");
-
-/* Statistics per interface */
-struct stats {
-    __u64 packets;
-    __u64 bytes;
-    __u64 drops;
-    __u64 redirects;
-};
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+    __array(values, struct redirect_table);
+} redirect_tables SEC(".maps");
+
+/* Possible CPUs, set by the loader before load */
+const volatile __u32 nr_cpus = 1;
 
+/* Dense stats slot per ifindex, shared with the TC object */
 struct {
-    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
-    __uint(max_entries, 256);
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, IF_SLOTS_SIZE);
+    __type(key, __u32);
+    __type(value, struct if_slot);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} if_slots SEC(".maps");
+
+/* Statistics per (slot, CPU); resized to STATS_SLOTS * nr_cpus at load */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, STATS_SLOTS);
     __type(key, __u32);
     __type(value, struct stats);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } stats_map SEC(".maps");
 
-/* Device map for redirect */
+/*
+ * Device map for redirect, keyed by destination ifindex. A hash devmap is
+ * used because ifindex values are sparse and can exceed the map size.
+ */
 struct {
-    __uint(type, BPF_MAP_TYPE_DEVMAP);
-    __uint(max_entries, 256);
+    __uint(type, BPF_MAP_TYPE_DEVMAP_HASH);
+    __uint(max_entries, DEVMAP_SIZE);
     __type(key, __u32);
     __type(value, __u32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
 } devmap SEC(".maps");
 
+/* AF_XDP sockets, at indexes assigned by the loader */
+struct {
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, XSK_MAP_SIZE);
+    __type(key, __u32);
+    __type(value, __u32);
+} xsks_map SEC(".maps");
+
+/* (ifindex, rx queue) -> socket and the flows it takes */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, XSK_MAP_SIZE);
+    __type(key, struct xsk_key);
+    __type(value, struct xsk_steer);
+} xsk_queues SEC(".maps");
+
+/*
+ * Offloaded flows. Entries come from the loader (connections the host
+ * stack has established) or are learned by tc_filter_prog from its
+ * redirect verdicts. Shared with the TC object.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, FLOW_CACHE_SIZE);
+    __type(key, struct flow_key);
+    __type(value, struct flow_entry);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} flow_cache SEC(".maps");
+
+/*
+ * Early-drop guard. The chain holds the programs xdp_ddos_guard hands
+ * accepted frames to; the loader fills it at load.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __uint(max_entries, GUARD_NEXT_SLOTS);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} guard_chain SEC(".maps");
+
+/* Interfaces the guard runs on, and their frame checks */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, GUARD_IF_SIZE);
+    __type(key, __u32);
+    __type(value, struct guard_if);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} guard_ifaces SEC(".maps");
+
+/* Source prefixes blocked per destination; a hit drops the frame */
+struct {
+    __uint(type, BPF_MAP_TYPE_LPM_TRIE);
+    __uint(max_entries, GUARD_BLOCK_SIZE);
+    __type(key, struct guard_block_key);
+    __type(value, __u32);   /* Unused, presence blocks */
+    __uint(map_flags, BPF_F_NO_PREALLOC);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} guard_block SEC(".maps");
+
+/* SYN and UDP flood caps per destination, in packets */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, GUARD_LIMITS_SIZE);
+    __type(key, struct guard_limit_key);
+    __type(value, struct rate_limit);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} guard_limits SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __uint(max_entries, GUARD_LIMITS_SIZE);
+    __type(key, struct guard_limit_key);
+    __type(value, struct rate_local);
+    __uint(pinning, LIBBPF_PIN_BY_NAME);
+} guard_local SEC(".maps");
+
+/* Array lookups are inlined by the verifier; no hashing per packet */
+static __always_inline struct stats *stats_for(__u32 ifindex) {
+    struct if_slot *slot = bpf_map_lookup_elem(&if_slots, &ifindex);
+    __u32 idx = (slot ? slot->slot : 0) * nr_cpus + bpf_get_smp_processor_id();
+    return bpf_map_lookup_elem(&stats_map, &idx);
+}
+
 static __always_inline void update_stats(__u32 ifindex, __u64 bytes, int redirected) {
-    struct stats *s = bpf_map_lookup_elem(&stats_map, &ifindex);
-    if (s) {
-        s->packets++;
-        s->bytes += bytes;
-        if (redirected)
-            s->redirects++;
-    } else {
-        struct stats new_stats = {
-            .packets = 1,
-            .bytes = bytes,
-            .drops = 0,
-            .redirects = redirected ? 1 : 0,
-        };
-        bpf_map_update_elem(&stats_map, &ifindex, &new_stats, BPF_ANY);
+    struct stats *s = stats_for(ifindex);
+    if (!s)
+        return;
+
+    s->packets++;
+    s->bytes += bytes;
+    if (redirected) {
+        s->redirects++;
+        s->redirect_bytes += bytes;
     }
 }
 
-static __always_inline int rewrite_mac(void *data, void *data_end, __u32 ifindex) {
-    struct mac_entry *entry = bpf_map_lookup_elem(&mac_rewrite_map, &ifindex);
-    if (!entry || !entry->rewrite)
+static __always_inline void count_drop(__u32 ifindex, __u64 bytes) {
+    struct stats *s = stats_for(ifindex);
+    if (!s)
+        return;
+
+    s->packets++;
+    s->bytes += bytes;
+    s->drops++;
+}
+
+static __always_inline struct redirect_entry *lookup_redirect(__u32 ifindex) {
+    __u32 zero = 0;
+    void *table = bpf_map_lookup_elem(&redirect_tables, &zero);
+    if (!table)
+        return NULL;
+    return bpf_map_lookup_elem(table, &ifindex);
+}
+
+static __always_inline int rewrite_mac(void *data, void *data_end,
+                                       const struct mac_entry *entry) {
+    if (!entry->rewrite)
         return 0;
 
     struct ethhdr *eth = data;
@@ -94,8 +210,21 @@ static __always_inline int rewrite_mac(void *data, void *data_end, __u32 ifindex
     return 0;
 }
 
-SEC("xdp")
-int xdp_redirect_prog(struct xdp_md *ctx) {
+/* Whether a frame belongs to the flows steered to an AF_XDP socket */
+static __always_inline int xsk_match(void *data, void *data_end, __u16 udp_port) {
+    if (!udp_port)
+        return 1;
+
+    struct pkt_meta pkt = {};
+    if (parse_packet(data, data_end, &pkt) < 0)
+        return 0;
+    /* Only first fragments carry the UDP header */
+    return pkt.protocol == IPPROTO_UDP && !pkt.fragment &&
+           pkt.dst_port == udp_port;
+}
+
+/* Per-ingress-interface redirect, shared by the redirect programs */
+static __always_inline int redirect_frame(struct xdp_md *ctx) {
     void *data = (void *)(long)ctx->data;
     void *data_end = (void *)(long)ctx->data_end;
     __u32 ifindex = ctx->ingress_ifindex;
@@ -107,16 +236,26 @@ int xdp_redirect_prog(struct xdp_md *ctx) {
         return XDP_PASS;
     }
 
+    /* Flows claimed by a userspace datapath go to its AF_XDP socket */
+    struct xsk_key xk = { .ifindex = ifindex, .queue = ctx->rx_queue_index };
+    struct xsk_steer *xs = bpf_map_lookup_elem(&xsk_queues, &xk);
+    if (xs && xsk_match(data, data_end, xs->udp_port)) {
+        update_stats(ifindex, pkt_len, 1);
+        /* Falls back to the stack if the socket is already gone */
+        return bpf_redirect_map(&xsks_map, xs->index, XDP_PASS);
+    }
+
     /* Look up redirect target */
-    __u32 *dst_ifindex = bpf_map_lookup_elem(&redirect_map, &ifindex);
-    if (!dst_ifindex) {
+    struct redirect_entry *entry = lookup_redirect(ifindex);
+    if (!entry) {
         /* No redirect rule, pass to kernel */
         update_stats(ifindex, pkt_len, 0);
         return XDP_PASS;
     }
 
     /* Optional MAC rewrite */
-    if (rewrite_mac(data, data_end, ifindex) < 0) {
+    if (rewrite_mac(data, data_end, &entry->mac) < 0) {
+        count_drop(ifindex, pkt_len);
         return XDP_DROP;
     }
 
@@ -124,7 +263,83 @@ int xdp_redirect_prog(struct xdp_md *ctx) {
     update_stats(ifindex, pkt_len, 1);
 
     /* Redirect packet to destination interface */
-    return bpf_redirect_map(&devmap, *dst_ifindex, 0);
+    return bpf_redirect_map(&devmap, entry->dst_ifindex, 0);
+}
+
+SEC("xdp")
+int xdp_redirect_prog(struct xdp_md *ctx) {
+    return redirect_frame(ctx);
+}
+
+/*
+ * A routed hop: decrement TTL or hop limit. Returns 0 when the packet
+ * must go to the stack instead, which owns ICMP time exceeded.
+ */
+static __always_inline int forward_hop(const struct pkt_meta *pkt, void *data_end) {
+    if (pkt->l3_proto == ETH_P_IP) {
+        struct iphdr *ip = pkt->l3;
+        if ((void *)(ip + 1) > data_end || ip->ttl <= 1)
+            return 0;
+        /* Incremental checksum update, as ip_decrease_ttl() does */
+        __u32 check = (__u32)ip->check + bpf_htons(0x0100);
+        ip->check = (__u16)(check + (check >= 0xFFFF));
+        ip->ttl--;
+    } else {
+        struct ipv6hdr *ip6 = pkt->l3;
+        if ((void *)(ip6 + 1) > data_end || ip6->hop_limit <= 1)
+            return 0;
+        ip6->hop_limit--;
+    }
+    return 1;
+}
+
+/*
+ * Flow offload: forward packets of flows in flow_cache straight to their
+ * devmap slot, and handle everything else like xdp_redirect_prog. TCP
+ * FIN and RST are left to the stack, with the entry dropped, so
+ * connection tracking sees every teardown.
+ */
+SEC("xdp")
+int xdp_flow_offload(struct xdp_md *ctx) {
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    __u32 ifindex = ctx->ingress_ifindex;
+    __u64 pkt_len = data_end - data;
+
+    struct pkt_meta pkt = {};
+    if (parse_packet(data, data_end, &pkt) < 0 || pkt.fragment)
+        return redirect_frame(ctx);
+
+    struct flow_key key;
+    flow_key_of(&pkt, ifindex, &key);
+    struct flow_entry *flow = bpf_map_lookup_elem(&flow_cache, &key);
+    if (!flow)
+        return redirect_frame(ctx);
+
+    if (flow->flags & FLOW_F_LEARNED) {
+        /* Learned under rules that have since changed */
+        struct if_slot *ifs = bpf_map_lookup_elem(&if_slots, &ifindex);
+        if (!ifs || ifs->rules != flow->rules) {
+            bpf_map_delete_elem(&flow_cache, &key);
+            return redirect_frame(ctx);
+        }
+    }
+
+    if (pkt.tcp_flags & (PKT_TCP_FIN | PKT_TCP_RST)) {
+        bpf_map_delete_elem(&flow_cache, &key);
+        return redirect_frame(ctx);
+    }
+
+    if (flow->mac.rewrite) {
+        if (!forward_hop(&pkt, data_end))
+            return redirect_frame(ctx);
+        if (rewrite_mac(data, data_end, &flow->mac) < 0)
+            return redirect_frame(ctx);
+    }
+
+    update_stats(ifindex, pkt_len, 1);
+    /* A target without a devmap slot goes up the stack as before */
+    return bpf_redirect_map(&devmap, flow->dst_ifindex, XDP_PASS);
 }
 
 /* VM fast path program - optimized for same-host VM traffic */
@@ -133,23 +348,117 @@ int xdp_vm_fastpath(struct xdp_md *ctx) {
     void *data = (void *)(long)ctx->data;
     void *data_end = (void *)(long)ctx->data_end;
     __u32 ifindex = ctx->ingress_ifindex;
+    __u64 pkt_len = data_end - data;
 
-    struct ethhdr *eth = data;
-    if ((void *)(eth + 1) > data_end)
+    /* Only process IPv4/IPv6, tagged or not */
+    struct pkt_meta pkt = {};
+    __be16 proto;
+    if (!parse_l2(data, data_end, &pkt, &proto))
         return XDP_PASS;
 
-    /* Only process IPv4/IPv6 */
-    __u16 proto = bpf_ntohs(eth->h_proto);
-    if (proto != ETH_P_IP && proto != ETH_P_IPV6)
+    if (proto != bpf_htons(ETH_P_IP) && proto != bpf_htons(ETH_P_IPV6)) {
+        update_stats(ifindex, pkt_len, 0);
         return XDP_PASS;
+    }
 
     /* Look up redirect target */
-    __u32 *dst = bpf_map_lookup_elem(&redirect_map, &ifindex);
-    if (!dst)
+    struct redirect_entry *entry = lookup_redirect(ifindex);
+    if (!entry) {
+        update_stats(ifindex, pkt_len, 0);
         return XDP_PASS;
+    }
 
     /* Direct redirect without modification for VM-to-VM */
-    return bpf_redirect_map(&devmap, *dst, 0);
+    update_stats(ifindex, pkt_len, 1);
+    return bpf_redirect_map(&devmap, entry->dst_ifindex, 0);
+}
+
+/* Whether an IP header claims more bytes than the frame holds */
+static __always_inline int ip_truncated(const struct pkt_meta *pkt, void *data_end) {
+    if (pkt->l3_proto == ETH_P_IP) {
+        struct iphdr *ip = pkt->l3;
+        if ((void *)(ip + 1) > data_end)
+            return 1;
+        return pkt->l3 + bpf_ntohs(ip->tot_len) > data_end;
+    }
+
+    struct ipv6hdr *ip6 = pkt->l3;
+    if ((void *)(ip6 + 1) > data_end)
+        return 1;
+    return (void *)(ip6 + 1) + bpf_ntohs(ip6->payload_len) > data_end;
+}
+
+/* Whether a flood cap on the destination has run out for this packet */
+static __always_inline int guard_flooded(const struct pkt_meta *pkt, __u32 kind) {
+    struct guard_limit_key key = { .kind = kind };
+    __builtin_memcpy(key.dst, pkt->dst, sizeof(key.dst));
+
+    struct rate_local *local = bpf_map_lookup_elem(&guard_local, &key);
+    if (!local || rate_spend_local(local, 1))
+        return 0;
+
+    struct rate_limit *rl = bpf_map_lookup_elem(&guard_limits, &key);
+    if (!rl)
+        return 0;
+    return !rate_spend(rl, local, 1);
+}
+
+/*
+ * Early drop, ahead of the interface's own program: frame size bounds,
+ * malformed IP headers, blocked sources and SYN/UDP flood caps. Frames
+ * that pass are tail called into the program guard_if names, so the
+ * guard costs one map lookup on interfaces it is not configured for and
+ * a dropped frame costs no more than XDP_DROP.
+ */
+SEC("xdp")
+int xdp_ddos_guard(struct xdp_md *ctx) {
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+    __u32 ifindex = ctx->ingress_ifindex;
+    __u64 pkt_len = data_end - data;
+    __u32 next = GUARD_NEXT_REDIRECT;
+    struct pkt_meta pkt = {};
+    struct guard_block_key bk = { .prefixlen = 128 + 128 };
+
+    struct guard_if *gif = bpf_map_lookup_elem(&guard_ifaces, &ifindex);
+    if (!gif)
+        goto chain;
+    next = gif->next;
+
+    if (pkt_len < gif->min_len || (gif->max_len && pkt_len > gif->max_len))
+        goto drop;
+
+    if (parse_packet(data, data_end, &pkt) < 0) {
+        /* l3_proto is set once the ethertype is IP, whatever comes after */
+        if (pkt.l3_proto && (gif->flags & GUARD_F_MALFORMED))
+            goto drop;
+        goto chain;
+    }
+    if ((gif->flags & GUARD_F_MALFORMED) && ip_truncated(&pkt, data_end))
+        goto drop;
+
+    __builtin_memcpy(bk.dst, pkt.dst, sizeof(bk.dst));
+    __builtin_memcpy(bk.src, pkt.src, sizeof(bk.src));
+    if (bpf_map_lookup_elem(&guard_block, &bk))
+        goto drop;
+
+    if (pkt.protocol == IPPROTO_TCP && !pkt.fragment &&
+        (pkt.tcp_flags & (PKT_TCP_SYN | PKT_TCP_ACK)) == PKT_TCP_SYN) {
+        if (guard_flooded(&pkt, GUARD_KIND_SYN))
+            goto drop;
+    } else if (pkt.protocol == IPPROTO_UDP) {
+        if (guard_flooded(&pkt, GUARD_KIND_UDP))
+            goto drop;
+    }
+
+chain:
+    bpf_tail_call(ctx, &guard_chain, next);
+    /* Only reached before the loader has filled the chain */
+    return redirect_frame(ctx);
+
+drop:
+    count_drop(ifindex, pkt_len);
+    return XDP_DROP;
 }
 
 char _license[] SEC("license") = "GPL";
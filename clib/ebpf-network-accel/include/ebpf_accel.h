@@ -29,6 +29,11 @@ extern "C" {
 #define EBPF_ERR_MAP           -7
 #define EBPF_ERR_PERMISSION    -8
 
+/* bpffs directory under which the library pins its maps */
+#ifndef EBPF_PIN_ROOT
+#define EBPF_PIN_ROOT          "/sys/fs/bpf/zixiao"
+#endif
+
 /* XDP action types */
 typedef enum {
     XDP_ACTION_PASS = 0,
@@ -37,12 +42,30 @@ typedef enum {
     XDP_ACTION_TX
 } xdp_action_t;
 
+/* XDP attach modes, in increasing order of speed */
+typedef enum {
+    XDP_MODE_NONE = 0,          /* No XDP program attached */
+    XDP_MODE_SKB,               /* Generic (SKB) mode */
+    XDP_MODE_NATIVE,            /* Driver-native mode */
+    XDP_MODE_OFFLOAD            /* Hardware offload */
+} xdp_mode_t;
+
+/* Per-interface XDP capability bits */
+#define EBPF_XDP_CAP_NATIVE     (1U << 0)   /* Driver runs XDP natively */
+#define EBPF_XDP_CAP_REDIRECT   (1U << 1)   /* Can redirect out of XDP */
+#define EBPF_XDP_CAP_XMIT       (1U << 2)   /* Can be a redirect target */
+#define EBPF_XDP_CAP_ZEROCOPY   (1U << 3)   /* AF_XDP zero-copy */
+#define EBPF_XDP_CAP_OFFLOAD    (1U << 4)   /* Hardware offload */
+#define EBPF_XDP_CAP_UNKNOWN    (1U << 31)  /* Kernel does not report features */
+
 /* Network interface info */
 typedef struct {
     uint32_t ifindex;
     char ifname[64];
     uint8_t mac[6];
     uint32_t mtu;
+    xdp_mode_t xdp_mode;        /* Mode the attached XDP program runs in */
+    uint32_t xdp_caps;          /* EBPF_XDP_CAP_* bits */
 } netif_info_t;
 
 /* XDP redirect rule */
@@ -54,18 +77,49 @@ typedef struct {
     bool rewrite_mac;           /* Whether to rewrite MAC */
 } xdp_redirect_rule_t;
 
-/* TC filter rule */
+/* Maximum TC filter rules per interface */
+#define EBPF_TC_MAX_RULES_PER_IF    1024
+
+/* Address family a TC filter rule applies to */
+typedef enum {
+    TC_FAMILY_IPV4 = 0,         /* src_ip/dst_ip */
+    TC_FAMILY_IPV6,             /* src_ip6/dst_ip6 */
+    TC_FAMILY_ANY               /* Both; addresses must be wildcards */
+} tc_family_t;
+
+/*
+ * TC filter rule. A prefix length of 0 with a non-zero address means the
+ * full address (/32 or /128), and a zero port range end means the start
+ * port only, so rules written before prefixes and ranges existed keep
+ * their meaning. Zeroed fields added later (family, VLAN) select IPv4 on
+ * any VLAN, as before.
+ */
 typedef struct {
     uint32_t ifindex;           /* Interface index */
-    uint32_t priority;          /* Filter priority */
-    uint32_t protocol;          /* Protocol (ETH_P_IP, etc.) */
+    uint32_t priority;          /* Filter priority (lower first) */
+    uint32_t protocol;          /* IP protocol (0 or an ethertype = any) */
     uint32_t src_ip;            /* Source IP (network order) */
     uint32_t dst_ip;            /* Destination IP (network order) */
     uint16_t src_port;          /* Source port (host order) */
     uint16_t dst_port;          /* Destination port (host order) */
     xdp_action_t action;        /* Action to take */
+    uint8_t src_prefix_len;     /* Source prefix length */
+    uint8_t dst_prefix_len;     /* Destination prefix length */
+    uint16_t src_port_max;      /* Source port range end */
+    uint16_t dst_port_max;      /* Destination port range end */
+    uint32_t redirect_ifindex;  /* Target for XDP_ACTION_REDIRECT */
+    tc_family_t family;         /* Address family */
+    uint8_t src_ip6[16];        /* Source IPv6 prefix (network order) */
+    uint8_t dst_ip6[16];        /* Destination IPv6 prefix (network order) */
+    uint16_t vlan_id;           /* Innermost 802.1Q VLAN ID (0 = any) */
 } tc_filter_rule_t;
 
+/* TC hook direction */
+typedef enum {
+    TC_DIR_INGRESS = 0,
+    TC_DIR_EGRESS
+} tc_direction_t;
+
 /* VM fast path entry */
 typedef struct {
     char vm1_tap[64];           /* First VM TAP interface */
@@ -74,6 +128,98 @@ typedef struct {
     uint32_t vm2_ifindex;       /* Second VM interface index */
 } vm_fastpath_entry_t;
 
+/*
+ * Offloaded flow: one direction of a connection entering ifindex, and
+ * where to forward it. Addresses follow tc_filter_rule_t; family must be
+ * TC_FAMILY_IPV4 or TC_FAMILY_IPV6.
+ */
+typedef struct {
+    uint32_t ifindex;           /* Ingress interface */
+    tc_family_t family;
+    uint32_t src_ip;            /* IPv4 source (network order) */
+    uint32_t dst_ip;            /* IPv4 destination (network order) */
+    uint8_t src_ip6[16];        /* IPv6 source */
+    uint8_t dst_ip6[16];        /* IPv6 destination */
+    uint16_t src_port;          /* Host order */
+    uint16_t dst_port;
+    uint8_t protocol;           /* IP protocol */
+    uint16_t vlan_id;           /* Innermost VLAN ID (0 = untagged) */
+    uint32_t dst_ifindex;       /* Forward to this interface */
+    uint8_t src_mac[6];         /* Rewritten source MAC */
+    uint8_t dst_mac[6];         /* Rewritten destination MAC */
+    bool rewrite_mac;           /* Rewrite MACs and decrement TTL (routed) */
+} ebpf_flow_t;
+
+/* XDP guard checks for one interface */
+typedef struct {
+    uint16_t min_frame_len;     /* Drop shorter frames (0 = no minimum) */
+    uint16_t max_frame_len;     /* Drop longer frames (0 = no maximum) */
+    bool drop_malformed;        /* Drop IP frames with bad or truncated headers */
+} ebpf_guard_config_t;
+
+/*
+ * Sources blocked from reaching a destination. Addresses follow
+ * tc_filter_rule_t, including a zero prefix length on a non-zero source
+ * meaning the full address; family must be TC_FAMILY_IPV4 or
+ * TC_FAMILY_IPV6.
+ */
+typedef struct {
+    tc_family_t family;
+    uint32_t dst_ip;            /* IPv4 destination (network order) */
+    uint8_t dst_ip6[16];        /* IPv6 destination */
+    uint32_t src_ip;            /* IPv4 source prefix (network order) */
+    uint8_t src_ip6[16];        /* IPv6 source prefix */
+    uint8_t src_prefix_len;     /* Source prefix length */
+} ebpf_guard_block_t;
+
+/* Traffic a guard flood cap counts */
+typedef enum {
+    GUARD_FLOOD_TCP_SYN = 0,    /* TCP SYN without ACK */
+    GUARD_FLOOD_UDP             /* UDP, fragments included */
+} ebpf_guard_flood_t;
+
+/* Flood cap on a destination */
+typedef struct {
+    tc_family_t family;         /* TC_FAMILY_IPV4 or TC_FAMILY_IPV6 */
+    uint32_t dst_ip;            /* IPv4 destination (network order) */
+    uint8_t dst_ip6[16];        /* IPv6 destination */
+    ebpf_guard_flood_t kind;
+    uint64_t rate;              /* Packets per second, 0 to remove the cap */
+    uint64_t burst;             /* Bucket size in packets */
+} ebpf_guard_limit_t;
+
+/* AF_XDP socket */
+typedef struct ebpf_xsk ebpf_xsk_t;
+
+/* AF_XDP socket configuration; zero fields take the defaults */
+typedef struct {
+    uint32_t ifindex;           /* Interface with the XDP redirect program */
+    uint32_t queue_id;          /* RX/TX queue to bind */
+    uint32_t frame_count;       /* UMEM frames (default 4096) */
+    uint32_t frame_size;        /* 2048 or 4096 bytes (default 4096) */
+    uint32_t ring_size;         /* Descriptors per ring, power of 2 (default 2048) */
+    uint16_t udp_port;          /* Steer only this UDP port (0 = all) */
+    bool busy_poll;             /* Drive the queue by busy polling */
+    bool force_copy;            /* Do not try zero-copy */
+} ebpf_xsk_config_t;
+
+/* Frame descriptor; addr is a UMEM offset, see ebpf_xsk_frame() */
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint32_t options;
+} ebpf_xsk_desc_t;
+
+/* AF_XDP socket counters, as reported by the kernel */
+typedef struct {
+    uint64_t rx_dropped;        /* No room in the RX ring */
+    uint64_t rx_invalid_descs;
+    uint64_t tx_invalid_descs;
+    uint64_t rx_ring_full;
+    uint64_t rx_fill_ring_empty;
+    uint64_t tx_ring_empty;
+} ebpf_xsk_stats_t;
+
 /* Statistics */
 typedef struct {
     uint64_t packets_received;
@@ -98,12 +244,18 @@ typedef struct {
 /**
  * Initialize eBPF acceleration subsystem
  *
+ * Loads the embedded XDP and TC objects and pins their maps under
+ * EBPF_PIN_ROOT. Maps already pinned by a previous instance are reused
+ * and the redirect rule table is rebuilt from them.
+ *
  * @return EBPF_OK on success, error code on failure
  */
 int ebpf_accel_init(void);
 
 /**
  * Cleanup eBPF acceleration subsystem
+ *
+ * Detaches every program attached through this library and unpins the maps.
  */
 void ebpf_accel_cleanup(void);
 
@@ -128,6 +280,9 @@ bool ebpf_accel_is_initialized(void);
 /**
  * Add XDP redirect rule
  *
+ * The rule is written to the kernel redirect, devmap and MAC rewrite maps
+ * before it is recorded; an existing rule for the same source is replaced.
+ *
  * @param rule Redirect rule
  * @return EBPF_OK on success
  */
@@ -141,6 +296,47 @@ int ebpf_xdp_add_redirect(const xdp_redirect_rule_t *rule);
  */
 int ebpf_xdp_del_redirect(uint32_t src_ifindex);
 
+/*
+ * Batch updates cost a few syscalls however many rules they carry. A
+ * batch that fails part way leaves the rules it did install in place, as
+ * a sequence of single calls would; ebpf_xdp_replace_redirects() is
+ * all-or-nothing.
+ */
+
+/**
+ * Add or update many XDP redirect rules
+ *
+ * Rules with the same source interface collapse to the last one.
+ *
+ * @param rules Redirect rules
+ * @param count Number of rules
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_add_redirects(const xdp_redirect_rule_t *rules, uint32_t count);
+
+/**
+ * Remove many XDP redirect rules
+ *
+ * Source interfaces without a rule are ignored.
+ *
+ * @param src_ifindexes Source interface indexes
+ * @param count Number of interfaces
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_del_redirects(const uint32_t *src_ifindexes, uint32_t count);
+
+/**
+ * Atomically replace the whole XDP redirect rule set
+ *
+ * The new set is built in a separate table and swapped in with a single
+ * map-in-map update, so no packet sees a partially applied set.
+ *
+ * @param rules New redirect rules (may be empty)
+ * @param count Number of rules
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_replace_redirects(const xdp_redirect_rule_t *rules, uint32_t count);
+
 /**
  * Get XDP redirect rule
  *
@@ -162,12 +358,49 @@ int ebpf_xdp_list_redirects(xdp_redirect_rule_t *rules, uint32_t max_rules);
 /**
  * Attach XDP program to interface
  *
+ * If flags carries no mode bit, driver-native mode is tried first and the
+ * attach falls back to generic (SKB) mode when the driver refuses it. An
+ * explicit XDP_FLAGS_SKB_MODE or XDP_FLAGS_DRV_MODE is honoured as-is.
+ * Hardware offload is reported by ebpf_xdp_probe() but cannot be used for
+ * the redirect programs, since offload JITs do not support devmap.
+ *
  * @param ifindex Interface index
  * @param flags Attach flags (XDP_FLAGS_*)
  * @return EBPF_OK on success
  */
 int ebpf_xdp_attach(uint32_t ifindex, uint32_t flags);
 
+/**
+ * Attach the flow offload XDP program to interface
+ *
+ * Like ebpf_xdp_attach(), but packets of flows in the flow cache are
+ * forwarded straight to their target first. Everything else, including
+ * AF_XDP steering and redirect rules, is handled as by the redirect
+ * program.
+ *
+ * @param ifindex Interface index
+ * @param flags Attach flags (XDP_FLAGS_*)
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_attach_flow_offload(uint32_t ifindex, uint32_t flags);
+
+/**
+ * Probe XDP capabilities of an interface
+ *
+ * @param ifindex Interface index
+ * @param caps Output EBPF_XDP_CAP_* bits
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_probe(uint32_t ifindex, uint32_t *caps);
+
+/**
+ * Get the mode the XDP program on an interface was bound in
+ *
+ * @param ifindex Interface index
+ * @return Bound mode, or XDP_MODE_NONE if not attached by this library
+ */
+xdp_mode_t ebpf_xdp_get_mode(uint32_t ifindex);
+
 /**
  * Detach XDP program from interface
  *
@@ -183,6 +416,12 @@ int ebpf_xdp_detach(uint32_t ifindex);
 /**
  * Add TC filter rule
  *
+ * Rules on an interface are evaluated in priority order, ties broken by
+ * insertion order, and the first match decides. The interface's rule set
+ * is recompiled into the kernel prefix tries on every change. Frames may
+ * carry up to two VLAN tags (802.1Q/802.1ad); IPv6 extension headers are
+ * skipped to find the ports.
+ *
  * @param rule Filter rule
  * @return Rule ID on success, negative error code on failure
  */
@@ -197,6 +436,63 @@ int ebpf_tc_add_filter(const tc_filter_rule_t *rule);
  */
 int ebpf_tc_del_filter(uint32_t ifindex, uint32_t rule_id);
 
+/*
+ * Every change to an interface's rules is compiled into a spare rule
+ * generation and made live with one store, so packets never see a half
+ * applied rule set. The batch calls below compile each interface once
+ * and either apply completely or not at all.
+ */
+
+/**
+ * Add many TC filter rules
+ *
+ * @param rules Filter rules, on any interfaces
+ * @param count Number of rules
+ * @param rule_ids Output rule IDs, one per rule (may be NULL)
+ * @return EBPF_OK on success
+ */
+int ebpf_tc_add_filters(const tc_filter_rule_t *rules, uint32_t count,
+                        uint32_t *rule_ids);
+
+/**
+ * Remove many TC filter rules of one interface
+ *
+ * @param ifindex Interface index
+ * @param rule_ids Rule IDs
+ * @param count Number of rules
+ * @return EBPF_OK on success
+ */
+int ebpf_tc_del_filters(uint32_t ifindex, const uint32_t *rule_ids, uint32_t count);
+
+/**
+ * Atomically replace all TC filter rules of one interface
+ *
+ * @param ifindex Interface index
+ * @param rules New filter rules for ifindex (may be empty)
+ * @param count Number of rules
+ * @param rule_ids Output rule IDs, one per rule (may be NULL)
+ * @return EBPF_OK on success
+ */
+int ebpf_tc_replace_filters(uint32_t ifindex, const tc_filter_rule_t *rules,
+                            uint32_t count, uint32_t *rule_ids);
+
+/**
+ * Set or clear a TC rate limit
+ *
+ * The limit is a token bucket enforced without locks: each CPU spends
+ * tokens from a private cache and refills it from a shared pool in
+ * quanta, so throughput scales with the number of queues. The error is
+ * bounded by one quantum per CPU.
+ *
+ * @param ifindex Interface index
+ * @param direction TC_DIR_INGRESS or TC_DIR_EGRESS
+ * @param rate Rate in bytes per second, 0 to remove the limit
+ * @param burst Bucket size in bytes
+ * @return EBPF_OK on success
+ */
+int ebpf_tc_set_rate_limit(uint32_t ifindex, tc_direction_t direction,
+                           uint64_t rate, uint64_t burst);
+
 /**
  * Attach TC program to interface
  *
@@ -222,6 +518,9 @@ int ebpf_tc_detach(uint32_t ifindex, bool ingress);
 /**
  * Enable fast path between two VMs
  *
+ * Installs bidirectional redirect rules and attaches the fast path XDP
+ * program to both TAPs unless a program is already attached there.
+ *
  * @param vm1_tap First VM TAP interface name
  * @param vm2_tap Second VM TAP interface name
  * @return EBPF_OK on success
@@ -246,10 +545,228 @@ int ebpf_disable_vm_fastpath(const char *vm1_tap, const char *vm2_tap);
  */
 int ebpf_list_vm_fastpaths(vm_fastpath_entry_t *entries, uint32_t max_entries);
 
+/* ============================================================================
+ * Flow Offload
+ * ============================================================================ */
+
+/*
+ * The flow cache is an LRU map read by the flow offload program. Flows
+ * get in two ways. The caller adds connections the host stack has
+ * established, for instance from conntrack events. TC also learns
+ * established TCP flows that a redirect rule matches, for as long as the
+ * interface's rules and ingress rate limit stay unchanged. A flow is
+ * dropped from the cache when it sees TCP FIN or RST, so teardown always
+ * reaches the stack.
+ */
+
+/**
+ * Add or update an offloaded flow
+ *
+ * @param flow Flow and its target
+ * @return EBPF_OK on success
+ */
+int ebpf_flow_offload_add(const ebpf_flow_t *flow);
+
+/**
+ * Remove an offloaded flow
+ *
+ * @param flow Flow to remove; target fields are ignored
+ * @return EBPF_OK on success
+ */
+int ebpf_flow_offload_del(const ebpf_flow_t *flow);
+
+/**
+ * Remove every offloaded flow entering an interface
+ *
+ * @param ifindex Ingress interface, or 0 for all flows
+ * @return EBPF_OK on success
+ */
+int ebpf_flow_offload_flush(uint32_t ifindex);
+
+/* ============================================================================
+ * XDP Guard
+ * ============================================================================ */
+
+/*
+ * The guard is an XDP stage bound in front of an interface's redirect,
+ * flow offload or fast path program. It drops frames outside the
+ * interface's size bounds, malformed IP frames, frames from blocked
+ * sources and SYN or UDP floods over a destination's cap, then tail
+ * calls the interface's program with everything else. Dropped frames
+ * never reach an skb and count as drops in the interface statistics.
+ * Blocks and caps are per destination address, so they apply on every
+ * interface with the guard enabled.
+ */
+
+/**
+ * Enable the guard on an interface, or change its checks
+ *
+ * An XDP program must already be attached to the interface; the guard is
+ * bound in the same mode and removed when that program is detached.
+ *
+ * @param ifindex Interface index
+ * @param config Checks to apply
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_guard_enable(uint32_t ifindex, const ebpf_guard_config_t *config);
+
+/**
+ * Disable the guard on an interface
+ *
+ * @param ifindex Interface index
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_guard_disable(uint32_t ifindex);
+
+/**
+ * Block a source prefix from a destination
+ *
+ * @param block Destination and source prefix
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_guard_block(const ebpf_guard_block_t *block);
+
+/**
+ * Remove a block added with ebpf_xdp_guard_block()
+ *
+ * @param block Destination and source prefix, as added
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_guard_unblock(const ebpf_guard_block_t *block);
+
+/**
+ * Set or clear a flood cap on a destination
+ *
+ * Enforced like ebpf_tc_set_rate_limit(), with the error bounded by one
+ * quantum per CPU, but counted in packets.
+ *
+ * @param limit Destination, kind and rate
+ * @return EBPF_OK on success
+ */
+int ebpf_xdp_guard_set_limit(const ebpf_guard_limit_t *limit);
+
+/* ============================================================================
+ * AF_XDP Sockets
+ * ============================================================================ */
+
+/*
+ * An AF_XDP socket takes the frames the XDP redirect program sees on one
+ * queue, optionally only one UDP port, and hands them to userspace without
+ * leaving the driver's buffers when the NIC supports zero-copy. Frames are
+ * owned by the caller between ebpf_xsk_rx_burst()/ebpf_xsk_alloc_frames()
+ * and ebpf_xsk_release()/ebpf_xsk_tx_burst(). A socket must be used from
+ * one thread at a time and destroyed before ebpf_accel_cleanup().
+ */
+
+/**
+ * Create an AF_XDP socket and steer its queue to it
+ *
+ * ebpf_xdp_attach() must have been called for the interface. Zero-copy is
+ * tried first and copy mode used if the driver does not support it.
+ *
+ * @param config Socket configuration
+ * @param xsk Output socket handle
+ * @return EBPF_OK on success
+ */
+int ebpf_xsk_create(const ebpf_xsk_config_t *config, ebpf_xsk_t **xsk);
+
+/**
+ * Stop steering to a socket and free it
+ *
+ * @param xsk Socket handle
+ */
+void ebpf_xsk_destroy(ebpf_xsk_t *xsk);
+
+/**
+ * Get the socket file descriptor, for poll()
+ *
+ * @param xsk Socket handle
+ * @return File descriptor
+ */
+int ebpf_xsk_fd(const ebpf_xsk_t *xsk);
+
+/**
+ * Check whether a socket runs in zero-copy mode
+ *
+ * @param xsk Socket handle
+ * @return true if bound zero-copy
+ */
+bool ebpf_xsk_is_zerocopy(const ebpf_xsk_t *xsk);
+
+/**
+ * Get the data of a frame
+ *
+ * @param xsk Socket handle
+ * @param addr Descriptor address
+ * @return Pointer into the UMEM
+ */
+void *ebpf_xsk_frame(const ebpf_xsk_t *xsk, uint64_t addr);
+
+/**
+ * Receive frames
+ *
+ * Never blocks; with busy polling enabled an empty ring drives the queue.
+ *
+ * @param xsk Socket handle
+ * @param descs Output descriptors
+ * @param max_descs Maximum descriptors to return
+ * @return Number of frames, or negative error code
+ */
+int ebpf_xsk_rx_burst(ebpf_xsk_t *xsk, ebpf_xsk_desc_t *descs, uint32_t max_descs);
+
+/**
+ * Queue frames for transmission
+ *
+ * Frames that were queued belong to the kernel and are recycled once sent;
+ * the caller keeps the rest.
+ *
+ * @param xsk Socket handle
+ * @param descs Frames to send, addr/len set
+ * @param count Number of frames
+ * @return Number of frames queued, or negative error code
+ */
+int ebpf_xsk_tx_burst(ebpf_xsk_t *xsk, const ebpf_xsk_desc_t *descs, uint32_t count);
+
+/**
+ * Take free frames for building packets to send
+ *
+ * @param xsk Socket handle
+ * @param addrs Output frame addresses
+ * @param count Number of frames wanted
+ * @return Number of frames taken, or negative error code
+ */
+int ebpf_xsk_alloc_frames(ebpf_xsk_t *xsk, uint64_t *addrs, uint32_t count);
+
+/**
+ * Return received or allocated frames without sending them
+ *
+ * @param xsk Socket handle
+ * @param descs Frames to return
+ * @param count Number of frames
+ * @return EBPF_OK on success
+ */
+int ebpf_xsk_release(ebpf_xsk_t *xsk, const ebpf_xsk_desc_t *descs, uint32_t count);
+
+/**
+ * Get socket counters
+ *
+ * @param xsk Socket handle
+ * @param stats Output counters
+ * @return EBPF_OK on success
+ */
+int ebpf_xsk_get_stats(const ebpf_xsk_t *xsk, ebpf_xsk_stats_t *stats);
+
 /* ============================================================================
  * Statistics
  * ============================================================================ */
 
+/*
+ * Counters come from mmap-ed BPF arrays, so reads cost no syscalls.
+ * Packet and byte counts are taken at XDP; drop and redirect counts also
+ * include TC verdicts. Interfaces get their own counters once an XDP or
+ * TC program is attached to them through this library.
+ */
+
 /**
  * Get global statistics
  *
@@ -267,6 +784,15 @@ int ebpf_get_stats(ebpf_stats_t *stats);
  */
 int ebpf_get_if_stats(uint32_t ifindex, ebpf_stats_t *stats);
 
+/**
+ * Get statistics of every interface with its own counters
+ *
+ * @param stats Output array
+ * @param max_entries Maximum entries to return
+ * @return Number of entries, or negative error code
+ */
+int ebpf_get_all_if_stats(ebpf_if_stats_t *stats, uint32_t max_entries);
+
 /**
  * Reset statistics
  *
@@ -281,6 +807,9 @@ int ebpf_reset_stats(void);
 /**
  * Get interface info by name
  *
+ * Besides the basic link attributes, reports the XDP mode currently bound
+ * on the interface and its XDP capabilities.
+ *
  * @param ifname Interface name
  * @param info Output info
  * @return EBPF_OK on success
@@ -0,0 +1,185 @@
+/**
+ * Zixiao Hypervisor - XDP Guard Tables
+ *
+ * Manages the blocklist and flood caps read by xdp_ddos_guard. Both are
+ * keyed by destination address and live only in the pinned maps, so a
+ * restarted loader enforces what the previous one configured without
+ * rebuilding anything. Enabling the guard on an interface is part of
+ * XDP attachment, in loader.c.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "xdp_redirect.skel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/* Destination addresses are matched in full */
+static int make_dst(tc_family_t family, uint32_t dst_ip, const uint8_t dst_ip6[16],
+                    uint32_t out[4]) {
+    uint8_t len;
+
+    switch (family) {
+        case TC_FAMILY_IPV4:
+            return ebpf_normalize_prefix4(dst_ip, 32, out, &len);
+        case TC_FAMILY_IPV6:
+            return ebpf_normalize_prefix6(dst_ip6, 128, out, &len);
+        default:
+            return -EINVAL;
+    }
+}
+
+static int make_block_key(const ebpf_guard_block_t *block, struct guard_block_key *key) {
+    uint8_t len;
+    int err;
+
+    memset(key, 0, sizeof(*key));
+    err = make_dst(block->family, block->dst_ip, block->dst_ip6, key->dst);
+    if (!err)
+        err = block->family == TC_FAMILY_IPV4
+                  ? ebpf_normalize_prefix4(block->src_ip, block->src_prefix_len,
+                                           key->src, &len)
+                  : ebpf_normalize_prefix6(block->src_ip6, block->src_prefix_len,
+                                           key->src, &len);
+    if (err) {
+        ebpf_set_error("Invalid guard block for address family %d", block->family);
+        return EBPF_ERR_INVALID;
+    }
+
+    key->prefixlen = 128 + len;
+    return EBPF_OK;
+}
+
+int ebpf_xdp_guard_block(const ebpf_guard_block_t *block) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!block) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct guard_block_key key;
+    int ret = make_block_key(block, &key);
+    if (ret != EBPF_OK)
+        return ret;
+
+    uint32_t unused = 0;
+    int err = bpf_map_update_elem(bpf_map__fd(ebpf_xdp_skel()->maps.guard_block),
+                                  &key, &unused, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to add guard block: %s", strerror(-err));
+        return err == -E2BIG || err == -ENOSPC ? EBPF_ERR_MEMORY : EBPF_ERR_MAP;
+    }
+    return EBPF_OK;
+}
+
+int ebpf_xdp_guard_unblock(const ebpf_guard_block_t *block) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!block) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct guard_block_key key;
+    int ret = make_block_key(block, &key);
+    if (ret != EBPF_OK)
+        return ret;
+
+    int err = bpf_map_delete_elem(bpf_map__fd(ebpf_xdp_skel()->maps.guard_block), &key);
+    if (err) {
+        ebpf_set_error("Failed to remove guard block: %s", strerror(-err));
+        return err == -ENOENT ? EBPF_ERR_INVALID : EBPF_ERR_MAP;
+    }
+    return EBPF_OK;
+}
+
+int ebpf_xdp_guard_set_limit(const ebpf_guard_limit_t *limit) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!limit ||
+        (limit->kind != GUARD_FLOOD_TCP_SYN && limit->kind != GUARD_FLOOD_UDP)) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct guard_limit_key key = {
+        .kind = limit->kind == GUARD_FLOOD_TCP_SYN ? GUARD_KIND_SYN : GUARD_KIND_UDP,
+    };
+    if (make_dst(limit->family, limit->dst_ip, limit->dst_ip6, key.dst)) {
+        ebpf_set_error("Invalid guard limit address family %d", limit->family);
+        return EBPF_ERR_INVALID;
+    }
+
+    struct xdp_redirect_bpf *skel = ebpf_xdp_skel();
+    int pool_fd = bpf_map__fd(skel->maps.guard_limits);
+    int local_fd = bpf_map__fd(skel->maps.guard_local);
+
+    if (limit->rate == 0) {
+        /* Removing the caches first makes the datapath stop enforcing */
+        bpf_map_delete_elem(local_fd, &key);
+        bpf_map_delete_elem(pool_fd, &key);
+        return EBPF_OK;
+    }
+
+    if (limit->burst == 0 || limit->burst > INT64_MAX) {
+        ebpf_set_error("Invalid burst size");
+        return EBPF_ERR_INVALID;
+    }
+
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0) {
+        ebpf_set_error("Failed to get possible CPU count");
+        return EBPF_ERR_INIT;
+    }
+
+    /* As for TC, but any packet fits in a quantum of one */
+    uint64_t quantum = limit->burst / (4 * (uint64_t)ncpus);
+    if (quantum == 0)
+        quantum = 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    struct rate_limit pool = {
+        .rate = limit->rate,
+        .burst = limit->burst,
+        .quantum = quantum,
+        .tokens = (int64_t)limit->burst,
+        .last_refill = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec,
+    };
+
+    int err = bpf_map_update_elem(pool_fd, &key, &pool, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to set guard limit: %s", strerror(-err));
+        return err == -E2BIG || err == -ENOSPC ? EBPF_ERR_MEMORY : EBPF_ERR_MAP;
+    }
+
+    struct rate_local *locals = calloc((size_t)ncpus, sizeof(*locals));
+    if (!locals) {
+        bpf_map_delete_elem(pool_fd, &key);
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    err = bpf_map_update_elem(local_fd, &key, locals, BPF_ANY);
+    free(locals);
+    if (err) {
+        bpf_map_delete_elem(pool_fd, &key);
+        ebpf_set_error("Failed to set guard limit caches: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    return EBPF_OK;
+}
@@ -0,0 +1,247 @@
+/**
+ * Zixiao Hypervisor - XDP Flow Offload
+ *
+ * Manages the flow cache read by xdp_flow_offload. Flows added here hold
+ * a devmap reference on their target so the XDP program can always
+ * forward them; flows tc_filter_prog learns hold none and fall back to
+ * the stack if their target has no slot. Evicted flows keep their
+ * reference until they are deleted or flushed.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "xdp_redirect.skel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/* A flow added through the API, and the target it references */
+typedef struct {
+    struct flow_key key;
+    uint32_t dst_ifindex;
+} flow_ref_t;
+
+static uint64_t flow_hash(const void *key) {
+    return ebpf_hash_bytes(key, sizeof(struct flow_key));
+}
+
+static bool flow_match(const void *entry, const void *key) {
+    return memcmp(&((const flow_ref_t *)entry)->key, key, sizeof(struct flow_key)) == 0;
+}
+
+static ebpf_table_t flows = EBPF_TABLE_INIT(flow_ref_t, flow_hash, flow_match);
+
+static int flow_cache_fd(void) {
+    return bpf_map__fd(ebpf_xdp_skel()->maps.flow_cache);
+}
+
+static int make_key(const ebpf_flow_t *flow, struct flow_key *key) {
+    memset(key, 0, sizeof(*key));
+
+    if (flow->ifindex == 0 || flow->ifindex >= IF_SLOTS_SIZE ||
+        flow->vlan_id > 4094) {
+        ebpf_set_error("Invalid flow");
+        return EBPF_ERR_INVALID;
+    }
+
+    switch (flow->family) {
+        case TC_FAMILY_IPV4:
+            key->src[2] = key->dst[2] = htonl(0xffff);
+            key->src[3] = flow->src_ip;
+            key->dst[3] = flow->dst_ip;
+            break;
+        case TC_FAMILY_IPV6:
+            memcpy(key->src, flow->src_ip6, sizeof(key->src));
+            memcpy(key->dst, flow->dst_ip6, sizeof(key->dst));
+            break;
+        default:
+            ebpf_set_error("Invalid flow address family %d", flow->family);
+            return EBPF_ERR_INVALID;
+    }
+
+    key->ifindex = flow->ifindex;
+    /* The datapath only sees ports for TCP and UDP */
+    if (flow->protocol == IPPROTO_TCP || flow->protocol == IPPROTO_UDP) {
+        key->src_port = flow->src_port;
+        key->dst_port = flow->dst_port;
+    }
+    key->vlan_id = flow->vlan_id;
+    key->protocol = flow->protocol;
+    return EBPF_OK;
+}
+
+static void drop_ref(flow_ref_t *ref) {
+    uint32_t dst = ref->dst_ifindex;
+    ebpf_table_remove(&flows, ref);
+    ebpf_devmap_put(dst);
+}
+
+int ebpf_flow_offload_add(const ebpf_flow_t *flow) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!flow || flow->dst_ifindex == 0) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct flow_key key;
+    int ret = make_key(flow, &key);
+    if (ret != EBPF_OK)
+        return ret;
+
+    flow_ref_t *ref = ebpf_table_find(&flows, &key);
+    if (!ref && flows.count >= FLOW_CACHE_SIZE) {
+        ebpf_set_error("Maximum offloaded flows reached");
+        return EBPF_ERR_MEMORY;
+    }
+    if (ebpf_table_reserve(&flows, flows.count + 1) < 0) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    /* The target's slot must exist before the datapath can pick the flow */
+    ret = ebpf_devmap_get(flow->dst_ifindex);
+    if (ret != EBPF_OK)
+        return ret;
+
+    struct flow_entry entry = { .dst_ifindex = flow->dst_ifindex };
+    if (flow->rewrite_mac) {
+        memcpy(entry.mac.src_mac, flow->src_mac, sizeof(entry.mac.src_mac));
+        memcpy(entry.mac.dst_mac, flow->dst_mac, sizeof(entry.mac.dst_mac));
+        entry.mac.rewrite = 1;
+    }
+
+    int err = bpf_map_update_elem(flow_cache_fd(), &key, &entry, BPF_ANY);
+    if (err) {
+        ebpf_devmap_put(flow->dst_ifindex);
+        ebpf_set_error("Failed to update flow cache: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    if (ref) {
+        uint32_t old_dst = ref->dst_ifindex;
+        ref->dst_ifindex = flow->dst_ifindex;
+        ebpf_devmap_put(old_dst);
+    } else {
+        flow_ref_t fresh = { .key = key, .dst_ifindex = flow->dst_ifindex };
+        ebpf_table_insert(&flows, &key, &fresh);
+    }
+    return EBPF_OK;
+}
+
+int ebpf_flow_offload_del(const ebpf_flow_t *flow) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!flow) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct flow_key key;
+    int ret = make_key(flow, &key);
+    if (ret != EBPF_OK)
+        return ret;
+
+    /* Learned flows have no reference but can be removed all the same */
+    int err = bpf_map_delete_elem(flow_cache_fd(), &key);
+    flow_ref_t *ref = ebpf_table_find(&flows, &key);
+    if (ref)
+        drop_ref(ref);
+
+    if (err && !ref) {
+        ebpf_set_error("Flow not found");
+        return EBPF_ERR_INVALID;
+    }
+    return EBPF_OK;
+}
+
+int ebpf_flow_offload_flush(uint32_t ifindex) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    int fd = flow_cache_fd();
+    struct flow_key *keys = NULL;
+    uint32_t count = 0, capacity = 0;
+    struct flow_key key, next;
+    struct flow_key *prev = NULL;
+
+    /* Collect first: deleting while walking restarts the iteration */
+    while (bpf_map_get_next_key(fd, prev, &next) == 0) {
+        key = next;
+        prev = &key;
+        if (ifindex && key.ifindex != ifindex)
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            struct flow_key *grown = realloc(keys, capacity * sizeof(*keys));
+            if (!grown) {
+                free(keys);
+                ebpf_set_error("Out of memory");
+                return EBPF_ERR_MEMORY;
+            }
+            keys = grown;
+        }
+        keys[count++] = key;
+    }
+
+    int err = ebpf_map_delete_many(fd, keys, count, sizeof(*keys));
+    free(keys);
+    if (err) {
+        ebpf_set_error("Failed to flush flow cache: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    /* Evicted flows are only known here */
+    for (flow_ref_t *ref = ebpf_table_next(&flows, NULL); ref;
+         ref = ebpf_table_next(&flows, ref)) {
+        if (!ifindex || ref->key.ifindex == ifindex)
+            drop_ref(ref);
+    }
+    return EBPF_OK;
+}
+
+/* ============================================================================
+ * Lifecycle
+ * ============================================================================ */
+
+/*
+ * Re-take references for the flows a previous instance added, so their
+ * targets keep their devmap slots. Learned flows need nothing.
+ */
+void flow_cache_sync(void) {
+    int fd = flow_cache_fd();
+    struct flow_key key, next;
+    struct flow_key *prev = NULL;
+    struct flow_entry entry;
+
+    flow_cache_reset();
+
+    while (bpf_map_get_next_key(fd, prev, &next) == 0) {
+        key = next;
+        prev = &key;
+
+        if (bpf_map_lookup_elem(fd, &key, &entry) != 0 ||
+            (entry.flags & FLOW_F_LEARNED) ||
+            ebpf_table_reserve(&flows, flows.count + 1) < 0 ||
+            ebpf_devmap_get(entry.dst_ifindex) != EBPF_OK)
+            continue;
+
+        flow_ref_t ref = { .key = key, .dst_ifindex = entry.dst_ifindex };
+        ebpf_table_insert(&flows, &key, &ref);
+    }
+}
+
+void flow_cache_reset(void) {
+    ebpf_table_clear(&flows);
+}
@@ -1,50 +1,506 @@
 /**
  * Zixiao Hypervisor - eBPF Loader Implementation
  *
+ * The BPF objects are embedded through libbpf skeletons generated by
+ * bpftool at build time. Maps are pinned under EBPF_PIN_ROOT so the
+ * datapath survives an agent restart; on init the loader reuses the pinned
+ * maps and rebuilds its rule tables from them.
+ *
  * Copyright (C) 2024 Zixiao Team
  * Licensed under Apache License 2.0
  */
 
 #include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "xdp_redirect.skel.h"
+#include "tc_filter.skel.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 #include <unistd.h>
 #include <net/if.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <linux/if_link.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+/* XDP feature bits from linux/netdev.h, absent from older UAPI headers */
+#ifndef NETDEV_XDP_ACT_BASIC
+#define NETDEV_XDP_ACT_BASIC        (1U << 0)
+#define NETDEV_XDP_ACT_REDIRECT     (1U << 1)
+#define NETDEV_XDP_ACT_NDO_XMIT     (1U << 2)
+#define NETDEV_XDP_ACT_XSK_ZEROCOPY (1U << 3)
+#define NETDEV_XDP_ACT_HW_OFFLOAD   (1U << 4)
+#endif
 
 /* Internal state */
 static struct {
     bool initialized;
     bool supported;
-    ebpf_stats_t global_stats;
     char last_error[256];
-} ebpf_state = {0};
+    struct xdp_redirect_bpf *xdp_skel;
+    struct tc_filter_bpf *tc_skel;
+    int redirect_fd;            /* Live redirect table */
+    int grace_fd;               /* Array of maps rewritten to wait for programs */
+    int grace_inner_fd;         /* Its only element */
+} ebpf_state = { .redirect_fd = -1, .grace_fd = -1, .grace_inner_fd = -1 };
+
+static uint64_t ifindex_hash(const void *key) {
+    return ebpf_hash_u32(*(const uint32_t *)key);
+}
 
-/* Hash map for redirect rules */
-#define MAX_REDIRECT_RULES 1024
-static xdp_redirect_rule_t redirect_rules[MAX_REDIRECT_RULES];
-static uint32_t redirect_count = 0;
+/* Redirect rules by source ifindex */
+static bool redirect_match(const void *entry, const void *key) {
+    return ((const xdp_redirect_rule_t *)entry)->src_ifindex == *(const uint32_t *)key;
+}
+static ebpf_table_t redirect_rules =
+    EBPF_TABLE_INIT(xdp_redirect_rule_t, ifindex_hash, redirect_match);
 
-/* Hash map for VM fast paths */
-#define MAX_FASTPATH_ENTRIES 256
-static vm_fastpath_entry_t fastpath_entries[MAX_FASTPATH_ENTRIES];
-static uint32_t fastpath_count = 0;
+/* Rules per devmap target, so a slot goes away with the last rule using it */
+typedef struct {
+    uint32_t dst_ifindex;
+    uint32_t refs;
+} devmap_ref_t;
 
-static void set_error(const char *fmt, ...) {
+static bool devmap_ref_match(const void *entry, const void *key) {
+    return ((const devmap_ref_t *)entry)->dst_ifindex == *(const uint32_t *)key;
+}
+static ebpf_table_t devmap_refs =
+    EBPF_TABLE_INIT(devmap_ref_t, ifindex_hash, devmap_ref_match);
+
+/* VM fast paths by TAP name pair, in either order */
+typedef struct {
+    const char *tap1;
+    const char *tap2;
+} tap_pair_t;
+
+static uint64_t tap_pair_hash(const void *key) {
+    const tap_pair_t *pair = key;
+    /* Commutative, so both orders land in the same bucket */
+    return ebpf_hash_str(pair->tap1) + ebpf_hash_str(pair->tap2);
+}
+
+static bool fastpath_match(const void *entry, const void *key) {
+    const vm_fastpath_entry_t *e = entry;
+    const tap_pair_t *pair = key;
+    return (strcmp(e->vm1_tap, pair->tap1) == 0 && strcmp(e->vm2_tap, pair->tap2) == 0) ||
+           (strcmp(e->vm1_tap, pair->tap2) == 0 && strcmp(e->vm2_tap, pair->tap1) == 0);
+}
+static ebpf_table_t fastpaths =
+    EBPF_TABLE_INIT(vm_fastpath_entry_t, tap_pair_hash, fastpath_match);
+
+/* Interfaces with an XDP program attached by this library */
+#define MAX_XDP_ATTACHMENTS 256
+typedef struct {
+    uint32_t ifindex;
+    uint32_t flags;             /* Flags the program was bound with */
+    xdp_mode_t mode;            /* Mode actually bound */
+    uint32_t next;              /* Program the interface runs, GUARD_NEXT_* */
+    bool guard;                 /* xdp_ddos_guard bound in front of it */
+    bool fastpath;              /* Attached implicitly by a fast path */
+} xdp_attachment_t;
+static xdp_attachment_t xdp_attachments[MAX_XDP_ATTACHMENTS];
+static uint32_t xdp_attach_count = 0;
+
+/* TC hooks with a filter attached by this library */
+#define MAX_TC_ATTACHMENTS 512
+#define TC_FILTER_HANDLE   1
+#define TC_FILTER_PRIORITY 1
+typedef struct {
+    uint32_t ifindex;
+    bool ingress;
+} tc_attachment_t;
+static tc_attachment_t tc_attachments[MAX_TC_ATTACHMENTS];
+static uint32_t tc_attach_count = 0;
+
+void ebpf_set_error(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     vsnprintf(ebpf_state.last_error, sizeof(ebpf_state.last_error), fmt, args);
     va_end(args);
 }
 
+struct xdp_redirect_bpf *ebpf_xdp_skel(void) {
+    return ebpf_state.xdp_skel;
+}
+
+struct tc_filter_bpf *ebpf_tc_skel(void) {
+    return ebpf_state.tc_skel;
+}
+
+/* Kernel-internal "operation not supported", returned for missing batch ops */
+#ifndef ENOTSUPP
+#define ENOTSUPP 524
+#endif
+
+static bool batch_unsupported(int err) {
+    return err == -EINVAL || err == -EOPNOTSUPP || err == -ENOTSUPP;
+}
+
+int ebpf_map_update_many(int map_fd, const void *keys, const void *values,
+                         uint32_t count, size_t key_size, size_t value_size) {
+    if (count == 0)
+        return 0;
+
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 done = count;
+    int err = bpf_map_update_batch(map_fd, keys, values, &done, &opts);
+    if (err == 0 || !batch_unsupported(err))
+        return err;
+
+    for (uint32_t i = done; i < count; i++) {
+        err = bpf_map_update_elem(map_fd, (const char *)keys + i * key_size,
+                                  (const char *)values + i * value_size, BPF_ANY);
+        if (err)
+            return err;
+    }
+    return 0;
+}
+
+int ebpf_map_delete_many(int map_fd, const void *keys, uint32_t count,
+                         size_t key_size) {
+    if (count == 0)
+        return 0;
+
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 done = count;
+    int err = bpf_map_delete_batch(map_fd, keys, &done, &opts);
+    if (err == 0)
+        return 0;
+
+    /* The batch stops at the first missing key; finish one by one */
+    for (uint32_t i = done; i < count; i++) {
+        err = bpf_map_delete_elem(map_fd, (const char *)keys + i * key_size);
+        if (err && err != -ENOENT)
+            return err;
+    }
+    return 0;
+}
+
+/*
+ * Before a syscall update of a map-in-map returns, the kernel waits for
+ * every running non-sleepable BPF program to finish. Rewriting the one
+ * slot of a private array of maps is therefore an RCU grace period on
+ * demand.
+ */
+static int create_grace_maps(void) {
+    int inner = bpf_map_create(BPF_MAP_TYPE_ARRAY, "grace_inner", sizeof(uint32_t),
+                               sizeof(uint32_t), 1, NULL);
+    if (inner < 0)
+        return -errno;
+
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .inner_map_fd = inner);
+    int outer = bpf_map_create(BPF_MAP_TYPE_ARRAY_OF_MAPS, "grace_sync", sizeof(uint32_t),
+                               sizeof(uint32_t), 1, &opts);
+    if (outer < 0) {
+        int err = -errno;
+        close(inner);
+        return err;
+    }
+
+    ebpf_state.grace_inner_fd = inner;
+    ebpf_state.grace_fd = outer;
+    return 0;
+}
+
+static void close_grace_maps(void) {
+    if (ebpf_state.grace_fd >= 0)
+        close(ebpf_state.grace_fd);
+    if (ebpf_state.grace_inner_fd >= 0)
+        close(ebpf_state.grace_inner_fd);
+    ebpf_state.grace_fd = -1;
+    ebpf_state.grace_inner_fd = -1;
+}
+
+int ebpf_wait_programs(void) {
+    uint32_t zero = 0;
+    return bpf_map_update_elem(ebpf_state.grace_fd, &zero, &ebpf_state.grace_inner_fd,
+                               BPF_ANY);
+}
+
 /* Check if eBPF is supported */
 static bool check_ebpf_support(void) {
-    /* Check kernel version and BPF support */
-    /* In real implementation, use bpf() syscall to verify */
-    return access("/sys/fs/bpf", F_OK) == 0;
+    if (access("/sys/fs/bpf", F_OK) != 0)
+        return false;
+    return libbpf_probe_bpf_prog_type(BPF_PROG_TYPE_XDP, NULL) > 0;
+}
+
+static int ensure_dir(const char *path) {
+    if (mkdir(path, 0700) == 0 || errno == EEXIST)
+        return 0;
+    return -errno;
+}
+
+static int detach_tc_hook(uint32_t ifindex, bool ingress) {
+    LIBBPF_OPTS(bpf_tc_hook, hook,
+                .ifindex = (int)ifindex,
+                .attach_point = ingress ? BPF_TC_INGRESS : BPF_TC_EGRESS);
+    LIBBPF_OPTS(bpf_tc_opts, opts,
+                .handle = TC_FILTER_HANDLE,
+                .priority = TC_FILTER_PRIORITY);
+    return bpf_tc_detach(&hook, &opts);
+}
+
+/* ============================================================================
+ * Skeleton Lifecycle
+ * ============================================================================ */
+
+static void destroy_skeletons(bool unpin) {
+    if (ebpf_state.xdp_skel) {
+        if (unpin)
+            bpf_object__unpin_maps(ebpf_state.xdp_skel->obj, NULL);
+        xdp_redirect_bpf__destroy(ebpf_state.xdp_skel);
+        ebpf_state.xdp_skel = NULL;
+    }
+    if (ebpf_state.tc_skel) {
+        if (unpin)
+            bpf_object__unpin_maps(ebpf_state.tc_skel->obj, NULL);
+        tc_filter_bpf__destroy(ebpf_state.tc_skel);
+        ebpf_state.tc_skel = NULL;
+    }
+}
+
+/* The program behind each guard_chain slot */
+static const struct bpf_program *chain_prog(uint32_t next) {
+    struct xdp_redirect_bpf *skel = ebpf_state.xdp_skel;
+    switch (next) {
+        case GUARD_NEXT_FLOW_OFFLOAD:   return skel->progs.xdp_flow_offload;
+        case GUARD_NEXT_FASTPATH:       return skel->progs.xdp_vm_fastpath;
+        default:                        return skel->progs.xdp_redirect_prog;
+    }
+}
+
+/* Point the guard at this instance's programs, replacing any left pinned */
+static int fill_guard_chain(void) {
+    int chain_fd = bpf_map__fd(ebpf_state.xdp_skel->maps.guard_chain);
+
+    for (uint32_t next = 0; next < GUARD_NEXT_SLOTS; next++) {
+        int prog_fd = bpf_program__fd(chain_prog(next));
+        if (bpf_map_update_elem(chain_fd, &next, &prog_fd, BPF_ANY))
+            return -errno;
+    }
+    return 0;
+}
+
+static int load_skeletons(uint32_t nr_cpus) {
+    int err;
+
+    if ((err = ensure_dir(EBPF_PIN_ROOT)) < 0 ||
+        (err = ensure_dir(EBPF_PIN_ROOT "/xdp")) < 0 ||
+        (err = ensure_dir(EBPF_PIN_ROOT "/tc")) < 0) {
+        ebpf_set_error("Failed to create pin directory %s: %s",
+                       EBPF_PIN_ROOT, strerror(-err));
+        return err == -EPERM || err == -EACCES ? EBPF_ERR_PERMISSION
+                                               : EBPF_ERR_INIT;
+    }
+
+    LIBBPF_OPTS(bpf_object_open_opts, xdp_opts,
+                .pin_root_path = EBPF_PIN_ROOT "/xdp");
+    ebpf_state.xdp_skel = xdp_redirect_bpf__open_opts(&xdp_opts);
+    if (!ebpf_state.xdp_skel) {
+        ebpf_set_error("Failed to open XDP object: %s", strerror(errno));
+        return EBPF_ERR_LOAD;
+    }
+
+    /* Stats arrays hold one element per (slot, CPU) */
+    ebpf_state.xdp_skel->rodata->nr_cpus = nr_cpus;
+    bpf_map__set_max_entries(ebpf_state.xdp_skel->maps.stats_map,
+                             STATS_SLOTS * nr_cpus);
+
+    err = xdp_redirect_bpf__load(ebpf_state.xdp_skel);
+    if (err) {
+        ebpf_set_error("Failed to load XDP object: %s", strerror(-err));
+        destroy_skeletons(false);
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_LOAD;
+    }
+
+    err = fill_guard_chain();
+    if (err) {
+        ebpf_set_error("Failed to fill XDP guard chain: %s", strerror(-err));
+        destroy_skeletons(false);
+        return EBPF_ERR_MAP;
+    }
+
+    LIBBPF_OPTS(bpf_object_open_opts, tc_opts,
+                .pin_root_path = EBPF_PIN_ROOT "/tc");
+    ebpf_state.tc_skel = tc_filter_bpf__open_opts(&tc_opts);
+    if (!ebpf_state.tc_skel) {
+        ebpf_set_error("Failed to open TC object: %s", strerror(errno));
+        destroy_skeletons(false);
+        return EBPF_ERR_LOAD;
+    }
+
+    ebpf_state.tc_skel->rodata->nr_cpus = nr_cpus;
+    bpf_map__set_max_entries(ebpf_state.tc_skel->maps.tc_stats_map,
+                             STATS_SLOTS * nr_cpus);
+
+    /* Both objects index stats through the same slot table */
+    err = bpf_map__reuse_fd(ebpf_state.tc_skel->maps.if_slots,
+                            bpf_map__fd(ebpf_state.xdp_skel->maps.if_slots));
+    /* TC learns flows into the cache the XDP flow offload reads */
+    if (!err)
+        err = bpf_map__reuse_fd(ebpf_state.tc_skel->maps.flow_cache,
+                                bpf_map__fd(ebpf_state.xdp_skel->maps.flow_cache));
+    if (err) {
+        ebpf_set_error("Failed to share slot table: %s", strerror(-err));
+        destroy_skeletons(false);
+        return EBPF_ERR_MAP;
+    }
+
+    err = tc_filter_bpf__load(ebpf_state.tc_skel);
+    if (err) {
+        ebpf_set_error("Failed to load TC object: %s", strerror(-err));
+        destroy_skeletons(false);
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_LOAD;
+    }
+
+    return EBPF_OK;
+}
+
+/* ============================================================================
+ * Rule Tables
+ * ============================================================================ */
+
+static void clear_rule_tables(void) {
+    ebpf_table_clear(&redirect_rules);
+    ebpf_table_clear(&devmap_refs);
+    ebpf_table_clear(&fastpaths);
+}
+
+/* Make room for n more redirect rules, so recording them cannot fail */
+static int reserve_redirects(uint32_t n) {
+    if (ebpf_table_reserve(&redirect_rules, redirect_rules.count + n) < 0 ||
+        ebpf_table_reserve(&devmap_refs, devmap_refs.count + n) < 0) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+    return EBPF_OK;
+}
+
+static void devmap_ref(uint32_t dst_ifindex) {
+    devmap_ref_t *ref = ebpf_table_find(&devmap_refs, &dst_ifindex);
+    if (ref) {
+        ref->refs++;
+        return;
+    }
+    devmap_ref_t fresh = { .dst_ifindex = dst_ifindex, .refs = 1 };
+    ebpf_table_insert(&devmap_refs, &dst_ifindex, &fresh);
+}
+
+static void devmap_unref(uint32_t dst_ifindex) {
+    devmap_ref_t *ref = ebpf_table_find(&devmap_refs, &dst_ifindex);
+    if (ref && --ref->refs == 0)
+        ebpf_table_remove(&devmap_refs, ref);
+}
+
+/* Record a rule the kernel now enforces; room must have been reserved */
+static void store_rule(const xdp_redirect_rule_t *rule) {
+    xdp_redirect_rule_t *cur = ebpf_table_find(&redirect_rules, &rule->src_ifindex);
+
+    devmap_ref(rule->dst_ifindex);
+    if (cur) {
+        devmap_unref(cur->dst_ifindex);
+        *cur = *rule;
+    } else {
+        ebpf_table_insert(&redirect_rules, &rule->src_ifindex, rule);
+    }
+}
+
+static void erase_rule(xdp_redirect_rule_t *rule) {
+    devmap_unref(rule->dst_ifindex);
+    ebpf_table_remove(&redirect_rules, rule);
+}
+
+static int create_redirect_table(void) {
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = BPF_F_NO_PREALLOC);
+    int fd = bpf_map_create(BPF_MAP_TYPE_HASH, "redirect_table", sizeof(uint32_t),
+                            sizeof(struct redirect_entry), REDIRECT_MAP_SIZE, &opts);
+    return fd < 0 ? -errno : fd;
+}
+
+/*
+ * Point the datapath at a redirect table. Readers see the old table or
+ * the new one, never a mix; the caller still owns the old table's fd.
+ */
+static int publish_redirect_table(int table_fd) {
+    uint32_t zero = 0;
+    return bpf_map_update_elem(bpf_map__fd(ebpf_state.xdp_skel->maps.redirect_tables),
+                               &zero, &table_fd, BPF_ANY);
+}
+
+/* Adopt the table a previous instance left live, or install an empty one */
+static int open_redirect_table(void) {
+    uint32_t zero = 0, id = 0;
+    int outer_fd = bpf_map__fd(ebpf_state.xdp_skel->maps.redirect_tables);
+
+    if (bpf_map_lookup_elem(outer_fd, &zero, &id) == 0 && id != 0) {
+        int fd = bpf_map_get_fd_by_id(id);
+        if (fd >= 0) {
+            ebpf_state.redirect_fd = fd;
+            return EBPF_OK;
+        }
+    }
+
+    int fd = create_redirect_table();
+    if (fd < 0) {
+        ebpf_set_error("Failed to create redirect table: %s", strerror(-fd));
+        return fd == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_MAP;
+    }
+
+    int err = publish_redirect_table(fd);
+    if (err) {
+        ebpf_set_error("Failed to install redirect table: %s", strerror(-err));
+        close(fd);
+        return EBPF_ERR_MAP;
+    }
+    ebpf_state.redirect_fd = fd;
+    return EBPF_OK;
+}
+
+static void rule_to_entry(const xdp_redirect_rule_t *rule, struct redirect_entry *entry) {
+    memset(entry, 0, sizeof(*entry));
+    entry->dst_ifindex = rule->dst_ifindex;
+    if (rule->rewrite_mac) {
+        entry->mac.rewrite = 1;
+        memcpy(entry->mac.src_mac, rule->src_mac, sizeof(entry->mac.src_mac));
+        memcpy(entry->mac.dst_mac, rule->dst_mac, sizeof(entry->mac.dst_mac));
+    }
+}
+
+/*
+ * Rebuild the redirect rule table from the live table left behind by a
+ * previous instance, so list/get reflect what the kernel is enforcing.
+ */
+static void sync_redirects_from_kernel(void) {
+    uint32_t key, next_key;
+    uint32_t *prev = NULL;
+    struct redirect_entry entry;
+
+    while (bpf_map_get_next_key(ebpf_state.redirect_fd, prev, &next_key) == 0) {
+        key = next_key;
+        prev = &key;
+
+        if (bpf_map_lookup_elem(ebpf_state.redirect_fd, &key, &entry) != 0)
+            continue;
+
+        if (reserve_redirects(1) != EBPF_OK)
+            break;
+
+        xdp_redirect_rule_t rule = {0};
+        rule.src_ifindex = key;
+        rule.dst_ifindex = entry.dst_ifindex;
+        if (entry.mac.rewrite) {
+            memcpy(rule.src_mac, entry.mac.src_mac, sizeof(rule.src_mac));
+            memcpy(rule.dst_mac, entry.mac.dst_mac, sizeof(rule.dst_mac));
+            rule.rewrite_mac = true;
+        }
+        store_rule(&rule);
+    }
 }
 
 /* ============================================================================
@@ -53,21 +509,56 @@ static bool check_ebpf_support(void) {
 
 int ebpf_accel_init(void) {
     if (ebpf_state.initialized) {
-        set_error("eBPF acceleration already initialized");
+        ebpf_set_error("eBPF acceleration already initialized");
         return EBPF_ERR_INIT;
     }
 
     ebpf_state.supported = check_ebpf_support();
     if (!ebpf_state.supported) {
-        set_error("eBPF not supported on this system");
+        ebpf_set_error("eBPF not supported on this system");
+        return EBPF_ERR_INIT;
+    }
+
+    clear_rule_tables();
+    xdp_attach_count = 0;
+    tc_attach_count = 0;
+
+    int nr_cpus = libbpf_num_possible_cpus();
+    if (nr_cpus <= 0) {
+        ebpf_set_error("Failed to get possible CPU count");
         return EBPF_ERR_INIT;
     }
 
-    memset(&ebpf_state.global_stats, 0, sizeof(ebpf_state.global_stats));
-    memset(redirect_rules, 0, sizeof(redirect_rules));
-    memset(fastpath_entries, 0, sizeof(fastpath_entries));
-    redirect_count = 0;
-    fastpath_count = 0;
+    int ret = load_skeletons((uint32_t)nr_cpus);
+    if (ret != EBPF_OK)
+        return ret;
+
+    ret = ebpf_stats_init((uint32_t)nr_cpus);
+    if (ret != EBPF_OK) {
+        destroy_skeletons(false);
+        return ret;
+    }
+
+    ret = open_redirect_table();
+    if (ret != EBPF_OK) {
+        ebpf_stats_cleanup();
+        destroy_skeletons(false);
+        return ret;
+    }
+
+    int err = create_grace_maps();
+    if (err) {
+        ebpf_set_error("Failed to create grace period maps: %s", strerror(-err));
+        close(ebpf_state.redirect_fd);
+        ebpf_state.redirect_fd = -1;
+        ebpf_stats_cleanup();
+        destroy_skeletons(false);
+        return EBPF_ERR_MAP;
+    }
+
+    sync_redirects_from_kernel();
+    tc_classifier_sync();
+    flow_cache_sync();
 
     ebpf_state.initialized = true;
     return EBPF_OK;
@@ -76,15 +567,30 @@ int ebpf_accel_init(void) {
 void ebpf_accel_cleanup(void) {
     if (!ebpf_state.initialized) return;
 
-    /* Detach all XDP programs */
-    for (uint32_t i = 0; i < redirect_count; i++) {
-        ebpf_xdp_detach(redirect_rules[i].src_ifindex);
+    /* Detach all XDP and TC programs */
+    for (uint32_t i = 0; i < xdp_attach_count; i++) {
+        bpf_xdp_detach((int)xdp_attachments[i].ifindex,
+                       xdp_attachments[i].flags, NULL);
+    }
+    for (uint32_t i = 0; i < tc_attach_count; i++) {
+        detach_tc_hook(tc_attachments[i].ifindex, tc_attachments[i].ingress);
     }
+    xdp_attach_count = 0;
+    tc_attach_count = 0;
+
+    ebpf_stats_cleanup();
+    close(ebpf_state.redirect_fd);
+    destroy_skeletons(true);
+    tc_classifier_reset();
+    flow_cache_reset();
+    close_grace_maps();
 
     /* Clear state */
     memset(&ebpf_state, 0, sizeof(ebpf_state));
-    redirect_count = 0;
-    fastpath_count = 0;
+    ebpf_state.redirect_fd = -1;
+    ebpf_state.grace_fd = -1;
+    ebpf_state.grace_inner_fd = -1;
+    clear_rule_tables();
 }
 
 bool ebpf_accel_supported(void) {
@@ -99,35 +605,96 @@ bool ebpf_accel_is_initialized(void) {
  * XDP Redirect
  * ============================================================================ */
 
+/* Drop a devmap slot once no redirect rule targets it any more */
+static void devmap_release(uint32_t dst_ifindex) {
+    if (ebpf_table_find(&devmap_refs, &dst_ifindex))
+        return;
+    bpf_map_delete_elem(bpf_map__fd(ebpf_state.xdp_skel->maps.devmap),
+                        &dst_ifindex);
+}
+
+int ebpf_devmap_get(uint32_t dst_ifindex) {
+    if (ebpf_table_reserve(&devmap_refs, devmap_refs.count + 1) < 0) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    int err = bpf_map_update_elem(bpf_map__fd(ebpf_state.xdp_skel->maps.devmap),
+                                  &dst_ifindex, &dst_ifindex, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to update devmap for ifindex %u: %s",
+                       dst_ifindex, strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    devmap_ref(dst_ifindex);
+    return EBPF_OK;
+}
+
+void ebpf_devmap_put(uint32_t dst_ifindex) {
+    devmap_unref(dst_ifindex);
+    devmap_release(dst_ifindex);
+}
+
+/*
+ * Program a rule into the live table. The devmap slot is written first so
+ * the datapath never sees a redirect to a missing target; target and MAC
+ * rewrite share an entry and change together.
+ */
+static int write_redirect_maps(const xdp_redirect_rule_t *rule) {
+    struct xdp_redirect_bpf *skel = ebpf_state.xdp_skel;
+    uint32_t src = rule->src_ifindex;
+    uint32_t dst = rule->dst_ifindex;
+    int err;
+
+    err = bpf_map_update_elem(bpf_map__fd(skel->maps.devmap), &dst, &dst, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to update devmap for ifindex %u: %s", dst, strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    struct redirect_entry entry;
+    rule_to_entry(rule, &entry);
+    err = bpf_map_update_elem(ebpf_state.redirect_fd, &src, &entry, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to update redirect table: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    return EBPF_OK;
+}
+
 int ebpf_xdp_add_redirect(const xdp_redirect_rule_t *rule) {
     if (!ebpf_state.initialized) {
-        set_error("eBPF not initialized");
+        ebpf_set_error("eBPF not initialized");
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!rule) {
-        set_error("Invalid rule pointer");
+    if (!rule || rule->src_ifindex == 0 || rule->dst_ifindex == 0) {
+        ebpf_set_error("Invalid rule pointer");
         return EBPF_ERR_INVALID;
     }
 
-    if (redirect_count >= MAX_REDIRECT_RULES) {
-        set_error("Maximum redirect rules reached");
+    int ret = reserve_redirects(1);
+    if (ret != EBPF_OK)
+        return ret;
+
+    const xdp_redirect_rule_t *cur = ebpf_table_find(&redirect_rules, &rule->src_ifindex);
+    uint32_t old_dst = cur ? cur->dst_ifindex : 0;
+    if (!cur && redirect_rules.count >= REDIRECT_MAP_SIZE) {
+        ebpf_set_error("Maximum redirect rules reached");
         return EBPF_ERR_MEMORY;
     }
 
-    /* Check if rule already exists */
-    for (uint32_t i = 0; i < redirect_count; i++) {
-        if (redirect_rules[i].src_ifindex == rule->src_ifindex) {
-            /* Update existing rule */
-            redirect_rules[i] = *rule;
-            return EBPF_OK;
-        }
+    ret = write_redirect_maps(rule);
+    if (ret != EBPF_OK) {
+        devmap_release(rule->dst_ifindex);
+        return ret;
     }
 
-    /* Add new rule */
-    redirect_rules[redirect_count++] = *rule;
-
-    /* In real implementation, update BPF map here */
+    store_rule(rule);
+    if (old_dst && old_dst != rule->dst_ifindex)
+        devmap_release(old_dst);
 
     return EBPF_OK;
 }
@@ -137,287 +704,945 @@ int ebpf_xdp_del_redirect(uint32_t src_ifindex) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    for (uint32_t i = 0; i < redirect_count; i++) {
-        if (redirect_rules[i].src_ifindex == src_ifindex) {
-            /* Remove by shifting */
-            memmove(&redirect_rules[i], &redirect_rules[i + 1],
-                    (redirect_count - i - 1) * sizeof(xdp_redirect_rule_t));
-            redirect_count--;
-            return EBPF_OK;
+    xdp_redirect_rule_t *rule = ebpf_table_find(&redirect_rules, &src_ifindex);
+    if (!rule) {
+        ebpf_set_error("Rule not found");
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t dst = rule->dst_ifindex;
+
+    /* Unhook the redirect first, then its devmap slot */
+    bpf_map_delete_elem(ebpf_state.redirect_fd, &src_ifindex);
+    erase_rule(rule);
+    devmap_release(dst);
+    return EBPF_OK;
+}
+
+/* ----------------------------------------------------------------------------
+ * Batch updates
+ * ---------------------------------------------------------------------------- */
+
+/* Index into a rule array, ordered by source ifindex */
+typedef struct {
+    uint32_t src_ifindex;
+    uint32_t pos;
+} rule_index_t;
+
+static int rule_index_cmp(const void *a, const void *b) {
+    const rule_index_t *ia = a, *ib = b;
+    if (ia->src_ifindex != ib->src_ifindex)
+        return ia->src_ifindex < ib->src_ifindex ? -1 : 1;
+    /* Later positions first, so the last duplicate wins */
+    return ia->pos < ib->pos ? 1 : ia->pos > ib->pos ? -1 : 0;
+}
+
+/* Add every distinct target of a rule set to the devmap in one batch */
+static int devmap_add_targets(const xdp_redirect_rule_t *rules, uint32_t count) {
+    uint32_t *dsts = malloc((count ? count : 1) * sizeof(*dsts));
+    if (!dsts)
+        return -ENOMEM;
+    for (uint32_t i = 0; i < count; i++)
+        dsts[i] = rules[i].dst_ifindex;
+
+    int err = ebpf_map_update_many(bpf_map__fd(ebpf_state.xdp_skel->maps.devmap),
+                                   dsts, dsts, count, sizeof(*dsts), sizeof(*dsts));
+    free(dsts);
+    return err;
+}
+
+/*
+ * Validate a rule set and collapse duplicate sources, last one winning.
+ * Returns the number of distinct rules written to out.
+ */
+static int dedup_rules(const xdp_redirect_rule_t *rules, uint32_t count,
+                       xdp_redirect_rule_t *out) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (rules[i].src_ifindex == 0 || rules[i].dst_ifindex == 0) {
+            ebpf_set_error("Invalid redirect rule at index %u", i);
+            return EBPF_ERR_INVALID;
         }
     }
 
-    set_error("Rule not found");
-    return EBPF_ERR_INVALID;
+    rule_index_t *index = malloc((count ? count : 1) * sizeof(*index));
+    if (!index) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        index[i].src_ifindex = rules[i].src_ifindex;
+        index[i].pos = i;
+    }
+    qsort(index, count, sizeof(*index), rule_index_cmp);
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (i > 0 && index[i].src_ifindex == index[i - 1].src_ifindex)
+            continue;
+        out[n++] = rules[index[i].pos];
+    }
+    free(index);
+    return (int)n;
 }
 
-int ebpf_xdp_get_redirect(uint32_t src_ifindex, xdp_redirect_rule_t *rule) {
+int ebpf_xdp_add_redirects(const xdp_redirect_rule_t *rules, uint32_t count) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!rule) {
+    if (!rules || count == 0) {
         return EBPF_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < redirect_count; i++) {
-        if (redirect_rules[i].src_ifindex == src_ifindex) {
-            *rule = redirect_rules[i];
-            return EBPF_OK;
+    xdp_redirect_rule_t *batch = malloc(count * sizeof(*batch));
+    uint32_t *keys = malloc(count * sizeof(*keys));
+    struct redirect_entry *entries = malloc(count * sizeof(*entries));
+    uint32_t *old_dsts = malloc(count * sizeof(*old_dsts));
+    int ret;
+
+    if (!batch || !keys || !entries || !old_dsts) {
+        ebpf_set_error("Out of memory");
+        ret = EBPF_ERR_MEMORY;
+        goto out;
+    }
+
+    ret = dedup_rules(rules, count, batch);
+    if (ret < 0)
+        goto out;
+    uint32_t n = (uint32_t)ret;
+
+    uint32_t added = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!ebpf_table_find(&redirect_rules, &batch[i].src_ifindex))
+            added++;
+    }
+    if (redirect_rules.count + added > REDIRECT_MAP_SIZE) {
+        ebpf_set_error("Maximum redirect rules reached");
+        ret = EBPF_ERR_MEMORY;
+        goto out;
+    }
+    if ((ret = reserve_redirects(added)) != EBPF_OK)
+        goto out;
+
+    int err = devmap_add_targets(batch, n);
+    if (!err) {
+        for (uint32_t i = 0; i < n; i++) {
+            keys[i] = batch[i].src_ifindex;
+            rule_to_entry(&batch[i], &entries[i]);
         }
+        err = ebpf_map_update_many(ebpf_state.redirect_fd, keys, entries, n,
+                                   sizeof(*keys), sizeof(*entries));
     }
 
-    set_error("Rule not found");
-    return EBPF_ERR_INVALID;
+    /* Mirror whatever reached the kernel, then report the failure */
+    uint32_t replaced = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        struct redirect_entry live;
+        if (err && (bpf_map_lookup_elem(ebpf_state.redirect_fd, &batch[i].src_ifindex, &live) ||
+                    live.dst_ifindex != batch[i].dst_ifindex))
+            continue;
+
+        const xdp_redirect_rule_t *cur = ebpf_table_find(&redirect_rules,
+                                                         &batch[i].src_ifindex);
+        if (cur && cur->dst_ifindex != batch[i].dst_ifindex)
+            old_dsts[replaced++] = cur->dst_ifindex;
+        store_rule(&batch[i]);
+    }
+    for (uint32_t i = 0; i < replaced; i++)
+        devmap_release(old_dsts[i]);
+
+    if (err) {
+        for (uint32_t i = 0; i < n; i++)
+            devmap_release(batch[i].dst_ifindex);
+        ebpf_set_error("Failed to update redirect table: %s", strerror(-err));
+        ret = EBPF_ERR_MAP;
+        goto out;
+    }
+    ret = EBPF_OK;
+
+out:
+    free(batch);
+    free(keys);
+    free(entries);
+    free(old_dsts);
+    return ret;
 }
 
-int ebpf_xdp_list_redirects(xdp_redirect_rule_t *rules, uint32_t max_rules) {
+int ebpf_xdp_del_redirects(const uint32_t *src_ifindexes, uint32_t count) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!rules) {
+    if (!src_ifindexes || count == 0) {
         return EBPF_ERR_INVALID;
     }
 
-    uint32_t count = redirect_count < max_rules ? redirect_count : max_rules;
-    memcpy(rules, redirect_rules, count * sizeof(xdp_redirect_rule_t));
+    int ret = ebpf_map_delete_many(ebpf_state.redirect_fd, src_ifindexes, count,
+                                   sizeof(uint32_t));
+    if (ret) {
+        ebpf_set_error("Failed to delete redirect rules: %s", strerror(-ret));
+        return EBPF_ERR_MAP;
+    }
 
-    return (int)count;
+    for (uint32_t i = 0; i < count; i++) {
+        xdp_redirect_rule_t *rule = ebpf_table_find(&redirect_rules, &src_ifindexes[i]);
+        if (!rule)
+            continue;
+
+        uint32_t dst = rule->dst_ifindex;
+        erase_rule(rule);
+        devmap_release(dst);
+    }
+    return EBPF_OK;
 }
 
-int ebpf_xdp_attach(uint32_t ifindex, uint32_t flags) {
+int ebpf_xdp_replace_redirects(const xdp_redirect_rule_t *rules, uint32_t count) {
+    if (!ebpf_state.initialized) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if ((!rules && count) || count > REDIRECT_MAP_SIZE) {
+        ebpf_set_error("Invalid redirect rule set");
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t old_count = redirect_rules.count;
+    xdp_redirect_rule_t *batch = malloc((count ? count : 1) * sizeof(*batch));
+    uint32_t *keys = malloc((count ? count : 1) * sizeof(*keys));
+    struct redirect_entry *entries = malloc((count ? count : 1) * sizeof(*entries));
+    uint32_t *old_dsts = malloc((old_count ? old_count : 1) * sizeof(*old_dsts));
+    int table_fd = -1;
+    int ret;
+
+    if (!batch || !keys || !entries || !old_dsts) {
+        ebpf_set_error("Out of memory");
+        ret = EBPF_ERR_MEMORY;
+        goto out;
+    }
+
+    ret = dedup_rules(rules, count, batch);
+    if (ret < 0)
+        goto out;
+    uint32_t n = (uint32_t)ret;
+
+    if (ebpf_table_reserve(&redirect_rules, n) < 0 ||
+        ebpf_table_reserve(&devmap_refs, devmap_refs.count + n) < 0) {
+        ebpf_set_error("Out of memory");
+        ret = EBPF_ERR_MEMORY;
+        goto out;
+    }
+
+    /* Build the complete new table off to the side */
+    table_fd = create_redirect_table();
+    if (table_fd < 0) {
+        ebpf_set_error("Failed to create redirect table: %s", strerror(-table_fd));
+        ret = EBPF_ERR_MAP;
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        keys[i] = batch[i].src_ifindex;
+        rule_to_entry(&batch[i], &entries[i]);
+    }
+
+    int err = devmap_add_targets(batch, n);
+    if (!err)
+        err = ebpf_map_update_many(table_fd, keys, entries, n,
+                                   sizeof(*keys), sizeof(*entries));
+    if (!err)
+        err = publish_redirect_table(table_fd);
+    if (err) {
+        for (uint32_t i = 0; i < n; i++)
+            devmap_release(batch[i].dst_ifindex);
+        ebpf_set_error("Failed to replace redirect rules: %s", strerror(-err));
+        ret = EBPF_ERR_MAP;
+        goto out;
+    }
+
+    /* Live now; the old table is freed once the datapath lets go of it */
+    close(ebpf_state.redirect_fd);
+    ebpf_state.redirect_fd = table_fd;
+    table_fd = -1;
+
+    uint32_t i = 0;
+    for (xdp_redirect_rule_t *r = ebpf_table_next(&redirect_rules, NULL); r;
+         r = ebpf_table_next(&redirect_rules, r)) {
+        old_dsts[i++] = r->dst_ifindex;
+        erase_rule(r);
+    }
+    for (uint32_t k = 0; k < n; k++)
+        store_rule(&batch[k]);
+    for (uint32_t k = 0; k < i; k++)
+        devmap_release(old_dsts[k]);
+    ret = EBPF_OK;
+
+out:
+    if (table_fd >= 0)
+        close(table_fd);
+    free(batch);
+    free(keys);
+    free(entries);
+    free(old_dsts);
+    return ret;
+}
+
+int ebpf_xdp_get_redirect(uint32_t src_ifindex, xdp_redirect_rule_t *rule) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    /* In real implementation:
-     * 1. Load XDP program from .o file
-     * 2. Attach to interface using bpf_set_link_xdp_fd()
-     */
+    if (!rule) {
+        return EBPF_ERR_INVALID;
+    }
 
-    (void)ifindex;
-    (void)flags;
+    const xdp_redirect_rule_t *found = ebpf_table_find(&redirect_rules, &src_ifindex);
+    if (!found) {
+        ebpf_set_error("Rule not found");
+        return EBPF_ERR_INVALID;
+    }
 
+    *rule = *found;
     return EBPF_OK;
 }
 
-int ebpf_xdp_detach(uint32_t ifindex) {
+int ebpf_xdp_list_redirects(xdp_redirect_rule_t *rules, uint32_t max_rules) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    /* In real implementation:
-     * bpf_set_link_xdp_fd(ifindex, -1, flags)
-     */
+    if (!rules) {
+        return EBPF_ERR_INVALID;
+    }
 
-    (void)ifindex;
+    uint32_t count = 0;
+    for (const xdp_redirect_rule_t *r = ebpf_table_next(&redirect_rules, NULL);
+         r && count < max_rules; r = ebpf_table_next(&redirect_rules, r))
+        rules[count++] = *r;
 
+    return (int)count;
+}
+
+static xdp_attachment_t *find_xdp_attachment(uint32_t ifindex) {
+    for (uint32_t i = 0; i < xdp_attach_count; i++) {
+        if (xdp_attachments[i].ifindex == ifindex)
+            return &xdp_attachments[i];
+    }
+    return NULL;
+}
+
+static int probe_xdp_caps(uint32_t ifindex, uint32_t *caps,
+                          xdp_mode_t *bound) {
+    LIBBPF_OPTS(bpf_xdp_query_opts, query);
+    int err = bpf_xdp_query((int)ifindex, 0, &query);
+    if (err)
+        return err;
+
+    uint64_t features = query.feature_flags;
+    uint32_t c = 0;
+    if (features == 0) {
+        /* Pre-6.3 kernels do not report features; native will be tried */
+        c = EBPF_XDP_CAP_UNKNOWN;
+    } else {
+        if (features & NETDEV_XDP_ACT_BASIC)        c |= EBPF_XDP_CAP_NATIVE;
+        if (features & NETDEV_XDP_ACT_REDIRECT)     c |= EBPF_XDP_CAP_REDIRECT;
+        if (features & NETDEV_XDP_ACT_NDO_XMIT)     c |= EBPF_XDP_CAP_XMIT;
+        if (features & NETDEV_XDP_ACT_XSK_ZEROCOPY) c |= EBPF_XDP_CAP_ZEROCOPY;
+        if (features & NETDEV_XDP_ACT_HW_OFFLOAD)   c |= EBPF_XDP_CAP_OFFLOAD;
+    }
+    if (caps)
+        *caps = c;
+
+    if (bound) {
+        if (query.hw_prog_id)
+            *bound = XDP_MODE_OFFLOAD;
+        else if (query.drv_prog_id)
+            *bound = XDP_MODE_NATIVE;
+        else if (query.skb_prog_id)
+            *bound = XDP_MODE_SKB;
+        else
+            *bound = XDP_MODE_NONE;
+    }
+    return 0;
+}
+
+/*
+ * Bind a program, trying driver-native mode before generic mode unless the
+ * caller pinned a mode. Permission and missing-device errors are final;
+ * anything else from the native attempt means the driver cannot run it.
+ */
+static int bind_xdp_prog(uint32_t ifindex, int prog_fd, uint32_t flags,
+                         uint32_t *bound_flags, xdp_mode_t *mode) {
+    uint32_t extra = flags & ~XDP_FLAGS_MODES;
+    int err;
+
+    if (flags & XDP_FLAGS_MODES) {
+        err = bpf_xdp_attach((int)ifindex, prog_fd, flags, NULL);
+        if (err)
+            return err;
+        *bound_flags = flags;
+        *mode = (flags & XDP_FLAGS_DRV_MODE) ? XDP_MODE_NATIVE : XDP_MODE_SKB;
+        return 0;
+    }
+
+    uint32_t caps = EBPF_XDP_CAP_UNKNOWN;
+    probe_xdp_caps(ifindex, &caps, NULL);
+
+    if (caps & (EBPF_XDP_CAP_NATIVE | EBPF_XDP_CAP_UNKNOWN)) {
+        err = bpf_xdp_attach((int)ifindex, prog_fd, extra | XDP_FLAGS_DRV_MODE, NULL);
+        if (err == 0) {
+            *bound_flags = extra | XDP_FLAGS_DRV_MODE;
+            *mode = XDP_MODE_NATIVE;
+            return 0;
+        }
+        if (err == -EPERM || err == -ENODEV)
+            return err;
+    }
+
+    err = bpf_xdp_attach((int)ifindex, prog_fd, extra | XDP_FLAGS_SKB_MODE, NULL);
+    if (err)
+        return err;
+    *bound_flags = extra | XDP_FLAGS_SKB_MODE;
+    *mode = XDP_MODE_SKB;
+    return 0;
+}
+
+/* Tell the guard on an interface which program to hand frames to */
+static int set_guard_next(uint32_t ifindex, uint32_t next) {
+    int fd = bpf_map__fd(ebpf_state.xdp_skel->maps.guard_ifaces);
+    struct guard_if gif;
+
+    if (bpf_map_lookup_elem(fd, &ifindex, &gif))
+        return -errno;
+    gif.next = next;
+    return bpf_map_update_elem(fd, &ifindex, &gif, BPF_EXIST) ? -errno : 0;
+}
+
+/*
+ * Bind the program behind guard_chain slot next. On an interface with
+ * the guard enabled the guard stays bound and chains to it instead.
+ */
+static int attach_xdp_prog(uint32_t ifindex, uint32_t next,
+                           uint32_t flags, bool fastpath) {
+    if (flags & XDP_FLAGS_HW_MODE) {
+        ebpf_set_error("XDP redirect programs cannot be offloaded to hardware");
+        return EBPF_ERR_INVALID;
+    }
+
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    if (!att && xdp_attach_count >= MAX_XDP_ATTACHMENTS) {
+        ebpf_set_error("Maximum XDP attachments reached");
+        return EBPF_ERR_MEMORY;
+    }
+
+    /* Replacing a program in another mode requires detaching it first */
+    if (att && (flags & XDP_FLAGS_MODES) &&
+        (flags & XDP_FLAGS_MODES) != (att->flags & XDP_FLAGS_MODES))
+        bpf_xdp_detach((int)ifindex, att->flags, NULL);
+
+    bool guard = att && att->guard;
+    if (guard) {
+        int err = set_guard_next(ifindex, next);
+        if (err) {
+            ebpf_set_error("Failed to update XDP guard on ifindex %u: %s",
+                           ifindex, strerror(-err));
+            return EBPF_ERR_MAP;
+        }
+    }
+
+    const struct bpf_program *prog = guard ? ebpf_state.xdp_skel->progs.xdp_ddos_guard
+                                           : chain_prog(next);
+    uint32_t bound_flags = 0;
+    xdp_mode_t mode = XDP_MODE_NONE;
+    int err = bind_xdp_prog(ifindex, bpf_program__fd(prog), flags,
+                            &bound_flags, &mode);
+    if (err) {
+        if (guard)
+            set_guard_next(ifindex, att->next);
+        ebpf_set_error("Failed to attach XDP program to ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_ATTACH;
+    }
+
+    if (!att) {
+        att = &xdp_attachments[xdp_attach_count++];
+        att->ifindex = ifindex;
+        att->guard = false;
+        ebpf_stats_acquire(ifindex);
+    }
+    att->flags = bound_flags;
+    att->mode = mode;
+    att->next = next;
+    att->fastpath = fastpath;
     return EBPF_OK;
 }
 
-/* ============================================================================
- * TC Filtering
- * ============================================================================ */
+int ebpf_xdp_attach(uint32_t ifindex, uint32_t flags) {
+    if (!ebpf_state.initialized) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (ifindex == 0) {
+        return EBPF_ERR_INVALID;
+    }
 
-int ebpf_tc_add_filter(const tc_filter_rule_t *rule) {
+    return attach_xdp_prog(ifindex, GUARD_NEXT_REDIRECT, flags, false);
+}
+
+int ebpf_xdp_attach_flow_offload(uint32_t ifindex, uint32_t flags) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!rule) {
+    if (ifindex == 0) {
+        return EBPF_ERR_INVALID;
+    }
+
+    return attach_xdp_prog(ifindex, GUARD_NEXT_FLOW_OFFLOAD, flags, false);
+}
+
+int ebpf_xdp_probe(uint32_t ifindex, uint32_t *caps) {
+    if (ifindex == 0 || !caps) {
         return EBPF_ERR_INVALID;
     }
 
-    /* In real implementation, add TC filter via netlink */
-    static uint32_t rule_id = 1;
-    return rule_id++;
+    int err = probe_xdp_caps(ifindex, caps, NULL);
+    if (err) {
+        ebpf_set_error("Failed to query XDP features of ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_INVALID;
+    }
+    return EBPF_OK;
+}
+
+bool ebpf_xdp_redirect_attached(uint32_t ifindex) {
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    return att && !att->fastpath;
+}
+
+xdp_mode_t ebpf_xdp_get_mode(uint32_t ifindex) {
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    return att ? att->mode : XDP_MODE_NONE;
 }
 
-int ebpf_tc_del_filter(uint32_t ifindex, uint32_t rule_id) {
+int ebpf_xdp_detach(uint32_t ifindex) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    (void)ifindex;
-    (void)rule_id;
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    if (!att) {
+        ebpf_set_error("No XDP program attached to ifindex %u", ifindex);
+        return EBPF_ERR_INVALID;
+    }
 
+    int err = bpf_xdp_detach((int)ifindex, att->flags, NULL);
+    if (err && err != -ENODEV) {
+        ebpf_set_error("Failed to detach XDP program from ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return EBPF_ERR_ATTACH;
+    }
+
+    if (att->guard)
+        bpf_map_delete_elem(bpf_map__fd(ebpf_state.xdp_skel->maps.guard_ifaces),
+                            &ifindex);
+    *att = xdp_attachments[--xdp_attach_count];
+    ebpf_stats_release(ifindex);
     return EBPF_OK;
 }
 
-int ebpf_tc_attach(uint32_t ifindex, bool ingress) {
+int ebpf_xdp_guard_enable(uint32_t ifindex, const ebpf_guard_config_t *config) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    (void)ifindex;
-    (void)ingress;
+    if (ifindex == 0 || !config ||
+        (config->max_frame_len && config->max_frame_len < config->min_frame_len)) {
+        return EBPF_ERR_INVALID;
+    }
+
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    if (!att) {
+        ebpf_set_error("No XDP program attached to ifindex %u", ifindex);
+        return EBPF_ERR_INVALID;
+    }
 
+    /* The checks are in place before the guard sees a frame */
+    struct guard_if gif = {
+        .min_len = config->min_frame_len,
+        .max_len = config->max_frame_len,
+        .next = att->next,
+        .flags = config->drop_malformed ? GUARD_F_MALFORMED : 0,
+    };
+    int fd = bpf_map__fd(ebpf_state.xdp_skel->maps.guard_ifaces);
+    int err = bpf_map_update_elem(fd, &ifindex, &gif, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to configure XDP guard on ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+    if (att->guard)
+        return EBPF_OK;
+
+    /* Same mode as the program it goes in front of */
+    uint32_t bound_flags = 0;
+    xdp_mode_t mode = XDP_MODE_NONE;
+    err = bind_xdp_prog(ifindex, bpf_program__fd(ebpf_state.xdp_skel->progs.xdp_ddos_guard),
+                        att->flags, &bound_flags, &mode);
+    if (err) {
+        bpf_map_delete_elem(fd, &ifindex);
+        ebpf_set_error("Failed to attach XDP guard to ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_ATTACH;
+    }
+
+    att->guard = true;
     return EBPF_OK;
 }
 
-int ebpf_tc_detach(uint32_t ifindex, bool ingress) {
+int ebpf_xdp_guard_disable(uint32_t ifindex) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    (void)ifindex;
-    (void)ingress;
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    if (!att || !att->guard) {
+        ebpf_set_error("No XDP guard on ifindex %u", ifindex);
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t bound_flags = 0;
+    xdp_mode_t mode = XDP_MODE_NONE;
+    int err = bind_xdp_prog(ifindex, bpf_program__fd(chain_prog(att->next)),
+                            att->flags, &bound_flags, &mode);
+    if (err) {
+        ebpf_set_error("Failed to detach XDP guard from ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_ATTACH;
+    }
 
+    bpf_map_delete_elem(bpf_map__fd(ebpf_state.xdp_skel->maps.guard_ifaces), &ifindex);
+    att->guard = false;
     return EBPF_OK;
 }
 
 /* ============================================================================
- * VM Fast Path
+ * TC Filtering
  * ============================================================================ */
 
-int ebpf_enable_vm_fastpath(const char *vm1_tap, const char *vm2_tap) {
+/* Smallest quantum a CPU borrows, about one full-size frame */
+#define RATE_MIN_QUANTUM 1514
+
+int ebpf_tc_set_rate_limit(uint32_t ifindex, tc_direction_t direction,
+                           uint64_t rate, uint64_t burst) {
     if (!ebpf_state.initialized) {
-        set_error("eBPF not initialized");
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!vm1_tap || !vm2_tap) {
-        set_error("Invalid TAP interface names");
+    if (ifindex == 0 || ifindex & RATE_KEY_EGRESS ||
+        (direction != TC_DIR_INGRESS && direction != TC_DIR_EGRESS)) {
         return EBPF_ERR_INVALID;
     }
 
-    if (fastpath_count >= MAX_FASTPATH_ENTRIES) {
-        set_error("Maximum fast path entries reached");
-        return EBPF_ERR_MEMORY;
-    }
+    struct tc_filter_bpf *skel = ebpf_state.tc_skel;
+    int pool_fd = bpf_map__fd(skel->maps.rate_limits);
+    int local_fd = bpf_map__fd(skel->maps.rate_local);
+    uint32_t key = direction == TC_DIR_EGRESS ? ifindex | RATE_KEY_EGRESS : ifindex;
 
-    /* Get interface indices */
-    uint32_t vm1_idx = if_nametoindex(vm1_tap);
-    uint32_t vm2_idx = if_nametoindex(vm2_tap);
+    if (rate == 0) {
+        /* Removing the caches first makes the datapath stop enforcing */
+        bpf_map_delete_elem(local_fd, &key);
+        bpf_map_delete_elem(pool_fd, &key);
+        return EBPF_OK;
+    }
 
-    if (vm1_idx == 0 || vm2_idx == 0) {
-        set_error("Failed to get interface index");
+    if (burst == 0 || burst > INT64_MAX) {
+        ebpf_set_error("Invalid burst size");
         return EBPF_ERR_INVALID;
     }
 
-    /* Check if already exists */
-    for (uint32_t i = 0; i < fastpath_count; i++) {
-        if ((strcmp(fastpath_entries[i].vm1_tap, vm1_tap) == 0 &&
-             strcmp(fastpath_entries[i].vm2_tap, vm2_tap) == 0) ||
-            (strcmp(fastpath_entries[i].vm1_tap, vm2_tap) == 0 &&
-             strcmp(fastpath_entries[i].vm2_tap, vm1_tap) == 0)) {
-            return EBPF_OK; /* Already exists */
-        }
+    int ncpus = libbpf_num_possible_cpus();
+    if (ncpus <= 0) {
+        ebpf_set_error("Failed to get possible CPU count");
+        return EBPF_ERR_INIT;
     }
 
-    /* Add entry */
-    vm_fastpath_entry_t *entry = &fastpath_entries[fastpath_count++];
-    strncpy(entry->vm1_tap, vm1_tap, sizeof(entry->vm1_tap) - 1);
-    strncpy(entry->vm2_tap, vm2_tap, sizeof(entry->vm2_tap) - 1);
-    entry->vm1_ifindex = vm1_idx;
-    entry->vm2_ifindex = vm2_idx;
-
-    /* Setup bidirectional XDP redirect */
-    xdp_redirect_rule_t rule1 = {
-        .src_ifindex = vm1_idx,
-        .dst_ifindex = vm2_idx,
-        .rewrite_mac = false
+    /* Small enough that stranded per-CPU tokens stay a fraction of burst */
+    uint64_t quantum = burst / (4 * (uint64_t)ncpus);
+    if (quantum < RATE_MIN_QUANTUM)
+        quantum = RATE_MIN_QUANTUM;
+    if (quantum > burst)
+        quantum = burst;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    struct rate_limit pool = {
+        .rate = rate,
+        .burst = burst,
+        .quantum = quantum,
+        .tokens = (int64_t)burst,
+        .last_refill = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec,
     };
-    ebpf_xdp_add_redirect(&rule1);
 
-    xdp_redirect_rule_t rule2 = {
-        .src_ifindex = vm2_idx,
-        .dst_ifindex = vm1_idx,
-        .rewrite_mac = false
-    };
-    ebpf_xdp_add_redirect(&rule2);
+    int err = bpf_map_update_elem(pool_fd, &key, &pool, BPF_ANY);
+    if (err) {
+        ebpf_set_error("Failed to set rate limit: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+
+    /* Flows offloaded to XDP would bypass the new limit */
+    if (direction == TC_DIR_INGRESS)
+        ebpf_if_set_rules(ifindex, ebpf_if_rules(ifindex));
+
+    struct rate_local *locals = calloc((size_t)ncpus, sizeof(*locals));
+    if (!locals) {
+        bpf_map_delete_elem(pool_fd, &key);
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    err = bpf_map_update_elem(local_fd, &key, locals, BPF_ANY);
+    free(locals);
+    if (err) {
+        bpf_map_delete_elem(pool_fd, &key);
+        ebpf_set_error("Failed to set rate limit caches: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
 
     return EBPF_OK;
 }
 
-int ebpf_disable_vm_fastpath(const char *vm1_tap, const char *vm2_tap) {
+static tc_attachment_t *find_tc_attachment(uint32_t ifindex, bool ingress) {
+    for (uint32_t i = 0; i < tc_attach_count; i++) {
+        if (tc_attachments[i].ifindex == ifindex &&
+            tc_attachments[i].ingress == ingress)
+            return &tc_attachments[i];
+    }
+    return NULL;
+}
+
+int ebpf_tc_attach(uint32_t ifindex, bool ingress) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!vm1_tap || !vm2_tap) {
+    if (ifindex == 0) {
         return EBPF_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < fastpath_count; i++) {
-        if ((strcmp(fastpath_entries[i].vm1_tap, vm1_tap) == 0 &&
-             strcmp(fastpath_entries[i].vm2_tap, vm2_tap) == 0) ||
-            (strcmp(fastpath_entries[i].vm1_tap, vm2_tap) == 0 &&
-             strcmp(fastpath_entries[i].vm2_tap, vm1_tap) == 0)) {
+    tc_attachment_t *att = find_tc_attachment(ifindex, ingress);
+    if (!att && tc_attach_count >= MAX_TC_ATTACHMENTS) {
+        ebpf_set_error("Maximum TC attachments reached");
+        return EBPF_ERR_MEMORY;
+    }
 
-            /* Remove redirect rules */
-            ebpf_xdp_del_redirect(fastpath_entries[i].vm1_ifindex);
-            ebpf_xdp_del_redirect(fastpath_entries[i].vm2_ifindex);
+    struct tc_filter_bpf *skel = ebpf_state.tc_skel;
+    const struct bpf_program *prog = ingress ? skel->progs.tc_filter_prog
+                                             : skel->progs.tc_egress_filter;
+
+    LIBBPF_OPTS(bpf_tc_hook, hook,
+                .ifindex = (int)ifindex,
+                .attach_point = ingress ? BPF_TC_INGRESS : BPF_TC_EGRESS);
+    int err = bpf_tc_hook_create(&hook);
+    if (err && err != -EEXIST) {
+        ebpf_set_error("Failed to create clsact qdisc on ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_ATTACH;
+    }
 
-            /* Remove entry */
-            memmove(&fastpath_entries[i], &fastpath_entries[i + 1],
-                    (fastpath_count - i - 1) * sizeof(vm_fastpath_entry_t));
-            fastpath_count--;
-            return EBPF_OK;
-        }
+    LIBBPF_OPTS(bpf_tc_opts, opts,
+                .handle = TC_FILTER_HANDLE,
+                .priority = TC_FILTER_PRIORITY,
+                .prog_fd = bpf_program__fd(prog),
+                .flags = BPF_TC_F_REPLACE);
+    err = bpf_tc_attach(&hook, &opts);
+    if (err) {
+        ebpf_set_error("Failed to attach TC program to ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return EBPF_ERR_ATTACH;
     }
 
-    set_error("Fast path entry not found");
-    return EBPF_ERR_INVALID;
+    if (!att) {
+        att = &tc_attachments[tc_attach_count++];
+        att->ifindex = ifindex;
+        att->ingress = ingress;
+        ebpf_stats_acquire(ifindex);
+    }
+    return EBPF_OK;
 }
 
-int ebpf_list_vm_fastpaths(vm_fastpath_entry_t *entries, uint32_t max_entries) {
+int ebpf_tc_detach(uint32_t ifindex, bool ingress) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!entries) {
+    tc_attachment_t *att = find_tc_attachment(ifindex, ingress);
+    if (!att) {
+        ebpf_set_error("No TC program attached to ifindex %u", ifindex);
         return EBPF_ERR_INVALID;
     }
 
-    uint32_t count = fastpath_count < max_entries ? fastpath_count : max_entries;
-    memcpy(entries, fastpath_entries, count * sizeof(vm_fastpath_entry_t));
+    int err = detach_tc_hook(ifindex, ingress);
+    if (err && err != -ENOENT && err != -ENODEV) {
+        ebpf_set_error("Failed to detach TC program from ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return EBPF_ERR_ATTACH;
+    }
 
-    return (int)count;
+    *att = tc_attachments[--tc_attach_count];
+    ebpf_stats_release(ifindex);
+    return EBPF_OK;
 }
 
 /* ============================================================================
- * Statistics
+ * VM Fast Path
  * ============================================================================ */
 
-int ebpf_get_stats(ebpf_stats_t *stats) {
+/* Attach the fast path program unless something is already bound */
+static int fastpath_attach(uint32_t ifindex) {
+    if (find_xdp_attachment(ifindex))
+        return EBPF_OK;
+    return attach_xdp_prog(ifindex, GUARD_NEXT_FASTPATH, 0, true);
+}
+
+static void fastpath_detach(uint32_t ifindex) {
+    xdp_attachment_t *att = find_xdp_attachment(ifindex);
+    if (att && att->fastpath)
+        ebpf_xdp_detach(ifindex);
+}
+
+/* Put back the redirect a TAP had before, or remove the one installed */
+static void restore_redirect(uint32_t src_ifindex, const xdp_redirect_rule_t *saved,
+                             bool had_saved) {
+    if (had_saved)
+        ebpf_xdp_add_redirect(saved);
+    else
+        ebpf_xdp_del_redirect(src_ifindex);
+}
+
+int ebpf_enable_vm_fastpath(const char *vm1_tap, const char *vm2_tap) {
     if (!ebpf_state.initialized) {
+        ebpf_set_error("eBPF not initialized");
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!stats) {
+    if (!vm1_tap || !vm2_tap) {
+        ebpf_set_error("Invalid TAP interface names");
         return EBPF_ERR_INVALID;
     }
 
-    /* In real implementation, read from BPF maps */
-    *stats = ebpf_state.global_stats;
+    /* Get interface indices */
+    uint32_t vm1_idx = if_nametoindex(vm1_tap);
+    uint32_t vm2_idx = if_nametoindex(vm2_tap);
+
+    if (vm1_idx == 0 || vm2_idx == 0) {
+        ebpf_set_error("Failed to get interface index");
+        return EBPF_ERR_INVALID;
+    }
+
+    tap_pair_t pair = { vm1_tap, vm2_tap };
+    if (ebpf_table_find(&fastpaths, &pair))
+        return EBPF_OK; /* Already exists */
+
+    if (ebpf_table_reserve(&fastpaths, fastpaths.count + 1) < 0) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    /* Redirects the TAPs already have are overwritten; keep them for rollback */
+    xdp_redirect_rule_t saved1, saved2;
+    bool had1 = ebpf_xdp_get_redirect(vm1_idx, &saved1) == EBPF_OK;
+    bool had2 = ebpf_xdp_get_redirect(vm2_idx, &saved2) == EBPF_OK;
+
+    /* Setup bidirectional XDP redirect */
+    xdp_redirect_rule_t rule1 = {
+        .src_ifindex = vm1_idx,
+        .dst_ifindex = vm2_idx,
+        .rewrite_mac = false
+    };
+    int ret = ebpf_xdp_add_redirect(&rule1);
+    if (ret != EBPF_OK)
+        return ret;
+
+    xdp_redirect_rule_t rule2 = {
+        .src_ifindex = vm2_idx,
+        .dst_ifindex = vm1_idx,
+        .rewrite_mac = false
+    };
+    ret = ebpf_xdp_add_redirect(&rule2);
+    if (ret != EBPF_OK)
+        goto err_rule1;
+
+    /* Bind the fast path program on both TAPs */
+    ret = fastpath_attach(vm1_idx);
+    if (ret != EBPF_OK)
+        goto err_rule2;
+    ret = fastpath_attach(vm2_idx);
+    if (ret != EBPF_OK)
+        goto err_attach1;
+
+    /* Add entry */
+    vm_fastpath_entry_t entry = {0};
+    strncpy(entry.vm1_tap, vm1_tap, sizeof(entry.vm1_tap) - 1);
+    strncpy(entry.vm2_tap, vm2_tap, sizeof(entry.vm2_tap) - 1);
+    entry.vm1_ifindex = vm1_idx;
+    entry.vm2_ifindex = vm2_idx;
+    ebpf_table_insert(&fastpaths, &pair, &entry);
+
     return EBPF_OK;
+
+err_attach1:
+    fastpath_detach(vm1_idx);
+err_rule2:
+    restore_redirect(vm2_idx, &saved2, had2);
+err_rule1:
+    restore_redirect(vm1_idx, &saved1, had1);
+    return ret;
 }
 
-int ebpf_get_if_stats(uint32_t ifindex, ebpf_stats_t *stats) {
+int ebpf_disable_vm_fastpath(const char *vm1_tap, const char *vm2_tap) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    if (!stats) {
+    if (!vm1_tap || !vm2_tap) {
         return EBPF_ERR_INVALID;
     }
 
-    /* In real implementation, read per-interface stats from BPF maps */
-    (void)ifindex;
-    memset(stats, 0, sizeof(*stats));
+    tap_pair_t pair = { vm1_tap, vm2_tap };
+    vm_fastpath_entry_t *entry = ebpf_table_find(&fastpaths, &pair);
+    if (!entry) {
+        ebpf_set_error("Fast path entry not found");
+        return EBPF_ERR_INVALID;
+    }
+
+    /* Remove redirect rules */
+    ebpf_xdp_del_redirect(entry->vm1_ifindex);
+    ebpf_xdp_del_redirect(entry->vm2_ifindex);
+
+    /* Unbind the fast path program where we bound it */
+    fastpath_detach(entry->vm1_ifindex);
+    fastpath_detach(entry->vm2_ifindex);
 
+    ebpf_table_remove(&fastpaths, entry);
     return EBPF_OK;
 }
 
-int ebpf_reset_stats(void) {
+int ebpf_list_vm_fastpaths(vm_fastpath_entry_t *entries, uint32_t max_entries) {
     if (!ebpf_state.initialized) {
         return EBPF_ERR_NOT_INIT;
     }
 
-    memset(&ebpf_state.global_stats, 0, sizeof(ebpf_state.global_stats));
-    return EBPF_OK;
+    if (!entries) {
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t count = 0;
+    for (const vm_fastpath_entry_t *e = ebpf_table_next(&fastpaths, NULL);
+         e && count < max_entries; e = ebpf_table_next(&fastpaths, e))
+        entries[count++] = *e;
+
+    return (int)count;
 }
 
 /* ============================================================================
@@ -433,13 +1658,16 @@ int ebpf_get_interface_info(const char *ifname, netif_info_t *info) {
 
     info->ifindex = if_nametoindex(ifname);
     if (info->ifindex == 0) {
-        set_error("Interface not found: %s", ifname);
+        ebpf_set_error("Interface not found: %s", ifname);
         return EBPF_ERR_INVALID;
     }
 
     strncpy(info->ifname, ifname, sizeof(info->ifname) - 1);
     info->mtu = 1500; /* Default, should read from sysfs */
 
+    /* XDP state is best effort; the query needs CAP_NET_ADMIN */
+    probe_xdp_caps(info->ifindex, &info->xdp_caps, &info->xdp_mode);
+
     return EBPF_OK;
 }
 
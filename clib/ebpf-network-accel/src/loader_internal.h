@@ -0,0 +1,122 @@
+/**
+ * Zixiao Hypervisor - eBPF Loader Internals
+ *
+ * Declarations shared between the loader translation units. Not installed.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_EBPF_LOADER_INTERNAL_H
+#define ZIXIAO_EBPF_LOADER_INTERNAL_H
+
+#include "ebpf_accel.h"
+#include <stddef.h>
+
+struct xdp_redirect_bpf;
+struct tc_filter_bpf;
+
+/* Record the message returned by ebpf_get_last_error() */
+__attribute__((format(printf, 1, 2)))
+void ebpf_set_error(const char *fmt, ...);
+
+/* Loaded skeletons, NULL before ebpf_accel_init() */
+struct xdp_redirect_bpf *ebpf_xdp_skel(void);
+struct tc_filter_bpf *ebpf_tc_skel(void);
+
+/*
+ * Update or delete many entries with the batch syscalls, falling back to
+ * one call per entry on kernels without batch support for the map type.
+ * Deletes ignore missing keys. Return 0 or a negative errno.
+ */
+int ebpf_map_update_many(int map_fd, const void *keys, const void *values,
+                         uint32_t count, size_t key_size, size_t value_size);
+int ebpf_map_delete_many(int map_fd, const void *keys, uint32_t count,
+                         size_t key_size);
+
+/*
+ * Wait until every BPF program running at the call has finished, so map
+ * entries it could have reached before they were unpublished can go.
+ * Sleeps for an RCU grace period. Returns 0 or a negative errno.
+ */
+int ebpf_wait_programs(void);
+
+/*
+ * Rule table (rule_table.c): entries in a growable slab, found through an
+ * open-addressing hash index. An entry's handle is stable until it is
+ * removed; pointers stay valid until the table grows, which callers can
+ * rule out with ebpf_table_reserve().
+ */
+typedef uint64_t (*ebpf_table_hash_fn)(const void *key);
+typedef bool (*ebpf_table_match_fn)(const void *entry, const void *key);
+
+typedef struct {
+    size_t entry_size;
+    ebpf_table_hash_fn hash;
+    ebpf_table_match_fn match;
+    uint8_t *entries;           /* capacity * entry_size */
+    uint64_t *hashes;           /* Key hash per handle */
+    uint8_t *live;              /* Handle in use */
+    uint32_t *free_handles;
+    uint32_t nr_free;
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t *slots;            /* Handle + 1, 0 = empty */
+    uint32_t slot_mask;
+} ebpf_table_t;
+
+#define EBPF_TABLE_INIT(type, hash_fn, match_fn) \
+    { .entry_size = sizeof(type), .hash = (hash_fn), .match = (match_fn) }
+
+int ebpf_table_reserve(ebpf_table_t *t, uint32_t count);
+void *ebpf_table_find(const ebpf_table_t *t, const void *key);
+void *ebpf_table_insert(ebpf_table_t *t, const void *key, const void *entry);
+void ebpf_table_remove(ebpf_table_t *t, void *entry);
+uint32_t ebpf_table_handle(const ebpf_table_t *t, const void *entry);
+void *ebpf_table_at(const ebpf_table_t *t, uint32_t handle);
+void *ebpf_table_next(const ebpf_table_t *t, const void *prev);
+void ebpf_table_clear(ebpf_table_t *t);
+
+uint64_t ebpf_hash_u32(uint32_t v);
+uint64_t ebpf_hash_str(const char *s);
+uint64_t ebpf_hash_bytes(const void *data, size_t len);
+
+/*
+ * Reference a devmap slot for a redirect target, creating it on first
+ * use; the slot goes away with the last reference.
+ */
+int ebpf_devmap_get(uint32_t dst_ifindex);
+void ebpf_devmap_put(uint32_t dst_ifindex);
+
+/* Whether the XDP redirect program is attached to an interface */
+bool ebpf_xdp_redirect_attached(uint32_t ifindex);
+
+/* Statistics (stats.c) */
+int ebpf_stats_init(uint32_t nr_cpus);
+void ebpf_stats_cleanup(void);
+void ebpf_stats_acquire(uint32_t ifindex);
+void ebpf_stats_release(uint32_t ifindex);
+
+/* Live TC rule generation word of an interface (IF_RULES_*) */
+uint32_t ebpf_if_rules(uint32_t ifindex);
+void ebpf_if_set_rules(uint32_t ifindex, uint32_t rules);
+
+/* TC classifier (tc_classifier.c) */
+void tc_classifier_sync(void);
+void tc_classifier_reset(void);
+
+/*
+ * Compile a prefix into the 128-bit form the datapath matches, IPv4
+ * mapped into ::ffff:0:0/96. A zero length on a non-zero address means
+ * the full address. Return 0 or -EINVAL.
+ */
+int ebpf_normalize_prefix4(uint32_t addr, uint8_t len, uint32_t out_addr[4],
+                           uint8_t *out_len);
+int ebpf_normalize_prefix6(const uint8_t addr[16], uint8_t len,
+                           uint32_t out_addr[4], uint8_t *out_len);
+
+/* Flow offload (flow_cache.c) */
+void flow_cache_sync(void);
+void flow_cache_reset(void);
+
+#endif /* ZIXIAO_EBPF_LOADER_INTERNAL_H */
@@ -0,0 +1,204 @@
+/**
+ * Zixiao Hypervisor - Loader Rule Tables
+ *
+ * Growable entry slab with an open-addressing (linear probing) hash index.
+ * Entries keep their handle for as long as they exist; removal uses
+ * backward-shift deletion, so the index never accumulates tombstones.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "loader_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TABLE_MIN_CAPACITY 16
+
+static void *entry_at(const ebpf_table_t *t, uint32_t handle) {
+    return t->entries + (size_t)handle * t->entry_size;
+}
+
+static void index_insert(ebpf_table_t *t, uint32_t handle) {
+    uint32_t i = (uint32_t)t->hashes[handle] & t->slot_mask;
+    while (t->slots[i])
+        i = (i + 1) & t->slot_mask;
+    t->slots[i] = handle + 1;
+}
+
+int ebpf_table_reserve(ebpf_table_t *t, uint32_t count) {
+    if (count <= t->capacity)
+        return 0;
+
+    uint32_t capacity = t->capacity ? t->capacity : TABLE_MIN_CAPACITY;
+    while (capacity < count) {
+        if (capacity > UINT32_MAX / 4)
+            return -ENOMEM;
+        capacity *= 2;
+    }
+
+    uint8_t *entries = realloc(t->entries, (size_t)capacity * t->entry_size);
+    if (!entries)
+        return -ENOMEM;
+    t->entries = entries;
+
+    uint64_t *hashes = realloc(t->hashes, capacity * sizeof(*hashes));
+    if (!hashes)
+        return -ENOMEM;
+    t->hashes = hashes;
+
+    uint8_t *live = realloc(t->live, capacity);
+    if (!live)
+        return -ENOMEM;
+    t->live = live;
+
+    uint32_t *free_handles = realloc(t->free_handles, capacity * sizeof(*free_handles));
+    if (!free_handles)
+        return -ENOMEM;
+    t->free_handles = free_handles;
+
+    /* Keep the load factor at or below one half */
+    uint32_t *slots = calloc((size_t)capacity * 2, sizeof(*slots));
+    if (!slots)
+        return -ENOMEM;
+    free(t->slots);
+    t->slots = slots;
+    t->slot_mask = capacity * 2 - 1;
+
+    /* New handles are handed out lowest first */
+    memset(t->live + t->capacity, 0, capacity - t->capacity);
+    for (uint32_t h = capacity; h-- > t->capacity;)
+        t->free_handles[t->nr_free++] = h;
+    t->capacity = capacity;
+
+    for (uint32_t h = 0; h < t->capacity; h++) {
+        if (t->live[h])
+            index_insert(t, h);
+    }
+    return 0;
+}
+
+void *ebpf_table_find(const ebpf_table_t *t, const void *key) {
+    if (t->count == 0)
+        return NULL;
+
+    uint64_t hash = t->hash(key);
+    for (uint32_t i = (uint32_t)hash & t->slot_mask;; i = (i + 1) & t->slot_mask) {
+        uint32_t slot = t->slots[i];
+        if (!slot)
+            return NULL;
+
+        uint32_t handle = slot - 1;
+        if (t->hashes[handle] == hash && t->match(entry_at(t, handle), key))
+            return entry_at(t, handle);
+    }
+}
+
+void *ebpf_table_insert(ebpf_table_t *t, const void *key, const void *entry) {
+    if (ebpf_table_reserve(t, t->count + 1) < 0)
+        return NULL;
+
+    uint32_t handle = t->free_handles[--t->nr_free];
+    memcpy(entry_at(t, handle), entry, t->entry_size);
+    t->hashes[handle] = t->hash(key);
+    t->live[handle] = 1;
+    index_insert(t, handle);
+    t->count++;
+    return entry_at(t, handle);
+}
+
+void ebpf_table_remove(ebpf_table_t *t, void *entry) {
+    uint32_t handle = ebpf_table_handle(t, entry);
+
+    uint32_t i = (uint32_t)t->hashes[handle] & t->slot_mask;
+    while (t->slots[i] != handle + 1)
+        i = (i + 1) & t->slot_mask;
+
+    /* Pull back later entries of the probe run that can fill the hole */
+    for (uint32_t j = (i + 1) & t->slot_mask; t->slots[j]; j = (j + 1) & t->slot_mask) {
+        uint32_t home = (uint32_t)t->hashes[t->slots[j] - 1] & t->slot_mask;
+        bool movable = (i <= j) ? (home <= i || home > j)
+                                : (home <= i && home > j);
+        if (movable) {
+            t->slots[i] = t->slots[j];
+            i = j;
+        }
+    }
+    t->slots[i] = 0;
+
+    t->live[handle] = 0;
+    t->free_handles[t->nr_free++] = handle;
+    t->count--;
+}
+
+uint32_t ebpf_table_handle(const ebpf_table_t *t, const void *entry) {
+    return (uint32_t)(((const uint8_t *)entry - t->entries) / t->entry_size);
+}
+
+void *ebpf_table_at(const ebpf_table_t *t, uint32_t handle) {
+    if (handle >= t->capacity || !t->live[handle])
+        return NULL;
+    return entry_at(t, handle);
+}
+
+void *ebpf_table_next(const ebpf_table_t *t, const void *prev) {
+    uint32_t h = prev ? ebpf_table_handle(t, prev) + 1 : 0;
+    for (; h < t->capacity; h++) {
+        if (t->live[h])
+            return entry_at(t, h);
+    }
+    return NULL;
+}
+
+void ebpf_table_clear(ebpf_table_t *t) {
+    free(t->entries);
+    free(t->hashes);
+    free(t->live);
+    free(t->free_handles);
+    free(t->slots);
+    t->entries = NULL;
+    t->hashes = NULL;
+    t->live = NULL;
+    t->free_handles = NULL;
+    t->slots = NULL;
+    t->slot_mask = 0;
+    t->nr_free = 0;
+    t->capacity = 0;
+    t->count = 0;
+}
+
+/* ============================================================================
+ * Hashes
+ * ============================================================================ */
+
+uint64_t ebpf_hash_u32(uint32_t v) {
+    /* splitmix64 finalizer */
+    uint64_t x = v + 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* FNV-1a */
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+uint64_t ebpf_hash_str(const char *s) {
+    uint64_t h = FNV_OFFSET;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t ebpf_hash_bytes(const void *data, size_t len) {
+    const uint8_t *p = data;
+    uint64_t h = FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
@@ -0,0 +1,360 @@
+/**
+ * Zixiao Hypervisor - eBPF Statistics Readout
+ *
+ * Interfaces attached through the library get a dense stats slot in the
+ * shared if_slots array, which also carries the live TC rule generation.
+ * The XDP and TC programs count into per-(slot, CPU) elements of mmap-able
+ * arrays, which this file maps once at init; every read after that is
+ * plain memory access with no syscalls. When the process has a metrics
+ * arena, a collector also folds every slot into an "ebpf_if" block, slot
+ * 0 (interfaces without a slot of their own) labelled ifindex=0.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "xdp_redirect.skel.h"
+#include "tc_filter.skel.h"
+#include "zx_metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+static struct {
+    struct if_slot *if_slots;           /* IF_SLOTS_SIZE entries */
+    volatile struct stats *xdp;         /* STATS_SLOTS * nr_cpus entries */
+    volatile struct tc_if_stats *tc;    /* STATS_SLOTS * nr_cpus entries */
+    size_t if_slots_len;
+    size_t xdp_len;
+    size_t tc_len;
+    uint32_t nr_cpus;
+    uint32_t slot_ifindex[STATS_SLOTS]; /* 0 = free */
+    uint32_t slot_refs[STATS_SLOTS];
+} stats_state = {0};
+
+/* Metric fields, in the order of ebpf_stats_t */
+enum {
+    M_PACKETS_RECEIVED, M_PACKETS_REDIRECTED, M_PACKETS_DROPPED, M_PACKETS_PASSED,
+    M_BYTES_RECEIVED, M_BYTES_REDIRECTED, M_FIELDS
+};
+
+static const zx_metrics_field_t metric_fields[M_FIELDS] = {
+    { .name = "packets_received", .kind = ZX_METRICS_COUNTER },
+    { .name = "packets_redirected", .kind = ZX_METRICS_COUNTER },
+    { .name = "packets_dropped", .kind = ZX_METRICS_COUNTER },
+    { .name = "packets_passed", .kind = ZX_METRICS_COUNTER },
+    { .name = "bytes_received", .kind = ZX_METRICS_COUNTER },
+    { .name = "bytes_redirected", .kind = ZX_METRICS_COUNTER },
+};
+
+/* Owned by the collector thread once it is added */
+static struct {
+    int type;                           /* Negative without an arena */
+    zx_metrics_block_t *block[STATS_SLOTS];
+    uint32_t ifindex[STATS_SLOTS];      /* Interface block[] is labelled with */
+} stats_metrics = { .type = -1 };
+
+static void fold_slot(uint32_t slot, ebpf_stats_t *out);
+static void metrics_collect(void *userdata);
+
+static void *map_mmap(const struct bpf_map *map, size_t value_size,
+                      size_t *len) {
+    *len = (size_t)bpf_map__max_entries(map) * ((value_size + 7) & ~(size_t)7);
+    void *addr = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      bpf_map__fd(map), 0);
+    return addr == MAP_FAILED ? NULL : addr;
+}
+
+static void clear_slot(uint32_t slot) {
+    size_t base = (size_t)slot * stats_state.nr_cpus;
+    memset((void *)&stats_state.xdp[base], 0,
+           stats_state.nr_cpus * sizeof(struct stats));
+    memset((void *)&stats_state.tc[base], 0,
+           stats_state.nr_cpus * sizeof(struct tc_if_stats));
+}
+
+static void free_slot(uint32_t slot) {
+    uint32_t ifindex = stats_state.slot_ifindex[slot];
+    if (ifindex < IF_SLOTS_SIZE)
+        stats_state.if_slots[ifindex].slot = 0;
+    stats_state.slot_ifindex[slot] = 0;
+    stats_state.slot_refs[slot] = 0;
+    clear_slot(slot);
+}
+
+/*
+ * Adopt slots assigned by a previous instance while their interface
+ * still exists; free the rest.
+ */
+static void sync_slots(void) {
+    char name[IF_NAMESIZE];
+
+    for (uint32_t ifindex = 1; ifindex < IF_SLOTS_SIZE; ifindex++) {
+        uint32_t slot = stats_state.if_slots[ifindex].slot;
+        if (slot == 0)
+            continue;
+
+        if (slot >= STATS_SLOTS || stats_state.slot_ifindex[slot] != 0 ||
+            !if_indextoname(ifindex, name)) {
+            stats_state.if_slots[ifindex].slot = 0;
+            if (slot < STATS_SLOTS && stats_state.slot_ifindex[slot] == 0)
+                clear_slot(slot);
+            continue;
+        }
+
+        stats_state.slot_ifindex[slot] = ifindex;
+    }
+}
+
+int ebpf_stats_init(uint32_t nr_cpus) {
+    struct xdp_redirect_bpf *xdp = ebpf_xdp_skel();
+    struct tc_filter_bpf *tc = ebpf_tc_skel();
+
+    memset(&stats_state, 0, sizeof(stats_state));
+    stats_state.nr_cpus = nr_cpus;
+
+    stats_state.if_slots = map_mmap(xdp->maps.if_slots, sizeof(struct if_slot),
+                                    &stats_state.if_slots_len);
+    stats_state.xdp = map_mmap(xdp->maps.stats_map, sizeof(struct stats),
+                               &stats_state.xdp_len);
+    stats_state.tc = map_mmap(tc->maps.tc_stats_map, sizeof(struct tc_if_stats),
+                              &stats_state.tc_len);
+
+    if (!stats_state.if_slots || !stats_state.xdp || !stats_state.tc) {
+        ebpf_set_error("Failed to map statistics: %s", strerror(errno));
+        ebpf_stats_cleanup();
+        return EBPF_ERR_MAP;
+    }
+
+    sync_slots();
+
+    stats_metrics.type = zx_metrics_type_register("ebpf_if", metric_fields, M_FIELDS);
+    if (stats_metrics.type >= 0 &&
+        zx_metrics_collector_add(metrics_collect, NULL) != ZX_METRICS_OK)
+        stats_metrics.type = -1;
+    return EBPF_OK;
+}
+
+void ebpf_stats_cleanup(void) {
+    if (stats_metrics.type >= 0) {
+        zx_metrics_collector_remove(metrics_collect, NULL);
+        for (uint32_t slot = 0; slot < STATS_SLOTS; slot++) {
+            zx_metrics_block_remove(stats_metrics.block[slot]);
+            stats_metrics.block[slot] = NULL;
+            stats_metrics.ifindex[slot] = 0;
+        }
+        stats_metrics.type = -1;
+    }
+
+    if (stats_state.if_slots)
+        munmap(stats_state.if_slots, stats_state.if_slots_len);
+    if (stats_state.xdp)
+        munmap((void *)stats_state.xdp, stats_state.xdp_len);
+    if (stats_state.tc)
+        munmap((void *)stats_state.tc, stats_state.tc_len);
+    memset(&stats_state, 0, sizeof(stats_state));
+}
+
+void ebpf_stats_acquire(uint32_t ifindex) {
+    if (!stats_state.if_slots || ifindex == 0 || ifindex >= IF_SLOTS_SIZE)
+        return;
+
+    uint32_t slot = stats_state.if_slots[ifindex].slot;
+    if (slot != 0 && slot < STATS_SLOTS &&
+        stats_state.slot_ifindex[slot] == ifindex) {
+        stats_state.slot_refs[slot]++;
+        return;
+    }
+
+    /* Slot 0 stays the catch-all for interfaces without a slot */
+    for (slot = 1; slot < STATS_SLOTS; slot++) {
+        if (stats_state.slot_ifindex[slot] == 0) {
+            clear_slot(slot);
+            stats_state.slot_ifindex[slot] = ifindex;
+            stats_state.slot_refs[slot] = 1;
+            stats_state.if_slots[ifindex].slot = slot;
+            return;
+        }
+    }
+}
+
+void ebpf_stats_release(uint32_t ifindex) {
+    if (!stats_state.if_slots || ifindex == 0 || ifindex >= IF_SLOTS_SIZE)
+        return;
+
+    uint32_t slot = stats_state.if_slots[ifindex].slot;
+    if (slot == 0 || slot >= STATS_SLOTS ||
+        stats_state.slot_ifindex[slot] != ifindex)
+        return;
+
+    if (stats_state.slot_refs[slot] > 1) {
+        stats_state.slot_refs[slot]--;
+        return;
+    }
+    free_slot(slot);
+}
+
+uint32_t ebpf_if_rules(uint32_t ifindex) {
+    if (!stats_state.if_slots || ifindex >= IF_SLOTS_SIZE)
+        return 0;
+    return __atomic_load_n(&stats_state.if_slots[ifindex].rules, __ATOMIC_ACQUIRE);
+}
+
+void ebpf_if_set_rules(uint32_t ifindex, uint32_t rules) {
+    if (!stats_state.if_slots || ifindex >= IF_SLOTS_SIZE)
+        return;
+
+    /* Every store moves the epoch, retiring flows learned under the old word */
+    uint32_t old = stats_state.if_slots[ifindex].rules;
+    uint32_t epoch = (old >> IF_RULES_EPOCH_SHIFT) + 1;
+    rules = (rules & IF_RULES_FLAGS) | (epoch << IF_RULES_EPOCH_SHIFT);
+
+    /* A single aligned store; the datapath sees the old or the new word */
+    __atomic_store_n(&stats_state.if_slots[ifindex].rules, rules, __ATOMIC_RELEASE);
+}
+
+/* Sum one slot across CPUs */
+static void fold_slot(uint32_t slot, ebpf_stats_t *out) {
+    size_t base = (size_t)slot * stats_state.nr_cpus;
+
+    for (uint32_t cpu = 0; cpu < stats_state.nr_cpus; cpu++) {
+        volatile struct stats *x = &stats_state.xdp[base + cpu];
+        volatile struct tc_if_stats *t = &stats_state.tc[base + cpu];
+
+        uint64_t packets = x->packets;
+        uint64_t redirects = x->redirects;
+        uint64_t drops = x->drops;
+
+        out->packets_received += packets;
+        out->bytes_received += x->bytes;
+        out->packets_redirected += redirects + t->packets_redirected;
+        out->bytes_redirected += x->redirect_bytes;
+        out->packets_dropped += drops + t->packets_dropped;
+        /* Counters are read while they move; never underflow */
+        if (packets > redirects + drops)
+            out->packets_passed += packets - redirects - drops;
+    }
+}
+
+/* Collector pass: relabel blocks whose slot changed hands, then refresh */
+static void metrics_collect(void *userdata) {
+    (void)userdata;
+
+    for (uint32_t slot = 0; slot < STATS_SLOTS; slot++) {
+        uint32_t ifindex = __atomic_load_n(&stats_state.slot_ifindex[slot], __ATOMIC_RELAXED);
+        bool live = slot == 0 || ifindex != 0;
+
+        if (stats_metrics.block[slot] && (!live || stats_metrics.ifindex[slot] != ifindex)) {
+            zx_metrics_block_remove(stats_metrics.block[slot]);
+            stats_metrics.block[slot] = NULL;
+        }
+        if (!live)
+            continue;
+
+        zx_metrics_block_t *m = stats_metrics.block[slot];
+        if (!m) {
+            char labels[ZX_METRICS_LABELS_LEN];
+            char name[IF_NAMESIZE];
+            if (ifindex && if_indextoname(ifindex, name))
+                snprintf(labels, sizeof(labels), "ifindex=%u,ifname=%s", ifindex, name);
+            else
+                snprintf(labels, sizeof(labels), "ifindex=%u", ifindex);
+            m = stats_metrics.block[slot] = zx_metrics_block_add(stats_metrics.type, labels);
+            stats_metrics.ifindex[slot] = ifindex;
+            if (!m)
+                continue;
+        }
+
+        ebpf_stats_t st = {0};
+        fold_slot(slot, &st);
+        zx_metrics_write_begin(m);
+        m->values[M_PACKETS_RECEIVED] = st.packets_received;
+        m->values[M_PACKETS_REDIRECTED] = st.packets_redirected;
+        m->values[M_PACKETS_DROPPED] = st.packets_dropped;
+        m->values[M_PACKETS_PASSED] = st.packets_passed;
+        m->values[M_BYTES_RECEIVED] = st.bytes_received;
+        m->values[M_BYTES_REDIRECTED] = st.bytes_redirected;
+        zx_metrics_write_end(m);
+    }
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+int ebpf_get_stats(ebpf_stats_t *stats) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!stats) {
+        return EBPF_ERR_INVALID;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    for (uint32_t slot = 0; slot < STATS_SLOTS; slot++)
+        fold_slot(slot, stats);
+
+    return EBPF_OK;
+}
+
+int ebpf_get_if_stats(uint32_t ifindex, ebpf_stats_t *stats) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!stats) {
+        return EBPF_ERR_INVALID;
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    if (ifindex == 0 || ifindex >= IF_SLOTS_SIZE)
+        return EBPF_OK;
+
+    uint32_t slot = stats_state.if_slots[ifindex].slot;
+    if (slot != 0 && slot < STATS_SLOTS)
+        fold_slot(slot, stats);
+
+    return EBPF_OK;
+}
+
+int ebpf_get_all_if_stats(ebpf_if_stats_t *stats, uint32_t max_entries) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!stats) {
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t count = 0;
+    for (uint32_t slot = 1; slot < STATS_SLOTS && count < max_entries; slot++) {
+        if (stats_state.slot_ifindex[slot] == 0)
+            continue;
+
+        ebpf_if_stats_t *out = &stats[count++];
+        memset(out, 0, sizeof(*out));
+        out->ifindex = stats_state.slot_ifindex[slot];
+        fold_slot(slot, &out->stats);
+    }
+
+    return (int)count;
+}
+
+int ebpf_reset_stats(void) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    for (uint32_t slot = 0; slot < STATS_SLOTS; slot++)
+        clear_slot(slot);
+
+    return EBPF_OK;
+}
@@ -0,0 +1,775 @@
+/**
+ * Zixiao Hypervisor - TC Classifier Compiler
+ *
+ * Keeps the per-interface TC rule lists and compiles them into the maps
+ * consumed by tc_filter_prog: rules occupy consecutive slots in priority
+ * order, and every distinct source/destination prefix gets an LPM entry
+ * whose bitmap names the slots whose prefix covers it. Per packet the
+ * program does two trie lookups and walks the intersection. Addresses are
+ * compiled to 128 bits with IPv4 mapped into ::ffff:0:0/96, so IPv4 and
+ * IPv6 rules share the tries and cost the same per packet.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "tc_filter.skel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+_Static_assert(EBPF_TC_MAX_RULES_PER_IF == MAX_RULES_PER_IF,
+               "public and BPF rule limits differ");
+
+/* Installed LPM keys, remembered so stale prefixes can be removed */
+typedef struct {
+    struct lpm_key *keys;
+    uint32_t count;
+} lpm_key_set_t;
+
+/* Kernel entries of one rule generation */
+typedef struct {
+    uint32_t slots;             /* rule_slots entries 0..slots-1 */
+    lpm_key_set_t src_keys;
+    lpm_key_set_t dst_keys;
+} rule_gen_t;
+
+/*
+ * Rules of one interface. New rule sets are written into the generation
+ * that is not live and switched to with one store to if_slot.rules. The
+ * previous generation is deleted once the programs that may have read
+ * the old word have finished.
+ */
+typedef struct {
+    uint32_t ifindex;
+    struct filter_rule *rules;  /* Sorted by priority, then rule_id */
+    uint32_t count;
+    uint32_t capacity;
+    bool live;                  /* A generation is enforced */
+    uint32_t live_gen;
+    rule_gen_t gens[2];
+} tc_if_rules_t;
+
+#define MAX_TC_RULE_IFS 256
+static tc_if_rules_t tc_ifs[MAX_TC_RULE_IFS];
+static uint32_t tc_if_count = 0;
+static uint32_t next_rule_id = 1;
+
+/* IPv4 addresses sit in the last word, below ::ffff:0:0/96 */
+#define V4_MAPPED_PREFIX    96
+
+/* Keep the first len bits of a 128-bit address */
+static void mask_addr(const uint32_t addr[4], uint8_t len, uint32_t out[4]) {
+    for (int i = 0; i < 4; i++) {
+        int bits = (int)len - i * 32;
+        if (bits >= 32)
+            out[i] = addr[i];
+        else if (bits <= 0)
+            out[i] = 0;
+        else
+            out[i] = addr[i] & htonl(~0U << (32 - bits));
+    }
+}
+
+static tc_if_rules_t *find_if_rules(uint32_t ifindex) {
+    for (uint32_t i = 0; i < tc_if_count; i++) {
+        if (tc_ifs[i].ifindex == ifindex)
+            return &tc_ifs[i];
+    }
+    return NULL;
+}
+
+static tc_if_rules_t *get_if_rules(uint32_t ifindex) {
+    tc_if_rules_t *ifr = find_if_rules(ifindex);
+    if (ifr || tc_if_count >= MAX_TC_RULE_IFS)
+        return ifr;
+
+    ifr = &tc_ifs[tc_if_count++];
+    memset(ifr, 0, sizeof(*ifr));
+    ifr->ifindex = ifindex;
+    return ifr;
+}
+
+static void free_if_rules(tc_if_rules_t *ifr) {
+    free(ifr->rules);
+    for (int g = 0; g < 2; g++) {
+        free(ifr->gens[g].src_keys.keys);
+        free(ifr->gens[g].dst_keys.keys);
+    }
+    *ifr = tc_ifs[--tc_if_count];
+}
+
+static int reserve_rules(tc_if_rules_t *ifr, uint32_t needed) {
+    if (needed <= ifr->capacity)
+        return 0;
+
+    uint32_t capacity = ifr->capacity ? ifr->capacity * 2 : 16;
+    while (capacity < needed)
+        capacity *= 2;
+
+    struct filter_rule *rules = realloc(ifr->rules, capacity * sizeof(*rules));
+    if (!rules)
+        return -ENOMEM;
+    ifr->rules = rules;
+    ifr->capacity = capacity;
+    return 0;
+}
+
+static int rule_cmp(const void *a, const void *b) {
+    const struct filter_rule *ra = a, *rb = b;
+    if (ra->priority != rb->priority)
+        return ra->priority < rb->priority ? -1 : 1;
+    if (ra->rule_id != rb->rule_id)
+        return ra->rule_id < rb->rule_id ? -1 : 1;
+    return 0;
+}
+
+static void sort_rules(tc_if_rules_t *ifr) {
+    qsort(ifr->rules, ifr->count, sizeof(ifr->rules[0]), rule_cmp);
+}
+
+static bool remove_rule(tc_if_rules_t *ifr, uint32_t rule_id) {
+    for (uint32_t pos = 0; pos < ifr->count; pos++) {
+        if (ifr->rules[pos].rule_id == rule_id) {
+            memmove(&ifr->rules[pos], &ifr->rules[pos + 1],
+                    (ifr->count - pos - 1) * sizeof(ifr->rules[0]));
+            ifr->count--;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* ============================================================================
+ * Compilation
+ * ============================================================================ */
+
+static bool key_covered(const struct lpm_key *key, const uint32_t addr[4],
+                        uint8_t len) {
+    uint32_t key_len = key->prefixlen - 32;
+    uint32_t masked[4];
+
+    if (len > key_len)
+        return false;
+    mask_addr(key->addr, len, masked);
+    return memcmp(masked, addr, sizeof(masked)) == 0;
+}
+
+static bool key_in_set(const struct lpm_key *keys, uint32_t count,
+                       const struct lpm_key *key) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (keys[i].prefixlen == key->prefixlen &&
+            memcmp(keys[i].addr, key->addr, sizeof(key->addr)) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void clear_gen(tc_if_rules_t *ifr, uint32_t g) {
+    struct tc_filter_bpf *skel = ebpf_tc_skel();
+    rule_gen_t *gen = &ifr->gens[g];
+
+    if (gen->slots > 0) {
+        struct rule_slot_key *keys = calloc(gen->slots, sizeof(*keys));
+        if (keys) {
+            for (uint32_t i = 0; i < gen->slots; i++) {
+                keys[i].ifindex = RULE_KEY_IFINDEX(ifr->ifindex, g);
+                keys[i].slot = i;
+            }
+            ebpf_map_delete_many(bpf_map__fd(skel->maps.rule_slots), keys,
+                                 gen->slots, sizeof(*keys));
+            free(keys);
+        }
+    }
+    ebpf_map_delete_many(bpf_map__fd(skel->maps.lpm_src), gen->src_keys.keys,
+                         gen->src_keys.count, sizeof(struct lpm_key));
+    ebpf_map_delete_many(bpf_map__fd(skel->maps.lpm_dst), gen->dst_keys.keys,
+                         gen->dst_keys.count, sizeof(struct lpm_key));
+
+    free(gen->src_keys.keys);
+    free(gen->dst_keys.keys);
+    memset(gen, 0, sizeof(*gen));
+}
+
+static int write_slots(int map_fd, tc_if_rules_t *ifr, uint32_t g) {
+    struct rule_slot_key *keys = calloc(ifr->count, sizeof(*keys));
+    if (!keys)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < ifr->count; i++) {
+        keys[i].ifindex = RULE_KEY_IFINDEX(ifr->ifindex, g);
+        keys[i].slot = i;
+    }
+
+    ifr->gens[g].slots = ifr->count;
+    int err = ebpf_map_update_many(map_fd, keys, ifr->rules, ifr->count,
+                                   sizeof(*keys), sizeof(ifr->rules[0]));
+    free(keys);
+    return err;
+}
+
+/*
+ * Install one LPM entry per distinct prefix of the given side. An entry's
+ * bitmap includes every rule whose prefix covers it, so the longest-prefix
+ * lookup alone yields all matching rules for that side.
+ */
+static int write_lpm(int map_fd, tc_if_rules_t *ifr, bool src, uint32_t g) {
+    lpm_key_set_t *set = src ? &ifr->gens[g].src_keys : &ifr->gens[g].dst_keys;
+    uint32_t key_ifindex = RULE_KEY_IFINDEX(ifr->ifindex, g);
+
+    struct lpm_key *keys = calloc(ifr->count + 1, sizeof(*keys));
+    if (!keys)
+        return -ENOMEM;
+    uint32_t nkeys = 0;
+
+    /* The /0 entry makes every lookup hit while rules exist */
+    keys[nkeys++] = (struct lpm_key){ .prefixlen = 32, .ifindex = key_ifindex };
+
+    for (uint32_t i = 0; i < ifr->count; i++) {
+        const struct filter_rule *r = &ifr->rules[i];
+        struct lpm_key key = {
+            .prefixlen = 32 + (src ? r->src_prefix_len : r->dst_prefix_len),
+            .ifindex = key_ifindex,
+        };
+        memcpy(key.addr, src ? r->src_addr : r->dst_addr, sizeof(key.addr));
+        if (!key_in_set(keys, nkeys, &key))
+            keys[nkeys++] = key;
+    }
+
+    /* Recorded up front so a failed write can still be cleaned up */
+    set->keys = keys;
+    set->count = nkeys;
+
+    struct rule_bitmap *bitmaps = calloc(nkeys, sizeof(*bitmaps));
+    if (!bitmaps)
+        return -ENOMEM;
+
+    for (uint32_t k = 0; k < nkeys; k++) {
+        for (uint32_t i = 0; i < ifr->count; i++) {
+            const struct filter_rule *r = &ifr->rules[i];
+            const uint32_t *addr = src ? r->src_addr : r->dst_addr;
+            uint8_t len = src ? r->src_prefix_len : r->dst_prefix_len;
+            if (key_covered(&keys[k], addr, len))
+                bitmaps[k].bits[i / 64] |= 1ULL << (i % 64);
+        }
+    }
+
+    int err = ebpf_map_update_many(map_fd, keys, bitmaps, nkeys,
+                                   sizeof(*keys), sizeof(*bitmaps));
+    free(bitmaps);
+    return err;
+}
+
+/*
+ * Delete a generation that if_slot.rules no longer names. A packet that
+ * loaded the old word may still be walking it and would fail open if
+ * its entries vanished, so wait for running programs first. Should the
+ * wait fail, the entries are deleted anyway rather than leaked.
+ */
+static void retire_gen(tc_if_rules_t *ifr, uint32_t g) {
+    const rule_gen_t *gen = &ifr->gens[g];
+
+    if (gen->slots == 0 && gen->src_keys.count == 0 && gen->dst_keys.count == 0)
+        return;
+    ebpf_wait_programs();
+    clear_gen(ifr, g);
+}
+
+/*
+ * Make the interface's current rule list live. On failure the live
+ * generation is untouched, so callers only need to restore their list.
+ */
+static int compile_if_rules(tc_if_rules_t *ifr) {
+    struct tc_filter_bpf *skel = ebpf_tc_skel();
+    uint32_t old = ifr->live_gen;
+    uint32_t next = !old;
+    int err;
+
+    /* Retired generations are already gone; whatever a previous instance
+     * left in the generation that is not live, no packet can reach */
+    clear_gen(ifr, next);
+
+    if (ifr->count == 0) {
+        ebpf_if_set_rules(ifr->ifindex, 0);
+        ifr->live = false;
+        retire_gen(ifr, old);
+        return 0;
+    }
+
+    if ((err = write_slots(bpf_map__fd(skel->maps.rule_slots), ifr, next)) ||
+        (err = write_lpm(bpf_map__fd(skel->maps.lpm_src), ifr, true, next)) ||
+        (err = write_lpm(bpf_map__fd(skel->maps.lpm_dst), ifr, false, next))) {
+        clear_gen(ifr, next);
+        return err;
+    }
+
+    ebpf_if_set_rules(ifr->ifindex, IF_RULES_ACTIVE | (next ? IF_RULES_GEN : 0));
+    ifr->live_gen = next;
+    ifr->live = true;
+    retire_gen(ifr, old);
+    return 0;
+}
+
+/* ============================================================================
+ * Rule Translation
+ * ============================================================================ */
+
+int ebpf_normalize_prefix4(uint32_t addr, uint8_t len, uint32_t out_addr[4],
+                           uint8_t *out_len) {
+    if (len > 32)
+        return -EINVAL;
+    if (len == 0 && addr != 0)
+        len = 32;
+
+    uint32_t mapped[4] = { 0, 0, htonl(0xffff), addr };
+    *out_len = V4_MAPPED_PREFIX + len;
+    mask_addr(mapped, *out_len, out_addr);
+    return 0;
+}
+
+int ebpf_normalize_prefix6(const uint8_t addr[16], uint8_t len,
+                           uint32_t out_addr[4], uint8_t *out_len) {
+    static const uint8_t zero[16];
+    uint32_t words[4];
+
+    if (len > 128)
+        return -EINVAL;
+    if (len == 0 && memcmp(addr, zero, sizeof(zero)) != 0)
+        len = 128;
+
+    memcpy(words, addr, sizeof(words));
+    mask_addr(words, len, out_addr);
+    *out_len = len;
+    return 0;
+}
+
+static int normalize_prefixes(const tc_filter_rule_t *rule, struct filter_rule *fr) {
+    switch (rule->family) {
+        case TC_FAMILY_IPV4:
+            if (ebpf_normalize_prefix4(rule->src_ip, rule->src_prefix_len,
+                                  fr->src_addr, &fr->src_prefix_len) ||
+                ebpf_normalize_prefix4(rule->dst_ip, rule->dst_prefix_len,
+                                  fr->dst_addr, &fr->dst_prefix_len))
+                return -EINVAL;
+            return 0;
+        case TC_FAMILY_IPV6:
+            if (ebpf_normalize_prefix6(rule->src_ip6, rule->src_prefix_len,
+                                  fr->src_addr, &fr->src_prefix_len) ||
+                ebpf_normalize_prefix6(rule->dst_ip6, rule->dst_prefix_len,
+                                  fr->dst_addr, &fr->dst_prefix_len))
+                return -EINVAL;
+            return 0;
+        case TC_FAMILY_ANY:
+            /* Only the 128-bit /0 covers both; fr is already zeroed to it */
+            if (rule->src_ip || rule->dst_ip ||
+                rule->src_prefix_len || rule->dst_prefix_len)
+                return -EINVAL;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+static int normalize_ports(uint16_t start, uint16_t end,
+                           uint16_t *out_min, uint16_t *out_max) {
+    if (start == 0 && end == 0) {
+        *out_min = 0;
+        *out_max = UINT16_MAX;
+    } else if (end == 0) {
+        *out_min = *out_max = start;
+    } else if (end < start) {
+        return -EINVAL;
+    } else {
+        *out_min = start;
+        *out_max = end;
+    }
+    return 0;
+}
+
+static int translate_rule(const tc_filter_rule_t *rule, struct filter_rule *fr) {
+    memset(fr, 0, sizeof(*fr));
+
+    if (normalize_prefixes(rule, fr)) {
+        ebpf_set_error("Invalid prefix for address family %d", rule->family);
+        return EBPF_ERR_INVALID;
+    }
+
+    if (rule->vlan_id > 4094) {
+        ebpf_set_error("Invalid VLAN ID %u", rule->vlan_id);
+        return EBPF_ERR_INVALID;
+    }
+    fr->vlan_id = rule->vlan_id;
+
+    if (normalize_ports(rule->src_port, rule->src_port_max,
+                        &fr->src_port_min, &fr->src_port_max) ||
+        normalize_ports(rule->dst_port, rule->dst_port_max,
+                        &fr->dst_port_min, &fr->dst_port_max)) {
+        ebpf_set_error("Invalid port range");
+        return EBPF_ERR_INVALID;
+    }
+
+    switch (rule->action) {
+        case XDP_ACTION_PASS:
+            fr->action = FILTER_ACTION_PASS;
+            break;
+        case XDP_ACTION_DROP:
+            fr->action = FILTER_ACTION_DROP;
+            break;
+        case XDP_ACTION_REDIRECT:
+            if (rule->redirect_ifindex == 0) {
+                ebpf_set_error("Redirect rule without target interface");
+                return EBPF_ERR_INVALID;
+            }
+            fr->action = FILTER_ACTION_REDIRECT;
+            fr->redirect_ifindex = rule->redirect_ifindex;
+            break;
+        default:
+            ebpf_set_error("Unsupported TC filter action %d", rule->action);
+            return EBPF_ERR_INVALID;
+    }
+
+    /* Ethertype values select all IP traffic; small values are IP protocols */
+    fr->protocol = rule->protocol <= 0xff ? (uint8_t)rule->protocol : 0;
+    fr->priority = rule->priority;
+    return EBPF_OK;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+static int check_ifindex(uint32_t ifindex) {
+    if (ifindex == 0 || ifindex >= IF_SLOTS_SIZE) {
+        ebpf_set_error("Invalid filter interface index %u", ifindex);
+        return EBPF_ERR_INVALID;
+    }
+    return EBPF_OK;
+}
+
+int ebpf_tc_add_filter(const tc_filter_rule_t *rule) {
+    uint32_t rule_id;
+
+    if (!rule) {
+        return EBPF_ERR_INVALID;
+    }
+
+    int ret = ebpf_tc_add_filters(rule, 1, &rule_id);
+    return ret == EBPF_OK ? (int)rule_id : ret;
+}
+
+int ebpf_tc_add_filters(const tc_filter_rule_t *rules, uint32_t count,
+                        uint32_t *rule_ids) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!rules || count == 0) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct filter_rule *frs = calloc(count, sizeof(*frs));
+    tc_if_rules_t **touched = calloc(count, sizeof(*touched));
+    uint32_t ntouched = 0, compiled = 0;
+    int ret = EBPF_OK;
+
+    if (!frs || !touched) {
+        ebpf_set_error("Out of memory");
+        ret = EBPF_ERR_MEMORY;
+        goto out;
+    }
+
+    /* Validate and translate everything before changing any list */
+    for (uint32_t i = 0; i < count; i++) {
+        if ((ret = check_ifindex(rules[i].ifindex)) != EBPF_OK ||
+            (ret = translate_rule(&rules[i], &frs[i])) != EBPF_OK)
+            goto out;
+        frs[i].rule_id = next_rule_id + i;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        tc_if_rules_t *ifr = get_if_rules(rules[i].ifindex);
+        if (!ifr) {
+            ebpf_set_error("Maximum filtered interfaces reached");
+            ret = EBPF_ERR_MEMORY;
+            goto undo;
+        }
+        if (ifr->count >= MAX_RULES_PER_IF) {
+            ebpf_set_error("Maximum filter rules reached on ifindex %u", ifr->ifindex);
+            ret = EBPF_ERR_MEMORY;
+            goto undo;
+        }
+        if (reserve_rules(ifr, ifr->count + 1) < 0) {
+            ebpf_set_error("Out of memory");
+            ret = EBPF_ERR_MEMORY;
+            goto undo;
+        }
+
+        ifr->rules[ifr->count++] = frs[i];
+
+        uint32_t t = 0;
+        while (t < ntouched && touched[t] != ifr)
+            t++;
+        if (t == ntouched)
+            touched[ntouched++] = ifr;
+    }
+
+    /* One compile per interface, however many of its rules changed */
+    for (; compiled < ntouched; compiled++) {
+        sort_rules(touched[compiled]);
+        int err = compile_if_rules(touched[compiled]);
+        if (err) {
+            ebpf_set_error("Failed to install filter rules on ifindex %u: %s",
+                           touched[compiled]->ifindex, strerror(-err));
+            ret = EBPF_ERR_MAP;
+            goto undo;
+        }
+    }
+
+    if (rule_ids) {
+        for (uint32_t i = 0; i < count; i++)
+            rule_ids[i] = frs[i].rule_id;
+    }
+    next_rule_id += count;
+    goto out;
+
+undo:
+    /* Drop the new rules; interfaces already recompiled get their old set back */
+    for (uint32_t t = 0; t < ntouched; t++) {
+        for (uint32_t i = 0; i < count; i++)
+            remove_rule(touched[t], frs[i].rule_id);
+        if (t < compiled)
+            compile_if_rules(touched[t]);
+    }
+    for (uint32_t i = tc_if_count; i-- > 0;) {
+        if (tc_ifs[i].count == 0 && !tc_ifs[i].live)
+            free_if_rules(&tc_ifs[i]);
+    }
+
+out:
+    free(frs);
+    free(touched);
+    return ret;
+}
+
+int ebpf_tc_del_filter(uint32_t ifindex, uint32_t rule_id) {
+    return ebpf_tc_del_filters(ifindex, &rule_id, 1);
+}
+
+int ebpf_tc_del_filters(uint32_t ifindex, const uint32_t *rule_ids, uint32_t count) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!rule_ids || count == 0) {
+        return EBPF_ERR_INVALID;
+    }
+
+    tc_if_rules_t *ifr = find_if_rules(ifindex);
+    for (uint32_t i = 0; i < count; i++) {
+        bool found = false;
+        for (uint32_t pos = 0; ifr && pos < ifr->count && !found; pos++)
+            found = ifr->rules[pos].rule_id == rule_ids[i];
+        if (!found) {
+            ebpf_set_error("Filter rule %u not found", rule_ids[i]);
+            return EBPF_ERR_INVALID;
+        }
+    }
+
+    struct filter_rule *saved = malloc(ifr->count * sizeof(*saved));
+    if (!saved) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+    uint32_t saved_count = ifr->count;
+    memcpy(saved, ifr->rules, saved_count * sizeof(*saved));
+
+    for (uint32_t i = 0; i < count; i++)
+        remove_rule(ifr, rule_ids[i]);
+
+    int err = compile_if_rules(ifr);
+    if (err) {
+        memcpy(ifr->rules, saved, saved_count * sizeof(*saved));
+        ifr->count = saved_count;
+        free(saved);
+        ebpf_set_error("Failed to update filter rules: %s", strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+    free(saved);
+
+    if (ifr->count == 0)
+        free_if_rules(ifr);
+    return EBPF_OK;
+}
+
+int ebpf_tc_replace_filters(uint32_t ifindex, const tc_filter_rule_t *rules,
+                            uint32_t count, uint32_t *rule_ids) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    int ret = check_ifindex(ifindex);
+    if (ret != EBPF_OK)
+        return ret;
+
+    if ((!rules && count) || count > MAX_RULES_PER_IF) {
+        ebpf_set_error("Invalid filter rule set");
+        return EBPF_ERR_INVALID;
+    }
+
+    struct filter_rule *frs = calloc(count ? count : 1, sizeof(*frs));
+    if (!frs) {
+        ebpf_set_error("Out of memory");
+        return EBPF_ERR_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (rules[i].ifindex != ifindex) {
+            ebpf_set_error("Rule %u is for ifindex %u, not %u",
+                           i, rules[i].ifindex, ifindex);
+            free(frs);
+            return EBPF_ERR_INVALID;
+        }
+        if ((ret = translate_rule(&rules[i], &frs[i])) != EBPF_OK) {
+            free(frs);
+            return ret;
+        }
+        frs[i].rule_id = next_rule_id + i;
+    }
+
+    tc_if_rules_t *ifr = get_if_rules(ifindex);
+    if (!ifr) {
+        ebpf_set_error("Maximum filtered interfaces reached");
+        free(frs);
+        return EBPF_ERR_MEMORY;
+    }
+
+    /* Swap in the new list; the old one is kept until the compile succeeds */
+    struct filter_rule *old_rules = ifr->rules;
+    uint32_t old_count = ifr->count, old_capacity = ifr->capacity;
+    ifr->rules = frs;
+    ifr->count = count;
+    ifr->capacity = count ? count : 1;
+    sort_rules(ifr);
+
+    int err = compile_if_rules(ifr);
+    if (err) {
+        ifr->rules = old_rules;
+        ifr->count = old_count;
+        ifr->capacity = old_capacity;
+        free(frs);
+        if (ifr->count == 0 && !ifr->live)
+            free_if_rules(ifr);
+        ebpf_set_error("Failed to replace filter rules on ifindex %u: %s",
+                       ifindex, strerror(-err));
+        return EBPF_ERR_MAP;
+    }
+    free(old_rules);
+
+    if (rule_ids) {
+        for (uint32_t i = 0; i < count; i++)
+            rule_ids[i] = next_rule_id + i;
+    }
+    next_rule_id += count;
+
+    if (ifr->count == 0)
+        free_if_rules(ifr);
+    return EBPF_OK;
+}
+
+/* ============================================================================
+ * Lifecycle
+ * ============================================================================ */
+
+static int collect_lpm_keys(int map_fd, bool src) {
+    struct lpm_key key, next;
+    struct lpm_key *prev = NULL;
+
+    while (bpf_map_get_next_key(map_fd, prev, &next) == 0) {
+        key = next;
+        prev = &key;
+
+        uint32_t g = (key.ifindex & RULE_GEN_BIT) ? 1 : 0;
+        tc_if_rules_t *ifr = get_if_rules(key.ifindex & ~RULE_GEN_BIT);
+        if (!ifr)
+            continue;
+
+        lpm_key_set_t *set = src ? &ifr->gens[g].src_keys : &ifr->gens[g].dst_keys;
+        struct lpm_key *keys = realloc(set->keys, (set->count + 1) * sizeof(*keys));
+        if (!keys)
+            return -ENOMEM;
+        keys[set->count++] = key;
+        set->keys = keys;
+    }
+    return 0;
+}
+
+/*
+ * Rebuild the rule lists from the live generation in the pinned maps, so
+ * rules enforced by a previous instance stay visible and removable. The
+ * kernel state is left as found; entries of dead generations are recorded
+ * and removed by the next compile.
+ */
+void tc_classifier_sync(void) {
+    struct tc_filter_bpf *skel = ebpf_tc_skel();
+    int slots_fd = bpf_map__fd(skel->maps.rule_slots);
+    struct rule_slot_key key, next;
+    struct rule_slot_key *prev = NULL;
+    struct filter_rule fr;
+
+    tc_classifier_reset();
+
+    while (bpf_map_get_next_key(slots_fd, prev, &next) == 0) {
+        key = next;
+        prev = &key;
+
+        uint32_t ifindex = key.ifindex & ~RULE_GEN_BIT;
+        uint32_t g = (key.ifindex & RULE_GEN_BIT) ? 1 : 0;
+        tc_if_rules_t *ifr = get_if_rules(ifindex);
+        if (!ifr)
+            continue;
+
+        if (ifr->count == 0 && !ifr->live) {
+            uint32_t rules = ebpf_if_rules(ifindex);
+            ifr->live = rules & IF_RULES_ACTIVE;
+            ifr->live_gen = (rules & IF_RULES_GEN) ? 1 : 0;
+        }
+
+        if (key.slot + 1 > ifr->gens[g].slots)
+            ifr->gens[g].slots = key.slot + 1;
+
+        if (!ifr->live || g != ifr->live_gen ||
+            bpf_map_lookup_elem(slots_fd, &key, &fr) != 0 ||
+            ifr->count >= MAX_RULES_PER_IF ||
+            reserve_rules(ifr, ifr->count + 1) < 0)
+            continue;
+
+        ifr->rules[ifr->count++] = fr;
+        if (fr.rule_id >= next_rule_id)
+            next_rule_id = fr.rule_id + 1;
+    }
+
+    collect_lpm_keys(bpf_map__fd(skel->maps.lpm_src), true);
+    collect_lpm_keys(bpf_map__fd(skel->maps.lpm_dst), false);
+
+    for (uint32_t i = tc_if_count; i-- > 0;) {
+        tc_if_rules_t *ifr = &tc_ifs[i];
+        sort_rules(ifr);
+        if (ifr->count == 0) {
+            /* Nothing live: drop whatever generations were left behind */
+            compile_if_rules(ifr);
+            free_if_rules(ifr);
+        }
+    }
+}
+
+void tc_classifier_reset(void) {
+    while (tc_if_count > 0)
+        free_if_rules(&tc_ifs[tc_if_count - 1]);
+    next_rule_id = 1;
+}
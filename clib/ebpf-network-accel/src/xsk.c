@@ -0,0 +1,544 @@
+/**
+ * Zixiao Hypervisor - AF_XDP Sockets
+ *
+ * UMEM and ring management for AF_XDP sockets fed by the XDP redirect
+ * program, with a non-blocking burst RX/TX API for userspace datapaths.
+ * Rings are driven directly through the kernel ABI in <linux/if_xdp.h>.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ebpf_accel.h"
+#include "ebpf_maps.h"
+#include "loader_internal.h"
+#include "xdp_redirect.skel.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_xdp.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#ifndef AF_XDP
+#define AF_XDP 44
+#endif
+#ifndef SOL_XDP
+#define SOL_XDP 283
+#endif
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+#ifndef SO_BUSY_POLL_BUDGET
+#define SO_BUSY_POLL_BUDGET 70
+#endif
+
+#define XSK_DEFAULT_FRAMES      4096
+#define XSK_DEFAULT_FRAME_SIZE  4096
+#define XSK_DEFAULT_RING_SIZE   2048
+#define XSK_BUSY_POLL_USECS     20
+#define XSK_BUSY_POLL_BUDGET    64
+
+/*
+ * Single-producer/single-consumer ring shared with the kernel. The cached
+ * indexes let a burst touch the shared producer/consumer words once.
+ */
+struct xsk_ring {
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descs;
+    uint32_t size;
+    uint32_t mask;
+    uint32_t cached_prod;
+    uint32_t cached_cons;
+    void *map;
+    size_t map_len;
+};
+
+struct ebpf_xsk {
+    int fd;
+    uint32_t ifindex;
+    uint32_t queue_id;
+    uint32_t index;             /* xsks_map index */
+    bool zerocopy;
+    bool busy_poll;
+
+    void *umem;
+    size_t umem_len;
+    uint32_t frame_size;
+
+    struct xsk_ring fill;
+    struct xsk_ring comp;
+    struct xsk_ring rx;
+    struct xsk_ring tx;
+
+    /* Frames owned by neither the kernel nor the caller */
+    uint64_t *free_frames;
+    uint32_t nr_free;
+    uint32_t nr_frames;
+};
+
+/* Live sockets by xsks_map index */
+static ebpf_xsk_t *xsk_sockets[XSK_MAP_SIZE];
+
+/* ============================================================================
+ * Rings
+ * ============================================================================ */
+
+static uint32_t ring_cons_peek(struct xsk_ring *r, uint32_t want) {
+    uint32_t n = r->cached_prod - r->cached_cons;
+    if (n < want) {
+        r->cached_prod = __atomic_load_n(r->producer, __ATOMIC_ACQUIRE);
+        n = r->cached_prod - r->cached_cons;
+    }
+    return n < want ? n : want;
+}
+
+static void ring_cons_release(struct xsk_ring *r, uint32_t n) {
+    r->cached_cons += n;
+    __atomic_store_n(r->consumer, r->cached_cons, __ATOMIC_RELEASE);
+}
+
+static uint32_t ring_prod_reserve(struct xsk_ring *r, uint32_t want) {
+    uint32_t n = r->size - (r->cached_prod - r->cached_cons);
+    if (n < want) {
+        r->cached_cons = __atomic_load_n(r->consumer, __ATOMIC_ACQUIRE);
+        n = r->size - (r->cached_prod - r->cached_cons);
+    }
+    return n < want ? n : want;
+}
+
+static void ring_prod_submit(struct xsk_ring *r, uint32_t n) {
+    r->cached_prod += n;
+    __atomic_store_n(r->producer, r->cached_prod, __ATOMIC_RELEASE);
+}
+
+static bool ring_needs_wakeup(const struct xsk_ring *r) {
+    return __atomic_load_n(r->flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP;
+}
+
+static int ring_map(int fd, struct xsk_ring *r, const struct xdp_ring_offset *off,
+                    uint32_t size, size_t desc_size, uint64_t pgoff) {
+    r->map_len = off->desc + size * desc_size;
+    r->map = mmap(NULL, r->map_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, (off_t)pgoff);
+    if (r->map == MAP_FAILED) {
+        r->map = NULL;
+        return -errno;
+    }
+
+    r->producer = (uint32_t *)((char *)r->map + off->producer);
+    r->consumer = (uint32_t *)((char *)r->map + off->consumer);
+    r->flags = (uint32_t *)((char *)r->map + off->flags);
+    r->descs = (char *)r->map + off->desc;
+    r->size = size;
+    r->mask = size - 1;
+    r->cached_prod = *r->producer;
+    r->cached_cons = *r->consumer;
+    return 0;
+}
+
+static void ring_unmap(struct xsk_ring *r) {
+    if (r->map)
+        munmap(r->map, r->map_len);
+    memset(r, 0, sizeof(*r));
+}
+
+/* ============================================================================
+ * Frames
+ * ============================================================================ */
+
+/* Move completed TX frames back to the free list */
+static void reclaim_tx(ebpf_xsk_t *xsk) {
+    uint32_t n = ring_cons_peek(&xsk->comp, xsk->comp.size);
+    const uint64_t *addrs = xsk->comp.descs;
+
+    for (uint32_t i = 0; i < n; i++)
+        xsk->free_frames[xsk->nr_free++] = addrs[(xsk->comp.cached_cons + i) & xsk->comp.mask];
+    if (n)
+        ring_cons_release(&xsk->comp, n);
+}
+
+/* Hand free frames to the kernel for RX */
+static void refill_rx(ebpf_xsk_t *xsk) {
+    uint32_t n = ring_prod_reserve(&xsk->fill, xsk->nr_free);
+    uint64_t *addrs = xsk->fill.descs;
+
+    for (uint32_t i = 0; i < n; i++)
+        addrs[(xsk->fill.cached_prod + i) & xsk->fill.mask] = xsk->free_frames[--xsk->nr_free];
+    if (n)
+        ring_prod_submit(&xsk->fill, n);
+}
+
+static void kick(const ebpf_xsk_t *xsk, bool tx) {
+    /* Queue full or device down are reported by the rings, not here */
+    if (tx)
+        sendto(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, 0);
+    else
+        recvfrom(xsk->fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+}
+
+/* ============================================================================
+ * Socket Setup
+ * ============================================================================ */
+
+static bool is_pow2(uint32_t v) {
+    return v && !(v & (v - 1));
+}
+
+static int setup_umem(ebpf_xsk_t *xsk, uint32_t ring_size) {
+    xsk->umem_len = (size_t)xsk->nr_frames * xsk->frame_size;
+    xsk->umem = mmap(NULL, xsk->umem_len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (xsk->umem == MAP_FAILED) {
+        xsk->umem = NULL;
+        return -errno;
+    }
+
+    xsk->free_frames = calloc(xsk->nr_frames, sizeof(uint64_t));
+    if (!xsk->free_frames)
+        return -ENOMEM;
+    for (uint32_t i = 0; i < xsk->nr_frames; i++)
+        xsk->free_frames[i] = (uint64_t)(xsk->nr_frames - 1 - i) * xsk->frame_size;
+    xsk->nr_free = xsk->nr_frames;
+
+    struct xdp_umem_reg reg = {
+        .addr = (uint64_t)(uintptr_t)xsk->umem,
+        .len = xsk->umem_len,
+        .chunk_size = xsk->frame_size,
+        .headroom = 0,
+    };
+    if (setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_FILL_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_UMEM_COMPLETION_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_RX_RING, &ring_size, sizeof(ring_size)) ||
+        setsockopt(xsk->fd, SOL_XDP, XDP_TX_RING, &ring_size, sizeof(ring_size)))
+        return -errno;
+
+    struct xdp_mmap_offsets off;
+    socklen_t optlen = sizeof(off);
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_MMAP_OFFSETS, &off, &optlen))
+        return -errno;
+
+    int err;
+    if ((err = ring_map(xsk->fd, &xsk->fill, &off.fr, ring_size, sizeof(uint64_t),
+                        XDP_UMEM_PGOFF_FILL_RING)) ||
+        (err = ring_map(xsk->fd, &xsk->comp, &off.cr, ring_size, sizeof(uint64_t),
+                        XDP_UMEM_PGOFF_COMPLETION_RING)) ||
+        (err = ring_map(xsk->fd, &xsk->rx, &off.rx, ring_size, sizeof(struct xdp_desc),
+                        XDP_PGOFF_RX_RING)) ||
+        (err = ring_map(xsk->fd, &xsk->tx, &off.tx, ring_size, sizeof(struct xdp_desc),
+                        XDP_PGOFF_TX_RING)))
+        return err;
+
+    return 0;
+}
+
+/* Busy polling is an optimisation; kernels without it still work */
+static void setup_busy_poll(ebpf_xsk_t *xsk) {
+    int one = 1;
+    int usecs = XSK_BUSY_POLL_USECS;
+    int budget = XSK_BUSY_POLL_BUDGET;
+
+    xsk->busy_poll =
+        setsockopt(xsk->fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) == 0 &&
+        setsockopt(xsk->fd, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) == 0 &&
+        setsockopt(xsk->fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) == 0;
+}
+
+/*
+ * Bind zero-copy first. Drivers without zero-copy support reject it, in
+ * which case the kernel copies frames between its buffers and the UMEM.
+ */
+static int bind_xsk(ebpf_xsk_t *xsk, bool force_copy) {
+    struct sockaddr_xdp sxdp = {
+        .sxdp_family = AF_XDP,
+        .sxdp_ifindex = xsk->ifindex,
+        .sxdp_queue_id = xsk->queue_id,
+    };
+
+    if (!force_copy) {
+        sxdp.sxdp_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP;
+        if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)) == 0) {
+            xsk->zerocopy = true;
+            return 0;
+        }
+        if (errno == EPERM || errno == ENODEV || errno == EBUSY)
+            return -errno;
+    }
+
+    sxdp.sxdp_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+    if (bind(xsk->fd, (struct sockaddr *)&sxdp, sizeof(sxdp)))
+        return -errno;
+    xsk->zerocopy = false;
+    return 0;
+}
+
+static void free_xsk(ebpf_xsk_t *xsk) {
+    ring_unmap(&xsk->fill);
+    ring_unmap(&xsk->comp);
+    ring_unmap(&xsk->rx);
+    ring_unmap(&xsk->tx);
+    if (xsk->fd >= 0)
+        close(xsk->fd);
+    if (xsk->umem)
+        munmap(xsk->umem, xsk->umem_len);
+    free(xsk->free_frames);
+    free(xsk);
+}
+
+static int find_free_index(const ebpf_xsk_config_t *config, uint32_t *index) {
+    int found = -1;
+
+    for (uint32_t i = 0; i < XSK_MAP_SIZE; i++) {
+        const ebpf_xsk_t *s = xsk_sockets[i];
+        if (!s) {
+            if (found < 0)
+                found = (int)i;
+            continue;
+        }
+        if (s->ifindex == config->ifindex && s->queue_id == config->queue_id) {
+            ebpf_set_error("Queue %u of ifindex %u already has an AF_XDP socket",
+                           config->queue_id, config->ifindex);
+            return EBPF_ERR_INVALID;
+        }
+    }
+
+    if (found < 0) {
+        ebpf_set_error("Maximum AF_XDP sockets reached");
+        return EBPF_ERR_MEMORY;
+    }
+    *index = (uint32_t)found;
+    return EBPF_OK;
+}
+
+/* ============================================================================
+ * Public API
+ * ============================================================================ */
+
+int ebpf_xsk_create(const ebpf_xsk_config_t *config, ebpf_xsk_t **out) {
+    if (!ebpf_accel_is_initialized()) {
+        return EBPF_ERR_NOT_INIT;
+    }
+
+    if (!config || !out || config->ifindex == 0) {
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t frames = config->frame_count ? config->frame_count : XSK_DEFAULT_FRAMES;
+    uint32_t frame_size = config->frame_size ? config->frame_size : XSK_DEFAULT_FRAME_SIZE;
+    uint32_t ring_size = config->ring_size ? config->ring_size : XSK_DEFAULT_RING_SIZE;
+    if ((frame_size != 2048 && frame_size != 4096) || !is_pow2(ring_size)) {
+        ebpf_set_error("Invalid AF_XDP frame size %u or ring size %u",
+                       frame_size, ring_size);
+        return EBPF_ERR_INVALID;
+    }
+
+    if (!ebpf_xdp_redirect_attached(config->ifindex)) {
+        ebpf_set_error("XDP redirect program not attached to ifindex %u",
+                       config->ifindex);
+        return EBPF_ERR_INVALID;
+    }
+
+    uint32_t index;
+    int ret = find_free_index(config, &index);
+    if (ret != EBPF_OK)
+        return ret;
+
+    ebpf_xsk_t *xsk = calloc(1, sizeof(*xsk));
+    if (!xsk) {
+        return EBPF_ERR_MEMORY;
+    }
+    xsk->ifindex = config->ifindex;
+    xsk->queue_id = config->queue_id;
+    xsk->index = index;
+    xsk->frame_size = frame_size;
+    xsk->nr_frames = frames;
+
+    xsk->fd = socket(AF_XDP, SOCK_RAW | SOCK_CLOEXEC, 0);
+    if (xsk->fd < 0) {
+        ebpf_set_error("Failed to create AF_XDP socket: %s", strerror(errno));
+        ret = errno == EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_INIT;
+        goto err_free;
+    }
+
+    int err = setup_umem(xsk, ring_size);
+    if (err) {
+        ebpf_set_error("Failed to set up AF_XDP UMEM: %s", strerror(-err));
+        ret = err == -ENOMEM ? EBPF_ERR_MEMORY : EBPF_ERR_INIT;
+        goto err_free;
+    }
+
+    if (config->busy_poll)
+        setup_busy_poll(xsk);
+
+    /* Give the kernel RX buffers before frames can arrive */
+    refill_rx(xsk);
+
+    err = bind_xsk(xsk, config->force_copy);
+    if (err) {
+        ebpf_set_error("Failed to bind AF_XDP socket to ifindex %u queue %u: %s",
+                       xsk->ifindex, xsk->queue_id, strerror(-err));
+        ret = err == -EPERM ? EBPF_ERR_PERMISSION : EBPF_ERR_ATTACH;
+        goto err_free;
+    }
+
+    struct xdp_redirect_bpf *skel = ebpf_xdp_skel();
+    int sock_fd = xsk->fd;
+    if (bpf_map_update_elem(bpf_map__fd(skel->maps.xsks_map), &index,
+                            &sock_fd, BPF_ANY)) {
+        ebpf_set_error("Failed to add AF_XDP socket to map: %s", strerror(errno));
+        ret = EBPF_ERR_MAP;
+        goto err_free;
+    }
+
+    /* Steering goes live last, once a socket is there to take frames */
+    struct xsk_key key = { .ifindex = xsk->ifindex, .queue = xsk->queue_id };
+    struct xsk_steer steer = { .index = index, .udp_port = config->udp_port };
+    if (bpf_map_update_elem(bpf_map__fd(skel->maps.xsk_queues), &key,
+                            &steer, BPF_ANY)) {
+        ebpf_set_error("Failed to steer queue to AF_XDP socket: %s", strerror(errno));
+        bpf_map_delete_elem(bpf_map__fd(skel->maps.xsks_map), &index);
+        ret = EBPF_ERR_MAP;
+        goto err_free;
+    }
+
+    xsk_sockets[index] = xsk;
+    *out = xsk;
+    return EBPF_OK;
+
+err_free:
+    free_xsk(xsk);
+    return ret;
+}
+
+void ebpf_xsk_destroy(ebpf_xsk_t *xsk) {
+    if (!xsk) return;
+
+    struct xdp_redirect_bpf *skel = ebpf_xdp_skel();
+    if (skel) {
+        struct xsk_key key = { .ifindex = xsk->ifindex, .queue = xsk->queue_id };
+        bpf_map_delete_elem(bpf_map__fd(skel->maps.xsk_queues), &key);
+        bpf_map_delete_elem(bpf_map__fd(skel->maps.xsks_map), &xsk->index);
+    }
+
+    xsk_sockets[xsk->index] = NULL;
+    free_xsk(xsk);
+}
+
+int ebpf_xsk_fd(const ebpf_xsk_t *xsk) {
+    return xsk ? xsk->fd : -1;
+}
+
+bool ebpf_xsk_is_zerocopy(const ebpf_xsk_t *xsk) {
+    return xsk && xsk->zerocopy;
+}
+
+void *ebpf_xsk_frame(const ebpf_xsk_t *xsk, uint64_t addr) {
+    return (char *)xsk->umem + addr;
+}
+
+int ebpf_xsk_rx_burst(ebpf_xsk_t *xsk, ebpf_xsk_desc_t *descs, uint32_t max_descs) {
+    if (!xsk || !descs) {
+        return EBPF_ERR_INVALID;
+    }
+
+    refill_rx(xsk);
+
+    uint32_t n = ring_cons_peek(&xsk->rx, max_descs);
+    if (n == 0) {
+        if (xsk->busy_poll || ring_needs_wakeup(&xsk->fill))
+            kick(xsk, false);
+        return 0;
+    }
+
+    const struct xdp_desc *ring = xsk->rx.descs;
+    for (uint32_t i = 0; i < n; i++) {
+        const struct xdp_desc *d = &ring[(xsk->rx.cached_cons + i) & xsk->rx.mask];
+        descs[i].addr = d->addr;
+        descs[i].len = d->len;
+        descs[i].options = d->options;
+    }
+    ring_cons_release(&xsk->rx, n);
+    return (int)n;
+}
+
+int ebpf_xsk_tx_burst(ebpf_xsk_t *xsk, const ebpf_xsk_desc_t *descs, uint32_t count) {
+    if (!xsk || (!descs && count)) {
+        return EBPF_ERR_INVALID;
+    }
+
+    reclaim_tx(xsk);
+
+    uint32_t n = ring_prod_reserve(&xsk->tx, count);
+    struct xdp_desc *ring = xsk->tx.descs;
+    for (uint32_t i = 0; i < n; i++) {
+        struct xdp_desc *d = &ring[(xsk->tx.cached_prod + i) & xsk->tx.mask];
+        d->addr = descs[i].addr;
+        d->len = descs[i].len;
+        d->options = 0;
+    }
+    if (n)
+        ring_prod_submit(&xsk->tx, n);
+
+    /* Copy mode and busy polling transmit only from the syscall */
+    if (n && (xsk->busy_poll || !xsk->zerocopy || ring_needs_wakeup(&xsk->tx)))
+        kick(xsk, true);
+    return (int)n;
+}
+
+int ebpf_xsk_alloc_frames(ebpf_xsk_t *xsk, uint64_t *addrs, uint32_t count) {
+    if (!xsk || (!addrs && count)) {
+        return EBPF_ERR_INVALID;
+    }
+
+    reclaim_tx(xsk);
+
+    uint32_t n = count < xsk->nr_free ? count : xsk->nr_free;
+    for (uint32_t i = 0; i < n; i++)
+        addrs[i] = xsk->free_frames[--xsk->nr_free];
+    return (int)n;
+}
+
+int ebpf_xsk_release(ebpf_xsk_t *xsk, const ebpf_xsk_desc_t *descs, uint32_t count) {
+    if (!xsk || (!descs && count)) {
+        return EBPF_ERR_INVALID;
+    }
+
+    if (xsk->nr_free + count > xsk->nr_frames) {
+        ebpf_set_error("More AF_XDP frames released than allocated");
+        return EBPF_ERR_INVALID;
+    }
+
+    /* RX addresses point past the headroom; recycle the whole frame */
+    uint64_t mask = ~(uint64_t)(xsk->frame_size - 1);
+    for (uint32_t i = 0; i < count; i++)
+        xsk->free_frames[xsk->nr_free++] = descs[i].addr & mask;
+    return EBPF_OK;
+}
+
+int ebpf_xsk_get_stats(const ebpf_xsk_t *xsk, ebpf_xsk_stats_t *stats) {
+    if (!xsk || !stats) {
+        return EBPF_ERR_INVALID;
+    }
+
+    struct xdp_statistics xs;
+    socklen_t optlen = sizeof(xs);
+    memset(&xs, 0, sizeof(xs));
+    if (getsockopt(xsk->fd, SOL_XDP, XDP_STATISTICS, &xs, &optlen)) {
+        ebpf_set_error("Failed to read AF_XDP statistics: %s", strerror(errno));
+        return EBPF_ERR_INVALID;
+    }
+
+    stats->rx_dropped = xs.rx_dropped;
+    stats->rx_invalid_descs = xs.rx_invalid_descs;
+    stats->tx_invalid_descs = xs.tx_invalid_descs;
+    stats->rx_ring_full = xs.rx_ring_full;
+    stats->rx_fill_ring_empty = xs.rx_fill_ring_empty_descs;
+    stats->tx_ring_empty = xs.tx_ring_empty_descs;
+    return EBPF_OK;
+}
@@ -5,10 +5,14 @@
  * Licensed under Apache License 2.0
  */
 
+#define _DEFAULT_SOURCE
+
 #include "balloon.h"
+#include "zx_metrics.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <errno.h>
 
 #ifdef __linux__
@@ -17,23 +21,125 @@
 #include <fcntl.h>
 #endif
 
+/*
+ * Balloon memory lives in one arena mapping sized to physical memory.
+ * The inflated pages are its first current_pages pages, so they need no
+ * per-page record; the ranges reported by the last pass follow them and
+ * are kept as a short list of coalesced ranges.
+ */
+typedef struct arena_range {
+    uint64_t offset;            /* Byte offset into the arena */
+    uint64_t length;            /* Length in bytes */
+} arena_range_t;
+
 /* Internal state */
 static struct {
     bool initialized;
     balloon_config_t config;
     uint32_t current_pages;
-    void **inflated_pages;
-    size_t inflated_capacity;
+    uint8_t *arena;
+    uint64_t arena_size;
+    arena_range_t *reported;
+    uint32_t reported_count;
+    uint32_t reported_capacity;
+    balloon_report_mode_t report_mode;
+    balloon_report_stats_t report_stats;
     balloon_request_callback_t request_callback;
     void *request_userdata;
     balloon_stats_callback_t stats_callback;
     void *stats_userdata;
+    balloon_report_callback_t report_callback;
+    void *report_userdata;
     char last_error[256];
 } balloon_state = {0};
 
 /* Page size */
 static size_t page_size = 0;
 
+/*
+ * Metrics export: when the process has a metrics arena, a collector
+ * copies the statistics into one "balloon" block on every pass.
+ */
+enum {
+    M_BALLOON_PAGES, M_SWAP_IN, M_SWAP_OUT, M_MAJOR_FAULTS, M_MINOR_FAULTS,
+    M_FREE_MEMORY, M_TOTAL_MEMORY, M_AVAILABLE_MEMORY, M_DISK_CACHES,
+    M_HUGETLB_ALLOCATIONS, M_HUGETLB_FAILURES,
+    M_REPORT_PASSES, M_REPORT_BATCHES, M_REPORTED_BYTES, M_LAST_PASS_BYTES,
+    M_TRACKED_RANGES, M_FIELDS
+};
+
+static const zx_metrics_field_t metric_fields[M_FIELDS] = {
+    { .name = "balloon_pages", .kind = ZX_METRICS_GAUGE },
+    { .name = "swap_in", .kind = ZX_METRICS_COUNTER },
+    { .name = "swap_out", .kind = ZX_METRICS_COUNTER },
+    { .name = "major_faults", .kind = ZX_METRICS_COUNTER },
+    { .name = "minor_faults", .kind = ZX_METRICS_COUNTER },
+    { .name = "free_memory", .kind = ZX_METRICS_GAUGE },
+    { .name = "total_memory", .kind = ZX_METRICS_GAUGE },
+    { .name = "available_memory", .kind = ZX_METRICS_GAUGE },
+    { .name = "disk_caches", .kind = ZX_METRICS_GAUGE },
+    { .name = "hugetlb_allocations", .kind = ZX_METRICS_COUNTER },
+    { .name = "hugetlb_failures", .kind = ZX_METRICS_COUNTER },
+    { .name = "report_passes", .kind = ZX_METRICS_COUNTER },
+    { .name = "report_batches", .kind = ZX_METRICS_COUNTER },
+    { .name = "reported_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "last_pass_bytes", .kind = ZX_METRICS_GAUGE },
+    { .name = "tracked_ranges", .kind = ZX_METRICS_GAUGE },
+};
+
+static zx_metrics_block_t *metric_block = NULL;
+
+static void metrics_collect(void *userdata) {
+    zx_metrics_block_t *m = userdata;
+    balloon_stats_t st;
+    balloon_report_stats_t rs;
+
+    if (balloon_get_stats(&st) != BALLOON_OK ||
+        balloon_get_report_stats(&rs) != BALLOON_OK) {
+        return;
+    }
+
+    zx_metrics_write_begin(m);
+    m->values[M_BALLOON_PAGES] = balloon_state.current_pages;
+    m->values[M_SWAP_IN] = st.swap_in;
+    m->values[M_SWAP_OUT] = st.swap_out;
+    m->values[M_MAJOR_FAULTS] = st.major_faults;
+    m->values[M_MINOR_FAULTS] = st.minor_faults;
+    m->values[M_FREE_MEMORY] = st.free_memory;
+    m->values[M_TOTAL_MEMORY] = st.total_memory;
+    m->values[M_AVAILABLE_MEMORY] = st.available_memory;
+    m->values[M_DISK_CACHES] = st.disk_caches;
+    m->values[M_HUGETLB_ALLOCATIONS] = st.hugetlb_allocations;
+    m->values[M_HUGETLB_FAILURES] = st.hugetlb_failures;
+    m->values[M_REPORT_PASSES] = rs.passes;
+    m->values[M_REPORT_BATCHES] = rs.batches;
+    m->values[M_REPORTED_BYTES] = rs.reported_bytes;
+    m->values[M_LAST_PASS_BYTES] = rs.last_pass_bytes;
+    m->values[M_TRACKED_RANGES] = rs.tracked_ranges;
+    zx_metrics_write_end(m);
+}
+
+static void metrics_attach(void) {
+    int type = zx_metrics_type_register("balloon", metric_fields, M_FIELDS);
+    if (type < 0)
+        return;
+
+    metric_block = zx_metrics_block_add(type, "");
+    if (metric_block && zx_metrics_collector_add(metrics_collect, metric_block) != ZX_METRICS_OK) {
+        zx_metrics_block_remove(metric_block);
+        metric_block = NULL;
+    }
+}
+
+static void metrics_detach(void) {
+    if (!metric_block)
+        return;
+
+    zx_metrics_collector_remove(metrics_collect, metric_block);
+    zx_metrics_block_remove(metric_block);
+    metric_block = NULL;
+}
+
 /* Set error message */
 static void set_error(const char *fmt, ...) {
     va_list args;
@@ -76,15 +182,12 @@ int balloon_init(const balloon_config_t *config) {
         balloon_state.config.stats_interval_ms = 1000;
     }
 
-    /* Allocate page tracking array */
-    balloon_state.inflated_capacity = 1024;
-    balloon_state.inflated_pages = calloc(balloon_state.inflated_capacity, sizeof(void*));
-    if (!balloon_state.inflated_pages) {
-        set_error("Failed to allocate page tracking array");
-        return BALLOON_ERR_MEMORY;
+    if (balloon_state.config.free_page_reporting) {
+        balloon_state.report_mode = BALLOON_REPORT_DISCARD;
     }
 
     balloon_state.initialized = true;
+    metrics_attach();
     return BALLOON_OK;
 }
 
@@ -93,23 +196,115 @@ void balloon_cleanup(void) {
         return;
     }
 
-    /* Release all inflated pages */
-    if (balloon_state.inflated_pages) {
-        for (uint32_t i = 0; i < balloon_state.current_pages; i++) {
-            if (balloon_state.inflated_pages[i]) {
+    metrics_detach();
+
+    /* Release the arena, inflated and reported pages with it */
 #ifdef __linux__
-                munmap(balloon_state.inflated_pages[i], page_size);
-#else
-                free(balloon_state.inflated_pages[i]);
+    if (balloon_state.arena) {
+        munmap(balloon_state.arena, balloon_state.arena_size);
+    }
 #endif
-            }
+    free(balloon_state.reported);
+
+    memset(&balloon_state, 0, sizeof(balloon_state));
+}
+
+#ifdef __linux__
+/* Reserve the arena on first use; it costs address space only */
+static int arena_create(void) {
+    uint64_t size;
+    uint64_t map_size;
+    uint8_t *map;
+    uint8_t *base;
+
+    if (balloon_state.arena) {
+        return BALLOON_OK;
+    }
+
+    size = (uint64_t)sysconf(_SC_PHYS_PAGES) * page_size;
+    size = (size + BALLOON_REPORT_CHUNK_SIZE - 1) & ~(uint64_t)(BALLOON_REPORT_CHUNK_SIZE - 1);
+    if (size == 0) {
+        set_error("Failed to determine physical memory size");
+        return BALLOON_ERR_MEMORY;
+    }
+
+    /* Over-map by a chunk so the arena can start on a chunk boundary */
+    map_size = size + BALLOON_REPORT_CHUNK_SIZE;
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED) {
+        set_error("Failed to reserve balloon arena: %s", strerror(errno));
+        return BALLOON_ERR_MEMORY;
+    }
+
+    base = (uint8_t *)(((uintptr_t)map + BALLOON_REPORT_CHUNK_SIZE - 1) &
+                       ~(uintptr_t)(BALLOON_REPORT_CHUNK_SIZE - 1));
+    if (base > map) {
+        munmap(map, base - map);
+    }
+    if (base + size < map + map_size) {
+        munmap(base + size, (map + map_size) - (base + size));
+    }
+
+#ifdef MADV_HUGEPAGE
+    /* Populate reports with huge pages, so each chunk is one page */
+    madvise(base, size, MADV_HUGEPAGE);
+#endif
+
+    balloon_state.arena = base;
+    balloon_state.arena_size = size;
+    return BALLOON_OK;
+}
+
+/* Drop reported ranges below an offset, which inflated pages now use */
+static void reported_clip(uint64_t below) {
+    uint32_t i, n = 0;
+
+    for (i = 0; i < balloon_state.reported_count; i++) {
+        arena_range_t r = balloon_state.reported[i];
+        uint64_t end = r.offset + r.length;
+
+        if (end <= below) {
+            continue;
         }
-        free(balloon_state.inflated_pages);
+        if (r.offset < below) {
+            r.length = end - below;
+            r.offset = below;
+        }
+        balloon_state.reported[n++] = r;
     }
 
-    memset(&balloon_state, 0, sizeof(balloon_state));
+    balloon_state.reported_count = n;
 }
 
+/* Append a reported range, merging it with the last one */
+static int reported_add(uint64_t offset, uint64_t length) {
+    arena_range_t *last = balloon_state.reported_count ?
+        &balloon_state.reported[balloon_state.reported_count - 1] : NULL;
+
+    if (last && last->offset + last->length == offset) {
+        last->length += length;
+        return BALLOON_OK;
+    }
+
+    if (balloon_state.reported_count == balloon_state.reported_capacity) {
+        uint32_t capacity = balloon_state.reported_capacity ? balloon_state.reported_capacity * 2 : 16;
+        arena_range_t *ranges = realloc(balloon_state.reported, capacity * sizeof(*ranges));
+        if (!ranges) {
+            set_error("Failed to expand range tracking");
+            return BALLOON_ERR_MEMORY;
+        }
+        balloon_state.reported = ranges;
+        balloon_state.reported_capacity = capacity;
+    }
+
+    balloon_state.reported[balloon_state.reported_count].offset = offset;
+    balloon_state.reported[balloon_state.reported_count].length = length;
+    balloon_state.reported_count++;
+    return BALLOON_OK;
+}
+#endif
+
 bool balloon_is_initialized(void) {
     return balloon_state.initialized;
 }
@@ -139,50 +334,35 @@ int balloon_inflate(uint32_t num_pages) {
         return BALLOON_ERR_NOT_INIT;
     }
 
-    /* Expand capacity if needed */
-    uint32_t new_total = balloon_state.current_pages + num_pages;
-    if (new_total > balloon_state.inflated_capacity) {
-        size_t new_capacity = balloon_state.inflated_capacity * 2;
-        while (new_capacity < new_total) {
-            new_capacity *= 2;
-        }
-
-        void **new_array = realloc(balloon_state.inflated_pages,
-                                   new_capacity * sizeof(void*));
-        if (!new_array) {
-            set_error("Failed to expand page tracking array");
-            return BALLOON_ERR_MEMORY;
-        }
-
-        balloon_state.inflated_pages = new_array;
-        balloon_state.inflated_capacity = new_capacity;
+    uint64_t new_total = (uint64_t)balloon_state.current_pages + num_pages;
+    if (new_total > UINT32_MAX) {
+        set_error("Balloon size out of range");
+        return BALLOON_ERR_INVALID;
     }
 
-    /* Allocate pages */
-    for (uint32_t i = 0; i < num_pages; i++) {
-        void *page = NULL;
-
 #ifdef __linux__
-        page = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
-                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-        if (page == MAP_FAILED) {
-            set_error("Failed to allocate page: %s", strerror(errno));
-            return BALLOON_ERR_MEMORY;
-        }
+    int ret = arena_create();
+    if (ret != BALLOON_OK) {
+        return ret;
+    }
 
-        /* Advise kernel we don't need this memory */
-        madvise(page, page_size, MADV_DONTNEED);
-#else
-        page = malloc(page_size);
-        if (!page) {
-            set_error("Failed to allocate page");
-            return BALLOON_ERR_MEMORY;
-        }
-#endif
+    uint64_t start = (uint64_t)balloon_state.current_pages * page_size;
+    uint64_t end = new_total * page_size;
+    if (end > balloon_state.arena_size) {
+        set_error("Balloon larger than physical memory");
+        return BALLOON_ERR_MEMORY;
+    }
 
-        balloon_state.inflated_pages[balloon_state.current_pages++] = page;
+    /* Release the whole run in one call; it may hold reported pages */
+    if (num_pages && madvise(balloon_state.arena + start, end - start, MADV_DONTNEED) != 0) {
+        set_error("Failed to release pages: %s", strerror(errno));
+        return BALLOON_ERR_MEMORY;
     }
 
+    reported_clip(end);
+#endif
+
+    balloon_state.current_pages = (uint32_t)new_total;
     balloon_state.config.actual = balloon_state.current_pages;
     return BALLOON_OK;
 }
@@ -197,23 +377,8 @@ int balloon_deflate(uint32_t num_pages) {
         num_pages = balloon_state.current_pages;
     }
 
-    /* Release pages */
-    for (uint32_t i = 0; i < num_pages; i++) {
-        uint32_t idx = balloon_state.current_pages - 1;
-        void *page = balloon_state.inflated_pages[idx];
-
-        if (page) {
-#ifdef __linux__
-            munmap(page, page_size);
-#else
-            free(page);
-#endif
-        }
-
-        balloon_state.inflated_pages[idx] = NULL;
-        balloon_state.current_pages--;
-    }
-
+    /* The pages were released on inflate; only the boundary moves */
+    balloon_state.current_pages -= num_pages;
     balloon_state.config.actual = balloon_state.current_pages;
     return BALLOON_OK;
 }
@@ -324,6 +489,203 @@ int balloon_set_free_page_reporting(bool enable) {
     }
 
     balloon_state.config.free_page_reporting = enable;
+    if (!enable) {
+        balloon_state.report_mode = BALLOON_REPORT_OFF;
+    } else if (balloon_state.report_mode == BALLOON_REPORT_OFF) {
+        balloon_state.report_mode = BALLOON_REPORT_DISCARD;
+    }
+    return BALLOON_OK;
+}
+
+int balloon_set_report_mode(balloon_report_mode_t mode) {
+    if (!balloon_state.initialized) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    if (mode != BALLOON_REPORT_OFF && mode != BALLOON_REPORT_DISCARD &&
+        mode != BALLOON_REPORT_HINT) {
+        set_error("Invalid report mode %d", (int)mode);
+        return BALLOON_ERR_INVALID;
+    }
+
+    balloon_state.report_mode = mode;
+    balloon_state.config.free_page_reporting = mode != BALLOON_REPORT_OFF;
+    return BALLOON_OK;
+}
+
+balloon_report_mode_t balloon_get_report_mode(void) {
+    return balloon_state.report_mode;
+}
+
+int balloon_register_report_callback(balloon_report_callback_t callback, void *userdata) {
+    if (!balloon_state.initialized) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    balloon_state.report_callback = callback;
+    balloon_state.report_userdata = userdata;
+    return BALLOON_OK;
+}
+
+#ifdef __linux__
+/* Memory that may be taken for reporting, from /proc/meminfo */
+static uint64_t report_budget(void) {
+    uint64_t total = 0, free_mem = 0, reserve;
+    char line[256];
+    FILE *fp = fopen("/proc/meminfo", "r");
+
+    if (!fp) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        uint64_t value;
+        if (sscanf(line, "MemTotal: %lu kB", &value) == 1) {
+            total = value * 1024;
+        } else if (sscanf(line, "MemFree: %lu kB", &value) == 1) {
+            free_mem = value * 1024;
+        }
+    }
+    fclose(fp);
+
+    reserve = total / 8;
+    return free_mem > reserve ? free_mem - reserve : 0;
+}
+
+/* Fault a chunk in, taking its memory off the kernel's free lists */
+static int report_populate(uint8_t *addr, size_t length) {
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(addr, length, MADV_POPULATE_WRITE) == 0) {
+        return 0;
+    }
+    if (errno != EINVAL) {
+        return -1;
+    }
+#endif
+    for (size_t off = 0; off < length; off += page_size) {
+        ((volatile uint8_t *)addr)[off] = 0;
+    }
+    return 0;
+}
+
+/* Report a batch of chunks and release them */
+static int report_batch(uint64_t offset, uint32_t chunks) {
+    balloon_range_t range;
+    uint64_t length = (uint64_t)chunks * BALLOON_REPORT_CHUNK_SIZE;
+    int advice = MADV_DONTNEED;
+
+#ifdef MADV_FREE
+    if (balloon_state.report_mode == BALLOON_REPORT_HINT) {
+        advice = MADV_FREE;
+    }
+#endif
+
+    /* A batch is contiguous, so it is one range and one madvise */
+    range.addr = balloon_state.arena + offset;
+    range.length = length;
+
+    if (balloon_state.report_callback) {
+        balloon_state.report_callback(&range, 1, balloon_state.report_userdata);
+    }
+
+    if (madvise(range.addr, length, advice) != 0) {
+        set_error("Failed to release reported range: %s", strerror(errno));
+        return BALLOON_ERR_MEMORY;
+    }
+
+    balloon_state.report_stats.batches++;
+    return reported_add(offset, length);
+}
+#endif
+
+int balloon_report_free_pages(uint64_t max_bytes) {
+    if (!balloon_state.initialized) {
+        set_error("Balloon driver not initialized");
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    if (balloon_state.report_mode == BALLOON_REPORT_OFF) {
+        set_error("Free page reporting disabled");
+        return BALLOON_ERR_OPERATION;
+    }
+
+#ifdef __linux__
+    int ret = arena_create();
+    if (ret != BALLOON_OK) {
+        return ret;
+    }
+
+    uint64_t budget = report_budget();
+    if (max_bytes && max_bytes < budget) {
+        budget = max_bytes;
+    }
+
+    /* Each pass reports afresh, starting after the inflated pages */
+    uint64_t offset = (uint64_t)balloon_state.current_pages * page_size;
+    offset = (offset + BALLOON_REPORT_CHUNK_SIZE - 1) & ~(uint64_t)(BALLOON_REPORT_CHUNK_SIZE - 1);
+    uint64_t start = offset;
+    balloon_state.reported_count = 0;
+
+    while (ret == BALLOON_OK && budget >= BALLOON_REPORT_CHUNK_SIZE) {
+        uint32_t chunks = 0;
+
+        while (chunks < BALLOON_REPORT_BATCH && budget >= BALLOON_REPORT_CHUNK_SIZE &&
+               offset + BALLOON_REPORT_CHUNK_SIZE <= balloon_state.arena_size) {
+            if (report_populate(balloon_state.arena + offset, BALLOON_REPORT_CHUNK_SIZE) != 0) {
+                budget = 0;
+                break;
+            }
+            offset += BALLOON_REPORT_CHUNK_SIZE;
+            budget -= BALLOON_REPORT_CHUNK_SIZE;
+            chunks++;
+        }
+
+        if (chunks == 0) {
+            break;
+        }
+
+        ret = report_batch(offset - (uint64_t)chunks * BALLOON_REPORT_CHUNK_SIZE, chunks);
+    }
+
+    balloon_state.report_stats.passes++;
+    balloon_state.report_stats.last_pass_bytes = offset - start;
+    balloon_state.report_stats.reported_bytes += offset - start;
+    return ret;
+#else
+    (void)max_bytes;
+    set_error("Free page reporting not supported on this platform");
+    return BALLOON_ERR_OPERATION;
+#endif
+}
+
+int balloon_get_report_stats(balloon_report_stats_t *stats) {
+    if (!balloon_state.initialized) {
+        set_error("Balloon driver not initialized");
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    if (!stats) {
+        set_error("Invalid stats pointer");
+        return BALLOON_ERR_INVALID;
+    }
+
+    *stats = balloon_state.report_stats;
+    stats->tracked_ranges = balloon_state.reported_count;
+    return BALLOON_OK;
+}
+
+int balloon_get_config(balloon_config_t *config) {
+    if (!balloon_state.initialized) {
+        set_error("Balloon driver not initialized");
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    if (!config) {
+        set_error("Invalid config pointer");
+        return BALLOON_ERR_INVALID;
+    }
+
+    *config = balloon_state.config;
     return BALLOON_OK;
 }
 
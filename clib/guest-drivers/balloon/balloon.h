@@ -52,12 +52,73 @@ typedef struct balloon_config {
     uint32_t stats_interval_ms; /* Statistics polling interval */
 } balloon_config_t;
 
+/* Free page reporting modes */
+typedef enum balloon_report_mode {
+    BALLOON_REPORT_OFF = 0,     /* No reporting */
+    BALLOON_REPORT_DISCARD,     /* Release reported ranges at once (MADV_DONTNEED) */
+    BALLOON_REPORT_HINT,        /* Let the kernel reclaim them lazily (MADV_FREE) */
+} balloon_report_mode_t;
+
+/* Reporting granularity, one transparent huge page */
+#define BALLOON_REPORT_CHUNK_SIZE   (2u * 1024 * 1024)
+
+/* Chunks handed to the report callback at once */
+#define BALLOON_REPORT_BATCH        32
+
+/* A range of the balloon's address space */
+typedef struct balloon_range {
+    void *addr;                 /* Start of the range */
+    uint64_t length;            /* Length in bytes */
+} balloon_range_t;
+
+/* Free page reporting statistics */
+typedef struct balloon_report_stats {
+    uint64_t passes;            /* Reporting passes run */
+    uint64_t batches;           /* Batches reported */
+    uint64_t reported_bytes;    /* Bytes reported over all passes */
+    uint64_t last_pass_bytes;   /* Bytes reported by the last pass */
+    uint32_t tracked_ranges;    /* Ranges held by the tracking structure */
+} balloon_report_stats_t;
+
+/* Adaptive controller tuning; zero fields take the defaults shown */
+typedef struct balloon_controller_config {
+    uint32_t interval_ms;           /* Minimum time between steps (1000) */
+    uint64_t min_available_bytes;   /* Memory kept available to the guest (1/8 of total) */
+    uint64_t max_balloon_bytes;     /* Largest balloon (physical memory) */
+    uint64_t max_inflate_bytes;     /* Largest inflate per step (64 MB) */
+    uint64_t max_deflate_bytes;     /* Largest deflate per step (256 MB) */
+    uint32_t psi_some_high;         /* PSI some avg10, in hundredths of a percent (1000) */
+    uint32_t major_faults_high;     /* Major faults per second (100) */
+    uint32_t swap_in_high;          /* Pages swapped in per second (100) */
+    uint32_t backoff_ms;            /* Hold-off after pressure, doubled while it lasts (10000) */
+    uint32_t max_backoff_ms;        /* Longest hold-off (300000) */
+} balloon_controller_config_t;
+
+/* Controller state, for monitoring */
+typedef struct balloon_controller_status {
+    uint32_t target_pages;          /* Target of the last step */
+    uint32_t psi_some_avg10;        /* PSI some avg10, in hundredths of a percent */
+    uint64_t major_fault_rate;      /* Major faults per second */
+    uint64_t swap_in_rate;          /* Pages swapped in per second */
+    uint64_t available_bytes;       /* Guest available memory */
+    uint32_t backoff_ms;            /* Current hold-off, 0 when none */
+    uint64_t oom_kills;             /* OOM kills seen since the controller started */
+    bool under_pressure;            /* Last step saw memory pressure */
+} balloon_controller_status_t;
+
 /* Callback for balloon resize requests from host */
 typedef void (*balloon_request_callback_t)(uint64_t target_pages, void *userdata);
 
 /* Callback for statistics reporting */
 typedef void (*balloon_stats_callback_t)(const balloon_stats_t *stats, void *userdata);
 
+/* Callback for a new controller target, only when it changes */
+typedef void (*balloon_target_callback_t)(uint32_t target_pages, void *userdata);
+
+/* Callback for a batch of free ranges, before they are released */
+typedef void (*balloon_report_callback_t)(const balloon_range_t *ranges, uint32_t count,
+                                          void *userdata);
+
 /**
  * Initialize the balloon driver
  *
@@ -160,6 +221,111 @@ int balloon_set_deflate_on_oom(bool enable);
  */
 int balloon_set_free_page_reporting(bool enable);
 
+/**
+ * Select how free pages are reported
+ *
+ * Enabling free page reporting without a mode selects
+ * BALLOON_REPORT_DISCARD.
+ *
+ * @param mode Reporting mode
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_set_report_mode(balloon_report_mode_t mode);
+
+/**
+ * Get the current reporting mode
+ *
+ * @return Reporting mode, BALLOON_REPORT_OFF when disabled
+ */
+balloon_report_mode_t balloon_get_report_mode(void);
+
+/**
+ * Register callback for reported free ranges
+ *
+ * The callback sees each batch while its pages are still populated,
+ * e.g. to pass the ranges on to the host.
+ *
+ * @param callback Callback function
+ * @param userdata User data passed to callback
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_register_report_callback(balloon_report_callback_t callback, void *userdata);
+
+/**
+ * Run one free page reporting pass
+ *
+ * Takes free memory in BALLOON_REPORT_CHUNK_SIZE chunks, reports them
+ * in batches of BALLOON_REPORT_BATCH and releases them again. An eighth
+ * of total memory is always left free.
+ *
+ * @param max_bytes Most memory to report (0 for all free memory)
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_report_free_pages(uint64_t max_bytes);
+
+/**
+ * Get free page reporting statistics
+ *
+ * @param stats Pointer to stats structure to fill
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_get_report_stats(balloon_report_stats_t *stats);
+
+/**
+ * Get the current configuration
+ *
+ * @param config Pointer to configuration structure to fill
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_get_config(balloon_config_t *config);
+
+/**
+ * Start the adaptive balloon controller
+ *
+ * The controller sizes the balloon from guest statistics and PSI
+ * memory pressure: it inflates in small rate-limited steps while memory
+ * is idle, deflates faster under pressure, and backs off after
+ * pressure or an OOM kill. With deflate on OOM enabled, an OOM kill
+ * also releases half the balloon.
+ *
+ * @param config Tuning (can be NULL for defaults)
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_controller_start(const balloon_controller_config_t *config);
+
+/**
+ * Stop the adaptive balloon controller, keeping the balloon as it is
+ */
+void balloon_controller_stop(void);
+
+/**
+ * Run one controller step
+ *
+ * Meant to be called from the caller's loop; returns without sampling
+ * when called before the interval has passed. A changed target is
+ * applied to the balloon and passed to the target callback.
+ *
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_controller_step(void);
+
+/**
+ * Get controller state
+ *
+ * @param status Pointer to status structure to fill
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_controller_get_status(balloon_controller_status_t *status);
+
+/**
+ * Register callback for controller target changes
+ *
+ * @param callback Callback function
+ * @param userdata User data passed to callback
+ * @return BALLOON_OK on success, error code on failure
+ */
+int balloon_register_target_callback(balloon_target_callback_t callback, void *userdata);
+
 /**
  * Get last error message
  *
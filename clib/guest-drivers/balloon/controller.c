@@ -0,0 +1,294 @@
+/**
+ * Zixiao Hypervisor - Adaptive Balloon Controller
+ *
+ * Sizes the balloon from guest statistics and PSI memory pressure, so
+ * the control plane only hears about target changes instead of polling
+ * every guest for raw numbers.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#define _DEFAULT_SOURCE
+
+#include "balloon.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+/* Defaults for zero fields of balloon_controller_config_t */
+#define CTRL_DEFAULT_INTERVAL_MS        1000
+#define CTRL_DEFAULT_MAX_INFLATE        (64ull * 1024 * 1024)
+#define CTRL_DEFAULT_MAX_DEFLATE        (256ull * 1024 * 1024)
+#define CTRL_DEFAULT_PSI_SOME_HIGH      1000    /* 10.00% */
+#define CTRL_DEFAULT_MAJOR_FAULTS_HIGH  100
+#define CTRL_DEFAULT_SWAP_IN_HIGH       100
+#define CTRL_DEFAULT_BACKOFF_MS         10000
+#define CTRL_DEFAULT_MAX_BACKOFF_MS     300000
+
+/* Inflate steps smaller than this are not worth a target change */
+#define CTRL_MIN_INFLATE                (2ull * 1024 * 1024)
+
+/* Controller state */
+static struct {
+    bool running;
+    balloon_controller_config_t config;
+    balloon_controller_status_t status;
+    uint64_t page_size;
+    uint64_t last_step_ms;
+    uint64_t hold_until_ms;
+    uint64_t last_major_faults;
+    uint64_t last_swap_in;
+    uint64_t last_oom_kills;
+    bool have_sample;
+    uint32_t reported_target;
+    balloon_target_callback_t target_callback;
+    void *target_userdata;
+} ctrl_state = {0};
+
+/* Monotonic time in milliseconds */
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* PSI some avg10 in hundredths of a percent, 0 without PSI */
+static uint32_t read_psi_some(void) {
+    uint32_t avg10 = 0;
+#ifdef __linux__
+    char line[256];
+    double value;
+    FILE *fp = fopen("/proc/pressure/memory", "r");
+
+    if (!fp) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "some avg10=%lf", &value) == 1) {
+            avg10 = (uint32_t)(value * 100.0);
+            break;
+        }
+    }
+    fclose(fp);
+#endif
+    return avg10;
+}
+
+/* OOM kills since boot, from /proc/vmstat */
+static uint64_t read_oom_kills(void) {
+    uint64_t kills = 0;
+#ifdef __linux__
+    char line[256];
+    FILE *fp = fopen("/proc/vmstat", "r");
+
+    if (!fp) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "oom_kill %lu", &kills) == 1) {
+            break;
+        }
+    }
+    fclose(fp);
+#endif
+    return kills;
+}
+
+int balloon_controller_start(const balloon_controller_config_t *config) {
+    balloon_controller_config_t *cfg = &ctrl_state.config;
+    balloon_target_callback_t callback = ctrl_state.target_callback;
+    void *userdata = ctrl_state.target_userdata;
+
+    if (!balloon_is_initialized()) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    memset(&ctrl_state, 0, sizeof(ctrl_state));
+    ctrl_state.target_callback = callback;
+    ctrl_state.target_userdata = userdata;
+
+    if (config) {
+        *cfg = *config;
+    }
+
+    if (cfg->max_backoff_ms && cfg->backoff_ms > cfg->max_backoff_ms) {
+        return BALLOON_ERR_INVALID;
+    }
+
+    if (!cfg->interval_ms) cfg->interval_ms = CTRL_DEFAULT_INTERVAL_MS;
+    if (!cfg->max_inflate_bytes) cfg->max_inflate_bytes = CTRL_DEFAULT_MAX_INFLATE;
+    if (!cfg->max_deflate_bytes) cfg->max_deflate_bytes = CTRL_DEFAULT_MAX_DEFLATE;
+    if (!cfg->psi_some_high) cfg->psi_some_high = CTRL_DEFAULT_PSI_SOME_HIGH;
+    if (!cfg->major_faults_high) cfg->major_faults_high = CTRL_DEFAULT_MAJOR_FAULTS_HIGH;
+    if (!cfg->swap_in_high) cfg->swap_in_high = CTRL_DEFAULT_SWAP_IN_HIGH;
+    if (!cfg->backoff_ms) cfg->backoff_ms = CTRL_DEFAULT_BACKOFF_MS;
+    if (!cfg->max_backoff_ms) cfg->max_backoff_ms = CTRL_DEFAULT_MAX_BACKOFF_MS;
+
+#ifdef __linux__
+    ctrl_state.page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+#else
+    ctrl_state.page_size = 4096;
+#endif
+
+    ctrl_state.reported_target = balloon_get_num_pages();
+    ctrl_state.status.target_pages = ctrl_state.reported_target;
+    ctrl_state.running = true;
+    return BALLOON_OK;
+}
+
+void balloon_controller_stop(void) {
+    ctrl_state.running = false;
+}
+
+int balloon_controller_step(void) {
+    balloon_controller_config_t *cfg = &ctrl_state.config;
+    balloon_controller_status_t *st = &ctrl_state.status;
+    balloon_config_t bconfig;
+    balloon_stats_t stats;
+    uint64_t now, elapsed, oom_kills, new_kills;
+    uint64_t min_available, max_balloon, current, target, step;
+    int ret;
+
+    if (!ctrl_state.running) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    now = now_ms();
+    elapsed = now - ctrl_state.last_step_ms;
+    if (ctrl_state.have_sample && elapsed < cfg->interval_ms) {
+        return BALLOON_OK;
+    }
+
+    ret = balloon_get_stats(&stats);
+    if (ret != BALLOON_OK) {
+        return ret;
+    }
+    ret = balloon_get_config(&bconfig);
+    if (ret != BALLOON_OK) {
+        return ret;
+    }
+
+    oom_kills = read_oom_kills();
+    st->psi_some_avg10 = read_psi_some();
+    st->available_bytes = stats.available_memory;
+
+    /* Rates need two samples */
+    if (ctrl_state.have_sample && elapsed) {
+        st->major_fault_rate = (stats.major_faults - ctrl_state.last_major_faults) * 1000 / elapsed;
+        st->swap_in_rate = (stats.swap_in - ctrl_state.last_swap_in) * 1000 / elapsed;
+        new_kills = oom_kills - ctrl_state.last_oom_kills;
+    } else {
+        st->major_fault_rate = 0;
+        st->swap_in_rate = 0;
+        new_kills = 0;
+    }
+
+    ctrl_state.last_major_faults = stats.major_faults;
+    ctrl_state.last_swap_in = stats.swap_in;
+    ctrl_state.last_oom_kills = oom_kills;
+    ctrl_state.last_step_ms = now;
+    ctrl_state.have_sample = true;
+
+    min_available = cfg->min_available_bytes ? cfg->min_available_bytes : stats.total_memory / 8;
+    max_balloon = cfg->max_balloon_bytes ? cfg->max_balloon_bytes : stats.total_memory;
+    current = balloon_get_num_pages();
+    target = current;
+
+    st->under_pressure = st->psi_some_avg10 >= cfg->psi_some_high ||
+                         st->major_fault_rate >= cfg->major_faults_high ||
+                         st->swap_in_rate >= cfg->swap_in_high ||
+                         stats.available_memory < min_available;
+
+    if (new_kills) {
+        /* The guest already lost a process; get well out of the way */
+        st->oom_kills += new_kills;
+        st->backoff_ms = cfg->max_backoff_ms;
+        ctrl_state.hold_until_ms = now + st->backoff_ms;
+        if (bconfig.deflate_on_oom) {
+            target = current / 2;
+        }
+    } else if (st->under_pressure) {
+        /* Cover the shortfall, or a full step when pressure has other causes */
+        step = cfg->max_deflate_bytes;
+        if (stats.available_memory < min_available && min_available - stats.available_memory < step) {
+            step = min_available - stats.available_memory;
+        }
+        step /= ctrl_state.page_size;
+        target = current > step ? current - step : 0;
+
+        st->backoff_ms = st->backoff_ms ? st->backoff_ms * 2 : cfg->backoff_ms;
+        if (st->backoff_ms > cfg->max_backoff_ms) {
+            st->backoff_ms = cfg->max_backoff_ms;
+        }
+        ctrl_state.hold_until_ms = now + st->backoff_ms;
+    } else if (now >= ctrl_state.hold_until_ms) {
+        st->backoff_ms = 0;
+
+        /* Take half of the spare memory, rate limited */
+        if (stats.available_memory > min_available) {
+            step = (stats.available_memory - min_available) / 2;
+            if (step > cfg->max_inflate_bytes) {
+                step = cfg->max_inflate_bytes;
+            }
+            if (step >= CTRL_MIN_INFLATE) {
+                target = current + step / ctrl_state.page_size;
+            }
+        }
+    }
+
+    if (target > max_balloon / ctrl_state.page_size) {
+        target = max_balloon / ctrl_state.page_size;
+    }
+    if (target > UINT32_MAX) {
+        target = UINT32_MAX;
+    }
+
+    if (target != current) {
+        ret = balloon_set_num_pages((uint32_t)target);
+        if (ret != BALLOON_OK) {
+            return ret;
+        }
+    }
+
+    st->target_pages = (uint32_t)target;
+
+    /* Only changes go upward */
+    if (st->target_pages != ctrl_state.reported_target) {
+        ctrl_state.reported_target = st->target_pages;
+        if (ctrl_state.target_callback) {
+            ctrl_state.target_callback(st->target_pages, ctrl_state.target_userdata);
+        }
+    }
+
+    return BALLOON_OK;
+}
+
+int balloon_controller_get_status(balloon_controller_status_t *status) {
+    if (!ctrl_state.running) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    if (!status) {
+        return BALLOON_ERR_INVALID;
+    }
+
+    *status = ctrl_state.status;
+    return BALLOON_OK;
+}
+
+int balloon_register_target_callback(balloon_target_callback_t callback, void *userdata) {
+    if (!balloon_is_initialized()) {
+        return BALLOON_ERR_NOT_INIT;
+    }
+
+    ctrl_state.target_callback = callback;
+    ctrl_state.target_userdata = userdata;
+    return BALLOON_OK;
+}
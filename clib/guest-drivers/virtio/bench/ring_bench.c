@@ -0,0 +1,574 @@
+/**
+ * Zixiao Hypervisor - VirtIO Ring Micro-Benchmark
+ *
+ * Runs the ring code against a simulated device on its own thread, the
+ * way a vhost backend sits on another CPU. The device sleeps until
+ * kicked, consumes chains in order and interrupts the driver following
+ * the negotiated suppression rules, so the kick and interrupt counts are
+ * what a real device would see. The driver keeps a window of requests in
+ * flight and times each one from submission to completion.
+ *
+ * Usage: ring_bench [-n ops] [-q size] [-c chain] [-w window] [-b batch]
+ *                   [-p] [-e] [-i] [-s]
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "virtio.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CHAIN       64      /* Buffers per request */
+#define MAX_BATCH       64      /* Chains per virtio_add_bufs() call */
+#define BUF_SIZE        64      /* Bytes per buffer */
+
+/* Ring layouts as the device sees them (virtio 1.1, 2.7 and 2.8) */
+struct sim_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct sim_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct sim_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+struct sim_event {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
+
+#define F_NEXT          1
+#define F_WRITE         2
+#define F_INDIRECT      4
+#define F_AVAIL         (1 << 7)
+#define F_USED          (1 << 15)
+
+#define AVAIL_F_NO_INTERRUPT    1
+#define USED_F_NO_NOTIFY        1
+
+#define EVENT_ENABLE    0
+#define EVENT_DISABLE   1
+#define EVENT_DESC      2
+
+/* Device config space: the largest queue the device takes */
+typedef struct {
+    uint16_t max_queue_size;
+    uint16_t reserved;
+} sim_config_t;
+
+/* One-shot wakeup between the two sides */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool pending;
+} waiter_t;
+
+typedef struct {
+    virtqueue_t *vq;
+    uint16_t num;
+    bool packed;
+    bool event_idx;
+
+    /* Split */
+    uint16_t avail_idx;         /* Next avail entry to read */
+    uint16_t used_idx;          /* Next used entry to write */
+
+    /* Packed */
+    uint16_t next_avail;        /* Next slot to read and write back */
+    bool avail_wrap;
+    uint32_t used_seq;          /* Slots written back, never wrapping */
+
+    waiter_t kick;
+    bool stop;
+    unsigned long interrupts;
+} sim_device_t;
+
+/* A request and the time it was submitted */
+typedef struct {
+    unsigned char *data;
+    uint64_t start_ns;
+} request_t;
+
+static uint64_t features;
+static sim_config_t config = { .max_queue_size = 32768 };
+static sim_device_t sim;
+static waiter_t irq;
+static unsigned long kicks;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void waiter_init(waiter_t *w) {
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    w->pending = false;
+}
+
+static void waiter_wake(waiter_t *w) {
+    pthread_mutex_lock(&w->lock);
+    w->pending = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait for a wakeup; false once stop is set */
+static bool waiter_wait(waiter_t *w, const bool *stop) {
+    pthread_mutex_lock(&w->lock);
+    while (!w->pending && !__atomic_load_n(stop, __ATOMIC_ACQUIRE)) {
+        pthread_cond_wait(&w->cond, &w->lock);
+    }
+    bool woken = w->pending;
+    w->pending = false;
+    pthread_mutex_unlock(&w->lock);
+    return woken;
+}
+
+/* ============================================================================
+ * Device Operations
+ * ============================================================================ */
+
+static uint64_t sim_get_features(virtio_device_t *dev) {
+    (void)dev;
+    return features;
+}
+
+static void sim_notify(virtio_device_t *dev, uint16_t queue_index) {
+    (void)dev;
+    (void)queue_index;
+    kicks++;
+    waiter_wake(&sim.kick);
+}
+
+static void sim_get_config(virtio_device_t *dev, uint32_t offset, void *buf, uint32_t len) {
+    (void)dev;
+    if (offset + len <= sizeof(config)) {
+        memcpy(buf, (unsigned char *)&config + offset, len);
+    }
+}
+
+static void sim_set_config(virtio_device_t *dev, uint32_t offset, const void *buf, uint32_t len) {
+    (void)dev;
+    if (offset + len <= sizeof(config)) {
+        memcpy((unsigned char *)&config + offset, buf, len);
+    }
+}
+
+static const virtio_device_ops_t sim_ops = {
+    .get_features = sim_get_features,
+    .notify = sim_notify,
+    .get_config = sim_get_config,
+    .set_config = sim_set_config,
+};
+
+/* ============================================================================
+ * Simulated Device
+ * ============================================================================ */
+
+static bool need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+static uint16_t *split_avail(sim_device_t *sd) {
+    return (uint16_t *)sd->vq->avail;
+}
+
+static uint16_t *split_used(sim_device_t *sd) {
+    return (uint16_t *)sd->vq->used;
+}
+
+/* Writable bytes of a split chain, directly or through its indirect table */
+static uint32_t split_chain_len(sim_device_t *sd, uint16_t head) {
+    const struct sim_desc *desc = (const struct sim_desc *)sd->vq->desc;
+    uint16_t i = head;
+    uint32_t len = 0;
+
+    if (desc[head].flags & F_INDIRECT) {
+        desc = (const struct sim_desc *)(uintptr_t)desc[head].addr;
+        i = 0;
+    }
+    for (;;) {
+        if (desc[i].flags & F_WRITE)
+            len += desc[i].len;
+        if (!(desc[i].flags & F_NEXT))
+            return len;
+        i = desc[i].next;
+    }
+}
+
+/* Complete every available split chain; returns the number completed */
+static uint32_t split_process(sim_device_t *sd) {
+    uint16_t *avail = split_avail(sd);
+    uint16_t *used = split_used(sd);
+    struct sim_used_elem *ring = (struct sim_used_elem *)(used + 2);
+    uint16_t avail_idx = __atomic_load_n(&avail[1], __ATOMIC_ACQUIRE);
+    uint16_t old_used = sd->used_idx;
+
+    while (sd->avail_idx != avail_idx) {
+        uint16_t head = avail[2 + sd->avail_idx % sd->num];
+        ring[sd->used_idx % sd->num].id = head;
+        ring[sd->used_idx % sd->num].len = split_chain_len(sd, head);
+        sd->avail_idx++;
+        sd->used_idx++;
+    }
+    if (sd->used_idx == old_used)
+        return 0;
+
+    __atomic_store_n(&used[1], sd->used_idx, __ATOMIC_RELEASE);
+
+    /* The used index goes out before the driver's event is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool interrupt;
+    if (sd->event_idx) {
+        uint16_t used_event = __atomic_load_n(&avail[2 + sd->num], __ATOMIC_RELAXED);
+        interrupt = need_event(used_event, sd->used_idx, old_used);
+    } else {
+        interrupt = !(__atomic_load_n(&avail[0], __ATOMIC_RELAXED) & AVAIL_F_NO_INTERRUPT);
+    }
+    if (interrupt) {
+        sd->interrupts++;
+        waiter_wake(&irq);
+    }
+    return (uint16_t)(sd->used_idx - old_used);
+}
+
+/* Does the driver's event fall inside the used slots [old_seq, new_seq)? */
+static bool packed_event_hit(sim_device_t *sd, uint16_t off_wrap, uint32_t old_seq, uint32_t new_seq) {
+    uint32_t off = off_wrap & 0x7fff;
+    uint32_t wrap = off_wrap >> 15;
+
+    /* The wrap counter starts at 1 and flips every lap */
+    uint32_t lap = old_seq / sd->num;
+    for (uint32_t l = lap ? lap - 1 : 0; l <= lap + 1; l++) {
+        uint32_t seq = l * sd->num + off;
+        if (((l & 1) ^ 1) == wrap && seq >= old_seq && seq < new_seq)
+            return true;
+    }
+    return false;
+}
+
+/* Complete every available packed chain; returns the number completed */
+static uint32_t packed_process(sim_device_t *sd) {
+    struct sim_packed_desc *ring = (struct sim_packed_desc *)sd->vq->packed_desc;
+    struct sim_event *driver_event = (struct sim_event *)sd->vq->driver_event;
+    uint32_t old_seq = sd->used_seq;
+    uint32_t done = 0;
+
+    for (;;) {
+        uint16_t head = sd->next_avail;
+        uint16_t flags = __atomic_load_n(&ring[head].flags, __ATOMIC_ACQUIRE);
+        if (((flags & F_AVAIL) != 0) != sd->avail_wrap || ((flags & F_USED) != 0) == sd->avail_wrap)
+            break;
+
+        uint16_t id = ring[head].id;
+        bool wrap = sd->avail_wrap;
+        uint32_t len = 0;
+        for (;;) {
+            struct sim_packed_desc *d = &ring[sd->next_avail];
+            flags = d->flags;
+            if (flags & F_INDIRECT) {
+                const struct sim_packed_desc *table = (const struct sim_packed_desc *)(uintptr_t)d->addr;
+                for (uint32_t i = 0; i < d->len / sizeof(*table); i++) {
+                    if (table[i].flags & F_WRITE)
+                        len += table[i].len;
+                }
+            } else if (flags & F_WRITE) {
+                len += d->len;
+            }
+            sd->used_seq++;
+            if (++sd->next_avail == sd->num) {
+                sd->next_avail = 0;
+                sd->avail_wrap = !sd->avail_wrap;
+            }
+            if (!(flags & F_NEXT))
+                break;
+        }
+
+        /* In order, the used descriptor goes back in the chain's head slot */
+        ring[head].id = id;
+        ring[head].len = len;
+        __atomic_store_n(&ring[head].flags, (uint16_t)(wrap ? F_AVAIL | F_USED : 0), __ATOMIC_RELEASE);
+        done++;
+    }
+    if (done == 0)
+        return 0;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint16_t event_flags = __atomic_load_n(&driver_event->flags, __ATOMIC_RELAXED);
+    bool interrupt = event_flags == EVENT_ENABLE ||
+                     (event_flags == EVENT_DESC &&
+                      packed_event_hit(sd, __atomic_load_n(&driver_event->off_wrap, __ATOMIC_RELAXED),
+                                       old_seq, sd->used_seq));
+    if (interrupt) {
+        sd->interrupts++;
+        waiter_wake(&irq);
+    }
+    return done;
+}
+
+/* Ask to be kicked (enable) or not (disable) for new chains */
+static void device_notify_enable(sim_device_t *sd, bool enable) {
+    if (sd->packed) {
+        struct sim_event *device_event = (struct sim_event *)sd->vq->device_event;
+        if (enable && sd->event_idx) {
+            device_event->off_wrap = (uint16_t)(sd->next_avail | (sd->avail_wrap ? 0x8000 : 0));
+            __atomic_store_n(&device_event->flags, (uint16_t)EVENT_DESC, __ATOMIC_RELEASE);
+        } else {
+            __atomic_store_n(&device_event->flags, (uint16_t)(enable ? EVENT_ENABLE : EVENT_DISABLE),
+                             __ATOMIC_RELEASE);
+        }
+    } else if (sd->event_idx) {
+        /* A stale avail_event is already passed and suppresses kicks */
+        if (enable) {
+            uint16_t *used = split_used(sd);
+            struct sim_used_elem *ring = (struct sim_used_elem *)(used + 2);
+            __atomic_store_n((uint16_t *)&ring[sd->num], sd->avail_idx, __ATOMIC_RELAXED);
+        }
+    } else {
+        __atomic_store_n(&split_used(sd)[0], (uint16_t)(enable ? 0 : USED_F_NO_NOTIFY),
+                         __ATOMIC_RELAXED);
+    }
+
+    /* Before rechecking for chains the driver added without kicking */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void *device_thread(void *arg) {
+    sim_device_t *sd = arg;
+
+    device_notify_enable(sd, false);
+    while (!__atomic_load_n(&sd->stop, __ATOMIC_ACQUIRE)) {
+        uint32_t done = sd->packed ? packed_process(sd) : split_process(sd);
+        if (done)
+            continue;
+
+        /* Idle: sleep until kicked, unless a chain slipped in */
+        device_notify_enable(sd, true);
+        done = sd->packed ? packed_process(sd) : split_process(sd);
+        if (!done)
+            waiter_wait(&sd->kick, &sd->stop);
+        device_notify_enable(sd, false);
+    }
+    return NULL;
+}
+
+/* ============================================================================
+ * Driver
+ * ============================================================================ */
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, unsigned long count, double p) {
+    unsigned long i = (unsigned long)(p * (double)(count - 1));
+    return sorted[i];
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: ring_bench [-n ops] [-q size] [-c chain] [-w window] [-b batch]\n"
+                    "                  [-p] [-e] [-i] [-s]\n"
+                    "  -n  Requests to complete (default 1000000)\n"
+                    "  -q  Queue size, a power of 2 (default 256)\n"
+                    "  -c  Buffers per request, the first device-readable (default 2)\n"
+                    "  -w  Requests in flight (default: as many as fit)\n"
+                    "  -b  Chains per virtio_add_bufs() call (default 8)\n"
+                    "  -p  Packed ring\n"
+                    "  -e  VIRTIO_F_RING_EVENT_IDX\n"
+                    "  -i  Indirect descriptors\n"
+                    "  -s  Spin on the used ring instead of waiting for interrupts\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    unsigned long ops = 1000000;
+    unsigned long queue_size = 256;
+    unsigned long chain = 2;
+    unsigned long window = 0;
+    unsigned long batch = 8;
+    bool spin = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:c:w:b:peish")) != -1) {
+        switch (opt) {
+            case 'n': ops = strtoul(optarg, NULL, 0); break;
+            case 'q': queue_size = strtoul(optarg, NULL, 0); break;
+            case 'c': chain = strtoul(optarg, NULL, 0); break;
+            case 'w': window = strtoul(optarg, NULL, 0); break;
+            case 'b': batch = strtoul(optarg, NULL, 0); break;
+            case 'p': features |= 1ULL << VIRTIO_F_RING_PACKED; break;
+            case 'e': features |= 1ULL << VIRTIO_F_RING_EVENT_IDX; break;
+            case 'i': features |= 1ULL << VIRTIO_F_RING_INDIRECT_DESC; break;
+            case 's': spin = true; break;
+            default: usage();
+        }
+    }
+    if (ops == 0 || queue_size == 0 || (queue_size & (queue_size - 1)) || chain == 0 ||
+        chain > MAX_CHAIN || batch == 0 || batch > MAX_BATCH)
+        usage();
+
+    virtio_device_t dev;
+    virtio_device_init(&dev, &sim_ops);
+    virtio_negotiate_features(&dev, features);
+
+    sim_config_t cfg;
+    virtio_read_config(&dev, 0, &cfg, sizeof(cfg));
+    if (queue_size > cfg.max_queue_size) {
+        fprintf(stderr, "ring_bench: device takes queues of up to %u entries\n", cfg.max_queue_size);
+        return 1;
+    }
+
+    /* Without indirect tables a request takes one descriptor per buffer */
+    bool indirect = virtio_has_feature(&dev, VIRTIO_F_RING_INDIRECT_DESC) && chain > 1 &&
+                    chain <= VIRTIO_INDIRECT_MAX;
+    unsigned long fit = indirect ? queue_size : queue_size / chain;
+    if (fit == 0) {
+        fprintf(stderr, "ring_bench: a chain of %lu does not fit a queue of %lu\n", chain, queue_size);
+        return 1;
+    }
+    if (window == 0 || window > fit)
+        window = fit;
+
+    virtqueue_t *vq = virtio_create_queue(&dev, 0, (uint16_t)queue_size, NULL, NULL);
+    if (!vq) {
+        fprintf(stderr, "ring_bench: %s\n", virtio_get_last_error());
+        return 1;
+    }
+    virtio_enable_cb(vq, false);
+
+    request_t *requests = calloc(window, sizeof(*requests));
+    request_t **free_reqs = calloc(window, sizeof(*free_reqs));
+    unsigned char *data = calloc(window * chain, BUF_SIZE);
+    uint64_t *latency = calloc(ops, sizeof(*latency));
+    if (!requests || !free_reqs || !data || !latency) {
+        fprintf(stderr, "ring_bench: out of memory\n");
+        return 1;
+    }
+    for (unsigned long i = 0; i < window; i++) {
+        requests[i].data = data + i * chain * BUF_SIZE;
+        free_reqs[i] = &requests[i];
+    }
+    unsigned long num_free = window;
+
+    sim.vq = vq;
+    sim.num = (uint16_t)queue_size;
+    sim.packed = vq->packed;
+    sim.event_idx = vq->event_idx;
+    sim.avail_wrap = true;
+    waiter_init(&sim.kick);
+    waiter_init(&irq);
+
+    pthread_t device;
+    if (pthread_create(&device, NULL, device_thread, &sim) != 0) {
+        fprintf(stderr, "ring_bench: cannot start the device thread\n");
+        return 1;
+    }
+
+    virtio_buf_t bufs[MAX_BATCH][MAX_CHAIN];
+    virtio_chain_t chains[MAX_BATCH];
+    void *cookies[MAX_BATCH];
+    unsigned long submitted = 0, completed = 0;
+    bool no_stop = false;
+
+    uint64_t start = now_ns();
+    while (completed < ops) {
+        /* Keep the window full */
+        while (num_free && submitted < ops) {
+            uint32_t n = 0;
+            uint64_t t = now_ns();
+            while (n < batch && num_free && submitted + n < ops) {
+                request_t *r = free_reqs[--num_free];
+                r->start_ns = t;
+                for (unsigned long i = 0; i < chain; i++) {
+                    bufs[n][i].addr = r->data + i * BUF_SIZE;
+                    bufs[n][i].len = BUF_SIZE;
+                    bufs[n][i].writable = i > 0;
+                }
+                chains[n].bufs = bufs[n];
+                chains[n].num_bufs = (uint32_t)chain;
+                chains[n].cookie = r;
+                n++;
+            }
+
+            int ret = virtio_add_bufs(vq, chains, n);
+            if (ret < 0)
+                ret = 0;
+            for (uint32_t i = (uint32_t)ret; i < n; i++)
+                free_reqs[num_free++] = chains[i].cookie;
+            submitted += (unsigned long)ret;
+            if ((uint32_t)ret < n)
+                break;
+        }
+        virtio_kick(vq);
+
+        int got = virtio_get_bufs(vq, cookies, NULL, MAX_BATCH);
+        if (got > 0) {
+            uint64_t t = now_ns();
+            for (int i = 0; i < got; i++) {
+                request_t *r = cookies[i];
+                latency[completed++] = t - r->start_ns;
+                free_reqs[num_free++] = r;
+            }
+            continue;
+        }
+
+        /* Nothing used: spin, or sleep until the device interrupts */
+        if (spin) {
+            while (!virtio_more_used(vq))
+                ;
+            continue;
+        }
+        virtio_enable_cb(vq, true);
+        if (!virtio_more_used(vq))
+            waiter_wait(&irq, &no_stop);
+        virtio_enable_cb(vq, false);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    __atomic_store_n(&sim.stop, true, __ATOMIC_RELEASE);
+    waiter_wake(&sim.kick);
+    pthread_join(device, NULL);
+
+    qsort(latency, ops, sizeof(*latency), compare_u64);
+    double secs = (double)elapsed / 1e9;
+
+    printf("%s ring, %lu entries, chain %lu%s%s, window %lu, batch %lu%s\n",
+           vq->packed ? "packed" : "split", queue_size, chain, vq->event_idx ? ", event idx" : "",
+           indirect ? ", indirect" : "", window, batch, spin ? ", spinning" : "");
+    printf("  %lu ops in %.3f s: %.3f Mops/s\n", ops, secs, (double)ops / secs / 1e6);
+    printf("  kicks/op %.4f, interrupts/op %.4f\n",
+           (double)kicks / (double)ops, (double)sim.interrupts / (double)ops);
+    printf("  latency ns: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+           (unsigned long long)percentile(latency, ops, 0.50),
+           (unsigned long long)percentile(latency, ops, 0.90),
+           (unsigned long long)percentile(latency, ops, 0.99),
+           (unsigned long long)percentile(latency, ops, 0.999),
+           (unsigned long long)latency[ops - 1]);
+
+    virtio_device_cleanup(&dev);
+    free(latency);
+    free(data);
+    free(free_reqs);
+    free(requests);
+    return 0;
+}
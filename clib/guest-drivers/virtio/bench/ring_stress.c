@@ -0,0 +1,497 @@
+/**
+ * Zixiao Hypervisor - VirtIO Ring Stress Benchmark
+ *
+ * Drives add/complete cycles through one virtqueue against a simulated
+ * device in the same thread. The device completes chains in random
+ * order and checks every chain it reads against what the driver
+ * submitted; the driver checks every completion it gets back. Any
+ * descriptor handed out twice or lost shows up as a mismatch or as a
+ * queue that stops draining. With -o the device completes in order,
+ * checks that descriptors are taken in ring order, and writes back one
+ * used entry per batch: in the batch's first slot, for its last chain.
+ *
+ * Usage: ring_stress [-n cycles] [-q size] [-b batch] [-p] [-i] [-o]
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "virtio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CHAIN       8       /* Buffers per request */
+#define BUF_STRIDE      64      /* Bytes between a request's buffers */
+
+/* Ring layouts as the device sees them (virtio 1.1, 2.7 and 2.8) */
+struct sim_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct sim_packed_desc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct sim_used_elem {
+    uint32_t id;
+    uint32_t len;
+};
+
+#define F_NEXT          1
+#define F_WRITE         2
+#define F_INDIRECT      4
+#define F_AVAIL         (1 << 7)
+#define F_USED          (1 << 15)
+
+/* A submitted request; its buffers live in data */
+typedef struct {
+    uint32_t num_bufs;
+    uint32_t writable_len;      /* Bytes the device reports written */
+    bool in_flight;
+} request_t;
+
+/* A chain the device has read but not completed */
+typedef struct {
+    uint16_t id;                /* Head descriptor or buffer ID */
+    uint16_t slots;             /* Ring slots it occupies (packed) */
+    uint32_t len;
+} pending_t;
+
+typedef struct {
+    virtqueue_t *vq;
+    uint16_t num;
+    bool packed;
+    bool in_order;
+
+    /* Split */
+    uint16_t avail_idx;         /* Next avail entry to read */
+    uint16_t used_idx;          /* Next used entry to write */
+    uint16_t next_desc;         /* In order: head the next chain must start at */
+
+    /* Packed */
+    uint16_t next_avail;        /* Next slot to read */
+    bool avail_wrap;
+    uint16_t next_used;         /* Next slot to write back */
+    bool used_wrap;
+
+    pending_t *pending;
+    uint32_t num_pending;
+} sim_device_t;
+
+static uint64_t features;
+static unsigned char *data;
+static request_t *requests;
+static uint32_t num_requests;
+static uint64_t rng = 0x9e3779b97f4a7c15ULL;
+static unsigned long kicks;
+
+static uint64_t next_random(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static uint64_t sim_get_features(virtio_device_t *dev) {
+    (void)dev;
+    return features;
+}
+
+static void sim_notify(virtio_device_t *dev, uint16_t queue_index) {
+    (void)dev;
+    (void)queue_index;
+    kicks++;
+}
+
+static const virtio_device_ops_t sim_ops = {
+    .get_features = sim_get_features,
+    .notify = sim_notify,
+};
+
+static void fail(const char *what, uint32_t value) {
+    fprintf(stderr, "ring_stress: %s (%u)\n", what, value);
+    exit(1);
+}
+
+static unsigned char *buf_addr(uint32_t req, uint32_t i) {
+    return data + ((size_t)req * MAX_CHAIN + i) * BUF_STRIDE;
+}
+
+static uint32_t buf_len(uint32_t req, uint32_t i) {
+    return 1 + (req + i) % BUF_STRIDE;
+}
+
+/* Buffers after the first are device-writable */
+static bool buf_writable(uint32_t i) {
+    return i > 0;
+}
+
+/* ============================================================================
+ * Simulated Device
+ * ============================================================================ */
+
+/* Check buffer i of the chain; returns the request it belongs to */
+static uint32_t check_buf(uint32_t i, uint64_t addr, uint32_t len, bool writable, uint32_t req) {
+    if (i == 0) {
+        size_t off = (size_t)((unsigned char *)(uintptr_t)addr - data);
+        req = (uint32_t)(off / (MAX_CHAIN * BUF_STRIDE));
+        if (req >= num_requests || !requests[req].in_flight)
+            fail("device read a buffer of no request in flight", req);
+    }
+    if (i >= requests[req].num_bufs || (unsigned char *)(uintptr_t)addr != buf_addr(req, i) ||
+        len != buf_len(req, i) || writable != buf_writable(i))
+        fail("device read a chain that differs from the request", req);
+    return req;
+}
+
+/* Walk a split chain, directly or through its indirect table; slots gets the descriptors it takes */
+static uint32_t read_split_chain(sim_device_t *sd, uint16_t head, uint16_t *slots) {
+    struct sim_desc *desc = (struct sim_desc *)sd->vq->desc;
+    struct sim_desc *d = &desc[head];
+    uint32_t n = 0, req = 0;
+
+    if (d->flags & F_INDIRECT) {
+        struct sim_desc *table = (struct sim_desc *)(uintptr_t)d->addr;
+        uint32_t count = d->len / sizeof(*table);
+        for (uint32_t i = 0; ; i = table[i].next) {
+            if (i >= count)
+                fail("indirect chain leaves its table", head);
+            req = check_buf(n++, table[i].addr, table[i].len, table[i].flags & F_WRITE, req);
+            if (!(table[i].flags & F_NEXT))
+                break;
+        }
+        *slots = 1;
+    } else {
+        for (;;) {
+            req = check_buf(n++, d->addr, d->len, d->flags & F_WRITE, req);
+            if (!(d->flags & F_NEXT))
+                break;
+            if (n > sd->num)
+                fail("descriptor chain loops", head);
+            if (sd->in_order && d->next != (d - desc + 1) % sd->num)
+                fail("in-order chain is not in ring order", head);
+            d = &desc[d->next];
+        }
+        *slots = (uint16_t)n;
+    }
+
+    if (n != requests[req].num_bufs)
+        fail("chain is shorter than the request", req);
+    return requests[req].writable_len;
+}
+
+/* Take every available chain into pending */
+static void device_fetch(sim_device_t *sd) {
+    if (!sd->packed) {
+        uint16_t *avail = (uint16_t *)sd->vq->avail;
+        uint16_t idx = __atomic_load_n(&avail[1], __ATOMIC_ACQUIRE);
+        while (sd->avail_idx != idx) {
+            uint16_t head = avail[2 + sd->avail_idx % sd->num];
+            if (head >= sd->num)
+                fail("avail entry outside the ring", head);
+            if (sd->in_order && head != sd->next_desc)
+                fail("in-order chain does not start at the next descriptor", head);
+            pending_t *p = &sd->pending[sd->num_pending++];
+            uint16_t slots;
+            p->id = head;
+            p->slots = 1;
+            p->len = read_split_chain(sd, head, &slots);
+            sd->next_desc = (uint16_t)((head + slots) % sd->num);
+            sd->avail_idx++;
+        }
+        return;
+    }
+
+    struct sim_packed_desc *ring = (struct sim_packed_desc *)sd->vq->packed_desc;
+    for (;;) {
+        uint16_t flags = __atomic_load_n(&ring[sd->next_avail].flags, __ATOMIC_ACQUIRE);
+        if (((flags & F_AVAIL) != 0) != sd->avail_wrap || ((flags & F_USED) != 0) == sd->avail_wrap)
+            return;
+
+        pending_t *p = &sd->pending[sd->num_pending++];
+        uint32_t n = 0, req = 0;
+        p->id = ring[sd->next_avail].id;
+        p->slots = 0;
+        for (;;) {
+            struct sim_packed_desc *d = &ring[sd->next_avail];
+            flags = d->flags;
+            if (flags & F_INDIRECT) {
+                struct sim_packed_desc *table = (struct sim_packed_desc *)(uintptr_t)d->addr;
+                for (uint32_t i = 0; i < d->len / sizeof(*table); i++)
+                    req = check_buf(n++, table[i].addr, table[i].len, table[i].flags & F_WRITE, req);
+            } else {
+                req = check_buf(n++, d->addr, d->len, flags & F_WRITE, req);
+            }
+            p->slots++;
+            if (++sd->next_avail == sd->num) {
+                sd->next_avail = 0;
+                sd->avail_wrap = !sd->avail_wrap;
+            }
+            if (!(flags & F_NEXT))
+                break;
+        }
+        if (n != requests[req].num_bufs)
+            fail("chain is shorter than the request", req);
+        p->len = requests[req].writable_len;
+    }
+}
+
+/*
+ * Complete the oldest pending chains as one batch with a single used
+ * entry for the last of them, written where the first one's would go
+ * (virtio 1.1, 2.6.9 and 2.7.9)
+ */
+static void device_complete_in_order(sim_device_t *sd, uint32_t max) {
+    uint32_t count = max < sd->num_pending ? max : sd->num_pending;
+    if (count == 0)
+        return;
+    pending_t *last = &sd->pending[count - 1];
+
+    if (!sd->packed) {
+        uint16_t *used = (uint16_t *)sd->vq->used;
+        struct sim_used_elem *ring = (struct sim_used_elem *)(used + 2);
+        ring[sd->used_idx % sd->num].id = last->id;
+        ring[sd->used_idx % sd->num].len = last->len;
+        /* The rest of the batch is left as garbage the driver must not read */
+        for (uint32_t i = 1; i < count; i++) {
+            ring[(sd->used_idx + i) % sd->num].id = UINT32_MAX;
+            ring[(sd->used_idx + i) % sd->num].len = UINT32_MAX;
+        }
+        sd->used_idx += (uint16_t)count;
+        __atomic_store_n(&used[1], sd->used_idx, __ATOMIC_RELEASE);
+    } else {
+        struct sim_packed_desc *d = &((struct sim_packed_desc *)sd->vq->packed_desc)[sd->next_used];
+        d->id = last->id;
+        d->len = last->len;
+        __atomic_store_n(&d->flags, (uint16_t)(sd->used_wrap ? F_AVAIL | F_USED : 0),
+                         __ATOMIC_RELEASE);
+        for (uint32_t i = 0; i < count; i++) {
+            sd->next_used += sd->pending[i].slots;
+            if (sd->next_used >= sd->num) {
+                sd->next_used -= sd->num;
+                sd->used_wrap = !sd->used_wrap;
+            }
+        }
+    }
+
+    sd->num_pending -= count;
+    memmove(sd->pending, sd->pending + count, sd->num_pending * sizeof(pending_t));
+}
+
+/* Complete up to max pending chains, picked at random */
+static void device_complete(sim_device_t *sd, uint32_t max) {
+    if (sd->in_order) {
+        device_complete_in_order(sd, max);
+        return;
+    }
+
+    for (uint32_t done = 0; done < max && sd->num_pending; done++) {
+        uint32_t pick = (uint32_t)(next_random() % sd->num_pending);
+        pending_t p = sd->pending[pick];
+        sd->pending[pick] = sd->pending[--sd->num_pending];
+
+        if (!sd->packed) {
+            uint16_t *used = (uint16_t *)sd->vq->used;
+            struct sim_used_elem *ring = (struct sim_used_elem *)(used + 2);
+            ring[sd->used_idx % sd->num].id = p.id;
+            ring[sd->used_idx % sd->num].len = p.len;
+            __atomic_store_n(&used[1], ++sd->used_idx, __ATOMIC_RELEASE);
+            continue;
+        }
+
+        struct sim_packed_desc *d = &((struct sim_packed_desc *)sd->vq->packed_desc)[sd->next_used];
+        d->id = p.id;
+        d->len = p.len;
+        __atomic_store_n(&d->flags, (uint16_t)(sd->used_wrap ? F_AVAIL | F_USED : 0),
+                         __ATOMIC_RELEASE);
+        sd->next_used += p.slots;
+        if (sd->next_used >= sd->num) {
+            sd->next_used -= sd->num;
+            sd->used_wrap = !sd->used_wrap;
+        }
+    }
+}
+
+/* ============================================================================
+ * Driver
+ * ============================================================================ */
+
+static uint32_t free_request(void) {
+    for (uint32_t tries = 0; tries < num_requests; tries++) {
+        uint32_t req = (uint32_t)(next_random() % num_requests);
+        if (!requests[req].in_flight)
+            return req;
+    }
+    for (uint32_t req = 0; req < num_requests; req++) {
+        if (!requests[req].in_flight)
+            return req;
+    }
+    return UINT32_MAX;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: ring_stress [-n cycles] [-q size] [-b batch] [-p] [-i] [-o]\n"
+                    "  -n  Add/complete cycles (default 5000000)\n"
+                    "  -q  Queue size, a power of 2 (default 256)\n"
+                    "  -b  Chains per virtio_add_bufs() call (default 8)\n"
+                    "  -p  Packed ring\n"
+                    "  -i  Indirect descriptors\n"
+                    "  -o  In-order completion\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    unsigned long cycles = 5000000;
+    unsigned long queue_size = 256;
+    unsigned long batch = 8;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:q:b:pioh")) != -1) {
+        switch (opt) {
+            case 'n': cycles = strtoul(optarg, NULL, 0); break;
+            case 'q': queue_size = strtoul(optarg, NULL, 0); break;
+            case 'b': batch = strtoul(optarg, NULL, 0); break;
+            case 'p': features |= 1ULL << VIRTIO_F_RING_PACKED; break;
+            case 'i': features |= 1ULL << VIRTIO_F_RING_INDIRECT_DESC; break;
+            case 'o': features |= 1ULL << VIRTIO_F_IN_ORDER; break;
+            default: usage();
+        }
+    }
+    if (queue_size == 0 || queue_size > 32768 || batch == 0 || batch > 64)
+        usage();
+
+    virtio_device_t dev;
+    virtio_device_init(&dev, &sim_ops);
+    virtio_negotiate_features(&dev, features);
+
+    virtqueue_t *vq = virtio_create_queue(&dev, 0, (uint16_t)queue_size, NULL, NULL);
+    if (!vq) {
+        fprintf(stderr, "ring_stress: %s\n", virtio_get_last_error());
+        return 1;
+    }
+
+    num_requests = (uint32_t)queue_size;
+    data = calloc((size_t)num_requests * MAX_CHAIN, BUF_STRIDE);
+    requests = calloc(num_requests, sizeof(*requests));
+    sim_device_t sd = {
+        .vq = vq,
+        .num = (uint16_t)queue_size,
+        .packed = vq->packed,
+        .in_order = vq->in_order,
+        .avail_wrap = true,
+        .used_wrap = true,
+        .pending = calloc(queue_size, sizeof(pending_t)),
+    };
+    if (!data || !requests || !sd.pending) {
+        fprintf(stderr, "ring_stress: out of memory\n");
+        return 1;
+    }
+
+    virtio_buf_t bufs[64][MAX_CHAIN];
+    virtio_chain_t chains[64];
+    unsigned long added = 0, completed = 0, idle = 0;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (completed < cycles) {
+        /* Submit a batch of random-length chains */
+        uint32_t n = 0;
+        while (n < batch && added - completed < num_requests) {
+            uint32_t req = free_request();
+            if (req == UINT32_MAX)
+                break;
+            request_t *r = &requests[req];
+            r->num_bufs = 1 + (uint32_t)(next_random() % MAX_CHAIN);
+            r->writable_len = 0;
+            for (uint32_t i = 0; i < r->num_bufs; i++) {
+                bufs[n][i].addr = buf_addr(req, i);
+                bufs[n][i].len = buf_len(req, i);
+                bufs[n][i].writable = buf_writable(i);
+                if (buf_writable(i))
+                    r->writable_len += buf_len(req, i);
+            }
+            r->in_flight = true;
+            chains[n].bufs = bufs[n];
+            chains[n].num_bufs = r->num_bufs;
+            chains[n].cookie = r;
+            n++;
+            added++;
+        }
+
+        int ret = n ? virtio_add_bufs(vq, chains, n) : 0;
+        if (ret < 0) {
+            ret = 0;
+        }
+        /* Chains that did not fit go back */
+        for (uint32_t i = (uint32_t)ret; i < n; i++) {
+            ((request_t *)chains[i].cookie)->in_flight = false;
+            added--;
+        }
+        virtio_kick(vq);
+
+        device_fetch(&sd);
+        device_complete(&sd, 1 + (uint32_t)(next_random() % (2 * batch)));
+
+        void *cookies[64];
+        uint32_t lens[64];
+        int got;
+        idle++;
+        while ((got = virtio_get_bufs(vq, cookies, lens, (uint32_t)batch)) > 0) {
+            for (int i = 0; i < got; i++) {
+                request_t *r = cookies[i];
+                uint32_t req = (uint32_t)(r - requests);
+                if (req >= num_requests || !r->in_flight)
+                    fail("completion of no request in flight", req);
+                if (lens[i] != r->writable_len)
+                    fail("completion length differs", req);
+                r->in_flight = false;
+                completed++;
+            }
+            idle = 0;
+        }
+
+        if (idle > 1000)
+            fail("queue stopped draining, descriptors lost", vq->free_count);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    /* Drain so every descriptor must be back */
+    while (sd.num_pending || added != completed) {
+        device_fetch(&sd);
+        device_complete(&sd, sd.num_pending);
+        request_t *r;
+        uint32_t len;
+        while ((r = virtio_get_buf(vq, &len)) != NULL) {
+            r->in_flight = false;
+            completed++;
+        }
+    }
+    if (vq->free_count != queue_size)
+        fail("descriptors missing after drain", vq->free_count);
+
+    printf("%s ring, %lu entries%s%s, batch %lu: %lu cycles in %.3f s, %.2f Mcycles/s, %lu kicks\n",
+           vq->packed ? "packed" : "split", queue_size,
+           (features & (1ULL << VIRTIO_F_RING_INDIRECT_DESC)) ? ", indirect" : "",
+           vq->in_order ? ", in order" : "",
+           batch, completed, secs, completed / secs / 1e6, kicks);
+
+    virtio_device_cleanup(&dev);
+    free(sd.pending);
+    free(requests);
+    free(data);
+    return 0;
+}
@@ -46,6 +46,19 @@ extern "C" {
 #define VIRTIO_F_SR_IOV             37
 #define VIRTIO_F_NOTIFICATION_DATA  38
 
+/* Longest chain placed in an indirect table; longer ones use ring slots */
+#define VIRTIO_INDIRECT_MAX         32
+
+/* Ring memory on whatever node the allocator picks */
+#define VIRTIO_NUMA_ANY             (-1)
+
+#define VIRTIO_CACHE_LINE           64
+#ifdef __cplusplus
+#define VIRTIO_CACHE_ALIGNED        alignas(VIRTIO_CACHE_LINE)
+#else
+#define VIRTIO_CACHE_ALIGNED        _Alignas(VIRTIO_CACHE_LINE)
+#endif
+
 /* VirtIO status bits */
 #define VIRTIO_STATUS_ACKNOWLEDGE   1
 #define VIRTIO_STATUS_DRIVER        2
@@ -78,6 +91,13 @@ typedef struct virtio_buf {
     bool writable;      /* true if device can write */
 } virtio_buf_t;
 
+/* Buffer chain for batched submission */
+typedef struct virtio_chain {
+    virtio_buf_t *bufs;     /* Buffers of the chain */
+    uint32_t num_bufs;      /* Number of buffers */
+    void *cookie;           /* Cookie for tracking */
+} virtio_chain_t;
+
 /* Completion callback */
 typedef void (*virtio_callback_t)(virtqueue_t *vq, void *userdata);
 
@@ -106,6 +126,9 @@ typedef struct virtio_device_ops {
 
     /* Notify queue */
     void (*notify)(virtio_device_t *dev, uint16_t queue_index);
+
+    /* Route a queue's interrupts to an MSI-X vector (optional) */
+    int (*set_queue_vector)(virtio_device_t *dev, uint16_t queue_index, uint16_t vector);
 } virtio_device_ops_t;
 
 /* VirtIO device structure */
@@ -124,21 +147,43 @@ struct virtio_device {
     void *driver_data;              /* Driver-specific data */
 };
 
-/* Virtqueue structure (opaque) */
+/*
+ * Virtqueue structure (opaque)
+ *
+ * Fields are grouped by who writes them: neither path once the queue is
+ * set up, the add/kick path alone, the completion path alone, and the
+ * free lists, which adds take from and completions return to. Each
+ * written group starts its own cache line, so when a submitting CPU and
+ * a completing CPU share the queue only the free list line moves
+ * between them. The ring memory, the chain state and the indirect
+ * tables are bound to numa_node; this structure is not, and is placed
+ * by whichever CPU creates the queue.
+ */
 struct virtqueue {
     virtio_device_t *dev;           /* Parent device */
     uint16_t index;                 /* Queue index */
     uint16_t num_entries;           /* Number of entries */
-    uint16_t free_count;            /* Free descriptors */
+    int numa_node;                  /* Node of the ring memory, or VIRTIO_NUMA_ANY */
 
     /* Descriptor ring */
     struct vring_desc *desc;
     struct vring_avail *avail;
     struct vring_used *used;
 
-    /* Tracking */
-    uint16_t last_used_idx;
-    void **desc_state;              /* Per-descriptor state */
+    /* Packed ring (VIRTIO_F_RING_PACKED); desc, avail and used stay NULL */
+    bool packed;
+    struct vring_packed_desc *packed_desc;
+    struct vring_packed_desc_event *driver_event;   /* Driver area */
+    struct vring_packed_desc_event *device_event;   /* Device area */
+
+    bool event_idx;                 /* VIRTIO_F_RING_EVENT_IDX negotiated */
+    bool in_order;                  /* VIRTIO_F_IN_ORDER negotiated */
+
+    /* Per head (packed: buffer ID): cookie and chain shape, never read from the ring */
+    struct vring_desc_state *state;
+
+    /* Indirect tables (VIRTIO_F_RING_INDIRECT_DESC), one per head or buffer ID */
+    void *indirect;                 /* num_entries tables of VIRTIO_INDIRECT_MAX */
 
     /* Callback */
     virtio_callback_t callback;
@@ -148,6 +193,35 @@ struct virtqueue {
     uint64_t desc_dma;
     uint64_t avail_dma;
     uint64_t used_dma;
+
+    /* Add and kick */
+    VIRTIO_CACHE_ALIGNED
+    uint16_t next_avail_idx;        /* Packed: next ring slot to fill */
+    uint16_t avail_used_flags;      /* Packed: AVAIL/USED bits of the current wrap */
+    uint16_t num_added;             /* Avail entries (packed: slots) since the last kick */
+
+    /* Free lists: taken by adds, returned by completions */
+    VIRTIO_CACHE_ALIGNED
+    uint16_t free_count;            /* Free descriptors */
+    uint16_t free_head;             /* Free descriptor list, LIFO (in order: ring order) */
+    uint16_t free_id;               /* Packed: head of the free buffer ID list */
+
+    /* Completion */
+    VIRTIO_CACHE_ALIGNED
+    uint16_t last_used_idx;
+    bool used_wrap_counter;         /* Packed: wrap counter last_used_idx expects */
+    bool cb_enabled;                /* Interrupts requested by the driver */
+
+    /* In-order completion (VIRTIO_F_IN_ORDER) */
+    bool in_batch;                  /* Reclaiming a batch the device completed at once */
+    uint16_t batch_last;            /* Head (packed: buffer ID) of its last chain */
+    uint32_t batch_len;             /* Length the device wrote for that chain */
+
+    /* Busy polling (virtio_set_polling) */
+    bool polling;                   /* Interrupts off, completions reaped by virtio_poll() */
+    uint32_t poll_budget;           /* Used ring checks per virtio_poll() call */
+    uint32_t poll_idle_threshold;   /* Idle calls before interrupts return; 0 = never poll */
+    uint32_t poll_idle;             /* Idle calls so far */
 };
 
 /* ============================================================================
@@ -210,6 +284,10 @@ bool virtio_has_feature(virtio_device_t *dev, uint64_t feature);
 /**
  * Create a virtqueue
  *
+ * The queue uses the packed layout when VIRTIO_F_RING_PACKED was
+ * negotiated, the split layout otherwise; the rest of the API is the
+ * same for both.
+ *
  * @param dev Parent device
  * @param index Queue index
  * @param num_entries Number of entries (must be power of 2)
@@ -222,6 +300,26 @@ virtqueue_t *virtio_create_queue(virtio_device_t *dev, uint16_t index,
                                   virtio_callback_t callback,
                                   void *callback_data);
 
+/**
+ * Create a virtqueue with its ring memory on a NUMA node
+ *
+ * The ring and indirect tables are bound to numa_node before they are
+ * first touched; put them on the node of the CPU that submits and
+ * completes. The same as virtio_create_queue() for VIRTIO_NUMA_ANY.
+ *
+ * @param dev Parent device
+ * @param index Queue index
+ * @param num_entries Number of entries (must be power of 2)
+ * @param callback Completion callback
+ * @param callback_data Callback user data
+ * @param numa_node Node for the ring memory, or VIRTIO_NUMA_ANY
+ * @return Created virtqueue or NULL on error
+ */
+virtqueue_t *virtio_create_queue_node(virtio_device_t *dev, uint16_t index,
+                                       uint16_t num_entries,
+                                       virtio_callback_t callback,
+                                       void *callback_data, int numa_node);
+
 /**
  * Destroy a virtqueue
  *
@@ -232,6 +330,10 @@ void virtio_destroy_queue(virtqueue_t *vq);
 /**
  * Add buffers to virtqueue
  *
+ * With VIRTIO_F_RING_INDIRECT_DESC a chain of up to VIRTIO_INDIRECT_MAX
+ * buffers goes in the queue's preallocated indirect table and takes a
+ * single ring slot.
+ *
  * @param vq Virtqueue
  * @param bufs Array of buffers
  * @param num_bufs Number of buffers
@@ -240,18 +342,55 @@ void virtio_destroy_queue(virtqueue_t *vq);
  */
 int virtio_add_buf(virtqueue_t *vq, virtio_buf_t *bufs, uint32_t num_bufs, void *cookie);
 
+/**
+ * Add several buffer chains to virtqueue
+ *
+ * Chains are added in order while they fit and published together
+ * behind a single ordering fence, so RX refill and TX bursts do not pay
+ * a barrier and an index update per chain.
+ *
+ * @param vq Virtqueue
+ * @param chains Array of chains
+ * @param count Number of chains
+ * @return Number of chains added, or negative error code if none fit
+ */
+int virtio_add_bufs(virtqueue_t *vq, const virtio_chain_t *chains, uint32_t count);
+
 /**
  * Get completed buffer from virtqueue
  *
+ * With VIRTIO_F_IN_ORDER the device may complete a batch with one used
+ * entry for its last chain, written in the slot of its first. The chains
+ * before it are reclaimed without reading the ring and report the
+ * writable length they were submitted with.
+ *
  * @param vq Virtqueue
  * @param len Output: bytes written by device
  * @return Cookie from virtio_add_buf, or NULL if none available
  */
 void *virtio_get_buf(virtqueue_t *vq, uint32_t *len);
 
+/**
+ * Get several completed buffers from virtqueue
+ *
+ * Reads the device's used index and re-arms the interrupt once for the
+ * whole call rather than once per buffer.
+ *
+ * @param vq Virtqueue
+ * @param cookies Output: cookies from virtio_add_buf
+ * @param lens Output: bytes written by device (may be NULL)
+ * @param max Size of cookies and lens
+ * @return Number of buffers returned, or negative error code
+ */
+int virtio_get_bufs(virtqueue_t *vq, void **cookies, uint32_t *lens, uint32_t max);
+
 /**
  * Kick the virtqueue (notify device)
  *
+ * With VIRTIO_F_RING_EVENT_IDX the device is notified only if the
+ * buffers added since the last kick pass the index it asked to hear
+ * about, so one kick per batch is enough.
+ *
  * @param vq Virtqueue to kick
  */
 void virtio_kick(virtqueue_t *vq);
@@ -267,18 +406,158 @@ bool virtio_more_used(virtqueue_t *vq);
 /**
  * Enable/disable virtqueue interrupts
  *
+ * A buffer used just before interrupts are enabled raises none; check
+ * virtio_more_used() afterwards.
+ *
  * @param vq Virtqueue
  * @param enable true to enable
  */
 void virtio_enable_cb(virtqueue_t *vq, bool enable);
 
+/**
+ * Enable interrupts once most outstanding buffers are used
+ *
+ * With VIRTIO_F_RING_EVENT_IDX the device interrupts after about three
+ * quarters of the buffers in flight rather than the first, which suits
+ * completions that need no prompt handling such as TX. Otherwise the
+ * same as virtio_enable_cb(vq, true).
+ *
+ * @param vq Virtqueue
+ * @return false if buffers are already used and should be processed now
+ */
+bool virtio_enable_cb_delayed(virtqueue_t *vq);
+
 /**
  * Process virtqueue interrupts
  *
+ * Once polling is set up with virtio_set_polling(), this also disables
+ * interrupts and puts the queue in polling mode.
+ *
  * @param vq Virtqueue
  */
 void virtio_process_queue(virtqueue_t *vq);
 
+/**
+ * Set up busy polling for a queue
+ *
+ * In polling mode, a dedicated thread or budgeted loop calls
+ * virtio_poll() with interrupts off. After idle_threshold polls in a row
+ * find nothing, interrupts come back on and the next one returns the
+ * queue to polling. An idle_threshold of 0 turns polling off.
+ * virtio_poll() and virtio_process_queue() must not run concurrently on
+ * one queue.
+ *
+ * @param vq Virtqueue
+ * @param spin_budget Used ring checks per virtio_poll() before it counts as idle
+ * @param idle_threshold Idle polls before switching back to interrupts
+ * @return VIRTIO_OK on success
+ */
+int virtio_set_polling(virtqueue_t *vq, uint32_t spin_budget, uint32_t idle_threshold);
+
+/**
+ * Poll a queue for completions
+ *
+ * Spins up to the queue's budget waiting for a used buffer and runs the
+ * completion callback until the queue is drained.
+ *
+ * @param vq Virtqueue
+ * @return true while the queue stays in polling mode, false once
+ *         interrupts are back on and the caller should wait for one
+ */
+bool virtio_poll(virtqueue_t *vq);
+
+/* ============================================================================
+ * Queue Sets
+ * ============================================================================ */
+
+/* MSI-X vector value for a queue without interrupts */
+#define VIRTIO_MSI_NO_VECTOR        0xffff
+
+/* Most queues a lane holds: a network receive/transmit pair */
+#define VIRTIO_LANE_MAX_QUEUES      2
+
+/*
+ * One lane of a multi-queue device: a network queue pair (receive first)
+ * or a single block request queue, owned by one submitting thread.
+ */
+typedef struct virtio_lane {
+    virtqueue_t *queues[VIRTIO_LANE_MAX_QUEUES];
+    uint16_t num_queues;
+    int cpu;                        /* CPU the lane is affine to */
+    uint16_t vector;                /* MSI-X vector of its queues, or VIRTIO_MSI_NO_VECTOR */
+    bool claimed;                   /* Owned by a thread (virtio_queue_set_claim) */
+} virtio_lane_t;
+
+typedef struct virtio_queue_set {
+    virtio_device_t *dev;
+    uint16_t num_lanes;
+    virtio_lane_t *lanes;
+    uint16_t num_cpus;
+    uint16_t *cpu_lane;             /* Lane serving each CPU */
+} virtio_queue_set_t;
+
+typedef struct virtio_queue_set_config {
+    uint16_t num_lanes;             /* Lanes wanted; 0 for one per online CPU */
+    uint16_t queue_size;            /* Entries per queue (power of 2) */
+    uint16_t first_vector;          /* Lane i uses first_vector + i; VIRTIO_MSI_NO_VECTOR for none */
+    int numa_node;                  /* Ring memory node, or VIRTIO_NUMA_ANY */
+    virtio_callback_t callback;     /* Completions of every queue in the set */
+    void *callback_data;
+} virtio_queue_set_config_t;
+
+/**
+ * Create the queues of a multi-queue device
+ *
+ * The number of lanes is capped by what the device offers: net
+ * max_virtqueue_pairs with VIRTIO_NET_F_MQ, blk num_queues with
+ * VIRTIO_BLK_F_MQ, one otherwise. Network lanes are a receive/transmit
+ * pair at queue indexes 2i and 2i + 1; other devices have one queue per
+ * lane at index i. Lane i is affine to CPU i and every CPU is mapped to
+ * a lane.
+ *
+ * @param dev Device, with features negotiated
+ * @param config Set configuration
+ * @return Queue set or NULL on error
+ */
+virtio_queue_set_t *virtio_queue_set_create(virtio_device_t *dev,
+                                            const virtio_queue_set_config_t *config);
+
+/**
+ * Destroy a queue set and its queues
+ *
+ * Call before virtio_device_cleanup(), which frees any queues left.
+ *
+ * @param set Queue set
+ */
+void virtio_queue_set_destroy(virtio_queue_set_t *set);
+
+/**
+ * Lane serving a CPU, for routing work or completions
+ *
+ * @param set Queue set
+ * @param cpu CPU number
+ * @return Lane, or NULL for an invalid CPU
+ */
+virtio_lane_t *virtio_queue_set_lane(virtio_queue_set_t *set, int cpu);
+
+/**
+ * Take a lane for the calling thread's exclusive use
+ *
+ * Prefers the lane of the CPU the thread runs on. The owner submits to
+ * its lane's queues without locking until virtio_queue_set_release().
+ *
+ * @param set Queue set
+ * @return Lane, or NULL if every lane is taken
+ */
+virtio_lane_t *virtio_queue_set_claim(virtio_queue_set_t *set);
+
+/**
+ * Give a claimed lane back
+ *
+ * @param lane Lane from virtio_queue_set_claim()
+ */
+void virtio_queue_set_release(virtio_lane_t *lane);
+
 /* ============================================================================
  * Config Space Access
  * ============================================================================ */
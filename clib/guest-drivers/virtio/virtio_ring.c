@@ -5,10 +5,20 @@
  * Licensed under Apache License 2.0
  */
 
+#define _GNU_SOURCE
+
 #include "virtio.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#ifdef __linux__
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 /* VirtIO ring structures (from virtio spec) */
 struct vring_desc {
@@ -43,6 +53,77 @@ struct vring_used {
 
 #define VRING_USED_F_NO_NOTIFY  1
 
+/* Packed ring structures (virtio 1.1) */
+struct vring_packed_desc {
+    uint64_t addr;      /* Buffer address */
+    uint32_t len;       /* Buffer length */
+    uint16_t id;        /* Buffer ID */
+    uint16_t flags;     /* Descriptor flags */
+};
+
+#define VRING_PACKED_DESC_F_AVAIL   (1 << 7)
+#define VRING_PACKED_DESC_F_USED    (1 << 15)
+
+struct vring_packed_desc_event {
+    uint16_t off_wrap;  /* Descriptor offset and wrap counter */
+    uint16_t flags;     /* Event suppression */
+};
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 1
+#define VRING_PACKED_EVENT_FLAG_DESC    2
+
+/* Indirect tables hold descriptors in the ring's own format */
+#define INDIRECT_TABLE_SIZE (sizeof(struct vring_desc) * VIRTIO_INDIRECT_MAX)
+
+/*
+ * Driver-side state of a chain, by head descriptor (split) or buffer ID
+ * (packed). Completions are reclaimed from here without reading back
+ * descriptors the device shares.
+ */
+struct vring_desc_state {
+    void *cookie;
+    uint32_t in_len;    /* Writable bytes in the chain */
+    uint16_t num;       /* Descriptors in the chain */
+    uint16_t link;      /* Split: last descriptor; packed: next free buffer ID */
+};
+
+/*
+ * VIRTIO_F_RING_EVENT_IDX: the driver publishes used_event after the
+ * available ring, the device avail_event after the used ring.
+ */
+static inline uint16_t *vring_used_event(virtqueue_t *vq) {
+    return &vq->avail->ring[vq->num_entries];
+}
+
+static inline uint16_t *vring_avail_event(virtqueue_t *vq) {
+    return (uint16_t *)&vq->used->ring[vq->num_entries];
+}
+
+/* Did moving the index from old_idx to new_idx pass event_idx? */
+static inline bool vring_need_event(uint16_t event_idx, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event_idx - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+/*
+ * Ring memory ordering. The device is another CPU, so CPU fences are
+ * enough: release when publishing an index or head flags, acquire when
+ * reading the device's, and a full barrier only where a store of ours
+ * must be visible before a load of the device's state.
+ */
+#define virtio_mb()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define virtio_store_release(p, v)  __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define virtio_load_acquire(p)      __atomic_load_n((p), __ATOMIC_ACQUIRE)
+
+/* Spin-wait hint; also keeps the compiler from hoisting ring loads out of the loop */
+#if defined(__x86_64__) || defined(__i386__)
+#define virtio_cpu_relax()          __asm__ __volatile__("pause" ::: "memory")
+#elif defined(__aarch64__)
+#define virtio_cpu_relax()          __asm__ __volatile__("yield" ::: "memory")
+#else
+#define virtio_cpu_relax()          __asm__ __volatile__("" ::: "memory")
+#endif
+
 /* Global error string */
 static char virtio_last_error[256] = {0};
 
@@ -57,7 +138,8 @@ static void set_error(const char *fmt, ...) {
 static size_t vring_size(uint16_t num, size_t align) {
     size_t desc_size = sizeof(struct vring_desc) * num;
     size_t avail_size = sizeof(struct vring_avail) + sizeof(uint16_t) * (num + 1);
-    size_t used_size = sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num;
+    size_t used_size = sizeof(struct vring_used) + sizeof(struct vring_used_elem) * num +
+                       sizeof(uint16_t);
 
     size_t size = desc_size;
     size = (size + avail_size + align - 1) & ~(align - 1);
@@ -66,6 +148,13 @@ static size_t vring_size(uint16_t num, size_t align) {
     return size;
 }
 
+/* Packed ring: descriptors, then the driver and device event areas */
+/* The driver and device event areas take a cache line each */
+static size_t vring_packed_size(uint16_t num, size_t align) {
+    size_t size = sizeof(struct vring_packed_desc) * num + 2 * VIRTIO_CACHE_LINE;
+    return (size + align - 1) & ~(align - 1);
+}
+
 /* ============================================================================
  * Device Management
  * ============================================================================ */
@@ -172,70 +261,191 @@ bool virtio_has_feature(virtio_device_t *dev, uint64_t feature) {
  * Virtqueue Management
  * ============================================================================ */
 
+#ifdef __linux__
+#define MPOL_BIND           2
+#define NUMA_MAX_NODES      1024
+#endif
+
+/*
+ * Zeroed, page-aligned memory for the rings and the per-chain state the
+ * hot paths touch. With a node, the pages are bound to it before
+ * anything touches them.
+ */
+static void *ring_alloc(size_t size, int node) {
+    if (node == VIRTIO_NUMA_ANY) {
+        void *mem = aligned_alloc(4096, size);
+        if (!mem) {
+            set_error("Failed to allocate ring memory");
+            return NULL;
+        }
+        memset(mem, 0, size);
+        return mem;
+    }
+
+#ifdef __linux__
+    if (node < 0 || node >= NUMA_MAX_NODES) {
+        set_error("Invalid NUMA node %d", node);
+        return NULL;
+    }
+
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        set_error("Failed to allocate ring memory");
+        return NULL;
+    }
+
+    /* A kernel without NUMA has a single node to place the pages on */
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+    if (syscall(SYS_mbind, mem, size, MPOL_BIND, mask, NUMA_MAX_NODES + 1, 0) != 0 &&
+        errno != ENOSYS) {
+        set_error("Failed to bind ring memory to NUMA node %d", node);
+        munmap(mem, size);
+        return NULL;
+    }
+    return mem;
+#else
+    return ring_alloc(size, VIRTIO_NUMA_ANY);
+#endif
+}
+
+static void ring_free(void *mem, size_t size, int node) {
+    if (!mem) return;
+#ifdef __linux__
+    if (node != VIRTIO_NUMA_ANY) {
+        munmap(mem, size);
+        return;
+    }
+#endif
+    (void)size;
+    (void)node;
+    free(mem);
+}
+
+static size_t ring_mem_size(const virtqueue_t *vq) {
+    return vq->packed ? vring_packed_size(vq->num_entries, 4096)
+                      : vring_size(vq->num_entries, 4096);
+}
+
+static size_t state_mem_size(const virtqueue_t *vq) {
+    return ((size_t)vq->num_entries * sizeof(*vq->state) + 4095) & ~4095UL;
+}
+
+static size_t indirect_mem_size(const virtqueue_t *vq) {
+    return ((size_t)vq->num_entries * INDIRECT_TABLE_SIZE + 4095) & ~4095UL;
+}
+
+static void free_queue(virtqueue_t *vq) {
+    ring_free(vq->indirect, indirect_mem_size(vq), vq->numa_node);
+    ring_free(vq->state, state_mem_size(vq), vq->numa_node);
+    /* The first ring frees the entire ring memory */
+    ring_free(vq->packed ? (void *)vq->packed_desc : (void *)vq->desc, ring_mem_size(vq),
+              vq->numa_node);
+    free(vq);
+}
+
 virtqueue_t *virtio_create_queue(virtio_device_t *dev, uint16_t index,
                                   uint16_t num_entries,
                                   virtio_callback_t callback,
                                   void *callback_data) {
+    return virtio_create_queue_node(dev, index, num_entries, callback, callback_data,
+                                    VIRTIO_NUMA_ANY);
+}
+
+virtqueue_t *virtio_create_queue_node(virtio_device_t *dev, uint16_t index,
+                                       uint16_t num_entries,
+                                       virtio_callback_t callback,
+                                       void *callback_data, int numa_node) {
     if (!dev || num_entries == 0 || (num_entries & (num_entries - 1))) {
         set_error("Invalid parameters or num_entries not power of 2");
         return NULL;
     }
 
-    /* Allocate queue structure */
-    virtqueue_t *vq = calloc(1, sizeof(*vq));
+    /* Allocate queue structure, aligned for its cache line groups */
+    virtqueue_t *vq = aligned_alloc(VIRTIO_CACHE_LINE, sizeof(*vq));
     if (!vq) {
         set_error("Failed to allocate virtqueue");
         return NULL;
     }
+    memset(vq, 0, sizeof(*vq));
 
     vq->dev = dev;
     vq->index = index;
     vq->num_entries = num_entries;
+    vq->numa_node = numa_node;
     vq->free_count = num_entries;
     vq->callback = callback;
     vq->callback_data = callback_data;
 
+    vq->packed = virtio_has_feature(dev, VIRTIO_F_RING_PACKED);
+    vq->event_idx = virtio_has_feature(dev, VIRTIO_F_RING_EVENT_IDX);
+    vq->cb_enabled = true;
+    vq->in_order = virtio_has_feature(dev, VIRTIO_F_IN_ORDER);
+
     /* Allocate vring memory (4KB aligned) */
-    size_t ring_size = vring_size(num_entries, 4096);
-    void *ring_mem = aligned_alloc(4096, ring_size);
+    void *ring_mem = ring_alloc(ring_mem_size(vq), numa_node);
     if (!ring_mem) {
-        set_error("Failed to allocate vring memory");
         free(vq);
         return NULL;
     }
-    memset(ring_mem, 0, ring_size);
 
-    /* Setup ring pointers */
-    vq->desc = (struct vring_desc *)ring_mem;
-    size_t avail_offset = sizeof(struct vring_desc) * num_entries;
-    vq->avail = (struct vring_avail *)((char *)ring_mem + avail_offset);
-    size_t used_offset = (avail_offset + sizeof(struct vring_avail) +
-                          sizeof(uint16_t) * (num_entries + 1) + 4095) & ~4095UL;
-    vq->used = (struct vring_used *)((char *)ring_mem + used_offset);
+    if (vq->packed) {
+        /* Setup ring pointers */
+        vq->packed_desc = (struct vring_packed_desc *)ring_mem;
+        vq->driver_event = (struct vring_packed_desc_event *)(vq->packed_desc + num_entries);
+        vq->device_event = (struct vring_packed_desc_event *)((char *)vq->driver_event +
+                                                              VIRTIO_CACHE_LINE);
 
-    /* Initialize free list */
-    for (uint16_t i = 0; i < num_entries - 1; i++) {
-        vq->desc[i].next = i + 1;
+        /* Both wrap counters start at 1 */
+        vq->avail_used_flags = VRING_PACKED_DESC_F_AVAIL;
+        vq->used_wrap_counter = true;
+    } else {
+        /* Setup ring pointers */
+        vq->desc = (struct vring_desc *)ring_mem;
+        size_t avail_offset = sizeof(struct vring_desc) * num_entries;
+        vq->avail = (struct vring_avail *)((char *)ring_mem + avail_offset);
+        size_t used_offset = (avail_offset + sizeof(struct vring_avail) +
+                              sizeof(uint16_t) * (num_entries + 1) + 4095) & ~4095UL;
+        vq->used = (struct vring_used *)((char *)ring_mem + used_offset);
+
+        /* Initialize free list; the last links back to the first, so in order it is the ring */
+        for (uint16_t i = 0; i < num_entries - 1; i++) {
+            vq->desc[i].next = i + 1;
+        }
+        vq->desc[num_entries - 1].next = 0;
+        vq->free_head = 0;
     }
 
-    /* Allocate descriptor state tracking */
-    vq->desc_state = calloc(num_entries, sizeof(void *));
-    if (!vq->desc_state) {
-        set_error("Failed to allocate descriptor state");
-        free(ring_mem);
-        free(vq);
+    /* Allocate chain state (by buffer ID when packed), read on every completion */
+    vq->state = ring_alloc(state_mem_size(vq), numa_node);
+    if (!vq->state) {
+        free_queue(vq);
         return NULL;
     }
 
+    /* Initialize free buffer ID list */
+    if (vq->packed) {
+        for (uint16_t i = 0; i < num_entries - 1; i++) {
+            vq->state[i].link = i + 1;
+        }
+    }
+
+    /* Indirect tables are taken by the chain's head or buffer ID */
+    if (virtio_has_feature(dev, VIRTIO_F_RING_INDIRECT_DESC)) {
+        vq->indirect = ring_alloc(indirect_mem_size(vq), numa_node);
+        if (!vq->indirect) {
+            free_queue(vq);
+            return NULL;
+        }
+    }
+
     /* Add to device queue list */
     if (index >= dev->num_queues) {
         uint16_t new_count = index + 1;
         virtqueue_t **new_queues = realloc(dev->queues, new_count * sizeof(virtqueue_t *));
         if (!new_queues) {
             set_error("Failed to expand queue array");
-            free(vq->desc_state);
-            free(ring_mem);
-            free(vq);
+            free_queue(vq);
             return NULL;
         }
         for (uint16_t i = dev->num_queues; i < new_count; i++) {
@@ -257,89 +467,512 @@ void virtio_destroy_queue(virtqueue_t *vq) {
         vq->dev->queues[vq->index] = NULL;
     }
 
-    /* Free resources */
-    free(vq->desc_state);
-    free(vq->desc);  /* This frees the entire ring memory */
-    free(vq);
+    free_queue(vq);
 }
 
-int virtio_add_buf(virtqueue_t *vq, virtio_buf_t *bufs, uint32_t num_bufs, void *cookie) {
-    if (!vq || !bufs || num_bufs == 0) {
-        set_error("Invalid parameters");
-        return VIRTIO_ERR_INVALID;
+/* ============================================================================
+ * Indirect Descriptors
+ * ============================================================================ */
+
+/* Chains of one buffer gain nothing from the extra fetch */
+static bool use_indirect(virtqueue_t *vq, uint32_t num_bufs) {
+    return vq->indirect && num_bufs > 1 && num_bufs <= VIRTIO_INDIRECT_MAX;
+}
+
+static void *indirect_table(virtqueue_t *vq, uint16_t slot) {
+    return (char *)vq->indirect + (size_t)slot * INDIRECT_TABLE_SIZE;
+}
+
+/* Descriptors the chain takes from the ring */
+static uint32_t chain_slots(virtqueue_t *vq, uint32_t num_bufs) {
+    return use_indirect(vq, num_bufs) ? 1 : num_bufs;
+}
+
+/* ============================================================================
+ * Packed Ring
+ * ============================================================================ */
+
+/*
+ * The chain takes consecutive slots from next_avail_idx and one buffer
+ * ID. The head's flags make the chain available, so they are returned
+ * for the caller to store once the chain is complete.
+ */
+static uint16_t packed_add_buf(virtqueue_t *vq, virtio_buf_t *bufs, uint32_t num_bufs, void *cookie) {
+    /* In order, a chain's buffer ID is its head slot */
+    uint16_t id = vq->in_order ? vq->next_avail_idx : vq->free_id;
+    uint16_t idx = vq->next_avail_idx;
+    uint16_t head_flags = 0;
+    uint16_t indirect_flag = 0;
+    uint32_t in_len = 0;
+    virtio_buf_t table_buf;
+
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        if (bufs[i].writable) {
+            in_len += bufs[i].len;
+        }
     }
 
-    if (vq->free_count < num_bufs) {
-        set_error("Not enough free descriptors");
-        return VIRTIO_ERR_QUEUE;
+    /* An indirect table is read in order, so only WRITE is meaningful */
+    if (use_indirect(vq, num_bufs)) {
+        struct vring_packed_desc *table = indirect_table(vq, id);
+        for (uint32_t i = 0; i < num_bufs; i++) {
+            table[i].addr = (uint64_t)(uintptr_t)bufs[i].addr;
+            table[i].len = bufs[i].len;
+            table[i].id = 0;
+            table[i].flags = bufs[i].writable ? VRING_DESC_F_WRITE : 0;
+        }
+        table_buf.addr = table;
+        table_buf.len = num_bufs * sizeof(*table);
+        table_buf.writable = false;
+        bufs = &table_buf;
+        num_bufs = 1;
+        indirect_flag = VRING_DESC_F_INDIRECT;
+    }
+
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        struct vring_packed_desc *d = &vq->packed_desc[idx];
+        uint16_t flags = vq->avail_used_flags | indirect_flag;
+        if (bufs[i].writable) {
+            flags |= VRING_DESC_F_WRITE;
+        }
+        if (i < num_bufs - 1) {
+            flags |= VRING_DESC_F_NEXT;
+        }
+
+        d->addr = (uint64_t)(uintptr_t)bufs[i].addr;
+        d->len = bufs[i].len;
+        d->id = id;
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            d->flags = flags;
+        }
+
+        if (++idx >= vq->num_entries) {
+            idx = 0;
+            vq->avail_used_flags ^= VRING_PACKED_DESC_F_AVAIL | VRING_PACKED_DESC_F_USED;
+        }
+    }
+
+    vq->state[id].num = (uint16_t)num_bufs;
+    vq->state[id].in_len = in_len;
+    vq->state[id].cookie = cookie;
+    if (!vq->in_order) {
+        vq->free_id = vq->state[id].link;
+    }
+    vq->next_avail_idx = idx;
+    vq->free_count -= num_bufs;
+    vq->num_added += num_bufs;
+
+    return head_flags;
+}
+
+static inline uint16_t packed_off_wrap(uint16_t idx, bool wrap) {
+    return (uint16_t)(idx | (wrap ? 1u << 15 : 0));
+}
+
+/* The device marks a chain used with AVAIL and USED both equal to its wrap counter */
+static bool packed_more_used(virtqueue_t *vq) {
+    if (vq->in_batch) {
+        return true;  /* The rest of the batch is already used */
+    }
+    uint16_t flags = virtio_load_acquire(&vq->packed_desc[vq->last_used_idx].flags);
+    bool avail = (flags & VRING_PACKED_DESC_F_AVAIL) != 0;
+    bool used = (flags & VRING_PACKED_DESC_F_USED) != 0;
+    return avail == used && used == vq->used_wrap_counter;
+}
+
+/* Detach the used chain at last_used_idx; false if the device returned a bad ID */
+static bool packed_detach(virtqueue_t *vq, void **cookie, uint32_t *len) {
+    uint16_t id;
+    uint32_t used_len;
+
+    if (vq->in_order) {
+        /*
+         * A batch is completed with one used descriptor carrying the ID of
+         * its last chain. IDs are head slots, so the chains before it are
+         * the ones from last_used_idx on.
+         */
+        if (!vq->in_batch) {
+            struct vring_packed_desc *d = &vq->packed_desc[vq->last_used_idx];
+            uint16_t in_flight = vq->num_entries - vq->free_count;
+            uint16_t ahead = (uint16_t)((d->id + vq->num_entries - vq->last_used_idx) % vq->num_entries);
+            if (d->id >= vq->num_entries || ahead >= in_flight) {
+                set_error("Device returned invalid buffer ID %u", d->id);
+                return false;
+            }
+            vq->batch_last = d->id;
+            vq->batch_len = d->len;
+            vq->in_batch = true;
+        }
+
+        id = vq->last_used_idx;
+        if (id == vq->batch_last) {
+            used_len = vq->batch_len;
+            vq->in_batch = false;
+        } else {
+            used_len = vq->state[id].in_len;
+        }
+    } else {
+        struct vring_packed_desc *d = &vq->packed_desc[vq->last_used_idx];
+        id = d->id;
+        if (id >= vq->num_entries) {
+            set_error("Device returned invalid buffer ID %u", id);
+            return false;
+        }
+        used_len = d->len;
     }
 
-    uint16_t head = vq->avail->ring[vq->avail->idx % vq->num_entries];
+    if (len) {
+        *len = used_len;
+    }
+
+    *cookie = vq->state[id].cookie;
+    vq->state[id].cookie = NULL;
+
+    /* Skip the chain's slots and return its buffer ID */
+    uint16_t num = vq->state[id].num;
+    vq->last_used_idx += num;
+    if (vq->last_used_idx >= vq->num_entries) {
+        vq->last_used_idx -= vq->num_entries;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    vq->free_count += num;
+    if (!vq->in_order) {
+        vq->state[id].link = vq->free_id;
+        vq->free_id = id;
+    }
+
+    return true;
+}
+
+/*
+ * The device's event index is a ring offset plus the wrap counter it
+ * belongs to. One from the previous lap is taken back by a ring size, so
+ * the comparison works on a continuous index.
+ */
+static bool packed_need_kick(virtqueue_t *vq) {
+    uint16_t new_idx = vq->next_avail_idx;
+    uint16_t old_idx = (uint16_t)(new_idx - vq->num_added);
+    uint16_t flags = vq->device_event->flags;
+
+    if (!vq->event_idx || flags != VRING_PACKED_EVENT_FLAG_DESC) {
+        return flags != VRING_PACKED_EVENT_FLAG_DISABLE;
+    }
+
+    uint16_t off_wrap = vq->device_event->off_wrap;
+    uint16_t event_idx = off_wrap & 0x7fff;
+    bool wrap = (off_wrap >> 15) != 0;
+    if (wrap != ((vq->avail_used_flags & VRING_PACKED_DESC_F_AVAIL) != 0)) {
+        event_idx -= vq->num_entries;
+    }
+    return vring_need_event(event_idx, new_idx, old_idx);
+}
+
+/* Ask for an interrupt once the device uses the slot delta past last_used_idx */
+static void packed_enable_cb(virtqueue_t *vq, uint16_t delta) {
+    if (vq->event_idx) {
+        uint16_t idx = vq->last_used_idx + delta;
+        bool wrap = vq->used_wrap_counter;
+        if (idx >= vq->num_entries) {
+            idx -= vq->num_entries;
+            wrap = !wrap;
+        }
+        vq->driver_event->off_wrap = packed_off_wrap(idx, wrap);
+        /* Offset before flags */
+        virtio_store_release(&vq->driver_event->flags, (uint16_t)VRING_PACKED_EVENT_FLAG_DESC);
+    } else {
+        vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+}
+
+/* ============================================================================
+ * Buffer Operations
+ * ============================================================================ */
+
+/*
+ * Fill the chain's descriptors and the avail ring entry at avail_idx.
+ * The device sees the entry once avail->idx is published past it.
+ */
+static void split_add_buf(virtqueue_t *vq, virtio_buf_t *bufs, uint32_t num_bufs, void *cookie,
+                          uint16_t avail_idx) {
+    uint16_t head = vq->free_head;
     uint16_t desc_idx = head;
+    uint32_t in_len = 0;
 
     for (uint32_t i = 0; i < num_bufs; i++) {
-        vq->desc[desc_idx].addr = (uint64_t)(uintptr_t)bufs[i].addr;
-        vq->desc[desc_idx].len = bufs[i].len;
-        vq->desc[desc_idx].flags = bufs[i].writable ? VRING_DESC_F_WRITE : 0;
+        if (bufs[i].writable) {
+            in_len += bufs[i].len;
+        }
+    }
 
-        if (i < num_bufs - 1) {
-            vq->desc[desc_idx].flags |= VRING_DESC_F_NEXT;
-            desc_idx = vq->desc[desc_idx].next;
+    if (use_indirect(vq, num_bufs)) {
+        /* The table is a chain of its own, linked in order */
+        struct vring_desc *table = indirect_table(vq, head);
+        for (uint32_t i = 0; i < num_bufs; i++) {
+            table[i].addr = (uint64_t)(uintptr_t)bufs[i].addr;
+            table[i].len = bufs[i].len;
+            table[i].flags = bufs[i].writable ? VRING_DESC_F_WRITE : 0;
+            if (i < num_bufs - 1) {
+                table[i].flags |= VRING_DESC_F_NEXT;
+                table[i].next = (uint16_t)(i + 1);
+            }
+        }
+
+        vq->desc[head].addr = (uint64_t)(uintptr_t)table;
+        vq->desc[head].len = num_bufs * sizeof(*table);
+        vq->desc[head].flags = VRING_DESC_F_INDIRECT;
+        num_bufs = 1;
+    } else {
+        /* The chain is the first num_bufs descriptors of the free list, already linked */
+        for (uint32_t i = 0; i < num_bufs; i++) {
+            vq->desc[desc_idx].addr = (uint64_t)(uintptr_t)bufs[i].addr;
+            vq->desc[desc_idx].len = bufs[i].len;
+            vq->desc[desc_idx].flags = bufs[i].writable ? VRING_DESC_F_WRITE : 0;
+
+            if (i < num_bufs - 1) {
+                vq->desc[desc_idx].flags |= VRING_DESC_F_NEXT;
+                desc_idx = vq->desc[desc_idx].next;
+            }
         }
     }
+    vq->free_head = vq->desc[desc_idx].next;
 
-    /* Store cookie for this chain */
-    vq->desc_state[head] = cookie;
+    /* Store cookie and shape for this chain */
+    vq->state[head].cookie = cookie;
+    vq->state[head].in_len = in_len;
+    vq->state[head].num = (uint16_t)num_bufs;
+    vq->state[head].link = desc_idx;
 
-    /* Update available ring */
-    vq->avail->ring[vq->avail->idx % vq->num_entries] = head;
-    __sync_synchronize();  /* Memory barrier */
-    vq->avail->idx++;
+    vq->avail->ring[avail_idx % vq->num_entries] = head;
 
     vq->free_count -= num_bufs;
+    vq->num_added++;
+}
+
+int virtio_add_buf(virtqueue_t *vq, virtio_buf_t *bufs, uint32_t num_bufs, void *cookie) {
+    if (!vq || !bufs || num_bufs == 0) {
+        set_error("Invalid parameters");
+        return VIRTIO_ERR_INVALID;
+    }
+
+    if (vq->free_count < chain_slots(vq, num_bufs)) {
+        set_error("Not enough free descriptors");
+        return VIRTIO_ERR_QUEUE;
+    }
+
+    if (vq->packed) {
+        uint16_t head = vq->next_avail_idx;
+        uint16_t flags = packed_add_buf(vq, bufs, num_bufs, cookie);
+        virtio_store_release(&vq->packed_desc[head].flags, flags);
+        return VIRTIO_OK;
+    }
+
+    uint16_t avail_idx = vq->avail->idx;
+    split_add_buf(vq, bufs, num_bufs, cookie, avail_idx);
+    virtio_store_release(&vq->avail->idx, (uint16_t)(avail_idx + 1));
 
     return VIRTIO_OK;
 }
 
-void *virtio_get_buf(virtqueue_t *vq, uint32_t *len) {
-    if (!vq) return NULL;
+int virtio_add_bufs(virtqueue_t *vq, const virtio_chain_t *chains, uint32_t count) {
+    if (!vq || !chains || count == 0) {
+        set_error("Invalid parameters");
+        return VIRTIO_ERR_INVALID;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (!chains[i].bufs || chains[i].num_bufs == 0) {
+            set_error("Invalid chain %u", i);
+            return VIRTIO_ERR_INVALID;
+        }
+    }
+
+    /* Take the chains that fit, in order */
+    uint32_t n = 0;
+    uint32_t free_count = vq->free_count;
+    while (n < count && free_count >= chain_slots(vq, chains[n].num_bufs)) {
+        free_count -= chain_slots(vq, chains[n].num_bufs);
+        n++;
+    }
+    if (n == 0) {
+        set_error("Not enough free descriptors");
+        return VIRTIO_ERR_QUEUE;
+    }
 
-    if (vq->last_used_idx == vq->used->idx) {
-        return NULL;  /* No completed buffers */
+    if (vq->packed) {
+        /*
+         * The device stops at the first head it does not see available,
+         * so only the first chain's flags need to be stored last.
+         */
+        uint16_t first = vq->next_avail_idx;
+        uint16_t first_flags = packed_add_buf(vq, chains[0].bufs, chains[0].num_bufs,
+                                              chains[0].cookie);
+        for (uint32_t i = 1; i < n; i++) {
+            uint16_t head = vq->next_avail_idx;
+            vq->packed_desc[head].flags = packed_add_buf(vq, chains[i].bufs, chains[i].num_bufs,
+                                                         chains[i].cookie);
+        }
+        virtio_store_release(&vq->packed_desc[first].flags, first_flags);
+        return (int)n;
     }
 
-    __sync_synchronize();  /* Memory barrier */
+    uint16_t avail_idx = vq->avail->idx;
+    for (uint32_t i = 0; i < n; i++) {
+        split_add_buf(vq, chains[i].bufs, chains[i].num_bufs, chains[i].cookie,
+                      (uint16_t)(avail_idx + i));
+    }
+    virtio_store_release(&vq->avail->idx, (uint16_t)(avail_idx + n));
 
-    struct vring_used_elem *elem = &vq->used->ring[vq->last_used_idx % vq->num_entries];
-    uint32_t id = elem->id;
+    return (int)n;
+}
 
-    if (len) {
-        *len = elem->len;
+/* Detach the chain of used entry last_used_idx; false if the device returned a bad head */
+static bool split_detach(virtqueue_t *vq, void **cookie, uint32_t *len) {
+    uint16_t slot = vq->last_used_idx % vq->num_entries;
+    uint32_t id;
+    uint32_t used_len;
+
+    if (vq->in_order) {
+        /*
+         * A batch is completed with one used entry, in the slot of its
+         * first chain, carrying the head of its last chain. Chains are
+         * used in the order they were made available, so each head is the
+         * one in our own avail ring entry.
+         */
+        id = vq->avail->ring[slot];
+        if (!vq->in_batch) {
+            struct vring_used_elem *elem = &vq->used->ring[slot];
+            uint16_t in_flight = vq->num_entries - vq->free_count;
+            uint32_t ahead = (elem->id + vq->num_entries - id) % vq->num_entries;
+            if (elem->id >= vq->num_entries || ahead >= in_flight) {
+                set_error("Device returned invalid descriptor %u", elem->id);
+                return false;
+            }
+            vq->batch_last = (uint16_t)elem->id;
+            vq->batch_len = elem->len;
+            vq->in_batch = true;
+        }
+
+        if (id == vq->batch_last) {
+            used_len = vq->batch_len;
+            vq->in_batch = false;
+        } else {
+            used_len = vq->state[id].in_len;
+        }
+    } else {
+        struct vring_used_elem *elem = &vq->used->ring[slot];
+        id = elem->id;
+        if (id >= vq->num_entries) {
+            set_error("Device returned invalid descriptor %u", id);
+            return false;
+        }
+        used_len = elem->len;
     }
 
-    void *cookie = vq->desc_state[id];
-    vq->desc_state[id] = NULL;
+    if (len) {
+        *len = used_len;
+    }
 
-    /* Return descriptors to free list */
-    uint16_t desc_idx = id;
-    while (vq->desc[desc_idx].flags & VRING_DESC_F_NEXT) {
-        vq->free_count++;
-        desc_idx = vq->desc[desc_idx].next;
+    struct vring_desc_state *state = &vq->state[id];
+    *cookie = state->cookie;
+    state->cookie = NULL;
+
+    /*
+     * Splice the chain back onto the head of the free list, still linked.
+     * In order, descriptors stay linked in ring order and are taken from
+     * free_head onwards: the ones freed are always the oldest.
+     */
+    vq->free_count += state->num;
+    if (!vq->in_order) {
+        vq->desc[state->link].next = vq->free_head;
+        vq->free_head = (uint16_t)id;
     }
-    vq->free_count++;
 
     vq->last_used_idx++;
+    return true;
+}
+
+/* Keep asking for the next used entry while interrupts are wanted */
+static void rearm_cb(virtqueue_t *vq) {
+    if (!vq->event_idx || !vq->cb_enabled) {
+        return;
+    }
+
+    if (vq->packed) {
+        vq->driver_event->off_wrap = packed_off_wrap(vq->last_used_idx, vq->used_wrap_counter);
+    } else {
+        *vring_used_event(vq) = vq->last_used_idx;
+    }
+    virtio_mb();
+}
 
+void *virtio_get_buf(virtqueue_t *vq, uint32_t *len) {
+    if (!vq) return NULL;
+
+    void *cookie = NULL;
+    if (vq->packed) {
+        if (!packed_more_used(vq) || !packed_detach(vq, &cookie, len)) {
+            return NULL;
+        }
+    } else {
+        /* The entry is read after the index that published it */
+        uint16_t used_idx = virtio_load_acquire(&vq->used->idx);
+        if (vq->last_used_idx == used_idx || !split_detach(vq, &cookie, len)) {
+            return NULL;
+        }
+    }
+
+    rearm_cb(vq);
     return cookie;
 }
 
+int virtio_get_bufs(virtqueue_t *vq, void **cookies, uint32_t *lens, uint32_t max) {
+    if (!vq || !cookies) {
+        set_error("Invalid parameters");
+        return VIRTIO_ERR_INVALID;
+    }
+
+    uint32_t count = 0;
+    if (vq->packed) {
+        while (count < max && packed_more_used(vq) &&
+               packed_detach(vq, &cookies[count], lens ? &lens[count] : NULL)) {
+            count++;
+        }
+    } else {
+        uint16_t used_idx = virtio_load_acquire(&vq->used->idx);
+        while (count < max && vq->last_used_idx != used_idx &&
+               split_detach(vq, &cookies[count], lens ? &lens[count] : NULL)) {
+            count++;
+        }
+    }
+
+    if (count > 0) {
+        rearm_cb(vq);
+    }
+    return (int)count;
+}
+
 void virtio_kick(virtqueue_t *vq) {
     if (!vq || !vq->dev) return;
 
-    __sync_synchronize();  /* Memory barrier */
+    /* Publish the new entries before reading the device's suppression state */
+    virtio_mb();
 
     /* Check if notification is needed */
-    if (!(vq->used->flags & VRING_USED_F_NO_NOTIFY)) {
+    bool needed;
+    if (vq->packed) {
+        needed = packed_need_kick(vq);
+    } else if (vq->event_idx) {
+        uint16_t new_idx = vq->avail->idx;
+        needed = vring_need_event(*vring_avail_event(vq), new_idx,
+                                  (uint16_t)(new_idx - vq->num_added));
+    } else {
+        needed = !(vq->used->flags & VRING_USED_F_NO_NOTIFY);
+    }
+    vq->num_added = 0;
+
+    if (needed) {
         if (vq->dev->ops && vq->dev->ops->notify) {
             vq->dev->ops->notify(vq->dev, vq->index);
         }
@@ -348,23 +981,72 @@ void virtio_kick(virtqueue_t *vq) {
 
 bool virtio_more_used(virtqueue_t *vq) {
     if (!vq) return false;
-    return vq->last_used_idx != vq->used->idx;
+    if (vq->packed) {
+        return packed_more_used(vq);
+    }
+    return vq->last_used_idx != virtio_load_acquire(&vq->used->idx);
 }
 
 void virtio_enable_cb(virtqueue_t *vq, bool enable) {
     if (!vq) return;
 
-    if (enable) {
+    vq->cb_enabled = enable;
+
+    if (vq->packed) {
+        if (enable) {
+            packed_enable_cb(vq, 0);
+        } else {
+            vq->driver_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+        }
+    } else if (vq->event_idx) {
+        /*
+         * The device ignores the flags and interrupts when it passes
+         * used_event. One behind last_used_idx is never passed: at most a
+         * ring's worth of entries are in flight.
+         */
+        *vring_used_event(vq) = enable ? vq->last_used_idx : (uint16_t)(vq->last_used_idx - 1);
+    } else if (enable) {
         vq->avail->flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
     } else {
         vq->avail->flags |= VRING_AVAIL_F_NO_INTERRUPT;
     }
-    __sync_synchronize();
+
+    /* Before the caller checks for entries used meanwhile */
+    virtio_mb();
+}
+
+bool virtio_enable_cb_delayed(virtqueue_t *vq) {
+    if (!vq) return true;
+
+    if (!vq->event_idx) {
+        virtio_enable_cb(vq, true);
+        return !virtio_more_used(vq);
+    }
+
+    vq->cb_enabled = true;
+
+    if (vq->packed) {
+        uint16_t in_flight = vq->num_entries - vq->free_count;
+        packed_enable_cb(vq, (uint16_t)(in_flight * 3 / 4));
+    } else {
+        uint16_t in_flight = (uint16_t)(vq->avail->idx - vq->last_used_idx);
+        *vring_used_event(vq) = (uint16_t)(vq->last_used_idx + in_flight * 3 / 4);
+    }
+    virtio_mb();
+
+    return !virtio_more_used(vq);
 }
 
 void virtio_process_queue(virtqueue_t *vq) {
     if (!vq) return;
 
+    /* With polling set up, the interrupt hands the queue to virtio_poll() */
+    if (vq->poll_idle_threshold && !vq->polling) {
+        virtio_enable_cb(vq, false);
+        vq->polling = true;
+        vq->poll_idle = 0;
+    }
+
     while (virtio_more_used(vq)) {
         if (vq->callback) {
             vq->callback(vq, vq->callback_data);
@@ -372,6 +1054,210 @@ void virtio_process_queue(virtqueue_t *vq) {
     }
 }
 
+int virtio_set_polling(virtqueue_t *vq, uint32_t spin_budget, uint32_t idle_threshold) {
+    if (!vq) {
+        set_error("Invalid parameters");
+        return VIRTIO_ERR_INVALID;
+    }
+
+    vq->poll_budget = spin_budget;
+    vq->poll_idle_threshold = idle_threshold;
+    vq->poll_idle = 0;
+
+    if (idle_threshold == 0 && vq->polling) {
+        vq->polling = false;
+        virtio_enable_cb(vq, true);
+    }
+
+    return VIRTIO_OK;
+}
+
+bool virtio_poll(virtqueue_t *vq) {
+    if (!vq || !vq->polling) return false;
+
+    uint32_t spins = 0;
+    while (!virtio_more_used(vq)) {
+        if (++spins < vq->poll_budget) {
+            virtio_cpu_relax();
+            continue;
+        }
+
+        if (++vq->poll_idle < vq->poll_idle_threshold) {
+            return true;
+        }
+
+        /* Idle long enough: back to interrupts, unless a buffer slipped in */
+        virtio_enable_cb(vq, true);
+        if (!virtio_more_used(vq)) {
+            vq->polling = false;
+            return false;
+        }
+        virtio_enable_cb(vq, false);
+        break;
+    }
+
+    vq->poll_idle = 0;
+    while (virtio_more_used(vq)) {
+        if (vq->callback) {
+            vq->callback(vq, vq->callback_data);
+        }
+    }
+
+    return true;
+}
+
+/* ============================================================================
+ * Queue Sets
+ * ============================================================================ */
+
+/* Device config the queue count comes from (virtio 1.1, 5.1.4 and 5.2.4) */
+#define VIRTIO_NET_F_MQ                 22
+#define VIRTIO_NET_CONFIG_MAX_PAIRS     8
+#define VIRTIO_BLK_F_MQ                 12
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES    34
+
+static uint16_t device_max_lanes(virtio_device_t *dev) {
+    uint16_t max = 1;
+
+    if (dev->device_type == VIRTIO_DEV_NET && virtio_has_feature(dev, VIRTIO_NET_F_MQ)) {
+        virtio_read_config(dev, VIRTIO_NET_CONFIG_MAX_PAIRS, &max, sizeof(max));
+        /* Two queue indexes per pair, and the control queue after them */
+        if (max > 0x7fff) {
+            max = 0x7fff;
+        }
+    } else if (dev->device_type == VIRTIO_DEV_BLK && virtio_has_feature(dev, VIRTIO_BLK_F_MQ)) {
+        virtio_read_config(dev, VIRTIO_BLK_CONFIG_NUM_QUEUES, &max, sizeof(max));
+    }
+    return max ? max : 1;
+}
+
+/* Online CPUs, or every CPU number that may come online */
+static uint16_t cpu_count(bool online) {
+#ifdef __linux__
+    long n = sysconf(online ? _SC_NPROCESSORS_ONLN : _SC_NPROCESSORS_CONF);
+    if (n > 0) {
+        return n > UINT16_MAX ? UINT16_MAX : (uint16_t)n;
+    }
+#else
+    (void)online;
+#endif
+    return 1;
+}
+
+virtio_queue_set_t *virtio_queue_set_create(virtio_device_t *dev,
+                                            const virtio_queue_set_config_t *config) {
+    if (!dev || !config) {
+        set_error("Invalid parameters");
+        return NULL;
+    }
+
+    uint16_t online = cpu_count(true);
+    uint16_t num_lanes = config->num_lanes ? config->num_lanes : online;
+    uint16_t max_lanes = device_max_lanes(dev);
+    if (num_lanes > max_lanes) {
+        num_lanes = max_lanes;
+    }
+    uint16_t per_lane = dev->device_type == VIRTIO_DEV_NET ? 2 : 1;
+
+    virtio_queue_set_t *set = calloc(1, sizeof(*set));
+    if (!set) {
+        set_error("Failed to allocate queue set");
+        return NULL;
+    }
+    set->dev = dev;
+    set->num_lanes = num_lanes;
+    set->num_cpus = cpu_count(false);
+    set->lanes = calloc(num_lanes, sizeof(*set->lanes));
+    set->cpu_lane = calloc(set->num_cpus, sizeof(*set->cpu_lane));
+    if (!set->lanes || !set->cpu_lane) {
+        set_error("Failed to allocate queue set");
+        virtio_queue_set_destroy(set);
+        return NULL;
+    }
+
+    for (uint16_t i = 0; i < num_lanes; i++) {
+        virtio_lane_t *lane = &set->lanes[i];
+        lane->cpu = i % set->num_cpus;
+        lane->vector = config->first_vector == VIRTIO_MSI_NO_VECTOR
+                       ? VIRTIO_MSI_NO_VECTOR : (uint16_t)(config->first_vector + i);
+
+        for (uint16_t q = 0; q < per_lane; q++) {
+            uint16_t index = (uint16_t)(i * per_lane + q);
+            lane->queues[q] = virtio_create_queue_node(dev, index, config->queue_size,
+                                                       config->callback, config->callback_data,
+                                                       config->numa_node);
+            if (!lane->queues[q]) {
+                virtio_queue_set_destroy(set);
+                return NULL;
+            }
+            lane->num_queues++;
+
+            if (lane->vector != VIRTIO_MSI_NO_VECTOR && dev->ops && dev->ops->set_queue_vector &&
+                dev->ops->set_queue_vector(dev, index, lane->vector) != VIRTIO_OK) {
+                set_error("Failed to route queue %u to MSI-X vector %u", index, lane->vector);
+                virtio_queue_set_destroy(set);
+                return NULL;
+            }
+        }
+    }
+
+    /* CPUs beyond the lanes share them round-robin */
+    for (uint16_t cpu = 0; cpu < set->num_cpus; cpu++) {
+        set->cpu_lane[cpu] = cpu % num_lanes;
+    }
+
+    return set;
+}
+
+void virtio_queue_set_destroy(virtio_queue_set_t *set) {
+    if (!set) return;
+
+    if (set->lanes) {
+        for (uint16_t i = 0; i < set->num_lanes; i++) {
+            for (uint16_t q = 0; q < set->lanes[i].num_queues; q++) {
+                virtio_destroy_queue(set->lanes[i].queues[q]);
+            }
+        }
+    }
+    free(set->lanes);
+    free(set->cpu_lane);
+    free(set);
+}
+
+virtio_lane_t *virtio_queue_set_lane(virtio_queue_set_t *set, int cpu) {
+    if (!set || cpu < 0 || cpu >= set->num_cpus) return NULL;
+    return &set->lanes[set->cpu_lane[cpu]];
+}
+
+virtio_lane_t *virtio_queue_set_claim(virtio_queue_set_t *set) {
+    if (!set) return NULL;
+
+    uint16_t first = 0;
+#ifdef __linux__
+    int cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < set->num_cpus) {
+        first = set->cpu_lane[cpu];
+    }
+#endif
+
+    for (uint16_t i = 0; i < set->num_lanes; i++) {
+        virtio_lane_t *lane = &set->lanes[(first + i) % set->num_lanes];
+        bool expected = false;
+        if (__atomic_compare_exchange_n(&lane->claimed, &expected, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return lane;
+        }
+    }
+
+    set_error("Every lane is claimed");
+    return NULL;
+}
+
+void virtio_queue_set_release(virtio_lane_t *lane) {
+    if (!lane) return;
+    __atomic_store_n(&lane->claimed, false, __ATOMIC_RELEASE);
+}
+
 /* ============================================================================
  * Config Space Access
  * ============================================================================ */
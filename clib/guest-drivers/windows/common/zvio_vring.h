@@ -0,0 +1,196 @@
+/*
+ * Zixiao VirtIO Drivers - Shared Split Virtqueue
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Ring layout and hot-path ring operations shared by zviopci, zvioblk,
+ * zvionet and zviobln. The drivers allocate, lock and track their
+ * queues in their own framework (KMDF, StorPort, NDIS), so only the
+ * ring protocol lives here, as macros that expand inline in each
+ * driver's submit and completion paths.
+ *
+ * The macros take any queue structure with the standard fields:
+ *
+ *   Desc, Avail, Used, Size           ring pointers and entry count
+ *   LastUsedIdx                       next used entry to reap
+ *   KickedAvailIdx                    avail index at the last kick
+ *   EventIdx, InOrder                 negotiated ring features
+ *   InBatch, BatchLast, BatchLen      in-order batch being reaped
+ *   InterruptsOff                     interrupts disabled by the driver
+ *
+ * The caller holds the queue lock unless noted otherwise.
+ */
+
+#pragma once
+
+//
+// Descriptor Flags
+//
+#define VRING_DESC_F_NEXT       1   // Buffer continues via 'next'
+#define VRING_DESC_F_WRITE      2   // Buffer is write-only (device writes)
+#define VRING_DESC_F_INDIRECT   4   // Buffer contains list of descriptors
+
+//
+// Ring Structures (VirtIO 1.0 spec section 2.6)
+//
+#pragma pack(push, 1)
+typedef struct _VRING_DESC {
+    ULONGLONG   Addr;               // Physical address
+    ULONG       Len;                // Length in bytes
+    USHORT      Flags;              // VRING_DESC_F_*
+    USHORT      Next;               // Next descriptor index
+} VRING_DESC, *PVRING_DESC;
+
+typedef struct _VRING_AVAIL {
+    USHORT      Flags;              // VRING_AVAIL_F_*
+    USHORT      Idx;                // Next available index
+    USHORT      Ring[1];            // Variable size
+    // Followed by: USHORT UsedEvent; (if VIRTIO_F_RING_EVENT_IDX)
+} VRING_AVAIL, *PVRING_AVAIL;
+
+typedef struct _VRING_USED_ELEM {
+    ULONG       Id;                 // Index of used descriptor chain
+    ULONG       Len;                // Total bytes written
+} VRING_USED_ELEM, *PVRING_USED_ELEM;
+
+typedef struct _VRING_USED {
+    USHORT          Flags;          // VRING_USED_F_*
+    USHORT          Idx;            // Next used index
+    VRING_USED_ELEM Ring[1];        // Variable size
+    // Followed by: USHORT AvailEvent; (if VIRTIO_F_RING_EVENT_IDX)
+} VRING_USED, *PVRING_USED;
+#pragma pack(pop)
+
+#define VRING_AVAIL_F_NO_INTERRUPT  1
+#define VRING_USED_F_NO_NOTIFY      1
+
+//
+// Ring part sizes, including the event index words
+//
+#define ZVIO_VRING_DESC_SIZE(Num)   (sizeof(VRING_DESC) * (Num))
+#define ZVIO_VRING_AVAIL_SIZE(Num)  (sizeof(USHORT) * (3 + (Num)))
+#define ZVIO_VRING_USED_SIZE(Num)   (sizeof(USHORT) * 3 + sizeof(VRING_USED_ELEM) * (Num))
+
+//
+// VIRTIO_F_RING_EVENT_IDX: the driver publishes UsedEvent after the
+// available ring, the device AvailEvent after the used ring
+//
+#define VRING_USED_EVENT(Queue)     ((Queue)->Avail->Ring[(Queue)->Size])
+#define VRING_AVAIL_EVENT(Queue)    (*(volatile USHORT *)&(Queue)->Used->Ring[(Queue)->Size])
+#define VRING_NEED_EVENT(EventIdx, NewIdx, OldIdx) \
+    ((USHORT)((NewIdx) - (EventIdx) - 1) < (USHORT)((NewIdx) - (OldIdx)))
+
+//
+// ZVIO_VRING_PUBLISH - Make a built chain available to the device
+//
+#define ZVIO_VRING_PUBLISH(Queue, Head) \
+    do { \
+        (Queue)->Avail->Ring[(Queue)->Avail->Idx & ((Queue)->Size - 1)] = (Head); \
+        KeMemoryBarrier(); \
+        (Queue)->Avail->Idx++; \
+    } while (0)
+
+//
+// ZVIO_VRING_PREPARE_KICK - Whether the entries published since the
+// last kick need a notification
+//
+// With VIRTIO_F_RING_EVENT_IDX the device is notified only when they
+// pass its AvailEvent, so a batch costs one notification. The caller
+// writes the doorbell after dropping the lock.
+//
+#define ZVIO_VRING_PREPARE_KICK(Queue, Notify) \
+    do { \
+        USHORT _newIdx, _oldIdx; \
+        /* Publish the new entries before reading the suppression state */ \
+        KeMemoryBarrier(); \
+        _newIdx = (Queue)->Avail->Idx; \
+        _oldIdx = (Queue)->KickedAvailIdx; \
+        (Queue)->KickedAvailIdx = _newIdx; \
+        if ((Queue)->EventIdx) { \
+            (Notify) = VRING_NEED_EVENT(VRING_AVAIL_EVENT(Queue), _newIdx, _oldIdx); \
+        } else { \
+            (Notify) = !((Queue)->Used->Flags & VRING_USED_F_NO_NOTIFY); \
+        } \
+    } while (0)
+
+//
+// ZVIO_VRING_SET_INTERRUPTS - Ask for or suppress used interrupts
+//
+// With VIRTIO_F_RING_EVENT_IDX the device ignores the ring flags and
+// interrupts when its used index passes UsedEvent. Enabling asks for
+// the next used entry; one behind LastUsedIdx is never passed, since
+// at most a ring's worth of entries are in flight.
+//
+#define ZVIO_VRING_SET_INTERRUPTS(Queue, Enable) \
+    do { \
+        (Queue)->InterruptsOff = !(Enable); \
+        if ((Queue)->EventIdx) { \
+            VRING_USED_EVENT(Queue) = (Enable) ? (Queue)->LastUsedIdx : \
+                                                 (USHORT)((Queue)->LastUsedIdx - 1); \
+        } else if (Enable) { \
+            (Queue)->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT; \
+        } else { \
+            (Queue)->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT; \
+        } \
+        KeMemoryBarrier(); \
+    } while (0)
+
+//
+// ZVIO_VRING_HAS_USED - Whether used entries are waiting
+//
+// Safe without the lock; a stale answer only costs one extra pass.
+//
+#define ZVIO_VRING_HAS_USED(Queue) \
+    ((Queue)->LastUsedIdx != *(volatile USHORT *)&(Queue)->Used->Idx)
+
+//
+// ZVIO_VRING_POP_USED - Take the next used entry
+//
+// Sets Head to its chain head and Length to the bytes the device
+// wrote. With VIRTIO_F_IN_ORDER the device may complete a batch with
+// one used entry, in the slot of its first chain, carrying the head of
+// its last chain (VirtIO 1.1 section 2.7.9). The chains of the batch
+// are found in our own avail ring, and LengthKnown is cleared for all
+// but the last so the caller can sum the writable descriptors instead.
+// Check ZVIO_VRING_HAS_USED first.
+//
+#define ZVIO_VRING_POP_USED(Queue, Head, Length, LengthKnown) \
+    do { \
+        USHORT _usedIdx = (Queue)->LastUsedIdx & ((Queue)->Size - 1); \
+        (LengthKnown) = TRUE; \
+        if ((Queue)->InOrder) { \
+            if (!(Queue)->InBatch) { \
+                /* Read the entry after the index that published it */ \
+                KeMemoryBarrier(); \
+                (Queue)->BatchLast = (USHORT)(Queue)->Used->Ring[_usedIdx].Id; \
+                (Queue)->BatchLen = (Queue)->Used->Ring[_usedIdx].Len; \
+                (Queue)->InBatch = TRUE; \
+            } \
+            (Head) = (Queue)->Avail->Ring[_usedIdx]; \
+            if ((Head) == (Queue)->BatchLast) { \
+                (Length) = (Queue)->BatchLen; \
+                (Queue)->InBatch = FALSE; \
+            } else { \
+                (Length) = 0; \
+                (LengthKnown) = FALSE; \
+            } \
+        } else { \
+            /* Read the entry after the index that published it */ \
+            KeMemoryBarrier(); \
+            (Head) = (USHORT)(Queue)->Used->Ring[_usedIdx].Id; \
+            (Length) = (Queue)->Used->Ring[_usedIdx].Len; \
+        } \
+        (Queue)->LastUsedIdx++; \
+    } while (0)
+
+//
+// ZVIO_VRING_ASK_NEXT - Keep asking for the next used entry
+//
+#define ZVIO_VRING_ASK_NEXT(Queue) \
+    do { \
+        if ((Queue)->EventIdx && !(Queue)->InterruptsOff) { \
+            VRING_USED_EVENT(Queue) = (Queue)->LastUsedIdx; \
+            KeMemoryBarrier(); \
+        } \
+    } while (0)
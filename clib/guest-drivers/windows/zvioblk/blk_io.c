@@ -199,8 +199,6 @@ ZvioBlkEvtIoDeviceControl(
 
     PAGED_CODE();
 
-    UNREFERENCED_PARAMETER(InputBufferLength);
-
     deviceContext = ZvioBlkGetDeviceContext(WdfIoQueueGetDevice(Queue));
 
     ZvioBlkDbgPrint("IOCTL: code=0x%08X", IoControlCode);
@@ -332,14 +330,178 @@ ZvioBlkEvtIoDeviceControl(
     case IOCTL_DISK_FLUSH_CACHE:
     case IOCTL_STORAGE_FLUSH_CACHE:
         if (deviceContext->SupportsFlush && !deviceContext->ReadOnly) {
-            status = ZvioBlkSubmitRequest(
-                deviceContext,
-                Request,
-                VIRTIO_BLK_T_FLUSH,
-                0,
-                NULL,
-                0
-                );
+            status = ZvioBlkSubmitFlush(deviceContext, Request);
+            if (NT_SUCCESS(status)) {
+                // Request will be completed asynchronously
+                return;
+            }
+        }
+        break;
+
+    case IOCTL_DISK_GET_CACHE_INFORMATION:
+        {
+            PDISK_CACHE_INFORMATION cacheInfo;
+
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(DISK_CACHE_INFORMATION), &outputBuffer, NULL);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            cacheInfo = (PDISK_CACHE_INFORMATION)outputBuffer;
+            RtlZeroMemory(cacheInfo, sizeof(DISK_CACHE_INFORMATION));
+            cacheInfo->ReadCacheEnabled = TRUE;
+            cacheInfo->WriteCacheEnabled = deviceContext->WriteCache;
+            cacheInfo->ReadRetentionPriority = EqualPriority;
+            cacheInfo->WriteRetentionPriority = EqualPriority;
+            bytesReturned = sizeof(DISK_CACHE_INFORMATION);
+        }
+        break;
+
+    case IOCTL_DISK_SET_CACHE_INFORMATION:
+        {
+            PDISK_CACHE_INFORMATION cacheInfo;
+
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(DISK_CACHE_INFORMATION),
+                                                   (PVOID*)&cacheInfo, NULL);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            // Only the write cache mode can be changed
+            status = ZvioBlkSetWriteCache(deviceContext, cacheInfo->WriteCacheEnabled != FALSE);
+        }
+        break;
+
+    case IOCTL_ZVIOBLK_QUERY_STATS:
+        if (OutputBufferLength < sizeof(ZVIOBLK_STATS)) {
+            status = STATUS_BUFFER_TOO_SMALL;
+            break;
+        }
+
+        status = WdfRequestRetrieveOutputBuffer(Request, sizeof(ZVIOBLK_STATS), &outputBuffer, NULL);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+
+        ZvioBlkStatsQuery(deviceContext, (PZVIOBLK_STATS)outputBuffer);
+        bytesReturned = sizeof(ZVIOBLK_STATS);
+        break;
+
+    case IOCTL_STORAGE_QUERY_PROPERTY:
+        {
+            PSTORAGE_PROPERTY_QUERY query;
+            PDEVICE_TRIM_DESCRIPTOR trimDescriptor;
+
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(STORAGE_PROPERTY_QUERY), (PVOID*)&query, NULL);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            // Only TRIM is answered here
+            if (query->PropertyId != StorageDeviceTrimProperty) {
+                status = STATUS_INVALID_DEVICE_REQUEST;
+                break;
+            }
+
+            if (query->QueryType == PropertyExistsQuery) {
+                break;
+            }
+            if (query->QueryType != PropertyStandardQuery) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+
+            if (OutputBufferLength < sizeof(DEVICE_TRIM_DESCRIPTOR)) {
+                status = STATUS_BUFFER_TOO_SMALL;
+                break;
+            }
+
+            status = WdfRequestRetrieveOutputBuffer(Request, sizeof(DEVICE_TRIM_DESCRIPTOR), &outputBuffer, NULL);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            trimDescriptor = (PDEVICE_TRIM_DESCRIPTOR)outputBuffer;
+            RtlZeroMemory(trimDescriptor, sizeof(DEVICE_TRIM_DESCRIPTOR));
+            trimDescriptor->Version = sizeof(DEVICE_TRIM_DESCRIPTOR);
+            trimDescriptor->Size = sizeof(DEVICE_TRIM_DESCRIPTOR);
+            trimDescriptor->TrimEnabled = (ZvioBlkTrimType(deviceContext) != 0);
+            bytesReturned = sizeof(DEVICE_TRIM_DESCRIPTOR);
+        }
+        break;
+
+    case IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES:
+        {
+            PDEVICE_MANAGE_DATA_SET_ATTRIBUTES dsm;
+            PDEVICE_DATA_SET_RANGE dataSetRanges;
+            DEVICE_DATA_SET_RANGE entireRange;
+            ULONG numRanges;
+            BOOLEAN trim;
+            ULONG i;
+
+            status = WdfRequestRetrieveInputBuffer(Request, sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES),
+                                                   (PVOID*)&dsm, NULL);
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            switch (dsm->Action) {
+            case DeviceDsmAction_Trim:
+                trim = TRUE;
+                if (ZvioBlkTrimType(deviceContext) == 0) {
+                    status = STATUS_INVALID_DEVICE_REQUEST;
+                }
+                break;
+#ifdef DeviceDsmAction_WriteZeroes
+            case DeviceDsmAction_WriteZeroes:
+                trim = FALSE;
+                if (!deviceContext->SupportsWriteZeroes || deviceContext->ReadOnly) {
+                    status = STATUS_INVALID_DEVICE_REQUEST;
+                }
+                break;
+#endif
+            default:
+                trim = FALSE;
+                status = STATUS_INVALID_DEVICE_REQUEST;
+                break;
+            }
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            if (dsm->Flags & DEVICE_DSM_FLAG_ENTIRE_DATA_SET_RANGE) {
+                entireRange.StartingOffset = 0;
+                entireRange.LengthInBytes = deviceContext->Capacity * 512;
+                dataSetRanges = &entireRange;
+                numRanges = 1;
+            } else {
+                if (dsm->DataSetRangesOffset < sizeof(DEVICE_MANAGE_DATA_SET_ATTRIBUTES) ||
+                    dsm->DataSetRangesOffset > InputBufferLength ||
+                    dsm->DataSetRangesLength > InputBufferLength - dsm->DataSetRangesOffset ||
+                    dsm->DataSetRangesOffset % TYPE_ALIGNMENT(DEVICE_DATA_SET_RANGE) != 0) {
+                    status = STATUS_INVALID_PARAMETER;
+                    break;
+                }
+                dataSetRanges = (PDEVICE_DATA_SET_RANGE)((PUCHAR)dsm + dsm->DataSetRangesOffset);
+                numRanges = dsm->DataSetRangesLength / sizeof(DEVICE_DATA_SET_RANGE);
+            }
+
+            //
+            // Zeroing must cover exactly what was asked; TRIM may fall short
+            //
+            for (i = 0; i < numRanges && !trim; i++) {
+                if (dataSetRanges[i].StartingOffset < 0 ||
+                    dataSetRanges[i].StartingOffset % deviceContext->SectorSize != 0 ||
+                    dataSetRanges[i].LengthInBytes % deviceContext->SectorSize != 0) {
+                    status = STATUS_INVALID_PARAMETER;
+                    break;
+                }
+            }
+            if (!NT_SUCCESS(status)) {
+                break;
+            }
+
+            status = ZvioBlkSubmitRanges(deviceContext, Request, trim, dataSetRanges, numRanges);
             if (NT_SUCCESS(status)) {
                 // Request will be completed asynchronously
                 return;
@@ -356,8 +518,104 @@ ZvioBlkEvtIoDeviceControl(
     WdfRequestCompleteWithInformation(Request, status, bytesReturned);
 }
 
+/*
+ * ZvioBlkSelectQueue - Request queue of the submitting processor
+ */
+static PZVIOBLK_VIRTQUEUE
+ZvioBlkSelectQueue(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    ULONG processor = KeGetCurrentProcessorNumberEx(NULL);
+    USHORT index;
+
+    if (processor < ZVIOBLK_MAX_PROCESSORS) {
+        index = DeviceContext->ProcessorQueue[processor];
+    } else {
+        index = (USHORT)(processor % DeviceContext->NumQueues);
+    }
+
+    return DeviceContext->Queues[index];
+}
+
+/*
+ * ZvioBlkBuildSgList - Map part of a transfer's MDL for the device
+ *
+ * Starts Offset bytes into the transfer and merges physically
+ * contiguous pages up to the device's segment size. When MaxElements
+ * run out first, the list is cut back to a sector boundary. Returns
+ * the bytes mapped.
+ */
+static ULONG
+ZvioBlkBuildSgList(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PMDL Mdl,
+    _In_ ULONG Offset,
+    _In_ ULONG Length,
+    _Out_ PSCATTER_GATHER_LIST SgList,
+    _In_ ULONG MaxElements
+    )
+{
+    PPFN_NUMBER pfns = MmGetMdlPfnArray(Mdl);
+    ULONG position = MmGetMdlByteOffset(Mdl) + Offset;
+    ULONG remaining = Length - Offset;
+    ULONG mapped = 0;
+    ULONG count = 0;
+    ULONG excess;
+
+    while (remaining > 0) {
+        ULONG pageOffset = position & (PAGE_SIZE - 1);
+        ULONG chunk = min(PAGE_SIZE - pageOffset, remaining);
+        ULONGLONG addr = ((ULONGLONG)pfns[position >> PAGE_SHIFT] << PAGE_SHIFT) + pageOffset;
+        PSCATTER_GATHER_ELEMENT last = count ? &SgList->Elements[count - 1] : NULL;
+
+        if (last && (ULONGLONG)last->Address.QuadPart + last->Length == addr &&
+            (ULONGLONG)last->Length + chunk <= DeviceContext->MaxSegmentSize) {
+            last->Length += chunk;
+        } else if (count < MaxElements) {
+            SgList->Elements[count].Address.QuadPart = addr;
+            SgList->Elements[count].Length = chunk;
+            count++;
+        } else {
+            break;
+        }
+
+        position += chunk;
+        remaining -= chunk;
+        mapped += chunk;
+    }
+
+    //
+    // Only the last piece of a transfer may end off a sector boundary
+    //
+    excess = (remaining > 0) ? mapped % DeviceContext->SectorSize : 0;
+    mapped -= excess;
+
+    while (excess > 0 && count > 0) {
+        PSCATTER_GATHER_ELEMENT last = &SgList->Elements[count - 1];
+        ULONG trim = min(excess, last->Length);
+
+        last->Length -= trim;
+        excess -= trim;
+        if (last->Length == 0) {
+            count--;
+        }
+    }
+
+    SgList->NumberOfElements = count;
+    SgList->Reserved = 0;
+
+    return mapped;
+}
+
 /*
  * ZvioBlkSubmitRequest - Submit a block request to the virtqueue
+ *
+ * The header and status go in the queue's pre-allocated slot for the
+ * chain, so submission itself allocates no DMA memory. The data is
+ * mapped page by page from the MDL; a transfer needing more than
+ * SegMax segments is posted as several VirtIO requests, and the WDF
+ * request completes with the last of them.
  */
 NTSTATUS
 ZvioBlkSubmitRequest(
@@ -372,135 +630,352 @@ ZvioBlkSubmitRequest(
     NTSTATUS status;
     PZVIOBLK_REQUEST blkRequest;
     WDF_OBJECT_ATTRIBUTES attributes;
-    SCATTER_GATHER_LIST sgList;
-    SCATTER_GATHER_ELEMENT sgElements[3];  // Header + Data + Status
-    ULONG outCount = 1;  // Header is always out
-    ULONG inCount = 1;   // Status is always in
-    ULONG sgCount = 2;   // Header + Status
-
-    if (DeviceContext->NumQueues == 0 || DeviceContext->Queues == NULL ||
-        DeviceContext->Queues[0] == NULL) {
+    VIRTIO_BLK_REQ_HDR header;
+    PSCATTER_GATHER_LIST sgList;
+    PSCATTER_GATHER_LIST dataSgList = NULL;
+    PZVIOBLK_VIRTQUEUE queue;
+    ULONG maxElements = 0;
+    ULONG offset = 0;
+    ULONG pieceLength = 0;
+    BOOLEAN posted = FALSE;
+
+    if (DeviceContext->NumQueues == 0 || DeviceContext->Queues == NULL) {
         return STATUS_DEVICE_NOT_READY;
     }
 
+    queue = ZvioBlkSelectQueue(DeviceContext);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    if (Mdl && Length > 0) {
+        maxElements = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(Mdl), Length);
+        maxElements = min(maxElements, DeviceContext->MaxSegments);
+    }
+
     //
-    // Create request context
+    // Create request context; the data scatter-gather list follows it
     //
     WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ZVIOBLK_REQUEST);
+    attributes.ContextSizeOverride = sizeof(ZVIOBLK_REQUEST) +
+        FIELD_OFFSET(SCATTER_GATHER_LIST, Elements) + maxElements * sizeof(SCATTER_GATHER_ELEMENT);
+
     status = WdfObjectAllocateContext(Request, &attributes, (PVOID*)&blkRequest);
     if (!NT_SUCCESS(status)) {
         return status;
     }
 
+    sgList = (PSCATTER_GATHER_LIST)(blkRequest + 1);
+
     RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
     blkRequest->Request = Request;
-    blkRequest->Queue = DeviceContext->Queues[0];
+    blkRequest->Queue = queue;
+    blkRequest->Type = Type;
     blkRequest->DataLength = Length;
+    blkRequest->Pending = 1;    // Held until every piece is posted
+    blkRequest->Status = VIRTIO_BLK_S_OK;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
 
     //
-    // Allocate header buffer
+    // Post the pieces. The list is rebuilt for each one; the queue has
+    // copied the previous one into descriptors by then.
     //
-    WDF_COMMON_BUFFER_CONFIG bufferConfig;
-    WDF_COMMON_BUFFER_CONFIG_INIT(&bufferConfig, sizeof(ULONGLONG));
-
-    status = WdfCommonBufferCreate(
-        DeviceContext->DmaEnabler,
-        sizeof(VIRTIO_BLK_REQ_HDR),
-        &bufferConfig,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &blkRequest->HeaderBuffer
-        );
+    do {
+        if (maxElements > 0) {
+            pieceLength = ZvioBlkBuildSgList(DeviceContext, Mdl, offset, Length, sgList, maxElements);
+            if (pieceLength == 0) {
+                status = STATUS_INVALID_PARAMETER;
+                break;
+            }
+            dataSgList = sgList;
+        }
 
-    if (!NT_SUCCESS(status)) {
+        header.Type = Type;
+        header.Reserved = 0;
+        header.Sector = Sector + offset / DeviceContext->SectorSize;
+
+        InterlockedIncrement(&blkRequest->Pending);
+
+        status = ZvioBlkQueueAddRequest(
+            queue,
+            &header,
+            dataSgList,
+            Type == VIRTIO_BLK_T_OUT,
+            blkRequest,
+            &blkRequest->HeadDescIdx
+            );
+
+        if (!NT_SUCCESS(status)) {
+            InterlockedDecrement(&blkRequest->Pending);
+            break;
+        }
+
+        posted = TRUE;
+        offset += pieceLength;
+    } while (offset < Length);
+
+    if (!posted) {
         return status;
     }
 
-    blkRequest->Header = (PVIRTIO_BLK_REQ_HDR)WdfCommonBufferGetAlignedVirtualAddress(blkRequest->HeaderBuffer);
-    blkRequest->HeaderPhys = WdfCommonBufferGetAlignedLogicalAddress(blkRequest->HeaderBuffer);
-
-    blkRequest->Header->Type = Type;
-    blkRequest->Header->Reserved = 0;
-    blkRequest->Header->Sector = Sector;
+    //
+    // Notify device
+    //
+    ZvioBlkQueueKick(queue);
 
     //
-    // Allocate status buffer
+    // Pieces already posted complete the request, failed if the rest
+    // could not follow
     //
-    status = WdfCommonBufferCreate(
-        DeviceContext->DmaEnabler,
-        sizeof(UCHAR),
-        &bufferConfig,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &blkRequest->StatusBuffer
-        );
+    ZvioBlkCompleteRequest(blkRequest, NT_SUCCESS(status) ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR,
+                           Length);
+
+    ZvioBlkQueuePoll(queue);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkSubmitRanges - Submit a TRIM or zeroing of byte ranges
+ *
+ * The ranges become discard or write zeroes segments in the queue's
+ * segment tables, as many VirtIO requests as the tables need; the WDF
+ * request completes with the last of them. TRIM is rounded inward to
+ * whole sectors, and when the tables run out the rest is dropped since
+ * TRIM is only a hint. A zeroing that cannot be posted in full fails.
+ */
+NTSTATUS
+ZvioBlkSubmitRanges(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ BOOLEAN Trim,
+    _In_reads_(NumRanges) PDEVICE_DATA_SET_RANGE DataSetRanges,
+    _In_ ULONG NumRanges
+    )
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    PZVIOBLK_REQUEST blkRequest;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    VIRTIO_BLK_REQ_HDR header;
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES table;
+    PZVIOBLK_VIRTQUEUE queue;
+    ZVIOBLK_RANGES ranges;
+    ULONG type = Trim ? ZvioBlkTrimType(DeviceContext) : VIRTIO_BLK_T_WRITE_ZEROES;
+    ULONGLONG taken = 0;
+    ULONG i = 0;
+    BOOLEAN posted = FALSE;
+
+    if (DeviceContext->NumQueues == 0 || DeviceContext->Queues == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    queue = ZvioBlkSelectQueue(DeviceContext);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ZVIOBLK_REQUEST);
+    status = WdfObjectAllocateContext(Request, &attributes, (PVOID*)&blkRequest);
     if (!NT_SUCCESS(status)) {
-        WdfObjectDelete(blkRequest->HeaderBuffer);
         return status;
     }
 
-    blkRequest->Status = (PUCHAR)WdfCommonBufferGetAlignedVirtualAddress(blkRequest->StatusBuffer);
-    blkRequest->StatusPhys = WdfCommonBufferGetAlignedLogicalAddress(blkRequest->StatusBuffer);
-    *blkRequest->Status = 0xFF;  // Initialize to invalid
+    RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
+    blkRequest->Request = Request;
+    blkRequest->Queue = queue;
+    blkRequest->Type = type;
+    blkRequest->Pending = 1;    // Held until every table is posted
+    blkRequest->Status = VIRTIO_BLK_S_OK;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    while (i < NumRanges) {
+        table = ZvioBlkQueueGetRangeTable(queue);
+        if (table == NULL) {
+            break;
+        }
+
+        ZvioBlkRangesInit(DeviceContext, type, TRUE, table, &ranges);
+
+        //
+        // Fill the table; a range that does not fit resumes in the next
+        //
+        while (i < NumRanges) {
+            ULONGLONG offset = (ULONGLONG)DataSetRanges[i].StartingOffset;
+            ULONGLONG start = (offset + 511) / 512;
+            ULONGLONG end = (offset + min(DataSetRanges[i].LengthInBytes, MAXLONGLONG)) / 512;
+            ULONGLONG added;
+
+            end = min(end, DeviceContext->Capacity);
+            if (DataSetRanges[i].StartingOffset < 0 || start + taken >= end) {
+                i++;
+                taken = 0;
+                continue;
+            }
+
+            added = ZvioBlkRangesAdd(&ranges, start + taken, end - start - taken);
+            if (added < end - start - taken) {
+                taken += added;
+                break;
+            }
+
+            i++;
+            taken = 0;
+        }
+
+        if (ranges.Count == 0) {
+            ZvioBlkQueuePutRangeTable(queue, table);
+            break;
+        }
+
+        header.Type = type;
+        header.Reserved = 0;
+        header.Sector = 0;
+
+        InterlockedIncrement(&blkRequest->Pending);
+
+        status = ZvioBlkQueueAddRanges(queue, &header, table, ranges.Count,
+                                       blkRequest, &blkRequest->HeadDescIdx);
+        if (!NT_SUCCESS(status)) {
+            InterlockedDecrement(&blkRequest->Pending);
+            ZvioBlkQueuePutRangeTable(queue, table);
+            break;
+        }
+
+        posted = TRUE;
+    }
 
     //
-    // Build scatter-gather list
+    // A zeroing left unfinished fails; nothing posted is still ours
     //
-    sgList.NumberOfElements = 0;
-    sgList.Reserved = 0;
+    if (i < NumRanges && !Trim) {
+        if (!posted) {
+            return NT_SUCCESS(status) ? STATUS_INSUFFICIENT_RESOURCES : status;
+        }
+        status = STATUS_INSUFFICIENT_RESOURCES;
+    } else {
+        status = STATUS_SUCCESS;
+    }
 
-    // Header (device-readable)
-    sgElements[0].Address = blkRequest->HeaderPhys;
-    sgElements[0].Length = sizeof(VIRTIO_BLK_REQ_HDR);
-    sgList.NumberOfElements++;
+    if (posted) {
+        ZvioBlkQueueKick(queue);
+    }
 
-    // Data buffer if present
-    if (Mdl && Length > 0) {
-        PHYSICAL_ADDRESS dataPhys = MmGetPhysicalAddress(MmGetMdlVirtualAddress(Mdl));
-        sgElements[sgList.NumberOfElements].Address = dataPhys;
-        sgElements[sgList.NumberOfElements].Length = Length;
-        sgList.NumberOfElements++;
-        sgCount++;
-
-        if (Type == VIRTIO_BLK_T_OUT) {
-            outCount++;  // Write: data is device-readable
-        } else {
-            inCount++;   // Read: data is device-writable
+    ZvioBlkCompleteRequest(blkRequest, NT_SUCCESS(status) ? VIRTIO_BLK_S_OK : VIRTIO_BLK_S_IOERR, 0);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkPostFlush - Post a batch of flushes as one VIRTIO_BLK_T_FLUSH
+ *
+ * The first request of the batch carries it. A batch that cannot be
+ * posted fails, and the flushes that queued meanwhile are tried next.
+ */
+static VOID
+ZvioBlkPostFlush(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_opt_ PZVIOBLK_REQUEST Batch
+    )
+{
+    VIRTIO_BLK_REQ_HDR header;
+    PZVIOBLK_REQUEST next;
+    NTSTATUS status;
+
+    while (Batch != NULL) {
+        header.Type = VIRTIO_BLK_T_FLUSH;
+        header.Reserved = 0;
+        header.Sector = 0;
+
+        status = ZvioBlkQueueAddRequest(Batch->Queue, &header, NULL, FALSE,
+                                        Batch, &Batch->HeadDescIdx);
+        if (NT_SUCCESS(status)) {
+            ZvioBlkQueueKick(Batch->Queue);
+            return;
+        }
+
+        next = ZvioBlkFlushDone(DeviceContext);
+
+        while (Batch != NULL) {
+            PZVIOBLK_REQUEST waiter = Batch;
+
+            Batch = Batch->FlushNext;
+            ZvioBlkCompleteRequest(waiter, VIRTIO_BLK_S_IOERR, 0);
         }
+
+        Batch = next;
     }
+}
 
-    // Status (device-writable)
-    sgElements[sgList.NumberOfElements].Address = blkRequest->StatusPhys;
-    sgElements[sgList.NumberOfElements].Length = sizeof(UCHAR);
-    sgList.NumberOfElements++;
+/*
+ * ZvioBlkSubmitFlush - Flush the device's write cache for a request
+ *
+ * Flushes are coalesced: one arriving while another is in flight
+ * waits for the next VIRTIO_BLK_T_FLUSH, which releases every flush
+ * that queued for it.
+ */
+NTSTATUS
+ZvioBlkSubmitFlush(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    )
+{
+    NTSTATUS status;
+    PZVIOBLK_REQUEST blkRequest;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    PZVIOBLK_VIRTQUEUE queue;
 
-    sgList.Elements = sgElements;
+    if (DeviceContext->NumQueues == 0 || DeviceContext->Queues == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
 
-    //
-    // Submit to virtqueue
-    //
-    status = ZvioBlkQueueAddBuffers(
-        blkRequest->Queue,
-        &sgList,
-        outCount,
-        inCount,
-        blkRequest,
-        &blkRequest->HeadDescIdx
-        );
+    queue = ZvioBlkSelectQueue(DeviceContext);
+    if (queue == NULL) {
+        return STATUS_DEVICE_NOT_READY;
+    }
 
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ZVIOBLK_REQUEST);
+    status = WdfObjectAllocateContext(Request, &attributes, (PVOID*)&blkRequest);
     if (!NT_SUCCESS(status)) {
-        WdfObjectDelete(blkRequest->StatusBuffer);
-        WdfObjectDelete(blkRequest->HeaderBuffer);
         return status;
     }
 
-    //
-    // Notify device
-    //
-    ZvioBlkQueueKick(blkRequest->Queue);
+    RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
+    blkRequest->Request = Request;
+    blkRequest->Queue = queue;
+    blkRequest->Type = VIRTIO_BLK_T_FLUSH;
+    blkRequest->Pending = 1;
+    blkRequest->Status = VIRTIO_BLK_S_OK;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    ZvioBlkPostFlush(DeviceContext, ZvioBlkFlushJoin(DeviceContext, blkRequest));
 
     return STATUS_SUCCESS;
 }
 
+/*
+ * ZvioBlkCompleteFlush - Release the batch a completed flush carried
+ *
+ * The next batch is posted first so that it is not held up by the
+ * completions.
+ */
+VOID
+ZvioBlkCompleteFlush(
+    _In_ PZVIOBLK_REQUEST BlkRequest,
+    _In_ UCHAR Status
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = BlkRequest->Queue->DeviceContext;
+    PZVIOBLK_REQUEST waiter;
+
+    ZvioBlkPostFlush(deviceContext, ZvioBlkFlushDone(deviceContext));
+
+    while (BlkRequest != NULL) {
+        waiter = BlkRequest;
+        BlkRequest = BlkRequest->FlushNext;
+        ZvioBlkCompleteRequest(waiter, Status, 0);
+    }
+}
+
 /*
  * ZvioBlkCompleteRequest - Complete a block request
  */
@@ -513,6 +988,22 @@ ZvioBlkCompleteRequest(
 {
     NTSTATUS ntStatus;
 
+    //
+    // A transfer posted in pieces completes with the last of them and
+    // fails if any piece failed
+    //
+    if (Status != VIRTIO_BLK_S_OK) {
+        InterlockedCompareExchange(&BlkRequest->Status, Status, VIRTIO_BLK_S_OK);
+    }
+
+    if (InterlockedDecrement(&BlkRequest->Pending) != 0) {
+        return;
+    }
+
+    ZvioBlkStatsRecord(BlkRequest->Queue, BlkRequest->Type, BlkRequest->SubmitTime);
+
+    Status = (UCHAR)BlkRequest->Status;
+
     switch (Status) {
     case VIRTIO_BLK_S_OK:
         ntStatus = STATUS_SUCCESS;
@@ -531,16 +1022,6 @@ ZvioBlkCompleteRequest(
         break;
     }
 
-    //
-    // Free DMA buffers
-    //
-    if (BlkRequest->HeaderBuffer) {
-        WdfObjectDelete(BlkRequest->HeaderBuffer);
-    }
-    if (BlkRequest->StatusBuffer) {
-        WdfObjectDelete(BlkRequest->StatusBuffer);
-    }
-
     //
     // Complete the request
     //
@@ -0,0 +1,137 @@
+/*
+ * Zixiao VirtIO Block Driver - Discard and Write Zeroes
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Turns the block ranges of a TRIM, UNMAP or zeroing request into
+ * VirtIO segments within the device's limits: adjacent ranges are
+ * merged, long ones split at the per-segment maximum, and discards are
+ * trimmed to the device's alignment. The segments are written straight
+ * into one of the queue's DMA tables.
+ */
+
+#include "public.h"
+
+/*
+ * ZvioBlkTrimType - Request type that serves a TRIM, or zero if none
+ *
+ * A write zeroes that may deallocate frees the space as well; TRIM
+ * leaves the contents undefined, so zeroing them is allowed.
+ */
+ULONG
+ZvioBlkTrimType(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    if (DeviceContext->ReadOnly) {
+        return 0;
+    }
+
+    if (DeviceContext->SupportsDiscard) {
+        return VIRTIO_BLK_T_DISCARD;
+    }
+
+    if (DeviceContext->SupportsWriteZeroes && DeviceContext->WriteZeroesUnmap) {
+        return VIRTIO_BLK_T_WRITE_ZEROES;
+    }
+
+    return 0;
+}
+
+/*
+ * ZvioBlkRangesInit - Start filling a segment table
+ *
+ * Table may be NULL to only learn the limits.
+ */
+VOID
+ZvioBlkRangesInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONG Type,
+    _In_ BOOLEAN Unmap,
+    _In_opt_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table,
+    _Out_ PZVIOBLK_RANGES Ranges
+    )
+{
+    RtlZeroMemory(Ranges, sizeof(*Ranges));
+    Ranges->Segments = Table;
+    Ranges->Alignment = 1;
+
+    if (Type == VIRTIO_BLK_T_DISCARD) {
+        Ranges->Discard = TRUE;
+        Ranges->MaxCount = DeviceContext->MaxDiscardSeg;
+        Ranges->MaxSectors = DeviceContext->MaxDiscardSectors;
+        Ranges->Alignment = max(DeviceContext->DiscardAlignment, 1);
+    } else {
+        Ranges->MaxCount = DeviceContext->MaxWriteZeroesSeg;
+        Ranges->MaxSectors = DeviceContext->MaxWriteZeroesSectors;
+        if (Unmap && DeviceContext->WriteZeroesUnmap) {
+            Ranges->Flags = VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP;
+        }
+    }
+
+    Ranges->MaxCount = max(min(Ranges->MaxCount, ZVIOBLK_MAX_RANGES), 1);
+
+    //
+    // Split points stay aligned when the segment maximum is
+    //
+    if (Ranges->MaxSectors >= Ranges->Alignment) {
+        Ranges->MaxSectors -= Ranges->MaxSectors % Ranges->Alignment;
+    } else {
+        Ranges->MaxSectors = Ranges->Alignment;
+    }
+}
+
+/*
+ * ZvioBlkRangesAdd - Add a sector range to the table
+ *
+ * Returns how many of the sectors were taken; fewer than NumSectors
+ * means the table is full and the rest goes in the next request.
+ * A discard drops the unaligned head and tail of the range, which then
+ * count as taken.
+ */
+ULONGLONG
+ZvioBlkRangesAdd(
+    _Inout_ PZVIOBLK_RANGES Ranges,
+    _In_ ULONGLONG Sector,
+    _In_ ULONGLONG NumSectors
+    )
+{
+    ULONGLONG start = Sector;
+    ULONGLONG end = Sector + NumSectors;
+    ULONGLONG take;
+
+    if (Ranges->Discard && Ranges->Alignment > 1) {
+        start = ((start + Ranges->Alignment - 1) / Ranges->Alignment) * Ranges->Alignment;
+        end -= end % Ranges->Alignment;
+    }
+
+    while (start < end) {
+        PVIRTIO_BLK_DISCARD_WRITE_ZEROES last =
+            Ranges->Count ? &Ranges->Segments[Ranges->Count - 1] : NULL;
+
+        //
+        // Extend the previous segment when this range continues it
+        //
+        if (last && last->Sector + last->NumSectors == start &&
+            last->Flags == Ranges->Flags && last->NumSectors < Ranges->MaxSectors) {
+            take = min(end - start, Ranges->MaxSectors - last->NumSectors);
+            last->NumSectors += (ULONG)take;
+            start += take;
+            continue;
+        }
+
+        if (Ranges->Count == Ranges->MaxCount) {
+            return start - Sector;
+        }
+
+        take = min(end - start, Ranges->MaxSectors);
+        Ranges->Segments[Ranges->Count].Sector = start;
+        Ranges->Segments[Ranges->Count].NumSectors = (ULONG)take;
+        Ranges->Segments[Ranges->Count].Flags = Ranges->Flags;
+        Ranges->Count++;
+        start += take;
+    }
+
+    return NumSectors;
+}
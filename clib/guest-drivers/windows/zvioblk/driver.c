@@ -9,9 +9,15 @@
 
 #include "public.h"
 
+static VOID
+ZvioBlkReadParameters(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
 #pragma alloc_text(PAGE, ZvioBlkEvtDeviceAdd)
+#pragma alloc_text(PAGE, ZvioBlkReadParameters)
 #pragma alloc_text(PAGE, ZvioBlkEvtDriverContextCleanup)
 #pragma alloc_text(PAGE, ZvioBlkEvtDevicePrepareHardware)
 #pragma alloc_text(PAGE, ZvioBlkEvtDeviceReleaseHardware)
@@ -32,6 +38,8 @@ DriverEntry(
 
     ZvioBlkDbgPrint("DriverEntry: Zixiao VirtIO Block Driver v1.0");
 
+    TraceLoggingRegister(ZvioBlkTraceProvider);
+
     //
     // Initialize driver configuration
     //
@@ -56,6 +64,7 @@ DriverEntry(
 
     if (!NT_SUCCESS(status)) {
         ZvioBlkDbgError("WdfDriverCreate failed: 0x%08X", status);
+        TraceLoggingUnregister(ZvioBlkTraceProvider);
         return status;
     }
 
@@ -75,6 +84,38 @@ ZvioBlkEvtDriverContextCleanup(
     UNREFERENCED_PARAMETER(DriverObject);
 
     ZvioBlkDbgPrint("Driver cleanup");
+
+    TraceLoggingUnregister(ZvioBlkTraceProvider);
+}
+
+/*
+ * ZvioBlkReadParameters - Per-device options from the device's key
+ *
+ * PollQueueDepth (DWORD): requests in flight on a queue from which its
+ * completions are polled by the submitters and the interrupt deferred.
+ * Zero, the default, leaves every completion to the interrupt.
+ */
+static VOID
+ZvioBlkReadParameters(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    DECLARE_CONST_UNICODE_STRING(pollQueueDepthName, L"PollQueueDepth");
+    WDFKEY key;
+    ULONG value;
+
+    PAGED_CODE();
+
+    if (!NT_SUCCESS(WdfDeviceOpenRegistryKey(DeviceContext->Device, PLUGPLAY_REGISTRY_KEY_DEVICE,
+                                             KEY_READ, WDF_NO_OBJECT_ATTRIBUTES, &key))) {
+        return;
+    }
+
+    if (NT_SUCCESS(WdfRegistryQueryULong(key, &pollQueueDepthName, &value))) {
+        DeviceContext->PollQueueDepth = (USHORT)min(value, MAXUSHORT);
+    }
+
+    WdfRegistryClose(key);
 }
 
 /*
@@ -92,7 +133,6 @@ ZvioBlkEvtDeviceAdd(
     WDFDEVICE device;
     PZVIOBLK_DEVICE_CONTEXT deviceContext;
     WDF_IO_QUEUE_CONFIG ioQueueConfig;
-    WDF_INTERRUPT_CONFIG interruptConfig;
 
     PAGED_CODE();
     UNREFERENCED_PARAMETER(Driver);
@@ -133,6 +173,8 @@ ZvioBlkEvtDeviceAdd(
     deviceContext->Device = device;
     deviceContext->SectorSize = 512; // Default
 
+    ZvioBlkReadParameters(deviceContext);
+
     //
     // Create I/O queue for read/write/ioctl operations
     //
@@ -159,19 +201,6 @@ ZvioBlkEvtDeviceAdd(
         // Continue without DMA - will use bounce buffers
     }
 
-    //
-    // Create interrupt object
-    //
-    WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, ZvioBlkEvtInterruptIsr, ZvioBlkEvtInterruptDpc);
-    interruptConfig.EvtInterruptEnable = ZvioBlkEvtInterruptEnable;
-    interruptConfig.EvtInterruptDisable = ZvioBlkEvtInterruptDisable;
-
-    status = WdfInterruptCreate(device, &interruptConfig, WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->Interrupt);
-    if (!NT_SUCCESS(status)) {
-        ZvioBlkDbgError("WdfInterruptCreate failed: 0x%08X", status);
-        // Will try again in PrepareHardware with proper resources
-    }
-
     ZvioBlkDbgPrint("Device created successfully");
     return STATUS_SUCCESS;
 }
@@ -251,8 +280,19 @@ ZvioBlkEvtDevicePrepareHardware(
             break;
 
         case CmResourceTypeInterrupt:
-            if (descriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE) {
-                deviceContext->UseMsix = TRUE;
+            //
+            // One interrupt object per message so that every request
+            // queue gets its own vector and DPC
+            //
+            status = ZvioBlkInterruptCreate(
+                deviceContext,
+                WdfCmResourceListGetDescriptor(ResourcesRaw, i),
+                descriptor
+                );
+            if (!NT_SUCCESS(status)) {
+                ZvioBlkDbgError("Failed to create interrupt %d: 0x%08X",
+                    deviceContext->InterruptCount, status);
+                return status;
             }
             break;
 
@@ -282,37 +322,7 @@ ZvioBlkEvtDevicePrepareHardware(
     //
     // Read device configuration
     //
-    if (deviceContext->DeviceCfg) {
-        deviceContext->Capacity = READ_REGISTER_ULONG64((PULONG64)&deviceContext->DeviceCfg->Capacity);
-
-        if (deviceContext->DriverFeatures & VIRTIO_BLK_F_BLK_SIZE) {
-            deviceContext->SectorSize = READ_REGISTER_ULONG(&deviceContext->DeviceCfg->BlkSize);
-        }
-
-        if (deviceContext->DriverFeatures & VIRTIO_BLK_F_SIZE_MAX) {
-            deviceContext->MaxSegmentSize = READ_REGISTER_ULONG(&deviceContext->DeviceCfg->SizeMax);
-        } else {
-            deviceContext->MaxSegmentSize = 0x10000; // 64KB default
-        }
-
-        if (deviceContext->DriverFeatures & VIRTIO_BLK_F_SEG_MAX) {
-            deviceContext->MaxSegments = READ_REGISTER_ULONG(&deviceContext->DeviceCfg->SegMax);
-        } else {
-            deviceContext->MaxSegments = 128; // Default
-        }
-
-        deviceContext->ReadOnly = (deviceContext->DeviceFeatures & VIRTIO_BLK_F_RO) != 0;
-        deviceContext->SupportsFlush = (deviceContext->DriverFeatures & VIRTIO_BLK_F_FLUSH) != 0;
-        deviceContext->SupportsDiscard = (deviceContext->DriverFeatures & VIRTIO_BLK_F_DISCARD) != 0;
-
-        ZvioBlkDbgPrint("Capacity: %llu sectors (%llu MB)",
-            deviceContext->Capacity,
-            (deviceContext->Capacity * deviceContext->SectorSize) / (1024 * 1024));
-        ZvioBlkDbgPrint("Sector size: %d, Max segments: %d, Max segment size: %d",
-            deviceContext->SectorSize, deviceContext->MaxSegments, deviceContext->MaxSegmentSize);
-        ZvioBlkDbgPrint("ReadOnly: %d, Flush: %d, Discard: %d",
-            deviceContext->ReadOnly, deviceContext->SupportsFlush, deviceContext->SupportsDiscard);
-    }
+    ZvioBlkReadDeviceConfig(deviceContext);
 
     return STATUS_SUCCESS;
 }
@@ -355,6 +365,15 @@ ZvioBlkEvtDeviceReleaseHardware(
         deviceContext->Queues = NULL;
     }
 
+    ZvioBlkStatsFree(deviceContext);
+
+    //
+    // The framework deletes the interrupt objects after this callback
+    //
+    RtlZeroMemory(deviceContext->Interrupts, sizeof(deviceContext->Interrupts));
+    deviceContext->InterruptCount = 0;
+    deviceContext->UseMsix = FALSE;
+
     //
     // Unmap BARs
     //
@@ -0,0 +1,105 @@
+/*
+ * Zixiao VirtIO Block Driver - Flush Coalescing
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * At most one VIRTIO_BLK_T_FLUSH is in flight per device. Flushes that
+ * arrive meanwhile collect on a waiter list; when the flush in flight
+ * completes, the whole list is posted as one flush whose completion
+ * releases every request on it. A request is only ever released by a
+ * flush posted after it arrived, so the writes it covers are durable.
+ *
+ * The list is pushed with compare-exchange and only ever taken whole,
+ * so it needs no lock and has no ABA problem; both drivers post and
+ * complete the batches with their own request types.
+ */
+
+#include "public.h"
+
+/*
+ * ZvioBlkFlushInit - Forget the flushes of a device that was reset
+ */
+VOID
+ZvioBlkFlushInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    DeviceContext->FlushWaiters = NULL;
+    DeviceContext->FlushActive = 0;
+}
+
+/*
+ * ZvioBlkFlushStart - Take the waiters as the next batch
+ *
+ * Returns NULL when a flush is in flight or nobody waits. A waiter
+ * pushed after the list was found empty either sees the flag clear
+ * and starts the batch itself, or is seen by the check that follows.
+ */
+static PZVIOBLK_REQUEST
+ZvioBlkFlushStart(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    PZVIOBLK_REQUEST batch;
+
+    for (;;) {
+        if (InterlockedCompareExchange(&DeviceContext->FlushActive, 1, 0) != 0) {
+            return NULL;
+        }
+
+        batch = (PZVIOBLK_REQUEST)InterlockedExchangePointer(
+            (PVOID volatile *)&DeviceContext->FlushWaiters, NULL);
+        if (batch != NULL) {
+            InterlockedIncrement64(&DeviceContext->FlushesPosted);
+            return batch;
+        }
+
+        InterlockedExchange(&DeviceContext->FlushActive, 0);
+
+        if (ReadPointerAcquire((PVOID volatile *)&DeviceContext->FlushWaiters) == NULL) {
+            return NULL;
+        }
+    }
+}
+
+/*
+ * ZvioBlkFlushJoin - Queue a flush request for the next batch
+ *
+ * Returns the batch the caller must post, linked by FlushNext, or NULL
+ * when a flush is in flight and the request waits for the next one.
+ */
+PZVIOBLK_REQUEST
+ZvioBlkFlushJoin(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLK_REQUEST BlkRequest
+    )
+{
+    PZVIOBLK_REQUEST head;
+
+    InterlockedIncrement64(&DeviceContext->FlushRequests);
+
+    do {
+        head = (PZVIOBLK_REQUEST)ReadPointerAcquire((PVOID volatile *)&DeviceContext->FlushWaiters);
+        BlkRequest->FlushNext = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile *)&DeviceContext->FlushWaiters,
+                                               BlkRequest, head) != head);
+
+    return ZvioBlkFlushStart(DeviceContext);
+}
+
+/*
+ * ZvioBlkFlushDone - End the flush in flight
+ *
+ * Called when its batch completed, or could not be posted. Returns the
+ * next batch to post, or NULL.
+ */
+PZVIOBLK_REQUEST
+ZvioBlkFlushDone(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    InterlockedExchange(&DeviceContext->FlushActive, 0);
+
+    return ZvioBlkFlushStart(DeviceContext);
+}
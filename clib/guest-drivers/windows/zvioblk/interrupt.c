@@ -4,11 +4,65 @@
  * Copyright (c) 2025 Zixiao System
  * SPDX-License-Identifier: Apache-2.0
  *
- * MSI-X and legacy interrupt handling.
+ * MSI-X and legacy interrupt handling. With MSI-X every request queue
+ * has its own message, interrupt object and DPC.
  */
 
 #include "public.h"
 
+/*
+ * ZvioBlkInterruptCreate - Create the interrupt object for one resource
+ */
+NTSTATUS
+ZvioBlkInterruptCreate(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR ResourceRaw,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR ResourceTranslated
+    )
+{
+    NTSTATUS status;
+    WDF_INTERRUPT_CONFIG interruptConfig;
+    WDF_OBJECT_ATTRIBUTES attributes;
+    WDFINTERRUPT interrupt;
+    ULONG index = DeviceContext->InterruptCount;
+
+    //
+    // Messages beyond one per queue would have nothing to service
+    //
+    if (index >= ZVIOBLK_MAX_INTERRUPTS) {
+        return STATUS_SUCCESS;
+    }
+
+    WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, ZvioBlkEvtInterruptIsr, ZvioBlkEvtInterruptDpc);
+    interruptConfig.EvtInterruptEnable = ZvioBlkEvtInterruptEnable;
+    interruptConfig.EvtInterruptDisable = ZvioBlkEvtInterruptDisable;
+    interruptConfig.InterruptRaw = ResourceRaw;
+    interruptConfig.InterruptTranslated = ResourceTranslated;
+
+    WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attributes, ZVIOBLK_INTERRUPT_CONTEXT);
+
+    status = WdfInterruptCreate(DeviceContext->Device, &interruptConfig, &attributes, &interrupt);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ZvioBlkGetInterruptContext(interrupt)->MessageId = index;
+
+    RtlZeroMemory(&DeviceContext->InterruptAffinity[index], sizeof(GROUP_AFFINITY));
+    if (ResourceTranslated->Flags & CM_RESOURCE_INTERRUPT_MESSAGE) {
+        DeviceContext->UseMsix = TRUE;
+        DeviceContext->InterruptAffinity[index].Group =
+            ResourceTranslated->u.MessageInterrupt.Translated.Group;
+        DeviceContext->InterruptAffinity[index].Mask =
+            ResourceTranslated->u.MessageInterrupt.Translated.Affinity;
+    }
+
+    DeviceContext->Interrupts[index] = interrupt;
+    DeviceContext->InterruptCount++;
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * ZvioBlkEvtInterruptIsr - Interrupt Service Routine
  */
@@ -25,17 +79,14 @@ ZvioBlkEvtInterruptIsr(
     deviceContext = ZvioBlkGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
     //
-    // For MSI-X, we know which queue triggered the interrupt
+    // For MSI-X, the message tells which queue triggered the interrupt
     //
     if (deviceContext->UseMsix) {
-        if (MessageID == 0) {
+        if (MessageID == 0 && deviceContext->InterruptCount > 1) {
             // Configuration change interrupt
             ZvioBlkDbgPrint("Config change interrupt");
-            claimed = TRUE;
-        } else if (MessageID == 1) {
-            // Virtqueue interrupt (request queue)
-            claimed = TRUE;
         }
+        claimed = TRUE;
     } else {
         //
         // Legacy interrupt: check ISR status register
@@ -63,8 +114,44 @@ ZvioBlkEvtInterruptIsr(
     return claimed;
 }
 
+/*
+ * ZvioBlkCompleteUsed - Complete a request the device has used
+ */
+VOID
+ZvioBlkCompleteUsed(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PZVIOBLK_REQUEST BlkRequest,
+    _In_ UCHAR Status
+    )
+{
+    ULONG bytesTransferred = 0;
+
+    //
+    // Calculate bytes transferred for read operations
+    //
+    if (BlkRequest->Type == VIRTIO_BLK_T_IN && Status == VIRTIO_BLK_S_OK) {
+        bytesTransferred = BlkRequest->DataLength;
+    } else if (BlkRequest->Type == VIRTIO_BLK_T_OUT && Status == VIRTIO_BLK_S_OK) {
+        bytesTransferred = BlkRequest->DataLength;
+    }
+
+    ZvioBlkDbgPrint("Completed: queue=%d type=%d status=%d bytes=%d",
+        Queue->Index, BlkRequest->Type, Status, bytesTransferred);
+
+    if (BlkRequest->Type == VIRTIO_BLK_T_FLUSH) {
+        ZvioBlkCompleteFlush(BlkRequest, Status);
+        return;
+    }
+
+    ZvioBlkCompleteRequest(BlkRequest, Status, bytesTransferred);
+}
+
 /*
  * ZvioBlkEvtInterruptDpc - Deferred Procedure Call for interrupt processing
+ *
+ * Completions are taken in batches within ZVIOBLK_DPC_BUDGET. When the
+ * budget runs out the DPC queues itself again with the queues'
+ * interrupts still off, so a deep queue does not hold the processor.
  */
 VOID
 ZvioBlkEvtInterruptDpc(
@@ -74,41 +161,34 @@ ZvioBlkEvtInterruptDpc(
 {
     PZVIOBLK_DEVICE_CONTEXT deviceContext;
     PZVIOBLK_VIRTQUEUE queue;
-    PZVIOBLK_REQUEST blkRequest;
-    ULONG length;
+    ULONG budget = ZVIOBLK_DPC_BUDGET;
+    BOOLEAN more = FALSE;
+    USHORT first, count, i;
 
     UNREFERENCED_PARAMETER(AssociatedObject);
 
     deviceContext = ZvioBlkGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
+    ZvioBlkMessageQueues(deviceContext, ZvioBlkGetInterruptContext(Interrupt)->MessageId,
+                           &first, &count);
+
     //
-    // Process the request queue (queue 0)
+    // Process the request queues this interrupt serves
     //
-    if (deviceContext->NumQueues > 0 && deviceContext->Queues && deviceContext->Queues[0]) {
-        queue = deviceContext->Queues[0];
-
-        //
-        // Process all completed requests
-        //
-        while ((blkRequest = (PZVIOBLK_REQUEST)ZvioBlkQueueGetBuffer(queue, &length)) != NULL) {
-            UCHAR status = *blkRequest->Status;
-            ULONG bytesTransferred = 0;
-
-            //
-            // Calculate bytes transferred for read operations
-            //
-            if (blkRequest->Header->Type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK) {
-                bytesTransferred = blkRequest->DataLength;
-            } else if (blkRequest->Header->Type == VIRTIO_BLK_T_OUT && status == VIRTIO_BLK_S_OK) {
-                bytesTransferred = blkRequest->DataLength;
-            }
-
-            ZvioBlkDbgPrint("Completed: type=%d status=%d bytes=%d",
-                blkRequest->Header->Type, status, bytesTransferred);
+    for (i = first; i < first + count; i++) {
+        queue = deviceContext->Queues[i];
+        if (!queue) {
+            continue;
+        }
 
-            ZvioBlkCompleteRequest(blkRequest, status, bytesTransferred);
+        if (ZvioBlkQueueService(queue, &budget)) {
+            more = TRUE;
         }
     }
+
+    if (more) {
+        WdfInterruptQueueDpcForIsr(Interrupt);
+    }
 }
 
 /*
@@ -121,25 +201,21 @@ ZvioBlkEvtInterruptEnable(
     )
 {
     PZVIOBLK_DEVICE_CONTEXT deviceContext;
-    USHORT i;
-
-    UNREFERENCED_PARAMETER(Interrupt);
+    USHORT first, count, i;
 
     deviceContext = ZvioBlkGetDeviceContext(AssociatedDevice);
 
     ZvioBlkDbgPrint("Enabling interrupts");
 
     //
-    // Enable interrupts on all queues
+    // Enable interrupts on the queues this interrupt serves
     //
-    if (deviceContext->Queues) {
-        for (i = 0; i < deviceContext->NumQueues; i++) {
-            if (deviceContext->Queues[i]) {
-                WdfSpinLockAcquire(deviceContext->Queues[i]->Lock);
-                deviceContext->Queues[i]->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
-                KeMemoryBarrier();
-                WdfSpinLockRelease(deviceContext->Queues[i]->Lock);
-            }
+    ZvioBlkMessageQueues(deviceContext, ZvioBlkGetInterruptContext(Interrupt)->MessageId,
+                           &first, &count);
+
+    for (i = first; i < first + count; i++) {
+        if (deviceContext->Queues[i]) {
+            ZvioBlkQueueEnableInterrupts(deviceContext->Queues[i], TRUE);
         }
     }
 
@@ -156,25 +232,21 @@ ZvioBlkEvtInterruptDisable(
     )
 {
     PZVIOBLK_DEVICE_CONTEXT deviceContext;
-    USHORT i;
-
-    UNREFERENCED_PARAMETER(Interrupt);
+    USHORT first, count, i;
 
     deviceContext = ZvioBlkGetDeviceContext(AssociatedDevice);
 
     ZvioBlkDbgPrint("Disabling interrupts");
 
     //
-    // Disable interrupts on all queues
+    // Disable interrupts on the queues this interrupt serves
     //
-    if (deviceContext->Queues) {
-        for (i = 0; i < deviceContext->NumQueues; i++) {
-            if (deviceContext->Queues[i]) {
-                WdfSpinLockAcquire(deviceContext->Queues[i]->Lock);
-                deviceContext->Queues[i]->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
-                KeMemoryBarrier();
-                WdfSpinLockRelease(deviceContext->Queues[i]->Lock);
-            }
+    ZvioBlkMessageQueues(deviceContext, ZvioBlkGetInterruptContext(Interrupt)->MessageId,
+                           &first, &count);
+
+    for (i = first; i < first + count; i++) {
+        if (deviceContext->Queues[i]) {
+            ZvioBlkQueueEnableInterrupts(deviceContext->Queues[i], FALSE);
         }
     }
 
@@ -58,6 +58,18 @@ ZvioBlkPciReadConfig(
     _In_ ULONG Length
     )
 {
+#ifdef ZVIOBLK_STORPORT
+    //
+    // StorPort reads config space only from offset 0; the miniport
+    // works from the copy taken in HwFindAdapter
+    //
+    if (Offset + Length > sizeof(DeviceContext->PciConfig)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    RtlCopyMemory(Buffer, DeviceContext->PciConfig + Offset, Length);
+    return STATUS_SUCCESS;
+#else
     ULONG bytesRead;
 
     if (!DeviceContext->BusInterface.GetBusData) {
@@ -79,6 +91,7 @@ ZvioBlkPciReadConfig(
     }
 
     return STATUS_SUCCESS;
+#endif
 }
 
 /*
@@ -5,15 +5,25 @@
  * SPDX-License-Identifier: Apache-2.0
  *
  * VirtIO block device structures and definitions.
+ *
+ * The sources build two drivers: the KMDF disk driver zvioblk.sys and,
+ * with ZVIOBLK_STORPORT defined, the StorPort miniport zviostor.sys.
+ * Both share the virtqueue, VirtIO and PCI code.
  */
 
 #pragma once
 
 #include <ntddk.h>
+#ifdef ZVIOBLK_STORPORT
+#include <storport.h>
+#else
 #include <wdf.h>
+#endif
 #include <initguid.h>
 #include <ntdddisk.h>
 #include <ntddscsi.h>
+#include <evntrace.h>
+#include <TraceLoggingProvider.h>
 
 //
 // Debug macros
@@ -30,6 +40,13 @@
 #define ZvioBlkDbgError(_fmt, ...)
 #endif
 
+//
+// TraceLogging; per-request events are verbose and keyword-gated
+//
+TRACELOGGING_DECLARE_PROVIDER(ZvioBlkTraceProvider);
+
+#define ZVIOBLK_TRACE_IO            0x1
+
 //
 // VirtIO Block Feature Bits
 //
@@ -51,6 +68,7 @@
 #define VIRTIO_F_VERSION_1          (1ULL << 32)
 #define VIRTIO_F_RING_INDIRECT_DESC (1ULL << 28)
 #define VIRTIO_F_RING_EVENT_IDX     (1ULL << 29)
+#define VIRTIO_F_IN_ORDER           (1ULL << 35)
 
 //
 // VirtIO Block Request Types
@@ -116,6 +134,20 @@ typedef struct _VIRTIO_BLK_REQ_HDR {
 } VIRTIO_BLK_REQ_HDR, *PVIRTIO_BLK_REQ_HDR;
 #pragma pack(pop)
 
+//
+// Request Header/Status Slot
+//
+// Each virtqueue owns one slot per descriptor, used by the chain whose
+// head is that descriptor, so nothing is allocated per request.
+//
+#pragma pack(push, 1)
+typedef struct _ZVIOBLK_REQ_SLOT {
+    VIRTIO_BLK_REQ_HDR  Header;
+    UCHAR               Status;
+    UCHAR               Reserved[15];
+} ZVIOBLK_REQ_SLOT, *PZVIOBLK_REQ_SLOT;
+#pragma pack(pop)
+
 //
 // VirtIO Block Discard/Write Zeroes Segment
 //
@@ -127,41 +159,12 @@ typedef struct _VIRTIO_BLK_DISCARD_WRITE_ZEROES {
 } VIRTIO_BLK_DISCARD_WRITE_ZEROES, *PVIRTIO_BLK_DISCARD_WRITE_ZEROES;
 #pragma pack(pop)
 
+#define VIRTIO_BLK_WRITE_ZEROES_FLAG_UNMAP  0x1 // Device may deallocate the range
+
 //
-// Virtqueue Ring Structures (from VirtIO spec)
+// Virtqueue Ring Structures
 //
-#define VRING_DESC_F_NEXT       1   // Buffer continues via 'next'
-#define VRING_DESC_F_WRITE      2   // Buffer is write-only (device writes)
-#define VRING_DESC_F_INDIRECT   4   // Buffer contains list of descriptors
-
-#pragma pack(push, 1)
-typedef struct _VRING_DESC {
-    ULONGLONG   Addr;               // Physical address
-    ULONG       Len;                // Length in bytes
-    USHORT      Flags;              // Descriptor flags
-    USHORT      Next;               // Next descriptor index
-} VRING_DESC, *PVRING_DESC;
-
-typedef struct _VRING_AVAIL {
-    USHORT      Flags;
-    USHORT      Idx;
-    USHORT      Ring[1];            // Variable size
-} VRING_AVAIL, *PVRING_AVAIL;
-
-typedef struct _VRING_USED_ELEM {
-    ULONG       Id;                 // Index of used descriptor chain
-    ULONG       Len;                // Total bytes written
-} VRING_USED_ELEM, *PVRING_USED_ELEM;
-
-typedef struct _VRING_USED {
-    USHORT          Flags;
-    USHORT          Idx;
-    VRING_USED_ELEM Ring[1];        // Variable size
-} VRING_USED, *PVRING_USED;
-#pragma pack(pop)
-
-#define VRING_AVAIL_F_NO_INTERRUPT  1
-#define VRING_USED_F_NO_NOTIFY      1
+#include "../common/zvio_vring.h"
 
 //
 // VirtIO PCI Common Configuration
@@ -198,6 +201,102 @@ typedef struct _VIRTIO_PCI_COMMON_CFG {
 #define VIRTIO_STATUS_FEATURES_OK   8
 #define VIRTIO_STATUS_FAILED        128
 
+#define VIRTIO_MSI_NO_VECTOR        0xFFFF
+
+//
+// Multi-queue limits. Message 0 serves configuration changes and
+// message N + 1 request queue N.
+//
+#define ZVIOBLK_MAX_QUEUES          64
+#define ZVIOBLK_MAX_INTERRUPTS      (ZVIOBLK_MAX_QUEUES + 1)
+#define ZVIOBLK_MAX_PROCESSORS      256
+
+//
+// Request size limits. With indirect descriptors a request takes one
+// ring entry however many segments it has, up to SegMax; a pool of
+// tables per queue holds the header, segments and status.
+//
+#define ZVIOBLK_MAX_SEGMENTS        257     // 1 MiB at any page offset
+#define ZVIOBLK_INDIRECT_TABLES     32
+
+//
+// Discard and write-zeroes segment tables, one page each, per queue
+//
+#define ZVIOBLK_MAX_RANGES          (PAGE_SIZE / sizeof(VIRTIO_BLK_DISCARD_WRITE_ZEROES))
+#define ZVIOBLK_RANGE_TABLES        4
+
+//
+// Completion processing: requests reaped per hold of the queue lock,
+// and per DPC run before the DPC yields and queues itself again
+//
+#define ZVIOBLK_COMPLETION_BATCH    32
+#define ZVIOBLK_DPC_BUDGET          256
+
+//
+// Latency and queue depth telemetry, read by the guest agent with
+// IOCTL_ZVIOBLK_QUERY_STATS, or for zviostor IOCTL_SCSI_MINIPORT with
+// ZVIOBLK_MINIPORT_SIGNATURE and ZVIOBLK_MINIPORT_QUERY_STATS after
+// the SRB_IO_CONTROL header. Fields are only appended, with Version
+// raised.
+//
+#define ZVIOBLK_STATS_VERSION       2
+
+#define IOCTL_ZVIOBLK_QUERY_STATS \
+    CTL_CODE(FILE_DEVICE_DISK, 0x800, METHOD_BUFFERED, FILE_READ_ACCESS)
+
+#define ZVIOBLK_MINIPORT_SIGNATURE  "ZVIOSTOR"
+#define ZVIOBLK_MINIPORT_QUERY_STATS 0x5A420001
+
+// Request classes the latency is kept for
+#define ZVIOBLK_IO_READ             0
+#define ZVIOBLK_IO_WRITE            1
+#define ZVIOBLK_IO_FLUSH            2
+#define ZVIOBLK_IO_DISCARD          3   // Discard and write zeroes
+#define ZVIOBLK_IO_CLASSES          4
+
+// Bucket 0 holds latencies under 1us, bucket n [2^(n-1), 2^n) us;
+// the last one is open-ended
+#define ZVIOBLK_LATENCY_BUCKETS     32
+
+typedef struct _ZVIOBLK_LATENCY_HISTOGRAM {
+    ULONG64                 Count;
+    ULONG64                 TotalUs;            // Sum of the latencies
+    ULONG64                 Buckets[ZVIOBLK_LATENCY_BUCKETS];
+} ZVIOBLK_LATENCY_HISTOGRAM, *PZVIOBLK_LATENCY_HISTOGRAM;
+
+typedef struct _ZVIOBLK_QUEUE_STATS {
+    ULONG64                 Submitted;          // VirtIO requests posted
+    ULONG                   Depth;              // In flight when queried
+    ULONG                   PeakDepth;
+} ZVIOBLK_QUEUE_STATS, *PZVIOBLK_QUEUE_STATS;
+
+typedef struct _ZVIOBLK_STATS {
+    ULONG                   Version;            // ZVIOBLK_STATS_VERSION
+    ULONG                   NumQueues;          // Entries of Queues in use
+    ZVIOBLK_LATENCY_HISTOGRAM Latency[ZVIOBLK_IO_CLASSES];  // Submission to completion
+    ZVIOBLK_QUEUE_STATS     Queues[ZVIOBLK_MAX_QUEUES];
+    ULONG64                 FlushRequests;      // Flushes asked for (version 2)
+    ULONG64                 FlushesPosted;      // VIRTIO_BLK_T_FLUSH sent for them
+} ZVIOBLK_STATS, *PZVIOBLK_STATS;
+
+//
+// Each processor updates only its own histograms
+//
+typedef struct DECLSPEC_CACHEALIGN _ZVIOBLK_CPU_STATS {
+    ZVIOBLK_LATENCY_HISTOGRAM Latency[ZVIOBLK_IO_CLASSES];
+} ZVIOBLK_CPU_STATS, *PZVIOBLK_CPU_STATS;
+
+//
+// DMA-able memory shared with the device
+//
+typedef struct _ZVIOBLK_DMA_BUFFER {
+#ifndef ZVIOBLK_STORPORT
+    WDFCOMMONBUFFER         CommonBuffer;
+#endif
+    PVOID                   VirtualAddress;
+    PHYSICAL_ADDRESS        LogicalAddress;
+} ZVIOBLK_DMA_BUFFER, *PZVIOBLK_DMA_BUFFER;
+
 //
 // Virtqueue Context
 //
@@ -207,6 +306,17 @@ typedef struct _ZVIOBLK_VIRTQUEUE {
     USHORT                  NumFree;
     USHORT                  FreeHead;
     USHORT                  LastUsedIdx;
+    USHORT                  KickedAvailIdx;     // Avail index at the last kick
+    BOOLEAN                 EventIdx;           // VIRTIO_F_RING_EVENT_IDX negotiated
+    BOOLEAN                 InterruptsOff;      // Interrupts disabled by the driver
+    BOOLEAN                 EventDeferred;      // UsedEvent set ahead for hybrid polling
+    BOOLEAN                 InOrder;            // VIRTIO_F_IN_ORDER negotiated
+    BOOLEAN                 InBatch;            // Reclaiming a batch used at once
+    USHORT                  BatchLast;          // Head of its last chain
+    ULONG                   BatchLen;           // Bytes the device wrote for that chain
+    USHORT                  MsixVector;         // MSI-X message, or VIRTIO_MSI_NO_VECTOR
+    USHORT                  PeakInFlight;       // Most chains the device held at once
+    ULONG64                 Submitted;          // Chains made available
 
     PVRING_DESC             Desc;
     PHYSICAL_ADDRESS        DescPhys;
@@ -219,8 +329,26 @@ typedef struct _ZVIOBLK_VIRTQUEUE {
 
     PVOID                   *DescData;          // User data per descriptor
 
-    WDFCOMMONBUFFER         RingBuffer;         // DMA buffer for rings
-    WDFSPINLOCK             Lock;
+    ZVIOBLK_DMA_BUFFER      SlotBuffer;         // DMA buffer for request slots
+    PZVIOBLK_REQ_SLOT       Slots;              // Header/status per head descriptor
+    PHYSICAL_ADDRESS        SlotsPhys;
+
+    ZVIOBLK_DMA_BUFFER      RingBuffer;         // DMA buffer for rings
+
+    ZVIOBLK_DMA_BUFFER      IndirectBuffer;     // DMA buffer for indirect tables
+    PVRING_DESC             Indirect;           // NULL without VIRTIO_F_RING_INDIRECT_DESC
+    PHYSICAL_ADDRESS        IndirectPhys;
+    USHORT                  IndirectDescs;      // Descriptors per table
+    USHORT                  IndirectFree;       // First free table, linked by Desc[0].Next
+
+    ZVIOBLK_DMA_BUFFER      RangeBuffer;        // DMA buffer for segment tables
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES Ranges;    // NULL without DISCARD/WRITE_ZEROES
+    PHYSICAL_ADDRESS        RangesPhys;
+    USHORT                  RangeFree;          // First free table, linked by [0].Flags
+
+#ifndef ZVIOBLK_STORPORT
+    WDFSPINLOCK             Lock;               // StorPort: the queue's MSI-X lock
+#endif
 
     PUCHAR                  NotifyAddr;         // Notify register address
 
@@ -231,29 +359,41 @@ typedef struct _ZVIOBLK_VIRTQUEUE {
 // Block Request Context
 //
 typedef struct _ZVIOBLK_REQUEST {
+#ifdef ZVIOBLK_STORPORT
+    PSCSI_REQUEST_BLOCK     Srb;                // SRB this extension belongs to
+#else
     WDFREQUEST              Request;            // WDF request handle
+    volatile LONG           Pending;            // VirtIO requests still in flight
+    volatile LONG           Status;             // First failing VIRTIO_BLK_S_* status
+#endif
     PZVIOBLK_VIRTQUEUE      Queue;              // Target virtqueue
-    WDFCOMMONBUFFER         HeaderBuffer;       // DMA buffer for header
-    PVIRTIO_BLK_REQ_HDR     Header;             // Request header
-    PHYSICAL_ADDRESS        HeaderPhys;
-    WDFCOMMONBUFFER         StatusBuffer;       // DMA buffer for status
-    PUCHAR                  Status;             // Status byte
-    PHYSICAL_ADDRESS        StatusPhys;
+    ULONG                   Type;               // Request type (VIRTIO_BLK_T_*)
     ULONG                   DataLength;         // Data transfer length
     USHORT                  HeadDescIdx;        // First descriptor index
+    LONGLONG                SubmitTime;         // Performance counter at submission
+    struct _ZVIOBLK_REQUEST *FlushNext;         // Next flush released with this one
 } ZVIOBLK_REQUEST, *PZVIOBLK_REQUEST;
 
+#ifndef ZVIOBLK_STORPORT
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIOBLK_REQUEST, ZvioBlkGetRequestContext)
+#endif
 
 //
 // Device Context
 //
 typedef struct _ZVIOBLK_DEVICE_CONTEXT {
+#ifdef ZVIOBLK_STORPORT
+    // PCI location and config space snapshot
+    ULONG                   SystemIoBusNumber;
+    ULONG                   SlotNumber;
+    UCHAR                   PciConfig[256];
+#else
     WDFDEVICE               Device;
     WDFQUEUE                IoQueue;
 
     // PCI Bus Interface
     BUS_INTERFACE_STANDARD  BusInterface;
+#endif
 
     // BAR mappings
     PVOID                   BarVA[6];
@@ -275,50 +415,107 @@ typedef struct _ZVIOBLK_DEVICE_CONTEXT {
     PZVIOBLK_VIRTQUEUE      *Queues;
     USHORT                  NumQueues;
 
+#ifdef ZVIOBLK_STORPORT
+    // Uncached extension the queues are carved from
+    PUCHAR                  DmaBase;
+    PHYSICAL_ADDRESS        DmaBasePhys;
+    SIZE_T                  DmaSize;
+    SIZE_T                  DmaUsed;
+
+    // Completion DPC per request queue
+    STOR_DPC                Dpcs[ZVIOBLK_MAX_QUEUES];
+    ULONG                   MaxTransferLength;
+#else
     // DMA
     WDFDMAENABLER           DmaEnabler;
 
-    // Interrupt
-    WDFINTERRUPT            Interrupt;
+    // Interrupts, one per message (a single one for line-based)
+    WDFINTERRUPT            Interrupts[ZVIOBLK_MAX_INTERRUPTS];
+#endif
+    GROUP_AFFINITY          InterruptAffinity[ZVIOBLK_MAX_INTERRUPTS];
+    ULONG                   InterruptCount;
     BOOLEAN                 UseMsix;
+    USHORT                  PollQueueDepth;     // Hybrid polling from this depth, 0 for off
+
+    // Request queue per processor index
+    UCHAR                   ProcessorQueue[ZVIOBLK_MAX_PROCESSORS];
 
     // Block device info
     ULONGLONG               Capacity;           // In sectors
     ULONG                   SectorSize;         // Usually 512
-    ULONG                   MaxSegments;
-    ULONG                   MaxSegmentSize;
+    ULONG                   MaxSegments;        // Data segments per request
+    ULONG                   MaxSegmentSize;     // Bytes per segment
     BOOLEAN                 ReadOnly;
     BOOLEAN                 SupportsFlush;
     BOOLEAN                 SupportsDiscard;
+    BOOLEAN                 SupportsWriteZeroes;
+    BOOLEAN                 WriteZeroesUnmap;   // Write zeroes may deallocate
+    BOOLEAN                 SupportsConfigWce;  // Cache mode switchable (VIRTIO_BLK_F_CONFIG_WCE)
+    BOOLEAN                 WriteCache;         // Writeback; writethrough when FALSE
+
+    // Flush coalescing, see flush.c
+    PZVIOBLK_REQUEST volatile FlushWaiters;     // Arrived since the last flush was posted
+    volatile LONG           FlushActive;        // A flush is in flight
+    volatile LONG64         FlushRequests;
+    volatile LONG64         FlushesPosted;
+
+    // Discard/write zeroes limits, in 512-byte sectors
+    ULONG                   MaxDiscardSectors;  // Per segment
+    ULONG                   MaxDiscardSeg;
+    ULONG                   DiscardAlignment;
+    ULONG                   MaxWriteZeroesSectors;
+    ULONG                   MaxWriteZeroesSeg;
 
     // Device ID string
     CHAR                    DeviceId[20 + 1];
 
+    // Latency histograms per processor, NULL if they could not be allocated
+    PZVIOBLK_CPU_STATS      CpuStats;
+    ULONG                   CpuStatsCount;
+    LONGLONG                PerfFrequency;
+
+#ifndef ZVIOBLK_STORPORT
     // Resources
     WDFCMRESLIST            ResourcesRaw;
     WDFCMRESLIST            ResourcesTranslated;
+#endif
 } ZVIOBLK_DEVICE_CONTEXT, *PZVIOBLK_DEVICE_CONTEXT;
 
+#ifndef ZVIOBLK_STORPORT
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIOBLK_DEVICE_CONTEXT, ZvioBlkGetDeviceContext)
 
+//
+// Interrupt Context
+//
+typedef struct _ZVIOBLK_INTERRUPT_CONTEXT {
+    ULONG                   MessageId;          // Index in Interrupts[]
+} ZVIOBLK_INTERRUPT_CONTEXT, *PZVIOBLK_INTERRUPT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIOBLK_INTERRUPT_CONTEXT, ZvioBlkGetInterruptContext)
+#endif
+
 //
 // Function Prototypes
 //
 
-// driver.c
+// driver.c, or storport.c for the miniport
 DRIVER_INITIALIZE DriverEntry;
+
+#ifndef ZVIOBLK_STORPORT
 EVT_WDF_DRIVER_DEVICE_ADD ZvioBlkEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP ZvioBlkEvtDriverContextCleanup;
 EVT_WDF_DEVICE_PREPARE_HARDWARE ZvioBlkEvtDevicePrepareHardware;
 EVT_WDF_DEVICE_RELEASE_HARDWARE ZvioBlkEvtDeviceReleaseHardware;
 EVT_WDF_DEVICE_D0_ENTRY ZvioBlkEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT ZvioBlkEvtDeviceD0Exit;
+#endif
 
 // virtqueue.c
 NTSTATUS
 ZvioBlkQueueCreate(
     _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
     _In_ USHORT Index,
+    _In_ USHORT MsixVector,
     _Out_ PZVIOBLK_VIRTQUEUE *Queue
     );
 
@@ -327,6 +524,13 @@ ZvioBlkQueueDestroy(
     _In_ PZVIOBLK_VIRTQUEUE Queue
     );
 
+SIZE_T
+ZvioBlkQueueMemorySize(
+    _In_ USHORT QueueSize,
+    _In_ ULONG IndirectDescs,
+    _In_ BOOLEAN RangeTables
+    );
+
 NTSTATUS
 ZvioBlkQueueAddBuffers(
     _In_ PZVIOBLK_VIRTQUEUE Queue,
@@ -337,17 +541,80 @@ ZvioBlkQueueAddBuffers(
     _Out_ PUSHORT HeadIdx
     );
 
+NTSTATUS
+ZvioBlkQueueAddRequest(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_REQ_HDR Header,
+    _In_opt_ PSCATTER_GATHER_LIST DataSgList,
+    _In_ BOOLEAN DataOut,
+    _In_opt_ PVOID UserData,
+    _Out_ PUSHORT HeadIdx
+    );
+
+PVIRTIO_BLK_DISCARD_WRITE_ZEROES
+ZvioBlkQueueGetRangeTable(
+    _In_ PZVIOBLK_VIRTQUEUE Queue
+    );
+
+VOID
+ZvioBlkQueuePutRangeTable(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table
+    );
+
+NTSTATUS
+ZvioBlkQueueAddRanges(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_REQ_HDR Header,
+    _In_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table,
+    _In_ ULONG Count,
+    _In_opt_ PVOID UserData,
+    _Out_ PUSHORT HeadIdx
+    );
+
 PVOID
 ZvioBlkQueueGetBuffer(
     _In_ PZVIOBLK_VIRTQUEUE Queue,
     _Out_ PULONG Length
     );
 
+ULONG
+ZvioBlkQueueGetRequests(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Out_writes_to_(MaxCount, return) PVOID *Requests,
+    _Out_writes_to_(MaxCount, return) PUCHAR Statuses,
+    _In_ ULONG MaxCount
+    );
+
+BOOLEAN
+ZvioBlkQueueRearm(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ USHORT PollDepth
+    );
+
+BOOLEAN
+ZvioBlkQueueService(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Inout_ PULONG Budget
+    );
+
+VOID
+ZvioBlkQueuePoll(
+    _In_ PZVIOBLK_VIRTQUEUE Queue
+    );
+
 VOID
 ZvioBlkQueueKick(
     _In_ PZVIOBLK_VIRTQUEUE Queue
     );
 
+BOOLEAN
+ZvioBlkQueueEnableInterrupts(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    );
+
+#ifndef ZVIOBLK_STORPORT
 // blk_io.c
 EVT_WDF_IO_QUEUE_IO_READ ZvioBlkEvtIoRead;
 EVT_WDF_IO_QUEUE_IO_WRITE ZvioBlkEvtIoWrite;
@@ -363,6 +630,27 @@ ZvioBlkSubmitRequest(
     _In_ ULONG Length
     );
 
+NTSTATUS
+ZvioBlkSubmitRanges(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request,
+    _In_ BOOLEAN Trim,
+    _In_reads_(NumRanges) PDEVICE_DATA_SET_RANGE DataSetRanges,
+    _In_ ULONG NumRanges
+    );
+
+NTSTATUS
+ZvioBlkSubmitFlush(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFREQUEST Request
+    );
+
+VOID
+ZvioBlkCompleteFlush(
+    _In_ PZVIOBLK_REQUEST BlkRequest,
+    _In_ UCHAR Status
+    );
+
 VOID
 ZvioBlkCompleteRequest(
     _In_ PZVIOBLK_REQUEST BlkRequest,
@@ -376,6 +664,95 @@ EVT_WDF_INTERRUPT_DPC ZvioBlkEvtInterruptDpc;
 EVT_WDF_INTERRUPT_ENABLE ZvioBlkEvtInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE ZvioBlkEvtInterruptDisable;
 
+NTSTATUS
+ZvioBlkInterruptCreate(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR ResourceRaw,
+    _In_ PCM_PARTIAL_RESOURCE_DESCRIPTOR ResourceTranslated
+    );
+#endif
+
+// interrupt.c, or storport.c for StorPort
+VOID
+ZvioBlkCompleteUsed(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PZVIOBLK_REQUEST BlkRequest,
+    _In_ UCHAR Status
+    );
+
+// stats.c
+VOID
+ZvioBlkStatsInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+ZvioBlkStatsFree(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+ZvioBlkStatsRecord(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ ULONG Type,
+    _In_ LONGLONG SubmitTime
+    );
+
+VOID
+ZvioBlkStatsQuery(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _Out_ PZVIOBLK_STATS Stats
+    );
+
+// flush.c
+VOID
+ZvioBlkFlushInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+PZVIOBLK_REQUEST
+ZvioBlkFlushJoin(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLK_REQUEST BlkRequest
+    );
+
+PZVIOBLK_REQUEST
+ZvioBlkFlushDone(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+// discard.c
+typedef struct _ZVIOBLK_RANGES {
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES Segments;  // Table being filled
+    ULONG                   Count;
+    ULONG                   MaxCount;           // Segments per request
+    ULONG                   MaxSectors;         // Sectors per segment
+    ULONG                   Alignment;          // Discard granularity in sectors
+    ULONG                   Flags;              // VIRTIO_BLK_WRITE_ZEROES_FLAG_*
+    BOOLEAN                 Discard;
+} ZVIOBLK_RANGES, *PZVIOBLK_RANGES;
+
+ULONG
+ZvioBlkTrimType(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+ZvioBlkRangesInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONG Type,
+    _In_ BOOLEAN Unmap,
+    _In_opt_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table,
+    _Out_ PZVIOBLK_RANGES Ranges
+    );
+
+ULONGLONG
+ZvioBlkRangesAdd(
+    _Inout_ PZVIOBLK_RANGES Ranges,
+    _In_ ULONGLONG Sector,
+    _In_ ULONGLONG NumSectors
+    );
+
 // pci.c
 NTSTATUS
 ZvioBlkPciReadConfig(
@@ -396,6 +773,36 @@ ZvioBlkDeviceInit(
     _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
     );
 
+ULONG
+ZvioBlkMaxSegments(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONGLONG Features
+    );
+
+VOID
+ZvioBlkReadDeviceConfig(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+NTSTATUS
+ZvioBlkSetWriteCache(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ BOOLEAN Enable
+    );
+
+VOID
+ZvioBlkMapProcessors(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+ZvioBlkMessageQueues(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONG MessageId,
+    _Out_ PUSHORT First,
+    _Out_ PUSHORT Count
+    );
+
 NTSTATUS
 ZvioBlkDeviceReset(
     _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
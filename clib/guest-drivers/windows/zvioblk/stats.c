@@ -0,0 +1,201 @@
+/*
+ * Zixiao VirtIO Block Driver - Latency and Queue Depth Telemetry
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every request is stamped when it is posted and its latency lands in
+ * a log2 histogram of the completing processor, so recording takes no
+ * lock and shares no cache line. A query sums the processors. The
+ * latency covers the device and the completion path, not the time a
+ * request waited before it was posted.
+ */
+
+#include "public.h"
+
+// {AF2541DE-26B3-480A-B44C-76F518323D69}
+TRACELOGGING_DEFINE_PROVIDER(
+    ZvioBlkTraceProvider,
+    "Zixiao.VirtIO.Block",
+    (0xaf2541de, 0x26b3, 0x480a, 0xb4, 0x4c, 0x76, 0xf5, 0x18, 0x32, 0x3d, 0x69));
+
+/*
+ * ZvioBlkStatsInit - Allocate the per-processor histograms
+ *
+ * They are kept across a re-initialization and freed when the device
+ * stops. The telemetry is diagnostics, so the driver runs without it
+ * when the allocation fails.
+ */
+VOID
+ZvioBlkStatsInit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    LARGE_INTEGER frequency;
+    ULONG count;
+
+    KeQueryPerformanceCounter(&frequency);
+    DeviceContext->PerfFrequency = frequency.QuadPart;
+
+    if (DeviceContext->CpuStats) {
+        return;
+    }
+
+    count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    DeviceContext->CpuStats = (PZVIOBLK_CPU_STATS)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED | POOL_FLAG_CACHE_ALIGNED,
+        count * sizeof(ZVIOBLK_CPU_STATS),
+        ZVIOBLK_TAG
+        );
+
+    if (!DeviceContext->CpuStats) {
+        ZvioBlkDbgError("Failed to allocate latency histograms");
+        return;
+    }
+
+    DeviceContext->CpuStatsCount = count;
+}
+
+/*
+ * ZvioBlkStatsFree - Undo ZvioBlkStatsInit
+ */
+VOID
+ZvioBlkStatsFree(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    if (DeviceContext->CpuStats) {
+        ExFreePoolWithTag(DeviceContext->CpuStats, ZVIOBLK_TAG);
+        DeviceContext->CpuStats = NULL;
+        DeviceContext->CpuStatsCount = 0;
+    }
+}
+
+/*
+ * ZvioBlkStatsClass - Histogram class of a request type, or -1
+ */
+static LONG
+ZvioBlkStatsClass(
+    _In_ ULONG Type
+    )
+{
+    switch (Type) {
+    case VIRTIO_BLK_T_IN:
+        return ZVIOBLK_IO_READ;
+    case VIRTIO_BLK_T_OUT:
+        return ZVIOBLK_IO_WRITE;
+    case VIRTIO_BLK_T_FLUSH:
+        return ZVIOBLK_IO_FLUSH;
+    case VIRTIO_BLK_T_DISCARD:
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        return ZVIOBLK_IO_DISCARD;
+    default:
+        return -1;
+    }
+}
+
+/*
+ * ZvioBlkStatsRecord - Account a completed request
+ */
+VOID
+ZvioBlkStatsRecord(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ ULONG Type,
+    _In_ LONGLONG SubmitTime
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = Queue->DeviceContext;
+    PZVIOBLK_LATENCY_HISTOGRAM histogram;
+    LONG ioClass = ZvioBlkStatsClass(Type);
+    ULONGLONG elapsed;
+    ULONGLONG latencyUs;
+    ULONG bucket = 0;
+    ULONG bit;
+
+    if (ioClass < 0 || SubmitTime == 0 || deviceContext->PerfFrequency == 0) {
+        return;
+    }
+
+    elapsed = (ULONGLONG)(KeQueryPerformanceCounter(NULL).QuadPart - SubmitTime);
+    latencyUs = elapsed * 1000000 / (ULONGLONG)deviceContext->PerfFrequency;
+
+    if (latencyUs != 0 && BitScanReverse64(&bit, latencyUs)) {
+        bucket = min(bit + 1, ZVIOBLK_LATENCY_BUCKETS - 1);
+    }
+
+    TraceLoggingWrite(ZvioBlkTraceProvider, "IoComplete",
+        TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+        TraceLoggingKeyword(ZVIOBLK_TRACE_IO),
+        TraceLoggingUInt32(Queue->Index, "Queue"),
+        TraceLoggingUInt32(Type, "Type"),
+        TraceLoggingUInt64(latencyUs, "LatencyUs"),
+        TraceLoggingUInt32((USHORT)(Queue->Avail->Idx - Queue->LastUsedIdx), "Depth"));
+
+    if (!deviceContext->CpuStats) {
+        return;
+    }
+
+    //
+    // Interlocked only against preemption on the submission path; the
+    // line stays with this processor
+    //
+    histogram = &deviceContext->CpuStats[
+        KeGetCurrentProcessorNumberEx(NULL) % deviceContext->CpuStatsCount].Latency[ioClass];
+
+    InterlockedIncrementNoFence64((volatile LONG64 *)&histogram->Count);
+    InterlockedAddNoFence64((volatile LONG64 *)&histogram->TotalUs, (LONG64)latencyUs);
+    InterlockedIncrementNoFence64((volatile LONG64 *)&histogram->Buckets[bucket]);
+}
+
+/*
+ * ZvioBlkStatsQuery - Snapshot of the telemetry for the guest agent
+ *
+ * Read without locks, so the sums may be a few requests apart.
+ */
+VOID
+ZvioBlkStatsQuery(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _Out_ PZVIOBLK_STATS Stats
+    )
+{
+    ULONG cpu, ioClass, bucket;
+    USHORT i;
+
+    RtlZeroMemory(Stats, sizeof(ZVIOBLK_STATS));
+    Stats->Version = ZVIOBLK_STATS_VERSION;
+
+    for (cpu = 0; DeviceContext->CpuStats && cpu < DeviceContext->CpuStatsCount; cpu++) {
+        for (ioClass = 0; ioClass < ZVIOBLK_IO_CLASSES; ioClass++) {
+            PZVIOBLK_LATENCY_HISTOGRAM from = &DeviceContext->CpuStats[cpu].Latency[ioClass];
+            PZVIOBLK_LATENCY_HISTOGRAM to = &Stats->Latency[ioClass];
+
+            to->Count += ReadULong64NoFence(&from->Count);
+            to->TotalUs += ReadULong64NoFence(&from->TotalUs);
+            for (bucket = 0; bucket < ZVIOBLK_LATENCY_BUCKETS; bucket++) {
+                to->Buckets[bucket] += ReadULong64NoFence(&from->Buckets[bucket]);
+            }
+        }
+    }
+
+    Stats->FlushRequests = (ULONG64)ReadNoFence64(&DeviceContext->FlushRequests);
+    Stats->FlushesPosted = (ULONG64)ReadNoFence64(&DeviceContext->FlushesPosted);
+
+    if (!DeviceContext->Queues) {
+        return;
+    }
+
+    Stats->NumQueues = DeviceContext->NumQueues;
+
+    for (i = 0; i < DeviceContext->NumQueues; i++) {
+        PZVIOBLK_VIRTQUEUE queue = DeviceContext->Queues[i];
+
+        if (!queue) {
+            continue;
+        }
+
+        Stats->Queues[i].Submitted = ReadULong64NoFence(&queue->Submitted);
+        Stats->Queues[i].Depth = (USHORT)(queue->Avail->Idx - queue->LastUsedIdx);
+        Stats->Queues[i].PeakDepth = queue->PeakInFlight;
+    }
+}
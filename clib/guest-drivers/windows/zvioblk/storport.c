@@ -0,0 +1,1719 @@
+/*
+ * Zixiao VirtIO Block Driver - StorPort Miniport
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * zviostor.sys presents the disk to the storage stack as a single
+ * SCSI LUN. StorPort queues the requests and builds their
+ * scatter-gather lists; each one goes to the virtqueue of the MSI-X
+ * message StorPort chose for the issuing processor and completes from
+ * that queue's DPC. Built with ZVIOBLK_STORPORT from zviostor.vcxproj.
+ */
+
+#include "public.h"
+
+#define ZVIOBLK_STOR_VENDOR_ID      "Zixiao  "
+#define ZVIOBLK_STOR_PRODUCT_ID     "VirtIO Block    "
+#define ZVIOBLK_STOR_REVISION       "1.0 "
+
+static HW_FIND_ADAPTER ZvioBlkStorFindAdapter;
+static HW_INITIALIZE ZvioBlkStorInitialize;
+static HW_PASSIVE_INITIALIZE_ROUTINE ZvioBlkStorPassiveInitialize;
+static HW_STARTIO ZvioBlkStorStartIo;
+static HW_INTERRUPT ZvioBlkStorInterrupt;
+static HW_MESSAGE_SIGNALED_INTERRUPT_ROUTINE ZvioBlkStorMsInterrupt;
+static HW_DPC_ROUTINE ZvioBlkStorDpc;
+static HW_RESET_BUS ZvioBlkStorResetBus;
+static HW_ADAPTER_CONTROL ZvioBlkStorAdapterControl;
+static DRIVER_UNLOAD ZvioBlkStorUnload;
+
+// StorPort's unload routine, chained after ours
+static PDRIVER_UNLOAD ZvioBlkStorPortUnload;
+
+//
+// Big-endian fields of CDBs and returned data
+//
+static USHORT
+ZvioBlkStorGetBe16(
+    _In_reads_(2) PUCHAR Buffer
+    )
+{
+    return (USHORT)((Buffer[0] << 8) | Buffer[1]);
+}
+
+static ULONG
+ZvioBlkStorGetBe32(
+    _In_reads_(4) PUCHAR Buffer
+    )
+{
+    return ((ULONG)Buffer[0] << 24) | ((ULONG)Buffer[1] << 16) |
+           ((ULONG)Buffer[2] << 8) | Buffer[3];
+}
+
+static ULONGLONG
+ZvioBlkStorGetBe64(
+    _In_reads_(8) PUCHAR Buffer
+    )
+{
+    return ((ULONGLONG)ZvioBlkStorGetBe32(Buffer) << 32) | ZvioBlkStorGetBe32(Buffer + 4);
+}
+
+static VOID
+ZvioBlkStorPutBe16(
+    _Out_writes_(2) PUCHAR Buffer,
+    _In_ USHORT Value
+    )
+{
+    Buffer[0] = (UCHAR)(Value >> 8);
+    Buffer[1] = (UCHAR)Value;
+}
+
+static VOID
+ZvioBlkStorPutBe32(
+    _Out_writes_(4) PUCHAR Buffer,
+    _In_ ULONG Value
+    )
+{
+    Buffer[0] = (UCHAR)(Value >> 24);
+    Buffer[1] = (UCHAR)(Value >> 16);
+    Buffer[2] = (UCHAR)(Value >> 8);
+    Buffer[3] = (UCHAR)Value;
+}
+
+static VOID
+ZvioBlkStorPutBe64(
+    _Out_writes_(8) PUCHAR Buffer,
+    _In_ ULONGLONG Value
+    )
+{
+    ZvioBlkStorPutBe32(Buffer, (ULONG)(Value >> 32));
+    ZvioBlkStorPutBe32(Buffer + 4, (ULONG)Value);
+}
+
+/*
+ * ZvioBlkStorSectorsPerBlock - 512-byte VirtIO sectors per logical block
+ */
+static ULONG
+ZvioBlkStorSectorsPerBlock(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    return max(DeviceContext->SectorSize / 512, 1);
+}
+
+/*
+ * DriverEntry - Register the miniport with StorPort
+ */
+NTSTATUS
+DriverEntry(
+    _In_ PDRIVER_OBJECT DriverObject,
+    _In_ PUNICODE_STRING RegistryPath
+    )
+{
+    HW_INITIALIZATION_DATA hwInitData;
+    ULONG status;
+
+    ZvioBlkDbgPrint("DriverEntry: Zixiao VirtIO Block StorPort Miniport v1.0");
+
+    RtlZeroMemory(&hwInitData, sizeof(hwInitData));
+    hwInitData.HwInitializationDataSize = sizeof(HW_INITIALIZATION_DATA);
+    hwInitData.AdapterInterfaceType = PCIBus;
+
+    hwInitData.HwFindAdapter = ZvioBlkStorFindAdapter;
+    hwInitData.HwInitialize = ZvioBlkStorInitialize;
+    hwInitData.HwStartIo = ZvioBlkStorStartIo;
+    hwInitData.HwInterrupt = ZvioBlkStorInterrupt;
+    hwInitData.HwResetBus = ZvioBlkStorResetBus;
+    hwInitData.HwAdapterControl = ZvioBlkStorAdapterControl;
+
+    hwInitData.DeviceExtensionSize = sizeof(ZVIOBLK_DEVICE_CONTEXT);
+    hwInitData.SrbExtensionSize = sizeof(ZVIOBLK_REQUEST);
+    hwInitData.NumberOfAccessRanges = PCI_TYPE0_ADDRESSES;
+
+    hwInitData.MapBuffers = STOR_MAP_NON_READ_WRITE_BUFFERS;
+    hwInitData.NeedPhysicalAddresses = TRUE;
+    hwInitData.TaggedQueuing = TRUE;
+    hwInitData.AutoRequestSense = TRUE;
+    hwInitData.MultipleRequestPerLu = TRUE;
+
+    TraceLoggingRegister(ZvioBlkTraceProvider);
+
+    status = StorPortInitialize(DriverObject, RegistryPath, &hwInitData, NULL);
+    if (status != STOR_STATUS_SUCCESS) {
+        ZvioBlkDbgError("StorPortInitialize failed: 0x%08X", status);
+        TraceLoggingUnregister(ZvioBlkTraceProvider);
+        return (NTSTATUS)status;
+    }
+
+    //
+    // StorPort owns the unload routine; hook it to drop the provider
+    //
+    ZvioBlkStorPortUnload = DriverObject->DriverUnload;
+    DriverObject->DriverUnload = ZvioBlkStorUnload;
+
+    return (NTSTATUS)status;
+}
+
+/*
+ * ZvioBlkStorUnload - Unregister the trace provider, then let StorPort unload
+ */
+static VOID
+ZvioBlkStorUnload(
+    _In_ PDRIVER_OBJECT DriverObject
+    )
+{
+    TraceLoggingUnregister(ZvioBlkTraceProvider);
+
+    if (ZvioBlkStorPortUnload) {
+        ZvioBlkStorPortUnload(DriverObject);
+    }
+}
+
+/*
+ * ZvioBlkStorMapBars - Map the memory BARs by their BAR number
+ *
+ * The VirtIO capabilities name BARs by number, so each access range is
+ * matched against the BAR registers in the config space snapshot.
+ */
+static NTSTATUS
+ZvioBlkStorMapBars(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PPORT_CONFIGURATION_INFORMATION ConfigInfo
+    )
+{
+    PPCI_COMMON_CONFIG pciConfig = (PPCI_COMMON_CONFIG)DeviceContext->PciConfig;
+    PHYSICAL_ADDRESS address;
+    ULONG bar;
+    ULONG range;
+
+    for (bar = 0; bar < PCI_TYPE0_ADDRESSES; bar++) {
+        ULONG barValue = pciConfig->u.type0.BaseAddresses[bar];
+        BOOLEAN is64Bit = (barValue & PCI_ADDRESS_MEMORY_TYPE_MASK) == PCI_TYPE_64BIT;
+
+        if (barValue & PCI_ADDRESS_IO_SPACE) {
+            continue;
+        }
+
+        address.QuadPart = barValue & PCI_ADDRESS_MEMORY_ADDRESS_MASK;
+        if (is64Bit && bar + 1 < PCI_TYPE0_ADDRESSES) {
+            address.HighPart = pciConfig->u.type0.BaseAddresses[bar + 1];
+        }
+
+        for (range = 0; address.QuadPart != 0 && range < ConfigInfo->NumberOfAccessRanges; range++) {
+            PACCESS_RANGE accessRange = &(*ConfigInfo->AccessRanges)[range];
+
+            if (!accessRange->RangeInMemory ||
+                accessRange->RangeStart.QuadPart != address.QuadPart) {
+                continue;
+            }
+
+            DeviceContext->BarPA[bar] = address;
+            DeviceContext->BarLength[bar] = accessRange->RangeLength;
+            DeviceContext->BarVA[bar] = StorPortGetDeviceBase(
+                DeviceContext,
+                PCIBus,
+                ConfigInfo->SystemIoBusNumber,
+                accessRange->RangeStart,
+                accessRange->RangeLength,
+                FALSE
+                );
+
+            if (DeviceContext->BarVA[bar] == NULL) {
+                ZvioBlkDbgError("Failed to map BAR%d", bar);
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            ZvioBlkDbgPrint("BAR%d: PA=0x%llX Len=0x%X VA=0x%p",
+                bar, address.QuadPart, accessRange->RangeLength, DeviceContext->BarVA[bar]);
+            break;
+        }
+
+        if (is64Bit) {
+            bar++;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkStorFreeQueues - Destroy the virtqueues after a device reset
+ */
+static VOID
+ZvioBlkStorFreeQueues(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    USHORT i;
+
+    if (DeviceContext->Queues) {
+        for (i = 0; i < DeviceContext->NumQueues; i++) {
+            if (DeviceContext->Queues[i]) {
+                ZvioBlkQueueDestroy(DeviceContext->Queues[i]);
+            }
+        }
+        ExFreePoolWithTag(DeviceContext->Queues, ZVIOBLK_TAG);
+        DeviceContext->Queues = NULL;
+    }
+
+    DeviceContext->NumQueues = 0;
+    DeviceContext->DmaUsed = 0;
+}
+
+/*
+ * ZvioBlkStorReadParameters - Per-adapter options from the registry
+ *
+ * PollQueueDepth (DWORD): requests in flight on a queue from which its
+ * completions are polled by the submitters and the interrupt deferred.
+ * Zero, the default, leaves every completion to the interrupt.
+ */
+static VOID
+ZvioBlkStorReadParameters(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    PULONG value;
+    ULONG length = sizeof(ULONG);
+
+    value = (PULONG)StorPortAllocateRegistryBuffer(DeviceContext, &length);
+    if (value == NULL) {
+        return;
+    }
+
+    *value = 0;
+    if (StorPortRegistryRead(DeviceContext, (PUCHAR)"PollQueueDepth", FALSE, MINIPORT_REG_DWORD,
+                             (PUCHAR)value, &length) && length == sizeof(ULONG)) {
+        DeviceContext->PollQueueDepth = (USHORT)min(*value, MAXUSHORT);
+    }
+
+    StorPortFreeRegistryBuffer(DeviceContext, (PUCHAR)value);
+}
+
+/*
+ * ZvioBlkStorFindAdapter - Locate the device and describe it to StorPort
+ *
+ * Queues are created in the passive initialization routine, once the
+ * granted MSI-X messages are known. The uncached extension is sized
+ * here for the most queues that could be created.
+ */
+static ULONG
+ZvioBlkStorFindAdapter(
+    _In_ PVOID DeviceExtension,
+    _In_ PVOID HwContext,
+    _In_ PVOID BusInformation,
+    _In_z_ PCHAR ArgumentString,
+    _Inout_ PPORT_CONFIGURATION_INFORMATION ConfigInfo,
+    _Out_ PBOOLEAN Reserved3
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    ULONGLONG deviceFeatures;
+    NTSTATUS status;
+    SIZE_T dmaSize = 0;
+    ULONG indirectDescs;
+    ULONG segments;
+    ULONG length;
+    USHORT maxQueues = 1;
+    USHORT queueSize;
+    USHORT i;
+
+    UNREFERENCED_PARAMETER(HwContext);
+    UNREFERENCED_PARAMETER(BusInformation);
+    UNREFERENCED_PARAMETER(ArgumentString);
+
+    *Reserved3 = FALSE;
+
+    //
+    // Called again on restart after ScsiStopAdapter
+    //
+    ZvioBlkStorFreeQueues(deviceContext);
+
+    deviceContext->SystemIoBusNumber = ConfigInfo->SystemIoBusNumber;
+    deviceContext->SlotNumber = ConfigInfo->SlotNumber;
+    deviceContext->SectorSize = 512; // Default
+
+    length = StorPortGetBusData(deviceContext, PCIConfiguration, ConfigInfo->SystemIoBusNumber,
+                                ConfigInfo->SlotNumber, deviceContext->PciConfig,
+                                sizeof(deviceContext->PciConfig));
+    if (length != sizeof(deviceContext->PciConfig)) {
+        ZvioBlkDbgError("PCI config read failed: %d bytes", length);
+        return SP_RETURN_NOT_FOUND;
+    }
+
+    status = ZvioBlkStorMapBars(deviceContext, ConfigInfo);
+    if (!NT_SUCCESS(status)) {
+        return SP_RETURN_ERROR;
+    }
+
+    status = ZvioBlkPciParseCapabilities(deviceContext);
+    if (!NT_SUCCESS(status)) {
+        ZvioBlkDbgError("Failed to parse VirtIO capabilities: 0x%08X", status);
+        return SP_RETURN_NOT_FOUND;
+    }
+
+    status = ZvioBlkDeviceReset(deviceContext);
+    if (!NT_SUCCESS(status)) {
+        return SP_RETURN_ERROR;
+    }
+
+    //
+    // Every offered feature used below is negotiated later, so the
+    // limits can be taken from the device's offer
+    //
+    deviceFeatures = ZvioBlkGetDeviceFeatures(deviceContext);
+
+    if (deviceFeatures & VIRTIO_BLK_F_MQ) {
+        maxQueues = READ_REGISTER_USHORT(&deviceContext->DeviceCfg->NumQueues);
+        maxQueues = (USHORT)min(maxQueues, KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+        maxQueues = max(min(maxQueues, ZVIOBLK_MAX_QUEUES), 1);
+    }
+
+    WRITE_REGISTER_USHORT(&deviceContext->CommonCfg->QueueSel, 0);
+    KeMemoryBarrier();
+    queueSize = READ_REGISTER_USHORT(&deviceContext->CommonCfg->QueueSize);
+    if (queueSize < 3) {
+        ZvioBlkDbgError("Request queue too small: %d", queueSize);
+        return SP_RETURN_NOT_FOUND;
+    }
+
+    //
+    // A transfer within the limits below spans at most that many
+    // pages, so splitting StorPort's elements at SizeMax (a page or
+    // more) keeps it within the segment limit
+    //
+    segments = ZvioBlkMaxSegments(deviceContext, deviceFeatures);
+    indirectDescs = ((deviceFeatures & VIRTIO_F_RING_INDIRECT_DESC) && segments > 1) ?
+        segments + 2 : 0;
+
+    for (i = 0; i < maxQueues; i++) {
+        WRITE_REGISTER_USHORT(&deviceContext->CommonCfg->QueueSel, i);
+        KeMemoryBarrier();
+        queueSize = READ_REGISTER_USHORT(&deviceContext->CommonCfg->QueueSize);
+        dmaSize += ZvioBlkQueueMemorySize(queueSize, indirectDescs,
+            (deviceFeatures & (VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES)) != 0);
+    }
+
+    deviceContext->MaxTransferLength = max(segments - 1, 1) * PAGE_SIZE;
+
+    ZvioBlkStorReadParameters(deviceContext);
+
+    ConfigInfo->NumberOfBuses = 1;
+    ConfigInfo->MaximumNumberOfTargets = 1;
+    ConfigInfo->MaximumNumberOfLogicalUnits = 1;
+    ConfigInfo->ScatterGather = TRUE;
+    ConfigInfo->Master = TRUE;
+    ConfigInfo->CachesData = TRUE;
+    ConfigInfo->Dma32BitAddresses = TRUE;
+    ConfigInfo->Dma64BitAddresses = SCSI_DMA64_MINIPORT_FULL64BIT_SUPPORTED;
+    ConfigInfo->MapBuffers = STOR_MAP_NON_READ_WRITE_BUFFERS;
+    ConfigInfo->ResetTargetSupported = TRUE;
+    ConfigInfo->NumberOfPhysicalBreaks = segments - 1;
+    ConfigInfo->MaximumTransferLength = deviceContext->MaxTransferLength;
+
+    ConfigInfo->SynchronizationModel = StorSynchronizeFullDuplex;
+    ConfigInfo->HwMSInterruptRoutine = ZvioBlkStorMsInterrupt;
+    ConfigInfo->InterruptSynchronizationMode = InterruptSynchronizePerMessage;
+
+    //
+    // StorPort hands back the same extension on a restart
+    //
+    if (deviceContext->DmaBase == NULL) {
+        PUCHAR base = (PUCHAR)StorPortGetUncachedExtension(deviceContext, ConfigInfo,
+                                                           (ULONG)(dmaSize + PAGE_SIZE));
+        if (base == NULL) {
+            ZvioBlkDbgError("Failed to allocate %Iu bytes of queue memory", dmaSize);
+            return SP_RETURN_ERROR;
+        }
+
+        deviceContext->DmaBase = (PUCHAR)ROUND_TO_PAGES((ULONG_PTR)base);
+        deviceContext->DmaBasePhys = StorPortGetPhysicalAddress(deviceContext, NULL,
+                                                                deviceContext->DmaBase, &length);
+        deviceContext->DmaSize = dmaSize;
+    }
+
+    ZvioBlkDbgPrint("FindAdapter: up to %d queue(s), %d segments, max transfer %d",
+        maxQueues, segments, deviceContext->MaxTransferLength);
+
+    return SP_RETURN_FOUND;
+}
+
+/*
+ * ZvioBlkStorInitialize - Defer device setup to passive level
+ */
+static BOOLEAN
+ZvioBlkStorInitialize(
+    _In_ PVOID DeviceExtension
+    )
+{
+    return StorPortEnablePassiveInitialization(DeviceExtension, ZvioBlkStorPassiveInitialize);
+}
+
+/*
+ * ZvioBlkStorInitializePerfOpts - Enable StorPort's multi-queue options
+ *
+ * DPC redirection completes each request on the processor that issued
+ * it, concurrent channels let StartIo run on every queue at once, and
+ * the message ranges tell StorPort which messages carry completions.
+ */
+static VOID
+ZvioBlkStorInitializePerfOpts(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONG MessageCount
+    )
+{
+    PERF_CONFIGURATION_DATA perfData;
+    ULONG supported;
+    ULONG status;
+
+    RtlZeroMemory(&perfData, sizeof(perfData));
+    perfData.Version = STOR_PERF_VERSION;
+    perfData.Size = sizeof(PERF_CONFIGURATION_DATA);
+
+    status = StorPortInitializePerfOpts(DeviceContext, TRUE, &perfData);
+    if (status != STOR_STATUS_SUCCESS) {
+        ZvioBlkDbgError("StorPortInitializePerfOpts query failed: 0x%08X", status);
+        return;
+    }
+
+    supported = perfData.Flags;
+    perfData.Flags = 0;
+
+    if (supported & STOR_PERF_DPC_REDIRECTION) {
+        perfData.Flags |= STOR_PERF_DPC_REDIRECTION;
+    }
+
+    if ((supported & STOR_PERF_CONCURRENT_CHANNELS) && DeviceContext->NumQueues > 1) {
+        perfData.Flags |= STOR_PERF_CONCURRENT_CHANNELS;
+        perfData.ConcurrentChannels = DeviceContext->NumQueues;
+    }
+
+    if (DeviceContext->UseMsix && DeviceContext->InterruptCount > 1) {
+        if (supported & STOR_PERF_INTERRUPT_MESSAGE_RANGES) {
+            perfData.Flags |= STOR_PERF_INTERRUPT_MESSAGE_RANGES;
+            perfData.FirstRedirectionMessageNumber = 1;
+            perfData.LastRedirectionMessageNumber = DeviceContext->NumQueues;
+        }
+
+        //
+        // StorPort writes a target for every message it connected
+        //
+        if ((supported & STOR_PERF_ADV_CONFIG_LOCALITY) && MessageCount <= ZVIOBLK_MAX_INTERRUPTS) {
+            perfData.Flags |= STOR_PERF_ADV_CONFIG_LOCALITY;
+            perfData.MessageTargets = DeviceContext->InterruptAffinity;
+        }
+    }
+
+    status = StorPortInitializePerfOpts(DeviceContext, FALSE, &perfData);
+    if (status != STOR_STATUS_SUCCESS) {
+        ZvioBlkDbgError("StorPortInitializePerfOpts failed: 0x%08X", status);
+        return;
+    }
+
+    if (perfData.Flags & STOR_PERF_ADV_CONFIG_LOCALITY) {
+        ZvioBlkMapProcessors(DeviceContext);
+    }
+
+    ZvioBlkDbgPrint("Perf options: 0x%08X (supported 0x%08X)", perfData.Flags, supported);
+}
+
+/*
+ * ZvioBlkStorPassiveInitialize - Bring up the device and its queues
+ */
+static BOOLEAN
+ZvioBlkStorPassiveInitialize(
+    _In_ PVOID DeviceExtension
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    MESSAGE_INTERRUPT_INFORMATION msiInfo;
+    ULONG messages = 0;
+    NTSTATUS status;
+    USHORT i;
+
+    //
+    // Count the messages StorPort connected
+    //
+    while (StorPortGetMSIInfo(deviceContext, messages, &msiInfo) == STOR_STATUS_SUCCESS) {
+        messages++;
+    }
+
+    deviceContext->UseMsix = (messages > 0);
+    deviceContext->InterruptCount = max(min(messages, ZVIOBLK_MAX_INTERRUPTS), 1);
+    RtlZeroMemory(deviceContext->InterruptAffinity, sizeof(deviceContext->InterruptAffinity));
+
+    //
+    // The DPCs must be ready before the first interrupt
+    //
+    for (i = 0; i < ZVIOBLK_MAX_QUEUES; i++) {
+        StorPortInitializeDpc(deviceContext, &deviceContext->Dpcs[i], ZvioBlkStorDpc);
+    }
+
+    status = ZvioBlkDeviceInit(deviceContext);
+    if (!NT_SUCCESS(status)) {
+        ZvioBlkDbgError("Failed to initialize VirtIO device: 0x%08X", status);
+        return FALSE;
+    }
+
+    ZvioBlkReadDeviceConfig(deviceContext);
+    ZvioBlkStorInitializePerfOpts(deviceContext, messages);
+
+    ZvioBlkDbgPrint("PassiveInitialize: %d queue(s), %d message(s)",
+        deviceContext->NumQueues, messages);
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkStorCompleteSrb - Hand an SRB back to StorPort
+ */
+static VOID
+ZvioBlkStorCompleteSrb(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ UCHAR SrbStatus
+    )
+{
+    Srb->SrbStatus = SrbStatus;
+    StorPortNotification(RequestComplete, DeviceContext, Srb);
+}
+
+/*
+ * ZvioBlkStorSetSense - Fail an SRB with CHECK CONDITION and sense data
+ */
+static UCHAR
+ZvioBlkStorSetSense(
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ UCHAR SenseKey,
+    _In_ UCHAR AdditionalSenseCode
+    )
+{
+    PSENSE_DATA sense = (PSENSE_DATA)Srb->SenseInfoBuffer;
+
+    Srb->ScsiStatus = SCSISTAT_CHECK_CONDITION;
+    Srb->DataTransferLength = 0;
+
+    if (sense == NULL || Srb->SenseInfoBufferLength < sizeof(SENSE_DATA)) {
+        return SRB_STATUS_ERROR;
+    }
+
+    RtlZeroMemory(sense, sizeof(SENSE_DATA));
+    sense->ErrorCode = SCSI_SENSE_ERRORCODE_FIXED_CURRENT;
+    sense->SenseKey = SenseKey;
+    sense->AdditionalSenseLength =
+        sizeof(SENSE_DATA) - RTL_SIZEOF_THROUGH_FIELD(SENSE_DATA, AdditionalSenseLength);
+    sense->AdditionalSenseCode = AdditionalSenseCode;
+    Srb->SenseInfoBufferLength = sizeof(SENSE_DATA);
+
+    return SRB_STATUS_ERROR | SRB_STATUS_AUTOSENSE_VALID;
+}
+
+/*
+ * ZvioBlkStorReturnData - Copy emulated command data to the SRB buffer
+ */
+static UCHAR
+ZvioBlkStorReturnData(
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_reads_bytes_(Length) PVOID Data,
+    _In_ ULONG Length,
+    _In_ ULONG AllocationLength
+    )
+{
+    ULONG length = min(min(Length, AllocationLength), Srb->DataTransferLength);
+
+    if (length > 0 && Srb->DataBuffer == NULL) {
+        return SRB_STATUS_ERROR;
+    }
+
+    RtlCopyMemory(Srb->DataBuffer, Data, length);
+    Srb->DataTransferLength = length;
+    Srb->ScsiStatus = SCSISTAT_GOOD;
+
+    return SRB_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkStorSelectQueue - Request queue for an SRB
+ *
+ * With DPC redirection StorPort names the message that completes on
+ * the issuing processor; otherwise the processor map decides.
+ */
+static PZVIOBLK_VIRTQUEUE
+ZvioBlkStorSelectQueue(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    STARTIO_PERFORMANCE_PARAMETERS params;
+    PROCESSOR_NUMBER processor;
+    ULONG index;
+
+    if (DeviceContext->NumQueues == 0 || DeviceContext->Queues == NULL) {
+        return NULL;
+    }
+
+    if (DeviceContext->UseMsix && DeviceContext->InterruptCount > 1) {
+        RtlZeroMemory(&params, sizeof(params));
+        params.Version = STOR_PERF_VERSION;
+        params.Size = sizeof(params);
+
+        if (StorPortGetStartIoPerfParams(DeviceContext, Srb, &params) == STOR_STATUS_SUCCESS &&
+            params.MessageNumber > 0 && params.MessageNumber <= DeviceContext->NumQueues) {
+            return DeviceContext->Queues[params.MessageNumber - 1];
+        }
+    }
+
+    StorPortGetCurrentProcessorNumber(DeviceContext, &processor);
+    index = KeGetProcessorIndexFromNumber(&processor);
+
+    if (index < ZVIOBLK_MAX_PROCESSORS) {
+        index = DeviceContext->ProcessorQueue[index];
+    } else {
+        index %= DeviceContext->NumQueues;
+    }
+
+    return DeviceContext->Queues[index];
+}
+
+/*
+ * ZvioBlkStorSubmit - Post an SRB to its virtqueue
+ */
+static UCHAR
+ZvioBlkStorSubmit(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ ULONG Type,
+    _In_ ULONGLONG Sector,
+    _In_ BOOLEAN HasData
+    )
+{
+    PZVIOBLK_REQUEST blkRequest = (PZVIOBLK_REQUEST)Srb->SrbExtension;
+    PSCATTER_GATHER_LIST sgList = NULL;
+    PZVIOBLK_VIRTQUEUE queue;
+    VIRTIO_BLK_REQ_HDR header;
+    NTSTATUS status;
+
+    queue = ZvioBlkStorSelectQueue(DeviceContext, Srb);
+    if (queue == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    //
+    // STOR_SCATTER_GATHER_LIST has the layout of SCATTER_GATHER_LIST
+    //
+    if (HasData) {
+        sgList = (PSCATTER_GATHER_LIST)StorPortGetScatterGatherList(DeviceContext, Srb);
+        if (sgList == NULL) {
+            return SRB_STATUS_ERROR;
+        }
+    }
+
+    RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
+    blkRequest->Srb = Srb;
+    blkRequest->Queue = queue;
+    blkRequest->Type = Type;
+    blkRequest->DataLength = HasData ? Srb->DataTransferLength : 0;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    header.Type = Type;
+    header.Reserved = 0;
+    header.Sector = Sector;
+
+    status = ZvioBlkQueueAddRequest(
+        queue,
+        &header,
+        sgList,
+        Type == VIRTIO_BLK_T_OUT,
+        blkRequest,
+        &blkRequest->HeadDescIdx
+        );
+
+    //
+    // A full ring is retried by StorPort
+    //
+    if (status == STATUS_INSUFFICIENT_RESOURCES) {
+        return SRB_STATUS_BUSY;
+    }
+    if (!NT_SUCCESS(status)) {
+        return SRB_STATUS_ERROR;
+    }
+
+    ZvioBlkQueueKick(queue);
+    ZvioBlkQueuePoll(queue);
+
+    return SRB_STATUS_PENDING;
+}
+
+/*
+ * ZvioBlkStorPostFlush - Post a batch of flushes as one VIRTIO_BLK_T_FLUSH
+ *
+ * The first SRB of the batch carries it. A batch that cannot be posted
+ * is handed back busy, for StorPort to retry, and the flushes that
+ * queued meanwhile are tried next.
+ */
+static VOID
+ZvioBlkStorPostFlush(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_opt_ PZVIOBLK_REQUEST Batch
+    )
+{
+    VIRTIO_BLK_REQ_HDR header;
+    PZVIOBLK_REQUEST next;
+    NTSTATUS status;
+    UCHAR srbStatus;
+
+    while (Batch != NULL) {
+        header.Type = VIRTIO_BLK_T_FLUSH;
+        header.Reserved = 0;
+        header.Sector = 0;
+
+        status = ZvioBlkQueueAddRequest(Batch->Queue, &header, NULL, FALSE,
+                                        Batch, &Batch->HeadDescIdx);
+        if (NT_SUCCESS(status)) {
+            ZvioBlkQueueKick(Batch->Queue);
+            return;
+        }
+
+        srbStatus = (status == STATUS_INSUFFICIENT_RESOURCES) ? SRB_STATUS_BUSY : SRB_STATUS_ERROR;
+        next = ZvioBlkFlushDone(DeviceContext);
+
+        while (Batch != NULL) {
+            PSCSI_REQUEST_BLOCK srb = Batch->Srb;
+
+            Batch = Batch->FlushNext;
+            ZvioBlkStorCompleteSrb(DeviceContext, srb, srbStatus);
+        }
+
+        Batch = next;
+    }
+}
+
+/*
+ * ZvioBlkStorFlush - SYNCHRONIZE CACHE, SRB_FUNCTION_FLUSH and SHUTDOWN
+ *
+ * Flushes are coalesced: one arriving while another is in flight
+ * waits for the next VIRTIO_BLK_T_FLUSH, which releases every flush
+ * that queued for it.
+ */
+static UCHAR
+ZvioBlkStorFlush(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PZVIOBLK_REQUEST blkRequest = (PZVIOBLK_REQUEST)Srb->SrbExtension;
+    PZVIOBLK_VIRTQUEUE queue;
+
+    if (!DeviceContext->SupportsFlush || DeviceContext->ReadOnly) {
+        Srb->DataTransferLength = 0;
+        return SRB_STATUS_SUCCESS;
+    }
+
+    queue = ZvioBlkStorSelectQueue(DeviceContext, Srb);
+    if (queue == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
+    blkRequest->Srb = Srb;
+    blkRequest->Queue = queue;
+    blkRequest->Type = VIRTIO_BLK_T_FLUSH;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    ZvioBlkStorPostFlush(DeviceContext, ZvioBlkFlushJoin(DeviceContext, blkRequest));
+
+    return SRB_STATUS_PENDING;
+}
+
+/*
+ * ZvioBlkStorReadWrite - READ and WRITE (6/10/12/16)
+ */
+static UCHAR
+ZvioBlkStorReadWrite(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PUCHAR cdb = Srb->Cdb;
+    ULONGLONG blockCount;
+    ULONGLONG lba;
+    ULONG blocks;
+    BOOLEAN write;
+
+    switch (cdb[0]) {
+    case SCSIOP_READ6:
+    case SCSIOP_WRITE6:
+        lba = ((ULONG)(cdb[1] & 0x1F) << 16) | ((ULONG)cdb[2] << 8) | cdb[3];
+        blocks = cdb[4] ? cdb[4] : 256;
+        break;
+
+    case SCSIOP_READ:
+    case SCSIOP_WRITE:
+        lba = ZvioBlkStorGetBe32(&cdb[2]);
+        blocks = ZvioBlkStorGetBe16(&cdb[7]);
+        break;
+
+    case SCSIOP_READ12:
+    case SCSIOP_WRITE12:
+        lba = ZvioBlkStorGetBe32(&cdb[2]);
+        blocks = ZvioBlkStorGetBe32(&cdb[6]);
+        break;
+
+    default:
+        lba = ZvioBlkStorGetBe64(&cdb[2]);
+        blocks = ZvioBlkStorGetBe32(&cdb[10]);
+        break;
+    }
+
+    write = cdb[0] == SCSIOP_WRITE6 || cdb[0] == SCSIOP_WRITE ||
+            cdb[0] == SCSIOP_WRITE12 || cdb[0] == SCSIOP_WRITE16;
+
+    if (write && DeviceContext->ReadOnly) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
+    }
+
+    blockCount = DeviceContext->Capacity / ZvioBlkStorSectorsPerBlock(DeviceContext);
+    if (lba > blockCount || blocks > blockCount - lba) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+    }
+
+    if ((ULONGLONG)blocks * DeviceContext->SectorSize < Srb->DataTransferLength) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    if (blocks == 0 || Srb->DataTransferLength == 0) {
+        Srb->DataTransferLength = 0;
+        return SRB_STATUS_SUCCESS;
+    }
+
+    return ZvioBlkStorSubmit(DeviceContext, Srb,
+                             write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN,
+                             lba * ZvioBlkStorSectorsPerBlock(DeviceContext), TRUE);
+}
+
+/*
+ * ZvioBlkStorPostRanges - Post a filled segment table for an SRB
+ *
+ * Consumes the table: it is posted, or returned to the queue.
+ */
+static UCHAR
+ZvioBlkStorPostRanges(
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ ULONG Type,
+    _In_ PZVIOBLK_RANGES Ranges
+    )
+{
+    PZVIOBLK_REQUEST blkRequest = (PZVIOBLK_REQUEST)Srb->SrbExtension;
+    VIRTIO_BLK_REQ_HDR header;
+    NTSTATUS status;
+
+    //
+    // Nothing left once aligned
+    //
+    if (Ranges->Count == 0) {
+        ZvioBlkQueuePutRangeTable(Queue, Ranges->Segments);
+        Srb->DataTransferLength = 0;
+        return SRB_STATUS_SUCCESS;
+    }
+
+    RtlZeroMemory(blkRequest, sizeof(ZVIOBLK_REQUEST));
+    blkRequest->Srb = Srb;
+    blkRequest->Queue = Queue;
+    blkRequest->Type = Type;
+    blkRequest->SubmitTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    header.Type = Type;
+    header.Reserved = 0;
+    header.Sector = 0;
+
+    status = ZvioBlkQueueAddRanges(Queue, &header, Ranges->Segments, Ranges->Count,
+                                   blkRequest, &blkRequest->HeadDescIdx);
+    if (!NT_SUCCESS(status)) {
+        ZvioBlkQueuePutRangeTable(Queue, Ranges->Segments);
+        return (status == STATUS_INSUFFICIENT_RESOURCES) ? SRB_STATUS_BUSY : SRB_STATUS_ERROR;
+    }
+
+    ZvioBlkQueueKick(Queue);
+
+    return SRB_STATUS_PENDING;
+}
+
+/*
+ * ZvioBlkStorUnmap - UNMAP, as a discard or deallocating write zeroes
+ */
+static UCHAR
+ZvioBlkStorUnmap(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PUCHAR list = (PUCHAR)Srb->DataBuffer;
+    ULONG sectorsPerBlock = ZvioBlkStorSectorsPerBlock(DeviceContext);
+    ULONGLONG blockCount = DeviceContext->Capacity / sectorsPerBlock;
+    ULONG type = ZvioBlkTrimType(DeviceContext);
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES table;
+    PZVIOBLK_VIRTQUEUE queue;
+    ZVIOBLK_RANGES ranges;
+    ULONG count;
+    ULONG i;
+
+    if (type == 0) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND);
+    }
+
+    //
+    // An 8-byte header, then 16-byte block descriptors
+    //
+    if (list == NULL || Srb->DataTransferLength < 8) {
+        Srb->DataTransferLength = 0;
+        return SRB_STATUS_SUCCESS;
+    }
+
+    count = min(ZvioBlkStorGetBe16(&list[2]), Srb->DataTransferLength - 8) / 16;
+    if (count == 0) {
+        Srb->DataTransferLength = 0;
+        return SRB_STATUS_SUCCESS;
+    }
+
+    queue = ZvioBlkStorSelectQueue(DeviceContext, Srb);
+    if (queue == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    table = ZvioBlkQueueGetRangeTable(queue);
+    if (table == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    ZvioBlkRangesInit(DeviceContext, type, TRUE, table, &ranges);
+
+    for (i = 0; i < count; i++) {
+        PUCHAR descriptor = &list[8 + i * 16];
+        ULONGLONG lba = ZvioBlkStorGetBe64(descriptor);
+        ULONG blocks = ZvioBlkStorGetBe32(descriptor + 8);
+        ULONGLONG sectors = (ULONGLONG)blocks * sectorsPerBlock;
+
+        if (lba > blockCount || blocks > blockCount - lba) {
+            ZvioBlkQueuePutRangeTable(queue, table);
+            return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+        }
+
+        if (ZvioBlkRangesAdd(&ranges, lba * sectorsPerBlock, sectors) < sectors) {
+            ZvioBlkQueuePutRangeTable(queue, table);
+            return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                                       SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+        }
+    }
+
+    return ZvioBlkStorPostRanges(Srb, queue, type, &ranges);
+}
+
+/*
+ * ZvioBlkStorWriteSame - WRITE SAME (16) of zeroes, as write zeroes
+ *
+ * Only a zero pattern is served; the UNMAP bit lets the device
+ * deallocate the range.
+ */
+static UCHAR
+ZvioBlkStorWriteSame(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PUCHAR cdb = Srb->Cdb;
+    ULONG sectorsPerBlock = ZvioBlkStorSectorsPerBlock(DeviceContext);
+    ULONGLONG blockCount = DeviceContext->Capacity / sectorsPerBlock;
+    ULONGLONG lba = ZvioBlkStorGetBe64(&cdb[2]);
+    ULONG blocks = ZvioBlkStorGetBe32(&cdb[10]);
+    ULONGLONG sectors = (ULONGLONG)blocks * sectorsPerBlock;
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES table;
+    PZVIOBLK_VIRTQUEUE queue;
+    ZVIOBLK_RANGES ranges;
+    PUCHAR pattern;
+    ULONG i;
+
+    if (DeviceContext->ReadOnly) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_DATA_PROTECT, SCSI_ADSENSE_WRITE_PROTECT);
+    }
+
+    if (!DeviceContext->SupportsWriteZeroes) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND);
+    }
+
+    //
+    // NDOB means no pattern was sent: the blocks become zero
+    //
+    if (!(cdb[1] & 0x01)) {
+        pattern = (PUCHAR)Srb->DataBuffer;
+        if (pattern == NULL || Srb->DataTransferLength < DeviceContext->SectorSize) {
+            return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+        }
+        for (i = 0; i < DeviceContext->SectorSize; i++) {
+            if (pattern[i] != 0) {
+                return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+            }
+        }
+    }
+
+    if (blocks == 0) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    if (lba > blockCount || blocks > blockCount - lba) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_BLOCK);
+    }
+
+    queue = ZvioBlkStorSelectQueue(DeviceContext, Srb);
+    if (queue == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    table = ZvioBlkQueueGetRangeTable(queue);
+    if (table == NULL) {
+        return SRB_STATUS_BUSY;
+    }
+
+    ZvioBlkRangesInit(DeviceContext, VIRTIO_BLK_T_WRITE_ZEROES, (cdb[1] & 0x08) != 0, table, &ranges);
+
+    if (ZvioBlkRangesAdd(&ranges, lba * sectorsPerBlock, sectors) < sectors) {
+        ZvioBlkQueuePutRangeTable(queue, table);
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    return ZvioBlkStorPostRanges(Srb, queue, VIRTIO_BLK_T_WRITE_ZEROES, &ranges);
+}
+
+/*
+ * ZvioBlkStorInquiry - Standard INQUIRY data and the VPD pages we serve
+ */
+static UCHAR
+ZvioBlkStorInquiry(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    UCHAR page[64];
+    ULONG allocationLength = ZvioBlkStorGetBe16(&Srb->Cdb[3]);
+    ULONG sectorsPerBlock = ZvioBlkStorSectorsPerBlock(DeviceContext);
+    ULONG trimType = ZvioBlkTrimType(DeviceContext);
+    ZVIOBLK_RANGES ranges;
+    ULONG length;
+    ULONG i;
+
+    RtlZeroMemory(page, sizeof(page));
+
+    if (!(Srb->Cdb[1] & CDB_INQUIRY_EVPD)) {
+        PINQUIRYDATA inquiry = (PINQUIRYDATA)page;
+
+        if (Srb->Cdb[2] != 0) {
+            return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+        }
+
+        inquiry->DeviceType = DIRECT_ACCESS_DEVICE;
+        inquiry->Versions = 5;  // SPC-3
+        inquiry->ResponseDataFormat = 2;
+        inquiry->AdditionalLength = INQUIRYDATABUFFERSIZE - 5;
+        inquiry->CommandQueue = 1;
+        RtlCopyMemory(inquiry->VendorId, ZVIOBLK_STOR_VENDOR_ID, sizeof(inquiry->VendorId));
+        RtlCopyMemory(inquiry->ProductId, ZVIOBLK_STOR_PRODUCT_ID, sizeof(inquiry->ProductId));
+        RtlCopyMemory(inquiry->ProductRevisionLevel, ZVIOBLK_STOR_REVISION,
+                      sizeof(inquiry->ProductRevisionLevel));
+
+        return ZvioBlkStorReturnData(Srb, page, INQUIRYDATABUFFERSIZE, allocationLength);
+    }
+
+    page[0] = DIRECT_ACCESS_DEVICE;
+    page[1] = Srb->Cdb[2];
+
+    switch (Srb->Cdb[2]) {
+    case VPD_SUPPORTED_PAGES:
+        page[3] = 5;
+        page[4] = VPD_SUPPORTED_PAGES;
+        page[5] = VPD_SERIAL_NUMBER;
+        page[6] = VPD_BLOCK_LIMITS;
+        page[7] = VPD_BLOCK_DEVICE_CHARACTERISTICS;
+        page[8] = VPD_LOGICAL_BLOCK_PROVISIONING;
+        length = 9;
+        break;
+
+    case VPD_SERIAL_NUMBER:
+        //
+        // Blank when the device ID is not known
+        //
+        for (i = 0; i < sizeof(DeviceContext->DeviceId) - 1 && DeviceContext->DeviceId[i]; i++) {
+            page[4 + i] = DeviceContext->DeviceId[i];
+        }
+        if (i == 0) {
+            page[4] = ' ';
+            i = 1;
+        }
+        page[3] = (UCHAR)i;
+        length = 4 + i;
+        break;
+
+    case VPD_BLOCK_LIMITS:
+        ZvioBlkStorPutBe16(&page[2], 0x3C);
+        page[4] = 0x01;  // WSNZ: WRITE SAME needs a block count
+        ZvioBlkStorPutBe32(&page[8], DeviceContext->MaxTransferLength / DeviceContext->SectorSize);
+
+        //
+        // One UNMAP or WRITE SAME must fit one VirtIO request: no more
+        // blocks than a segment holds, no more descriptors than a table
+        //
+        if (trimType != 0) {
+            ZvioBlkRangesInit(DeviceContext, trimType, TRUE, NULL, &ranges);
+            ZvioBlkStorPutBe32(&page[20], max(ranges.MaxSectors / sectorsPerBlock, 1));
+            ZvioBlkStorPutBe32(&page[24], ranges.MaxCount);
+            ZvioBlkStorPutBe32(&page[28], max(ranges.Alignment / sectorsPerBlock, 1));
+        }
+        if (DeviceContext->SupportsWriteZeroes && !DeviceContext->ReadOnly) {
+            ZvioBlkRangesInit(DeviceContext, VIRTIO_BLK_T_WRITE_ZEROES, FALSE, NULL, &ranges);
+            ZvioBlkStorPutBe64(&page[36], max(ranges.MaxSectors / sectorsPerBlock, 1));
+        }
+        length = 0x40;
+        break;
+
+    case VPD_LOGICAL_BLOCK_PROVISIONING:
+        ZvioBlkStorPutBe16(&page[2], 4);
+        if (trimType != 0) {
+            page[5] |= 0x80;  // LBPU: UNMAP
+            page[6] = 0x02;   // Thin provisioned
+        }
+        if (DeviceContext->SupportsWriteZeroes && !DeviceContext->ReadOnly) {
+            page[5] |= 0x40;  // LBPWS: WRITE SAME (16) with UNMAP
+        }
+        if (trimType == VIRTIO_BLK_T_WRITE_ZEROES) {
+            page[5] |= 0x04;  // LBPRZ: unmapped blocks read as zero
+        }
+        length = 8;
+        break;
+
+    case VPD_BLOCK_DEVICE_CHARACTERISTICS:
+        ZvioBlkStorPutBe16(&page[2], 0x3C);
+        ZvioBlkStorPutBe16(&page[4], 1);  // Non-rotating medium
+        length = 0x40;
+        break;
+
+    default:
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    return ZvioBlkStorReturnData(Srb, page, length, allocationLength);
+}
+
+/*
+ * ZvioBlkStorReadCapacity - READ CAPACITY (10) and (16)
+ */
+static UCHAR
+ZvioBlkStorReadCapacity(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb,
+    _In_ BOOLEAN Capacity16
+    )
+{
+    UCHAR data[32];
+    ULONGLONG lastLba;
+
+    RtlZeroMemory(data, sizeof(data));
+    lastLba = DeviceContext->Capacity / ZvioBlkStorSectorsPerBlock(DeviceContext) - 1;
+
+    if (!Capacity16) {
+        ZvioBlkStorPutBe32(&data[0], lastLba > MAXULONG ? MAXULONG : (ULONG)lastLba);
+        ZvioBlkStorPutBe32(&data[4], DeviceContext->SectorSize);
+        return ZvioBlkStorReturnData(Srb, data, 8, 8);
+    }
+
+    ZvioBlkStorPutBe64(&data[0], lastLba);
+    ZvioBlkStorPutBe32(&data[8], DeviceContext->SectorSize);
+
+    switch (ZvioBlkTrimType(DeviceContext)) {
+    case VIRTIO_BLK_T_DISCARD:
+        data[14] = 0x80;         // LBPME
+        break;
+    case VIRTIO_BLK_T_WRITE_ZEROES:
+        data[14] = 0x80 | 0x40;  // LBPME, LBPRZ
+        break;
+    }
+
+    return ZvioBlkStorReturnData(Srb, data, sizeof(data), ZvioBlkStorGetBe32(&Srb->Cdb[10]));
+}
+
+/*
+ * ZvioBlkStorModeSense - MODE SENSE (6) and (10) with the caching page
+ *
+ * WCE reports the write cache mode; among the changeable values it is
+ * set when the mode can be switched with MODE SELECT.
+ */
+static UCHAR
+ZvioBlkStorModeSense(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    BOOLEAN modeSense10 = Srb->Cdb[0] == SCSIOP_MODE_SENSE10;
+    BOOLEAN changeable = (Srb->Cdb[2] >> 6) == 1;
+    UCHAR pageCode = Srb->Cdb[2] & 0x3F;
+    ULONG headerLength = modeSense10 ? 8 : 4;
+    ULONG allocationLength;
+    UCHAR data[8 + 20];
+    PUCHAR page;
+    ULONG length;
+
+    if (pageCode != MODE_PAGE_CACHING && pageCode != MODE_SENSE_RETURN_ALL) {
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    RtlZeroMemory(data, sizeof(data));
+
+    page = data + headerLength;
+    page[0] = MODE_PAGE_CACHING;
+    page[1] = 0x12;
+    if (changeable) {
+        page[2] = DeviceContext->SupportsConfigWce ? 0x04 : 0;
+    } else {
+        page[2] = DeviceContext->WriteCache ? 0x04 : 0;     // WCE
+    }
+    length = headerLength + 20;
+
+    if (modeSense10) {
+        ZvioBlkStorPutBe16(&data[0], (USHORT)(length - 2));
+        data[3] = DeviceContext->ReadOnly ? MODE_DSP_WRITE_PROTECT : 0;
+        allocationLength = ZvioBlkStorGetBe16(&Srb->Cdb[7]);
+    } else {
+        data[0] = (UCHAR)(length - 1);
+        data[2] = DeviceContext->ReadOnly ? MODE_DSP_WRITE_PROTECT : 0;
+        allocationLength = Srb->Cdb[4];
+    }
+
+    return ZvioBlkStorReturnData(Srb, data, length, allocationLength);
+}
+
+/*
+ * ZvioBlkStorModeSelect - MODE SELECT (6) and (10) of the caching page
+ *
+ * Only WCE is applied, switching the write cache mode; the rest of the
+ * page is ignored. Saved pages are not supported.
+ */
+static UCHAR
+ZvioBlkStorModeSelect(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    BOOLEAN modeSelect10 = Srb->Cdb[0] == SCSIOP_MODE_SELECT10;
+    PUCHAR data = (PUCHAR)Srb->DataBuffer;
+    ULONG length;
+    ULONG offset;
+    ULONG pageLength;
+
+    if (Srb->Cdb[1] & 0x01) {   // SP
+        return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_INVALID_CDB);
+    }
+
+    length = modeSelect10 ? ZvioBlkStorGetBe16(&Srb->Cdb[7]) : Srb->Cdb[4];
+    length = min(length, Srb->DataTransferLength);
+
+    if (length > 0) {
+        offset = modeSelect10 ? 8 : 4;
+        if (data == NULL || length < offset) {
+            return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                                       SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+        }
+
+        //
+        // Skip the block descriptors
+        //
+        offset += modeSelect10 ? ZvioBlkStorGetBe16(&data[6]) : data[3];
+
+        while (offset + 2 <= length) {
+            pageLength = data[offset + 1];
+
+            if ((data[offset] & 0x3F) != MODE_PAGE_CACHING || pageLength < 1 ||
+                offset + 2 + pageLength > length ||
+                !NT_SUCCESS(ZvioBlkSetWriteCache(DeviceContext, (data[offset + 2] & 0x04) != 0))) {
+                return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                                           SCSI_ADSENSE_INVALID_FIELD_PARAMETER_LIST);
+            }
+
+            offset += 2 + pageLength;
+        }
+    }
+
+    Srb->DataTransferLength = 0;
+    Srb->ScsiStatus = SCSISTAT_GOOD;
+    return SRB_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkStorExecuteScsi - Dispatch a SCSI command for LUN 0
+ */
+static UCHAR
+ZvioBlkStorExecuteScsi(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    UCHAR data[18];
+
+    switch (Srb->Cdb[0]) {
+    case SCSIOP_READ6:
+    case SCSIOP_READ:
+    case SCSIOP_READ12:
+    case SCSIOP_READ16:
+    case SCSIOP_WRITE6:
+    case SCSIOP_WRITE:
+    case SCSIOP_WRITE12:
+    case SCSIOP_WRITE16:
+        return ZvioBlkStorReadWrite(DeviceContext, Srb);
+
+    case SCSIOP_SYNCHRONIZE_CACHE:
+    case SCSIOP_SYNCHRONIZE_CACHE16:
+        return ZvioBlkStorFlush(DeviceContext, Srb);
+
+    case SCSIOP_UNMAP:
+        return ZvioBlkStorUnmap(DeviceContext, Srb);
+
+    case SCSIOP_WRITE_SAME16:
+        return ZvioBlkStorWriteSame(DeviceContext, Srb);
+
+    case SCSIOP_INQUIRY:
+        return ZvioBlkStorInquiry(DeviceContext, Srb);
+
+    case SCSIOP_READ_CAPACITY:
+        return ZvioBlkStorReadCapacity(DeviceContext, Srb, FALSE);
+
+    case SCSIOP_READ_CAPACITY16:
+        if ((Srb->Cdb[1] & 0x1F) == SERVICE_ACTION_READ_CAPACITY16) {
+            return ZvioBlkStorReadCapacity(DeviceContext, Srb, TRUE);
+        }
+        break;
+
+    case SCSIOP_MODE_SENSE:
+    case SCSIOP_MODE_SENSE10:
+        return ZvioBlkStorModeSense(DeviceContext, Srb);
+
+    case SCSIOP_MODE_SELECT:
+    case SCSIOP_MODE_SELECT10:
+        return ZvioBlkStorModeSelect(DeviceContext, Srb);
+
+    case SCSIOP_REPORT_LUNS:
+        //
+        // LUN 0 only: an 8-byte list header and one zero entry
+        //
+        RtlZeroMemory(data, sizeof(data));
+        ZvioBlkStorPutBe32(&data[0], 8);
+        return ZvioBlkStorReturnData(Srb, data, 16, ZvioBlkStorGetBe32(&Srb->Cdb[6]));
+
+    case SCSIOP_REQUEST_SENSE:
+        RtlZeroMemory(data, sizeof(data));
+        data[0] = SCSI_SENSE_ERRORCODE_FIXED_CURRENT;
+        data[7] = sizeof(data) - 8;
+        return ZvioBlkStorReturnData(Srb, data, sizeof(data), Srb->Cdb[4]);
+
+    case SCSIOP_TEST_UNIT_READY:
+    case SCSIOP_START_STOP_UNIT:
+    case SCSIOP_MEDIUM_REMOVAL:
+    case SCSIOP_VERIFY:
+    case SCSIOP_VERIFY16:
+    case SCSIOP_RESERVE_UNIT:
+    case SCSIOP_RELEASE_UNIT:
+        Srb->DataTransferLength = 0;
+        Srb->ScsiStatus = SCSISTAT_GOOD;
+        return SRB_STATUS_SUCCESS;
+
+    default:
+        break;
+    }
+
+    return ZvioBlkStorSetSense(Srb, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_ADSENSE_ILLEGAL_COMMAND);
+}
+
+/*
+ * ZvioBlkStorIoControl - IOCTL_SCSI_MINIPORT requests of the guest agent
+ */
+static UCHAR
+ZvioBlkStorIoControl(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PSRB_IO_CONTROL control = (PSRB_IO_CONTROL)Srb->DataBuffer;
+
+    if (control == NULL || Srb->DataTransferLength < sizeof(SRB_IO_CONTROL) ||
+        RtlCompareMemory(control->Signature, ZVIOBLK_MINIPORT_SIGNATURE,
+                         sizeof(control->Signature)) != sizeof(control->Signature)) {
+        return SRB_STATUS_INVALID_REQUEST;
+    }
+
+    switch (control->ControlCode) {
+    case ZVIOBLK_MINIPORT_QUERY_STATS:
+        if (control->Length < sizeof(ZVIOBLK_STATS) ||
+            Srb->DataTransferLength - sizeof(SRB_IO_CONTROL) < sizeof(ZVIOBLK_STATS)) {
+            control->ReturnCode = (ULONG)STATUS_BUFFER_TOO_SMALL;
+            return SRB_STATUS_DATA_OVERRUN;
+        }
+        ZvioBlkStatsQuery(DeviceContext, (PZVIOBLK_STATS)(control + 1));
+        control->Length = sizeof(ZVIOBLK_STATS);
+        control->ReturnCode = 0;
+        return SRB_STATUS_SUCCESS;
+
+    default:
+        control->ReturnCode = (ULONG)STATUS_INVALID_DEVICE_REQUEST;
+        return SRB_STATUS_INVALID_REQUEST;
+    }
+}
+
+/*
+ * ZvioBlkStorStartIo - Process an SRB
+ *
+ * Runs concurrently on every channel; the virtqueue locks serialize
+ * each queue.
+ */
+static BOOLEAN
+ZvioBlkStorStartIo(
+    _In_ PVOID DeviceExtension,
+    _In_ PSCSI_REQUEST_BLOCK Srb
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    UCHAR srbStatus;
+
+    switch (Srb->Function) {
+    case SRB_FUNCTION_EXECUTE_SCSI:
+        if (Srb->PathId != 0 || Srb->TargetId != 0 || Srb->Lun != 0) {
+            srbStatus = SRB_STATUS_NO_DEVICE;
+            break;
+        }
+        srbStatus = ZvioBlkStorExecuteScsi(deviceContext, Srb);
+        break;
+
+    case SRB_FUNCTION_FLUSH:
+    case SRB_FUNCTION_SHUTDOWN:
+        srbStatus = ZvioBlkStorFlush(deviceContext, Srb);
+        break;
+
+    case SRB_FUNCTION_IO_CONTROL:
+        srbStatus = ZvioBlkStorIoControl(deviceContext, Srb);
+        break;
+
+    case SRB_FUNCTION_RESET_BUS:
+    case SRB_FUNCTION_RESET_DEVICE:
+    case SRB_FUNCTION_RESET_LOGICAL_UNIT:
+    case SRB_FUNCTION_PNP:
+    case SRB_FUNCTION_POWER:
+        srbStatus = SRB_STATUS_SUCCESS;
+        break;
+
+    default:
+        srbStatus = SRB_STATUS_INVALID_REQUEST;
+        break;
+    }
+
+    if (srbStatus != SRB_STATUS_PENDING) {
+        ZvioBlkStorCompleteSrb(deviceContext, Srb, srbStatus);
+    }
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkStorInterrupt - Line-based interrupt
+ */
+static BOOLEAN
+ZvioBlkStorInterrupt(
+    _In_ PVOID DeviceExtension
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    UCHAR isrStatus;
+    USHORT i;
+
+    if (!deviceContext->IsrStatus) {
+        return FALSE;
+    }
+
+    isrStatus = READ_REGISTER_UCHAR(deviceContext->IsrStatus);
+    if (isrStatus == 0) {
+        return FALSE;
+    }
+
+    if (isrStatus & 0x02) {
+        ZvioBlkDbgPrint("Config change interrupt (legacy)");
+    }
+
+    for (i = 0; i < deviceContext->NumQueues; i++) {
+        StorPortIssueDpc(deviceContext, &deviceContext->Dpcs[i], NULL, NULL);
+    }
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkStorMsInterrupt - MSI-X interrupt
+ *
+ * StorPort holds the message's lock, which is also the queue lock, so
+ * the used ring is left to the DPC.
+ */
+static BOOLEAN
+ZvioBlkStorMsInterrupt(
+    _In_ PVOID DeviceExtension,
+    _In_ ULONG MessageId
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    USHORT first, count, i;
+
+    if (MessageId == 0 && deviceContext->InterruptCount > 1) {
+        ZvioBlkDbgPrint("Config change interrupt");
+    }
+
+    ZvioBlkMessageQueues(deviceContext, MessageId, &first, &count);
+
+    for (i = first; i < first + count; i++) {
+        StorPortIssueDpc(deviceContext, &deviceContext->Dpcs[i], NULL, NULL);
+    }
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkCompleteUsed - Complete an SRB the device has used
+ */
+VOID
+ZvioBlkCompleteUsed(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PZVIOBLK_REQUEST BlkRequest,
+    _In_ UCHAR Status
+    )
+{
+    PSCSI_REQUEST_BLOCK srb;
+    PZVIOBLK_REQUEST next;
+    UCHAR srbStatus;
+
+    //
+    // A flush releases its whole batch; the next one is posted first
+    //
+    if (BlkRequest->Type == VIRTIO_BLK_T_FLUSH) {
+        ZvioBlkStorPostFlush(Queue->DeviceContext, ZvioBlkFlushDone(Queue->DeviceContext));
+    }
+
+    do {
+        srb = BlkRequest->Srb;
+        next = BlkRequest->FlushNext;
+
+        ZvioBlkStatsRecord(BlkRequest->Queue, BlkRequest->Type, BlkRequest->SubmitTime);
+
+        switch (Status) {
+        case VIRTIO_BLK_S_OK:
+            srb->ScsiStatus = SCSISTAT_GOOD;
+            srbStatus = SRB_STATUS_SUCCESS;
+            break;
+        case VIRTIO_BLK_S_UNSUPP:
+            srbStatus = ZvioBlkStorSetSense(srb, SCSI_SENSE_ILLEGAL_REQUEST,
+                                            SCSI_ADSENSE_ILLEGAL_COMMAND);
+            break;
+        default:
+            srbStatus = ZvioBlkStorSetSense(srb, SCSI_SENSE_MEDIUM_ERROR, SCSI_ADSENSE_NO_SENSE);
+            break;
+        }
+
+        ZvioBlkStorCompleteSrb(Queue->DeviceContext, srb, srbStatus);
+        BlkRequest = next;
+    } while (BlkRequest != NULL);
+}
+
+/*
+ * ZvioBlkStorDpc - Complete the used requests of one queue
+ *
+ * Completions are taken in batches within ZVIOBLK_DPC_BUDGET; past it
+ * the DPC issues itself again with the queue's interrupt still off.
+ */
+static VOID
+ZvioBlkStorDpc(
+    _In_ PSTOR_DPC Dpc,
+    _In_ PVOID HwDeviceExtension,
+    _In_opt_ PVOID SystemArgument1,
+    _In_opt_ PVOID SystemArgument2
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)HwDeviceExtension;
+    ULONG index = (ULONG)(Dpc - deviceContext->Dpcs);
+    ULONG budget = ZVIOBLK_DPC_BUDGET;
+    PZVIOBLK_VIRTQUEUE queue;
+
+    UNREFERENCED_PARAMETER(SystemArgument1);
+    UNREFERENCED_PARAMETER(SystemArgument2);
+
+    if (index >= deviceContext->NumQueues || deviceContext->Queues == NULL) {
+        return;
+    }
+
+    queue = deviceContext->Queues[index];
+    if (queue == NULL) {
+        return;
+    }
+
+    if (ZvioBlkQueueService(queue, &budget)) {
+        StorPortIssueDpc(deviceContext, Dpc, NULL, NULL);
+    }
+}
+
+/*
+ * ZvioBlkStorResetBus - Bus reset
+ *
+ * Requests in flight belong to the device until it returns them, so
+ * they complete through the DPC as usual.
+ */
+static BOOLEAN
+ZvioBlkStorResetBus(
+    _In_ PVOID DeviceExtension,
+    _In_ ULONG PathId
+    )
+{
+    UNREFERENCED_PARAMETER(DeviceExtension);
+    UNREFERENCED_PARAMETER(PathId);
+
+    ZvioBlkDbgPrint("ResetBus");
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkStorAdapterControl - Adapter stop and control queries
+ *
+ * Restart is not offered; StorPort then runs HwFindAdapter and
+ * HwInitialize again, which rebuild the queues.
+ */
+static SCSI_ADAPTER_CONTROL_STATUS
+ZvioBlkStorAdapterControl(
+    _In_ PVOID DeviceExtension,
+    _In_ SCSI_ADAPTER_CONTROL_TYPE ControlType,
+    _In_ PVOID Parameters
+    )
+{
+    PZVIOBLK_DEVICE_CONTEXT deviceContext = (PZVIOBLK_DEVICE_CONTEXT)DeviceExtension;
+    PSCSI_SUPPORTED_CONTROL_TYPE_LIST list;
+
+    switch (ControlType) {
+    case ScsiQuerySupportedControlTypes:
+        list = (PSCSI_SUPPORTED_CONTROL_TYPE_LIST)Parameters;
+        if (list->MaxControlType > ScsiQuerySupportedControlTypes) {
+            list->SupportedTypeList[ScsiQuerySupportedControlTypes] = TRUE;
+        }
+        if (list->MaxControlType > ScsiStopAdapter) {
+            list->SupportedTypeList[ScsiStopAdapter] = TRUE;
+        }
+        return ScsiAdapterControlSuccess;
+
+    case ScsiStopAdapter:
+        ZvioBlkDbgPrint("StopAdapter");
+        ZvioBlkDeviceReset(deviceContext);
+        ZvioBlkStorFreeQueues(deviceContext);
+        ZvioBlkStatsFree(deviceContext);
+        return ScsiAdapterControlSuccess;
+
+    default:
+        return ScsiAdapterControlUnsuccessful;
+    }
+}
@@ -61,13 +61,16 @@ ZvioBlkDeviceInit(
         VIRTIO_F_VERSION_1 |
         VIRTIO_F_RING_INDIRECT_DESC |
         VIRTIO_F_RING_EVENT_IDX |
+        VIRTIO_F_IN_ORDER |
         VIRTIO_BLK_F_SIZE_MAX |
         VIRTIO_BLK_F_SEG_MAX |
         VIRTIO_BLK_F_BLK_SIZE |
         VIRTIO_BLK_F_FLUSH |
+        VIRTIO_BLK_F_CONFIG_WCE |
         VIRTIO_BLK_F_TOPOLOGY |
         VIRTIO_BLK_F_DISCARD |
         VIRTIO_BLK_F_WRITE_ZEROES |
+        VIRTIO_BLK_F_MQ |
         VIRTIO_BLK_F_RO
         );
 
@@ -101,15 +104,35 @@ ZvioBlkDeviceInit(
     //
     // Step 7: Read number of queues and create them
     //
-    if (driverFeatures & VIRTIO_BLK_F_MQ) {
-        // Multi-queue is supported, but for simplicity use single queue
-        numQueues = 1;
-    } else {
-        numQueues = 1;
+    // One queue per processor up to the device limit. With MSI-X each
+    // queue also needs a message of its own next to the config one.
+    //
+    numQueues = 1;
+    if ((driverFeatures & VIRTIO_BLK_F_MQ) && DeviceContext->DeviceCfg) {
+        numQueues = READ_REGISTER_USHORT(&DeviceContext->DeviceCfg->NumQueues);
+        numQueues = (USHORT)min(numQueues, KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+        numQueues = min(numQueues, ZVIOBLK_MAX_QUEUES);
+
+        if (DeviceContext->UseMsix && DeviceContext->InterruptCount > 1) {
+            numQueues = (USHORT)min(numQueues, DeviceContext->InterruptCount - 1);
+        }
+        numQueues = max(numQueues, 1);
     }
 
+    DeviceContext->MaxSegments = ZvioBlkMaxSegments(DeviceContext, driverFeatures);
+
+    ZvioBlkStatsInit(DeviceContext);
+    ZvioBlkFlushInit(DeviceContext);
+
     ZvioBlkDbgPrint("Creating %d request queue(s)", numQueues);
 
+    if (DeviceContext->UseMsix) {
+        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->MsixConfig, 0);
+        if (READ_REGISTER_USHORT(&DeviceContext->CommonCfg->MsixConfig) == VIRTIO_MSI_NO_VECTOR) {
+            ZvioBlkDbgError("Device rejected the config MSI-X vector");
+        }
+    }
+
     DeviceContext->Queues = (PZVIOBLK_VIRTQUEUE*)ExAllocatePool2(
         POOL_FLAG_NON_PAGED,
         numQueues * sizeof(PZVIOBLK_VIRTQUEUE),
@@ -126,13 +149,30 @@ ZvioBlkDeviceInit(
     DeviceContext->NumQueues = numQueues;
 
     for (USHORT i = 0; i < numQueues; i++) {
-        status = ZvioBlkQueueCreate(DeviceContext, i, &DeviceContext->Queues[i]);
+        USHORT vector = VIRTIO_MSI_NO_VECTOR;
+
+        if (DeviceContext->UseMsix) {
+            vector = (DeviceContext->InterruptCount > 1) ? i + 1 : 0;
+        }
+
+        status = ZvioBlkQueueCreate(DeviceContext, i, vector, &DeviceContext->Queues[i]);
         if (!NT_SUCCESS(status)) {
             ZvioBlkDbgError("Failed to create queue %d: 0x%08X", i, status);
-            // Continue - some queues may still work
+
+            //
+            // Run with the queues created so far
+            //
+            if (i == 0) {
+                ZvioBlkSetDeviceStatus(DeviceContext, VIRTIO_STATUS_FAILED);
+                return status;
+            }
+            DeviceContext->NumQueues = i;
+            break;
         }
     }
 
+    ZvioBlkMapProcessors(DeviceContext);
+
     //
     // Step 8: Set DRIVER_OK status
     //
@@ -143,6 +183,226 @@ ZvioBlkDeviceInit(
     return STATUS_SUCCESS;
 }
 
+/*
+ * ZvioBlkMaxSegments - Data segments one request may carry
+ *
+ * A direct chain also needs the header and status descriptors, so it
+ * is bounded by the ring; indirect tables are bounded by SegMax only.
+ */
+ULONG
+ZvioBlkMaxSegments(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONGLONG Features
+    )
+{
+    ULONG segments = 128; // Default
+    USHORT queueSize;
+
+    if ((Features & VIRTIO_BLK_F_SEG_MAX) && DeviceContext->DeviceCfg) {
+        segments = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->SegMax);
+    }
+
+    if (!(Features & VIRTIO_F_RING_INDIRECT_DESC)) {
+        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueSel, 0);
+        KeMemoryBarrier();
+        queueSize = READ_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueSize);
+        segments = min(segments, (ULONG)max(queueSize, 3) - 2);
+    }
+
+    return max(min(segments, ZVIOBLK_MAX_SEGMENTS), 1);
+}
+
+/*
+ * ZvioBlkReadDeviceConfig - Read the disk geometry and limits
+ */
+VOID
+ZvioBlkReadDeviceConfig(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    if (!DeviceContext->DeviceCfg) {
+        return;
+    }
+
+    DeviceContext->Capacity = READ_REGISTER_ULONG64((PULONG64)&DeviceContext->DeviceCfg->Capacity);
+
+    if (DeviceContext->DriverFeatures & VIRTIO_BLK_F_BLK_SIZE) {
+        DeviceContext->SectorSize = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->BlkSize);
+    }
+
+    //
+    // Without SIZE_MAX a segment may be any length. MaxSegments was
+    // set when the queues were sized.
+    //
+    DeviceContext->MaxSegmentSize = MAXULONG;
+    if (DeviceContext->DriverFeatures & VIRTIO_BLK_F_SIZE_MAX) {
+        ULONG sizeMax = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->SizeMax);
+
+        if (sizeMax != 0) {
+            DeviceContext->MaxSegmentSize = sizeMax;
+        }
+    }
+
+    DeviceContext->ReadOnly = (DeviceContext->DeviceFeatures & VIRTIO_BLK_F_RO) != 0;
+    DeviceContext->SupportsFlush = (DeviceContext->DriverFeatures & VIRTIO_BLK_F_FLUSH) != 0;
+    DeviceContext->SupportsDiscard = (DeviceContext->DriverFeatures & VIRTIO_BLK_F_DISCARD) != 0;
+    DeviceContext->SupportsWriteZeroes = (DeviceContext->DriverFeatures & VIRTIO_BLK_F_WRITE_ZEROES) != 0;
+
+    //
+    // A device with FLUSH but no CONFIG_WCE caches writes; one without
+    // FLUSH writes through
+    //
+    DeviceContext->SupportsConfigWce = DeviceContext->SupportsFlush &&
+        (DeviceContext->DriverFeatures & VIRTIO_BLK_F_CONFIG_WCE) != 0;
+    DeviceContext->WriteCache = DeviceContext->SupportsFlush;
+    if (DeviceContext->SupportsConfigWce) {
+        DeviceContext->WriteCache = READ_REGISTER_UCHAR(&DeviceContext->DeviceCfg->Writeback) != 0;
+    }
+
+    //
+    // Zero limits are taken as none; alignment is at least a block
+    //
+    if (DeviceContext->SupportsDiscard) {
+        DeviceContext->MaxDiscardSectors = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->MaxDiscardSectors);
+        DeviceContext->MaxDiscardSeg = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->MaxDiscardSeg);
+        DeviceContext->DiscardAlignment = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->DiscardSectorAlignment);
+
+        if (DeviceContext->MaxDiscardSectors == 0) {
+            DeviceContext->MaxDiscardSectors = MAXULONG;
+        }
+        DeviceContext->DiscardAlignment = max(DeviceContext->DiscardAlignment,
+                                              DeviceContext->SectorSize / 512);
+    }
+
+    if (DeviceContext->SupportsWriteZeroes) {
+        DeviceContext->MaxWriteZeroesSectors =
+            READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->MaxWriteZeroesSectors);
+        DeviceContext->MaxWriteZeroesSeg = READ_REGISTER_ULONG(&DeviceContext->DeviceCfg->MaxWriteZeroesSeg);
+        DeviceContext->WriteZeroesUnmap =
+            READ_REGISTER_UCHAR(&DeviceContext->DeviceCfg->WriteZeroesUnmap) != 0;
+
+        if (DeviceContext->MaxWriteZeroesSectors == 0) {
+            DeviceContext->MaxWriteZeroesSectors = MAXULONG;
+        }
+    }
+
+    ZvioBlkDbgPrint("Capacity: %llu sectors (%llu MB)",
+        DeviceContext->Capacity,
+        (DeviceContext->Capacity * DeviceContext->SectorSize) / (1024 * 1024));
+    ZvioBlkDbgPrint("Sector size: %d, Max segments: %d, Max segment size: %u",
+        DeviceContext->SectorSize, DeviceContext->MaxSegments, DeviceContext->MaxSegmentSize);
+    ZvioBlkDbgPrint("ReadOnly: %d, Flush: %d, Discard: %d, Write zeroes: %d",
+        DeviceContext->ReadOnly, DeviceContext->SupportsFlush, DeviceContext->SupportsDiscard,
+        DeviceContext->SupportsWriteZeroes);
+    ZvioBlkDbgPrint("Write cache: %d, switchable: %d",
+        DeviceContext->WriteCache, DeviceContext->SupportsConfigWce);
+}
+
+/*
+ * ZvioBlkSetWriteCache - Switch the device between writeback and writethrough
+ *
+ * Needs VIRTIO_BLK_F_CONFIG_WCE unless the mode asked for is the
+ * current one. Flushes are still posted in writethrough mode, so
+ * writes cached before the switch stay covered by them.
+ */
+NTSTATUS
+ZvioBlkSetWriteCache(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ BOOLEAN Enable
+    )
+{
+    if (Enable == DeviceContext->WriteCache) {
+        return STATUS_SUCCESS;
+    }
+
+    if (!DeviceContext->SupportsConfigWce || !DeviceContext->DeviceCfg) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    WRITE_REGISTER_UCHAR(&DeviceContext->DeviceCfg->Writeback, Enable ? 1 : 0);
+    DeviceContext->WriteCache = READ_REGISTER_UCHAR(&DeviceContext->DeviceCfg->Writeback) != 0;
+
+    ZvioBlkDbgPrint("Write cache %s", DeviceContext->WriteCache ? "enabled" : "disabled");
+
+    return DeviceContext->WriteCache == Enable ? STATUS_SUCCESS : STATUS_IO_DEVICE_ERROR;
+}
+
+/*
+ * ZvioBlkMessageQueues - Request queues serviced by an interrupt message
+ *
+ * With a vector per queue, message 0 is configuration only and
+ * message N + 1 belongs to queue N. Line interrupts, or a single
+ * shared message, service every queue.
+ */
+VOID
+ZvioBlkMessageQueues(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ ULONG MessageId,
+    _Out_ PUSHORT First,
+    _Out_ PUSHORT Count
+    )
+{
+    *First = 0;
+    *Count = 0;
+
+    if (!DeviceContext->Queues) {
+        return;
+    }
+
+    if (!DeviceContext->UseMsix || DeviceContext->InterruptCount < 2) {
+        *Count = DeviceContext->NumQueues;
+    } else if (MessageId > 0 && MessageId <= DeviceContext->NumQueues) {
+        *First = (USHORT)(MessageId - 1);
+        *Count = 1;
+    }
+}
+
+/*
+ * ZvioBlkMapProcessors - Choose the request queue for each processor
+ *
+ * Processors are spread round-robin over the queues. A queue whose
+ * message targets a single processor is then given that processor,
+ * so its completions run where its requests were issued.
+ */
+VOID
+ZvioBlkMapProcessors(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext
+    )
+{
+    PROCESSOR_NUMBER processor;
+    ULONG processorCount;
+    ULONG index;
+    USHORT i;
+
+    processorCount = min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                         ZVIOBLK_MAX_PROCESSORS);
+
+    for (index = 0; index < processorCount; index++) {
+        DeviceContext->ProcessorQueue[index] = (UCHAR)(index % DeviceContext->NumQueues);
+    }
+
+    if (!DeviceContext->UseMsix || DeviceContext->InterruptCount < 2) {
+        return;
+    }
+
+    for (i = 0; i < DeviceContext->NumQueues && i + 1u < DeviceContext->InterruptCount; i++) {
+        PGROUP_AFFINITY affinity = &DeviceContext->InterruptAffinity[i + 1];
+
+        if (affinity->Mask == 0 || (affinity->Mask & (affinity->Mask - 1)) != 0) {
+            continue;
+        }
+
+        processor.Group = affinity->Group;
+        processor.Number = (UCHAR)RtlFindLeastSignificantBit((ULONGLONG)affinity->Mask);
+        processor.Reserved = 0;
+
+        index = KeGetProcessorIndexFromNumber(&processor);
+        if (index < ZVIOBLK_MAX_PROCESSORS) {
+            DeviceContext->ProcessorQueue[index] = (UCHAR)i;
+        }
+    }
+}
+
 /*
  * ZvioBlkDeviceReset - Reset the VirtIO device
  */
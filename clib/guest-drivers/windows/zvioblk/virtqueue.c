@@ -9,6 +9,168 @@
 
 #include "public.h"
 
+//
+// Queue lock. The KMDF driver uses a spinlock per queue; StorPort
+// serializes on the queue's MSI-X message, or the interrupt lock for
+// line interrupts, which also covers the completion DPC.
+//
+typedef struct _ZVIOBLK_LOCK_HANDLE {
+#ifdef ZVIOBLK_STORPORT
+    ULONG                   OldIrql;
+    STOR_LOCK_HANDLE        LockHandle;
+#else
+    UCHAR                   Unused;
+#endif
+} ZVIOBLK_LOCK_HANDLE, *PZVIOBLK_LOCK_HANDLE;
+
+static FORCEINLINE VOID
+ZvioBlkQueueAcquire(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Out_ PZVIOBLK_LOCK_HANDLE Handle
+    )
+{
+#ifdef ZVIOBLK_STORPORT
+    if (Queue->DeviceContext->UseMsix) {
+        StorPortAcquireMSISpinLock(Queue->DeviceContext, Queue->MsixVector, &Handle->OldIrql);
+    } else {
+        StorPortAcquireSpinLock(Queue->DeviceContext, InterruptLock, NULL, &Handle->LockHandle);
+    }
+#else
+    UNREFERENCED_PARAMETER(Handle);
+    WdfSpinLockAcquire(Queue->Lock);
+#endif
+}
+
+static FORCEINLINE VOID
+ZvioBlkQueueRelease(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PZVIOBLK_LOCK_HANDLE Handle
+    )
+{
+#ifdef ZVIOBLK_STORPORT
+    if (Queue->DeviceContext->UseMsix) {
+        StorPortReleaseMSISpinLock(Queue->DeviceContext, Queue->MsixVector, Handle->OldIrql);
+    } else {
+        StorPortReleaseSpinLock(Queue->DeviceContext, &Handle->LockHandle);
+    }
+#else
+    UNREFERENCED_PARAMETER(Handle);
+    WdfSpinLockRelease(Queue->Lock);
+#endif
+}
+
+/*
+ * ZvioBlkDmaAllocate - Allocate zeroed, page-aligned memory for the device
+ *
+ * The miniport carves from the uncached extension sized in
+ * HwFindAdapter; StorPort owns that memory and frees it on removal.
+ */
+static NTSTATUS
+ZvioBlkDmaAllocate(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _In_ SIZE_T Size,
+    _Out_ PZVIOBLK_DMA_BUFFER Buffer
+    )
+{
+#ifdef ZVIOBLK_STORPORT
+    SIZE_T size = ROUND_TO_PAGES(Size);
+
+    RtlZeroMemory(Buffer, sizeof(*Buffer));
+
+    if (DeviceContext->DmaUsed + size > DeviceContext->DmaSize) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    Buffer->VirtualAddress = DeviceContext->DmaBase + DeviceContext->DmaUsed;
+    Buffer->LogicalAddress.QuadPart = DeviceContext->DmaBasePhys.QuadPart + DeviceContext->DmaUsed;
+    DeviceContext->DmaUsed += size;
+#else
+    NTSTATUS status;
+    WDF_COMMON_BUFFER_CONFIG bufferConfig;
+
+    RtlZeroMemory(Buffer, sizeof(*Buffer));
+
+    WDF_COMMON_BUFFER_CONFIG_INIT(&bufferConfig, PAGE_SIZE);
+
+    status = WdfCommonBufferCreate(
+        DeviceContext->DmaEnabler,
+        Size,
+        &bufferConfig,
+        WDF_NO_OBJECT_ATTRIBUTES,
+        &Buffer->CommonBuffer
+        );
+
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    Buffer->VirtualAddress = WdfCommonBufferGetAlignedVirtualAddress(Buffer->CommonBuffer);
+    Buffer->LogicalAddress = WdfCommonBufferGetAlignedLogicalAddress(Buffer->CommonBuffer);
+#endif
+
+    RtlZeroMemory(Buffer->VirtualAddress, Size);
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkDmaFree - Free memory from ZvioBlkDmaAllocate
+ *
+ * Carved memory goes back as a whole once every queue is destroyed.
+ */
+static VOID
+ZvioBlkDmaFree(
+    _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
+    _Inout_ PZVIOBLK_DMA_BUFFER Buffer
+    )
+{
+    UNREFERENCED_PARAMETER(DeviceContext);
+
+    if (!Buffer->VirtualAddress) {
+        return;
+    }
+
+#ifndef ZVIOBLK_STORPORT
+    WdfObjectDelete(Buffer->CommonBuffer);
+#endif
+
+    RtlZeroMemory(Buffer, sizeof(*Buffer));
+}
+
+/*
+ * ZvioBlkQueueIndirectTables - Indirect tables a queue gets
+ */
+static USHORT
+ZvioBlkQueueIndirectTables(
+    _In_ USHORT QueueSize,
+    _In_ ULONG IndirectDescs
+    )
+{
+    return IndirectDescs ? (USHORT)min(QueueSize, ZVIOBLK_INDIRECT_TABLES) : 0;
+}
+
+/*
+ * ZvioBlkQueueMemorySize - DMA memory a queue of QueueSize entries needs
+ */
+SIZE_T
+ZvioBlkQueueMemorySize(
+    _In_ USHORT QueueSize,
+    _In_ ULONG IndirectDescs,
+    _In_ BOOLEAN RangeTables
+    )
+{
+    SIZE_T descSize = ZVIO_VRING_DESC_SIZE(QueueSize);
+    SIZE_T availSize = ZVIO_VRING_AVAIL_SIZE(QueueSize);
+    SIZE_T usedSize = ZVIO_VRING_USED_SIZE(QueueSize);
+    SIZE_T indirectSize = sizeof(VRING_DESC) * IndirectDescs *
+                          ZvioBlkQueueIndirectTables(QueueSize, IndirectDescs);
+
+    return ROUND_TO_PAGES(ROUND_TO_PAGES(descSize) + ROUND_TO_PAGES(availSize) +
+                          ROUND_TO_PAGES(usedSize)) +
+           ROUND_TO_PAGES(QueueSize * sizeof(ZVIOBLK_REQ_SLOT)) +
+           ROUND_TO_PAGES(indirectSize) +
+           (RangeTables ? ZVIOBLK_RANGE_TABLES * PAGE_SIZE : 0);
+}
+
 /*
  * ZvioBlkQueueCreate - Create and initialize a virtqueue
  */
@@ -16,6 +178,7 @@ NTSTATUS
 ZvioBlkQueueCreate(
     _In_ PZVIOBLK_DEVICE_CONTEXT DeviceContext,
     _In_ USHORT Index,
+    _In_ USHORT MsixVector,
     _Out_ PZVIOBLK_VIRTQUEUE *Queue
     )
 {
@@ -23,7 +186,6 @@ ZvioBlkQueueCreate(
     PZVIOBLK_VIRTQUEUE vq;
     USHORT queueSize;
     SIZE_T descSize, availSize, usedSize, totalSize;
-    WDF_COMMON_BUFFER_CONFIG bufferConfig;
 
     *Queue = NULL;
 
@@ -65,7 +227,12 @@ ZvioBlkQueueCreate(
     vq->Index = Index;
     vq->Size = queueSize;
     vq->DeviceContext = DeviceContext;
+    vq->EventIdx = (DeviceContext->DriverFeatures & VIRTIO_F_RING_EVENT_IDX) != 0;
+    vq->InOrder = (DeviceContext->DriverFeatures & VIRTIO_F_IN_ORDER) != 0;
+
+    vq->MsixVector = MsixVector;
 
+#ifndef ZVIOBLK_STORPORT
     //
     // Create spinlock for queue
     //
@@ -74,43 +241,32 @@ ZvioBlkQueueCreate(
         ExFreePoolWithTag(vq, ZVIOBLK_TAG);
         return status;
     }
+#endif
 
     //
     // Calculate ring sizes
     //
-    descSize = sizeof(VRING_DESC) * queueSize;
-    availSize = sizeof(USHORT) * (3 + queueSize);
-    usedSize = sizeof(USHORT) * 3 + sizeof(VRING_USED_ELEM) * queueSize;
+    descSize = ZVIO_VRING_DESC_SIZE(queueSize);
+    availSize = ZVIO_VRING_AVAIL_SIZE(queueSize);
+    usedSize = ZVIO_VRING_USED_SIZE(queueSize);
 
     totalSize = ROUND_TO_PAGES(descSize) + ROUND_TO_PAGES(availSize) + ROUND_TO_PAGES(usedSize);
 
     //
     // Allocate DMA buffer for rings
     //
-    WDF_COMMON_BUFFER_CONFIG_INIT(&bufferConfig, PAGE_SIZE);
-
-    status = WdfCommonBufferCreate(
-        DeviceContext->DmaEnabler,
-        totalSize,
-        &bufferConfig,
-        WDF_NO_OBJECT_ATTRIBUTES,
-        &vq->RingBuffer
-        );
-
+    status = ZvioBlkDmaAllocate(DeviceContext, totalSize, &vq->RingBuffer);
     if (!NT_SUCCESS(status)) {
         ZvioBlkDbgError("Failed to allocate ring buffer: 0x%08X", status);
-        WdfObjectDelete(vq->Lock);
-        ExFreePoolWithTag(vq, ZVIOBLK_TAG);
+        ZvioBlkQueueDestroy(vq);
         return status;
     }
 
     //
     // Get buffer addresses
     //
-    PVOID ringVA = WdfCommonBufferGetAlignedVirtualAddress(vq->RingBuffer);
-    PHYSICAL_ADDRESS ringPA = WdfCommonBufferGetAlignedLogicalAddress(vq->RingBuffer);
-
-    RtlZeroMemory(ringVA, totalSize);
+    PVOID ringVA = vq->RingBuffer.VirtualAddress;
+    PHYSICAL_ADDRESS ringPA = vq->RingBuffer.LogicalAddress;
 
     //
     // Set up ring pointers
@@ -144,14 +300,77 @@ ZvioBlkQueueCreate(
         );
 
     if (!vq->DescData) {
-        WdfObjectDelete(vq->RingBuffer);
-        WdfObjectDelete(vq->Lock);
-        ExFreePoolWithTag(vq, ZVIOBLK_TAG);
+        ZvioBlkQueueDestroy(vq);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
     RtlZeroMemory(vq->DescData, queueSize * sizeof(PVOID));
 
+    //
+    // Allocate the request header/status slots, one per descriptor
+    //
+    status = ZvioBlkDmaAllocate(DeviceContext, queueSize * sizeof(ZVIOBLK_REQ_SLOT),
+                                &vq->SlotBuffer);
+    if (!NT_SUCCESS(status)) {
+        ZvioBlkDbgError("Failed to allocate request slots: 0x%08X", status);
+        ZvioBlkQueueDestroy(vq);
+        return status;
+    }
+
+    vq->Slots = (PZVIOBLK_REQ_SLOT)vq->SlotBuffer.VirtualAddress;
+    vq->SlotsPhys = vq->SlotBuffer.LogicalAddress;
+
+    //
+    // Allocate the indirect tables: header, segments and status each
+    //
+    vq->IndirectFree = 0xFFFF;
+    if ((DeviceContext->DriverFeatures & VIRTIO_F_RING_INDIRECT_DESC) &&
+        DeviceContext->MaxSegments > 1) {
+        USHORT tables;
+
+        vq->IndirectDescs = (USHORT)(DeviceContext->MaxSegments + 2);
+        tables = ZvioBlkQueueIndirectTables(queueSize, vq->IndirectDescs);
+
+        status = ZvioBlkDmaAllocate(DeviceContext,
+                                    (SIZE_T)tables * vq->IndirectDescs * sizeof(VRING_DESC),
+                                    &vq->IndirectBuffer);
+        if (!NT_SUCCESS(status)) {
+            ZvioBlkDbgError("Failed to allocate indirect tables: 0x%08X", status);
+            ZvioBlkQueueDestroy(vq);
+            return status;
+        }
+
+        vq->Indirect = (PVRING_DESC)vq->IndirectBuffer.VirtualAddress;
+        vq->IndirectPhys = vq->IndirectBuffer.LogicalAddress;
+
+        for (USHORT i = tables; i > 0; i--) {
+            vq->Indirect[(i - 1) * vq->IndirectDescs].Next = vq->IndirectFree;
+            vq->IndirectFree = i - 1;
+        }
+    }
+
+    //
+    // Allocate the discard/write zeroes segment tables
+    //
+    vq->RangeFree = 0xFFFF;
+    if (DeviceContext->DriverFeatures & (VIRTIO_BLK_F_DISCARD | VIRTIO_BLK_F_WRITE_ZEROES)) {
+        status = ZvioBlkDmaAllocate(DeviceContext, ZVIOBLK_RANGE_TABLES * PAGE_SIZE,
+                                    &vq->RangeBuffer);
+        if (!NT_SUCCESS(status)) {
+            ZvioBlkDbgError("Failed to allocate segment tables: 0x%08X", status);
+            ZvioBlkQueueDestroy(vq);
+            return status;
+        }
+
+        vq->Ranges = (PVIRTIO_BLK_DISCARD_WRITE_ZEROES)vq->RangeBuffer.VirtualAddress;
+        vq->RangesPhys = vq->RangeBuffer.LogicalAddress;
+
+        for (USHORT i = ZVIOBLK_RANGE_TABLES; i > 0; i--) {
+            vq->Ranges[(i - 1) * ZVIOBLK_MAX_RANGES].Flags = vq->RangeFree;
+            vq->RangeFree = i - 1;
+        }
+    }
+
     //
     // Write queue addresses to device
     //
@@ -169,6 +388,19 @@ ZvioBlkQueueCreate(
     vq->NotifyAddr = (PUCHAR)DeviceContext->NotifyBase +
                      notifyOff * DeviceContext->NotifyOffMultiplier;
 
+    //
+    // Route the queue to its MSI-X message; the device answers
+    // NO_VECTOR when it cannot
+    //
+    if (MsixVector != VIRTIO_MSI_NO_VECTOR) {
+        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector, MsixVector);
+        if (READ_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector) != MsixVector) {
+            ZvioBlkDbgError("Queue %d: MSI-X vector %d rejected", Index, MsixVector);
+            ZvioBlkQueueDestroy(vq);
+            return STATUS_DEVICE_CONFIGURATION_ERROR;
+        }
+    }
+
     //
     // Enable the queue
     //
@@ -211,17 +443,45 @@ ZvioBlkQueueDestroy(
         ExFreePoolWithTag(Queue->DescData, ZVIOBLK_TAG);
     }
 
-    if (Queue->RingBuffer) {
-        WdfObjectDelete(Queue->RingBuffer);
-    }
+    ZvioBlkDmaFree(Queue->DeviceContext, &Queue->RangeBuffer);
+    ZvioBlkDmaFree(Queue->DeviceContext, &Queue->IndirectBuffer);
+    ZvioBlkDmaFree(Queue->DeviceContext, &Queue->SlotBuffer);
+    ZvioBlkDmaFree(Queue->DeviceContext, &Queue->RingBuffer);
 
+#ifndef ZVIOBLK_STORPORT
     if (Queue->Lock) {
         WdfObjectDelete(Queue->Lock);
     }
+#endif
 
     ExFreePoolWithTag(Queue, ZVIOBLK_TAG);
 }
 
+/*
+ * ZvioBlkQueuePublish - Make a built chain available to the device
+ *
+ * Caller holds the queue lock.
+ */
+static VOID
+ZvioBlkQueuePublish(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ USHORT Head,
+    _In_opt_ PVOID UserData
+    )
+{
+    USHORT inFlight;
+
+    Queue->DescData[Head] = UserData;
+
+    ZVIO_VRING_PUBLISH(Queue, Head);
+
+    Queue->Submitted++;
+    inFlight = (USHORT)(Queue->Avail->Idx - Queue->LastUsedIdx);
+    if (inFlight > Queue->PeakInFlight) {
+        Queue->PeakInFlight = inFlight;
+    }
+}
+
 /*
  * ZvioBlkQueueAddBuffers - Add scatter-gather buffers to the virtqueue
  *
@@ -239,6 +499,7 @@ ZvioBlkQueueAddBuffers(
     _Out_ PUSHORT HeadIdx
     )
 {
+    ZVIOBLK_LOCK_HANDLE lock;
     USHORT head;
     USHORT descIdx;
     USHORT prevIdx = 0xFFFF;
@@ -251,10 +512,10 @@ ZvioBlkQueueAddBuffers(
         return STATUS_INVALID_PARAMETER;
     }
 
-    WdfSpinLockAcquire(Queue->Lock);
+    ZvioBlkQueueAcquire(Queue, &lock);
 
     if (Queue->NumFree < totalDescs) {
-        WdfSpinLockRelease(Queue->Lock);
+        ZvioBlkQueueRelease(Queue, &lock);
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
@@ -270,7 +531,7 @@ ZvioBlkQueueAddBuffers(
     for (i = 0; i < SgList->NumberOfElements; i++) {
         if (Queue->FreeHead == 0xFFFF) {
             // Should not happen if we checked NumFree
-            WdfSpinLockRelease(Queue->Lock);
+            ZvioBlkQueueRelease(Queue, &lock);
             return STATUS_INSUFFICIENT_RESOURCES;
         }
 
@@ -308,56 +569,414 @@ ZvioBlkQueueAddBuffers(
     //
     // Store user data on the head descriptor
     //
-    Queue->DescData[head] = UserData;
+    ZvioBlkQueuePublish(Queue, head, UserData);
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    *HeadIdx = head;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkQueuePushDesc - Take a free descriptor and link it into a chain
+ *
+ * Caller holds the queue lock and has checked NumFree.
+ */
+static USHORT
+ZvioBlkQueuePushDesc(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ ULONGLONG Addr,
+    _In_ ULONG Len,
+    _In_ USHORT Flags,
+    _In_ USHORT PrevIdx
+    )
+{
+    USHORT descIdx = Queue->FreeHead;
+
+    Queue->FreeHead = Queue->Desc[descIdx].Next;
+    Queue->NumFree--;
+
+    Queue->Desc[descIdx].Addr = Addr;
+    Queue->Desc[descIdx].Len = Len;
+    Queue->Desc[descIdx].Flags = Flags;
+    Queue->Desc[descIdx].Next = 0xFFFF;
+
+    if (PrevIdx != 0xFFFF) {
+        Queue->Desc[PrevIdx].Next = descIdx;
+        Queue->Desc[PrevIdx].Flags |= VRING_DESC_F_NEXT;
+    }
+
+    return descIdx;
+}
+
+/*
+ * ZvioBlkSgNextSegment - Next device segment of a scatter-gather list
+ *
+ * Elements longer than the device's SizeMax are split. Element and
+ * Offset track the position and start at zero.
+ */
+static BOOLEAN
+ZvioBlkSgNextSegment(
+    _In_ PSCATTER_GATHER_LIST SgList,
+    _In_ ULONG MaxSegmentSize,
+    _Inout_ PULONG Element,
+    _Inout_ PULONG Offset,
+    _Out_ PULONGLONG Addr,
+    _Out_ PULONG Len
+    )
+{
+    PSCATTER_GATHER_ELEMENT element;
+
+    while (*Element < SgList->NumberOfElements &&
+           *Offset >= SgList->Elements[*Element].Length) {
+        (*Element)++;
+        *Offset = 0;
+    }
+
+    if (*Element >= SgList->NumberOfElements) {
+        return FALSE;
+    }
+
+    element = &SgList->Elements[*Element];
+    *Addr = element->Address.QuadPart + *Offset;
+    *Len = min(element->Length - *Offset, MaxSegmentSize ? MaxSegmentSize : MAXULONG);
+    *Offset += *Len;
+
+    return TRUE;
+}
+
+/*
+ * ZvioBlkSgSegmentCount - Device segments a scatter-gather list makes
+ */
+static ULONG
+ZvioBlkSgSegmentCount(
+    _In_opt_ PSCATTER_GATHER_LIST SgList,
+    _In_ ULONG MaxSegmentSize
+    )
+{
+    ULONG element = 0, offset = 0, count = 0;
+    ULONGLONG addr;
+    ULONG len;
+
+    if (!SgList) {
+        return 0;
+    }
+
+    while (ZvioBlkSgNextSegment(SgList, MaxSegmentSize, &element, &offset, &addr, &len)) {
+        count++;
+    }
+
+    return count;
+}
+
+/*
+ * ZvioBlkQueueAddRequest - Post a block request using the head's slot
+ *
+ * The header and status live in the slot of the chain's head
+ * descriptor, which is only known under the queue lock; the header is
+ * copied in there. DataSgList is device-readable when DataOut is set.
+ *
+ * A request with more than one data segment goes in an indirect table
+ * when one is free, taking a single ring descriptor; otherwise, or
+ * without VIRTIO_F_RING_INDIRECT_DESC, it is chained in the ring.
+ */
+NTSTATUS
+ZvioBlkQueueAddRequest(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_REQ_HDR Header,
+    _In_opt_ PSCATTER_GATHER_LIST DataSgList,
+    _In_ BOOLEAN DataOut,
+    _In_opt_ PVOID UserData,
+    _Out_ PUSHORT HeadIdx
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    ULONG maxSegmentSize = Queue->DeviceContext->MaxSegmentSize;
+    ULONG dataCount = ZvioBlkSgSegmentCount(DataSgList, maxSegmentSize);
+    USHORT dataFlags = DataOut ? 0 : VRING_DESC_F_WRITE;
+    ULONG element = 0, offset = 0, len;
+    BOOLEAN indirect;
+    PZVIOBLK_REQ_SLOT slot;
+    ULONGLONG slotPhys;
+    ULONGLONG addr;
+    USHORT head;
+    USHORT descIdx;
+
+    *HeadIdx = 0xFFFF;
+
+    if (dataCount > Queue->DeviceContext->MaxSegments) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    indirect = Queue->Indirect != NULL && dataCount > 1;
+    if (!indirect && dataCount + 2 > Queue->Size) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ZvioBlkQueueAcquire(Queue, &lock);
 
     //
-    // Add to available ring
+    // Chain in the ring when every table is in use
     //
-    USHORT availIdx = Queue->Avail->Idx & (Queue->Size - 1);
-    Queue->Avail->Ring[availIdx] = head;
-    KeMemoryBarrier();
-    Queue->Avail->Idx++;
+    if (indirect && Queue->IndirectFree == 0xFFFF) {
+        indirect = FALSE;
+        if (dataCount + 2 > Queue->Size) {
+            ZvioBlkQueueRelease(Queue, &lock);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
 
-    WdfSpinLockRelease(Queue->Lock);
+    if (Queue->NumFree < (indirect ? 1 : dataCount + 2)) {
+        ZvioBlkQueueRelease(Queue, &lock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    head = Queue->FreeHead;
+    slot = &Queue->Slots[head];
+    slotPhys = Queue->SlotsPhys.QuadPart + head * sizeof(ZVIOBLK_REQ_SLOT);
+
+    slot->Header = *Header;
+    slot->Status = 0xFF;  // Initialize to invalid
+
+    if (indirect) {
+        USHORT table = Queue->IndirectFree;
+        PVRING_DESC desc = &Queue->Indirect[table * Queue->IndirectDescs];
+        ULONG count = 0;
+
+        Queue->IndirectFree = desc[0].Next;
+
+        desc[count].Addr = slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Header);
+        desc[count].Len = sizeof(VIRTIO_BLK_REQ_HDR);
+        desc[count].Flags = VRING_DESC_F_NEXT;
+        desc[count].Next = (USHORT)(count + 1);
+        count++;
+
+        while (ZvioBlkSgNextSegment(DataSgList, maxSegmentSize, &element, &offset, &addr, &len)) {
+            desc[count].Addr = addr;
+            desc[count].Len = len;
+            desc[count].Flags = dataFlags | VRING_DESC_F_NEXT;
+            desc[count].Next = (USHORT)(count + 1);
+            count++;
+        }
+
+        desc[count].Addr = slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Status);
+        desc[count].Len = sizeof(UCHAR);
+        desc[count].Flags = VRING_DESC_F_WRITE;
+        desc[count].Next = 0;
+        count++;
+
+        ZvioBlkQueuePushDesc(Queue,
+                             Queue->IndirectPhys.QuadPart +
+                                 (ULONGLONG)table * Queue->IndirectDescs * sizeof(VRING_DESC),
+                             count * sizeof(VRING_DESC), VRING_DESC_F_INDIRECT, 0xFFFF);
+    } else {
+        descIdx = ZvioBlkQueuePushDesc(Queue, slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Header),
+                                       sizeof(VIRTIO_BLK_REQ_HDR), 0, 0xFFFF);
+
+        while (DataSgList &&
+               ZvioBlkSgNextSegment(DataSgList, maxSegmentSize, &element, &offset, &addr, &len)) {
+            descIdx = ZvioBlkQueuePushDesc(Queue, addr, len, dataFlags, descIdx);
+        }
+
+        ZvioBlkQueuePushDesc(Queue, slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Status),
+                             sizeof(UCHAR), VRING_DESC_F_WRITE, descIdx);
+    }
+
+    ZvioBlkQueuePublish(Queue, head, UserData);
+
+    ZvioBlkQueueRelease(Queue, &lock);
 
     *HeadIdx = head;
     return STATUS_SUCCESS;
 }
 
 /*
- * ZvioBlkQueueGetBuffer - Get a completed buffer from the virtqueue
+ * ZvioBlkQueueGetRangeTable - Take a free segment table
+ *
+ * The caller fills it and posts it with ZvioBlkQueueAddRanges, or
+ * hands it back with ZvioBlkQueuePutRangeTable. Returns NULL when all
+ * are in use. A table holds ZVIOBLK_MAX_RANGES segments.
  */
-PVOID
-ZvioBlkQueueGetBuffer(
+PVIRTIO_BLK_DISCARD_WRITE_ZEROES
+ZvioBlkQueueGetRangeTable(
+    _In_ PZVIOBLK_VIRTQUEUE Queue
+    )
+{
+    PVIRTIO_BLK_DISCARD_WRITE_ZEROES table = NULL;
+    ZVIOBLK_LOCK_HANDLE lock;
+
+    if (!Queue->Ranges) {
+        return NULL;
+    }
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+
+    if (Queue->RangeFree != 0xFFFF) {
+        table = &Queue->Ranges[Queue->RangeFree * ZVIOBLK_MAX_RANGES];
+        Queue->RangeFree = (USHORT)table[0].Flags;
+    }
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    return table;
+}
+
+/*
+ * ZvioBlkQueueFreeRangeTable - Link a segment table back into the pool
+ *
+ * Caller holds the queue lock.
+ */
+static VOID
+ZvioBlkQueueFreeRangeTable(
     _In_ PZVIOBLK_VIRTQUEUE Queue,
-    _Out_ PULONG Length
+    _In_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table
+    )
+{
+    Table[0].Flags = Queue->RangeFree;
+    Queue->RangeFree = (USHORT)((Table - Queue->Ranges) / ZVIOBLK_MAX_RANGES);
+}
+
+/*
+ * ZvioBlkQueuePutRangeTable - Return a segment table that was not posted
+ */
+VOID
+ZvioBlkQueuePutRangeTable(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+    ZvioBlkQueueFreeRangeTable(Queue, Table);
+    ZvioBlkQueueRelease(Queue, &lock);
+}
+
+/*
+ * ZvioBlkQueueAddRanges - Post a discard or write zeroes request
+ *
+ * Table comes from ZvioBlkQueueGetRangeTable and holds Count segments;
+ * it returns to the pool when the request is used. On failure the
+ * caller still owns it.
+ */
+NTSTATUS
+ZvioBlkQueueAddRanges(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVIRTIO_BLK_REQ_HDR Header,
+    _In_ PVIRTIO_BLK_DISCARD_WRITE_ZEROES Table,
+    _In_ ULONG Count,
+    _In_opt_ PVOID UserData,
+    _Out_ PUSHORT HeadIdx
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    PZVIOBLK_REQ_SLOT slot;
+    ULONGLONG slotPhys;
+    ULONGLONG tablePhys;
+    USHORT head;
+    USHORT descIdx;
+
+    *HeadIdx = 0xFFFF;
+
+    if (Count == 0 || Count > ZVIOBLK_MAX_RANGES) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    tablePhys = Queue->RangesPhys.QuadPart + (ULONGLONG)(Table - Queue->Ranges) * sizeof(*Table);
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+
+    if (Queue->NumFree < 3) {
+        ZvioBlkQueueRelease(Queue, &lock);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    head = Queue->FreeHead;
+    slot = &Queue->Slots[head];
+    slotPhys = Queue->SlotsPhys.QuadPart + head * sizeof(ZVIOBLK_REQ_SLOT);
+
+    slot->Header = *Header;
+    slot->Status = 0xFF;  // Initialize to invalid
+
+    descIdx = ZvioBlkQueuePushDesc(Queue, slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Header),
+                                   sizeof(VIRTIO_BLK_REQ_HDR), 0, 0xFFFF);
+    descIdx = ZvioBlkQueuePushDesc(Queue, tablePhys, Count * sizeof(*Table), 0, descIdx);
+    ZvioBlkQueuePushDesc(Queue, slotPhys + FIELD_OFFSET(ZVIOBLK_REQ_SLOT, Status),
+                         sizeof(UCHAR), VRING_DESC_F_WRITE, descIdx);
+
+    ZvioBlkQueuePublish(Queue, head, UserData);
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    *HeadIdx = head;
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlkQueueFreeIndirect - Return a used indirect table to the pool
+ *
+ * Caller holds the queue lock. Adds the table's writable length.
+ */
+static VOID
+ZvioBlkQueueFreeIndirect(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ PVRING_DESC RingDesc,
+    _Inout_ PULONG InLength
+    )
+{
+    SIZE_T tableSize = Queue->IndirectDescs * sizeof(VRING_DESC);
+    USHORT table = (USHORT)((RingDesc->Addr - Queue->IndirectPhys.QuadPart) / tableSize);
+    PVRING_DESC desc = &Queue->Indirect[table * Queue->IndirectDescs];
+    ULONG count = RingDesc->Len / sizeof(VRING_DESC);
+    ULONG i;
+
+    for (i = 0; i < count; i++) {
+        if (desc[i].Flags & VRING_DESC_F_WRITE) {
+            *InLength += desc[i].Len;
+        }
+    }
+
+    desc[0].Next = Queue->IndirectFree;
+    Queue->IndirectFree = table;
+}
+
+/*
+ * ZvioBlkQueueReap - Take the next used chain off the ring
+ *
+ * Caller holds the queue lock. Ring protocol, including in-order
+ * batches: ZVIO_VRING_POP_USED.
+ */
+static PVOID
+ZvioBlkQueueReap(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Out_ PULONG Length,
+    _Out_ PUSHORT HeadIdx
     )
 {
-    USHORT usedIdx;
     USHORT headIdx;
     USHORT descIdx;
     PVOID userData;
+    BOOLEAN lengthKnown;
+    ULONG inLength = 0;
 
     *Length = 0;
-
-    WdfSpinLockAcquire(Queue->Lock);
+    *HeadIdx = 0xFFFF;
 
     //
     // Check if there are any used buffers
     //
-    if (Queue->LastUsedIdx == Queue->Used->Idx) {
-        WdfSpinLockRelease(Queue->Lock);
+    if (!ZVIO_VRING_HAS_USED(Queue)) {
         return NULL;
     }
 
+    ZVIO_VRING_POP_USED(Queue, headIdx, *Length, lengthKnown);
+
     //
-    // Get the used element
+    // Keep asking for the next used entry, unless a deferred event is armed
     //
-    usedIdx = Queue->LastUsedIdx & (Queue->Size - 1);
-    headIdx = (USHORT)Queue->Used->Ring[usedIdx].Id;
-    *Length = Queue->Used->Ring[usedIdx].Len;
-
-    Queue->LastUsedIdx++;
+    if (!Queue->EventDeferred) {
+        ZVIO_VRING_ASK_NEXT(Queue);
+    }
 
     //
     // Get user data
@@ -373,6 +992,18 @@ ZvioBlkQueueGetBuffer(
         USHORT nextIdx = (Queue->Desc[descIdx].Flags & VRING_DESC_F_NEXT) ?
             Queue->Desc[descIdx].Next : 0xFFFF;
 
+        if (Queue->Desc[descIdx].Flags & VRING_DESC_F_INDIRECT) {
+            ZvioBlkQueueFreeIndirect(Queue, &Queue->Desc[descIdx], &inLength);
+        } else if (Queue->Desc[descIdx].Flags & VRING_DESC_F_WRITE) {
+            inLength += Queue->Desc[descIdx].Len;
+        } else if (Queue->Ranges &&
+                   Queue->Desc[descIdx].Addr >= (ULONGLONG)Queue->RangesPhys.QuadPart &&
+                   Queue->Desc[descIdx].Addr <
+                       (ULONGLONG)Queue->RangesPhys.QuadPart + ZVIOBLK_RANGE_TABLES * PAGE_SIZE) {
+            ZvioBlkQueueFreeRangeTable(Queue, &Queue->Ranges[
+                (Queue->Desc[descIdx].Addr - Queue->RangesPhys.QuadPart) / sizeof(VIRTIO_BLK_DISCARD_WRITE_ZEROES)]);
+        }
+
         Queue->Desc[descIdx].Next = Queue->FreeHead;
         Queue->FreeHead = descIdx;
         Queue->NumFree++;
@@ -380,32 +1011,256 @@ ZvioBlkQueueGetBuffer(
         descIdx = nextIdx;
     }
 
-    WdfSpinLockRelease(Queue->Lock);
+    if (!lengthKnown) {
+        *Length = inLength;
+    }
 
+    *HeadIdx = headIdx;
     return userData;
 }
 
 /*
- * ZvioBlkQueueKick - Notify the device of new buffers
+ * ZvioBlkQueueGetBuffer - Get a completed buffer from the virtqueue
  */
-VOID
-ZvioBlkQueueKick(
-    _In_ PZVIOBLK_VIRTQUEUE Queue
+PVOID
+ZvioBlkQueueGetBuffer(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Out_ PULONG Length
     )
 {
-    KeMemoryBarrier();
+    ZVIOBLK_LOCK_HANDLE lock;
+    PVOID userData;
+    USHORT headIdx;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+    userData = ZvioBlkQueueReap(Queue, Length, &headIdx);
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    return userData;
+}
+
+/*
+ * ZvioBlkQueueGetRequests - Get a batch of completed requests
+ *
+ * Takes up to MaxCount requests in one hold of the queue lock. The
+ * statuses are read before it drops; after that the heads' slots may
+ * be reused by the next submission. Returns the number taken.
+ */
+ULONG
+ZvioBlkQueueGetRequests(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Out_writes_to_(MaxCount, return) PVOID *Requests,
+    _Out_writes_to_(MaxCount, return) PUCHAR Statuses,
+    _In_ ULONG MaxCount
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    PVOID userData;
+    USHORT headIdx;
+    ULONG length;
+    ULONG count = 0;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+
+    while (count < MaxCount) {
+        userData = ZvioBlkQueueReap(Queue, &length, &headIdx);
+        if (!userData) {
+            break;
+        }
+        Requests[count] = userData;
+        Statuses[count] = *(volatile UCHAR *)&Queue->Slots[headIdx].Status;
+        count++;
+    }
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    return count;
+}
+
+/*
+ * ZvioBlkQueueRearm - Enable interrupts again after draining
+ *
+ * Past PollDepth requests in flight (VIRTIO_F_RING_EVENT_IDX only), the
+ * interrupt is deferred until the depth falls back to PollDepth; the
+ * submitters reap what completes before that. The deferred entry was
+ * already posted, so the device always reaches it. Returns TRUE, with
+ * interrupts left off, when entries the event should have caught were
+ * used before the device could see it.
+ */
+BOOLEAN
+ZvioBlkQueueRearm(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ USHORT PollDepth
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    USHORT inFlight;
+    USHORT defer = 0;
+    BOOLEAN missed;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+
+    inFlight = (USHORT)(Queue->Avail->Idx - Queue->LastUsedIdx);
+    if (Queue->EventIdx && PollDepth != 0 && inFlight >= PollDepth) {
+        defer = (USHORT)(inFlight - PollDepth);
+    }
+
+    Queue->InterruptsOff = FALSE;
+    Queue->EventDeferred = (defer != 0);
+
+    if (Queue->EventIdx) {
+        VRING_USED_EVENT(Queue) = (USHORT)(Queue->LastUsedIdx + defer);
+    } else {
+        Queue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+    }
 
     //
-    // Check if notification is needed
+    // Publish the event before looking at the used index
     //
-    if (Queue->Used->Flags & VRING_USED_F_NO_NOTIFY) {
+    KeMemoryBarrier();
+
+    missed = (USHORT)(Queue->Used->Idx - Queue->LastUsedIdx) > defer;
+    if (missed) {
+        Queue->InterruptsOff = TRUE;
+        Queue->EventDeferred = FALSE;
+        if (Queue->EventIdx) {
+            VRING_USED_EVENT(Queue) = (USHORT)(Queue->LastUsedIdx - 1);
+        } else {
+            Queue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
+        }
+    }
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    return missed;
+}
+
+/*
+ * ZvioBlkQueueDrain - Complete up to Budget used requests in batches
+ *
+ * Returns the number completed.
+ */
+static ULONG
+ZvioBlkQueueDrain(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ ULONG Budget
+    )
+{
+    PVOID requests[ZVIOBLK_COMPLETION_BATCH];
+    UCHAR statuses[ZVIOBLK_COMPLETION_BATCH];
+    ULONG completed = 0;
+    ULONG wanted;
+    ULONG count;
+    ULONG i;
+
+    while (completed < Budget) {
+        wanted = min(Budget - completed, ZVIOBLK_COMPLETION_BATCH);
+
+        count = ZvioBlkQueueGetRequests(Queue, requests, statuses, wanted);
+        for (i = 0; i < count; i++) {
+            ZvioBlkCompleteUsed(Queue, (PZVIOBLK_REQUEST)requests[i], statuses[i]);
+        }
+
+        completed += count;
+        if (count < wanted) {
+            break;
+        }
+    }
+
+    return completed;
+}
+
+/*
+ * ZvioBlkQueueService - Complete a queue's used requests and re-arm it
+ *
+ * Interrupts stay suppressed while the queue is drained. Returns TRUE
+ * when the budget ran out with completions still waiting; the
+ * interrupts are then left off for the DPC the caller queues next.
+ */
+BOOLEAN
+ZvioBlkQueueService(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _Inout_ PULONG Budget
+    )
+{
+    ZvioBlkQueueEnableInterrupts(Queue, FALSE);
+
+    for (;;) {
+        *Budget -= ZvioBlkQueueDrain(Queue, *Budget);
+
+        if (!ZvioBlkQueueRearm(Queue, Queue->DeviceContext->PollQueueDepth)) {
+            return FALSE;
+        }
+
+        if (*Budget == 0) {
+            return TRUE;
+        }
+    }
+}
+
+/*
+ * ZvioBlkQueuePoll - Reap completions from the submission path
+ *
+ * Only at PollQueueDepth requests in flight or more, where the queue's
+ * interrupt is deferred.
+ */
+VOID
+ZvioBlkQueuePoll(
+    _In_ PZVIOBLK_VIRTQUEUE Queue
+    )
+{
+    USHORT pollDepth = Queue->DeviceContext->PollQueueDepth;
+
+    if (pollDepth == 0 || (USHORT)(Queue->Avail->Idx - Queue->LastUsedIdx) < pollDepth) {
         return;
     }
 
-    //
-    // Write to the notify address
-    //
-    if (Queue->NotifyAddr) {
+    ZvioBlkQueueDrain(Queue, ZVIOBLK_COMPLETION_BATCH);
+}
+
+/*
+ * ZvioBlkQueueKick - Notify the device of new buffers
+ *
+ * Suppression as in ZVIO_VRING_PREPARE_KICK.
+ */
+VOID
+ZvioBlkQueueKick(
+    _In_ PZVIOBLK_VIRTQUEUE Queue
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    BOOLEAN notify;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+    ZVIO_VRING_PREPARE_KICK(Queue, notify);
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    if (notify && Queue->NotifyAddr) {
         WRITE_REGISTER_USHORT((PUSHORT)Queue->NotifyAddr, Queue->Index);
     }
 }
+
+/*
+ * ZvioBlkQueueEnableInterrupts - Enable/disable queue interrupts
+ *
+ * Event index handling: ZVIO_VRING_SET_INTERRUPTS.
+ */
+BOOLEAN
+ZvioBlkQueueEnableInterrupts(
+    _In_ PZVIOBLK_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    )
+{
+    ZVIOBLK_LOCK_HANDLE lock;
+    BOOLEAN wasEnabled;
+
+    ZvioBlkQueueAcquire(Queue, &lock);
+
+    wasEnabled = !Queue->InterruptsOff;
+    Queue->EventDeferred = FALSE;
+    ZVIO_VRING_SET_INTERRUPTS(Queue, Enable);
+
+    ZvioBlkQueueRelease(Queue, &lock);
+
+    return wasEnabled;
+}
@@ -12,7 +12,8 @@
 /*
  * ZvioBlnWorkTimerCallback - Periodic work timer callback
  *
- * Checks host's requested balloon size and adjusts accordingly.
+ * Checks host's requested balloon size and adjusts accordingly. Runs
+ * at PASSIVE_LEVEL, since it allocates pages and waits for the host.
  */
 VOID
 ZvioBlnWorkTimerCallback(
@@ -32,14 +33,21 @@ ZvioBlnWorkTimerCallback(
         return;
     }
 
+    //
+    // A large inflate can outlast the period; let it finish
+    //
+    if (InterlockedCompareExchange(&deviceContext->WorkActive, 1, 0) != 0) {
+        return;
+    }
+
     //
     // Read target from device config
     //
     targetPages = READ_REGISTER_ULONG(&deviceContext->DeviceCfg->NumPages);
 
-    WdfSpinLockAcquire(deviceContext->PageListLock);
+    WdfSpinLockAcquire(deviceContext->ChunkListLock);
     currentPages = deviceContext->NumPages;
-    WdfSpinLockRelease(deviceContext->PageListLock);
+    WdfSpinLockRelease(deviceContext->ChunkListLock);
 
     deviceContext->TargetPages = targetPages;
 
@@ -64,16 +72,282 @@ ZvioBlnWorkTimerCallback(
         ZvioBlnUpdateStats(deviceContext);
     }
 
+    //
+    // Report free memory once the balloon has settled
+    //
+    if (delta == 0) {
+        ZvioBlnReportFreePages(deviceContext);
+    }
+
     //
     // Update actual pages in device config
     //
-    WdfSpinLockAcquire(deviceContext->PageListLock);
+    WdfSpinLockAcquire(deviceContext->ChunkListLock);
     WRITE_REGISTER_ULONG(&deviceContext->DeviceCfg->ActualPages, deviceContext->NumPages);
-    WdfSpinLockRelease(deviceContext->PageListLock);
+    WdfSpinLockRelease(deviceContext->ChunkListLock);
+
+    InterlockedExchange(&deviceContext->WorkActive, 0);
+}
+
+/*
+ * ZvioBlnAllocateChunk - Allocate up to NumPages pages in one MDL
+ *
+ * A full chunk is first tried as a 2 MB large page, which the host can
+ * drop in one piece. The pages are handed to the host, so they are not
+ * zeroed. The MDL may describe fewer pages than asked for.
+ */
+static PZVIOBLN_CHUNK
+ZvioBlnAllocateChunk(
+    _In_ ULONG NumPages
+    )
+{
+    PHYSICAL_ADDRESS lowAddr, highAddr, skipBytes;
+    PZVIOBLN_CHUNK chunk;
+    PMDL mdl = NULL;
+
+    lowAddr.QuadPart = 0;
+    highAddr.QuadPart = (ULONGLONG)-1;
+    skipBytes.QuadPart = 0;
+
+#ifdef MM_ALLOCATE_FAST_LARGE_PAGES
+    if (NumPages == ZVIOBLN_CHUNK_PAGES) {
+        mdl = MmAllocatePagesForMdlEx(
+            lowAddr,
+            highAddr,
+            skipBytes,
+            ZVIOBLN_CHUNK_SIZE,
+            MmCached,
+            MM_ALLOCATE_FAST_LARGE_PAGES | MM_ALLOCATE_FULLY_REQUIRED | MM_DONT_ZERO_ALLOCATION
+            );
+    }
+#endif
+
+    if (!mdl) {
+        mdl = MmAllocatePagesForMdlEx(
+            lowAddr,
+            highAddr,
+            skipBytes,
+            (SIZE_T)NumPages * PAGE_SIZE,
+            MmCached,
+            MM_DONT_ZERO_ALLOCATION
+            );
+    }
+
+    if (!mdl) {
+        return NULL;
+    }
+
+    if (MmGetMdlByteCount(mdl) < PAGE_SIZE) {
+        ExFreePool(mdl);
+        return NULL;
+    }
+
+    chunk = (PZVIOBLN_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(ZVIOBLN_CHUNK),
+        ZVIOBLN_TAG
+        );
+
+    if (!chunk) {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return NULL;
+    }
+
+    chunk->Mdl = mdl;
+    chunk->NumPages = MmGetMdlByteCount(mdl) >> PAGE_SHIFT;
+
+    return chunk;
+}
+
+/*
+ * ZvioBlnFreeChunkList - Return the pages of a list of chunks to Windows
+ */
+VOID
+ZvioBlnFreeChunkList(
+    _Inout_ PLIST_ENTRY ChunkList
+    )
+{
+    PLIST_ENTRY entry;
+    PZVIOBLN_CHUNK chunk;
+
+    while (!IsListEmpty(ChunkList)) {
+        entry = RemoveHeadList(ChunkList);
+        chunk = CONTAINING_RECORD(entry, ZVIOBLN_CHUNK, Link);
+
+        MmFreePagesFromMdl(chunk->Mdl);
+        ExFreePool(chunk->Mdl);
+        ExFreePoolWithTag(chunk, ZVIOBLN_TAG);
+    }
+}
+
+/*
+ * ZvioBlnCopyPfns - Append the PFNs of a chunk to the PFN array
+ */
+static VOID
+ZvioBlnCopyPfns(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_CHUNK Chunk,
+    _In_ ULONG Offset
+    )
+{
+    PPFN_NUMBER pfns = MmGetMdlPfnArray(Chunk->Mdl);
+    ULONG i;
+
+    for (i = 0; i < Chunk->NumPages; i++) {
+        DeviceContext->PfnArray[Offset + i] = (ULONG)pfns[i];
+    }
+}
+
+/*
+ * ZvioBlnHostBatchBegin - Start a batch of buffers for the host
+ *
+ * The inflate, deflate and reporting buffers all come from the work
+ * timer, one batch at a time. A batch that timed out may still be
+ * with the host, so its memory is not reused until it is back.
+ */
+NTSTATUS
+ZvioBlnHostBatchBegin(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    )
+{
+    LARGE_INTEGER timeout;
+
+    PAGED_CODE();
+
+    timeout.QuadPart = WDF_REL_TIMEOUT_IN_MS(ZVIOBLN_HOST_TIMEOUT_MS);
+
+    if (DeviceContext->HostInFlight != 0 &&
+        KeWaitForSingleObject(&DeviceContext->HostEvent, Executive, KernelMode,
+                              FALSE, &timeout) == STATUS_TIMEOUT) {
+        return STATUS_DEVICE_BUSY;
+    }
+
+    //
+    // Bias the count so the DPC cannot signal before the last buffer
+    // is posted
+    //
+    KeClearEvent(&DeviceContext->HostEvent);
+    InterlockedIncrement(&DeviceContext->HostInFlight);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlnHostBatchAdd - Post one buffer of the batch
+ */
+NTSTATUS
+ZvioBlnHostBatchAdd(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_VIRTQUEUE Queue,
+    _In_ PHYSICAL_ADDRESS PhysAddr,
+    _In_ ULONG Length,
+    _In_ BOOLEAN DeviceWritable
+    )
+{
+    NTSTATUS status;
+
+    InterlockedIncrement(&DeviceContext->HostInFlight);
+
+    //
+    // The user data only has to be non-NULL for the DPC to count it
+    //
+    status = ZvioBlnQueueAddBuffer(Queue, PhysAddr, Length, DeviceWritable, DeviceContext);
+
+    if (!NT_SUCCESS(status)) {
+        InterlockedDecrement(&DeviceContext->HostInFlight);
+    }
+
+    return status;
+}
+
+/*
+ * ZvioBlnHostBatchEnd - Kick the queue and wait for the host to return the batch
+ */
+NTSTATUS
+ZvioBlnHostBatchEnd(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_VIRTQUEUE Queue
+    )
+{
+    LARGE_INTEGER timeout;
+
+    PAGED_CODE();
+
+    ZvioBlnQueueKick(Queue);
+
+    if (InterlockedDecrement(&DeviceContext->HostInFlight) == 0) {
+        KeSetEvent(&DeviceContext->HostEvent, IO_NO_INCREMENT, FALSE);
+        return STATUS_SUCCESS;
+    }
+
+    timeout.QuadPart = WDF_REL_TIMEOUT_IN_MS(ZVIOBLN_HOST_TIMEOUT_MS);
+
+    if (KeWaitForSingleObject(&DeviceContext->HostEvent, Executive, KernelMode,
+                              FALSE, &timeout) == STATUS_TIMEOUT) {
+        ZvioBlnDbgError("Host did not return queue %u buffers", Queue->Index);
+        return STATUS_IO_TIMEOUT;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlnTellHost - Hand the first NumPfns entries of the PFN array to the host
+ *
+ * The array goes out as full ZVIOBLN_MAX_PAGES_PER_OP buffers behind a
+ * single kick, and the call waits until the host has returned all of
+ * them, so the array can be refilled. *Posted tells how many PFNs were
+ * posted; on a timeout they are still with the host.
+ */
+static NTSTATUS
+ZvioBlnTellHost(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_VIRTQUEUE Queue,
+    _In_ ULONG NumPfns,
+    _Out_ PULONG Posted
+    )
+{
+    NTSTATUS status;
+    NTSTATUS waitStatus;
+    PHYSICAL_ADDRESS phys;
+    ULONG offset;
+    ULONG count;
+
+    *Posted = 0;
+
+    if (Queue->NumFree < (NumPfns + ZVIOBLN_MAX_PAGES_PER_OP - 1) / ZVIOBLN_MAX_PAGES_PER_OP) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    status = ZvioBlnHostBatchBegin(DeviceContext);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (offset = 0; offset < NumPfns; offset += count) {
+        count = min(NumPfns - offset, ZVIOBLN_MAX_PAGES_PER_OP);
+
+        phys.QuadPart = DeviceContext->PfnArrayPhys.QuadPart + offset * sizeof(ULONG);
+
+        status = ZvioBlnHostBatchAdd(DeviceContext, Queue, phys, count * sizeof(ULONG), FALSE);
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
+    }
+
+    *Posted = offset;
+
+    waitStatus = ZvioBlnHostBatchEnd(DeviceContext, Queue);
+
+    return NT_SUCCESS(status) ? waitStatus : status;
 }
 
 /*
  * ZvioBlnInflate - Inflate balloon (allocate pages and give to host)
+ *
+ * Pages are allocated in chunks of up to 2 MB until the PFN array is
+ * full, and the array is then handed over in one kick.
  */
 NTSTATUS
 ZvioBlnInflate(
@@ -82,70 +356,51 @@ ZvioBlnInflate(
     )
 {
     NTSTATUS status = STATUS_SUCCESS;
-    ULONG pagesToInflate;
     ULONG inflated = 0;
-    ULONG i;
-    PZVIOBLN_PAGE_ENTRY pageEntry;
-    PHYSICAL_ADDRESS lowAddr, highAddr, skipBytes;
-    PMDL mdl;
+    ULONG count;
+    ULONG posted;
+    ULONG want;
+    BOOLEAN exhausted = FALSE;
+    LIST_ENTRY chunks;
+    PLIST_ENTRY entry;
+    PZVIOBLN_CHUNK chunk;
 
-    ZvioBlnDbgPrint("Inflate: requesting %u pages", NumPages);
+    PAGED_CODE();
 
-    lowAddr.QuadPart = 0;
-    highAddr.QuadPart = (ULONGLONG)-1;
-    skipBytes.QuadPart = 0;
+    ZvioBlnDbgPrint("Inflate: requesting %u pages", NumPages);
 
-    while (inflated < NumPages) {
-        pagesToInflate = min(NumPages - inflated, ZVIOBLN_MAX_PAGES_PER_OP);
+    while (inflated < NumPages && !exhausted) {
+        InitializeListHead(&chunks);
+        count = 0;
 
         //
-        // Allocate pages
+        // Fill the PFN array
         //
-        for (i = 0; i < pagesToInflate; i++) {
-            //
-            // Allocate a single page using MmAllocatePagesForMdl
-            //
-            mdl = MmAllocatePagesForMdl(lowAddr, highAddr, skipBytes, PAGE_SIZE);
-            if (!mdl) {
-                ZvioBlnDbgPrint("Failed to allocate page %u/%u", i, pagesToInflate);
+        while (inflated + count < NumPages && count < DeviceContext->PfnArraySize) {
+            want = min(NumPages - inflated - count, DeviceContext->PfnArraySize - count);
+            want = min(want, ZVIOBLN_CHUNK_PAGES);
+
+            chunk = ZvioBlnAllocateChunk(want);
+            if (!chunk) {
+                ZvioBlnDbgPrint("Failed to allocate %u pages", want);
+                exhausted = TRUE;
                 break;
             }
 
+            ZvioBlnCopyPfns(DeviceContext, chunk, count);
+            InsertHeadList(&chunks, &chunk->Link);
+            count += chunk->NumPages;
+
             //
-            // Create page entry to track this allocation
+            // A short MDL means memory is running low
             //
-            pageEntry = (PZVIOBLN_PAGE_ENTRY)ExAllocatePool2(
-                POOL_FLAG_NON_PAGED,
-                sizeof(ZVIOBLN_PAGE_ENTRY),
-                ZVIOBLN_TAG
-                );
-
-            if (!pageEntry) {
-                MmFreePagesFromMdl(mdl);
-                ExFreePool(mdl);
-                ZvioBlnDbgPrint("Failed to allocate page entry");
+            if (chunk->NumPages < want) {
+                exhausted = TRUE;
                 break;
             }
-
-            pageEntry->Mdl = mdl;
-            pageEntry->PageFrameNumber = MmGetMdlPfnArray(mdl)[0];
-            pageEntry->VirtualAddress = NULL;
-
-            //
-            // Add PFN to array for host notification
-            //
-            DeviceContext->PfnArray[i] = (ULONG)pageEntry->PageFrameNumber;
-
-            //
-            // Add to page list
-            //
-            WdfSpinLockAcquire(DeviceContext->PageListLock);
-            InsertTailList(&DeviceContext->PageList, &pageEntry->Link);
-            DeviceContext->NumPages++;
-            WdfSpinLockRelease(DeviceContext->PageListLock);
         }
 
-        if (i == 0) {
+        if (count == 0) {
             //
             // Couldn't allocate any pages
             //
@@ -156,19 +411,30 @@ ZvioBlnInflate(
         //
         // Notify host about inflated pages via inflate queue
         //
-        status = ZvioBlnQueueAddBuffer(
-            DeviceContext->InflateQueue,
-            DeviceContext->PfnArrayPhys,
-            i * sizeof(ULONG),
-            FALSE,
-            NULL
-            );
+        status = ZvioBlnTellHost(DeviceContext, DeviceContext->InflateQueue, count, &posted);
 
-        if (NT_SUCCESS(status)) {
-            ZvioBlnQueueKick(DeviceContext->InflateQueue);
+        if (posted == 0) {
+            ZvioBlnFreeChunkList(&chunks);
+            break;
         }
 
-        inflated += i;
+        //
+        // Once the host has seen any of the PFNs the whole batch stays
+        // in the balloon; keeping an unreported page is harmless
+        //
+        WdfSpinLockAcquire(DeviceContext->ChunkListLock);
+        while (!IsListEmpty(&chunks)) {
+            entry = RemoveTailList(&chunks);
+            InsertHeadList(&DeviceContext->ChunkList, entry);
+        }
+        DeviceContext->NumPages += count;
+        WdfSpinLockRelease(DeviceContext->ChunkListLock);
+
+        inflated += count;
+
+        if (!NT_SUCCESS(status)) {
+            break;
+        }
     }
 
     ZvioBlnDbgPrint("Inflated %u pages (requested %u)", inflated, NumPages);
@@ -177,6 +443,10 @@ ZvioBlnInflate(
 
 /*
  * ZvioBlnDeflate - Deflate balloon (reclaim pages from host)
+ *
+ * Chunks are released whole, newest first, so the balloon may shrink
+ * by up to a chunk more than asked; the next pass re-inflates the
+ * difference with a smaller chunk.
  */
 NTSTATUS
 ZvioBlnDeflate(
@@ -185,42 +455,45 @@ ZvioBlnDeflate(
     )
 {
     NTSTATUS status = STATUS_SUCCESS;
-    ULONG pagesToDeflate;
     ULONG deflated = 0;
-    ULONG i;
+    ULONG count;
+    ULONG posted;
+    LIST_ENTRY chunks;
     PLIST_ENTRY entry;
-    PZVIOBLN_PAGE_ENTRY pageEntry;
-    PZVIOBLN_PAGE_ENTRY pageEntries[ZVIOBLN_MAX_PAGES_PER_OP];
+    PZVIOBLN_CHUNK chunk;
     BOOLEAN mustTellHost;
 
+    PAGED_CODE();
+
     ZvioBlnDbgPrint("Deflate: releasing %u pages", NumPages);
 
     mustTellHost = (DeviceContext->DriverFeatures & VIRTIO_BALLOON_F_MUST_TELL_HOST) != 0;
 
     while (deflated < NumPages) {
-        pagesToDeflate = min(NumPages - deflated, ZVIOBLN_MAX_PAGES_PER_OP);
+        InitializeListHead(&chunks);
+        count = 0;
 
         //
-        // Collect pages to deflate
+        // Collect chunks to deflate
         //
-        WdfSpinLockAcquire(DeviceContext->PageListLock);
+        WdfSpinLockAcquire(DeviceContext->ChunkListLock);
+
+        while (deflated + count < NumPages && !IsListEmpty(&DeviceContext->ChunkList)) {
+            chunk = CONTAINING_RECORD(DeviceContext->ChunkList.Flink, ZVIOBLN_CHUNK, Link);
 
-        for (i = 0; i < pagesToDeflate; i++) {
-            if (IsListEmpty(&DeviceContext->PageList)) {
+            if (count + chunk->NumPages > DeviceContext->PfnArraySize) {
                 break;
             }
 
-            entry = RemoveHeadList(&DeviceContext->PageList);
-            pageEntry = CONTAINING_RECORD(entry, ZVIOBLN_PAGE_ENTRY, Link);
-            DeviceContext->NumPages--;
-
-            pageEntries[i] = pageEntry;
-            DeviceContext->PfnArray[i] = (ULONG)pageEntry->PageFrameNumber;
+            RemoveEntryList(&chunk->Link);
+            InsertTailList(&chunks, &chunk->Link);
+            DeviceContext->NumPages -= chunk->NumPages;
+            count += chunk->NumPages;
         }
 
-        WdfSpinLockRelease(DeviceContext->PageListLock);
+        WdfSpinLockRelease(DeviceContext->ChunkListLock);
 
-        if (i == 0) {
+        if (count == 0) {
             //
             // No more pages to deflate
             //
@@ -232,39 +505,56 @@ ZvioBlnDeflate(
         // Notify host if required
         //
         if (mustTellHost) {
-            status = ZvioBlnQueueAddBuffer(
-                DeviceContext->DeflateQueue,
-                DeviceContext->PfnArrayPhys,
-                i * sizeof(ULONG),
-                FALSE,
-                NULL
-                );
-
-            if (NT_SUCCESS(status)) {
-                ZvioBlnQueueKick(DeviceContext->DeflateQueue);
+            count = 0;
+            for (entry = chunks.Flink; entry != &chunks; entry = entry->Flink) {
+                chunk = CONTAINING_RECORD(entry, ZVIOBLN_CHUNK, Link);
+                ZvioBlnCopyPfns(DeviceContext, chunk, count);
+                count += chunk->NumPages;
+            }
+
+            status = ZvioBlnTellHost(DeviceContext, DeviceContext->DeflateQueue, count, &posted);
+
+            if (!NT_SUCCESS(status)) {
+                //
+                // The host may not know; keep the pages in the balloon
+                //
+                WdfSpinLockAcquire(DeviceContext->ChunkListLock);
+                while (!IsListEmpty(&chunks)) {
+                    entry = RemoveTailList(&chunks);
+                    InsertHeadList(&DeviceContext->ChunkList, entry);
+                }
+                DeviceContext->NumPages += count;
+                WdfSpinLockRelease(DeviceContext->ChunkListLock);
+                break;
             }
         }
 
         //
         // Free the pages
         //
-        for (ULONG j = 0; j < i; j++) {
-            pageEntry = pageEntries[j];
-
-            if (pageEntry->Mdl) {
-                MmFreePagesFromMdl(pageEntry->Mdl);
-                ExFreePool(pageEntry->Mdl);
-            }
-            ExFreePoolWithTag(pageEntry, ZVIOBLN_TAG);
-        }
+        ZvioBlnFreeChunkList(&chunks);
 
-        deflated += i;
+        deflated += count;
     }
 
     ZvioBlnDbgPrint("Deflated %u pages (requested %u)", deflated, NumPages);
     return status;
 }
 
+/*
+ * ZvioBlnFreeChunks - Free every page in the balloon
+ *
+ * Only after the device has been reset.
+ */
+VOID
+ZvioBlnFreeChunks(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    )
+{
+    ZvioBlnFreeChunkList(&DeviceContext->ChunkList);
+    DeviceContext->NumPages = 0;
+}
+
 /*
  * ZvioBlnUpdateStats - Update memory statistics and send to host
  */
@@ -110,23 +110,28 @@ ZvioBlnEvtDeviceAdd(
     deviceContext = ZvioBlnGetDeviceContext(device);
     RtlZeroMemory(deviceContext, sizeof(ZVIOBLN_DEVICE_CONTEXT));
     deviceContext->Device = device;
-    InitializeListHead(&deviceContext->PageList);
+    InitializeListHead(&deviceContext->ChunkList);
+    InitializeListHead(&deviceContext->ReportList);
+    KeInitializeEvent(&deviceContext->HostEvent, NotificationEvent, TRUE);
 
     //
-    // Create spin lock for page list
+    // Create spin lock for chunk list
     //
-    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->PageListLock);
+    status = WdfSpinLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &deviceContext->ChunkListLock);
     if (!NT_SUCCESS(status)) {
         ZvioBlnDbgError("WdfSpinLockCreate failed: 0x%X", status);
         return status;
     }
 
     //
-    // Create work timer for balloon operations
+    // Create work timer for balloon operations. It allocates pages and
+    // waits for the host, so it runs at PASSIVE_LEVEL.
     //
     WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, ZvioBlnWorkTimerCallback, 1000);
+    timerConfig.AutomaticSerialization = FALSE;
     WDF_OBJECT_ATTRIBUTES_INIT(&timerAttributes);
     timerAttributes.ParentObject = device;
+    timerAttributes.ExecutionLevel = WdfExecutionLevelPassive;
 
     status = WdfTimerCreate(&timerConfig, &timerAttributes, &deviceContext->WorkTimer);
     if (!NT_SUCCESS(status)) {
@@ -276,7 +281,7 @@ ZvioBlnEvtDevicePrepareHardware(
     //
     status = WdfCommonBufferCreate(
         deviceContext->DmaEnabler,
-        ZVIOBLN_MAX_PAGES_PER_OP * sizeof(ULONG),
+        ZVIOBLN_MAX_PAGES_PER_OP * ZVIOBLN_PFN_BUFFERS * sizeof(ULONG),
         WDF_NO_OBJECT_ATTRIBUTES,
         &deviceContext->PfnBuffer
         );
@@ -288,7 +293,7 @@ ZvioBlnEvtDevicePrepareHardware(
 
     deviceContext->PfnArray = (PULONG)WdfCommonBufferGetAlignedVirtualAddress(deviceContext->PfnBuffer);
     deviceContext->PfnArrayPhys = WdfCommonBufferGetAlignedLogicalAddress(deviceContext->PfnBuffer);
-    deviceContext->PfnArraySize = ZVIOBLN_MAX_PAGES_PER_OP;
+    deviceContext->PfnArraySize = ZVIOBLN_MAX_PAGES_PER_OP * ZVIOBLN_PFN_BUFFERS;
 
     //
     // Allocate stats buffer if feature supported
@@ -322,8 +327,6 @@ ZvioBlnEvtDeviceReleaseHardware(
 {
     PZVIOBLN_DEVICE_CONTEXT deviceContext;
     ULONG i;
-    PLIST_ENTRY entry;
-    PZVIOBLN_PAGE_ENTRY pageEntry;
 
     UNREFERENCED_PARAMETER(ResourcesTranslated);
     PAGED_CODE();
@@ -340,17 +343,14 @@ ZvioBlnEvtDeviceReleaseHardware(
     //
     // Free all balloon pages
     //
-    while (!IsListEmpty(&deviceContext->PageList)) {
-        entry = RemoveHeadList(&deviceContext->PageList);
-        pageEntry = CONTAINING_RECORD(entry, ZVIOBLN_PAGE_ENTRY, Link);
+    ZvioBlnFreeChunks(deviceContext);
+    ZvioBlnFreeChunkList(&deviceContext->ReportList);
 
-        if (pageEntry->Mdl) {
-            MmFreePagesFromMdl(pageEntry->Mdl);
-            ExFreePool(pageEntry->Mdl);
-        }
-        ExFreePoolWithTag(pageEntry, ZVIOBLN_TAG);
-    }
-    deviceContext->NumPages = 0;
+    //
+    // The reset dropped any buffers still with the host
+    //
+    deviceContext->HostInFlight = 0;
+    KeSetEvent(&deviceContext->HostEvent, IO_NO_INCREMENT, FALSE);
 
     //
     // Destroy virtqueues
@@ -367,6 +367,10 @@ ZvioBlnEvtDeviceReleaseHardware(
         ZvioBlnQueueDestroy(deviceContext->StatsQueue);
         deviceContext->StatsQueue = NULL;
     }
+    if (deviceContext->ReportQueue) {
+        ZvioBlnQueueDestroy(deviceContext->ReportQueue);
+        deviceContext->ReportQueue = NULL;
+    }
 
     //
     // Unmap BARs
@@ -55,6 +55,19 @@ ZvioBlnEvtInterruptIsr(
     return TRUE;
 }
 
+/*
+ * ZvioBlnHostBufferDone - Account a work timer buffer the host has returned
+ */
+static VOID
+ZvioBlnHostBufferDone(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    )
+{
+    if (InterlockedDecrement(&DeviceContext->HostInFlight) == 0) {
+        KeSetEvent(&DeviceContext->HostEvent, IO_NO_INCREMENT, FALSE);
+    }
+}
+
 /*
  * ZvioBlnEvtInterruptDpc - Deferred procedure call for interrupt
  */
@@ -82,9 +95,11 @@ ZvioBlnEvtInterruptDpc(
     if (deviceContext->InflateQueue) {
         while ((userData = ZvioBlnQueueGetBuffer(deviceContext->InflateQueue, &length)) != NULL) {
             //
-            // Inflate completed - nothing to do with user data for PFN array
+            // Inflate completed - wake the work timer once the whole
+            // PFN array is back
             //
             ZvioBlnDbgPrint("Inflate completed: %u bytes", length);
+            ZvioBlnHostBufferDone(deviceContext);
         }
     }
 
@@ -94,9 +109,20 @@ ZvioBlnEvtInterruptDpc(
     if (deviceContext->DeflateQueue) {
         while ((userData = ZvioBlnQueueGetBuffer(deviceContext->DeflateQueue, &length)) != NULL) {
             //
-            // Deflate completed - nothing to do with user data for PFN array
+            // Deflate completed - wake the work timer once the whole
+            // PFN array is back
             //
             ZvioBlnDbgPrint("Deflate completed: %u bytes", length);
+            ZvioBlnHostBufferDone(deviceContext);
+        }
+    }
+
+    //
+    // Process reported free page ranges
+    //
+    if (deviceContext->ReportQueue) {
+        while ((userData = ZvioBlnQueueGetBuffer(deviceContext->ReportQueue, &length)) != NULL) {
+            ZvioBlnHostBufferDone(deviceContext);
         }
     }
 
@@ -148,21 +174,23 @@ ZvioBlnEvtInterruptEnable(
     deviceContext = ZvioBlnGetDeviceContext(Device);
 
     //
-    // Enable interrupts on all queues by clearing NO_INTERRUPT flag
+    // Enable interrupts on all queues
     //
     if (deviceContext->InflateQueue && deviceContext->InflateQueue->Avail) {
-        deviceContext->InflateQueue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->InflateQueue, TRUE);
     }
 
     if (deviceContext->DeflateQueue && deviceContext->DeflateQueue->Avail) {
-        deviceContext->DeflateQueue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->DeflateQueue, TRUE);
     }
 
     if (deviceContext->StatsQueue && deviceContext->StatsQueue->Avail) {
-        deviceContext->StatsQueue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->StatsQueue, TRUE);
     }
 
-    KeMemoryBarrier();
+    if (deviceContext->ReportQueue && deviceContext->ReportQueue->Avail) {
+        ZvioBlnQueueEnableInterrupts(deviceContext->ReportQueue, TRUE);
+    }
 
     return STATUS_SUCCESS;
 }
@@ -185,21 +213,23 @@ ZvioBlnEvtInterruptDisable(
     deviceContext = ZvioBlnGetDeviceContext(Device);
 
     //
-    // Disable interrupts on all queues by setting NO_INTERRUPT flag
+    // Disable interrupts on all queues
     //
     if (deviceContext->InflateQueue && deviceContext->InflateQueue->Avail) {
-        deviceContext->InflateQueue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->InflateQueue, FALSE);
     }
 
     if (deviceContext->DeflateQueue && deviceContext->DeflateQueue->Avail) {
-        deviceContext->DeflateQueue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->DeflateQueue, FALSE);
     }
 
     if (deviceContext->StatsQueue && deviceContext->StatsQueue->Avail) {
-        deviceContext->StatsQueue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
+        ZvioBlnQueueEnableInterrupts(deviceContext->StatsQueue, FALSE);
     }
 
-    KeMemoryBarrier();
+    if (deviceContext->ReportQueue && deviceContext->ReportQueue->Avail) {
+        ZvioBlnQueueEnableInterrupts(deviceContext->ReportQueue, FALSE);
+    }
 
     return STATUS_SUCCESS;
 }
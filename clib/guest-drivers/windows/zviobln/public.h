@@ -42,6 +42,7 @@
 #define VIRTIO_F_VERSION_1                  (1ULL << 32)
 #define VIRTIO_F_RING_INDIRECT_DESC         (1ULL << 28)
 #define VIRTIO_F_RING_EVENT_IDX             (1ULL << 29)
+#define VIRTIO_F_IN_ORDER                   (1ULL << 35)
 
 //
 // VirtIO Balloon Device Configuration
@@ -80,38 +81,7 @@ typedef struct _VIRTIO_BALLOON_STAT {
 //
 // Virtqueue Ring Structures
 //
-#define VRING_DESC_F_NEXT       1
-#define VRING_DESC_F_WRITE      2
-#define VRING_DESC_F_INDIRECT   4
-
-#pragma pack(push, 1)
-typedef struct _VRING_DESC {
-    ULONGLONG   Addr;
-    ULONG       Len;
-    USHORT      Flags;
-    USHORT      Next;
-} VRING_DESC, *PVRING_DESC;
-
-typedef struct _VRING_AVAIL {
-    USHORT      Flags;
-    USHORT      Idx;
-    USHORT      Ring[1];
-} VRING_AVAIL, *PVRING_AVAIL;
-
-typedef struct _VRING_USED_ELEM {
-    ULONG       Id;
-    ULONG       Len;
-} VRING_USED_ELEM, *PVRING_USED_ELEM;
-
-typedef struct _VRING_USED {
-    USHORT          Flags;
-    USHORT          Idx;
-    VRING_USED_ELEM Ring[1];
-} VRING_USED, *PVRING_USED;
-#pragma pack(pop)
-
-#define VRING_AVAIL_F_NO_INTERRUPT  1
-#define VRING_USED_F_NO_NOTIFY      1
+#include "../common/zvio_vring.h"
 
 //
 // VirtIO PCI Common Configuration
@@ -152,14 +122,16 @@ typedef struct _ZVIOBLN_DEVICE_CONTEXT ZVIOBLN_DEVICE_CONTEXT, *PZVIOBLN_DEVICE_
 typedef struct _ZVIOBLN_VIRTQUEUE ZVIOBLN_VIRTQUEUE, *PZVIOBLN_VIRTQUEUE;
 
 //
-// Balloon Page Entry - tracks allocated pages
+// Balloon Chunk - one MDL of inflated pages
+//
+// The MDL's PFN array is the only per-page record, so a 2 MB chunk
+// costs one entry instead of 512.
 //
-typedef struct _ZVIOBLN_PAGE_ENTRY {
+typedef struct _ZVIOBLN_CHUNK {
     LIST_ENTRY      Link;
     PMDL            Mdl;
-    PVOID           VirtualAddress;
-    PFN_NUMBER      PageFrameNumber;
-} ZVIOBLN_PAGE_ENTRY, *PZVIOBLN_PAGE_ENTRY;
+    ULONG           NumPages;       // Pages described by the MDL
+} ZVIOBLN_CHUNK, *PZVIOBLN_CHUNK;
 
 //
 // Virtqueue Context
@@ -170,6 +142,13 @@ struct _ZVIOBLN_VIRTQUEUE {
     USHORT                  NumFree;
     USHORT                  FreeHead;
     USHORT                  LastUsedIdx;
+    USHORT                  KickedAvailIdx;
+    BOOLEAN                 EventIdx;
+    BOOLEAN                 InterruptsOff;
+    BOOLEAN                 InOrder;
+    BOOLEAN                 InBatch;
+    USHORT                  BatchLast;
+    ULONG                   BatchLen;
 
     PVRING_DESC             Desc;
     PHYSICAL_ADDRESS        DescPhys;
@@ -220,6 +199,7 @@ struct _ZVIOBLN_DEVICE_CONTEXT {
     PZVIOBLN_VIRTQUEUE      InflateQueue;   // Queue 0: Inflate (add pages to balloon)
     PZVIOBLN_VIRTQUEUE      DeflateQueue;   // Queue 1: Deflate (remove pages from balloon)
     PZVIOBLN_VIRTQUEUE      StatsQueue;     // Queue 2: Statistics (optional)
+    PZVIOBLN_VIRTQUEUE      ReportQueue;    // Free page reporting (optional)
 
     // DMA
     WDFDMAENABLER           DmaEnabler;
@@ -229,8 +209,8 @@ struct _ZVIOBLN_DEVICE_CONTEXT {
     BOOLEAN                 UseMsix;
 
     // Balloon state
-    LIST_ENTRY              PageList;       // List of inflated pages
-    WDFSPINLOCK             PageListLock;
+    LIST_ENTRY              ChunkList;      // Inflated chunks, newest first
+    WDFSPINLOCK             ChunkListLock;
     ULONG                   NumPages;       // Current pages in balloon
     ULONG                   TargetPages;    // Target pages requested by host
 
@@ -238,7 +218,14 @@ struct _ZVIOBLN_DEVICE_CONTEXT {
     WDFCOMMONBUFFER         PfnBuffer;
     PULONG                  PfnArray;
     PHYSICAL_ADDRESS        PfnArrayPhys;
-    ULONG                   PfnArraySize;
+    ULONG                   PfnArraySize;   // ZVIOBLN_PFN_BUFFERS buffers of PFNs
+
+    // Buffers posted by the work timer
+    volatile LONG           HostInFlight;   // Buffers the host has not returned
+    KEVENT                  HostEvent;      // Set when HostInFlight drops to zero
+    volatile LONG           WorkActive;     // Work timer callback is running
+    ULONG                   ReportTicks;    // Work timer ticks since the last report
+    LIST_ENTRY              ReportList;     // Reported chunks the host still holds
 
     // Statistics buffer
     WDFCOMMONBUFFER         StatsBuffer;
@@ -253,10 +240,31 @@ struct _ZVIOBLN_DEVICE_CONTEXT {
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIOBLN_DEVICE_CONTEXT, ZvioBlnGetDeviceContext)
 
 //
-// Maximum pages per inflate/deflate operation
+// Maximum pages per inflate/deflate buffer
 //
 #define ZVIOBLN_MAX_PAGES_PER_OP    256
 
+//
+// Inflate/deflate buffers posted per kick, and the pages one MDL holds
+//
+#define ZVIOBLN_PFN_BUFFERS         8
+#define ZVIOBLN_CHUNK_SIZE          (2 * 1024 * 1024)
+#define ZVIOBLN_CHUNK_PAGES         (ZVIOBLN_CHUNK_SIZE / PAGE_SIZE)
+
+//
+// Free page reporting: a pass every ZVIOBLN_REPORT_INTERVAL work timer
+// ticks reports up to ZVIOBLN_REPORT_BATCH chunks per kick, and leaves
+// 1 / 2^ZVIOBLN_REPORT_RESERVE_SHIFT of memory available
+//
+#define ZVIOBLN_REPORT_INTERVAL     10
+#define ZVIOBLN_REPORT_BATCH        32
+#define ZVIOBLN_REPORT_RESERVE_SHIFT 3
+
+//
+// How long to wait for the host to return a batch of buffers
+//
+#define ZVIOBLN_HOST_TIMEOUT_MS     5000
+
 //
 // Function Prototypes
 //
@@ -285,11 +293,47 @@ ZvioBlnDeflate(
     _In_ ULONG NumPages
     );
 
+VOID
+ZvioBlnFreeChunks(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    );
+
+VOID
+ZvioBlnFreeChunkList(
+    _Inout_ PLIST_ENTRY ChunkList
+    );
+
+NTSTATUS
+ZvioBlnHostBatchBegin(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    );
+
+NTSTATUS
+ZvioBlnHostBatchAdd(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_VIRTQUEUE Queue,
+    _In_ PHYSICAL_ADDRESS PhysAddr,
+    _In_ ULONG Length,
+    _In_ BOOLEAN DeviceWritable
+    );
+
+NTSTATUS
+ZvioBlnHostBatchEnd(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_VIRTQUEUE Queue
+    );
+
 VOID
 ZvioBlnUpdateStats(
     _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
     );
 
+// report.c
+VOID
+ZvioBlnReportFreePages(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    );
+
 // virtqueue.c
 NTSTATUS
 ZvioBlnQueueCreate(
@@ -323,6 +367,12 @@ ZvioBlnQueueKick(
     _In_ PZVIOBLN_VIRTQUEUE Queue
     );
 
+BOOLEAN
+ZvioBlnQueueEnableInterrupts(
+    _In_ PZVIOBLN_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    );
+
 // interrupt.c
 EVT_WDF_INTERRUPT_ISR ZvioBlnEvtInterruptIsr;
 EVT_WDF_INTERRUPT_DPC ZvioBlnEvtInterruptDpc;
@@ -0,0 +1,240 @@
+/*
+ * Zixiao VirtIO Balloon Driver - Free Page Reporting
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Tells the host which guest memory is free so it can reclaim it
+ * without a balloon target. A driver cannot walk the Windows free
+ * lists, so free memory is found by allocating it: 2 MB large pages
+ * that are readily available come off the free and zeroed lists
+ * without trimming working sets or repurposing standby pages. The
+ * chunks of a pass are held until the pass ends, so a pass never
+ * reports a page twice, and are then freed back to Windows.
+ */
+
+#include "public.h"
+
+/*
+ * ZvioBlnReportAvailablePages - Pages Windows could hand out right now
+ */
+static ULONG
+ZvioBlnReportAvailablePages(
+    VOID
+    )
+{
+    SYSTEM_PERFORMANCE_INFORMATION perfInfo;
+
+    if (!NT_SUCCESS(ZwQuerySystemInformation(SystemPerformanceInformation,
+                                             &perfInfo, sizeof(perfInfo), NULL))) {
+        return 0;
+    }
+
+    return perfInfo.AvailablePages;
+}
+
+/*
+ * ZvioBlnReportAllocateChunk - Take one free 2 MB large page, or NULL
+ */
+static PZVIOBLN_CHUNK
+ZvioBlnReportAllocateChunk(
+    VOID
+    )
+{
+#ifdef MM_ALLOCATE_FAST_LARGE_PAGES
+    PHYSICAL_ADDRESS lowAddr, highAddr, skipBytes;
+    PZVIOBLN_CHUNK chunk;
+    PMDL mdl;
+
+    lowAddr.QuadPart = 0;
+    highAddr.QuadPart = (ULONGLONG)-1;
+    skipBytes.QuadPart = 0;
+
+    mdl = MmAllocatePagesForMdlEx(
+        lowAddr,
+        highAddr,
+        skipBytes,
+        ZVIOBLN_CHUNK_SIZE,
+        MmCached,
+        MM_ALLOCATE_FAST_LARGE_PAGES | MM_ALLOCATE_FULLY_REQUIRED | MM_DONT_ZERO_ALLOCATION
+        );
+
+    if (!mdl) {
+        return NULL;
+    }
+
+    chunk = (PZVIOBLN_CHUNK)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(ZVIOBLN_CHUNK),
+        ZVIOBLN_TAG
+        );
+
+    if (!chunk) {
+        MmFreePagesFromMdl(mdl);
+        ExFreePool(mdl);
+        return NULL;
+    }
+
+    chunk->Mdl = mdl;
+    chunk->NumPages = ZVIOBLN_CHUNK_PAGES;
+
+    return chunk;
+#else
+    return NULL;
+#endif
+}
+
+/*
+ * ZvioBlnReportChunk - Post the physically contiguous runs of a chunk
+ *
+ * A large page is a single run. The buffers are device-writable, as
+ * the host may discard their contents.
+ */
+static NTSTATUS
+ZvioBlnReportChunk(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIOBLN_CHUNK Chunk
+    )
+{
+    PPFN_NUMBER pfns = MmGetMdlPfnArray(Chunk->Mdl);
+    PHYSICAL_ADDRESS phys;
+    NTSTATUS status;
+    ULONG start = 0;
+    ULONG i;
+
+    for (i = 1; i <= Chunk->NumPages; i++) {
+        if (i < Chunk->NumPages && pfns[i] == pfns[i - 1] + 1) {
+            continue;
+        }
+
+        phys.QuadPart = (LONGLONG)pfns[start] << PAGE_SHIFT;
+
+        status = ZvioBlnHostBatchAdd(
+            DeviceContext,
+            DeviceContext->ReportQueue,
+            phys,
+            (i - start) * PAGE_SIZE,
+            TRUE
+            );
+
+        if (!NT_SUCCESS(status)) {
+            return status;
+        }
+
+        start = i;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBlnReportFreePages - Report free memory to the host
+ *
+ * Called from the work timer while the balloon is at its target.
+ */
+VOID
+ZvioBlnReportFreePages(
+    _In_ PZVIOBLN_DEVICE_CONTEXT DeviceContext
+    )
+{
+    SYSTEM_BASIC_INFORMATION basicInfo;
+    LIST_ENTRY reported;
+    LIST_ENTRY batch;
+    PLIST_ENTRY entry;
+    PZVIOBLN_CHUNK chunk;
+    NTSTATUS status = STATUS_SUCCESS;
+    ULONG reservePages;
+    ULONG reportedPages = 0;
+    ULONG count;
+
+    PAGED_CODE();
+
+    if (!DeviceContext->ReportQueue) {
+        return;
+    }
+
+    if (++DeviceContext->ReportTicks < ZVIOBLN_REPORT_INTERVAL) {
+        return;
+    }
+
+    DeviceContext->ReportTicks = 0;
+
+    //
+    // A pass that timed out left its chunks behind
+    //
+    if (DeviceContext->HostInFlight != 0) {
+        return;
+    }
+
+    ZvioBlnFreeChunkList(&DeviceContext->ReportList);
+
+    if (!NT_SUCCESS(ZwQuerySystemInformation(SystemBasicInformation,
+                                             &basicInfo, sizeof(basicInfo), NULL))) {
+        return;
+    }
+
+    reservePages = basicInfo.NumberOfPhysicalPages >> ZVIOBLN_REPORT_RESERVE_SHIFT;
+
+    InitializeListHead(&reported);
+
+    while (NT_SUCCESS(status)) {
+        InitializeListHead(&batch);
+        count = 0;
+
+        //
+        // Take free chunks while the reserve holds and the queue has a
+        // descriptor for each
+        //
+        while (count < ZVIOBLN_REPORT_BATCH &&
+               DeviceContext->ReportQueue->NumFree > count &&
+               ZvioBlnReportAvailablePages() > reservePages + ZVIOBLN_CHUNK_PAGES) {
+            chunk = ZvioBlnReportAllocateChunk();
+            if (!chunk) {
+                break;
+            }
+
+            InsertTailList(&batch, &chunk->Link);
+            count++;
+        }
+
+        if (count == 0) {
+            break;
+        }
+
+        status = ZvioBlnHostBatchBegin(DeviceContext);
+        if (!NT_SUCCESS(status)) {
+            ZvioBlnFreeChunkList(&batch);
+            break;
+        }
+
+        for (entry = batch.Flink; entry != &batch && NT_SUCCESS(status); entry = entry->Flink) {
+            chunk = CONTAINING_RECORD(entry, ZVIOBLN_CHUNK, Link);
+            status = ZvioBlnReportChunk(DeviceContext, chunk);
+        }
+
+        if (!NT_SUCCESS(ZvioBlnHostBatchEnd(DeviceContext, DeviceContext->ReportQueue))) {
+            status = STATUS_IO_TIMEOUT;
+        }
+
+        while (!IsListEmpty(&batch)) {
+            InsertTailList(&reported, RemoveHeadList(&batch));
+        }
+
+        reportedPages += count * ZVIOBLN_CHUNK_PAGES;
+    }
+
+    if (status == STATUS_IO_TIMEOUT) {
+        //
+        // Posted ranges stay allocated until the host is done with them
+        //
+        while (!IsListEmpty(&reported)) {
+            InsertTailList(&DeviceContext->ReportList, RemoveHeadList(&reported));
+        }
+    } else {
+        ZvioBlnFreeChunkList(&reported);
+    }
+
+    if (reportedPages) {
+        ZvioBlnDbgPrint("Reported %u free pages", reportedPages);
+    }
+}
@@ -60,11 +60,19 @@ ZvioBlnDeviceInit(
         VIRTIO_F_VERSION_1 |
         VIRTIO_F_RING_INDIRECT_DESC |
         VIRTIO_F_RING_EVENT_IDX |
+        VIRTIO_F_IN_ORDER |
         VIRTIO_BALLOON_F_MUST_TELL_HOST |
         VIRTIO_BALLOON_F_STATS_VQ |
         VIRTIO_BALLOON_F_DEFLATE_ON_OOM
         );
 
+#ifdef MM_ALLOCATE_FAST_LARGE_PAGES
+    //
+    // Free pages are found through large page allocations
+    //
+    driverFeatures |= deviceFeatures & VIRTIO_BALLOON_F_REPORTING;
+#endif
+
     ZvioBlnDbgPrint("Driver features: 0x%016llX", driverFeatures);
 
     status = ZvioBlnSetDriverFeatures(DeviceContext, driverFeatures);
@@ -120,6 +128,26 @@ ZvioBlnDeviceInit(
         }
     }
 
+    //
+    // Reporting queue: numbered after the optional queues the device
+    // offers, whether or not they were negotiated
+    //
+    if (driverFeatures & VIRTIO_BALLOON_F_REPORTING) {
+        USHORT reportIndex = 2;
+
+        if (deviceFeatures & VIRTIO_BALLOON_F_STATS_VQ) {
+            reportIndex++;
+        }
+        if (deviceFeatures & VIRTIO_BALLOON_F_FREE_PAGE_HINT) {
+            reportIndex++;
+        }
+
+        status = ZvioBlnQueueCreate(DeviceContext, reportIndex, &DeviceContext->ReportQueue);
+        if (!NT_SUCCESS(status)) {
+            ZvioBlnDbgPrint("Reporting queue not available (optional)");
+        }
+    }
+
     //
     // Step 8: Set DRIVER_OK status - device is live
     //
@@ -18,9 +18,9 @@ ZvioBlnQueueRingSize(
     _In_ USHORT QueueSize
     )
 {
-    ULONG descSize = sizeof(VRING_DESC) * QueueSize;
-    ULONG availSize = sizeof(USHORT) * (3 + QueueSize);
-    ULONG usedSize = sizeof(USHORT) * 3 + sizeof(VRING_USED_ELEM) * QueueSize;
+    ULONG descSize = ZVIO_VRING_DESC_SIZE(QueueSize);
+    ULONG availSize = ZVIO_VRING_AVAIL_SIZE(QueueSize);
+    ULONG usedSize = ZVIO_VRING_USED_SIZE(QueueSize);
 
     //
     // Align available ring to 2 bytes, used ring to 4 bytes
@@ -96,6 +96,8 @@ ZvioBlnQueueCreate(
     queue->Index = Index;
     queue->Size = queueSize;
     queue->DeviceContext = DeviceContext;
+    queue->EventIdx = (DeviceContext->DriverFeatures & VIRTIO_F_RING_EVENT_IDX) != 0;
+    queue->InOrder = (DeviceContext->DriverFeatures & VIRTIO_F_IN_ORDER) != 0;
 
     //
     // Allocate ring buffer
@@ -248,7 +250,6 @@ ZvioBlnQueueAddBuffer(
     )
 {
     USHORT descIdx;
-    USHORT availIdx;
 
     if (!Queue || Queue->NumFree == 0) {
         return STATUS_INSUFFICIENT_RESOURCES;
@@ -273,15 +274,7 @@ ZvioBlnQueueAddBuffer(
 
     Queue->DescData[descIdx] = UserData;
 
-    //
-    // Add to available ring
-    //
-    availIdx = Queue->Avail->Idx & (Queue->Size - 1);
-    Queue->Avail->Ring[availIdx] = descIdx;
-    KeMemoryBarrier();
-
-    Queue->Avail->Idx++;
-    KeMemoryBarrier();
+    ZVIO_VRING_PUBLISH(Queue, descIdx);
 
     WdfSpinLockRelease(Queue->Lock);
 
@@ -290,6 +283,8 @@ ZvioBlnQueueAddBuffer(
 
 /*
  * ZvioBlnQueueGetBuffer - Get a completed buffer from the virtqueue
+ *
+ * Ring protocol, including in-order batches: ZVIO_VRING_POP_USED.
  */
 PVOID
 ZvioBlnQueueGetBuffer(
@@ -297,8 +292,8 @@ ZvioBlnQueueGetBuffer(
     _Out_ PULONG Length
     )
 {
-    USHORT usedIdx;
     USHORT descIdx;
+    BOOLEAN lengthKnown;
     PVOID userData;
 
     *Length = 0;
@@ -309,19 +304,17 @@ ZvioBlnQueueGetBuffer(
 
     WdfSpinLockAcquire(Queue->Lock);
 
-    if (Queue->LastUsedIdx == Queue->Used->Idx) {
+    if (!ZVIO_VRING_HAS_USED(Queue)) {
         WdfSpinLockRelease(Queue->Lock);
         return NULL;
     }
 
-    //
-    // Get used entry
-    //
-    usedIdx = Queue->LastUsedIdx & (Queue->Size - 1);
-    descIdx = (USHORT)Queue->Used->Ring[usedIdx].Id;
-    *Length = Queue->Used->Ring[usedIdx].Len;
+    ZVIO_VRING_POP_USED(Queue, descIdx, *Length, lengthKnown);
+    ZVIO_VRING_ASK_NEXT(Queue);
 
-    Queue->LastUsedIdx++;
+    if (!lengthKnown && (Queue->Desc[descIdx].Flags & VRING_DESC_F_WRITE)) {
+        *Length = Queue->Desc[descIdx].Len;
+    }
 
     //
     // Get user data
@@ -343,22 +336,48 @@ ZvioBlnQueueGetBuffer(
 
 /*
  * ZvioBlnQueueKick - Notify device about new available buffers
+ *
+ * Suppression as in ZVIO_VRING_PREPARE_KICK.
  */
 VOID
 ZvioBlnQueueKick(
     _In_ PZVIOBLN_VIRTQUEUE Queue
     )
 {
+    BOOLEAN notify;
+
     if (!Queue || !Queue->NotifyAddr) {
         return;
     }
 
-    KeMemoryBarrier();
+    WdfSpinLockAcquire(Queue->Lock);
+    ZVIO_VRING_PREPARE_KICK(Queue, notify);
+    WdfSpinLockRelease(Queue->Lock);
 
-    //
-    // Check if notification is needed
-    //
-    if (!(Queue->Used->Flags & VRING_USED_F_NO_NOTIFY)) {
+    if (notify) {
         WRITE_REGISTER_USHORT((PUSHORT)Queue->NotifyAddr, Queue->Index);
     }
 }
+
+/*
+ * ZvioBlnQueueEnableInterrupts - Enable/disable queue interrupts
+ *
+ * Event index handling: ZVIO_VRING_SET_INTERRUPTS.
+ */
+BOOLEAN
+ZvioBlnQueueEnableInterrupts(
+    _In_ PZVIOBLN_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    )
+{
+    BOOLEAN wasEnabled;
+
+    WdfSpinLockAcquire(Queue->Lock);
+
+    wasEnabled = !Queue->InterruptsOff;
+    ZVIO_VRING_SET_INTERRUPTS(Queue, Enable);
+
+    WdfSpinLockRelease(Queue->Lock);
+
+    return wasEnabled;
+}
@@ -0,0 +1,268 @@
+/*
+ * Zixiao VirtIO Network Driver - Interrupt Moderation
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * A periodic timer samples each pair's packet rate and picks a
+ * coalescing level for it; a work item then programs the device
+ * through the control queue. At low rates every packet interrupts,
+ * so latency is untouched until the load makes interrupts costly.
+ */
+
+#include "public.h"
+
+#define ZVIONET_COAL_PERIOD_MS      100
+
+//
+// Levels by packets per second. A pair moves one level per sample,
+// and falls back only once the rate is well below the threshold.
+//
+static const struct {
+    ULONG   Rate;
+    ULONG   MaxUsecs;
+    ULONG   MaxPackets;
+} ZvioNetCoalLevels[] = {
+    { 0,        0,      0  },
+    { 20000,    25,     8  },
+    { 80000,    50,     32 },
+    { 250000,   100,    64 },
+};
+
+#define ZVIONET_COAL_LEVEL_COUNT    ARRAYSIZE(ZvioNetCoalLevels)
+
+static NDIS_TIMER_FUNCTION ZvioNetCoalTimer;
+static NDIS_IO_WORKITEM_FUNCTION ZvioNetCoalWork;
+
+/*
+ * ZvioNetCoalSupported - Whether the device takes coalescing commands
+ */
+BOOLEAN
+ZvioNetCoalSupported(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    return Adapter->CtrlQueue != NULL &&
+        (Adapter->DriverFeatures & (VIRTIO_NET_F_NOTF_COAL | VIRTIO_NET_F_VQ_NOTF_COAL)) != 0;
+}
+
+/*
+ * ZvioNetCoalSetQueue - Program one virtqueue's coalescing
+ */
+static NDIS_STATUS
+ZvioNetCoalSetQueue(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ USHORT Vqn,
+    _In_ ULONG Level
+    )
+{
+    VIRTIO_NET_CTRL_COAL_VQ coal;
+
+    coal.Vqn = Vqn;
+    coal.Reserved = 0;
+    coal.Coal.MaxPackets = ZvioNetCoalLevels[Level].MaxPackets;
+    coal.Coal.MaxUsecs = ZvioNetCoalLevels[Level].MaxUsecs;
+
+    return ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_NOTF_COAL,
+                              VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET, &coal, sizeof(coal));
+}
+
+/*
+ * ZvioNetCoalSetAll - Program device-wide RX and TX coalescing
+ */
+static NDIS_STATUS
+ZvioNetCoalSetAll(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONG Level
+    )
+{
+    VIRTIO_NET_CTRL_COAL coal;
+    NDIS_STATUS status;
+
+    coal.MaxPackets = ZvioNetCoalLevels[Level].MaxPackets;
+    coal.MaxUsecs = ZvioNetCoalLevels[Level].MaxUsecs;
+
+    status = ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_NOTF_COAL,
+                                VIRTIO_NET_CTRL_NOTF_COAL_RX_SET, &coal, sizeof(coal));
+    if (status != NDIS_STATUS_SUCCESS) {
+        return status;
+    }
+
+    return ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_NOTF_COAL,
+                              VIRTIO_NET_CTRL_NOTF_COAL_TX_SET, &coal, sizeof(coal));
+}
+
+/*
+ * ZvioNetCoalWork - Apply the levels the timer picked
+ */
+static VOID
+ZvioNetCoalWork(
+    _In_ PVOID WorkItemContext,
+    _In_ NDIS_HANDLE NdisIoWorkItemHandle
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)WorkItemContext;
+    ULONG level = 0;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(NdisIoWorkItemHandle);
+
+    if (adapter->DriverFeatures & VIRTIO_NET_F_VQ_NOTF_COAL) {
+        for (i = 0; i < adapter->NumPairs; i++) {
+            PZVIONET_QUEUE_PAIR pair = &adapter->Pairs[i];
+            ULONG target = pair->CoalTarget;
+
+            if (target == pair->CoalLevel) {
+                continue;
+            }
+
+            if (ZvioNetCoalSetQueue(adapter, (USHORT)(2 * i), target) == NDIS_STATUS_SUCCESS &&
+                ZvioNetCoalSetQueue(adapter, (USHORT)(2 * i + 1), target) == NDIS_STATUS_SUCCESS) {
+                pair->CoalLevel = target;
+            }
+        }
+    } else {
+        //
+        // Only device-wide settings: follow the busiest pair
+        //
+        for (i = 0; i < adapter->NumPairs; i++) {
+            level = max(level, adapter->Pairs[i].CoalTarget);
+        }
+
+        if (ZvioNetCoalSetAll(adapter, level) == NDIS_STATUS_SUCCESS) {
+            for (i = 0; i < adapter->NumPairs; i++) {
+                adapter->Pairs[i].CoalLevel = level;
+            }
+        }
+    }
+
+    InterlockedExchange(&adapter->CoalPending, 0);
+}
+
+/*
+ * ZvioNetCoalTimer - Sample packet rates and choose levels
+ */
+static VOID
+ZvioNetCoalTimer(
+    _In_ PVOID SystemSpecific1,
+    _In_ PVOID FunctionContext,
+    _In_ PVOID SystemSpecific2,
+    _In_ PVOID SystemSpecific3
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)FunctionContext;
+    BOOLEAN perQueue = (adapter->DriverFeatures & VIRTIO_NET_F_VQ_NOTF_COAL) != 0;
+    BOOLEAN changed = FALSE;
+    ULONG maxTarget = 0;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(SystemSpecific1);
+    UNREFERENCED_PARAMETER(SystemSpecific2);
+    UNREFERENCED_PARAMETER(SystemSpecific3);
+
+    if (!adapter->Running) {
+        return;
+    }
+
+    for (i = 0; i < adapter->NumPairs; i++) {
+        PZVIONET_QUEUE_PAIR pair = &adapter->Pairs[i];
+        ULONG64 packets = pair->Stats.RxPackets + pair->Stats.TxPackets;
+        ULONG64 rate = (packets - pair->CoalLastPackets) * (1000 / ZVIONET_COAL_PERIOD_MS);
+        ULONG level = pair->CoalTarget;
+
+        pair->CoalLastPackets = packets;
+
+        if (!adapter->InterruptModeration) {
+            level = 0;
+        } else if (level + 1 < ZVIONET_COAL_LEVEL_COUNT &&
+                   rate >= ZvioNetCoalLevels[level + 1].Rate) {
+            level++;
+        } else if (level > 0 &&
+                   rate < ZvioNetCoalLevels[level].Rate - ZvioNetCoalLevels[level].Rate / 4) {
+            level--;
+        }
+
+        pair->CoalTarget = level;
+        maxTarget = max(maxTarget, level);
+        if (level != pair->CoalLevel) {
+            changed = TRUE;
+        }
+    }
+
+    if (!perQueue) {
+        changed = (maxTarget != adapter->Pairs[0].CoalLevel);
+    }
+
+    //
+    // Control commands wait on the device; leave them to a work item
+    //
+    if (changed && InterlockedCompareExchange(&adapter->CoalPending, 1, 0) == 0) {
+        NdisQueueIoWorkItem(adapter->CoalWorkItem, ZvioNetCoalWork, adapter);
+    }
+}
+
+/*
+ * ZvioNetCoalInit - Start sampling if the device can coalesce
+ */
+NDIS_STATUS
+ZvioNetCoalInit(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    NDIS_TIMER_CHARACTERISTICS timerChars;
+    LARGE_INTEGER dueTime;
+    NDIS_STATUS status;
+
+    if (!ZvioNetCoalSupported(Adapter)) {
+        return NDIS_STATUS_SUCCESS;
+    }
+
+    Adapter->CoalWorkItem = NdisAllocateIoWorkItem(Adapter->AdapterHandle);
+    if (!Adapter->CoalWorkItem) {
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    NdisZeroMemory(&timerChars, sizeof(timerChars));
+    timerChars.Header.Type = NDIS_OBJECT_TYPE_TIMER_CHARACTERISTICS;
+    timerChars.Header.Revision = NDIS_TIMER_CHARACTERISTICS_REVISION_1;
+    timerChars.Header.Size = NDIS_SIZEOF_TIMER_CHARACTERISTICS_REVISION_1;
+    timerChars.AllocationTag = ZVIONET_TAG;
+    timerChars.TimerFunction = ZvioNetCoalTimer;
+    timerChars.FunctionContext = Adapter;
+
+    status = NdisAllocateTimerObject(Adapter->AdapterHandle, &timerChars, &Adapter->CoalTimer);
+    if (status != NDIS_STATUS_SUCCESS) {
+        NdisFreeIoWorkItem(Adapter->CoalWorkItem);
+        Adapter->CoalWorkItem = NULL;
+        return status;
+    }
+
+    dueTime.QuadPart = -(LONGLONG)ZVIONET_COAL_PERIOD_MS * 10000;
+    NdisSetTimerObject(Adapter->CoalTimer, dueTime, ZVIONET_COAL_PERIOD_MS, NULL);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetCoalFree - Stop sampling and wait out a pending update
+ */
+VOID
+ZvioNetCoalFree(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    if (Adapter->CoalTimer) {
+        NdisCancelTimerObject(Adapter->CoalTimer);
+        KeFlushQueuedDpcs();
+        NdisFreeTimerObject(Adapter->CoalTimer);
+        Adapter->CoalTimer = NULL;
+    }
+
+    if (Adapter->CoalWorkItem) {
+        while (Adapter->CoalPending) {
+            NdisMSleep(1000);
+        }
+        NdisFreeIoWorkItem(Adapter->CoalWorkItem);
+        Adapter->CoalWorkItem = NULL;
+    }
+}
@@ -0,0 +1,179 @@
+/*
+ * Zixiao VirtIO Network Driver - Control Queue
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Commands are sent one at a time out of a single shared page laid out
+ * as header, payload, then the ack byte the device writes back.
+ */
+
+#include "public.h"
+
+#define ZVIONET_CTRL_BUFFER_SIZE    PAGE_SIZE
+#define ZVIONET_CTRL_POLL_US        10
+#define ZVIONET_CTRL_TIMEOUT_US     1000000
+
+/*
+ * ZvioNetCtrlInit - Allocate the command buffer
+ */
+NDIS_STATUS
+ZvioNetCtrlInit(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    NdisMAllocateSharedMemory(
+        Adapter->AdapterHandle,
+        ZVIONET_CTRL_BUFFER_SIZE,
+        FALSE,
+        (PVOID *)&Adapter->CtrlBuffer,
+        &Adapter->CtrlBufferPA
+        );
+
+    if (!Adapter->CtrlBuffer) {
+        ZvioNetDbgError("Failed to allocate control buffer");
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetCtrlFree - Free the command buffer
+ */
+VOID
+ZvioNetCtrlFree(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    if (Adapter->CtrlBuffer) {
+        NdisMFreeSharedMemory(
+            Adapter->AdapterHandle,
+            ZVIONET_CTRL_BUFFER_SIZE,
+            FALSE,
+            Adapter->CtrlBuffer,
+            Adapter->CtrlBufferPA
+            );
+        Adapter->CtrlBuffer = NULL;
+    }
+}
+
+/*
+ * ZvioNetCtrlCommand - Send a command and wait for the device's ack
+ */
+NDIS_STATUS
+ZvioNetCtrlCommand(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ UCHAR Class,
+    _In_ UCHAR Cmd,
+    _In_reads_bytes_opt_(Length) PVOID Data,
+    _In_ ULONG Length
+    )
+{
+    struct {
+        SCATTER_GATHER_LIST     List;
+        SCATTER_GATHER_ELEMENT  More[2];
+    } sg;
+    PVIRTIO_NET_CTRL_HDR hdr;
+    volatile UCHAR *ack;
+    NDIS_STATUS status;
+    USHORT headIdx;
+    ULONG length;
+    ULONG waited;
+    ULONG n = 0;
+
+    if (!Adapter->CtrlQueue || !Adapter->CtrlBuffer) {
+        return NDIS_STATUS_NOT_SUPPORTED;
+    }
+
+    if (sizeof(VIRTIO_NET_CTRL_HDR) + Length + 1 > ZVIONET_CTRL_BUFFER_SIZE) {
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    NdisAcquireSpinLock(&Adapter->CtrlLock);
+
+    hdr = (PVIRTIO_NET_CTRL_HDR)Adapter->CtrlBuffer;
+    hdr->Class = Class;
+    hdr->Cmd = Cmd;
+    ack = Adapter->CtrlBuffer + sizeof(VIRTIO_NET_CTRL_HDR) + Length;
+    *ack = VIRTIO_NET_ERR;
+
+    sg.List.Elements[n].Address = Adapter->CtrlBufferPA;
+    sg.List.Elements[n].Length = sizeof(VIRTIO_NET_CTRL_HDR);
+    n++;
+
+    if (Length) {
+        NdisMoveMemory(Adapter->CtrlBuffer + sizeof(VIRTIO_NET_CTRL_HDR), Data, Length);
+        sg.List.Elements[n].Address.QuadPart =
+            Adapter->CtrlBufferPA.QuadPart + sizeof(VIRTIO_NET_CTRL_HDR);
+        sg.List.Elements[n].Length = Length;
+        n++;
+    }
+
+    sg.List.Elements[n].Address.QuadPart =
+        Adapter->CtrlBufferPA.QuadPart + sizeof(VIRTIO_NET_CTRL_HDR) + Length;
+    sg.List.Elements[n].Length = 1;
+    n++;
+    sg.List.NumberOfElements = n;
+
+    if (!NT_SUCCESS(ZvioNetQueueAddBufferChain(Adapter->CtrlQueue, &sg.List, n - 1, 1,
+                                               Adapter->CtrlBuffer, &headIdx))) {
+        NdisReleaseSpinLock(&Adapter->CtrlLock);
+        return NDIS_STATUS_RESOURCES;
+    }
+
+    ZvioNetQueueKick(Adapter->CtrlQueue);
+
+    //
+    // The device answers quickly; commands are rare enough to poll
+    //
+    status = NDIS_STATUS_FAILURE;
+    for (waited = 0; waited < ZVIONET_CTRL_TIMEOUT_US; waited += ZVIONET_CTRL_POLL_US) {
+        if (ZvioNetQueueGetBuffer(Adapter->CtrlQueue, &length)) {
+            status = *ack == VIRTIO_NET_OK ? NDIS_STATUS_SUCCESS : NDIS_STATUS_FAILURE;
+            break;
+        }
+        KeStallExecutionProcessor(ZVIONET_CTRL_POLL_US);
+    }
+
+    NdisReleaseSpinLock(&Adapter->CtrlLock);
+
+    if (waited >= ZVIONET_CTRL_TIMEOUT_US) {
+        ZvioNetDbgError("Control command %d/%d timed out", Class, Cmd);
+    }
+
+    return status;
+}
+
+/*
+ * ZvioNetCtrlSetQueuePairs - Set the number of active queue pairs
+ *
+ * This also turns off RSS, leaving the device to steer flows itself.
+ */
+NDIS_STATUS
+ZvioNetCtrlSetQueuePairs(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ USHORT Pairs
+    )
+{
+    return ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET,
+                              &Pairs, sizeof(Pairs));
+}
+
+/*
+ * ZvioNetCtrlSetGuestOffloads - Choose which negotiated receive offloads apply
+ */
+NDIS_STATUS
+ZvioNetCtrlSetGuestOffloads(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONGLONG Offloads
+    )
+{
+    if (!(Adapter->DriverFeatures & VIRTIO_NET_F_CTRL_GUEST_OFFLOADS)) {
+        return NDIS_STATUS_NOT_SUPPORTED;
+    }
+
+    return ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_GUEST_OFFLOADS,
+                              VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET,
+                              &Offloads, sizeof(Offloads));
+}
@@ -11,8 +11,11 @@
 
 NDIS_HANDLE g_NdisMiniportDriverHandle = NULL;
 
+static VOID ZvioNetReadConfiguration(_In_ PZVIONET_ADAPTER Adapter);
+
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text(INIT, DriverEntry)
+#pragma alloc_text(PAGE, ZvioNetReadConfiguration)
 #pragma alloc_text(PAGE, ZvioNetMiniportInitialize)
 #pragma alloc_text(PAGE, ZvioNetMiniportHalt)
 #endif
@@ -56,6 +59,8 @@ DriverEntry(
     miniportChars.DevicePnPEventNotifyHandler = ZvioNetMiniportDevicePnPEvent;
     miniportChars.UnloadHandler = ZvioNetMiniportUnload;
 
+    ZvioNetPerfRegister();
+
     status = NdisMRegisterMiniportDriver(
         DriverObject,
         RegistryPath,
@@ -66,6 +71,7 @@ DriverEntry(
 
     if (status != NDIS_STATUS_SUCCESS) {
         ZvioNetDbgError("NdisMRegisterMiniportDriver failed: 0x%08X", status);
+        ZvioNetPerfUnregister();
         return status;
     }
 
@@ -89,6 +95,46 @@ ZvioNetMiniportUnload(
         NdisMDeregisterMiniportDriver(g_NdisMiniportDriverHandle);
         g_NdisMiniportDriverHandle = NULL;
     }
+
+    ZvioNetPerfUnregister();
+}
+
+/*
+ * ZvioNetReadConfiguration - Read advanced properties from the registry
+ */
+static VOID
+ZvioNetReadConfiguration(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    NDIS_CONFIGURATION_OBJECT configObject;
+    NDIS_HANDLE configHandle = NULL;
+    PNDIS_CONFIGURATION_PARAMETER param;
+    NDIS_STRING interruptModeration = NDIS_STRING_CONST("*InterruptModeration");
+    NDIS_STATUS status;
+
+    PAGED_CODE();
+
+    Adapter->InterruptModeration = TRUE;
+
+    NdisZeroMemory(&configObject, sizeof(configObject));
+    configObject.Header.Type = NDIS_OBJECT_TYPE_CONFIGURATION_OBJECT;
+    configObject.Header.Revision = NDIS_CONFIGURATION_OBJECT_REVISION_1;
+    configObject.Header.Size = NDIS_SIZEOF_CONFIGURATION_OBJECT_REVISION_1;
+    configObject.NdisHandle = Adapter->AdapterHandle;
+
+    status = NdisOpenConfigurationEx(&configObject, &configHandle);
+    if (status != NDIS_STATUS_SUCCESS) {
+        return;
+    }
+
+    NdisReadConfiguration(&status, &param, configHandle,
+                          &interruptModeration, NdisParameterInteger);
+    if (status == NDIS_STATUS_SUCCESS) {
+        Adapter->InterruptModeration = param->ParameterData.IntegerData != 0;
+    }
+
+    NdisCloseConfiguration(configHandle);
 }
 
 /*
@@ -106,7 +152,11 @@ ZvioNetMiniportInitialize(
     NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES regAttributes;
     NDIS_MINIPORT_ADAPTER_GENERAL_ATTRIBUTES genAttributes;
     NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES offloadAttributes;
+    NDIS_OFFLOAD defaultOffload;
+    NDIS_OFFLOAD hardwareOffload;
     NDIS_MINIPORT_INTERRUPT_CHARACTERISTICS interruptChars;
+    NDIS_RECEIVE_SCALE_CAPABILITIES rssCaps;
+    NDIS_SG_DMA_DESCRIPTION dmaDescription;
     PNDIS_RESOURCE_LIST resourceList;
     ULONG i;
 
@@ -132,12 +182,24 @@ ZvioNetMiniportInitialize(
 
     NdisZeroMemory(adapter, sizeof(ZVIONET_ADAPTER));
     adapter->AdapterHandle = MiniportAdapterHandle;
+    adapter->IfIndex = MiniportInitParameters->IfIndex;
     adapter->Mtu = ZVIONET_DEFAULT_MTU;
     adapter->LinkSpeed = 10000000000ULL; // 10 Gbps default
     adapter->LinkUp = FALSE;
     adapter->MediaConnectState = MediaConnectStateDisconnected;
-    InitializeListHead(&adapter->RxFreeList);
-    NdisAllocateSpinLock(&adapter->RxFreeLock);
+    adapter->NumPairs = 1;
+    NdisAllocateSpinLock(&adapter->CtrlLock);
+
+    for (i = 0; i < ZVIONET_MAX_QUEUE_PAIRS; i++) {
+        adapter->Pairs[i].Adapter = adapter;
+        adapter->Pairs[i].Index = i;
+        InitializeListHead(&adapter->Pairs[i].RxFreeList);
+        NdisAllocateSpinLock(&adapter->Pairs[i].RxFreeLock);
+        InitializeSListHead(&adapter->Pairs[i].TxFreeList);
+        InitializeSListHead(&adapter->Pairs[i].TxReadyList);
+    }
+
+    ZvioNetReadConfiguration(adapter);
 
     //
     // Set registration attributes
@@ -148,6 +210,7 @@ ZvioNetMiniportInitialize(
     regAttributes.Header.Revision = NDIS_MINIPORT_ADAPTER_REGISTRATION_ATTRIBUTES_REVISION_2;
     regAttributes.MiniportAdapterContext = adapter;
     regAttributes.AttributeFlags = NDIS_MINIPORT_ATTRIBUTES_NDIS_WDM |
+                                   NDIS_MINIPORT_ATTRIBUTES_BUS_MASTER |
                                    NDIS_MINIPORT_ATTRIBUTES_SURPRISE_REMOVE_OK;
     regAttributes.CheckForHangTimeInSeconds = 0;
     regAttributes.InterfaceType = NdisInterfacePci;
@@ -214,6 +277,54 @@ ZvioNetMiniportInitialize(
         goto Error;
     }
 
+    //
+    // Register interrupt; the queues are sized by the messages we get
+    //
+    NdisZeroMemory(&interruptChars, sizeof(interruptChars));
+    interruptChars.Header.Type = NDIS_OBJECT_TYPE_MINIPORT_INTERRUPT;
+    interruptChars.Header.Size = NDIS_SIZEOF_MINIPORT_INTERRUPT_CHARACTERISTICS_REVISION_1;
+    interruptChars.Header.Revision = NDIS_MINIPORT_INTERRUPT_CHARACTERISTICS_REVISION_1;
+    interruptChars.InterruptHandler = ZvioNetInterruptHandler;
+    interruptChars.InterruptDpcHandler = ZvioNetInterruptDpc;
+    interruptChars.EnableInterruptHandler = ZvioNetEnableInterrupt;
+    interruptChars.DisableInterruptHandler = ZvioNetDisableInterrupt;
+    interruptChars.MsiSupported = TRUE;
+    interruptChars.MsiSyncWithAllMessages = FALSE;
+    interruptChars.MessageInterruptHandler = ZvioNetMessageInterruptHandler;
+    interruptChars.MessageInterruptDpcHandler = ZvioNetMessageInterruptDpc;
+    interruptChars.EnableMessageInterruptHandler = ZvioNetEnableMessageInterrupt;
+    interruptChars.DisableMessageInterruptHandler = ZvioNetDisableMessageInterrupt;
+
+    status = NdisMRegisterInterruptEx(
+        MiniportAdapterHandle,
+        adapter,
+        &interruptChars,
+        &adapter->InterruptHandle
+        );
+
+    if (status != NDIS_STATUS_SUCCESS) {
+        ZvioNetDbgError("NdisMRegisterInterruptEx failed: 0x%08X", status);
+        goto Error;
+    }
+
+    //
+    // With MSI-X each queue pair gets its own message
+    //
+    if (interruptChars.InterruptType == NDIS_CONNECT_MESSAGE_BASED &&
+        interruptChars.MessageInfoTable) {
+        adapter->UseMsix = TRUE;
+        adapter->MessageInfo = interruptChars.MessageInfoTable;
+        ZvioNetDbgPrint("Using %d MSI-X messages", adapter->MessageInfo->MessageCount);
+    }
+
+    //
+    // Allocate the control command buffer
+    //
+    status = ZvioNetCtrlInit(adapter);
+    if (status != NDIS_STATUS_SUCCESS) {
+        goto Error;
+    }
+
     //
     // Initialize VirtIO device
     //
@@ -282,7 +393,12 @@ ZvioNetMiniportInitialize(
     genAttributes.MacAddressLength = 6;
     NdisMoveMemory(genAttributes.PermanentMacAddress, adapter->PermanentMacAddress, 6);
     NdisMoveMemory(genAttributes.CurrentMacAddress, adapter->CurrentMacAddress, 6);
-    genAttributes.RecvScaleCapabilities = NULL;
+    if (adapter->RssSupported) {
+        ZvioNetRssFillCapabilities(adapter, &rssCaps);
+        genAttributes.RecvScaleCapabilities = &rssCaps;
+    } else {
+        genAttributes.RecvScaleCapabilities = NULL;
+    }
     genAttributes.AccessType = NET_IF_ACCESS_BROADCAST;
     genAttributes.DirectionType = NET_IF_DIRECTION_SENDRECEIVE;
     genAttributes.ConnectionType = NET_IF_CONNECTION_DEDICATED;
@@ -306,26 +422,58 @@ ZvioNetMiniportInitialize(
     }
 
     //
-    // Register interrupt
+    // Set offload attributes
     //
-    NdisZeroMemory(&interruptChars, sizeof(interruptChars));
-    interruptChars.Header.Type = NDIS_OBJECT_TYPE_MINIPORT_INTERRUPT;
-    interruptChars.Header.Size = NDIS_SIZEOF_MINIPORT_INTERRUPT_CHARACTERISTICS_REVISION_1;
-    interruptChars.Header.Revision = NDIS_MINIPORT_INTERRUPT_CHARACTERISTICS_REVISION_1;
-    interruptChars.InterruptHandler = ZvioNetInterruptHandler;
-    interruptChars.InterruptDpcHandler = ZvioNetInterruptDpc;
-    interruptChars.EnableInterruptHandler = ZvioNetEnableInterrupt;
-    interruptChars.DisableInterruptHandler = ZvioNetDisableInterrupt;
+    ZvioNetFillOffload(adapter, &defaultOffload, FALSE);
+    ZvioNetFillOffload(adapter, &hardwareOffload, TRUE);
 
-    status = NdisMRegisterInterruptEx(
+    NdisZeroMemory(&offloadAttributes, sizeof(offloadAttributes));
+    offloadAttributes.Header.Type = NDIS_OBJECT_TYPE_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES;
+    offloadAttributes.Header.Size = NDIS_SIZEOF_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1;
+    offloadAttributes.Header.Revision = NDIS_MINIPORT_ADAPTER_OFFLOAD_ATTRIBUTES_REVISION_1;
+    offloadAttributes.DefaultOffloadConfiguration = &defaultOffload;
+    offloadAttributes.HardwareOffloadCapabilities = &hardwareOffload;
+
+    status = NdisMSetMiniportAttributes(
         MiniportAdapterHandle,
-        adapter,
-        &interruptChars,
-        &adapter->InterruptHandle
+        (PNDIS_MINIPORT_ADAPTER_ATTRIBUTES)&offloadAttributes
         );
 
     if (status != NDIS_STATUS_SUCCESS) {
-        ZvioNetDbgError("NdisMRegisterInterruptEx failed: 0x%08X", status);
+        ZvioNetDbgError("NdisMSetMiniportAttributes (offload) failed: 0x%08X", status);
+        goto Error;
+    }
+
+    //
+    // Register scatter-gather DMA for the transmit path
+    //
+    NdisZeroMemory(&dmaDescription, sizeof(dmaDescription));
+    dmaDescription.Header.Type = NDIS_OBJECT_TYPE_SG_DMA_DESCRIPTION;
+    dmaDescription.Header.Revision = NDIS_SG_DMA_DESCRIPTION_REVISION_1;
+    dmaDescription.Header.Size = NDIS_SIZEOF_SG_DMA_DESCRIPTION_REVISION_1;
+    dmaDescription.Flags = NDIS_SG_DMA_64_BIT_ADDRESS;
+    dmaDescription.MaximumPhysicalMapping = ZVIONET_MAX_LSO_SIZE + ZVIONET_MAX_HEADERS_SIZE;
+    dmaDescription.ProcessSGListHandler = ZvioNetProcessSGList;
+
+    status = NdisMRegisterScatterGatherDma(
+        MiniportAdapterHandle,
+        &dmaDescription,
+        &adapter->MiniportDmaHandle
+        );
+
+    if (status != NDIS_STATUS_SUCCESS) {
+        ZvioNetDbgError("NdisMRegisterScatterGatherDma failed: 0x%08X", status);
+        goto Error;
+    }
+
+    adapter->SgListSize = dmaDescription.ScatterGatherListSize;
+
+    //
+    // Initialize TX contexts
+    //
+    status = ZvioNetInitTx(adapter);
+    if (status != NDIS_STATUS_SUCCESS) {
+        ZvioNetDbgError("Failed to initialize TX contexts");
         goto Error;
     }
 
@@ -339,6 +487,16 @@ ZvioNetMiniportInitialize(
     }
 
     adapter->Running = TRUE;
+
+    //
+    // Adaptive coalescing; without it every packet interrupts
+    //
+    if (ZvioNetCoalInit(adapter) != NDIS_STATUS_SUCCESS) {
+        ZvioNetDbgPrint("Interrupt moderation not available");
+    }
+
+    ZvioNetPerfAddPairs(adapter);
+
     ZvioNetDbgPrint("Adapter initialized successfully");
     return NDIS_STATUS_SUCCESS;
 
@@ -372,6 +530,9 @@ ZvioNetMiniportHalt(
 
     adapter->Running = FALSE;
 
+    ZvioNetCoalFree(adapter);
+    ZvioNetPerfRemovePairs(adapter);
+
     //
     // Deregister interrupt
     //
@@ -386,25 +547,34 @@ ZvioNetMiniportHalt(
     ZvioNetDeviceReset(adapter);
 
     //
-    // Free RX buffers
+    // Free RX buffers and TX contexts
     //
     ZvioNetFreeRxBuffers(adapter);
+    ZvioNetFreeTx(adapter);
+
+    if (adapter->MiniportDmaHandle) {
+        NdisMDeregisterScatterGatherDma(adapter->MiniportDmaHandle);
+        adapter->MiniportDmaHandle = NULL;
+    }
 
     //
     // Destroy virtqueues
     //
-    if (adapter->RxQueue) {
-        ZvioNetQueueDestroy(adapter->RxQueue);
-        adapter->RxQueue = NULL;
-    }
-    if (adapter->TxQueue) {
-        ZvioNetQueueDestroy(adapter->TxQueue);
-        adapter->TxQueue = NULL;
+    for (i = 0; i < ZVIONET_MAX_QUEUE_PAIRS; i++) {
+        if (adapter->Pairs[i].RxQueue) {
+            ZvioNetQueueDestroy(adapter->Pairs[i].RxQueue);
+            adapter->Pairs[i].RxQueue = NULL;
+        }
+        if (adapter->Pairs[i].TxQueue) {
+            ZvioNetQueueDestroy(adapter->Pairs[i].TxQueue);
+            adapter->Pairs[i].TxQueue = NULL;
+        }
     }
     if (adapter->CtrlQueue) {
         ZvioNetQueueDestroy(adapter->CtrlQueue);
         adapter->CtrlQueue = NULL;
     }
+    ZvioNetCtrlFree(adapter);
 
     //
     // Unmap BARs
@@ -428,7 +598,10 @@ ZvioNetMiniportHalt(
         adapter->NbPool = NULL;
     }
 
-    NdisFreeSpinLock(&adapter->RxFreeLock);
+    for (i = 0; i < ZVIONET_MAX_QUEUE_PAIRS; i++) {
+        NdisFreeSpinLock(&adapter->Pairs[i].RxFreeLock);
+    }
+    NdisFreeSpinLock(&adapter->CtrlLock);
     NdisFreeMemory(adapter, sizeof(ZVIONET_ADAPTER), 0);
 }
 
@@ -532,22 +705,31 @@ ZvioNetMiniportReturnNetBufferLists(
 {
     PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportAdapterContext;
     PNET_BUFFER_LIST nbl;
+    PNET_BUFFER_LIST nextNbl;
+    ULONG returned = 0;
+    ULONG i;
 
     UNREFERENCED_PARAMETER(ReturnFlags);
 
     //
-    // Return NBLs to free list and replenish RX queue
+    // Return NBLs to their pair's free list and replenish those RX queues
     //
-    for (nbl = NetBufferLists; nbl != NULL; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
+    for (nbl = NetBufferLists; nbl != NULL; nbl = nextNbl) {
         PZVIONET_RX_BUFFER rxBuf = (PZVIONET_RX_BUFFER)NET_BUFFER_LIST_MINIPORT_RESERVED(nbl)[0];
+
+        // The NBL may be reposted as soon as it is recycled
+        nextNbl = NET_BUFFER_LIST_NEXT_NBL(nbl);
         if (rxBuf) {
-            NdisAcquireSpinLock(&adapter->RxFreeLock);
-            InsertTailList(&adapter->RxFreeList, &rxBuf->Link);
-            NdisReleaseSpinLock(&adapter->RxFreeLock);
+            returned |= 1UL << rxBuf->Pair->Index;
+            ZvioNetRecycleRxBuffer(rxBuf);
         }
     }
 
-    ZvioNetReplenishRx(adapter);
+    for (i = 0; i < adapter->NumPairs; i++) {
+        if (returned & (1UL << i)) {
+            ZvioNetReplenishRx(&adapter->Pairs[i]);
+        }
+    }
 }
 
 /*
@@ -654,6 +836,9 @@ ZvioNetMiniportOidRequest(
                     OID_802_3_CURRENT_ADDRESS,
                     OID_802_3_MULTICAST_LIST,
                     OID_802_3_MAXIMUM_LIST_SIZE,
+                    OID_GEN_RECEIVE_SCALE_PARAMETERS,
+                    OID_TCP_OFFLOAD_PARAMETERS,
+                    OID_GEN_INTERRUPT_MODERATION,
                 };
                 bytesNeeded = sizeof(supportedOids);
                 if (infoBufferLength >= bytesNeeded) {
@@ -780,6 +965,28 @@ ZvioNetMiniportOidRequest(
             }
             break;
 
+        case OID_GEN_INTERRUPT_MODERATION:
+            bytesNeeded = NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
+            if (infoBufferLength >= bytesNeeded) {
+                PNDIS_INTERRUPT_MODERATION_PARAMETERS moderation =
+                    (PNDIS_INTERRUPT_MODERATION_PARAMETERS)infoBuffer;
+
+                NdisZeroMemory(moderation, bytesNeeded);
+                moderation->Header.Type = NDIS_OBJECT_TYPE_DEFAULT;
+                moderation->Header.Revision = NDIS_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
+                moderation->Header.Size = NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
+                if (!adapter->CoalTimer) {
+                    moderation->InterruptModeration = NdisInterruptModerationNotSupported;
+                } else {
+                    moderation->InterruptModeration = adapter->InterruptModeration ?
+                        NdisInterruptModerationEnabled : NdisInterruptModerationDisabled;
+                }
+                bytesWritten = bytesNeeded;
+            } else {
+                status = NDIS_STATUS_BUFFER_TOO_SHORT;
+            }
+            break;
+
         default:
             status = NDIS_STATUS_NOT_SUPPORTED;
             break;
@@ -813,6 +1020,47 @@ ZvioNetMiniportOidRequest(
             }
             break;
 
+        case OID_TCP_OFFLOAD_PARAMETERS:
+            status = ZvioNetSetOffloadParameters(
+                adapter,
+                (PNDIS_OFFLOAD_PARAMETERS)infoBuffer,
+                infoBufferLength,
+                &bytesRead
+                );
+            break;
+
+        case OID_GEN_RECEIVE_SCALE_PARAMETERS:
+            status = ZvioNetRssSetParameters(
+                adapter,
+                (PNDIS_RECEIVE_SCALE_PARAMETERS)infoBuffer,
+                infoBufferLength,
+                &bytesRead
+                );
+            break;
+
+        case OID_GEN_INTERRUPT_MODERATION:
+            if (infoBufferLength >= NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1) {
+                PNDIS_INTERRUPT_MODERATION_PARAMETERS moderation =
+                    (PNDIS_INTERRUPT_MODERATION_PARAMETERS)infoBuffer;
+
+                //
+                // The timer picks the change up on its next sample
+                //
+                if (!adapter->CoalTimer) {
+                    status = NDIS_STATUS_NOT_SUPPORTED;
+                } else if (moderation->InterruptModeration == NdisInterruptModerationEnabled) {
+                    adapter->InterruptModeration = TRUE;
+                } else if (moderation->InterruptModeration == NdisInterruptModerationDisabled) {
+                    adapter->InterruptModeration = FALSE;
+                } else {
+                    status = NDIS_STATUS_INVALID_DATA;
+                }
+                bytesRead = NDIS_SIZEOF_INTERRUPT_MODERATION_PARAMETERS_REVISION_1;
+            } else {
+                status = NDIS_STATUS_INVALID_LENGTH;
+            }
+            break;
+
         default:
             status = NDIS_STATUS_NOT_SUPPORTED;
             break;
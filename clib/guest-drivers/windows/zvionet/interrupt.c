@@ -35,12 +35,102 @@ ZvioNetInterruptHandler(
     }
 
     if (claimed) {
+        adapter->Pairs[0].Stats.Interrupts++;
         *QueueDefaultInterruptDpc = TRUE;
     }
 
     return claimed;
 }
 
+/*
+ * ZvioNetSetPairInterrupts - Enable or suppress both of a pair's queues
+ */
+static VOID
+ZvioNetSetPairInterrupts(
+    _In_ PZVIONET_QUEUE_PAIR Pair,
+    _In_ BOOLEAN Enable
+    )
+{
+    if (Pair->RxQueue) {
+        ZvioNetQueueEnableInterrupts(Pair->RxQueue, Enable);
+    }
+
+    if (Pair->TxQueue) {
+        ZvioNetQueueEnableInterrupts(Pair->TxQueue, Enable);
+    }
+}
+
+/*
+ * ZvioNetServicePair - Reap a queue pair's completions within a budget
+ *
+ * Interrupts stay suppressed while the pair is serviced. Returns TRUE
+ * when the budget ran out with frames still waiting; the interrupts
+ * are then left off for the DPC NDIS queues next.
+ */
+static BOOLEAN
+ZvioNetServicePair(
+    _In_ PZVIONET_QUEUE_PAIR Pair,
+    _Inout_ PULONG Budget
+    )
+{
+    Pair->Stats.DpcRuns++;
+    ZvioNetSetPairInterrupts(Pair, FALSE);
+
+    for (;;) {
+        //
+        // Process TX completions
+        //
+        ZvioNetCompleteTx(Pair);
+
+        //
+        // Process RX packets
+        //
+        *Budget -= ZvioNetProcessRx(Pair, *Budget);
+
+        if (Pair->RxQueue) {
+            Pair->Stats.RxInFlight = Pair->RxQueue->Size - Pair->RxQueue->NumFree;
+        }
+
+        if (*Budget == 0 && Pair->RxQueue && ZvioNetQueueHasUsed(Pair->RxQueue)) {
+            Pair->Stats.DpcBudgetExhausted++;
+            return TRUE;
+        }
+
+        //
+        // Re-arm, then look again for entries used before the device
+        // saw it
+        //
+        ZvioNetSetPairInterrupts(Pair, TRUE);
+
+        if (!(Pair->RxQueue && ZvioNetQueueHasUsed(Pair->RxQueue)) &&
+            !(Pair->TxQueue && ZvioNetQueueHasUsed(Pair->TxQueue))) {
+            return FALSE;
+        }
+
+        ZvioNetSetPairInterrupts(Pair, FALSE);
+
+        if (*Budget == 0) {
+            Pair->Stats.DpcBudgetExhausted++;
+            return TRUE;
+        }
+    }
+}
+
+/*
+ * ZvioNetDpcBudget - NBLs the DPC may indicate this pass
+ */
+static ULONG
+ZvioNetDpcBudget(
+    _In_opt_ PNDIS_RECEIVE_THROTTLE_PARAMETERS Throttle
+    )
+{
+    if (!Throttle || Throttle->MaxNblsToIndicate == NDIS_INDICATE_ALL_NBLS) {
+        return MAXULONG;
+    }
+
+    return Throttle->MaxNblsToIndicate;
+}
+
 /*
  * ZvioNetInterruptDpc - Deferred Procedure Call
  */
@@ -53,9 +143,13 @@ ZvioNetInterruptDpc(
     )
 {
     PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+    PNDIS_RECEIVE_THROTTLE_PARAMETERS throttle =
+        (PNDIS_RECEIVE_THROTTLE_PARAMETERS)ReceiveThrottleParameters;
+    ULONG budget = ZvioNetDpcBudget(throttle);
+    BOOLEAN more = FALSE;
+    ULONG i;
 
     UNREFERENCED_PARAMETER(MiniportDpcContext);
-    UNREFERENCED_PARAMETER(ReceiveThrottleParameters);
     UNREFERENCED_PARAMETER(NdisReserved2);
 
     if (!adapter->Running) {
@@ -63,14 +157,17 @@ ZvioNetInterruptDpc(
     }
 
     //
-    // Process TX completions
+    // A line interrupt covers every pair; they share the budget
     //
-    ZvioNetCompleteTx(adapter);
+    for (i = 0; i < adapter->NumPairs; i++) {
+        if (ZvioNetServicePair(&adapter->Pairs[i], &budget)) {
+            more = TRUE;
+        }
+    }
 
-    //
-    // Process RX packets
-    //
-    ZvioNetProcessRx(adapter);
+    if (throttle) {
+        throttle->MoreNblsPending = more;
+    }
 }
 
 /*
@@ -82,21 +179,12 @@ ZvioNetEnableInterrupt(
     )
 {
     PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+    ULONG i;
 
     ZvioNetDbgPrint("EnableInterrupt");
 
-    if (adapter->RxQueue) {
-        NdisAcquireSpinLock(&adapter->RxQueue->Lock);
-        adapter->RxQueue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
-        KeMemoryBarrier();
-        NdisReleaseSpinLock(&adapter->RxQueue->Lock);
-    }
-
-    if (adapter->TxQueue) {
-        NdisAcquireSpinLock(&adapter->TxQueue->Lock);
-        adapter->TxQueue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
-        KeMemoryBarrier();
-        NdisReleaseSpinLock(&adapter->TxQueue->Lock);
+    for (i = 0; i < adapter->NumPairs; i++) {
+        ZvioNetEnableMessageInterrupt(adapter, i);
     }
 }
 
@@ -109,20 +197,121 @@ ZvioNetDisableInterrupt(
     )
 {
     PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+    ULONG i;
 
     ZvioNetDbgPrint("DisableInterrupt");
 
-    if (adapter->RxQueue) {
-        NdisAcquireSpinLock(&adapter->RxQueue->Lock);
-        adapter->RxQueue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
-        KeMemoryBarrier();
-        NdisReleaseSpinLock(&adapter->RxQueue->Lock);
+    for (i = 0; i < adapter->NumPairs; i++) {
+        ZvioNetDisableMessageInterrupt(adapter, i);
     }
+}
+
+/*
+ * ZvioNetMessageInterruptHandler - MSI-X Interrupt Service Routine
+ *
+ * Message N belongs to queue pair N. Its DPC is sent to the processor
+ * the pair is assigned, which is not always where the message landed.
+ */
+BOOLEAN
+ZvioNetMessageInterruptHandler(
+    _In_ NDIS_HANDLE MiniportInterruptContext,
+    _In_ ULONG MessageId,
+    _Out_ PBOOLEAN QueueDefaultInterruptDpc,
+    _Out_ PULONG TargetProcessors
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+    PROCESSOR_NUMBER current;
+    PROCESSOR_NUMBER target;
+    GROUP_AFFINITY affinity;
 
-    if (adapter->TxQueue) {
-        NdisAcquireSpinLock(&adapter->TxQueue->Lock);
-        adapter->TxQueue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
-        KeMemoryBarrier();
-        NdisReleaseSpinLock(&adapter->TxQueue->Lock);
+    *QueueDefaultInterruptDpc = FALSE;
+    *TargetProcessors = 0;
+
+    if (MessageId >= adapter->NumPairs) {
+        return TRUE;
+    }
+
+    adapter->Pairs[MessageId].Stats.Interrupts++;
+    target = adapter->Pairs[MessageId].Processor;
+    KeGetCurrentProcessorNumberEx(&current);
+
+    if (current.Group == target.Group && current.Number == target.Number) {
+        *QueueDefaultInterruptDpc = TRUE;
+    } else {
+        NdisZeroMemory(&affinity, sizeof(affinity));
+        affinity.Group = target.Group;
+        affinity.Mask = AFFINITY_MASK(target.Number);
+        NdisMQueueDpcEx(adapter->InterruptHandle, MessageId, &affinity, NULL);
+    }
+
+    return TRUE;
+}
+
+/*
+ * ZvioNetMessageInterruptDpc - MSI-X Deferred Procedure Call
+ */
+VOID
+ZvioNetMessageInterruptDpc(
+    _In_ NDIS_HANDLE MiniportInterruptContext,
+    _In_ ULONG MessageId,
+    _In_ PVOID MiniportDpcContext,
+    _In_ PVOID ReceiveThrottleParameters,
+    _In_ PVOID NdisReserved2
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+    PNDIS_RECEIVE_THROTTLE_PARAMETERS throttle =
+        (PNDIS_RECEIVE_THROTTLE_PARAMETERS)ReceiveThrottleParameters;
+    ULONG budget = ZvioNetDpcBudget(throttle);
+    BOOLEAN more;
+
+    UNREFERENCED_PARAMETER(MiniportDpcContext);
+    UNREFERENCED_PARAMETER(NdisReserved2);
+
+    if (!adapter->Running || MessageId >= adapter->NumPairs) {
+        return;
     }
+
+    more = ZvioNetServicePair(&adapter->Pairs[MessageId], &budget);
+
+    if (throttle) {
+        throttle->MoreNblsPending = more;
+    }
+}
+
+/*
+ * ZvioNetEnableMessageInterrupt - Enable a queue pair's interrupts
+ */
+VOID
+ZvioNetEnableMessageInterrupt(
+    _In_ NDIS_HANDLE MiniportInterruptContext,
+    _In_ ULONG MessageId
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+
+    if (MessageId >= adapter->NumPairs) {
+        return;
+    }
+
+    ZvioNetSetPairInterrupts(&adapter->Pairs[MessageId], TRUE);
+}
+
+/*
+ * ZvioNetDisableMessageInterrupt - Disable a queue pair's interrupts
+ */
+VOID
+ZvioNetDisableMessageInterrupt(
+    _In_ NDIS_HANDLE MiniportInterruptContext,
+    _In_ ULONG MessageId
+    )
+{
+    PZVIONET_ADAPTER adapter = (PZVIONET_ADAPTER)MiniportInterruptContext;
+
+    if (MessageId >= adapter->NumPairs) {
+        return;
+    }
+
+    ZvioNetSetPairInterrupts(&adapter->Pairs[MessageId], FALSE);
 }
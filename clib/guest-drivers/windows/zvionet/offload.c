@@ -0,0 +1,455 @@
+/*
+ * Zixiao VirtIO Network Driver - Checksum and Segmentation Offload
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Offloads travel in the virtio_net_hdr in front of every frame. On
+ * transmit the NBL's out-of-band info becomes NEEDS_CSUM and GSO
+ * fields; on receive DATA_VALID becomes checksum-succeeded info.
+ */
+
+#include "public.h"
+
+#define ZVIONET_TCP_CSUM_OFFSET     16
+#define ZVIONET_UDP_CSUM_OFFSET     6
+
+/*
+ * ZvioNetParseL4 - Find the transport header of an Ethernet frame
+ *
+ * Fails for fragments and frames that are not IP, which have no
+ * transport checksum to offload.
+ */
+BOOLEAN
+ZvioNetParseL4(
+    _In_reads_bytes_(Length) PUCHAR Frame,
+    _In_ ULONG Length,
+    _Out_ PULONG L4Offset,
+    _Out_ PUCHAR Protocol
+    )
+{
+    ULONG offset = ZVIONET_ETH_HEADER_SIZE;
+    USHORT etherType;
+    UCHAR next;
+
+    if (Length < ZVIONET_ETH_HEADER_SIZE) {
+        return FALSE;
+    }
+
+    etherType = (USHORT)((Frame[12] << 8) | Frame[13]);
+    if (etherType == ZVIONET_ETH_TYPE_VLAN) {
+        if (Length < offset + 4) {
+            return FALSE;
+        }
+        etherType = (USHORT)((Frame[16] << 8) | Frame[17]);
+        offset += 4;
+    }
+
+    if (etherType == ZVIONET_ETH_TYPE_IPV4) {
+        ULONG ihl;
+
+        if (Length < offset + 20) {
+            return FALSE;
+        }
+        ihl = (Frame[offset] & 0x0F) * 4;
+        if (ihl < 20 || ((Frame[offset + 6] & 0x3F) | Frame[offset + 7]) != 0) {
+            return FALSE;
+        }
+        *Protocol = Frame[offset + 9];
+        offset += ihl;
+    } else if (etherType == ZVIONET_ETH_TYPE_IPV6) {
+        if (Length < offset + 40) {
+            return FALSE;
+        }
+        next = Frame[offset + 6];
+        offset += 40;
+
+        //
+        // Hop-by-hop, routing and destination options precede the
+        // transport header; a fragment header ends the search
+        //
+        while (next == 0 || next == 43 || next == 60) {
+            if (Length < offset + 8) {
+                return FALSE;
+            }
+            next = Frame[offset];
+            offset += (Frame[offset + 1] + 1) * 8;
+        }
+        if (next == 44) {
+            return FALSE;
+        }
+        *Protocol = next;
+    } else {
+        return FALSE;
+    }
+
+    if (offset > Length) {
+        return FALSE;
+    }
+
+    *L4Offset = offset;
+    return TRUE;
+}
+
+/*
+ * ZvioNetFillOffload - Describe offloads to NDIS
+ *
+ * Hardware gives what the negotiated features allow, otherwise what
+ * is currently enabled.
+ */
+VOID
+ZvioNetFillOffload(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Out_ PNDIS_OFFLOAD Offload,
+    _In_ BOOLEAN Hardware
+    )
+{
+    BOOLEAN txCsum = Adapter->TxChecksumOffload;
+    BOOLEAN rxCsum = Adapter->RxChecksumOffload;
+    BOOLEAN lso4 = Adapter->LsoV2Ipv4;
+    BOOLEAN lso6 = Adapter->LsoV2Ipv6;
+    BOOLEAN rsc4 = Adapter->RscIpv4;
+    BOOLEAN rsc6 = Adapter->RscIpv6;
+
+    if (Hardware) {
+        txCsum = (Adapter->DriverFeatures & VIRTIO_NET_F_CSUM) != 0;
+        rxCsum = (Adapter->DriverFeatures & VIRTIO_NET_F_GUEST_CSUM) != 0;
+        lso4 = txCsum && (Adapter->DriverFeatures & VIRTIO_NET_F_HOST_TSO4) != 0;
+        lso6 = txCsum && (Adapter->DriverFeatures & VIRTIO_NET_F_HOST_TSO6) != 0;
+        rsc4 = rxCsum;
+        rsc6 = rxCsum && (Adapter->DriverFeatures & VIRTIO_NET_F_GUEST_TSO6) != 0;
+    }
+
+    NdisZeroMemory(Offload, sizeof(*Offload));
+    Offload->Header.Type = NDIS_OBJECT_TYPE_OFFLOAD;
+    Offload->Header.Revision = NDIS_OFFLOAD_REVISION_3;
+    Offload->Header.Size = NDIS_SIZEOF_NDIS_OFFLOAD_REVISION_3;
+
+    //
+    // The device fills transport checksums only; IPv4 header
+    // checksums stay with the stack
+    //
+    Offload->Checksum.IPv4Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    if (txCsum) {
+        Offload->Checksum.IPv4Transmit.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Transmit.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Transmit.UdpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    Offload->Checksum.IPv4Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    if (rxCsum) {
+        Offload->Checksum.IPv4Receive.IpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Receive.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv4Receive.UdpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    Offload->Checksum.IPv6Transmit.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    if (txCsum) {
+        Offload->Checksum.IPv6Transmit.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Transmit.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Transmit.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Transmit.UdpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    Offload->Checksum.IPv6Receive.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+    if (rxCsum) {
+        Offload->Checksum.IPv6Receive.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Receive.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Receive.TcpChecksum = NDIS_OFFLOAD_SUPPORTED;
+        Offload->Checksum.IPv6Receive.UdpChecksum = NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    if (lso4) {
+        Offload->LsoV2.IPv4.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+        Offload->LsoV2.IPv4.MaxOffLoadSize = ZVIONET_MAX_LSO_SIZE;
+        Offload->LsoV2.IPv4.MinSegmentCount = 2;
+    }
+
+    if (lso6) {
+        Offload->LsoV2.IPv6.Encapsulation = NDIS_ENCAPSULATION_IEEE_802_3;
+        Offload->LsoV2.IPv6.MaxOffLoadSize = ZVIONET_MAX_LSO_SIZE;
+        Offload->LsoV2.IPv6.MinSegmentCount = 2;
+        Offload->LsoV2.IPv6.IpExtensionHeadersSupported = NDIS_OFFLOAD_SUPPORTED;
+        Offload->LsoV2.IPv6.TcpOptionsSupported = NDIS_OFFLOAD_SUPPORTED;
+    }
+
+    //
+    // The host coalesces GUEST_TSO frames; IPv4 flows are also
+    // coalesced here within each receive batch
+    //
+    Offload->Rsc.IPv4.Enabled = rsc4;
+    Offload->Rsc.IPv6.Enabled = rsc6;
+}
+
+/*
+ * ZvioNetApplyChecksumParameter - Fold one NDIS_OFFLOAD_PARAMETERS_* value in
+ */
+static VOID
+ZvioNetApplyChecksumParameter(
+    _In_ UCHAR Value,
+    _Inout_ PBOOLEAN Tx,
+    _Inout_ PBOOLEAN Rx
+    )
+{
+    switch (Value) {
+    case NDIS_OFFLOAD_PARAMETERS_TX_RX_DISABLED:
+        *Tx = FALSE;
+        *Rx = FALSE;
+        break;
+    case NDIS_OFFLOAD_PARAMETERS_TX_ENABLED_RX_DISABLED:
+        *Tx = TRUE;
+        *Rx = FALSE;
+        break;
+    case NDIS_OFFLOAD_PARAMETERS_RX_ENABLED_TX_DISABLED:
+        *Tx = FALSE;
+        *Rx = TRUE;
+        break;
+    case NDIS_OFFLOAD_PARAMETERS_TX_AND_RX_ENABLED:
+        *Tx = TRUE;
+        *Rx = TRUE;
+        break;
+    default:
+        break;
+    }
+}
+
+/*
+ * ZvioNetSetOffloadParameters - OID_TCP_OFFLOAD_PARAMETERS set
+ */
+NDIS_STATUS
+ZvioNetSetOffloadParameters(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_reads_bytes_(Length) PNDIS_OFFLOAD_PARAMETERS Params,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesRead
+    )
+{
+    NDIS_STATUS_INDICATION indication;
+    NDIS_OFFLOAD hardware;
+    NDIS_OFFLOAD current;
+    ULONGLONG offloads;
+    BOOLEAN tx = Adapter->TxChecksumOffload;
+    BOOLEAN rx = Adapter->RxChecksumOffload;
+
+    *BytesRead = 0;
+
+    if (Length < NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_1) {
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    //
+    // The device offloads TCP and UDP alike, so the transport
+    // settings are applied together
+    //
+    ZvioNetApplyChecksumParameter(Params->TCPIPv4Checksum, &tx, &rx);
+    ZvioNetApplyChecksumParameter(Params->UDPIPv4Checksum, &tx, &rx);
+    ZvioNetApplyChecksumParameter(Params->TCPIPv6Checksum, &tx, &rx);
+    ZvioNetApplyChecksumParameter(Params->UDPIPv6Checksum, &tx, &rx);
+
+    ZvioNetFillOffload(Adapter, &hardware, TRUE);
+
+    Adapter->TxChecksumOffload = tx && hardware.Checksum.IPv4Transmit.TcpChecksum;
+    Adapter->RxChecksumOffload = rx && hardware.Checksum.IPv4Receive.TcpChecksum;
+
+    if (Params->LsoV2IPv4 == NDIS_OFFLOAD_PARAMETERS_LSOV2_DISABLED) {
+        Adapter->LsoV2Ipv4 = FALSE;
+    } else if (Params->LsoV2IPv4 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED) {
+        Adapter->LsoV2Ipv4 = hardware.LsoV2.IPv4.MaxOffLoadSize != 0;
+    }
+
+    if (Params->LsoV2IPv6 == NDIS_OFFLOAD_PARAMETERS_LSOV2_DISABLED) {
+        Adapter->LsoV2Ipv6 = FALSE;
+    } else if (Params->LsoV2IPv6 == NDIS_OFFLOAD_PARAMETERS_LSOV2_ENABLED) {
+        Adapter->LsoV2Ipv6 = hardware.LsoV2.IPv6.MaxOffLoadSize != 0;
+    }
+
+    if (Length >= NDIS_SIZEOF_OFFLOAD_PARAMETERS_REVISION_3) {
+        if (Params->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED) {
+            Adapter->RscIpv4 = FALSE;
+        } else if (Params->RscIPv4 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED) {
+            Adapter->RscIpv4 = hardware.Rsc.IPv4.Enabled;
+        }
+
+        if (Params->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_DISABLED) {
+            Adapter->RscIpv6 = FALSE;
+        } else if (Params->RscIPv6 == NDIS_OFFLOAD_PARAMETERS_RSC_ENABLED) {
+            Adapter->RscIpv6 = hardware.Rsc.IPv6.Enabled;
+        }
+    }
+
+    //
+    // Segmentation also needs the transport checksum, and coalesced
+    // segments are only indicated with a verified one
+    //
+    if (!Adapter->TxChecksumOffload) {
+        Adapter->LsoV2Ipv4 = FALSE;
+        Adapter->LsoV2Ipv6 = FALSE;
+    }
+    if (!Adapter->RxChecksumOffload) {
+        Adapter->RscIpv4 = FALSE;
+        Adapter->RscIpv6 = FALSE;
+    }
+
+    //
+    // Stop the host coalescing what the stack no longer wants
+    //
+    offloads = Adapter->DriverFeatures &
+        (VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6);
+    if (!Adapter->RscIpv4) {
+        offloads &= ~VIRTIO_NET_F_GUEST_TSO4;
+    }
+    if (!Adapter->RscIpv6) {
+        offloads &= ~VIRTIO_NET_F_GUEST_TSO6;
+    }
+    if (!Adapter->RxChecksumOffload) {
+        offloads &= ~VIRTIO_NET_F_GUEST_CSUM;
+    }
+    ZvioNetCtrlSetGuestOffloads(Adapter, offloads);
+
+    *BytesRead = Length;
+
+    ZvioNetFillOffload(Adapter, &current, FALSE);
+
+    NdisZeroMemory(&indication, sizeof(indication));
+    indication.Header.Type = NDIS_OBJECT_TYPE_STATUS_INDICATION;
+    indication.Header.Revision = NDIS_STATUS_INDICATION_REVISION_1;
+    indication.Header.Size = NDIS_SIZEOF_STATUS_INDICATION_REVISION_1;
+    indication.SourceHandle = Adapter->AdapterHandle;
+    indication.StatusCode = NDIS_STATUS_TASK_OFFLOAD_CURRENT_CONFIG;
+    indication.StatusBuffer = &current;
+    indication.StatusBufferSize = sizeof(current);
+    NdisMIndicateStatusEx(Adapter->AdapterHandle, &indication);
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetTxBuildHeader - Build the virtio_net_hdr for one NET_BUFFER
+ */
+NDIS_STATUS
+ZvioNetTxBuildHeader(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PNET_BUFFER Nb,
+    _Out_ PVIRTIO_NET_HDR Hdr
+    )
+{
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO lso;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO csum;
+    UCHAR storage[ZVIONET_MAX_HEADERS_SIZE];
+    ULONG headerLength = min(NET_BUFFER_DATA_LENGTH(Nb), sizeof(storage));
+    PUCHAR frame;
+    ULONG l4Offset;
+    UCHAR protocol;
+
+    NdisZeroMemory(Hdr, sizeof(*Hdr));
+
+    lso.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+    csum.Value = NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo);
+
+    if (lso.Value && lso.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE &&
+        lso.LsoV2Transmit.MSS != 0) {
+        BOOLEAN ipv4 = lso.LsoV2Transmit.IPVersion == NDIS_TCP_LARGE_SEND_OFFLOAD_IPv4;
+
+        if (!(ipv4 ? Adapter->LsoV2Ipv4 : Adapter->LsoV2Ipv6)) {
+            return NDIS_STATUS_INVALID_PACKET;
+        }
+
+        l4Offset = lso.LsoV2Transmit.TcpHeaderOffset;
+        if (l4Offset + 20 > headerLength) {
+            return NDIS_STATUS_INVALID_PACKET;
+        }
+
+        frame = (PUCHAR)NdisGetDataBuffer(Nb, l4Offset + 20, storage, 1, 0);
+        if (!frame) {
+            return NDIS_STATUS_INVALID_PACKET;
+        }
+
+        Hdr->Flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        Hdr->GsoType = ipv4 ? VIRTIO_NET_HDR_GSO_TCPV4 : VIRTIO_NET_HDR_GSO_TCPV6;
+        Hdr->HdrLen = (USHORT)(l4Offset + (frame[l4Offset + 12] >> 4) * 4);
+        Hdr->GsoSize = (USHORT)lso.LsoV2Transmit.MSS;
+        Hdr->CsumStart = (USHORT)l4Offset;
+        Hdr->CsumOffset = ZVIONET_TCP_CSUM_OFFSET;
+        return NDIS_STATUS_SUCCESS;
+    }
+
+    if (!csum.Value || !Adapter->TxChecksumOffload) {
+        return NDIS_STATUS_SUCCESS;
+    }
+
+    if (csum.Transmit.TcpChecksum) {
+        Hdr->Flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        Hdr->CsumStart = (USHORT)csum.Transmit.TcpHeaderOffset;
+        Hdr->CsumOffset = ZVIONET_TCP_CSUM_OFFSET;
+    } else if (csum.Transmit.UdpChecksum) {
+        //
+        // NDIS gives no UDP header offset, so walk the headers
+        //
+        frame = (PUCHAR)NdisGetDataBuffer(Nb, headerLength, storage, 1, 0);
+        if (!frame || !ZvioNetParseL4(frame, headerLength, &l4Offset, &protocol) ||
+            protocol != ZVIONET_IP_PROTO_UDP) {
+            return NDIS_STATUS_INVALID_PACKET;
+        }
+
+        Hdr->Flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        Hdr->CsumStart = (USHORT)l4Offset;
+        Hdr->CsumOffset = ZVIONET_UDP_CSUM_OFFSET;
+    }
+
+    return NDIS_STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetTxCompleteOffload - Report LSO completion to the stack
+ */
+VOID
+ZvioNetTxCompleteOffload(
+    _In_ PNET_BUFFER_LIST Nbl
+    )
+{
+    NDIS_TCP_LARGE_SEND_OFFLOAD_NET_BUFFER_LIST_INFO lso;
+
+    lso.Value = NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo);
+    if (lso.Value && lso.Transmit.Type == NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE) {
+        lso.Value = NULL;
+        lso.LsoV2TransmitComplete.Type = NDIS_TCP_LARGE_SEND_OFFLOAD_V2_TYPE;
+        NET_BUFFER_LIST_INFO(Nbl, TcpLargeSendNetBufferListInfo) = lso.Value;
+    }
+}
+
+/*
+ * ZvioNetRxSetChecksum - Pass the device's checksum verdict to NDIS
+ *
+ * NEEDS_CSUM frames come from a local sender that left the checksum
+ * to us; their data is intact, so they are reported like DATA_VALID.
+ */
+VOID
+ZvioNetRxSetChecksum(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_reads_bytes_(Length) PUCHAR Frame,
+    _In_ ULONG Length
+    )
+{
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO csum;
+    ULONG l4Offset;
+    UCHAR protocol;
+
+    csum.Value = NULL;
+
+    if (Adapter->RxChecksumOffload &&
+        (Hdr->Flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) &&
+        ZvioNetParseL4(Frame, Length, &l4Offset, &protocol)) {
+        if (protocol == ZVIONET_IP_PROTO_TCP) {
+            csum.Receive.TcpChecksumSucceeded = 1;
+        } else if (protocol == ZVIONET_IP_PROTO_UDP) {
+            csum.Receive.UdpChecksumSucceeded = 1;
+        }
+    }
+
+    NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo) = csum.Value;
+}
@@ -0,0 +1,149 @@
+/*
+ * Zixiao VirtIO Network Driver - Performance Counters and Tracing
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Every queue pair is an instance of the "Zixiao VirtIO Network Queue"
+ * counterset (zvionet.man, installed with lodctr /m). PCW reads the
+ * counters straight from the pair's ZVIONET_PAIR_STATS, so publishing
+ * costs the datapath nothing.
+ */
+
+#include "public.h"
+#include <ntstrsafe.h>
+
+// {02C45B01-7348-4353-A39A-FECD09F9B3C1}
+TRACELOGGING_DEFINE_PROVIDER(
+    ZvioNetTraceProvider,
+    "Zixiao.VirtIO.Net",
+    (0x02c45b01, 0x7348, 0x4353, 0xa3, 0x9a, 0xfe, 0xcd, 0x09, 0xf9, 0xb3, 0xc1));
+
+// Counterset GUID; must match zvionet.man
+static const UNICODE_STRING ZvioNetCountersetName =
+    RTL_CONSTANT_STRING(L"{48C44745-B18E-49C2-AFDC-6C77C8A1A54A}");
+
+#define ZVIONET_COUNTER(_id, _field) \
+    { (_id), 0, FIELD_OFFSET(ZVIONET_PAIR_STATS, _field), RTL_FIELD_SIZE(ZVIONET_PAIR_STATS, _field) }
+
+// Counter ids as in zvionet.man
+static PCW_COUNTER_DESCRIPTOR ZvioNetCounters[] = {
+    ZVIONET_COUNTER(1,  RxPackets),
+    ZVIONET_COUNTER(2,  RxBytes),
+    ZVIONET_COUNTER(3,  RxErrors),
+    ZVIONET_COUNTER(4,  RxKicks),
+    ZVIONET_COUNTER(5,  TxPackets),
+    ZVIONET_COUNTER(6,  TxBytes),
+    ZVIONET_COUNTER(7,  TxErrors),
+    ZVIONET_COUNTER(8,  TxKicks),
+    ZVIONET_COUNTER(9,  TxRingFull),
+    ZVIONET_COUNTER(10, TxAllocFailures),
+    ZVIONET_COUNTER(11, Interrupts),
+    ZVIONET_COUNTER(12, DpcRuns),
+    ZVIONET_COUNTER(13, DpcBudgetExhausted),
+    ZVIONET_COUNTER(14, RxInFlight),
+    ZVIONET_COUNTER(15, TxInFlight),
+};
+
+static PPCW_REGISTRATION ZvioNetPcwRegistration;
+
+/*
+ * ZvioNetPerfRegister - Register the trace provider and counterset
+ */
+VOID
+ZvioNetPerfRegister(
+    VOID
+    )
+{
+    PCW_REGISTRATION_INFORMATION info;
+    NTSTATUS status;
+
+    TraceLoggingRegister(ZvioNetTraceProvider);
+
+    NdisZeroMemory(&info, sizeof(info));
+    info.Version = PCW_CURRENT_VERSION;
+    info.Name = &ZvioNetCountersetName;
+    info.CounterCount = ARRAYSIZE(ZvioNetCounters);
+    info.Counters = ZvioNetCounters;
+
+    //
+    // Counters are diagnostics; the driver runs without them
+    //
+    status = PcwRegister(&ZvioNetPcwRegistration, &info);
+    if (!NT_SUCCESS(status)) {
+        ZvioNetDbgError("PcwRegister failed: 0x%08X", status);
+        ZvioNetPcwRegistration = NULL;
+    }
+}
+
+/*
+ * ZvioNetPerfUnregister - Undo ZvioNetPerfRegister
+ */
+VOID
+ZvioNetPerfUnregister(
+    VOID
+    )
+{
+    if (ZvioNetPcwRegistration) {
+        PcwUnregister(ZvioNetPcwRegistration);
+        ZvioNetPcwRegistration = NULL;
+    }
+
+    TraceLoggingUnregister(ZvioNetTraceProvider);
+}
+
+/*
+ * ZvioNetPerfAddPairs - Publish an instance per active queue pair
+ *
+ * Instances are named "<ifIndex>:<pair>" to stay unique across adapters.
+ */
+VOID
+ZvioNetPerfAddPairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    WCHAR nameBuffer[32];
+    UNICODE_STRING name;
+    PCW_DATA data;
+    ULONG i;
+
+    if (!ZvioNetPcwRegistration) {
+        return;
+    }
+
+    for (i = 0; i < Adapter->NumPairs; i++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[i];
+
+        if (!NT_SUCCESS(RtlStringCchPrintfW(nameBuffer, ARRAYSIZE(nameBuffer),
+                                            L"%u:%u", Adapter->IfIndex, i))) {
+            continue;
+        }
+        RtlInitUnicodeString(&name, nameBuffer);
+
+        data.Data = &pair->Stats;
+        data.Size = sizeof(pair->Stats);
+
+        if (!NT_SUCCESS(PcwCreateInstance(&pair->PcwInstance, ZvioNetPcwRegistration,
+                                          &name, 1, &data))) {
+            pair->PcwInstance = NULL;
+        }
+    }
+}
+
+/*
+ * ZvioNetPerfRemovePairs - Withdraw the adapter's instances
+ */
+VOID
+ZvioNetPerfRemovePairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < ZVIONET_MAX_QUEUE_PAIRS; i++) {
+        if (Adapter->Pairs[i].PcwInstance) {
+            PcwCloseInstance(Adapter->Pairs[i].PcwInstance);
+            Adapter->Pairs[i].PcwInstance = NULL;
+        }
+    }
+}
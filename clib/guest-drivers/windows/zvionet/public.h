@@ -11,6 +11,8 @@
 
 #include <ndis.h>
 #include <wdf.h>
+#include <evntrace.h>
+#include <TraceLoggingProvider.h>
 
 //
 // Debug macros
@@ -27,6 +29,13 @@
 #define ZvioNetDbgError(_fmt, ...)
 #endif
 
+//
+// TraceLogging; datapath events are verbose and keyword-gated
+//
+TRACELOGGING_DECLARE_PROVIDER(ZvioNetTraceProvider);
+
+#define ZVIONET_TRACE_DATAPATH      0x1
+
 //
 // Driver version
 //
@@ -43,7 +52,25 @@
 #define ZVIONET_MAX_RX_QUEUES       8
 #define ZVIONET_MAX_QUEUE_SIZE      256
 #define ZVIONET_RX_BUFFER_SIZE      2048
+#define ZVIONET_RX_MERGE_BUFFER_SIZE PAGE_SIZE
 #define ZVIONET_MAX_MULTICAST       64
+#define ZVIONET_MAX_QUEUE_PAIRS     ZVIONET_MAX_RX_QUEUES
+#define ZVIONET_MAX_PROCESSORS      64
+#define ZVIONET_RSS_MAX_KEY_SIZE    40
+#define ZVIONET_RSS_MAX_TABLE_SIZE  128
+#define ZVIONET_MAX_LSO_SIZE        0xF000
+#define ZVIONET_MAX_HEADERS_SIZE    128
+#define ZVIONET_TX_TABLE_ENTRIES    64      // Header plus up to 63 fragments
+
+//
+// Frame parsing
+//
+#define ZVIONET_ETH_HEADER_SIZE     14
+#define ZVIONET_ETH_TYPE_IPV4       0x0800
+#define ZVIONET_ETH_TYPE_IPV6       0x86DD
+#define ZVIONET_ETH_TYPE_VLAN       0x8100
+#define ZVIONET_IP_PROTO_TCP        6
+#define ZVIONET_IP_PROTO_UDP        17
 
 //
 // VirtIO Network Feature Bits
@@ -71,6 +98,8 @@
 #define VIRTIO_NET_F_GUEST_ANNOUNCE (1ULL << 21)  // Guest can send announcements
 #define VIRTIO_NET_F_MQ             (1ULL << 22)  // Multi-queue
 #define VIRTIO_NET_F_CTRL_MAC_ADDR  (1ULL << 23)  // Set MAC via control
+#define VIRTIO_NET_F_VQ_NOTF_COAL   (1ULL << 52)  // Per-queue coalescing
+#define VIRTIO_NET_F_NOTF_COAL      (1ULL << 53)  // Notification coalescing
 #define VIRTIO_NET_F_HOST_USO       (1ULL << 56)
 #define VIRTIO_NET_F_HASH_REPORT    (1ULL << 57)
 #define VIRTIO_NET_F_GUEST_HDRLEN   (1ULL << 59)
@@ -83,10 +112,14 @@
 #define VIRTIO_F_VERSION_1          (1ULL << 32)
 #define VIRTIO_F_RING_INDIRECT_DESC (1ULL << 28)
 #define VIRTIO_F_RING_EVENT_IDX     (1ULL << 29)
+#define VIRTIO_F_IN_ORDER           (1ULL << 35)
 
 //
 // VirtIO Network Header (prepended to packets)
 //
+// With VIRTIO_F_VERSION_1 this is virtio_net_hdr_v1: NumBuffers is
+// always present, on transmit as well as receive.
+//
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM 1   // Checksum required
 #define VIRTIO_NET_HDR_F_DATA_VALID 2   // Checksum verified
 #define VIRTIO_NET_HDR_F_RSC_INFO   4   // RSC info valid
@@ -154,11 +187,43 @@ typedef struct _VIRTIO_NET_CONFIG {
 #define VIRTIO_NET_CTRL_MQ_RSS_CONFIG       1
 #define VIRTIO_NET_CTRL_MQ_HASH_CONFIG      2
 
+#define VIRTIO_NET_CTRL_GUEST_OFFLOADS  5
+#define VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET  0
+
+#define VIRTIO_NET_CTRL_NOTF_COAL   6
+#define VIRTIO_NET_CTRL_NOTF_COAL_TX_SET    0
+#define VIRTIO_NET_CTRL_NOTF_COAL_RX_SET    1
+#define VIRTIO_NET_CTRL_NOTF_COAL_VQ_SET    2
+
+//
+// VIRTIO_NET_CTRL_MQ_RSS_CONFIG hash types
+//
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv4       (1 << 0)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv4      (1 << 1)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv4      (1 << 2)
+#define VIRTIO_NET_RSS_HASH_TYPE_IPv6       (1 << 3)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCPv6      (1 << 4)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDPv6      (1 << 5)
+#define VIRTIO_NET_RSS_HASH_TYPE_IP_EX      (1 << 6)
+#define VIRTIO_NET_RSS_HASH_TYPE_TCP_EX     (1 << 7)
+#define VIRTIO_NET_RSS_HASH_TYPE_UDP_EX     (1 << 8)
+
 #pragma pack(push, 1)
 typedef struct _VIRTIO_NET_CTRL_HDR {
     UCHAR       Class;
     UCHAR       Cmd;
 } VIRTIO_NET_CTRL_HDR, *PVIRTIO_NET_CTRL_HDR;
+
+typedef struct _VIRTIO_NET_CTRL_COAL {
+    ULONG       MaxPackets;
+    ULONG       MaxUsecs;
+} VIRTIO_NET_CTRL_COAL, *PVIRTIO_NET_CTRL_COAL;
+
+typedef struct _VIRTIO_NET_CTRL_COAL_VQ {
+    USHORT      Vqn;
+    USHORT      Reserved;
+    VIRTIO_NET_CTRL_COAL Coal;
+} VIRTIO_NET_CTRL_COAL_VQ, *PVIRTIO_NET_CTRL_COAL_VQ;
 #pragma pack(pop)
 
 #define VIRTIO_NET_OK               0
@@ -167,38 +232,7 @@ typedef struct _VIRTIO_NET_CTRL_HDR {
 //
 // Virtqueue Ring Structures
 //
-#define VRING_DESC_F_NEXT       1
-#define VRING_DESC_F_WRITE      2
-#define VRING_DESC_F_INDIRECT   4
-
-#pragma pack(push, 1)
-typedef struct _VRING_DESC {
-    ULONGLONG   Addr;
-    ULONG       Len;
-    USHORT      Flags;
-    USHORT      Next;
-} VRING_DESC, *PVRING_DESC;
-
-typedef struct _VRING_AVAIL {
-    USHORT      Flags;
-    USHORT      Idx;
-    USHORT      Ring[1];
-} VRING_AVAIL, *PVRING_AVAIL;
-
-typedef struct _VRING_USED_ELEM {
-    ULONG       Id;
-    ULONG       Len;
-} VRING_USED_ELEM, *PVRING_USED_ELEM;
-
-typedef struct _VRING_USED {
-    USHORT          Flags;
-    USHORT          Idx;
-    VRING_USED_ELEM Ring[1];
-} VRING_USED, *PVRING_USED;
-#pragma pack(pop)
-
-#define VRING_AVAIL_F_NO_INTERRUPT  1
-#define VRING_USED_F_NO_NOTIFY      1
+#include "../common/zvio_vring.h"
 
 //
 // VirtIO PCI Common Configuration
@@ -232,11 +266,14 @@ typedef struct _VIRTIO_PCI_COMMON_CFG {
 #define VIRTIO_STATUS_FEATURES_OK   8
 #define VIRTIO_STATUS_FAILED        128
 
+#define VIRTIO_MSI_NO_VECTOR        0xFFFF
+
 //
 // Forward declarations
 //
 typedef struct _ZVIONET_ADAPTER ZVIONET_ADAPTER, *PZVIONET_ADAPTER;
 typedef struct _ZVIONET_VIRTQUEUE ZVIONET_VIRTQUEUE, *PZVIONET_VIRTQUEUE;
+typedef struct _ZVIONET_QUEUE_PAIR ZVIONET_QUEUE_PAIR, *PZVIONET_QUEUE_PAIR;
 
 //
 // Receive Buffer
@@ -246,23 +283,79 @@ typedef struct _ZVIONET_RX_BUFFER {
     PZVIONET_ADAPTER    Adapter;
     PNET_BUFFER_LIST    Nbl;
     PMDL                Mdl;
+    PMDL                PayloadMdl;
     PVOID               Buffer;
     PHYSICAL_ADDRESS    BufferPA;
     ULONG               BufferSize;
     NDIS_HANDLE         PoolHandle;
+    PZVIONET_QUEUE_PAIR Pair;
+    struct _ZVIONET_RX_BUFFER *MergeNext;
 } ZVIONET_RX_BUFFER, *PZVIONET_RX_BUFFER;
 
 //
 // Transmit Context
 //
+// One per TX ring entry, each with its own header slot, SG list
+// buffer and indirect descriptor table, so mapping a NET_BUFFER
+// allocates nothing. Free and mapped contexts sit on lock-free lists.
+//
 typedef struct _ZVIONET_TX_CONTEXT {
+    SLIST_ENTRY         Link;
+    PZVIONET_QUEUE_PAIR Pair;
+    ULONG               Index;
+    USHORT              DescCount;
     PNET_BUFFER_LIST    Nbl;
     PNET_BUFFER         Nb;
-    PZVIONET_ADAPTER    Adapter;
-    ULONG               DescCount;
-    USHORT              HeadIdx;
+    PSCATTER_GATHER_LIST SgList;
+    PVOID               SgBuffer;
+    PVRING_DESC         Table;
+    PHYSICAL_ADDRESS    TablePA;
 } ZVIONET_TX_CONTEXT, *PZVIONET_TX_CONTEXT;
 
+//
+// Receive Segment Coalescing
+//
+// The TCP/IPv4 segment being grown within one receive batch. Later
+// segments of the flow add only their payload, as a partial MDL.
+//
+typedef struct _ZVIONET_RSC_STATE {
+    PZVIONET_RX_BUFFER  Head;
+    PZVIONET_RX_BUFFER  Tail;
+    PNET_BUFFER_LIST    Nbl;
+    PMDL                LastMdl;
+    PUCHAR              Frame;
+    ULONG               TcpHeaderLength;
+    ULONG               NextSeq;
+    ULONG               IpLength;
+    USHORT              Segments;
+} ZVIONET_RSC_STATE, *PZVIONET_RSC_STATE;
+
+//
+// Queue Pair Counters
+//
+// Published per pair as performance counter instances, so the layout
+// and the descriptors in perf.c move together. Packet counts are only
+// written on serialized paths; the rest can race and use interlocked
+// updates.
+//
+typedef struct _ZVIONET_PAIR_STATS {
+    ULONG64             RxPackets;
+    ULONG64             RxBytes;
+    ULONG64             RxErrors;
+    ULONG64             RxKicks;
+    ULONG64             TxPackets;
+    ULONG64             TxBytes;
+    ULONG64             TxErrors;
+    ULONG64             TxKicks;
+    ULONG64             TxRingFull;
+    ULONG64             TxAllocFailures;
+    ULONG64             Interrupts;
+    ULONG64             DpcRuns;
+    ULONG64             DpcBudgetExhausted;
+    ULONG               RxInFlight;
+    ULONG               TxInFlight;
+} ZVIONET_PAIR_STATS, *PZVIONET_PAIR_STATS;
+
 //
 // Virtqueue Context
 //
@@ -272,6 +365,14 @@ struct _ZVIONET_VIRTQUEUE {
     USHORT                  NumFree;
     USHORT                  FreeHead;
     USHORT                  LastUsedIdx;
+    USHORT                  KickedAvailIdx;
+    BOOLEAN                 EventIdx;
+    BOOLEAN                 InterruptsOff;
+    BOOLEAN                 InOrder;
+    BOOLEAN                 InBatch;
+    USHORT                  BatchLast;
+    ULONG                   BatchLen;
+    BOOLEAN                 Indirect;
 
     PVRING_DESC             Desc;
     PHYSICAL_ADDRESS        DescPhys;
@@ -295,12 +396,54 @@ struct _ZVIONET_VIRTQUEUE {
     PZVIONET_ADAPTER        Adapter;
 };
 
+//
+// Queue Pair Context
+//
+// Pair N is RX virtqueue 2N and TX virtqueue 2N+1. With MSI-X both
+// share message N, whose DPC runs on Processor.
+//
+struct _ZVIONET_QUEUE_PAIR {
+    PZVIONET_ADAPTER        Adapter;
+    ULONG                   Index;
+
+    PZVIONET_VIRTQUEUE      RxQueue;
+    PZVIONET_VIRTQUEUE      TxQueue;
+
+    PROCESSOR_NUMBER        Processor;
+
+    PVIRTIO_NET_HDR         TxHeaders;
+    PHYSICAL_ADDRESS        TxHeadersPA;
+    ULONG                   TxHeadersSize;
+    PVRING_DESC             TxTables;
+    PHYSICAL_ADDRESS        TxTablesPA;
+    ULONG                   TxTablesSize;
+    PZVIONET_TX_CONTEXT     TxContexts;
+    ULONG                   TxContextCount;
+    PUCHAR                  TxSgBuffers;
+    SLIST_HEADER            TxFreeList;
+    SLIST_HEADER            TxReadyList;
+    volatile LONG           TxSending;
+
+    LIST_ENTRY              RxFreeList;
+    NDIS_SPIN_LOCK          RxFreeLock;
+    ULONG                   RxBufferCount;
+
+    ZVIONET_PAIR_STATS      Stats;
+    PPCW_INSTANCE           PcwInstance;
+
+    ULONG64                 CoalLastPackets;
+    ULONG                   CoalLevel;
+    ULONG                   CoalTarget;
+};
+
 //
 // Adapter Context
 //
 struct _ZVIONET_ADAPTER {
     NDIS_HANDLE             AdapterHandle;
+    NET_IFINDEX             IfIndex;
     NDIS_HANDLE             MiniportDmaHandle;
+    ULONG                   SgListSize;
 
     // Device identification
     WDFDEVICE               WdfDevice;
@@ -321,14 +464,37 @@ struct _ZVIONET_ADAPTER {
     ULONGLONG               DeviceFeatures;
     ULONGLONG               DriverFeatures;
 
-    // Virtqueues (0=RX, 1=TX, 2=Control if available)
-    PZVIONET_VIRTQUEUE      RxQueue;
-    PZVIONET_VIRTQUEUE      TxQueue;
+    // Virtqueue pairs, then Control at 2 * MaxPairs if available
+    ZVIONET_QUEUE_PAIR      Pairs[ZVIONET_MAX_QUEUE_PAIRS];
+    ULONG                   NumPairs;
+    ULONG                   MaxPairs;
     PZVIONET_VIRTQUEUE      CtrlQueue;
 
+    // Control commands
+    PUCHAR                  CtrlBuffer;
+    PHYSICAL_ADDRESS        CtrlBufferPA;
+    NDIS_SPIN_LOCK          CtrlLock;
+
     // Interrupt
     NDIS_HANDLE             InterruptHandle;
     BOOLEAN                 UseMsix;
+    PIO_INTERRUPT_MESSAGE_INFO MessageInfo;
+
+    // Interrupt moderation
+    BOOLEAN                 InterruptModeration;
+    NDIS_HANDLE             CoalTimer;
+    NDIS_HANDLE             CoalWorkItem;
+    volatile LONG           CoalPending;
+
+    // Receive side scaling
+    BOOLEAN                 RssSupported;
+    BOOLEAN                 RssEnabled;
+    ULONG                   RssHashInformation;
+    USHORT                  RssHashKeySize;
+    UCHAR                   RssHashKey[ZVIONET_RSS_MAX_KEY_SIZE];
+    ULONG                   RssTableSize;
+    PROCESSOR_NUMBER        RssTable[ZVIONET_RSS_MAX_TABLE_SIZE];
+    UCHAR                   ProcessorPair[ZVIONET_MAX_PROCESSORS];
 
     // Network configuration
     UCHAR                   CurrentMacAddress[6];
@@ -349,23 +515,16 @@ struct _ZVIONET_ADAPTER {
     BOOLEAN                 LsoV1;
     BOOLEAN                 LsoV2Ipv4;
     BOOLEAN                 LsoV2Ipv6;
-
-    // Statistics
-    ULONG64                 TxPackets;
-    ULONG64                 TxBytes;
-    ULONG64                 RxPackets;
-    ULONG64                 RxBytes;
-    ULONG64                 TxErrors;
-    ULONG64                 RxErrors;
+    BOOLEAN                 RscIpv4;
+    BOOLEAN                 RscIpv6;
 
     // Memory pools
     NDIS_HANDLE             NblPool;
     NDIS_HANDLE             NbPool;
 
-    // RX buffer list
-    LIST_ENTRY              RxFreeList;
-    NDIS_SPIN_LOCK          RxFreeLock;
-    ULONG                   RxBufferCount;
+    // Receive buffers
+    BOOLEAN                 MergeRxBuffers;
+    ULONG                   RxBufferSize;
 
     // State
     BOOLEAN                 Running;
@@ -396,6 +555,7 @@ NTSTATUS
 ZvioNetQueueCreate(
     _In_ PZVIONET_ADAPTER Adapter,
     _In_ USHORT Index,
+    _In_ USHORT MsixVector,
     _Out_ PZVIONET_VIRTQUEUE *Queue
     );
 
@@ -423,18 +583,66 @@ ZvioNetQueueAddBufferChain(
     _Out_ PUSHORT HeadIdx
     );
 
+NTSTATUS
+ZvioNetQueuePostDescriptors(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Inout_updates_(Count) PVRING_DESC Descs,
+    _In_ PHYSICAL_ADDRESS DescsPA,
+    _In_ USHORT Count,
+    _In_opt_ PVOID UserData
+    );
+
+NTSTATUS
+ZvioNetQueueAddDescriptors(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Inout_updates_(Count) PVRING_DESC Descs,
+    _In_ PHYSICAL_ADDRESS DescsPA,
+    _In_ USHORT Count,
+    _In_opt_ PVOID UserData
+    );
+
 PVOID
 ZvioNetQueueGetBuffer(
     _In_ PZVIONET_VIRTQUEUE Queue,
     _Out_ PULONG Length
     );
 
-VOID
+ULONG
+ZvioNetQueueGetBuffers(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Out_writes_to_(MaxCount, return) PVOID *Buffers,
+    _In_ ULONG MaxCount
+    );
+
+BOOLEAN
+ZvioNetQueueHasUsed(
+    _In_ PZVIONET_VIRTQUEUE Queue
+    );
+
+BOOLEAN
 ZvioNetQueueKick(
     _In_ PZVIONET_VIRTQUEUE Queue
     );
 
+BOOLEAN
+ZvioNetQueueEnableInterrupts(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    );
+
 // tx.c
+NTSTATUS
+ZvioNetInitTx(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+VOID
+ZvioNetFreeTx(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+MINIPORT_PROCESS_SG_LIST ZvioNetProcessSGList;
+
 VOID
 ZvioNetSendNetBufferLists(
     _In_ PZVIONET_ADAPTER Adapter,
@@ -443,7 +651,7 @@ ZvioNetSendNetBufferLists(
 
 VOID
 ZvioNetCompleteTx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair
     );
 
 // rx.c
@@ -457,14 +665,66 @@ ZvioNetFreeRxBuffers(
     _In_ PZVIONET_ADAPTER Adapter
     );
 
-VOID
+ULONG
 ZvioNetProcessRx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair,
+    _In_ ULONG MaxNbls
     );
 
 VOID
 ZvioNetReplenishRx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair
+    );
+
+VOID
+ZvioNetRecycleRxBuffer(
+    _In_ PZVIONET_RX_BUFFER RxBuffer
+    );
+
+// offload.c
+BOOLEAN
+ZvioNetParseL4(
+    _In_reads_bytes_(Length) PUCHAR Frame,
+    _In_ ULONG Length,
+    _Out_ PULONG L4Offset,
+    _Out_ PUCHAR Protocol
+    );
+
+VOID
+ZvioNetFillOffload(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Out_ PNDIS_OFFLOAD Offload,
+    _In_ BOOLEAN Hardware
+    );
+
+NDIS_STATUS
+ZvioNetSetOffloadParameters(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_reads_bytes_(Length) PNDIS_OFFLOAD_PARAMETERS Params,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesRead
+    );
+
+NDIS_STATUS
+ZvioNetTxBuildHeader(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PNET_BUFFER Nb,
+    _Out_ PVIRTIO_NET_HDR Hdr
+    );
+
+VOID
+ZvioNetTxCompleteOffload(
+    _In_ PNET_BUFFER_LIST Nbl
+    );
+
+VOID
+ZvioNetRxSetChecksum(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_reads_bytes_(Length) PUCHAR Frame,
+    _In_ ULONG Length
     );
 
 // interrupt.c
@@ -472,6 +732,139 @@ MINIPORT_ISR ZvioNetInterruptHandler;
 MINIPORT_INTERRUPT_DPC ZvioNetInterruptDpc;
 MINIPORT_ENABLE_INTERRUPT ZvioNetEnableInterrupt;
 MINIPORT_DISABLE_INTERRUPT ZvioNetDisableInterrupt;
+MINIPORT_MESSAGE_INTERRUPT ZvioNetMessageInterruptHandler;
+MINIPORT_MESSAGE_INTERRUPT_DPC ZvioNetMessageInterruptDpc;
+MINIPORT_ENABLE_MESSAGE_INTERRUPT ZvioNetEnableMessageInterrupt;
+MINIPORT_DISABLE_MESSAGE_INTERRUPT ZvioNetDisableMessageInterrupt;
+
+// ctrl.c
+NDIS_STATUS
+ZvioNetCtrlInit(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+VOID
+ZvioNetCtrlFree(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+NDIS_STATUS
+ZvioNetCtrlCommand(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ UCHAR Class,
+    _In_ UCHAR Cmd,
+    _In_reads_bytes_opt_(Length) PVOID Data,
+    _In_ ULONG Length
+    );
+
+NDIS_STATUS
+ZvioNetCtrlSetQueuePairs(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ USHORT Pairs
+    );
+
+NDIS_STATUS
+ZvioNetCtrlSetGuestOffloads(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONGLONG Offloads
+    );
+
+// coalesce.c
+NDIS_STATUS
+ZvioNetCoalInit(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+VOID
+ZvioNetCoalFree(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+BOOLEAN
+ZvioNetCoalSupported(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+// rss.c
+VOID
+ZvioNetRssInitPairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+VOID
+ZvioNetRssFillCapabilities(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Out_ PNDIS_RECEIVE_SCALE_CAPABILITIES Caps
+    );
+
+NDIS_STATUS
+ZvioNetRssSetParameters(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_reads_bytes_(Length) PNDIS_RECEIVE_SCALE_PARAMETERS Params,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesRead
+    );
+
+PZVIONET_QUEUE_PAIR
+ZvioNetRssPairForProcessor(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONG ProcessorIndex
+    );
+
+// rsc.c
+VOID
+ZvioNetRxSetRsc(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_reads_bytes_(HeaderLength) PUCHAR Frame,
+    _In_ ULONG HeaderLength,
+    _In_ ULONG FrameLength
+    );
+
+VOID
+ZvioNetRscStart(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Inout_ PZVIONET_RSC_STATE State,
+    _In_ PZVIONET_RX_BUFFER RxBuffer,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_ ULONG Length
+    );
+
+BOOLEAN
+ZvioNetRscMerge(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Inout_ PZVIONET_RSC_STATE State,
+    _In_ PZVIONET_RX_BUFFER RxBuffer,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_ ULONG Length
+    );
+
+VOID
+ZvioNetRscFlush(
+    _Inout_ PZVIONET_RSC_STATE State
+    );
+
+// perf.c
+VOID
+ZvioNetPerfRegister(
+    VOID
+    );
+
+VOID
+ZvioNetPerfUnregister(
+    VOID
+    );
+
+VOID
+ZvioNetPerfAddPairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
+
+VOID
+ZvioNetPerfRemovePairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    );
 
 // pci.c
 NTSTATUS
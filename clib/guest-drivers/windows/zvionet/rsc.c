@@ -0,0 +1,317 @@
+/*
+ * Zixiao VirtIO Network Driver - Receive Segment Coalescing
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * With GUEST_TSO the host hands over TCP segments it has already
+ * coalesced; they only need their segment count reported. Flows the
+ * host did not coalesce are merged here, within one receive batch and
+ * only for plain TCP/IPv4 segments that line up exactly.
+ */
+
+#include "public.h"
+
+#define ZVIONET_RSC_IP_HEADER_SIZE  20
+#define ZVIONET_RSC_MAX_SEGMENTS    64
+#define ZVIONET_RSC_MAX_IP_LENGTH   0xFFFF
+
+#define ZVIONET_TCP_FLAG_PSH        0x08
+#define ZVIONET_TCP_FLAG_ACK        0x10
+
+#define ZVIONET_RSC_GET16(_p)       ((USHORT)(((_p)[0] << 8) | (_p)[1]))
+#define ZVIONET_RSC_GET32(_p)       (((ULONG)(_p)[0] << 24) | ((ULONG)(_p)[1] << 16) | \
+                                     ((ULONG)(_p)[2] << 8) | (ULONG)(_p)[3])
+
+/*
+ * ZvioNetRscSetInfo - Report a coalesced segment to NDIS
+ *
+ * Coalesced segments are indicated with verified checksums; the IPv4
+ * header was rewritten by whoever coalesced them.
+ */
+static VOID
+ZvioNetRscSetInfo(
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ USHORT Segments,
+    _In_ BOOLEAN Ipv4
+    )
+{
+    NDIS_RSC_NBL_INFO rsc;
+    NDIS_TCP_IP_CHECKSUM_NET_BUFFER_LIST_INFO csum;
+
+    rsc.Value = NULL;
+    rsc.Info.CoalescedSegCount = Segments;
+    NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) = rsc.Value;
+
+    csum.Value = NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo);
+    if (Ipv4) {
+        csum.Receive.IpChecksumSucceeded = 1;
+    }
+    NET_BUFFER_LIST_INFO(Nbl, TcpIpChecksumNetBufferListInfo) = csum.Value;
+}
+
+/*
+ * ZvioNetRxSetRsc - Report a segment the host coalesced
+ *
+ * The headers lie in the first HeaderLength bytes; FrameLength covers
+ * all merged buffers.
+ */
+VOID
+ZvioNetRxSetRsc(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_reads_bytes_(HeaderLength) PUCHAR Frame,
+    _In_ ULONG HeaderLength,
+    _In_ ULONG FrameLength
+    )
+{
+    UCHAR gsoType = Hdr->GsoType & ~VIRTIO_NET_HDR_GSO_ECN;
+    BOOLEAN ipv4 = gsoType == VIRTIO_NET_HDR_GSO_TCPV4;
+    ULONG l4Offset;
+    ULONG payload;
+    ULONG segments;
+    UCHAR protocol;
+
+    NET_BUFFER_LIST_INFO(Nbl, TcpRecvSegCoalesceInfo) = NULL;
+
+    if ((!ipv4 && gsoType != VIRTIO_NET_HDR_GSO_TCPV6) || Hdr->GsoSize == 0) {
+        return;
+    }
+
+    if (!(ipv4 ? Adapter->RscIpv4 : Adapter->RscIpv6)) {
+        return;
+    }
+
+    if (!ZvioNetParseL4(Frame, HeaderLength, &l4Offset, &protocol) ||
+        protocol != ZVIONET_IP_PROTO_TCP || l4Offset + 20 > HeaderLength) {
+        return;
+    }
+
+    l4Offset += (Frame[l4Offset + 12] >> 4) * 4;
+    if (l4Offset >= FrameLength) {
+        return;
+    }
+
+    payload = FrameLength - l4Offset;
+    segments = (payload + Hdr->GsoSize - 1) / Hdr->GsoSize;
+    if (segments > 1) {
+        ZvioNetRscSetInfo(Nbl, (USHORT)min(segments, MAXUSHORT), ipv4);
+    }
+}
+
+/*
+ * ZvioNetRscParse - Check that a frame can take part in coalescing
+ *
+ * Only a plain IPv4 header, no fragments, and TCP with data carrying
+ * nothing but ACK and PSH qualify. Returns the TCP header length.
+ */
+static ULONG
+ZvioNetRscParse(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_reads_bytes_(Length) PUCHAR Frame,
+    _In_ ULONG Length
+    )
+{
+    PUCHAR ip = Frame + ZVIONET_ETH_HEADER_SIZE;
+    PUCHAR tcp = ip + ZVIONET_RSC_IP_HEADER_SIZE;
+    ULONG ipLength;
+    ULONG tcpLength;
+
+    if (!Adapter->RscIpv4 || !Adapter->RxChecksumOffload ||
+        Hdr->GsoType != VIRTIO_NET_HDR_GSO_NONE ||
+        !(Hdr->Flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM))) {
+        return 0;
+    }
+
+    if (Length < ZVIONET_ETH_HEADER_SIZE + ZVIONET_RSC_IP_HEADER_SIZE + 20 ||
+        ZVIONET_RSC_GET16(Frame + 12) != ZVIONET_ETH_TYPE_IPV4) {
+        return 0;
+    }
+
+    if (ip[0] != 0x45 || ((ip[6] & 0x3F) | ip[7]) != 0 || ip[9] != ZVIONET_IP_PROTO_TCP) {
+        return 0;
+    }
+
+    ipLength = ZVIONET_RSC_GET16(ip + 2);
+    tcpLength = (tcp[12] >> 4) * 4;
+    if (ZVIONET_ETH_HEADER_SIZE + ipLength > Length || tcpLength < 20 ||
+        ZVIONET_RSC_IP_HEADER_SIZE + tcpLength >= ipLength) {
+        return 0;
+    }
+
+    if ((tcp[13] & ~ZVIONET_TCP_FLAG_PSH) != ZVIONET_TCP_FLAG_ACK) {
+        return 0;
+    }
+
+    return tcpLength;
+}
+
+/*
+ * ZvioNetRscStart - Open a coalescing candidate
+ *
+ * Length is the frame length in the buffer after the virtio_net_hdr.
+ * The frame is already indicated; a later match grows it in place.
+ */
+VOID
+ZvioNetRscStart(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Inout_ PZVIONET_RSC_STATE State,
+    _In_ PZVIONET_RX_BUFFER RxBuffer,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_ ULONG Length
+    )
+{
+    PUCHAR frame = (PUCHAR)RxBuffer->Buffer + sizeof(VIRTIO_NET_HDR);
+    PUCHAR ip = frame + ZVIONET_ETH_HEADER_SIZE;
+    PUCHAR tcp = ip + ZVIONET_RSC_IP_HEADER_SIZE;
+    ULONG tcpLength;
+    ULONG ipLength;
+
+    NdisZeroMemory(State, sizeof(*State));
+
+    tcpLength = ZvioNetRscParse(Adapter, Hdr, frame, Length);
+    if (!tcpLength || (tcp[13] & ZVIONET_TCP_FLAG_PSH)) {
+        return;
+    }
+
+    //
+    // Drop Ethernet padding so payloads can follow the first segment
+    //
+    ipLength = ZVIONET_RSC_GET16(ip + 2);
+    NdisAdjustMdlLength(RxBuffer->Mdl, sizeof(VIRTIO_NET_HDR) + ZVIONET_ETH_HEADER_SIZE + ipLength);
+    NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(RxBuffer->Nbl)) =
+        ZVIONET_ETH_HEADER_SIZE + ipLength;
+
+    State->Head = RxBuffer;
+    State->Tail = RxBuffer;
+    State->Nbl = RxBuffer->Nbl;
+    State->LastMdl = RxBuffer->Mdl;
+    State->Frame = frame;
+    State->TcpHeaderLength = tcpLength;
+    State->IpLength = ipLength;
+    State->NextSeq = ZVIONET_RSC_GET32(tcp + 4) +
+        (ipLength - ZVIONET_RSC_IP_HEADER_SIZE - tcpLength);
+    State->Segments = 1;
+}
+
+/*
+ * ZvioNetRscMerge - Append a segment to the open candidate
+ *
+ * Returns TRUE when the segment's payload now belongs to the
+ * candidate. Otherwise the candidate is closed and the caller
+ * indicates the segment itself.
+ */
+BOOLEAN
+ZvioNetRscMerge(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Inout_ PZVIONET_RSC_STATE State,
+    _In_ PZVIONET_RX_BUFFER RxBuffer,
+    _In_ PVIRTIO_NET_HDR Hdr,
+    _In_ ULONG Length
+    )
+{
+    PUCHAR frame = (PUCHAR)RxBuffer->Buffer + sizeof(VIRTIO_NET_HDR);
+    PUCHAR ip = frame + ZVIONET_ETH_HEADER_SIZE;
+    PUCHAR tcp = ip + ZVIONET_RSC_IP_HEADER_SIZE;
+    PUCHAR headIp = State->Frame + ZVIONET_ETH_HEADER_SIZE;
+    PUCHAR headTcp = headIp + ZVIONET_RSC_IP_HEADER_SIZE;
+    ULONG tcpLength;
+    ULONG payload;
+
+    if (!State->Head) {
+        return FALSE;
+    }
+
+    tcpLength = ZvioNetRscParse(Adapter, Hdr, frame, Length);
+    payload = ZVIONET_RSC_GET16(ip + 2) - ZVIONET_RSC_IP_HEADER_SIZE - tcpLength;
+
+    //
+    // Same link and IP headers apart from length, ID and checksum;
+    // same ports, ACK, window and options; the next byte in sequence
+    //
+    if (!tcpLength || tcpLength != State->TcpHeaderLength ||
+        State->Segments >= ZVIONET_RSC_MAX_SEGMENTS ||
+        State->IpLength + payload > ZVIONET_RSC_MAX_IP_LENGTH ||
+        !NdisEqualMemory(frame, State->Frame, ZVIONET_ETH_HEADER_SIZE) ||
+        ip[1] != headIp[1] || ip[8] != headIp[8] || (ip[6] & 0x40) != (headIp[6] & 0x40) ||
+        !NdisEqualMemory(ip + 12, headIp + 12, 8) ||
+        !NdisEqualMemory(tcp, headTcp, 4) ||
+        ZVIONET_RSC_GET32(tcp + 4) != State->NextSeq ||
+        !NdisEqualMemory(tcp + 8, headTcp + 8, 4) ||
+        !NdisEqualMemory(tcp + 14, headTcp + 14, 2) ||
+        !NdisEqualMemory(tcp + 20, headTcp + 20, tcpLength - 20)) {
+        ZvioNetRscFlush(State);
+        return FALSE;
+    }
+
+    IoBuildPartialMdl(
+        RxBuffer->Mdl,
+        RxBuffer->PayloadMdl,
+        tcp + tcpLength,
+        payload
+        );
+
+    State->LastMdl->Next = RxBuffer->PayloadMdl;
+    State->LastMdl = RxBuffer->PayloadMdl;
+    State->Tail->MergeNext = RxBuffer;
+    State->Tail = RxBuffer;
+
+    NET_BUFFER_DATA_LENGTH(NET_BUFFER_LIST_FIRST_NB(State->Nbl)) += payload;
+    State->IpLength += payload;
+    State->NextSeq += payload;
+    State->Segments++;
+
+    //
+    // A push ends the burst; nothing more will line up behind it
+    //
+    if (tcp[13] & ZVIONET_TCP_FLAG_PSH) {
+        headTcp[13] |= ZVIONET_TCP_FLAG_PSH;
+        ZvioNetRscFlush(State);
+    }
+
+    return TRUE;
+}
+
+/*
+ * ZvioNetRscFlush - Close the open candidate
+ *
+ * Rewrites the first segment's IPv4 length and header checksum to
+ * cover everything appended to it.
+ */
+VOID
+ZvioNetRscFlush(
+    _Inout_ PZVIONET_RSC_STATE State
+    )
+{
+    PUCHAR ip;
+    ULONG sum = 0;
+    ULONG i;
+
+    if (!State->Head) {
+        return;
+    }
+
+    if (State->Segments > 1) {
+        ip = State->Frame + ZVIONET_ETH_HEADER_SIZE;
+        ip[2] = (UCHAR)(State->IpLength >> 8);
+        ip[3] = (UCHAR)State->IpLength;
+        ip[10] = 0;
+        ip[11] = 0;
+
+        for (i = 0; i < ZVIONET_RSC_IP_HEADER_SIZE; i += 2) {
+            sum += ZVIONET_RSC_GET16(ip + i);
+        }
+        while (sum >> 16) {
+            sum = (sum & 0xFFFF) + (sum >> 16);
+        }
+        sum = ~sum & 0xFFFF;
+        ip[10] = (UCHAR)(sum >> 8);
+        ip[11] = (UCHAR)sum;
+
+        ZvioNetRscSetInfo(State->Nbl, State->Segments, TRUE);
+    }
+
+    NdisZeroMemory(State, sizeof(*State));
+}
@@ -0,0 +1,321 @@
+/*
+ * Zixiao VirtIO Network Driver - Receive Side Scaling
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * NDIS picks the processors a flow may land on; the device does the
+ * Toeplitz hashing. Each distinct processor in the indirection table
+ * is given a queue pair, whose DPC then runs there, and the table is
+ * handed to the device in pair numbers.
+ */
+
+#include "public.h"
+
+#pragma pack(push, 1)
+typedef struct _VIRTIO_NET_RSS_CONFIG {
+    ULONG       HashTypes;
+    USHORT      IndirectionTableMask;
+    USHORT      UnclassifiedQueue;
+    USHORT      IndirectionTable[ZVIONET_RSS_MAX_TABLE_SIZE];
+    // Followed by USHORT MaxTxVq, UCHAR HashKeyLength, then the key
+} VIRTIO_NET_RSS_CONFIG, *PVIRTIO_NET_RSS_CONFIG;
+#pragma pack(pop)
+
+#define ZVIONET_RSS_CONFIG_MAX_SIZE \
+    (sizeof(VIRTIO_NET_RSS_CONFIG) + sizeof(USHORT) + sizeof(UCHAR) + ZVIONET_RSS_MAX_KEY_SIZE)
+
+/*
+ * ZvioNetRssTableSize - Largest table the device takes, up to Entries
+ */
+static ULONG
+ZvioNetRssTableSize(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONG Entries
+    )
+{
+    ULONG deviceMax = READ_REGISTER_USHORT(&Adapter->DeviceCfg->RssMaxIndirectionTableLength);
+    ULONG size = Entries;
+
+    while (size > 1 && size > deviceMax) {
+        size >>= 1;
+    }
+
+    return size;
+}
+
+/*
+ * ZvioNetRssInitPairs - Spread the pairs over processors without RSS
+ *
+ * A pair's DPC runs where its MSI-X message is delivered, and the
+ * other processors send on pairs round-robin.
+ */
+VOID
+ZvioNetRssInitPairs(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    ULONG activeProcessors = NdisGroupActiveProcessorCount(ALL_PROCESSOR_GROUPS);
+    ULONG i;
+
+    for (i = 0; i < ZVIONET_MAX_PROCESSORS; i++) {
+        Adapter->ProcessorPair[i] = (UCHAR)(i % Adapter->NumPairs);
+    }
+
+    for (i = 0; i < Adapter->NumPairs; i++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[i];
+        ULONG processorIndex;
+
+        if (Adapter->UseMsix && i < Adapter->MessageInfo->MessageCount) {
+            KAFFINITY affinity = Adapter->MessageInfo->MessageInfo[i].TargetProcessorSet;
+            UCHAR number = 0;
+
+            while (affinity && !(affinity & 1)) {
+                affinity >>= 1;
+                number++;
+            }
+            pair->Processor.Group = 0;
+            pair->Processor.Number = number;
+            pair->Processor.Reserved = 0;
+        } else {
+            KeGetProcessorNumberFromIndex(i % activeProcessors, &pair->Processor);
+        }
+
+        processorIndex = KeGetProcessorIndexFromNumber(&pair->Processor);
+        if (processorIndex < ZVIONET_MAX_PROCESSORS) {
+            Adapter->ProcessorPair[processorIndex] = (UCHAR)i;
+        }
+    }
+}
+
+/*
+ * ZvioNetRssPairForProcessor - Pair a processor sends on
+ */
+PZVIONET_QUEUE_PAIR
+ZvioNetRssPairForProcessor(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ ULONG ProcessorIndex
+    )
+{
+    ULONG pair = ProcessorIndex < ZVIONET_MAX_PROCESSORS ?
+        Adapter->ProcessorPair[ProcessorIndex] : ProcessorIndex % Adapter->NumPairs;
+
+    return &Adapter->Pairs[pair < Adapter->NumPairs ? pair : 0];
+}
+
+/*
+ * ZvioNetRssFillCapabilities - Describe RSS to NDIS
+ */
+VOID
+ZvioNetRssFillCapabilities(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _Out_ PNDIS_RECEIVE_SCALE_CAPABILITIES Caps
+    )
+{
+    ULONG hashTypes = READ_REGISTER_ULONG(&Adapter->DeviceCfg->SupportedHashTypes);
+
+    NdisZeroMemory(Caps, sizeof(*Caps));
+    Caps->Header.Type = NDIS_OBJECT_TYPE_RSS_CAPABILITIES;
+    Caps->Header.Revision = NDIS_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
+    Caps->Header.Size = NDIS_SIZEOF_RECEIVE_SCALE_CAPABILITIES_REVISION_2;
+
+    Caps->CapabilitiesFlags = NDIS_RSS_CAPS_CLASSIFICATION_AT_ISR | NdisHashFunctionToeplitz;
+    if (Adapter->UseMsix) {
+        Caps->CapabilitiesFlags |= NDIS_RSS_CAPS_MESSAGE_SIGNALED_INTERRUPTS |
+                                   NDIS_RSS_CAPS_SUPPORTS_MSI_X |
+                                   NDIS_RSS_CAPS_USING_MSI_X;
+    }
+    if (hashTypes & VIRTIO_NET_RSS_HASH_TYPE_TCPv4) {
+        Caps->CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV4;
+    }
+    if (hashTypes & VIRTIO_NET_RSS_HASH_TYPE_TCPv6) {
+        Caps->CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6;
+    }
+    if (hashTypes & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX) {
+        Caps->CapabilitiesFlags |= NDIS_RSS_CAPS_HASH_TYPE_TCP_IPV6_EX;
+    }
+
+    Caps->NumberOfInterruptMessages = Adapter->UseMsix ? Adapter->NumPairs : 1;
+    Caps->NumberOfReceiveQueues = Adapter->NumPairs;
+    Caps->NumberOfIndirectionTableEntries =
+        (USHORT)ZvioNetRssTableSize(Adapter, ZVIONET_RSS_MAX_TABLE_SIZE);
+}
+
+/*
+ * ZvioNetRssApply - Assign pairs to the table's processors and program the device
+ */
+static NDIS_STATUS
+ZvioNetRssApply(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    UCHAR config[ZVIONET_RSS_CONFIG_MAX_SIZE];
+    PVIRTIO_NET_RSS_CONFIG rss = (PVIRTIO_NET_RSS_CONFIG)config;
+    UCHAR seen[ZVIONET_MAX_PROCESSORS];
+    ULONG ndisHash = NDIS_RSS_HASH_TYPE_FROM_HASH_INFO(Adapter->RssHashInformation);
+    ULONG tableSize = ZvioNetRssTableSize(Adapter, Adapter->RssTableSize);
+    ULONG distinct = 0;
+    PUCHAR tail;
+    ULONG i;
+
+    NdisZeroMemory(config, sizeof(config));
+    NdisFillMemory(seen, sizeof(seen), 0xFF);
+
+    if (ndisHash & NDIS_HASH_IPV4) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_IPv4;
+    }
+    if (ndisHash & NDIS_HASH_TCP_IPV4) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_TCPv4;
+    }
+    if (ndisHash & NDIS_HASH_IPV6) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_IPv6;
+    }
+    if (ndisHash & NDIS_HASH_TCP_IPV6) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_TCPv6;
+    }
+    if (ndisHash & NDIS_HASH_IPV6_EX) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_IP_EX;
+    }
+    if (ndisHash & NDIS_HASH_TCP_IPV6_EX) {
+        rss->HashTypes |= VIRTIO_NET_RSS_HASH_TYPE_TCP_EX;
+    }
+    rss->HashTypes &= READ_REGISTER_ULONG(&Adapter->DeviceCfg->SupportedHashTypes);
+
+    rss->IndirectionTableMask = (USHORT)(tableSize - 1);
+    rss->UnclassifiedQueue = 0;
+
+    //
+    // The first processors seen own a pair each and take its DPC; any
+    // beyond the pair count share them round-robin
+    //
+    for (i = 0; i < Adapter->RssTableSize; i++) {
+        PROCESSOR_NUMBER processor = Adapter->RssTable[i];
+        ULONG processorIndex = KeGetProcessorIndexFromNumber(&processor);
+        ULONG pair;
+
+        if (processorIndex < ZVIONET_MAX_PROCESSORS && seen[processorIndex] != 0xFF) {
+            pair = seen[processorIndex];
+        } else {
+            pair = distinct % Adapter->NumPairs;
+            if (distinct < Adapter->NumPairs) {
+                Adapter->Pairs[pair].Processor = processor;
+            }
+            distinct++;
+            if (processorIndex < ZVIONET_MAX_PROCESSORS) {
+                seen[processorIndex] = (UCHAR)pair;
+            }
+        }
+
+        if (i < tableSize) {
+            rss->IndirectionTable[i] = (USHORT)pair;
+        }
+    }
+
+    for (i = 0; i < ZVIONET_MAX_PROCESSORS; i++) {
+        Adapter->ProcessorPair[i] = seen[i] != 0xFF ? seen[i] : (UCHAR)(i % Adapter->NumPairs);
+    }
+
+    tail = (PUCHAR)&rss->IndirectionTable[tableSize];
+    *(PUSHORT)tail = (USHORT)Adapter->NumPairs;
+    tail += sizeof(USHORT);
+    *tail++ = (UCHAR)Adapter->RssHashKeySize;
+    NdisMoveMemory(tail, Adapter->RssHashKey, Adapter->RssHashKeySize);
+    tail += Adapter->RssHashKeySize;
+
+    return ZvioNetCtrlCommand(Adapter, VIRTIO_NET_CTRL_MQ, VIRTIO_NET_CTRL_MQ_RSS_CONFIG,
+                              config, (ULONG)(tail - config));
+}
+
+/*
+ * ZvioNetRssSetParameters - OID_GEN_RECEIVE_SCALE_PARAMETERS set
+ */
+NDIS_STATUS
+ZvioNetRssSetParameters(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_reads_bytes_(Length) PNDIS_RECEIVE_SCALE_PARAMETERS Params,
+    _In_ ULONG Length,
+    _Out_ PULONG BytesRead
+    )
+{
+    ULONG hashInfo = Adapter->RssHashInformation;
+    NDIS_STATUS status;
+
+    *BytesRead = 0;
+
+    if (!Adapter->RssSupported) {
+        return NDIS_STATUS_NOT_SUPPORTED;
+    }
+
+    if (Length < NDIS_SIZEOF_RECEIVE_SCALE_PARAMETERS_REVISION_1) {
+        return NDIS_STATUS_INVALID_LENGTH;
+    }
+
+    if (!(Params->Flags & NDIS_RSS_PARAM_FLAG_HASH_INFO_UNCHANGED)) {
+        hashInfo = Params->HashInformation;
+    }
+
+    if ((Params->Flags & NDIS_RSS_PARAM_FLAG_DISABLE_RSS) ||
+        NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(hashInfo) == 0) {
+        //
+        // Setting the pair count hands steering back to the device
+        //
+        Adapter->RssEnabled = FALSE;
+        ZvioNetRssInitPairs(Adapter);
+        *BytesRead = Length;
+        return ZvioNetCtrlSetQueuePairs(Adapter, (USHORT)Adapter->NumPairs);
+    }
+
+    if (NDIS_RSS_HASH_FUNC_FROM_HASH_INFO(hashInfo) != NdisHashFunctionToeplitz) {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    if (!(Params->Flags & NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED)) {
+        if (Params->HashSecretKeySize > ZVIONET_RSS_MAX_KEY_SIZE ||
+            Params->HashSecretKeySize > READ_REGISTER_UCHAR(&Adapter->DeviceCfg->RssMaxKeySize) ||
+            Params->HashSecretKeyOffset > Length ||
+            Params->HashSecretKeySize > Length - Params->HashSecretKeyOffset) {
+            return NDIS_STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    if (!(Params->Flags & NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED)) {
+        if (Params->IndirectionTableSize == 0 ||
+            Params->IndirectionTableSize % sizeof(PROCESSOR_NUMBER) != 0 ||
+            Params->IndirectionTableSize > sizeof(Adapter->RssTable) ||
+            Params->IndirectionTableOffset > Length ||
+            Params->IndirectionTableSize > Length - Params->IndirectionTableOffset) {
+            return NDIS_STATUS_INVALID_PARAMETER;
+        }
+    }
+
+    Adapter->RssHashInformation = hashInfo;
+
+    if (!(Params->Flags & NDIS_RSS_PARAM_FLAG_HASH_KEY_UNCHANGED)) {
+        Adapter->RssHashKeySize = Params->HashSecretKeySize;
+        NdisMoveMemory(Adapter->RssHashKey,
+                       (PUCHAR)Params + Params->HashSecretKeyOffset,
+                       Params->HashSecretKeySize);
+    }
+
+    if (!(Params->Flags & NDIS_RSS_PARAM_FLAG_ITABLE_UNCHANGED)) {
+        Adapter->RssTableSize = Params->IndirectionTableSize / sizeof(PROCESSOR_NUMBER);
+        NdisMoveMemory(Adapter->RssTable,
+                       (PUCHAR)Params + Params->IndirectionTableOffset,
+                       Params->IndirectionTableSize);
+    }
+
+    if (Adapter->RssTableSize == 0 || Adapter->RssHashKeySize == 0) {
+        return NDIS_STATUS_INVALID_PARAMETER;
+    }
+
+    status = ZvioNetRssApply(Adapter);
+    Adapter->RssEnabled = status == NDIS_STATUS_SUCCESS;
+    if (status == NDIS_STATUS_SUCCESS) {
+        *BytesRead = Length;
+    } else {
+        ZvioNetDbgError("RSS configuration failed: 0x%08X", status);
+        ZvioNetRssInitPairs(Adapter);
+    }
+
+    return status;
+}
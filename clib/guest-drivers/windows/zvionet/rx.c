@@ -7,10 +7,14 @@
 
 #include "public.h"
 
-#define RX_BUFFER_COUNT     64
+#define RX_BUFFER_COUNT         64
+#define RX_MERGE_BUFFER_COUNT   256
 
 /*
  * ZvioNetInitRxBuffers - Initialize receive buffers
+ *
+ * With VIRTIO_NET_F_MRG_RXBUF buffers are a page each and large frames
+ * span several of them, so more are posted.
  */
 NTSTATUS
 ZvioNetInitRxBuffers(
@@ -19,6 +23,8 @@ ZvioNetInitRxBuffers(
 {
     NET_BUFFER_LIST_POOL_PARAMETERS nblPoolParams;
     NET_BUFFER_POOL_PARAMETERS nbPoolParams;
+    ULONG count = Adapter->MergeRxBuffers ? RX_MERGE_BUFFER_COUNT : RX_BUFFER_COUNT;
+    ULONG p;
     ULONG i;
 
     //
@@ -40,60 +46,96 @@ ZvioNetInitRxBuffers(
     }
 
     //
-    // Allocate RX buffers and post to queue
+    // Allocate RX buffers for each pair and post them to its queue
     //
-    for (i = 0; i < RX_BUFFER_COUNT; i++) {
-        PZVIONET_RX_BUFFER rxBuf;
-        PHYSICAL_ADDRESS bufferPA;
-
-        rxBuf = (PZVIONET_RX_BUFFER)NdisAllocateMemoryWithTagPriority(
-            Adapter->AdapterHandle,
-            sizeof(ZVIONET_RX_BUFFER),
-            ZVIONET_TAG,
-            NormalPoolPriority
-            );
+    for (p = 0; p < Adapter->NumPairs; p++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[p];
 
-        if (!rxBuf) {
-            continue;
-        }
+        for (i = 0; i < count; i++) {
+            PZVIONET_RX_BUFFER rxBuf;
 
-        NdisZeroMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER));
-        rxBuf->Adapter = Adapter;
-        rxBuf->BufferSize = ZVIONET_RX_BUFFER_SIZE;
-        rxBuf->PoolHandle = Adapter->NblPool;
+            rxBuf = (PZVIONET_RX_BUFFER)NdisAllocateMemoryWithTagPriority(
+                Adapter->AdapterHandle,
+                sizeof(ZVIONET_RX_BUFFER),
+                ZVIONET_TAG,
+                NormalPoolPriority
+                );
 
-        //
-        // Allocate shared memory for receive buffer
-        //
-        NdisMAllocateSharedMemory(
-            Adapter->AdapterHandle,
-            ZVIONET_RX_BUFFER_SIZE,
-            FALSE,
-            &rxBuf->Buffer,
-            &rxBuf->BufferPA
-            );
+            if (!rxBuf) {
+                continue;
+            }
 
-        if (!rxBuf->Buffer) {
-            NdisFreeMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER), 0);
-            continue;
+            NdisZeroMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER));
+            rxBuf->Adapter = Adapter;
+            rxBuf->Pair = pair;
+            rxBuf->BufferSize = Adapter->RxBufferSize;
+            rxBuf->PoolHandle = Adapter->NblPool;
+
+            //
+            // Allocate shared memory for receive buffer
+            //
+            NdisMAllocateSharedMemory(
+                Adapter->AdapterHandle,
+                rxBuf->BufferSize,
+                FALSE,
+                &rxBuf->Buffer,
+                &rxBuf->BufferPA
+                );
+
+            if (!rxBuf->Buffer) {
+                NdisFreeMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER), 0);
+                continue;
+            }
+
+            //
+            // The NBL and MDL live as long as the buffer; receive only
+            // adjusts the offsets and length
+            //
+            rxBuf->Mdl = NdisAllocateMdl(Adapter->AdapterHandle, rxBuf->Buffer, rxBuf->BufferSize);
+            rxBuf->PayloadMdl = NdisAllocateMdl(Adapter->AdapterHandle, rxBuf->Buffer, rxBuf->BufferSize);
+            if (rxBuf->Mdl && rxBuf->PayloadMdl) {
+                rxBuf->Nbl = NdisAllocateNetBufferAndNetBufferList(
+                    Adapter->NblPool,
+                    0,
+                    0,
+                    rxBuf->Mdl,
+                    0,
+                    0
+                    );
+            }
+
+            if (!rxBuf->Nbl) {
+                if (rxBuf->Mdl) {
+                    NdisFreeMdl(rxBuf->Mdl);
+                }
+                if (rxBuf->PayloadMdl) {
+                    NdisFreeMdl(rxBuf->PayloadMdl);
+                }
+                NdisMFreeSharedMemory(Adapter->AdapterHandle, rxBuf->BufferSize, FALSE,
+                                      rxBuf->Buffer, rxBuf->BufferPA);
+                NdisFreeMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER), 0);
+                continue;
+            }
+
+            NET_BUFFER_LIST_MINIPORT_RESERVED(rxBuf->Nbl)[0] = rxBuf;
+
+            //
+            // Add to free list
+            //
+            NdisAcquireSpinLock(&pair->RxFreeLock);
+            InsertTailList(&pair->RxFreeList, &rxBuf->Link);
+            pair->RxBufferCount++;
+            NdisReleaseSpinLock(&pair->RxFreeLock);
         }
 
+        ZvioNetDbgPrint("Allocated %d RX buffers for pair %d", pair->RxBufferCount, p);
+
         //
-        // Add to free list
+        // Post buffers to RX queue
         //
-        NdisAcquireSpinLock(&Adapter->RxFreeLock);
-        InsertTailList(&Adapter->RxFreeList, &rxBuf->Link);
-        Adapter->RxBufferCount++;
-        NdisReleaseSpinLock(&Adapter->RxFreeLock);
+        ZvioNetReplenishRx(pair);
     }
 
-    ZvioNetDbgPrint("Allocated %d RX buffers", Adapter->RxBufferCount);
-
-    //
-    // Post buffers to RX queue
-    //
-    ZvioNetReplenishRx(Adapter);
-
     return STATUS_SUCCESS;
 }
 
@@ -107,32 +149,46 @@ ZvioNetFreeRxBuffers(
 {
     PLIST_ENTRY entry;
     PZVIONET_RX_BUFFER rxBuf;
+    ULONG p;
 
-    NdisAcquireSpinLock(&Adapter->RxFreeLock);
+    for (p = 0; p < ZVIONET_MAX_QUEUE_PAIRS; p++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[p];
 
-    while (!IsListEmpty(&Adapter->RxFreeList)) {
-        entry = RemoveHeadList(&Adapter->RxFreeList);
-        rxBuf = CONTAINING_RECORD(entry, ZVIONET_RX_BUFFER, Link);
+        NdisAcquireSpinLock(&pair->RxFreeLock);
 
-        if (rxBuf->Buffer) {
-            NdisMFreeSharedMemory(
-                Adapter->AdapterHandle,
-                ZVIONET_RX_BUFFER_SIZE,
-                FALSE,
-                rxBuf->Buffer,
-                rxBuf->BufferPA
-                );
-        }
+        while (!IsListEmpty(&pair->RxFreeList)) {
+            entry = RemoveHeadList(&pair->RxFreeList);
+            rxBuf = CONTAINING_RECORD(entry, ZVIONET_RX_BUFFER, Link);
+
+            if (rxBuf->Nbl) {
+                NdisFreeNetBufferList(rxBuf->Nbl);
+            }
 
-        if (rxBuf->Nbl) {
-            NdisFreeNetBufferList(rxBuf->Nbl);
+            if (rxBuf->Mdl) {
+                NdisFreeMdl(rxBuf->Mdl);
+            }
+
+            if (rxBuf->PayloadMdl) {
+                NdisFreeMdl(rxBuf->PayloadMdl);
+            }
+
+            if (rxBuf->Buffer) {
+                NdisMFreeSharedMemory(
+                    Adapter->AdapterHandle,
+                    rxBuf->BufferSize,
+                    FALSE,
+                    rxBuf->Buffer,
+                    rxBuf->BufferPA
+                    );
+            }
+
+            NdisFreeMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER), 0);
         }
 
-        NdisFreeMemory(rxBuf, sizeof(ZVIONET_RX_BUFFER), 0);
+        pair->RxBufferCount = 0;
+        NdisReleaseSpinLock(&pair->RxFreeLock);
     }
 
-    NdisReleaseSpinLock(&Adapter->RxFreeLock);
-
     if (Adapter->NblPool) {
         NdisFreeNetBufferListPool(Adapter->NblPool);
         Adapter->NblPool = NULL;
@@ -144,10 +200,10 @@ ZvioNetFreeRxBuffers(
  */
 VOID
 ZvioNetReplenishRx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair
     )
 {
-    PZVIONET_VIRTQUEUE rxQueue = Adapter->RxQueue;
+    PZVIONET_VIRTQUEUE rxQueue = Pair->RxQueue;
     PLIST_ENTRY entry;
     PZVIONET_RX_BUFFER rxBuf;
 
@@ -155,10 +211,10 @@ ZvioNetReplenishRx(
         return;
     }
 
-    NdisAcquireSpinLock(&Adapter->RxFreeLock);
+    NdisAcquireSpinLock(&Pair->RxFreeLock);
 
-    while (!IsListEmpty(&Adapter->RxFreeList)) {
-        entry = Adapter->RxFreeList.Flink;
+    while (!IsListEmpty(&Pair->RxFreeList)) {
+        entry = Pair->RxFreeList.Flink;
         rxBuf = CONTAINING_RECORD(entry, ZVIONET_RX_BUFFER, Link);
 
         //
@@ -168,90 +224,163 @@ ZvioNetReplenishRx(
             break;
         }
 
-        RemoveHeadList(&Adapter->RxFreeList);
+        RemoveHeadList(&Pair->RxFreeList);
     }
 
-    NdisReleaseSpinLock(&Adapter->RxFreeLock);
+    NdisReleaseSpinLock(&Pair->RxFreeLock);
 
-    ZvioNetQueueKick(rxQueue);
+    if (ZvioNetQueueKick(rxQueue)) {
+        InterlockedIncrement64((volatile LONG64 *)&Pair->Stats.RxKicks);
+    }
 }
 
 /*
- * ZvioNetProcessRx - Process received packets
+ * ZvioNetRecycleRxBuffer - Return a received frame's buffers to the free list
  */
 VOID
+ZvioNetRecycleRxBuffer(
+    _In_ PZVIONET_RX_BUFFER RxBuffer
+    )
+{
+    PZVIONET_QUEUE_PAIR pair = RxBuffer->Pair;
+    PZVIONET_RX_BUFFER rxBuf;
+    PZVIONET_RX_BUFFER next;
+
+    NdisAcquireSpinLock(&pair->RxFreeLock);
+
+    for (rxBuf = RxBuffer; rxBuf; rxBuf = next) {
+        next = rxBuf->MergeNext;
+        rxBuf->MergeNext = NULL;
+        rxBuf->Mdl->Next = NULL;
+        NdisAdjustMdlLength(rxBuf->Mdl, rxBuf->BufferSize);
+        MmPrepareMdlForReuse(rxBuf->PayloadMdl);
+        rxBuf->PayloadMdl->Next = NULL;
+        InsertTailList(&pair->RxFreeList, &rxBuf->Link);
+    }
+
+    NdisReleaseSpinLock(&pair->RxFreeLock);
+}
+
+/*
+ * ZvioNetProcessRx - Process received packets
+ *
+ * Indicates at most MaxNbls NBLs and returns how many it did.
+ *
+ * A merged frame's buffers are used back to back; their MDLs are
+ * linked behind the first buffer's NBL, which is the one indicated.
+ * Single-buffer TCP segments of one flow may be coalesced on the way.
+ */
+ULONG
 ZvioNetProcessRx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair,
+    _In_ ULONG MaxNbls
     )
 {
-    PZVIONET_VIRTQUEUE rxQueue = Adapter->RxQueue;
+    PZVIONET_ADAPTER adapter = Pair->Adapter;
+    PZVIONET_VIRTQUEUE rxQueue = Pair->RxQueue;
     PZVIONET_RX_BUFFER rxBuf;
     PNET_BUFFER_LIST nblChain = NULL;
     PNET_BUFFER_LIST *nextNbl = &nblChain;
+    ZVIONET_RSC_STATE rsc;
     ULONG length;
     ULONG packetCount = 0;
 
-    if (!rxQueue || !Adapter->Running) {
-        return;
+    if (!rxQueue || !adapter->Running || MaxNbls == 0) {
+        return 0;
     }
 
+    NdisZeroMemory(&rsc, sizeof(rsc));
+
     //
     // Process received buffers
     //
-    while ((rxBuf = (PZVIONET_RX_BUFFER)ZvioNetQueueGetBuffer(rxQueue, &length)) != NULL) {
-        PNET_BUFFER_LIST nbl;
-        PNET_BUFFER nb;
-        PMDL mdl;
-
-        if (length == 0 || length > rxBuf->BufferSize) {
-            //
-            // Invalid packet, return buffer to free list
-            //
-            NdisAcquireSpinLock(&Adapter->RxFreeLock);
-            InsertTailList(&Adapter->RxFreeList, &rxBuf->Link);
-            NdisReleaseSpinLock(&Adapter->RxFreeLock);
-            Adapter->RxErrors++;
-            continue;
-        }
+    while (packetCount < MaxNbls &&
+           (rxBuf = (PZVIONET_RX_BUFFER)ZvioNetQueueGetBuffer(rxQueue, &length)) != NULL) {
+        PZVIONET_RX_BUFFER tail = rxBuf;
+        PNET_BUFFER_LIST nbl = rxBuf->Nbl;
+        PNET_BUFFER nb = NET_BUFFER_LIST_FIRST_NB(nbl);
+        PVIRTIO_NET_HDR hdr;
+        PUCHAR frame;
+        ULONG frameLength;
+        ULONG firstLength;
+        USHORT numBuffers = 1;
+        USHORT n;
+        BOOLEAN valid;
+
+        valid = length > sizeof(VIRTIO_NET_HDR) && length <= rxBuf->BufferSize;
 
         //
-        // Create MDL for the received data
+        // The frame follows the virtio_net_hdr
         //
-        mdl = NdisAllocateMdl(Adapter->AdapterHandle, rxBuf->Buffer, length);
-        if (!mdl) {
-            NdisAcquireSpinLock(&Adapter->RxFreeLock);
-            InsertTailList(&Adapter->RxFreeList, &rxBuf->Link);
-            NdisReleaseSpinLock(&Adapter->RxFreeLock);
-            continue;
+        hdr = (PVIRTIO_NET_HDR)rxBuf->Buffer;
+        frame = (PUCHAR)rxBuf->Buffer + sizeof(VIRTIO_NET_HDR);
+        frameLength = length - sizeof(VIRTIO_NET_HDR);
+
+        if (valid && adapter->MergeRxBuffers && hdr->NumBuffers > 1) {
+            numBuffers = hdr->NumBuffers;
+        }
+
+        if (valid) {
+            NdisAdjustMdlLength(rxBuf->Mdl, length);
         }
 
         //
-        // Allocate NBL
+        // Gather the rest of a merged frame
         //
-        nbl = NdisAllocateNetBufferAndNetBufferList(
-            Adapter->NblPool,
-            0,
-            0,
-            mdl,
-            0,
-            length
-            );
+        for (n = 1; n < numBuffers; n++) {
+            PZVIONET_RX_BUFFER next = (PZVIONET_RX_BUFFER)ZvioNetQueueGetBuffer(rxQueue, &length);
+
+            if (!next) {
+                valid = FALSE;
+                break;
+            }
+
+            tail->MergeNext = next;
+            tail->Mdl->Next = next->Mdl;
+            tail = next;
+
+            if (length > next->BufferSize) {
+                valid = FALSE;
+            } else {
+                NdisAdjustMdlLength(next->Mdl, length);
+            }
+            frameLength += length;
+        }
 
-        if (!nbl) {
-            NdisFreeMdl(mdl);
-            NdisAcquireSpinLock(&Adapter->RxFreeLock);
-            InsertTailList(&Adapter->RxFreeList, &rxBuf->Link);
-            NdisReleaseSpinLock(&Adapter->RxFreeLock);
+        if (!valid) {
+            //
+            // Invalid packet, return buffers to free list
+            //
+            ZvioNetRecycleRxBuffer(rxBuf);
+            Pair->Stats.RxErrors++;
             continue;
         }
 
-        rxBuf->Nbl = nbl;
-        rxBuf->Mdl = mdl;
+        if (numBuffers == 1 && ZvioNetRscMerge(adapter, &rsc, rxBuf, hdr, frameLength)) {
+            Pair->Stats.RxPackets++;
+            Pair->Stats.RxBytes += frameLength;
+            continue;
+        }
+        ZvioNetRscFlush(&rsc);
+
+        NET_BUFFER_FIRST_MDL(nb) = rxBuf->Mdl;
+        NET_BUFFER_CURRENT_MDL(nb) = rxBuf->Mdl;
+        NET_BUFFER_DATA_OFFSET(nb) = sizeof(VIRTIO_NET_HDR);
+        NET_BUFFER_CURRENT_MDL_OFFSET(nb) = sizeof(VIRTIO_NET_HDR);
+        NET_BUFFER_DATA_LENGTH(nb) = frameLength;
+        NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SUCCESS;
+        NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
 
         //
-        // Store context for return
+        // The headers the checksum check parses sit in the first buffer
         //
-        NET_BUFFER_LIST_MINIPORT_RESERVED(nbl)[0] = rxBuf;
+        firstLength = min(frameLength, rxBuf->BufferSize - (ULONG)sizeof(VIRTIO_NET_HDR));
+        ZvioNetRxSetChecksum(adapter, nbl, hdr, frame, firstLength);
+        ZvioNetRxSetRsc(adapter, nbl, hdr, frame, firstLength, frameLength);
+
+        if (numBuffers == 1) {
+            ZvioNetRscStart(adapter, &rsc, rxBuf, hdr, frameLength);
+        }
 
         //
         // Add to chain
@@ -259,26 +388,37 @@ ZvioNetProcessRx(
         *nextNbl = nbl;
         nextNbl = &NET_BUFFER_LIST_NEXT_NBL(nbl);
 
-        Adapter->RxPackets++;
-        Adapter->RxBytes += length;
+        Pair->Stats.RxPackets++;
+        Pair->Stats.RxBytes += frameLength;
         packetCount++;
     }
 
+    ZvioNetRscFlush(&rsc);
+
     //
     // Indicate received packets
     //
     if (nblChain) {
         NdisMIndicateReceiveNetBufferLists(
-            Adapter->AdapterHandle,
+            adapter->AdapterHandle,
             nblChain,
             NDIS_DEFAULT_PORT_NUMBER,
             packetCount,
             NDIS_RECEIVE_FLAGS_DISPATCH_LEVEL
             );
+
+        TraceLoggingWrite(ZvioNetTraceProvider, "RxIndicate",
+            TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+            TraceLoggingKeyword(ZVIONET_TRACE_DATAPATH),
+            TraceLoggingUInt32(Pair->Index, "Pair"),
+            TraceLoggingUInt32(packetCount, "Nbls"),
+            TraceLoggingUInt32(MaxNbls, "Budget"));
     }
 
     //
     // Replenish RX queue
     //
-    ZvioNetReplenishRx(Adapter);
+    ZvioNetReplenishRx(Pair);
+
+    return packetCount;
 }
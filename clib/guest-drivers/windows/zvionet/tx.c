@@ -7,8 +7,369 @@
 
 #include "public.h"
 
+#define ZVIONET_TX_COMPLETE_BATCH   64
+
+//
+// An NBL completes when its last NET_BUFFER does. Send holds one
+// reference of its own so that NET_BUFFERs finishing early cannot
+// complete the NBL while later ones are still being mapped.
+//
+#define ZVIONET_NBL_PENDING(_Nbl) \
+    (*(volatile LONG *)&NET_BUFFER_LIST_MINIPORT_RESERVED(_Nbl)[0])
+#define ZVIONET_NBL_STATUS(_Nbl) \
+    (*(NDIS_STATUS *)&NET_BUFFER_LIST_MINIPORT_RESERVED(_Nbl)[1])
+
+/*
+ * ZvioNetInitTx - Allocate the per-slot transmit contexts
+ *
+ * A chain never needs more than one context, so one per ring entry
+ * covers the queue. Each owns a header, an SG list buffer sized by
+ * NDIS and an indirect table.
+ */
+NTSTATUS
+ZvioNetInitTx(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    ULONG i, j;
+
+    for (i = 0; i < Adapter->NumPairs; i++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[i];
+        ULONG count;
+
+        if (!pair->TxQueue) {
+            continue;
+        }
+
+        count = pair->TxQueue->Size;
+
+        pair->TxHeadersSize = count * sizeof(VIRTIO_NET_HDR);
+        NdisMAllocateSharedMemory(
+            Adapter->AdapterHandle,
+            pair->TxHeadersSize,
+            FALSE,
+            (PVOID *)&pair->TxHeaders,
+            &pair->TxHeadersPA
+            );
+
+        if (!pair->TxHeaders) {
+            ZvioNetDbgError("Failed to allocate TX headers for pair %d", i);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        NdisZeroMemory(pair->TxHeaders, pair->TxHeadersSize);
+
+        pair->TxTablesSize = count * ZVIONET_TX_TABLE_ENTRIES * sizeof(VRING_DESC);
+        NdisMAllocateSharedMemory(
+            Adapter->AdapterHandle,
+            pair->TxTablesSize,
+            FALSE,
+            (PVOID *)&pair->TxTables,
+            &pair->TxTablesPA
+            );
+
+        if (!pair->TxTables) {
+            ZvioNetDbgError("Failed to allocate TX tables for pair %d", i);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        pair->TxContexts = (PZVIONET_TX_CONTEXT)NdisAllocateMemoryWithTagPriority(
+            Adapter->AdapterHandle,
+            count * sizeof(ZVIONET_TX_CONTEXT),
+            ZVIONET_TAG,
+            NormalPoolPriority
+            );
+
+        pair->TxSgBuffers = (PUCHAR)NdisAllocateMemoryWithTagPriority(
+            Adapter->AdapterHandle,
+            count * Adapter->SgListSize,
+            ZVIONET_TAG,
+            NormalPoolPriority
+            );
+
+        if (!pair->TxContexts || !pair->TxSgBuffers) {
+            ZvioNetDbgError("Failed to allocate TX contexts for pair %d", i);
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+
+        NdisZeroMemory(pair->TxContexts, count * sizeof(ZVIONET_TX_CONTEXT));
+        pair->TxContextCount = count;
+
+        for (j = 0; j < count; j++) {
+            PZVIONET_TX_CONTEXT ctx = &pair->TxContexts[j];
+
+            ctx->Pair = pair;
+            ctx->Index = j;
+            ctx->SgBuffer = pair->TxSgBuffers + j * Adapter->SgListSize;
+            ctx->Table = pair->TxTables + j * ZVIONET_TX_TABLE_ENTRIES;
+            ctx->TablePA.QuadPart = pair->TxTablesPA.QuadPart +
+                j * ZVIONET_TX_TABLE_ENTRIES * sizeof(VRING_DESC);
+            InterlockedPushEntrySList(&pair->TxFreeList, &ctx->Link);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetFreeTx - Free the transmit contexts
+ */
+VOID
+ZvioNetFreeTx(
+    _In_ PZVIONET_ADAPTER Adapter
+    )
+{
+    ULONG i;
+
+    for (i = 0; i < ZVIONET_MAX_QUEUE_PAIRS; i++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[i];
+
+        InitializeSListHead(&pair->TxFreeList);
+        InitializeSListHead(&pair->TxReadyList);
+
+        if (pair->TxContexts) {
+            NdisFreeMemory(pair->TxContexts, pair->TxContextCount * sizeof(ZVIONET_TX_CONTEXT), 0);
+            pair->TxContexts = NULL;
+        }
+        if (pair->TxSgBuffers) {
+            NdisFreeMemory(pair->TxSgBuffers, pair->TxContextCount * Adapter->SgListSize, 0);
+            pair->TxSgBuffers = NULL;
+        }
+        pair->TxContextCount = 0;
+
+        if (pair->TxTables) {
+            NdisMFreeSharedMemory(
+                Adapter->AdapterHandle,
+                pair->TxTablesSize,
+                FALSE,
+                pair->TxTables,
+                pair->TxTablesPA
+                );
+            pair->TxTables = NULL;
+        }
+        if (pair->TxHeaders) {
+            NdisMFreeSharedMemory(
+                Adapter->AdapterHandle,
+                pair->TxHeadersSize,
+                FALSE,
+                pair->TxHeaders,
+                pair->TxHeadersPA
+                );
+            pair->TxHeaders = NULL;
+        }
+    }
+}
+
+/*
+ * ZvioNetTxReleaseNbl - Drop a reference and complete the NBL on the last
+ */
+static VOID
+ZvioNetTxReleaseNbl(
+    _In_ PZVIONET_ADAPTER Adapter,
+    _In_ PNET_BUFFER_LIST Nbl,
+    _In_ NDIS_STATUS Status
+    )
+{
+    if (Status != NDIS_STATUS_SUCCESS) {
+        ZVIONET_NBL_STATUS(Nbl) = Status;
+    }
+
+    if (InterlockedDecrement(&ZVIONET_NBL_PENDING(Nbl)) != 0) {
+        return;
+    }
+
+    NET_BUFFER_LIST_STATUS(Nbl) = ZVIONET_NBL_STATUS(Nbl);
+    ZvioNetTxCompleteOffload(Nbl);
+    NET_BUFFER_LIST_NEXT_NBL(Nbl) = NULL;
+    NdisMSendNetBufferListsComplete(
+        Adapter->AdapterHandle,
+        Nbl,
+        KeGetCurrentIrql() == DISPATCH_LEVEL ? NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL : 0
+        );
+}
+
+/*
+ * ZvioNetTxPutContext - Return a context to its pair's free list
+ */
+static VOID
+ZvioNetTxPutContext(
+    _In_ PZVIONET_TX_CONTEXT Context
+    )
+{
+    PZVIONET_QUEUE_PAIR pair = Context->Pair;
+
+    Context->Nbl = NULL;
+    Context->Nb = NULL;
+    Context->SgList = NULL;
+
+    InterlockedPushEntrySList(&pair->TxFreeList, &Context->Link);
+}
+
+/*
+ * ZvioNetTxFlush - Post every mapped NET_BUFFER and kick once
+ *
+ * The ready list is taken under the queue lock, so chains reach the
+ * ring in the order they were mapped.
+ */
+static VOID
+ZvioNetTxFlush(
+    _In_ PZVIONET_QUEUE_PAIR Pair
+    )
+{
+    PZVIONET_ADAPTER adapter = Pair->Adapter;
+    PZVIONET_VIRTQUEUE txQueue = Pair->TxQueue;
+    PSLIST_ENTRY entry;
+    PSLIST_ENTRY ordered = NULL;
+    PSLIST_ENTRY failed = NULL;
+    PZVIONET_TX_CONTEXT ctx;
+    ULONG posted = 0;
+    ULONG failedCount = 0;
+    ULONG inFlight;
+
+    NdisAcquireSpinLock(&txQueue->Lock);
+
+    entry = InterlockedFlushSList(&Pair->TxReadyList);
+    if (!entry) {
+        NdisReleaseSpinLock(&txQueue->Lock);
+        return;
+    }
+
+    //
+    // The list pops newest first
+    //
+    while (entry) {
+        PSLIST_ENTRY next = entry->Next;
+        entry->Next = ordered;
+        ordered = entry;
+        entry = next;
+    }
+
+    while (ordered) {
+        entry = ordered;
+        ordered = entry->Next;
+        ctx = CONTAINING_RECORD(entry, ZVIONET_TX_CONTEXT, Link);
+
+        if (!NT_SUCCESS(ZvioNetQueuePostDescriptors(txQueue, ctx->Table, ctx->TablePA,
+                                                    ctx->DescCount, ctx))) {
+            entry->Next = failed;
+            failed = entry;
+            failedCount++;
+            continue;
+        }
+
+        Pair->Stats.TxPackets++;
+        Pair->Stats.TxBytes += NET_BUFFER_DATA_LENGTH(ctx->Nb);
+        posted++;
+    }
+
+    inFlight = txQueue->Size - txQueue->NumFree;
+    Pair->Stats.TxInFlight = inFlight;
+
+    NdisReleaseSpinLock(&txQueue->Lock);
+
+    if (posted && ZvioNetQueueKick(txQueue)) {
+        InterlockedIncrement64((volatile LONG64 *)&Pair->Stats.TxKicks);
+    }
+
+    if (failedCount) {
+        InterlockedAdd64((volatile LONG64 *)&Pair->Stats.TxRingFull, failedCount);
+        InterlockedAdd64((volatile LONG64 *)&Pair->Stats.TxErrors, failedCount);
+    }
+
+    TraceLoggingWrite(ZvioNetTraceProvider, "TxFlush",
+        TraceLoggingLevel(TRACE_LEVEL_VERBOSE),
+        TraceLoggingKeyword(ZVIONET_TRACE_DATAPATH),
+        TraceLoggingUInt32(Pair->Index, "Pair"),
+        TraceLoggingUInt32(posted, "Posted"),
+        TraceLoggingUInt32(failedCount, "Failed"),
+        TraceLoggingUInt32(inFlight, "InFlight"));
+
+    while (failed) {
+        PNET_BUFFER_LIST nbl;
+
+        ctx = CONTAINING_RECORD(failed, ZVIONET_TX_CONTEXT, Link);
+        failed = failed->Next;
+        nbl = ctx->Nbl;
+
+        NdisMFreeNetBufferSGList(adapter->MiniportDmaHandle, ctx->SgList, ctx->Nb);
+        ZvioNetTxPutContext(ctx);
+        ZvioNetTxReleaseNbl(adapter, nbl, NDIS_STATUS_RESOURCES);
+    }
+}
+
+/*
+ * ZvioNetProcessSGList - Stage a mapped NET_BUFFER
+ *
+ * NDIS calls this once the buffer's MDL chain is mapped, possibly
+ * before NdisMAllocateNetBufferSGList returns. The header goes first,
+ * then one descriptor per fragment. While a send is in progress on
+ * the pair the chain waits for its flush; a late callback flushes
+ * itself.
+ */
+VOID
+ZvioNetProcessSGList(
+    _In_ PDEVICE_OBJECT DeviceObject,
+    _In_ PVOID Reserved,
+    _In_ PSCATTER_GATHER_LIST ScatterGatherList,
+    _In_ PVOID Context
+    )
+{
+    PZVIONET_TX_CONTEXT ctx = (PZVIONET_TX_CONTEXT)Context;
+    PZVIONET_QUEUE_PAIR pair = ctx->Pair;
+    PZVIONET_ADAPTER adapter = pair->Adapter;
+    PNET_BUFFER_LIST nbl = ctx->Nbl;
+    PNET_BUFFER nb = ctx->Nb;
+    ULONG count = ScatterGatherList->NumberOfElements;
+    NDIS_STATUS status;
+    ULONG i;
+
+    UNREFERENCED_PARAMETER(DeviceObject);
+    UNREFERENCED_PARAMETER(Reserved);
+
+    ctx->SgList = ScatterGatherList;
+
+    if (count == 0 || count >= ZVIONET_TX_TABLE_ENTRIES) {
+        ZvioNetDbgError("TX frame has %d fragments", count);
+        status = NDIS_STATUS_INVALID_PACKET;
+        goto Fail;
+    }
+
+    ctx->Table[0].Addr = pair->TxHeadersPA.QuadPart + ctx->Index * sizeof(VIRTIO_NET_HDR);
+    ctx->Table[0].Len = sizeof(VIRTIO_NET_HDR);
+    ctx->Table[0].Flags = 0;
+
+    for (i = 0; i < count; i++) {
+        ctx->Table[i + 1].Addr = ScatterGatherList->Elements[i].Address.QuadPart;
+        ctx->Table[i + 1].Len = ScatterGatherList->Elements[i].Length;
+        ctx->Table[i + 1].Flags = 0;
+    }
+
+    ctx->DescCount = (USHORT)(count + 1);
+    InterlockedPushEntrySList(&pair->TxReadyList, &ctx->Link);
+
+    //
+    // Publish the staged chain before looking for a sender to flush it
+    //
+    KeMemoryBarrier();
+    if (pair->TxSending == 0) {
+        ZvioNetTxFlush(pair);
+    }
+    return;
+
+Fail:
+    InterlockedIncrement64((volatile LONG64 *)&pair->Stats.TxErrors);
+    NdisMFreeNetBufferSGList(adapter->MiniportDmaHandle, ScatterGatherList, nb);
+    ZvioNetTxPutContext(ctx);
+    ZvioNetTxReleaseNbl(adapter, nbl, status);
+}
+
 /*
  * ZvioNetSendNetBufferLists - Send network buffer lists
+ *
+ * Each processor sends on its own pair's TX queue, so senders on
+ * different processors do not share a queue lock. Every NET_BUFFER
+ * is mapped through its full MDL chain by NDIS; the whole NBL chain
+ * is then posted under one lock acquisition and one kick.
  */
 VOID
 ZvioNetSendNetBufferLists(
@@ -18,10 +379,12 @@ ZvioNetSendNetBufferLists(
 {
     PNET_BUFFER_LIST nbl;
     PNET_BUFFER nb;
-    PZVIONET_VIRTQUEUE txQueue = Adapter->TxQueue;
-    NDIS_STATUS status = NDIS_STATUS_SUCCESS;
+    PZVIONET_QUEUE_PAIR pair = ZvioNetRssPairForProcessor(Adapter, KeGetCurrentProcessorIndex());
+    PZVIONET_VIRTQUEUE txQueue = pair->TxQueue;
+    NDIS_STATUS status;
+    VIRTIO_NET_HDR hdr;
 
-    if (!txQueue) {
+    if (!txQueue || !pair->TxContexts || !Adapter->MiniportDmaHandle) {
         for (nbl = NetBufferLists; nbl; nbl = NET_BUFFER_LIST_NEXT_NBL(nbl)) {
             NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_ADAPTER_NOT_READY;
         }
@@ -29,6 +392,8 @@ ZvioNetSendNetBufferLists(
         return;
     }
 
+    InterlockedIncrement(&pair->TxSending);
+
     //
     // Process each NBL
     //
@@ -36,111 +401,134 @@ ZvioNetSendNetBufferLists(
         PNET_BUFFER_LIST nextNbl = NET_BUFFER_LIST_NEXT_NBL(nbl);
         NET_BUFFER_LIST_NEXT_NBL(nbl) = NULL;
 
+        ZVIONET_NBL_PENDING(nbl) = 1;
+        ZVIONET_NBL_STATUS(nbl) = NDIS_STATUS_SUCCESS;
         status = NDIS_STATUS_SUCCESS;
 
         for (nb = NET_BUFFER_LIST_FIRST_NB(nbl); nb; nb = NET_BUFFER_NEXT_NB(nb)) {
-            PMDL mdl = NET_BUFFER_CURRENT_MDL(nb);
-            ULONG dataLength = NET_BUFFER_DATA_LENGTH(nb);
-            ULONG offset = NET_BUFFER_CURRENT_MDL_OFFSET(nb);
-            PVOID virtualAddr;
-            PHYSICAL_ADDRESS physAddr;
+            PZVIONET_TX_CONTEXT ctx;
+            PSLIST_ENTRY entry;
 
-            if (!mdl || dataLength == 0) {
+            if (!NET_BUFFER_CURRENT_MDL(nb) || NET_BUFFER_DATA_LENGTH(nb) == 0) {
                 status = NDIS_STATUS_INVALID_DATA;
                 break;
             }
 
             //
-            // Get the virtual address of the data
-            //
-            virtualAddr = (PUCHAR)MmGetMdlVirtualAddress(mdl) + offset;
-            physAddr = MmGetPhysicalAddress(virtualAddr);
-
+            // Offload requests go in the virtio_net_hdr ahead of the frame
             //
-            // For simplicity, we send the packet directly without VirtIO header
-            // In a real driver, we would prepend VIRTIO_NET_HDR
-            //
-            NdisAcquireSpinLock(&txQueue->Lock);
+            status = ZvioNetTxBuildHeader(Adapter, nbl, nb, &hdr);
+            if (status != NDIS_STATUS_SUCCESS) {
+                break;
+            }
 
-            if (txQueue->NumFree < 2) {
-                NdisReleaseSpinLock(&txQueue->Lock);
+            entry = InterlockedPopEntrySList(&pair->TxFreeList);
+            if (!entry) {
+                InterlockedIncrement64((volatile LONG64 *)&pair->Stats.TxRingFull);
                 status = NDIS_STATUS_RESOURCES;
                 break;
             }
+            ctx = CONTAINING_RECORD(entry, ZVIONET_TX_CONTEXT, Link);
 
-            //
-            // Add buffer to TX queue
-            //
-            USHORT descIdx = txQueue->FreeHead;
-            txQueue->FreeHead = txQueue->Desc[descIdx].Next;
-            txQueue->NumFree--;
-
-            txQueue->Desc[descIdx].Addr = physAddr.QuadPart;
-            txQueue->Desc[descIdx].Len = dataLength;
-            txQueue->Desc[descIdx].Flags = 0;
-            txQueue->Desc[descIdx].Next = 0xFFFF;
-
-            txQueue->DescData[descIdx] = nbl;
+            ctx->Nbl = nbl;
+            ctx->Nb = nb;
+            pair->TxHeaders[ctx->Index] = hdr;
 
-            USHORT availIdx = txQueue->Avail->Idx & (txQueue->Size - 1);
-            txQueue->Avail->Ring[availIdx] = descIdx;
-            KeMemoryBarrier();
-            txQueue->Avail->Idx++;
+            InterlockedIncrement(&ZVIONET_NBL_PENDING(nbl));
 
-            NdisReleaseSpinLock(&txQueue->Lock);
+            status = NdisMAllocateNetBufferSGList(
+                Adapter->MiniportDmaHandle,
+                nb,
+                ctx,
+                0,
+                ctx->SgBuffer,
+                Adapter->SgListSize
+                );
 
-            Adapter->TxPackets++;
-            Adapter->TxBytes += dataLength;
+            if (status != NDIS_STATUS_SUCCESS) {
+                InterlockedIncrement64((volatile LONG64 *)&pair->Stats.TxAllocFailures);
+                ZvioNetTxPutContext(ctx);
+                InterlockedDecrement(&ZVIONET_NBL_PENDING(nbl));
+                break;
+            }
         }
 
         if (status != NDIS_STATUS_SUCCESS) {
-            NET_BUFFER_LIST_STATUS(nbl) = status;
-            NdisMSendNetBufferListsComplete(Adapter->AdapterHandle, nbl, 0);
-        } else {
-            //
-            // Kick the TX queue
-            //
-            ZvioNetQueueKick(txQueue);
+            InterlockedIncrement64((volatile LONG64 *)&pair->Stats.TxErrors);
         }
 
+        //
+        // Drop the send reference; completes now if nothing was posted
+        //
+        ZvioNetTxReleaseNbl(Adapter, nbl, status);
+
         nbl = nextNbl;
     }
+
+    //
+    // Callbacks that see no sender flush themselves, so stop being one
+    // before flushing
+    //
+    InterlockedDecrement(&pair->TxSending);
+    ZvioNetTxFlush(pair);
 }
 
 /*
  * ZvioNetCompleteTx - Complete transmitted packets
+ *
+ * Used chains are reaped ZVIONET_TX_COMPLETE_BATCH at a time under one
+ * queue lock acquisition, and finished NBLs go up in one call.
  */
 VOID
 ZvioNetCompleteTx(
-    _In_ PZVIONET_ADAPTER Adapter
+    _In_ PZVIONET_QUEUE_PAIR Pair
     )
 {
-    PZVIONET_VIRTQUEUE txQueue = Adapter->TxQueue;
+    PZVIONET_VIRTQUEUE txQueue = Pair->TxQueue;
+    PZVIONET_ADAPTER adapter = Pair->Adapter;
+    PVOID done[ZVIONET_TX_COMPLETE_BATCH];
     PNET_BUFFER_LIST nbl;
     PNET_BUFFER_LIST completeList = NULL;
     PNET_BUFFER_LIST *nextPtr = &completeList;
-    ULONG length;
+    ULONG count;
+    ULONG i;
 
     if (!txQueue) {
         return;
     }
 
     //
-    // Process completed TX buffers
+    // Unmap each sent NET_BUFFER; its NBL is done with the last one
     //
-    while ((nbl = (PNET_BUFFER_LIST)ZvioNetQueueGetBuffer(txQueue, &length)) != NULL) {
-        NET_BUFFER_LIST_STATUS(nbl) = NDIS_STATUS_SUCCESS;
-        *nextPtr = nbl;
-        nextPtr = &NET_BUFFER_LIST_NEXT_NBL(nbl);
-        *nextPtr = NULL;
-    }
+    do {
+        count = ZvioNetQueueGetBuffers(txQueue, done, ZVIONET_TX_COMPLETE_BATCH);
+
+        for (i = 0; i < count; i++) {
+            PZVIONET_TX_CONTEXT ctx = (PZVIONET_TX_CONTEXT)done[i];
+
+            nbl = ctx->Nbl;
+
+            NdisMFreeNetBufferSGList(adapter->MiniportDmaHandle, ctx->SgList, ctx->Nb);
+            ZvioNetTxPutContext(ctx);
+
+            if (InterlockedDecrement(&ZVIONET_NBL_PENDING(nbl)) != 0) {
+                continue;
+            }
+
+            NET_BUFFER_LIST_STATUS(nbl) = ZVIONET_NBL_STATUS(nbl);
+            ZvioNetTxCompleteOffload(nbl);
+            *nextPtr = nbl;
+            nextPtr = &NET_BUFFER_LIST_NEXT_NBL(nbl);
+            *nextPtr = NULL;
+        }
+    } while (count == ZVIONET_TX_COMPLETE_BATCH);
 
     //
     // Complete all NBLs
     //
     if (completeList) {
         NdisMSendNetBufferListsComplete(
-            Adapter->AdapterHandle,
+            adapter->AdapterHandle,
             completeList,
             NDIS_SEND_COMPLETE_FLAGS_DISPATCH_LEVEL
             );
@@ -20,6 +20,7 @@ ZvioNetDeviceInit(
     UCHAR deviceStatus;
     ULONGLONG deviceFeatures;
     ULONGLONG driverFeatures;
+    ULONG i;
 
     if (!Adapter->CommonCfg) {
         return STATUS_INVALID_DEVICE_STATE;
@@ -48,6 +49,7 @@ ZvioNetDeviceInit(
         VIRTIO_F_VERSION_1 |
         VIRTIO_F_RING_INDIRECT_DESC |
         VIRTIO_F_RING_EVENT_IDX |
+        VIRTIO_F_IN_ORDER |
         VIRTIO_NET_F_MAC |
         VIRTIO_NET_F_STATUS |
         VIRTIO_NET_F_MTU |
@@ -59,9 +61,25 @@ ZvioNetDeviceInit(
         VIRTIO_NET_F_GUEST_TSO6 |
         VIRTIO_NET_F_CTRL_VQ |
         VIRTIO_NET_F_CTRL_RX |
-        VIRTIO_NET_F_MRG_RXBUF
+        VIRTIO_NET_F_CTRL_GUEST_OFFLOADS |
+        VIRTIO_NET_F_NOTF_COAL |
+        VIRTIO_NET_F_VQ_NOTF_COAL |
+        VIRTIO_NET_F_MRG_RXBUF |
+        VIRTIO_NET_F_MQ |
+        VIRTIO_NET_F_RSS
         );
 
+    // Large receives without merged buffers need 64KB per buffer; go without
+    if (!(driverFeatures & VIRTIO_NET_F_MRG_RXBUF)) {
+        driverFeatures &= ~(VIRTIO_NET_F_GUEST_TSO4 | VIRTIO_NET_F_GUEST_TSO6);
+    }
+
+    // Queue pairs, RSS, guest offloads and coalescing go through the control queue
+    if (!(driverFeatures & VIRTIO_NET_F_CTRL_VQ)) {
+        driverFeatures &= ~(VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS | VIRTIO_NET_F_CTRL_GUEST_OFFLOADS |
+                            VIRTIO_NET_F_NOTF_COAL | VIRTIO_NET_F_VQ_NOTF_COAL);
+    }
+
     ZvioNetDbgPrint("Driver features: 0x%016llX", driverFeatures);
 
     status = ZvioNetSetDriverFeatures(Adapter, driverFeatures);
@@ -83,6 +101,11 @@ ZvioNetDeviceInit(
         return STATUS_DEVICE_FEATURE_NOT_SUPPORTED;
     }
 
+    // Merged frames are spread over page-sized buffers
+    Adapter->MergeRxBuffers = (driverFeatures & VIRTIO_NET_F_MRG_RXBUF) != 0;
+    Adapter->RxBufferSize = Adapter->MergeRxBuffers ?
+        ZVIONET_RX_MERGE_BUFFER_SIZE : ZVIONET_RX_BUFFER_SIZE;
+
     // Set up offload capabilities
     if (driverFeatures & VIRTIO_NET_F_CSUM) {
         Adapter->TxChecksumOffload = TRUE;
@@ -90,43 +113,96 @@ ZvioNetDeviceInit(
     if (driverFeatures & VIRTIO_NET_F_GUEST_CSUM) {
         Adapter->RxChecksumOffload = TRUE;
     }
-    if (driverFeatures & VIRTIO_NET_F_HOST_TSO4) {
+    // The device segments only frames it also checksums
+    if ((driverFeatures & VIRTIO_NET_F_CSUM) && (driverFeatures & VIRTIO_NET_F_HOST_TSO4)) {
         Adapter->LsoV2Ipv4 = TRUE;
     }
-    if (driverFeatures & VIRTIO_NET_F_HOST_TSO6) {
+    if ((driverFeatures & VIRTIO_NET_F_CSUM) && (driverFeatures & VIRTIO_NET_F_HOST_TSO6)) {
         Adapter->LsoV2Ipv6 = TRUE;
     }
-
-    // Create virtqueues (0=RX, 1=TX)
-    status = ZvioNetQueueCreate(Adapter, 0, &Adapter->RxQueue);
-    if (!NT_SUCCESS(status)) {
-        ZvioNetDbgError("Failed to create RX queue");
-        ZvioNetSetDeviceStatus(Adapter, VIRTIO_STATUS_FAILED);
-        return status;
+    // IPv4 segments are coalesced in software too; IPv6 only by the host
+    if (driverFeatures & VIRTIO_NET_F_GUEST_CSUM) {
+        Adapter->RscIpv4 = TRUE;
+        Adapter->RscIpv6 = (driverFeatures & VIRTIO_NET_F_GUEST_TSO6) != 0;
     }
 
-    status = ZvioNetQueueCreate(Adapter, 1, &Adapter->TxQueue);
-    if (!NT_SUCCESS(status)) {
-        ZvioNetDbgError("Failed to create TX queue");
-        ZvioNetQueueDestroy(Adapter->RxQueue);
-        Adapter->RxQueue = NULL;
-        ZvioNetSetDeviceStatus(Adapter, VIRTIO_STATUS_FAILED);
-        return status;
+    // Create the control queue first; it decides whether we can go multi-queue
+    Adapter->MaxPairs = 1;
+    if ((driverFeatures & (VIRTIO_NET_F_MQ | VIRTIO_NET_F_RSS)) && Adapter->DeviceCfg) {
+        Adapter->MaxPairs = READ_REGISTER_USHORT(&Adapter->DeviceCfg->MaxVirtqueuePairs);
+        if (Adapter->MaxPairs == 0) {
+            Adapter->MaxPairs = 1;
+        }
     }
 
-    // Create control queue if available
     if (driverFeatures & VIRTIO_NET_F_CTRL_VQ) {
-        status = ZvioNetQueueCreate(Adapter, 2, &Adapter->CtrlQueue);
+        status = ZvioNetQueueCreate(Adapter, (USHORT)(2 * Adapter->MaxPairs),
+            VIRTIO_MSI_NO_VECTOR, &Adapter->CtrlQueue);
         if (!NT_SUCCESS(status)) {
             ZvioNetDbgPrint("Control queue not available");
             // Not fatal
         }
     }
 
+    // One pair per processor, each with its own MSI-X message
+    Adapter->NumPairs = 1;
+    if (Adapter->CtrlQueue) {
+        Adapter->NumPairs = min(Adapter->MaxPairs, ZVIONET_MAX_QUEUE_PAIRS);
+        Adapter->NumPairs = min(Adapter->NumPairs,
+            NdisGroupActiveProcessorCount(ALL_PROCESSOR_GROUPS));
+        if (Adapter->UseMsix) {
+            Adapter->NumPairs = min(Adapter->NumPairs, Adapter->MessageInfo->MessageCount);
+        }
+    }
+
+    // Create virtqueues (2N=RX, 2N+1=TX)
+    for (i = 0; i < Adapter->NumPairs; i++) {
+        PZVIONET_QUEUE_PAIR pair = &Adapter->Pairs[i];
+        USHORT vector = Adapter->UseMsix ? (USHORT)i : VIRTIO_MSI_NO_VECTOR;
+
+        status = ZvioNetQueueCreate(Adapter, (USHORT)(2 * i), vector, &pair->RxQueue);
+        if (NT_SUCCESS(status)) {
+            status = ZvioNetQueueCreate(Adapter, (USHORT)(2 * i + 1), vector, &pair->TxQueue);
+        }
+
+        if (!NT_SUCCESS(status)) {
+            if (i == 0) {
+                ZvioNetDbgError("Failed to create queue pair 0");
+                ZvioNetSetDeviceStatus(Adapter, VIRTIO_STATUS_FAILED);
+                return status;
+            }
+
+            //
+            // Run with the pairs we have
+            //
+            ZvioNetDbgPrint("Queue pair %d not available", i);
+            if (pair->RxQueue) {
+                ZvioNetQueueDestroy(pair->RxQueue);
+                pair->RxQueue = NULL;
+            }
+            Adapter->NumPairs = i;
+            break;
+        }
+    }
+
+    Adapter->RssSupported = (driverFeatures & VIRTIO_NET_F_RSS) && Adapter->NumPairs > 1;
+    Adapter->RssEnabled = FALSE;
+    ZvioNetRssInitPairs(Adapter);
+
     // Set DRIVER_OK
     deviceStatus = ZvioNetGetDeviceStatus(Adapter);
     ZvioNetSetDeviceStatus(Adapter, deviceStatus | VIRTIO_STATUS_DRIVER_OK);
 
+    // The device starts with one pair until told otherwise
+    if (Adapter->NumPairs > 1 &&
+        ZvioNetCtrlSetQueuePairs(Adapter, (USHORT)Adapter->NumPairs) != NDIS_STATUS_SUCCESS) {
+        ZvioNetDbgError("Failed to enable %d queue pairs", Adapter->NumPairs);
+        Adapter->NumPairs = 1;
+        Adapter->RssSupported = FALSE;
+        ZvioNetRssInitPairs(Adapter);
+    }
+
+    ZvioNetDbgPrint("Using %d of %d queue pairs", Adapter->NumPairs, Adapter->MaxPairs);
     ZvioNetDbgPrint("VirtIO network device initialized");
     return STATUS_SUCCESS;
 }
@@ -9,11 +9,15 @@
 
 /*
  * ZvioNetQueueCreate - Create and initialize a virtqueue
+ *
+ * MsixVector is the MSI-X message the queue signals, or
+ * VIRTIO_MSI_NO_VECTOR for a queue that is only polled.
  */
 NTSTATUS
 ZvioNetQueueCreate(
     _In_ PZVIONET_ADAPTER Adapter,
     _In_ USHORT Index,
+    _In_ USHORT MsixVector,
     _Out_ PZVIONET_VIRTQUEUE *Queue
     )
 {
@@ -53,12 +57,15 @@ ZvioNetQueueCreate(
     vq->Index = Index;
     vq->Size = queueSize;
     vq->Adapter = Adapter;
+    vq->EventIdx = (Adapter->DriverFeatures & VIRTIO_F_RING_EVENT_IDX) != 0;
+    vq->InOrder = (Adapter->DriverFeatures & VIRTIO_F_IN_ORDER) != 0;
+    vq->Indirect = (Adapter->DriverFeatures & VIRTIO_F_RING_INDIRECT_DESC) != 0;
 
     NdisAllocateSpinLock(&vq->Lock);
 
-    descSize = sizeof(VRING_DESC) * queueSize;
-    availSize = sizeof(USHORT) * (3 + queueSize);
-    usedSize = sizeof(USHORT) * 3 + sizeof(VRING_USED_ELEM) * queueSize;
+    descSize = ZVIO_VRING_DESC_SIZE(queueSize);
+    availSize = ZVIO_VRING_AVAIL_SIZE(queueSize);
+    usedSize = ZVIO_VRING_USED_SIZE(queueSize);
     totalSize = ROUND_TO_PAGES(descSize) + ROUND_TO_PAGES(availSize) + ROUND_TO_PAGES(usedSize);
 
     status = NdisMAllocateSharedMemory(
@@ -121,6 +128,22 @@ ZvioNetQueueCreate(
     USHORT notifyOff = READ_REGISTER_USHORT(&Adapter->CommonCfg->QueueNotifyOff);
     vq->NotifyAddr = (PUCHAR)Adapter->NotifyBase + notifyOff * Adapter->NotifyOffMultiplier;
 
+    if (Adapter->UseMsix) {
+        //
+        // The device reads back NO_VECTOR when it cannot map the message
+        //
+        WRITE_REGISTER_USHORT(&Adapter->CommonCfg->QueueMsixVector, MsixVector);
+        if (MsixVector != VIRTIO_MSI_NO_VECTOR &&
+            READ_REGISTER_USHORT(&Adapter->CommonCfg->QueueMsixVector) != MsixVector) {
+            ZvioNetDbgError("Queue %d rejected MSI-X vector %d", Index, MsixVector);
+            NdisFreeMemory(vq->DescData, queueSize * sizeof(PVOID), 0);
+            NdisMFreeSharedMemory(Adapter->AdapterHandle, vq->RingBufferSize, FALSE, vq->RingBuffer, vq->RingBufferPA);
+            NdisFreeSpinLock(&vq->Lock);
+            NdisFreeMemory(vq, sizeof(ZVIONET_VIRTQUEUE), 0);
+            return STATUS_DEVICE_CONFIGURATION_ERROR;
+        }
+    }
+
     WRITE_REGISTER_USHORT(&Adapter->CommonCfg->QueueEnable, 1);
 
     *Queue = vq;
@@ -168,7 +191,6 @@ ZvioNetQueueAddBuffer(
     )
 {
     USHORT descIdx;
-    USHORT availIdx;
 
     NdisAcquireSpinLock(&Queue->Lock);
 
@@ -188,10 +210,7 @@ ZvioNetQueueAddBuffer(
 
     Queue->DescData[descIdx] = UserData;
 
-    availIdx = Queue->Avail->Idx & (Queue->Size - 1);
-    Queue->Avail->Ring[availIdx] = descIdx;
-    KeMemoryBarrier();
-    Queue->Avail->Idx++;
+    ZVIO_VRING_PUBLISH(Queue, descIdx);
 
     NdisReleaseSpinLock(&Queue->Lock);
     return STATUS_SUCCESS;
@@ -250,10 +269,7 @@ ZvioNetQueueAddBufferChain(
     Queue->Desc[descIdx].Next = 0xFFFF;
     Queue->DescData[head] = UserData;
 
-    USHORT availIdx = Queue->Avail->Idx & (Queue->Size - 1);
-    Queue->Avail->Ring[availIdx] = head;
-    KeMemoryBarrier();
-    Queue->Avail->Idx++;
+    ZVIO_VRING_PUBLISH(Queue, head);
 
     NdisReleaseSpinLock(&Queue->Lock);
 
@@ -262,33 +278,128 @@ ZvioNetQueueAddBufferChain(
 }
 
 /*
- * ZvioNetQueueGetBuffer - Get a completed buffer
+ * ZvioNetQueuePostDescriptors - Add a prepared descriptor chain
+ *
+ * The caller holds Queue->Lock and fills Descs with Addr, Len and the
+ * WRITE flag. With VIRTIO_F_RING_INDIRECT_DESC the array itself is
+ * posted as one indirect descriptor, so a fragmented frame costs one
+ * ring entry. Otherwise its entries are copied into free ring
+ * descriptors.
  */
-PVOID
-ZvioNetQueueGetBuffer(
+NTSTATUS
+ZvioNetQueuePostDescriptors(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Inout_updates_(Count) PVRING_DESC Descs,
+    _In_ PHYSICAL_ADDRESS DescsPA,
+    _In_ USHORT Count,
+    _In_opt_ PVOID UserData
+    )
+{
+    BOOLEAN indirect = Queue->Indirect && Count > 1;
+    USHORT needed = indirect ? 1 : Count;
+    USHORT head;
+    USHORT descIdx;
+    USHORT i;
+
+    if (Count == 0 || (!indirect && Count > Queue->Size)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    if (Queue->NumFree < needed) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    head = Queue->FreeHead;
+
+    if (indirect) {
+        for (i = 0; i < Count; i++) {
+            Descs[i].Flags &= VRING_DESC_F_WRITE;
+            if (i + 1 < Count) {
+                Descs[i].Flags |= VRING_DESC_F_NEXT;
+                Descs[i].Next = i + 1;
+            } else {
+                Descs[i].Next = 0;
+            }
+        }
+
+        Queue->FreeHead = Queue->Desc[head].Next;
+        Queue->NumFree--;
+
+        Queue->Desc[head].Addr = DescsPA.QuadPart;
+        Queue->Desc[head].Len = Count * sizeof(VRING_DESC);
+        Queue->Desc[head].Flags = VRING_DESC_F_INDIRECT;
+        Queue->Desc[head].Next = 0xFFFF;
+    } else {
+        for (i = 0; i < Count; i++) {
+            descIdx = Queue->FreeHead;
+            Queue->FreeHead = Queue->Desc[descIdx].Next;
+            Queue->NumFree--;
+
+            Queue->Desc[descIdx].Addr = Descs[i].Addr;
+            Queue->Desc[descIdx].Len = Descs[i].Len;
+            Queue->Desc[descIdx].Flags = Descs[i].Flags & VRING_DESC_F_WRITE;
+
+            if (i + 1 < Count) {
+                Queue->Desc[descIdx].Flags |= VRING_DESC_F_NEXT;
+            } else {
+                Queue->Desc[descIdx].Next = 0xFFFF;
+            }
+        }
+    }
+
+    Queue->DescData[head] = UserData;
+
+    ZVIO_VRING_PUBLISH(Queue, head);
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioNetQueueAddDescriptors - Add a prepared descriptor chain
+ */
+NTSTATUS
+ZvioNetQueueAddDescriptors(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Inout_updates_(Count) PVRING_DESC Descs,
+    _In_ PHYSICAL_ADDRESS DescsPA,
+    _In_ USHORT Count,
+    _In_opt_ PVOID UserData
+    )
+{
+    NTSTATUS status;
+
+    NdisAcquireSpinLock(&Queue->Lock);
+    status = ZvioNetQueuePostDescriptors(Queue, Descs, DescsPA, Count, UserData);
+    NdisReleaseSpinLock(&Queue->Lock);
+
+    return status;
+}
+
+/*
+ * ZvioNetQueueReap - Take the next used chain; the caller holds Queue->Lock
+ *
+ * Ring protocol, including in-order batches: ZVIO_VRING_POP_USED.
+ */
+static PVOID
+ZvioNetQueueReap(
     _In_ PZVIONET_VIRTQUEUE Queue,
     _Out_ PULONG Length
     )
 {
-    USHORT usedIdx;
     USHORT headIdx;
     USHORT descIdx;
     PVOID userData;
+    BOOLEAN lengthKnown;
+    ULONG inLength = 0;
 
     *Length = 0;
 
-    NdisAcquireSpinLock(&Queue->Lock);
-
-    if (Queue->LastUsedIdx == Queue->Used->Idx) {
-        NdisReleaseSpinLock(&Queue->Lock);
+    if (!ZVIO_VRING_HAS_USED(Queue)) {
         return NULL;
     }
 
-    usedIdx = Queue->LastUsedIdx & (Queue->Size - 1);
-    headIdx = (USHORT)Queue->Used->Ring[usedIdx].Id;
-    *Length = Queue->Used->Ring[usedIdx].Len;
-
-    Queue->LastUsedIdx++;
+    ZVIO_VRING_POP_USED(Queue, headIdx, *Length, lengthKnown);
+    ZVIO_VRING_ASK_NEXT(Queue);
 
     userData = Queue->DescData[headIdx];
     Queue->DescData[headIdx] = NULL;
@@ -298,6 +409,10 @@ ZvioNetQueueGetBuffer(
         USHORT nextIdx = (Queue->Desc[descIdx].Flags & VRING_DESC_F_NEXT) ?
             Queue->Desc[descIdx].Next : 0xFFFF;
 
+        if (Queue->Desc[descIdx].Flags & VRING_DESC_F_WRITE) {
+            inLength += Queue->Desc[descIdx].Len;
+        }
+
         Queue->Desc[descIdx].Next = Queue->FreeHead;
         Queue->FreeHead = descIdx;
         Queue->NumFree++;
@@ -305,25 +420,117 @@ ZvioNetQueueGetBuffer(
         descIdx = nextIdx;
     }
 
+    if (!lengthKnown) {
+        *Length = inLength;
+    }
+
+    return userData;
+}
+
+/*
+ * ZvioNetQueueGetBuffer - Get a completed buffer
+ */
+PVOID
+ZvioNetQueueGetBuffer(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Out_ PULONG Length
+    )
+{
+    PVOID userData;
+
+    NdisAcquireSpinLock(&Queue->Lock);
+    userData = ZvioNetQueueReap(Queue, Length);
     NdisReleaseSpinLock(&Queue->Lock);
+
     return userData;
 }
 
+/*
+ * ZvioNetQueueGetBuffers - Get up to MaxCount completed buffers at once
+ */
+ULONG
+ZvioNetQueueGetBuffers(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _Out_writes_to_(MaxCount, return) PVOID *Buffers,
+    _In_ ULONG MaxCount
+    )
+{
+    ULONG length;
+    ULONG count = 0;
+
+    NdisAcquireSpinLock(&Queue->Lock);
+
+    while (count < MaxCount) {
+        Buffers[count] = ZvioNetQueueReap(Queue, &length);
+        if (!Buffers[count]) {
+            break;
+        }
+        count++;
+    }
+
+    NdisReleaseSpinLock(&Queue->Lock);
+
+    return count;
+}
+
+/*
+ * ZvioNetQueueHasUsed - Check for used entries not yet reaped
+ *
+ * Lock-free, like ZVIO_VRING_HAS_USED.
+ */
+BOOLEAN
+ZvioNetQueueHasUsed(
+    _In_ PZVIONET_VIRTQUEUE Queue
+    )
+{
+    KeMemoryBarrier();
+    return ZVIO_VRING_HAS_USED(Queue);
+}
+
 /*
  * ZvioNetQueueKick - Notify the device
+ *
+ * Suppression as in ZVIO_VRING_PREPARE_KICK. Returns whether the device
+ * was notified.
  */
-VOID
+BOOLEAN
 ZvioNetQueueKick(
     _In_ PZVIONET_VIRTQUEUE Queue
     )
 {
-    KeMemoryBarrier();
+    BOOLEAN notify;
 
-    if (Queue->Used->Flags & VRING_USED_F_NO_NOTIFY) {
-        return;
-    }
+    NdisAcquireSpinLock(&Queue->Lock);
+    ZVIO_VRING_PREPARE_KICK(Queue, notify);
+    NdisReleaseSpinLock(&Queue->Lock);
 
-    if (Queue->NotifyAddr) {
-        WRITE_REGISTER_USHORT((PUSHORT)Queue->NotifyAddr, Queue->Index);
+    if (!notify || !Queue->NotifyAddr) {
+        return FALSE;
     }
+
+    WRITE_REGISTER_USHORT((PUSHORT)Queue->NotifyAddr, Queue->Index);
+    return TRUE;
+}
+
+/*
+ * ZvioNetQueueEnableInterrupts - Enable/disable queue interrupts
+ *
+ * Event index handling: ZVIO_VRING_SET_INTERRUPTS.
+ */
+BOOLEAN
+ZvioNetQueueEnableInterrupts(
+    _In_ PZVIONET_VIRTQUEUE Queue,
+    _In_ BOOLEAN Enable
+    )
+{
+    BOOLEAN wasEnabled;
+
+    NdisAcquireSpinLock(&Queue->Lock);
+
+    wasEnabled = !Queue->InterruptsOff;
+    ZVIO_VRING_SET_INTERRUPTS(Queue, Enable);
+
+    NdisReleaseSpinLock(&Queue->Lock);
+
+    return wasEnabled;
 }
@@ -74,6 +74,8 @@ ZvioBusEnumerateChildren(
     WDF_OBJECT_ATTRIBUTES pdoAttributes;
     PZVIO_PDO_CONTEXT pdoContext;
     const ZVIO_DEVICE_INFO *deviceInfo;
+    ZVIO_BUS_INTERFACE busInterface;
+    WDF_QUERY_INTERFACE_CONFIG qiConfig;
     DECLARE_UNICODE_STRING_SIZE(hardwareId, 128);
     DECLARE_UNICODE_STRING_SIZE(instanceId, 32);
     DECLARE_UNICODE_STRING_SIZE(compatibleId, 128);
@@ -178,6 +180,23 @@ ZvioBusEnumerateChildren(
     pdoContext = ZvioGetPdoContext(hChild);
     pdoContext->DeviceType = DeviceContext->DeviceType;
 
+    //
+    // Let the function driver find the interrupt routing of its queues
+    //
+    status = ZvioBusQueryInterface(DeviceContext, pdoContext,
+                                   &GUID_ZVIO_BUS_INTERFACE, (PINTERFACE)&busInterface);
+    if (NT_SUCCESS(status)) {
+        WDF_QUERY_INTERFACE_CONFIG_INIT(&qiConfig, (PINTERFACE)&busInterface,
+                                        &GUID_ZVIO_BUS_INTERFACE, NULL);
+
+        status = WdfDeviceAddQueryInterface(hChild, &qiConfig);
+        if (!NT_SUCCESS(status)) {
+            ZvioDbgError("WdfDeviceAddQueryInterface failed: 0x%08X", status);
+            WdfObjectDelete(hChild);
+            return status;
+        }
+    }
+
     //
     // Add the PDO to the bus
     //
@@ -202,6 +221,8 @@ Cleanup:
  * ZvioBusQueryInterface - Handle IRP_MN_QUERY_INTERFACE for child PDOs
  *
  * This allows child function drivers to access the parent VirtIO resources.
+ * The interface lives as long as the parent FDO, which outlives its
+ * children, so referencing is a no-op.
  */
 NTSTATUS
 ZvioBusQueryInterface(
@@ -211,18 +232,24 @@ ZvioBusQueryInterface(
     _Out_ PINTERFACE Interface
     )
 {
-    UNREFERENCED_PARAMETER(DeviceContext);
+    PZVIO_BUS_INTERFACE busInterface;
+
     UNREFERENCED_PARAMETER(PdoContext);
-    UNREFERENCED_PARAMETER(InterfaceType);
-    UNREFERENCED_PARAMETER(Interface);
 
-    //
-    // TODO: Implement a custom interface that allows child drivers
-    // (zvioblk, zvionet, etc.) to access virtqueues and device config.
-    //
-    // For now, child drivers will need to re-probe the PCI device
-    // or we can expose this through a custom IOCTL.
-    //
+    if (!IsEqualGUID(InterfaceType, &GUID_ZVIO_BUS_INTERFACE)) {
+        return STATUS_NOT_SUPPORTED;
+    }
 
-    return STATUS_NOT_SUPPORTED;
+    busInterface = (PZVIO_BUS_INTERFACE)Interface;
+    RtlZeroMemory(busInterface, sizeof(ZVIO_BUS_INTERFACE));
+
+    busInterface->Header.Size = sizeof(ZVIO_BUS_INTERFACE);
+    busInterface->Header.Version = ZVIO_BUS_INTERFACE_VERSION;
+    busInterface->Header.Context = DeviceContext;
+    busInterface->Header.InterfaceReference = WdfDeviceInterfaceReferenceNoOp;
+    busInterface->Header.InterfaceDereference = WdfDeviceInterfaceDereferenceNoOp;
+    busInterface->NumQueues = DeviceContext->NumQueues;
+    busInterface->GetQueueInterrupt = ZvioBusGetQueueInterrupt;
+
+    return STATUS_SUCCESS;
 }
@@ -94,9 +94,9 @@ ZvioEvtDeviceAdd(
     NTSTATUS status;
     WDF_OBJECT_ATTRIBUTES deviceAttributes;
     WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
+    WDF_FDO_EVENT_CALLBACKS fdoCallbacks;
     WDFDEVICE device;
     PZVIO_DEVICE_CONTEXT deviceContext;
-    WDF_INTERRUPT_CONFIG interruptConfig;
 
     PAGED_CODE();
     UNREFERENCED_PARAMETER(Driver);
@@ -118,6 +118,14 @@ ZvioEvtDeviceAdd(
     pnpPowerCallbacks.EvtDeviceD0Exit = ZvioEvtDeviceD0Exit;
     WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
+    //
+    // MSI-X affinity is chosen in the resource requirements
+    //
+    WDF_FDO_EVENT_CALLBACKS_INIT(&fdoCallbacks);
+    fdoCallbacks.EvtDeviceFilterRemoveResourceRequirements =
+        ZvioEvtDeviceFilterRemoveResourceRequirements;
+    WdfFdoInitSetEventCallbacks(DeviceInit, &fdoCallbacks);
+
     //
     // Create the device object with context
     //
@@ -137,15 +145,8 @@ ZvioEvtDeviceAdd(
     deviceContext->Device = device;
     deviceContext->DeviceType = VirtioDevTypeUnknown;
 
-    //
-    // Create a default interrupt object (will be configured in PrepareHardware)
-    // This creates a single interrupt; MSI-X will configure multiple in PrepareHardware
-    //
-    WDF_INTERRUPT_CONFIG_INIT(&interruptConfig, ZvioEvtInterruptIsr, ZvioEvtInterruptDpc);
-    interruptConfig.EvtInterruptEnable = ZvioEvtInterruptEnable;
-    interruptConfig.EvtInterruptDisable = ZvioEvtInterruptDisable;
-
-    // We'll create interrupts in PrepareHardware after we know MSI-X vector count
+    // Interrupts are created in PrepareHardware, once the granted
+    // MSI-X message count is known
 
     //
     // Create DMA enabler for 64-bit addressing
@@ -279,6 +280,16 @@ ZvioEvtDevicePrepareHardware(
         return status;
     }
 
+    //
+    // Create one interrupt object per message before the queues are
+    // routed to them
+    //
+    status = ZvioCreateInterrupts(deviceContext, ResourcesTranslated);
+    if (!NT_SUCCESS(status)) {
+        ZvioDbgError("Failed to create interrupts: 0x%08X", status);
+        return status;
+    }
+
     //
     // Initialize the VirtIO device
     //
@@ -345,6 +356,8 @@ ZvioEvtDeviceReleaseHardware(
         ExFreePoolWithTag(deviceContext->Interrupts, ZVIO_POOL_TAG);
         deviceContext->Interrupts = NULL;
     }
+    deviceContext->NumInterrupts = 0;
+    deviceContext->UseMsix = FALSE;
 
     //
     // Unmap BARs
@@ -9,6 +9,49 @@
 
 #include "public.h"
 
+#ifdef ALLOC_PRAGMA
+#pragma alloc_text(PAGE, ZvioEvtDeviceFilterRemoveResourceRequirements)
+#endif
+
+/*
+ * ZvioQueueMsixVector - MSI-X vector that serves a queue
+ *
+ * Returns VIRTIO_MSI_NO_VECTOR without MSI-X.
+ */
+USHORT
+ZvioQueueMsixVector(
+    _In_ PZVIO_DEVICE_CONTEXT DeviceContext,
+    _In_ USHORT Index
+    )
+{
+    if (!DeviceContext->UseMsix || DeviceContext->NumInterrupts == 0) {
+        return VIRTIO_MSI_NO_VECTOR;
+    }
+
+    if (DeviceContext->NumInterrupts == 1) {
+        return VIRTIO_MSI_CONFIG_VECTOR;
+    }
+
+    return (USHORT)(1 + Index % (DeviceContext->NumInterrupts - 1));
+}
+
+/*
+ * ZvioInterruptServesQueue - Whether an interrupt object services a queue
+ */
+static BOOLEAN
+ZvioInterruptServesQueue(
+    _In_ PZVIO_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIO_INTERRUPT_CONTEXT InterruptContext,
+    _In_ PZVIO_VIRTQUEUE Queue
+    )
+{
+    if (!DeviceContext->UseMsix) {
+        return TRUE;
+    }
+
+    return Queue->MsixVector == InterruptContext->MessageId;
+}
+
 /*
  * ZvioEvtInterruptIsr - Interrupt Service Routine
  *
@@ -26,24 +69,12 @@ ZvioEvtInterruptIsr(
 
     deviceContext = ZvioGetDeviceContext(WdfInterruptGetDevice(Interrupt));
 
-    //
-    // For MSI-X, we know which queue triggered the interrupt
-    //
     if (deviceContext->UseMsix) {
         //
-        // MessageID 0 is typically for configuration changes
-        // MessageID 1+ are for virtqueues
+        // Messages are not shared; the DPC finds the queues of this
+        // vector from the interrupt context
         //
-        if (MessageID == VIRTIO_MSI_CONFIG_VECTOR) {
-            //
-            // Configuration change interrupt
-            //
-            ZvioDbgPrint("Config change interrupt");
-            claimed = TRUE;
-        } else if (MessageID > 0 && MessageID <= deviceContext->NumQueues) {
-            //
-            // Virtqueue interrupt
-            //
+        if (MessageID < deviceContext->NumInterrupts) {
             claimed = TRUE;
         }
     } else {
@@ -80,7 +111,9 @@ ZvioEvtInterruptIsr(
 /*
  * ZvioEvtInterruptDpc - Deferred Procedure Call for interrupt processing
  *
- * Called at DISPATCH_LEVEL to process completed buffers.
+ * Called at DISPATCH_LEVEL to process completed buffers of the queues
+ * served by this interrupt. The DPC runs on the processor that took
+ * the interrupt, which the affinity policy keeps close to the device.
  */
 VOID
 ZvioEvtInterruptDpc(
@@ -89,6 +122,7 @@ ZvioEvtInterruptDpc(
     )
 {
     PZVIO_DEVICE_CONTEXT deviceContext;
+    PZVIO_INTERRUPT_CONTEXT interruptContext;
     USHORT i;
     PZVIO_VIRTQUEUE queue;
     ULONG length;
@@ -97,13 +131,15 @@ ZvioEvtInterruptDpc(
     UNREFERENCED_PARAMETER(AssociatedObject);
 
     deviceContext = ZvioGetDeviceContext(WdfInterruptGetDevice(Interrupt));
+    interruptContext = ZvioGetInterruptContext(Interrupt);
+
+    if (deviceContext->UseMsix && interruptContext->MessageId == VIRTIO_MSI_CONFIG_VECTOR) {
+        ZvioDbgPrint("Config change interrupt");
+    }
 
-    //
-    // Process all queues for completed buffers
-    //
     for (i = 0; i < deviceContext->NumQueues; i++) {
         queue = deviceContext->Queues[i];
-        if (!queue) {
+        if (!queue || !ZvioInterruptServesQueue(deviceContext, interruptContext, queue)) {
             continue;
         }
 
@@ -132,19 +168,20 @@ ZvioEvtInterruptEnable(
     )
 {
     PZVIO_DEVICE_CONTEXT deviceContext;
+    PZVIO_INTERRUPT_CONTEXT interruptContext;
     USHORT i;
 
-    UNREFERENCED_PARAMETER(Interrupt);
-
     deviceContext = ZvioGetDeviceContext(AssociatedDevice);
+    interruptContext = ZvioGetInterruptContext(Interrupt);
 
-    ZvioDbgPrint("Enabling interrupts");
+    ZvioDbgPrint("Enabling interrupt %d", interruptContext->MessageId);
 
     //
-    // Enable interrupts on all queues
+    // Enable interrupts on the queues of this vector
     //
     for (i = 0; i < deviceContext->NumQueues; i++) {
-        if (deviceContext->Queues[i]) {
+        if (deviceContext->Queues[i] &&
+            ZvioInterruptServesQueue(deviceContext, interruptContext, deviceContext->Queues[i])) {
             ZvioQueueEnableInterrupts(deviceContext->Queues[i], TRUE);
         }
     }
@@ -162,19 +199,20 @@ ZvioEvtInterruptDisable(
     )
 {
     PZVIO_DEVICE_CONTEXT deviceContext;
+    PZVIO_INTERRUPT_CONTEXT interruptContext;
     USHORT i;
 
-    UNREFERENCED_PARAMETER(Interrupt);
-
     deviceContext = ZvioGetDeviceContext(AssociatedDevice);
+    interruptContext = ZvioGetInterruptContext(Interrupt);
 
-    ZvioDbgPrint("Disabling interrupts");
+    ZvioDbgPrint("Disabling interrupt %d", interruptContext->MessageId);
 
     //
-    // Disable interrupts on all queues
+    // Disable interrupts on the queues of this vector
     //
     for (i = 0; i < deviceContext->NumQueues; i++) {
-        if (deviceContext->Queues[i]) {
+        if (deviceContext->Queues[i] &&
+            ZvioInterruptServesQueue(deviceContext, interruptContext, deviceContext->Queues[i])) {
             ZvioQueueEnableInterrupts(deviceContext->Queues[i], FALSE);
         }
     }
@@ -182,10 +220,135 @@ ZvioEvtInterruptDisable(
     return STATUS_SUCCESS;
 }
 
+/*
+ * ZvioEvtDeviceFilterRemoveResourceRequirements - Set MSI-X affinity
+ *
+ * Interrupt affinity is part of the resource requirements, so it is
+ * chosen before the PnP manager assigns the messages. Each queue vector
+ * is pinned to its own processor of the device's NUMA node, in message
+ * order, wrapping when the node has fewer processors than vectors. The
+ * config vector stays on a processor close to the device. Without
+ * NUMA information the messages are spread across all processors.
+ */
+NTSTATUS
+ZvioEvtDeviceFilterRemoveResourceRequirements(
+    _In_ WDFDEVICE Device,
+    _In_ WDFIORESREQLIST IoResourceRequirementsList
+    )
+{
+    GROUP_AFFINITY nodeAffinity;
+    USHORT nodeCount = 0;
+    USHORT node;
+    ULONG listCount, descCount;
+    ULONG i, j;
+    ULONG message;
+    ULONG target;
+    ULONG bit = 0;
+    KAFFINITY remaining;
+    WDFIORESLIST ioResList;
+    PIO_RESOURCE_DESCRIPTOR descriptor;
+
+    PAGED_CODE();
+
+    RtlZeroMemory(&nodeAffinity, sizeof(nodeAffinity));
+
+    if (NT_SUCCESS(IoGetDeviceNumaNode(WdfDeviceWdmGetPhysicalDevice(Device), &node))) {
+        KeQueryNodeActiveAffinity(node, &nodeAffinity, &nodeCount);
+    }
+
+    listCount = WdfIoResourceRequirementsListGetCount(IoResourceRequirementsList);
+
+    for (i = 0; i < listCount; i++) {
+        ioResList = WdfIoResourceRequirementsListGetIoResList(IoResourceRequirementsList, i);
+        descCount = WdfIoResourceListGetCount(ioResList);
+        message = 0;
+
+        for (j = 0; j < descCount; j++) {
+            descriptor = WdfIoResourceListGetDescriptor(ioResList, j);
+
+            if (descriptor->Type != CmResourceTypeInterrupt ||
+                !(descriptor->Flags & CM_RESOURCE_INTERRUPT_MESSAGE)) {
+                continue;
+            }
+
+            if (nodeCount == 0) {
+                descriptor->u.Interrupt.AffinityPolicy = IrqPolicySpreadMessagesAcrossAllProcessors;
+            } else if (message == VIRTIO_MSI_CONFIG_VECTOR) {
+                descriptor->u.Interrupt.AffinityPolicy = IrqPolicyOneCloseProcessor;
+            } else {
+                //
+                // The n-th active processor of the node
+                //
+                target = (message - 1) % nodeCount;
+                remaining = nodeAffinity.Mask;
+
+                while (BitScanForward64(&bit, (ULONG64)remaining) && target--) {
+                    remaining &= remaining - 1;
+                }
+
+                descriptor->u.Interrupt.AffinityPolicy = IrqPolicySpecifiedProcessors;
+                descriptor->u.Interrupt.Group = nodeAffinity.Group;
+                descriptor->u.Interrupt.TargetedProcessors = (KAFFINITY)1 << bit;
+            }
+
+            message++;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+/*
+ * ZvioBusGetQueueInterrupt - Interrupt routing of a queue
+ *
+ * Exported to child drivers through ZVIO_BUS_INTERFACE. Callable at
+ * IRQL <= DISPATCH_LEVEL while the parent has its hardware.
+ */
+NTSTATUS
+ZvioBusGetQueueInterrupt(
+    _In_ PVOID Context,
+    _In_ USHORT QueueIndex,
+    _Out_ PZVIO_QUEUE_INTERRUPT_INFO Info
+    )
+{
+    PZVIO_DEVICE_CONTEXT deviceContext = (PZVIO_DEVICE_CONTEXT)Context;
+    PZVIO_VIRTQUEUE queue;
+    WDF_INTERRUPT_INFO interruptInfo;
+    USHORT interruptIndex;
+
+    RtlZeroMemory(Info, sizeof(ZVIO_QUEUE_INTERRUPT_INFO));
+
+    if (QueueIndex >= deviceContext->NumQueues || !deviceContext->Queues ||
+        !deviceContext->Queues[QueueIndex]) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    queue = deviceContext->Queues[QueueIndex];
+    Info->MessageId = queue->MsixVector;
+
+    if (!deviceContext->Interrupts || deviceContext->NumInterrupts == 0) {
+        return STATUS_DEVICE_NOT_READY;
+    }
+
+    interruptIndex = deviceContext->UseMsix ? queue->MsixVector : 0;
+    if (interruptIndex >= deviceContext->NumInterrupts) {
+        return STATUS_NOT_FOUND;
+    }
+
+    WDF_INTERRUPT_INFO_INIT(&interruptInfo);
+    WdfInterruptGetInfo(deviceContext->Interrupts[interruptIndex], &interruptInfo);
+
+    Info->Group = interruptInfo.Group;
+    Info->TargetProcessors = interruptInfo.TargetProcessorSet;
+
+    return STATUS_SUCCESS;
+}
+
 /*
  * ZvioCreateInterrupts - Create interrupt objects for the device
  *
- * Called during device initialization to set up MSI-X or legacy interrupts.
+ * Called from PrepareHardware, before the queues are created, so that
+ * each queue can be routed to its vector as it is set up.
  */
 NTSTATUS
 ZvioCreateInterrupts(
@@ -198,6 +361,7 @@ ZvioCreateInterrupts(
     PCM_PARTIAL_RESOURCE_DESCRIPTOR descriptor;
     ULONG interruptCount = 0;
     WDF_INTERRUPT_CONFIG interruptConfig;
+    WDF_OBJECT_ATTRIBUTES interruptAttributes;
     WDFINTERRUPT interrupt;
 
     //
@@ -249,7 +413,7 @@ ZvioCreateInterrupts(
     ZvioDbgPrint("Using %s interrupts", DeviceContext->UseMsix ? "MSI-X" : "legacy");
 
     //
-    // Create interrupt objects
+    // Create interrupt objects, one per message in message order
     //
     ULONG interruptIndex = 0;
     for (i = 0; i < WdfCmResourceListGetCount(ResourcesTranslated); i++) {
@@ -265,10 +429,12 @@ ZvioCreateInterrupts(
         interruptConfig.InterruptRaw = WdfCmResourceListGetDescriptor(
             DeviceContext->ResourcesRaw, i);
 
+        WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&interruptAttributes, ZVIO_INTERRUPT_CONTEXT);
+
         status = WdfInterruptCreate(
             DeviceContext->Device,
             &interruptConfig,
-            WDF_NO_OBJECT_ATTRIBUTES,
+            &interruptAttributes,
             &interrupt
             );
 
@@ -277,36 +443,11 @@ ZvioCreateInterrupts(
             return status;
         }
 
+        ZvioGetInterruptContext(interrupt)->MessageId = (USHORT)interruptIndex;
+
         DeviceContext->Interrupts[interruptIndex] = interrupt;
         interruptIndex++;
-    }
-
-    DeviceContext->NumInterrupts = (USHORT)interruptIndex;
-
-    //
-    // Configure MSI-X vectors for virtqueues
-    //
-    if (DeviceContext->UseMsix && DeviceContext->CommonCfg) {
-        //
-        // Set config vector
-        //
-        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->MsixConfig, VIRTIO_MSI_CONFIG_VECTOR);
-
-        //
-        // Set queue vectors (one per queue, up to available vectors)
-        //
-        for (i = 0; i < DeviceContext->NumQueues; i++) {
-            WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueSel, (USHORT)i);
-            KeMemoryBarrier();
-
-            if (i + 1 < DeviceContext->NumInterrupts) {
-                WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector, (USHORT)(i + 1));
-            } else {
-                // Share the last vector for remaining queues
-                WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector,
-                    DeviceContext->NumInterrupts - 1);
-            }
-        }
+        DeviceContext->NumInterrupts = (USHORT)interruptIndex;
     }
 
     ZvioDbgPrint("Interrupts configured successfully");
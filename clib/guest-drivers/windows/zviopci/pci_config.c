@@ -239,6 +239,7 @@ ZvioPciParseCapabilities(
                 if (NT_SUCCESS(status)) {
                     DeviceContext->NotifyBase = (PUCHAR)barVA + cap.Offset;
                     DeviceContext->NotifyOffMultiplier = notifyCap.NotifyOffMultiplier;
+                    DeviceContext->NotifyLength = cap.Length;
                     foundNotify = TRUE;
                     ZvioDbgPrint("Notify at BAR%d+0x%X, multiplier=%d",
                         cap.Bar, cap.Offset, notifyCap.NotifyOffMultiplier);
@@ -189,52 +189,9 @@ typedef struct _VIRTIO_PCI_COMMON_CFG {
 #define VIRTIO_F_NOTIFICATION_DATA      (1ULL << 38)
 
 //
-// Virtqueue Descriptor Flags
+// Virtqueue Ring Structures
 //
-#define VRING_DESC_F_NEXT               0x01
-#define VRING_DESC_F_WRITE              0x02
-#define VRING_DESC_F_INDIRECT           0x04
-
-//
-// Virtqueue Available Ring Flags
-//
-#define VRING_AVAIL_F_NO_INTERRUPT      0x01
-
-//
-// Virtqueue Used Ring Flags
-//
-#define VRING_USED_F_NO_NOTIFY          0x01
-
-//
-// Virtqueue Structures
-//
-#pragma pack(push, 1)
-typedef struct _VRING_DESC {
-    ULONGLONG   Addr;           // Physical address of buffer
-    ULONG       Len;            // Length of buffer
-    USHORT      Flags;          // VRING_DESC_F_*
-    USHORT      Next;           // Next descriptor index
-} VRING_DESC, *PVRING_DESC;
-
-typedef struct _VRING_AVAIL {
-    USHORT      Flags;          // VRING_AVAIL_F_*
-    USHORT      Idx;            // Next available index
-    USHORT      Ring[];         // Available descriptor indices
-    // Followed by: USHORT UsedEvent; (if VIRTIO_F_RING_EVENT_IDX)
-} VRING_AVAIL, *PVRING_AVAIL;
-
-typedef struct _VRING_USED_ELEM {
-    ULONG       Id;             // Descriptor index
-    ULONG       Len;            // Length written by device
-} VRING_USED_ELEM, *PVRING_USED_ELEM;
-
-typedef struct _VRING_USED {
-    USHORT          Flags;      // VRING_USED_F_*
-    USHORT          Idx;        // Next used index
-    VRING_USED_ELEM Ring[];     // Used elements
-    // Followed by: USHORT AvailEvent; (if VIRTIO_F_RING_EVENT_IDX)
-} VRING_USED, *PVRING_USED;
-#pragma pack(pop)
+#include "../common/zvio_vring.h"
 
 //
 // MSI-X Vector Constants
@@ -264,6 +221,13 @@ typedef struct _ZVIO_VIRTQUEUE {
     USHORT              NumFree;            // Number of free descriptors
     USHORT              FreeHead;           // First free descriptor
     USHORT              LastUsedIdx;        // Last seen used index
+    USHORT              KickedAvailIdx;     // Avail index at the last kick
+    BOOLEAN             EventIdx;           // VIRTIO_F_RING_EVENT_IDX negotiated
+    BOOLEAN             InterruptsOff;      // Interrupts disabled by the driver
+    BOOLEAN             InOrder;            // VIRTIO_F_IN_ORDER negotiated
+    BOOLEAN             InBatch;            // Reclaiming a batch used at once
+    USHORT              BatchLast;          // Head of its last chain
+    ULONG               BatchLen;           // Bytes the device wrote for that chain
 
     PVRING_DESC         Desc;               // Descriptor table
     PVRING_AVAIL        Avail;              // Available ring
@@ -274,6 +238,8 @@ typedef struct _ZVIO_VIRTQUEUE {
     PHYSICAL_ADDRESS    UsedPhys;           // Physical address of used ring
 
     PVOID               NotifyAddr;         // Queue-specific notify address
+    BOOLEAN             NotifyData;         // VIRTIO_F_NOTIFICATION_DATA negotiated
+    USHORT              MsixVector;         // MSI-X vector, VIRTIO_MSI_NO_VECTOR for INTx
     WDFSPINLOCK         Lock;               // Queue lock
 
     // Tracking for in-flight descriptors
@@ -305,6 +271,7 @@ typedef struct _ZVIO_DEVICE_CONTEXT {
     PVIRTIO_PCI_COMMON_CFG  CommonCfg;          // Common config structure
     PVOID                   NotifyBase;         // Notification base address
     ULONG                   NotifyOffMultiplier;// Notify offset multiplier
+    ULONG                   NotifyLength;       // Notify structure length
     PUCHAR                  IsrStatus;          // ISR status byte
     PVOID                   DeviceCfg;          // Device-specific config
     ULONG                   DeviceCfgLen;       // Device config length
@@ -329,6 +296,51 @@ typedef struct _ZVIO_DEVICE_CONTEXT {
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIO_DEVICE_CONTEXT, ZvioGetDeviceContext)
 
+//
+// Interrupt Object Context
+//
+// With MSI-X, vector 0 signals configuration changes and vector i + 1
+// serves queue i. Queues beyond the granted vectors share them round
+// robin; a single vector serves everything.
+//
+typedef struct _ZVIO_INTERRUPT_CONTEXT {
+    USHORT                  MessageId;          // MSI-X message, 0 for INTx
+} ZVIO_INTERRUPT_CONTEXT, *PZVIO_INTERRUPT_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ZVIO_INTERRUPT_CONTEXT, ZvioGetInterruptContext)
+
+//
+// Bus Interface for Child Drivers
+//
+// Returned for IRP_MN_QUERY_INTERFACE on a child PDO, so a function
+// driver can place its per-queue work on the processor that takes the
+// queue's interrupt.
+//
+// {5B0A8C4E-2F61-4D3A-9E57-C1A4D8B36F02}
+DEFINE_GUID(GUID_ZVIO_BUS_INTERFACE,
+    0x5b0a8c4e, 0x2f61, 0x4d3a, 0x9e, 0x57, 0xc1, 0xa4, 0xd8, 0xb3, 0x6f, 0x02);
+
+#define ZVIO_BUS_INTERFACE_VERSION      1
+
+typedef struct _ZVIO_QUEUE_INTERRUPT_INFO {
+    USHORT                  MessageId;          // MSI-X vector, VIRTIO_MSI_NO_VECTOR for INTx
+    USHORT                  Group;              // Processor group of the target
+    KAFFINITY               TargetProcessors;   // Processors the interrupt is delivered to
+} ZVIO_QUEUE_INTERRUPT_INFO, *PZVIO_QUEUE_INTERRUPT_INFO;
+
+typedef NTSTATUS
+(*PZVIO_GET_QUEUE_INTERRUPT)(
+    _In_ PVOID Context,
+    _In_ USHORT QueueIndex,
+    _Out_ PZVIO_QUEUE_INTERRUPT_INFO Info
+    );
+
+typedef struct _ZVIO_BUS_INTERFACE {
+    INTERFACE                   Header;         // Size, Version, Context, reference callbacks
+    USHORT                      NumQueues;      // Queues of the parent device
+    PZVIO_GET_QUEUE_INTERRUPT   GetQueueInterrupt;
+} ZVIO_BUS_INTERFACE, *PZVIO_BUS_INTERFACE;
+
 //
 // Child PDO Context (for bus enumeration)
 //
@@ -354,6 +366,7 @@ EVT_WDF_DEVICE_PREPARE_HARDWARE ZvioEvtDevicePrepareHardware;
 EVT_WDF_DEVICE_RELEASE_HARDWARE ZvioEvtDeviceReleaseHardware;
 EVT_WDF_DEVICE_D0_ENTRY ZvioEvtDeviceD0Entry;
 EVT_WDF_DEVICE_D0_EXIT ZvioEvtDeviceD0Exit;
+EVT_WDF_DEVICE_FILTER_RESOURCE_REQUIREMENTS ZvioEvtDeviceFilterRemoveResourceRequirements;
 
 //
 // Function Prototypes - PCI Configuration
@@ -463,6 +476,25 @@ EVT_WDF_INTERRUPT_DPC ZvioEvtInterruptDpc;
 EVT_WDF_INTERRUPT_ENABLE ZvioEvtInterruptEnable;
 EVT_WDF_INTERRUPT_DISABLE ZvioEvtInterruptDisable;
 
+NTSTATUS
+ZvioCreateInterrupts(
+    _In_ PZVIO_DEVICE_CONTEXT DeviceContext,
+    _In_ WDFCMRESLIST ResourcesTranslated
+    );
+
+USHORT
+ZvioQueueMsixVector(
+    _In_ PZVIO_DEVICE_CONTEXT DeviceContext,
+    _In_ USHORT Index
+    );
+
+NTSTATUS
+ZvioBusGetQueueInterrupt(
+    _In_ PVOID Context,
+    _In_ USHORT QueueIndex,
+    _Out_ PZVIO_QUEUE_INTERRUPT_INFO Info
+    );
+
 //
 // Function Prototypes - Bus Enumeration
 //
@@ -471,6 +503,14 @@ ZvioBusEnumerateChildren(
     _In_ PZVIO_DEVICE_CONTEXT DeviceContext
     );
 
+NTSTATUS
+ZvioBusQueryInterface(
+    _In_ PZVIO_DEVICE_CONTEXT DeviceContext,
+    _In_ PZVIO_PDO_CONTEXT PdoContext,
+    _In_ LPCGUID InterfaceType,
+    _Out_ PINTERFACE Interface
+    );
+
 //
 // Logging/Tracing
 //
@@ -73,7 +73,8 @@ ZvioDeviceInit(
         VIRTIO_F_VERSION_1 |
         VIRTIO_F_RING_INDIRECT_DESC |
         VIRTIO_F_RING_EVENT_IDX |
-        VIRTIO_F_IN_ORDER
+        VIRTIO_F_IN_ORDER |
+        VIRTIO_F_NOTIFICATION_DATA
         );
 
     ZvioDbgPrint("Driver features: 0x%016llX", driverFeatures);
@@ -101,6 +102,17 @@ ZvioDeviceInit(
         return STATUS_DEVICE_FEATURE_NOT_SUPPORTED;
     }
 
+    //
+    // Route configuration changes to vector 0; the queues get theirs
+    // as they are created
+    //
+    if (DeviceContext->UseMsix) {
+        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->MsixConfig, VIRTIO_MSI_CONFIG_VECTOR);
+        if (READ_REGISTER_USHORT(&DeviceContext->CommonCfg->MsixConfig) == VIRTIO_MSI_NO_VECTOR) {
+            ZvioDbgError("Device did not accept the config vector");
+        }
+    }
+
     //
     // Step 7: Read number of queues and allocate queue array
     //
@@ -342,6 +354,9 @@ ZvioQueueCreate(
     vq->Index = Index;
     vq->Size = queueSize;
     vq->DeviceContext = DeviceContext;
+    vq->EventIdx = (DeviceContext->DriverFeatures & VIRTIO_F_RING_EVENT_IDX) != 0;
+    vq->InOrder = (DeviceContext->DriverFeatures & VIRTIO_F_IN_ORDER) != 0;
+    vq->NotifyData = (DeviceContext->DriverFeatures & VIRTIO_F_NOTIFICATION_DATA) != 0;
 
     //
     // Create spinlock for queue
@@ -358,9 +373,9 @@ ZvioQueueCreate(
     // Available ring: 2 bytes header + 2 bytes per entry + 2 bytes event
     // Used ring: 2 bytes header + 8 bytes per entry + 2 bytes event
     //
-    descSize = sizeof(VRING_DESC) * queueSize;
-    availSize = sizeof(USHORT) * (3 + queueSize);  // flags + idx + ring + event
-    usedSize = sizeof(USHORT) * 3 + sizeof(VRING_USED_ELEM) * queueSize;
+    descSize = ZVIO_VRING_DESC_SIZE(queueSize);
+    availSize = ZVIO_VRING_AVAIL_SIZE(queueSize);
+    usedSize = ZVIO_VRING_USED_SIZE(queueSize);
 
     // Align to 4K page boundary
     totalSize = ROUND_TO_PAGES(descSize) + ROUND_TO_PAGES(availSize) + ROUND_TO_PAGES(usedSize);
@@ -444,11 +459,45 @@ ZvioQueueCreate(
     WRITE_REGISTER_ULONGLONG(&DeviceContext->CommonCfg->QueueDevice, vq->UsedPhys.QuadPart);
 
     //
-    // Calculate notify address for this queue
+    // Route the queue to its vector. A device that ran out of vectors
+    // reads back NO_VECTOR; the queue then shares the config vector.
+    //
+    vq->MsixVector = ZvioQueueMsixVector(DeviceContext, Index);
+
+    if (vq->MsixVector != VIRTIO_MSI_NO_VECTOR) {
+        WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector, vq->MsixVector);
+
+        if (READ_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector) != vq->MsixVector) {
+            ZvioDbgError("Queue %d: vector %d refused, sharing the config vector",
+                Index, vq->MsixVector);
+
+            vq->MsixVector = VIRTIO_MSI_CONFIG_VECTOR;
+            WRITE_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector, vq->MsixVector);
+
+            if (READ_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueMsixVector) != vq->MsixVector) {
+                ZvioDbgError("Queue %d: no MSI-X vector available", Index);
+                ZvioQueueDestroy(vq);
+                return STATUS_DEVICE_CONFIGURATION_ERROR;
+            }
+        }
+    }
+
+    //
+    // Calculate notify address for this queue once; kicks use it as is.
+    // The doorbell is 4 bytes wide with VIRTIO_F_NOTIFICATION_DATA.
     //
     USHORT notifyOff = READ_REGISTER_USHORT(&DeviceContext->CommonCfg->QueueNotifyOff);
-    vq->NotifyAddr = (PUCHAR)DeviceContext->NotifyBase +
-                     notifyOff * DeviceContext->NotifyOffMultiplier;
+    ULONG notifyOffset = (ULONG)notifyOff * DeviceContext->NotifyOffMultiplier;
+
+    if (notifyOffset + (vq->NotifyData ? sizeof(ULONG) : sizeof(USHORT)) >
+        DeviceContext->NotifyLength) {
+        ZvioDbgError("Queue %d: notify offset 0x%X outside the notify structure",
+            Index, notifyOffset);
+        ZvioQueueDestroy(vq);
+        return STATUS_DEVICE_CONFIGURATION_ERROR;
+    }
+
+    vq->NotifyAddr = (PUCHAR)DeviceContext->NotifyBase + notifyOffset;
 
     //
     // Enable the queue
@@ -516,7 +565,6 @@ ZvioQueueAddBuffer(
     )
 {
     USHORT descIdx;
-    USHORT availIdx;
 
     WdfSpinLockAcquire(Queue->Lock);
 
@@ -542,13 +590,7 @@ ZvioQueueAddBuffer(
 
     Queue->DescData[descIdx] = UserData;
 
-    //
-    // Add to available ring
-    //
-    availIdx = Queue->Avail->Idx & (Queue->Size - 1);
-    Queue->Avail->Ring[availIdx] = descIdx;
-    KeMemoryBarrier();
-    Queue->Avail->Idx++;
+    ZVIO_VRING_PUBLISH(Queue, descIdx);
 
     WdfSpinLockRelease(Queue->Lock);
 
@@ -557,6 +599,8 @@ ZvioQueueAddBuffer(
 
 /*
  * ZvioQueueGetBuffer - Get a completed buffer from the virtqueue
+ *
+ * Ring protocol, including in-order batches: ZVIO_VRING_POP_USED.
  */
 PVOID
 ZvioQueueGetBuffer(
@@ -564,8 +608,8 @@ ZvioQueueGetBuffer(
     _Out_ PULONG Length
     )
 {
-    USHORT usedIdx;
     USHORT descIdx;
+    BOOLEAN lengthKnown;
     PVOID userData;
 
     *Length = 0;
@@ -575,19 +619,17 @@ ZvioQueueGetBuffer(
     //
     // Check if there are any used buffers
     //
-    if (Queue->LastUsedIdx == Queue->Used->Idx) {
+    if (!ZVIO_VRING_HAS_USED(Queue)) {
         WdfSpinLockRelease(Queue->Lock);
         return NULL;
     }
 
-    //
-    // Get the used element
-    //
-    usedIdx = Queue->LastUsedIdx & (Queue->Size - 1);
-    descIdx = (USHORT)Queue->Used->Ring[usedIdx].Id;
-    *Length = Queue->Used->Ring[usedIdx].Len;
+    ZVIO_VRING_POP_USED(Queue, descIdx, *Length, lengthKnown);
+    ZVIO_VRING_ASK_NEXT(Queue);
 
-    Queue->LastUsedIdx++;
+    if (!lengthKnown && (Queue->Desc[descIdx].Flags & VRING_DESC_F_WRITE)) {
+        *Length = Queue->Desc[descIdx].Len;
+    }
 
     //
     // Get user data and return descriptor to free list
@@ -606,31 +648,43 @@ ZvioQueueGetBuffer(
 
 /*
  * ZvioQueueKick - Notify the device of new buffers
+ *
+ * Suppression as in ZVIO_VRING_PREPARE_KICK. With
+ * VIRTIO_F_NOTIFICATION_DATA the doorbell also carries the new avail
+ * index, so the device need not fetch it from the ring.
  */
 VOID
 ZvioQueueKick(
     _In_ PZVIO_VIRTQUEUE Queue
     )
 {
-    KeMemoryBarrier();
+    BOOLEAN notify;
+    USHORT availIdx;
 
-    //
-    // Check if notification is needed
-    //
-    if (Queue->Used->Flags & VRING_USED_F_NO_NOTIFY) {
+    WdfSpinLockAcquire(Queue->Lock);
+    ZVIO_VRING_PREPARE_KICK(Queue, notify);
+    availIdx = Queue->KickedAvailIdx;
+    WdfSpinLockRelease(Queue->Lock);
+
+    if (!notify || !Queue->NotifyAddr) {
         return;
     }
 
-    //
-    // Write to the notify address
-    //
-    if (Queue->NotifyAddr) {
+    if (Queue->NotifyData) {
+        //
+        // Split ring: vqn in bits 0-15, avail index in bits 16-31
+        //
+        WRITE_REGISTER_ULONG((PULONG)Queue->NotifyAddr,
+                             (ULONG)Queue->Index | ((ULONG)availIdx << 16));
+    } else {
         WRITE_REGISTER_USHORT((PUSHORT)Queue->NotifyAddr, Queue->Index);
     }
 }
 
 /*
  * ZvioQueueEnableInterrupts - Enable/disable queue interrupts
+ *
+ * Event index handling: ZVIO_VRING_SET_INTERRUPTS.
  */
 BOOLEAN
 ZvioQueueEnableInterrupts(
@@ -642,15 +696,8 @@ ZvioQueueEnableInterrupts(
 
     WdfSpinLockAcquire(Queue->Lock);
 
-    wasEnabled = !(Queue->Avail->Flags & VRING_AVAIL_F_NO_INTERRUPT);
-
-    if (Enable) {
-        Queue->Avail->Flags &= ~VRING_AVAIL_F_NO_INTERRUPT;
-    } else {
-        Queue->Avail->Flags |= VRING_AVAIL_F_NO_INTERRUPT;
-    }
-
-    KeMemoryBarrier();
+    wasEnabled = !Queue->InterruptsOff;
+    ZVIO_VRING_SET_INTERRUPTS(Queue, Enable);
 
     WdfSpinLockRelease(Queue->Lock);
 
@@ -3,15 +3,24 @@
  */
 
 #include "libvirt_wrapper.h"
+#include "zx_metrics.h"
 #include <libvirt/libvirt.h>
 #include <libvirt/virterror.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
-
-/* Global connection handle */
+#include <stdarg.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* Primary connection handle, the first of the pool */
 static virConnectPtr g_conn = NULL;
-static char g_last_error[1024] = {0};
+static __thread char g_last_error[1024] = {0};
 
 /* Helper to set error message */
 static void set_error(const char* msg) {
@@ -23,29 +32,628 @@ static void set_error(const char* msg) {
     }
 }
 
+/*
+ * Connection pool
+ *
+ * libvirtd serves a bounded number of calls per client at a time, so
+ * parallel operations are spread over several connections. Each thread
+ * sticks to one, keeping its cached domain handles on it. The primary
+ * connection also carries the event callbacks. A connection found dead
+ * is reopened, at most once per LV_RECONNECT_INTERVAL_MS; the old one
+ * may still be in use by other threads and is only closed on
+ * disconnect.
+ */
+
+#define LV_RECONNECT_INTERVAL_MS 1000
+
+static virConnectPtr _Atomic g_pool[LV_POOL_MAX];
+static int g_pool_size = 0;
+static char* g_pool_uri = NULL;
+static uint64_t g_pool_retry_ms[LV_POOL_MAX];
+static virConnectPtr* g_retired = NULL;
+static int g_retired_count = 0;
+static pthread_mutex_t g_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic unsigned int g_pool_next = 0;
+static __thread int t_pool_slot = -1;
+
+static void events_register(void);
+static void dom_cache_forget(virConnectPtr conn, const char* name, const char* uuid);
+
+static uint64_t monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static virConnectPtr pool_open(const char* uri) {
+    virConnectPtr conn = virConnectOpen(uri);
+
+    if (conn != NULL) {
+        /* Needs the event loop; without one a dead peer shows on the next call */
+        virConnectSetKeepAlive(conn, 5, 3);
+    }
+    return conn;
+}
+
+/* Replace the dead connection of a slot, unless another thread did */
+static virConnectPtr pool_reconnect(int slot, virConnectPtr dead) {
+    virConnectPtr conn;
+
+    pthread_mutex_lock(&g_pool_lock);
+    conn = atomic_load(&g_pool[slot]);
+    if (conn == dead && g_pool_size > 0 && monotonic_ms() >= g_pool_retry_ms[slot]) {
+        virConnectPtr* retired = realloc(g_retired, sizeof(virConnectPtr) * (g_retired_count + 1));
+        virConnectPtr fresh = retired ? pool_open(g_pool_uri) : NULL;
+
+        if (retired) {
+            g_retired = retired;
+        }
+        if (fresh != NULL) {
+            g_retired[g_retired_count++] = dead;
+            atomic_store(&g_pool[slot], fresh);
+            dom_cache_forget(dead, NULL, NULL);
+            if (slot == 0) {
+                g_conn = fresh;
+                events_register();
+            }
+            conn = fresh;
+        } else {
+            /* Calls fail on the dead connection until the next attempt */
+            g_pool_retry_ms[slot] = monotonic_ms() + LV_RECONNECT_INTERVAL_MS;
+        }
+    }
+    pthread_mutex_unlock(&g_pool_lock);
+
+    return conn;
+}
+
+/* Connection for the calling thread */
+static virConnectPtr conn_get(void) {
+    int slot = 0;
+
+    if (g_pool_size > 1) {
+        if (t_pool_slot < 0) {
+            t_pool_slot = (int)(atomic_fetch_add(&g_pool_next, 1) % LV_POOL_MAX);
+        }
+        slot = t_pool_slot % g_pool_size;
+    }
+
+    virConnectPtr conn = atomic_load(&g_pool[slot]);
+    if (conn == NULL || virConnectIsAlive(conn) == 1) {
+        return conn;
+    }
+    return pool_reconnect(slot, conn);
+}
+
+/*
+ * Domain handle cache
+ *
+ * Looking a domain up by name is a round trip to libvirtd, so handles
+ * are kept per pool connection and shared between callers. Entries count
+ * their users themselves: releasing a cached handle makes no libvirt
+ * call, which would reset the error the caller is about to report.
+ * An entry goes stale when a lifecycle event says the domain was
+ * undefined or renamed, or when an operation on it fails with
+ * VIR_ERR_NO_DOMAIN; lookups skip it and its last user frees it.
+ */
+
+typedef struct lv_dom_entry {
+    struct lv_dom_entry* next;
+    virConnectPtr conn;
+    virDomainPtr dom;
+    char* name;
+    char uuid[VIR_UUID_STRING_BUFLEN];
+    int refs;
+    int stale;
+} lv_dom_entry_t;
+
+static lv_dom_entry_t* g_dom_cache = NULL;
+static pthread_mutex_t g_dom_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dom_cache_free_entry(lv_dom_entry_t* entry) {
+    while (entry != NULL) {
+        lv_dom_entry_t* next = entry->next;
+        virDomainFree(entry->dom);
+        free(entry->name);
+        free(entry);
+        entry = next;
+    }
+}
+
+/* Mark an entry stale, moving it to dead if nobody holds it (lock held) */
+static void dom_cache_stale(lv_dom_entry_t** link, lv_dom_entry_t** dead) {
+    lv_dom_entry_t* entry = *link;
+
+    entry->stale = 1;
+    if (entry->refs == 0) {
+        *link = entry->next;
+        entry->next = *dead;
+        *dead = entry;
+    }
+}
+
+/* Take a reference on the live entry matching name or uuid (lock held) */
+static virDomainPtr dom_cache_find(virConnectPtr conn, const char* name, const char* uuid) {
+    for (lv_dom_entry_t* entry = g_dom_cache; entry != NULL; entry = entry->next) {
+        if (entry->stale || entry->conn != conn) {
+            continue;
+        }
+        if ((name && strcmp(entry->name, name) == 0) ||
+            (uuid && strcasecmp(entry->uuid, uuid) == 0)) {
+            entry->refs++;
+            return entry->dom;
+        }
+    }
+    return NULL;
+}
+
+/* Cache a freshly looked up handle, or return the one that won a race */
+static virDomainPtr dom_cache_insert(virConnectPtr conn, virDomainPtr dom) {
+    lv_dom_entry_t* entry = calloc(1, sizeof(lv_dom_entry_t));
+    const char* name = virDomainGetName(dom);
+    virDomainPtr cached = NULL;
+
+    if (entry == NULL || name == NULL ||
+        virDomainGetUUIDString(dom, entry->uuid) < 0 ||
+        (entry->name = strdup(name)) == NULL) {
+        /* Handles that are not in the cache are freed by domain_put */
+        if (entry) free(entry->name);
+        free(entry);
+        return dom;
+    }
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    cached = dom_cache_find(conn, entry->name, entry->uuid);
+    if (cached == NULL) {
+        entry->conn = conn;
+        entry->dom = dom;
+        entry->refs = 1;
+        entry->next = g_dom_cache;
+        g_dom_cache = entry;
+    }
+    pthread_mutex_unlock(&g_dom_cache_lock);
+
+    if (cached != NULL) {
+        virDomainFree(dom);
+        free(entry->name);
+        free(entry);
+        return cached;
+    }
+    return dom;
+}
+
+/*
+ * Invalidate the entries matching name or uuid on any connection, or
+ * every entry of conn when both are NULL
+ */
+static void dom_cache_forget(virConnectPtr conn, const char* name, const char* uuid) {
+    lv_dom_entry_t* dead = NULL;
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    for (lv_dom_entry_t** link = &g_dom_cache; *link != NULL; ) {
+        lv_dom_entry_t* entry = *link;
+        if ((name && strcmp(entry->name, name) == 0) ||
+            (uuid && strcasecmp(entry->uuid, uuid) == 0) ||
+            (!name && !uuid && entry->conn == conn)) {
+            dom_cache_stale(link, &dead);
+        }
+        if (*link == entry) {
+            link = &entry->next;
+        }
+    }
+    pthread_mutex_unlock(&g_dom_cache_lock);
+
+    dom_cache_free_entry(dead);
+}
+
+/* Drop every entry on disconnect; callers must be done with them */
+static void dom_cache_flush(void) {
+    lv_dom_entry_t* dead;
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    dead = g_dom_cache;
+    g_dom_cache = NULL;
+    pthread_mutex_unlock(&g_dom_cache_lock);
+
+    dom_cache_free_entry(dead);
+}
+
+/* Handle for a domain name, looked up once and then cached */
+static virDomainPtr domain_get(const char* name) {
+    virConnectPtr conn = conn_get();
+    virDomainPtr dom;
+
+    if (name == NULL || conn == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    dom = dom_cache_find(conn, name, NULL);
+    pthread_mutex_unlock(&g_dom_cache_lock);
+    if (dom != NULL) {
+        return dom;
+    }
+
+    dom = virDomainLookupByName(conn, name);
+    return dom ? dom_cache_insert(conn, dom) : NULL;
+}
+
+/* Handle for a domain UUID string, looked up once and then cached */
+static virDomainPtr domain_get_by_uuid(const char* uuid) {
+    virConnectPtr conn = conn_get();
+    virDomainPtr dom;
+
+    if (uuid == NULL || conn == NULL) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    dom = dom_cache_find(conn, NULL, uuid);
+    pthread_mutex_unlock(&g_dom_cache_lock);
+    if (dom != NULL) {
+        return dom;
+    }
+
+    dom = virDomainLookupByUUIDString(conn, uuid);
+    return dom ? dom_cache_insert(conn, dom) : NULL;
+}
+
+/*
+ * Release a handle from domain_get. ret is the result of the operation
+ * on it; a failure because the domain is gone invalidates the entry.
+ */
+static void domain_put(virDomainPtr dom, int ret) {
+    virErrorPtr err = ret < 0 ? virGetLastError() : NULL;
+    lv_dom_entry_t* dead = NULL;
+    int cached = 0;
+
+    pthread_mutex_lock(&g_dom_cache_lock);
+    for (lv_dom_entry_t** link = &g_dom_cache; *link != NULL; link = &(*link)->next) {
+        lv_dom_entry_t* entry = *link;
+        if (entry->dom != dom) {
+            continue;
+        }
+        cached = 1;
+        entry->refs--;
+        if (entry->stale || (err && err->code == VIR_ERR_NO_DOMAIN)) {
+            dom_cache_stale(link, &dead);
+        }
+        break;
+    }
+    pthread_mutex_unlock(&g_dom_cache_lock);
+
+    if (!cached) {
+        virDomainFree(dom);
+    }
+    dom_cache_free_entry(dead);
+}
+
+/*
+ * Domain events
+ *
+ * The event loop thread is the only producer, the caller of
+ * lv_events_poll the only consumer, so the ring needs no lock: the
+ * producer owns head, the consumer tail. An eventfd wakes a waiting
+ * consumer. Events that find the ring full are counted and dropped.
+ */
+
+static struct {
+    lv_event_t* slots;
+    uint64_t mask;
+    int wake_fd;
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+} g_events = { .wake_fd = -1 };
+
+static int g_event_callbacks[4] = { -1, -1, -1, -1 };
+
+/* Queue an event for dom (event loop thread) */
+static void event_push(virDomainPtr dom, int type, int event, int detail,
+                       uint64_t value, const char* disk) {
+    uint64_t head = atomic_load_explicit(&g_events.head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&g_events.tail, memory_order_acquire);
+    struct timespec ts;
+    uint64_t one = 1;
+
+    if (g_events.slots == NULL) {
+        return;
+    }
+
+    if (head - tail > g_events.mask) {
+        atomic_fetch_add_explicit(&g_events.dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    lv_event_t* ev = &g_events.slots[head & g_events.mask];
+    memset(ev, 0, sizeof(*ev));
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ev->timestamp_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+    ev->value = value;
+    ev->type = type;
+    ev->event = event;
+    ev->detail = detail;
+
+    if (virDomainGetUUIDString(dom, ev->uuid) < 0) {
+        ev->uuid[0] = '\0';
+    }
+    const char* name = virDomainGetName(dom);
+    if (name) {
+        snprintf(ev->name, sizeof(ev->name), "%s", name);
+    }
+    if (disk) {
+        snprintf(ev->disk, sizeof(ev->disk), "%s", disk);
+    }
+
+    atomic_store_explicit(&g_events.head, head + 1, memory_order_release);
+
+    if (write(g_events.wake_fd, &one, sizeof(one)) < 0) {
+        /* The counter only saturates; the consumer is awake already */
+    }
+}
+
+/* Lifecycle events also invalidate undefined and renamed domains */
+static int lifecycle_event_cb(virConnectPtr conn, virDomainPtr dom,
+                              int event, int detail, void* opaque) {
+    char uuid[VIR_UUID_STRING_BUFLEN];
+
+    (void)conn;
+    (void)opaque;
+
+    if (event == VIR_DOMAIN_EVENT_UNDEFINED ||
+        (event == VIR_DOMAIN_EVENT_DEFINED && detail == VIR_DOMAIN_EVENT_DEFINED_RENAMED)) {
+        if (virDomainGetUUIDString(dom, uuid) == 0) {
+            dom_cache_forget(NULL, NULL, uuid);
+        }
+    }
+
+    event_push(dom, LV_EVENT_LIFECYCLE, event, detail, 0, NULL);
+    return 0;
+}
+
+static int reboot_event_cb(virConnectPtr conn, virDomainPtr dom, void* opaque) {
+    (void)conn;
+    (void)opaque;
+
+    event_push(dom, LV_EVENT_REBOOT, 0, 0, 0, NULL);
+    return 0;
+}
+
+static int balloon_event_cb(virConnectPtr conn, virDomainPtr dom,
+                            unsigned long long actual, void* opaque) {
+    (void)conn;
+    (void)opaque;
+
+    event_push(dom, LV_EVENT_BALLOON_CHANGE, 0, 0, actual, NULL);
+    return 0;
+}
+
+static int block_job_event_cb(virConnectPtr conn, virDomainPtr dom,
+                              const char* disk, int type, int status, void* opaque) {
+    (void)conn;
+    (void)opaque;
+
+    event_push(dom, LV_EVENT_BLOCK_JOB, type, status, 0, disk);
+    return 0;
+}
+
+static void* event_loop_thread(void* arg) {
+    (void)arg;
+
+    for (;;) {
+        virEventRunDefaultImpl();
+    }
+    return NULL;
+}
+
+/* Register the domain event callbacks on a new connection */
+static void events_register(void) {
+    /*
+     * The lifecycle callback keeps the handle cache honest. Without an
+     * event loop it fails to register, and the cache notices removed
+     * domains through VIR_ERR_NO_DOMAIN instead.
+     */
+    g_event_callbacks[0] = virConnectDomainEventRegisterAny(g_conn, NULL,
+        VIR_DOMAIN_EVENT_ID_LIFECYCLE, VIR_DOMAIN_EVENT_CALLBACK(lifecycle_event_cb),
+        NULL, NULL);
+
+    if (g_events.slots == NULL) {
+        return;
+    }
+
+    g_event_callbacks[1] = virConnectDomainEventRegisterAny(g_conn, NULL,
+        VIR_DOMAIN_EVENT_ID_REBOOT, VIR_DOMAIN_EVENT_CALLBACK(reboot_event_cb),
+        NULL, NULL);
+    g_event_callbacks[2] = virConnectDomainEventRegisterAny(g_conn, NULL,
+        VIR_DOMAIN_EVENT_ID_BALLOON_CHANGE, VIR_DOMAIN_EVENT_CALLBACK(balloon_event_cb),
+        NULL, NULL);
+    g_event_callbacks[3] = virConnectDomainEventRegisterAny(g_conn, NULL,
+        VIR_DOMAIN_EVENT_ID_BLOCK_JOB_2, VIR_DOMAIN_EVENT_CALLBACK(block_job_event_cb),
+        NULL, NULL);
+}
+
+static void events_deregister(void) {
+    for (int i = 0; i < 4; i++) {
+        if (g_event_callbacks[i] >= 0) {
+            virConnectDomainEventDeregisterAny(g_conn, g_event_callbacks[i]);
+            g_event_callbacks[i] = -1;
+        }
+    }
+}
+
+int lv_events_start(int capacity) {
+    if (g_events.slots != NULL) {
+        return LV_OK; /* Already started */
+    }
+
+    if (g_conn != NULL) {
+        set_error("Events must be started before connecting");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    if (capacity <= 0 || capacity > (1 << 20)) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    uint64_t size = 1;
+    while (size < (uint64_t)capacity) {
+        size <<= 1;
+    }
+
+    if (virEventRegisterDefaultImpl() < 0) {
+        set_error("Failed to register event loop");
+        return LV_ERR_OPERATION;
+    }
+
+    g_events.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (g_events.wake_fd < 0) {
+        set_error("Failed to create event wakeup fd");
+        return LV_ERR_OPERATION;
+    }
+
+    lv_event_t* slots = calloc(size, sizeof(lv_event_t));
+    if (slots == NULL) {
+        close(g_events.wake_fd);
+        g_events.wake_fd = -1;
+        return LV_ERR_MEMORY;
+    }
+
+    g_events.mask = size - 1;
+    g_events.slots = slots;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, event_loop_thread, NULL) != 0) {
+        g_events.slots = NULL;
+        free(slots);
+        close(g_events.wake_fd);
+        g_events.wake_fd = -1;
+        set_error("Failed to start event loop thread");
+        return LV_ERR_OPERATION;
+    }
+    pthread_detach(thread);
+
+    return LV_OK;
+}
+
+int lv_events_poll(lv_event_t* events, int max) {
+    if (g_events.slots == NULL || events == NULL || max <= 0) {
+        return 0;
+    }
+
+    uint64_t tail = atomic_load_explicit(&g_events.tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&g_events.head, memory_order_acquire);
+    int n = 0;
+
+    while (tail != head && n < max) {
+        events[n++] = g_events.slots[tail & g_events.mask];
+        tail++;
+    }
+
+    atomic_store_explicit(&g_events.tail, tail, memory_order_release);
+    return n;
+}
+
+int lv_events_wait(int timeout_ms) {
+    uint64_t counter;
+
+    if (g_events.slots == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    /* Clear the wakeup first, so a push after the check still wakes us */
+    if (read(g_events.wake_fd, &counter, sizeof(counter)) < 0) {
+        /* EAGAIN: nothing pushed since the last wait */
+    }
+
+    if (atomic_load_explicit(&g_events.head, memory_order_acquire) !=
+        atomic_load_explicit(&g_events.tail, memory_order_relaxed)) {
+        return 1;
+    }
+
+    struct pollfd pfd = { .fd = g_events.wake_fd, .events = POLLIN };
+    int ret = poll(&pfd, 1, timeout_ms);
+    if (ret < 0) {
+        return errno == EINTR ? 0 : LV_ERR_OPERATION;
+    }
+
+    return ret > 0 ? 1 : 0;
+}
+
+uint64_t lv_events_dropped(void) {
+    return atomic_load_explicit(&g_events.dropped, memory_order_relaxed);
+}
+
 /*
  * Connection management
  */
 
 int lv_connect(const char* uri) {
+    return lv_connect_pool(uri, 1);
+}
+
+int lv_connect_pool(const char* uri, int size) {
+    if (size < 1 || size > LV_POOL_MAX) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    pthread_mutex_lock(&g_pool_lock);
     if (g_conn != NULL) {
+        pthread_mutex_unlock(&g_pool_lock);
         return LV_OK; /* Already connected */
     }
 
-    g_conn = virConnectOpen(uri);
-    if (g_conn == NULL) {
-        set_error("Failed to connect to hypervisor");
-        return LV_ERR_CONNECT;
+    if (uri != NULL && (g_pool_uri = strdup(uri)) == NULL) {
+        pthread_mutex_unlock(&g_pool_lock);
+        return LV_ERR_MEMORY;
     }
 
+    for (int i = 0; i < size; i++) {
+        virConnectPtr conn = pool_open(uri);
+        if (conn == NULL) {
+            set_error("Failed to connect to hypervisor");
+            while (i-- > 0) {
+                virConnectClose(atomic_exchange(&g_pool[i], NULL));
+            }
+            free(g_pool_uri);
+            g_pool_uri = NULL;
+            pthread_mutex_unlock(&g_pool_lock);
+            return LV_ERR_CONNECT;
+        }
+        atomic_store(&g_pool[i], conn);
+        g_pool_retry_ms[i] = 0;
+    }
+
+    g_pool_size = size;
+    g_conn = atomic_load(&g_pool[0]);
+    events_register();
+    pthread_mutex_unlock(&g_pool_lock);
+
     return LV_OK;
 }
 
 void lv_disconnect(void) {
+    pthread_mutex_lock(&g_pool_lock);
     if (g_conn != NULL) {
-        virConnectClose(g_conn);
+        events_deregister();
+        dom_cache_flush();
+
+        for (int i = 0; i < g_pool_size; i++) {
+            virConnectClose(atomic_exchange(&g_pool[i], NULL));
+        }
+        for (int i = 0; i < g_retired_count; i++) {
+            virConnectClose(g_retired[i]);
+        }
+
+        free(g_retired);
+        g_retired = NULL;
+        g_retired_count = 0;
+        free(g_pool_uri);
+        g_pool_uri = NULL;
+        g_pool_size = 0;
         g_conn = NULL;
     }
+    pthread_mutex_unlock(&g_pool_lock);
 }
 
 int lv_is_connected(void) {
@@ -72,34 +680,36 @@ int lv_get_host_info(lv_host_info_t* info) {
 
     memset(info, 0, sizeof(lv_host_info_t));
 
+    virConnectPtr conn = conn_get();
+
     /* Get hostname */
-    char* hostname = virConnectGetHostname(g_conn);
+    char* hostname = virConnectGetHostname(conn);
     if (hostname) {
         info->hostname = strdup(hostname);
         free(hostname);
     }
 
     /* Get hypervisor type */
-    const char* type = virConnectGetType(g_conn);
+    const char* type = virConnectGetType(conn);
     if (type) {
         info->hypervisor_type = strdup(type);
     }
 
     /* Get hypervisor version */
     unsigned long version;
-    if (virConnectGetVersion(g_conn, &version) == 0) {
+    if (virConnectGetVersion(conn, &version) == 0) {
         info->hypervisor_version = version;
     }
 
     /* Get node info */
     virNodeInfo node_info;
-    if (virNodeGetInfo(g_conn, &node_info) == 0) {
+    if (virNodeGetInfo(conn, &node_info) == 0) {
         info->cpus = node_info.cpus;
         info->memory_kb = node_info.memory;
     }
 
     /* Get free memory */
-    unsigned long long free_mem = virNodeGetFreeMemory(g_conn);
+    unsigned long long free_mem = virNodeGetFreeMemory(conn);
     info->free_memory_kb = free_mem / 1024;
 
     return LV_OK;
@@ -128,13 +738,16 @@ int lv_domain_create(const char* xml) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainCreateXML(g_conn, xml, 0);
+    virConnectPtr conn = conn_get();
+    virDomainPtr dom = virDomainCreateXML(conn, xml, 0);
     if (dom == NULL) {
         set_error("Failed to create domain");
         return LV_ERR_DOMAIN;
     }
 
-    virDomainFree(dom);
+    /* Seed the cache, replacing a handle for an older domain of that name */
+    dom_cache_forget(NULL, virDomainGetName(dom), NULL);
+    domain_put(dom_cache_insert(conn, dom), 0);
     return LV_OK;
 }
 
@@ -144,99 +757,344 @@ int lv_domain_define(const char* xml) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainDefineXML(g_conn, xml);
+    virConnectPtr conn = conn_get();
+    virDomainPtr dom = virDomainDefineXML(conn, xml);
     if (dom == NULL) {
         set_error("Failed to define domain");
         return LV_ERR_DOMAIN;
     }
 
-    virDomainFree(dom);
+    /* Seed the cache, replacing a handle for an older domain of that name */
+    dom_cache_forget(NULL, virDomainGetName(dom), NULL);
+    domain_put(dom_cache_insert(conn, dom), 0);
     return LV_OK;
 }
 
-int lv_domain_undefine(const char* name) {
-    if (g_conn == NULL) {
-        set_error("Not connected");
-        return LV_ERR_CONNECT;
-    }
+/*
+ * Domain specs
+ */
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
-    if (dom == NULL) {
-        set_error("Domain not found");
-        return LV_ERR_NOT_FOUND;
-    }
+/* Growing string for XML; a failed append marks it and frees nothing */
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+    int failed;
+} lv_buf_t;
 
-    int ret = virDomainUndefine(dom);
-    virDomainFree(dom);
+static void buf_printf(lv_buf_t* buf, const char* fmt, ...) {
+    va_list ap;
 
-    if (ret < 0) {
-        set_error("Failed to undefine domain");
-        return LV_ERR_OPERATION;
+    if (buf->failed) {
+        return;
     }
 
-    return LV_OK;
-}
+    for (;;) {
+        size_t room = buf->cap - buf->len;
+        va_start(ap, fmt);
+        int n = vsnprintf(buf->data ? buf->data + buf->len : NULL, room, fmt, ap);
+        va_end(ap);
 
-int lv_domain_start(const char* name) {
-    if (g_conn == NULL) {
-        set_error("Not connected");
-        return LV_ERR_CONNECT;
-    }
+        if (n < 0) {
+            buf->failed = 1;
+            return;
+        }
+        if ((size_t)n < room) {
+            buf->len += (size_t)n;
+            return;
+        }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
-    if (dom == NULL) {
-        set_error("Domain not found");
-        return LV_ERR_NOT_FOUND;
+        size_t cap = buf->cap ? buf->cap * 2 : 4096;
+        while (cap - buf->len <= (size_t)n) {
+            cap *= 2;
+        }
+        char* data = realloc(buf->data, cap);
+        if (data == NULL) {
+            buf->failed = 1;
+            return;
+        }
+        buf->data = data;
+        buf->cap = cap;
     }
+}
 
-    int ret = virDomainCreate(dom);
-    virDomainFree(dom);
-
-    if (ret < 0) {
-        set_error("Failed to start domain");
-        return LV_ERR_OPERATION;
+/* Append text escaped for an XML attribute or element */
+static void buf_escape(lv_buf_t* buf, const char* text) {
+    for (; *text; text++) {
+        switch (*text) {
+        case '&':  buf_printf(buf, "&amp;");  break;
+        case '<':  buf_printf(buf, "&lt;");   break;
+        case '>':  buf_printf(buf, "&gt;");   break;
+        case '\'': buf_printf(buf, "&apos;"); break;
+        case '"':  buf_printf(buf, "&quot;"); break;
+        default:   buf_printf(buf, "%c", *text); break;
+        }
     }
+}
 
-    return LV_OK;
+/* Default queue count: one per vCPU, capped */
+static uint32_t spec_queues(const lv_domain_spec_t* spec, uint32_t queues) {
+    if (queues) {
+        return queues;
+    }
+    return spec->vcpus < LV_SPEC_MAX_QUEUES ? spec->vcpus : LV_SPEC_MAX_QUEUES;
 }
 
-int lv_domain_shutdown(const char* name) {
-    if (g_conn == NULL) {
-        set_error("Not connected");
-        return LV_ERR_CONNECT;
+char* lv_domain_spec_xml(const lv_domain_spec_t* spec) {
+    if (spec == NULL || spec->name == NULL || spec->vcpus == 0 || spec->memory_kb == 0 ||
+        spec->ndisks < 0 || spec->nnics < 0 ||
+        (spec->ndisks && spec->disks == NULL) || (spec->nnics && spec->nics == NULL)) {
+        set_error("Invalid domain spec");
+        return NULL;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
-    if (dom == NULL) {
-        set_error("Domain not found");
-        return LV_ERR_NOT_FOUND;
+    uint32_t iothreads = spec->iothreads;
+    if (iothreads == 0) {
+        iothreads = spec->ndisks < 4 ? (uint32_t)spec->ndisks : 4;
     }
 
-    int ret = virDomainShutdown(dom);
-    virDomainFree(dom);
+    lv_buf_t buf = {0};
 
-    if (ret < 0) {
-        set_error("Failed to shutdown domain");
-        return LV_ERR_OPERATION;
+    buf_printf(&buf, "<domain type='kvm'>\n  <name>");
+    buf_escape(&buf, spec->name);
+    buf_printf(&buf, "</name>\n");
+    if (spec->uuid) {
+        buf_printf(&buf, "  <uuid>");
+        buf_escape(&buf, spec->uuid);
+        buf_printf(&buf, "</uuid>\n");
     }
+    buf_printf(&buf, "  <memory unit='KiB'>%llu</memory>\n",
+               (unsigned long long)spec->memory_kb);
 
-    return LV_OK;
-}
+    if (spec->hugepages) {
+        buf_printf(&buf, "  <memoryBacking>\n    <hugepages>");
+        if (spec->hugepage_size_kb) {
+            buf_printf(&buf, "\n      <page size='%llu' unit='KiB'/>\n    ",
+                       (unsigned long long)spec->hugepage_size_kb);
+        }
+        buf_printf(&buf, "</hugepages>\n  </memoryBacking>\n");
+    }
 
-int lv_domain_destroy(const char* name) {
-    if (g_conn == NULL) {
-        set_error("Not connected");
-        return LV_ERR_CONNECT;
+    buf_printf(&buf, "  <vcpu placement='static'>%u</vcpu>\n", spec->vcpus);
+    if (iothreads) {
+        buf_printf(&buf, "  <iothreads>%u</iothreads>\n", iothreads);
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    /* Pinning keeps vCPUs off the CPUs that run emulator and I/O work */
+    if (spec->vcpu_pins || spec->emulator_cpuset) {
+        buf_printf(&buf, "  <cputune>\n");
+        for (uint32_t i = 0; spec->vcpu_pins && i < spec->vcpus; i++) {
+            if (spec->vcpu_pins[i] >= 0) {
+                buf_printf(&buf, "    <vcpupin vcpu='%u' cpuset='%d'/>\n", i, spec->vcpu_pins[i]);
+            }
+        }
+        if (spec->emulator_cpuset) {
+            buf_printf(&buf, "    <emulatorpin cpuset='");
+            buf_escape(&buf, spec->emulator_cpuset);
+            buf_printf(&buf, "'/>\n");
+            for (uint32_t i = 1; i <= iothreads; i++) {
+                buf_printf(&buf, "    <iothreadpin iothread='%u' cpuset='", i);
+                buf_escape(&buf, spec->emulator_cpuset);
+                buf_printf(&buf, "'/>\n");
+            }
+        }
+        buf_printf(&buf, "  </cputune>\n");
+    }
+
+    if (spec->numa_nodeset) {
+        buf_printf(&buf, "  <numatune>\n    <memory mode='strict' nodeset='");
+        buf_escape(&buf, spec->numa_nodeset);
+        buf_printf(&buf, "'/>\n  </numatune>\n");
+    }
+
+    buf_printf(&buf,
+        "  <os>\n"
+        "    <type arch='x86_64' machine='pc'>hvm</type>\n"
+        "    <boot dev='hd'/>\n"
+        "  </os>\n"
+        "  <features>\n"
+        "    <acpi/>\n"
+        "    <apic/>\n"
+        "  </features>\n"
+        "  <cpu mode='%s'/>\n"
+        "  <clock offset='utc'>\n"
+        "    <timer name='rtc' tickpolicy='catchup'/>\n"
+        "    <timer name='pit' tickpolicy='delay'/>\n"
+        "    <timer name='hpet' present='no'/>\n"
+        "  </clock>\n"
+        "  <devices>\n",
+        spec->vcpu_pins ? "host-passthrough" : "host-model");
+
+    for (int i = 0; i < spec->ndisks; i++) {
+        const lv_disk_spec_t* disk = &spec->disks[i];
+        uint32_t iothread = disk->iothread ? disk->iothread : (uint32_t)i % iothreads + 1;
+
+        if (disk->source_path == NULL || disk->target_dev == NULL) {
+            buf.failed = 1;
+            break;
+        }
+
+        buf_printf(&buf, "    <disk type='file' device='disk'>\n"
+                         "      <driver name='qemu' type='");
+        buf_escape(&buf, disk->format ? disk->format : "qcow2");
+        buf_printf(&buf, "' cache='none' io='native' discard='unmap' iothread='%u' queues='%u'/>\n"
+                         "      <source file='", iothread, spec_queues(spec, disk->queues));
+        buf_escape(&buf, disk->source_path);
+        buf_printf(&buf, "'/>\n      <target dev='");
+        buf_escape(&buf, disk->target_dev);
+        buf_printf(&buf, "' bus='virtio'/>\n%s    </disk>\n",
+                   disk->readonly ? "      <readonly/>\n" : "");
+    }
+
+    for (int i = 0; i < spec->nnics; i++) {
+        const lv_nic_spec_t* nic = &spec->nics[i];
+
+        if (nic->network == NULL) {
+            buf.failed = 1;
+            break;
+        }
+
+        buf_printf(&buf, "    <interface type='network'>\n      <source network='");
+        buf_escape(&buf, nic->network);
+        buf_printf(&buf, "'/>\n");
+        if (nic->mac_address && nic->mac_address[0]) {
+            buf_printf(&buf, "      <mac address='");
+            buf_escape(&buf, nic->mac_address);
+            buf_printf(&buf, "'/>\n");
+        }
+        buf_printf(&buf, "      <model type='virtio'/>\n"
+                         "      <driver name='vhost' queues='%u'/>\n"
+                         "    </interface>\n", spec_queues(spec, nic->queues));
+    }
+
+    buf_printf(&buf,
+        "    <console type='pty'>\n"
+        "      <target type='serial' port='0'/>\n"
+        "    </console>\n"
+        "    <graphics type='vnc' port='-1' autoport='yes' listen='127.0.0.1'>\n"
+        "      <listen type='address' address='127.0.0.1'/>\n"
+        "    </graphics>\n"
+        "    <memballoon model='virtio'>\n"
+        "      <stats period='10'/>\n"
+        "    </memballoon>\n"
+        "  </devices>\n"
+        "</domain>\n");
+
+    if (buf.failed) {
+        free(buf.data);
+        set_error("Failed to build domain XML");
+        return NULL;
+    }
+
+    return buf.data;
+}
+
+int lv_domain_create_spec(const lv_domain_spec_t* spec) {
+    char* xml = lv_domain_spec_xml(spec);
+    if (xml == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    int ret = lv_domain_create(xml);
+    free(xml);
+    return ret;
+}
+
+int lv_domain_define_spec(const lv_domain_spec_t* spec) {
+    char* xml = lv_domain_spec_xml(spec);
+    if (xml == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    int ret = lv_domain_define(xml);
+    free(xml);
+    return ret;
+}
+
+int lv_domain_undefine(const char* name) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    virDomainPtr dom = domain_get(name);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int ret = virDomainUndefine(dom);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to undefine domain");
+        return LV_ERR_OPERATION;
+    }
+
+    dom_cache_forget(NULL, name, NULL);
+    return LV_OK;
+}
+
+int lv_domain_start(const char* name) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    virDomainPtr dom = domain_get(name);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int ret = virDomainCreate(dom);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to start domain");
+        return LV_ERR_OPERATION;
+    }
+
+    return LV_OK;
+}
+
+int lv_domain_shutdown(const char* name) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    virDomainPtr dom = domain_get(name);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int ret = virDomainShutdown(dom);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to shutdown domain");
+        return LV_ERR_OPERATION;
+    }
+
+    return LV_OK;
+}
+
+int lv_domain_destroy(const char* name) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainDestroy(dom);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to destroy domain");
@@ -252,14 +1110,14 @@ int lv_domain_reboot(const char* name) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainReboot(dom, 0);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to reboot domain");
@@ -275,14 +1133,14 @@ int lv_domain_suspend(const char* name) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainSuspend(dom);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to suspend domain");
@@ -298,14 +1156,14 @@ int lv_domain_resume(const char* name) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainResume(dom);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to resume domain");
@@ -329,7 +1187,7 @@ int lv_domain_get_info(const char* name, lv_domain_info_t* info) {
         return LV_ERR_INVALID_ARG;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -359,7 +1217,7 @@ int lv_domain_get_info(const char* name, lv_domain_info_t* info) {
         info->cpu_time_ns = dom_info.cpuTime;
     }
 
-    virDomainFree(dom);
+    domain_put(dom, 0);
     return LV_OK;
 }
 
@@ -369,20 +1227,18 @@ int lv_domain_get_info_by_uuid(const char* uuid, lv_domain_info_t* info) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByUUIDString(g_conn, uuid);
+    virDomainPtr dom = domain_get_by_uuid(uuid);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
+    /* The name is owned by the handle, which the cache keeps alive */
     const char* name = virDomainGetName(dom);
-    virDomainFree(dom);
-
-    if (name == NULL) {
-        return LV_ERR_DOMAIN;
-    }
+    int ret = name ? lv_domain_get_info(name, info) : LV_ERR_DOMAIN;
+    domain_put(dom, 0);
 
-    return lv_domain_get_info(name, info);
+    return ret;
 }
 
 void lv_free_domain_info(lv_domain_info_t* info) {
@@ -404,14 +1260,14 @@ char* lv_domain_get_xml(const char* name) {
         return NULL;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return NULL;
     }
 
     char* xml = virDomainGetXMLDesc(dom, 0);
-    virDomainFree(dom);
+    domain_put(dom, xml ? 0 : -1);
 
     return xml;
 }
@@ -421,14 +1277,14 @@ int lv_domain_get_state(const char* name) {
         return -1;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         return -1;
     }
 
     int state, reason;
     int ret = virDomainGetState(dom, &state, &reason, 0);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         return -1;
@@ -437,12 +1293,117 @@ int lv_domain_get_state(const char* name) {
     return state;
 }
 
+/*
+ * Bulk statistics
+ */
+
+/* Stat groups collected for every domain */
+#define LV_STATS_GROUPS (VIR_DOMAIN_STATS_STATE | VIR_DOMAIN_STATS_CPU_TOTAL | \
+                         VIR_DOMAIN_STATS_BALLOON | VIR_DOMAIN_STATS_VCPU | \
+                         VIR_DOMAIN_STATS_INTERFACE | VIR_DOMAIN_STATS_BLOCK)
+
+/* Numeric value of a typed parameter, 0 for other types */
+static uint64_t param_value(const virTypedParameter* param) {
+    switch (param->type) {
+    case VIR_TYPED_PARAM_INT:
+        return param->value.i < 0 ? 0 : (uint64_t)param->value.i;
+    case VIR_TYPED_PARAM_UINT:
+        return param->value.ui;
+    case VIR_TYPED_PARAM_LLONG:
+        return param->value.l < 0 ? 0 : (uint64_t)param->value.l;
+    case VIR_TYPED_PARAM_ULLONG:
+        return param->value.ul;
+    default:
+        return 0;
+    }
+}
+
+/* Field of a per-device stat "<prefix>.<n>.<field>", or NULL */
+static const char* device_field(const char* name, const char* prefix, size_t prefix_len) {
+    if (strncmp(name, prefix, prefix_len) != 0) {
+        return NULL;
+    }
+
+    name += prefix_len;
+    if (*name < '0' || *name > '9') {
+        return NULL;
+    }
+    while (*name >= '0' && *name <= '9') {
+        name++;
+    }
+
+    return *name == '.' ? name + 1 : NULL;
+}
+
+/* Fill a bulk record from one libvirt stats record */
+static void parse_stats_record(virDomainStatsRecordPtr record, lv_domain_bulk_stats_t* out) {
+    memset(out, 0, sizeof(lv_domain_bulk_stats_t));
+
+    if (virDomainGetUUIDString(record->dom, out->uuid) < 0) {
+        out->uuid[0] = '\0';
+    }
+
+    const char* dom_name = virDomainGetName(record->dom);
+    if (dom_name) {
+        snprintf(out->name, sizeof(out->name), "%s", dom_name);
+    }
+
+    for (int i = 0; i < record->nparams; i++) {
+        const virTypedParameter* param = &record->params[i];
+        const char* field = param->field;
+        uint64_t value = param_value(param);
+        const char* dev;
+
+        if ((dev = device_field(field, "block.", 6)) != NULL) {
+            if (strcmp(dev, "rd.bytes") == 0) out->block_rd_bytes += value;
+            else if (strcmp(dev, "wr.bytes") == 0) out->block_wr_bytes += value;
+            else if (strcmp(dev, "rd.reqs") == 0) out->block_rd_reqs += value;
+            else if (strcmp(dev, "wr.reqs") == 0) out->block_wr_reqs += value;
+        } else if ((dev = device_field(field, "net.", 4)) != NULL) {
+            if (strcmp(dev, "rx.bytes") == 0) out->net_rx_bytes += value;
+            else if (strcmp(dev, "tx.bytes") == 0) out->net_tx_bytes += value;
+            else if (strcmp(dev, "rx.pkts") == 0) out->net_rx_pkts += value;
+            else if (strcmp(dev, "tx.pkts") == 0) out->net_tx_pkts += value;
+            else if (strcmp(dev, "rx.drop") == 0) out->net_rx_drop += value;
+            else if (strcmp(dev, "tx.drop") == 0) out->net_tx_drop += value;
+        } else if (strcmp(field, "state.state") == 0) {
+            out->state = (int)value;
+        } else if (strcmp(field, "cpu.time") == 0) {
+            out->cpu_time_ns = value;
+        } else if (strcmp(field, "cpu.user") == 0) {
+            out->cpu_user_ns = value;
+        } else if (strcmp(field, "cpu.system") == 0) {
+            out->cpu_system_ns = value;
+        } else if (strcmp(field, "balloon.current") == 0) {
+            out->balloon_current_kb = value;
+        } else if (strcmp(field, "balloon.maximum") == 0) {
+            out->balloon_maximum_kb = value;
+        } else if (strcmp(field, "balloon.rss") == 0) {
+            out->balloon_rss_kb = value;
+        } else if (strcmp(field, "balloon.available") == 0) {
+            out->balloon_available_kb = value;
+        } else if (strcmp(field, "balloon.usable") == 0) {
+            out->balloon_usable_kb = value;
+        } else if (strcmp(field, "balloon.unused") == 0) {
+            out->balloon_unused_kb = value;
+        } else if (strcmp(field, "vcpu.current") == 0) {
+            out->vcpu_current = (uint32_t)value;
+        } else if (strcmp(field, "vcpu.maximum") == 0) {
+            out->vcpu_maximum = (uint32_t)value;
+        } else if (strcmp(field, "block.count") == 0) {
+            out->block_count = (uint32_t)value;
+        } else if (strcmp(field, "net.count") == 0) {
+            out->net_count = (uint32_t)value;
+        }
+    }
+}
+
 int lv_domain_get_stats(const char* name, lv_domain_stats_t* stats) {
     if (g_conn == NULL || stats == NULL) {
         return LV_ERR_INVALID_ARG;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -450,22 +1411,255 @@ int lv_domain_get_stats(const char* name, lv_domain_stats_t* stats) {
 
     memset(stats, 0, sizeof(lv_domain_stats_t));
 
-    /* Get basic info for CPU time */
-    virDomainInfo info;
-    if (virDomainGetInfo(dom, &info) == 0) {
-        stats->cpu_time_ns = info.cpuTime;
-        stats->memory_used_kb = info.memory;
-        stats->memory_max_kb = info.maxMem;
+    /* One stats call covers CPU, memory, block and network */
+    virDomainPtr doms[2] = { dom, NULL };
+    virDomainStatsRecordPtr* records = NULL;
+    int n = virDomainListGetStats(doms, LV_STATS_GROUPS, &records, 0);
+    domain_put(dom, n);
+
+    if (n < 0) {
+        set_error("Failed to get domain stats");
+        return LV_ERR_OPERATION;
     }
 
-    /* Block stats would require iterating over block devices */
-    /* Network stats would require iterating over interfaces */
-    /* For now, we just return basic stats */
+    if (n > 0) {
+        lv_domain_bulk_stats_t bulk;
+        parse_stats_record(records[0], &bulk);
 
-    virDomainFree(dom);
+        stats->cpu_time_ns = bulk.cpu_time_ns;
+        stats->memory_used_kb = bulk.balloon_current_kb;
+        stats->memory_max_kb = bulk.balloon_maximum_kb;
+        stats->disk_read_bytes = bulk.block_rd_bytes;
+        stats->disk_write_bytes = bulk.block_wr_bytes;
+        stats->net_rx_bytes = bulk.net_rx_bytes;
+        stats->net_tx_bytes = bulk.net_tx_bytes;
+    }
+
+    virDomainStatsRecordListFree(records);
+    return LV_OK;
+}
+
+int lv_domain_get_all_stats(lv_domain_bulk_stats_t* stats, int capacity, int* count) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (count == NULL || capacity < 0 || (stats == NULL && capacity > 0)) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virDomainStatsRecordPtr* records = NULL;
+    int n = virConnectGetAllDomainStats(conn_get(), LV_STATS_GROUPS, &records, 0);
+    if (n < 0) {
+        set_error("Failed to get domain stats");
+        return LV_ERR_OPERATION;
+    }
+
+    for (int i = 0; i < n && i < capacity; i++) {
+        parse_stats_record(records[i], &stats[i]);
+    }
+
+    *count = n;
+    virDomainStatsRecordListFree(records);
     return LV_OK;
 }
 
+/*
+ * Metrics export
+ *
+ * A collector on the metrics thread takes the bulk statistics of every
+ * domain once per pass and keeps one "domain" block per domain, keyed
+ * by UUID, so readers of the arena never call into libvirt.
+ */
+
+enum {
+    LV_M_STATE, LV_M_CPU_TIME, LV_M_CPU_USER, LV_M_CPU_SYSTEM,
+    LV_M_BALLOON_CURRENT, LV_M_BALLOON_MAXIMUM, LV_M_BALLOON_RSS,
+    LV_M_BALLOON_AVAILABLE, LV_M_BALLOON_USABLE, LV_M_BALLOON_UNUSED,
+    LV_M_VCPU_CURRENT, LV_M_VCPU_MAXIMUM,
+    LV_M_BLOCK_COUNT, LV_M_BLOCK_RD_BYTES, LV_M_BLOCK_WR_BYTES,
+    LV_M_BLOCK_RD_REQS, LV_M_BLOCK_WR_REQS,
+    LV_M_NET_COUNT, LV_M_NET_RX_BYTES, LV_M_NET_TX_BYTES, LV_M_NET_RX_PKTS,
+    LV_M_NET_TX_PKTS, LV_M_NET_RX_DROP, LV_M_NET_TX_DROP,
+    LV_M_FIELDS
+};
+
+static const zx_metrics_field_t lv_metric_fields[LV_M_FIELDS] = {
+    { .name = "state", .kind = ZX_METRICS_GAUGE },
+    { .name = "cpu_time_ns", .kind = ZX_METRICS_COUNTER },
+    { .name = "cpu_user_ns", .kind = ZX_METRICS_COUNTER },
+    { .name = "cpu_system_ns", .kind = ZX_METRICS_COUNTER },
+    { .name = "balloon_current_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "balloon_maximum_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "balloon_rss_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "balloon_available_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "balloon_usable_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "balloon_unused_kb", .kind = ZX_METRICS_GAUGE },
+    { .name = "vcpu_current", .kind = ZX_METRICS_GAUGE },
+    { .name = "vcpu_maximum", .kind = ZX_METRICS_GAUGE },
+    { .name = "block_count", .kind = ZX_METRICS_GAUGE },
+    { .name = "block_rd_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "block_wr_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "block_rd_reqs", .kind = ZX_METRICS_COUNTER },
+    { .name = "block_wr_reqs", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_count", .kind = ZX_METRICS_GAUGE },
+    { .name = "net_rx_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_tx_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_rx_pkts", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_tx_pkts", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_rx_drop", .kind = ZX_METRICS_COUNTER },
+    { .name = "net_tx_drop", .kind = ZX_METRICS_COUNTER },
+};
+
+typedef struct {
+    char uuid[LV_UUID_STRING_LEN];
+    zx_metrics_block_t* block;
+    int seen;
+} lv_metric_domain_t;
+
+/* Owned by the collector thread while exporting */
+static int g_metrics_type = -1;
+static lv_metric_domain_t* g_metric_doms = NULL;
+static int g_metric_dom_count = 0;
+static int g_metric_dom_cap = 0;
+
+static zx_metrics_block_t* metrics_domain_block(const lv_domain_bulk_stats_t* st) {
+    for (int i = 0; i < g_metric_dom_count; i++) {
+        if (strcmp(g_metric_doms[i].uuid, st->uuid) == 0) {
+            g_metric_doms[i].seen = 1;
+            return g_metric_doms[i].block;
+        }
+    }
+
+    if (g_metric_dom_count == g_metric_dom_cap) {
+        int cap = g_metric_dom_cap ? g_metric_dom_cap * 2 : 64;
+        lv_metric_domain_t* doms = realloc(g_metric_doms, (size_t)cap * sizeof(*doms));
+        if (doms == NULL) {
+            return NULL;
+        }
+        g_metric_doms = doms;
+        g_metric_dom_cap = cap;
+    }
+
+    char labels[ZX_METRICS_LABELS_LEN];
+    snprintf(labels, sizeof(labels), "uuid=%s,name=%s", st->uuid, st->name);
+    zx_metrics_block_t* block = zx_metrics_block_add(g_metrics_type, labels);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    lv_metric_domain_t* d = &g_metric_doms[g_metric_dom_count++];
+    snprintf(d->uuid, sizeof(d->uuid), "%s", st->uuid);
+    d->block = block;
+    d->seen = 1;
+    return block;
+}
+
+static void metrics_collect(void* userdata) {
+    (void)userdata;
+
+    if (g_conn == NULL) {
+        return;
+    }
+
+    virDomainStatsRecordPtr* records = NULL;
+    int n = virConnectGetAllDomainStats(conn_get(), LV_STATS_GROUPS, &records, 0);
+    if (n < 0) {
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        lv_domain_bulk_stats_t st;
+        parse_stats_record(records[i], &st);
+        if (st.uuid[0] == '\0') {
+            continue;
+        }
+
+        zx_metrics_block_t* m = metrics_domain_block(&st);
+        if (m == NULL) {
+            continue;
+        }
+
+        zx_metrics_write_begin(m);
+        m->values[LV_M_STATE] = (uint64_t)st.state;
+        m->values[LV_M_CPU_TIME] = st.cpu_time_ns;
+        m->values[LV_M_CPU_USER] = st.cpu_user_ns;
+        m->values[LV_M_CPU_SYSTEM] = st.cpu_system_ns;
+        m->values[LV_M_BALLOON_CURRENT] = st.balloon_current_kb;
+        m->values[LV_M_BALLOON_MAXIMUM] = st.balloon_maximum_kb;
+        m->values[LV_M_BALLOON_RSS] = st.balloon_rss_kb;
+        m->values[LV_M_BALLOON_AVAILABLE] = st.balloon_available_kb;
+        m->values[LV_M_BALLOON_USABLE] = st.balloon_usable_kb;
+        m->values[LV_M_BALLOON_UNUSED] = st.balloon_unused_kb;
+        m->values[LV_M_VCPU_CURRENT] = st.vcpu_current;
+        m->values[LV_M_VCPU_MAXIMUM] = st.vcpu_maximum;
+        m->values[LV_M_BLOCK_COUNT] = st.block_count;
+        m->values[LV_M_BLOCK_RD_BYTES] = st.block_rd_bytes;
+        m->values[LV_M_BLOCK_WR_BYTES] = st.block_wr_bytes;
+        m->values[LV_M_BLOCK_RD_REQS] = st.block_rd_reqs;
+        m->values[LV_M_BLOCK_WR_REQS] = st.block_wr_reqs;
+        m->values[LV_M_NET_COUNT] = st.net_count;
+        m->values[LV_M_NET_RX_BYTES] = st.net_rx_bytes;
+        m->values[LV_M_NET_TX_BYTES] = st.net_tx_bytes;
+        m->values[LV_M_NET_RX_PKTS] = st.net_rx_pkts;
+        m->values[LV_M_NET_TX_PKTS] = st.net_tx_pkts;
+        m->values[LV_M_NET_RX_DROP] = st.net_rx_drop;
+        m->values[LV_M_NET_TX_DROP] = st.net_tx_drop;
+        zx_metrics_write_end(m);
+    }
+    virDomainStatsRecordListFree(records);
+
+    /* Domains no longer listed were undefined */
+    int kept = 0;
+    for (int i = 0; i < g_metric_dom_count; i++) {
+        if (!g_metric_doms[i].seen) {
+            zx_metrics_block_remove(g_metric_doms[i].block);
+            continue;
+        }
+        g_metric_doms[i].seen = 0;
+        g_metric_doms[kept++] = g_metric_doms[i];
+    }
+    g_metric_dom_count = kept;
+}
+
+int lv_metrics_start(void) {
+    if (g_metrics_type >= 0) {
+        return LV_OK;
+    }
+
+    int type = zx_metrics_type_register("domain", lv_metric_fields, LV_M_FIELDS);
+    if (type < 0) {
+        set_error(type == ZX_METRICS_ERR_NOT_INIT ? "No metrics arena"
+                                                  : "Failed to register domain metrics");
+        return type == ZX_METRICS_ERR_NOT_INIT ? LV_ERR_INVALID_ARG : LV_ERR_OPERATION;
+    }
+
+    g_metrics_type = type;
+    if (zx_metrics_collector_add(metrics_collect, NULL) != ZX_METRICS_OK) {
+        g_metrics_type = -1;
+        set_error("Failed to add metrics collector");
+        return LV_ERR_MEMORY;
+    }
+    return LV_OK;
+}
+
+void lv_metrics_stop(void) {
+    if (g_metrics_type < 0) {
+        return;
+    }
+
+    zx_metrics_collector_remove(metrics_collect, NULL);
+    for (int i = 0; i < g_metric_dom_count; i++) {
+        zx_metrics_block_remove(g_metric_doms[i].block);
+    }
+    free(g_metric_doms);
+    g_metric_doms = NULL;
+    g_metric_dom_count = 0;
+    g_metric_dom_cap = 0;
+    g_metrics_type = -1;
+}
+
 /*
  * Domain listing
  */
@@ -476,7 +1670,7 @@ int lv_domain_list(char*** names, int* count) {
     }
 
     virDomainPtr* domains = NULL;
-    int num_domains = virConnectListAllDomains(g_conn, &domains,
+    int num_domains = virConnectListAllDomains(conn_get(), &domains,
         VIR_CONNECT_LIST_DOMAINS_ACTIVE | VIR_CONNECT_LIST_DOMAINS_INACTIVE);
 
     if (num_domains < 0) {
@@ -510,7 +1704,7 @@ int lv_domain_list_running(char*** names, int* count) {
     }
 
     virDomainPtr* domains = NULL;
-    int num_domains = virConnectListAllDomains(g_conn, &domains,
+    int num_domains = virConnectListAllDomains(conn_get(), &domains,
         VIR_CONNECT_LIST_DOMAINS_ACTIVE);
 
     if (num_domains < 0) {
@@ -544,7 +1738,7 @@ int lv_domain_list_defined(char*** names, int* count) {
     }
 
     virDomainPtr* domains = NULL;
-    int num_domains = virConnectListAllDomains(g_conn, &domains,
+    int num_domains = virConnectListAllDomains(conn_get(), &domains,
         VIR_CONNECT_LIST_DOMAINS_INACTIVE);
 
     if (num_domains < 0) {
@@ -593,14 +1787,14 @@ int lv_domain_set_vcpus(const char* name, uint32_t count) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainSetVcpus(dom, count);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to set vCPUs");
@@ -616,14 +1810,14 @@ int lv_domain_set_memory(const char* name, uint64_t memory_kb) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, name);
+    virDomainPtr dom = domain_get(name);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
     }
 
     int ret = virDomainSetMemory(dom, memory_kb);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to set memory");
@@ -644,7 +1838,7 @@ int lv_domain_attach_disk(const char* domain, const char* source_path,
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, domain);
+    virDomainPtr dom = domain_get(domain);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -654,7 +1848,7 @@ int lv_domain_attach_disk(const char* domain, const char* source_path,
     char xml[1024];
     snprintf(xml, sizeof(xml),
         "<disk type='file' device='disk'>"
-        "  <driver name='qemu' type='qcow2'/>"
+        "  <driver name='qemu' type='qcow2' cache='none' io='native' discard='unmap'/>"
         "  <source file='%s'/>"
         "  <target dev='%s' bus='virtio'/>"
         "  %s"
@@ -663,7 +1857,7 @@ int lv_domain_attach_disk(const char* domain, const char* source_path,
         readonly ? "<readonly/>" : "");
 
     int ret = virDomainAttachDevice(dom, xml);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to attach disk");
@@ -679,7 +1873,7 @@ int lv_domain_detach_disk(const char* domain, const char* target_dev) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, domain);
+    virDomainPtr dom = domain_get(domain);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -694,7 +1888,7 @@ int lv_domain_detach_disk(const char* domain, const char* target_dev) {
         target_dev);
 
     int ret = virDomainDetachDevice(dom, xml);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to detach disk");
@@ -715,7 +1909,7 @@ int lv_domain_attach_network(const char* domain, const char* network_name,
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, domain);
+    virDomainPtr dom = domain_get(domain);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -741,7 +1935,7 @@ int lv_domain_attach_network(const char* domain, const char* network_name,
     }
 
     int ret = virDomainAttachDevice(dom, xml);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to attach network");
@@ -757,7 +1951,7 @@ int lv_domain_detach_network(const char* domain, const char* mac_address) {
         return LV_ERR_CONNECT;
     }
 
-    virDomainPtr dom = virDomainLookupByName(g_conn, domain);
+    virDomainPtr dom = domain_get(domain);
     if (dom == NULL) {
         set_error("Domain not found");
         return LV_ERR_NOT_FOUND;
@@ -772,7 +1966,7 @@ int lv_domain_detach_network(const char* domain, const char* mac_address) {
         mac_address);
 
     int ret = virDomainDetachDevice(dom, xml);
-    virDomainFree(dom);
+    domain_put(dom, ret);
 
     if (ret < 0) {
         set_error("Failed to detach network");
@@ -781,3 +1975,717 @@ int lv_domain_detach_network(const char* domain, const char* mac_address) {
 
     return LV_OK;
 }
+
+/*
+ * Live migration
+ *
+ * The migration call blocks for the whole job, so it runs on a worker
+ * thread while the caller watches the job: it reports progress, sets
+ * the downtime limit once the job exists, and switches to post-copy or
+ * aborts when asked to.
+ */
+
+#define LV_MIGRATE_DEFAULT_INTERVAL_MS 500
+
+typedef struct {
+    virDomainPtr dom;
+    const char* dest_uri;
+    virTypedParameterPtr params;
+    int nparams;
+    unsigned int flags;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int ret;
+    char error[512];
+} lv_migrate_job_t;
+
+static void* migrate_thread(void* arg) {
+    lv_migrate_job_t* job = arg;
+    int ret = virDomainMigrateToURI3(job->dom, job->dest_uri, job->params,
+                                     job->nparams, job->flags);
+
+    /* Errors are per thread; hand ours to the caller */
+    virErrorPtr err = ret < 0 ? virGetLastError() : NULL;
+
+    pthread_mutex_lock(&job->lock);
+    job->ret = ret;
+    if (err && err->message) {
+        snprintf(job->error, sizeof(job->error), "%s", err->message);
+    }
+    job->done = 1;
+    pthread_cond_signal(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+static uint64_t job_param(virTypedParameterPtr params, int nparams, const char* field) {
+    unsigned long long value = 0;
+
+    if (virTypedParamsGetULLong(params, nparams, field, &value) <= 0) {
+        return 0;
+    }
+    return value;
+}
+
+/* Current or completed job statistics; 1 when a migration job is active */
+static int migrate_progress(virDomainPtr dom, int completed, lv_migrate_progress_t* out) {
+    virTypedParameterPtr params = NULL;
+    int nparams = 0;
+    int type, throttle = 0;
+
+    memset(out, 0, sizeof(*out));
+    out->completed = completed;
+
+    if (virDomainGetJobStats(dom, &type, &params, &nparams,
+                             completed ? VIR_DOMAIN_JOB_STATS_COMPLETED : 0) < 0) {
+        return 0;
+    }
+
+    out->elapsed_ms = job_param(params, nparams, VIR_DOMAIN_JOB_TIME_ELAPSED);
+    out->data_total = job_param(params, nparams, VIR_DOMAIN_JOB_DATA_TOTAL);
+    out->data_processed = job_param(params, nparams, VIR_DOMAIN_JOB_DATA_PROCESSED);
+    out->data_remaining = job_param(params, nparams, VIR_DOMAIN_JOB_DATA_REMAINING);
+    out->mem_remaining = job_param(params, nparams, VIR_DOMAIN_JOB_MEMORY_REMAINING);
+    out->mem_bps = job_param(params, nparams, VIR_DOMAIN_JOB_MEMORY_BPS);
+    out->mem_dirty_rate = job_param(params, nparams, VIR_DOMAIN_JOB_MEMORY_DIRTY_RATE);
+    out->mem_iteration = job_param(params, nparams, VIR_DOMAIN_JOB_MEMORY_ITERATION);
+    out->downtime_ms = job_param(params, nparams, VIR_DOMAIN_JOB_DOWNTIME);
+    if (virTypedParamsGetInt(params, nparams, VIR_DOMAIN_JOB_AUTO_CONVERGE_THROTTLE, &throttle) > 0) {
+        out->auto_converge_throttle = throttle;
+    }
+
+    virTypedParamsFree(params, nparams);
+    return type != VIR_DOMAIN_JOB_NONE;
+}
+
+/* Typed parameters and flags for the migration call */
+static int migrate_build(const lv_migrate_params_t* p, virTypedParameterPtr* params,
+                         int* nparams, unsigned int* flags) {
+    int maxparams = 0;
+    int ret = 0;
+
+    *flags = VIR_MIGRATE_LIVE | VIR_MIGRATE_PEER2PEER;
+
+    if (p->migrate_uri) {
+        ret |= virTypedParamsAddString(params, nparams, &maxparams,
+                                       VIR_MIGRATE_PARAM_URI, p->migrate_uri);
+    }
+    if (p->dest_name) {
+        ret |= virTypedParamsAddString(params, nparams, &maxparams,
+                                       VIR_MIGRATE_PARAM_DEST_NAME, p->dest_name);
+    }
+    if (p->parallel_connections > 0) {
+        *flags |= VIR_MIGRATE_PARALLEL;
+        ret |= virTypedParamsAddInt(params, nparams, &maxparams,
+                                    VIR_MIGRATE_PARAM_PARALLEL_CONNECTIONS,
+                                    p->parallel_connections);
+    }
+    if (p->compression) {
+        *flags |= VIR_MIGRATE_COMPRESSED;
+        ret |= virTypedParamsAddString(params, nparams, &maxparams,
+                                       VIR_MIGRATE_PARAM_COMPRESSION, p->compression);
+    }
+    if (p->bandwidth_mib) {
+        ret |= virTypedParamsAddULLong(params, nparams, &maxparams,
+                                       VIR_MIGRATE_PARAM_BANDWIDTH, p->bandwidth_mib);
+    }
+    if (p->postcopy_bandwidth_mib) {
+        ret |= virTypedParamsAddULLong(params, nparams, &maxparams,
+                                       VIR_MIGRATE_PARAM_BANDWIDTH_POSTCOPY,
+                                       p->postcopy_bandwidth_mib);
+    }
+    if (p->auto_converge) {
+        *flags |= VIR_MIGRATE_AUTO_CONVERGE;
+    }
+    if (p->postcopy) {
+        *flags |= VIR_MIGRATE_POSTCOPY;
+    }
+    if (p->persist) {
+        *flags |= VIR_MIGRATE_PERSIST_DEST | VIR_MIGRATE_UNDEFINE_SOURCE;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+int lv_domain_migrate(const char* name, const lv_migrate_params_t* params,
+                      lv_migrate_progress_cb progress, void* opaque) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (params == NULL || params->dest_uri == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virDomainPtr dom = domain_get(name);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    lv_migrate_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.dom = dom;
+    job.dest_uri = params->dest_uri;
+
+    if (migrate_build(params, &job.params, &job.nparams, &job.flags) < 0) {
+        virTypedParamsFree(job.params, job.nparams);
+        domain_put(dom, 0);
+        set_error("Failed to build migration parameters");
+        return LV_ERR_MEMORY;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, migrate_thread, &job) != 0) {
+        pthread_cond_destroy(&job.cond);
+        pthread_mutex_destroy(&job.lock);
+        virTypedParamsFree(job.params, job.nparams);
+        domain_put(dom, 0);
+        set_error("Failed to start migration thread");
+        return LV_ERR_OPERATION;
+    }
+
+    uint32_t interval = params->progress_interval_ms ?
+        params->progress_interval_ms : LV_MIGRATE_DEFAULT_INTERVAL_MS;
+    int downtime_set = params->max_downtime_ms == 0;
+    int postcopy = 0;
+    int aborted = 0;
+    lv_migrate_progress_t prog;
+
+    pthread_mutex_lock(&job.lock);
+    while (!job.done) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += interval / 1000;
+        deadline.tv_nsec += (long)(interval % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&job.cond, &job.lock, &deadline);
+        if (job.done) {
+            break;
+        }
+        pthread_mutex_unlock(&job.lock);
+
+        if (migrate_progress(dom, 0, &prog) && !aborted) {
+            /* The limit needs the job, which the worker may not have begun */
+            if (!downtime_set) {
+                downtime_set = virDomainMigrateSetMaxDowntime(dom, params->max_downtime_ms, 0) == 0;
+            }
+
+            prog.postcopy = postcopy;
+            int verdict = progress ? progress(&prog, opaque) : LV_MIGRATE_CONTINUE;
+
+            if (verdict == LV_MIGRATE_ABORT) {
+                aborted = virDomainAbortJob(dom) == 0;
+            } else if (params->postcopy && !postcopy &&
+                       (verdict == LV_MIGRATE_START_POSTCOPY ||
+                        (params->postcopy_after_ms && prog.elapsed_ms >= params->postcopy_after_ms))) {
+                postcopy = virDomainMigrateStartPostCopy(dom, 0) == 0;
+            }
+        }
+
+        pthread_mutex_lock(&job.lock);
+    }
+    pthread_mutex_unlock(&job.lock);
+
+    pthread_join(thread, NULL);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    virTypedParamsFree(job.params, job.nparams);
+
+    if (progress) {
+        migrate_progress(dom, 1, &prog);
+        prog.postcopy = postcopy;
+        progress(&prog, opaque);
+    }
+
+    domain_put(dom, 0);
+
+    if (job.ret < 0) {
+        snprintf(g_last_error, sizeof(g_last_error), "%s: %s",
+                 aborted ? "Migration aborted" : "Failed to migrate domain",
+                 job.error[0] ? job.error : "unknown error");
+        return LV_ERR_OPERATION;
+    }
+
+    /* The domain runs on the destination now */
+    dom_cache_forget(NULL, name, NULL);
+    return LV_OK;
+}
+
+/*
+ * Fast provisioning
+ *
+ * Desktops of a pool share one golden image: each clone gets qcow2
+ * overlays on it, so defining one writes a few KB instead of copying
+ * the disk. A booted desktop can be saved, or snapshotted with its
+ * memory, and brought back running in the time it takes to read that
+ * memory image.
+ */
+
+/* Volume XML of a qcow2 overlay; the capacity comes from the backing image */
+static char* overlay_xml(const char* name, const char* backing_path, const char* backing_format) {
+    lv_buf_t buf = {0};
+
+    buf_printf(&buf, "<volume type='file'>\n  <name>");
+    buf_escape(&buf, name);
+    buf_printf(&buf, "</name>\n"
+                     "  <target>\n    <format type='qcow2'/>\n  </target>\n"
+                     "  <backingStore>\n    <path>");
+    buf_escape(&buf, backing_path);
+    buf_printf(&buf, "</path>\n    <format type='");
+    buf_escape(&buf, backing_format ? backing_format : "qcow2");
+    buf_printf(&buf, "'/>\n  </backingStore>\n</volume>\n");
+
+    if (buf.failed) {
+        free(buf.data);
+        return NULL;
+    }
+    return buf.data;
+}
+
+/* Create an overlay in pool; returns its path (free it) or NULL */
+static char* overlay_create(virStoragePoolPtr pool, const char* name,
+                            const char* backing_path, const char* backing_format) {
+    char* xml = overlay_xml(name, backing_path, backing_format);
+    if (xml == NULL) {
+        set_error("Failed to build volume XML");
+        return NULL;
+    }
+
+    virStorageVolPtr vol = virStorageVolCreateXML(pool, xml, 0);
+    free(xml);
+    if (vol == NULL) {
+        set_error("Failed to create overlay");
+        return NULL;
+    }
+
+    char* path = virStorageVolGetPath(vol);
+    if (path == NULL) {
+        set_error("Failed to get overlay path");
+        virStorageVolDelete(vol, 0);
+    }
+    virStorageVolFree(vol);
+    return path;
+}
+
+/* Delete the volume at path, keeping the caller's error message */
+static int volume_delete(virConnectPtr conn, const char* path) {
+    virStorageVolPtr vol = virStorageVolLookupByPath(conn, path);
+    if (vol == NULL) {
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int ret = virStorageVolDelete(vol, 0);
+    virStorageVolFree(vol);
+    return ret < 0 ? LV_ERR_OPERATION : LV_OK;
+}
+
+int lv_volume_create_overlay(const char* pool, const char* name, const char* backing_path,
+                             const char* backing_format, char** path) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (pool == NULL || name == NULL || backing_path == NULL || path == NULL) {
+        set_error("Invalid overlay");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virStoragePoolPtr p = virStoragePoolLookupByName(conn_get(), pool);
+    if (p == NULL) {
+        set_error("Storage pool not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    *path = overlay_create(p, name, backing_path, backing_format);
+    virStoragePoolFree(p);
+
+    return *path ? LV_OK : LV_ERR_OPERATION;
+}
+
+int lv_volume_delete(const char* path) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (path == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    int ret = volume_delete(conn_get(), path);
+    if (ret == LV_ERR_NOT_FOUND) {
+        set_error("Volume not found");
+    } else if (ret != LV_OK) {
+        set_error("Failed to delete volume");
+    }
+    return ret;
+}
+
+int lv_domain_define_linked_clone(const lv_domain_spec_t* spec, const char* pool) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (spec == NULL || spec->name == NULL || pool == NULL || spec->ndisks < 0 ||
+        (spec->ndisks && spec->disks == NULL)) {
+        set_error("Invalid linked clone");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virConnectPtr conn = conn_get();
+    virStoragePoolPtr p = virStoragePoolLookupByName(conn, pool);
+    if (p == NULL) {
+        set_error("Storage pool not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int n = spec->ndisks ? spec->ndisks : 1;
+    lv_disk_spec_t* disks = calloc((size_t)n, sizeof(*disks));
+    char** overlays = calloc((size_t)n, sizeof(*overlays));
+    int ret = disks && overlays ? LV_OK : LV_ERR_MEMORY;
+    if (ret != LV_OK) {
+        set_error("Out of memory");
+    }
+
+    for (int i = 0; ret == LV_OK && i < spec->ndisks; i++) {
+        disks[i] = spec->disks[i];
+        if (disks[i].readonly) {
+            continue;
+        }
+        if (disks[i].source_path == NULL || disks[i].target_dev == NULL) {
+            set_error("Invalid domain spec");
+            ret = LV_ERR_INVALID_ARG;
+            break;
+        }
+
+        char vol[LV_DOMAIN_NAME_LEN + 80];
+        snprintf(vol, sizeof(vol), "%s-%s.qcow2", spec->name, disks[i].target_dev);
+        overlays[i] = overlay_create(p, vol, disks[i].source_path, disks[i].format);
+        if (overlays[i] == NULL) {
+            ret = LV_ERR_OPERATION;
+            break;
+        }
+        disks[i].source_path = overlays[i];
+        disks[i].format = "qcow2";
+    }
+    virStoragePoolFree(p);
+
+    if (ret == LV_OK) {
+        lv_domain_spec_t clone = *spec;
+        clone.disks = disks;
+        ret = lv_domain_define_spec(&clone);
+    }
+
+    for (int i = 0; overlays && i < spec->ndisks; i++) {
+        if (overlays[i] && ret != LV_OK) {
+            volume_delete(conn, overlays[i]);
+        }
+        free(overlays[i]);
+    }
+    free(overlays);
+    free(disks);
+    return ret;
+}
+
+/* libvirt flags for LV_SAVE_* */
+static int save_flags(unsigned int flags, unsigned int* out) {
+    if ((flags & ~(LV_SAVE_BYPASS_CACHE | LV_SAVE_RUNNING | LV_SAVE_PAUSED)) ||
+        ((flags & LV_SAVE_RUNNING) && (flags & LV_SAVE_PAUSED))) {
+        set_error("Invalid save flags");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    *out = 0;
+    if (flags & LV_SAVE_BYPASS_CACHE) {
+        *out |= VIR_DOMAIN_SAVE_BYPASS_CACHE;
+    }
+    if (flags & LV_SAVE_RUNNING) {
+        *out |= VIR_DOMAIN_SAVE_RUNNING;
+    }
+    if (flags & LV_SAVE_PAUSED) {
+        *out |= VIR_DOMAIN_SAVE_PAUSED;
+    }
+    return LV_OK;
+}
+
+int lv_domain_snapshot_create(const char* domain, const lv_snapshot_params_t* params) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (params == NULL) {
+        set_error("Invalid snapshot");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    lv_buf_t buf = {0};
+    buf_printf(&buf, "<domainsnapshot>\n");
+    if (params->name) {
+        buf_printf(&buf, "  <name>");
+        buf_escape(&buf, params->name);
+        buf_printf(&buf, "</name>\n");
+    }
+    if (params->description) {
+        buf_printf(&buf, "  <description>");
+        buf_escape(&buf, params->description);
+        buf_printf(&buf, "</description>\n");
+    }
+    /* An external memory image makes the disks default to external too */
+    if (params->memory_file) {
+        buf_printf(&buf, "  <memory snapshot='external' file='");
+        buf_escape(&buf, params->memory_file);
+        buf_printf(&buf, "'/>\n");
+    } else {
+        buf_printf(&buf, "  <memory snapshot='no'/>\n");
+    }
+    buf_printf(&buf, "</domainsnapshot>\n");
+
+    if (buf.failed) {
+        free(buf.data);
+        set_error("Failed to build snapshot XML");
+        return LV_ERR_MEMORY;
+    }
+
+    unsigned int flags = VIR_DOMAIN_SNAPSHOT_CREATE_ATOMIC;
+    if (params->memory_file == NULL) {
+        flags |= VIR_DOMAIN_SNAPSHOT_CREATE_DISK_ONLY;
+    } else if (params->live) {
+        flags |= VIR_DOMAIN_SNAPSHOT_CREATE_LIVE;
+    }
+    if (params->quiesce) {
+        flags |= VIR_DOMAIN_SNAPSHOT_CREATE_QUIESCE;
+    }
+
+    virDomainPtr dom = domain_get(domain);
+    if (dom == NULL) {
+        free(buf.data);
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    virDomainSnapshotPtr snap = virDomainSnapshotCreateXML(dom, buf.data, flags);
+    free(buf.data);
+    domain_put(dom, snap ? 0 : -1);
+
+    if (snap == NULL) {
+        set_error("Failed to create snapshot");
+        return LV_ERR_OPERATION;
+    }
+
+    virDomainSnapshotFree(snap);
+    return LV_OK;
+}
+
+int lv_domain_snapshot_list(const char* domain, char*** names, int* count) {
+    if (g_conn == NULL || names == NULL || count == NULL) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virDomainPtr dom = domain_get(domain);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    virDomainSnapshotPtr* snaps = NULL;
+    int num_snaps = virDomainListAllSnapshots(dom, &snaps, 0);
+    domain_put(dom, num_snaps);
+
+    if (num_snaps < 0) {
+        set_error("Failed to list snapshots");
+        return LV_ERR_OPERATION;
+    }
+
+    *count = num_snaps;
+    *names = (char**)malloc(sizeof(char*) * (num_snaps ? num_snaps : 1));
+    if (*names == NULL) {
+        for (int i = 0; i < num_snaps; i++) {
+            virDomainSnapshotFree(snaps[i]);
+        }
+        free(snaps);
+        return LV_ERR_MEMORY;
+    }
+
+    for (int i = 0; i < num_snaps; i++) {
+        const char* name = virDomainSnapshotGetName(snaps[i]);
+        (*names)[i] = name ? strdup(name) : NULL;
+        virDomainSnapshotFree(snaps[i]);
+    }
+
+    free(snaps);
+    return LV_OK;
+}
+
+/* Snapshot of a domain by name; *dom is set to release with domain_put */
+static virDomainSnapshotPtr snapshot_get(const char* domain, const char* snapshot,
+                                         virDomainPtr* dom, int* ret) {
+    *dom = domain_get(domain);
+    if (*dom == NULL) {
+        set_error("Domain not found");
+        *ret = LV_ERR_NOT_FOUND;
+        return NULL;
+    }
+
+    virDomainSnapshotPtr snap = snapshot ? virDomainSnapshotLookupByName(*dom, snapshot, 0) : NULL;
+    if (snap == NULL) {
+        domain_put(*dom, 0);
+        set_error("Snapshot not found");
+        *ret = LV_ERR_NOT_FOUND;
+    }
+    return snap;
+}
+
+int lv_domain_snapshot_revert(const char* domain, const char* snapshot, unsigned int flags) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if ((flags & ~(LV_SAVE_RUNNING | LV_SAVE_PAUSED)) ||
+        (flags == (LV_SAVE_RUNNING | LV_SAVE_PAUSED))) {
+        set_error("Invalid revert flags");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virDomainPtr dom;
+    int ret;
+    virDomainSnapshotPtr snap = snapshot_get(domain, snapshot, &dom, &ret);
+    if (snap == NULL) {
+        return ret;
+    }
+
+    unsigned int vflags = 0;
+    if (flags & LV_SAVE_RUNNING) {
+        vflags |= VIR_DOMAIN_SNAPSHOT_REVERT_RUNNING;
+    }
+    if (flags & LV_SAVE_PAUSED) {
+        vflags |= VIR_DOMAIN_SNAPSHOT_REVERT_PAUSED;
+    }
+
+    ret = virDomainRevertToSnapshot(snap, vflags);
+    virDomainSnapshotFree(snap);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to revert to snapshot");
+        return LV_ERR_OPERATION;
+    }
+
+    return LV_OK;
+}
+
+int lv_domain_snapshot_delete(const char* domain, const char* snapshot, int metadata_only) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    virDomainPtr dom;
+    int ret;
+    virDomainSnapshotPtr snap = snapshot_get(domain, snapshot, &dom, &ret);
+    if (snap == NULL) {
+        return ret;
+    }
+
+    ret = virDomainSnapshotDelete(snap, metadata_only ? VIR_DOMAIN_SNAPSHOT_DELETE_METADATA_ONLY : 0);
+    virDomainSnapshotFree(snap);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to delete snapshot");
+        return LV_ERR_OPERATION;
+    }
+
+    return LV_OK;
+}
+
+int lv_domain_save(const char* name, const char* path, unsigned int flags) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (path == NULL) {
+        set_error("Invalid save path");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    unsigned int vflags;
+    if (save_flags(flags, &vflags) != LV_OK) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    virDomainPtr dom = domain_get(name);
+    if (dom == NULL) {
+        set_error("Domain not found");
+        return LV_ERR_NOT_FOUND;
+    }
+
+    int ret = virDomainSaveFlags(dom, path, NULL, vflags);
+    domain_put(dom, ret);
+
+    if (ret < 0) {
+        set_error("Failed to save domain");
+        return LV_ERR_OPERATION;
+    }
+
+    /* A transient domain is gone once saved */
+    dom_cache_forget(NULL, name, NULL);
+    return LV_OK;
+}
+
+int lv_domain_restore(const char* path, const char* dxml, unsigned int flags) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return LV_ERR_CONNECT;
+    }
+
+    if (path == NULL) {
+        set_error("Invalid restore path");
+        return LV_ERR_INVALID_ARG;
+    }
+
+    unsigned int vflags;
+    if (save_flags(flags, &vflags) != LV_OK) {
+        return LV_ERR_INVALID_ARG;
+    }
+
+    if (virDomainRestoreFlags(conn_get(), path, dxml, vflags) < 0) {
+        set_error("Failed to restore domain");
+        return LV_ERR_OPERATION;
+    }
+
+    return LV_OK;
+}
+
+char* lv_save_image_get_xml(const char* path) {
+    if (g_conn == NULL) {
+        set_error("Not connected");
+        return NULL;
+    }
+
+    if (path == NULL) {
+        set_error("Invalid save image path");
+        return NULL;
+    }
+
+    char* xml = virDomainSaveImageGetXMLDesc(conn_get(), path, VIR_DOMAIN_SAVE_IMAGE_XML_SECURE);
+    if (xml == NULL) {
+        set_error("Failed to read save image");
+    }
+    return xml;
+}
@@ -55,6 +55,112 @@ typedef struct {
     uint64_t net_tx_bytes;
 } lv_domain_stats_t;
 
+/* Fixed string sizes in bulk records */
+#define LV_UUID_STRING_LEN    37
+#define LV_DOMAIN_NAME_LEN    128
+
+/* Bulk statistics of one domain, without pointers so an array of them
+ * can be read in place. Block and interface counters are summed over
+ * the devices of the domain. Fields a domain does not report are 0.
+ */
+typedef struct {
+    char     uuid[LV_UUID_STRING_LEN];
+    char     name[LV_DOMAIN_NAME_LEN];
+    int      state;
+
+    uint64_t cpu_time_ns;
+    uint64_t cpu_user_ns;
+    uint64_t cpu_system_ns;
+
+    uint64_t balloon_current_kb;
+    uint64_t balloon_maximum_kb;
+    uint64_t balloon_rss_kb;
+    uint64_t balloon_available_kb;
+    uint64_t balloon_usable_kb;
+    uint64_t balloon_unused_kb;
+
+    uint32_t vcpu_current;
+    uint32_t vcpu_maximum;
+
+    uint32_t block_count;
+    uint64_t block_rd_bytes;
+    uint64_t block_wr_bytes;
+    uint64_t block_rd_reqs;
+    uint64_t block_wr_reqs;
+
+    uint32_t net_count;
+    uint64_t net_rx_bytes;
+    uint64_t net_tx_bytes;
+    uint64_t net_rx_pkts;
+    uint64_t net_tx_pkts;
+    uint64_t net_rx_drop;
+    uint64_t net_tx_drop;
+} lv_domain_bulk_stats_t;
+
+/* Domain event types */
+#define LV_EVENT_LIFECYCLE      1
+#define LV_EVENT_REBOOT         2
+#define LV_EVENT_BALLOON_CHANGE 3
+#define LV_EVENT_BLOCK_JOB      4
+
+#define LV_EVENT_DISK_LEN       64
+
+/* One domain event, without pointers so the ring can be drained by copy.
+ * LIFECYCLE: event and detail are libvirt's VIR_DOMAIN_EVENT_* values.
+ * BALLOON_CHANGE: value is the new balloon size in KB.
+ * BLOCK_JOB: event is the job type, detail its status, disk the target.
+ */
+typedef struct {
+    uint64_t timestamp_ns;          /* CLOCK_REALTIME */
+    uint64_t value;
+    int32_t  type;                  /* LV_EVENT_* */
+    int32_t  event;
+    int32_t  detail;
+    char     uuid[LV_UUID_STRING_LEN];
+    char     name[LV_DOMAIN_NAME_LEN];
+    char     disk[LV_EVENT_DISK_LEN];
+} lv_event_t;
+
+/* Disk of a domain spec */
+typedef struct {
+    const char* source_path;
+    const char* target_dev;         /* "vda", ... */
+    const char* format;             /* "qcow2" when NULL */
+    int      readonly;
+    uint32_t queues;                /* 0 for one per vCPU */
+    uint32_t iothread;              /* 0 to spread disks over the iothreads */
+} lv_disk_spec_t;
+
+/* Network interface of a domain spec */
+typedef struct {
+    const char* network;
+    const char* mac_address;        /* NULL for a generated one */
+    uint32_t queues;                /* 0 for one per vCPU */
+} lv_nic_spec_t;
+
+/* Largest queue count given to a device by default */
+#define LV_SPEC_MAX_QUEUES 16
+
+/* Structured domain definition. The XML built from it uses virtio disks
+ * with cache='none' io='native' on iothreads, and multiqueue vhost-net.
+ */
+typedef struct {
+    const char* name;
+    const char* uuid;               /* NULL for a generated one */
+    uint32_t vcpus;
+    uint64_t memory_kb;
+    int      hugepages;             /* back guest memory with hugepages */
+    uint64_t hugepage_size_kb;      /* 0 for the host default */
+    const int* vcpu_pins;           /* host CPU of each vCPU, NULL unpinned */
+    const char* emulator_cpuset;    /* emulator and iothread CPUs, NULL unpinned */
+    const char* numa_nodeset;       /* host nodes for guest memory, NULL any */
+    uint32_t iothreads;             /* 0 for one per disk, up to 4 */
+    const lv_disk_spec_t* disks;
+    int      ndisks;
+    const lv_nic_spec_t* nics;
+    int      nnics;
+} lv_domain_spec_t;
+
 /* Host info structure */
 typedef struct {
     char*    hostname;
@@ -77,13 +183,26 @@ typedef struct {
  */
 int lv_connect(const char* uri);
 
-/* Disconnect from hypervisor */
+/* Largest connection pool */
+#define LV_POOL_MAX 16
+
+/* Connect with a pool of size connections, so calls from different
+ * threads run in parallel instead of queueing on one client. Each
+ * thread keeps to one connection; a dead one is reopened on its next
+ * use. lv_connect is lv_connect_pool(uri, 1). Safe to call from any
+ * thread.
+ */
+int lv_connect_pool(const char* uri, int size);
+
+/* Disconnect from hypervisor. Releases the cached domain handles, so
+ * no other call may be in progress.
+ */
 void lv_disconnect(void);
 
 /* Check if connected */
 int lv_is_connected(void);
 
-/* Get last error message */
+/* Get last error message of the calling thread */
 const char* lv_get_last_error(void);
 
 /*
@@ -106,6 +225,13 @@ int lv_domain_create(const char* xml);
 /* Define a domain (persistent) from XML */
 int lv_domain_define(const char* xml);
 
+/* Domain XML for a spec. Returns NULL on error; free the result. */
+char* lv_domain_spec_xml(const lv_domain_spec_t* spec);
+
+/* Create or define a domain from a spec */
+int lv_domain_create_spec(const lv_domain_spec_t* spec);
+int lv_domain_define_spec(const lv_domain_spec_t* spec);
+
 /* Undefine (remove persistent config) a domain */
 int lv_domain_undefine(const char* name);
 
@@ -149,6 +275,23 @@ int lv_domain_get_state(const char* name);
 /* Get domain statistics */
 int lv_domain_get_stats(const char* name, lv_domain_stats_t* stats);
 
+/* Get statistics of all domains in one call.
+ * Fills up to capacity records of the caller's array and sets count
+ * to the number of domains; when count exceeds capacity the rest were
+ * dropped and the caller can retry with a larger array.
+ */
+int lv_domain_get_all_stats(lv_domain_bulk_stats_t* stats, int capacity, int* count);
+
+/* Export the bulk statistics of every domain as "domain" blocks of the
+ * process metrics arena, refreshed on each pass of its collector
+ * thread. zx_metrics_open must have been called. Blocks are labelled
+ * uuid=...,name=... and dropped when their domain goes away.
+ */
+int lv_metrics_start(void);
+
+/* Stop exporting and remove the domain blocks */
+void lv_metrics_stop(void);
+
 /*
  * Domain listing
  */
@@ -200,6 +343,154 @@ int lv_domain_attach_network(const char* domain, const char* network_name,
 /* Detach a network interface from domain */
 int lv_domain_detach_network(const char* domain, const char* mac_address);
 
+/*
+ * Live migration
+ */
+
+/* Progress callback verdicts */
+#define LV_MIGRATE_CONTINUE         0
+#define LV_MIGRATE_START_POSTCOPY   1   /* switch to post-copy now */
+#define LV_MIGRATE_ABORT            2
+
+/* Migration settings. Zero fields take libvirt's defaults. */
+typedef struct {
+    const char* dest_uri;               /* libvirt URI of the destination host */
+    const char* migrate_uri;            /* data connection URI, NULL for default */
+    const char* dest_name;              /* rename on the destination, NULL to keep */
+    const char* compression;            /* "zstd", "zlib", "xbzrle", "mt", NULL for none */
+    int      parallel_connections;      /* multifd connections, 0 for a single one */
+    int      auto_converge;             /* throttle vCPUs when memory does not converge */
+    int      postcopy;                  /* allow switching to post-copy */
+    uint64_t postcopy_after_ms;         /* switch automatically after this long, 0 never */
+    uint64_t bandwidth_mib;             /* MiB/s cap for pre-copy, 0 unlimited */
+    uint64_t postcopy_bandwidth_mib;    /* MiB/s cap for post-copy, 0 unlimited */
+    uint64_t max_downtime_ms;           /* tolerated final pause, 0 for default */
+    int      persist;                   /* define on the destination, undefine here */
+    uint32_t progress_interval_ms;      /* progress callback period, 0 for 500 */
+} lv_migrate_params_t;
+
+/* Migration progress, from virDomainGetJobStats */
+typedef struct {
+    uint64_t elapsed_ms;
+    uint64_t data_total;                /* bytes, memory and disks */
+    uint64_t data_processed;
+    uint64_t data_remaining;
+    uint64_t mem_remaining;
+    uint64_t mem_bps;                   /* transfer rate */
+    uint64_t mem_dirty_rate;            /* pages dirtied per second */
+    uint64_t mem_iteration;             /* pre-copy passes */
+    uint64_t downtime_ms;               /* expected, or actual once completed */
+    int32_t  auto_converge_throttle;    /* percent of vCPU time taken */
+    int32_t  postcopy;                  /* switched to post-copy */
+    int32_t  completed;                 /* final report */
+} lv_migrate_progress_t;
+
+/* Called every progress_interval_ms while migrating and once at the end.
+ * Returns an LV_MIGRATE_* verdict; the final call's verdict is ignored.
+ */
+typedef int (*lv_migrate_progress_cb)(const lv_migrate_progress_t* progress, void* opaque);
+
+/* Live-migrate a running domain peer to peer, blocking until it is done.
+ * progress may be NULL.
+ */
+int lv_domain_migrate(const char* name, const lv_migrate_params_t* params,
+                      lv_migrate_progress_cb progress, void* opaque);
+
+/*
+ * Fast provisioning
+ */
+
+/* Create a qcow2 overlay named name in a storage pool, backed by
+ * backing_path (format backing_format, "qcow2" when NULL) and of its
+ * size. Sets path to the overlay's path; free it.
+ */
+int lv_volume_create_overlay(const char* pool, const char* name, const char* backing_path,
+                             const char* backing_format, char** path);
+
+/* Delete a storage volume by path */
+int lv_volume_delete(const char* path);
+
+/* Define a linked clone: a domain from spec whose writable disks are
+ * new overlays, "<name>-<target>.qcow2" in pool, on the spec's
+ * source_path images. Clones share the golden image and write only
+ * their own changes, so the golden image must not change while any
+ * exist. Readonly disks are shared as given. Nothing is left behind
+ * on failure.
+ */
+int lv_domain_define_linked_clone(const lv_domain_spec_t* spec, const char* pool);
+
+/* External snapshot settings */
+typedef struct {
+    const char* name;               /* NULL for the creation time */
+    const char* description;        /* NULL for none */
+    const char* memory_file;        /* memory image, NULL for disks only */
+    int      live;                  /* keep vCPUs running while memory is saved */
+    int      quiesce;               /* freeze guest filesystems via the guest agent */
+} lv_snapshot_params_t;
+
+/* Take an external snapshot. The disks move to new overlays and the
+ * current images become the snapshot; with memory_file the guest's
+ * memory is saved too, so the snapshot can be reverted to running.
+ */
+int lv_domain_snapshot_create(const char* domain, const lv_snapshot_params_t* params);
+
+/* List snapshot names of a domain; free with lv_free_string_list */
+int lv_domain_snapshot_list(const char* domain, char*** names, int* count);
+
+/* Save and restore flags */
+#define LV_SAVE_BYPASS_CACHE  1     /* skip the host page cache for the image */
+#define LV_SAVE_RUNNING       2     /* run once restored, whatever the saved state */
+#define LV_SAVE_PAUSED        4     /* stay paused once restored */
+
+/* Revert a domain to a snapshot. flags takes LV_SAVE_RUNNING or
+ * LV_SAVE_PAUSED.
+ */
+int lv_domain_snapshot_revert(const char* domain, const char* snapshot, unsigned int flags);
+
+/* Delete a snapshot; with metadata_only its files are kept */
+int lv_domain_snapshot_delete(const char* domain, const char* snapshot, int metadata_only);
+
+/* Save a running domain's memory and device state to path and stop it.
+ * A pool can boot a desktop once, save it, and later restore it in the
+ * time it takes to read the image instead of cold-booting.
+ */
+int lv_domain_save(const char* name, const char* path, unsigned int flags);
+
+/* Restore a domain from a saved image. dxml, when not NULL, replaces
+ * the saved domain XML; it may only change host-side details such as
+ * disk paths (see lv_save_image_get_xml).
+ */
+int lv_domain_restore(const char* path, const char* dxml, unsigned int flags);
+
+/* Domain XML stored in a saved image. Returns NULL on error; free the
+ * result.
+ */
+char* lv_save_image_get_xml(const char* path);
+
+/*
+ * Domain events
+ */
+
+/* Start the libvirt event loop on its own thread and queue domain
+ * events in a ring of capacity entries (rounded up to a power of 2).
+ * Must be called before lv_connect; the loop runs until the process
+ * exits. Connections opened afterwards deliver events.
+ */
+int lv_events_start(int capacity);
+
+/* Copy up to max queued events, oldest first. Returns the number
+ * copied. There must be only one consumer.
+ */
+int lv_events_poll(lv_event_t* events, int max);
+
+/* Wait up to timeout_ms (-1 forever) for queued events.
+ * Returns 1 when events are queued, 0 on timeout, <0 on error.
+ */
+int lv_events_wait(int timeout_ms);
+
+/* Number of events dropped because the ring was full */
+uint64_t lv_events_dropped(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,306 @@
+/**
+ * Zixiao Hypervisor - Shared-Memory Metrics Arena
+ *
+ * One POSIX shared-memory arena per process holds the counters of every
+ * clib library linked into it. Libraries describe their metrics once as
+ * types (a named list of fields) and add a block of that type per object
+ * they track, labelled with what it belongs to (VM, port, interface).
+ * Readers, such as the Go agent, map the arena read-only and take the
+ * whole of it with one copy: no locks, no syscalls and no cgo calls per
+ * counter, however many VMs the host runs.
+ *
+ * Layout, all offsets from the start of the arena:
+ *
+ *   0              zx_metrics_header_t
+ *   types_offset   max_types x zx_metrics_type_t (types_used valid)
+ *   blocks_offset  max_blocks x zx_metrics_block_t (blocks_used scanned)
+ *
+ * Types never change once published. Each block carries a sequence
+ * counter that is odd while the block is added, removed or rewritten
+ * as a whole; the header generation is bumped whenever a type or block
+ * is added or removed, so readers can cache the schema between changes.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_ZX_METRICS_H
+#define ZIXIAO_ZX_METRICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Error codes */
+#define ZX_METRICS_OK               0
+#define ZX_METRICS_ERR_INIT        -1
+#define ZX_METRICS_ERR_NOT_INIT    -2
+#define ZX_METRICS_ERR_MEMORY      -3
+#define ZX_METRICS_ERR_INVALID     -4
+#define ZX_METRICS_ERR_EXISTS      -5
+
+/* Shared-memory objects are named with this prefix, under /dev/shm */
+#define ZX_METRICS_SHM_PREFIX       "/zixiao-metrics"
+
+#define ZX_METRICS_MAGIC            0x414d585a  /* "ZXMA" */
+#define ZX_METRICS_VERSION          1
+
+#define ZX_METRICS_MAX_TYPES        64
+#define ZX_METRICS_MAX_BLOCKS       16384
+#define ZX_METRICS_MAX_FIELDS       46          /* Values per block */
+#define ZX_METRICS_NAME_LEN         40
+#define ZX_METRICS_TYPE_NAME_LEN    48
+#define ZX_METRICS_LABELS_LEN       128
+
+/* Field kinds */
+#define ZX_METRICS_COUNTER          1   /* Monotonic uint64 */
+#define ZX_METRICS_GAUGE            2   /* Current value, int64 */
+#define ZX_METRICS_BUCKET           3   /* Observations <= bound, not cumulative */
+
+/* Type flags */
+#define ZX_METRICS_T_HISTOGRAM      (1u << 0)   /* count, sum, then buckets */
+
+/* Block flags */
+#define ZX_METRICS_B_USED           (1u << 0)
+
+/* Bound of the last bucket of a histogram */
+#define ZX_METRICS_INF              UINT64_MAX
+
+/* One field of a type, 56 bytes */
+typedef struct {
+    char name[ZX_METRICS_NAME_LEN];     /* e.g. "rx_packets" */
+    uint32_t kind;                      /* ZX_METRICS_COUNTER etc. */
+    uint32_t reserved;
+    uint64_t bound;                     /* Buckets: upper bound, inclusive */
+} zx_metrics_field_t;
+
+/* A metric type, 2688 bytes, 64-byte aligned */
+typedef struct {
+    char name[ZX_METRICS_TYPE_NAME_LEN];    /* e.g. "vhost_port" */
+    uint32_t nfields;
+    uint32_t flags;                     /* ZX_METRICS_T_* */
+    uint8_t reserved[8];
+    zx_metrics_field_t fields[ZX_METRICS_MAX_FIELDS];
+} __attribute__((aligned(64))) zx_metrics_type_t;
+
+/*
+ * One labelled instance of a type. Fixed layout, 512 bytes, 64-byte
+ * aligned; values[i] belongs to fields[i] of the type.
+ *
+ * Read protocol: load seq (acquire); retry while odd. Copy the block,
+ * then load seq again (after an acquire fence); retry if it changed.
+ * Values updated one at a time with zx_metrics_add/zx_metrics_set are
+ * never torn but may be a few updates apart from each other.
+ */
+typedef struct {
+    uint32_t seq;                       /* Odd while being written */
+    uint32_t flags;                     /* ZX_METRICS_B_* */
+    uint32_t type;                      /* Index in the type table */
+    uint32_t reserved;
+    char labels[ZX_METRICS_LABELS_LEN]; /* "key=value,key=value" */
+    uint64_t values[ZX_METRICS_MAX_FIELDS];
+} __attribute__((aligned(64))) zx_metrics_block_t;
+
+/* Arena header */
+typedef struct {
+    uint32_t magic;                     /* ZX_METRICS_MAGIC */
+    uint32_t version;                   /* ZX_METRICS_VERSION */
+    uint32_t header_size;               /* sizeof(zx_metrics_header_t) */
+    uint32_t type_size;                 /* sizeof(zx_metrics_type_t) */
+    uint32_t block_size;                /* sizeof(zx_metrics_block_t) */
+    uint32_t max_types;
+    uint32_t max_blocks;
+    uint32_t pid;                       /* Producing process */
+    uint64_t types_offset;
+    uint64_t blocks_offset;
+    uint64_t arena_size;
+    uint64_t generation;                /* Bumped when a type or block comes or goes */
+    uint32_t types_used;                /* Types published */
+    uint32_t blocks_used;               /* Block slots ever used */
+    uint64_t started_ns;                /* CLOCK_REALTIME at creation */
+    uint64_t collected_ns;              /* Last collector pass */
+    uint8_t reserved[40];
+} __attribute__((aligned(64))) zx_metrics_header_t;
+
+/* Called by the collector thread on every pass */
+typedef void (*zx_metrics_collector_t)(void *userdata);
+
+/* ============================================================================
+ * Arena
+ * ============================================================================ */
+
+/**
+ * Create this process's arena
+ *
+ * Call before initializing the libraries that export into it: until
+ * then block registration returns NULL and their metrics go nowhere.
+ *
+ * @param shm_name Shared-memory object name (NULL for
+ *                 ZX_METRICS_SHM_PREFIX ".<pid>")
+ * @return 0 on success, negative error code on failure
+ */
+int zx_metrics_open(const char *shm_name);
+
+/**
+ * Stop the collector, unmap the arena and remove it
+ *
+ * Blocks handed out become invalid; call at process exit, once the
+ * libraries have been cleaned up.
+ */
+void zx_metrics_close(void);
+
+/**
+ * Check whether this process has an arena
+ */
+bool zx_metrics_is_open(void);
+
+/* ============================================================================
+ * Schema
+ * ============================================================================ */
+
+/**
+ * Publish a metric type
+ *
+ * Registering the same name again with the same fields returns the
+ * existing type, so every library can do it on its own init.
+ *
+ * @param name Type name
+ * @param fields Fields, in value order
+ * @param nfields Number of fields (at most ZX_METRICS_MAX_FIELDS)
+ * @return Type index, or negative error code
+ */
+int zx_metrics_type_register(const char *name, const zx_metrics_field_t *fields,
+                             uint32_t nfields);
+
+/**
+ * Publish a histogram type
+ *
+ * Its fields are "count", "sum", then one bucket per bound plus a last
+ * one for the rest (ZX_METRICS_INF).
+ *
+ * @param name Type name
+ * @param bounds Ascending bucket upper bounds
+ * @param nbounds Number of bounds (at most ZX_METRICS_MAX_FIELDS - 3)
+ * @return Type index, or negative error code
+ */
+int zx_metrics_histogram_register(const char *name, const uint64_t *bounds,
+                                  uint32_t nbounds);
+
+/**
+ * Add a block of a type
+ *
+ * Its values start at zero.
+ *
+ * @param type Type index
+ * @param labels Labels, "key=value" pairs separated by commas
+ * @return Block, or NULL when there is no arena or it is full
+ */
+zx_metrics_block_t *zx_metrics_block_add(int type, const char *labels);
+
+/**
+ * Remove a block (NULL is ignored)
+ */
+void zx_metrics_block_remove(zx_metrics_block_t *block);
+
+/* ============================================================================
+ * Updates
+ * ============================================================================ */
+
+/* Add to a counter or gauge; safe from any thread (NULL block ignored) */
+static inline void zx_metrics_add(zx_metrics_block_t *block, uint32_t field, uint64_t delta) {
+    if (block)
+        __atomic_fetch_add(&block->values[field], delta, __ATOMIC_RELAXED);
+}
+
+/* Set a counter or gauge; safe from any thread (NULL block ignored) */
+static inline void zx_metrics_set(zx_metrics_block_t *block, uint32_t field, uint64_t value) {
+    if (block)
+        __atomic_store_n(&block->values[field], value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Rewrite a block as a whole: readers see all the values stored between
+ * begin and end or none. One writer per block at a time.
+ */
+static inline void zx_metrics_write_begin(zx_metrics_block_t *block) {
+    __atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void zx_metrics_write_end(zx_metrics_block_t *block) {
+    __atomic_store_n(&block->seq, block->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Record an observation in a histogram block (NULL block ignored)
+ *
+ * Safe from any thread.
+ *
+ * @param block Block of a histogram type
+ * @param value Observed value
+ */
+void zx_metrics_observe(zx_metrics_block_t *block, uint64_t value);
+
+/* ============================================================================
+ * Collectors
+ * ============================================================================ */
+
+/**
+ * Add a collector, for libraries whose counters are pulled
+ *
+ * Collectors run one after another on the collector thread, and must
+ * not add or remove collectors themselves.
+ *
+ * @param fn Collector
+ * @param userdata Passed to fn
+ * @return 0 on success, negative error code on failure
+ */
+int zx_metrics_collector_add(zx_metrics_collector_t fn, void *userdata);
+
+/**
+ * Remove a collector; waits for a pass that is running it
+ */
+void zx_metrics_collector_remove(zx_metrics_collector_t fn, void *userdata);
+
+/**
+ * Start the collector thread
+ *
+ * @param interval_ms Time between passes (0 for 1000)
+ * @return 0 on success, negative error code on failure
+ */
+int zx_metrics_start(uint32_t interval_ms);
+
+/**
+ * Stop the collector thread
+ */
+void zx_metrics_stop(void);
+
+/* ============================================================================
+ * Readers
+ * ============================================================================ */
+
+/**
+ * Consistent copy of a block, following the read protocol
+ *
+ * @param block Block in a mapped arena
+ * @param out Output copy
+ */
+static inline void zx_metrics_read_block(const zx_metrics_block_t *block,
+                                         zx_metrics_block_t *out) {
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&block->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        __builtin_memcpy(out, (const void *)block, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&block->seq, __ATOMIC_RELAXED) != seq);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZIXIAO_ZX_METRICS_H */
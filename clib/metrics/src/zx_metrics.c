@@ -0,0 +1,425 @@
+/**
+ * Zixiao Hypervisor - Shared-Memory Metrics Arena
+ *
+ * The arena is mapped once for the life of the process and never moves,
+ * so blocks handed to libraries stay valid until zx_metrics_close().
+ * Registration is serialized by one lock; value updates take none. Free
+ * block slots are kept on a private stack so slots freed by removed VMs
+ * are reused before the scanned range grows.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#define _POSIX_C_SOURCE 200809L     /* clock_gettime */
+
+#include "zx_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define MAX_COLLECTORS 32
+#define DEFAULT_INTERVAL_MS 1000
+
+#define TYPES_OFFSET 4096
+#define BLOCKS_OFFSET (TYPES_OFFSET + ZX_METRICS_MAX_TYPES * sizeof(zx_metrics_type_t))
+#define ARENA_SIZE (BLOCKS_OFFSET + ZX_METRICS_MAX_BLOCKS * sizeof(zx_metrics_block_t))
+
+_Static_assert(sizeof(zx_metrics_header_t) <= TYPES_OFFSET, "header too large");
+_Static_assert(sizeof(zx_metrics_field_t) == 56, "field layout changed");
+_Static_assert(sizeof(zx_metrics_type_t) == 2688, "type layout changed");
+_Static_assert(sizeof(zx_metrics_block_t) == 512, "block layout changed");
+
+typedef struct {
+    zx_metrics_collector_t fn;
+    void *userdata;
+} collector_t;
+
+static struct {
+    pthread_mutex_t lock;       /* Types and block slots */
+    zx_metrics_header_t *arena;
+    char shm_name[64];
+
+    uint32_t free_slots[ZX_METRICS_MAX_BLOCKS];
+    uint32_t free_count;
+
+    pthread_mutex_t collect_lock;   /* Collector list, held for a pass */
+    collector_t collectors[MAX_COLLECTORS];
+    int collector_count;
+
+    pthread_t thread;
+    bool running;
+    int wake[2];                /* Pipe that stops the collector */
+    int interval_ms;
+} metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .collect_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = { -1, -1 },
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static zx_metrics_type_t *type_at(uint32_t type) {
+    return (zx_metrics_type_t *)((char *)metrics.arena + TYPES_OFFSET) + type;
+}
+
+static zx_metrics_block_t *block_at(uint32_t slot) {
+    return (zx_metrics_block_t *)((char *)metrics.arena + BLOCKS_OFFSET) + slot;
+}
+
+/* ============================================================================
+ * Arena
+ * ============================================================================ */
+
+int zx_metrics_open(const char *shm_name) {
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.arena) {
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_EXISTS;
+    }
+
+    if (shm_name)
+        snprintf(metrics.shm_name, sizeof(metrics.shm_name), "%s", shm_name);
+    else
+        snprintf(metrics.shm_name, sizeof(metrics.shm_name), "%s.%ld",
+                 ZX_METRICS_SHM_PREFIX, (long)getpid());
+
+    int fd = shm_open(metrics.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_INIT;
+    }
+    /* Sparse: only slots in use are ever touched */
+    if (ftruncate(fd, (off_t)ARENA_SIZE) != 0) {
+        close(fd);
+        shm_unlink(metrics.shm_name);
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_MEMORY;
+    }
+    zx_metrics_header_t *h = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED, fd, 0);
+    close(fd);
+    if (h == MAP_FAILED) {
+        shm_unlink(metrics.shm_name);
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_MEMORY;
+    }
+
+    h->version = ZX_METRICS_VERSION;
+    h->header_size = sizeof(zx_metrics_header_t);
+    h->type_size = sizeof(zx_metrics_type_t);
+    h->block_size = sizeof(zx_metrics_block_t);
+    h->max_types = ZX_METRICS_MAX_TYPES;
+    h->max_blocks = ZX_METRICS_MAX_BLOCKS;
+    h->pid = (uint32_t)getpid();
+    h->types_offset = TYPES_OFFSET;
+    h->blocks_offset = BLOCKS_OFFSET;
+    h->arena_size = ARENA_SIZE;
+    h->started_ns = now_ns();
+    /* Readers check the magic last */
+    __atomic_store_n(&h->magic, ZX_METRICS_MAGIC, __ATOMIC_RELEASE);
+
+    metrics.arena = h;
+    metrics.free_count = 0;
+    pthread_mutex_unlock(&metrics.lock);
+    return ZX_METRICS_OK;
+}
+
+void zx_metrics_close(void) {
+    zx_metrics_stop();
+
+    pthread_mutex_lock(&metrics.lock);
+    if (metrics.arena) {
+        munmap(metrics.arena, ARENA_SIZE);
+        shm_unlink(metrics.shm_name);
+        metrics.arena = NULL;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+bool zx_metrics_is_open(void) {
+    return __atomic_load_n(&metrics.arena, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/* ============================================================================
+ * Schema
+ * ============================================================================ */
+
+static bool same_fields(const zx_metrics_type_t *t, const zx_metrics_field_t *fields,
+                        uint32_t nfields) {
+    if (t->nfields != nfields)
+        return false;
+    for (uint32_t i = 0; i < nfields; i++) {
+        if (strncmp(t->fields[i].name, fields[i].name, ZX_METRICS_NAME_LEN) != 0 ||
+            t->fields[i].kind != fields[i].kind || t->fields[i].bound != fields[i].bound)
+            return false;
+    }
+    return true;
+}
+
+static int type_publish(const char *name, const zx_metrics_field_t *fields,
+                        uint32_t nfields, uint32_t flags) {
+    if (!name || !*name || strlen(name) >= ZX_METRICS_TYPE_NAME_LEN ||
+        !fields || nfields == 0 || nfields > ZX_METRICS_MAX_FIELDS) {
+        return ZX_METRICS_ERR_INVALID;
+    }
+    for (uint32_t i = 0; i < nfields; i++) {
+        if (!fields[i].name[0] || fields[i].kind < ZX_METRICS_COUNTER ||
+            fields[i].kind > ZX_METRICS_BUCKET)
+            return ZX_METRICS_ERR_INVALID;
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    zx_metrics_header_t *h = metrics.arena;
+    if (!h) {
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_NOT_INIT;
+    }
+
+    for (uint32_t i = 0; i < h->types_used; i++) {
+        zx_metrics_type_t *t = type_at(i);
+        if (strcmp(t->name, name) != 0)
+            continue;
+        int ret = t->flags == flags && same_fields(t, fields, nfields)
+                      ? (int)i : ZX_METRICS_ERR_EXISTS;
+        pthread_mutex_unlock(&metrics.lock);
+        return ret;
+    }
+
+    if (h->types_used == ZX_METRICS_MAX_TYPES) {
+        pthread_mutex_unlock(&metrics.lock);
+        return ZX_METRICS_ERR_MEMORY;
+    }
+
+    uint32_t index = h->types_used;
+    zx_metrics_type_t *t = type_at(index);
+    snprintf(t->name, sizeof(t->name), "%s", name);
+    t->nfields = nfields;
+    t->flags = flags;
+    for (uint32_t i = 0; i < nfields; i++) {
+        t->fields[i] = fields[i];
+        t->fields[i].name[ZX_METRICS_NAME_LEN - 1] = '\0';
+        t->fields[i].reserved = 0;
+    }
+    __atomic_store_n(&h->types_used, index + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->generation, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&metrics.lock);
+    return (int)index;
+}
+
+int zx_metrics_type_register(const char *name, const zx_metrics_field_t *fields,
+                             uint32_t nfields) {
+    for (uint32_t i = 0; fields && i < nfields && i < ZX_METRICS_MAX_FIELDS; i++) {
+        if (fields[i].kind == ZX_METRICS_BUCKET)
+            return ZX_METRICS_ERR_INVALID;
+    }
+    return type_publish(name, fields, nfields, 0);
+}
+
+int zx_metrics_histogram_register(const char *name, const uint64_t *bounds,
+                                  uint32_t nbounds) {
+    zx_metrics_field_t fields[ZX_METRICS_MAX_FIELDS] = {
+        { .name = "count", .kind = ZX_METRICS_COUNTER },
+        { .name = "sum", .kind = ZX_METRICS_COUNTER },
+    };
+
+    if (!bounds || nbounds == 0 || nbounds > ZX_METRICS_MAX_FIELDS - 3) {
+        return ZX_METRICS_ERR_INVALID;
+    }
+    for (uint32_t i = 0; i < nbounds; i++) {
+        if ((i > 0 && bounds[i] <= bounds[i - 1]) || bounds[i] == ZX_METRICS_INF)
+            return ZX_METRICS_ERR_INVALID;
+        snprintf(fields[2 + i].name, ZX_METRICS_NAME_LEN, "le_%llu",
+                 (unsigned long long)bounds[i]);
+        fields[2 + i].kind = ZX_METRICS_BUCKET;
+        fields[2 + i].bound = bounds[i];
+    }
+    snprintf(fields[2 + nbounds].name, ZX_METRICS_NAME_LEN, "le_inf");
+    fields[2 + nbounds].kind = ZX_METRICS_BUCKET;
+    fields[2 + nbounds].bound = ZX_METRICS_INF;
+
+    return type_publish(name, fields, nbounds + 3, ZX_METRICS_T_HISTOGRAM);
+}
+
+/* ============================================================================
+ * Blocks
+ * ============================================================================ */
+
+zx_metrics_block_t *zx_metrics_block_add(int type, const char *labels) {
+    pthread_mutex_lock(&metrics.lock);
+    zx_metrics_header_t *h = metrics.arena;
+    if (!h || type < 0 || (uint32_t)type >= h->types_used) {
+        pthread_mutex_unlock(&metrics.lock);
+        return NULL;
+    }
+
+    uint32_t slot;
+    if (metrics.free_count > 0) {
+        slot = metrics.free_slots[--metrics.free_count];
+    } else if (h->blocks_used < ZX_METRICS_MAX_BLOCKS) {
+        slot = h->blocks_used;
+    } else {
+        pthread_mutex_unlock(&metrics.lock);
+        return NULL;
+    }
+
+    zx_metrics_block_t *b = block_at(slot);
+    zx_metrics_write_begin(b);
+    uint32_t seq = b->seq;
+    memset(b, 0, sizeof(*b));
+    b->seq = seq;
+    b->flags = ZX_METRICS_B_USED;
+    b->type = (uint32_t)type;
+    snprintf(b->labels, sizeof(b->labels), "%s", labels ? labels : "");
+    zx_metrics_write_end(b);
+
+    if (slot == h->blocks_used)
+        __atomic_store_n(&h->blocks_used, slot + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&h->generation, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&metrics.lock);
+    return b;
+}
+
+void zx_metrics_block_remove(zx_metrics_block_t *block) {
+    if (!block)
+        return;
+
+    pthread_mutex_lock(&metrics.lock);
+    zx_metrics_header_t *h = metrics.arena;
+    if (!h || !(block->flags & ZX_METRICS_B_USED)) {
+        pthread_mutex_unlock(&metrics.lock);
+        return;
+    }
+
+    zx_metrics_write_begin(block);
+    uint32_t seq = block->seq;
+    memset(block, 0, sizeof(*block));
+    block->seq = seq;
+    zx_metrics_write_end(block);
+
+    metrics.free_slots[metrics.free_count++] = (uint32_t)(block - block_at(0));
+    __atomic_add_fetch(&h->generation, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+void zx_metrics_observe(zx_metrics_block_t *block, uint64_t value) {
+    if (!block)
+        return;
+
+    /* Published types never change, so no lock is needed to read one */
+    const zx_metrics_type_t *t = type_at(block->type);
+    if (!(t->flags & ZX_METRICS_T_HISTOGRAM))
+        return;
+
+    uint32_t lo = 2, hi = t->nfields - 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (value <= t->fields[mid].bound)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    zx_metrics_add(block, 0, 1);
+    zx_metrics_add(block, 1, value);
+    zx_metrics_add(block, lo, 1);
+}
+
+/* ============================================================================
+ * Collectors
+ * ============================================================================ */
+
+int zx_metrics_collector_add(zx_metrics_collector_t fn, void *userdata) {
+    if (!fn) {
+        return ZX_METRICS_ERR_INVALID;
+    }
+
+    pthread_mutex_lock(&metrics.collect_lock);
+    if (metrics.collector_count == MAX_COLLECTORS) {
+        pthread_mutex_unlock(&metrics.collect_lock);
+        return ZX_METRICS_ERR_MEMORY;
+    }
+    metrics.collectors[metrics.collector_count].fn = fn;
+    metrics.collectors[metrics.collector_count].userdata = userdata;
+    metrics.collector_count++;
+    pthread_mutex_unlock(&metrics.collect_lock);
+    return ZX_METRICS_OK;
+}
+
+void zx_metrics_collector_remove(zx_metrics_collector_t fn, void *userdata) {
+    pthread_mutex_lock(&metrics.collect_lock);
+    for (int i = 0; i < metrics.collector_count; i++) {
+        if (metrics.collectors[i].fn == fn && metrics.collectors[i].userdata == userdata) {
+            memmove(&metrics.collectors[i], &metrics.collectors[i + 1],
+                    (size_t)(metrics.collector_count - i - 1) * sizeof(collector_t));
+            metrics.collector_count--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics.collect_lock);
+}
+
+static void *collector_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&metrics.collect_lock);
+        for (int i = 0; i < metrics.collector_count; i++)
+            metrics.collectors[i].fn(metrics.collectors[i].userdata);
+        pthread_mutex_unlock(&metrics.collect_lock);
+
+        __atomic_store_n(&metrics.arena->collected_ns, now_ns(), __ATOMIC_RELEASE);
+
+        /* Wait for the next pass, but wake at once for stop */
+        struct pollfd pfd = { .fd = metrics.wake[0], .events = POLLIN };
+        if (poll(&pfd, 1, metrics.interval_ms) > 0)
+            return NULL;
+    }
+}
+
+int zx_metrics_start(uint32_t interval_ms) {
+    if (metrics.running) {
+        return ZX_METRICS_ERR_EXISTS;
+    }
+    if (!zx_metrics_is_open()) {
+        return ZX_METRICS_ERR_NOT_INIT;
+    }
+
+    metrics.interval_ms = interval_ms ? (int)interval_ms : DEFAULT_INTERVAL_MS;
+    if (pipe(metrics.wake) != 0) {
+        metrics.wake[0] = metrics.wake[1] = -1;
+        return ZX_METRICS_ERR_INIT;
+    }
+
+    metrics.running = pthread_create(&metrics.thread, NULL, collector_main, NULL) == 0;
+    if (!metrics.running) {
+        zx_metrics_stop();
+        return ZX_METRICS_ERR_INIT;
+    }
+    return ZX_METRICS_OK;
+}
+
+void zx_metrics_stop(void) {
+    if (metrics.running) {
+        ssize_t n = write(metrics.wake[1], "x", 1);
+        (void)n;
+        pthread_join(metrics.thread, NULL);
+        metrics.running = false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (metrics.wake[i] >= 0)
+            close(metrics.wake[i]);
+        metrics.wake[i] = -1;
+    }
+}
@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -30,6 +31,24 @@ extern "C" {
 #define OVS_ERR_DPDK           -9
 #endif
 
+/* NUMA sockets tracked for mempools and hugepages */
+#define DPDK_MAX_SOCKETS        8
+
+/* Place on the device's own NUMA socket */
+#define DPDK_SOCKET_ANY         (-1)
+
+/* Most packets one burst call moves */
+#define DPDK_BURST_MAX          32
+
+/* Headroom reserved in front of received data (RTE_PKTMBUF_HEADROOM) */
+#define DPDK_MBUF_HEADROOM      128
+
+/* DMA engines tracked for async vhost */
+#define DPDK_MAX_DMA_DEVS       64
+
+/* Packet buffer; a struct rte_mbuf in DPDK builds */
+typedef struct dpdk_mbuf dpdk_mbuf_t;
+
 /* DPDK port state */
 typedef enum {
     DPDK_PORT_STATE_STOPPED = 0,
@@ -55,8 +74,10 @@ typedef struct {
     bool reconnect;             /* Auto-reconnect on disconnect */
     uint32_t reconnect_time;    /* Reconnect interval (ms) */
     uint16_t queues;            /* Number of queue pairs */
+    int numa_node;              /* VM memory node (DPDK_SOCKET_ANY = socket 0) */
     bool linear_buffers;        /* Use linear buffers only */
     bool packed_ring;           /* Enable packed virtqueue */
+    bool async_copy;            /* Offload enqueue copies to DMA channels */
 } dpdk_vhost_config_t;
 
 /* DPDK port configuration */
@@ -78,7 +99,8 @@ typedef struct {
     /* Buffer configuration */
     uint32_t mtu;               /* MTU size */
     uint16_t mbuf_size;         /* mbuf size */
-    uint32_t mempool_size;      /* Memory pool size */
+    uint32_t mempool_size;      /* Memory pool size (0 = from queues and descriptors) */
+    int socket_id;              /* Mempool NUMA socket (DPDK_SOCKET_ANY = NIC's) */
 
     /* RSS configuration */
     bool rss_enabled;           /* Enable RSS */
@@ -119,8 +141,41 @@ typedef struct {
     uint64_t free_memory;       /* Free hugepage memory */
     uint32_t socket_count;      /* Number of NUMA sockets */
     uint32_t channel_count;     /* Memory channels per socket */
+
+    /* Per-socket usage (first socket_count entries) */
+    struct {
+        uint64_t total_memory;  /* Hugepage memory on the socket */
+        uint64_t free_memory;   /* Free hugepage memory on the socket */
+        uint64_t mempool_memory; /* Held by this library's mempools */
+        uint32_t mempools;      /* Mempools on the socket */
+    } sockets[DPDK_MAX_SOCKETS];
 } dpdk_memory_info_t;
 
+/* Mempool a port receives into */
+typedef struct {
+    char name[32];              /* Mempool name */
+    int socket_id;              /* NUMA socket */
+    uint32_t mbuf_count;        /* Number of mbufs */
+    uint16_t mbuf_size;         /* Data room per mbuf */
+    uint32_t reserved;          /* mbufs sized for attached ports */
+    uint32_t ports;             /* Attached ports */
+} dpdk_mempool_info_t;
+
+/* DMA engine type */
+typedef enum {
+    DPDK_DMA_DSA = 0,           /* Intel Data Streaming Accelerator */
+    DPDK_DMA_IOAT               /* Intel QuickData (CBDMA) */
+} dpdk_dma_type_t;
+
+/* DMA engine that async vhost can copy with */
+typedef struct {
+    char pci_addr[32];          /* PCI address, as passed to the EAL */
+    dpdk_dma_type_t type;       /* Engine type */
+    int numa_node;              /* NUMA node the engine sits on */
+    bool bound;                 /* Bound to vfio-pci or UIO, so DPDK can drive it */
+    int lcore;                  /* PMD core it is assigned to (-1 = free) */
+} dpdk_dma_info_t;
+
 /* DPDK device info */
 typedef struct {
     char name[64];              /* Device name */
@@ -213,6 +268,18 @@ int dpdk_port_stop(uint16_t port_id);
  */
 int dpdk_port_get_config(uint16_t port_id, dpdk_port_config_t *config);
 
+/**
+ * Get the mempool a port is attached to
+ *
+ * Ports share a mempool on their socket while its mbufs cover every
+ * attached port's queues and descriptors.
+ *
+ * @param port_id Port ID
+ * @param info Output mempool info
+ * @return OVS_OK on success
+ */
+int dpdk_port_get_mempool(uint16_t port_id, dpdk_mempool_info_t *info);
+
 /**
  * Get device info
  *
@@ -280,6 +347,10 @@ int dpdk_port_list(uint16_t *ports, uint32_t max_ports);
 /**
  * Create vhost-user port for VM
  *
+ * With async_copy set, packets enqueued to the guest are copied by the
+ * DMA channel of the sending PMD core rather than by the core itself,
+ * so at least one core must hold a channel (see dpdk_dma_assign()).
+ *
  * @param config vhost-user configuration
  * @return Port ID on success, negative error code on failure
  */
@@ -311,6 +382,48 @@ bool dpdk_vhost_is_connected(uint16_t port_id);
  */
 int dpdk_vhost_get_socket_path(uint16_t port_id, char *path, size_t path_len);
 
+/* ============================================================================
+ * DMA Channels
+ *
+ * DSA and IOAT engines for async vhost. Each PMD core gets a channel of
+ * its own on its NUMA node, so enqueues never share a channel between
+ * cores and copies stay on the node of the core that submits them.
+ * ============================================================================ */
+
+/**
+ * List the DMA engines on the host
+ *
+ * Engines are found in sysfs on first use. Only bound engines can be
+ * assigned; the rest are still owned by the idxd or ioatdma driver.
+ *
+ * @param devs Output array
+ * @param max_devs Maximum engines to return
+ * @return Number of engines
+ */
+int dpdk_dma_list(dpdk_dma_info_t *devs, uint32_t max_devs);
+
+/**
+ * Assign a DMA channel to a PMD core
+ *
+ * A core that already holds a channel keeps it.
+ *
+ * @param lcore PMD core
+ * @param numa_node NUMA node of the core
+ * @return Index of the engine in dpdk_dma_list() on success,
+ *         OVS_ERR_NOT_FOUND if no bound engine is free on the node
+ */
+int dpdk_dma_assign(uint32_t lcore, int numa_node);
+
+/**
+ * Release a PMD core's DMA channel
+ *
+ * Only call once the core no longer sends to async vhost ports.
+ *
+ * @param lcore PMD core
+ * @return OVS_OK on success
+ */
+int dpdk_dma_release(uint32_t lcore);
+
 /* ============================================================================
  * Queue Management
  * ============================================================================ */
@@ -338,6 +451,103 @@ int dpdk_queue_get_stats(uint16_t port_id, uint16_t queue_id, bool rx,
  */
 int dpdk_queue_count(uint16_t port_id, uint16_t *rx_queues, uint16_t *tx_queues);
 
+/* ============================================================================
+ * Burst I/O
+ *
+ * Data-plane access to ports this process drives itself. A port used
+ * here must not also be added to OVS: give the application its own NIC,
+ * VF or ring port and let OVS keep the rest. Each queue is polled by
+ * one thread at a time; packets are never copied, callers work on the
+ * mbuf data in place.
+ * ============================================================================ */
+
+/**
+ * Receive a burst of packets
+ *
+ * The caller owns the returned mbufs and must send or free them. The
+ * headers of the packets returned are prefetched, so they are in cache
+ * by the time the caller parses them.
+ *
+ * @param port_id Port ID (started)
+ * @param queue_id RX queue ID
+ * @param mbufs Output mbufs
+ * @param count Most packets to receive (up to DPDK_BURST_MAX)
+ * @return Number of packets received, or negative error code
+ */
+int dpdk_rx_burst(uint16_t port_id, uint16_t queue_id, dpdk_mbuf_t **mbufs, uint16_t count);
+
+/**
+ * Send a burst of packets
+ *
+ * Sent mbufs belong to the port from then on. Mbufs past the returned
+ * count were not sent and stay with the caller, to retry or free.
+ *
+ * @param port_id Port ID (started)
+ * @param queue_id TX queue ID
+ * @param mbufs mbufs to send
+ * @param count Number of mbufs (up to DPDK_BURST_MAX)
+ * @return Number of packets sent, or negative error code
+ */
+int dpdk_tx_burst(uint16_t port_id, uint16_t queue_id, dpdk_mbuf_t **mbufs, uint16_t count);
+
+/**
+ * Allocate empty mbufs from a port's mempool
+ *
+ * All or nothing, like rte_pktmbuf_alloc_bulk().
+ *
+ * @param port_id Port ID
+ * @param mbufs Output mbufs
+ * @param count Number of mbufs
+ * @return OVS_OK on success
+ */
+int dpdk_mbuf_alloc_bulk(uint16_t port_id, dpdk_mbuf_t **mbufs, uint16_t count);
+
+/**
+ * Return mbufs to their mempool
+ *
+ * @param mbufs mbufs to free (NULL entries are skipped)
+ * @param count Number of mbufs
+ */
+void dpdk_mbuf_free_bulk(dpdk_mbuf_t **mbufs, uint16_t count);
+
+/**
+ * Borrow an mbuf's packet data
+ *
+ * The pointer stays valid until the mbuf is sent or freed.
+ *
+ * @param mbuf mbuf
+ * @param len Output data length (may be NULL)
+ * @return Start of the packet
+ */
+uint8_t *dpdk_mbuf_data(const dpdk_mbuf_t *mbuf, uint16_t *len);
+
+/**
+ * Grow packet data at the front, e.g. to push a tunnel header
+ *
+ * @param mbuf mbuf
+ * @param len Bytes to add
+ * @return New start of the packet, or NULL without enough headroom
+ */
+uint8_t *dpdk_mbuf_prepend(dpdk_mbuf_t *mbuf, uint16_t len);
+
+/**
+ * Grow packet data at the end
+ *
+ * @param mbuf mbuf
+ * @param len Bytes to add
+ * @return Start of the added bytes, or NULL without enough tailroom
+ */
+uint8_t *dpdk_mbuf_append(dpdk_mbuf_t *mbuf, uint16_t len);
+
+/**
+ * Drop bytes from the front of the packet, e.g. to pop a header
+ *
+ * @param mbuf mbuf
+ * @param len Bytes to drop
+ * @return New start of the packet, or NULL if the packet is shorter
+ */
+uint8_t *dpdk_mbuf_adj(dpdk_mbuf_t *mbuf, uint16_t len);
+
 /* ============================================================================
  * Utility Functions
  * ============================================================================ */
@@ -29,6 +29,7 @@ extern "C" {
 #define OVS_ERR_OVSDB          -7
 #define OVS_ERR_OPENFLOW       -8
 #define OVS_ERR_DPDK           -9
+#define OVS_ERR_UNIXCTL        -10
 
 /* Port types */
 typedef enum {
@@ -52,6 +53,7 @@ typedef struct {
     bool rstp_enabled;          /* Rapid spanning tree */
     uint16_t fail_mode;         /* 0=standalone, 1=secure */
     char controller[256];       /* OpenFlow controller address */
+    bool hw_offload;            /* Hardware flow offload (host-wide in OVS) */
 } ovs_bridge_config_t;
 
 /* Port configuration */
@@ -62,6 +64,7 @@ typedef struct {
     uint16_t tag;               /* VLAN tag (0 = trunk) */
     uint16_t trunks[4096/16];   /* Trunk VLAN bitmap */
     uint32_t ofport;            /* OpenFlow port number */
+    char rxq_affinity[128];     /* PMD pinning, "rxq:core,..." (empty = OVS assigns) */
 
     /* Tunnel options (for VXLAN, Geneve, GRE) */
     struct {
@@ -77,12 +80,15 @@ typedef struct {
         uint16_t rxq;           /* Number of RX queues */
         uint16_t txq;           /* Number of TX queues */
         uint32_t mtu;           /* MTU size */
+        bool representor;       /* VF representor of the PF in devargs */
+        uint16_t vf;            /* VF index of the representor */
     } dpdk;
 
     /* vhost-user options */
     struct {
         char socket_path[256];  /* vhost-user socket path */
         bool server_mode;       /* true = server, false = client */
+        bool async_copy;        /* DMA-offloaded enqueue (see ovs_vhost_async_set()) */
     } vhost;
 } ovs_port_config_t;
 
@@ -121,14 +127,73 @@ typedef struct {
     } actions;
 } ovs_flow_t;
 
+/* Hardware offload state of a flow */
+typedef enum {
+    OVS_FLOW_OFFLOAD_NONE = 0,  /* Handled by the datapath in software */
+    OVS_FLOW_OFFLOAD_PARTIAL,   /* NIC classifies, PMD cores still forward */
+    OVS_FLOW_OFFLOAD_FULL       /* NIC matches and forwards */
+} ovs_flow_offload_t;
+
 /* Flow statistics */
 typedef struct {
     uint64_t packet_count;
     uint64_t byte_count;
     uint64_t duration_sec;
     uint64_t duration_nsec;
+    ovs_flow_offload_t offload; /* Best state of the flow's datapath flows */
+    uint32_t offloaded_flows;   /* Datapath flows of the flow in hardware */
 } ovs_flow_stats_t;
 
+/* Changes applied by a flow reconciliation */
+typedef struct {
+    uint32_t added;
+    uint32_t modified;
+    uint32_t deleted;
+} ovs_flow_diff_t;
+
+/* PMD thread load (dpif-netdev/pmd-stats-show, pmd-rxq-show) */
+typedef struct {
+    uint32_t core_id;           /* CPU the PMD polls on */
+    uint32_t numa_id;           /* NUMA node of the core */
+    bool isolated;              /* Only polls rxqs pinned to it */
+    uint32_t rxq_count;         /* rxqs assigned */
+    uint32_t usage;             /* Sum of assigned rxq usage (% of the core) */
+    uint64_t packets;           /* Packets received */
+    uint64_t idle_cycles;       /* Cycles spent polling empty queues */
+    uint64_t busy_cycles;       /* Cycles spent processing packets */
+    uint64_t emc_hits;          /* Exact-match cache hits */
+    uint64_t smc_hits;          /* Signature-match cache hits */
+    uint64_t megaflow_hits;     /* Datapath classifier hits */
+    uint64_t upcalls;           /* Misses resolved by an upcall */
+    uint64_t lost;              /* Misses whose upcall failed */
+} ovs_pmd_stats_t;
+
+/* Receive queue placement and load */
+typedef struct {
+    char port[64];              /* Interface name */
+    uint32_t queue_id;          /* Queue on the interface */
+    uint32_t core_id;           /* PMD core polling it */
+    uint32_t numa_id;           /* NUMA node of that core */
+    bool enabled;               /* Guest has enabled the queue */
+    uint32_t usage;             /* Share of the core's cycles last interval (%) */
+} ovs_rxq_stats_t;
+
+/* Rebalance thresholds; zero fields take the defaults */
+typedef struct {
+    uint32_t load_threshold;    /* Busiest PMD usage (%) that triggers a move (70) */
+    uint32_t improvement_threshold; /* Minimum busiest-PMD reduction (%) (25) */
+    uint32_t interval_sec;      /* Minimum seconds between moves (60) */
+    bool dry_run;               /* Plan only */
+} ovs_pmd_rebalance_opts_t;
+
+/* Rebalance outcome */
+typedef struct {
+    bool applied;               /* New pinning written */
+    uint32_t moved;             /* rxqs moved, or planned in a dry run */
+    uint32_t max_load_before;   /* Busiest PMD usage before (%) */
+    uint32_t max_load_after;    /* Busiest PMD usage as planned (%) */
+} ovs_pmd_rebalance_result_t;
+
 /* Bridge statistics */
 typedef struct {
     uint64_t rx_packets;
@@ -194,6 +259,9 @@ bool ovs_dpdk_available(void);
 /**
  * Create a new bridge
  *
+ * A config with hw_offload set also turns on hardware offload, which OVS
+ * applies to every bridge of the host.
+ *
  * @param config Bridge configuration
  * @return OVS_OK on success
  */
@@ -234,6 +302,47 @@ int ovs_bridge_list(ovs_bridge_config_t *bridges, uint32_t max_bridges);
  */
 int ovs_bridge_get_stats(const char *name, ovs_bridge_stats_t *stats);
 
+/**
+ * Enable or disable hardware flow offload
+ *
+ * Sets other_config:hw-offload. OVS then installs datapath flows into
+ * capable NICs: rte_flow for DPDK ports, tc-flower for kernel ports.
+ * Offload is host-wide, and OVS only drops it on restart.
+ *
+ * @param enable true to offload
+ * @return OVS_OK on success
+ */
+int ovs_hw_offload_set(bool enable);
+
+/**
+ * Check if hardware flow offload is enabled
+ *
+ * @return true if other_config:hw-offload is set
+ */
+bool ovs_hw_offload_enabled(void);
+
+/**
+ * Enable or disable the async vhost data path
+ *
+ * Sets other_config:vhost-async-support and allowlists the DMA engines
+ * in other_config:dpdk-extra so the EAL probes them. OVS then gives each
+ * PMD core a DMA channel, and vhost ports added with vhost.async_copy
+ * hand their enqueue copies to it. Both keys are read when OVS starts.
+ *
+ * @param enable true for async vhost
+ * @param dma_devs PCI addresses of the DMA engines
+ * @param count Number of engines
+ * @return OVS_OK on success
+ */
+int ovs_vhost_async_set(bool enable, const char *const *dma_devs, uint32_t count);
+
+/**
+ * Check if the async vhost data path is enabled
+ *
+ * @return true if other_config:vhost-async-support is set
+ */
+bool ovs_vhost_async_enabled(void);
+
 /**
  * Set OpenFlow controller for bridge
  *
@@ -255,6 +364,17 @@ int ovs_bridge_set_controller(const char *bridge, const char *controller);
  */
 int ovs_port_add(const ovs_port_config_t *config);
 
+/**
+ * Add several ports in one OVSDB transaction
+ *
+ * Either every port is added or none is.
+ *
+ * @param configs Port configurations
+ * @param count Number of ports
+ * @return OVS_OK on success
+ */
+int ovs_port_add_batch(const ovs_port_config_t *configs, uint32_t count);
+
 /**
  * Delete a port from a bridge
  *
@@ -304,6 +424,72 @@ int ovs_port_get_stats(const char *bridge, const char *port, ovs_port_stats_t *s
  */
 int ovs_port_set_vlan(const char *bridge, const char *port, uint16_t tag);
 
+/**
+ * Pin a port's receive queues to PMD cores
+ *
+ * Sets other_config:pmd-rxq-affinity on the port's interface. Queues
+ * left out of the list are assigned by OVS to non-isolated cores.
+ *
+ * @param bridge Bridge name
+ * @param port Port name
+ * @param affinity "rxq:core,..." list (NULL or empty to unpin)
+ * @return OVS_OK on success
+ */
+int ovs_port_set_rxq_affinity(const char *bridge, const char *port, const char *affinity);
+
+/**
+ * List the PMD cores on a NUMA node
+ *
+ * PMD cores are the CPUs in other_config:pmd-cpu-mask.
+ *
+ * @param numa_node NUMA node (-1 for all nodes)
+ * @param cpus Output CPU numbers, ascending
+ * @param max_cpus Maximum CPUs to return
+ * @return Number of CPUs, or negative error code
+ */
+int ovs_pmd_cpus(int numa_node, uint32_t *cpus, uint32_t max_cpus);
+
+/* ============================================================================
+ * PMD Thread Management
+ * ============================================================================ */
+
+/**
+ * Get PMD thread load statistics
+ *
+ * Counters are cumulative since ovs-vswitchd started or the last
+ * dpif-netdev/pmd-stats-clear; compare two samples for a rate.
+ *
+ * @param pmds Output array
+ * @param max_pmds Maximum PMDs to return
+ * @return Number of PMDs, or negative error code
+ */
+int ovs_pmd_get_stats(ovs_pmd_stats_t *pmds, uint32_t max_pmds);
+
+/**
+ * Get receive queue placement and usage
+ *
+ * @param rxqs Output array
+ * @param max_rxqs Maximum rxqs to return
+ * @return Number of rxqs, or negative error code
+ */
+int ovs_pmd_get_rxqs(ovs_rxq_stats_t *rxqs, uint32_t max_rxqs);
+
+/**
+ * Reassign rxqs to PMD cores by measured load
+ *
+ * Busiest rxqs go first to the least loaded PMD on their NUMA node. The
+ * plan is applied as pmd-rxq-affinity pins only when the busiest PMD is
+ * over the load threshold, the plan lowers it by at least the
+ * improvement threshold, and the interval since the last applied
+ * rebalance has passed, so load near a threshold does not make queues
+ * flap between cores.
+ *
+ * @param opts Thresholds (NULL for defaults)
+ * @param result Output outcome (may be NULL)
+ * @return OVS_OK on success, whether or not anything moved
+ */
+int ovs_pmd_rebalance(const ovs_pmd_rebalance_opts_t *opts, ovs_pmd_rebalance_result_t *result);
+
 /* ============================================================================
  * OpenFlow Management
  * ============================================================================ */
@@ -317,6 +503,18 @@ int ovs_port_set_vlan(const char *bridge, const char *port, uint16_t tag);
  */
 int ovs_flow_add(const char *bridge, const ovs_flow_t *flow);
 
+/**
+ * Add several flow rules as one atomic OpenFlow bundle
+ *
+ * Either every flow is installed or none is.
+ *
+ * @param bridge Bridge name
+ * @param flows Flow rules
+ * @param count Number of flows
+ * @return OVS_OK on success
+ */
+int ovs_flow_add_batch(const char *bridge, const ovs_flow_t *flows, uint32_t count);
+
 /**
  * Delete a flow rule
  *
@@ -348,6 +546,11 @@ int ovs_flow_dump(const char *bridge, ovs_flow_t *flows, uint32_t max_flows);
 /**
  * Get flow statistics
  *
+ * With hardware offload enabled, also reports whether the datapath flows
+ * carrying the flow's traffic are in the NIC. A datapath flow counts
+ * when its key matches every field the flow matches; a higher-priority
+ * flow overlapping the match can make this an overestimate.
+ *
  * @param bridge Bridge name
  * @param flow Flow match criteria
  * @param stats Output statistics
@@ -355,6 +558,42 @@ int ovs_flow_dump(const char *bridge, ovs_flow_t *flows, uint32_t max_flows);
  */
 int ovs_flow_get_stats(const char *bridge, const ovs_flow_t *flow, ovs_flow_stats_t *stats);
 
+/**
+ * Reconcile a table and cookie range to a desired flow set
+ *
+ * The scope is every flow in table_id whose cookie matches cookie under
+ * cookie_mask. Only the difference between flows and the library's view
+ * of the scope is sent, as one atomic bundle: new flows are added, flows
+ * whose actions changed are modified in place and keep their counters,
+ * flows whose cookie or timeouts changed are replaced, and flows missing
+ * from the set are deleted. The view is read from the switch on the
+ * first reconcile of a scope, and again whenever the view holds flows
+ * with a timeout, since the switch may have expired them; flow changes
+ * made through this library keep it honest, changes made by anyone
+ * else need ovs_flow_reconcile_reset().
+ *
+ * @param bridge Bridge name
+ * @param table_id Table ID
+ * @param cookie Cookie of the range
+ * @param cookie_mask Cookie bits that select the range (0 = whole table)
+ * @param flows Desired flows, all inside the scope
+ * @param count Number of flows (0 empties the scope)
+ * @param diff Output change counts (may be NULL)
+ * @return OVS_OK on success
+ */
+int ovs_flow_reconcile(const char *bridge, uint32_t table_id, uint64_t cookie,
+                       uint64_t cookie_mask, const ovs_flow_t *flows, uint32_t count,
+                       ovs_flow_diff_t *diff);
+
+/**
+ * Forget the reconciliation views of a bridge
+ *
+ * The next reconcile of each scope reads it from the switch again.
+ *
+ * @param bridge Bridge name (NULL for all bridges)
+ */
+void ovs_flow_reconcile_reset(const char *bridge);
+
 /* ============================================================================
  * Utility Functions
  * ============================================================================ */
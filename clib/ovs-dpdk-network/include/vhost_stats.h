@@ -0,0 +1,111 @@
+/**
+ * Zixiao Hypervisor - vhost-user Statistics Export
+ *
+ * Interface counters of every vhost-user VM port, kept current by a
+ * background collector in a POSIX shared-memory table. Readers map the
+ * table read-only and take no locks and make no syscalls per VM: each
+ * entry is guarded by a sequence counter that is odd while the collector
+ * rewrites it.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_VHOST_STATS_H
+#define ZIXIAO_VHOST_STATS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Default shared-memory object, under /dev/shm */
+#define VHOST_STATS_SHM_NAME    "/zixiao-vhost-stats"
+
+#define VHOST_STATS_MAGIC       0x5a585653  /* "ZXVS" */
+#define VHOST_STATS_VERSION     1
+#define VHOST_STATS_MAX_ENTRIES 4096
+
+/* Entry flags */
+#define VHOST_STATS_F_USED      (1u << 0)   /* Slot holds a VM port */
+#define VHOST_STATS_F_VALID     (1u << 1)   /* Counters received from OVS */
+
+/*
+ * One VM port. Fixed layout, 256 bytes, 64-byte aligned.
+ *
+ * Read protocol: load seq (acquire); retry while odd. Copy the entry,
+ * then load seq again (after an acquire fence); retry if it changed.
+ */
+typedef struct {
+    uint32_t seq;               /* Odd while being written */
+    uint32_t flags;             /* VHOST_STATS_F_* */
+    char vm_id[64];             /* VM identifier */
+    char port[64];              /* OVS port name */
+    uint64_t rx_packets;        /* Received by OVS from the VM */
+    uint64_t tx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_bytes;
+    uint64_t rx_dropped;
+    uint64_t tx_dropped;
+    uint64_t rx_errors;
+    uint64_t tx_errors;
+    uint64_t updated_ns;        /* CLOCK_REALTIME of the last OVS update */
+    uint8_t reserved[48];
+} __attribute__((aligned(64))) vhost_stats_entry_t;
+
+/* Table header, followed by capacity entries */
+typedef struct {
+    uint32_t magic;             /* VHOST_STATS_MAGIC */
+    uint32_t version;           /* VHOST_STATS_VERSION */
+    uint32_t entry_size;        /* sizeof(vhost_stats_entry_t) */
+    uint32_t capacity;          /* Number of entry slots */
+    uint64_t generation;        /* Bumped when a slot is taken or freed */
+    uint64_t updated_ns;        /* Last update applied to any entry */
+    uint32_t collector_connected; /* 1 while the OVSDB monitor is up */
+    uint8_t reserved[28];
+    vhost_stats_entry_t entries[];
+} __attribute__((aligned(64))) vhost_stats_table_t;
+
+/**
+ * Start exporting statistics
+ *
+ * Creates the shared-memory table, fills it with the VM ports created so
+ * far, and starts a thread that follows OVS interface statistics with
+ * its own OVSDB monitor. OVS refreshes those every
+ * other_config:stats-update-interval (5 s by default).
+ *
+ * @param shm_name Shared-memory object name (NULL for VHOST_STATS_SHM_NAME)
+ * @param ovsdb_socket OVSDB socket path (NULL for default)
+ * @return 0 on success, negative error code on failure
+ */
+int vhost_stats_start(const char *shm_name, const char *ovsdb_socket);
+
+/**
+ * Stop exporting statistics and remove the shared-memory table
+ */
+void vhost_stats_stop(void);
+
+/**
+ * Consistent copy of an entry, following the read protocol
+ *
+ * @param entry Entry in a mapped table
+ * @param out Output copy
+ */
+static inline void vhost_stats_read_entry(const vhost_stats_entry_t *entry,
+                                          vhost_stats_entry_t *out) {
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        __builtin_memcpy(out, (const void *)entry, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZIXIAO_VHOST_STATS_H */
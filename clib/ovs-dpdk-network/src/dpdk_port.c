@@ -5,17 +5,23 @@
  * Licensed under Apache License 2.0
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "dpdk_port.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <dirent.h>
+#include <unistd.h>
 
 /* Note: This is a stub implementation for build purposes.
  * Real implementation would include DPDK headers:
  * #include <rte_eal.h>
  * #include <rte_ethdev.h>
  * #include <rte_vhost.h>
+ * #include <rte_vhost_async.h>
+ * #include <rte_dmadev.h>
  */
 
 /* Internal state */
@@ -25,6 +31,26 @@ static struct {
     char last_error[256];
 } dpdk_state = {0};
 
+/* Packet buffer of the stub; struct rte_mbuf in a real build */
+struct dpdk_mbuf {
+    struct dpdk_mbuf *next;     /* Mempool free list */
+    int mempool;                /* Index into mempools */
+    uint32_t mempool_id;        /* Detects a pool freed under the mbuf */
+    uint16_t port;              /* Input port */
+    uint16_t data_off;          /* Start of data in buf */
+    uint16_t data_len;
+    uint16_t buf_len;
+    uint8_t buf[];
+};
+
+/* Ring PMD queue: TX queue q loops back to RX queue q */
+typedef struct {
+    struct dpdk_mbuf **slots;
+    uint32_t mask;              /* Slots - 1 */
+    uint32_t head;              /* Next slot to dequeue */
+    uint32_t tail;              /* Next slot to enqueue */
+} ring_queue_t;
+
 /* Port storage */
 #define MAX_DPDK_PORTS 64
 static struct {
@@ -32,8 +58,45 @@ static struct {
     dpdk_port_config_t config;
     dpdk_port_state_t state;
     dpdk_port_stats_t stats;
+    int mempool;                /* Index into mempools */
+    uint32_t mbufs;             /* mbufs reserved in it */
+    ring_queue_t *rings;        /* Ring PMD queues */
+    uint16_t ring_count;
 } dpdk_ports[MAX_DPDK_PORTS];
 
+/* Mempool storage: shared per socket and mbuf size */
+#define MAX_MEMPOOLS 32
+#define MEMPOOL_MIN_MBUFS 16383         /* Pool sizes of 2^n - 1 waste no ring slot */
+#define MEMPOOL_CACHE_SIZE 256          /* Per-lcore cache, as in OVS */
+#define MBUF_OVERHEAD 192               /* struct rte_mbuf + headroom + pool header */
+#define DEFAULT_MBUF_SIZE 2176          /* RTE_MBUF_DEFAULT_BUF_SIZE */
+#define DEFAULT_RX_DESC 1024
+#define DEFAULT_TX_DESC 1024
+#define RX_BURST 32
+
+static struct {
+    bool in_use;
+    uint32_t id;
+    int socket_id;
+    uint16_t mbuf_size;
+    uint32_t mbuf_count;
+    uint32_t reserved;
+    uint32_t ports;
+    uint32_t allocated;         /* mbufs carved out so far */
+    struct dpdk_mbuf *free_list;
+} mempools[MAX_MEMPOOLS];
+
+static uint32_t next_mempool_id = 1;
+
+/* DMA engines, found in sysfs on first use and kept in scan order */
+#define DMA_RING_SIZE 2048              /* Descriptors per channel, as in OVS */
+
+static struct {
+    bool scanned;
+    uint32_t count;
+    dpdk_dma_info_t devs[DPDK_MAX_DMA_DEVS];
+} dma_state;
+
 static void set_error(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
@@ -41,6 +104,215 @@ static void set_error(const char *fmt, ...) {
     va_end(args);
 }
 
+/* ============================================================================
+ * NUMA Placement
+ * ============================================================================ */
+
+static bool read_u64(const char *path, uint64_t *value) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    unsigned long long v;
+    bool ok = fscanf(f, "%llu", &v) == 1;
+    fclose(f);
+    if (ok) {
+        *value = v;
+    }
+    return ok;
+}
+
+/* Socket a port's mbufs should live on */
+static int port_socket(const dpdk_port_config_t *config) {
+    if (config->socket_id >= 0) {
+        return config->socket_id;
+    }
+
+    if (config->type == DPDK_DEV_VHOST_USER) {
+        /* Guest memory is where vhost copies packets to and from */
+        return config->vhost.numa_node >= 0 ? config->vhost.numa_node : 0;
+    }
+
+    if (config->pci_addr[0]) {
+        char path[128];
+        FILE *f;
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", config->pci_addr);
+        if ((f = fopen(path, "r"))) {
+            int node = -1;
+            if (fscanf(f, "%d", &node) != 1) {
+                node = -1;
+            }
+            fclose(f);
+            /* -1 on hosts without NUMA */
+            if (node >= 0) {
+                return node;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* mbufs that keep every queue of the port filled, cached and mid-burst */
+static uint32_t port_mbuf_demand(const dpdk_port_config_t *config) {
+    if (config->mempool_size > 0) {
+        return config->mempool_size;
+    }
+
+    uint32_t rxq = config->rx_queues ? config->rx_queues : 1;
+    uint32_t txq = config->tx_queues ? config->tx_queues : 1;
+    uint32_t rxd = config->rx_desc ? config->rx_desc : DEFAULT_RX_DESC;
+    uint32_t txd = config->tx_desc ? config->tx_desc : DEFAULT_TX_DESC;
+
+    return rxq * (rxd + RX_BURST) + txq * txd + (rxq + txq) * MEMPOOL_CACHE_SIZE;
+}
+
+/* Reserve mbufs in a pool on the socket, creating one if none has room */
+static int mempool_attach(int socket_id, uint16_t mbuf_size, uint32_t mbufs) {
+    int free_slot = -1;
+    for (int i = 0; i < MAX_MEMPOOLS; i++) {
+        if (!mempools[i].in_use) {
+            if (free_slot < 0) {
+                free_slot = i;
+            }
+            continue;
+        }
+        if (mempools[i].socket_id == socket_id && mempools[i].mbuf_size == mbuf_size &&
+            mempools[i].mbuf_count - mempools[i].reserved >= mbufs) {
+            mempools[i].reserved += mbufs;
+            mempools[i].ports++;
+            return i;
+        }
+    }
+
+    if (free_slot < 0) {
+        set_error("No free mempool slots");
+        return OVS_ERR_MEMORY;
+    }
+
+    uint32_t count = MEMPOOL_MIN_MBUFS;
+    while (count < mbufs && count < UINT32_MAX / 2) {
+        count = count * 2 + 1;
+    }
+
+    /* In real implementation:
+     * char name[32];
+     * snprintf(name, sizeof(name), "zx_mp_s%d_%d", socket_id, free_slot);
+     * struct rte_mempool *mp = rte_pktmbuf_pool_create(name, count,
+     *         MEMPOOL_CACHE_SIZE, 0, mbuf_size, socket_id);
+     * if (!mp) {
+     *     set_error("Mempool creation failed on socket %d: %s",
+     *               socket_id, rte_strerror(rte_errno));
+     *     return OVS_ERR_MEMORY;
+     * }
+     */
+
+    mempools[free_slot].in_use = true;
+    mempools[free_slot].id = next_mempool_id++;
+    mempools[free_slot].socket_id = socket_id;
+    mempools[free_slot].mbuf_size = mbuf_size;
+    mempools[free_slot].mbuf_count = count;
+    mempools[free_slot].reserved = mbufs;
+    mempools[free_slot].ports = 1;
+    return free_slot;
+}
+
+static void mempool_detach(int index, uint32_t mbufs) {
+    if (index < 0 || index >= MAX_MEMPOOLS || !mempools[index].in_use) {
+        return;
+    }
+
+    mempools[index].reserved -= mbufs;
+    if (--mempools[index].ports == 0) {
+        /* In real implementation:
+         * rte_mempool_free(mp);
+         */
+        while (mempools[index].free_list) {
+            struct dpdk_mbuf *m = mempools[index].free_list;
+            mempools[index].free_list = m->next;
+            free(m);
+        }
+        memset(&mempools[index], 0, sizeof(mempools[0]));
+    }
+}
+
+/* Queues of a ring PMD port, each as deep as the RX descriptors */
+static int ring_create(uint16_t port_id) {
+    const dpdk_port_config_t *config = &dpdk_ports[port_id].config;
+    uint16_t queues = config->rx_queues > config->tx_queues ? config->rx_queues
+                                                            : config->tx_queues;
+    if (queues == 0) {
+        queues = 1;
+    }
+    uint32_t size = 1;
+    while (size < (config->rx_desc ? config->rx_desc : DEFAULT_RX_DESC)) {
+        size <<= 1;
+    }
+
+    ring_queue_t *rings = calloc(queues, sizeof(*rings));
+    if (!rings) {
+        set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+    for (uint16_t q = 0; q < queues; q++) {
+        rings[q].slots = calloc(size, sizeof(*rings[q].slots));
+        rings[q].mask = size - 1;
+        if (!rings[q].slots) {
+            while (q-- > 0) {
+                free(rings[q].slots);
+            }
+            free(rings);
+            set_error("Out of memory");
+            return OVS_ERR_MEMORY;
+        }
+    }
+
+    dpdk_ports[port_id].rings = rings;
+    dpdk_ports[port_id].ring_count = queues;
+    return OVS_OK;
+}
+
+static void ring_destroy(uint16_t port_id) {
+    ring_queue_t *rings = dpdk_ports[port_id].rings;
+    for (uint16_t q = 0; rings && q < dpdk_ports[port_id].ring_count; q++) {
+        while (rings[q].head != rings[q].tail) {
+            dpdk_mbuf_free_bulk(&rings[q].slots[rings[q].head++ & rings[q].mask], 1);
+        }
+        free(rings[q].slots);
+    }
+    free(rings);
+    dpdk_ports[port_id].rings = NULL;
+    dpdk_ports[port_id].ring_count = 0;
+}
+
+/* Hugepages of every size under a sysfs hugepages directory */
+static void read_hugepages(const char *dir, uint64_t *total, uint64_t *free_mem) {
+    DIR *d = opendir(dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        unsigned long kb;
+        if (sscanf(e->d_name, "hugepages-%lukB", &kb) != 1) {
+            continue;
+        }
+
+        char path[512];
+        uint64_t pages;
+        snprintf(path, sizeof(path), "%s/%s/nr_hugepages", dir, e->d_name);
+        if (read_u64(path, &pages)) {
+            *total += pages * kb * 1024;
+        }
+        snprintf(path, sizeof(path), "%s/%s/free_hugepages", dir, e->d_name);
+        if (read_u64(path, &pages)) {
+            *free_mem += pages * kb * 1024;
+        }
+    }
+    closedir(d);
+}
+
 /* ============================================================================
  * DPDK Initialization
  * ============================================================================ */
@@ -66,6 +338,7 @@ int dpdk_init(const char *eal_args) {
      */
 
     memset(dpdk_ports, 0, sizeof(dpdk_ports));
+    memset(mempools, 0, sizeof(mempools));
     dpdk_state.initialized = true;
 
     return OVS_OK;
@@ -82,11 +355,18 @@ void dpdk_cleanup(void) {
         }
     }
 
+    for (uint32_t i = 0; i < dma_state.count; i++) {
+        if (dma_state.devs[i].lcore >= 0) {
+            dpdk_dma_release((uint32_t)dma_state.devs[i].lcore);
+        }
+    }
+
     /* In real implementation:
      * rte_eal_cleanup();
      */
 
     memset(&dpdk_state, 0, sizeof(dpdk_state));
+    memset(&dma_state, 0, sizeof(dma_state));
 }
 
 bool dpdk_is_initialized(void) {
@@ -105,10 +385,53 @@ int dpdk_get_memory_info(dpdk_memory_info_t *info) {
      * for each socket...
      */
 
-    info->total_memory = 2ULL * 1024 * 1024 * 1024;  /* Placeholder: 2GB */
-    info->free_memory = 1ULL * 1024 * 1024 * 1024;
-    info->socket_count = 1;
+    /* Hugepages are reserved per node; count sockets up to the last node seen */
+    for (int node = 0; node < DPDK_MAX_SOCKETS; node++) {
+        char dir[64];
+        snprintf(dir, sizeof(dir), "/sys/devices/system/node/node%d", node);
+        DIR *d = opendir(dir);
+        if (!d) {
+            continue;
+        }
+        closedir(d);
+
+        snprintf(dir, sizeof(dir), "/sys/devices/system/node/node%d/hugepages", node);
+        read_hugepages(dir, &info->sockets[node].total_memory,
+                       &info->sockets[node].free_memory);
+        info->socket_count = (uint32_t)node + 1;
+    }
+
+    /* Kernels without NUMA show one pool */
+    if (info->socket_count == 0) {
+        read_hugepages("/sys/kernel/mm/hugepages", &info->sockets[0].total_memory,
+                       &info->sockets[0].free_memory);
+        info->socket_count = 1;
+    }
+
+    for (int i = 0; i < MAX_MEMPOOLS; i++) {
+        int socket = mempools[i].socket_id;
+        if (!mempools[i].in_use || socket < 0 || socket >= DPDK_MAX_SOCKETS) {
+            continue;
+        }
+        info->sockets[socket].mempools++;
+        info->sockets[socket].mempool_memory +=
+            (uint64_t)mempools[i].mbuf_count * (mempools[i].mbuf_size + MBUF_OVERHEAD);
+    }
+
+    for (uint32_t i = 0; i < info->socket_count; i++) {
+        info->total_memory += info->sockets[i].total_memory;
+        info->free_memory += info->sockets[i].free_memory;
+    }
+
+    /* -n as given to the EAL */
     info->channel_count = 4;
+    const char *n = strstr(dpdk_state.eal_args, "-n ");
+    if (n && (n == dpdk_state.eal_args || n[-1] == ' ')) {
+        unsigned long channels = strtoul(n + 3, NULL, 10);
+        if (channels > 0) {
+            info->channel_count = (uint32_t)channels;
+        }
+    }
 
     return OVS_OK;
 }
@@ -142,18 +465,46 @@ int dpdk_port_create(const dpdk_port_config_t *config) {
         return OVS_ERR_MEMORY;
     }
 
+    int socket_id = port_socket(config);
+    if (socket_id >= DPDK_MAX_SOCKETS) {
+        set_error("Invalid NUMA socket: %d", socket_id);
+        return OVS_ERR_INVALID;
+    }
+
+    uint16_t mbuf_size = config->mbuf_size ? config->mbuf_size : DEFAULT_MBUF_SIZE;
+    uint32_t mbufs = port_mbuf_demand(config);
+    int mempool = mempool_attach(socket_id, mbuf_size, mbufs);
+    if (mempool < 0) {
+        return mempool;
+    }
+
     /* In real implementation, create device based on type:
      * - Physical: rte_eth_dev_configure()
      * - vhost-user: rte_vhost_driver_register()
      * - virtio-user: rte_eal_hotplug_add()
+     * and set up every rx queue from the socket-local pool:
+     * rte_eth_rx_queue_setup(port_id, q, rx_desc, socket_id, NULL, mp);
      */
 
     dpdk_ports[port_id].in_use = true;
     dpdk_ports[port_id].config = *config;
     dpdk_ports[port_id].config.port_id = port_id;
+    dpdk_ports[port_id].config.socket_id = socket_id;
+    dpdk_ports[port_id].config.mbuf_size = mbuf_size;
+    dpdk_ports[port_id].mempool = mempool;
+    dpdk_ports[port_id].mbufs = mbufs;
     dpdk_ports[port_id].state = DPDK_PORT_STATE_CONFIGURED;
     memset(&dpdk_ports[port_id].stats, 0, sizeof(dpdk_port_stats_t));
 
+    if (config->type == DPDK_DEV_RING) {
+        int ret = ring_create(port_id);
+        if (ret != OVS_OK) {
+            mempool_detach(mempool, mbufs);
+            memset(&dpdk_ports[port_id], 0, sizeof(dpdk_ports[0]));
+            return ret;
+        }
+    }
+
     return port_id;
 }
 
@@ -176,6 +527,8 @@ int dpdk_port_destroy(uint16_t port_id) {
      * or rte_vhost_driver_unregister() for vhost
      */
 
+    ring_destroy(port_id);
+    mempool_detach(dpdk_ports[port_id].mempool, dpdk_ports[port_id].mbufs);
     dpdk_ports[port_id].in_use = false;
     memset(&dpdk_ports[port_id], 0, sizeof(dpdk_ports[0]));
 
@@ -237,6 +590,31 @@ int dpdk_port_get_config(uint16_t port_id, dpdk_port_config_t *config) {
     return OVS_OK;
 }
 
+int dpdk_port_get_mempool(uint16_t port_id, dpdk_mempool_info_t *info) {
+    if (!dpdk_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+
+    if (port_id >= MAX_DPDK_PORTS || !dpdk_ports[port_id].in_use) {
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    if (!info) {
+        return OVS_ERR_INVALID;
+    }
+
+    int index = dpdk_ports[port_id].mempool;
+    memset(info, 0, sizeof(*info));
+    snprintf(info->name, sizeof(info->name), "zx_mp_s%d_%d", mempools[index].socket_id, index);
+    info->socket_id = mempools[index].socket_id;
+    info->mbuf_count = mempools[index].mbuf_count;
+    info->mbuf_size = mempools[index].mbuf_size;
+    info->reserved = mempools[index].reserved;
+    info->ports = mempools[index].ports;
+
+    return OVS_OK;
+}
+
 int dpdk_port_get_info(uint16_t port_id, dpdk_device_info_t *info) {
     if (!dpdk_state.initialized) {
         return OVS_ERR_NOT_INIT;
@@ -392,10 +770,29 @@ int dpdk_vhost_create(const dpdk_vhost_config_t *config) {
     snprintf(port_config.name, sizeof(port_config.name), "vhost_%s",
              config->socket_path);
     port_config.type = DPDK_DEV_VHOST_USER;
+    port_config.socket_id = DPDK_SOCKET_ANY;
     port_config.rx_queues = config->queues > 0 ? config->queues : 1;
     port_config.tx_queues = config->queues > 0 ? config->queues : 1;
     port_config.vhost = *config;
 
+    if (config->async_copy) {
+        bool channels = false;
+        for (uint32_t i = 0; i < dma_state.count && !channels; i++) {
+            channels = dma_state.devs[i].lcore >= 0;
+        }
+        if (!channels) {
+            set_error("Async vhost needs a DMA channel on a PMD core");
+            return OVS_ERR_NOT_FOUND;
+        }
+    }
+
+    /* In real implementation, async ports register with
+     * RTE_VHOST_USER_ASYNC_COPY and, as each vring is enabled,
+     * rte_vhost_async_channel_register(vid, queue_id); PMD cores then
+     * enqueue with rte_vhost_submit_enqueue_burst(..., dma_id, 0) and
+     * reap with rte_vhost_poll_enqueue_completed().
+     */
+
     return dpdk_port_create(&port_config);
 }
 
@@ -434,6 +831,186 @@ int dpdk_vhost_get_socket_path(uint16_t port_id, char *path, size_t path_len) {
     return OVS_OK;
 }
 
+/* ============================================================================
+ * DMA Channels
+ * ============================================================================ */
+
+/* Engines DPDK has drivers for (vendor 8086, class 0x0880xx) */
+static const struct {
+    uint16_t first;
+    uint16_t last;
+    dpdk_dma_type_t type;
+} dma_ids[] = {
+    { 0x0b25, 0x0b25, DPDK_DMA_DSA },    /* Sapphire Rapids */
+    { 0x11fb, 0x11fb, DPDK_DMA_DSA },    /* Granite Rapids */
+    { 0x0b00, 0x0b00, DPDK_DMA_IOAT },   /* Ice Lake */
+    { 0x2021, 0x2021, DPDK_DMA_IOAT },   /* Skylake */
+    { 0x6f20, 0x6f27, DPDK_DMA_IOAT },   /* Broadwell */
+};
+
+static bool read_hex(const char *path, unsigned int *value) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return false;
+    }
+    bool ok = fscanf(f, "%x", value) == 1;
+    fclose(f);
+    return ok;
+}
+
+/* vfio-pci and UIO drivers leave the device to a user-space PMD */
+static bool dma_bound(const char *pci_addr) {
+    char path[128];
+    char target[256];
+    snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/driver", pci_addr);
+    ssize_t len = readlink(path, target, sizeof(target) - 1);
+    if (len < 0) {
+        return false;
+    }
+    target[len] = '\0';
+
+    const char *driver = strrchr(target, '/');
+    driver = driver ? driver + 1 : target;
+    return strcmp(driver, "vfio-pci") == 0 || strcmp(driver, "uio_pci_generic") == 0 ||
+           strcmp(driver, "igb_uio") == 0;
+}
+
+static void dma_scan(void) {
+    if (dma_state.scanned) {
+        return;
+    }
+    dma_state.scanned = true;
+
+    DIR *d = opendir("/sys/bus/pci/devices");
+    if (!d) {
+        return;
+    }
+
+    struct dirent *ent;
+    while ((ent = readdir(d)) && dma_state.count < DPDK_MAX_DMA_DEVS) {
+        if (ent->d_name[0] == '.' || strlen(ent->d_name) >= sizeof(dma_state.devs[0].pci_addr)) {
+            continue;
+        }
+
+        char path[128];
+        unsigned int vendor, device, class;
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/vendor", ent->d_name);
+        if (!read_hex(path, &vendor) || vendor != 0x8086) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/class", ent->d_name);
+        if (!read_hex(path, &class) || (class >> 8) != 0x0880) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/device", ent->d_name);
+        if (!read_hex(path, &device)) {
+            continue;
+        }
+
+        size_t id = 0;
+        while (id < sizeof(dma_ids) / sizeof(dma_ids[0]) &&
+               (device < dma_ids[id].first || device > dma_ids[id].last)) {
+            id++;
+        }
+        if (id == sizeof(dma_ids) / sizeof(dma_ids[0])) {
+            continue;
+        }
+
+        dpdk_dma_info_t *dev = &dma_state.devs[dma_state.count++];
+        memset(dev, 0, sizeof(*dev));
+        snprintf(dev->pci_addr, sizeof(dev->pci_addr), "%s", ent->d_name);
+        dev->type = dma_ids[id].type;
+        dev->bound = dma_bound(ent->d_name);
+        dev->lcore = -1;
+
+        /* -1 on hosts without NUMA */
+        FILE *f;
+        dev->numa_node = 0;
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node", ent->d_name);
+        if ((f = fopen(path, "r"))) {
+            if (fscanf(f, "%d", &dev->numa_node) != 1 || dev->numa_node < 0) {
+                dev->numa_node = 0;
+            }
+            fclose(f);
+        }
+    }
+    closedir(d);
+}
+
+int dpdk_dma_list(dpdk_dma_info_t *devs, uint32_t max_devs) {
+    if (!devs) {
+        return OVS_ERR_INVALID;
+    }
+
+    dma_scan();
+
+    uint32_t count = dma_state.count < max_devs ? dma_state.count : max_devs;
+    memcpy(devs, dma_state.devs, count * sizeof(*devs));
+    return (int)count;
+}
+
+int dpdk_dma_assign(uint32_t lcore, int numa_node) {
+    if (!dpdk_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+
+    if (numa_node < 0 || numa_node >= DPDK_MAX_SOCKETS) {
+        set_error("Invalid NUMA socket: %d", numa_node);
+        return OVS_ERR_INVALID;
+    }
+
+    dma_scan();
+
+    int free_dev = -1;
+    for (uint32_t i = 0; i < dma_state.count; i++) {
+        dpdk_dma_info_t *dev = &dma_state.devs[i];
+        if (dev->lcore == (int)lcore) {
+            return (int)i;
+        }
+        if (free_dev < 0 && dev->lcore < 0 && dev->bound && dev->numa_node == numa_node) {
+            free_dev = (int)i;
+        }
+    }
+
+    if (free_dev < 0) {
+        set_error("No free DMA device on NUMA node %d", numa_node);
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    /* In real implementation, one vchan per engine, the engine found by
+     * rte_dma_get_dev_id_by_name(pci_addr):
+     * struct rte_dma_conf conf = { .nb_vchans = 1 };
+     * struct rte_dma_vchan_conf vconf = {
+     *     .direction = RTE_DMA_DIR_MEM_TO_MEM, .nb_desc = DMA_RING_SIZE };
+     * rte_dma_configure(dev_id, &conf);
+     * rte_dma_vchan_setup(dev_id, 0, &vconf);
+     * rte_dma_start(dev_id);
+     * rte_vhost_async_dma_configure(dev_id, 0);
+     */
+    dma_state.devs[free_dev].lcore = (int)lcore;
+    return free_dev;
+}
+
+int dpdk_dma_release(uint32_t lcore) {
+    if (!dpdk_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+
+    for (uint32_t i = 0; i < dma_state.count; i++) {
+        if (dma_state.devs[i].lcore == (int)lcore) {
+            /* In real implementation:
+             * rte_vhost_async_dma_unconfigure(dev_id, 0);
+             * rte_dma_stop(dev_id);
+             */
+            dma_state.devs[i].lcore = -1;
+            return OVS_OK;
+        }
+    }
+
+    set_error("No DMA channel on core %u", lcore);
+    return OVS_ERR_NOT_FOUND;
+}
+
 /* ============================================================================
  * Queue Management
  * ============================================================================ */
@@ -483,6 +1060,229 @@ int dpdk_queue_count(uint16_t port_id, uint16_t *rx_queues, uint16_t *tx_queues)
     return OVS_OK;
 }
 
+/* ============================================================================
+ * Burst I/O
+ * ============================================================================ */
+
+static void stats_add(dpdk_port_stats_t *stats, bool rx, uint16_t queue_id,
+                      uint64_t packets, uint64_t bytes) {
+    if (rx) {
+        stats->ipackets += packets;
+        stats->ibytes += bytes;
+    } else {
+        stats->opackets += packets;
+        stats->obytes += bytes;
+    }
+    if (queue_id < 8) {
+        if (rx) {
+            stats->q_ipackets[queue_id] += packets;
+            stats->q_ibytes[queue_id] += bytes;
+        } else {
+            stats->q_opackets[queue_id] += packets;
+            stats->q_obytes[queue_id] += bytes;
+        }
+    }
+}
+
+/* Started port and an existing queue of it */
+static int burst_check(uint16_t port_id, uint16_t queue_id, bool rx) {
+    if (!dpdk_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+    if (port_id >= MAX_DPDK_PORTS || !dpdk_ports[port_id].in_use) {
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    uint16_t queues = rx ? dpdk_ports[port_id].config.rx_queues
+                         : dpdk_ports[port_id].config.tx_queues;
+    if (queue_id >= (queues ? queues : 1)) {
+        return OVS_ERR_INVALID;
+    }
+    if (dpdk_ports[port_id].state != DPDK_PORT_STATE_STARTED) {
+        return OVS_ERR_INVALID;
+    }
+    return OVS_OK;
+}
+
+int dpdk_rx_burst(uint16_t port_id, uint16_t queue_id, dpdk_mbuf_t **mbufs, uint16_t count) {
+    int ret = burst_check(port_id, queue_id, true);
+    if (ret != OVS_OK) {
+        return ret;
+    }
+    if (!mbufs) {
+        return OVS_ERR_INVALID;
+    }
+    if (count > DPDK_BURST_MAX) {
+        count = DPDK_BURST_MAX;
+    }
+
+    /* In real implementation:
+     * uint16_t n = rte_eth_rx_burst(port_id, queue_id, (struct rte_mbuf **)mbufs, count);
+     * for (uint16_t i = 0; i < n; i++) {
+     *     rte_prefetch0(rte_pktmbuf_mtod(mbufs[i], void *));
+     * }
+     * return n;
+     */
+
+    uint16_t n = 0;
+    uint64_t bytes = 0;
+    if (dpdk_ports[port_id].rings && queue_id < dpdk_ports[port_id].ring_count) {
+        ring_queue_t *ring = &dpdk_ports[port_id].rings[queue_id];
+        while (n < count && ring->head != ring->tail) {
+            struct dpdk_mbuf *m = ring->slots[ring->head++ & ring->mask];
+            m->port = port_id;
+            __builtin_prefetch(m->buf + m->data_off);
+            bytes += m->data_len;
+            mbufs[n++] = m;
+        }
+    }
+
+    stats_add(&dpdk_ports[port_id].stats, true, queue_id, n, bytes);
+    return n;
+}
+
+int dpdk_tx_burst(uint16_t port_id, uint16_t queue_id, dpdk_mbuf_t **mbufs, uint16_t count) {
+    int ret = burst_check(port_id, queue_id, false);
+    if (ret != OVS_OK) {
+        return ret;
+    }
+    if (!mbufs) {
+        return OVS_ERR_INVALID;
+    }
+    if (count > DPDK_BURST_MAX) {
+        count = DPDK_BURST_MAX;
+    }
+
+    /* In real implementation:
+     * return rte_eth_tx_burst(port_id, queue_id, (struct rte_mbuf **)mbufs, count);
+     */
+
+    uint16_t n = 0;
+    uint64_t bytes = 0;
+    if (dpdk_ports[port_id].rings) {
+        ring_queue_t *ring = &dpdk_ports[port_id].rings[queue_id];
+        while (n < count && ring->tail - ring->head <= ring->mask) {
+            bytes += mbufs[n]->data_len;
+            ring->slots[ring->tail++ & ring->mask] = mbufs[n++];
+        }
+        if (n < count) {
+            dpdk_ports[port_id].stats.oerrors += count - n;
+        }
+    } else {
+        /* No wire behind the stub: the NIC takes the packets and frees them */
+        for (; n < count; n++) {
+            bytes += mbufs[n]->data_len;
+        }
+        dpdk_mbuf_free_bulk(mbufs, n);
+    }
+
+    stats_add(&dpdk_ports[port_id].stats, false, queue_id, n, bytes);
+    return n;
+}
+
+int dpdk_mbuf_alloc_bulk(uint16_t port_id, dpdk_mbuf_t **mbufs, uint16_t count) {
+    if (!dpdk_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+    if (port_id >= MAX_DPDK_PORTS || !dpdk_ports[port_id].in_use) {
+        return OVS_ERR_NOT_FOUND;
+    }
+    if (!mbufs) {
+        return OVS_ERR_INVALID;
+    }
+
+    /* In real implementation:
+     * if (rte_pktmbuf_alloc_bulk(mp, (struct rte_mbuf **)mbufs, count) != 0) ...
+     */
+
+    int index = dpdk_ports[port_id].mempool;
+    for (uint16_t i = 0; i < count; i++) {
+        struct dpdk_mbuf *m = mempools[index].free_list;
+        if (m) {
+            mempools[index].free_list = m->next;
+        } else if (mempools[index].allocated < mempools[index].mbuf_count) {
+            m = malloc(sizeof(*m) + mempools[index].mbuf_size);
+            if (m) {
+                mempools[index].allocated++;
+                m->mempool = index;
+                m->mempool_id = mempools[index].id;
+                m->buf_len = mempools[index].mbuf_size;
+            }
+        }
+
+        if (!m) {
+            dpdk_mbuf_free_bulk(mbufs, i);
+            dpdk_ports[port_id].stats.rx_nombuf += count;
+            set_error("Mempool of port %u exhausted", port_id);
+            return OVS_ERR_MEMORY;
+        }
+
+        m->next = NULL;
+        m->port = port_id;
+        m->data_off = m->buf_len < DPDK_MBUF_HEADROOM ? m->buf_len : DPDK_MBUF_HEADROOM;
+        m->data_len = 0;
+        mbufs[i] = m;
+    }
+    return OVS_OK;
+}
+
+void dpdk_mbuf_free_bulk(dpdk_mbuf_t **mbufs, uint16_t count) {
+    if (!mbufs) {
+        return;
+    }
+
+    /* In real implementation:
+     * rte_pktmbuf_free_bulk((struct rte_mbuf **)mbufs, count);
+     */
+
+    for (uint16_t i = 0; i < count; i++) {
+        struct dpdk_mbuf *m = mbufs[i];
+        if (!m) {
+            continue;
+        }
+        if (mempools[m->mempool].in_use && mempools[m->mempool].id == m->mempool_id) {
+            m->next = mempools[m->mempool].free_list;
+            mempools[m->mempool].free_list = m;
+        } else {
+            free(m);
+        }
+    }
+}
+
+uint8_t *dpdk_mbuf_data(const dpdk_mbuf_t *mbuf, uint16_t *len) {
+    if (len) {
+        *len = mbuf->data_len;
+    }
+    return (uint8_t *)mbuf->buf + mbuf->data_off;
+}
+
+uint8_t *dpdk_mbuf_prepend(dpdk_mbuf_t *mbuf, uint16_t len) {
+    if (len > mbuf->data_off) {
+        return NULL;
+    }
+    mbuf->data_off -= len;
+    mbuf->data_len += len;
+    return mbuf->buf + mbuf->data_off;
+}
+
+uint8_t *dpdk_mbuf_append(dpdk_mbuf_t *mbuf, uint16_t len) {
+    if ((uint32_t)mbuf->data_off + mbuf->data_len + len > mbuf->buf_len) {
+        return NULL;
+    }
+    uint8_t *tail = mbuf->buf + mbuf->data_off + mbuf->data_len;
+    mbuf->data_len += len;
+    return tail;
+}
+
+uint8_t *dpdk_mbuf_adj(dpdk_mbuf_t *mbuf, uint16_t len) {
+    if (len > mbuf->data_len) {
+        return NULL;
+    }
+    mbuf->data_off += len;
+    mbuf->data_len -= len;
+    return mbuf->buf + mbuf->data_off;
+}
+
 /* ============================================================================
  * Utility Functions
  * ============================================================================ */
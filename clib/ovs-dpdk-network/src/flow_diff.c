@@ -0,0 +1,389 @@
+/**
+ * Zixiao Hypervisor - Flow Reconciliation
+ *
+ * Keeps a view of the flows in each reconciled scope (bridge, table and
+ * cookie range) and turns a desired flow set into the smallest bundle of
+ * flow-mods that gets the switch there. Flows are identified the way
+ * OpenFlow does, by table, priority and match; a flow whose actions
+ * changed is modified in place and keeps its counters, one whose cookie
+ * or timeouts changed is re-added. The first reconcile of a scope reads
+ * it from the switch, later ones only diff against the view, unless it
+ * holds flows with a timeout: those expire on the switch by themselves,
+ * so such a scope is read again every time.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Flow identity: table, priority and normalized match, packed */
+#define IDENT_LEN 48
+
+typedef struct {
+    uint8_t ident[IDENT_LEN];
+    uint64_t hash;
+    ovs_flow_t flow;
+} flow_entry_t;
+
+/* Open-addressing set of flows keyed by identity */
+typedef struct {
+    flow_entry_t *entries;
+    uint32_t count;
+    uint32_t *slots;            /* Entry index + 1, 0 = empty */
+    uint32_t mask;
+    uint32_t timed;             /* Flows with an idle or hard timeout */
+} flow_set_t;
+
+typedef struct flow_scope {
+    char bridge[64];
+    uint32_t table_id;
+    uint64_t cookie;
+    uint64_t cookie_mask;
+    flow_set_t flows;
+    struct flow_scope *next;
+} flow_scope_t;
+
+static flow_scope_t *scopes;
+
+/* ============================================================================
+ * Flow Identity
+ * ============================================================================ */
+
+/* The match as put on the wire: IP fields imply dl_type 0x0800 */
+static void normalize(ovs_flow_t *flow) {
+    if (!flow->match.dl_type &&
+        (flow->match.nw_src || flow->match.nw_dst || flow->match.nw_proto))
+        flow->match.dl_type = 0x0800;
+    flow->match.dl_vlan &= 0x0fff;
+    flow->actions.set_vlan &= 0x0fff;
+}
+
+static uint8_t *put_bytes(uint8_t *p, const void *v, size_t n) {
+    memcpy(p, v, n);
+    return p + n;
+}
+
+/* Field by field, so struct padding never reaches the key */
+static void make_ident(const ovs_flow_t *flow, uint8_t *ident) {
+    uint8_t *p = ident;
+    memset(ident, 0, IDENT_LEN);
+    p = put_bytes(p, &flow->table_id, sizeof(flow->table_id));
+    p = put_bytes(p, &flow->priority, sizeof(flow->priority));
+    p = put_bytes(p, &flow->match.in_port, sizeof(flow->match.in_port));
+    p = put_bytes(p, flow->match.dl_src, sizeof(flow->match.dl_src));
+    p = put_bytes(p, flow->match.dl_dst, sizeof(flow->match.dl_dst));
+    p = put_bytes(p, &flow->match.dl_type, sizeof(flow->match.dl_type));
+    p = put_bytes(p, &flow->match.dl_vlan, sizeof(flow->match.dl_vlan));
+    p = put_bytes(p, &flow->match.nw_src, sizeof(flow->match.nw_src));
+    p = put_bytes(p, &flow->match.nw_dst, sizeof(flow->match.nw_dst));
+    p = put_bytes(p, &flow->match.nw_proto, sizeof(flow->match.nw_proto));
+    p = put_bytes(p, &flow->match.tp_src, sizeof(flow->match.tp_src));
+    p = put_bytes(p, &flow->match.tp_dst, sizeof(flow->match.tp_dst));
+    put_bytes(p, &flow->match.tun_id, sizeof(flow->match.tun_id));
+}
+
+static uint64_t ident_hash(const uint8_t *ident) {
+    uint64_t h = 0xcbf29ce484222325ULL;     /* FNV-1a */
+    for (size_t i = 0; i < IDENT_LEN; i++) {
+        h ^= ident[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool actions_equal(const ovs_flow_t *a, const ovs_flow_t *b) {
+    return a->actions.output_port == b->actions.output_port &&
+           a->actions.set_vlan == b->actions.set_vlan &&
+           a->actions.strip_vlan == b->actions.strip_vlan &&
+           a->actions.set_tunnel == b->actions.set_tunnel &&
+           memcmp(a->actions.set_dl_src, b->actions.set_dl_src, 6) == 0 &&
+           memcmp(a->actions.set_dl_dst, b->actions.set_dl_dst, 6) == 0 &&
+           a->actions.goto_table == b->actions.goto_table;
+}
+
+/* Attributes a modify cannot change */
+static bool entry_equal(const ovs_flow_t *a, const ovs_flow_t *b) {
+    return a->cookie == b->cookie &&
+           a->idle_timeout == b->idle_timeout &&
+           a->hard_timeout == b->hard_timeout;
+}
+
+/* ============================================================================
+ * Flow Sets
+ * ============================================================================ */
+
+static void set_free(flow_set_t *s) {
+    free(s->entries);
+    free(s->slots);
+    memset(s, 0, sizeof(*s));
+}
+
+/* Size for count flows, discarding any contents */
+static bool set_init(flow_set_t *s, uint32_t count) {
+    uint32_t nslots = 16;
+    while (nslots < count * 2)
+        nslots *= 2;
+
+    set_free(s);
+    s->entries = malloc((count ? count : 1) * sizeof(*s->entries));
+    s->slots = calloc(nslots, sizeof(*s->slots));
+    if (!s->entries || !s->slots) {
+        set_free(s);
+        return false;
+    }
+    s->mask = nslots - 1;
+    return true;
+}
+
+static const flow_entry_t *set_find(const flow_set_t *s, const uint8_t *ident, uint64_t hash) {
+    if (!s->slots)
+        return NULL;
+
+    for (uint32_t i = (uint32_t)hash & s->mask;; i = (i + 1) & s->mask) {
+        uint32_t slot = s->slots[i];
+        if (!slot)
+            return NULL;
+        const flow_entry_t *e = &s->entries[slot - 1];
+        if (e->hash == hash && memcmp(e->ident, ident, IDENT_LEN) == 0)
+            return e;
+    }
+}
+
+/* Capacity was fixed by set_init(); false if the identity is already present */
+static bool set_add(flow_set_t *s, const ovs_flow_t *flow) {
+    flow_entry_t *e = &s->entries[s->count];
+    e->flow = *flow;
+    normalize(&e->flow);
+    make_ident(&e->flow, e->ident);
+    e->hash = ident_hash(e->ident);
+
+    uint32_t i = (uint32_t)e->hash & s->mask;
+    for (; s->slots[i]; i = (i + 1) & s->mask) {
+        const flow_entry_t *other = &s->entries[s->slots[i] - 1];
+        if (other->hash == e->hash && memcmp(other->ident, e->ident, IDENT_LEN) == 0)
+            return false;
+    }
+    s->slots[i] = ++s->count;
+    if (e->flow.idle_timeout || e->flow.hard_timeout)
+        s->timed++;
+    return true;
+}
+
+/* ============================================================================
+ * Scopes
+ * ============================================================================ */
+
+static void scope_free(flow_scope_t *scope) {
+    set_free(&scope->flows);
+    free(scope);
+}
+
+static bool scopes_overlap(const flow_scope_t *a, const char *bridge, uint32_t table_id,
+                           uint64_t cookie, uint64_t cookie_mask) {
+    return strcmp(a->bridge, bridge) == 0 && a->table_id == table_id &&
+           ((a->cookie ^ cookie) & a->cookie_mask & cookie_mask) == 0;
+}
+
+/* Unlink and return the scope, or NULL if it has no view yet */
+static flow_scope_t *scope_take(const char *bridge, uint32_t table_id,
+                                uint64_t cookie, uint64_t cookie_mask) {
+    for (flow_scope_t **pp = &scopes; *pp; pp = &(*pp)->next) {
+        flow_scope_t *scope = *pp;
+        if (strcmp(scope->bridge, bridge) == 0 && scope->table_id == table_id &&
+            scope->cookie_mask == cookie_mask &&
+            (scope->cookie & cookie_mask) == (cookie & cookie_mask)) {
+            *pp = scope->next;
+            return scope;
+        }
+    }
+    return NULL;
+}
+
+/* Read the scope's flows from the switch */
+static int scope_load(flow_scope_t *scope, const of_flow_mod_t *filter) {
+    uint32_t max = 1024;
+    for (;;) {
+        ovs_flow_t *flows = malloc(max * sizeof(*flows));
+        if (!flows) {
+            ovs_set_error("Out of memory");
+            return OVS_ERR_MEMORY;
+        }
+
+        int n = of_flow_stats(scope->bridge, filter, flows, NULL, max);
+        if (n >= 0 && (uint32_t)n == max) {
+            /* Possibly truncated: ask again with room to spare */
+            free(flows);
+            max *= 4;
+            continue;
+        }
+
+        int ret = n < 0 ? n : OVS_OK;
+        if (ret == OVS_OK && !set_init(&scope->flows, (uint32_t)n)) {
+            ovs_set_error("Out of memory");
+            ret = OVS_ERR_MEMORY;
+        }
+        for (int i = 0; ret == OVS_OK && i < n; i++) {
+            set_add(&scope->flows, &flows[i]);
+        }
+        free(flows);
+        return ret;
+    }
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+int flow_diff_reconcile(const char *bridge, uint32_t table_id, uint64_t cookie,
+                        uint64_t cookie_mask, const ovs_flow_t *desired, uint32_t count,
+                        ovs_flow_diff_t *diff) {
+    flow_set_t want = {0};
+    if (!set_init(&want, count)) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const ovs_flow_t *flow = &desired[i];
+        if (flow->table_id != table_id || ((flow->cookie ^ cookie) & cookie_mask)) {
+            set_free(&want);
+            ovs_set_error("Flow %u is outside table %u cookie 0x%llx/0x%llx", i, table_id,
+                          (unsigned long long)cookie, (unsigned long long)cookie_mask);
+            return OVS_ERR_INVALID;
+        }
+        if (!set_add(&want, flow)) {
+            set_free(&want);
+            ovs_set_error("Flow %u duplicates an earlier flow's priority and match", i);
+            return OVS_ERR_INVALID;
+        }
+    }
+
+    of_flow_mod_t filter = {
+        .cookie_mask = cookie_mask,
+        .match_all = true,
+        .flow = { .table_id = table_id, .cookie = cookie & cookie_mask },
+    };
+
+    int ret = OVS_OK;
+    flow_scope_t *scope = scope_take(bridge, table_id, cookie, cookie_mask);
+    if (!scope) {
+        scope = calloc(1, sizeof(*scope));
+        if (!scope) {
+            set_free(&want);
+            ovs_set_error("Out of memory");
+            return OVS_ERR_MEMORY;
+        }
+        snprintf(scope->bridge, sizeof(scope->bridge), "%s", bridge);
+        scope->table_id = table_id;
+        scope->cookie = cookie & cookie_mask;
+        scope->cookie_mask = cookie_mask;
+        ret = scope_load(scope, &filter);
+    } else if (scope->flows.timed) {
+        /* Timed flows may have expired since: the view cannot tell */
+        ret = scope_load(scope, &filter);
+    }
+
+    /* At most one mod per wanted flow plus one per stale flow */
+    of_flow_mod_t *mods = NULL;
+    if (ret == OVS_OK) {
+        mods = malloc(((size_t)want.count + scope->flows.count + 1) * sizeof(*mods));
+        if (!mods) {
+            ovs_set_error("Out of memory");
+            ret = OVS_ERR_MEMORY;
+        }
+    }
+    if (ret != OVS_OK) {
+        set_free(&want);
+        scope_free(scope);
+        return ret;
+    }
+
+    ovs_flow_diff_t d = {0};
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < want.count; i++) {
+        const flow_entry_t *w = &want.entries[i];
+        const flow_entry_t *have = set_find(&scope->flows, w->ident, w->hash);
+        if (have && entry_equal(&have->flow, &w->flow) && actions_equal(&have->flow, &w->flow))
+            continue;
+
+        of_flow_mod_t *mod = &mods[n++];
+        memset(mod, 0, sizeof(*mod));
+        mod->flow = w->flow;
+        if (have && entry_equal(&have->flow, &w->flow)) {
+            /* Only the actions differ: keep the entry and its counters */
+            mod->command = OFPFC_MODIFY_STRICT;
+            d.modified++;
+        } else {
+            /* An add over an existing entry replaces it whole */
+            mod->command = OFPFC_ADD;
+            if (have)
+                d.modified++;
+            else
+                d.added++;
+        }
+    }
+
+    for (uint32_t i = 0; i < scope->flows.count; i++) {
+        const flow_entry_t *h = &scope->flows.entries[i];
+        if (set_find(&want, h->ident, h->hash))
+            continue;
+
+        of_flow_mod_t *mod = &mods[n++];
+        memset(mod, 0, sizeof(*mod));
+        mod->command = OFPFC_DELETE_STRICT;
+        mod->flow = h->flow;
+        d.deleted++;
+    }
+
+    /* One bundle: the switch never shows a half-applied policy */
+    ret = of_flow_bundle(bridge, mods, n);
+    free(mods);
+
+    if (ret != OVS_OK) {
+        /* The switch state is unknown if the channel broke; re-read next time */
+        set_free(&want);
+        scope_free(scope);
+        return ret;
+    }
+
+    /* The wanted set is now the view; overlapping views are stale */
+    set_free(&scope->flows);
+    scope->flows = want;
+    flow_diff_forget_overlapping(bridge, table_id, cookie, cookie_mask);
+    scope->next = scopes;
+    scopes = scope;
+
+    if (diff)
+        *diff = d;
+    return OVS_OK;
+}
+
+void flow_diff_forget_overlapping(const char *bridge, uint32_t table_id,
+                                  uint64_t cookie, uint64_t cookie_mask) {
+    for (flow_scope_t **pp = &scopes; *pp;) {
+        flow_scope_t *scope = *pp;
+        if (scopes_overlap(scope, bridge, table_id, cookie, cookie_mask)) {
+            *pp = scope->next;
+            scope_free(scope);
+        } else {
+            pp = &scope->next;
+        }
+    }
+}
+
+void flow_diff_forget(const char *bridge) {
+    for (flow_scope_t **pp = &scopes; *pp;) {
+        flow_scope_t *scope = *pp;
+        if (!bridge || strcmp(scope->bridge, bridge) == 0) {
+            *pp = scope->next;
+            scope_free(scope);
+        } else {
+            pp = &scope->next;
+        }
+    }
+}
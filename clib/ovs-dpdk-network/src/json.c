@@ -0,0 +1,473 @@
+/**
+ * Zixiao Hypervisor - Minimal JSON
+ *
+ * Just enough JSON for the OVSDB JSON-RPC protocol: a tree parser, a
+ * stream scanner for framing back-to-back messages, and an append-only
+ * writer.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdarg.h>
+
+/* Deeper nesting than OVSDB ever produces is treated as malformed */
+#define JSON_MAX_DEPTH 64
+
+typedef struct {
+    const char *p;
+    const char *end;
+} parser_t;
+
+static json_t *parse_value(parser_t *ps, int depth);
+
+static void skip_space(parser_t *ps) {
+    while (ps->p < ps->end &&
+           (*ps->p == ' ' || *ps->p == '\t' || *ps->p == '\n' || *ps->p == '\r'))
+        ps->p++;
+}
+
+static json_t *new_value(json_type_t type) {
+    json_t *json = calloc(1, sizeof(*json));
+    if (json)
+        json->type = type;
+    return json;
+}
+
+static void append_child(json_t *parent, json_t *child) {
+    if (parent->tail)
+        parent->tail->next = child;
+    else
+        parent->head = child;
+    parent->tail = child;
+    parent->count++;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+static bool parse_hex4(parser_t *ps, uint32_t *cp) {
+    if (ps->end - ps->p < 4)
+        return false;
+
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) {
+        int d = hex_digit(ps->p[i]);
+        if (d < 0)
+            return false;
+        v = (v << 4) | (uint32_t)d;
+    }
+    ps->p += 4;
+    *cp = v;
+    return true;
+}
+
+static char *put_utf8(char *out, uint32_t cp) {
+    if (cp < 0x80) {
+        *out++ = (char)cp;
+    } else if (cp < 0x800) {
+        *out++ = (char)(0xc0 | (cp >> 6));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *out++ = (char)(0xe0 | (cp >> 12));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    } else {
+        *out++ = (char)(0xf0 | (cp >> 18));
+        *out++ = (char)(0x80 | ((cp >> 12) & 0x3f));
+        *out++ = (char)(0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char)(0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+/* ps->p is past the opening quote. Decoded text is never longer than its source. */
+static char *parse_string(parser_t *ps) {
+    const char *start = ps->p;
+    while (ps->p < ps->end && *ps->p != '"') {
+        if (*ps->p == '\\')
+            ps->p++;
+        ps->p++;
+    }
+    if (ps->p >= ps->end)
+        return NULL;
+
+    char *str = malloc((size_t)(ps->p - start) + 1);
+    if (!str)
+        return NULL;
+
+    parser_t in = { start, ps->p };
+    char *out = str;
+    while (in.p < in.end) {
+        char c = *in.p++;
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+
+        c = *in.p++;
+        switch (c) {
+            case '"':  *out++ = '"'; break;
+            case '\\': *out++ = '\\'; break;
+            case '/':  *out++ = '/'; break;
+            case 'b':  *out++ = '\b'; break;
+            case 'f':  *out++ = '\f'; break;
+            case 'n':  *out++ = '\n'; break;
+            case 'r':  *out++ = '\r'; break;
+            case 't':  *out++ = '\t'; break;
+            case 'u': {
+                uint32_t cp, lo;
+                if (!parse_hex4(&in, &cp))
+                    goto bad;
+                /* A high surrogate must be followed by its low half */
+                if (cp >= 0xd800 && cp < 0xdc00) {
+                    if (in.end - in.p < 2 || in.p[0] != '\\' || in.p[1] != 'u')
+                        goto bad;
+                    in.p += 2;
+                    if (!parse_hex4(&in, &lo) || lo < 0xdc00 || lo >= 0xe000)
+                        goto bad;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                out = put_utf8(out, cp);
+                break;
+            }
+            default:
+                goto bad;
+        }
+    }
+    *out = '\0';
+    ps->p++;    /* Closing quote */
+    return str;
+
+bad:
+    free(str);
+    return NULL;
+}
+
+static json_t *parse_number(parser_t *ps) {
+    char buf[64];
+    size_t n = 0;
+    bool real = false;
+
+    while (ps->p < ps->end && n < sizeof(buf) - 1) {
+        char c = *ps->p;
+        if (c == '.' || c == 'e' || c == 'E')
+            real = true;
+        else if (!(c == '-' || c == '+' || (c >= '0' && c <= '9')))
+            break;
+        buf[n++] = c;
+        ps->p++;
+    }
+    buf[n] = '\0';
+
+    char *end;
+    json_t *json = new_value(real ? JSON_REAL : JSON_INTEGER);
+    if (!json)
+        return NULL;
+    if (real)
+        json->u.real = strtod(buf, &end);
+    else
+        json->u.integer = strtoll(buf, &end, 10);
+
+    if (n == 0 || *end != '\0') {
+        free(json);
+        return NULL;
+    }
+    return json;
+}
+
+static bool parse_literal(parser_t *ps, const char *word) {
+    size_t len = strlen(word);
+    if ((size_t)(ps->end - ps->p) < len || memcmp(ps->p, word, len) != 0)
+        return false;
+    ps->p += len;
+    return true;
+}
+
+static json_t *parse_container(parser_t *ps, int depth, bool object) {
+    json_t *json = new_value(object ? JSON_OBJECT : JSON_ARRAY);
+    if (!json)
+        return NULL;
+    char close = object ? '}' : ']';
+
+    skip_space(ps);
+    if (ps->p < ps->end && *ps->p == close) {
+        ps->p++;
+        return json;
+    }
+
+    for (;;) {
+        char *name = NULL;
+        if (object) {
+            skip_space(ps);
+            if (ps->p >= ps->end || *ps->p != '"')
+                goto bad;
+            ps->p++;
+            name = parse_string(ps);
+            if (!name)
+                goto bad;
+            skip_space(ps);
+            if (ps->p >= ps->end || *ps->p != ':') {
+                free(name);
+                goto bad;
+            }
+            ps->p++;
+        }
+
+        json_t *child = parse_value(ps, depth + 1);
+        if (!child) {
+            free(name);
+            goto bad;
+        }
+        child->name = name;
+        append_child(json, child);
+
+        skip_space(ps);
+        if (ps->p >= ps->end)
+            goto bad;
+        if (*ps->p == close) {
+            ps->p++;
+            return json;
+        }
+        if (*ps->p != ',')
+            goto bad;
+        ps->p++;
+    }
+
+bad:
+    json_free(json);
+    return NULL;
+}
+
+static json_t *parse_value(parser_t *ps, int depth) {
+    if (depth > JSON_MAX_DEPTH)
+        return NULL;
+
+    skip_space(ps);
+    if (ps->p >= ps->end)
+        return NULL;
+
+    switch (*ps->p) {
+        case '{':
+            ps->p++;
+            return parse_container(ps, depth, true);
+        case '[':
+            ps->p++;
+            return parse_container(ps, depth, false);
+        case '"': {
+            ps->p++;
+            char *str = parse_string(ps);
+            if (!str)
+                return NULL;
+            json_t *json = new_value(JSON_STRING);
+            if (!json) {
+                free(str);
+                return NULL;
+            }
+            json->u.string = str;
+            return json;
+        }
+        case 't':
+            return parse_literal(ps, "true") ? new_value(JSON_TRUE) : NULL;
+        case 'f':
+            return parse_literal(ps, "false") ? new_value(JSON_FALSE) : NULL;
+        case 'n':
+            return parse_literal(ps, "null") ? new_value(JSON_NULL) : NULL;
+        default:
+            return parse_number(ps);
+    }
+}
+
+json_t *json_parse(const char *text, size_t len) {
+    parser_t ps = { text, text + len };
+    json_t *json = parse_value(&ps, 0);
+    if (!json)
+        return NULL;
+
+    skip_space(&ps);
+    if (ps.p != ps.end) {
+        json_free(json);
+        return NULL;
+    }
+    return json;
+}
+
+void json_free(json_t *json) {
+    while (json) {
+        json_t *next = json->next;
+        json_free(json->head);
+        if (json->type == JSON_STRING)
+            free(json->u.string);
+        free(json->name);
+        free(json);
+        json = next;
+    }
+}
+
+json_t *json_take(json_t *json) {
+    json_t *taken = malloc(sizeof(*taken));
+    if (!taken)
+        return NULL;
+
+    *taken = *json;
+    taken->name = NULL;
+    taken->next = NULL;
+
+    /* What stays behind in the parent is an empty null */
+    json->type = JSON_NULL;
+    json->head = json->tail = NULL;
+    json->count = 0;
+    return taken;
+}
+
+json_t *json_member(const json_t *json, const char *name) {
+    if (!json || json->type != JSON_OBJECT)
+        return NULL;
+
+    for (json_t *m = json->head; m; m = m->next) {
+        if (strcmp(m->name, name) == 0)
+            return m;
+    }
+    return NULL;
+}
+
+json_t *json_index(const json_t *json, size_t index) {
+    if (!json || json->type != JSON_ARRAY || index >= json->count)
+        return NULL;
+
+    json_t *e = json->head;
+    while (index--)
+        e = e->next;
+    return e;
+}
+
+const char *json_string(const json_t *json) {
+    return json && json->type == JSON_STRING ? json->u.string : NULL;
+}
+
+/* ============================================================================
+ * Stream Framing
+ * ============================================================================ */
+
+long json_scan(json_scanner_t *s, const char *text, size_t len) {
+    for (; s->pos < len; s->pos++) {
+        char c = text[s->pos];
+
+        if (s->in_string) {
+            if (s->escape)
+                s->escape = false;
+            else if (c == '\\')
+                s->escape = true;
+            else if (c == '"')
+                s->in_string = false;
+            continue;
+        }
+
+        switch (c) {
+            case '"':
+                s->in_string = true;
+                break;
+            case '{':
+            case '[':
+                s->depth++;
+                break;
+            case '}':
+            case ']':
+                if (--s->depth < 0)
+                    return -1;
+                if (s->depth == 0) {
+                    long n = (long)++s->pos;
+                    memset(s, 0, sizeof(*s));
+                    return n;
+                }
+                break;
+            case ' ':
+            case '\t':
+            case '\n':
+            case '\r':
+                break;
+            default:
+                /* JSON-RPC messages are objects: no bare top-level atoms */
+                if (s->depth == 0)
+                    return -1;
+        }
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Writer
+ * ============================================================================ */
+
+static bool buf_grow(json_buf_t *b, size_t extra) {
+    if (b->failed)
+        return false;
+    if (b->len + extra + 1 <= b->cap)
+        return true;
+
+    size_t cap = b->cap ? b->cap : 256;
+    while (cap < b->len + extra + 1)
+        cap *= 2;
+
+    char *data = realloc(b->data, cap);
+    if (!data) {
+        b->failed = true;
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+void json_buf_free(json_buf_t *b) {
+    free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+void json_buf_raw(json_buf_t *b, const char *s) {
+    size_t n = strlen(s);
+    if (!buf_grow(b, n))
+        return;
+    memcpy(b->data + b->len, s, n + 1);
+    b->len += n;
+}
+
+void json_buf_printf(json_buf_t *b, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+
+    if (n < 0 || !buf_grow(b, (size_t)n))
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(b->data + b->len, (size_t)n + 1, fmt, args);
+    va_end(args);
+    b->len += (size_t)n;
+}
+
+void json_buf_string(json_buf_t *b, const char *s) {
+    json_buf_raw(b, "\"");
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            char esc[3] = { '\\', (char)c, '\0' };
+            json_buf_raw(b, esc);
+        } else if (c < 0x20) {
+            json_buf_printf(b, "\\u%04x", c);
+        } else {
+            char ch[2] = { (char)c, '\0' };
+            json_buf_raw(b, ch);
+        }
+    }
+    json_buf_raw(b, "\"");
+}
@@ -0,0 +1,327 @@
+/**
+ * Zixiao Hypervisor - Hardware Flow Offload Status
+ *
+ * OpenFlow flows are not offloaded themselves: ovs-vswitchd translates
+ * them into datapath flows and, with other_config:hw-offload, pushes
+ * those into the NIC (rte_flow for DPDK, tc-flower for the kernel). The
+ * state of a flow is read from dpctl/dump-flows type=offloaded, taking
+ * the datapath flows whose key matches every field the OpenFlow flow
+ * matches.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/* Datapath flow key field encodings */
+typedef enum {
+    FIELD_INT = 0,              /* Decimal or 0x hex */
+    FIELD_MAC,                  /* xx:xx:xx:xx:xx:xx */
+    FIELD_IPV4                  /* Dotted quad */
+} field_kind_t;
+
+/* ============================================================================
+ * Datapath Flow Keys
+ * ============================================================================ */
+
+/*
+ * Find name(...) among the comma-separated, top-level attributes of
+ * text, e.g. "eth_type" in "in_port(dpdk0),eth_type(0x0800),ipv4(...)".
+ */
+static bool key_attr(const char *text, size_t len, const char *name,
+                     const char **body, size_t *body_len) {
+    size_t name_len = strlen(name);
+    int depth = 0;
+    bool token_start = true;
+
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        if (token_start && depth == 0 && c != ' ' && i + name_len < len &&
+            strncmp(text + i, name, name_len) == 0 && text[i + name_len] == '(') {
+            size_t start = i + name_len + 1;
+            int inner = 1;
+            for (size_t j = start; j < len; j++) {
+                if (text[j] == '(') {
+                    inner++;
+                } else if (text[j] == ')' && --inner == 0) {
+                    *body = text + start;
+                    *body_len = j - start;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        }
+        if (c != ' ') {
+            token_start = depth == 0 && c == ',';
+        }
+    }
+    return false;
+}
+
+/* Copy the value of field=value at the top level of an attribute body */
+static bool attr_field(const char *body, size_t len, const char *field, char *out, size_t out_len) {
+    size_t field_len = strlen(field);
+    int depth = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (depth == 0 && (i == 0 || body[i - 1] == ',') && i + field_len < len &&
+            strncmp(body + i, field, field_len) == 0 && body[i + field_len] == '=') {
+            size_t start = i + field_len + 1, end = start;
+            while (end < len && body[end] != ',' && body[end] != '(')
+                end++;
+            if (end - start >= out_len)
+                return false;
+            memcpy(out, body + start, end - start);
+            out[end - start] = '\0';
+            return true;
+        }
+        if (body[i] == '(') {
+            depth++;
+        } else if (body[i] == ')') {
+            depth--;
+        }
+    }
+    return false;
+}
+
+static bool parse_value(field_kind_t kind, const char *s, uint64_t *value) {
+    unsigned a[6];
+    char tail;
+    switch (kind) {
+        case FIELD_MAC:
+            if (sscanf(s, "%2x:%2x:%2x:%2x:%2x:%2x%c", &a[0], &a[1], &a[2], &a[3], &a[4],
+                       &a[5], &tail) != 6)
+                return false;
+            *value = 0;
+            for (int i = 0; i < 6; i++)
+                *value = (*value << 8) | a[i];
+            return true;
+        case FIELD_IPV4:
+            if (sscanf(s, "%u.%u.%u.%u%c", &a[0], &a[1], &a[2], &a[3], &tail) != 4 ||
+                a[0] > 255 || a[1] > 255 || a[2] > 255 || a[3] > 255)
+                return false;
+            *value = ((uint64_t)a[0] << 24) | (a[1] << 16) | (a[2] << 8) | a[3];
+            return true;
+        default: {
+            char *end;
+            *value = strtoull(s, &end, 0);
+            return end != s && *end == '\0';
+        }
+    }
+}
+
+/*
+ * True when the datapath flow matches want in every bit the field
+ * carries. A missing or fully wildcarded field does not match.
+ */
+static bool field_matches(const char *body, size_t len, const char *field,
+                          field_kind_t kind, uint64_t full_mask, uint64_t want) {
+    char text[64];
+    if (!attr_field(body, len, field, text, sizeof(text)))
+        return false;
+
+    uint64_t value, mask = full_mask;
+    char *slash = strchr(text, '/');
+    if (slash) {
+        *slash = '\0';
+        if (!parse_value(kind, slash + 1, &mask))
+            return false;
+    }
+    if (!parse_value(kind, text, &value))
+        return false;
+
+    mask &= full_mask;
+    return mask != 0 && (value & mask) == (want & mask);
+}
+
+static uint64_t mac_value(const uint8_t *mac) {
+    uint64_t v = 0;
+    for (int i = 0; i < 6; i++)
+        v = (v << 8) | mac[i];
+    return v;
+}
+
+static bool mac_set(const uint8_t *mac) {
+    return mac_value(mac) != 0;
+}
+
+/* Name of the bridge interface at ofport; NULL if there is none */
+static const char *ofport_name(const char *bridge, uint32_t ofport) {
+    const ovsdb_row_t *br = NULL;
+    for (const ovsdb_row_t *row = ovsdb_next(OVSDB_BRIDGE, NULL); row && !br;
+         row = ovsdb_next(OVSDB_BRIDGE, row)) {
+        const char *name = ovsdb_get_string(row, "name");
+        if (name && strcmp(name, bridge) == 0)
+            br = row;
+    }
+
+    size_t ports = ovsdb_set_count(br, "ports");
+    for (size_t i = 0; i < ports; i++) {
+        const ovsdb_row_t *port = ovsdb_find(OVSDB_PORT,
+                                             ovsdb_atom_uuid(ovsdb_set_at(br, "ports", i)));
+        size_t ifaces = ovsdb_set_count(port, "interfaces");
+        for (size_t j = 0; j < ifaces; j++) {
+            const ovsdb_row_t *iface = ovsdb_find(OVSDB_INTERFACE,
+                                                  ovsdb_atom_uuid(ovsdb_set_at(port, "interfaces", j)));
+            int64_t v;
+            if (ovsdb_get_integer(iface, "ofport", &v) && v == (int64_t)ofport)
+                return ovsdb_get_string(iface, "name");
+        }
+    }
+    return NULL;
+}
+
+/* Does the datapath flow key carry traffic the OpenFlow flow matches? */
+static bool key_matches(const char *key, size_t len, const ovs_flow_t *flow, const char *in_port) {
+    const char *body;
+    size_t body_len;
+
+    if (in_port) {
+        if (!key_attr(key, len, "in_port", &body, &body_len) ||
+            body_len != strlen(in_port) || strncmp(body, in_port, body_len) != 0)
+            return false;
+    }
+
+    if (mac_set(flow->match.dl_src) || mac_set(flow->match.dl_dst)) {
+        if (!key_attr(key, len, "eth", &body, &body_len))
+            return false;
+        if (mac_set(flow->match.dl_src) &&
+            !field_matches(body, body_len, "src", FIELD_MAC, 0xffffffffffffULL,
+                           mac_value(flow->match.dl_src)))
+            return false;
+        if (mac_set(flow->match.dl_dst) &&
+            !field_matches(body, body_len, "dst", FIELD_MAC, 0xffffffffffffULL,
+                           mac_value(flow->match.dl_dst)))
+            return false;
+    }
+
+    if (flow->match.dl_vlan &&
+        (!key_attr(key, len, "vlan", &body, &body_len) ||
+         !field_matches(body, body_len, "vid", FIELD_INT, 0x0fff, flow->match.dl_vlan & 0x0fff)))
+        return false;
+
+    /* Tagged packets carry their inner headers in encap(...) */
+    const char *inner = key;
+    size_t inner_len = len;
+    if (key_attr(key, len, "encap", &body, &body_len)) {
+        inner = body;
+        inner_len = body_len;
+    }
+
+    bool ip = flow->match.nw_src || flow->match.nw_dst || flow->match.nw_proto;
+    uint16_t dl_type = flow->match.dl_type ? flow->match.dl_type : ip ? 0x0800 : 0;
+    if (dl_type) {
+        char value[16];
+        uint64_t type;
+        if (!key_attr(inner, inner_len, "eth_type", &body, &body_len) ||
+            body_len >= sizeof(value))
+            return false;
+        memcpy(value, body, body_len);
+        value[body_len] = '\0';
+        if (!parse_value(FIELD_INT, value, &type) || type != dl_type)
+            return false;
+    }
+
+    if (ip) {
+        if (!key_attr(inner, inner_len, "ipv4", &body, &body_len))
+            return false;
+        if (flow->match.nw_src &&
+            !field_matches(body, body_len, "src", FIELD_IPV4, 0xffffffff, flow->match.nw_src))
+            return false;
+        if (flow->match.nw_dst &&
+            !field_matches(body, body_len, "dst", FIELD_IPV4, 0xffffffff, flow->match.nw_dst))
+            return false;
+        if (flow->match.nw_proto &&
+            !field_matches(body, body_len, "proto", FIELD_INT, 0xff, flow->match.nw_proto))
+            return false;
+    }
+
+    if (flow->match.tp_src || flow->match.tp_dst) {
+        const char *l4 = flow->match.nw_proto == 6 ? "tcp" :
+                         flow->match.nw_proto == 17 ? "udp" :
+                         flow->match.nw_proto == 132 ? "sctp" : NULL;
+        if (!l4 || !key_attr(inner, inner_len, l4, &body, &body_len))
+            return false;
+        if (flow->match.tp_src &&
+            !field_matches(body, body_len, "src", FIELD_INT, 0xffff, flow->match.tp_src))
+            return false;
+        if (flow->match.tp_dst &&
+            !field_matches(body, body_len, "dst", FIELD_INT, 0xffff, flow->match.tp_dst))
+            return false;
+    }
+
+    if (flow->match.tun_id &&
+        (!key_attr(key, len, "tunnel", &body, &body_len) ||
+         !field_matches(body, body_len, "tun_id", FIELD_INT, UINT64_MAX, flow->match.tun_id)))
+        return false;
+
+    return true;
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+int offload_flow_status(const char *bridge, const char *datapath_type,
+                        const ovs_flow_t *flow, ovs_flow_stats_t *stats) {
+    stats->offload = OVS_FLOW_OFFLOAD_NONE;
+    stats->offloaded_flows = 0;
+
+    const char *in_port = NULL;
+    if (flow->match.in_port) {
+        in_port = ofport_name(bridge, flow->match.in_port);
+        if (!in_port) {
+            /* No such port, so no traffic to offload */
+            return OVS_OK;
+        }
+    }
+
+    const char *dp = datapath_type && strcmp(datapath_type, "netdev") == 0
+                     ? "netdev@ovs-netdev" : "system@ovs-system";
+    const char *args[] = { "-m", "--names", dp, "type=offloaded", NULL };
+    char *text;
+    int ret = unixctl_call("dpctl/dump-flows", args, &text);
+    if (ret != OVS_OK)
+        return ret;
+
+    for (char *line = text; line && *line;) {
+        char *eol = strchr(line, '\n');
+        if (eol)
+            *eol = '\0';
+
+        /* The key ends where the counters start */
+        char *counters = strstr(line, " packets:");
+        size_t key_len = counters ? (size_t)(counters - line) : strlen(line);
+
+        if (key_matches(line, key_len, flow, in_port)) {
+            const char *state = strstr(line, ", offloaded:");
+            ovs_flow_offload_t offload = OVS_FLOW_OFFLOAD_NONE;
+            if (state && strncmp(state + 12, "yes", 3) == 0) {
+                offload = OVS_FLOW_OFFLOAD_FULL;
+            } else if (state && strncmp(state + 12, "partial", 7) == 0) {
+                offload = OVS_FLOW_OFFLOAD_PARTIAL;
+            }
+
+            if (offload != OVS_FLOW_OFFLOAD_NONE) {
+                stats->offloaded_flows++;
+                if (offload > stats->offload)
+                    stats->offload = offload;
+            }
+        }
+
+        line = eol ? eol + 1 : NULL;
+    }
+
+    free(text);
+    return OVS_OK;
+}
@@ -0,0 +1,824 @@
+/**
+ * Zixiao Hypervisor - OpenFlow Channel
+ *
+ * One persistent OpenFlow connection per bridge, on the management socket
+ * ovs-vswitchd serves next to the database (<rundir>/<bridge>.mgmt).
+ * Flow-mods are encoded in binary and submitted in an atomic, ordered
+ * bundle: the whole batch is written at once and answered by a single
+ * commit reply. OpenFlow 1.4 bundles are used when the bridge allows
+ * 1.4, the equivalent ONF extension under 1.3.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define OF_TIMEOUT_MS 5000
+#define MAX_OF_CONNS 64
+
+/* Wire protocol */
+#define OFP13_VERSION           0x04
+#define OFP14_VERSION           0x05
+
+#define OFPT_HELLO              0
+#define OFPT_ERROR              1
+#define OFPT_ECHO_REQUEST       2
+#define OFPT_ECHO_REPLY         3
+#define OFPT_EXPERIMENTER       4
+#define OFPT_FLOW_MOD           14
+#define OFPT_MULTIPART_REQUEST  18
+#define OFPT_MULTIPART_REPLY    19
+#define OFPT_BUNDLE_CONTROL     33      /* OpenFlow 1.4 */
+#define OFPT_BUNDLE_ADD_MESSAGE 34
+
+#define OFPHET_VERSIONBITMAP    1
+
+/* ONF bundle extension for OpenFlow 1.3 */
+#define ONF_EXPERIMENTER_ID     0x4f4e4600
+#define ONFT_BUNDLE_CONTROL     2300
+#define ONFT_BUNDLE_ADD_MESSAGE 2301
+
+#define OFPBCT_OPEN_REQUEST     0
+#define OFPBCT_COMMIT_REQUEST   4
+#define OFPBCT_COMMIT_REPLY     5
+#define OFPBF_ATOMIC            1
+#define OFPBF_ORDERED           2
+
+#define OFPMP_FLOW              1
+#define OFPMPF_REPLY_MORE       1
+
+#define OFPTT_ALL               0xff
+#define OFPP_ANY                0xffffffffu
+#define OFPG_ANY                0xffffffffu
+#define OFP_NO_BUFFER           0xffffffffu
+
+#define OFPMT_OXM               1
+#define OFPXMC_OPENFLOW_BASIC   0x8000
+#define OFPXMT_IN_PORT          0
+#define OFPXMT_ETH_DST          3
+#define OFPXMT_ETH_SRC          4
+#define OFPXMT_ETH_TYPE         5
+#define OFPXMT_VLAN_VID         6
+#define OFPXMT_IP_PROTO         10
+#define OFPXMT_IPV4_SRC         11
+#define OFPXMT_IPV4_DST         12
+#define OFPXMT_TCP_SRC          13
+#define OFPXMT_TCP_DST          14
+#define OFPXMT_UDP_SRC          15
+#define OFPXMT_UDP_DST          16
+#define OFPXMT_SCTP_SRC         17
+#define OFPXMT_SCTP_DST         18
+#define OFPXMT_TUNNEL_ID        38
+#define OFPVID_PRESENT          0x1000
+
+#define OFPIT_GOTO_TABLE        1
+#define OFPIT_APPLY_ACTIONS     4
+#define OFPAT_OUTPUT            0
+#define OFPAT_POP_VLAN          18
+#define OFPAT_SET_FIELD         25
+#define OFPCML_NO_BUFFER        0xffff
+
+#define OF_HEADER_LEN           8
+#define OF_FLOW_STATS_LEN       48
+
+/* A slot is in use while bridge is set */
+typedef struct {
+    char bridge[64];
+    int fd;
+    uint8_t version;
+    uint32_t next_xid;
+    uint32_t next_bundle;
+} of_conn_t;
+
+static of_conn_t conns[MAX_OF_CONNS];
+static char of_rundir[256];
+
+static uint8_t rx_msg[65536];   /* Largest OpenFlow message */
+
+/* ============================================================================
+ * Encoding
+ * ============================================================================ */
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} of_buf_t;
+
+static uint8_t *buf_put(of_buf_t *b, size_t n) {
+    if (b->failed)
+        return NULL;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < b->len + n)
+            cap *= 2;
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) {
+            b->failed = true;
+            return NULL;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    uint8_t *p = b->data + b->len;
+    memset(p, 0, n);
+    b->len += n;
+    return p;
+}
+
+static void wr16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = (uint8_t)v; }
+static void wr32(uint8_t *p, uint32_t v) { wr16(p, v >> 16); wr16(p + 2, (uint16_t)v); }
+static void wr64(uint8_t *p, uint64_t v) { wr32(p, v >> 32); wr32(p + 4, (uint32_t)v); }
+static uint16_t rd16(const uint8_t *p) { return (uint16_t)(p[0] << 8 | p[1]); }
+static uint32_t rd32(const uint8_t *p) { return (uint32_t)rd16(p) << 16 | rd16(p + 2); }
+static uint64_t rd64(const uint8_t *p) { return (uint64_t)rd32(p) << 32 | rd32(p + 4); }
+
+static void put8(of_buf_t *b, uint8_t v)   { uint8_t *p = buf_put(b, 1); if (p) *p = v; }
+static void put16(of_buf_t *b, uint16_t v) { uint8_t *p = buf_put(b, 2); if (p) wr16(p, v); }
+static void put32(of_buf_t *b, uint32_t v) { uint8_t *p = buf_put(b, 4); if (p) wr32(p, v); }
+static void put64(of_buf_t *b, uint64_t v) { uint8_t *p = buf_put(b, 8); if (p) wr64(p, v); }
+static void put_zeros(of_buf_t *b, size_t n) { buf_put(b, n); }
+
+static void pad8(of_buf_t *b, size_t start) {
+    put_zeros(b, (8 - (b->len - start) % 8) % 8);
+}
+
+/* Start a message; returns its offset for end_msg() */
+static size_t start_msg(of_buf_t *b, uint8_t version, uint8_t type, uint32_t xid) {
+    size_t start = b->len;
+    put8(b, version);
+    put8(b, type);
+    put16(b, 0);
+    put32(b, xid);
+    return start;
+}
+
+static void end_msg(of_buf_t *b, size_t start) {
+    if (!b->failed)
+        wr16(b->data + start + 2, (uint16_t)(b->len - start));
+}
+
+static void put_oxm(of_buf_t *b, uint8_t field, const void *value, uint8_t len) {
+    put16(b, OFPXMC_OPENFLOW_BASIC);
+    put8(b, (uint8_t)(field << 1));
+    put8(b, len);
+    uint8_t *p = buf_put(b, len);
+    if (p)
+        memcpy(p, value, len);
+}
+
+static void put_oxm16(of_buf_t *b, uint8_t field, uint16_t v) {
+    uint8_t be[2];
+    wr16(be, v);
+    put_oxm(b, field, be, 2);
+}
+
+static void put_oxm32(of_buf_t *b, uint8_t field, uint32_t v) {
+    uint8_t be[4];
+    wr32(be, v);
+    put_oxm(b, field, be, 4);
+}
+
+static void put_oxm64(of_buf_t *b, uint8_t field, uint64_t v) {
+    uint8_t be[8];
+    wr64(be, v);
+    put_oxm(b, field, be, 8);
+}
+
+static bool mac_set(const uint8_t *mac) {
+    static const uint8_t zero[6];
+    return memcmp(mac, zero, sizeof(zero)) != 0;
+}
+
+/* OXM fields of the L4 ports for an IP protocol, false if it has none */
+static bool port_fields(uint8_t proto, uint8_t *src, uint8_t *dst) {
+    switch (proto) {
+        case 6:   *src = OFPXMT_TCP_SRC;  *dst = OFPXMT_TCP_DST;  return true;
+        case 17:  *src = OFPXMT_UDP_SRC;  *dst = OFPXMT_UDP_DST;  return true;
+        case 132: *src = OFPXMT_SCTP_SRC; *dst = OFPXMT_SCTP_DST; return true;
+        default:  return false;
+    }
+}
+
+/* ofp_match with the set fields; IP fields imply dl_type 0x0800 */
+static int put_match(of_buf_t *b, const ovs_flow_t *flow) {
+    size_t start = b->len;
+    put16(b, OFPMT_OXM);
+    put16(b, 0);
+
+    if (flow->match.in_port)
+        put_oxm32(b, OFPXMT_IN_PORT, flow->match.in_port);
+    if (mac_set(flow->match.dl_dst))
+        put_oxm(b, OFPXMT_ETH_DST, flow->match.dl_dst, 6);
+    if (mac_set(flow->match.dl_src))
+        put_oxm(b, OFPXMT_ETH_SRC, flow->match.dl_src, 6);
+
+    bool ip = flow->match.nw_src || flow->match.nw_dst || flow->match.nw_proto;
+    uint16_t dl_type = flow->match.dl_type ? flow->match.dl_type : (ip ? 0x0800 : 0);
+    if (dl_type)
+        put_oxm16(b, OFPXMT_ETH_TYPE, dl_type);
+    if (flow->match.dl_vlan)
+        put_oxm16(b, OFPXMT_VLAN_VID, OFPVID_PRESENT | (flow->match.dl_vlan & 0x0fff));
+    if (flow->match.nw_proto)
+        put_oxm(b, OFPXMT_IP_PROTO, &flow->match.nw_proto, 1);
+    if (flow->match.nw_src)
+        put_oxm32(b, OFPXMT_IPV4_SRC, flow->match.nw_src);
+    if (flow->match.nw_dst)
+        put_oxm32(b, OFPXMT_IPV4_DST, flow->match.nw_dst);
+
+    if (flow->match.tp_src || flow->match.tp_dst) {
+        uint8_t src, dst;
+        if (!port_fields(flow->match.nw_proto, &src, &dst)) {
+            ovs_set_error("L4 port match needs nw_proto TCP, UDP or SCTP");
+            return OVS_ERR_INVALID;
+        }
+        if (flow->match.tp_src)
+            put_oxm16(b, src, flow->match.tp_src);
+        if (flow->match.tp_dst)
+            put_oxm16(b, dst, flow->match.tp_dst);
+    }
+    if (flow->match.tun_id)
+        put_oxm64(b, OFPXMT_TUNNEL_ID, flow->match.tun_id);
+
+    /* The length excludes the padding */
+    if (!b->failed)
+        wr16(b->data + start + 2, (uint16_t)(b->len - start));
+    pad8(b, start);
+    return OVS_OK;
+}
+
+static void put_set_field(of_buf_t *b, uint8_t field, const void *value, uint8_t len) {
+    size_t start = b->len;
+    put16(b, OFPAT_SET_FIELD);
+    put16(b, 0);
+    put_oxm(b, field, value, len);
+    pad8(b, start);
+    if (!b->failed)
+        wr16(b->data + start + 2, (uint16_t)(b->len - start));
+}
+
+/* Apply-actions in the order ovs-ofctl would run them, then goto_table */
+static void put_instructions(of_buf_t *b, const ovs_flow_t *flow) {
+    bool any = flow->actions.strip_vlan || flow->actions.set_vlan ||
+               flow->actions.set_tunnel || mac_set(flow->actions.set_dl_src) ||
+               mac_set(flow->actions.set_dl_dst) || flow->actions.output_port;
+
+    if (any) {
+        size_t start = b->len;
+        put16(b, OFPIT_APPLY_ACTIONS);
+        put16(b, 0);
+        put32(b, 0);
+
+        if (flow->actions.strip_vlan) {
+            put16(b, OFPAT_POP_VLAN);
+            put16(b, 8);
+            put32(b, 0);
+        }
+        if (flow->actions.set_vlan) {
+            uint8_t vid[2];
+            wr16(vid, OFPVID_PRESENT | (flow->actions.set_vlan & 0x0fff));
+            put_set_field(b, OFPXMT_VLAN_VID, vid, 2);
+        }
+        if (flow->actions.set_tunnel) {
+            uint8_t tun[8];
+            wr64(tun, flow->actions.set_tunnel);
+            put_set_field(b, OFPXMT_TUNNEL_ID, tun, 8);
+        }
+        if (mac_set(flow->actions.set_dl_src))
+            put_set_field(b, OFPXMT_ETH_SRC, flow->actions.set_dl_src, 6);
+        if (mac_set(flow->actions.set_dl_dst))
+            put_set_field(b, OFPXMT_ETH_DST, flow->actions.set_dl_dst, 6);
+        if (flow->actions.output_port) {
+            put16(b, OFPAT_OUTPUT);
+            put16(b, 16);
+            put32(b, flow->actions.output_port);
+            put16(b, OFPCML_NO_BUFFER);
+            put_zeros(b, 6);
+        }
+        if (!b->failed)
+            wr16(b->data + start + 2, (uint16_t)(b->len - start));
+    }
+
+    if (flow->actions.goto_table) {
+        put16(b, OFPIT_GOTO_TABLE);
+        put16(b, 8);
+        put8(b, (uint8_t)flow->actions.goto_table);
+        put_zeros(b, 3);
+    }
+}
+
+static int put_flow_mod(of_buf_t *b, uint8_t version, uint32_t xid, const of_flow_mod_t *mod) {
+    const ovs_flow_t *flow = &mod->flow;
+    size_t start = start_msg(b, version, OFPT_FLOW_MOD, xid);
+    bool del = mod->command == OFPFC_DELETE || mod->command == OFPFC_DELETE_STRICT;
+
+    put64(b, flow->cookie);
+    put64(b, mod->command == OFPFC_ADD ? 0 : mod->cookie_mask);
+    put8(b, mod->all_tables ? OFPTT_ALL : (uint8_t)flow->table_id);
+    put8(b, mod->command);
+    put16(b, (uint16_t)flow->idle_timeout);
+    put16(b, (uint16_t)flow->hard_timeout);
+    put16(b, flow->priority);
+    put32(b, OFP_NO_BUFFER);
+    put32(b, OFPP_ANY);             /* out_port: deletes are not filtered by output */
+    put32(b, OFPG_ANY);
+    put16(b, 0);                    /* flags */
+    put16(b, 0);                    /* importance (1.4) / pad */
+
+    int ret = mod->match_all ? OVS_OK : put_match(b, flow);
+    if (mod->match_all) {
+        put16(b, OFPMT_OXM);
+        put16(b, 4);
+        put32(b, 0);
+    }
+    if (ret != OVS_OK)
+        return ret;
+
+    if (!del)
+        put_instructions(b, flow);
+    end_msg(b, start);
+    return OVS_OK;
+}
+
+/* Bundle control, as OpenFlow 1.4 or as its ONF extension under 1.3 */
+static void put_bundle_ctrl(of_buf_t *b, of_conn_t *c, uint32_t xid,
+                            uint32_t bundle, uint16_t type) {
+    size_t start;
+    if (c->version >= OFP14_VERSION) {
+        start = start_msg(b, c->version, OFPT_BUNDLE_CONTROL, xid);
+    } else {
+        start = start_msg(b, c->version, OFPT_EXPERIMENTER, xid);
+        put32(b, ONF_EXPERIMENTER_ID);
+        put32(b, ONFT_BUNDLE_CONTROL);
+    }
+    put32(b, bundle);
+    put16(b, type);
+    put16(b, OFPBF_ATOMIC | OFPBF_ORDERED);
+    end_msg(b, start);
+}
+
+static int put_bundle_add(of_buf_t *b, of_conn_t *c, uint32_t bundle,
+                          const of_flow_mod_t *mod) {
+    /* The inner message carries the same xid as the one wrapping it */
+    uint32_t xid = c->next_xid++;
+    size_t start;
+    if (c->version >= OFP14_VERSION) {
+        start = start_msg(b, c->version, OFPT_BUNDLE_ADD_MESSAGE, xid);
+    } else {
+        start = start_msg(b, c->version, OFPT_EXPERIMENTER, xid);
+        put32(b, ONF_EXPERIMENTER_ID);
+        put32(b, ONFT_BUNDLE_ADD_MESSAGE);
+    }
+    put32(b, bundle);
+    put16(b, 0);
+    put16(b, OFPBF_ATOMIC | OFPBF_ORDERED);
+
+    int ret = put_flow_mod(b, c->version, xid, mod);
+    end_msg(b, start);
+    return ret;
+}
+
+/* ============================================================================
+ * Decoding
+ * ============================================================================ */
+
+static void decode_match(const uint8_t *p, size_t len, ovs_flow_t *flow) {
+    for (size_t off = 0; off + 4 <= len;) {
+        const uint8_t *oxm = p + off;
+        const uint8_t *v = oxm + 4;
+        uint8_t field = oxm[2] >> 1;
+        off += 4 + oxm[3];
+        if (off > len)
+            break;
+        /* Masked fields never come from put_match() */
+        if (rd16(oxm) != OFPXMC_OPENFLOW_BASIC || (oxm[2] & 1))
+            continue;
+
+        switch (field) {
+            case OFPXMT_IN_PORT:   flow->match.in_port = rd32(v); break;
+            case OFPXMT_ETH_DST:   memcpy(flow->match.dl_dst, v, 6); break;
+            case OFPXMT_ETH_SRC:   memcpy(flow->match.dl_src, v, 6); break;
+            case OFPXMT_ETH_TYPE:  flow->match.dl_type = rd16(v); break;
+            case OFPXMT_VLAN_VID:  flow->match.dl_vlan = rd16(v) & 0x0fff; break;
+            case OFPXMT_IP_PROTO:  flow->match.nw_proto = v[0]; break;
+            case OFPXMT_IPV4_SRC:  flow->match.nw_src = rd32(v); break;
+            case OFPXMT_IPV4_DST:  flow->match.nw_dst = rd32(v); break;
+            case OFPXMT_TUNNEL_ID: flow->match.tun_id = (uint32_t)rd64(v); break;
+            case OFPXMT_TCP_SRC:
+            case OFPXMT_UDP_SRC:
+            case OFPXMT_SCTP_SRC:  flow->match.tp_src = rd16(v); break;
+            case OFPXMT_TCP_DST:
+            case OFPXMT_UDP_DST:
+            case OFPXMT_SCTP_DST:  flow->match.tp_dst = rd16(v); break;
+            default: break;
+        }
+    }
+}
+
+static void decode_actions(const uint8_t *p, size_t len, ovs_flow_t *flow) {
+    for (size_t off = 0; off + 4 <= len;) {
+        uint16_t type = rd16(p + off);
+        uint16_t alen = rd16(p + off + 2);
+        if (alen < 8 || off + alen > len)
+            break;
+        const uint8_t *a = p + off;
+
+        if (type == OFPAT_OUTPUT) {
+            flow->actions.output_port = rd32(a + 4);
+        } else if (type == OFPAT_POP_VLAN) {
+            flow->actions.strip_vlan = true;
+        } else if (type == OFPAT_SET_FIELD && rd16(a + 4) == OFPXMC_OPENFLOW_BASIC) {
+            uint8_t field = a[6] >> 1;
+            const uint8_t *v = a + 8;
+            if (field == OFPXMT_VLAN_VID)
+                flow->actions.set_vlan = rd16(v) & 0x0fff;
+            else if (field == OFPXMT_TUNNEL_ID)
+                flow->actions.set_tunnel = (uint32_t)rd64(v);
+            else if (field == OFPXMT_ETH_SRC)
+                memcpy(flow->actions.set_dl_src, v, 6);
+            else if (field == OFPXMT_ETH_DST)
+                memcpy(flow->actions.set_dl_dst, v, 6);
+        }
+        off += alen;
+    }
+}
+
+static void decode_instructions(const uint8_t *p, size_t len, ovs_flow_t *flow) {
+    for (size_t off = 0; off + 4 <= len;) {
+        uint16_t type = rd16(p + off);
+        uint16_t ilen = rd16(p + off + 2);
+        if (ilen < 8 || off + ilen > len)
+            break;
+
+        if (type == OFPIT_APPLY_ACTIONS)
+            decode_actions(p + off + 8, ilen - 8, flow);
+        else if (type == OFPIT_GOTO_TABLE)
+            flow->actions.goto_table = p[off + 4];
+        off += ilen;
+    }
+}
+
+/* One ofp_flow_stats entry; returns its length, 0 if malformed */
+static size_t decode_flow_stats(const uint8_t *p, size_t len,
+                                ovs_flow_t *flow, ovs_flow_stats_t *stats) {
+    if (len < OF_FLOW_STATS_LEN + 4)
+        return 0;
+    uint16_t elen = rd16(p);
+    uint16_t mlen = rd16(p + OF_FLOW_STATS_LEN + 2);
+    size_t mpad = (mlen + 7u) & ~7u;
+    if (elen > len || mlen < 4 || OF_FLOW_STATS_LEN + mpad > elen)
+        return 0;
+
+    memset(flow, 0, sizeof(*flow));
+    flow->table_id = p[2];
+    flow->priority = rd16(p + 12);
+    flow->idle_timeout = rd16(p + 14);
+    flow->hard_timeout = rd16(p + 16);
+    flow->cookie = rd64(p + 24);
+
+    if (stats) {
+        stats->duration_sec = rd32(p + 4);
+        stats->duration_nsec = rd32(p + 8);
+        stats->packet_count = rd64(p + 32);
+        stats->byte_count = rd64(p + 40);
+    }
+
+    decode_match(p + OF_FLOW_STATS_LEN + 4, mlen - 4u, flow);
+    decode_instructions(p + OF_FLOW_STATS_LEN + mpad, elen - OF_FLOW_STATS_LEN - mpad, flow);
+    return elen;
+}
+
+/* ============================================================================
+ * Connection
+ * ============================================================================ */
+
+static void conn_drop(of_conn_t *c) {
+    if (c->fd >= 0)
+        close(c->fd);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+static int conn_send(of_conn_t *c, const of_buf_t *b) {
+    if (b->failed) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    for (size_t off = 0; off < b->len;) {
+        ssize_t n = send(c->fd, b->data + off, b->len - off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ovs_set_error("OpenFlow send to %s failed: %s", c->bridge, strerror(errno));
+            conn_drop(c);
+            return OVS_ERR_OPENFLOW;
+        }
+        off += (size_t)n;
+    }
+    return OVS_OK;
+}
+
+static int read_full(of_conn_t *c, uint8_t *p, size_t len) {
+    while (len > 0) {
+        struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+        int ret = poll(&pfd, 1, OF_TIMEOUT_MS);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            ovs_set_error("OpenFlow channel to %s %s", c->bridge,
+                          ret ? strerror(errno) : "timed out");
+            conn_drop(c);
+            return OVS_ERR_OPENFLOW;
+        }
+
+        ssize_t n = recv(c->fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ovs_set_error("OpenFlow channel to %s closed", c->bridge);
+            conn_drop(c);
+            return OVS_ERR_OPENFLOW;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return OVS_OK;
+}
+
+/* Next message other than an echo request, which is answered here */
+static int conn_recv(of_conn_t *c, uint8_t **msg) {
+    for (;;) {
+        int ret = read_full(c, rx_msg, OF_HEADER_LEN);
+        if (ret != OVS_OK)
+            return ret;
+
+        uint16_t len = rd16(rx_msg + 2);
+        if (len < OF_HEADER_LEN) {
+            ovs_set_error("Malformed OpenFlow message from %s", c->bridge);
+            conn_drop(c);
+            return OVS_ERR_OPENFLOW;
+        }
+        ret = read_full(c, rx_msg + OF_HEADER_LEN, len - OF_HEADER_LEN);
+        if (ret != OVS_OK)
+            return ret;
+
+        if (rx_msg[1] != OFPT_ECHO_REQUEST) {
+            *msg = rx_msg;
+            return OVS_OK;
+        }
+
+        of_buf_t reply = {0};
+        uint8_t *p = buf_put(&reply, len);
+        if (p) {
+            memcpy(p, rx_msg, len);
+            p[1] = OFPT_ECHO_REPLY;
+        }
+        ret = conn_send(c, &reply);
+        free(reply.data);
+        if (ret != OVS_OK)
+            return ret;
+    }
+}
+
+static int error_of(of_conn_t *c, const uint8_t *msg) {
+    uint16_t len = rd16(msg + 2);
+    if (len >= OF_HEADER_LEN + 4) {
+        ovs_set_error("OpenFlow error from %s: type %u code %u", c->bridge,
+                      rd16(msg + 8), rd16(msg + 10));
+    } else {
+        ovs_set_error("OpenFlow error from %s", c->bridge);
+    }
+    return OVS_ERR_OPENFLOW;
+}
+
+static int conn_open(of_conn_t *c, const char *bridge) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s.mgmt", of_rundir, bridge);
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path)) {
+        ovs_set_error("OpenFlow socket path too long for bridge %s", bridge);
+        return OVS_ERR_INVALID;
+    }
+
+    conn_drop(c);
+    snprintf(c->bridge, sizeof(c->bridge), "%s", bridge);
+    c->next_xid = 1;
+    c->next_bundle = 1;
+
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ovs_set_error("Failed to connect to %s: %s", addr.sun_path, strerror(errno));
+        conn_drop(c);
+        return OVS_ERR_OPENFLOW;
+    }
+
+    /* Offer 1.3 and 1.4 and settle on the highest both sides speak */
+    of_buf_t b = {0};
+    size_t start = start_msg(&b, OFP14_VERSION, OFPT_HELLO, c->next_xid++);
+    put16(&b, OFPHET_VERSIONBITMAP);
+    put16(&b, 8);
+    put32(&b, 1u << OFP13_VERSION | 1u << OFP14_VERSION);
+    end_msg(&b, start);
+    int ret = conn_send(c, &b);
+    free(b.data);
+    if (ret != OVS_OK)
+        return ret;
+
+    uint8_t *msg;
+    ret = conn_recv(c, &msg);
+    if (ret != OVS_OK)
+        return ret;
+    if (msg[1] != OFPT_HELLO) {
+        ovs_set_error("Unexpected OpenFlow handshake from %s", bridge);
+        conn_drop(c);
+        return OVS_ERR_OPENFLOW;
+    }
+
+    uint32_t theirs = 0;
+    uint16_t len = rd16(msg + 2);
+    for (size_t off = OF_HEADER_LEN; off + 8 <= len;) {
+        uint16_t type = rd16(msg + off);
+        uint16_t elen = rd16(msg + off + 2);
+        if (elen < 4)
+            break;
+        if (type == OFPHET_VERSIONBITMAP)
+            theirs = rd32(msg + off + 4);
+        off += (elen + 7u) & ~7u;
+    }
+    if (!theirs)
+        theirs = (2u << msg[0]) - 1;    /* Every version up to the header's */
+
+    if (theirs & (1u << OFP14_VERSION)) {
+        c->version = OFP14_VERSION;
+    } else if (theirs & (1u << OFP13_VERSION)) {
+        c->version = OFP13_VERSION;
+    } else {
+        ovs_set_error("Bridge %s does not allow OpenFlow 1.3 or later", bridge);
+        conn_drop(c);
+        return OVS_ERR_OPENFLOW;
+    }
+    return OVS_OK;
+}
+
+static of_conn_t *conn_get(const char *bridge, int *err) {
+    of_conn_t *free_slot = NULL;
+    for (int i = 0; i < MAX_OF_CONNS; i++) {
+        if (conns[i].bridge[0] && strcmp(conns[i].bridge, bridge) == 0)
+            return &conns[i];
+        if (!conns[i].bridge[0] && !free_slot)
+            free_slot = &conns[i];
+    }
+
+    if (!free_slot) {
+        ovs_set_error("Too many OpenFlow channels");
+        *err = OVS_ERR_MEMORY;
+        return NULL;
+    }
+
+    *err = conn_open(free_slot, bridge);
+    return *err == OVS_OK ? free_slot : NULL;
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+void of_init(const char *rundir) {
+    snprintf(of_rundir, sizeof(of_rundir), "%s", rundir);
+}
+
+void of_close(const char *bridge) {
+    for (int i = 0; i < MAX_OF_CONNS; i++) {
+        if (conns[i].bridge[0] && (!bridge || strcmp(conns[i].bridge, bridge) == 0))
+            conn_drop(&conns[i]);
+    }
+}
+
+int of_flow_bundle(const char *bridge, const of_flow_mod_t *mods, uint32_t count) {
+    if (count == 0)
+        return OVS_OK;
+
+    int ret;
+    of_conn_t *c = conn_get(bridge, &ret);
+    if (!c)
+        return ret;
+
+    /* Open, every add and the commit go out in one write */
+    of_buf_t b = {0};
+    uint32_t bundle = c->next_bundle++;
+    put_bundle_ctrl(&b, c, c->next_xid++, bundle, OFPBCT_OPEN_REQUEST);
+    for (uint32_t i = 0; i < count; i++) {
+        ret = put_bundle_add(&b, c, bundle, &mods[i]);
+        if (ret != OVS_OK) {
+            free(b.data);
+            return ret;
+        }
+    }
+    uint32_t commit_xid = c->next_xid++;
+    put_bundle_ctrl(&b, c, commit_xid, bundle, OFPBCT_COMMIT_REQUEST);
+
+    ret = conn_send(c, &b);
+    free(b.data);
+    if (ret != OVS_OK)
+        return ret;
+
+    /*
+     * Replies come in order, so the commit's is last. Keep the first error:
+     * a rejected flow-mod explains the failed commit better than the
+     * commit error does.
+     */
+    int result = OVS_OK;
+    for (;;) {
+        uint8_t *msg;
+        ret = conn_recv(c, &msg);
+        if (ret != OVS_OK)
+            return ret;
+
+        uint32_t xid = rd32(msg + 4);
+        if (msg[1] == OFPT_ERROR && result == OVS_OK)
+            result = error_of(c, msg);
+        if (xid == commit_xid)
+            return result;
+    }
+}
+
+int of_flow_stats(const char *bridge, const of_flow_mod_t *filter,
+                  ovs_flow_t *flows, ovs_flow_stats_t *stats, uint32_t max) {
+    int ret;
+    of_conn_t *c = conn_get(bridge, &ret);
+    if (!c)
+        return ret;
+
+    uint32_t xid = c->next_xid++;
+    of_buf_t b = {0};
+    size_t start = start_msg(&b, c->version, OFPT_MULTIPART_REQUEST, xid);
+    put16(&b, OFPMP_FLOW);
+    put16(&b, 0);
+    put32(&b, 0);
+    put8(&b, filter->all_tables ? OFPTT_ALL : (uint8_t)filter->flow.table_id);
+    put_zeros(&b, 3);
+    put32(&b, OFPP_ANY);
+    put32(&b, OFPG_ANY);
+    put32(&b, 0);
+    put64(&b, filter->flow.cookie);
+    put64(&b, filter->cookie_mask);
+    if (filter->match_all) {
+        put16(&b, OFPMT_OXM);
+        put16(&b, 4);
+        put32(&b, 0);
+    } else if ((ret = put_match(&b, &filter->flow)) != OVS_OK) {
+        free(b.data);
+        return ret;
+    }
+    end_msg(&b, start);
+
+    ret = conn_send(c, &b);
+    free(b.data);
+    if (ret != OVS_OK)
+        return ret;
+
+    /* Drain every part even past max, so the channel stays in step */
+    uint32_t count = 0;
+    for (;;) {
+        uint8_t *msg;
+        ret = conn_recv(c, &msg);
+        if (ret != OVS_OK)
+            return ret;
+        if (rd32(msg + 4) != xid)
+            continue;
+        if (msg[1] == OFPT_ERROR)
+            return error_of(c, msg);
+        if (msg[1] != OFPT_MULTIPART_REPLY)
+            continue;
+
+        uint16_t len = rd16(msg + 2);
+        for (size_t off = OF_HEADER_LEN + 8; off < len;) {
+            ovs_flow_t flow;
+            ovs_flow_stats_t st;
+            size_t n = decode_flow_stats(msg + off, len - off, &flow, &st);
+            if (n == 0)
+                break;
+            if (count < max) {
+                if (flows)
+                    flows[count] = flow;
+                if (stats)
+                    stats[count] = st;
+                count++;
+            }
+            off += n;
+        }
+
+        if (!(rd16(msg + OF_HEADER_LEN + 2) & OFPMPF_REPLY_MORE))
+            return (int)count;
+    }
+}
@@ -5,14 +5,12 @@
  * Licensed under Apache License 2.0
  */
 
-#include "ovs_bridge.h"
+#include "ovs_internal.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <sys/un.h>
 #include <errno.h>
 
 /* Default OVSDB socket path */
@@ -25,75 +23,380 @@ static struct {
     char last_error[256];
 } ovs_state = {0};
 
-/* Bridge storage (simplified - real impl would use OVSDB) */
-#define MAX_BRIDGES 64
-static ovs_bridge_config_t bridges[MAX_BRIDGES];
-static uint32_t bridge_count = 0;
-
-/* Port storage */
-#define MAX_PORTS 1024
-static ovs_port_config_t ports[MAX_PORTS];
-static uint32_t port_count = 0;
-
-/* Flow storage */
-#define MAX_FLOWS 4096
-static struct {
-    char bridge[64];
-    ovs_flow_t flow;
-    ovs_flow_stats_t stats;
-} flows[MAX_FLOWS];
-static uint32_t flow_count = 0;
-
-static void set_error(const char *fmt, ...) {
+void ovs_set_error(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
     vsnprintf(ovs_state.last_error, sizeof(ovs_state.last_error), fmt, args);
     va_end(args);
 }
 
-/* Execute ovs-vsctl command (simplified) */
-static int ovs_vsctl(const char *cmd, char *output, size_t output_len) {
-    char full_cmd[1024];
-    snprintf(full_cmd, sizeof(full_cmd), "ovs-vsctl --db=unix:%s %s 2>&1",
-             ovs_state.ovsdb_socket, cmd);
+/* ============================================================================
+ * OVSDB Cache Lookups
+ * ============================================================================ */
 
-    FILE *fp = popen(full_cmd, "r");
-    if (!fp) {
-        set_error("Failed to execute ovs-vsctl: %s", strerror(errno));
-        return OVS_ERR_OVSDB;
+static const ovsdb_row_t *find_bridge(const char *name) {
+    for (const ovsdb_row_t *row = ovsdb_next(OVSDB_BRIDGE, NULL); row;
+         row = ovsdb_next(OVSDB_BRIDGE, row)) {
+        const char *row_name = ovsdb_get_string(row, "name");
+        if (row_name && strcmp(row_name, name) == 0)
+            return row;
     }
+    return NULL;
+}
 
-    if (output && output_len > 0) {
-        size_t total = 0;
-        while (fgets(output + total, output_len - total, fp) && total < output_len - 1) {
-            total = strlen(output);
-        }
+/* Port of a bridge by position in its "ports" set */
+static const ovsdb_row_t *bridge_port_at(const ovsdb_row_t *br, size_t index) {
+    return ovsdb_find(OVSDB_PORT, ovsdb_atom_uuid(ovsdb_set_at(br, "ports", index)));
+}
+
+static const ovsdb_row_t *find_port(const ovsdb_row_t *br, const char *name) {
+    size_t count = ovsdb_set_count(br, "ports");
+    for (size_t i = 0; i < count; i++) {
+        const ovsdb_row_t *row = bridge_port_at(br, i);
+        const char *row_name = ovsdb_get_string(row, "name");
+        if (row_name && strcmp(row_name, name) == 0)
+            return row;
     }
+    return NULL;
+}
 
-    int ret = pclose(fp);
-    return ret == 0 ? OVS_OK : OVS_ERR_OVSDB;
+/* Port names are unique across all bridges */
+static bool port_name_taken(const char *name) {
+    for (const ovsdb_row_t *row = ovsdb_next(OVSDB_PORT, NULL); row;
+         row = ovsdb_next(OVSDB_PORT, row)) {
+        const char *row_name = ovsdb_get_string(row, "name");
+        if (row_name && strcmp(row_name, name) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void copy_string(char *dst, size_t size, const char *src) {
+    snprintf(dst, size, "%s", src ? src : "");
 }
 
-/* Execute ovs-ofctl command */
-static int ovs_ofctl(const char *bridge, const char *cmd, char *output, size_t output_len) {
-    char full_cmd[1024];
-    snprintf(full_cmd, sizeof(full_cmd), "ovs-ofctl %s %s 2>&1", cmd, bridge);
+/* other_config:hw-offload of the Open_vSwitch row */
+static bool hw_offload_enabled(void) {
+    const char *value = ovsdb_map_get(ovsdb_next(OVSDB_OPEN_VSWITCH, NULL),
+                                      "other_config", "hw-offload");
+    return value && strcmp(value, "true") == 0;
+}
+
+/* other_config:vhost-async-support of the Open_vSwitch row */
+static bool vhost_async_enabled(void) {
+    const char *value = ovsdb_map_get(ovsdb_next(OVSDB_OPEN_VSWITCH, NULL),
+                                      "other_config", "vhost-async-support");
+    return value && strcmp(value, "true") == 0;
+}
+
+static void fill_bridge(const ovsdb_row_t *row, ovs_bridge_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    copy_string(config->name, sizeof(config->name), ovsdb_get_string(row, "name"));
+    copy_string(config->datapath_type, sizeof(config->datapath_type),
+                ovsdb_get_string(row, "datapath_type"));
+    config->stp_enabled = ovsdb_get_bool(row, "stp_enable");
+    config->rstp_enabled = ovsdb_get_bool(row, "rstp_enable");
+
+    const char *fail_mode = ovsdb_get_string(row, "fail_mode");
+    config->fail_mode = fail_mode && strcmp(fail_mode, "secure") == 0;
+
+    const ovsdb_row_t *ctrl = ovsdb_find(OVSDB_CONTROLLER,
+                                         ovsdb_atom_uuid(ovsdb_set_at(row, "controller", 0)));
+    copy_string(config->controller, sizeof(config->controller),
+                ovsdb_get_string(ctrl, "target"));
+
+    config->hw_offload = hw_offload_enabled();
+}
 
-    FILE *fp = popen(full_cmd, "r");
-    if (!fp) {
-        set_error("Failed to execute ovs-ofctl: %s", strerror(errno));
-        return OVS_ERR_OPENFLOW;
+#define REPRESENTOR_ARG ",representor=["
+
+static void fill_port(const char *bridge, const ovsdb_row_t *row, ovs_port_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    copy_string(config->name, sizeof(config->name), ovsdb_get_string(row, "name"));
+    copy_string(config->bridge, sizeof(config->bridge), bridge);
+
+    int64_t v;
+    if (ovsdb_get_integer(row, "tag", &v))
+        config->tag = (uint16_t)v;
+
+    size_t trunks = ovsdb_set_count(row, "trunks");
+    for (size_t i = 0; i < trunks; i++) {
+        const json_t *vlan = ovsdb_set_at(row, "trunks", i);
+        if (vlan && vlan->type == JSON_INTEGER && vlan->u.integer >= 0 &&
+            vlan->u.integer < 4096)
+            config->trunks[vlan->u.integer / 16] |= 1u << (vlan->u.integer % 16);
+    }
+
+    /* Ports the library creates have exactly one interface */
+    const ovsdb_row_t *iface = ovsdb_find(OVSDB_INTERFACE,
+                                          ovsdb_atom_uuid(ovsdb_set_at(row, "interfaces", 0)));
+    const char *type = ovsdb_get_string(iface, "type");
+    int parsed = type && type[0] ? ovs_port_type_parse(type) : -1;
+    config->type = parsed >= 0 ? (ovs_port_type_t)parsed : OVS_PORT_SYSTEM;
+
+    if (ovsdb_get_integer(iface, "ofport", &v) && v > 0)
+        config->ofport = (uint32_t)v;
+
+    const char *opt;
+    copy_string(config->tunnel.remote_ip, sizeof(config->tunnel.remote_ip),
+                ovsdb_map_get(iface, "options", "remote_ip"));
+    copy_string(config->tunnel.local_ip, sizeof(config->tunnel.local_ip),
+                ovsdb_map_get(iface, "options", "local_ip"));
+    if ((opt = ovsdb_map_get(iface, "options", "key")))
+        config->tunnel.key = (uint32_t)strtoul(opt, NULL, 0);
+    if ((opt = ovsdb_map_get(iface, "options", "dst_port")))
+        config->tunnel.dst_port = (uint16_t)strtoul(opt, NULL, 10);
+
+    copy_string(config->dpdk.devargs, sizeof(config->dpdk.devargs),
+                ovsdb_map_get(iface, "options", "dpdk-devargs"));
+    if ((opt = ovsdb_map_get(iface, "options", "n_rxq")))
+        config->dpdk.rxq = (uint16_t)strtoul(opt, NULL, 10);
+
+    /* Representors are the PF's devargs plus ",representor=[vf]" */
+    char *rep = strstr(config->dpdk.devargs, REPRESENTOR_ARG);
+    if (rep) {
+        config->dpdk.representor = true;
+        config->dpdk.vf = (uint16_t)strtoul(rep + strlen(REPRESENTOR_ARG), NULL, 10);
+        *rep = '\0';
+    }
+
+    copy_string(config->rxq_affinity, sizeof(config->rxq_affinity),
+                ovsdb_map_get(iface, "other_config", "pmd-rxq-affinity"));
+
+    copy_string(config->vhost.socket_path, sizeof(config->vhost.socket_path),
+                ovsdb_map_get(iface, "options", "vhost-server-path"));
+    config->vhost.server_mode = config->type == OVS_PORT_DPDKVHOSTUSER;
+    const char *async = ovsdb_map_get(iface, "other_config", "vhost-async-support");
+    config->vhost.async_copy = async && strcmp(async, "true") == 0;
+}
+
+/* "rxq:core" pairs separated by commas */
+static bool valid_affinity(const char *affinity) {
+    const char *p = affinity;
+    while (*p) {
+        if (*p < '0' || *p > '9')
+            return false;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p++ != ':' || *p < '0' || *p > '9')
+            return false;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p == ',' && p[1])
+            p++;
+        else if (*p)
+            return false;
+    }
+    return true;
+}
+
+/* ============================================================================
+ * OVSDB Operations
+ * ============================================================================ */
+
+/* Interface "type" column; system and TAP devices leave it empty */
+static const char *interface_type(ovs_port_type_t type) {
+    switch (type) {
+        case OVS_PORT_SYSTEM:
+        case OVS_PORT_TAP:
+            return "";
+        default:
+            return ovs_port_type_name(type);
+    }
+}
+
+static void op_sep(json_buf_t *b) {
+    if (b->len > 0)
+        json_buf_raw(b, ",");
+}
+
+static void map_pair(json_buf_t *b, bool *first, const char *key, const char *value) {
+    json_buf_raw(b, *first ? "[" : ",[");
+    json_buf_string(b, key);
+    json_buf_raw(b, ",");
+    json_buf_string(b, value);
+    json_buf_raw(b, "]");
+    *first = false;
+}
+
+static void op_insert_interface(json_buf_t *b, const ovs_port_config_t *config, uint32_t n) {
+    const char *type = interface_type(config->type);
+    char num[16];
+    bool first = true;
+
+    op_sep(b);
+    json_buf_printf(b, "{\"op\":\"insert\",\"table\":\"Interface\",\"uuid-name\":\"iface%u\","
+                       "\"row\":{\"name\":", n);
+    json_buf_string(b, config->name);
+    if (type[0]) {
+        json_buf_raw(b, ",\"type\":");
+        json_buf_string(b, type);
     }
 
-    if (output && output_len > 0) {
-        size_t total = 0;
-        while (fgets(output + total, output_len - total, fp) && total < output_len - 1) {
-            total = strlen(output);
+    json_buf_raw(b, ",\"options\":[\"map\",[");
+    switch (config->type) {
+        case OVS_PORT_VXLAN:
+        case OVS_PORT_GENEVE:
+        case OVS_PORT_GRE:
+            map_pair(b, &first, "remote_ip", config->tunnel.remote_ip);
+            if (config->tunnel.local_ip[0])
+                map_pair(b, &first, "local_ip", config->tunnel.local_ip);
+            if (config->tunnel.key) {
+                snprintf(num, sizeof(num), "%u", config->tunnel.key);
+                map_pair(b, &first, "key", num);
+            }
+            if (config->tunnel.dst_port) {
+                snprintf(num, sizeof(num), "%u", config->tunnel.dst_port);
+                map_pair(b, &first, "dst_port", num);
+            }
+            break;
+        case OVS_PORT_DPDKVHOSTUSER:
+        case OVS_PORT_DPDKVHOSTUSERCLIENT:
+            map_pair(b, &first, "vhost-server-path", config->vhost.socket_path);
+            break;
+        case OVS_PORT_DPDK:
+            if (config->dpdk.representor) {
+                char devargs[sizeof(config->dpdk.devargs) + 32];
+                snprintf(devargs, sizeof(devargs), "%s" REPRESENTOR_ARG "%u]",
+                         config->dpdk.devargs, config->dpdk.vf);
+                map_pair(b, &first, "dpdk-devargs", devargs);
+            } else {
+                map_pair(b, &first, "dpdk-devargs", config->dpdk.devargs);
+            }
+            if (config->dpdk.rxq > 1) {
+                snprintf(num, sizeof(num), "%u", config->dpdk.rxq);
+                map_pair(b, &first, "n_rxq", num);
+            }
+            break;
+        default:
+            break;
+    }
+    json_buf_raw(b, "]]");
+
+    bool async = config->vhost.async_copy && (config->type == OVS_PORT_DPDKVHOSTUSER ||
+                                              config->type == OVS_PORT_DPDKVHOSTUSERCLIENT);
+    if (config->rxq_affinity[0] || async) {
+        first = true;
+        json_buf_raw(b, ",\"other_config\":[\"map\",[");
+        if (config->rxq_affinity[0])
+            map_pair(b, &first, "pmd-rxq-affinity", config->rxq_affinity);
+        if (async)
+            map_pair(b, &first, "vhost-async-support", "true");
+        json_buf_raw(b, "]]");
+    }
+    json_buf_raw(b, "}}");
+}
+
+static void op_insert_port(json_buf_t *b, const ovs_port_config_t *config, uint32_t n) {
+    op_sep(b);
+    json_buf_printf(b, "{\"op\":\"insert\",\"table\":\"Port\",\"uuid-name\":\"port%u\","
+                       "\"row\":{\"name\":", n);
+    json_buf_string(b, config->name);
+    json_buf_printf(b, ",\"interfaces\":[\"named-uuid\",\"iface%u\"]", n);
+    if (config->tag > 0)
+        json_buf_printf(b, ",\"tag\":%u", config->tag);
+
+    bool first = true;
+    for (uint32_t vlan = 0; vlan < 4096; vlan++) {
+        if (!(config->trunks[vlan / 16] & (1u << (vlan % 16))))
+            continue;
+        json_buf_printf(b, "%s%u", first ? ",\"trunks\":[\"set\",[" : ",", vlan);
+        first = false;
+    }
+    if (!first)
+        json_buf_raw(b, "]]");
+    json_buf_raw(b, "}}");
+}
+
+/* Abort the transaction unless the named bridge still exists */
+static void op_wait_bridge(json_buf_t *b, const char *bridge) {
+    op_sep(b);
+    json_buf_raw(b, "{\"op\":\"wait\",\"timeout\":0,\"table\":\"Bridge\","
+                    "\"where\":[[\"name\",\"==\",");
+    json_buf_string(b, bridge);
+    json_buf_raw(b, "]],\"columns\":[\"name\"],\"until\":\"==\",\"rows\":[{\"name\":");
+    json_buf_string(b, bridge);
+    json_buf_raw(b, "}]}");
+}
+
+/* Mutate a set column of one row; value is an atom or set in OVSDB notation */
+static void op_mutate(json_buf_t *b, const char *table, const char *uuid,
+                      const char *column, const char *mutator, const char *value) {
+    op_sep(b);
+    json_buf_printf(b, "{\"op\":\"mutate\",\"table\":\"%s\",\"where\":", table);
+    if (uuid)
+        json_buf_printf(b, "[[\"_uuid\",\"==\",[\"uuid\",\"%s\"]]]", uuid);
+    else
+        json_buf_raw(b, "[]");
+    json_buf_printf(b, ",\"mutations\":[[\"%s\",\"%s\",%s]]}", column, mutator, value);
+}
+
+/* Update columns of one row; row is the JSON object of new values */
+static void op_update(json_buf_t *b, const char *table, const char *uuid, const char *row) {
+    op_sep(b);
+    json_buf_printf(b, "{\"op\":\"update\",\"table\":\"%s\","
+                       "\"where\":[[\"_uuid\",\"==\",[\"uuid\",\"%s\"]]],\"row\":%s}",
+                    table, uuid, row);
+}
+
+/* Replace other_config:hw-offload of the Open_vSwitch row */
+static void op_set_hw_offload(json_buf_t *b, bool enable) {
+    op_mutate(b, "Open_vSwitch", NULL, "other_config", "delete", "[\"set\",[\"hw-offload\"]]");
+    op_mutate(b, "Open_vSwitch", NULL, "other_config", "insert",
+              enable ? "[\"map\",[[\"hw-offload\",\"true\"]]]"
+                     : "[\"map\",[[\"hw-offload\",\"false\"]]]");
+}
+
+/* Whether a dpdk-extra token is one of the DMA engines */
+static bool dma_listed(const char *token, size_t len, const char *const *dma_devs,
+                       uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (strlen(dma_devs[i]) == len && strncmp(token, dma_devs[i], len) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Rewrite dpdk-extra without "-a <engine>" for the given engines, then
+ * append them again when enabling; other EAL arguments are kept.
+ */
+static void build_dpdk_extra(json_buf_t *out, const char *extra, bool enable,
+                             const char *const *dma_devs, uint32_t count) {
+    const char *p = extra ? extra : "";
+    while (*p) {
+        while (*p == ' ')
+            p++;
+        if (!*p)
+            break;
+        const char *tok = p;
+        while (*p && *p != ' ')
+            p++;
+        size_t len = (size_t)(p - tok);
+
+        if (len == 2 && strncmp(tok, "-a", 2) == 0) {
+            const char *arg = p;
+            while (*arg == ' ')
+                arg++;
+            const char *end = arg;
+            while (*end && *end != ' ')
+                end++;
+            if (end > arg && dma_listed(arg, (size_t)(end - arg), dma_devs, count)) {
+                p = end;
+                continue;
+            }
         }
+        json_buf_printf(out, "%s%.*s", out->len ? " " : "", (int)len, tok);
     }
 
-    int ret = pclose(fp);
-    return ret == 0 ? OVS_OK : OVS_ERR_OPENFLOW;
+    for (uint32_t i = 0; enable && i < count; i++)
+        json_buf_printf(out, "%s-a %s", out->len ? " " : "", dma_devs[i]);
+}
+
+static int transact(json_buf_t *ops) {
+    int ret = ovsdb_transact(ops, NULL);
+    json_buf_free(ops);
+    return ret;
 }
 
 /* ============================================================================
@@ -102,7 +405,7 @@ static int ovs_ofctl(const char *bridge, const char *cmd, char *output, size_t o
 
 int ovs_init(const char *ovsdb_socket) {
     if (ovs_state.initialized) {
-        set_error("OVS already initialized");
+        ovs_set_error("OVS already initialized");
         return OVS_ERR_INIT;
     }
 
@@ -116,17 +419,28 @@ int ovs_init(const char *ovsdb_socket) {
 
     /* Check if OVSDB is accessible */
     if (access(ovs_state.ovsdb_socket, F_OK) != 0) {
-        set_error("OVSDB socket not found: %s", ovs_state.ovsdb_socket);
+        ovs_set_error("OVSDB socket not found: %s", ovs_state.ovsdb_socket);
         return OVS_ERR_OVSDB;
     }
 
-    /* Clear state */
-    memset(bridges, 0, sizeof(bridges));
-    memset(ports, 0, sizeof(ports));
-    memset(flows, 0, sizeof(flows));
-    bridge_count = 0;
-    port_count = 0;
-    flow_count = 0;
+    /* One session for the library's lifetime; bridges and ports come from its cache */
+    int ret = ovsdb_open(ovs_state.ovsdb_socket);
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    /* Flow channels open per bridge on first use, next to the database */
+    char rundir[256];
+    snprintf(rundir, sizeof(rundir), "%s", ovs_state.ovsdb_socket);
+    char *slash = strrchr(rundir, '/');
+    if (slash) {
+        *slash = '\0';
+    } else {
+        snprintf(rundir, sizeof(rundir), ".");
+    }
+    of_init(rundir);
+    unixctl_init(rundir);
+    pmd_init();
 
     ovs_state.initialized = true;
     return OVS_OK;
@@ -135,23 +449,22 @@ int ovs_init(const char *ovsdb_socket) {
 void ovs_cleanup(void) {
     if (!ovs_state.initialized) return;
 
+    flow_diff_forget(NULL);
+    of_close(NULL);
+    ovsdb_close();
     memset(&ovs_state, 0, sizeof(ovs_state));
-    bridge_count = 0;
-    port_count = 0;
-    flow_count = 0;
 }
 
 bool ovs_available(void) {
-    return access("/usr/bin/ovs-vsctl", X_OK) == 0 ||
-           access("/usr/local/bin/ovs-vsctl", X_OK) == 0;
+    return access(ovs_state.initialized ? ovs_state.ovsdb_socket : DEFAULT_OVSDB_SOCKET,
+                  F_OK) == 0;
 }
 
 bool ovs_dpdk_available(void) {
-    char output[256] = {0};
-    if (ovs_vsctl("get Open_vSwitch . dpdk_initialized", output, sizeof(output)) != OVS_OK) {
+    if (!ovs_state.initialized || ovsdb_sync() != OVS_OK) {
         return false;
     }
-    return strstr(output, "true") != NULL;
+    return ovsdb_get_bool(ovsdb_next(OVSDB_OPEN_VSWITCH, NULL), "dpdk_initialized");
 }
 
 /* ============================================================================
@@ -160,59 +473,70 @@ bool ovs_dpdk_available(void) {
 
 int ovs_bridge_create(const ovs_bridge_config_t *config) {
     if (!ovs_state.initialized) {
-        set_error("OVS not initialized");
+        ovs_set_error("OVS not initialized");
         return OVS_ERR_NOT_INIT;
     }
 
     if (!config || !config->name[0]) {
-        set_error("Invalid bridge configuration");
+        ovs_set_error("Invalid bridge configuration");
         return OVS_ERR_INVALID;
     }
 
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
     /* Check if bridge already exists */
-    for (uint32_t i = 0; i < bridge_count; i++) {
-        if (strcmp(bridges[i].name, config->name) == 0) {
-            set_error("Bridge already exists: %s", config->name);
-            return OVS_ERR_EXISTS;
-        }
+    if (find_bridge(config->name)) {
+        ovs_set_error("Bridge already exists: %s", config->name);
+        return OVS_ERR_EXISTS;
     }
 
-    if (bridge_count >= MAX_BRIDGES) {
-        set_error("Maximum bridges reached");
-        return OVS_ERR_MEMORY;
+    /* The bridge, its local port, controller and fail mode commit together */
+    json_buf_t ops = {0};
+    ovs_port_config_t local = { .type = OVS_PORT_INTERNAL };
+    copy_string(local.name, sizeof(local.name), config->name);
+    op_insert_interface(&ops, &local, 0);
+    op_insert_port(&ops, &local, 0);
+
+    if (config->controller[0]) {
+        json_buf_raw(&ops, ",{\"op\":\"insert\",\"table\":\"Controller\","
+                           "\"uuid-name\":\"ctrl\",\"row\":{\"target\":");
+        json_buf_string(&ops, config->controller);
+        json_buf_raw(&ops, "}}");
     }
 
-    /* Build ovs-vsctl command */
-    char cmd[512];
+    json_buf_raw(&ops, ",{\"op\":\"insert\",\"table\":\"Bridge\",\"uuid-name\":\"br\","
+                       "\"row\":{\"name\":");
+    json_buf_string(&ops, config->name);
+    json_buf_raw(&ops, ",\"ports\":[\"named-uuid\",\"port0\"]");
     if (config->datapath_type[0]) {
-        snprintf(cmd, sizeof(cmd), "add-br %s -- set bridge %s datapath_type=%s",
-                 config->name, config->name, config->datapath_type);
-    } else {
-        snprintf(cmd, sizeof(cmd), "add-br %s", config->name);
+        json_buf_raw(&ops, ",\"datapath_type\":");
+        json_buf_string(&ops, config->datapath_type);
     }
-
-    int ret = ovs_vsctl(cmd, NULL, 0);
-    if (ret != OVS_OK) {
-        return ret;
+    if (config->fail_mode == 1) {
+        json_buf_raw(&ops, ",\"fail_mode\":\"secure\"");
+    }
+    if (config->stp_enabled) {
+        json_buf_raw(&ops, ",\"stp_enable\":true");
+    }
+    if (config->rstp_enabled) {
+        json_buf_raw(&ops, ",\"rstp_enable\":true");
     }
-
-    /* Set controller if specified */
     if (config->controller[0]) {
-        snprintf(cmd, sizeof(cmd), "set-controller %s %s",
-                 config->name, config->controller);
-        ovs_vsctl(cmd, NULL, 0);
+        json_buf_raw(&ops, ",\"controller\":[\"named-uuid\",\"ctrl\"]");
     }
+    json_buf_raw(&ops, "}}");
 
-    /* Set fail mode */
-    if (config->fail_mode == 1) {
-        snprintf(cmd, sizeof(cmd), "set-fail-mode %s secure", config->name);
-        ovs_vsctl(cmd, NULL, 0);
-    }
+    op_mutate(&ops, "Open_vSwitch", NULL, "bridges", "insert", "[\"named-uuid\",\"br\"]");
 
-    /* Store bridge config */
-    bridges[bridge_count++] = *config;
+    /* Never turns offload off: that would reach every other bridge */
+    if (config->hw_offload && !hw_offload_enabled()) {
+        op_set_hw_offload(&ops, true);
+    }
 
-    return OVS_OK;
+    return transact(&ops);
 }
 
 int ovs_bridge_delete(const char *name) {
@@ -224,36 +548,29 @@ int ovs_bridge_delete(const char *name) {
         return OVS_ERR_INVALID;
     }
 
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "del-br %s", name);
-
-    int ret = ovs_vsctl(cmd, NULL, 0);
+    int ret = ovsdb_sync();
     if (ret != OVS_OK) {
         return ret;
     }
 
-    /* Remove from storage */
-    for (uint32_t i = 0; i < bridge_count; i++) {
-        if (strcmp(bridges[i].name, name) == 0) {
-            memmove(&bridges[i], &bridges[i + 1],
-                    (bridge_count - i - 1) * sizeof(ovs_bridge_config_t));
-            bridge_count--;
-            break;
-        }
+    const ovsdb_row_t *br = find_bridge(name);
+    if (!br) {
+        ovs_set_error("Bridge not found: %s", name);
+        return OVS_ERR_NOT_FOUND;
     }
 
-    /* Remove associated ports */
-    for (uint32_t i = 0; i < port_count; ) {
-        if (strcmp(ports[i].bridge, name) == 0) {
-            memmove(&ports[i], &ports[i + 1],
-                    (port_count - i - 1) * sizeof(ovs_port_config_t));
-            port_count--;
-        } else {
-            i++;
-        }
-    }
+    /* Unreferenced bridges are garbage collected with their ports */
+    char value[64];
+    snprintf(value, sizeof(value), "[\"uuid\",\"%s\"]", br->uuid);
 
-    return OVS_OK;
+    json_buf_t ops = {0};
+    op_mutate(&ops, "Open_vSwitch", NULL, "bridges", "delete", value);
+    ret = transact(&ops);
+    if (ret == OVS_OK) {
+        flow_diff_forget(name);
+        of_close(name);
+    }
+    return ret;
 }
 
 int ovs_bridge_get(const char *name, ovs_bridge_config_t *config) {
@@ -265,14 +582,18 @@ int ovs_bridge_get(const char *name, ovs_bridge_config_t *config) {
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < bridge_count; i++) {
-        if (strcmp(bridges[i].name, name) == 0) {
-            *config = bridges[i];
-            return OVS_OK;
-        }
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    const ovsdb_row_t *br = find_bridge(name);
+    if (br) {
+        fill_bridge(br, config);
+        return OVS_OK;
     }
 
-    set_error("Bridge not found: %s", name);
+    ovs_set_error("Bridge not found: %s", name);
     return OVS_ERR_NOT_FOUND;
 }
 
@@ -285,8 +606,16 @@ int ovs_bridge_list(ovs_bridge_config_t *bridges_out, uint32_t max_bridges) {
         return OVS_ERR_INVALID;
     }
 
-    uint32_t count = bridge_count < max_bridges ? bridge_count : max_bridges;
-    memcpy(bridges_out, bridges, count * sizeof(ovs_bridge_config_t));
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    uint32_t count = 0;
+    for (const ovsdb_row_t *row = ovsdb_next(OVSDB_BRIDGE, NULL);
+         row && count < max_bridges; row = ovsdb_next(OVSDB_BRIDGE, row)) {
+        fill_bridge(row, &bridges_out[count++]);
+    }
 
     return (int)count;
 }
@@ -302,14 +631,90 @@ int ovs_bridge_get_stats(const char *name, ovs_bridge_stats_t *stats) {
 
     memset(stats, 0, sizeof(*stats));
 
-    /* In real implementation, aggregate port stats */
-    for (uint32_t i = 0; i < port_count; i++) {
-        if (strcmp(ports[i].bridge, name) == 0) {
-            /* Would read actual stats from kernel/DPDK */
+    /* In real implementation, aggregate port stats from kernel/DPDK */
+
+    return OVS_OK;
+}
+
+int ovs_hw_offload_set(bool enable) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    json_buf_t ops = {0};
+    op_set_hw_offload(&ops, enable);
+    return transact(&ops);
+}
+
+bool ovs_hw_offload_enabled(void) {
+    if (!ovs_state.initialized || ovsdb_sync() != OVS_OK) {
+        return false;
+    }
+    return hw_offload_enabled();
+}
+
+int ovs_vhost_async_set(bool enable, const char *const *dma_devs, uint32_t count) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
+
+    if (count > 0 && !dma_devs) {
+        return OVS_ERR_INVALID;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (!dma_devs[i] || !dma_devs[i][0] || strchr(dma_devs[i], ' ')) {
+            ovs_set_error("Invalid DMA device: %s", dma_devs[i] ? dma_devs[i] : "(null)");
+            return OVS_ERR_INVALID;
         }
     }
 
-    return OVS_OK;
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    json_buf_t extra = {0};
+    build_dpdk_extra(&extra, ovsdb_map_get(ovsdb_next(OVSDB_OPEN_VSWITCH, NULL),
+                                           "other_config", "dpdk-extra"),
+                     enable, dma_devs, count);
+
+    json_buf_t value = {0};
+    json_buf_printf(&value, "[\"map\",[[\"vhost-async-support\",\"%s\"]",
+                    enable ? "true" : "false");
+    if (extra.len > 0) {
+        json_buf_raw(&value, ",[\"dpdk-extra\",");
+        json_buf_string(&value, extra.data);
+        json_buf_raw(&value, "]");
+    }
+    json_buf_raw(&value, "]]");
+    bool failed = extra.failed || value.failed;
+    json_buf_free(&extra);
+
+    if (failed) {
+        json_buf_free(&value);
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    /* Replace the two keys, leaving the rest of other_config alone */
+    json_buf_t ops = {0};
+    op_mutate(&ops, "Open_vSwitch", NULL, "other_config", "delete",
+              "[\"set\",[\"vhost-async-support\",\"dpdk-extra\"]]");
+    op_mutate(&ops, "Open_vSwitch", NULL, "other_config", "insert", value.data);
+    json_buf_free(&value);
+    return transact(&ops);
+}
+
+bool ovs_vhost_async_enabled(void) {
+    if (!ovs_state.initialized || ovsdb_sync() != OVS_OK) {
+        return false;
+    }
+    return vhost_async_enabled();
 }
 
 int ovs_bridge_set_controller(const char *bridge, const char *controller) {
@@ -321,14 +726,30 @@ int ovs_bridge_set_controller(const char *bridge, const char *controller) {
         return OVS_ERR_INVALID;
     }
 
-    char cmd[512];
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    const ovsdb_row_t *br = find_bridge(bridge);
+    if (!br) {
+        ovs_set_error("Bridge not found: %s", bridge);
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    /* Replaced controllers are garbage collected */
+    json_buf_t ops = {0};
     if (controller && controller[0]) {
-        snprintf(cmd, sizeof(cmd), "set-controller %s %s", bridge, controller);
+        json_buf_raw(&ops, "{\"op\":\"insert\",\"table\":\"Controller\","
+                           "\"uuid-name\":\"ctrl\",\"row\":{\"target\":");
+        json_buf_string(&ops, controller);
+        json_buf_raw(&ops, "}}");
+        op_update(&ops, "Bridge", br->uuid, "{\"controller\":[\"named-uuid\",\"ctrl\"]}");
     } else {
-        snprintf(cmd, sizeof(cmd), "del-controller %s", bridge);
+        op_update(&ops, "Bridge", br->uuid, "{\"controller\":[\"set\",[]]}");
     }
 
-    return ovs_vsctl(cmd, NULL, 0);
+    return transact(&ops);
 }
 
 /* ============================================================================
@@ -336,103 +757,80 @@ int ovs_bridge_set_controller(const char *bridge, const char *controller) {
  * ============================================================================ */
 
 int ovs_port_add(const ovs_port_config_t *config) {
+    return ovs_port_add_batch(config, 1);
+}
+
+int ovs_port_add_batch(const ovs_port_config_t *configs, uint32_t count) {
     if (!ovs_state.initialized) {
         return OVS_ERR_NOT_INIT;
     }
 
-    if (!config || !config->name[0] || !config->bridge[0]) {
-        set_error("Invalid port configuration");
+    if (!configs || count == 0) {
+        ovs_set_error("Invalid port configuration");
         return OVS_ERR_INVALID;
     }
 
-    if (port_count >= MAX_PORTS) {
-        set_error("Maximum ports reached");
-        return OVS_ERR_MEMORY;
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
     }
 
-    /* Build ovs-vsctl command based on port type */
-    char cmd[1024];
-    const char *type_str = "";
+    for (uint32_t i = 0; i < count; i++) {
+        const ovs_port_config_t *config = &configs[i];
 
-    switch (config->type) {
-        case OVS_PORT_INTERNAL:
-            type_str = "internal";
-            break;
-        case OVS_PORT_VXLAN:
-            type_str = "vxlan";
-            break;
-        case OVS_PORT_GENEVE:
-            type_str = "geneve";
-            break;
-        case OVS_PORT_GRE:
-            type_str = "gre";
-            break;
-        case OVS_PORT_PATCH:
-            type_str = "patch";
-            break;
-        case OVS_PORT_DPDK:
-            type_str = "dpdk";
-            break;
-        case OVS_PORT_DPDKVHOSTUSER:
-            type_str = "dpdkvhostuser";
-            break;
-        case OVS_PORT_DPDKVHOSTUSERCLIENT:
-            type_str = "dpdkvhostuserclient";
-            break;
-        default:
-            type_str = "";
-    }
+        if (!config->name[0] || !config->bridge[0]) {
+            ovs_set_error("Invalid port configuration");
+            return OVS_ERR_INVALID;
+        }
 
-    if (config->type == OVS_PORT_VXLAN || config->type == OVS_PORT_GENEVE ||
-        config->type == OVS_PORT_GRE) {
-        /* Tunnel port */
-        snprintf(cmd, sizeof(cmd),
-                 "add-port %s %s -- set interface %s type=%s options:remote_ip=%s",
-                 config->bridge, config->name, config->name, type_str,
-                 config->tunnel.remote_ip);
+        if (!valid_affinity(config->rxq_affinity)) {
+            ovs_set_error("Invalid rxq affinity: %s", config->rxq_affinity);
+            return OVS_ERR_INVALID;
+        }
 
-        if (config->tunnel.key) {
-            char key_opt[64];
-            snprintf(key_opt, sizeof(key_opt), " options:key=%u", config->tunnel.key);
-            strncat(cmd, key_opt, sizeof(cmd) - strlen(cmd) - 1);
+        if (config->dpdk.representor &&
+            (config->type != OVS_PORT_DPDK || !config->dpdk.devargs[0] ||
+             strstr(config->dpdk.devargs, "representor="))) {
+            ovs_set_error("VF representor needs a DPDK port with the PF's devargs: %s",
+                          config->name);
+            return OVS_ERR_INVALID;
         }
-    } else if (config->type == OVS_PORT_DPDKVHOSTUSER ||
-               config->type == OVS_PORT_DPDKVHOSTUSERCLIENT) {
-        /* vhost-user port */
-        snprintf(cmd, sizeof(cmd),
-                 "add-port %s %s -- set interface %s type=%s options:vhost-server-path=%s",
-                 config->bridge, config->name, config->name, type_str,
-                 config->vhost.socket_path);
-    } else if (config->type == OVS_PORT_DPDK) {
-        /* DPDK physical port */
-        snprintf(cmd, sizeof(cmd),
-                 "add-port %s %s -- set interface %s type=dpdk options:dpdk-devargs=%s",
-                 config->bridge, config->name, config->name, config->dpdk.devargs);
-    } else if (type_str[0]) {
-        /* Other typed port */
-        snprintf(cmd, sizeof(cmd),
-                 "add-port %s %s -- set interface %s type=%s",
-                 config->bridge, config->name, config->name, type_str);
-    } else {
-        /* System port */
-        snprintf(cmd, sizeof(cmd), "add-port %s %s", config->bridge, config->name);
-    }
 
-    int ret = ovs_vsctl(cmd, NULL, 0);
-    if (ret != OVS_OK) {
-        return ret;
-    }
+        if (!find_bridge(config->bridge)) {
+            ovs_set_error("Bridge not found: %s", config->bridge);
+            return OVS_ERR_NOT_FOUND;
+        }
 
-    /* Set VLAN tag if specified */
-    if (config->tag > 0) {
-        snprintf(cmd, sizeof(cmd), "set port %s tag=%u", config->name, config->tag);
-        ovs_vsctl(cmd, NULL, 0);
+        if (port_name_taken(config->name)) {
+            ovs_set_error("Port already exists: %s", config->name);
+            return OVS_ERR_EXISTS;
+        }
     }
 
-    /* Store port config */
-    ports[port_count++] = *config;
+    /* Every port in one transaction: one round trip, all or nothing */
+    json_buf_t ops = {0};
+    for (uint32_t i = 0; i < count; i++) {
+        const ovs_port_config_t *config = &configs[i];
 
-    return OVS_OK;
+        bool waited = false;
+        for (uint32_t j = 0; j < i && !waited; j++) {
+            waited = strcmp(configs[j].bridge, config->bridge) == 0;
+        }
+        if (!waited) {
+            op_wait_bridge(&ops, config->bridge);
+        }
+
+        op_insert_interface(&ops, config, i);
+        op_insert_port(&ops, config, i);
+
+        op_sep(&ops);
+        json_buf_raw(&ops, "{\"op\":\"mutate\",\"table\":\"Bridge\",\"where\":[[\"name\",\"==\",");
+        json_buf_string(&ops, config->bridge);
+        json_buf_printf(&ops, "]],\"mutations\":[[\"ports\",\"insert\","
+                              "[\"named-uuid\",\"port%u\"]]]}", i);
+    }
+
+    return transact(&ops);
 }
 
 int ovs_port_delete(const char *bridge, const char *port) {
@@ -444,26 +842,25 @@ int ovs_port_delete(const char *bridge, const char *port) {
         return OVS_ERR_INVALID;
     }
 
-    char cmd[256];
-    snprintf(cmd, sizeof(cmd), "del-port %s %s", bridge, port);
-
-    int ret = ovs_vsctl(cmd, NULL, 0);
+    int ret = ovsdb_sync();
     if (ret != OVS_OK) {
         return ret;
     }
 
-    /* Remove from storage */
-    for (uint32_t i = 0; i < port_count; i++) {
-        if (strcmp(ports[i].bridge, bridge) == 0 &&
-            strcmp(ports[i].name, port) == 0) {
-            memmove(&ports[i], &ports[i + 1],
-                    (port_count - i - 1) * sizeof(ovs_port_config_t));
-            port_count--;
-            break;
-        }
+    const ovsdb_row_t *br = find_bridge(bridge);
+    const ovsdb_row_t *row = br ? find_port(br, port) : NULL;
+    if (!row) {
+        ovs_set_error("Port not found: %s/%s", bridge, port);
+        return OVS_ERR_NOT_FOUND;
     }
 
-    return OVS_OK;
+    /* The port and its interfaces go once the bridge drops them */
+    char value[64];
+    snprintf(value, sizeof(value), "[\"uuid\",\"%s\"]", row->uuid);
+
+    json_buf_t ops = {0};
+    op_mutate(&ops, "Bridge", br->uuid, "ports", "delete", value);
+    return transact(&ops);
 }
 
 int ovs_port_get(const char *bridge, const char *port, ovs_port_config_t *config) {
@@ -475,15 +872,19 @@ int ovs_port_get(const char *bridge, const char *port, ovs_port_config_t *config
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < port_count; i++) {
-        if (strcmp(ports[i].bridge, bridge) == 0 &&
-            strcmp(ports[i].name, port) == 0) {
-            *config = ports[i];
-            return OVS_OK;
-        }
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    const ovsdb_row_t *br = find_bridge(bridge);
+    const ovsdb_row_t *row = br ? find_port(br, port) : NULL;
+    if (row) {
+        fill_port(bridge, row, config);
+        return OVS_OK;
     }
 
-    set_error("Port not found: %s/%s", bridge, port);
+    ovs_set_error("Port not found: %s/%s", bridge, port);
     return OVS_ERR_NOT_FOUND;
 }
 
@@ -496,10 +897,18 @@ int ovs_port_list(const char *bridge, ovs_port_config_t *ports_out, uint32_t max
         return OVS_ERR_INVALID;
     }
 
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    const ovsdb_row_t *br = find_bridge(bridge);
+    size_t total = ovsdb_set_count(br, "ports");
     uint32_t count = 0;
-    for (uint32_t i = 0; i < port_count && count < max_ports; i++) {
-        if (strcmp(ports[i].bridge, bridge) == 0) {
-            ports_out[count++] = ports[i];
+    for (size_t i = 0; i < total && count < max_ports; i++) {
+        const ovsdb_row_t *row = bridge_port_at(br, i);
+        if (row) {
+            fill_port(bridge, row, &ports_out[count++]);
         }
     }
 
@@ -518,7 +927,7 @@ int ovs_port_get_stats(const char *bridge, const char *port, ovs_port_stats_t *s
     memset(stats, 0, sizeof(*stats));
     strncpy(stats->name, port, sizeof(stats->name) - 1);
 
-    /* In real implementation, read from ovs-vsctl or kernel */
+    /* In real implementation, read from the Interface statistics column or kernel */
 
     return OVS_OK;
 }
@@ -532,110 +941,237 @@ int ovs_port_set_vlan(const char *bridge, const char *port, uint16_t tag) {
         return OVS_ERR_INVALID;
     }
 
-    (void)bridge;  /* Not needed for ovs-vsctl */
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
 
-    char cmd[256];
+    const ovsdb_row_t *br = find_bridge(bridge);
+    const ovsdb_row_t *row = br ? find_port(br, port) : NULL;
+    if (!row) {
+        ovs_set_error("Port not found: %s/%s", bridge, port);
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    char value[32];
     if (tag > 0) {
-        snprintf(cmd, sizeof(cmd), "set port %s tag=%u", port, tag);
+        snprintf(value, sizeof(value), "{\"tag\":%u}", tag);
     } else {
-        snprintf(cmd, sizeof(cmd), "clear port %s tag", port);
+        snprintf(value, sizeof(value), "{\"tag\":[\"set\",[]]}");
     }
 
-    return ovs_vsctl(cmd, NULL, 0);
+    json_buf_t ops = {0};
+    op_update(&ops, "Port", row->uuid, value);
+    return transact(&ops);
 }
 
-/* ============================================================================
- * OpenFlow Management
- * ============================================================================ */
+int ovs_port_set_rxq_affinity(const char *bridge, const char *port, const char *affinity) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
 
-int ovs_flow_add(const char *bridge, const ovs_flow_t *flow) {
+    if (!bridge || !port) {
+        return OVS_ERR_INVALID;
+    }
+
+    if (affinity && (!valid_affinity(affinity) || strlen(affinity) >= 128)) {
+        ovs_set_error("Invalid rxq affinity: %s", affinity);
+        return OVS_ERR_INVALID;
+    }
+
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
+
+    const ovsdb_row_t *br = find_bridge(bridge);
+    const ovsdb_row_t *row = br ? find_port(br, port) : NULL;
+    const char *iface = row ? ovsdb_atom_uuid(ovsdb_set_at(row, "interfaces", 0)) : NULL;
+    if (!iface) {
+        ovs_set_error("Port not found: %s/%s", bridge, port);
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    /* Replace the one key, leaving the rest of other_config alone */
+    json_buf_t ops = {0};
+    op_mutate(&ops, "Interface", iface, "other_config", "delete",
+              "[\"set\",[\"pmd-rxq-affinity\"]]");
+    if (affinity && affinity[0]) {
+        char value[192];
+        snprintf(value, sizeof(value), "[\"map\",[[\"pmd-rxq-affinity\",\"%s\"]]]", affinity);
+        op_mutate(&ops, "Interface", iface, "other_config", "insert", value);
+    }
+    return transact(&ops);
+}
+
+#define MAX_CPUS 1024
+
+static void cpu_set(uint64_t *mask, unsigned long cpu) {
+    if (cpu < MAX_CPUS)
+        mask[cpu / 64] |= 1ULL << (cpu % 64);
+}
+
+/* Kernel cpulist format, e.g. "0-7,16-23" */
+static bool read_node_cpus(int node, uint64_t *mask) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+
+    char list[1024];
+    bool ok = fgets(list, sizeof(list), f) != NULL;
+    fclose(f);
+    if (!ok)
+        return false;
+
+    char *p = list;
+    while (*p >= '0' && *p <= '9') {
+        unsigned long first = strtoul(p, &p, 10);
+        unsigned long last = first;
+        if (*p == '-')
+            last = strtoul(p + 1, &p, 10);
+        for (unsigned long cpu = first; cpu <= last && cpu < MAX_CPUS; cpu++)
+            cpu_set(mask, cpu);
+        if (*p == ',')
+            p++;
+    }
+    return true;
+}
+
+int ovs_pmd_cpus(int numa_node, uint32_t *cpus, uint32_t max_cpus) {
     if (!ovs_state.initialized) {
         return OVS_ERR_NOT_INIT;
     }
 
-    if (!bridge || !flow) {
+    if (!cpus) {
         return OVS_ERR_INVALID;
     }
 
-    if (flow_count >= MAX_FLOWS) {
-        set_error("Maximum flows reached");
-        return OVS_ERR_MEMORY;
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
     }
 
-    /* Build flow match string */
-    char match[512] = "";
-    char *p = match;
-    size_t remaining = sizeof(match);
+    const char *hex = ovsdb_map_get(ovsdb_next(OVSDB_OPEN_VSWITCH, NULL),
+                                    "other_config", "pmd-cpu-mask");
+    if (!hex) {
+        ovs_set_error("pmd-cpu-mask not set");
+        return OVS_ERR_NOT_FOUND;
+    }
+    if (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))
+        hex += 2;
+
+    /* Least significant digit last */
+    uint64_t pmd[MAX_CPUS / 64] = {0};
+    size_t len = strlen(hex);
+    for (size_t i = 0; i < len; i++) {
+        char c = hex[len - 1 - i];
+        int digit = c >= '0' && c <= '9' ? c - '0' :
+                    c >= 'a' && c <= 'f' ? c - 'a' + 10 :
+                    c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+        if (digit < 0) {
+            ovs_set_error("Invalid pmd-cpu-mask: %s", hex);
+            return OVS_ERR_INVALID;
+        }
+        for (int bit = 0; bit < 4; bit++) {
+            if (digit & (1 << bit))
+                cpu_set(pmd, i * 4 + (size_t)bit);
+        }
+    }
 
-    if (flow->match.in_port) {
-        int n = snprintf(p, remaining, "in_port=%u,", flow->match.in_port);
-        p += n;
-        remaining -= n;
+    uint64_t node[MAX_CPUS / 64];
+    memset(node, 0xff, sizeof(node));
+    if (numa_node >= 0) {
+        memset(node, 0, sizeof(node));
+        if (!read_node_cpus(numa_node, node)) {
+            ovs_set_error("NUMA node not found: %d", numa_node);
+            return OVS_ERR_NOT_FOUND;
+        }
     }
 
-    if (flow->match.dl_type) {
-        int n = snprintf(p, remaining, "dl_type=0x%04x,", flow->match.dl_type);
-        p += n;
-        remaining -= n;
+    uint32_t count = 0;
+    for (uint32_t cpu = 0; cpu < MAX_CPUS && count < max_cpus; cpu++) {
+        if (pmd[cpu / 64] & node[cpu / 64] & (1ULL << (cpu % 64)))
+            cpus[count++] = cpu;
     }
+    return (int)count;
+}
+
+/* ============================================================================
+ * PMD Thread Management
+ * ============================================================================ */
 
-    if (flow->match.nw_src) {
-        int n = snprintf(p, remaining, "nw_src=0x%08x,", flow->match.nw_src);
-        p += n;
-        remaining -= n;
+int ovs_pmd_get_stats(ovs_pmd_stats_t *pmds, uint32_t max_pmds) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
     }
 
-    if (flow->match.nw_dst) {
-        int n = snprintf(p, remaining, "nw_dst=0x%08x,", flow->match.nw_dst);
-        p += n;
-        remaining -= n;
+    if (!pmds) {
+        return OVS_ERR_INVALID;
     }
 
-    /* Remove trailing comma */
-    if (p > match && *(p - 1) == ',') {
-        *(p - 1) = '\0';
+    return pmd_get_stats(pmds, max_pmds);
+}
+
+int ovs_pmd_get_rxqs(ovs_rxq_stats_t *rxqs, uint32_t max_rxqs) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
     }
 
-    /* Build actions string */
-    char actions[256] = "";
-    if (flow->actions.output_port) {
-        snprintf(actions, sizeof(actions), "output:%u", flow->actions.output_port);
-    } else if (flow->actions.goto_table) {
-        snprintf(actions, sizeof(actions), "goto_table:%u", flow->actions.goto_table);
-    } else {
-        strncpy(actions, "drop", sizeof(actions));
+    if (!rxqs) {
+        return OVS_ERR_INVALID;
     }
 
-    /* Build ovs-ofctl command */
-    char cmd[1024];
-    snprintf(cmd, sizeof(cmd),
-             "add-flow -OOpenFlow13 %s \"table=%u,priority=%u,%s,actions=%s\"",
-             bridge, flow->table_id, flow->priority,
-             match[0] ? match : "priority=0", actions);
+    return pmd_get_rxqs(rxqs, max_rxqs);
+}
 
-    /* Execute via shell since ovs-ofctl needs the bridge name directly */
-    char full_cmd[1200];
-    snprintf(full_cmd, sizeof(full_cmd), "ovs-ofctl %s 2>&1", cmd + 10); /* Skip "add-flow " */
+int ovs_pmd_rebalance(const ovs_pmd_rebalance_opts_t *opts, ovs_pmd_rebalance_result_t *result) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
 
-    FILE *fp = popen(full_cmd, "r");
-    if (!fp) {
-        set_error("Failed to execute ovs-ofctl");
-        return OVS_ERR_OPENFLOW;
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
     }
 
-    int ret = pclose(fp);
-    if (ret != 0) {
-        set_error("ovs-ofctl add-flow failed");
-        return OVS_ERR_OPENFLOW;
+    return pmd_rebalance(opts, result);
+}
+
+/* ============================================================================
+ * OpenFlow Management
+ * ============================================================================ */
+
+int ovs_flow_add(const char *bridge, const ovs_flow_t *flow) {
+    return ovs_flow_add_batch(bridge, flow, 1);
+}
+
+int ovs_flow_add_batch(const char *bridge, const ovs_flow_t *flows, uint32_t count) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
     }
 
-    /* Store flow */
-    strncpy(flows[flow_count].bridge, bridge, sizeof(flows[flow_count].bridge) - 1);
-    flows[flow_count].flow = *flow;
-    memset(&flows[flow_count].stats, 0, sizeof(ovs_flow_stats_t));
-    flow_count++;
+    if (!bridge || !flows || count == 0) {
+        return OVS_ERR_INVALID;
+    }
 
-    return OVS_OK;
+    of_flow_mod_t *mods = calloc(count, sizeof(*mods));
+    if (!mods) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        mods[i].command = OFPFC_ADD;
+        mods[i].flow = flows[i];
+        flow_diff_forget_overlapping(bridge, flows[i].table_id, flows[i].cookie, UINT64_MAX);
+    }
+
+    int ret = of_flow_bundle(bridge, mods, count);
+    free(mods);
+    return ret;
 }
 
 int ovs_flow_delete(const char *bridge, const ovs_flow_t *flow) {
@@ -647,11 +1183,16 @@ int ovs_flow_delete(const char *bridge, const ovs_flow_t *flow) {
         return OVS_ERR_INVALID;
     }
 
-    char cmd[512];
-    snprintf(cmd, sizeof(cmd), "del-flows -OOpenFlow13 %s \"table=%u,cookie=0x%lx/-1\"",
-             bridge, flow->table_id, flow->cookie);
+    /* Every flow in the table carrying the cookie */
+    of_flow_mod_t mod = {
+        .command = OFPFC_DELETE,
+        .match_all = true,
+        .cookie_mask = UINT64_MAX,
+        .flow = { .table_id = flow->table_id, .cookie = flow->cookie },
+    };
 
-    return ovs_ofctl(bridge, cmd, NULL, 0);
+    flow_diff_forget_overlapping(bridge, flow->table_id, flow->cookie, UINT64_MAX);
+    return of_flow_bundle(bridge, &mod, 1);
 }
 
 int ovs_flow_delete_all(const char *bridge, int table_id) {
@@ -663,65 +1204,111 @@ int ovs_flow_delete_all(const char *bridge, int table_id) {
         return OVS_ERR_INVALID;
     }
 
-    char cmd[256];
-    if (table_id >= 0) {
-        snprintf(cmd, sizeof(cmd), "del-flows -OOpenFlow13 %s table=%d", bridge, table_id);
+    of_flow_mod_t mod = {
+        .command = OFPFC_DELETE,
+        .all_tables = table_id < 0,
+        .match_all = true,
+        .flow = { .table_id = table_id < 0 ? 0 : (uint32_t)table_id },
+    };
+
+    if (table_id < 0) {
+        flow_diff_forget(bridge);
     } else {
-        snprintf(cmd, sizeof(cmd), "del-flows -OOpenFlow13 %s", bridge);
+        flow_diff_forget_overlapping(bridge, (uint32_t)table_id, 0, 0);
     }
+    return of_flow_bundle(bridge, &mod, 1);
+}
 
-    int ret = ovs_ofctl(bridge, cmd, NULL, 0);
+int ovs_flow_dump(const char *bridge, ovs_flow_t *flows_out, uint32_t max_flows) {
+    if (!ovs_state.initialized) {
+        return OVS_ERR_NOT_INIT;
+    }
 
-    /* Clear stored flows */
-    if (ret == OVS_OK) {
-        for (uint32_t i = 0; i < flow_count; ) {
-            if (strcmp(flows[i].bridge, bridge) == 0 &&
-                (table_id < 0 || flows[i].flow.table_id == (uint32_t)table_id)) {
-                memmove(&flows[i], &flows[i + 1],
-                        (flow_count - i - 1) * sizeof(flows[0]));
-                flow_count--;
-            } else {
-                i++;
-            }
-        }
+    if (!bridge || !flows_out) {
+        return OVS_ERR_INVALID;
     }
 
-    return ret;
+    of_flow_mod_t filter = { .all_tables = true, .match_all = true };
+    return of_flow_stats(bridge, &filter, flows_out, NULL, max_flows);
 }
 
-int ovs_flow_dump(const char *bridge, ovs_flow_t *flows_out, uint32_t max_flows) {
+/* Most flows one match can select that ovs_flow_get_stats() looks through */
+#define FLOW_STATS_CANDIDATES 64
+
+int ovs_flow_get_stats(const char *bridge, const ovs_flow_t *flow, ovs_flow_stats_t *stats) {
     if (!ovs_state.initialized) {
         return OVS_ERR_NOT_INIT;
     }
 
-    if (!bridge || !flows_out) {
+    if (!bridge || !flow || !stats) {
         return OVS_ERR_INVALID;
     }
 
-    uint32_t count = 0;
-    for (uint32_t i = 0; i < flow_count && count < max_flows; i++) {
-        if (strcmp(flows[i].bridge, bridge) == 0) {
-            flows_out[count++] = flows[i].flow;
+    memset(stats, 0, sizeof(*stats));
+
+    /* Stats requests match loosely; the flow is the one at its priority */
+    of_flow_mod_t filter = {
+        .cookie_mask = flow->cookie ? UINT64_MAX : 0,
+        .flow = *flow,
+    };
+
+    ovs_flow_t *found = calloc(FLOW_STATS_CANDIDATES, sizeof(*found));
+    ovs_flow_stats_t *found_stats = calloc(FLOW_STATS_CANDIDATES, sizeof(*found_stats));
+    int n = OVS_ERR_MEMORY;
+    if (found && found_stats) {
+        n = of_flow_stats(bridge, &filter, found, found_stats, FLOW_STATS_CANDIDATES);
+    } else {
+        ovs_set_error("Out of memory");
+    }
+
+    int ret = n < 0 ? n : OVS_ERR_NOT_FOUND;
+    for (int i = 0; i < n; i++) {
+        if (found[i].priority == flow->priority) {
+            *stats = found_stats[i];
+            ret = OVS_OK;
+            break;
         }
     }
+    if (ret == OVS_ERR_NOT_FOUND) {
+        ovs_set_error("Flow not found");
+    }
 
-    return (int)count;
+    if (ret == OVS_OK && (ret = ovsdb_sync()) == OVS_OK && hw_offload_enabled()) {
+        const ovsdb_row_t *br = find_bridge(bridge);
+        ret = offload_flow_status(bridge, ovsdb_get_string(br, "datapath_type"), flow, stats);
+    }
+
+    free(found);
+    free(found_stats);
+    return ret;
 }
 
-int ovs_flow_get_stats(const char *bridge, const ovs_flow_t *flow, ovs_flow_stats_t *stats) {
+int ovs_flow_reconcile(const char *bridge, uint32_t table_id, uint64_t cookie,
+                       uint64_t cookie_mask, const ovs_flow_t *flows, uint32_t count,
+                       ovs_flow_diff_t *diff) {
     if (!ovs_state.initialized) {
         return OVS_ERR_NOT_INIT;
     }
 
-    if (!bridge || !flow || !stats) {
+    if (!bridge || (!flows && count > 0)) {
         return OVS_ERR_INVALID;
     }
 
-    memset(stats, 0, sizeof(*stats));
+    int ret = ovsdb_sync();
+    if (ret != OVS_OK) {
+        return ret;
+    }
 
-    /* In real implementation, parse ovs-ofctl dump-flows output */
+    if (!find_bridge(bridge)) {
+        ovs_set_error("Bridge not found: %s", bridge);
+        return OVS_ERR_NOT_FOUND;
+    }
 
-    return OVS_OK;
+    return flow_diff_reconcile(bridge, table_id, cookie, cookie_mask, flows, count, diff);
+}
+
+void ovs_flow_reconcile_reset(const char *bridge) {
+    flow_diff_forget(bridge);
 }
 
 /* ============================================================================
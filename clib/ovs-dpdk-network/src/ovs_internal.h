@@ -0,0 +1,250 @@
+/**
+ * Zixiao Hypervisor - OVS Library Internals
+ *
+ * Declarations shared between the library translation units. Not installed.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#ifndef ZIXIAO_OVS_INTERNAL_H
+#define ZIXIAO_OVS_INTERNAL_H
+
+#include "ovs_bridge.h"
+#include "vhost_stats.h"
+#include <stddef.h>
+
+/* Record the message returned by ovs_get_last_error() */
+__attribute__((format(printf, 1, 2)))
+void ovs_set_error(const char *fmt, ...);
+
+/* ============================================================================
+ * JSON (json.c)
+ * ============================================================================ */
+
+typedef enum {
+    JSON_NULL = 0,
+    JSON_FALSE,
+    JSON_TRUE,
+    JSON_INTEGER,
+    JSON_REAL,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} json_type_t;
+
+/* Parsed value. Array elements and object members are a child list. */
+typedef struct json {
+    json_type_t type;
+    char *name;                 /* Member name when inside an object */
+    union {
+        int64_t integer;
+        double real;
+        char *string;
+    } u;
+    struct json *head;          /* First child */
+    struct json *tail;
+    struct json *next;          /* Next sibling */
+    size_t count;               /* Number of children */
+} json_t;
+
+/* Parse exactly one value; NULL on malformed input or out of memory */
+json_t *json_parse(const char *text, size_t len);
+void json_free(json_t *json);
+
+/* Move a value out of its parent, which keeps a null in its place */
+json_t *json_take(json_t *json);
+
+/* NULL when json is not an object/array or has no such member/element */
+json_t *json_member(const json_t *json, const char *name);
+json_t *json_index(const json_t *json, size_t index);
+const char *json_string(const json_t *json);
+
+/*
+ * Resumable scanner that finds where the first complete top-level value
+ * of a stream ends, so a receive buffer is scanned once however it is
+ * split between reads.
+ */
+typedef struct {
+    size_t pos;
+    int depth;
+    bool in_string;
+    bool escape;
+} json_scanner_t;
+
+/* Length of the first complete value, or 0 if more input is needed; -1 on garbage */
+long json_scan(json_scanner_t *s, const char *text, size_t len);
+
+/* Output buffer; a failed allocation sticks until json_buf_free() */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    bool failed;
+} json_buf_t;
+
+void json_buf_free(json_buf_t *b);
+void json_buf_raw(json_buf_t *b, const char *s);
+__attribute__((format(printf, 2, 3)))
+void json_buf_printf(json_buf_t *b, const char *fmt, ...);
+void json_buf_string(json_buf_t *b, const char *s);     /* Quoted and escaped */
+
+/* ============================================================================
+ * OVSDB client (ovsdb.c)
+ * ============================================================================ */
+
+#define OVSDB_DATABASE "Open_vSwitch"
+
+/* Monitored tables */
+typedef enum {
+    OVSDB_OPEN_VSWITCH = 0,
+    OVSDB_BRIDGE,
+    OVSDB_PORT,
+    OVSDB_INTERFACE,
+    OVSDB_CONTROLLER,
+    OVSDB_N_TABLES
+} ovsdb_table_t;
+
+/* Cached row: the monitored columns as the server last sent them */
+typedef struct ovsdb_row {
+    char uuid[40];
+    json_t *columns;            /* Object of column name to datum */
+    struct ovsdb_row *next;     /* Hash chain */
+} ovsdb_row_t;
+
+/* Connect to the server and start monitoring; the cache fills before return */
+int ovsdb_open(const char *path);
+void ovsdb_close(void);
+
+/*
+ * Apply pending monitor updates without blocking, reconnecting first if
+ * the session was lost.
+ */
+int ovsdb_sync(void);
+
+/*
+ * Run one transaction. ops holds the comma-separated operations. Fails
+ * with the first operation error; on success the cache already reflects
+ * the commit. If result is set it receives the result array, which the
+ * caller frees.
+ */
+int ovsdb_transact(const json_buf_t *ops, json_t **result);
+
+const ovsdb_row_t *ovsdb_find(ovsdb_table_t table, const char *uuid);
+const ovsdb_row_t *ovsdb_next(ovsdb_table_t table, const ovsdb_row_t *prev);
+
+/*
+ * Datum accessors. Scalars report absence (an empty optional) as NULL or
+ * false; sets may be sent as a bare atom when they hold one element.
+ */
+const char *ovsdb_get_string(const ovsdb_row_t *row, const char *column);
+bool ovsdb_get_integer(const ovsdb_row_t *row, const char *column, int64_t *value);
+bool ovsdb_get_bool(const ovsdb_row_t *row, const char *column);
+size_t ovsdb_set_count(const ovsdb_row_t *row, const char *column);
+const json_t *ovsdb_set_at(const ovsdb_row_t *row, const char *column, size_t index);
+const char *ovsdb_map_get(const ovsdb_row_t *row, const char *column, const char *key);
+
+/* UUID of a ["uuid", "..."] atom */
+const char *ovsdb_atom_uuid(const json_t *atom);
+
+/* ============================================================================
+ * OpenFlow channel (openflow.c)
+ * ============================================================================ */
+
+/* Flow-mod commands */
+#define OFPFC_ADD               0
+#define OFPFC_MODIFY            1
+#define OFPFC_MODIFY_STRICT     2
+#define OFPFC_DELETE            3
+#define OFPFC_DELETE_STRICT     4
+
+typedef struct {
+    uint8_t command;            /* OFPFC_* */
+    bool all_tables;            /* Ignore flow.table_id */
+    bool match_all;             /* Ignore flow.match */
+    uint64_t cookie_mask;       /* Cookie bits a modify, delete or dump must match */
+    ovs_flow_t flow;
+} of_flow_mod_t;
+
+/* Management sockets live in rundir; channels open on first use */
+void of_init(const char *rundir);
+
+/* Close one bridge's channel, or every channel when bridge is NULL */
+void of_close(const char *bridge);
+
+/* Apply flow-mods in order as one atomic bundle */
+int of_flow_bundle(const char *bridge, const of_flow_mod_t *mods, uint32_t count);
+
+/*
+ * Flow stats for the flows filter selects (non-strict). Stores up to max
+ * entries in flows and stats, either of which may be NULL, and returns
+ * the number stored.
+ */
+int of_flow_stats(const char *bridge, const of_flow_mod_t *filter,
+                  ovs_flow_t *flows, ovs_flow_stats_t *stats, uint32_t max);
+
+/* ============================================================================
+ * Flow reconciliation (flow_diff.c)
+ * ============================================================================ */
+
+/* Bring the scope's flows to desired with one bundle of the changes */
+int flow_diff_reconcile(const char *bridge, uint32_t table_id, uint64_t cookie,
+                        uint64_t cookie_mask, const ovs_flow_t *desired, uint32_t count,
+                        ovs_flow_diff_t *diff);
+
+/* Drop the views a flow change in the table and cookie range may have staled */
+void flow_diff_forget_overlapping(const char *bridge, uint32_t table_id,
+                                  uint64_t cookie, uint64_t cookie_mask);
+
+/* Drop one bridge's views, or every view when bridge is NULL */
+void flow_diff_forget(const char *bridge);
+
+/* ============================================================================
+ * unixctl client (unixctl.c)
+ * ============================================================================ */
+
+/* ovs-vswitchd's pid file and unixctl socket live in rundir */
+void unixctl_init(const char *rundir);
+
+/*
+ * Run one ovs-vswitchd command with the NULL-terminated args (args may be
+ * NULL). On success *text is the reply body, freed by the caller.
+ */
+int unixctl_call(const char *command, const char *const *args, char **text);
+
+/* ============================================================================
+ * PMD threads (pmd.c)
+ * ============================================================================ */
+
+void pmd_init(void);
+
+int pmd_get_stats(ovs_pmd_stats_t *pmds, uint32_t max);
+int pmd_get_rxqs(ovs_rxq_stats_t *rxqs, uint32_t max);
+
+/* Needs a synced OVSDB cache to find the interfaces it pins */
+int pmd_rebalance(const ovs_pmd_rebalance_opts_t *opts, ovs_pmd_rebalance_result_t *result);
+
+/* ============================================================================
+ * Hardware offload (offload.c)
+ * ============================================================================ */
+
+/*
+ * Fill the offload fields of stats from the datapath flows of the
+ * bridge's datapath that belong to flow. Needs a synced OVSDB cache to
+ * name the flow's in_port.
+ */
+int offload_flow_status(const char *bridge, const char *datapath_type,
+                        const ovs_flow_t *flow, ovs_flow_stats_t *stats);
+
+/* ============================================================================
+ * vhost-user statistics export (vhost_stats.c)
+ * ============================================================================ */
+
+/* Give the VM port a table slot; the collector fills it by port name */
+int vhost_stats_register(const char *vm_id, const char *port);
+void vhost_stats_unregister(const char *port);
+
+/* Copy of the port's entry; false until OVS has reported its counters */
+bool vhost_stats_lookup(const char *port, vhost_stats_entry_t *out);
+
+#endif /* ZIXIAO_OVS_INTERNAL_H */
@@ -0,0 +1,634 @@
+/**
+ * Zixiao Hypervisor - OVSDB JSON-RPC Client
+ *
+ * One long-lived session to ovsdb-server (RFC 7047). Writes are OVSDB
+ * transactions; reads come from a local cache of the Bridge, Port,
+ * Interface and Controller tables that a "monitor" keeps current. A lost
+ * session is reopened on the next call and the cache reloaded from the
+ * monitor's initial contents.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* How long a request may wait for its reply */
+#define OVSDB_TIMEOUT_MS 5000
+
+#define RX_CHUNK 65536
+#define CACHE_MIN_BUCKETS 64
+
+static const char *const table_names[OVSDB_N_TABLES] = {
+    [OVSDB_OPEN_VSWITCH] = "Open_vSwitch",
+    [OVSDB_BRIDGE]       = "Bridge",
+    [OVSDB_PORT]         = "Port",
+    [OVSDB_INTERFACE]    = "Interface",
+    [OVSDB_CONTROLLER]   = "Controller",
+};
+
+/* Columns the library reads; nothing else is sent to us */
+static const char *const monitor_columns =
+    "{\"Open_vSwitch\":{\"columns\":[\"bridges\",\"dpdk_initialized\",\"other_config\"]},"
+    "\"Bridge\":{\"columns\":[\"name\",\"datapath_type\",\"fail_mode\","
+        "\"stp_enable\",\"rstp_enable\",\"controller\",\"ports\"]},"
+    "\"Port\":{\"columns\":[\"name\",\"interfaces\",\"tag\",\"trunks\"]},"
+    "\"Interface\":{\"columns\":[\"name\",\"type\",\"options\",\"other_config\","
+        "\"ofport\"]},"
+    "\"Controller\":{\"columns\":[\"target\"]}}";
+
+typedef struct {
+    ovsdb_row_t **buckets;
+    uint32_t mask;
+    uint32_t count;
+} row_table_t;
+
+static struct {
+    char path[256];
+    int fd;
+    uint64_t next_id;
+    char *rx;                   /* Received, not yet dispatched */
+    size_t rx_len;
+    size_t rx_cap;
+    json_scanner_t scan;
+    row_table_t tables[OVSDB_N_TABLES];
+} db = { .fd = -1 };
+
+/* ============================================================================
+ * Row Cache
+ * ============================================================================ */
+
+static uint32_t uuid_hash(const char *uuid) {
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    while (*uuid) {
+        h ^= (uint8_t)*uuid++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void table_clear(row_table_t *t) {
+    for (uint32_t i = 0; t->buckets && i <= t->mask; i++) {
+        ovsdb_row_t *row = t->buckets[i];
+        while (row) {
+            ovsdb_row_t *next = row->next;
+            json_free(row->columns);
+            free(row);
+            row = next;
+        }
+    }
+    free(t->buckets);
+    memset(t, 0, sizeof(*t));
+}
+
+static bool table_grow(row_table_t *t) {
+    uint32_t nbuckets = t->buckets ? (t->mask + 1) * 2 : CACHE_MIN_BUCKETS;
+    ovsdb_row_t **buckets = calloc(nbuckets, sizeof(*buckets));
+    if (!buckets)
+        return false;
+
+    for (uint32_t i = 0; t->buckets && i <= t->mask; i++) {
+        ovsdb_row_t *row = t->buckets[i];
+        while (row) {
+            ovsdb_row_t *next = row->next;
+            uint32_t b = uuid_hash(row->uuid) & (nbuckets - 1);
+            row->next = buckets[b];
+            buckets[b] = row;
+            row = next;
+        }
+    }
+    free(t->buckets);
+    t->buckets = buckets;
+    t->mask = nbuckets - 1;
+    return true;
+}
+
+static ovsdb_row_t **table_slot(row_table_t *t, const char *uuid) {
+    ovsdb_row_t **slot = &t->buckets[uuid_hash(uuid) & t->mask];
+    while (*slot && strcmp((*slot)->uuid, uuid) != 0)
+        slot = &(*slot)->next;
+    return slot;
+}
+
+/* Takes ownership of columns; NULL columns deletes the row */
+static void table_apply(row_table_t *t, const char *uuid, json_t *columns) {
+    if (!t->buckets && (!columns || !table_grow(t))) {
+        json_free(columns);
+        return;
+    }
+
+    ovsdb_row_t **slot = table_slot(t, uuid);
+    ovsdb_row_t *row = *slot;
+
+    if (!columns) {
+        if (row) {
+            *slot = row->next;
+            json_free(row->columns);
+            free(row);
+            t->count--;
+        }
+        return;
+    }
+
+    if (row) {
+        json_free(row->columns);
+        row->columns = columns;
+        return;
+    }
+
+    row = calloc(1, sizeof(*row));
+    if (!row) {
+        json_free(columns);
+        return;
+    }
+    snprintf(row->uuid, sizeof(row->uuid), "%s", uuid);
+    row->columns = columns;
+    row->next = *slot;
+    *slot = row;
+
+    /* Keep chains short: grow at an average length of one */
+    if (++t->count > t->mask + 1)
+        table_grow(t);
+}
+
+/* Apply a <table-updates> object from a monitor reply or update notification */
+static void apply_updates(json_t *updates) {
+    if (!updates || updates->type != JSON_OBJECT)
+        return;
+
+    for (json_t *tu = updates->head; tu; tu = tu->next) {
+        int table = -1;
+        for (int i = 0; i < OVSDB_N_TABLES; i++) {
+            if (strcmp(tu->name, table_names[i]) == 0) {
+                table = i;
+                break;
+            }
+        }
+        if (table < 0 || tu->type != JSON_OBJECT)
+            continue;
+
+        for (json_t *ru = tu->head; ru; ru = ru->next) {
+            /* "new" carries every monitored column; no "new" means deleted */
+            json_t *new_row = json_member(ru, "new");
+            json_t *columns = NULL;
+            if (new_row) {
+                columns = json_take(new_row);
+                if (!columns)
+                    continue;
+            }
+            table_apply(&db.tables[table], ru->name, columns);
+        }
+    }
+}
+
+static void cache_clear(void) {
+    for (int i = 0; i < OVSDB_N_TABLES; i++)
+        table_clear(&db.tables[i]);
+}
+
+const ovsdb_row_t *ovsdb_find(ovsdb_table_t table, const char *uuid) {
+    row_table_t *t = &db.tables[table];
+    if (!uuid || !t->buckets)
+        return NULL;
+    return *table_slot(t, uuid);
+}
+
+const ovsdb_row_t *ovsdb_next(ovsdb_table_t table, const ovsdb_row_t *prev) {
+    row_table_t *t = &db.tables[table];
+    if (!t->buckets)
+        return NULL;
+    if (prev && prev->next)
+        return prev->next;
+
+    uint32_t b = prev ? (uuid_hash(prev->uuid) & t->mask) + 1 : 0;
+    for (; b <= t->mask; b++) {
+        if (t->buckets[b])
+            return t->buckets[b];
+    }
+    return NULL;
+}
+
+/* ============================================================================
+ * Datum Accessors
+ * ============================================================================ */
+
+static bool is_tagged(const json_t *datum, const char *tag) {
+    return datum && datum->type == JSON_ARRAY && datum->count == 2 &&
+           json_string(datum->head) && strcmp(datum->head->u.string, tag) == 0;
+}
+
+static const json_t *column(const ovsdb_row_t *row, const char *name) {
+    return row ? json_member(row->columns, name) : NULL;
+}
+
+/* An empty ["set", []] is how OVSDB writes an absent optional value */
+static const json_t *scalar(const ovsdb_row_t *row, const char *name) {
+    const json_t *datum = column(row, name);
+    if (is_tagged(datum, "set")) {
+        const json_t *elems = datum->head->next;
+        return elems->count == 1 ? elems->head : NULL;
+    }
+    return datum;
+}
+
+const char *ovsdb_get_string(const ovsdb_row_t *row, const char *name) {
+    return json_string(scalar(row, name));
+}
+
+bool ovsdb_get_integer(const ovsdb_row_t *row, const char *name, int64_t *value) {
+    const json_t *atom = scalar(row, name);
+    if (!atom || atom->type != JSON_INTEGER)
+        return false;
+    *value = atom->u.integer;
+    return true;
+}
+
+bool ovsdb_get_bool(const ovsdb_row_t *row, const char *name) {
+    const json_t *atom = scalar(row, name);
+    return atom && atom->type == JSON_TRUE;
+}
+
+size_t ovsdb_set_count(const ovsdb_row_t *row, const char *name) {
+    const json_t *datum = column(row, name);
+    if (!datum)
+        return 0;
+    return is_tagged(datum, "set") ? datum->head->next->count : 1;
+}
+
+const json_t *ovsdb_set_at(const ovsdb_row_t *row, const char *name, size_t index) {
+    const json_t *datum = column(row, name);
+    if (is_tagged(datum, "set"))
+        return json_index(datum->head->next, index);
+    return index == 0 ? datum : NULL;
+}
+
+const char *ovsdb_map_get(const ovsdb_row_t *row, const char *name, const char *key) {
+    const json_t *datum = column(row, name);
+    if (!is_tagged(datum, "map"))
+        return NULL;
+
+    for (const json_t *pair = datum->head->next->head; pair; pair = pair->next) {
+        const char *k = json_string(json_index(pair, 0));
+        if (k && strcmp(k, key) == 0)
+            return json_string(json_index(pair, 1));
+    }
+    return NULL;
+}
+
+const char *ovsdb_atom_uuid(const json_t *atom) {
+    return is_tagged(atom, "uuid") ? atom->head->next->u.string : NULL;
+}
+
+/* ============================================================================
+ * Session
+ * ============================================================================ */
+
+static void session_drop(void) {
+    if (db.fd >= 0)
+        close(db.fd);
+    db.fd = -1;
+    db.rx_len = 0;
+    memset(&db.scan, 0, sizeof(db.scan));
+}
+
+static int send_all(const char *data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(db.fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ovs_set_error("OVSDB send failed: %s", strerror(errno));
+            session_drop();
+            return OVS_ERR_OVSDB;
+        }
+        data += n;
+        len -= (size_t)n;
+    }
+    return OVS_OK;
+}
+
+/* Read what is available, waiting up to timeout_ms for the first byte */
+static int receive(int timeout_ms) {
+    struct pollfd pfd = { .fd = db.fd, .events = POLLIN };
+    int ret;
+    do {
+        ret = poll(&pfd, 1, timeout_ms);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        ovs_set_error("OVSDB poll failed: %s", strerror(errno));
+        session_drop();
+        return OVS_ERR_OVSDB;
+    }
+    if (ret == 0)
+        return 0;
+
+    if (db.rx_cap - db.rx_len < RX_CHUNK) {
+        char *rx = realloc(db.rx, db.rx_cap + RX_CHUNK);
+        if (!rx) {
+            ovs_set_error("Out of memory");
+            return OVS_ERR_MEMORY;
+        }
+        db.rx = rx;
+        db.rx_cap += RX_CHUNK;
+    }
+
+    ssize_t n = recv(db.fd, db.rx + db.rx_len, db.rx_cap - db.rx_len, MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+    if (n <= 0) {
+        ovs_set_error("OVSDB connection closed: %s", n ? strerror(errno) : "EOF");
+        session_drop();
+        return OVS_ERR_OVSDB;
+    }
+    db.rx_len += (size_t)n;
+    return (int)n;
+}
+
+/* Pop the next complete message off the receive buffer */
+static int next_message(json_t **msg) {
+    long len = json_scan(&db.scan, db.rx, db.rx_len);
+    *msg = NULL;
+    if (len == 0)
+        return OVS_OK;
+    if (len < 0) {
+        ovs_set_error("Malformed OVSDB message");
+        session_drop();
+        return OVS_ERR_OVSDB;
+    }
+
+    *msg = json_parse(db.rx, (size_t)len);
+    memmove(db.rx, db.rx + len, db.rx_len - (size_t)len);
+    db.rx_len -= (size_t)len;
+    if (!*msg) {
+        ovs_set_error("Malformed OVSDB message");
+        session_drop();
+        return OVS_ERR_OVSDB;
+    }
+    return OVS_OK;
+}
+
+static int send_request(const char *method, const char *params, uint64_t *id) {
+    json_buf_t b = {0};
+    *id = db.next_id++;
+    json_buf_printf(&b, "{\"method\":\"%s\",\"params\":%s,\"id\":%llu}",
+                    method, params, (unsigned long long)*id);
+    if (b.failed) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    int ret = send_all(b.data, b.len);
+    json_buf_free(&b);
+    return ret;
+}
+
+/* Serve a request or notification the server sent us */
+static int handle_server_message(json_t *msg, const char *method) {
+    json_t *params = json_member(msg, "params");
+
+    if (strcmp(method, "update") == 0) {
+        apply_updates(json_index(params, 1));
+        return OVS_OK;
+    }
+
+    if (strcmp(method, "echo") == 0) {
+        /* Inactivity probe; ovsdb-server sends no params worth echoing */
+        json_t *id = json_member(msg, "id");
+        if (!id || id->type != JSON_INTEGER)
+            return OVS_OK;
+
+        json_buf_t b = {0};
+        json_buf_printf(&b, "{\"id\":%lld,\"result\":[],\"error\":null}",
+                        (long long)id->u.integer);
+        int ret = b.failed ? OVS_ERR_MEMORY : send_all(b.data, b.len);
+        json_buf_free(&b);
+        return ret;
+    }
+    return OVS_OK;
+}
+
+/*
+ * Dispatch messages until the reply to id arrives, or only until the
+ * buffer runs dry when id is 0. The reply is returned to the caller.
+ */
+static int pump(uint64_t id, json_t **reply) {
+    for (;;) {
+        json_t *msg;
+        int ret = next_message(&msg);
+        if (ret != OVS_OK)
+            return ret;
+
+        if (!msg) {
+            ret = receive(id ? OVSDB_TIMEOUT_MS : 0);
+            if (ret < 0)
+                return ret;
+            if (ret == 0) {
+                if (!id)
+                    return OVS_OK;
+                ovs_set_error("OVSDB request timed out");
+                session_drop();
+                return OVS_ERR_OVSDB;
+            }
+            continue;
+        }
+
+        const char *method = json_string(json_member(msg, "method"));
+        json_t *msg_id = json_member(msg, "id");
+        if (method) {
+            ret = handle_server_message(msg, method);
+            json_free(msg);
+            if (ret != OVS_OK)
+                return ret;
+        } else if (id && msg_id && msg_id->type == JSON_INTEGER &&
+                   (uint64_t)msg_id->u.integer == id) {
+            *reply = msg;
+            return OVS_OK;
+        } else {
+            /* Reply to a request we gave up on */
+            json_free(msg);
+        }
+    }
+}
+
+static int call(const char *method, const char *params, json_t **result) {
+    uint64_t id;
+    json_t *reply = NULL;
+
+    int ret = send_request(method, params, &id);
+    if (ret == OVS_OK)
+        ret = pump(id, &reply);
+    if (ret != OVS_OK)
+        return ret;
+
+    json_t *error = json_member(reply, "error");
+    if (error && error->type != JSON_NULL) {
+        const char *what = json_string(error) ? json_string(error)
+                                              : json_string(json_member(error, "error"));
+        ovs_set_error("OVSDB %s failed: %s", method, what ? what : "unknown error");
+        json_free(reply);
+        return OVS_ERR_OVSDB;
+    }
+
+    if (result) {
+        json_t *res = json_member(reply, "result");
+        *result = res ? json_take(res) : NULL;
+        if (!*result) {
+            json_free(reply);
+            ovs_set_error("Out of memory");
+            return OVS_ERR_MEMORY;
+        }
+    }
+    json_free(reply);
+    return OVS_OK;
+}
+
+static int session_open(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(db.path) >= sizeof(addr.sun_path)) {
+        ovs_set_error("OVSDB socket path too long: %s", db.path);
+        return OVS_ERR_INVALID;
+    }
+    memcpy(addr.sun_path, db.path, strlen(db.path) + 1);
+
+    db.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (db.fd < 0) {
+        ovs_set_error("Failed to create OVSDB socket: %s", strerror(errno));
+        return OVS_ERR_OVSDB;
+    }
+    if (connect(db.fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ovs_set_error("Failed to connect to OVSDB at %s: %s", db.path, strerror(errno));
+        session_drop();
+        return OVS_ERR_OVSDB;
+    }
+
+    /* The reply carries the current contents of every monitored table */
+    char params[1024];
+    snprintf(params, sizeof(params), "[\"%s\",\"zixiao\",%s]", OVSDB_DATABASE, monitor_columns);
+
+    json_t *initial = NULL;
+    int ret = call("monitor", params, &initial);
+    if (ret != OVS_OK) {
+        session_drop();
+        return ret;
+    }
+
+    cache_clear();
+    apply_updates(initial);
+    json_free(initial);
+    return OVS_OK;
+}
+
+static int session_ensure(void) {
+    if (db.fd >= 0)
+        return OVS_OK;
+    if (!db.path[0]) {
+        ovs_set_error("OVSDB not connected");
+        return OVS_ERR_NOT_INIT;
+    }
+    return session_open();
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+int ovsdb_open(const char *path) {
+    ovsdb_close();
+    snprintf(db.path, sizeof(db.path), "%s", path);
+    db.next_id = 1;
+
+    int ret = session_open();
+    if (ret != OVS_OK)
+        db.path[0] = '\0';
+    return ret;
+}
+
+void ovsdb_close(void) {
+    session_drop();
+    cache_clear();
+    free(db.rx);
+    db.rx = NULL;
+    db.rx_cap = 0;
+    db.path[0] = '\0';
+}
+
+int ovsdb_sync(void) {
+    int ret = session_ensure();
+    if (ret != OVS_OK)
+        return ret;
+    return pump(0, NULL);
+}
+
+/* First error in a transaction result array, NULL if it committed */
+static const char *transact_error(const json_t *result, const char **details) {
+    for (const json_t *r = result ? result->head : NULL; r; r = r->next) {
+        const char *error = json_string(json_member(r, "error"));
+        if (error) {
+            *details = json_string(json_member(r, "details"));
+            return error;
+        }
+    }
+    return NULL;
+}
+
+int ovsdb_transact(const json_buf_t *ops, json_t **result) {
+    if (ops->failed) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    int ret = session_ensure();
+    if (ret != OVS_OK)
+        return ret;
+
+    json_buf_t params = {0};
+    json_buf_printf(&params, "[\"%s\",", OVSDB_DATABASE);
+    json_buf_raw(&params, ops->data ? ops->data : "");
+    json_buf_raw(&params, "]");
+    if (params.failed) {
+        json_buf_free(&params);
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    json_t *res = NULL;
+    ret = call("transact", params.data, &res);
+    json_buf_free(&params);
+    if (ret != OVS_OK)
+        return ret;
+
+    const char *details = NULL;
+    const char *error = transact_error(res, &details);
+    if (error) {
+        ovs_set_error("OVSDB transaction failed: %s%s%s", error,
+                      details ? ": " : "", details ? details : "");
+        json_free(res);
+        return OVS_ERR_OVSDB;
+    }
+
+    /*
+     * ovsdb-server flushes a commit's monitor updates before it reads the
+     * session's next request, so once an echo comes back the cache has
+     * caught up with this transaction.
+     */
+    ret = call("echo", "[]", NULL);
+    if (ret != OVS_OK) {
+        json_free(res);
+        return ret;
+    }
+
+    if (result)
+        *result = res;
+    else
+        json_free(res);
+    return OVS_OK;
+}
@@ -0,0 +1,362 @@
+/**
+ * Zixiao Hypervisor - PMD Thread Load
+ *
+ * PMD and rxq statistics read from ovs-vswitchd over unixctl, the same
+ * commands ovs-appctl runs: dpif-netdev/pmd-stats-show and
+ * dpif-netdev/pmd-rxq-show. Rebalancing assigns rxqs to PMD cores by
+ * their measured usage and pins them with other_config:pmd-rxq-affinity.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Most PMD threads and rxqs a rebalance considers */
+#define MAX_PMDS 128
+#define MAX_RXQS 1024
+
+/* Rebalance defaults, close to OVS's own pmd-auto-lb */
+#define DEFAULT_LOAD_THRESHOLD 70
+#define DEFAULT_IMPROVEMENT_THRESHOLD 25
+#define DEFAULT_INTERVAL_SEC 60
+
+static time_t last_rebalance;
+
+/* ============================================================================
+ * Parsing
+ * ============================================================================ */
+
+/* "pmd thread numa_id N core_id M:" starts each PMD's block */
+static bool parse_pmd_header(const char *line, uint32_t *numa_id, uint32_t *core_id) {
+    return sscanf(line, "pmd thread numa_id %u core_id %u:", numa_id, core_id) == 2;
+}
+
+/* Value after "key:" or "key :" when the trimmed line starts with key */
+static const char *field(const char *line, const char *key) {
+    while (*line == ' ' || *line == '\t')
+        line++;
+    size_t len = strlen(key);
+    if (strncmp(line, key, len) != 0)
+        return NULL;
+    line += len;
+    while (*line == ' ' || *line == '\t')
+        line++;
+    return *line == ':' ? line + 1 : NULL;
+}
+
+static int parse_pmd_stats(char *text, ovs_pmd_stats_t *pmds, uint32_t max) {
+    ovs_pmd_stats_t *pmd = NULL;
+    uint32_t count = 0;
+
+    for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+        uint32_t numa_id, core_id;
+        if (parse_pmd_header(line, &numa_id, &core_id)) {
+            pmd = count < max ? &pmds[count++] : NULL;
+            if (pmd) {
+                memset(pmd, 0, sizeof(*pmd));
+                pmd->numa_id = numa_id;
+                pmd->core_id = core_id;
+            }
+            continue;
+        }
+        if (line[0] != ' ' && line[0] != '\t') {
+            pmd = NULL;     /* "main thread:" and other non-PMD blocks */
+            continue;
+        }
+        if (!pmd)
+            continue;
+
+        const char *v;
+        if ((v = field(line, "packets received")))
+            pmd->packets = strtoull(v, NULL, 10);
+        else if ((v = field(line, "emc hits")))
+            pmd->emc_hits = strtoull(v, NULL, 10);
+        else if ((v = field(line, "smc hits")))
+            pmd->smc_hits = strtoull(v, NULL, 10);
+        else if ((v = field(line, "megaflow hits")))
+            pmd->megaflow_hits = strtoull(v, NULL, 10);
+        else if ((v = field(line, "miss with success upcall")))
+            pmd->upcalls = strtoull(v, NULL, 10);
+        else if ((v = field(line, "miss with failed upcall")))
+            pmd->lost = strtoull(v, NULL, 10);
+        else if ((v = field(line, "idle cycles")))
+            pmd->idle_cycles = strtoull(v, NULL, 10);
+        else if ((v = field(line, "processing cycles")))
+            pmd->busy_cycles = strtoull(v, NULL, 10);
+    }
+    return (int)count;
+}
+
+/* Fills rxqs and, when pmds is set, each PMD's isolation and summed usage */
+static int parse_rxqs(char *text, ovs_rxq_stats_t *rxqs, uint32_t max,
+                      ovs_pmd_stats_t *pmds, uint32_t npmds) {
+    uint32_t numa_id = 0, core_id = 0;
+    ovs_pmd_stats_t *pmd = NULL;
+    bool in_pmd = false;
+    uint32_t count = 0;
+
+    for (char *line = strtok(text, "\n"); line; line = strtok(NULL, "\n")) {
+        if (parse_pmd_header(line, &numa_id, &core_id)) {
+            in_pmd = true;
+            pmd = NULL;
+            for (uint32_t i = 0; i < npmds; i++) {
+                if (pmds[i].core_id == core_id)
+                    pmd = &pmds[i];
+            }
+            continue;
+        }
+        if (line[0] != ' ' && line[0] != '\t') {
+            in_pmd = false;
+            continue;
+        }
+        if (!in_pmd)
+            continue;
+
+        const char *v;
+        if ((v = field(line, "isolated"))) {
+            if (pmd)
+                pmd->isolated = strstr(v, "true") != NULL;
+            continue;
+        }
+
+        char port[64], state[16] = "enabled";
+        uint32_t queue_id;
+        if (sscanf(line, " port: %63s queue-id: %u (%15[^)])", port, &queue_id, state) < 2)
+            continue;
+
+        /* "pmd usage: NN %", or "NOT AVAIL" before the first interval ends */
+        uint32_t usage = 0;
+        const char *u = strstr(line, "usage:");
+        if (u)
+            usage = (uint32_t)strtoul(u + 6, NULL, 10);
+
+        if (pmd) {
+            pmd->rxq_count++;
+            pmd->usage += usage;
+        }
+        if (count < max && rxqs) {
+            ovs_rxq_stats_t *rxq = &rxqs[count];
+            memset(rxq, 0, sizeof(*rxq));
+            snprintf(rxq->port, sizeof(rxq->port), "%s", port);
+            rxq->queue_id = queue_id;
+            rxq->numa_id = numa_id;
+            rxq->core_id = core_id;
+            rxq->enabled = strcmp(state, "enabled") == 0;
+            rxq->usage = usage;
+        }
+        count++;
+    }
+    return (int)(count < max ? count : max);
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+void pmd_init(void) {
+    last_rebalance = 0;
+}
+
+int pmd_get_stats(ovs_pmd_stats_t *pmds, uint32_t max) {
+    char *text;
+    int ret = unixctl_call("dpif-netdev/pmd-stats-show", NULL, &text);
+    if (ret != OVS_OK)
+        return ret;
+    int n = parse_pmd_stats(text, pmds, max);
+    free(text);
+
+    ret = unixctl_call("dpif-netdev/pmd-rxq-show", NULL, &text);
+    if (ret != OVS_OK)
+        return ret;
+    parse_rxqs(text, NULL, 0, pmds, (uint32_t)n);
+    free(text);
+    return n;
+}
+
+int pmd_get_rxqs(ovs_rxq_stats_t *rxqs, uint32_t max) {
+    char *text;
+    int ret = unixctl_call("dpif-netdev/pmd-rxq-show", NULL, &text);
+    if (ret != OVS_OK)
+        return ret;
+    int n = parse_rxqs(text, rxqs, max, NULL, 0);
+    free(text);
+    return n;
+}
+
+static int by_usage_desc(const void *a, const void *b) {
+    const ovs_rxq_stats_t *x = *(const ovs_rxq_stats_t *const *)a;
+    const ovs_rxq_stats_t *y = *(const ovs_rxq_stats_t *const *)b;
+    return (x->usage < y->usage) - (x->usage > y->usage);
+}
+
+/* One update per interface whose rxqs moved, pinning all of its rxqs */
+static int apply_assignment(const ovs_rxq_stats_t *rxqs, const uint32_t *target, uint32_t n) {
+    json_buf_t ops = {0};
+    bool *done = calloc(n, sizeof(*done));
+    if (!done) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    int ret = OVS_OK;
+    for (uint32_t i = 0; i < n && ret == OVS_OK; i++) {
+        if (done[i])
+            continue;
+
+        bool moved = false;
+        for (uint32_t j = i; j < n; j++) {
+            if (strcmp(rxqs[j].port, rxqs[i].port) == 0 && target[j] != rxqs[j].core_id)
+                moved = true;
+        }
+
+        char affinity[1024];
+        size_t used = 0;
+        affinity[0] = '\0';
+        for (uint32_t j = i; j < n; j++) {
+            if (strcmp(rxqs[j].port, rxqs[i].port) != 0)
+                continue;
+            done[j] = true;
+            int w = snprintf(affinity + used, sizeof(affinity) - used, "%s%u:%u",
+                             used ? "," : "", rxqs[j].queue_id, target[j]);
+            if (w > 0 && (size_t)w < sizeof(affinity) - used)
+                used += (size_t)w;
+        }
+        if (!moved)
+            continue;
+
+        const ovsdb_row_t *iface = NULL;
+        for (const ovsdb_row_t *row = ovsdb_next(OVSDB_INTERFACE, NULL); row;
+             row = ovsdb_next(OVSDB_INTERFACE, row)) {
+            const char *name = ovsdb_get_string(row, "name");
+            if (name && strcmp(name, rxqs[i].port) == 0)
+                iface = row;
+        }
+        if (!iface) {
+            ovs_set_error("Interface not found: %s", rxqs[i].port);
+            ret = OVS_ERR_NOT_FOUND;
+            break;
+        }
+
+        if (ops.len > 0)
+            json_buf_raw(&ops, ",");
+        json_buf_printf(&ops, "{\"op\":\"mutate\",\"table\":\"Interface\","
+                              "\"where\":[[\"_uuid\",\"==\",[\"uuid\",\"%s\"]]],"
+                              "\"mutations\":[[\"other_config\",\"delete\","
+                              "[\"set\",[\"pmd-rxq-affinity\"]]],"
+                              "[\"other_config\",\"insert\","
+                              "[\"map\",[[\"pmd-rxq-affinity\",\"%s\"]]]]]}",
+                        iface->uuid, affinity);
+    }
+    free(done);
+
+    if (ret == OVS_OK && ops.len > 0)
+        ret = ovsdb_transact(&ops, NULL);
+    json_buf_free(&ops);
+    return ret;
+}
+
+int pmd_rebalance(const ovs_pmd_rebalance_opts_t *opts, ovs_pmd_rebalance_result_t *result) {
+    uint32_t load_threshold = opts && opts->load_threshold ? opts->load_threshold
+                                                           : DEFAULT_LOAD_THRESHOLD;
+    uint32_t improvement = opts && opts->improvement_threshold ? opts->improvement_threshold
+                                                               : DEFAULT_IMPROVEMENT_THRESHOLD;
+    uint32_t interval = opts && opts->interval_sec ? opts->interval_sec : DEFAULT_INTERVAL_SEC;
+    bool dry_run = opts && opts->dry_run;
+
+    ovs_pmd_rebalance_result_t res = {0};
+    ovs_pmd_stats_t *pmds = calloc(MAX_PMDS, sizeof(*pmds));
+    ovs_rxq_stats_t *rxqs = calloc(MAX_RXQS, sizeof(*rxqs));
+    ovs_rxq_stats_t **order = calloc(MAX_RXQS, sizeof(*order));
+    uint32_t *target = calloc(MAX_RXQS, sizeof(*target));
+    uint32_t *load = calloc(MAX_PMDS, sizeof(*load));
+    int ret = OVS_OK;
+
+    if (!pmds || !rxqs || !order || !target || !load) {
+        ovs_set_error("Out of memory");
+        ret = OVS_ERR_MEMORY;
+        goto out;
+    }
+
+    int npmds = pmd_get_stats(pmds, MAX_PMDS);
+    if (npmds < 0) {
+        ret = npmds;
+        goto out;
+    }
+    int nrxqs = pmd_get_rxqs(rxqs, MAX_RXQS);
+    if (nrxqs < 0) {
+        ret = nrxqs;
+        goto out;
+    }
+
+    for (int i = 0; i < npmds; i++) {
+        if (pmds[i].usage > res.max_load_before)
+            res.max_load_before = pmds[i].usage;
+    }
+
+    /*
+     * Longest-processing-time first: busiest rxq to the least loaded PMD
+     * on its NUMA node, staying put on ties so balanced queues don't move.
+     */
+    for (int i = 0; i < nrxqs; i++)
+        order[i] = &rxqs[i];
+    qsort(order, (size_t)nrxqs, sizeof(*order), by_usage_desc);
+
+    for (int k = 0; k < nrxqs; k++) {
+        ovs_rxq_stats_t *rxq = order[k];
+        int best = -1;
+        for (int i = 0; i < npmds; i++) {
+            if (pmds[i].numa_id != rxq->numa_id)
+                continue;
+            if (best < 0 || load[i] < load[best] ||
+                (load[i] == load[best] && pmds[i].core_id == rxq->core_id))
+                best = i;
+        }
+
+        size_t index = (size_t)(rxq - rxqs);
+        target[index] = best >= 0 ? pmds[best].core_id : rxq->core_id;
+        if (best >= 0)
+            load[best] += rxq->usage;
+        if (target[index] != rxq->core_id)
+            res.moved++;
+    }
+
+    for (int i = 0; i < npmds; i++) {
+        if (load[i] > res.max_load_after)
+            res.max_load_after = load[i];
+    }
+
+    /* Hysteresis: a hot PMD, a worthwhile gain, and time since the last move */
+    time_t now = time(NULL);
+    uint32_t gain = res.max_load_before > 0
+        ? (res.max_load_before - (res.max_load_after < res.max_load_before
+                                  ? res.max_load_after : res.max_load_before)) * 100 /
+          res.max_load_before
+        : 0;
+
+    if (res.moved == 0 || res.max_load_before < load_threshold || gain < improvement) {
+        res.moved = 0;
+    } else if (last_rebalance && now - last_rebalance < (time_t)interval) {
+        res.moved = 0;
+    } else if (!dry_run) {
+        ret = apply_assignment(rxqs, target, (uint32_t)nrxqs);
+        if (ret == OVS_OK) {
+            res.applied = true;
+            last_rebalance = now;
+        }
+    }
+
+out:
+    free(pmds);
+    free(rxqs);
+    free(order);
+    free(target);
+    free(load);
+    if (ret == OVS_OK && result)
+        *result = res;
+    return ret;
+}
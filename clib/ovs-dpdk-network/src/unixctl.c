@@ -0,0 +1,168 @@
+/**
+ * Zixiao Hypervisor - unixctl Client
+ *
+ * Runs ovs-vswitchd management commands over its unixctl socket
+ * (<rundir>/ovs-vswitchd.<pid>.ctl), the JSON-RPC channel ovs-appctl
+ * uses. One connection per command; replies are the command's text
+ * output.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#include "ovs_internal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define UNIXCTL_TIMEOUT_MS 5000
+#define UNIXCTL_MAX_REPLY (4 * 1024 * 1024)
+
+static char unixctl_rundir[256];
+
+void unixctl_init(const char *rundir) {
+    snprintf(unixctl_rundir, sizeof(unixctl_rundir), "%s", rundir);
+}
+
+static int unixctl_connect(void) {
+    char path[300];
+    snprintf(path, sizeof(path), "%s/ovs-vswitchd.pid", unixctl_rundir);
+
+    FILE *f = fopen(path, "r");
+    long pid = 0;
+    if (f) {
+        if (fscanf(f, "%ld", &pid) != 1)
+            pid = 0;
+        fclose(f);
+    }
+    if (pid <= 0) {
+        ovs_set_error("ovs-vswitchd not running: no pid in %s", path);
+        return OVS_ERR_UNIXCTL;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int n = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/ovs-vswitchd.%ld.ctl",
+                     unixctl_rundir, pid);
+    if (n < 0 || (size_t)n >= sizeof(addr.sun_path)) {
+        ovs_set_error("unixctl socket path too long");
+        return OVS_ERR_INVALID;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        ovs_set_error("Failed to connect to %s: %s", addr.sun_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return OVS_ERR_UNIXCTL;
+    }
+    return fd;
+}
+
+int unixctl_call(const char *command, const char *const *args, char **text) {
+    int fd = unixctl_connect();
+    if (fd < 0)
+        return fd;
+
+    json_buf_t request = {0};
+    json_buf_raw(&request, "{\"id\":0,\"method\":");
+    json_buf_string(&request, command);
+    json_buf_raw(&request, ",\"params\":[");
+    for (size_t i = 0; args && args[i]; i++) {
+        if (i > 0)
+            json_buf_raw(&request, ",");
+        json_buf_string(&request, args[i]);
+    }
+    json_buf_raw(&request, "]}");
+    if (request.failed) {
+        json_buf_free(&request);
+        close(fd);
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+
+    for (size_t off = 0; off < request.len;) {
+        ssize_t n = send(fd, request.data + off, request.len - off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            ovs_set_error("unixctl send failed: %s", strerror(errno));
+            json_buf_free(&request);
+            close(fd);
+            return OVS_ERR_UNIXCTL;
+        }
+        off += (size_t)n;
+    }
+    json_buf_free(&request);
+
+    json_scanner_t scan = {0};
+    size_t cap = 16384, used = 0;
+    char *rx = malloc(cap);
+    long end = 0;
+    int ret = rx ? OVS_OK : OVS_ERR_MEMORY;
+    if (!rx)
+        ovs_set_error("Out of memory");
+
+    while (ret == OVS_OK && end == 0) {
+        if (used == cap) {
+            char *bigger = cap < UNIXCTL_MAX_REPLY ? realloc(rx, cap * 2) : NULL;
+            if (!bigger) {
+                ovs_set_error("unixctl reply to %s too large", command);
+                ret = OVS_ERR_MEMORY;
+                break;
+            }
+            rx = bigger;
+            cap *= 2;
+        }
+
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        int p = poll(&pfd, 1, UNIXCTL_TIMEOUT_MS);
+        if (p < 0 && errno == EINTR)
+            continue;
+        ssize_t n = p > 0 ? recv(fd, rx + used, cap - used, 0) : -1;
+        if (n < 0 && p > 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ovs_set_error("unixctl %s: %s", command,
+                          p == 0 ? "timed out" : n == 0 ? "connection closed" : strerror(errno));
+            ret = OVS_ERR_UNIXCTL;
+            break;
+        }
+        used += (size_t)n;
+
+        end = json_scan(&scan, rx, used);
+        if (end < 0) {
+            ovs_set_error("unixctl %s: malformed reply", command);
+            ret = OVS_ERR_UNIXCTL;
+        }
+    }
+    close(fd);
+
+    json_t *reply = ret == OVS_OK ? json_parse(rx, (size_t)end) : NULL;
+    free(rx);
+    if (ret != OVS_OK)
+        return ret;
+
+    const char *result = json_string(json_member(reply, "result"));
+    const char *error = json_string(json_member(reply, "error"));
+    if (!result) {
+        ovs_set_error("unixctl %s failed: %s", command, error ? error : "malformed reply");
+        json_free(reply);
+        return OVS_ERR_UNIXCTL;
+    }
+
+    size_t len = strlen(result) + 1;
+    *text = malloc(len);
+    if (*text)
+        memcpy(*text, result, len);
+    json_free(reply);
+    if (!*text) {
+        ovs_set_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+    return OVS_OK;
+}
@@ -0,0 +1,523 @@
+/**
+ * Zixiao Hypervisor - vhost-user Statistics Export
+ *
+ * The collector thread holds its own OVSDB session, monitoring only the
+ * name and statistics of Interface rows: ovsdb-server pushes every
+ * refresh of every port's counters as one update, and the thread copies
+ * the VM ports' into the shared table. The table starts out in private
+ * memory so ports can register before export starts. Each port also
+ * gets a "vhost_port" block in the process metrics arena, when there is
+ * one, written alongside its entry.
+ *
+ * Copyright (C) 2024 Zixiao Team
+ * Licensed under Apache License 2.0
+ */
+
+#define _POSIX_C_SOURCE 200809L     /* clock_gettime */
+
+#include "ovs_internal.h"
+#include "vhost_stats.h"
+#include "zx_metrics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEFAULT_OVSDB_SOCKET "/var/run/openvswitch/db.sock"
+#define RECONNECT_MS 1000
+#define INDEX_BUCKETS 8192          /* Power of two, twice the capacity */
+#define NO_SLOT UINT32_MAX
+
+#define TABLE_SIZE (sizeof(vhost_stats_table_t) + \
+                    VHOST_STATS_MAX_ENTRIES * sizeof(vhost_stats_entry_t))
+
+static const char *const monitor_request =
+    "{\"id\":\"stats\",\"method\":\"monitor\",\"params\":[\"" OVSDB_DATABASE "\","
+    "\"zixiao-stats\",{\"Interface\":{\"columns\":[\"name\",\"statistics\"]}}]}";
+
+/* Metric fields, in the order of the counters in vhost_stats_entry_t */
+enum {
+    M_RX_PACKETS, M_TX_PACKETS, M_RX_BYTES, M_TX_BYTES,
+    M_RX_DROPPED, M_TX_DROPPED, M_RX_ERRORS, M_TX_ERRORS, M_FIELDS
+};
+
+static const zx_metrics_field_t metric_fields[M_FIELDS] = {
+    { .name = "rx_packets", .kind = ZX_METRICS_COUNTER },
+    { .name = "tx_packets", .kind = ZX_METRICS_COUNTER },
+    { .name = "rx_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "tx_bytes", .kind = ZX_METRICS_COUNTER },
+    { .name = "rx_dropped", .kind = ZX_METRICS_COUNTER },
+    { .name = "tx_dropped", .kind = ZX_METRICS_COUNTER },
+    { .name = "rx_errors", .kind = ZX_METRICS_COUNTER },
+    { .name = "tx_errors", .kind = ZX_METRICS_COUNTER },
+};
+
+static struct {
+    pthread_mutex_t lock;       /* Slots, index and entry writes */
+    vhost_stats_table_t *table;
+    bool shared;                /* table is the mapped object */
+    char shm_name[64];
+
+    /* Port name index, chained through next[] */
+    uint32_t head[INDEX_BUCKETS];
+    uint32_t next[VHOST_STATS_MAX_ENTRIES];
+    bool index_ready;
+
+    zx_metrics_block_t *metric[VHOST_STATS_MAX_ENTRIES];   /* NULL without an arena */
+
+    pthread_t thread;
+    bool running;
+    int wake[2];                /* Pipe that stops the collector */
+    char ovsdb_path[256];
+} stats = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = { -1, -1 } };
+
+/* ============================================================================
+ * Table
+ * ============================================================================ */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t name_bucket(const char *name) {
+    uint32_t h = 2166136261u;       /* FNV-1a */
+    for (; *name; name++) {
+        h ^= (uint8_t)*name;
+        h *= 16777619u;
+    }
+    return h & (INDEX_BUCKETS - 1);
+}
+
+static void table_init(vhost_stats_table_t *t) {
+    memset(t, 0, TABLE_SIZE);
+    t->magic = VHOST_STATS_MAGIC;
+    t->version = VHOST_STATS_VERSION;
+    t->entry_size = sizeof(vhost_stats_entry_t);
+    t->capacity = VHOST_STATS_MAX_ENTRIES;
+}
+
+/* Caller holds the lock */
+static bool table_ensure(void) {
+    if (stats.table)
+        return true;
+
+    stats.table = aligned_alloc(64, TABLE_SIZE);
+    if (!stats.table)
+        return false;
+    table_init(stats.table);
+
+    for (uint32_t i = 0; i < INDEX_BUCKETS; i++)
+        stats.head[i] = NO_SLOT;
+    stats.index_ready = true;
+    return true;
+}
+
+static uint32_t find_slot(const char *port) {
+    if (!stats.index_ready)
+        return NO_SLOT;
+    uint32_t slot = stats.head[name_bucket(port)];
+    while (slot != NO_SLOT && strcmp(stats.table->entries[slot].port, port) != 0)
+        slot = stats.next[slot];
+    return slot;
+}
+
+/* Seqlock writer side; writers are serialized by the lock */
+static void write_begin(vhost_stats_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(vhost_stats_entry_t *e) {
+    __atomic_store_n(&e->seq, e->seq + 1, __ATOMIC_RELEASE);
+}
+
+int vhost_stats_register(const char *vm_id, const char *port) {
+    pthread_mutex_lock(&stats.lock);
+    if (!table_ensure()) {
+        pthread_mutex_unlock(&stats.lock);
+        return OVS_ERR_MEMORY;
+    }
+
+    if (find_slot(port) != NO_SLOT) {
+        pthread_mutex_unlock(&stats.lock);
+        return OVS_OK;
+    }
+
+    uint32_t slot = 0;
+    while (slot < VHOST_STATS_MAX_ENTRIES && stats.table->entries[slot].flags)
+        slot++;
+    if (slot == VHOST_STATS_MAX_ENTRIES) {
+        pthread_mutex_unlock(&stats.lock);
+        return OVS_ERR_MEMORY;
+    }
+
+    vhost_stats_entry_t *e = &stats.table->entries[slot];
+    write_begin(e);
+    uint32_t seq = e->seq;
+    memset(e, 0, sizeof(*e));
+    e->seq = seq;
+    e->flags = VHOST_STATS_F_USED;
+    snprintf(e->vm_id, sizeof(e->vm_id), "%s", vm_id);
+    snprintf(e->port, sizeof(e->port), "%s", port);
+    write_end(e);
+
+    int type = zx_metrics_type_register("vhost_port", metric_fields, M_FIELDS);
+    if (type >= 0) {
+        char labels[ZX_METRICS_LABELS_LEN];
+        snprintf(labels, sizeof(labels), "vm=%s,port=%s", vm_id, port);
+        stats.metric[slot] = zx_metrics_block_add(type, labels);
+    }
+
+    uint32_t bucket = name_bucket(port);
+    stats.next[slot] = stats.head[bucket];
+    stats.head[bucket] = slot;
+    __atomic_add_fetch(&stats.table->generation, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&stats.lock);
+    return OVS_OK;
+}
+
+void vhost_stats_unregister(const char *port) {
+    pthread_mutex_lock(&stats.lock);
+    uint32_t slot = find_slot(port);
+    if (slot == NO_SLOT) {
+        pthread_mutex_unlock(&stats.lock);
+        return;
+    }
+
+    uint32_t *link = &stats.head[name_bucket(port)];
+    while (*link != slot)
+        link = &stats.next[*link];
+    *link = stats.next[slot];
+
+    vhost_stats_entry_t *e = &stats.table->entries[slot];
+    write_begin(e);
+    uint32_t seq = e->seq;
+    memset(e, 0, sizeof(*e));
+    e->seq = seq;
+    write_end(e);
+    __atomic_add_fetch(&stats.table->generation, 1, __ATOMIC_RELEASE);
+
+    zx_metrics_block_remove(stats.metric[slot]);
+    stats.metric[slot] = NULL;
+
+    pthread_mutex_unlock(&stats.lock);
+}
+
+bool vhost_stats_lookup(const char *port, vhost_stats_entry_t *out) {
+    pthread_mutex_lock(&stats.lock);
+    uint32_t slot = find_slot(port);
+    if (slot != NO_SLOT)
+        *out = stats.table->entries[slot];
+    pthread_mutex_unlock(&stats.lock);
+    return slot != NO_SLOT && (out->flags & VHOST_STATS_F_VALID);
+}
+
+/* ============================================================================
+ * Collector
+ * ============================================================================ */
+
+static uint64_t stat_value(const json_t *map, const char *key) {
+    /* ["map", [[key, value], ...]] */
+    const json_t *pairs = json_index(map, 1);
+    for (const json_t *pair = pairs ? pairs->head : NULL; pair; pair = pair->next) {
+        const char *k = json_string(json_index(pair, 0));
+        const json_t *v = json_index(pair, 1);
+        if (k && strcmp(k, key) == 0 && v && v->type == JSON_INTEGER && v->u.integer >= 0)
+            return (uint64_t)v->u.integer;
+    }
+    return 0;
+}
+
+static void apply_updates(const json_t *updates) {
+    const json_t *rows = json_member(updates, "Interface");
+    if (!rows || rows->type != JSON_OBJECT)
+        return;
+
+    uint64_t now = now_ns();
+    pthread_mutex_lock(&stats.lock);
+    for (const json_t *ru = rows->head; ru; ru = ru->next) {
+        /* "new" has every monitored column; deletions are unregistered by their owner */
+        const json_t *row = json_member(ru, "new");
+        const char *name = json_string(json_member(row, "name"));
+        const json_t *st = json_member(row, "statistics");
+        if (!name || !st)
+            continue;
+
+        uint32_t slot = find_slot(name);
+        if (slot == NO_SLOT)
+            continue;
+
+        vhost_stats_entry_t *e = &stats.table->entries[slot];
+        write_begin(e);
+        e->rx_packets = stat_value(st, "rx_packets");
+        e->tx_packets = stat_value(st, "tx_packets");
+        e->rx_bytes = stat_value(st, "rx_bytes");
+        e->tx_bytes = stat_value(st, "tx_bytes");
+        e->rx_dropped = stat_value(st, "rx_dropped");
+        e->tx_dropped = stat_value(st, "tx_dropped");
+        e->rx_errors = stat_value(st, "rx_errors");
+        e->tx_errors = stat_value(st, "tx_errors");
+        e->updated_ns = now;
+        e->flags |= VHOST_STATS_F_VALID;
+        write_end(e);
+
+        zx_metrics_block_t *m = stats.metric[slot];
+        if (m) {
+            zx_metrics_write_begin(m);
+            m->values[M_RX_PACKETS] = e->rx_packets;
+            m->values[M_TX_PACKETS] = e->tx_packets;
+            m->values[M_RX_BYTES] = e->rx_bytes;
+            m->values[M_TX_BYTES] = e->tx_bytes;
+            m->values[M_RX_DROPPED] = e->rx_dropped;
+            m->values[M_TX_DROPPED] = e->tx_dropped;
+            m->values[M_RX_ERRORS] = e->rx_errors;
+            m->values[M_TX_ERRORS] = e->tx_errors;
+            zx_metrics_write_end(m);
+        }
+    }
+    __atomic_store_n(&stats.table->updated_ns, now, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&stats.lock);
+}
+
+static bool send_text(int fd, const char *text, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, text, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        text += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* False when the session should be dropped */
+static bool handle_message(int fd, const json_t *msg) {
+    const json_t *id = json_member(msg, "id");
+    const char *method = json_string(json_member(msg, "method"));
+
+    if (!method) {
+        /* Reply to the monitor request: the initial contents */
+        if (json_string(id) && strcmp(json_string(id), "stats") == 0) {
+            const json_t *error = json_member(msg, "error");
+            if (error && error->type != JSON_NULL)
+                return false;
+            apply_updates(json_member(msg, "result"));
+        }
+        return true;
+    }
+
+    if (strcmp(method, "update") == 0) {
+        apply_updates(json_index(json_member(msg, "params"), 1));
+        return true;
+    }
+
+    if (strcmp(method, "echo") == 0 && id) {
+        json_buf_t b = {0};
+        if (id->type == JSON_INTEGER)
+            json_buf_printf(&b, "{\"id\":%lld,\"result\":[],\"error\":null}",
+                            (long long)id->u.integer);
+        else if (json_string(id)) {
+            json_buf_raw(&b, "{\"id\":");
+            json_buf_string(&b, json_string(id));
+            json_buf_raw(&b, ",\"result\":[],\"error\":null}");
+        }
+        bool ok = b.failed || !b.data || send_text(fd, b.data, b.len);
+        json_buf_free(&b);
+        return ok;
+    }
+    return true;
+}
+
+static int session_connect(void) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    memcpy(addr.sun_path, stats.ovsdb_path, strlen(stats.ovsdb_path) + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        !send_text(fd, monitor_request, strlen(monitor_request))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Follow one session until it drops or stop is requested; false on stop */
+static bool session_run(int fd) {
+    json_scanner_t scan = {0};
+    size_t cap = 65536, len = 0;
+    char *rx = malloc(cap);
+    bool keep_running = true;
+
+    __atomic_store_n(&stats.table->collector_connected, 1, __ATOMIC_RELEASE);
+    while (rx) {
+        struct pollfd pfd[2] = {
+            { .fd = fd, .events = POLLIN },
+            { .fd = stats.wake[0], .events = POLLIN },
+        };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents) {
+            keep_running = false;
+            break;
+        }
+
+        if (len == cap) {
+            char *bigger = realloc(rx, cap * 2);
+            if (!bigger)
+                break;
+            rx = bigger;
+            cap *= 2;
+        }
+        ssize_t n = recv(fd, rx + len, cap - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        len += (size_t)n;
+
+        /* Dispatch every complete message, keep the partial tail */
+        long end;
+        bool ok = true;
+        while (ok && (end = json_scan(&scan, rx, len)) > 0) {
+            json_t *msg = json_parse(rx, (size_t)end);
+            ok = msg && handle_message(fd, msg);
+            json_free(msg);
+            memmove(rx, rx + end, len - (size_t)end);
+            len -= (size_t)end;
+        }
+        if (!ok || end < 0)
+            break;
+    }
+    __atomic_store_n(&stats.table->collector_connected, 0, __ATOMIC_RELEASE);
+
+    free(rx);
+    return keep_running;
+}
+
+static void *collector_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        int fd = session_connect();
+        if (fd >= 0) {
+            bool keep_running = session_run(fd);
+            close(fd);
+            if (!keep_running)
+                return NULL;
+        }
+
+        /* Server restarting: wait, but wake at once for stop */
+        struct pollfd pfd = { .fd = stats.wake[0], .events = POLLIN };
+        if (poll(&pfd, 1, RECONNECT_MS) > 0)
+            return NULL;
+    }
+}
+
+/* ============================================================================
+ * Interface
+ * ============================================================================ */
+
+int vhost_stats_start(const char *shm_name, const char *ovsdb_socket) {
+    if (stats.running) {
+        return OVS_ERR_EXISTS;
+    }
+
+    snprintf(stats.shm_name, sizeof(stats.shm_name), "%s",
+             shm_name ? shm_name : VHOST_STATS_SHM_NAME);
+    snprintf(stats.ovsdb_path, sizeof(stats.ovsdb_path), "%s",
+             ovsdb_socket ? ovsdb_socket : DEFAULT_OVSDB_SOCKET);
+    if (strlen(stats.ovsdb_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        return OVS_ERR_INVALID;
+    }
+
+    int fd = shm_open(stats.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return OVS_ERR_INIT;
+    }
+    if (ftruncate(fd, (off_t)TABLE_SIZE) != 0) {
+        close(fd);
+        shm_unlink(stats.shm_name);
+        return OVS_ERR_MEMORY;
+    }
+    vhost_stats_table_t *shared = mmap(NULL, TABLE_SIZE, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        shm_unlink(stats.shm_name);
+        return OVS_ERR_MEMORY;
+    }
+
+    /* Ports registered so far move into the shared table */
+    pthread_mutex_lock(&stats.lock);
+    if (!table_ensure()) {
+        pthread_mutex_unlock(&stats.lock);
+        munmap(shared, TABLE_SIZE);
+        shm_unlink(stats.shm_name);
+        return OVS_ERR_MEMORY;
+    }
+    memcpy(shared, stats.table, TABLE_SIZE);
+    free(stats.table);
+    stats.table = shared;
+    stats.shared = true;
+    pthread_mutex_unlock(&stats.lock);
+
+    if (pipe(stats.wake) != 0) {
+        vhost_stats_stop();
+        return OVS_ERR_INIT;
+    }
+
+    stats.running = pthread_create(&stats.thread, NULL, collector_main, NULL) == 0;
+    if (!stats.running) {
+        vhost_stats_stop();
+        return OVS_ERR_INIT;
+    }
+    return OVS_OK;
+}
+
+void vhost_stats_stop(void) {
+    if (stats.running) {
+        ssize_t n = write(stats.wake[1], "x", 1);
+        (void)n;
+        pthread_join(stats.thread, NULL);
+        stats.running = false;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (stats.wake[i] >= 0)
+            close(stats.wake[i]);
+        stats.wake[i] = -1;
+    }
+
+    /* Registrations live on in private memory */
+    pthread_mutex_lock(&stats.lock);
+    if (stats.shared) {
+        vhost_stats_table_t *local = aligned_alloc(64, TABLE_SIZE);
+        if (local) {
+            memcpy(local, stats.table, TABLE_SIZE);
+            local->collector_connected = 0;
+        } else {
+            stats.index_ready = false;
+        }
+        munmap(stats.table, TABLE_SIZE);
+        shm_unlink(stats.shm_name);
+        stats.table = local;
+        stats.shared = false;
+    }
+    pthread_mutex_unlock(&stats.lock);
+}
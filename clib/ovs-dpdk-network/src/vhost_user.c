@@ -8,13 +8,16 @@
  * Licensed under Apache License 2.0
  */
 
+#define _POSIX_C_SOURCE 200809L
+
 #include "dpdk_port.h"
-#include "ovs_bridge.h"
+#include "ovs_internal.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -23,26 +26,49 @@
 /* vhost-user socket directory */
 #define VHOST_SOCKET_DIR "/var/run/zixiao/vhost"
 
-/* VM connection tracking */
-#define MAX_VM_CONNECTIONS 256
+/* Initial registry size; doubles past 3/4 load */
+#define VM_REGISTRY_MIN_BUCKETS 64
 
-typedef struct {
+/*
+ * VM connection tracking
+ *
+ * Connections live in a hash table keyed by VM ID. The table lock only
+ * covers finding, linking and unlinking entries; creating or destroying a
+ * port runs under the entry's own lock, so calls for different VMs
+ * proceed in parallel. An entry is freed when the registry and every
+ * lookup in flight have dropped their reference.
+ */
+typedef struct vm_vhost_connection {
     char vm_id[64];             /* VM identifier */
     char socket_path[256];      /* vhost-user socket path */
     uint16_t dpdk_port_id;      /* Associated DPDK port */
     char bridge[64];            /* OVS bridge name */
     char ovs_port[64];          /* OVS port name */
+    uint16_t queues;            /* Queue pairs */
     bool connected;             /* VM connection status */
     uint64_t rx_packets;        /* Received packets */
     uint64_t tx_packets;        /* Transmitted packets */
     uint64_t rx_bytes;          /* Received bytes */
     uint64_t tx_bytes;          /* Transmitted bytes */
+
+    pthread_mutex_t lock;       /* Held while the port is created or torn down */
+    uint32_t refs;              /* Registry link plus lookups (atomic) */
+    bool ready;                 /* Port created (atomic) */
+    bool removed;               /* Unlinked from the registry */
+    struct vm_vhost_connection *next;   /* Hash chain */
 } vm_vhost_connection_t;
 
-static vm_vhost_connection_t vm_connections[MAX_VM_CONNECTIONS];
-static uint32_t vm_connection_count = 0;
+static struct {
+    pthread_rwlock_t lock;
+    vm_vhost_connection_t **buckets;
+    uint32_t mask;              /* Bucket count - 1 */
+    uint32_t count;
+} vm_registry = { .lock = PTHREAD_RWLOCK_INITIALIZER };
 
-static char vhost_last_error[256] = {0};
+/* The OVS and DPDK layers are not thread-safe; their calls go one at a time */
+static pthread_mutex_t backend_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local char vhost_last_error[256] = {0};
 
 static void set_vhost_error(const char *fmt, ...) {
     va_list args;
@@ -97,61 +123,240 @@ static int ensure_socket_dir(void) {
     return 0;
 }
 
+/* ============================================================================
+ * Connection Registry
+ * ============================================================================ */
+
+static uint32_t vm_hash(const char *vm_id) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)vm_id; *p; p++) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+/* Caller holds the registry lock */
+static vm_vhost_connection_t *registry_find(const char *vm_id) {
+    if (!vm_registry.buckets) return NULL;
+
+    vm_vhost_connection_t *conn = vm_registry.buckets[vm_hash(vm_id) & vm_registry.mask];
+    while (conn && strcmp(conn->vm_id, vm_id) != 0) {
+        conn = conn->next;
+    }
+    return conn;
+}
+
+/* Caller holds the registry write lock */
+static int registry_grow(void) {
+    uint32_t size = vm_registry.buckets ? (vm_registry.mask + 1) * 2 : VM_REGISTRY_MIN_BUCKETS;
+    vm_vhost_connection_t **buckets = calloc(size, sizeof(*buckets));
+    if (!buckets) {
+        return OVS_ERR_MEMORY;
+    }
+
+    if (vm_registry.buckets) {
+        for (uint32_t i = 0; i <= vm_registry.mask; i++) {
+            vm_vhost_connection_t *conn = vm_registry.buckets[i];
+            while (conn) {
+                vm_vhost_connection_t *next = conn->next;
+                uint32_t b = vm_hash(conn->vm_id) & (size - 1);
+                conn->next = buckets[b];
+                buckets[b] = conn;
+                conn = next;
+            }
+        }
+        free(vm_registry.buckets);
+    }
+
+    vm_registry.buckets = buckets;
+    vm_registry.mask = size - 1;
+    return OVS_OK;
+}
+
+static void conn_put(vm_vhost_connection_t *conn) {
+    if (__atomic_sub_fetch(&conn->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        pthread_mutex_destroy(&conn->lock);
+        free(conn);
+    }
+}
+
+/*
+ * Look up a VM and lock its entry, waiting out a create or destroy in
+ * progress. NULL if the VM has no port (any more).
+ */
+static vm_vhost_connection_t *conn_acquire(const char *vm_id) {
+    pthread_rwlock_rdlock(&vm_registry.lock);
+    vm_vhost_connection_t *conn = registry_find(vm_id);
+    if (conn) {
+        __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&vm_registry.lock);
+
+    if (!conn) return NULL;
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->removed) {
+        pthread_mutex_unlock(&conn->lock);
+        conn_put(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+static void conn_release(vm_vhost_connection_t *conn) {
+    pthread_mutex_unlock(&conn->lock);
+    conn_put(conn);
+}
+
+/*
+ * Link a new, locked entry. If the VM is already registered, returns
+ * OVS_ERR_EXISTS with a reference to that entry in *existing.
+ */
+static int conn_insert(vm_vhost_connection_t *conn, vm_vhost_connection_t **existing) {
+    pthread_rwlock_wrlock(&vm_registry.lock);
+
+    vm_vhost_connection_t *found = registry_find(conn->vm_id);
+    if (found) {
+        __atomic_add_fetch(&found->refs, 1, __ATOMIC_RELAXED);
+        pthread_rwlock_unlock(&vm_registry.lock);
+        *existing = found;
+        return OVS_ERR_EXISTS;
+    }
+
+    if (!vm_registry.buckets ||
+        (uint64_t)(vm_registry.count + 1) * 4 > (uint64_t)(vm_registry.mask + 1) * 3) {
+        if (registry_grow() != OVS_OK && !vm_registry.buckets) {
+            pthread_rwlock_unlock(&vm_registry.lock);
+            return OVS_ERR_MEMORY;
+        }
+        /* A failed grow just leaves longer chains */
+    }
+
+    uint32_t b = vm_hash(conn->vm_id) & vm_registry.mask;
+    conn->next = vm_registry.buckets[b];
+    vm_registry.buckets[b] = conn;
+    vm_registry.count++;
+    __atomic_add_fetch(&conn->refs, 1, __ATOMIC_RELAXED);
+
+    pthread_rwlock_unlock(&vm_registry.lock);
+    return OVS_OK;
+}
+
+/* Unlink a locked entry; the caller still holds its own reference */
+static void conn_remove(vm_vhost_connection_t *conn) {
+    pthread_rwlock_wrlock(&vm_registry.lock);
+
+    vm_vhost_connection_t **pp = &vm_registry.buckets[vm_hash(conn->vm_id) & vm_registry.mask];
+    while (*pp && *pp != conn) {
+        pp = &(*pp)->next;
+    }
+    if (*pp) {
+        *pp = conn->next;
+        vm_registry.count--;
+    }
+    conn->next = NULL;
+    conn->removed = true;
+
+    pthread_rwlock_unlock(&vm_registry.lock);
+    conn_put(conn);
+}
+
 /* ============================================================================
  * VM vhost-user Connection Management
  * ============================================================================ */
 
 /**
- * Create vhost-user port for a VM
+ * Spread a port's receive queues over the PMD cores of a NUMA node
  *
- * @param vm_id Unique VM identifier
- * @param bridge OVS bridge to attach to
- * @param queues Number of queue pairs (0 for default)
- * @param socket_path Output socket path
- * @param path_len Socket path buffer length
- * @return 0 on success, negative error code on failure
+ * @param numa_node NUMA node of the VM's memory
+ * @param queues Number of queue pairs
+ * @param affinity Output pmd-rxq-affinity list
+ * @param len Output buffer length
+ * @return 0 on success
  */
-int vhost_create_vm_port(const char *vm_id, const char *bridge,
-                          uint16_t queues, char *socket_path, size_t path_len) {
-    if (!vm_id || !bridge) {
-        set_vhost_error("Invalid parameters");
-        return OVS_ERR_INVALID;
+static int build_rxq_affinity(int numa_node, uint16_t queues, char *affinity, size_t len) {
+    uint32_t cpus[128];
+    int ncpus = ovs_pmd_cpus(numa_node, cpus, 128);
+    if (ncpus < 0) {
+        set_vhost_error("Failed to list PMD cores: %s", ovs_get_last_error());
+        return ncpus;
+    }
+    if (ncpus == 0) {
+        set_vhost_error("No PMD cores on NUMA node %d", numa_node);
+        return OVS_ERR_NOT_FOUND;
     }
 
-    /* Check for existing connection */
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            if (socket_path && path_len > 0) {
-                strncpy(socket_path, vm_connections[i].socket_path, path_len - 1);
-            }
-            return OVS_OK;  /* Already exists */
+    size_t used = 0;
+    affinity[0] = '\0';
+    for (uint16_t q = 0; q < queues; q++) {
+        int n = snprintf(affinity + used, len - used, "%s%u:%u",
+                         q ? "," : "", q, cpus[q % ncpus]);
+        if (n < 0 || (size_t)n >= len - used) {
+            set_vhost_error("Too many queues to pin: %u", queues);
+            return OVS_ERR_INVALID;
         }
+        used += (size_t)n;
     }
+    return OVS_OK;
+}
 
-    if (vm_connection_count >= MAX_VM_CONNECTIONS) {
-        set_vhost_error("Maximum VM connections reached");
-        return OVS_ERR_MEMORY;
+/**
+ * Give every PMD core a DMA channel on its own NUMA node
+ *
+ * Cores that already hold one keep it. Caller holds backend_lock.
+ *
+ * @return Number of cores with a channel, or negative error code
+ */
+static int assign_dma_channels(void) {
+    uint32_t cpus[128];
+    int ncpus = ovs_pmd_cpus(-1, cpus, 128);
+    if (ncpus < 0) {
+        set_vhost_error("Failed to list PMD cores: %s", ovs_get_last_error());
+        return ncpus;
     }
 
-    /* Ensure socket directory exists */
-    if (ensure_socket_dir() != 0) {
-        return OVS_ERR_INIT;
+    int assigned = 0;
+    for (int node = 0; node < DPDK_MAX_SOCKETS && ncpus > 0; node++) {
+        int n = ovs_pmd_cpus(node, cpus, 128);
+        for (int i = 0; i < n; i++) {
+            if (dpdk_dma_assign(cpus[i], node) >= 0) {
+                assigned++;
+            }
+        }
+        if (n > 0) {
+            ncpus -= n;
+        }
     }
 
-    /* Generate socket path */
-    char sock_path[256];
-    snprintf(sock_path, sizeof(sock_path), "%s/%s.sock", VHOST_SOCKET_DIR, vm_id);
+    if (assigned == 0) {
+        set_vhost_error("No DMA channels for PMD cores: %s", dpdk_get_last_error());
+        return OVS_ERR_NOT_FOUND;
+    }
+    return assigned;
+}
 
+/* Create the DPDK and OVS ports of a registered entry; caller holds backend_lock */
+static int create_ports(vm_vhost_connection_t *conn, uint16_t queues, int numa_node,
+                        bool async_copy) {
     /* Create DPDK vhost-user port */
     dpdk_vhost_config_t vhost_config = {
         .server_mode = true,
         .reconnect = true,
         .reconnect_time = 1000,
         .queues = queues > 0 ? queues : 1,
+        .numa_node = numa_node,
         .linear_buffers = false,
-        .packed_ring = false
+        .packed_ring = false,
+        .async_copy = async_copy
     };
-    strncpy(vhost_config.socket_path, sock_path, sizeof(vhost_config.socket_path) - 1);
+    snprintf(vhost_config.socket_path, sizeof(vhost_config.socket_path), "%s", conn->socket_path);
+
+    if (async_copy) {
+        int ret = assign_dma_channels();
+        if (ret < 0) {
+            return ret;
+        }
+    }
 
     int port_id = dpdk_vhost_create(&vhost_config);
     if (port_id < 0) {
@@ -159,45 +364,190 @@ int vhost_create_vm_port(const char *vm_id, const char *bridge,
         return port_id;
     }
 
-    /* Generate OVS port name */
-    char ovs_port_name[64];
-    snprintf(ovs_port_name, sizeof(ovs_port_name), "vhost-%s", vm_id);
-
     /* Add port to OVS bridge */
     ovs_port_config_t ovs_config = {
         .type = OVS_PORT_DPDKVHOSTUSER
     };
-    strncpy(ovs_config.name, ovs_port_name, sizeof(ovs_config.name) - 1);
-    strncpy(ovs_config.bridge, bridge, sizeof(ovs_config.bridge) - 1);
-    strncpy(ovs_config.vhost.socket_path, sock_path, sizeof(ovs_config.vhost.socket_path) - 1);
+    snprintf(ovs_config.name, sizeof(ovs_config.name), "%s", conn->ovs_port);
+    snprintf(ovs_config.bridge, sizeof(ovs_config.bridge), "%s", conn->bridge);
+    snprintf(ovs_config.vhost.socket_path, sizeof(ovs_config.vhost.socket_path), "%s",
+             conn->socket_path);
     ovs_config.vhost.server_mode = true;
+    ovs_config.vhost.async_copy = async_copy;
+
+    int ret;
+    if (numa_node >= 0) {
+        ret = build_rxq_affinity(numa_node, vhost_config.queues,
+                                 ovs_config.rxq_affinity, sizeof(ovs_config.rxq_affinity));
+        if (ret != OVS_OK) {
+            dpdk_vhost_destroy(port_id);
+            return ret;
+        }
+    }
 
-    int ret = ovs_port_add(&ovs_config);
+    ret = ovs_port_add(&ovs_config);
     if (ret != OVS_OK) {
         dpdk_vhost_destroy(port_id);
         set_vhost_error("Failed to add OVS port: %s", ovs_get_last_error());
         return ret;
     }
 
-    /* Store connection info */
-    vm_vhost_connection_t *conn = &vm_connections[vm_connection_count++];
-    strncpy(conn->vm_id, vm_id, sizeof(conn->vm_id) - 1);
-    strncpy(conn->socket_path, sock_path, sizeof(conn->socket_path) - 1);
-    strncpy(conn->bridge, bridge, sizeof(conn->bridge) - 1);
-    strncpy(conn->ovs_port, ovs_port_name, sizeof(conn->ovs_port) - 1);
     conn->dpdk_port_id = port_id;
+    conn->queues = vhost_config.queues;
     conn->connected = false;
 
     /* Start the DPDK port */
     dpdk_port_start(port_id);
+    return OVS_OK;
+}
+
+/* Register a VM and create its ports, or report the ones it already has */
+static int create_vm_port(const char *vm_id, const char *bridge, uint16_t queues,
+                          int numa_node, bool async_copy, char *socket_path, size_t path_len) {
+    if (!vm_id || !bridge) {
+        set_vhost_error("Invalid parameters");
+        return OVS_ERR_INVALID;
+    }
+
+    /* Check for existing connection */
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (conn) {
+        if (socket_path && path_len > 0) {
+            strncpy(socket_path, conn->socket_path, path_len - 1);
+        }
+        conn_release(conn);
+        return OVS_OK;  /* Already exists */
+    }
+
+    /* Ensure socket directory exists */
+    if (ensure_socket_dir() != 0) {
+        return OVS_ERR_INIT;
+    }
+
+    conn = calloc(1, sizeof(*conn));
+    if (!conn) {
+        set_vhost_error("Out of memory");
+        return OVS_ERR_MEMORY;
+    }
+    strncpy(conn->vm_id, vm_id, sizeof(conn->vm_id) - 1);
+    strncpy(conn->bridge, bridge, sizeof(conn->bridge) - 1);
+    snprintf(conn->socket_path, sizeof(conn->socket_path), "%s/%s.sock", VHOST_SOCKET_DIR, vm_id);
+    snprintf(conn->ovs_port, sizeof(conn->ovs_port), "vhost-%s", vm_id);
+    pthread_mutex_init(&conn->lock, NULL);
+    pthread_mutex_lock(&conn->lock);
+    conn->refs = 1;
+
+    /* Reserve the VM ID; lookups wait on conn->lock until the ports exist */
+    for (;;) {
+        vm_vhost_connection_t *existing;
+        int ret = conn_insert(conn, &existing);
+        if (ret == OVS_OK) break;
+
+        if (ret == OVS_ERR_EXISTS) {
+            /* Lost a race with another create; take its outcome */
+            pthread_mutex_lock(&existing->lock);
+            bool removed = existing->removed;
+            if (!removed && socket_path && path_len > 0) {
+                strncpy(socket_path, existing->socket_path, path_len - 1);
+            }
+            conn_release(existing);
+            if (removed) continue;
+            ret = OVS_OK;
+        } else {
+            set_vhost_error("Out of memory");
+        }
+
+        pthread_mutex_unlock(&conn->lock);
+        conn_put(conn);
+        return ret;
+    }
+
+    pthread_mutex_lock(&backend_lock);
+    int ret = create_ports(conn, queues, numa_node, async_copy);
+    pthread_mutex_unlock(&backend_lock);
+
+    if (ret != OVS_OK) {
+        conn_remove(conn);
+        conn_release(conn);
+        return ret;
+    }
+
+    /* Exported once OVS reports the port's counters */
+    vhost_stats_register(vm_id, conn->ovs_port);
 
     if (socket_path && path_len > 0) {
-        strncpy(socket_path, sock_path, path_len - 1);
+        strncpy(socket_path, conn->socket_path, path_len - 1);
     }
 
+    __atomic_store_n(&conn->ready, true, __ATOMIC_RELEASE);
+    conn_release(conn);
     return OVS_OK;
 }
 
+/**
+ * Create multi-queue vhost-user port for a VM with NUMA-local PMD pinning
+ *
+ * Receive queues are pinned round-robin to the PMD cores on numa_node,
+ * so a VM's queues are polled by cores local to its memory and spread
+ * across them.
+ *
+ * Safe to call from several threads. A call for a VM whose port is being
+ * created waits for that create and then reports its socket path.
+ *
+ * @param vm_id Unique VM identifier
+ * @param bridge OVS bridge to attach to
+ * @param queues Number of queue pairs (0 for default)
+ * @param numa_node NUMA node to pin rxqs to (-1 to let OVS assign)
+ * @param socket_path Output socket path
+ * @param path_len Socket path buffer length
+ * @return 0 on success, negative error code on failure
+ */
+int vhost_create_vm_port_numa(const char *vm_id, const char *bridge, uint16_t queues,
+                              int numa_node, char *socket_path, size_t path_len) {
+    return create_vm_port(vm_id, bridge, queues, numa_node, false, socket_path, path_len);
+}
+
+/**
+ * Create vhost-user port for a VM with DMA-offloaded enqueue
+ *
+ * As vhost_create_vm_port_numa(), but packets switched to the VM are
+ * copied into guest memory by the DMA channel of the sending PMD core,
+ * leaving the core's cycles for switching. Suits VMs moving bulk
+ * traffic in large packets; small packets are cheaper to copy in
+ * software. Every PMD core is given a channel on its own NUMA node
+ * first; cores left without one still copy in software.
+ *
+ * Needs the async data path enabled in OVS (vhost_async_configure()).
+ *
+ * @param vm_id Unique VM identifier
+ * @param bridge OVS bridge to attach to
+ * @param queues Number of queue pairs (0 for default)
+ * @param numa_node NUMA node to pin rxqs to (-1 to let OVS assign)
+ * @param socket_path Output socket path
+ * @param path_len Socket path buffer length
+ * @return 0 on success, OVS_ERR_NOT_FOUND if no PMD core has a DMA
+ *         channel, other negative error code on failure
+ */
+int vhost_create_vm_port_async(const char *vm_id, const char *bridge, uint16_t queues,
+                               int numa_node, char *socket_path, size_t path_len) {
+    return create_vm_port(vm_id, bridge, queues, numa_node, true, socket_path, path_len);
+}
+
+/**
+ * Create vhost-user port for a VM
+ *
+ * @param vm_id Unique VM identifier
+ * @param bridge OVS bridge to attach to
+ * @param queues Number of queue pairs (0 for default)
+ * @param socket_path Output socket path
+ * @param path_len Socket path buffer length
+ * @return 0 on success, negative error code on failure
+ */
+int vhost_create_vm_port(const char *vm_id, const char *bridge,
+                          uint16_t queues, char *socket_path, size_t path_len) {
+    return vhost_create_vm_port_numa(vm_id, bridge, queues, -1, socket_path, path_len);
+}
+
 /**
  * Destroy vhost-user port for a VM
  *
@@ -209,30 +559,30 @@ int vhost_destroy_vm_port(const char *vm_id) {
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            vm_vhost_connection_t *conn = &vm_connections[i];
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        set_vhost_error("VM connection not found: %s", vm_id);
+        return OVS_ERR_NOT_FOUND;
+    }
 
-            /* Remove OVS port */
-            ovs_port_delete(conn->bridge, conn->ovs_port);
+    /* Remove from registry; callers already waiting see it gone */
+    conn_remove(conn);
 
-            /* Destroy DPDK port */
-            dpdk_vhost_destroy(conn->dpdk_port_id);
+    /* Remove OVS port */
+    vhost_stats_unregister(conn->ovs_port);
 
-            /* Remove socket file */
-            unlink(conn->socket_path);
+    pthread_mutex_lock(&backend_lock);
+    ovs_port_delete(conn->bridge, conn->ovs_port);
 
-            /* Remove from list */
-            memmove(&vm_connections[i], &vm_connections[i + 1],
-                    (vm_connection_count - i - 1) * sizeof(vm_vhost_connection_t));
-            vm_connection_count--;
+    /* Destroy DPDK port */
+    dpdk_vhost_destroy(conn->dpdk_port_id);
+    pthread_mutex_unlock(&backend_lock);
 
-            return OVS_OK;
-        }
-    }
+    /* Remove socket file */
+    unlink(conn->socket_path);
 
-    set_vhost_error("VM connection not found: %s", vm_id);
-    return OVS_ERR_NOT_FOUND;
+    conn_release(conn);
+    return OVS_OK;
 }
 
 /**
@@ -248,15 +598,15 @@ int vhost_get_socket_path(const char *vm_id, char *socket_path, size_t path_len)
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            strncpy(socket_path, vm_connections[i].socket_path, path_len - 1);
-            socket_path[path_len - 1] = '\0';
-            return OVS_OK;
-        }
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        return OVS_ERR_NOT_FOUND;
     }
 
-    return OVS_ERR_NOT_FOUND;
+    strncpy(socket_path, conn->socket_path, path_len - 1);
+    socket_path[path_len - 1] = '\0';
+    conn_release(conn);
+    return OVS_OK;
 }
 
 /**
@@ -268,14 +618,18 @@ int vhost_get_socket_path(const char *vm_id, char *socket_path, size_t path_len)
 bool vhost_is_vm_connected(const char *vm_id) {
     if (!vm_id) return false;
 
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            /* Check DPDK port connection status */
-            return dpdk_vhost_is_connected(vm_connections[i].dpdk_port_id);
-        }
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        return false;
     }
 
-    return false;
+    /* Check DPDK port connection status */
+    pthread_mutex_lock(&backend_lock);
+    bool connected = dpdk_vhost_is_connected(conn->dpdk_port_id);
+    pthread_mutex_unlock(&backend_lock);
+
+    conn_release(conn);
+    return connected;
 }
 
 /**
@@ -295,26 +649,43 @@ int vhost_get_vm_stats(const char *vm_id,
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            dpdk_port_stats_t stats;
-            if (dpdk_port_get_stats(vm_connections[i].dpdk_port_id, &stats) == OVS_OK) {
-                if (rx_packets) *rx_packets = stats.ipackets;
-                if (tx_packets) *tx_packets = stats.opackets;
-                if (rx_bytes) *rx_bytes = stats.ibytes;
-                if (tx_bytes) *tx_bytes = stats.obytes;
-                return OVS_OK;
-            }
-            return OVS_ERR_DPDK;
-        }
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        return OVS_ERR_NOT_FOUND;
     }
 
-    return OVS_ERR_NOT_FOUND;
+    /* OVS interface counters, when the collector has them */
+    vhost_stats_entry_t entry;
+    if (vhost_stats_lookup(conn->ovs_port, &entry)) {
+        conn_release(conn);
+        if (rx_packets) *rx_packets = entry.rx_packets;
+        if (tx_packets) *tx_packets = entry.tx_packets;
+        if (rx_bytes) *rx_bytes = entry.rx_bytes;
+        if (tx_bytes) *tx_bytes = entry.tx_bytes;
+        return OVS_OK;
+    }
+
+    dpdk_port_stats_t stats;
+    pthread_mutex_lock(&backend_lock);
+    int ret = dpdk_port_get_stats(conn->dpdk_port_id, &stats);
+    pthread_mutex_unlock(&backend_lock);
+    conn_release(conn);
+
+    if (ret == OVS_OK) {
+        if (rx_packets) *rx_packets = stats.ipackets;
+        if (tx_packets) *tx_packets = stats.opackets;
+        if (rx_bytes) *rx_bytes = stats.ibytes;
+        if (tx_bytes) *tx_bytes = stats.obytes;
+        return OVS_OK;
+    }
+    return OVS_ERR_DPDK;
 }
 
 /**
  * List all VM vhost-user connections
  *
+ * Ports still being created are left out.
+ *
  * @param vm_ids Output array of VM IDs
  * @param max_vms Maximum VMs to return
  * @return Number of VMs
@@ -324,11 +695,17 @@ int vhost_list_vm_connections(char (*vm_ids)[64], uint32_t max_vms) {
         return OVS_ERR_INVALID;
     }
 
-    uint32_t count = vm_connection_count < max_vms ? vm_connection_count : max_vms;
-    for (uint32_t i = 0; i < count; i++) {
-        strncpy(vm_ids[i], vm_connections[i].vm_id, 63);
-        vm_ids[i][63] = '\0';
+    uint32_t count = 0;
+    pthread_rwlock_rdlock(&vm_registry.lock);
+    for (uint32_t b = 0; vm_registry.buckets && b <= vm_registry.mask && count < max_vms; b++) {
+        for (vm_vhost_connection_t *conn = vm_registry.buckets[b];
+             conn && count < max_vms; conn = conn->next) {
+            if (!__atomic_load_n(&conn->ready, __ATOMIC_ACQUIRE)) continue;
+            snprintf(vm_ids[count], sizeof(vm_ids[count]), "%s", conn->vm_id);
+            count++;
+        }
     }
+    pthread_rwlock_unlock(&vm_registry.lock);
 
     return (int)count;
 }
@@ -345,20 +722,63 @@ int vhost_set_vm_vlan(const char *vm_id, uint16_t vlan_id) {
         return OVS_ERR_INVALID;
     }
 
-    for (uint32_t i = 0; i < vm_connection_count; i++) {
-        if (strcmp(vm_connections[i].vm_id, vm_id) == 0) {
-            return ovs_port_set_vlan(vm_connections[i].bridge,
-                                     vm_connections[i].ovs_port, vlan_id);
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        return OVS_ERR_NOT_FOUND;
+    }
+
+    pthread_mutex_lock(&backend_lock);
+    int ret = ovs_port_set_vlan(conn->bridge, conn->ovs_port, vlan_id);
+    pthread_mutex_unlock(&backend_lock);
+
+    conn_release(conn);
+    return ret;
+}
+
+/**
+ * Enable or disable DMA-offloaded vhost in OVS
+ *
+ * Hands OVS every DSA and IOAT engine bound to vfio-pci or UIO, for
+ * vhost_create_vm_port_async() ports. Takes effect when ovs-vswitchd
+ * restarts; ports already running keep copying in software until then.
+ *
+ * @param enable true for async vhost
+ * @return 0 on success, OVS_ERR_NOT_FOUND if enabling with no bound
+ *         engine on the host
+ */
+int vhost_async_configure(bool enable) {
+    dpdk_dma_info_t devs[DPDK_MAX_DMA_DEVS];
+    const char *addrs[DPDK_MAX_DMA_DEVS];
+    uint32_t count = 0;
+
+    pthread_mutex_lock(&backend_lock);
+    int n = dpdk_dma_list(devs, DPDK_MAX_DMA_DEVS);
+    for (int i = 0; i < n; i++) {
+        if (devs[i].bound) {
+            addrs[count++] = devs[i].pci_addr;
         }
     }
 
-    return OVS_ERR_NOT_FOUND;
+    int ret;
+    if (enable && count == 0) {
+        set_vhost_error("No DMA engines bound to vfio-pci or UIO");
+        ret = OVS_ERR_NOT_FOUND;
+    } else {
+        ret = ovs_vhost_async_set(enable, addrs, count);
+        if (ret != OVS_OK) {
+            set_vhost_error("Failed to set vhost async support: %s", ovs_get_last_error());
+        }
+    }
+    pthread_mutex_unlock(&backend_lock);
+    return ret;
 }
 
 /**
  * Get last vhost error message
  *
- * @return Static error string
+ * Errors are kept per thread.
+ *
+ * @return Error string of the calling thread's last failure
  */
 const char *vhost_get_last_error(void) {
     return vhost_last_error[0] ? vhost_last_error : "No error";
@@ -371,6 +791,9 @@ const char *vhost_get_last_error(void) {
 /**
  * Generate QEMU vhost-user netdev argument
  *
+ * Multi-queue ports get queues=N; pair with vhost_qemu_device_arg()
+ * given the same queue count.
+ *
  * @param vm_id VM identifier
  * @param netdev_id QEMU netdev ID
  * @param buf Output buffer
@@ -383,16 +806,25 @@ int vhost_qemu_netdev_arg(const char *vm_id, const char *netdev_id,
         return OVS_ERR_INVALID;
     }
 
+    vm_vhost_connection_t *conn = conn_acquire(vm_id);
+    if (!conn) {
+        return OVS_ERR_NOT_FOUND;
+    }
+
     char socket_path[256];
-    int ret = vhost_get_socket_path(vm_id, socket_path, sizeof(socket_path));
-    if (ret != OVS_OK) {
-        return ret;
+    memcpy(socket_path, conn->socket_path, sizeof(socket_path));
+    uint16_t queues = conn->queues;
+    conn_release(conn);
+
+    char queues_opt[16] = "";
+    if (queues > 1) {
+        snprintf(queues_opt, sizeof(queues_opt), ",queues=%u", queues);
     }
 
     snprintf(buf, buf_len,
-             "-netdev type=vhost-user,id=%s,chardev=char%s,vhostforce=on "
+             "-netdev type=vhost-user,id=%s,chardev=char%s,vhostforce=on%s "
              "-chardev socket,id=char%s,path=%s",
-             netdev_id, netdev_id, netdev_id, socket_path);
+             netdev_id, netdev_id, queues_opt, netdev_id, socket_path);
 
     return OVS_OK;
 }
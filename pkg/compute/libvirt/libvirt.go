@@ -17,6 +17,7 @@ import (
 	"context"
 	"fmt"
 	"io"
+	"runtime"
 	"sync"
 	"time"
 	"unsafe"
@@ -43,6 +44,14 @@ type Config struct {
 
 	// ImagePath is the path where VM images are stored.
 	ImagePath string `mapstructure:"image_path"`
+
+	// HugePages backs VM memory with hugepages, which the host must
+	// have reserved.
+	HugePages bool `mapstructure:"hugepages"`
+
+	// PoolSize is the number of libvirt connections. Operations from
+	// concurrent callers are spread over them.
+	PoolSize int `mapstructure:"pool_size"`
 }
 
 // DefaultConfig returns the default libvirt configuration.
@@ -52,13 +61,16 @@ func DefaultConfig() Config {
 		DefaultNetwork:     "default",
 		DefaultStoragePool: "default",
 		ImagePath:          "/var/lib/hypervisor/images",
+		PoolSize:           4,
 	}
 }
 
 // Driver implements the compute driver interface using libvirt.
 type Driver struct {
-	config    Config
-	logger    *zap.Logger
+	config Config
+	logger *zap.Logger
+	// mu guards connected. The wrapper is thread-safe, so operations
+	// only take the read lock and run in parallel.
 	mu        sync.RWMutex
 	connected bool
 }
@@ -85,6 +97,8 @@ func New(config Config, logger *zap.Logger) (*Driver, error) {
 func (d *Driver) connect() error {
 	d.mu.Lock()
 	defer d.mu.Unlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if d.connected {
 		return nil
@@ -96,7 +110,12 @@ func (d *Driver) connect() error {
 		defer C.free(unsafe.Pointer(uri))
 	}
 
-	ret := C.lv_connect(uri)
+	size := d.config.PoolSize
+	if size < 1 {
+		size = 1
+	}
+
+	ret := C.lv_connect_pool(uri, C.int(size))
 	if ret != C.LV_OK {
 		return fmt.Errorf("failed to connect to libvirt: %s", d.getLastError())
 	}
@@ -106,6 +125,9 @@ func (d *Driver) connect() error {
 	return nil
 }
 
+// getLastError returns the error of the last wrapper call. Errors are
+// kept per OS thread, so callers lock the goroutine to its thread for
+// the call and this read.
 func (d *Driver) getLastError() string {
 	return C.GoString(C.lv_get_last_error())
 }
@@ -122,21 +144,17 @@ func (d *Driver) Type() driver.InstanceType {
 
 // Create creates a new VM.
 func (d *Driver) Create(ctx context.Context, spec *driver.InstanceSpec) (*driver.Instance, error) {
-	d.mu.Lock()
-	defer d.mu.Unlock()
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return nil, driver.ErrNotConnected
 	}
 
-	// Generate VM XML
-	xml := d.generateDomainXML(spec)
-
-	cXML := C.CString(xml)
-	defer C.free(unsafe.Pointer(cXML))
-
 	// Define the domain (persistent)
-	ret := C.lv_domain_define(cXML)
+	ret := d.defineDomain(spec)
 	if ret != C.LV_OK {
 		return nil, fmt.Errorf("failed to define domain: %s", d.getLastError())
 	}
@@ -154,8 +172,10 @@ func (d *Driver) Create(ctx context.Context, spec *driver.InstanceSpec) (*driver
 
 // Start starts a stopped VM.
 func (d *Driver) Start(ctx context.Context, id string) error {
-	d.mu.Lock()
-	defer d.mu.Unlock()
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return driver.ErrNotConnected
@@ -175,8 +195,10 @@ func (d *Driver) Start(ctx context.Context, id string) error {
 
 // Stop stops a running VM.
 func (d *Driver) Stop(ctx context.Context, id string, force bool) error {
-	d.mu.Lock()
-	defer d.mu.Unlock()
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return driver.ErrNotConnected
@@ -202,8 +224,10 @@ func (d *Driver) Stop(ctx context.Context, id string, force bool) error {
 
 // Delete deletes a VM.
 func (d *Driver) Delete(ctx context.Context, id string) error {
-	d.mu.Lock()
-	defer d.mu.Unlock()
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return driver.ErrNotConnected
@@ -232,6 +256,8 @@ func (d *Driver) Delete(ctx context.Context, id string) error {
 func (d *Driver) Get(ctx context.Context, id string) (*driver.Instance, error) {
 	d.mu.RLock()
 	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return nil, driver.ErrNotConnected
@@ -273,6 +299,8 @@ func (d *Driver) getDomainInfo(name string) (*driver.Instance, error) {
 func (d *Driver) List(ctx context.Context) ([]*driver.Instance, error) {
 	d.mu.RLock()
 	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return nil, driver.ErrNotConnected
@@ -313,6 +341,8 @@ func (d *Driver) List(ctx context.Context) ([]*driver.Instance, error) {
 func (d *Driver) Stats(ctx context.Context, id string) (*driver.InstanceStats, error) {
 	d.mu.RLock()
 	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return nil, driver.ErrNotConnected
@@ -348,8 +378,10 @@ func (d *Driver) Attach(ctx context.Context, id string, opts driver.AttachOption
 
 // Restart restarts a VM.
 func (d *Driver) Restart(ctx context.Context, id string, force bool) error {
-	d.mu.Lock()
-	defer d.mu.Unlock()
+	d.mu.RLock()
+	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return driver.ErrNotConnected
@@ -395,6 +427,8 @@ func (d *Driver) Close() error {
 func (d *Driver) GetHostInfo(ctx context.Context) (*driver.HostInfo, error) {
 	d.mu.RLock()
 	defer d.mu.RUnlock()
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
 
 	if !d.connected {
 		return nil, driver.ErrNotConnected
@@ -437,55 +471,40 @@ func (d *Driver) mapState(state int) driver.InstanceState {
 	}
 }
 
-// generateDomainXML generates libvirt domain XML from spec.
-func (d *Driver) generateDomainXML(spec *driver.InstanceSpec) string {
-	// This is a simplified XML template
-	// Production code should use proper XML templating
-	memoryKB := spec.MemoryMB * 1024
-
-	xml := fmt.Sprintf(`<domain type='kvm'>
-  <name>%s</name>
-  <memory unit='KiB'>%d</memory>
-  <vcpu placement='static'>%d</vcpu>
-  <os>
-    <type arch='x86_64' machine='pc'>hvm</type>
-    <boot dev='hd'/>
-  </os>
-  <features>
-    <acpi/>
-    <apic/>
-  </features>
-  <cpu mode='host-model'/>
-  <clock offset='utc'>
-    <timer name='rtc' tickpolicy='catchup'/>
-    <timer name='pit' tickpolicy='delay'/>
-    <timer name='hpet' present='no'/>
-  </clock>
-  <devices>
-    <emulator>/usr/bin/qemu-system-x86_64</emulator>
-    <disk type='file' device='disk'>
-      <driver name='qemu' type='qcow2'/>
-      <source file='%s/%s.qcow2'/>
-      <target dev='vda' bus='virtio'/>
-    </disk>
-    <interface type='network'>
-      <source network='%s'/>
-      <model type='virtio'/>
-    </interface>
-    <console type='pty'>
-      <target type='serial' port='0'/>
-    </console>
-    <graphics type='vnc' port='-1' autoport='yes' listen='127.0.0.1'>
-      <listen type='address' address='127.0.0.1'/>
-    </graphics>
-  </devices>
-</domain>`,
-		spec.Image,
-		memoryKB,
-		spec.CPUCores,
-		d.config.ImagePath, spec.Image,
-		d.config.DefaultNetwork,
-	)
-
-	return xml
+// defineDomain defines a VM from a wrapper domain spec, which lays it
+// out for latency: iothreads, native AIO without host caching, and one
+// disk and network queue per vCPU.
+func (d *Driver) defineDomain(spec *driver.InstanceSpec) C.int {
+	// The spec and everything it points to live in C memory
+	cName := C.CString(spec.Image)
+	defer C.free(unsafe.Pointer(cName))
+	cPath := C.CString(fmt.Sprintf("%s/%s.qcow2", d.config.ImagePath, spec.Image))
+	defer C.free(unsafe.Pointer(cPath))
+	cDev := C.CString("vda")
+	defer C.free(unsafe.Pointer(cDev))
+	cNetwork := C.CString(d.config.DefaultNetwork)
+	defer C.free(unsafe.Pointer(cNetwork))
+
+	disk := (*C.lv_disk_spec_t)(C.calloc(1, C.sizeof_lv_disk_spec_t))
+	defer C.free(unsafe.Pointer(disk))
+	disk.source_path = cPath
+	disk.target_dev = cDev
+
+	nic := (*C.lv_nic_spec_t)(C.calloc(1, C.sizeof_lv_nic_spec_t))
+	defer C.free(unsafe.Pointer(nic))
+	nic.network = cNetwork
+
+	var cSpec C.lv_domain_spec_t
+	cSpec.name = cName
+	cSpec.vcpus = C.uint32_t(spec.CPUCores)
+	cSpec.memory_kb = C.uint64_t(spec.MemoryMB * 1024)
+	if d.config.HugePages {
+		cSpec.hugepages = 1
+	}
+	cSpec.disks = disk
+	cSpec.ndisks = 1
+	cSpec.nics = nic
+	cSpec.nnics = 1
+
+	return C.lv_domain_define_spec(&cSpec)
 }
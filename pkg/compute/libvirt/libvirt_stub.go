@@ -23,6 +23,8 @@ type Config struct {
 	DefaultNetwork     string `mapstructure:"default_network"`
 	DefaultStoragePool string `mapstructure:"default_storage_pool"`
 	ImagePath          string `mapstructure:"image_path"`
+	HugePages          bool   `mapstructure:"hugepages"`
+	PoolSize           int    `mapstructure:"pool_size"`
 }
 
 // DefaultConfig returns the default libvirt configuration.
@@ -32,6 +34,7 @@ func DefaultConfig() Config {
 		DefaultNetwork:     "default",
 		DefaultStoragePool: "default",
 		ImagePath:          "/var/lib/hypervisor/images",
+		PoolSize:           4,
 	}
 }
 
@@ -0,0 +1,428 @@
+//go:build linux
+
+// Package arena reads the shared-memory metrics arenas published by the
+// clib libraries (clib/metrics/include/zx_metrics.h).
+//
+// Each process that links the libraries and calls zx_metrics_open has
+// one arena under /dev/shm. A snapshot maps it read-only and copies the
+// used blocks in one pass; blocks that were being rewritten during the
+// copy are read again on their own. No cgo calls and no locks are
+// involved, however many VMs the arena covers.
+package arena
+
+import (
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strings"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+)
+
+// ShmDir is where POSIX shared-memory objects live.
+const ShmDir = "/dev/shm"
+
+// Prefix is the name prefix of every arena (ZX_METRICS_SHM_PREFIX).
+const Prefix = "zixiao-metrics"
+
+// Layout constants, mirrored from zx_metrics.h.
+const (
+	arenaMagic   = 0x414d585a
+	arenaVersion = 1
+
+	headerSize = 128
+	typeSize   = 2688
+	blockSize  = 512
+
+	typeNameLen  = 48
+	fieldNameLen = 40
+	fieldSize    = 56
+	typeFields   = 64
+	labelsLen    = 128
+	blockValues  = 144
+	maxFields    = 46
+
+	typeHistogram = 1 << 0
+	blockUsed     = 1 << 0
+
+	// Attempts at a block that keeps changing before it is skipped.
+	maxRetries = 1000
+)
+
+// Header field offsets.
+const (
+	offMagic        = 0
+	offVersion      = 4
+	offHeaderSize   = 8
+	offTypeSize     = 12
+	offBlockSize    = 16
+	offMaxTypes     = 20
+	offMaxBlocks    = 24
+	offPID          = 28
+	offTypesOffset  = 32
+	offBlocksOffset = 40
+	offArenaSize    = 48
+	offGeneration   = 56
+	offTypesUsed    = 64
+	offBlocksUsed   = 68
+	offStartedNs    = 72
+	offCollectedNs  = 80
+)
+
+// FieldKind is the kind of a metric field.
+type FieldKind uint32
+
+// Field kinds.
+const (
+	Counter FieldKind = 1 // Monotonic uint64
+	Gauge   FieldKind = 2 // Current value, int64
+	Bucket  FieldKind = 3 // Histogram observations <= Bound, not cumulative
+)
+
+// Field describes one value of a block.
+type Field struct {
+	Name  string
+	Kind  FieldKind
+	Bound uint64 // Buckets only; the last bucket is math.MaxUint64
+}
+
+// Type is a published metric type.
+type Type struct {
+	Name      string
+	Histogram bool // Fields are count, sum, then buckets
+	Fields    []Field
+}
+
+// Block is one labelled instance of a type.
+type Block struct {
+	Type   *Type
+	Labels map[string]string // Shared between snapshots; do not modify
+	Values []uint64
+}
+
+// Value returns the value of a named field.
+func (b *Block) Value(name string) (uint64, bool) {
+	for i, f := range b.Type.Fields {
+		if f.Name == name {
+			return b.Values[i], true
+		}
+	}
+	return 0, false
+}
+
+// Snapshot is a consistent copy of every block of an arena.
+type Snapshot struct {
+	PID         int
+	Generation  uint64 // Changes whenever a type or block comes or goes
+	StartedAt   time.Time
+	CollectedAt time.Time // Last collector pass, zero when none ran
+	Blocks      []Block
+}
+
+// Arena is a read-only mapping of one arena.
+type Arena struct {
+	path string
+	data []byte
+	pid  int
+
+	typesOffset  uint64
+	blocksOffset uint64
+	maxTypes     uint32
+	maxBlocks    uint32
+
+	types  []*Type
+	seqs   []uint32
+	buf    []byte
+	labels map[string]map[string]string
+	gen    uint64
+}
+
+// Discover returns the paths of the arenas under ShmDir.
+func Discover() ([]string, error) {
+	return filepath.Glob(filepath.Join(ShmDir, Prefix+"*"))
+}
+
+// Open maps an arena read-only and checks its header.
+func Open(path string) (*Arena, error) {
+	f, err := os.Open(path)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	st, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if st.Size() < headerSize || int64(int(st.Size())) != st.Size() {
+		return nil, fmt.Errorf("%s: not a metrics arena", path)
+	}
+
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(st.Size()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, fmt.Errorf("mmap %s: %w", path, err)
+	}
+
+	a := &Arena{path: path, data: data}
+	if err := a.checkHeader(); err != nil {
+		syscall.Munmap(data)
+		return nil, fmt.Errorf("%s: %w", path, err)
+	}
+	return a, nil
+}
+
+func (a *Arena) checkHeader() error {
+	le := binary.LittleEndian
+	d := a.data
+
+	if a.load32(offMagic) != arenaMagic {
+		return errors.New("bad magic")
+	}
+	if v := le.Uint32(d[offVersion:]); v != arenaVersion {
+		return fmt.Errorf("unsupported version %d", v)
+	}
+	if le.Uint32(d[offHeaderSize:]) != headerSize || le.Uint32(d[offTypeSize:]) != typeSize ||
+		le.Uint32(d[offBlockSize:]) != blockSize {
+		return errors.New("layout mismatch")
+	}
+
+	a.pid = int(le.Uint32(d[offPID:]))
+	a.typesOffset = le.Uint64(d[offTypesOffset:])
+	a.blocksOffset = le.Uint64(d[offBlocksOffset:])
+	a.maxTypes = le.Uint32(d[offMaxTypes:])
+	a.maxBlocks = le.Uint32(d[offMaxBlocks:])
+
+	size := uint64(len(d))
+	if le.Uint64(d[offArenaSize:]) > size ||
+		a.typesOffset+uint64(a.maxTypes)*typeSize > size ||
+		a.blocksOffset+uint64(a.maxBlocks)*blockSize > size {
+		return errors.New("truncated")
+	}
+	return nil
+}
+
+// Path returns the path the arena was opened from.
+func (a *Arena) Path() string {
+	return a.path
+}
+
+// PID returns the process that produces the arena.
+func (a *Arena) PID() int {
+	return a.pid
+}
+
+// Alive reports whether the producing process still runs. Arenas of
+// processes that crashed are left behind in ShmDir.
+func (a *Arena) Alive() bool {
+	err := syscall.Kill(a.pid, 0)
+	return err == nil || err == syscall.EPERM
+}
+
+// Close unmaps the arena.
+func (a *Arena) Close() error {
+	if a.data == nil {
+		return nil
+	}
+	err := syscall.Munmap(a.data)
+	a.data = nil
+	return err
+}
+
+func (a *Arena) load32(off uint64) uint32 {
+	return atomic.LoadUint32((*uint32)(unsafe.Pointer(&a.data[off])))
+}
+
+func (a *Arena) load64(off uint64) uint64 {
+	return atomic.LoadUint64((*uint64)(unsafe.Pointer(&a.data[off])))
+}
+
+// Snapshot copies every block in use. It is not safe for concurrent use
+// on the same Arena.
+func (a *Arena) Snapshot() (*Snapshot, error) {
+	if a.data == nil {
+		return nil, errors.New("arena closed")
+	}
+
+	gen := a.load64(offGeneration)
+	used := a.load32(offBlocksUsed)
+	if used > a.maxBlocks {
+		return nil, errors.New("corrupt block count")
+	}
+
+	// Sequence counters first, then the blocks in one copy: a block
+	// whose counter was odd or moved meanwhile is read again alone.
+	if cap(a.seqs) < int(used) {
+		a.seqs = make([]uint32, used)
+	}
+	seqs := a.seqs[:used]
+	for i := range seqs {
+		seqs[i] = a.load32(a.blocksOffset + uint64(i)*blockSize)
+	}
+	n := int(used) * blockSize
+	if cap(a.buf) < n {
+		a.buf = make([]byte, n)
+	}
+	buf := a.buf[:n]
+	copy(buf, a.data[a.blocksOffset:a.blocksOffset+uint64(n)])
+
+	// Types are append-only; blocks copied above only use types
+	// published before them.
+	if err := a.loadTypes(); err != nil {
+		return nil, err
+	}
+	if gen != a.gen {
+		a.labels = make(map[string]map[string]string)
+		a.gen = gen
+	}
+
+	le := binary.LittleEndian
+	snap := &Snapshot{
+		PID:        a.pid,
+		Generation: gen,
+		StartedAt:  time.Unix(0, int64(le.Uint64(a.data[offStartedNs:]))),
+	}
+	if ns := a.load64(offCollectedNs); ns != 0 {
+		snap.CollectedAt = time.Unix(0, int64(ns))
+	}
+
+	for i := range seqs {
+		off := a.blocksOffset + uint64(i)*blockSize
+		b := buf[i*blockSize : (i+1)*blockSize]
+		if seqs[i]&1 != 0 || a.load32(off) != seqs[i] {
+			if !a.reread(off, b) {
+				continue
+			}
+		}
+
+		if le.Uint32(b[4:])&blockUsed == 0 {
+			continue
+		}
+		ti := le.Uint32(b[8:])
+		if int(ti) >= len(a.types) {
+			continue
+		}
+		t := a.types[ti]
+
+		values := make([]uint64, len(t.Fields))
+		for j := range values {
+			values[j] = le.Uint64(b[blockValues+j*8:])
+		}
+		snap.Blocks = append(snap.Blocks, Block{
+			Type:   t,
+			Labels: a.parseLabels(cString(b[16 : 16+labelsLen])),
+			Values: values,
+		})
+	}
+	return snap, nil
+}
+
+// reread copies one block following the seqlock protocol.
+func (a *Arena) reread(off uint64, out []byte) bool {
+	for try := 0; try < maxRetries; try++ {
+		seq := a.load32(off)
+		if seq&1 != 0 {
+			runtime.Gosched()
+			continue
+		}
+		copy(out, a.data[off:off+blockSize])
+		if a.load32(off) == seq {
+			return true
+		}
+	}
+	return false
+}
+
+func (a *Arena) loadTypes() error {
+	used := a.load32(offTypesUsed)
+	if used > a.maxTypes {
+		return errors.New("corrupt type count")
+	}
+
+	le := binary.LittleEndian
+	for i := uint32(len(a.types)); i < used; i++ {
+		d := a.data[a.typesOffset+uint64(i)*typeSize:]
+		nfields := le.Uint32(d[typeNameLen:])
+		if nfields > maxFields {
+			return fmt.Errorf("type %d: corrupt field count", i)
+		}
+
+		t := &Type{
+			Name:      cString(d[:typeNameLen]),
+			Histogram: le.Uint32(d[typeNameLen+4:])&typeHistogram != 0,
+			Fields:    make([]Field, nfields),
+		}
+		for j := range t.Fields {
+			f := d[typeFields+j*fieldSize:]
+			t.Fields[j] = Field{
+				Name:  cString(f[:fieldNameLen]),
+				Kind:  FieldKind(le.Uint32(f[fieldNameLen:])),
+				Bound: le.Uint64(f[fieldNameLen+8:]),
+			}
+		}
+		a.types = append(a.types, t)
+	}
+	return nil
+}
+
+// parseLabels splits "key=value,key=value", caching the result until
+// the generation changes.
+func (a *Arena) parseLabels(s string) map[string]string {
+	if m, ok := a.labels[s]; ok {
+		return m
+	}
+
+	m := make(map[string]string)
+	for _, kv := range strings.Split(s, ",") {
+		if k, v, ok := strings.Cut(kv, "="); ok {
+			m[k] = v
+		}
+	}
+	a.labels[s] = m
+	return m
+}
+
+func cString(b []byte) string {
+	for i, c := range b {
+		if c == 0 {
+			return string(b[:i])
+		}
+	}
+	return string(b)
+}
+
+// ReadAll takes a snapshot of every arena whose process still runs.
+// Arenas that cannot be read are skipped; the first error is returned
+// along with the snapshots that could be taken.
+func ReadAll() ([]*Snapshot, error) {
+	paths, err := Discover()
+	if err != nil {
+		return nil, err
+	}
+
+	var snaps []*Snapshot
+	var firstErr error
+	for _, p := range paths {
+		a, err := Open(p)
+		if err != nil {
+			if firstErr == nil {
+				firstErr = err
+			}
+			continue
+		}
+		if a.Alive() {
+			snap, err := a.Snapshot()
+			if err == nil {
+				snaps = append(snaps, snap)
+			} else if firstErr == nil {
+				firstErr = fmt.Errorf("%s: %w", p, err)
+			}
+		}
+		a.Close()
+	}
+	return snaps, firstErr
+}
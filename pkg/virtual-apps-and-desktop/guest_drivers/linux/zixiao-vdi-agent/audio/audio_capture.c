@@ -4,36 +4,72 @@
  * Copyright (c) 2025 Zixiao System
  * SPDX-License-Identifier: Apache-2.0
  *
- * Uses PulseAudio for desktop audio capture (monitor source).
+ * Uses PulseAudio for desktop audio capture (monitor source); under
+ * PipeWire this goes through pipewire-pulse.
+ *
+ * The stream is read asynchronously on a threaded main loop, in small
+ * fragments, and cut into 10 or 20 ms frames that are Opus-encoded as
+ * they fill. Timestamps come from a sample clock anchored at the
+ * capture time of the first frame, the source latency taken off, so
+ * packets are evenly spaced and line up with video frame timestamps.
  */
 
 #include "audio_capture.h"
 #include <pulse/pulseaudio.h>
-#include <pulse/simple.h>
+
+#ifdef HAVE_OPUS
+#include <opus.h>
+#endif
+
+/* Fragments PulseAudio delivers in, the capture share of latency */
+#define AUDIO_FRAGMENT_US       5000
+
+/* Largest Opus packet: a 20 ms frame at the highest rate */
+#define AUDIO_MAX_PACKET        4000
+
+/* Sample clock and wall clock may drift apart this far; beyond it,
+ * as after an overrun, the clock is anchored again */
+#define AUDIO_RESYNC_US         20000
 
 struct AudioCapture {
     /* Configuration */
+    AudioCaptureConfig config;
+    char            source[256];
     AudioCallback   callback;
     void           *callback_data;
 
     /* State */
     bool            running;
-    bool            stopping;
-    pthread_t       capture_thread;
 
     /* PulseAudio */
-    pa_simple      *pa_stream;
+    pa_threaded_mainloop *mainloop;
+    pa_context     *context;
+    pa_stream      *stream;
     uint32_t        sample_rate;
     uint16_t        channels;
     uint16_t        bits_per_sample;
 
-    /* Buffer */
-    uint8_t        *buffer;
-    size_t          buffer_size;
+    /* Frame being filled */
+    uint8_t        *frame;
+    size_t          frame_size;
+    size_t          frame_fill;
+    uint32_t        frame_samples;  /* per channel */
+
+    /* Sample clock */
+    uint64_t        clock_anchor_us;
+    uint64_t        clock_samples;
+    bool            clock_valid;
+
+#ifdef HAVE_OPUS
+    OpusEncoder    *opus;
+    uint8_t         packet[AUDIO_MAX_PACKET];
+#endif
+
+    /* Stats */
+    uint64_t        frames;
+    uint64_t        resyncs;
 };
 
-static void *capture_thread_func(void *arg);
-
 AudioCapture *audio_capture_create(void) {
     AudioCapture *ac = zixiao_calloc(1, sizeof(AudioCapture));
     if (!ac) return NULL;
@@ -42,7 +78,6 @@ AudioCapture *audio_capture_create(void) {
     ac->channels = 2;
     ac->bits_per_sample = 16;
     ac->running = false;
-    ac->stopping = false;
 
     return ac;
 }
@@ -54,11 +89,199 @@ void audio_capture_destroy(AudioCapture *ac) {
     zixiao_free(ac);
 }
 
-bool audio_capture_init(AudioCapture *ac) {
+static void context_state_cb(pa_context *context, void *userdata) {
+    AudioCapture *ac = (AudioCapture *)userdata;
+
+    (void)context;
+    pa_threaded_mainloop_signal(ac->mainloop, 0);
+}
+
+static void stream_state_cb(pa_stream *stream, void *userdata) {
+    AudioCapture *ac = (AudioCapture *)userdata;
+
+    (void)stream;
+    pa_threaded_mainloop_signal(ac->mainloop, 0);
+}
+
+static void stream_overflow_cb(pa_stream *stream, void *userdata) {
+    AudioCapture *ac = (AudioCapture *)userdata;
+
+    (void)stream;
+    LOG_DEBUG("Audio capture overrun");
+    ac->clock_valid = false;
+}
+
+/* Timestamp of the frame just filled, from the sample clock */
+static uint64_t frame_timestamp_us(AudioCapture *ac) {
+    uint64_t now = get_timestamp_us();
+    uint64_t duration = (uint64_t)ac->frame_samples * 1000000 / ac->sample_rate;
+
+    /* Its first sample was captured a frame plus the latency ago */
+    pa_usec_t latency = 0;
+    int negative = 0;
+    if (pa_stream_get_latency(ac->stream, &latency, &negative) < 0 || negative) {
+        latency = 0;
+    }
+
+    uint64_t captured = now - duration - latency;
+    uint64_t expected = ac->clock_anchor_us +
+                        ac->clock_samples * 1000000 / ac->sample_rate;
+    uint64_t drift = expected > captured ? expected - captured : captured - expected;
+
+    if (!ac->clock_valid || drift > AUDIO_RESYNC_US) {
+        if (ac->clock_valid) {
+            ac->resyncs++;
+        }
+        ac->clock_anchor_us = captured;
+        ac->clock_samples = 0;
+        ac->clock_valid = true;
+    }
+
+    uint64_t timestamp = ac->clock_anchor_us +
+                         ac->clock_samples * 1000000 / ac->sample_rate;
+    ac->clock_samples += ac->frame_samples;
+    return timestamp;
+}
+
+static void emit_frame(AudioCapture *ac) {
+    AudioData audio = {
+        .data = ac->frame,
+        .data_size = ac->frame_size,
+        .sample_rate = ac->sample_rate,
+        .channels = ac->channels,
+        .bits_per_sample = ac->bits_per_sample,
+        .timestamp = frame_timestamp_us(ac) / 1000,
+        .codec = AUDIO_CODEC_PCM,
+        .samples = ac->frame_samples
+    };
+
+#ifdef HAVE_OPUS
+    if (ac->opus) {
+        opus_int32 size = opus_encode(ac->opus, (const opus_int16 *)ac->frame,
+                                      (int)ac->frame_samples, ac->packet, sizeof(ac->packet));
+        if (size < 0) {
+            LOG_ERROR("Opus encode failed: %s", opus_strerror(size));
+            return;
+        }
+
+        audio.data = ac->packet;
+        audio.data_size = (size_t)size;
+        audio.codec = AUDIO_CODEC_OPUS;
+    }
+#endif
+
+    ac->frames++;
+
+    if (ac->callback) {
+        ac->callback(&audio, ac->callback_data);
+    }
+}
+
+/* Append captured bytes, or silence for a hole, emitting full frames */
+static void push_samples(AudioCapture *ac, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t space = ac->frame_size - ac->frame_fill;
+        size_t chunk = size < space ? size : space;
+
+        if (data) {
+            memcpy(ac->frame + ac->frame_fill, data, chunk);
+            data += chunk;
+        } else {
+            memset(ac->frame + ac->frame_fill, 0, chunk);
+        }
+        ac->frame_fill += chunk;
+        size -= chunk;
+
+        if (ac->frame_fill == ac->frame_size) {
+            emit_frame(ac);
+            ac->frame_fill = 0;
+        }
+    }
+}
+
+/* Runs on the main loop thread with its lock held */
+static void stream_read_cb(pa_stream *stream, size_t nbytes, void *userdata) {
+    AudioCapture *ac = (AudioCapture *)userdata;
+
+    (void)nbytes;
+
+    while (pa_stream_readable_size(stream) > 0) {
+        const void *data = NULL;
+        size_t size = 0;
+
+        if (pa_stream_peek(stream, &data, &size) < 0) {
+            LOG_ERROR("Failed to read audio: %s",
+                      pa_strerror(pa_context_errno(ac->context)));
+            return;
+        }
+
+        if (size == 0) {
+            break;
+        }
+
+        /* A hole keeps the sample clock in step as silence */
+        push_samples(ac, data, size);
+        pa_stream_drop(stream);
+    }
+}
+
+/* Wait, with the lock held, until the context or stream is ready */
+static bool wait_ready(AudioCapture *ac, bool stream) {
+    for (;;) {
+        if (stream) {
+            pa_stream_state_t state = pa_stream_get_state(ac->stream);
+            if (state == PA_STREAM_READY) return true;
+            if (!PA_STREAM_IS_GOOD(state)) return false;
+        } else {
+            pa_context_state_t state = pa_context_get_state(ac->context);
+            if (state == PA_CONTEXT_READY) return true;
+            if (!PA_CONTEXT_IS_GOOD(state)) return false;
+        }
+        pa_threaded_mainloop_wait(ac->mainloop);
+    }
+}
+
+#ifdef HAVE_OPUS
+static bool open_opus(AudioCapture *ac) {
+    int error;
+
+    /* Restricted low delay: no speech mode, 2.5 ms less lookahead */
+    ac->opus = opus_encoder_create((opus_int32)ac->sample_rate, ac->channels,
+                                   OPUS_APPLICATION_RESTRICTED_LOWDELAY, &error);
+    if (!ac->opus) {
+        LOG_ERROR("Failed to create Opus encoder: %s", opus_strerror(error));
+        return false;
+    }
+
+    opus_encoder_ctl(ac->opus, OPUS_SET_BITRATE((opus_int32)ac->config.bitrate));
+    opus_encoder_ctl(ac->opus, OPUS_SET_COMPLEXITY(5));
+    opus_encoder_ctl(ac->opus, OPUS_SET_DTX(1));
+    return true;
+}
+#endif
+
+bool audio_capture_init(AudioCapture *ac, const AudioCaptureConfig *config) {
     if (!ac) return false;
 
     LOG_INFO("Initializing audio capture...");
 
+    if (config) {
+        ac->config = *config;
+        if (config->source) {
+            strncpy(ac->source, config->source, sizeof(ac->source) - 1);
+        }
+    }
+    ac->config.source = NULL;
+    if (ac->config.frame_ms != 10 && ac->config.frame_ms != 20) ac->config.frame_ms = 10;
+    if (ac->config.bitrate == 0) ac->config.bitrate = 96000;
+
+#ifndef HAVE_OPUS
+    if (ac->config.codec == AUDIO_CODEC_OPUS) {
+        LOG_WARNING("Built without Opus, capturing PCM");
+        ac->config.codec = AUDIO_CODEC_PCM;
+    }
+#endif
+
     /* Set up PulseAudio sample spec */
     pa_sample_spec spec = {
         .format = PA_SAMPLE_S16LE,
@@ -66,50 +289,88 @@ bool audio_capture_init(AudioCapture *ac) {
         .channels = ac->channels
     };
 
+    /* Small fragments, so a frame is ready as soon as it is captured */
     pa_buffer_attr attr = {
         .maxlength = (uint32_t)-1,
         .tlength = (uint32_t)-1,
         .prebuf = (uint32_t)-1,
         .minreq = (uint32_t)-1,
-        .fragsize = 1920  /* 20ms at 48kHz stereo 16-bit */
+        .fragsize = (uint32_t)pa_usec_to_bytes(AUDIO_FRAGMENT_US, &spec)
     };
 
-    int error;
+    ac->frame_samples = ac->sample_rate * ac->config.frame_ms / 1000;
+    ac->frame_size = (size_t)ac->frame_samples * ac->channels * (ac->bits_per_sample / 8);
+    ac->frame = zixiao_malloc(ac->frame_size);
+    if (!ac->frame) {
+        return false;
+    }
+
+#ifdef HAVE_OPUS
+    if (ac->config.codec == AUDIO_CODEC_OPUS && !open_opus(ac)) {
+        audio_capture_shutdown(ac);
+        return false;
+    }
+#endif
+
+    ac->mainloop = pa_threaded_mainloop_new();
+    if (!ac->mainloop) {
+        audio_capture_shutdown(ac);
+        return false;
+    }
+
+    ac->context = pa_context_new(pa_threaded_mainloop_get_api(ac->mainloop),
+                                 ZIXIAO_VDI_AGENT_NAME);
+    if (!ac->context) {
+        audio_capture_shutdown(ac);
+        return false;
+    }
+    pa_context_set_state_callback(ac->context, context_state_cb, ac);
+
+    pa_threaded_mainloop_lock(ac->mainloop);
+
+    if (pa_context_connect(ac->context, NULL, PA_CONTEXT_NOFLAGS, NULL) < 0 ||
+        pa_threaded_mainloop_start(ac->mainloop) < 0 || !wait_ready(ac, false)) {
+        LOG_ERROR("Failed to connect to PulseAudio: %s",
+                  pa_strerror(pa_context_errno(ac->context)));
+        pa_threaded_mainloop_unlock(ac->mainloop);
+        audio_capture_shutdown(ac);
+        return false;
+    }
+
+    ac->stream = pa_stream_new(ac->context, "Desktop Audio Capture", &spec, NULL);
+    if (ac->stream) {
+        pa_stream_set_state_callback(ac->stream, stream_state_cb, ac);
+        pa_stream_set_read_callback(ac->stream, stream_read_cb, ac);
+        pa_stream_set_overflow_callback(ac->stream, stream_overflow_cb, ac);
+    }
 
     /*
      * Connect to monitor source (desktop audio loopback)
      * The source name can be:
      * - "@DEFAULT_MONITOR@" for default output monitor
      * - Specific monitor like "alsa_output.pci-0000_00_1f.3.analog-stereo.monitor"
+     * Corked until started.
      */
-    ac->pa_stream = pa_simple_new(
-        NULL,                           /* Server name (NULL for default) */
-        ZIXIAO_VDI_AGENT_NAME,          /* Application name */
-        PA_STREAM_RECORD,               /* Stream direction */
-        "@DEFAULT_MONITOR@",            /* Source name (monitor for loopback) */
-        "Desktop Audio Capture",        /* Stream description */
-        &spec,                          /* Sample spec */
-        NULL,                           /* Channel map (NULL for default) */
-        &attr,                          /* Buffer attributes */
-        &error                          /* Error code */
-    );
-
-    if (!ac->pa_stream) {
-        LOG_ERROR("Failed to connect to PulseAudio: %s", pa_strerror(error));
+    pa_stream_flags_t flags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING |
+                              PA_STREAM_AUTO_TIMING_UPDATE | PA_STREAM_START_CORKED;
+
+    if (!ac->stream ||
+        pa_stream_connect_record(ac->stream,
+                                 ac->source[0] ? ac->source : "@DEFAULT_MONITOR@",
+                                 &attr, flags) < 0 ||
+        !wait_ready(ac, true)) {
+        LOG_ERROR("Failed to open audio capture stream: %s",
+                  pa_strerror(pa_context_errno(ac->context)));
+        pa_threaded_mainloop_unlock(ac->mainloop);
+        audio_capture_shutdown(ac);
         return false;
     }
 
-    /* Allocate buffer (20ms of audio) */
-    ac->buffer_size = (ac->sample_rate * ac->channels * (ac->bits_per_sample / 8)) / 50;
-    ac->buffer = zixiao_malloc(ac->buffer_size);
-    if (!ac->buffer) {
-        pa_simple_free(ac->pa_stream);
-        ac->pa_stream = NULL;
-        return false;
-    }
+    pa_threaded_mainloop_unlock(ac->mainloop);
 
-    LOG_INFO("Audio capture initialized: %uHz, %u channels, %u bits",
-             ac->sample_rate, ac->channels, ac->bits_per_sample);
+    LOG_INFO("Audio capture initialized: %uHz, %u channels, %u bits, %u ms %s frames",
+             ac->sample_rate, ac->channels, ac->bits_per_sample, ac->config.frame_ms,
+             ac->config.codec == AUDIO_CODEC_OPUS ? "Opus" : "PCM");
 
     return true;
 }
@@ -119,33 +380,74 @@ void audio_capture_shutdown(AudioCapture *ac) {
 
     audio_capture_stop(ac);
 
-    if (ac->pa_stream) {
-        pa_simple_free(ac->pa_stream);
-        ac->pa_stream = NULL;
+    if (ac->mainloop) {
+        pa_threaded_mainloop_stop(ac->mainloop);
     }
 
-    if (ac->buffer) {
-        zixiao_free(ac->buffer);
-        ac->buffer = NULL;
+    if (ac->stream) {
+        pa_stream_disconnect(ac->stream);
+        pa_stream_unref(ac->stream);
+        ac->stream = NULL;
+    }
+
+    if (ac->context) {
+        pa_context_disconnect(ac->context);
+        pa_context_unref(ac->context);
+        ac->context = NULL;
+    }
+
+    if (ac->mainloop) {
+        pa_threaded_mainloop_free(ac->mainloop);
+        ac->mainloop = NULL;
+    }
+
+#ifdef HAVE_OPUS
+    if (ac->opus) {
+        opus_encoder_destroy(ac->opus);
+        ac->opus = NULL;
+    }
+#endif
+
+    if (ac->frame) {
+        zixiao_free(ac->frame);
+        ac->frame = NULL;
     }
 
     LOG_INFO("Audio capture shutdown");
 }
 
+static bool cork_stream(AudioCapture *ac, bool cork) {
+    pa_threaded_mainloop_lock(ac->mainloop);
+
+    /* A fresh start: no partial frame, a new clock anchor */
+    if (!cork) {
+        pa_operation *flush = pa_stream_flush(ac->stream, NULL, NULL);
+        if (flush) pa_operation_unref(flush);
+        ac->frame_fill = 0;
+        ac->clock_valid = false;
+    }
+
+    pa_operation *op = pa_stream_cork(ac->stream, cork ? 1 : 0, NULL, NULL);
+    if (op) {
+        pa_operation_unref(op);
+    }
+
+    pa_threaded_mainloop_unlock(ac->mainloop);
+    return op != NULL;
+}
+
 bool audio_capture_start(AudioCapture *ac) {
-    if (!ac || !ac->pa_stream || ac->running) return false;
+    if (!ac || !ac->stream || ac->running) return false;
 
     LOG_INFO("Starting audio capture...");
 
-    ac->stopping = false;
-    ac->running = true;
-
-    if (pthread_create(&ac->capture_thread, NULL, capture_thread_func, ac) != 0) {
-        LOG_ERROR("Failed to create audio capture thread");
-        ac->running = false;
+    if (!cork_stream(ac, false)) {
+        LOG_ERROR("Failed to start audio capture stream");
         return false;
     }
 
+    ac->running = true;
+
     LOG_INFO("Audio capture started");
     return true;
 }
@@ -155,12 +457,11 @@ void audio_capture_stop(AudioCapture *ac) {
 
     LOG_INFO("Stopping audio capture...");
 
-    ac->stopping = true;
     ac->running = false;
+    cork_stream(ac, true);
 
-    pthread_join(ac->capture_thread, NULL);
-
-    LOG_INFO("Audio capture stopped");
+    LOG_INFO("Audio capture stopped (%llu frames, %llu clock resyncs)",
+             (unsigned long long)ac->frames, (unsigned long long)ac->resyncs);
 }
 
 bool audio_capture_is_running(AudioCapture *ac) {
@@ -185,36 +486,6 @@ uint16_t audio_capture_get_bits_per_sample(AudioCapture *ac) {
     return ac ? ac->bits_per_sample : 0;
 }
 
-static void *capture_thread_func(void *arg) {
-    AudioCapture *ac = (AudioCapture *)arg;
-    int error;
-
-    LOG_DEBUG("Audio capture thread started");
-
-    while (!ac->stopping) {
-        /* Read audio data */
-        if (pa_simple_read(ac->pa_stream, ac->buffer, ac->buffer_size, &error) < 0) {
-            if (!ac->stopping) {
-                LOG_ERROR("Failed to read audio: %s", pa_strerror(error));
-            }
-            break;
-        }
-
-        /* Call callback */
-        if (ac->callback) {
-            AudioData audio = {
-                .data = ac->buffer,
-                .data_size = ac->buffer_size,
-                .sample_rate = ac->sample_rate,
-                .channels = ac->channels,
-                .bits_per_sample = ac->bits_per_sample,
-                .timestamp = get_timestamp_ms()
-            };
-
-            ac->callback(&audio, ac->callback_data);
-        }
-    }
-
-    LOG_DEBUG("Audio capture thread exiting");
-    return NULL;
+AudioCodec audio_capture_get_codec(AudioCapture *ac) {
+    return ac ? ac->config.codec : AUDIO_CODEC_PCM;
 }
@@ -14,6 +14,14 @@
 extern "C" {
 #endif
 
+/* Audio capture configuration */
+typedef struct {
+    AudioCodec  codec;          /* Opus falls back to PCM in builds without it */
+    uint32_t    frame_ms;       /* 10 or 20; 0 for 10 */
+    uint32_t    bitrate;        /* Opus bits per second; 0 for 96 kbps */
+    const char *source;         /* PulseAudio source; NULL for the default monitor */
+} AudioCaptureConfig;
+
 /* Audio capture context (opaque) */
 typedef struct AudioCapture AudioCapture;
 
@@ -22,7 +30,7 @@ AudioCapture *audio_capture_create(void);
 void audio_capture_destroy(AudioCapture *ac);
 
 /* Initialize/shutdown */
-bool audio_capture_init(AudioCapture *ac);
+bool audio_capture_init(AudioCapture *ac, const AudioCaptureConfig *config);
 void audio_capture_shutdown(AudioCapture *ac);
 
 /* Control */
@@ -37,6 +45,7 @@ void audio_capture_set_callback(AudioCapture *ac, AudioCallback callback, void *
 uint32_t audio_capture_get_sample_rate(AudioCapture *ac);
 uint16_t audio_capture_get_channels(AudioCapture *ac);
 uint16_t audio_capture_get_bits_per_sample(AudioCapture *ac);
+AudioCodec audio_capture_get_codec(AudioCapture *ac);
 
 #ifdef __cplusplus
 }
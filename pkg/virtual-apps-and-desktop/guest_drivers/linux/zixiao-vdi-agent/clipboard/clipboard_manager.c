@@ -4,41 +4,131 @@
  * Copyright (c) 2025 Zixiao System
  * SPDX-License-Identifier: Apache-2.0
  *
- * Uses X11 selections (CLIPBOARD and PRIMARY) for clipboard sync.
+ * Uses the X11 CLIPBOARD selection for clipboard sync. Owner changes
+ * come from XFixes (or owner polling without it) and only announce the
+ * formats on offer; data is converted when the remote side asks,
+ * reading INCR transfers chunk by chunk.
  */
 
 #include "clipboard_manager.h"
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/extensions/Xfixes.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/* Owners that do not answer a conversion in time are given up on */
+#define CLIPBOARD_CONVERT_TIMEOUT_MS    2000
+
+/* Owner polling interval without XFixes */
+#define CLIPBOARD_POLL_INTERVAL_MS      500
+
+/* Largest selection transferred */
+#define CLIPBOARD_MAX_SIZE              (64 * 1024 * 1024)
+
+/* Property bytes read per round trip */
+#define CLIPBOARD_READ_CHUNK            (1024 * 1024)
+
+typedef struct {
+    ClipboardFormat format;
+    const char     *atom_name;
+    const char     *mime_type;
+} ClipboardTarget;
+
+/* X targets carried, preferred first within a format */
+static const ClipboardTarget clipboard_targets[] = {
+    { CLIPBOARD_FORMAT_UTF8,      "UTF8_STRING",              "text/plain;charset=utf-8" },
+    { CLIPBOARD_FORMAT_UTF8,      "text/plain;charset=utf-8", "text/plain;charset=utf-8" },
+    { CLIPBOARD_FORMAT_TEXT,      "STRING",                   "text/plain" },
+    { CLIPBOARD_FORMAT_HTML,      "text/html",                "text/html" },
+    { CLIPBOARD_FORMAT_IMAGE_PNG, "image/png",                "image/png" },
+    { CLIPBOARD_FORMAT_IMAGE_BMP, "image/bmp",                "image/bmp" },
+};
+
+#define CLIPBOARD_NUM_TARGETS (sizeof(clipboard_targets) / sizeof(clipboard_targets[0]))
 
 struct ClipboardManager {
-    /* Callback */
-    ClipboardCallback callback;
-    void             *callback_data;
+    /* Callbacks */
+    ClipboardCallback       callback;
+    void                   *callback_data;
+    ClipboardOfferCallback  offer_callback;
+    void                   *offer_callback_data;
 
     /* State */
     bool              running;
     bool              stopping;
     pthread_t         monitor_thread;
+    int               wake_fd;          /* requests, remote content, stop */
 
     /* X11 */
     Display          *display;
     Window            window;
     Atom              clipboard_atom;
     Atom              targets_atom;
-    Atom              utf8_string_atom;
     Atom              incr_atom;
-
-    /* Last clipboard content (to detect changes) */
-    char             *last_text;
-    size_t            last_text_len;
-
-    /* Ignore flag for self-set */
-    bool              ignore_next;
+    Atom              targets_prop;
+    Atom              data_prop;
+    Atom              target_atoms[CLIPBOARD_NUM_TARGETS];
+    bool              use_xfixes;
+    int               xfixes_event_base;
+    Window            last_owner;       /* owner polling */
+    uint64_t          next_poll_ms;
+
+    /* Conversion in flight; one at a time, on the monitor thread */
+    Atom              convert_target;   /* None when idle */
+    size_t            convert_index;
+    uint64_t          convert_deadline_ms;
+    bool              incr;
+    bool              targets_wanted;   /* new owner, not yet offered */
+    uint32_t          offered_targets;  /* bit per clipboard_targets entry */
+    uint8_t          *fetch_buf;        /* only ever grows */
+    size_t            fetch_len;
+    size_t            fetch_capacity;
+
+    /* Shared with the transport threads */
+    pthread_mutex_t   mutex;
+    uint32_t          pending;          /* requested formats, bit per ClipboardFormat */
+    bool              claim;            /* remote content waiting for ownership */
+    bool              owned;
+    ClipboardFormat   own_format;
+    uint8_t          *own_data;
+    size_t            own_size;
+    uint64_t          own_hash;
 };
 
 static void *monitor_thread_func(void *arg);
-static char *get_clipboard_text(ClipboardManager *cm);
+
+/*
+ * 64-bit multiply-xorshift over words; equal content hashes equal, and
+ * a collision needs equal sizes as well to be mistaken for a match.
+ */
+uint64_t clipboard_hash(const uint8_t *data, size_t size) {
+    const uint64_t k = 0xff51afd7ed558ccdULL;
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ size;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * k;
+        h ^= h >> 32;
+    }
+    if (i < size) {
+        uint64_t w = 0;
+        memcpy(&w, data + i, size - i);
+        h = (h ^ w) * k;
+    }
+    h ^= h >> 29;
+
+    return h ? h : 1;
+}
+
+static int clipboard_target_index(ClipboardFormat format) {
+    for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+        if (clipboard_targets[i].format == format) return (int)i;
+    }
+    return -1;
+}
 
 ClipboardManager *clipboard_manager_create(void) {
     ClipboardManager *cm = zixiao_calloc(1, sizeof(ClipboardManager));
@@ -46,7 +136,9 @@ ClipboardManager *clipboard_manager_create(void) {
 
     cm->running = false;
     cm->stopping = false;
-    cm->ignore_next = false;
+    cm->wake_fd = -1;
+    cm->convert_target = None;
+    pthread_mutex_init(&cm->mutex, NULL);
 
     return cm;
 }
@@ -56,9 +148,9 @@ void clipboard_manager_destroy(ClipboardManager *cm) {
 
     clipboard_manager_shutdown(cm);
 
-    if (cm->last_text) {
-        zixiao_free(cm->last_text);
-    }
+    zixiao_free(cm->own_data);
+    zixiao_free(cm->fetch_buf);
+    pthread_mutex_destroy(&cm->mutex);
 
     zixiao_free(cm);
 }
@@ -89,11 +181,36 @@ bool clipboard_manager_init(ClipboardManager *cm) {
         return false;
     }
 
+    cm->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cm->wake_fd < 0) {
+        LOG_ERROR("Failed to create clipboard wake fd: %s", strerror(errno));
+        XDestroyWindow(cm->display, cm->window);
+        XCloseDisplay(cm->display);
+        cm->window = 0;
+        cm->display = NULL;
+        return false;
+    }
+
     /* Get atoms */
     cm->clipboard_atom = XInternAtom(cm->display, "CLIPBOARD", False);
     cm->targets_atom = XInternAtom(cm->display, "TARGETS", False);
-    cm->utf8_string_atom = XInternAtom(cm->display, "UTF8_STRING", False);
     cm->incr_atom = XInternAtom(cm->display, "INCR", False);
+    cm->targets_prop = XInternAtom(cm->display, "ZIXIAO_TARGETS", False);
+    cm->data_prop = XInternAtom(cm->display, "ZIXIAO_CLIP", False);
+    for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+        cm->target_atoms[i] = XInternAtom(cm->display, clipboard_targets[i].atom_name, False);
+    }
+
+    /* INCR chunks arrive as property changes on our window */
+    XSelectInput(cm->display, cm->window, PropertyChangeMask);
+
+    int error_base;
+    cm->use_xfixes = XFixesQueryExtension(cm->display, &cm->xfixes_event_base, &error_base);
+    if (cm->use_xfixes) {
+        XFixesSelectSelectionInput(cm->display, cm->window, cm->clipboard_atom,
+                                   XFixesSetSelectionOwnerNotifyMask);
+    }
+    LOG_INFO("Clipboard owner changes via %s", cm->use_xfixes ? "XFixes" : "polling");
 
     LOG_INFO("Clipboard manager initialized");
     return true;
@@ -114,9 +231,21 @@ void clipboard_manager_shutdown(ClipboardManager *cm) {
         cm->display = NULL;
     }
 
+    if (cm->wake_fd >= 0) {
+        close(cm->wake_fd);
+        cm->wake_fd = -1;
+    }
+
     LOG_INFO("Clipboard manager shutdown");
 }
 
+static void clipboard_manager_wake(ClipboardManager *cm) {
+    uint64_t one = 1;
+    if (write(cm->wake_fd, &one, sizeof(one)) < 0) {
+        /* EAGAIN: the counter is far from zero, the thread wakes anyway */
+    }
+}
+
 bool clipboard_manager_start(ClipboardManager *cm) {
     if (!cm || !cm->display || cm->running) return false;
 
@@ -143,14 +272,7 @@ void clipboard_manager_stop(ClipboardManager *cm) {
     cm->stopping = true;
     cm->running = false;
 
-    /* Send dummy event to wake up monitor thread */
-    if (cm->display && cm->window) {
-        XEvent ev = {0};
-        ev.type = ClientMessage;
-        XSendEvent(cm->display, cm->window, False, 0, &ev);
-        XFlush(cm->display);
-    }
-
+    clipboard_manager_wake(cm);
     pthread_join(cm->monitor_thread, NULL);
 
     LOG_INFO("Clipboard manager stopped");
@@ -160,227 +282,543 @@ bool clipboard_manager_is_running(ClipboardManager *cm) {
     return cm && cm->running;
 }
 
+void clipboard_manager_set_offer_callback(ClipboardManager *cm, ClipboardOfferCallback callback,
+                                          void *user_data) {
+    if (!cm) return;
+    cm->offer_callback = callback;
+    cm->offer_callback_data = user_data;
+}
+
 void clipboard_manager_set_callback(ClipboardManager *cm, ClipboardCallback callback, void *user_data) {
     if (!cm) return;
     cm->callback = callback;
     cm->callback_data = user_data;
 }
 
+bool clipboard_manager_request(ClipboardManager *cm, ClipboardFormat format) {
+    if (!cm || !cm->running || clipboard_target_index(format) < 0) return false;
+
+    pthread_mutex_lock(&cm->mutex);
+    cm->pending |= 1u << format;
+    pthread_mutex_unlock(&cm->mutex);
+
+    clipboard_manager_wake(cm);
+    return true;
+}
+
 bool clipboard_manager_set(ClipboardManager *cm, const ClipboardData *data) {
-    if (!cm || !cm->display || !data) return false;
+    if (!cm || !cm->display || !data || (!data->data && data->data_size > 0)) return false;
 
-    if (data->format != CLIPBOARD_FORMAT_TEXT &&
-        data->format != CLIPBOARD_FORMAT_UTF8) {
-        LOG_WARNING("Only text clipboard supported currently");
+    if (clipboard_target_index(data->format) < 0) {
+        LOG_WARNING("Clipboard format %d not supported", data->format);
         return false;
     }
 
-    /* Update our stored text */
-    if (cm->last_text) {
-        zixiao_free(cm->last_text);
+    uint64_t hash = clipboard_hash(data->data, data->data_size);
+
+    pthread_mutex_lock(&cm->mutex);
+
+    /* The host resending what we hold changes nothing on this side */
+    if ((cm->owned || cm->claim) && cm->own_format == data->format &&
+        cm->own_size == data->data_size && cm->own_hash == hash &&
+        (data->data_size == 0 || memcmp(cm->own_data, data->data, data->data_size) == 0)) {
+        pthread_mutex_unlock(&cm->mutex);
+        LOG_DEBUG("Clipboard unchanged: %zu bytes", data->data_size);
+        return true;
     }
 
-    cm->last_text = zixiao_malloc(data->data_size + 1);
-    if (!cm->last_text) return false;
+    uint8_t *copy = zixiao_malloc(data->data_size ? data->data_size : 1);
+    if (!copy) {
+        pthread_mutex_unlock(&cm->mutex);
+        return false;
+    }
+    memcpy(copy, data->data, data->data_size);
 
-    memcpy(cm->last_text, data->data, data->data_size);
-    cm->last_text[data->data_size] = '\0';
-    cm->last_text_len = data->data_size;
+    zixiao_free(cm->own_data);
+    cm->own_data = copy;
+    cm->own_size = data->data_size;
+    cm->own_format = data->format;
+    cm->own_hash = hash;
+    cm->claim = true;
 
-    /* Take ownership of CLIPBOARD selection */
-    XSetSelectionOwner(cm->display, cm->clipboard_atom, cm->window, CurrentTime);
-    XFlush(cm->display);
+    pthread_mutex_unlock(&cm->mutex);
 
-    cm->ignore_next = true;
+    /* The monitor thread takes the selection */
+    clipboard_manager_wake(cm);
 
     LOG_DEBUG("Set clipboard: %zu bytes", data->data_size);
     return true;
 }
 
 bool clipboard_manager_get(ClipboardManager *cm, ClipboardData *data) {
-    if (!cm || !cm->display || !data) return false;
+    if (!cm || !data) return false;
 
-    char *text = get_clipboard_text(cm);
-    if (!text) return false;
+    pthread_mutex_lock(&cm->mutex);
 
-    data->format = CLIPBOARD_FORMAT_UTF8;
-    data->data_size = strlen(text);
-    data->data = (uint8_t *)zixiao_malloc(data->data_size);
-    if (!data->data) {
-        XFree(text);
+    if (!cm->own_data) {
+        pthread_mutex_unlock(&cm->mutex);
         return false;
     }
 
-    memcpy(data->data, text, data->data_size);
-    data->mime_type = zixiao_strdup("text/plain;charset=utf-8");
+    data->format = cm->own_format;
+    data->data_size = cm->own_size;
+    data->hash = cm->own_hash;
+    data->data = (uint8_t *)zixiao_malloc(cm->own_size ? cm->own_size : 1);
+    if (!data->data) {
+        pthread_mutex_unlock(&cm->mutex);
+        return false;
+    }
+    memcpy(data->data, cm->own_data, cm->own_size);
+    data->mime_type = zixiao_strdup(clipboard_targets[clipboard_target_index(cm->own_format)].mime_type);
 
-    XFree(text);
+    pthread_mutex_unlock(&cm->mutex);
     return true;
 }
 
-static char *get_clipboard_text(ClipboardManager *cm) {
-    Atom property = XInternAtom(cm->display, "ZIXIAO_CLIP", False);
+/* ---- Conversions (monitor thread) ---- */
 
-    /* Request clipboard content */
-    XConvertSelection(
-        cm->display,
-        cm->clipboard_atom,
-        cm->utf8_string_atom,
-        property,
-        cm->window,
-        CurrentTime
-    );
-    XFlush(cm->display);
+static void start_conversion(ClipboardManager *cm, Atom target, Atom property) {
+    XDeleteProperty(cm->display, cm->window, property);
+    XConvertSelection(cm->display, cm->clipboard_atom, target, property, cm->window, CurrentTime);
 
-    /* Wait for SelectionNotify event */
-    XEvent ev;
-    int timeout = 100;
-    while (timeout-- > 0) {
-        if (XCheckTypedWindowEvent(cm->display, cm->window, SelectionNotify, &ev)) {
-            break;
-        }
-        usleep(10000);
+    cm->convert_target = target;
+    cm->convert_deadline_ms = get_timestamp_ms() + CLIPBOARD_CONVERT_TIMEOUT_MS;
+    cm->incr = false;
+    cm->fetch_len = 0;
+}
+
+static void finish_conversion(ClipboardManager *cm) {
+    cm->convert_target = None;
+    cm->incr = false;
+}
+
+static bool fetch_append(ClipboardManager *cm, const uint8_t *data, size_t size) {
+    if (cm->fetch_len + size > CLIPBOARD_MAX_SIZE) {
+        LOG_WARNING("Clipboard content over %d bytes not transferred", CLIPBOARD_MAX_SIZE);
+        return false;
     }
 
-    if (timeout <= 0) {
-        return NULL;
+    if (cm->fetch_len + size > cm->fetch_capacity) {
+        size_t capacity = cm->fetch_capacity ? cm->fetch_capacity : 64 * 1024;
+        while (capacity < cm->fetch_len + size) {
+            capacity *= 2;
+        }
+        uint8_t *buf = zixiao_realloc(cm->fetch_buf, capacity);
+        if (!buf) return false;
+        cm->fetch_buf = buf;
+        cm->fetch_capacity = capacity;
     }
 
-    /* Check if conversion succeeded */
-    if (ev.xselection.property == None) {
-        return NULL;
+    memcpy(cm->fetch_buf + cm->fetch_len, data, size);
+    cm->fetch_len += size;
+    return true;
+}
+
+/*
+ * Append a property's bytes to the fetch buffer, a chunk per round
+ * trip, then delete it; during INCR the deletion asks for the next
+ * chunk. *type is the property type, INCR included.
+ */
+static bool read_property(ClipboardManager *cm, Atom property, Atom *type) {
+    long offset = 0;
+
+    for (;;) {
+        int format;
+        unsigned long nitems, bytes_after;
+        unsigned char *chunk = NULL;
+
+        if (XGetWindowProperty(cm->display, cm->window, property, offset,
+                               CLIPBOARD_READ_CHUNK / 4, False, AnyPropertyType,
+                               type, &format, &nitems, &bytes_after, &chunk) != Success) {
+            return false;
+        }
+
+        if (*type == cm->incr_atom) {
+            /* The value is only a size hint */
+            XFree(chunk);
+            break;
+        }
+
+        bool ok = (format == 8 || nitems == 0) && fetch_append(cm, chunk, nitems);
+        if (chunk) XFree(chunk);
+        if (!ok) {
+            XDeleteProperty(cm->display, cm->window, property);
+            return false;
+        }
+
+        if (bytes_after == 0) break;
+        offset += (long)(nitems / 4);
     }
 
-    /* Get property data */
+    XDeleteProperty(cm->display, cm->window, property);
+    return true;
+}
+
+static void deliver_fetched(ClipboardManager *cm, size_t index) {
+    if (!cm->callback) return;
+
+    ClipboardData data = {
+        .format = clipboard_targets[index].format,
+        .data = cm->fetch_buf,
+        .data_size = cm->fetch_len,
+        .mime_type = (char *)clipboard_targets[index].mime_type,
+        .hash = clipboard_hash(cm->fetch_buf, cm->fetch_len)
+    };
+
+    LOG_DEBUG("Clipboard %s: %zu bytes", clipboard_targets[index].atom_name, cm->fetch_len);
+    cm->callback(&data, cm->callback_data);
+}
+
+/* The owner's TARGETS decide what is offered, and later converted */
+static void offer_targets(ClipboardManager *cm, Atom property) {
     Atom type;
     int format;
-    unsigned long nitems, bytes_after;
-    unsigned char *data = NULL;
+    unsigned long nitems = 0, bytes_after;
+    unsigned char *value = NULL;
+
+    cm->offered_targets = 0;
+
+    if (property != None &&
+        XGetWindowProperty(cm->display, cm->window, property, 0, 1024, True, XA_ATOM,
+                           &type, &format, &nitems, &bytes_after, &value) == Success &&
+        value && format == 32) {
+        /* Format 32 comes back as an array of long, which Atom is */
+        const Atom *atoms = (const Atom *)value;
+        for (unsigned long n = 0; n < nitems; n++) {
+            for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+                if (atoms[n] == cm->target_atoms[i]) {
+                    cm->offered_targets |= 1u << i;
+                }
+            }
+        }
+    } else {
+        /* Owners without TARGETS: assume text */
+        cm->offered_targets = 1u << clipboard_target_index(CLIPBOARD_FORMAT_UTF8);
+    }
+    if (value) XFree(value);
 
-    XGetWindowProperty(
-        cm->display,
-        cm->window,
-        property,
-        0, 1024 * 1024,
-        True,
-        AnyPropertyType,
-        &type,
-        &format,
-        &nitems,
-        &bytes_after,
-        &data
-    );
+    ClipboardFormat formats[CLIPBOARD_NUM_TARGETS];
+    uint32_t count = 0;
+    for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+        if (!(cm->offered_targets & (1u << i))) continue;
 
-    if (!data || nitems == 0) {
-        if (data) XFree(data);
-        return NULL;
+        bool seen = false;
+        for (uint32_t j = 0; j < count; j++) {
+            seen |= formats[j] == clipboard_targets[i].format;
+        }
+        if (!seen) {
+            formats[count++] = clipboard_targets[i].format;
+        }
     }
 
-    /* Make a copy */
-    char *result = zixiao_malloc(nitems + 1);
-    if (result) {
-        memcpy(result, data, nitems);
-        result[nitems] = '\0';
+    if (count > 0 && cm->offer_callback) {
+        cm->offer_callback(formats, count, cm->offer_callback_data);
     }
+}
 
-    XFree(data);
-    return result;
+static void on_owner_changed(ClipboardManager *cm, Window owner) {
+    /* Our own claim coming back, or nothing on offer */
+    if (owner == cm->window || owner == None) return;
+
+    cm->targets_wanted = true;
 }
 
-static void *monitor_thread_func(void *arg) {
-    ClipboardManager *cm = (ClipboardManager *)arg;
+static void on_selection_notify(ClipboardManager *cm, const XSelectionEvent *sel) {
+    if (cm->convert_target == None || sel->target != cm->convert_target) return;
 
-    LOG_DEBUG("Clipboard monitor thread started");
+    if (sel->target == cm->targets_atom) {
+        offer_targets(cm, sel->property);
+        finish_conversion(cm);
+        return;
+    }
 
-    /* Select for property changes and selection events */
-    XSelectInput(cm->display, cm->window, PropertyChangeMask);
+    if (sel->property == None) {
+        LOG_DEBUG("Clipboard owner refused %s", clipboard_targets[cm->convert_index].atom_name);
+        finish_conversion(cm);
+        return;
+    }
 
-    while (!cm->stopping) {
-        /* Poll for clipboard changes */
-        char *text = get_clipboard_text(cm);
+    Atom type = None;
+    if (!read_property(cm, sel->property, &type)) {
+        finish_conversion(cm);
+        return;
+    }
+
+    if (type == cm->incr_atom) {
+        /* Deleting the property started the chunked transfer */
+        cm->incr = true;
+        cm->fetch_len = 0;
+        cm->convert_deadline_ms = get_timestamp_ms() + CLIPBOARD_CONVERT_TIMEOUT_MS;
+        return;
+    }
+
+    deliver_fetched(cm, cm->convert_index);
+    finish_conversion(cm);
+}
+
+static void on_incr_chunk(ClipboardManager *cm) {
+    size_t before = cm->fetch_len;
+    Atom type = None;
+
+    if (!read_property(cm, cm->data_prop, &type)) {
+        finish_conversion(cm);
+        return;
+    }
+
+    /* A zero-length chunk ends the transfer */
+    if (cm->fetch_len == before) {
+        deliver_fetched(cm, cm->convert_index);
+        finish_conversion(cm);
+        return;
+    }
+
+    cm->convert_deadline_ms = get_timestamp_ms() + CLIPBOARD_CONVERT_TIMEOUT_MS;
+}
+
+/* Requests for content we own are answered without a round trip */
+static bool deliver_owned(ClipboardManager *cm, ClipboardFormat format) {
+    pthread_mutex_lock(&cm->mutex);
+
+    bool have = cm->owned && cm->own_data && cm->own_format == format;
+    if (have) {
+        cm->fetch_len = 0;
+        have = fetch_append(cm, cm->own_data, cm->own_size);
+    }
+
+    pthread_mutex_unlock(&cm->mutex);
+
+    if (have) {
+        deliver_fetched(cm, (size_t)clipboard_target_index(format));
+    }
+    return have;
+}
 
-        if (text) {
-            bool changed = false;
+static void start_next_conversion(ClipboardManager *cm) {
+    while (cm->convert_target == None) {
+        if (cm->targets_wanted) {
+            cm->targets_wanted = false;
+            start_conversion(cm, cm->targets_atom, cm->targets_prop);
+            return;
+        }
 
-            if (!cm->last_text) {
-                changed = true;
-            } else if (strcmp(text, cm->last_text) != 0) {
-                changed = true;
+        /* One requested format at a time */
+        pthread_mutex_lock(&cm->mutex);
+        uint32_t pending = cm->pending;
+        ClipboardFormat format = CLIPBOARD_FORMAT_NONE;
+        if (pending) {
+            format = (ClipboardFormat)__builtin_ctz(pending);
+            cm->pending &= ~(1u << format);
+        }
+        pthread_mutex_unlock(&cm->mutex);
+
+        if (format == CLIPBOARD_FORMAT_NONE) return;
+        if (deliver_owned(cm, format)) continue;
+
+        /* Prefer a target the owner listed */
+        int index = -1;
+        for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+            if (clipboard_targets[i].format != format) continue;
+            if (index < 0) index = (int)i;
+            if (cm->offered_targets & (1u << i)) {
+                index = (int)i;
+                break;
             }
+        }
 
-            if (changed && !cm->ignore_next && cm->callback) {
-                /* Update stored text */
-                if (cm->last_text) {
-                    zixiao_free(cm->last_text);
-                }
-                cm->last_text = zixiao_strdup(text);
-                cm->last_text_len = strlen(text);
-
-                /* Notify callback */
-                ClipboardData data = {
-                    .format = CLIPBOARD_FORMAT_UTF8,
-                    .data = (uint8_t *)text,
-                    .data_size = strlen(text),
-                    .mime_type = "text/plain;charset=utf-8"
-                };
-
-                cm->callback(&data, cm->callback_data);
+        cm->convert_index = (size_t)index;
+        start_conversion(cm, cm->target_atoms[index], cm->data_prop);
+    }
+}
+
+/* Take the selection for content the remote side set */
+static void apply_claim(ClipboardManager *cm) {
+    pthread_mutex_lock(&cm->mutex);
+    bool claim = cm->claim;
+    cm->claim = false;
+    pthread_mutex_unlock(&cm->mutex);
+
+    if (!claim) return;
+
+    XSetSelectionOwner(cm->display, cm->clipboard_atom, cm->window, CurrentTime);
+    bool owned = XGetSelectionOwner(cm->display, cm->clipboard_atom) == cm->window;
+
+    pthread_mutex_lock(&cm->mutex);
+    cm->owned = owned;
+    pthread_mutex_unlock(&cm->mutex);
+
+    if (!owned) {
+        LOG_WARNING("Failed to take clipboard ownership");
+    }
+}
+
+static bool target_matches(ClipboardManager *cm, Atom target, ClipboardFormat format) {
+    for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+        if (cm->target_atoms[i] != target) continue;
+
+        ClipboardFormat f = clipboard_targets[i].format;
+        if (f == format) return true;
+
+        /* Plain and UTF-8 text are served from either */
+        bool text = f == CLIPBOARD_FORMAT_UTF8 || f == CLIPBOARD_FORMAT_TEXT;
+        bool own_text = format == CLIPBOARD_FORMAT_UTF8 || format == CLIPBOARD_FORMAT_TEXT;
+        if (text && own_text) return true;
+    }
+    return false;
+}
+
+/* A local application pasting what the remote side set */
+static void serve_request(ClipboardManager *cm, const XSelectionRequestEvent *req) {
+    XEvent response = {0};
+    response.xselection.type = SelectionNotify;
+    response.xselection.requestor = req->requestor;
+    response.xselection.selection = req->selection;
+    response.xselection.target = req->target;
+    response.xselection.time = req->time;
+    response.xselection.property = None;
+
+    long max_request = XExtendedMaxRequestSize(cm->display);
+    if (max_request == 0) {
+        max_request = XMaxRequestSize(cm->display);
+    }
+    size_t max_bytes = (size_t)max_request * 4 - 64;
+
+    pthread_mutex_lock(&cm->mutex);
+
+    if (cm->own_data && req->target == cm->targets_atom) {
+        Atom targets[CLIPBOARD_NUM_TARGETS + 1];
+        int count = 0;
+        targets[count++] = cm->targets_atom;
+        for (size_t i = 0; i < CLIPBOARD_NUM_TARGETS; i++) {
+            if (target_matches(cm, cm->target_atoms[i], cm->own_format)) {
+                targets[count++] = cm->target_atoms[i];
             }
+        }
+        XChangeProperty(cm->display, req->requestor, req->property, XA_ATOM, 32,
+                        PropModeReplace, (unsigned char *)targets, count);
+        response.xselection.property = req->property;
+    } else if (cm->own_data && target_matches(cm, req->target, cm->own_format)) {
+        if (cm->own_size <= max_bytes) {
+            XChangeProperty(cm->display, req->requestor, req->property, req->target, 8,
+                            PropModeReplace, cm->own_data, (int)cm->own_size);
+            response.xselection.property = req->property;
+        } else {
+            LOG_WARNING("Clipboard content of %zu bytes exceeds X request size", cm->own_size);
+        }
+    }
+
+    pthread_mutex_unlock(&cm->mutex);
 
-            cm->ignore_next = false;
-            zixiao_free(text);
+    XSendEvent(cm->display, req->requestor, False, 0, &response);
+}
+
+static void handle_event(ClipboardManager *cm, XEvent *ev) {
+    if (cm->use_xfixes && ev->type == cm->xfixes_event_base + XFixesSelectionNotify) {
+        const XFixesSelectionNotifyEvent *sn = (const XFixesSelectionNotifyEvent *)ev;
+        if (sn->selection == cm->clipboard_atom) {
+            on_owner_changed(cm, sn->owner);
         }
+        return;
+    }
 
-        /* Handle X events (for selection requests) */
+    switch (ev->type) {
+        case SelectionNotify:
+            on_selection_notify(cm, &ev->xselection);
+            break;
+
+        case PropertyNotify:
+            if (cm->incr && ev->xproperty.atom == cm->data_prop &&
+                ev->xproperty.state == PropertyNewValue) {
+                on_incr_chunk(cm);
+            }
+            break;
+
+        case SelectionRequest:
+            serve_request(cm, &ev->xselectionrequest);
+            break;
+
+        case SelectionClear:
+            /* Someone copied locally; what the remote side set is gone */
+            pthread_mutex_lock(&cm->mutex);
+            cm->owned = false;
+            zixiao_free(cm->own_data);
+            cm->own_data = NULL;
+            cm->own_size = 0;
+            pthread_mutex_unlock(&cm->mutex);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void *monitor_thread_func(void *arg) {
+    ClipboardManager *cm = (ClipboardManager *)arg;
+
+    LOG_DEBUG("Clipboard monitor thread started");
+
+    /* Offer what is on the clipboard already */
+    cm->last_owner = XGetSelectionOwner(cm->display, cm->clipboard_atom);
+    on_owner_changed(cm, cm->last_owner);
+    cm->next_poll_ms = get_timestamp_ms() + CLIPBOARD_POLL_INTERVAL_MS;
+
+    struct pollfd pfds[2] = {
+        { .fd = ConnectionNumber(cm->display), .events = POLLIN },
+        { .fd = cm->wake_fd, .events = POLLIN }
+    };
+
+    while (!cm->stopping) {
         while (XPending(cm->display)) {
             XEvent ev;
             XNextEvent(cm->display, &ev);
+            handle_event(cm, &ev);
+        }
 
-            if (ev.type == SelectionRequest) {
-                /* Someone requested our clipboard content */
-                XSelectionRequestEvent *req = &ev.xselectionrequest;
-                XEvent response = {0};
-                response.xselection.type = SelectionNotify;
-                response.xselection.requestor = req->requestor;
-                response.xselection.selection = req->selection;
-                response.xselection.target = req->target;
-                response.xselection.time = req->time;
-                response.xselection.property = None;
-
-                if (cm->last_text && req->target == cm->utf8_string_atom) {
-                    XChangeProperty(
-                        cm->display,
-                        req->requestor,
-                        req->property,
-                        cm->utf8_string_atom,
-                        8,
-                        PropModeReplace,
-                        (unsigned char *)cm->last_text,
-                        cm->last_text_len
-                    );
-                    response.xselection.property = req->property;
-                } else if (req->target == cm->targets_atom) {
-                    Atom targets[] = { cm->targets_atom, cm->utf8_string_atom, XA_STRING };
-                    XChangeProperty(
-                        cm->display,
-                        req->requestor,
-                        req->property,
-                        XA_ATOM,
-                        32,
-                        PropModeReplace,
-                        (unsigned char *)targets,
-                        3
-                    );
-                    response.xselection.property = req->property;
-                }
+        uint64_t now = get_timestamp_ms();
+
+        if (cm->convert_target != None && now >= cm->convert_deadline_ms) {
+            LOG_WARNING("Clipboard owner did not answer");
+            XDeleteProperty(cm->display, cm->window,
+                            cm->convert_target == cm->targets_atom ? cm->targets_prop
+                                                                   : cm->data_prop);
+            finish_conversion(cm);
+        }
 
-                XSendEvent(cm->display, req->requestor, False, 0, &response);
-                XFlush(cm->display);
+        if (!cm->use_xfixes && now >= cm->next_poll_ms) {
+            Window owner = XGetSelectionOwner(cm->display, cm->clipboard_atom);
+            if (owner != cm->last_owner) {
+                cm->last_owner = owner;
+                on_owner_changed(cm, owner);
             }
+            cm->next_poll_ms = now + CLIPBOARD_POLL_INTERVAL_MS;
         }
 
-        /* Sleep before next poll */
-        usleep(500000);  /* 500ms */
+        apply_claim(cm);
+        start_next_conversion(cm);
+        XFlush(cm->display);
+
+        /* Events already read into Xlib's queue do not show on the fd */
+        if (XPending(cm->display)) continue;
+
+        int timeout = -1;
+        if (cm->convert_target != None) {
+            timeout = (int)(cm->convert_deadline_ms > now ? cm->convert_deadline_ms - now : 0);
+        }
+        if (!cm->use_xfixes) {
+            int poll_ms = (int)(cm->next_poll_ms > now ? cm->next_poll_ms - now : 0);
+            timeout = (timeout < 0 || poll_ms < timeout) ? poll_ms : timeout;
+        }
+
+        if (poll(pfds, 2, timeout) < 0 && errno != EINTR) {
+            LOG_ERROR("poll failed: %s", strerror(errno));
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(cm->wake_fd, &count, sizeof(count)) < 0) {
+                /* EAGAIN: another pass already drained it */
+            }
+        }
     }
 
     LOG_DEBUG("Clipboard monitor thread exiting");
@@ -30,15 +30,28 @@ bool clipboard_manager_start(ClipboardManager *cm);
 void clipboard_manager_stop(ClipboardManager *cm);
 bool clipboard_manager_is_running(ClipboardManager *cm);
 
-/* Callback for clipboard changes */
+/*
+ * Transfer is lazy: a new local selection only announces its formats
+ * to the offer callback. Data is fetched when the remote side asks for
+ * a format with clipboard_manager_request, and handed to the data
+ * callback from the clipboard thread.
+ */
+void clipboard_manager_set_offer_callback(ClipboardManager *cm, ClipboardOfferCallback callback,
+                                          void *user_data);
 void clipboard_manager_set_callback(ClipboardManager *cm, ClipboardCallback callback, void *user_data);
 
-/* Set clipboard from remote */
+/* Ask for the local selection in one of the offered formats */
+bool clipboard_manager_request(ClipboardManager *cm, ClipboardFormat format);
+
+/* Set clipboard from remote; content equal to what is held is a no-op */
 bool clipboard_manager_set(ClipboardManager *cm, const ClipboardData *data);
 
-/* Get current clipboard */
+/* Get a copy of the clipboard content set from remote, while it is held */
 bool clipboard_manager_get(ClipboardManager *cm, ClipboardData *data);
 
+/* Content hash as carried in ClipboardData.hash; never 0 */
+uint64_t clipboard_hash(const uint8_t *data, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,21 @@
  * SPDX-License-Identifier: Apache-2.0
  *
  * Supports X11 (XShm) and PipeWire (for Wayland) screen capture.
+ *
+ * Frames live in a fixed ring of page-aligned buffers, each its own
+ * XShm segment, so the X server writes a frame straight into the
+ * buffer the encoder reads and nothing is allocated per frame. Buffers
+ * are reference counted; a frame is captured into a free one while
+ * the encoder still holds the previous ones.
+ *
+ * With XDamage only changed areas are read back. Each buffer keeps a
+ * server-side region of the damage it has missed, and bringing it up
+ * to date reads just those rectangles, through a scratch segment.
+ * Ticks without damage produce no frame, and the thread then sleeps
+ * until the X server reports some.
+ *
+ * A context may capture one monitor of a multi-head screen: it reads
+ * only that part of the root window, and clips damage to it.
  */
 
 #include "display_capture.h"
@@ -12,8 +27,36 @@
 #include <X11/Xutil.h>
 #include <X11/extensions/XShm.h>
 #include <X11/extensions/Xrandr.h>
+#include <X11/extensions/Xdamage.h>
+#include <X11/extensions/Xfixes.h>
+#include <stdatomic.h>
 #include <sys/shm.h>
 #include <sys/ipc.h>
+#include <poll.h>
+#include <sched.h>
+
+/* More rectangles than this are read as one full frame */
+#define DISPLAY_MAX_DIRTY_RECTS 64
+
+/* Frame buffers: one being captured, the rest queued for or held by
+ * the encoder */
+#define DISPLAY_FRAME_BUFFERS   4
+
+/* Longest sleep waiting for damage, so a stop is noticed */
+#define DISPLAY_IDLE_WAIT_MS    100
+
+/* Monitors looked at when picking one */
+#define DISPLAY_MAX_ENUM        16
+
+typedef struct FrameBuffer {
+    DisplayCapture      *owner;
+    atomic_int           refs;
+    uint8_t             *data;
+    XImage              *image;         /* XShm image over data */
+    XShmSegmentInfo      shm_info;
+    XserverRegion        stale;         /* damage not yet read into data */
+    FrameRect            dirty[DISPLAY_MAX_DIRTY_RECTS];
+} FrameBuffer;
 
 struct DisplayCapture {
     /* Configuration */
@@ -30,28 +73,50 @@ struct DisplayCapture {
     Display             *display;
     Window               root;
     int                  screen;
-    XImage              *image;
-    XShmSegmentInfo      shm_info;
     bool                 use_shm;
 
+    /* Frame ring */
+    FrameBuffer          buffers[DISPLAY_FRAME_BUFFERS];
+    uint32_t             next_buffer;
+    uint32_t             stride;
+    size_t               frame_size;
+
+    /* Area of the root window captured */
+    int                  origin_x;
+    int                  origin_y;
+    uint32_t             monitor;          /* stream index frames carry */
+
+    /* XDamage */
+    bool                 use_damage;
+    bool                 still;            /* the last tick found no damage */
+    Damage               damage;
+    XserverRegion        damage_region;    /* damage of this tick */
+    XserverRegion        report_region;    /* damage since the last frame */
+    XserverRegion        monitor_region;   /* captured area, root coordinates */
+    int                  damage_event_base;
+    XImage              *scratch;
+    XShmSegmentInfo      scratch_info;
+
     /* Screen info */
     int                  width;
     int                  height;
     int                  depth;
 
     /* Timing */
-    uint64_t             frame_interval_us;
+    _Atomic uint64_t     frame_interval_us;    /* set from the transport thread */
     uint64_t             frame_count;
+    uint64_t             frames_dropped;
 };
 
 static void *capture_thread_func(void *arg);
+static int enumerate_crtcs(Display *display, int screen, MonitorInfo *monitors, int max_count);
 
 DisplayCapture *display_capture_create(void) {
     DisplayCapture *dc = zixiao_calloc(1, sizeof(DisplayCapture));
     if (!dc) return NULL;
 
     dc->config.target_fps = 30;
-    dc->config.monitor_id = 0;
+    dc->config.monitor_id = DISPLAY_MONITOR_ALL;
     dc->running = false;
     dc->stopping = false;
     dc->use_shm = false;
@@ -66,6 +131,98 @@ void display_capture_destroy(DisplayCapture *dc) {
     zixiao_free(dc);
 }
 
+/* Create a screen-sized XShm image; shmat memory is page-aligned */
+static XImage *shm_image_create(DisplayCapture *dc, XShmSegmentInfo *info) {
+    XImage *image = XShmCreateImage(
+        dc->display,
+        DefaultVisual(dc->display, dc->screen),
+        dc->depth,
+        ZPixmap,
+        NULL,
+        info,
+        dc->width,
+        dc->height
+    );
+
+    if (!image) {
+        return NULL;
+    }
+
+    info->shmid = shmget(IPC_PRIVATE, (size_t)image->bytes_per_line * image->height, IPC_CREAT | 0600);
+    if (info->shmid < 0) {
+        XDestroyImage(image);
+        return NULL;
+    }
+
+    info->shmaddr = image->data = shmat(info->shmid, NULL, 0);
+    info->readOnly = False;
+
+    /* Marked for removal now, so the segment goes away with the process */
+    if (info->shmaddr == (char *)-1 || !XShmAttach(dc->display, info)) {
+        if (info->shmaddr != (char *)-1) {
+            shmdt(info->shmaddr);
+        }
+        shmctl(info->shmid, IPC_RMID, NULL);
+        image->data = NULL;
+        XDestroyImage(image);
+        return NULL;
+    }
+
+    XSync(dc->display, False);
+    shmctl(info->shmid, IPC_RMID, NULL);
+    return image;
+}
+
+static void shm_image_destroy(DisplayCapture *dc, XImage *image, XShmSegmentInfo *info) {
+    if (!image) return;
+
+    XShmDetach(dc->display, info);
+    shmdt(info->shmaddr);
+    image->data = NULL;
+    XDestroyImage(image);
+}
+
+/* Set up the frame ring: XShm segments, or plain aligned memory */
+static bool display_capture_init_buffers(DisplayCapture *dc, bool try_shm) {
+    int i;
+
+    for (i = 0; try_shm && i < DISPLAY_FRAME_BUFFERS; i++) {
+        FrameBuffer *fb = &dc->buffers[i];
+        fb->image = shm_image_create(dc, &fb->shm_info);
+        if (!fb->image) break;
+        fb->data = (uint8_t *)fb->image->data;
+    }
+
+    if (try_shm && i == DISPLAY_FRAME_BUFFERS) {
+        dc->use_shm = true;
+        dc->stride = dc->buffers[0].image->bytes_per_line;
+    } else {
+        while (i-- > 0) {
+            shm_image_destroy(dc, dc->buffers[i].image, &dc->buffers[i].shm_info);
+            dc->buffers[i].image = NULL;
+        }
+
+        /* XGetImage returns 32-bit pixels for depth 24 and 32 */
+        dc->use_shm = false;
+        dc->stride = (uint32_t)dc->width * (dc->depth > 16 ? 4 : 2);
+        for (i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+            void *data = NULL;
+            if (posix_memalign(&data, (size_t)sysconf(_SC_PAGESIZE),
+                               (size_t)dc->stride * dc->height) != 0) {
+                return false;
+            }
+            dc->buffers[i].data = data;
+        }
+    }
+
+    dc->frame_size = (size_t)dc->stride * dc->height;
+    for (i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+        dc->buffers[i].owner = dc;
+        atomic_init(&dc->buffers[i].refs, 0);
+    }
+    return true;
+}
+
 bool display_capture_init(DisplayCapture *dc, const DisplayCaptureConfig *config) {
     if (!dc) return false;
 
@@ -88,76 +245,114 @@ bool display_capture_init(DisplayCapture *dc, const DisplayCaptureConfig *config
     dc->height = DisplayHeight(dc->display, dc->screen);
     dc->depth = DefaultDepth(dc->display, dc->screen);
 
-    LOG_INFO("Display: %dx%d, depth=%d", dc->width, dc->height, dc->depth);
+    /* One monitor: its part of the root window, at its size */
+    if (dc->config.monitor_id != DISPLAY_MONITOR_ALL) {
+        MonitorInfo monitors[DISPLAY_MAX_ENUM];
+        int count = enumerate_crtcs(dc->display, dc->screen, monitors, DISPLAY_MAX_ENUM);
+
+        if (dc->config.monitor_id >= (uint32_t)count ||
+            dc->config.monitor_id >= ZIXIAO_MAX_MONITORS) {
+            LOG_ERROR("Monitor %u not found (%d present)", dc->config.monitor_id, count);
+            display_capture_shutdown(dc);
+            return false;
+        }
+
+        const MonitorInfo *m = &monitors[dc->config.monitor_id];
+        dc->origin_x = m->x;
+        dc->origin_y = m->y;
+        dc->width = (int)m->width;
+        dc->height = (int)m->height;
+        dc->monitor = dc->config.monitor_id;
+
+        LOG_INFO("Display: monitor %u, %dx%d at +%d+%d, depth=%d", dc->monitor,
+                 dc->width, dc->height, dc->origin_x, dc->origin_y, dc->depth);
+    } else {
+        LOG_INFO("Display: %dx%d, depth=%d", dc->width, dc->height, dc->depth);
+    }
 
     /* Check for XShm extension */
     int major, minor;
     Bool pixmaps;
-    if (XShmQueryVersion(dc->display, &major, &minor, &pixmaps)) {
+    bool have_shm = XShmQueryVersion(dc->display, &major, &minor, &pixmaps);
+    if (have_shm) {
         LOG_INFO("XShm version %d.%d available", major, minor);
+    }
 
-        /* Create shared memory image */
-        dc->image = XShmCreateImage(
-            dc->display,
-            DefaultVisual(dc->display, dc->screen),
-            dc->depth,
-            ZPixmap,
-            NULL,
-            &dc->shm_info,
-            dc->width,
-            dc->height
-        );
-
-        if (dc->image) {
-            dc->shm_info.shmid = shmget(
-                IPC_PRIVATE,
-                dc->image->bytes_per_line * dc->image->height,
-                IPC_CREAT | 0600
-            );
-
-            if (dc->shm_info.shmid >= 0) {
-                dc->shm_info.shmaddr = dc->image->data = shmat(dc->shm_info.shmid, NULL, 0);
-                dc->shm_info.readOnly = False;
-
-                if (XShmAttach(dc->display, &dc->shm_info)) {
-                    dc->use_shm = true;
-                    LOG_INFO("XShm initialized successfully");
-                } else {
-                    LOG_WARNING("XShmAttach failed");
-                    shmdt(dc->shm_info.shmaddr);
-                    shmctl(dc->shm_info.shmid, IPC_RMID, NULL);
-                    XDestroyImage(dc->image);
-                    dc->image = NULL;
-                }
-            } else {
-                XDestroyImage(dc->image);
-                dc->image = NULL;
-            }
-        }
+    if (!display_capture_init_buffers(dc, have_shm)) {
+        LOG_ERROR("Failed to allocate frame buffers");
+        display_capture_shutdown(dc);
+        return false;
     }
 
-    if (!dc->use_shm) {
+    if (dc->use_shm) {
+        LOG_INFO("XShm initialized successfully, %d frame buffers", DISPLAY_FRAME_BUFFERS);
+    } else {
         LOG_INFO("Using XGetImage fallback (slower)");
     }
 
+    /* XDamage needs XFixes regions and XShm for the rectangle reads */
+    int damage_error, fixes_event, fixes_error;
+    if (dc->use_shm &&
+        XDamageQueryExtension(dc->display, &dc->damage_event_base, &damage_error) &&
+        XFixesQueryExtension(dc->display, &fixes_event, &fixes_error)) {
+        XRectangle screen = { 0, 0, (unsigned short)dc->width, (unsigned short)dc->height };
+        XRectangle area = { (short)dc->origin_x, (short)dc->origin_y,
+                            (unsigned short)dc->width, (unsigned short)dc->height };
+
+        dc->scratch = shm_image_create(dc, &dc->scratch_info);
+        if (dc->scratch) {
+            dc->damage = XDamageCreate(dc->display, dc->root, XDamageReportNonEmpty);
+            dc->damage_region = XFixesCreateRegion(dc->display, NULL, 0);
+            dc->report_region = XFixesCreateRegion(dc->display, NULL, 0);
+            dc->monitor_region = XFixesCreateRegion(dc->display, &area, 1);
+
+            /* Every buffer starts out wholly stale */
+            for (int i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+                dc->buffers[i].stale = XFixesCreateRegion(dc->display, &screen, 1);
+            }
+            dc->use_damage = true;
+        }
+        LOG_INFO("XDamage %s", dc->use_damage ? "enabled" : "unavailable");
+    }
+
     dc->frame_interval_us = 1000000 / dc->config.target_fps;
 
     LOG_INFO("Display capture initialized");
     return true;
 }
 
+/* Frames handed out must have been released */
 void display_capture_shutdown(DisplayCapture *dc) {
     if (!dc) return;
 
     display_capture_stop(dc);
 
-    if (dc->use_shm && dc->image) {
-        XShmDetach(dc->display, &dc->shm_info);
-        shmdt(dc->shm_info.shmaddr);
-        shmctl(dc->shm_info.shmid, IPC_RMID, NULL);
-        XDestroyImage(dc->image);
-        dc->image = NULL;
+    if (dc->use_damage) {
+        XDamageDestroy(dc->display, dc->damage);
+        XFixesDestroyRegion(dc->display, dc->damage_region);
+        XFixesDestroyRegion(dc->display, dc->report_region);
+        XFixesDestroyRegion(dc->display, dc->monitor_region);
+        for (int i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+            XFixesDestroyRegion(dc->display, dc->buffers[i].stale);
+            dc->buffers[i].stale = None;
+        }
+        shm_image_destroy(dc, dc->scratch, &dc->scratch_info);
+        dc->scratch = NULL;
+        dc->use_damage = false;
+    }
+
+    for (int i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+        FrameBuffer *fb = &dc->buffers[i];
+
+        if (fb->image) {
+            shm_image_destroy(dc, fb->image, &fb->shm_info);
+            fb->image = NULL;
+        } else {
+            free(fb->data);
+        }
+        fb->data = NULL;
     }
+    dc->use_shm = false;
 
     if (dc->display) {
         XCloseDisplay(dc->display);
@@ -211,118 +406,349 @@ void display_capture_set_callback(DisplayCapture *dc, FrameCallback callback, vo
 
 void display_capture_set_fps(DisplayCapture *dc, uint32_t fps) {
     if (!dc || fps == 0) return;
-    dc->config.target_fps = fps;
-    dc->frame_interval_us = 1000000 / fps;
+    atomic_store_explicit(&dc->frame_interval_us, 1000000 / fps, memory_order_relaxed);
 }
 
-bool display_capture_capture_frame(DisplayCapture *dc, FrameData *frame) {
-    if (!dc || !dc->display || !frame) return false;
+/*
+ * Clip a region's rectangles to the screen. Returns their number, or
+ * -1 when they cover so much that one full read is cheaper.
+ */
+static int display_capture_fetch_rects(DisplayCapture *dc, XserverRegion region,
+                                       FrameRect *out) {
+    int count = 0;
+    int num = 0;
+    uint64_t area = 0;
+    XRectangle *rects = XFixesFetchRegion(dc->display, region, &count);
+
+    for (int i = 0; rects && i < count; i++) {
+        int x0 = rects[i].x < 0 ? 0 : rects[i].x;
+        int y0 = rects[i].y < 0 ? 0 : rects[i].y;
+        int x1 = rects[i].x + rects[i].width;
+        int y1 = rects[i].y + rects[i].height;
+
+        if (x1 > dc->width) x1 = dc->width;
+        if (y1 > dc->height) y1 = dc->height;
+        if (x1 <= x0 || y1 <= y0) continue;
+
+        if (num == DISPLAY_MAX_DIRTY_RECTS) {
+            num = -1;
+            break;
+        }
+
+        out[num].x = x0;
+        out[num].y = y0;
+        out[num].width = (uint32_t)(x1 - x0);
+        out[num].height = (uint32_t)(y1 - y0);
+        area += (uint64_t)out[num].width * out[num].height;
+        num++;
+    }
+
+    if (rects) {
+        XFree(rects);
+    }
+
+    /* One round trip beats many once most of the screen changed */
+    if (area * 2 > (uint64_t)dc->width * dc->height) {
+        return -1;
+    }
+    return num;
+}
 
-    XImage *img = NULL;
+/*
+ * Move this tick's damage into the report and every buffer's stale
+ * region. Returns false when nothing changed.
+ */
+static bool display_capture_collect_damage(DisplayCapture *dc) {
+    XEvent event;
+    int count = 0;
 
-    if (dc->use_shm && dc->image) {
-        /* Use shared memory for fast capture */
-        if (!XShmGetImage(dc->display, dc->root, dc->image, 0, 0, AllPlanes)) {
-            LOG_ERROR("XShmGetImage failed");
+    /* DamageNotify only says damage exists; the region has the detail */
+    while (XPending(dc->display)) {
+        XNextEvent(dc->display, &event);
+    }
+
+    XDamageSubtract(dc->display, dc->damage, None, dc->damage_region);
+
+    /* Only this monitor's part, in its own coordinates */
+    XFixesIntersectRegion(dc->display, dc->damage_region, dc->damage_region, dc->monitor_region);
+    XFixesTranslateRegion(dc->display, dc->damage_region, -dc->origin_x, -dc->origin_y);
+
+    XRectangle *rects = XFixesFetchRegion(dc->display, dc->damage_region, &count);
+    if (rects) {
+        XFree(rects);
+    }
+    if (count == 0) {
+        return false;
+    }
+
+    XFixesUnionRegion(dc->display, dc->report_region, dc->report_region, dc->damage_region);
+    for (int i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+        XFixesUnionRegion(dc->display, dc->buffers[i].stale, dc->buffers[i].stale, dc->damage_region);
+    }
+    return true;
+}
+
+/* Read rectangles into a buffer through the scratch segment */
+static bool display_capture_read_rects(DisplayCapture *dc, FrameBuffer *fb,
+                                       const FrameRect *rects, int count) {
+    int bytes_pp = fb->image->bits_per_pixel / 8;
+
+    for (int i = 0; i < count; i++) {
+        const FrameRect *r = &rects[i];
+
+        XImage *sub = XShmCreateImage(
+            dc->display,
+            DefaultVisual(dc->display, dc->screen),
+            dc->depth,
+            ZPixmap,
+            dc->scratch->data,
+            &dc->scratch_info,
+            r->width,
+            r->height
+        );
+
+        if (!sub) {
+            return false;
+        }
+
+        bool ok = XShmGetImage(dc->display, dc->root, sub,
+                               dc->origin_x + r->x, dc->origin_y + r->y, AllPlanes);
+        if (ok) {
+            for (uint32_t row = 0; row < r->height; row++) {
+                memcpy(fb->data + (size_t)(r->y + row) * dc->stride + (size_t)r->x * bytes_pp,
+                       sub->data + (size_t)row * sub->bytes_per_line,
+                       (size_t)r->width * bytes_pp);
+            }
+        }
+
+        /* The data belongs to the segment */
+        sub->data = NULL;
+        XDestroyImage(sub);
+
+        if (!ok) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Bring a buffer up to date with the screen */
+static bool display_capture_fill(DisplayCapture *dc, FrameBuffer *fb) {
+    if (dc->use_damage) {
+        FrameRect rects[DISPLAY_MAX_DIRTY_RECTS];
+        int count = display_capture_fetch_rects(dc, fb->stale, rects);
+
+        if (count >= 0) {
+            if (!display_capture_read_rects(dc, fb, rects, count)) {
+                return false;
+            }
+            XFixesSetRegion(dc->display, fb->stale, NULL, 0);
+            return true;
+        }
+    }
+
+    if (dc->use_shm) {
+        if (!XShmGetImage(dc->display, dc->root, fb->image,
+                          dc->origin_x, dc->origin_y, AllPlanes)) {
             return false;
         }
-        img = dc->image;
     } else {
-        /* Fallback to XGetImage */
-        img = XGetImage(dc->display, dc->root, 0, 0, dc->width, dc->height, AllPlanes, ZPixmap);
+        /* Fallback to XGetImage; one copy per frame into the ring */
+        XImage *img = XGetImage(dc->display, dc->root, dc->origin_x, dc->origin_y,
+                                dc->width, dc->height, AllPlanes, ZPixmap);
         if (!img) {
-            LOG_ERROR("XGetImage failed");
             return false;
         }
+
+        size_t row_bytes = (size_t)img->bytes_per_line < dc->stride ?
+                           (size_t)img->bytes_per_line : dc->stride;
+        for (int row = 0; row < dc->height; row++) {
+            memcpy(fb->data + (size_t)row * dc->stride,
+                   img->data + (size_t)row * img->bytes_per_line, row_bytes);
+        }
+        XDestroyImage(img);
     }
 
-    /* Copy image data */
-    frame->width = img->width;
-    frame->height = img->height;
-    frame->stride = img->bytes_per_line;
-    frame->timestamp = get_timestamp_ms();
-    frame->key_frame = (dc->frame_count % 30 == 0);
-    frame->data_size = img->bytes_per_line * img->height;
+    if (dc->use_damage) {
+        XFixesSetRegion(dc->display, fb->stale, NULL, 0);
+    }
+    return true;
+}
+
+/* A buffer nobody holds, taken with one reference */
+static FrameBuffer *display_capture_take_buffer(DisplayCapture *dc) {
+    for (uint32_t i = 0; i < DISPLAY_FRAME_BUFFERS; i++) {
+        FrameBuffer *fb = &dc->buffers[(dc->next_buffer + i) % DISPLAY_FRAME_BUFFERS];
 
-    frame->data = zixiao_malloc(frame->data_size);
-    if (!frame->data) {
-        if (!dc->use_shm) {
-            XDestroyImage(img);
+        /* Only this thread takes free buffers, so no one races the 0 */
+        if (atomic_load_explicit(&fb->refs, memory_order_acquire) == 0) {
+            atomic_store_explicit(&fb->refs, 1, memory_order_relaxed);
+            dc->next_buffer = (dc->next_buffer + i + 1) % DISPLAY_FRAME_BUFFERS;
+            return fb;
         }
+    }
+    return NULL;
+}
+
+bool display_capture_capture_frame(DisplayCapture *dc, FrameData *frame) {
+    if (!dc || !dc->display || !frame || !dc->buffers[0].data) return false;
+
+    bool key_frame = (dc->frame_count % 30 == 0);
+
+    /* Key frames go out even on a still screen */
+    dc->still = false;
+    if (dc->use_damage && !display_capture_collect_damage(dc) && !key_frame) {
+        dc->still = true;
         return false;
     }
 
-    memcpy(frame->data, img->data, frame->data_size);
+    FrameBuffer *fb = display_capture_take_buffer(dc);
+    if (!fb) {
+        /* The encoder holds every buffer; this tick's damage waits */
+        dc->frames_dropped++;
+        return false;
+    }
 
-    if (!dc->use_shm) {
-        XDestroyImage(img);
+    if (!display_capture_fill(dc, fb)) {
+        LOG_ERROR("Frame capture failed");
+        atomic_store_explicit(&fb->refs, 0, memory_order_release);
+        return false;
+    }
+
+    int num_dirty = 0;
+    if (dc->use_damage) {
+        num_dirty = display_capture_fetch_rects(dc, dc->report_region, fb->dirty);
+        XFixesSetRegion(dc->display, dc->report_region, NULL, 0);
     }
 
+    frame->data = fb->data;
+    frame->width = (uint32_t)dc->width;
+    frame->height = (uint32_t)dc->height;
+    frame->stride = dc->stride;
+    frame->timestamp = get_timestamp_ms();
+    frame->key_frame = key_frame;
+    frame->monitor = dc->monitor;
+    frame->data_size = dc->frame_size;
+    frame->dirty_rects = fb->dirty;
+    frame->num_dirty_rects = (key_frame || num_dirty < 0) ? 0 : (uint32_t)num_dirty;
+    frame->buffer = fb;
+
     dc->frame_count++;
     return true;
 }
 
+void display_capture_retain_frame(const FrameData *frame) {
+    if (!frame || !frame->buffer) return;
+
+    FrameBuffer *fb = frame->buffer;
+    atomic_fetch_add_explicit(&fb->refs, 1, memory_order_relaxed);
+}
+
+void display_capture_release_frame(const FrameData *frame) {
+    if (!frame || !frame->buffer) return;
+
+    FrameBuffer *fb = frame->buffer;
+    atomic_fetch_sub_explicit(&fb->refs, 1, memory_order_release);
+}
+
+/*
+ * Sleep until the X server has events, at most timeout_ms. Damage on
+ * any monitor wakes every context once; one whose own area stayed
+ * still reads nothing and goes back to sleep.
+ */
+static void display_capture_wait_damage(DisplayCapture *dc, int timeout_ms) {
+    /* XPending also flushes what was sent */
+    if (XPending(dc->display)) return;
+
+    struct pollfd pfd = { .fd = ConnectionNumber(dc->display), .events = POLLIN };
+    poll(&pfd, 1, timeout_ms);
+}
+
 static void *capture_thread_func(void *arg) {
     DisplayCapture *dc = (DisplayCapture *)arg;
 
-    LOG_DEBUG("Capture thread started");
+    LOG_DEBUG("Capture thread started for monitor %u", dc->monitor);
+
+    if (dc->config.pin_cpu) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(dc->config.cpu, &set);
+
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            LOG_WARNING("Failed to pin capture thread to CPU %u: %s", dc->config.cpu, strerror(err));
+        }
+    }
 
     while (!dc->stopping) {
         uint64_t start = get_timestamp_ms() * 1000;
 
         FrameData frame = {0};
         if (display_capture_capture_frame(dc, &frame)) {
+            /* Consumers that keep the frame past the callback retain it */
             if (dc->callback) {
                 dc->callback(&frame, dc->callback_data);
             }
-            zixiao_free(frame.data);
+            display_capture_release_frame(&frame);
+        } else if (dc->still) {
+            /* Nothing changed: the first damage is captured at once */
+            display_capture_wait_damage(dc, DISPLAY_IDLE_WAIT_MS);
+            continue;
         }
 
         /* Rate limiting */
         uint64_t elapsed = get_timestamp_ms() * 1000 - start;
-        if (elapsed < dc->frame_interval_us) {
-            usleep(dc->frame_interval_us - elapsed);
+        uint64_t interval = atomic_load_explicit(&dc->frame_interval_us, memory_order_relaxed);
+        if (elapsed < interval) {
+            usleep(interval - elapsed);
         }
     }
 
-    LOG_DEBUG("Capture thread exiting");
+    LOG_DEBUG("Capture thread exiting (%llu frames dropped)",
+              (unsigned long long)dc->frames_dropped);
     return NULL;
 }
 
 bool display_capture_get_monitor_info(DisplayCapture *dc, MonitorInfo *info) {
     if (!dc || !dc->display || !info) return false;
 
-    info->id = 0;
-    info->x = 0;
-    info->y = 0;
+    info->id = dc->monitor;
+    info->x = dc->origin_x;
+    info->y = dc->origin_y;
     info->width = dc->width;
     info->height = dc->height;
     info->depth = dc->depth;
-    info->primary = true;
-    snprintf(info->name, sizeof(info->name), "Screen %d", dc->screen);
+    info->primary = (dc->origin_x == 0 && dc->origin_y == 0);
+    if (dc->config.monitor_id == DISPLAY_MONITOR_ALL) {
+        snprintf(info->name, sizeof(info->name), "Screen %d", dc->screen);
+    } else {
+        snprintf(info->name, sizeof(info->name), "Monitor %u", dc->monitor);
+    }
 
     return true;
 }
 
-int display_capture_enumerate_monitors(DisplayCapture *dc, MonitorInfo *monitors, int max_count) {
-    if (!dc || !dc->display || !monitors || max_count <= 0) return 0;
-
+/* XRandR CRTCs in use, or the whole screen when there are none */
+static int enumerate_crtcs(Display *display, int screen, MonitorInfo *monitors, int max_count) {
+    Window root = RootWindow(display, screen);
+    int depth = DefaultDepth(display, screen);
     int count = 0;
 
     /* Try XRandR for multi-monitor support */
     int event_base, error_base;
-    if (XRRQueryExtension(dc->display, &event_base, &error_base)) {
-        XRRScreenResources *res = XRRGetScreenResources(dc->display, dc->root);
+    if (XRRQueryExtension(display, &event_base, &error_base)) {
+        XRRScreenResources *res = XRRGetScreenResources(display, root);
         if (res) {
             for (int i = 0; i < res->ncrtc && count < max_count; i++) {
-                XRRCrtcInfo *crtc = XRRGetCrtcInfo(dc->display, res, res->crtcs[i]);
+                XRRCrtcInfo *crtc = XRRGetCrtcInfo(display, res, res->crtcs[i]);
                 if (crtc && crtc->mode != None) {
                     monitors[count].id = count;
                     monitors[count].x = crtc->x;
                     monitors[count].y = crtc->y;
                     monitors[count].width = crtc->width;
                     monitors[count].height = crtc->height;
-                    monitors[count].depth = dc->depth;
+                    monitors[count].depth = depth;
                     monitors[count].primary = (crtc->x == 0 && crtc->y == 0);
                     snprintf(monitors[count].name, sizeof(monitors[count].name),
                              "Monitor %d", count);
@@ -336,9 +762,33 @@ int display_capture_enumerate_monitors(DisplayCapture *dc, MonitorInfo *monitors
 
     /* Fallback to single monitor */
     if (count == 0) {
-        display_capture_get_monitor_info(dc, &monitors[0]);
+        monitors[0].id = 0;
+        monitors[0].x = 0;
+        monitors[0].y = 0;
+        monitors[0].width = DisplayWidth(display, screen);
+        monitors[0].height = DisplayHeight(display, screen);
+        monitors[0].depth = depth;
+        monitors[0].primary = true;
+        snprintf(monitors[0].name, sizeof(monitors[0].name), "Screen %d", screen);
         count = 1;
     }
 
     return count;
 }
+
+int display_capture_enumerate_monitors(DisplayCapture *dc, MonitorInfo *monitors, int max_count) {
+    if (!dc || !dc->display || !monitors || max_count <= 0) return 0;
+
+    return enumerate_crtcs(dc->display, dc->screen, monitors, max_count);
+}
+
+int display_capture_query_monitors(MonitorInfo *monitors, int max_count) {
+    if (!monitors || max_count <= 0) return 0;
+
+    Display *display = XOpenDisplay(NULL);
+    if (!display) return 0;
+
+    int count = enumerate_crtcs(display, DefaultScreen(display), monitors, max_count);
+    XCloseDisplay(display);
+    return count;
+}
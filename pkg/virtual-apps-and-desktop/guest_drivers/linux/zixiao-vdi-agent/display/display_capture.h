@@ -14,13 +14,19 @@
 extern "C" {
 #endif
 
+/* monitor_id for the whole screen as one frame */
+#define DISPLAY_MONITOR_ALL     UINT32_MAX
+
 /* Display capture configuration */
 typedef struct {
     uint32_t target_fps;
-    uint32_t monitor_id;
+    uint32_t monitor_id;    /* index from enumerate_monitors, or DISPLAY_MONITOR_ALL */
+    bool     pin_cpu;       /* keep the capture thread on cpu */
+    uint32_t cpu;
 } DisplayCaptureConfig;
 
-/* Display capture context (opaque) */
+/* Display capture context (opaque). Each captures one monitor on its
+ * own X connection and thread, into buffers sized to it */
 typedef struct DisplayCapture DisplayCapture;
 
 /* Create/destroy */
@@ -44,9 +50,20 @@ void display_capture_set_fps(DisplayCapture *dc, uint32_t fps);
 bool display_capture_get_monitor_info(DisplayCapture *dc, MonitorInfo *info);
 int display_capture_enumerate_monitors(DisplayCapture *dc, MonitorInfo *monitors, int max_count);
 
-/* Manual capture */
+/* Monitors of the default display, before any capture is set up */
+int display_capture_query_monitors(MonitorInfo *monitors, int max_count);
+
+/* Manual capture; false when capture failed or, with XDamage, nothing
+ * changed since the previous frame */
 bool display_capture_capture_frame(DisplayCapture *dc, FrameData *frame);
 
+/* Frames point into a ring of capture buffers. A manually captured
+ * frame belongs to the caller until released; a frame passed to the
+ * callback must be retained to be used after the callback returns.
+ * Every frame is released before display_capture_shutdown. */
+void display_capture_retain_frame(const FrameData *frame);
+void display_capture_release_frame(const FrameData *frame);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,469 @@
+/*
+ * Zixiao VDI Agent for Linux - Video Encoder Implementation
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * H.264 encoding behind a backend table, tried in order: VA-API,
+ * NVENC, then software x264. The backends are driven through
+ * libavcodec; a build without it has none, and WebRTC sends no video.
+ *
+ * Each backend is fed the pixel format it takes without help:
+ * NVENC converts BGRX itself, so the capture buffer is handed over
+ * as is, retained until the encoder has uploaded it. VA-API and x264
+ * get NV12 and I420 converted into one reused frame; VA-API uploads
+ * it into a surface from a fixed pool. A smaller output size is
+ * scaled in the same conversion, and NVENC then gets the scaled BGRX.
+ *
+ * The rate control buffer holds 100 ms, so a frame is not queued
+ * behind more than that of its predecessors.
+ */
+
+#include "video_encoder.h"
+#include "../display/display_capture.h"
+
+#ifdef HAVE_AVCODEC
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
+#endif
+
+/* VA-API surfaces the encoder may hold at once */
+#define VAAPI_SURFACE_POOL  8
+
+typedef struct VideoEncoderBackend {
+    const char *name;
+    bool        hardware;
+    bool        live_bitrate;   /* takes bitrate changes while open */
+    bool      (*open)(VideoEncoder *ve);
+    bool      (*encode)(VideoEncoder *ve, const FrameData *frame, bool force_key_frame);
+    void      (*close)(VideoEncoder *ve);
+} VideoEncoderBackend;
+
+struct VideoEncoder {
+    /* Configuration */
+    VideoEncoderConfig          config;
+    char                        device[256];
+    EncodedPacketCallback       callback;
+    void                       *callback_data;
+
+    /* Backend */
+    const VideoEncoderBackend  *backend;
+
+#ifdef HAVE_AVCODEC
+    AVCodecContext             *codec;
+    AVBufferRef                *hw_device;
+    AVBufferRef                *hw_frames;
+    AVFrame                    *input;         /* frame handed to the codec */
+    AVFrame                    *converted;     /* reused conversion target */
+    AVPacket                   *packet;
+    struct SwsContext          *sws;
+#endif
+
+    /* Stats */
+    uint64_t                    frames;
+    int64_t                     last_pts;
+};
+
+#ifdef HAVE_AVCODEC
+
+/* Capture frames are BGRX in memory order */
+#define CAPTURE_PIX_FMT     AV_PIX_FMT_BGR0
+
+static bool encoder_is_scaled(const VideoEncoder *ve) {
+    return ve->config.output_width != ve->config.width ||
+           ve->config.output_height != ve->config.height;
+}
+
+static void avcodec_close_encoder(VideoEncoder *ve) {
+    avcodec_free_context(&ve->codec);
+    av_buffer_unref(&ve->hw_frames);
+    av_buffer_unref(&ve->hw_device);
+    av_frame_free(&ve->input);
+    av_frame_free(&ve->converted);
+    av_packet_free(&ve->packet);
+    sws_freeContext(ve->sws);
+    ve->sws = NULL;
+}
+
+static void avcodec_apply_bitrate(VideoEncoder *ve) {
+    ve->codec->bit_rate = ve->config.bitrate;
+    ve->codec->rc_max_rate = ve->config.bitrate;
+    ve->codec->rc_buffer_size = (int)(ve->config.bitrate / 10);
+}
+
+/* Codec context for low-latency streaming: CBR, no B-frames */
+static bool avcodec_alloc_encoder(VideoEncoder *ve, const char *codec_name,
+                                  enum AVPixelFormat pix_fmt) {
+    const AVCodec *codec = avcodec_find_encoder_by_name(codec_name);
+    if (!codec) {
+        LOG_DEBUG("Encoder %s not available", codec_name);
+        return false;
+    }
+
+    ve->codec = avcodec_alloc_context3(codec);
+    ve->input = av_frame_alloc();
+    ve->packet = av_packet_alloc();
+    if (!ve->codec || !ve->input || !ve->packet) {
+        return false;
+    }
+
+    AVCodecContext *ctx = ve->codec;
+    ctx->width = (int)ve->config.output_width;
+    ctx->height = (int)ve->config.output_height;
+    ctx->pix_fmt = pix_fmt;
+    ctx->time_base = (AVRational){ 1, 1000 };
+    ctx->framerate = (AVRational){ (int)ve->config.fps, 1 };
+    ctx->gop_size = (int)ve->config.gop_size;
+    ctx->max_b_frames = 0;
+    avcodec_apply_bitrate(ve);
+    return true;
+}
+
+static bool avcodec_open_encoder(VideoEncoder *ve) {
+    int ret = avcodec_open2(ve->codec, ve->codec->codec, NULL);
+    if (ret < 0) {
+        LOG_WARNING("Failed to open %s encoder: %s", ve->backend->name, av_err2str(ret));
+        return false;
+    }
+    return true;
+}
+
+/* Converter into a reused frame of the codec's software format */
+static bool avcodec_alloc_converter(VideoEncoder *ve, enum AVPixelFormat pix_fmt) {
+    ve->converted = av_frame_alloc();
+    if (!ve->converted) {
+        return false;
+    }
+
+    ve->converted->format = pix_fmt;
+    ve->converted->width = (int)ve->config.output_width;
+    ve->converted->height = (int)ve->config.output_height;
+    if (av_frame_get_buffer(ve->converted, 0) < 0) {
+        return false;
+    }
+
+    /* Bilinear when scaling, so text stays legible */
+    int flags = encoder_is_scaled(ve) ? SWS_FAST_BILINEAR : SWS_POINT;
+    ve->sws = sws_getContext((int)ve->config.width, (int)ve->config.height, CAPTURE_PIX_FMT,
+                             (int)ve->config.output_width, (int)ve->config.output_height,
+                             pix_fmt, flags, NULL, NULL, NULL);
+    return ve->sws != NULL;
+}
+
+static bool avcodec_convert(VideoEncoder *ve, const FrameData *frame) {
+    const uint8_t *const src[] = { frame->data };
+    const int src_stride[] = { (int)frame->stride };
+
+    /* Still referenced when the codec has not consumed it yet */
+    if (av_frame_make_writable(ve->converted) < 0) {
+        return false;
+    }
+
+    sws_scale(ve->sws, src, src_stride, 0, (int)frame->height,
+              ve->converted->data, ve->converted->linesize);
+    return true;
+}
+
+/* Send one frame and pass on every packet that is ready */
+static bool avcodec_submit(VideoEncoder *ve, AVFrame *input, const FrameData *frame,
+                           bool force_key_frame) {
+    /* Encoders need strictly increasing timestamps */
+    int64_t pts = (int64_t)frame->timestamp;
+    if (ve->frames > 0 && pts <= ve->last_pts) {
+        pts = ve->last_pts + 1;
+    }
+    ve->last_pts = pts;
+
+    input->pts = pts;
+    input->pict_type = force_key_frame ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    int ret = avcodec_send_frame(ve->codec, input);
+    av_frame_unref(ve->input);
+    if (ret < 0) {
+        LOG_ERROR("%s encode failed: %s", ve->backend->name, av_err2str(ret));
+        return false;
+    }
+
+    ve->frames++;
+
+    while ((ret = avcodec_receive_packet(ve->codec, ve->packet)) == 0) {
+        EncodedPacket packet = {
+            .data = ve->packet->data,
+            .size = (size_t)ve->packet->size,
+            .timestamp = (uint64_t)ve->packet->pts,
+            .key_frame = (ve->packet->flags & AV_PKT_FLAG_KEY) != 0
+        };
+
+        if (ve->callback) {
+            ve->callback(&packet, ve->callback_data);
+        }
+        av_packet_unref(ve->packet);
+    }
+
+    return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF;
+}
+
+/* VA-API: NV12 uploaded into surfaces from a fixed pool */
+static bool vaapi_open(VideoEncoder *ve) {
+    if (!avcodec_alloc_encoder(ve, "h264_vaapi", AV_PIX_FMT_VAAPI)) {
+        return false;
+    }
+
+    int ret = av_hwdevice_ctx_create(&ve->hw_device, AV_HWDEVICE_TYPE_VAAPI,
+                                     ve->device[0] ? ve->device : NULL, NULL, 0);
+    if (ret < 0) {
+        LOG_DEBUG("No VA-API device: %s", av_err2str(ret));
+        return false;
+    }
+
+    ve->hw_frames = av_hwframe_ctx_alloc(ve->hw_device);
+    if (!ve->hw_frames) {
+        return false;
+    }
+
+    AVHWFramesContext *frames = (AVHWFramesContext *)ve->hw_frames->data;
+    frames->format = AV_PIX_FMT_VAAPI;
+    frames->sw_format = AV_PIX_FMT_NV12;
+    frames->width = (int)ve->config.output_width;
+    frames->height = (int)ve->config.output_height;
+    frames->initial_pool_size = VAAPI_SURFACE_POOL;
+
+    ret = av_hwframe_ctx_init(ve->hw_frames);
+    if (ret < 0) {
+        LOG_WARNING("Failed to create VA-API surfaces: %s", av_err2str(ret));
+        return false;
+    }
+
+    ve->codec->hw_frames_ctx = av_buffer_ref(ve->hw_frames);
+    if (!ve->codec->hw_frames_ctx) {
+        return false;
+    }
+
+    av_opt_set(ve->codec->priv_data, "rc_mode", "CBR", 0);
+    av_opt_set(ve->codec->priv_data, "async_depth", "1", 0);
+
+    return avcodec_alloc_converter(ve, AV_PIX_FMT_NV12) && avcodec_open_encoder(ve);
+}
+
+static bool vaapi_encode(VideoEncoder *ve, const FrameData *frame, bool force_key_frame) {
+    if (!avcodec_convert(ve, frame)) {
+        return false;
+    }
+
+    int ret = av_hwframe_get_buffer(ve->hw_frames, ve->input, 0);
+    if (ret == 0) {
+        ret = av_hwframe_transfer_data(ve->input, ve->converted, 0);
+    }
+
+    if (ret < 0) {
+        LOG_ERROR("VA-API upload failed: %s", av_err2str(ret));
+        av_frame_unref(ve->input);
+        return false;
+    }
+
+    return avcodec_submit(ve, ve->input, frame, force_key_frame);
+}
+
+/* NVENC: takes BGRX and converts on the GPU; scaled on the CPU */
+static bool nvenc_open(VideoEncoder *ve) {
+    if (!avcodec_alloc_encoder(ve, "h264_nvenc", CAPTURE_PIX_FMT)) {
+        return false;
+    }
+
+    av_opt_set(ve->codec->priv_data, "preset", "p1", 0);
+    av_opt_set(ve->codec->priv_data, "tune", "ull", 0);
+    av_opt_set(ve->codec->priv_data, "rc", "cbr", 0);
+    av_opt_set(ve->codec->priv_data, "zerolatency", "1", 0);
+    av_opt_set(ve->codec->priv_data, "delay", "0", 0);
+    av_opt_set(ve->codec->priv_data, "forced-idr", "1", 0);
+
+    if (encoder_is_scaled(ve) && !avcodec_alloc_converter(ve, CAPTURE_PIX_FMT)) {
+        return false;
+    }
+    return avcodec_open_encoder(ve);
+}
+
+/* Drops the encoder's hold on a capture buffer */
+static void capture_buffer_unref(void *opaque, uint8_t *data) {
+    FrameData frame = { .buffer = opaque };
+
+    (void)data;
+    display_capture_release_frame(&frame);
+}
+
+static bool nvenc_encode(VideoEncoder *ve, const FrameData *frame, bool force_key_frame) {
+    AVFrame *input = ve->input;
+
+    if (ve->sws) {
+        if (!avcodec_convert(ve, frame) || av_frame_ref(input, ve->converted) < 0) {
+            return false;
+        }
+        return avcodec_submit(ve, input, frame, force_key_frame);
+    }
+
+    input->format = CAPTURE_PIX_FMT;
+    input->width = (int)frame->width;
+    input->height = (int)frame->height;
+    input->data[0] = frame->data;
+    input->linesize[0] = (int)frame->stride;
+
+    /* A referenced frame is uploaded in place; otherwise avcodec copies */
+    if (frame->buffer) {
+        display_capture_retain_frame(frame);
+        input->buf[0] = av_buffer_create(frame->data, frame->data_size,
+                                         capture_buffer_unref, frame->buffer,
+                                         AV_BUFFER_FLAG_READONLY);
+        if (!input->buf[0]) {
+            display_capture_release_frame(frame);
+            av_frame_unref(input);
+            return false;
+        }
+    }
+
+    return avcodec_submit(ve, input, frame, force_key_frame);
+}
+
+/* x264: the software fallback, fed I420 */
+static bool x264_open(VideoEncoder *ve) {
+    if (!avcodec_alloc_encoder(ve, "libx264", AV_PIX_FMT_YUV420P)) {
+        return false;
+    }
+
+    av_opt_set(ve->codec->priv_data, "preset", "veryfast", 0);
+    av_opt_set(ve->codec->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(ve->codec->priv_data, "profile", "baseline", 0);
+    av_opt_set(ve->codec->priv_data, "forced-idr", "1", 0);
+
+    return avcodec_alloc_converter(ve, AV_PIX_FMT_YUV420P) && avcodec_open_encoder(ve);
+}
+
+static bool x264_encode(VideoEncoder *ve, const FrameData *frame, bool force_key_frame) {
+    if (!avcodec_convert(ve, frame) || av_frame_ref(ve->input, ve->converted) < 0) {
+        return false;
+    }
+
+    return avcodec_submit(ve, ve->input, frame, force_key_frame);
+}
+
+static const VideoEncoderBackend g_vaapi_backend = {
+    "vaapi", true, false, vaapi_open, vaapi_encode, avcodec_close_encoder
+};
+
+static const VideoEncoderBackend g_nvenc_backend = {
+    "nvenc", true, true, nvenc_open, nvenc_encode, avcodec_close_encoder
+};
+
+static const VideoEncoderBackend g_x264_backend = {
+    "x264", false, true, x264_open, x264_encode, avcodec_close_encoder
+};
+
+#endif /* HAVE_AVCODEC */
+
+/* Preference order for "auto" */
+static const VideoEncoderBackend *const g_backends[] = {
+#ifdef HAVE_AVCODEC
+    &g_vaapi_backend,
+    &g_nvenc_backend,
+    &g_x264_backend,
+#endif
+    NULL
+};
+
+VideoEncoder *video_encoder_create(const VideoEncoderConfig *config,
+                                   EncodedPacketCallback callback, void *user_data) {
+    if (!config || config->width == 0 || config->height == 0) return NULL;
+
+    const char *wanted = config->backend;
+    if (wanted && strcmp(wanted, "auto") == 0) {
+        wanted = NULL;
+    }
+
+    for (int i = 0; g_backends[i]; i++) {
+        const VideoEncoderBackend *backend = g_backends[i];
+
+        if (wanted && strcmp(wanted, backend->name) != 0) {
+            continue;
+        }
+
+        VideoEncoder *ve = zixiao_calloc(1, sizeof(VideoEncoder));
+        if (!ve) return NULL;
+
+        ve->config = *config;
+        if (ve->config.fps == 0) ve->config.fps = 30;
+        if (ve->config.bitrate == 0) ve->config.bitrate = 4000000;
+        if (ve->config.gop_size == 0) ve->config.gop_size = ve->config.fps * 2;
+        if (ve->config.output_width == 0 || ve->config.output_height == 0) {
+            ve->config.output_width = ve->config.width;
+            ve->config.output_height = ve->config.height;
+        }
+        if (config->device) {
+            strncpy(ve->device, config->device, sizeof(ve->device) - 1);
+        }
+        ve->config.backend = NULL;
+        ve->config.device = NULL;
+        ve->callback = callback;
+        ve->callback_data = user_data;
+        ve->backend = backend;
+
+        if (backend->open(ve)) {
+            LOG_INFO("Video encoder: %s, %ux%u @ %u fps, %u kbps",
+                     backend->name, ve->config.output_width, ve->config.output_height,
+                     ve->config.fps, ve->config.bitrate / 1000);
+            return ve;
+        }
+
+        backend->close(ve);
+        zixiao_free(ve);
+    }
+
+    if (wanted) {
+        LOG_ERROR("Video encoder %s not available", wanted);
+    } else {
+        LOG_ERROR("No video encoder available");
+    }
+    return NULL;
+}
+
+void video_encoder_destroy(VideoEncoder *ve) {
+    if (!ve) return;
+
+    ve->backend->close(ve);
+    LOG_DEBUG("Video encoder %s destroyed after %llu frames",
+              ve->backend->name, (unsigned long long)ve->frames);
+    zixiao_free(ve);
+}
+
+bool video_encoder_encode(VideoEncoder *ve, const FrameData *frame, bool force_key_frame) {
+    if (!ve || !frame || !frame->data) return false;
+
+    /* 32-bit pixels of the configured size */
+    if (frame->width != ve->config.width || frame->height != ve->config.height ||
+        frame->stride < frame->width * 4 ||
+        frame->data_size < (size_t)frame->stride * frame->height) {
+        return false;
+    }
+
+    return ve->backend->encode(ve, frame, force_key_frame);
+}
+
+bool video_encoder_set_bitrate(VideoEncoder *ve, uint32_t bitrate) {
+    if (!ve || bitrate == 0) return false;
+    if (!ve->backend->live_bitrate) return false;
+
+    /* libx264 and NVENC reconfigure when the context changes */
+    ve->config.bitrate = bitrate;
+#ifdef HAVE_AVCODEC
+    avcodec_apply_bitrate(ve);
+#endif
+    return true;
+}
+
+const char *video_encoder_get_backend(VideoEncoder *ve) {
+    return ve ? ve->backend->name : NULL;
+}
+
+bool video_encoder_is_hardware(VideoEncoder *ve) {
+    return ve && ve->backend->hardware;
+}
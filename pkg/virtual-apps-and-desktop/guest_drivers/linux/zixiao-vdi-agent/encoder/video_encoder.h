@@ -0,0 +1,68 @@
+/*
+ * Zixiao VDI Agent for Linux - Video Encoder
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ZIXIAO_VDI_VIDEO_ENCODER_H
+#define ZIXIAO_VDI_VIDEO_ENCODER_H
+
+#include "../src/common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* One encoded H.264 access unit, Annex B; valid during the callback */
+typedef struct {
+    const uint8_t *data;
+    size_t         size;
+    uint64_t       timestamp;   /* of the frame, in ms */
+    bool           key_frame;
+} EncodedPacket;
+
+typedef void (*EncodedPacketCallback)(const EncodedPacket *packet, void *user_data);
+
+/* Video encoder configuration */
+typedef struct {
+    uint32_t    width;          /* of the captured frames */
+    uint32_t    height;
+    uint32_t    output_width;   /* encoded size; 0 for the captured size */
+    uint32_t    output_height;
+    uint32_t    fps;
+    uint32_t    bitrate;        /* bits per second */
+    uint32_t    gop_size;       /* frames between key frames; 0 for 2 s */
+
+    /* "vaapi", "nvenc" or "x264"; NULL or "auto" tries them in order */
+    const char *backend;
+
+    /* DRM render node for VA-API; NULL for the default */
+    const char *device;
+} VideoEncoderConfig;
+
+/* Video encoder context (opaque) */
+typedef struct VideoEncoder VideoEncoder;
+
+/* Create/destroy; NULL when no backend could be opened */
+VideoEncoder *video_encoder_create(const VideoEncoderConfig *config,
+                                   EncodedPacketCallback callback, void *user_data);
+void video_encoder_destroy(VideoEncoder *ve);
+
+/* Encode a captured frame; packets go to the callback before it
+ * returns. Frames must match the configured size. */
+bool video_encoder_encode(VideoEncoder *ve, const FrameData *frame, bool force_key_frame);
+
+/* Change the target bitrate from the next frame. False when the
+ * backend cannot change it while open; reopen it with the new rate. */
+bool video_encoder_set_bitrate(VideoEncoder *ve, uint32_t bitrate);
+
+/* Query */
+const char *video_encoder_get_backend(VideoEncoder *ve);
+bool video_encoder_is_hardware(VideoEncoder *ve);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZIXIAO_VDI_VIDEO_ENCODER_H */
@@ -4,24 +4,58 @@
  * Copyright (c) 2025 Zixiao System
  * SPDX-License-Identifier: Apache-2.0
  *
- * Uses uinput for kernel-level input injection.
+ * Uses uinput for kernel-level input injection. Pointer motion is
+ * coalesced: the first move after a quiet interval goes out at once,
+ * later ones accumulate and leave together at the end of the interval.
+ * Buttons and keys flush pending motion ahead of them, so order holds.
+ * Each flush is one write of an input_event array.
  */
 
 #include "input_handler.h"
 #include <linux/uinput.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* Motion report plus one button or key report */
+#define INPUT_BATCH_MAX         8
+
+/* Until the agent sets the display frame interval */
+#define INPUT_DEFAULT_BATCH_US  (1000000 / 30)
+
+typedef struct {
+    struct input_event  events[INPUT_BATCH_MAX];
+    int                 count;
+} InputBatch;
 
 struct InputHandler {
     int         uinput_fd;
     uint32_t    screen_width;
     uint32_t    screen_height;
     bool        initialized;
+
+    /* Motion waiting for the end of the batch interval */
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    pthread_t       flush_thread;
+    bool            flush_running;
+    uint64_t        batch_interval_us;
+    uint64_t        last_motion_us;     /* when motion last went out */
+    bool            abs_pending;
+    int32_t         abs_x;
+    int32_t         abs_y;
+    int32_t         rel_x;
+    int32_t         rel_y;
+
+    /* Counters and the latency probe's reference */
+    _Atomic uint64_t last_inject_us;
+    uint64_t        writes;
+    uint64_t        moves;
 };
 
 static bool setup_uinput_device(InputHandler *ih);
-static void emit_event(InputHandler *ih, int type, int code, int value);
-static void sync_event(InputHandler *ih);
+static void *flush_thread_func(void *arg);
 
 InputHandler *input_handler_create(void) {
     InputHandler *ih = zixiao_calloc(1, sizeof(InputHandler));
@@ -31,6 +65,9 @@ InputHandler *input_handler_create(void) {
     ih->screen_width = 1920;
     ih->screen_height = 1080;
     ih->initialized = false;
+    ih->batch_interval_us = INPUT_DEFAULT_BATCH_US;
+    pthread_mutex_init(&ih->mutex, NULL);
+    pthread_cond_init(&ih->cond, NULL);
 
     return ih;
 }
@@ -39,6 +76,8 @@ void input_handler_destroy(InputHandler *ih) {
     if (!ih) return;
 
     input_handler_shutdown(ih);
+    pthread_cond_destroy(&ih->cond);
+    pthread_mutex_destroy(&ih->mutex);
     zixiao_free(ih);
 }
 
@@ -62,6 +101,16 @@ bool input_handler_init(InputHandler *ih) {
         return false;
     }
 
+    ih->flush_running = true;
+    if (pthread_create(&ih->flush_thread, NULL, flush_thread_func, ih) != 0) {
+        LOG_ERROR("Failed to create input flush thread");
+        ih->flush_running = false;
+        ioctl(ih->uinput_fd, UI_DEV_DESTROY);
+        close(ih->uinput_fd);
+        ih->uinput_fd = -1;
+        return false;
+    }
+
     ih->initialized = true;
     LOG_INFO("Input handler initialized");
     return true;
@@ -70,6 +119,17 @@ bool input_handler_init(InputHandler *ih) {
 void input_handler_shutdown(InputHandler *ih) {
     if (!ih) return;
 
+    if (ih->flush_running) {
+        pthread_mutex_lock(&ih->mutex);
+        ih->flush_running = false;
+        pthread_cond_signal(&ih->cond);
+        pthread_mutex_unlock(&ih->mutex);
+        pthread_join(ih->flush_thread, NULL);
+
+        LOG_DEBUG("Input: %llu moves in %llu writes",
+                  (unsigned long long)ih->moves, (unsigned long long)ih->writes);
+    }
+
     if (ih->uinput_fd >= 0) {
         ioctl(ih->uinput_fd, UI_DEV_DESTROY);
         close(ih->uinput_fd);
@@ -160,18 +220,90 @@ static bool setup_uinput_device(InputHandler *ih) {
     return true;
 }
 
-static void emit_event(InputHandler *ih, int type, int code, int value) {
-    struct input_event ev = {0};
-    gettimeofday(&ev.time, NULL);
-    ev.type = type;
-    ev.code = code;
-    ev.value = value;
-    ssize_t ret = write(ih->uinput_fd, &ev, sizeof(ev));
-    (void)ret;  // Intentionally ignoring return value for input events
+static void batch_add(InputBatch *batch, int type, int code, int value) {
+    struct input_event *ev = &batch->events[batch->count++];
+    memset(ev, 0, sizeof(*ev));
+    ev->type = type;
+    ev->code = code;
+    ev->value = value;
 }
 
-static void sync_event(InputHandler *ih) {
-    emit_event(ih, EV_SYN, SYN_REPORT, 0);
+/* Pending motion as one report; called with the mutex held */
+static void batch_take_motion(InputHandler *ih, InputBatch *batch) {
+    bool any = false;
+
+    if (ih->abs_pending) {
+        batch_add(batch, EV_ABS, ABS_X, ih->abs_x);
+        batch_add(batch, EV_ABS, ABS_Y, ih->abs_y);
+        ih->abs_pending = false;
+        any = true;
+    }
+    if (ih->rel_x || ih->rel_y) {
+        if (ih->rel_x) batch_add(batch, EV_REL, REL_X, ih->rel_x);
+        if (ih->rel_y) batch_add(batch, EV_REL, REL_Y, ih->rel_y);
+        ih->rel_x = 0;
+        ih->rel_y = 0;
+        any = true;
+    }
+
+    if (any) {
+        batch_add(batch, EV_SYN, SYN_REPORT, 0);
+        ih->last_motion_us = get_timestamp_us();
+    }
+}
+
+/* One write for the whole batch; called with the mutex held */
+static bool batch_write(InputHandler *ih, InputBatch *batch) {
+    if (batch->count == 0) return true;
+
+    /* The kernel stamps uinput events itself; this is for readers of
+     * the raw stream only */
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    for (int i = 0; i < batch->count; i++) {
+        batch->events[i].time = now;
+    }
+
+    size_t size = (size_t)batch->count * sizeof(struct input_event);
+    ssize_t ret = write(ih->uinput_fd, batch->events, size);
+
+    ih->writes++;
+    atomic_store_explicit(&ih->last_inject_us, get_timestamp_us(), memory_order_relaxed);
+
+    batch->count = 0;
+    return ret == (ssize_t)size;
+}
+
+/* Motion that arrived within the interval leaves at its end */
+static void *flush_thread_func(void *arg) {
+    InputHandler *ih = (InputHandler *)arg;
+    InputBatch batch = { .count = 0 };
+
+    pthread_mutex_lock(&ih->mutex);
+
+    while (ih->flush_running) {
+        if (!ih->abs_pending && !ih->rel_x && !ih->rel_y) {
+            pthread_cond_wait(&ih->cond, &ih->mutex);
+            continue;
+        }
+
+        uint64_t deadline = ih->last_motion_us + ih->batch_interval_us;
+        if (get_timestamp_us() < deadline) {
+            /* get_timestamp_us is on the realtime clock, as is the condvar */
+            struct timespec ts = {
+                .tv_sec = (time_t)(deadline / 1000000),
+                .tv_nsec = (long)(deadline % 1000000) * 1000
+            };
+            pthread_cond_timedwait(&ih->cond, &ih->mutex, &ts);
+            continue;
+        }
+
+        batch_take_motion(ih, &batch);
+        batch_write(ih, &batch);
+    }
+
+    pthread_mutex_unlock(&ih->mutex);
+    return NULL;
 }
 
 bool input_handler_inject(InputHandler *ih, const InputEvent *event) {
@@ -202,16 +334,46 @@ bool input_handler_inject(InputHandler *ih, const InputEvent *event) {
 bool input_handler_inject_mouse_move(InputHandler *ih, int32_t x, int32_t y, bool absolute) {
     if (!ih || !ih->initialized) return false;
 
+    pthread_mutex_lock(&ih->mutex);
+
+    /* Absolute moves keep the latest position, relative ones add up */
     if (absolute) {
-        emit_event(ih, EV_ABS, ABS_X, x);
-        emit_event(ih, EV_ABS, ABS_Y, y);
+        ih->abs_x = x;
+        ih->abs_y = y;
+        ih->abs_pending = true;
+    } else {
+        ih->rel_x += x;
+        ih->rel_y += y;
+    }
+    ih->moves++;
+
+    bool ok = true;
+    if (get_timestamp_us() - ih->last_motion_us >= ih->batch_interval_us) {
+        /* First move after a quiet spell: no waiting */
+        InputBatch batch = { .count = 0 };
+        batch_take_motion(ih, &batch);
+        ok = batch_write(ih, &batch);
     } else {
-        emit_event(ih, EV_REL, REL_X, x);
-        emit_event(ih, EV_REL, REL_Y, y);
+        pthread_cond_signal(&ih->cond);
     }
 
-    sync_event(ih);
-    return true;
+    pthread_mutex_unlock(&ih->mutex);
+    return ok;
+}
+
+/* A discrete event, behind whatever motion is pending */
+static bool inject_report(InputHandler *ih, int type, int code, int value) {
+    InputBatch batch = { .count = 0 };
+
+    pthread_mutex_lock(&ih->mutex);
+
+    batch_take_motion(ih, &batch);
+    batch_add(&batch, type, code, value);
+    batch_add(&batch, EV_SYN, SYN_REPORT, 0);
+    bool ok = batch_write(ih, &batch);
+
+    pthread_mutex_unlock(&ih->mutex);
+    return ok;
 }
 
 bool input_handler_inject_mouse_button(InputHandler *ih, uint32_t button, bool pressed) {
@@ -225,9 +387,7 @@ bool input_handler_inject_mouse_button(InputHandler *ih, uint32_t button, bool p
         default: return false;
     }
 
-    emit_event(ih, EV_KEY, btn_code, pressed ? 1 : 0);
-    sync_event(ih);
-    return true;
+    return inject_report(ih, EV_KEY, btn_code, pressed ? 1 : 0);
 }
 
 bool input_handler_inject_mouse_wheel(InputHandler *ih, int32_t delta) {
@@ -236,18 +396,28 @@ bool input_handler_inject_mouse_wheel(InputHandler *ih, int32_t delta) {
     /* Normalize delta to +/-1 */
     int value = (delta > 0) ? 1 : ((delta < 0) ? -1 : 0);
 
-    emit_event(ih, EV_REL, REL_WHEEL, value);
-    sync_event(ih);
-    return true;
+    return inject_report(ih, EV_REL, REL_WHEEL, value);
 }
 
 bool input_handler_inject_key(InputHandler *ih, uint32_t key_code, bool pressed) {
     if (!ih || !ih->initialized) return false;
 
     /* key_code is expected to be Linux key code */
-    emit_event(ih, EV_KEY, key_code, pressed ? 1 : 0);
-    sync_event(ih);
-    return true;
+    return inject_report(ih, EV_KEY, (int)key_code, pressed ? 1 : 0);
+}
+
+void input_handler_set_batch_interval(InputHandler *ih, uint32_t interval_us) {
+    if (!ih) return;
+
+    pthread_mutex_lock(&ih->mutex);
+    ih->batch_interval_us = interval_us;
+    pthread_cond_signal(&ih->cond);
+    pthread_mutex_unlock(&ih->mutex);
+}
+
+uint64_t input_handler_get_last_inject_us(InputHandler *ih) {
+    if (!ih) return 0;
+    return atomic_load_explicit(&ih->last_inject_us, memory_order_relaxed);
 }
 
 void input_handler_set_screen_size(InputHandler *ih, uint32_t width, uint32_t height) {
@@ -35,6 +35,12 @@ bool input_handler_inject_key(InputHandler *ih, uint32_t key_code, bool pressed)
 /* Configuration */
 void input_handler_set_screen_size(InputHandler *ih, uint32_t width, uint32_t height);
 
+/* Pointer motion within this interval is coalesced; 0 sends every move */
+void input_handler_set_batch_interval(InputHandler *ih, uint32_t interval_us);
+
+/* When input last reached uinput, in get_timestamp_us time; 0 if never */
+uint64_t input_handler_get_last_inject_us(InputHandler *ih);
+
 #ifdef __cplusplus
 }
 #endif
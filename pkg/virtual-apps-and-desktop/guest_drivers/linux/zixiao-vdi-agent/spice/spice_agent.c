@@ -10,6 +10,13 @@
 #include "spice_agent.h"
 #include <fcntl.h>
 #include <poll.h>
+#include <sys/uio.h>
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#elif defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
 
 /* SPICE vdagent message types */
 #define VD_AGENT_MOUSE_STATE             1
@@ -36,8 +43,40 @@
 #define VD_AGENT_CAP_DISPLAY_CONFIG      (1 << 4)
 #define VD_AGENT_CAP_CLIPBOARD_BY_DEMAND (1 << 5)
 
+/*
+ * Zixiao extension, used only with hosts announcing it: clipboard data
+ * goes out as VD_AGENT_ZIXIAO_CLIPBOARD, compressed when large, or as
+ * a bare reference when the host already holds the same content from
+ * earlier in the session.
+ */
+#define VD_AGENT_CAP_ZIXIAO_CLIPBOARD    (1u << 31)
+#define VD_AGENT_ZIXIAO_CLIPBOARD        0x5a580001
+
+#define ZIXIAO_CLIPBOARD_RAW             0
+#define ZIXIAO_CLIPBOARD_REF             1
+#define ZIXIAO_CLIPBOARD_LZ4             2
+#define ZIXIAO_CLIPBOARD_ZSTD            3
+
+/* Smaller payloads are sent as they are */
+#define SPICE_CLIPBOARD_COMPRESS_MIN     (32 * 1024)
+
 #define VD_AGENT_PORT                    1
 
+/* Chunk payload limit on the virtio port; larger messages span chunks */
+#define VD_AGENT_MAX_DATA_SIZE           2048
+
+/* SPICE allows no more displays than this */
+#define VD_AGENT_MAX_MONITORS            16
+
+/* Sending: payload parts per message, chunks per writev */
+#define SPICE_TX_MAX_PARTS               2
+#define SPICE_TX_CHUNKS_PER_WRITE        32
+#define SPICE_TX_TIMEOUT_MS              1000
+
+/* Receiving: raw chunk stream, and the largest message reassembled */
+#define SPICE_RX_BUFFER_SIZE             65536
+#define SPICE_RX_MAX_MESSAGE             (64 * 1024 * 1024)
+
 #pragma pack(push, 1)
 typedef struct {
     uint32_t port;
@@ -78,6 +117,17 @@ typedef struct {
 typedef struct {
     uint32_t type;
 } VDAgentClipboard;
+
+typedef struct {
+    uint32_t type;
+} VDAgentClipboardRequest;
+
+typedef struct {
+    uint32_t type;              /* VD_AGENT_CLIPBOARD_* */
+    uint32_t codec;             /* ZIXIAO_CLIPBOARD_* */
+    uint32_t raw_size;
+    uint64_t hash;
+} VDAgentZixiaoClipboard;
 #pragma pack(pop)
 
 struct SpiceAgent {
@@ -85,6 +135,10 @@ struct SpiceAgent {
     SpiceAgentConfig config;
     InputCallback    input_callback;
     void            *input_callback_data;
+    ClipboardCallback clipboard_callback;
+    void            *clipboard_callback_data;
+    ClipboardRequestCallback clipboard_request_callback;
+    void            *clipboard_request_callback_data;
 
     /* State */
     bool             running;
@@ -95,13 +149,41 @@ struct SpiceAgent {
     int              fd;
     char             port_path[256];
 
+    /* Whole messages go out under the lock, so chunks never interleave */
+    pthread_mutex_t  send_mutex;
+
+    /* Chunk stream read from the port */
+    uint8_t          rx_buf[SPICE_RX_BUFFER_SIZE];
+    size_t           rx_len;
+
+    /* Message spanning chunks; the buffer only ever grows */
+    VDAgentMessage   rx_header;
+    uint8_t         *msg_buf;
+    size_t           msg_capacity;
+    size_t           msg_len;
+    size_t           msg_total;          /* 0 until the header is in */
+    bool             msg_discard;
+
     /* Capabilities */
     uint32_t         host_caps;
     uint32_t         guest_caps;
+
+    /* Clipboard the host holds (under send_mutex), and the compression
+     * buffer (clipboard thread only) */
+    uint64_t         clip_sent_hash;
+    uint32_t         clip_sent_type;
+    size_t           clip_sent_size;
+    uint8_t         *clip_buf;
+    size_t           clip_buf_capacity;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx       *zstd;
+#endif
 };
 
 static void *read_thread_func(void *arg);
 static bool send_message(SpiceAgent *sa, uint32_t type, const void *data, size_t size);
+static bool send_message_iov(SpiceAgent *sa, uint32_t type,
+                             const struct iovec *parts, int num_parts);
 static void process_message(SpiceAgent *sa, const uint8_t *data, size_t size);
 
 SpiceAgent *spice_agent_create(void) {
@@ -111,6 +193,7 @@ SpiceAgent *spice_agent_create(void) {
     sa->fd = -1;
     sa->running = false;
     sa->stopping = false;
+    pthread_mutex_init(&sa->send_mutex, NULL);
 
     return sa;
 }
@@ -119,6 +202,12 @@ void spice_agent_destroy(SpiceAgent *sa) {
     if (!sa) return;
 
     spice_agent_shutdown(sa);
+    pthread_mutex_destroy(&sa->send_mutex);
+    zixiao_free(sa->msg_buf);
+    zixiao_free(sa->clip_buf);
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(sa->zstd);
+#endif
     zixiao_free(sa);
 }
 
@@ -161,7 +250,8 @@ bool spice_agent_init(SpiceAgent *sa, const SpiceAgentConfig *config) {
         VD_AGENT_CAP_MONITORS_CONFIG |
         VD_AGENT_CAP_REPLY |
         VD_AGENT_CAP_CLIPBOARD |
-        VD_AGENT_CAP_CLIPBOARD_BY_DEMAND;
+        VD_AGENT_CAP_CLIPBOARD_BY_DEMAND |
+        VD_AGENT_CAP_ZIXIAO_CLIPBOARD;
 
     LOG_INFO("SPICE agent initialized");
     return true;
@@ -228,30 +318,154 @@ void spice_agent_set_input_callback(SpiceAgent *sa, InputCallback callback, void
     sa->input_callback_data = user_data;
 }
 
-static bool send_message(SpiceAgent *sa, uint32_t type, const void *data, size_t size) {
-    if (!sa || sa->fd < 0) return false;
+void spice_agent_set_clipboard_callback(SpiceAgent *sa, ClipboardCallback callback, void *user_data) {
+    if (!sa) return;
+    sa->clipboard_callback = callback;
+    sa->clipboard_callback_data = user_data;
+}
+
+void spice_agent_set_clipboard_request_callback(SpiceAgent *sa, ClipboardRequestCallback callback,
+                                                void *user_data) {
+    if (!sa) return;
+    sa->clipboard_request_callback = callback;
+    sa->clipboard_request_callback_data = user_data;
+}
+
+static uint32_t clipboard_format_to_vd(ClipboardFormat format) {
+    switch (format) {
+        case CLIPBOARD_FORMAT_TEXT:
+        case CLIPBOARD_FORMAT_UTF8:      return VD_AGENT_CLIPBOARD_UTF8_TEXT;
+        case CLIPBOARD_FORMAT_IMAGE_PNG: return VD_AGENT_CLIPBOARD_IMAGE_PNG;
+        case CLIPBOARD_FORMAT_IMAGE_BMP: return VD_AGENT_CLIPBOARD_IMAGE_BMP;
+        default:                         return VD_AGENT_CLIPBOARD_NONE;
+    }
+}
+
+static ClipboardFormat clipboard_format_from_vd(uint32_t type) {
+    switch (type) {
+        case VD_AGENT_CLIPBOARD_UTF8_TEXT: return CLIPBOARD_FORMAT_UTF8;
+        case VD_AGENT_CLIPBOARD_IMAGE_PNG: return CLIPBOARD_FORMAT_IMAGE_PNG;
+        case VD_AGENT_CLIPBOARD_IMAGE_BMP: return CLIPBOARD_FORMAT_IMAGE_BMP;
+        default:                           return CLIPBOARD_FORMAT_NONE;
+    }
+}
 
-    size_t total_size = sizeof(VDAgentHeader) + sizeof(VDAgentMessage) + size;
-    uint8_t *buf = zixiao_malloc(total_size);
-    if (!buf) return false;
+/* Write the whole vector, waiting out a full port */
+static bool write_all(SpiceAgent *sa, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(sa->fd, iov, iovcnt);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { .fd = sa->fd, .events = POLLOUT };
+                int ret = poll(&pfd, 1, SPICE_TX_TIMEOUT_MS);
+                if (ret > 0 || (ret < 0 && errno == EINTR)) continue;
+                LOG_ERROR("SPICE port write timed out");
+                return false;
+            }
+            LOG_ERROR("writev failed: %s", strerror(errno));
+            return false;
+        }
 
-    VDAgentHeader *header = (VDAgentHeader *)buf;
-    header->port = VD_AGENT_PORT;
-    header->size = sizeof(VDAgentMessage) + size;
+        /* Skip what went out; a short write can stop inside an entry */
+        size_t done = (size_t)n;
+        while (iovcnt > 0 && done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return true;
+}
 
-    VDAgentMessage *msg = (VDAgentMessage *)(buf + sizeof(VDAgentHeader));
-    msg->type = type;
-    msg->opaque = 0;
-    msg->size = size;
+/*
+ * Send one message straight from the caller's buffers. The message
+ * header and payload parts are cut into chunks of at most
+ * VD_AGENT_MAX_DATA_SIZE, each behind its chunk header, and written a
+ * batch of chunks per writev without copying the payload.
+ */
+static bool send_message_iov(SpiceAgent *sa, uint32_t type,
+                             const struct iovec *parts, int num_parts) {
+    if (!sa || sa->fd < 0 || num_parts < 0 || num_parts > SPICE_TX_MAX_PARTS) return false;
 
-    if (size > 0 && data) {
-        memcpy(buf + sizeof(VDAgentHeader) + sizeof(VDAgentMessage), data, size);
+    size_t size = 0;
+    for (int i = 0; i < num_parts; i++) {
+        size += parts[i].iov_len;
     }
+    if (size > UINT32_MAX - sizeof(VDAgentMessage)) return false;
 
-    ssize_t written = write(sa->fd, buf, total_size);
-    zixiao_free(buf);
+    VDAgentMessage msg = {
+        .type = type,
+        .opaque = 0,
+        .size = (uint32_t)size
+    };
 
-    return written == (ssize_t)total_size;
+    /* The stream to cut: message header, then the payload */
+    struct iovec src[SPICE_TX_MAX_PARTS + 1];
+    src[0].iov_base = &msg;
+    src[0].iov_len = sizeof(msg);
+    for (int i = 0; i < num_parts; i++) {
+        src[i + 1] = parts[i];
+    }
+
+    /* A chunk takes its header plus a piece of each part it touches */
+    VDAgentHeader headers[SPICE_TX_CHUNKS_PER_WRITE];
+    struct iovec iov[SPICE_TX_CHUNKS_PER_WRITE * (SPICE_TX_MAX_PARTS + 2)];
+
+    size_t remaining = sizeof(msg) + size;
+    int seg = 0;
+    size_t seg_off = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&sa->send_mutex);
+
+    while (ok && remaining > 0) {
+        int iovcnt = 0;
+
+        for (int c = 0; c < SPICE_TX_CHUNKS_PER_WRITE && remaining > 0; c++) {
+            size_t chunk = remaining < VD_AGENT_MAX_DATA_SIZE ? remaining : VD_AGENT_MAX_DATA_SIZE;
+            remaining -= chunk;
+
+            headers[c].port = VD_AGENT_PORT;
+            headers[c].size = (uint32_t)chunk;
+            iov[iovcnt].iov_base = &headers[c];
+            iov[iovcnt].iov_len = sizeof(VDAgentHeader);
+            iovcnt++;
+
+            while (chunk > 0) {
+                size_t n = src[seg].iov_len - seg_off;
+                if (n > chunk) n = chunk;
+                if (n > 0) {
+                    iov[iovcnt].iov_base = (uint8_t *)src[seg].iov_base + seg_off;
+                    iov[iovcnt].iov_len = n;
+                    iovcnt++;
+                }
+                chunk -= n;
+                seg_off += n;
+                if (seg_off == src[seg].iov_len) {
+                    seg++;
+                    seg_off = 0;
+                }
+            }
+        }
+
+        ok = write_all(sa, iov, iovcnt);
+    }
+
+    pthread_mutex_unlock(&sa->send_mutex);
+    return ok;
+}
+
+static bool send_message(SpiceAgent *sa, uint32_t type, const void *data, size_t size) {
+    struct iovec part = {
+        .iov_base = (void *)data,
+        .iov_len = data ? size : 0
+    };
+    return send_message_iov(sa, type, &part, 1);
 }
 
 static void process_message(SpiceAgent *sa, const uint8_t *data, size_t size) {
@@ -287,6 +501,11 @@ static void process_message(SpiceAgent *sa, const uint8_t *data, size_t size) {
                 LOG_INFO("Host capabilities: 0x%08X", sa->host_caps);
 
                 if (caps->request) {
+                    /* A new host session holds no clipboard of ours */
+                    pthread_mutex_lock(&sa->send_mutex);
+                    sa->clip_sent_hash = 0;
+                    pthread_mutex_unlock(&sa->send_mutex);
+
                     VDAgentAnnounceCapabilities resp = {0};
                     resp.request = 0;
                     resp.caps[0] = sa->guest_caps;
@@ -296,13 +515,47 @@ static void process_message(SpiceAgent *sa, const uint8_t *data, size_t size) {
             break;
         }
 
-        case VD_AGENT_CLIPBOARD_GRAB:
+        case VD_AGENT_CLIPBOARD_GRAB: {
+            /* Fetch the first type we can hold; we cannot stall local
+             * pastes waiting for the host */
+            const uint32_t *types = (const uint32_t *)payload;
+            for (size_t i = 0; i < msg->size / sizeof(uint32_t); i++) {
+                if (clipboard_format_from_vd(types[i]) != CLIPBOARD_FORMAT_NONE) {
+                    VDAgentClipboardRequest req = { .type = types[i] };
+                    send_message(sa, VD_AGENT_CLIPBOARD_REQUEST, &req, sizeof(req));
+                    break;
+                }
+            }
             LOG_DEBUG("Clipboard grab from host");
             break;
+        }
 
-        case VD_AGENT_CLIPBOARD_REQUEST:
-            LOG_DEBUG("Clipboard request from host");
+        case VD_AGENT_CLIPBOARD_REQUEST: {
+            if (msg->size >= sizeof(VDAgentClipboardRequest)) {
+                const VDAgentClipboardRequest *req = (const VDAgentClipboardRequest *)payload;
+                ClipboardFormat format = clipboard_format_from_vd(req->type);
+                LOG_DEBUG("Clipboard request from host: type %u", req->type);
+                if (format != CLIPBOARD_FORMAT_NONE && sa->clipboard_request_callback) {
+                    sa->clipboard_request_callback(format, sa->clipboard_request_callback_data);
+                }
+            }
             break;
+        }
+
+        case VD_AGENT_CLIPBOARD: {
+            if (msg->size >= sizeof(VDAgentClipboard)) {
+                const VDAgentClipboard *clip = (const VDAgentClipboard *)payload;
+                ClipboardData data = {
+                    .format = clipboard_format_from_vd(clip->type),
+                    .data = (uint8_t *)payload + sizeof(VDAgentClipboard),
+                    .data_size = msg->size - sizeof(VDAgentClipboard)
+                };
+                if (data.format != CLIPBOARD_FORMAT_NONE && sa->clipboard_callback) {
+                    sa->clipboard_callback(&data, sa->clipboard_callback_data);
+                }
+            }
+            break;
+        }
 
         default:
             LOG_DEBUG("Unhandled SPICE message type: %u", msg->type);
@@ -310,14 +563,79 @@ static void process_message(SpiceAgent *sa, const uint8_t *data, size_t size) {
     }
 }
 
+/* Message data out of one chunk; messages may span chunk boundaries */
+static void receive_message_data(SpiceAgent *sa, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        /* A message whole inside the chunk is handled in place */
+        if (sa->msg_total == 0 && sa->msg_len == 0 && size >= sizeof(VDAgentMessage)) {
+            const VDAgentMessage *msg = (const VDAgentMessage *)data;
+            size_t total = sizeof(VDAgentMessage) + (size_t)msg->size;
+            if (total <= size) {
+                process_message(sa, data, total);
+                data += total;
+                size -= total;
+                continue;
+            }
+        }
+
+        if (sa->msg_total == 0) {
+            /* Gather the header to learn the message size */
+            size_t n = sizeof(VDAgentMessage) - sa->msg_len;
+            if (n > size) n = size;
+            memcpy((uint8_t *)&sa->rx_header + sa->msg_len, data, n);
+            sa->msg_len += n;
+            data += n;
+            size -= n;
+            if (sa->msg_len < sizeof(VDAgentMessage)) continue;
+
+            sa->msg_total = sizeof(VDAgentMessage) + (size_t)sa->rx_header.size;
+            sa->msg_discard = false;
+            if (sa->msg_total > SPICE_RX_MAX_MESSAGE) {
+                LOG_WARNING("Dropping SPICE message type=%u of %zu bytes",
+                            sa->rx_header.type, sa->msg_total);
+                sa->msg_discard = true;
+            } else if (sa->msg_total > sa->msg_capacity) {
+                uint8_t *buf = zixiao_realloc(sa->msg_buf, sa->msg_total);
+                if (buf) {
+                    sa->msg_buf = buf;
+                    sa->msg_capacity = sa->msg_total;
+                } else {
+                    sa->msg_discard = true;
+                }
+            }
+            if (!sa->msg_discard) {
+                memcpy(sa->msg_buf, &sa->rx_header, sizeof(VDAgentMessage));
+            }
+        }
+
+        size_t n = sa->msg_total - sa->msg_len;
+        if (n > size) n = size;
+        if (!sa->msg_discard) {
+            memcpy(sa->msg_buf + sa->msg_len, data, n);
+        }
+        sa->msg_len += n;
+        data += n;
+        size -= n;
+
+        if (sa->msg_len == sa->msg_total) {
+            if (!sa->msg_discard) {
+                process_message(sa, sa->msg_buf, sa->msg_total);
+            }
+            sa->msg_len = 0;
+            sa->msg_total = 0;
+        }
+    }
+}
+
 static void *read_thread_func(void *arg) {
     SpiceAgent *sa = (SpiceAgent *)arg;
-    uint8_t buffer[4096];
-    uint8_t msg_buffer[65536];
-    size_t msg_offset = 0;
 
     LOG_DEBUG("SPICE read thread started");
 
+    sa->rx_len = 0;
+    sa->msg_len = 0;
+    sa->msg_total = 0;
+
     struct pollfd pfd = {
         .fd = sa->fd,
         .events = POLLIN
@@ -337,7 +655,8 @@ static void *read_thread_func(void *arg) {
         if (ret == 0) continue;  /* Timeout */
 
         if (pfd.revents & POLLIN) {
-            ssize_t n = read(sa->fd, buffer, sizeof(buffer));
+            /* Straight into the chunk buffer, behind any partial chunk */
+            ssize_t n = read(sa->fd, sa->rx_buf + sa->rx_len, sizeof(sa->rx_buf) - sa->rx_len);
             if (n < 0) {
                 if (errno != EAGAIN && errno != EWOULDBLOCK) {
                     LOG_ERROR("read failed: %s", strerror(errno));
@@ -351,23 +670,33 @@ static void *read_thread_func(void *arg) {
                 break;
             }
 
-            /* Append to message buffer */
-            if (msg_offset + n <= sizeof(msg_buffer)) {
-                memcpy(msg_buffer + msg_offset, buffer, n);
-                msg_offset += n;
-            }
+            sa->rx_len += (size_t)n;
 
-            /* Process complete messages */
-            while (msg_offset >= sizeof(VDAgentHeader)) {
-                VDAgentHeader *header = (VDAgentHeader *)msg_buffer;
-                size_t total_size = sizeof(VDAgentHeader) + header->size;
+            /* Process complete chunks */
+            size_t offset = 0;
+            while (sa->rx_len - offset >= sizeof(VDAgentHeader)) {
+                const VDAgentHeader *header = (const VDAgentHeader *)(sa->rx_buf + offset);
+                size_t chunk_size = sizeof(VDAgentHeader) + (size_t)header->size;
 
-                if (msg_offset < total_size) break;
+                if (chunk_size > sizeof(sa->rx_buf)) {
+                    /* Framing is lost; start over with the next read */
+                    LOG_ERROR("SPICE chunk of %u bytes exceeds buffer", header->size);
+                    offset = sa->rx_len;
+                    sa->msg_len = 0;
+                    sa->msg_total = 0;
+                    break;
+                }
+                if (sa->rx_len - offset < chunk_size) break;
 
-                process_message(sa, msg_buffer + sizeof(VDAgentHeader), header->size);
+                receive_message_data(sa, sa->rx_buf + offset + sizeof(VDAgentHeader),
+                                     header->size);
+                offset += chunk_size;
+            }
 
-                memmove(msg_buffer, msg_buffer + total_size, msg_offset - total_size);
-                msg_offset -= total_size;
+            /* Only a partial chunk is left to move */
+            if (offset > 0) {
+                memmove(sa->rx_buf, sa->rx_buf + offset, sa->rx_len - offset);
+                sa->rx_len -= offset;
             }
         }
     }
@@ -383,48 +712,155 @@ bool spice_agent_send_frame(SpiceAgent *sa, const FrameData *frame) {
     return true;
 }
 
+bool spice_agent_send_clipboard_grab(SpiceAgent *sa, const ClipboardFormat *formats,
+                                     uint32_t count) {
+    if (!sa || !formats) return false;
+
+    /* Types only; the data waits for the host's request */
+    uint32_t types[CLIPBOARD_FORMAT_FILE_LIST + 1];
+    uint32_t num_types = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t type = clipboard_format_to_vd(formats[i]);
+        bool seen = (type == VD_AGENT_CLIPBOARD_NONE);
+        for (uint32_t j = 0; j < num_types && !seen; j++) {
+            seen = types[j] == type;
+        }
+        if (!seen && num_types < sizeof(types) / sizeof(types[0])) {
+            types[num_types++] = type;
+        }
+    }
+
+    if (num_types == 0) return false;
+    return send_message(sa, VD_AGENT_CLIPBOARD_GRAB, types, num_types * sizeof(uint32_t));
+}
+
+/*
+ * Compress into clip_buf; false when the codec is missing or saves
+ * less than a tenth. Called with send_mutex held.
+ */
+static bool clipboard_compress(SpiceAgent *sa, const uint8_t *data, size_t size,
+                               uint32_t *codec, size_t *out_size) {
+#if defined(HAVE_ZSTD) || defined(HAVE_LZ4)
+# if defined(HAVE_ZSTD)
+    size_t bound = ZSTD_compressBound(size);
+# else
+    if (size > LZ4_MAX_INPUT_SIZE) return false;
+    size_t bound = (size_t)LZ4_compressBound((int)size);
+# endif
+
+    if (bound > sa->clip_buf_capacity) {
+        uint8_t *buf = zixiao_realloc(sa->clip_buf, bound);
+        if (!buf) return false;
+        sa->clip_buf = buf;
+        sa->clip_buf_capacity = bound;
+    }
+
+# if defined(HAVE_ZSTD)
+    if (!sa->zstd && !(sa->zstd = ZSTD_createCCtx())) return false;
+
+    /* Level 1: a paste is waiting on it */
+    size_t n = ZSTD_compressCCtx(sa->zstd, sa->clip_buf, bound, data, size, 1);
+    if (ZSTD_isError(n)) return false;
+    *codec = ZIXIAO_CLIPBOARD_ZSTD;
+# else
+    int ret = LZ4_compress_default((const char *)data, (char *)sa->clip_buf,
+                                   (int)size, (int)bound);
+    if (ret <= 0) return false;
+    size_t n = (size_t)ret;
+    *codec = ZIXIAO_CLIPBOARD_LZ4;
+# endif
+
+    if (n > size - size / 10) return false;
+    *out_size = n;
+    return true;
+#else
+    (void)sa;
+    (void)data;
+    (void)size;
+    (void)codec;
+    (void)out_size;
+    return false;
+#endif
+}
+
 bool spice_agent_send_clipboard(SpiceAgent *sa, const ClipboardData *data) {
-    if (!sa || !data || data->format == CLIPBOARD_FORMAT_NONE) return false;
-
-    /* First, grab clipboard */
-    uint32_t types[2] = {0};
-    if (data->format == CLIPBOARD_FORMAT_UTF8 || data->format == CLIPBOARD_FORMAT_TEXT) {
-        types[0] = VD_AGENT_CLIPBOARD_UTF8_TEXT;
-    } else if (data->format == CLIPBOARD_FORMAT_IMAGE_PNG) {
-        types[0] = VD_AGENT_CLIPBOARD_IMAGE_PNG;
-    } else {
-        return false;
+    if (!sa || !data || (!data->data && data->data_size > 0)) return false;
+
+    uint32_t type = clipboard_format_to_vd(data->format);
+    if (type == VD_AGENT_CLIPBOARD_NONE) return false;
+
+    /* Stock hosts: plain data, straight from the caller's buffer */
+    if (!(sa->host_caps & VD_AGENT_CAP_ZIXIAO_CLIPBOARD) || data->data_size > UINT32_MAX) {
+        VDAgentClipboard clip = { .type = type };
+        struct iovec parts[2] = {
+            { .iov_base = &clip, .iov_len = sizeof(clip) },
+            { .iov_base = data->data, .iov_len = data->data_size }
+        };
+
+        return send_message_iov(sa, VD_AGENT_CLIPBOARD, parts, 2);
+    }
+
+    VDAgentZixiaoClipboard clip = {
+        .type = type,
+        .codec = ZIXIAO_CLIPBOARD_RAW,
+        .raw_size = (uint32_t)data->data_size,
+        .hash = data->hash
+    };
+    struct iovec parts[2] = {
+        { .iov_base = &clip, .iov_len = sizeof(clip) },
+        { .iov_base = data->data, .iov_len = data->data_size }
+    };
+
+    pthread_mutex_lock(&sa->send_mutex);
+
+    if (data->hash && data->hash == sa->clip_sent_hash && type == sa->clip_sent_type &&
+        data->data_size == sa->clip_sent_size) {
+        /* A re-copy of what the host already has */
+        clip.codec = ZIXIAO_CLIPBOARD_REF;
+        parts[1].iov_len = 0;
+    } else if (data->data_size >= SPICE_CLIPBOARD_COMPRESS_MIN &&
+               type != VD_AGENT_CLIPBOARD_IMAGE_PNG) {
+        uint32_t codec;
+        size_t size;
+        if (clipboard_compress(sa, data->data, data->data_size, &codec, &size)) {
+            clip.codec = codec;
+            parts[1].iov_base = sa->clip_buf;
+            parts[1].iov_len = size;
+        }
     }
 
-    send_message(sa, VD_AGENT_CLIPBOARD_GRAB, types, sizeof(uint32_t) * 2);
+    pthread_mutex_unlock(&sa->send_mutex);
 
-    /* Then send data */
-    size_t clip_size = sizeof(VDAgentClipboard) + data->data_size;
-    uint8_t *buf = zixiao_malloc(clip_size);
-    if (!buf) return false;
+    LOG_DEBUG("Clipboard to host: %zu bytes as %zu (codec %u)",
+              data->data_size, parts[1].iov_len, clip.codec);
 
-    VDAgentClipboard *clip = (VDAgentClipboard *)buf;
-    clip->type = types[0];
-    memcpy(buf + sizeof(VDAgentClipboard), data->data, data->data_size);
+    /* Only the clipboard thread sends clipboard data, so clip_buf
+     * is not rewritten under the send */
+    bool ok = send_message_iov(sa, VD_AGENT_ZIXIAO_CLIPBOARD, parts, 2);
 
-    bool result = send_message(sa, VD_AGENT_CLIPBOARD, buf, clip_size);
-    zixiao_free(buf);
+    pthread_mutex_lock(&sa->send_mutex);
+    sa->clip_sent_hash = ok ? data->hash : 0;
+    sa->clip_sent_type = type;
+    sa->clip_sent_size = data->data_size;
+    pthread_mutex_unlock(&sa->send_mutex);
 
-    return result;
+    return ok;
 }
 
 bool spice_agent_send_monitor_config(SpiceAgent *sa, const MonitorInfo *monitors, int count) {
     if (!sa || !monitors || count <= 0) return false;
 
-    size_t size = sizeof(VDAgentMonitorsConfig) + count * sizeof(VDAgentMonitor);
-    uint8_t *buf = zixiao_malloc(size);
-    if (!buf) return false;
+    if (count > VD_AGENT_MAX_MONITORS) {
+        LOG_WARNING("Reporting %d of %d monitors", VD_AGENT_MAX_MONITORS, count);
+        count = VD_AGENT_MAX_MONITORS;
+    }
 
-    VDAgentMonitorsConfig *config = (VDAgentMonitorsConfig *)buf;
-    config->num_monitors = count;
-    config->flags = 0;
+    VDAgentMonitorsConfig config = {
+        .num_monitors = (uint32_t)count,
+        .flags = 0
+    };
 
-    VDAgentMonitor *mons = (VDAgentMonitor *)(buf + sizeof(VDAgentMonitorsConfig));
+    VDAgentMonitor mons[VD_AGENT_MAX_MONITORS];
     for (int i = 0; i < count; i++) {
         mons[i].width = monitors[i].width;
         mons[i].height = monitors[i].height;
@@ -433,8 +869,10 @@ bool spice_agent_send_monitor_config(SpiceAgent *sa, const MonitorInfo *monitors
         mons[i].y = monitors[i].y;
     }
 
-    bool result = send_message(sa, VD_AGENT_MONITORS_CONFIG, buf, size);
-    zixiao_free(buf);
+    struct iovec parts[2] = {
+        { .iov_base = &config, .iov_len = sizeof(config) },
+        { .iov_base = mons, .iov_len = (size_t)count * sizeof(VDAgentMonitor) }
+    };
 
-    return result;
+    return send_message_iov(sa, VD_AGENT_MONITORS_CONFIG, parts, 2);
 }
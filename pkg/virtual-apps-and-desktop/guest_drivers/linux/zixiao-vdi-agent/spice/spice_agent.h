@@ -38,8 +38,17 @@ bool spice_agent_is_running(SpiceAgent *sa);
 /* Callbacks */
 void spice_agent_set_input_callback(SpiceAgent *sa, InputCallback callback, void *user_data);
 
+/* Clipboard data from the host, and host requests for ours */
+void spice_agent_set_clipboard_callback(SpiceAgent *sa, ClipboardCallback callback, void *user_data);
+void spice_agent_set_clipboard_request_callback(SpiceAgent *sa, ClipboardRequestCallback callback,
+                                                void *user_data);
+
 /* Send data to host */
 bool spice_agent_send_frame(SpiceAgent *sa, const FrameData *frame);
+
+/* Clipboard: the grab offers formats, data answers a host request */
+bool spice_agent_send_clipboard_grab(SpiceAgent *sa, const ClipboardFormat *formats,
+                                     uint32_t count);
 bool spice_agent_send_clipboard(SpiceAgent *sa, const ClipboardData *data);
 bool spice_agent_send_monitor_config(SpiceAgent *sa, const MonitorInfo *monitors, int count);
 
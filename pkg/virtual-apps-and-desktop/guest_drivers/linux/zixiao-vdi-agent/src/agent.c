@@ -19,6 +19,25 @@
 
 static VDIAgent *g_agent = NULL;
 
+/*
+ * Video keeps the newest frames: a stale one is worth less than the
+ * next. Audio keeps what it already has: dropping the newest packet is
+ * one gap, where evicting would cut into audio already in sequence.
+ */
+#define AGENT_VIDEO_QUEUE_DEPTH     2
+#define AGENT_AUDIO_QUEUE_DEPTH     16      /* 160 ms of 10 ms packets */
+
+/* Largest audio block carried: an Opus packet, or 20 ms of stereo PCM */
+#define AGENT_AUDIO_MAX_PAYLOAD     4000
+
+typedef struct {
+    AudioData   audio;
+    uint8_t     payload[AGENT_AUDIO_MAX_PAYLOAD];
+} QueuedAudio;
+
+/* Changes this long after the last input are not its doing */
+#define AGENT_PROBE_MAX_US          1000000
+
 /* Log function declaration */
 void zixiao_log_init(LogLevel min_level, bool use_syslog, const char *log_file);
 void zixiao_log_shutdown(void);
@@ -30,6 +49,7 @@ void agent_config_default(AgentConfig *config) {
     config->virtio_port = "/dev/virtio-ports/org.zixiao.vdi.0";
     config->signaling_url = "ws://localhost:8080/signaling";
     config->target_fps = 30;
+    config->max_monitors = 4;
     config->capture_audio = true;
     config->daemonize = false;
     config->pid_file = "/var/run/zixiao-vdi-agent.pid";
@@ -51,6 +71,7 @@ VDIAgent *agent_create(const AgentConfig *config) {
 
     agent->running = false;
     agent->stopping = false;
+    pthread_mutex_init(&agent->probe_mutex, NULL);
 
     return agent;
 }
@@ -76,32 +97,195 @@ void agent_destroy(VDIAgent *agent) {
     if (agent->audio) {
         audio_capture_destroy(agent->audio);
     }
-    if (agent->display) {
-        display_capture_destroy(agent->display);
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        display_capture_destroy(agent->displays[i]);
     }
 
+    if (agent->audio_queue) {
+        sem_destroy(&agent->transport_wake);
+    }
+    for (int i = 0; i < ZIXIAO_MAX_MONITORS; i++) {
+        spsc_queue_destroy(agent->video_queues[i]);
+    }
+    spsc_queue_destroy(agent->audio_queue);
+    pthread_mutex_destroy(&agent->probe_mutex);
+
     zixiao_free(agent);
 }
 
-/* Frame callback for display capture */
+/*
+ * The first frame with damage after input reached uinput closes one
+ * latency sample, whichever monitor it is on. Full-screen and key
+ * frames carry no damage list and are skipped, so are frames without
+ * XDamage. Others that change the screen at the same time make the
+ * sample optimistic.
+ */
+static void probe_input_latency(VDIAgent *agent, const FrameData *frame) {
+    if (!agent->input || frame->key_frame || frame->num_dirty_rects == 0) return;
+
+    uint64_t injected = input_handler_get_last_inject_us(agent->input);
+    uint64_t now = get_timestamp_us();
+
+    /* Capture threads race for the sample */
+    pthread_mutex_lock(&agent->probe_mutex);
+    if (injected <= agent->probe_inject_us) {
+        pthread_mutex_unlock(&agent->probe_mutex);
+        return;
+    }
+    agent->probe_inject_us = injected;
+    if (now <= injected || now - injected >= AGENT_PROBE_MAX_US) {
+        pthread_mutex_unlock(&agent->probe_mutex);
+        return;
+    }
+
+    uint32_t latency = (uint32_t)(now - injected);
+
+    agent->latency_last_us = latency;
+    agent->latency_avg_us = agent->latency_samples
+        ? agent->latency_avg_us - agent->latency_avg_us / 8 + latency / 8
+        : latency;
+    if (latency > agent->latency_max_us) {
+        agent->latency_max_us = latency;
+    }
+    agent->latency_samples++;
+    pthread_mutex_unlock(&agent->probe_mutex);
+}
+
+/* Frame callback for display capture; runs on the monitor's capture thread */
 static void on_frame_captured(const FrameData *frame, void *user_data) {
     VDIAgent *agent = (VDIAgent *)user_data;
 
-    if (agent->spice) {
-        spice_agent_send_frame(agent->spice, frame);
+    probe_input_latency(agent, frame);
+
+    /* The queue keeps the capture buffer until the transport is done */
+    FrameData evicted;
+    SpscQueue *queue = agent->video_queues[frame->monitor];
+    display_capture_retain_frame(frame);
+    if (spsc_queue_push_evict(queue, frame, &evicted)) {
+        display_capture_release_frame(&evicted);
     }
-    if (agent->webrtc) {
-        webrtc_agent_send_frame(agent->webrtc, frame);
+    sem_post(&agent->transport_wake);
+}
+
+/* Capture rate from the WebRTC congestion controller; SPICE clients
+ * share the capture and follow it */
+static void on_capture_fps(uint32_t fps, void *user_data) {
+    VDIAgent *agent = (VDIAgent *)user_data;
+
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        display_capture_set_fps(agent->displays[i], fps);
+    }
+
+    /* Motion finer than a frame would not show */
+    if (agent->input && fps > 0) {
+        input_handler_set_batch_interval(agent->input, 1000000 / fps);
     }
 }
 
-/* Audio callback */
+/* Audio callback; runs on the PulseAudio thread */
 static void on_audio_captured(const AudioData *audio, void *user_data) {
     VDIAgent *agent = (VDIAgent *)user_data;
 
-    if (agent->webrtc) {
-        webrtc_agent_send_audio(agent->webrtc, audio);
+    if (audio->data_size > AGENT_AUDIO_MAX_PAYLOAD) {
+        LOG_WARNING("Audio block of %zu bytes too large to queue", audio->data_size);
+        return;
+    }
+
+    /* The capture reuses its packet buffer, so the queue holds a copy */
+    QueuedAudio queued;
+    queued.audio = *audio;
+    queued.audio.data = NULL;
+    memcpy(queued.payload, audio->data, audio->data_size);
+
+    if (spsc_queue_push(agent->audio_queue, &queued)) {
+        sem_post(&agent->transport_wake);
+    }
+}
+
+/*
+ * Transport thread: the only caller of the SPICE and WebRTC send paths.
+ * Audio goes first on every pass, so a slow frame send delays it by
+ * one frame at most. Each pass takes a frame from every monitor, so a
+ * busy one cannot starve the rest.
+ */
+static void *transport_thread_func(void *arg) {
+    VDIAgent *agent = (VDIAgent *)arg;
+    QueuedAudio queued;
+    FrameData frame;
+
+    LOG_DEBUG("Transport thread started");
+
+    while (agent->transport_running) {
+        sem_wait(&agent->transport_wake);
+
+        bool busy = true;
+        while (busy && agent->transport_running) {
+            busy = false;
+
+            while (spsc_queue_pop(agent->audio_queue, &queued)) {
+                queued.audio.data = queued.payload;
+                if (agent->webrtc) {
+                    webrtc_agent_send_audio(agent->webrtc, &queued.audio);
+                }
+                busy = true;
+            }
+
+            for (uint32_t i = 0; i < agent->num_displays; i++) {
+                if (!spsc_queue_pop(agent->video_queues[i], &frame)) continue;
+
+                if (agent->spice) {
+                    spice_agent_send_frame(agent->spice, &frame);
+                }
+                if (agent->webrtc) {
+                    webrtc_agent_send_frame(agent->webrtc, &frame);
+                }
+                display_capture_release_frame(&frame);
+                busy = true;
+            }
+        }
+    }
+
+    LOG_DEBUG("Transport thread exiting");
+    return NULL;
+}
+
+/* Return what capture left queued once capture and transport stopped */
+static void agent_flush_queues(VDIAgent *agent) {
+    QueuedAudio queued;
+    FrameData frame;
+
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        while (spsc_queue_pop(agent->video_queues[i], &frame)) {
+            display_capture_release_frame(&frame);
+        }
+    }
+    while (spsc_queue_pop(agent->audio_queue, &queued)) {
+        /* Copies; nothing to return */
+    }
+}
+
+void agent_get_queue_stats(VDIAgent *agent, AgentQueueStats *stats) {
+    if (!agent || !stats) return;
+
+    stats->video_queued = 0;
+    stats->video_dropped = 0;
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        stats->video_queued += spsc_queue_size(agent->video_queues[i]);
+        stats->video_dropped += spsc_queue_dropped(agent->video_queues[i]);
     }
+    stats->audio_queued = spsc_queue_size(agent->audio_queue);
+    stats->audio_dropped = spsc_queue_dropped(agent->audio_queue);
+}
+
+void agent_get_input_latency(VDIAgent *agent, AgentLatencyStats *stats) {
+    if (!agent || !stats) return;
+
+    pthread_mutex_lock(&agent->probe_mutex);
+    stats->samples = agent->latency_samples;
+    stats->last_us = agent->latency_last_us;
+    stats->avg_us = agent->latency_avg_us;
+    stats->max_us = agent->latency_max_us;
+    pthread_mutex_unlock(&agent->probe_mutex);
 }
 
 /* Input callback from SPICE/WebRTC */
@@ -113,8 +297,16 @@ static void on_input_received(const InputEvent *event, void *user_data) {
     }
 }
 
-/* Clipboard callback */
-static void on_clipboard_changed(const ClipboardData *data, void *user_data) {
+/* Clipboard callbacks: local formats are offered, data follows on request */
+static void on_clipboard_offer(const ClipboardFormat *formats, uint32_t count, void *user_data) {
+    VDIAgent *agent = (VDIAgent *)user_data;
+
+    if (agent->spice) {
+        spice_agent_send_clipboard_grab(agent->spice, formats, count);
+    }
+}
+
+static void on_clipboard_data(const ClipboardData *data, void *user_data) {
     VDIAgent *agent = (VDIAgent *)user_data;
 
     if (agent->spice) {
@@ -122,36 +314,102 @@ static void on_clipboard_changed(const ClipboardData *data, void *user_data) {
     }
 }
 
+static void on_clipboard_request(ClipboardFormat format, void *user_data) {
+    VDIAgent *agent = (VDIAgent *)user_data;
+
+    if (agent->clipboard) {
+        clipboard_manager_request(agent->clipboard, format);
+    }
+}
+
+static void on_remote_clipboard(const ClipboardData *data, void *user_data) {
+    VDIAgent *agent = (VDIAgent *)user_data;
+
+    if (agent->clipboard) {
+        clipboard_manager_set(agent->clipboard, data);
+    }
+}
+
+/*
+ * A display capture per monitor, each with its own X connection, thread
+ * and buffers sized to it. Threads are pinned from the last CPU down
+ * when there are more CPUs than monitors, away from CPU 0 and the
+ * interrupts it takes. One monitor, or max_monitors of 1, is captured
+ * as the whole screen.
+ */
+static bool agent_init_displays(VDIAgent *agent) {
+    MonitorInfo monitors[ZIXIAO_MAX_MONITORS];
+    int count = display_capture_query_monitors(monitors, ZIXIAO_MAX_MONITORS);
+    uint32_t wanted = agent->config.max_monitors;
+
+    if (wanted > (uint32_t)count) wanted = (uint32_t)count;
+    if (wanted == 0) wanted = 1;
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool per_monitor = wanted > 1;
+
+    for (uint32_t i = 0; i < wanted; i++) {
+        DisplayCaptureConfig display_config = {
+            .target_fps = agent->config.target_fps,
+            .monitor_id = per_monitor ? i : DISPLAY_MONITOR_ALL,
+            .pin_cpu = per_monitor && cpus > (long)wanted,
+            .cpu = per_monitor && cpus > (long)wanted ? (uint32_t)(cpus - 1 - i) : 0
+        };
+
+        agent->video_queues[i] = spsc_queue_create(AGENT_VIDEO_QUEUE_DEPTH, sizeof(FrameData));
+        DisplayCapture *dc = display_capture_create();
+        if (!agent->video_queues[i] || !dc) {
+            LOG_ERROR("Failed to create display capture");
+            display_capture_destroy(dc);
+            return false;
+        }
+
+        if (!display_capture_init(dc, &display_config)) {
+            LOG_ERROR("Failed to initialize display capture");
+            display_capture_destroy(dc);
+            return false;
+        }
+
+        display_capture_set_callback(dc, on_frame_captured, agent);
+        agent->displays[agent->num_displays++] = dc;
+    }
+
+    if (per_monitor) {
+        LOG_INFO("Capturing %u monitors as separate streams", agent->num_displays);
+    }
+    return true;
+}
+
 bool agent_init(VDIAgent *agent) {
     if (!agent) return false;
 
     LOG_INFO("Initializing Zixiao VDI Agent v%d.%d.%d",
              ZIXIAO_VDI_VERSION_MAJOR, ZIXIAO_VDI_VERSION_MINOR, ZIXIAO_VDI_VERSION_PATCH);
 
-    /* Initialize display capture */
-    agent->display = display_capture_create();
-    if (!agent->display) {
-        LOG_ERROR("Failed to create display capture");
+    /* Capture-to-transport queues */
+    agent->audio_queue = spsc_queue_create(AGENT_AUDIO_QUEUE_DEPTH, sizeof(QueuedAudio));
+    if (!agent->audio_queue) {
+        LOG_ERROR("Failed to create transport queues");
         return false;
     }
+    sem_init(&agent->transport_wake, 0, 0);
 
-    DisplayCaptureConfig display_config = {
-        .target_fps = agent->config.target_fps,
-        .monitor_id = 0  /* Primary monitor */
-    };
-
-    if (!display_capture_init(agent->display, &display_config)) {
-        LOG_ERROR("Failed to initialize display capture");
+    /* Initialize display capture */
+    if (!agent_init_displays(agent)) {
         return false;
     }
 
-    display_capture_set_callback(agent->display, on_frame_captured, agent);
-
     /* Initialize audio capture */
     if (agent->config.capture_audio) {
         agent->audio = audio_capture_create();
         if (agent->audio) {
-            if (!audio_capture_init(agent->audio)) {
+            /* WebRTC carries Opus; 10 ms frames keep audio ahead of video */
+            AudioCaptureConfig audio_config = {
+                .codec = AUDIO_CODEC_OPUS,
+                .frame_ms = 10
+            };
+
+            if (!audio_capture_init(agent->audio, &audio_config)) {
                 LOG_WARNING("Failed to initialize audio capture (non-fatal)");
                 audio_capture_destroy(agent->audio);
                 agent->audio = NULL;
@@ -173,6 +431,10 @@ bool agent_init(VDIAgent *agent) {
         return false;
     }
 
+    if (agent->config.target_fps > 0) {
+        input_handler_set_batch_interval(agent->input, 1000000 / agent->config.target_fps);
+    }
+
     /* Initialize clipboard manager */
     agent->clipboard = clipboard_manager_create();
     if (agent->clipboard) {
@@ -181,7 +443,8 @@ bool agent_init(VDIAgent *agent) {
             clipboard_manager_destroy(agent->clipboard);
             agent->clipboard = NULL;
         } else {
-            clipboard_manager_set_callback(agent->clipboard, on_clipboard_changed, agent);
+            clipboard_manager_set_offer_callback(agent->clipboard, on_clipboard_offer, agent);
+            clipboard_manager_set_callback(agent->clipboard, on_clipboard_data, agent);
         }
     }
 
@@ -199,6 +462,8 @@ bool agent_init(VDIAgent *agent) {
                 agent->spice = NULL;
             } else {
                 spice_agent_set_input_callback(agent->spice, on_input_received, agent);
+                spice_agent_set_clipboard_callback(agent->spice, on_remote_clipboard, agent);
+                spice_agent_set_clipboard_request_callback(agent->spice, on_clipboard_request, agent);
             }
         }
     }
@@ -208,7 +473,9 @@ bool agent_init(VDIAgent *agent) {
         agent->webrtc = webrtc_agent_create();
         if (agent->webrtc) {
             WebRTCAgentConfig webrtc_config = {
-                .signaling_url = agent->config.signaling_url
+                .signaling_url = agent->config.signaling_url,
+                .video_encoder = agent->config.video_encoder,
+                .video_fps = agent->config.target_fps
             };
 
             if (!webrtc_agent_init(agent->webrtc, &webrtc_config)) {
@@ -217,6 +484,7 @@ bool agent_init(VDIAgent *agent) {
                 agent->webrtc = NULL;
             } else {
                 webrtc_agent_set_input_callback(agent->webrtc, on_input_received, agent);
+                webrtc_agent_set_fps_callback(agent->webrtc, on_capture_fps, agent);
             }
         }
     }
@@ -233,12 +501,23 @@ bool agent_start(VDIAgent *agent) {
     agent->stopping = false;
     agent->running = true;
 
-    /* Start display capture */
-    if (agent->display && !display_capture_start(agent->display)) {
-        LOG_ERROR("Failed to start display capture");
+    /* Transport first, so the first frames find their consumer */
+    agent->transport_running = true;
+    if (pthread_create(&agent->transport_thread, NULL, transport_thread_func, agent) != 0) {
+        LOG_ERROR("Failed to create transport thread");
+        agent->transport_running = false;
+        agent->running = false;
         return false;
     }
 
+    /* Start display capture */
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        if (!display_capture_start(agent->displays[i])) {
+            LOG_ERROR("Failed to start display capture");
+            return false;
+        }
+    }
+
     /* Start audio capture */
     if (agent->audio) {
         audio_capture_start(agent->audio);
@@ -271,6 +550,14 @@ void agent_stop(VDIAgent *agent) {
     agent->stopping = true;
     agent->running = false;
 
+    /* Nothing sends once the transport thread is gone; captures that
+     * still arrive only cycle through the bounded queues */
+    if (agent->transport_running) {
+        agent->transport_running = false;
+        sem_post(&agent->transport_wake);
+        pthread_join(agent->transport_thread, NULL);
+    }
+
     /* Stop subsystems in reverse order */
     if (agent->webrtc) {
         webrtc_agent_stop(agent->webrtc);
@@ -288,11 +575,25 @@ void agent_stop(VDIAgent *agent) {
         audio_capture_stop(agent->audio);
     }
 
-    if (agent->display) {
-        display_capture_stop(agent->display);
+    for (uint32_t i = 0; i < agent->num_displays; i++) {
+        display_capture_stop(agent->displays[i]);
+    }
+
+    AgentQueueStats stats;
+    agent_get_queue_stats(agent, &stats);
+    agent_flush_queues(agent);
+
+    AgentLatencyStats latency;
+    agent_get_input_latency(agent, &latency);
+    if (latency.samples > 0) {
+        LOG_INFO("Input-to-display latency: avg %.1f ms, max %.1f ms over %llu samples",
+                 latency.avg_us / 1000.0, latency.max_us / 1000.0,
+                 (unsigned long long)latency.samples);
     }
 
-    LOG_INFO("Zixiao VDI Agent stopped");
+    LOG_INFO("Zixiao VDI Agent stopped (%llu video frames, %llu audio packets dropped)",
+             (unsigned long long)stats.video_dropped,
+             (unsigned long long)stats.audio_dropped);
 }
 
 void agent_run(VDIAgent *agent) {
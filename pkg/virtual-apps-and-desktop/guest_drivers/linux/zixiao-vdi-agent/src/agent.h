@@ -9,6 +9,7 @@
 #define ZIXIAO_VDI_AGENT_H
 
 #include "common.h"
+#include <semaphore.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -28,7 +29,9 @@ typedef struct {
     bool        webrtc_enabled;
     const char *virtio_port;
     const char *signaling_url;
+    const char *video_encoder;
     uint32_t    target_fps;
+    uint32_t    max_monitors;   /* captured as separate streams; 1 for the whole screen */
     bool        capture_audio;
     bool        daemonize;
     const char *pid_file;
@@ -43,15 +46,49 @@ typedef struct {
     bool              stopping;
     pthread_t         main_thread;
 
-    /* Subsystems */
-    DisplayCapture   *display;
+    /* Subsystems; a display capture per monitor */
+    DisplayCapture   *displays[ZIXIAO_MAX_MONITORS];
+    uint32_t          num_displays;
     AudioCapture     *audio;
     InputHandler     *input;
     ClipboardManager *clipboard;
     SpiceAgent       *spice;
     WebRTCAgent      *webrtc;
+
+    /* Capture-to-transport hand-off; capture threads never block on sends.
+     * A video queue per capture thread, as each has one producer */
+    SpscQueue        *video_queues[ZIXIAO_MAX_MONITORS];
+    SpscQueue        *audio_queue;
+    sem_t             transport_wake;
+    pthread_t         transport_thread;
+    bool              transport_running;
+
+    /* Input-to-display latency probe */
+    pthread_mutex_t   probe_mutex;
+    uint64_t          probe_inject_us;  /* input already matched to a frame */
+    uint64_t          latency_samples;
+    uint32_t          latency_last_us;
+    uint32_t          latency_avg_us;
+    uint32_t          latency_max_us;
 } VDIAgent;
 
+/* Capture-to-transport queue counters */
+typedef struct {
+    size_t      video_queued;       /* over every monitor */
+    size_t      audio_queued;
+    uint64_t    video_dropped;      /* oldest frames evicted */
+    uint64_t    audio_dropped;      /* new packets refused */
+} AgentQueueStats;
+
+/* Input-to-display latency: from input reaching the device to the first
+ * changed frame captured after it */
+typedef struct {
+    uint64_t    samples;
+    uint32_t    last_us;
+    uint32_t    avg_us;             /* moving average over about 8 samples */
+    uint32_t    max_us;
+} AgentLatencyStats;
+
 /* Agent lifecycle */
 VDIAgent *agent_create(const AgentConfig *config);
 void agent_destroy(VDIAgent *agent);
@@ -60,6 +97,12 @@ bool agent_start(VDIAgent *agent);
 void agent_stop(VDIAgent *agent);
 void agent_run(VDIAgent *agent);
 
+/* Queue depths and drop counts */
+void agent_get_queue_stats(VDIAgent *agent, AgentQueueStats *stats);
+
+/* Input-to-display latency on this side of the network */
+void agent_get_input_latency(VDIAgent *agent, AgentLatencyStats *stats);
+
 /* Get default config */
 void agent_config_default(AgentConfig *config);
 
@@ -7,7 +7,9 @@
 
 #include "common.h"
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <sched.h>
 #include <syslog.h>
 
 /* Logging configuration */
@@ -201,3 +203,169 @@ void queue_clear(ThreadSafeQueue *q, void (*free_func)(void *)) {
 
     pthread_mutex_unlock(&q->mutex);
 }
+
+/*
+ * Lock-free SPSC queue
+ *
+ * Each slot carries a sequence number (after Vyukov's bounded queue):
+ * pos when free for the push at pos, pos + 1 once filled, and
+ * pos + capacity after its element was taken. Taking claims head with
+ * a CAS, so the producer can evict from the head while the consumer
+ * pops without either copying a slot the other owns.
+ */
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+    atomic_size_t seq;
+} SpscSlot;
+
+struct SpscQueue {
+    atomic_size_t        head;          /* next to take */
+    char                 pad0[SPSC_CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_size_t        tail;          /* next to fill; producer only */
+    char                 pad1[SPSC_CACHE_LINE - sizeof(atomic_size_t)];
+    atomic_uint_fast64_t dropped;
+    size_t               capacity;
+    size_t               elem_size;
+    size_t               slot_size;
+    uint8_t             *slots;
+};
+
+#define SPSC_ELEM_OFFSET \
+    ((sizeof(SpscSlot) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+static inline SpscSlot *spsc_slot(SpscQueue *q, size_t pos) {
+    return (SpscSlot *)(q->slots + (pos & (q->capacity - 1)) * q->slot_size);
+}
+
+SpscQueue *spsc_queue_create(size_t capacity, size_t elem_size) {
+    if (capacity == 0 || elem_size == 0) return NULL;
+
+    SpscQueue *q = zixiao_calloc(1, sizeof(SpscQueue));
+    if (!q) return NULL;
+
+    /* The sequence scheme needs two slots at least */
+    q->capacity = 2;
+    while (q->capacity < capacity) {
+        q->capacity <<= 1;
+    }
+    q->elem_size = elem_size;
+    q->slot_size = (SPSC_ELEM_OFFSET + elem_size + _Alignof(max_align_t) - 1) &
+                   ~(_Alignof(max_align_t) - 1);
+
+    q->slots = zixiao_calloc(q->capacity, q->slot_size);
+    if (!q->slots) {
+        zixiao_free(q);
+        return NULL;
+    }
+
+    for (size_t i = 0; i < q->capacity; i++) {
+        atomic_init(&spsc_slot(q, i)->seq, i);
+    }
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->dropped, 0);
+
+    return q;
+}
+
+void spsc_queue_destroy(SpscQueue *q) {
+    if (!q) return;
+
+    zixiao_free(q->slots);
+    zixiao_free(q);
+}
+
+static bool spsc_queue_try_push(SpscQueue *q, const void *elem) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    SpscSlot *slot = spsc_slot(q, pos);
+
+    /* Still holding, or handing out, the element from a lap ago */
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos) {
+        return false;
+    }
+
+    memcpy((uint8_t *)slot + SPSC_ELEM_OFFSET, elem, q->elem_size);
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    atomic_store_explicit(&q->tail, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool spsc_queue_take(SpscQueue *q, void *elem) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    SpscSlot *slot;
+
+    for (;;) {
+        slot = spsc_slot(q, pos);
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+        if (seq == pos + 1) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                break;
+            }
+        } else if (seq == pos) {
+            return false;   /* empty */
+        } else {
+            /* The other taker got this one first */
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+
+    memcpy(elem, (uint8_t *)slot + SPSC_ELEM_OFFSET, q->elem_size);
+    atomic_store_explicit(&slot->seq, pos + q->capacity, memory_order_release);
+    return true;
+}
+
+bool spsc_queue_push(SpscQueue *q, const void *elem) {
+    if (!q || !elem) return false;
+
+    if (!spsc_queue_try_push(q, elem)) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    return true;
+}
+
+bool spsc_queue_push_evict(SpscQueue *q, const void *elem, void *evicted) {
+    if (!q || !elem || !evicted) return false;
+
+    bool did_evict = false;
+    while (!spsc_queue_try_push(q, elem)) {
+        size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+        if (!did_evict && tail - head >= q->capacity) {
+            did_evict = spsc_queue_take(q, evicted);
+            continue;
+        }
+
+        /* The consumer claimed the oldest and is copying it out */
+        sched_yield();
+    }
+
+    if (did_evict) {
+        atomic_fetch_add_explicit(&q->dropped, 1, memory_order_relaxed);
+    }
+    return did_evict;
+}
+
+bool spsc_queue_pop(SpscQueue *q, void *elem) {
+    if (!q || !elem) return false;
+    return spsc_queue_take(q, elem);
+}
+
+size_t spsc_queue_size(SpscQueue *q) {
+    if (!q) return 0;
+
+    size_t head = atomic_load_explicit(&q->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    size_t size = tail - head;
+    return size > q->capacity ? q->capacity : size;
+}
+
+uint64_t spsc_queue_dropped(SpscQueue *q) {
+    if (!q) return 0;
+    return atomic_load_explicit(&q->dropped, memory_order_relaxed);
+}
@@ -31,6 +31,9 @@ extern "C" {
 
 #define ZIXIAO_VDI_AGENT_NAME       "zixiao-vdi-agent"
 
+/* Monitors captured as separate video streams */
+#define ZIXIAO_MAX_MONITORS         8
+
 /* Logging */
 typedef enum {
     LOG_LEVEL_TRACE = 0,
@@ -51,6 +54,14 @@ void zixiao_log(LogLevel level, const char *file, int line, const char *fmt, ...
 #define LOG_ERROR(...)   zixiao_log(LOG_LEVEL_ERROR, __FILE__, __LINE__, __VA_ARGS__)
 #define LOG_FATAL(...)   zixiao_log(LOG_LEVEL_FATAL, __FILE__, __LINE__, __VA_ARGS__)
 
+/* Changed area of a frame */
+typedef struct {
+    int32_t   x;
+    int32_t   y;
+    uint32_t  width;
+    uint32_t  height;
+} FrameRect;
+
 /* Frame data for display capture */
 typedef struct {
     uint8_t  *data;
@@ -60,16 +71,32 @@ typedef struct {
     uint32_t  stride;
     uint64_t  timestamp;
     bool      key_frame;
+    uint32_t  monitor;      /* stream index, below ZIXIAO_MAX_MONITORS */
+
+    /* Areas changed since the previous frame; none means all of it */
+    const FrameRect *dirty_rects;
+    uint32_t  num_dirty_rects;
+
+    /* Capture buffer holding data; see display_capture_release_frame */
+    void     *buffer;
 } FrameData;
 
-/* Audio data */
+/* Audio encodings */
+typedef enum {
+    AUDIO_CODEC_PCM = 0,    /* interleaved signed 16-bit */
+    AUDIO_CODEC_OPUS
+} AudioCodec;
+
+/* Audio data: one block of PCM, or one encoded packet */
 typedef struct {
     uint8_t  *data;
     size_t    data_size;
     uint32_t  sample_rate;
     uint16_t  channels;
     uint16_t  bits_per_sample;
-    uint64_t  timestamp;
+    uint64_t  timestamp;    /* capture time of the first sample, in ms */
+    AudioCodec codec;
+    uint32_t  samples;      /* per channel */
 } AudioData;
 
 /* Input event types */
@@ -124,6 +151,7 @@ typedef struct {
     uint8_t        *data;
     size_t          data_size;
     char           *mime_type;
+    uint64_t        hash;       /* content hash, 0 when not computed */
 } ClipboardData;
 
 /* Monitor information */
@@ -143,6 +171,9 @@ typedef void (*FrameCallback)(const FrameData *frame, void *user_data);
 typedef void (*AudioCallback)(const AudioData *audio, void *user_data);
 typedef void (*InputCallback)(const InputEvent *event, void *user_data);
 typedef void (*ClipboardCallback)(const ClipboardData *data, void *user_data);
+typedef void (*ClipboardOfferCallback)(const ClipboardFormat *formats, uint32_t count,
+                                       void *user_data);
+typedef void (*ClipboardRequestCallback)(ClipboardFormat format, void *user_data);
 
 /* Subsystem interface */
 typedef struct Subsystem {
@@ -162,6 +193,12 @@ static inline uint64_t get_timestamp_ms(void) {
     return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static inline uint64_t get_timestamp_us(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
 /* Memory allocation */
 static inline void *zixiao_malloc(size_t size) {
     return malloc(size);
@@ -204,6 +241,30 @@ void *queue_pop(ThreadSafeQueue *q, int timeout_ms);
 size_t queue_size(ThreadSafeQueue *q);
 void queue_clear(ThreadSafeQueue *q, void (*free_func)(void *));
 
+/*
+ * Bounded lock-free queue for one producer and one consumer thread.
+ * Elements are fixed-size copies. When full, push refuses the new
+ * element and push_evict gives up the oldest to make room; both count
+ * what they lose in spsc_queue_dropped.
+ */
+typedef struct SpscQueue SpscQueue;
+
+/* Capacity is rounded up to a power of two */
+SpscQueue *spsc_queue_create(size_t capacity, size_t elem_size);
+void spsc_queue_destroy(SpscQueue *q);
+
+/* Producer side; push_evict always stores elem and returns true when
+ * the oldest element was moved to evicted for the caller to dispose of */
+bool spsc_queue_push(SpscQueue *q, const void *elem);
+bool spsc_queue_push_evict(SpscQueue *q, const void *elem, void *evicted);
+
+/* Consumer side */
+bool spsc_queue_pop(SpscQueue *q, void *elem);
+
+/* Approximate when read off the producer and consumer threads */
+size_t spsc_queue_size(SpscQueue *q);
+uint64_t spsc_queue_dropped(SpscQueue *q);
+
 #ifdef __cplusplus
 }
 #endif
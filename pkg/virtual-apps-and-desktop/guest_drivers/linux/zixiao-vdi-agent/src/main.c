@@ -33,6 +33,8 @@ static void print_usage(const char *prog) {
     printf("  --virtio-port PATH     VirtIO serial port (default: /dev/virtio-ports/org.zixiao.vdi.0)\n");
     printf("  --signaling-url URL    WebRTC signaling server URL\n");
     printf("  --fps N                Target FPS (default: 30)\n");
+    printf("  --monitors N           Monitors captured as separate streams; 1 for the whole screen (default: 4)\n");
+    printf("  --video-encoder NAME   WebRTC encoder: vaapi, nvenc, x264 (default: auto)\n");
     printf("  -h, --help             Show this help\n");
     printf("  -V, --version          Show version\n");
 }
@@ -49,6 +51,8 @@ static struct option long_options[] = {
     {"virtio-port",  required_argument, NULL, 1003},
     {"signaling-url",required_argument, NULL, 1004},
     {"fps",          required_argument, NULL, 1005},
+    {"video-encoder",required_argument, NULL, 1006},
+    {"monitors",     required_argument, NULL, 1007},
     {"help",         no_argument,       NULL, 'h'},
     {"version",      no_argument,       NULL, 'V'},
     {NULL,           0,                 NULL, 0}
@@ -96,6 +100,14 @@ int main(int argc, char *argv[]) {
                 if (config.target_fps < 1) config.target_fps = 1;
                 if (config.target_fps > 60) config.target_fps = 60;
                 break;
+            case 1006:  /* --video-encoder */
+                config.video_encoder = optarg;
+                break;
+            case 1007:  /* --monitors */
+                config.max_monitors = (uint32_t)atoi(optarg);
+                if (config.max_monitors < 1) config.max_monitors = 1;
+                if (config.max_monitors > ZIXIAO_MAX_MONITORS) config.max_monitors = ZIXIAO_MAX_MONITORS;
+                break;
             case 'h':
                 print_usage(argv[0]);
                 return 0;
@@ -0,0 +1,624 @@
+/*
+ * Zixiao VDI Agent for Linux - Congestion Controller Implementation
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Send-side bandwidth estimation after Google Congestion Control:
+ * the peer reports when each video packet arrived (transport-wide
+ * congestion control feedback), and two estimates are kept from it.
+ *
+ * The delay-based one groups packets by send time, compares the
+ * spacing of groups on arrival to their spacing on departure, and
+ * fits a trendline to the accumulated variation. A rising trend past
+ * an adaptive threshold means a queue is building: the rate drops to
+ * 85% of what was delivered. Otherwise it grows, by 8% a second, or
+ * by a packet per round trip close to the last point of congestion.
+ * Queueing delay over the lowest delay seen backs off as well, so
+ * interactive latency stays within budget on links with deep buffers.
+ *
+ * The loss-based one follows packet loss: it cuts above 10% and grows
+ * below 2%. The target is the lower of the two, and is spent on frame
+ * rate first and then on resolution.
+ */
+
+#include "congestion_controller.h"
+
+/* Sent packets remembered for feedback, indexed by sequence number */
+#define CC_HISTORY_SIZE         4096
+
+/* Packet statuses taken from one feedback packet */
+#define CC_MAX_FEEDBACK         2048
+
+/* Feedback packet status symbols */
+#define CC_STATUS_NOT_RECEIVED  0
+#define CC_STATUS_SMALL_DELTA   1
+#define CC_STATUS_LARGE_DELTA   2
+
+/* Feedback time units */
+#define CC_REFERENCE_TIME_US    64000
+#define CC_DELTA_US             250
+
+/* Packets sent within this span form one group */
+#define CC_GROUP_US             5000
+
+/* Trendline estimator */
+#define CC_TREND_WINDOW         20
+#define CC_TREND_SMOOTHING      0.9
+#define CC_TREND_GAIN           4.0
+#define CC_TREND_MAX_DELTAS     60
+
+/* Adaptive overuse threshold, in ms */
+#define CC_THRESHOLD_INIT       12.5
+#define CC_THRESHOLD_MIN        6.0
+#define CC_THRESHOLD_MAX        600.0
+#define CC_THRESHOLD_K_UP       0.0087
+#define CC_THRESHOLD_K_DOWN     0.039
+#define CC_OVERUSE_TIME_MS      10.0
+
+/* Queueing left to the network out of a 100 ms interactive budget,
+ * once capture, encoding and decoding have had theirs */
+#define CC_QUEUE_LIMIT_US       50000
+
+/* Lowest one-way delay is kept per window, to follow clock drift */
+#define CC_BASE_DELAY_WINDOW_US 10000000
+
+/* Delivered rate measurement */
+#define CC_ACKED_WINDOW_US      500000
+
+/* Rate control */
+#define CC_DECREASE_FACTOR      0.85
+#define CC_INCREASE_PER_SECOND  0.08
+#define CC_PACKET_BITS          (1200 * 8)
+#define CC_MIN_RTT_MS           100
+
+/* Bits per pixel a frame needs before frame rate or size give way */
+#define CC_BITS_PER_PIXEL       0.04
+
+typedef struct {
+    uint64_t send_time_us;
+    uint32_t size;
+    uint16_t seq;
+    bool     valid;
+} SentPacket;
+
+typedef struct {
+    uint64_t first_send_us;
+    uint64_t last_send_us;
+    int64_t  last_arrival_us;
+    bool     valid;
+} PacketGroup;
+
+typedef enum {
+    BANDWIDTH_NORMAL,
+    BANDWIDTH_UNDERUSING,
+    BANDWIDTH_OVERUSING
+} BandwidthUsage;
+
+struct CongestionController {
+    /* Configuration */
+    CongestionControllerConfig config;
+    pthread_mutex_t     mutex;
+
+    /* Sent packets awaiting feedback */
+    SentPacket          history[CC_HISTORY_SIZE];
+
+    /* Inter-group delay variation */
+    PacketGroup         current;
+    PacketGroup         previous;
+
+    /* Trendline over the accumulated variation */
+    double              acc_delay_ms;
+    double              smoothed_delay_ms;
+    double              trend_x[CC_TREND_WINDOW];
+    double              trend_y[CC_TREND_WINDOW];
+    int                 trend_count;
+    int                 trend_pos;
+    int                 num_deltas;
+    int64_t             first_arrival_us;
+    bool                have_first_arrival;
+
+    /* Overuse detector */
+    double              threshold_ms;
+    double              prev_trend;
+    double              time_over_using_ms;
+    int                 overuse_count;
+    int64_t             last_threshold_ms;
+    bool                have_threshold_time;
+    BandwidthUsage      usage;
+
+    /* Queueing over the lowest one-way delay, current and last window */
+    int64_t             base_delay_us[2];
+    uint64_t            base_window_start_us;
+    int64_t             queue_delay_us;
+
+    /* Delivered rate */
+    int64_t             acked_window_start_us;
+    uint64_t            acked_bytes;
+    uint32_t            acked_bitrate;
+
+    /* Rate control */
+    uint32_t            delay_bitrate;
+    uint32_t            loss_bitrate;
+    uint32_t            link_capacity;      /* delivered at the last overuse */
+    uint64_t            last_update_us;
+    uint64_t            last_decrease_us;
+    uint64_t            last_loss_update_us;
+    uint64_t            last_loss_decrease_us;
+    uint32_t            rtt_ms;
+
+    /* Resolution step in use */
+    uint32_t            scale;
+};
+
+/* Resolution steps, in percent */
+static const uint32_t g_scales[] = { 100, 75, 50 };
+
+#define CC_NUM_SCALES   (sizeof(g_scales) / sizeof(g_scales[0]))
+
+static inline uint16_t read_u16(const uint8_t *p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline double abs_double(double v) {
+    return v < 0 ? -v : v;
+}
+
+static uint32_t clamp_bitrate(const CongestionController *cc, double rate) {
+    if (rate < cc->config.min_bitrate) return cc->config.min_bitrate;
+    if (rate > cc->config.max_bitrate) return cc->config.max_bitrate;
+    return (uint32_t)rate;
+}
+
+/* Interval between decreases: long enough to see the last one work */
+static uint64_t response_time_us(const CongestionController *cc) {
+    uint32_t rtt = cc->rtt_ms > CC_MIN_RTT_MS ? cc->rtt_ms : CC_MIN_RTT_MS;
+    return (uint64_t)rtt * 1000;
+}
+
+CongestionController *congestion_controller_create(const CongestionControllerConfig *config) {
+    CongestionController *cc = zixiao_calloc(1, sizeof(CongestionController));
+    if (!cc) return NULL;
+
+    if (config) {
+        cc->config = *config;
+    }
+    if (cc->config.min_bitrate == 0) cc->config.min_bitrate = 150000;
+    if (cc->config.max_bitrate < cc->config.min_bitrate) cc->config.max_bitrate = 8000000;
+    if (cc->config.start_bitrate == 0) cc->config.start_bitrate = 1500000;
+    if (cc->config.max_fps == 0) cc->config.max_fps = 30;
+    if (cc->config.min_fps == 0 || cc->config.min_fps > cc->config.max_fps) {
+        cc->config.min_fps = cc->config.max_fps < 15 ? cc->config.max_fps : 15;
+    }
+
+    pthread_mutex_init(&cc->mutex, NULL);
+
+    cc->threshold_ms = CC_THRESHOLD_INIT;
+    cc->time_over_using_ms = -1;
+    cc->base_delay_us[0] = INT64_MAX;
+    cc->base_delay_us[1] = INT64_MAX;
+    cc->acked_window_start_us = -1;
+    cc->delay_bitrate = clamp_bitrate(cc, cc->config.start_bitrate);
+    cc->loss_bitrate = cc->delay_bitrate;
+    cc->scale = 100;
+
+    return cc;
+}
+
+void congestion_controller_destroy(CongestionController *cc) {
+    if (!cc) return;
+
+    pthread_mutex_destroy(&cc->mutex);
+    zixiao_free(cc);
+}
+
+void congestion_controller_on_packet_sent(CongestionController *cc, uint16_t seq,
+                                          size_t size, uint64_t send_time_us) {
+    if (!cc) return;
+
+    pthread_mutex_lock(&cc->mutex);
+
+    SentPacket *sent = &cc->history[seq % CC_HISTORY_SIZE];
+    sent->seq = seq;
+    sent->size = (uint32_t)size;
+    sent->send_time_us = send_time_us;
+    sent->valid = true;
+
+    pthread_mutex_unlock(&cc->mutex);
+}
+
+/* Least-squares slope of smoothed delay over arrival time */
+static double trendline_slope(const CongestionController *cc) {
+    double mean_x = 0, mean_y = 0;
+
+    for (int i = 0; i < cc->trend_count; i++) {
+        mean_x += cc->trend_x[i];
+        mean_y += cc->trend_y[i];
+    }
+    mean_x /= cc->trend_count;
+    mean_y /= cc->trend_count;
+
+    double num = 0, den = 0;
+    for (int i = 0; i < cc->trend_count; i++) {
+        double dx = cc->trend_x[i] - mean_x;
+        num += dx * (cc->trend_y[i] - mean_y);
+        den += dx * dx;
+    }
+
+    return den != 0 ? num / den : cc->prev_trend;
+}
+
+static void update_threshold(CongestionController *cc, double modified_trend, int64_t now_ms) {
+    double magnitude = abs_double(modified_trend);
+
+    if (!cc->have_threshold_time) {
+        cc->last_threshold_ms = now_ms;
+        cc->have_threshold_time = true;
+    }
+
+    /* Spikes, such as a route change, are not followed */
+    if (magnitude > cc->threshold_ms + 15.0) {
+        cc->last_threshold_ms = now_ms;
+        return;
+    }
+
+    double k = magnitude < cc->threshold_ms ? CC_THRESHOLD_K_DOWN : CC_THRESHOLD_K_UP;
+    int64_t elapsed = now_ms - cc->last_threshold_ms;
+    if (elapsed > 100) elapsed = 100;
+    if (elapsed < 0) elapsed = 0;
+
+    cc->threshold_ms += k * (magnitude - cc->threshold_ms) * (double)elapsed;
+    if (cc->threshold_ms < CC_THRESHOLD_MIN) cc->threshold_ms = CC_THRESHOLD_MIN;
+    if (cc->threshold_ms > CC_THRESHOLD_MAX) cc->threshold_ms = CC_THRESHOLD_MAX;
+    cc->last_threshold_ms = now_ms;
+}
+
+static void detect_overuse(CongestionController *cc, double trend, double ts_delta_ms,
+                           int64_t now_ms) {
+    int deltas = cc->num_deltas < CC_TREND_MAX_DELTAS ? cc->num_deltas : CC_TREND_MAX_DELTAS;
+    double modified = deltas * trend * CC_TREND_GAIN;
+
+    if (modified > cc->threshold_ms) {
+        if (cc->time_over_using_ms < 0) {
+            cc->time_over_using_ms = ts_delta_ms / 2;
+        } else {
+            cc->time_over_using_ms += ts_delta_ms;
+        }
+        cc->overuse_count++;
+
+        /* Sustained and still rising before it counts */
+        if (cc->time_over_using_ms > CC_OVERUSE_TIME_MS && cc->overuse_count > 1 &&
+            trend >= cc->prev_trend) {
+            cc->time_over_using_ms = 0;
+            cc->overuse_count = 0;
+            cc->usage = BANDWIDTH_OVERUSING;
+        }
+    } else if (modified < -cc->threshold_ms) {
+        cc->time_over_using_ms = -1;
+        cc->overuse_count = 0;
+        cc->usage = BANDWIDTH_UNDERUSING;
+    } else {
+        cc->time_over_using_ms = -1;
+        cc->overuse_count = 0;
+        cc->usage = BANDWIDTH_NORMAL;
+    }
+
+    cc->prev_trend = trend;
+    update_threshold(cc, modified, now_ms);
+}
+
+static void trendline_update(CongestionController *cc, double delay_delta_ms,
+                             double arrival_delta_ms, int64_t arrival_us) {
+    if (!cc->have_first_arrival) {
+        cc->first_arrival_us = arrival_us;
+        cc->have_first_arrival = true;
+    }
+
+    if (cc->num_deltas < CC_TREND_MAX_DELTAS) {
+        cc->num_deltas++;
+    }
+
+    cc->acc_delay_ms += delay_delta_ms;
+    cc->smoothed_delay_ms = CC_TREND_SMOOTHING * cc->smoothed_delay_ms +
+                            (1 - CC_TREND_SMOOTHING) * cc->acc_delay_ms;
+
+    cc->trend_x[cc->trend_pos] = (double)(arrival_us - cc->first_arrival_us) / 1000.0;
+    cc->trend_y[cc->trend_pos] = cc->smoothed_delay_ms;
+    cc->trend_pos = (cc->trend_pos + 1) % CC_TREND_WINDOW;
+    if (cc->trend_count < CC_TREND_WINDOW) {
+        cc->trend_count++;
+    }
+
+    double trend = cc->prev_trend;
+    if (cc->trend_count == CC_TREND_WINDOW) {
+        trend = trendline_slope(cc);
+    }
+
+    detect_overuse(cc, trend, arrival_delta_ms, arrival_us / 1000);
+}
+
+static void on_packet_arrival(CongestionController *cc, const SentPacket *sent,
+                              int64_t arrival_us, uint64_t now_us) {
+    /* Delivered rate */
+    if (cc->acked_window_start_us < 0) {
+        cc->acked_window_start_us = arrival_us;
+    }
+    cc->acked_bytes += sent->size;
+
+    int64_t window = arrival_us - cc->acked_window_start_us;
+    if (window >= CC_ACKED_WINDOW_US) {
+        uint32_t rate = (uint32_t)(cc->acked_bytes * 8 * 1000000 / (uint64_t)window);
+        cc->acked_bitrate = cc->acked_bitrate ? (cc->acked_bitrate * 3 + rate) / 4 : rate;
+        cc->acked_window_start_us = arrival_us;
+        cc->acked_bytes = 0;
+    }
+
+    /* Queueing: one-way delay over the lowest seen; the clocks differ,
+     * but only the difference is used */
+    if (now_us - cc->base_window_start_us >= CC_BASE_DELAY_WINDOW_US) {
+        cc->base_delay_us[1] = cc->base_delay_us[0];
+        cc->base_delay_us[0] = INT64_MAX;
+        cc->base_window_start_us = now_us;
+    }
+
+    int64_t offset = arrival_us - (int64_t)sent->send_time_us;
+    if (offset < cc->base_delay_us[0]) {
+        cc->base_delay_us[0] = offset;
+    }
+
+    int64_t base = cc->base_delay_us[0] < cc->base_delay_us[1] ?
+                   cc->base_delay_us[0] : cc->base_delay_us[1];
+    cc->queue_delay_us = offset - base;
+
+    /* Inter-group delay variation */
+    if (!cc->current.valid) {
+        cc->current = (PacketGroup){ sent->send_time_us, sent->send_time_us, arrival_us, true };
+        return;
+    }
+
+    /* Reordered behind the group already being built */
+    if (sent->send_time_us < cc->current.first_send_us) {
+        return;
+    }
+
+    if (sent->send_time_us - cc->current.first_send_us <= CC_GROUP_US) {
+        if (sent->send_time_us > cc->current.last_send_us) {
+            cc->current.last_send_us = sent->send_time_us;
+        }
+        if (arrival_us > cc->current.last_arrival_us) {
+            cc->current.last_arrival_us = arrival_us;
+        }
+        return;
+    }
+
+    if (cc->previous.valid) {
+        double send_delta_ms =
+            (double)(cc->current.last_send_us - cc->previous.last_send_us) / 1000.0;
+        double arrival_delta_ms =
+            (double)(cc->current.last_arrival_us - cc->previous.last_arrival_us) / 1000.0;
+
+        trendline_update(cc, arrival_delta_ms - send_delta_ms, arrival_delta_ms,
+                         cc->current.last_arrival_us);
+    }
+
+    cc->previous = cc->current;
+    cc->current = (PacketGroup){ sent->send_time_us, sent->send_time_us, arrival_us, true };
+}
+
+static void update_delay_bitrate(CongestionController *cc, uint64_t now_us) {
+    double rate = cc->delay_bitrate;
+    double elapsed_s = 0;
+
+    if (cc->last_update_us) {
+        elapsed_s = (double)(now_us - cc->last_update_us) / 1000000.0;
+        if (elapsed_s > 1.0) elapsed_s = 1.0;
+    }
+    cc->last_update_us = now_us;
+
+    bool overusing = cc->usage == BANDWIDTH_OVERUSING ||
+                     cc->queue_delay_us > CC_QUEUE_LIMIT_US;
+
+    if (overusing) {
+        if (now_us - cc->last_decrease_us >= response_time_us(cc)) {
+            double basis = cc->acked_bitrate ? cc->acked_bitrate : rate;
+            if (basis * CC_DECREASE_FACTOR < rate) {
+                rate = basis * CC_DECREASE_FACTOR;
+            }
+            cc->link_capacity = cc->acked_bitrate;
+            cc->last_decrease_us = now_us;
+
+            LOG_DEBUG("Congestion: %.0f kbps (queue %lld ms, delivered %u kbps)",
+                      rate / 1000, (long long)(cc->queue_delay_us / 1000),
+                      cc->acked_bitrate / 1000);
+        }
+    } else if (cc->usage == BANDWIDTH_NORMAL) {
+        /* The link got faster than when it last congested */
+        if (cc->link_capacity && cc->acked_bitrate > cc->link_capacity * 1.3) {
+            cc->link_capacity = 0;
+        }
+
+        if (cc->link_capacity && rate > cc->link_capacity * 0.9) {
+            uint64_t response_ms = response_time_us(cc) / 1000 + 100;
+            rate += CC_PACKET_BITS * 1000.0 / (double)response_ms * elapsed_s;
+        } else {
+            rate += rate * CC_INCREASE_PER_SECOND * elapsed_s;
+        }
+
+        /* Not far past what the network has shown it delivers */
+        if (cc->acked_bitrate) {
+            double cap = cc->acked_bitrate * 1.5 + 10000;
+            if (rate > cap) {
+                rate = cap > cc->delay_bitrate ? cap : cc->delay_bitrate;
+            }
+        }
+    }
+
+    cc->delay_bitrate = clamp_bitrate(cc, rate);
+}
+
+static void update_loss_bitrate(CongestionController *cc, double fraction, uint64_t now_us) {
+    double rate = cc->loss_bitrate;
+
+    if (fraction > 0.10) {
+        if (now_us - cc->last_loss_decrease_us >= response_time_us(cc)) {
+            rate *= 1.0 - 0.5 * fraction;
+            cc->last_loss_decrease_us = now_us;
+        }
+    } else if (fraction < 0.02 && cc->last_loss_update_us) {
+        double elapsed_s = (double)(now_us - cc->last_loss_update_us) / 1000000.0;
+        if (elapsed_s > 1.0) elapsed_s = 1.0;
+        rate += rate * CC_INCREASE_PER_SECOND * elapsed_s;
+    }
+
+    cc->last_loss_update_us = now_us;
+    cc->loss_bitrate = clamp_bitrate(cc, rate);
+}
+
+bool congestion_controller_on_transport_feedback(CongestionController *cc,
+                                                 const uint8_t *fci, size_t size,
+                                                 uint64_t now_us) {
+    if (!cc || !fci || size < 8) return false;
+
+    uint16_t base_seq = read_u16(fci);
+    uint16_t count = read_u16(fci + 2);
+    int32_t reference = (int32_t)(((uint32_t)fci[4] << 16) | ((uint32_t)fci[5] << 8) | fci[6]);
+    if (reference & 0x800000) {
+        reference -= 0x1000000;
+    }
+
+    if (count == 0 || count > CC_MAX_FEEDBACK) return false;
+
+    /* Packet status chunks */
+    uint8_t status[CC_MAX_FEEDBACK];
+    size_t pos = 8;
+    uint32_t n = 0;
+
+    while (n < count) {
+        if (pos + 2 > size) return false;
+        uint16_t chunk = read_u16(fci + pos);
+        pos += 2;
+
+        if (!(chunk & 0x8000)) {
+            /* Run length */
+            uint8_t symbol = (chunk >> 13) & 0x3;
+            for (uint32_t run = chunk & 0x1FFF; run > 0 && n < count; run--) {
+                status[n++] = symbol;
+            }
+        } else if (!(chunk & 0x4000)) {
+            /* Fourteen one-bit symbols */
+            for (int bit = 13; bit >= 0 && n < count; bit--) {
+                status[n++] = (chunk >> bit) & 0x1;
+            }
+        } else {
+            /* Seven two-bit symbols */
+            for (int bit = 12; bit >= 0 && n < count; bit -= 2) {
+                status[n++] = (chunk >> bit) & 0x3;
+            }
+        }
+    }
+
+    /* Receive deltas, one per received packet */
+    int64_t arrival[CC_MAX_FEEDBACK];
+    int64_t arrival_us = (int64_t)reference * CC_REFERENCE_TIME_US;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (status[i] == CC_STATUS_SMALL_DELTA) {
+            if (pos + 1 > size) return false;
+            arrival_us += (int64_t)fci[pos] * CC_DELTA_US;
+            pos += 1;
+        } else if (status[i] == CC_STATUS_LARGE_DELTA) {
+            if (pos + 2 > size) return false;
+            arrival_us += (int64_t)(int16_t)read_u16(fci + pos) * CC_DELTA_US;
+            pos += 2;
+        } else if (status[i] != CC_STATUS_NOT_RECEIVED) {
+            return false;
+        }
+        arrival[i] = arrival_us;
+    }
+
+    pthread_mutex_lock(&cc->mutex);
+
+    uint32_t received = 0;
+    uint32_t lost = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t seq = (uint16_t)(base_seq + i);
+        SentPacket *sent = &cc->history[seq % CC_HISTORY_SIZE];
+
+        /* Not ours, or no longer remembered */
+        if (!sent->valid || sent->seq != seq) {
+            continue;
+        }
+
+        if (status[i] == CC_STATUS_NOT_RECEIVED) {
+            lost++;
+            continue;
+        }
+
+        received++;
+        on_packet_arrival(cc, sent, arrival[i], now_us);
+        sent->valid = false;
+    }
+
+    if (received > 0) {
+        update_delay_bitrate(cc, now_us);
+    }
+    if (received + lost > 0) {
+        update_loss_bitrate(cc, (double)lost / (received + lost), now_us);
+    }
+
+    pthread_mutex_unlock(&cc->mutex);
+    return true;
+}
+
+void congestion_controller_on_receiver_report(CongestionController *cc,
+                                              uint8_t fraction_lost, uint32_t rtt_ms,
+                                              uint64_t now_us) {
+    if (!cc) return;
+
+    pthread_mutex_lock(&cc->mutex);
+
+    if (rtt_ms > 0) {
+        cc->rtt_ms = cc->rtt_ms ? (cc->rtt_ms * 7 + rtt_ms) / 8 : rtt_ms;
+    }
+    update_loss_bitrate(cc, fraction_lost / 256.0, now_us);
+
+    pthread_mutex_unlock(&cc->mutex);
+}
+
+void congestion_controller_get_target(CongestionController *cc, uint32_t width,
+                                      uint32_t height, CongestionTarget *target) {
+    if (!cc || !target) return;
+
+    pthread_mutex_lock(&cc->mutex);
+
+    uint32_t bitrate = cc->delay_bitrate < cc->loss_bitrate ?
+                       cc->delay_bitrate : cc->loss_bitrate;
+    double pixels = (double)width * height;
+    double fps = cc->config.max_fps;
+    uint32_t scale = 100;
+
+    /* Frame rate gives way first, down to min_fps; then the size steps
+     * down. Stepping back up needs a quarter of headroom, so the size
+     * does not flap at a step boundary. */
+    for (size_t i = 0; i < CC_NUM_SCALES && pixels > 0; i++) {
+        scale = g_scales[i];
+        double frame_bits = pixels * scale * scale / 10000.0 * CC_BITS_PER_PIXEL;
+        double need = cc->config.min_fps * (scale > cc->scale ? 1.25 : 1.0);
+
+        fps = bitrate / frame_bits;
+        if (fps >= need) break;
+    }
+
+    uint32_t rate = fps >= cc->config.max_fps ? cc->config.max_fps : (uint32_t)fps;
+    if (rate > 5) rate -= rate % 5;
+    if (rate < cc->config.min_fps) rate = cc->config.min_fps;
+
+    cc->scale = scale;
+
+    target->bitrate = bitrate;
+    target->fps = rate;
+    target->scale = scale;
+
+    pthread_mutex_unlock(&cc->mutex);
+}
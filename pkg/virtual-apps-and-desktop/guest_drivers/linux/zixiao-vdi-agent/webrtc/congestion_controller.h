@@ -0,0 +1,62 @@
+/*
+ * Zixiao VDI Agent for Linux - Congestion Controller
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef ZIXIAO_VDI_CONGESTION_CONTROLLER_H
+#define ZIXIAO_VDI_CONGESTION_CONTROLLER_H
+
+#include "../src/common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Congestion controller configuration */
+typedef struct {
+    uint32_t min_bitrate;       /* bits per second */
+    uint32_t max_bitrate;
+    uint32_t start_bitrate;
+    uint32_t min_fps;
+    uint32_t max_fps;
+} CongestionControllerConfig;
+
+/* What the video pipeline should send at */
+typedef struct {
+    uint32_t bitrate;           /* encoder target, bits per second */
+    uint32_t fps;               /* capture rate */
+    uint32_t scale;             /* percent of the captured size to encode */
+} CongestionTarget;
+
+/* Congestion controller context (opaque) */
+typedef struct CongestionController CongestionController;
+
+/* Create/destroy */
+CongestionController *congestion_controller_create(const CongestionControllerConfig *config);
+void congestion_controller_destroy(CongestionController *cc);
+
+/* A video RTP packet left, with its transport-wide sequence number */
+void congestion_controller_on_packet_sent(CongestionController *cc, uint16_t seq,
+                                          size_t size, uint64_t send_time_us);
+
+/* FCI of a transport-wide feedback packet (RTPFB, FMT 15) */
+bool congestion_controller_on_transport_feedback(CongestionController *cc,
+                                                 const uint8_t *fci, size_t size,
+                                                 uint64_t now_us);
+
+/* Report block of an RTCP receiver report; rtt_ms is 0 when unknown */
+void congestion_controller_on_receiver_report(CongestionController *cc,
+                                              uint8_t fraction_lost, uint32_t rtt_ms,
+                                              uint64_t now_us);
+
+/* Current target for a capture of the given size */
+void congestion_controller_get_target(CongestionController *cc, uint32_t width,
+                                      uint32_t height, CongestionTarget *target);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* ZIXIAO_VDI_CONGESTION_CONTROLLER_H */
@@ -9,17 +9,76 @@
  */
 
 #include "webrtc_agent.h"
+#include "congestion_controller.h"
+#include "../encoder/video_encoder.h"
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
-#include <poll.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+/* Video RTP packets: payload per packet, and RTP, extension, SRTP,
+ * UDP and IP bytes around it */
+#define WEBRTC_RTP_PAYLOAD      1200
+#define WEBRTC_RTP_OVERHEAD     68
+
+/* Bitrate bounds for the congestion controller */
+#define WEBRTC_MIN_BITRATE      150000
+#define WEBRTC_START_BITRATE    1500000
+#define WEBRTC_MAX_BITRATE      8000000
+
+/* RTCP */
+#define RTCP_SR                 200
+#define RTCP_RR                 201
+#define RTCP_RTPFB              205
+#define RTCP_FMT_TRANSPORT_CC   15
+#define RTCP_REPORT_BLOCK_SIZE  24
+
+/* NTP seconds at the Unix epoch */
+#define NTP_UNIX_OFFSET         2208988800u
+
+/* WebSocket opcodes (RFC 6455) */
+#define WS_OP_CONTINUATION      0x0
+#define WS_OP_TEXT              0x1
+#define WS_OP_BINARY            0x2
+#define WS_OP_CLOSE             0x8
+#define WS_OP_PING              0x9
+#define WS_OP_PONG              0xA
+
+/* Largest frame header: 2 bytes, 8 of length, 4 of mask key */
+#define WS_MAX_HEADER           14
+
+/* Largest message accepted, and bytes allowed to queue for sending */
+#define WS_MAX_MESSAGE          (16 * 1024 * 1024)
+#define WS_MAX_PENDING          (4 * 1024 * 1024)
+
+#define WS_RX_CHUNK             16384
+#define WS_RECONNECT_MS         5000
+
+/* A monitor without a frame for this long leaves the bitrate to the others */
+#define WEBRTC_STREAM_IDLE_US   1000000
+
+/* Encoder session of one monitor's video stream */
+typedef struct {
+    WebRTCAgent      *owner;
+    VideoEncoder     *encoder;
+    uint32_t          width;            /* of the frames it was opened for */
+    uint32_t          height;
+    uint32_t          scale;
+    uint32_t          bitrate;
+    bool              key_frame_needed;
+    uint64_t          last_frame_us;
+} VideoStream;
 
 struct WebRTCAgent {
     /* Configuration */
     WebRTCAgentConfig config;
     InputCallback     input_callback;
     void             *input_callback_data;
+    WebRTCFpsCallback fps_callback;
+    void             *fps_callback_data;
 
     /* State */
     bool              running;
@@ -27,17 +86,54 @@ struct WebRTCAgent {
     bool              connected;
     pthread_t         signaling_thread;
 
+    WebRTCDataCallback data_callback;
+    void             *data_callback_data;
+
     /* WebSocket */
     int               ws_fd;
+    int               epoll_fd;
+    int               wake_fd;          /* eventfd, wakes the signaling thread */
     char              signaling_url[512];
 
+    /* Outgoing frames, already masked; under tx_mutex */
+    pthread_mutex_t   tx_mutex;
+    uint8_t          *tx_buf;
+    size_t            tx_cap;
+    size_t            tx_len;           /* bytes queued */
+    size_t            tx_off;           /* bytes of those sent */
+    bool              tx_waiting;       /* EPOLLOUT armed */
+    uint32_t          mask_state;
+
+    /* Incoming bytes, and the fragmented message being put together;
+     * signaling thread only */
+    uint8_t          *rx_buf;
+    size_t            rx_cap;
+    size_t            rx_len;
+    uint8_t          *msg_buf;
+    size_t            msg_cap;
+    size_t            msg_len;
+    uint8_t           msg_opcode;       /* 0 when none */
+
     /* Peer connection state */
     bool              peer_connected;
+
+    /* Video encoding, a stream per monitor; transport thread only */
+    VideoStream       streams[ZIXIAO_MAX_MONITORS];
+    char              video_encoder[32];
+    uint32_t          video_fps;
+    uint64_t          video_bytes;
+    uint64_t          audio_bytes;
+
+    /* Congestion control */
+    CongestionController *cc;
+    CongestionTarget  target;
+    uint16_t          transport_seq;
 };
 
 static void *signaling_thread_func(void *arg);
 static bool connect_to_signaling(WebRTCAgent *wa);
 static bool send_ws_message(WebRTCAgent *wa, const char *message);
+static bool ws_queue_frame(WebRTCAgent *wa, uint8_t opcode, const void *data, size_t len);
 static void process_signaling_message(WebRTCAgent *wa, const char *message);
 
 WebRTCAgent *webrtc_agent_create(void) {
@@ -45,6 +141,9 @@ WebRTCAgent *webrtc_agent_create(void) {
     if (!wa) return NULL;
 
     wa->ws_fd = -1;
+    wa->epoll_fd = -1;
+    wa->wake_fd = -1;
+    pthread_mutex_init(&wa->tx_mutex, NULL);
     wa->running = false;
     wa->stopping = false;
     wa->connected = false;
@@ -57,6 +156,7 @@ void webrtc_agent_destroy(WebRTCAgent *wa) {
     if (!wa) return;
 
     webrtc_agent_shutdown(wa);
+    pthread_mutex_destroy(&wa->tx_mutex);
     zixiao_free(wa);
 }
 
@@ -70,12 +170,48 @@ bool webrtc_agent_init(WebRTCAgent *wa, const WebRTCAgentConfig *config) {
         if (config->signaling_url) {
             strncpy(wa->signaling_url, config->signaling_url, sizeof(wa->signaling_url) - 1);
         }
+        if (config->video_encoder) {
+            strncpy(wa->video_encoder, config->video_encoder, sizeof(wa->video_encoder) - 1);
+        }
+        wa->video_fps = config->video_fps;
     }
 
     if (wa->signaling_url[0] == '\0') {
         strncpy(wa->signaling_url, "ws://localhost:8080/signaling", sizeof(wa->signaling_url) - 1);
     }
 
+    CongestionControllerConfig cc_config = {
+        .min_bitrate = WEBRTC_MIN_BITRATE,
+        .max_bitrate = WEBRTC_MAX_BITRATE,
+        .start_bitrate = WEBRTC_START_BITRATE,
+        .max_fps = wa->video_fps ? wa->video_fps : 30
+    };
+
+    wa->cc = congestion_controller_create(&cc_config);
+    if (!wa->cc) {
+        LOG_ERROR("Failed to create congestion controller");
+        return false;
+    }
+
+    /* The signaling thread waits on the socket and on wake_fd */
+    wa->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    wa->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wa->epoll_fd < 0 || wa->wake_fd < 0) {
+        LOG_ERROR("Failed to create signaling event sources: %s", strerror(errno));
+        return false;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = wa->wake_fd };
+    if (epoll_ctl(wa->epoll_fd, EPOLL_CTL_ADD, wa->wake_fd, &ev) < 0) {
+        LOG_ERROR("Failed to watch signaling wake-up: %s", strerror(errno));
+        return false;
+    }
+
+    /* Masks keep proxies from mistaking frames for HTTP; a fast non-cryptographic
+     * generator is enough for that */
+    wa->mask_state = (uint32_t)get_timestamp_us() ^ ((uint32_t)getpid() << 16) ^ 0x9e3779b9u;
+    if (wa->mask_state == 0) wa->mask_state = 1;
+
     LOG_INFO("WebRTC agent initialized (signaling: %s)", wa->signaling_url);
     return true;
 }
@@ -85,11 +221,35 @@ void webrtc_agent_shutdown(WebRTCAgent *wa) {
 
     webrtc_agent_stop(wa);
 
+    /* Frames come from the capture thread, stopped by now */
+    for (int i = 0; i < ZIXIAO_MAX_MONITORS; i++) {
+        video_encoder_destroy(wa->streams[i].encoder);
+        memset(&wa->streams[i], 0, sizeof(wa->streams[i]));
+    }
+
+    congestion_controller_destroy(wa->cc);
+    wa->cc = NULL;
+
+    if (wa->epoll_fd >= 0) {
+        close(wa->epoll_fd);
+        wa->epoll_fd = -1;
+    }
+    if (wa->wake_fd >= 0) {
+        close(wa->wake_fd);
+        wa->wake_fd = -1;
+    }
+
+    zixiao_free(wa->tx_buf);
+    zixiao_free(wa->rx_buf);
+    zixiao_free(wa->msg_buf);
+    wa->tx_buf = wa->rx_buf = wa->msg_buf = NULL;
+    wa->tx_cap = wa->rx_cap = wa->msg_cap = 0;
+
     LOG_INFO("WebRTC agent shutdown");
 }
 
 bool webrtc_agent_start(WebRTCAgent *wa) {
-    if (!wa || wa->running) return false;
+    if (!wa || wa->running || wa->epoll_fd < 0) return false;
 
     LOG_INFO("Starting WebRTC agent...");
 
@@ -115,9 +275,10 @@ void webrtc_agent_stop(WebRTCAgent *wa) {
     wa->stopping = true;
     wa->running = false;
 
-    if (wa->ws_fd >= 0) {
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
+    /* The signaling thread owns the socket and closes it on the way out */
+    uint64_t one = 1;
+    if (write(wa->wake_fd, &one, sizeof(one)) < 0) {
+        LOG_WARNING("Failed to wake signaling thread: %s", strerror(errno));
     }
 
     pthread_join(wa->signaling_thread, NULL);
@@ -139,6 +300,23 @@ void webrtc_agent_set_input_callback(WebRTCAgent *wa, InputCallback callback, vo
     wa->input_callback_data = user_data;
 }
 
+void webrtc_agent_set_fps_callback(WebRTCAgent *wa, WebRTCFpsCallback callback, void *user_data) {
+    if (!wa) return;
+    wa->fps_callback = callback;
+    wa->fps_callback_data = user_data;
+}
+
+void webrtc_agent_set_data_callback(WebRTCAgent *wa, WebRTCDataCallback callback, void *user_data) {
+    if (!wa) return;
+    wa->data_callback = callback;
+    wa->data_callback_data = user_data;
+}
+
+bool webrtc_agent_send_data(WebRTCAgent *wa, const uint8_t *data, size_t size) {
+    if (!wa || (!data && size > 0)) return false;
+    return ws_queue_frame(wa, WS_OP_BINARY, data, size);
+}
+
 static bool parse_ws_url(const char *url, char *host, int host_len, int *port, char *path, int path_len) {
     /* Parse ws://host:port/path */
     const char *p = url;
@@ -183,6 +361,164 @@ static bool parse_ws_url(const char *url, char *host, int host_len, int *port, c
     return true;
 }
 
+static bool ws_reserve(uint8_t **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return true;
+
+    size_t new_cap = *cap ? *cap : 4096;
+    while (new_cap < need) new_cap *= 2;
+
+    uint8_t *p = zixiao_realloc(*buf, new_cap);
+    if (!p) return false;
+
+    *buf = p;
+    *cap = new_cap;
+    return true;
+}
+
+/*
+ * XOR with the repeating 4-byte key, eight bytes at a time. The key
+ * phase restarts at the first byte, as it does for each frame.
+ * dst may be src.
+ */
+static void ws_mask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t key[4]) {
+    uint32_t key32;
+    memcpy(&key32, key, sizeof(key32));
+    uint64_t key64 = ((uint64_t)key32 << 32) | key32;
+
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy(&word, src + i, sizeof(word));
+        word ^= key64;
+        memcpy(dst + i, &word, sizeof(word));
+    }
+    for (; i < len; i++) {
+        dst[i] = src[i] ^ key[i & 3];
+    }
+}
+
+static uint32_t ws_next_mask(WebRTCAgent *wa) {
+    /* xorshift32 */
+    uint32_t x = wa->mask_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    wa->mask_state = x;
+    return x;
+}
+
+static void ws_set_writable_watch(WebRTCAgent *wa, bool on) {
+    if (wa->tx_waiting == on) return;
+
+    struct epoll_event ev = {
+        .events = EPOLLIN | (on ? EPOLLOUT : 0),
+        .data.fd = wa->ws_fd
+    };
+    if (epoll_ctl(wa->epoll_fd, EPOLL_CTL_MOD, wa->ws_fd, &ev) == 0) {
+        wa->tx_waiting = on;
+    }
+}
+
+/* Sends what the socket takes; the rest waits for EPOLLOUT. tx_mutex held */
+static bool ws_flush_locked(WebRTCAgent *wa) {
+    while (wa->tx_off < wa->tx_len) {
+        ssize_t n = send(wa->ws_fd, wa->tx_buf + wa->tx_off, wa->tx_len - wa->tx_off,
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n > 0) {
+            wa->tx_off += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            ws_set_writable_watch(wa, true);
+            return true;
+        }
+
+        /* The receive side sees the error and reconnects */
+        LOG_DEBUG("Signaling send failed: %s", strerror(errno));
+        return false;
+    }
+
+    wa->tx_off = wa->tx_len = 0;
+    ws_set_writable_watch(wa, false);
+    return true;
+}
+
+/* Frames, masks and queues one message, then sends what it can. Any thread */
+static bool ws_queue_frame(WebRTCAgent *wa, uint8_t opcode, const void *data, size_t len) {
+    bool ok = false;
+
+    pthread_mutex_lock(&wa->tx_mutex);
+
+    if (!wa->connected) goto out;
+
+    if (wa->tx_len - wa->tx_off + len > WS_MAX_PENDING) {
+        LOG_DEBUG("Signaling send queue full, dropping %zu byte message", len);
+        goto out;
+    }
+
+    /* Reclaim what was already sent before growing */
+    if (wa->tx_off > 0 && wa->tx_cap - wa->tx_len < len + WS_MAX_HEADER) {
+        memmove(wa->tx_buf, wa->tx_buf + wa->tx_off, wa->tx_len - wa->tx_off);
+        wa->tx_len -= wa->tx_off;
+        wa->tx_off = 0;
+    }
+    if (!ws_reserve(&wa->tx_buf, &wa->tx_cap, wa->tx_len + len + WS_MAX_HEADER)) goto out;
+
+    /* Client frames are always masked */
+    uint8_t *p = wa->tx_buf + wa->tx_len;
+    size_t hdr = 2;
+
+    p[0] = 0x80 | opcode;  /* FIN */
+    if (len < 126) {
+        p[1] = 0x80 | len;
+    } else if (len < 65536) {
+        p[1] = 0x80 | 126;
+        p[2] = (len >> 8) & 0xFF;
+        p[3] = len & 0xFF;
+        hdr = 4;
+    } else {
+        p[1] = 0x80 | 127;
+        for (int i = 0; i < 8; i++) {
+            p[2 + i] = ((uint64_t)len >> (56 - 8 * i)) & 0xFF;
+        }
+        hdr = 10;
+    }
+
+    uint32_t mask = ws_next_mask(wa);
+    memcpy(p + hdr, &mask, 4);
+    ws_mask(p + hdr + 4, data, len, p + hdr);
+    wa->tx_len += hdr + 4 + len;
+
+    ok = ws_flush_locked(wa);
+
+out:
+    pthread_mutex_unlock(&wa->tx_mutex);
+    return ok;
+}
+
+static bool send_ws_message(WebRTCAgent *wa, const char *message) {
+    if (!wa || !message) return false;
+    return ws_queue_frame(wa, WS_OP_TEXT, message, strlen(message));
+}
+
+static void ws_close(WebRTCAgent *wa) {
+    pthread_mutex_lock(&wa->tx_mutex);
+    if (wa->ws_fd >= 0) {
+        close(wa->ws_fd);
+        wa->ws_fd = -1;
+    }
+    wa->connected = false;
+    wa->tx_off = wa->tx_len = 0;
+    wa->tx_waiting = false;
+    pthread_mutex_unlock(&wa->tx_mutex);
+
+    wa->peer_connected = false;
+    wa->rx_len = 0;
+    wa->msg_len = 0;
+    wa->msg_opcode = 0;
+}
+
 static bool connect_to_signaling(WebRTCAgent *wa) {
     char host[256] = {0};
     char path[256] = {0};
@@ -203,8 +539,8 @@ static bool connect_to_signaling(WebRTCAgent *wa) {
     }
 
     /* Create socket */
-    wa->ws_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (wa->ws_fd < 0) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
         LOG_ERROR("Failed to create socket: %s", strerror(errno));
         return false;
     }
@@ -215,10 +551,9 @@ static bool connect_to_signaling(WebRTCAgent *wa) {
     addr.sin_port = htons(port);
     memcpy(&addr.sin_addr, he->h_addr_list[0], he->h_length);
 
-    if (connect(wa->ws_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
         LOG_ERROR("Failed to connect: %s", strerror(errno));
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
+        close(fd);
         return false;
     }
 
@@ -234,82 +569,66 @@ static bool connect_to_signaling(WebRTCAgent *wa) {
         "\r\n",
         path, host, port);
 
-    if (send(wa->ws_fd, request, strlen(request), 0) < 0) {
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) {
         LOG_ERROR("Failed to send upgrade request");
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
+        close(fd);
         return false;
     }
 
-    /* Read response */
-    char response[1024];
-    ssize_t n = recv(wa->ws_fd, response, sizeof(response) - 1, 0);
-    if (n <= 0) {
-        LOG_ERROR("Failed to receive upgrade response");
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
-        return false;
+    /* Read response headers; frames may follow in the same read */
+    char response[4096];
+    size_t got = 0;
+    char *end = NULL;
+    while (!end && got < sizeof(response) - 1) {
+        ssize_t n = recv(fd, response + got, sizeof(response) - 1 - got, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            LOG_ERROR("Failed to receive upgrade response");
+            close(fd);
+            return false;
+        }
+        got += n;
+        response[got] = '\0';
+        end = strstr(response, "\r\n\r\n");
     }
-    response[n] = '\0';
 
     /* Check for 101 Switching Protocols */
-    if (strstr(response, "101") == NULL) {
+    if (!end || strncmp(response, "HTTP/1.1 101", 12) != 0) {
         LOG_ERROR("WebSocket upgrade failed: %s", response);
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
+        close(fd);
         return false;
     }
 
-    wa->connected = true;
-    LOG_INFO("Connected to signaling server");
-
-    return true;
-}
-
-static bool send_ws_message(WebRTCAgent *wa, const char *message) {
-    if (!wa || wa->ws_fd < 0 || !message) return false;
-
-    size_t len = strlen(message);
-
-    /* Simple WebSocket frame (text, unmasked - server to client typically doesn't mask) */
-    uint8_t frame[10];
-    int frame_len = 2;
-
-    frame[0] = 0x81;  /* FIN + text opcode */
-
-    if (len < 126) {
-        frame[1] = 0x80 | len;  /* Mask bit + length */
-    } else if (len < 65536) {
-        frame[1] = 0x80 | 126;
-        frame[2] = (len >> 8) & 0xFF;
-        frame[3] = len & 0xFF;
-        frame_len = 4;
-    } else {
-        return false;  /* Too large */
+    size_t extra = got - (end + 4 - response);
+    wa->rx_len = 0;
+    if (extra > 0) {
+        if (!ws_reserve(&wa->rx_buf, &wa->rx_cap, extra)) {
+            close(fd);
+            return false;
+        }
+        memcpy(wa->rx_buf, end + 4, extra);
+        wa->rx_len = extra;
     }
 
-    /* Add mask key */
-    uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
-    memcpy(frame + frame_len, mask, 4);
-    frame_len += 4;
+    /* From here on the signaling thread waits in epoll */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
 
-    /* Send frame header */
-    if (send(wa->ws_fd, frame, frame_len, 0) != frame_len) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    if (epoll_ctl(wa->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        LOG_ERROR("Failed to watch signaling socket: %s", strerror(errno));
+        close(fd);
         return false;
     }
 
-    /* Send masked payload */
-    uint8_t *masked = zixiao_malloc(len);
-    if (!masked) return false;
-
-    for (size_t i = 0; i < len; i++) {
-        masked[i] = message[i] ^ mask[i % 4];
-    }
+    pthread_mutex_lock(&wa->tx_mutex);
+    wa->ws_fd = fd;
+    wa->tx_waiting = false;
+    wa->connected = true;
+    pthread_mutex_unlock(&wa->tx_mutex);
 
-    ssize_t sent = send(wa->ws_fd, masked, len, 0);
-    zixiao_free(masked);
+    LOG_INFO("Connected to signaling server");
 
-    return sent == (ssize_t)len;
+    return true;
 }
 
 static void process_signaling_message(WebRTCAgent *wa, const char *message) {
@@ -322,6 +641,9 @@ static void process_signaling_message(WebRTCAgent *wa, const char *message) {
     if (strstr(message, "\"offer\"")) {
         LOG_INFO("Received SDP offer");
         wa->peer_connected = true;
+        for (int i = 0; i < ZIXIAO_MAX_MONITORS; i++) {
+            wa->streams[i].key_frame_needed = true;
+        }
 
         /* Send simple answer */
         const char *answer = "{\"type\":\"answer\",\"payload\":\"\"}";
@@ -347,117 +669,434 @@ static void process_signaling_message(WebRTCAgent *wa, const char *message) {
     }
 }
 
+/* A complete text or binary message */
+static void ws_deliver(WebRTCAgent *wa, uint8_t opcode, const uint8_t *data, size_t len) {
+    if (opcode == WS_OP_BINARY) {
+        if (wa->data_callback) {
+            wa->data_callback(data, len, wa->data_callback_data);
+        }
+        return;
+    }
+
+    /* Signaling JSON is parsed as a C string */
+    if (data != wa->msg_buf) {
+        if (!ws_reserve(&wa->msg_buf, &wa->msg_cap, len + 1)) return;
+        memcpy(wa->msg_buf, data, len);
+    }
+    wa->msg_buf[len] = '\0';
+    process_signaling_message(wa, (char *)wa->msg_buf);
+}
+
+/* False when the connection should close */
+static bool ws_handle_frame(WebRTCAgent *wa, bool fin, uint8_t opcode,
+                            const uint8_t *payload, size_t len) {
+    switch (opcode) {
+        case WS_OP_CLOSE:
+            LOG_INFO("WebSocket close frame received");
+            /* Echo the status code back */
+            ws_queue_frame(wa, WS_OP_CLOSE, payload, len >= 2 ? 2 : 0);
+            return false;
+
+        case WS_OP_PING:
+            ws_queue_frame(wa, WS_OP_PONG, payload, len);
+            return true;
+
+        case WS_OP_PONG:
+            return true;
+
+        case WS_OP_TEXT:
+        case WS_OP_BINARY:
+            if (wa->msg_opcode != 0) {
+                LOG_WARNING("WebSocket message started inside a fragmented one");
+                return false;
+            }
+            if (fin) {
+                ws_deliver(wa, opcode, payload, len);
+                return true;
+            }
+            wa->msg_opcode = opcode;
+            wa->msg_len = 0;
+            break;
+
+        case WS_OP_CONTINUATION:
+            if (wa->msg_opcode == 0) {
+                LOG_WARNING("WebSocket continuation without a message");
+                return false;
+            }
+            break;
+
+        default:
+            LOG_WARNING("Unknown WebSocket opcode 0x%x", opcode);
+            return false;
+    }
+
+    /* Fragment: keep room for the terminator text messages get */
+    if (wa->msg_len + len > WS_MAX_MESSAGE ||
+        !ws_reserve(&wa->msg_buf, &wa->msg_cap, wa->msg_len + len + 1)) {
+        LOG_WARNING("WebSocket message too large");
+        return false;
+    }
+    memcpy(wa->msg_buf + wa->msg_len, payload, len);
+    wa->msg_len += len;
+
+    if (fin) {
+        ws_deliver(wa, wa->msg_opcode, wa->msg_buf, wa->msg_len);
+        wa->msg_opcode = 0;
+        wa->msg_len = 0;
+    }
+    return true;
+}
+
+/* Handles every complete frame in rx_buf and keeps the partial tail */
+static bool ws_parse_frames(WebRTCAgent *wa) {
+    size_t off = 0;
+    bool ok = true;
+
+    while (ok && wa->rx_len - off >= 2) {
+        uint8_t *p = wa->rx_buf + off;
+        size_t avail = wa->rx_len - off;
+        bool fin = p[0] & 0x80;
+        uint8_t opcode = p[0] & 0x0F;
+        bool masked = p[1] & 0x80;
+        uint64_t len = p[1] & 0x7F;
+        size_t hdr = 2;
+
+        if (len == 126) {
+            if (avail < 4) break;
+            len = ((uint64_t)p[2] << 8) | p[3];
+            hdr = 4;
+        } else if (len == 127) {
+            if (avail < 10) break;
+            len = 0;
+            for (int i = 0; i < 8; i++) {
+                len = (len << 8) | p[2 + i];
+            }
+            hdr = 10;
+        }
+        if (masked) hdr += 4;
+
+        if (len > WS_MAX_MESSAGE) {
+            LOG_WARNING("WebSocket frame too large: %llu bytes", (unsigned long long)len);
+            return false;
+        }
+        if (avail < hdr + len) break;
+
+        uint8_t *payload = p + hdr;
+        if (masked) {
+            ws_mask(payload, payload, len, payload - 4);
+        }
+
+        ok = ws_handle_frame(wa, fin, opcode, payload, len);
+        off += hdr + len;
+    }
+
+    if (off > 0) {
+        memmove(wa->rx_buf, wa->rx_buf + off, wa->rx_len - off);
+        wa->rx_len -= off;
+    }
+    return ok;
+}
+
+/* Reads until the socket is drained; false when the connection is gone */
+static bool ws_receive(WebRTCAgent *wa) {
+    for (;;) {
+        if (wa->rx_len >= WS_MAX_MESSAGE + WS_MAX_HEADER ||
+            !ws_reserve(&wa->rx_buf, &wa->rx_cap, wa->rx_len + WS_RX_CHUNK)) {
+            LOG_WARNING("Signaling receive buffer exhausted");
+            return false;
+        }
+
+        ssize_t n = recv(wa->ws_fd, wa->rx_buf + wa->rx_len, wa->rx_cap - wa->rx_len, 0);
+        if (n > 0) {
+            wa->rx_len += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+
+        if (n < 0) LOG_DEBUG("Signaling recv failed: %s", strerror(errno));
+        return false;
+    }
+
+    return ws_parse_frames(wa);
+}
+
 static void *signaling_thread_func(void *arg) {
     WebRTCAgent *wa = (WebRTCAgent *)arg;
 
     LOG_DEBUG("WebRTC signaling thread started");
 
     while (!wa->stopping) {
-        /* Connect if not connected */
-        if (!wa->connected) {
+        /* Connect if not connected; retries wait on wake_fd so stop is prompt */
+        int timeout = -1;
+        if (wa->ws_fd < 0) {
             if (!connect_to_signaling(wa)) {
-                /* Wait before retry */
-                sleep(5);
+                timeout = WS_RECONNECT_MS;
+            } else if (wa->rx_len > 0 && !ws_parse_frames(wa)) {
+                ws_close(wa);
                 continue;
             }
         }
 
-        /* Poll for messages */
-        struct pollfd pfd = {
-            .fd = wa->ws_fd,
-            .events = POLLIN
-        };
-
-        int ret = poll(&pfd, 1, 100);
+        struct epoll_event events[4];
+        int n = epoll_wait(wa->epoll_fd, events, 4, timeout);
 
-        if (ret < 0) {
+        if (n < 0) {
             if (errno != EINTR) {
-                LOG_ERROR("poll failed: %s", strerror(errno));
-                wa->connected = false;
+                LOG_ERROR("epoll_wait failed: %s", strerror(errno));
+                break;
             }
             continue;
         }
 
-        if (ret == 0) continue;
-
-        if (pfd.revents & (POLLHUP | POLLERR)) {
-            LOG_INFO("Signaling connection closed");
-            close(wa->ws_fd);
-            wa->ws_fd = -1;
-            wa->connected = false;
-            wa->peer_connected = false;
-            continue;
-        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.fd == wa->wake_fd) {
+                uint64_t count;
+                while (read(wa->wake_fd, &count, sizeof(count)) > 0) {}
+                continue;
+            }
+            if (events[i].data.fd != wa->ws_fd) continue;
 
-        if (pfd.revents & POLLIN) {
-            uint8_t buffer[4096];
-            ssize_t n = recv(wa->ws_fd, buffer, sizeof(buffer), 0);
+            uint32_t what = events[i].events;
 
-            if (n <= 0) {
-                LOG_INFO("Signaling connection closed");
-                close(wa->ws_fd);
-                wa->ws_fd = -1;
-                wa->connected = false;
-                wa->peer_connected = false;
-                continue;
+            if ((what & EPOLLOUT) && !(what & (EPOLLERR | EPOLLHUP))) {
+                pthread_mutex_lock(&wa->tx_mutex);
+                ws_flush_locked(wa);
+                pthread_mutex_unlock(&wa->tx_mutex);
             }
 
-            /* Parse WebSocket frame */
-            if (n >= 2) {
-                uint8_t opcode = buffer[0] & 0x0F;
-                uint8_t len = buffer[1] & 0x7F;
-                int offset = 2;
-
-                if (len == 126 && n >= 4) {
-                    len = (buffer[2] << 8) | buffer[3];
-                    offset = 4;
-                }
-
-                if (opcode == 0x01 && offset + len <= n) {  /* Text frame */
-                    buffer[offset + len] = '\0';
-                    process_signaling_message(wa, (char *)(buffer + offset));
-                } else if (opcode == 0x08) {  /* Close frame */
-                    LOG_INFO("WebSocket close frame received");
-                    close(wa->ws_fd);
-                    wa->ws_fd = -1;
-                    wa->connected = false;
-                    wa->peer_connected = false;
-                }
+            /* Data before a hangup is still read; recv then reports the close */
+            if ((what & (EPOLLIN | EPOLLERR | EPOLLHUP)) && !ws_receive(wa)) {
+                LOG_INFO("Signaling connection closed");
+                ws_close(wa);
             }
         }
     }
 
-    if (wa->ws_fd >= 0) {
-        close(wa->ws_fd);
-        wa->ws_fd = -1;
-    }
+    ws_close(wa);
 
     LOG_DEBUG("WebRTC signaling thread exiting");
     return NULL;
 }
 
-bool webrtc_agent_send_frame(WebRTCAgent *wa, const FrameData *frame) {
-    if (!wa || !wa->peer_connected || !frame) return false;
+static void on_encoded_packet(const EncodedPacket *packet, void *user_data) {
+    VideoStream *vs = (VideoStream *)user_data;
+    WebRTCAgent *wa = vs->owner;
+    uint64_t now = get_timestamp_us();
 
     /* In a full implementation:
-     * 1. Encode frame to H.264 (using libx264 or hardware encoder)
-     * 2. Package in RTP
-     * 3. Send via DTLS-SRTP over UDP
+     * 1. Package the access unit in RTP (RFC 6184) on the SSRC of its
+     *    monitor's stream, every packet carrying the transport-wide
+     *    sequence number extension
+     * 2. Send via DTLS-SRTP over UDP
+     * The congestion controller learns of each packet as it leaves.
      */
 
-    (void)frame;
+    for (size_t offset = 0; offset < packet->size; offset += WEBRTC_RTP_PAYLOAD) {
+        size_t payload = packet->size - offset;
+        if (payload > WEBRTC_RTP_PAYLOAD) payload = WEBRTC_RTP_PAYLOAD;
+
+        congestion_controller_on_packet_sent(wa->cc, wa->transport_seq++,
+                                             payload + WEBRTC_RTP_OVERHEAD, now);
+    }
+
+    wa->video_bytes += packet->size;
+}
+
+/* Encoder for the frame size and target, opened again when either
+ * the mode or the resolution step changes */
+static bool ensure_encoder(WebRTCAgent *wa, VideoStream *vs, const FrameData *frame,
+                           uint32_t bitrate) {
+    if (frame->width == vs->width && frame->height == vs->height &&
+        wa->target.scale == vs->scale) {
+        return vs->encoder != NULL;
+    }
+
+    video_encoder_destroy(vs->encoder);
+    vs->width = frame->width;
+    vs->height = frame->height;
+    vs->scale = wa->target.scale;
+    vs->bitrate = bitrate;
+
+    /* 4:2:0 needs even dimensions */
+    VideoEncoderConfig config = {
+        .width = frame->width,
+        .height = frame->height,
+        .output_width = (frame->width * wa->target.scale / 100) & ~1u,
+        .output_height = (frame->height * wa->target.scale / 100) & ~1u,
+        .fps = wa->target.fps,
+        .bitrate = bitrate,
+        .backend = wa->video_encoder[0] ? wa->video_encoder : NULL
+    };
+
+    /* A failure is not retried until the size changes */
+    vs->owner = wa;
+    vs->encoder = video_encoder_create(&config, on_encoded_packet, vs);
+    if (!vs->encoder) {
+        LOG_WARNING("WebRTC video disabled for monitor %u at %ux%u",
+                    frame->monitor, frame->width, frame->height);
+    }
+
+    return vs->encoder != NULL;
+}
+
+/*
+ * Follow the congestion controller: capture rate, bitrate and size.
+ * One peer connection carries every monitor, so the target is for the
+ * area of those that changed lately, and each stream gets the share of
+ * the bitrate its area is of that. Still monitors send nothing and
+ * take none. Returns the stream's bitrate.
+ */
+static uint32_t apply_congestion_target(WebRTCAgent *wa, VideoStream *vs,
+                                        const FrameData *frame, uint64_t now) {
+    uint64_t pixels = (uint64_t)frame->width * frame->height;
+    uint64_t active_pixels = pixels;
+
+    for (int i = 0; i < ZIXIAO_MAX_MONITORS; i++) {
+        const VideoStream *other = &wa->streams[i];
+        if (other != vs && other->last_frame_us &&
+            now - other->last_frame_us < WEBRTC_STREAM_IDLE_US) {
+            active_pixels += (uint64_t)other->width * other->height;
+        }
+    }
+
+    CongestionTarget target;
+    congestion_controller_get_target(wa->cc, frame->width,
+                                     (uint32_t)(active_pixels / frame->width), &target);
+
+    if (target.fps != wa->target.fps && wa->fps_callback) {
+        wa->fps_callback(target.fps, wa->fps_callback_data);
+    }
+
+    if (wa->target.scale && target.scale != wa->target.scale) {
+        LOG_INFO("WebRTC video at %u%% for %u kbps", target.scale, target.bitrate / 1000);
+    }
+
+    uint32_t bitrate = (uint32_t)(target.bitrate * pixels / active_pixels);
+
+    /* Backends that cannot change rate while open are reopened, once
+     * it is off by a quarter; a new encoder starts on a key frame */
+    if (vs->encoder && bitrate != vs->bitrate &&
+        !video_encoder_set_bitrate(vs->encoder, bitrate)) {
+        uint32_t low = bitrate < vs->bitrate ? bitrate : vs->bitrate;
+        uint32_t high = bitrate < vs->bitrate ? vs->bitrate : bitrate;
+        if (high - low > low / 4) {
+            vs->width = 0;
+        }
+    } else if (vs->encoder) {
+        vs->bitrate = bitrate;
+    }
+
+    wa->target = target;
+    return bitrate;
+}
+
+bool webrtc_agent_send_frame(WebRTCAgent *wa, const FrameData *frame) {
+    if (!wa || !wa->peer_connected || !frame || frame->width == 0) return false;
+    if (frame->monitor >= ZIXIAO_MAX_MONITORS) return false;
+
+    VideoStream *vs = &wa->streams[frame->monitor];
+    uint64_t now = get_timestamp_us();
+
+    uint32_t bitrate = apply_congestion_target(wa, vs, frame, now);
+    vs->last_frame_us = now;
+
+    if (!ensure_encoder(wa, vs, frame, bitrate)) {
+        return false;
+    }
+
+    bool force_key_frame = vs->key_frame_needed;
+    vs->key_frame_needed = false;
+
+    if (!video_encoder_encode(vs->encoder, frame, force_key_frame)) {
+        vs->key_frame_needed = force_key_frame;
+        return false;
+    }
+
     return true;
 }
 
 bool webrtc_agent_send_audio(WebRTCAgent *wa, const AudioData *audio) {
     if (!wa || !wa->peer_connected || !audio) return false;
 
+    /* Raw PCM has no place on the peer connection */
+    if (audio->codec != AUDIO_CODEC_OPUS) return false;
+
     /* In a full implementation:
-     * 1. Encode audio to Opus
-     * 2. Package in RTP
-     * 3. Send via DTLS-SRTP over UDP
+     * 1. Package the packet in RTP (RFC 7587), the RTP timestamp at
+     *    48 kHz from audio->timestamp, on the clock video uses
+     * 2. Send via DTLS-SRTP over UDP
      */
 
-    (void)audio;
+    wa->audio_bytes += audio->data_size;
     return true;
 }
+
+/* Middle 32 bits of the NTP time, as LSR in receiver reports */
+static uint32_t ntp_short_time(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    uint32_t seconds = (uint32_t)tv.tv_sec + NTP_UNIX_OFFSET;
+    uint32_t fraction = (uint32_t)(((uint64_t)tv.tv_usec << 16) / 1000000);
+    return (seconds << 16) | fraction;
+}
+
+static void handle_report_block(WebRTCAgent *wa, const uint8_t *block, uint64_t now_us) {
+    uint8_t fraction_lost = block[4];
+    uint32_t lsr = ((uint32_t)block[16] << 24) | ((uint32_t)block[17] << 16) |
+                   ((uint32_t)block[18] << 8) | block[19];
+    uint32_t dlsr = ((uint32_t)block[20] << 24) | ((uint32_t)block[21] << 16) |
+                    ((uint32_t)block[22] << 8) | block[23];
+
+    /* Round trip from our last sender report, in 1/65536 s */
+    uint32_t rtt_ms = 0;
+    if (lsr != 0) {
+        uint32_t rtt = ntp_short_time() - lsr - dlsr;
+        if (rtt < 0x80000000u) {
+            rtt_ms = (uint32_t)(((uint64_t)rtt * 1000) >> 16);
+        }
+    }
+
+    congestion_controller_on_receiver_report(wa->cc, fraction_lost, rtt_ms, now_us);
+}
+
+bool webrtc_agent_handle_rtcp(WebRTCAgent *wa, const uint8_t *data, size_t size) {
+    if (!wa || !wa->cc || !data) return false;
+
+    uint64_t now = get_timestamp_us();
+    bool handled = false;
+    size_t pos = 0;
+
+    /* Only video is sent, so every report block is about it */
+    while (pos + 4 <= size) {
+        const uint8_t *packet = data + pos;
+        if ((packet[0] >> 6) != 2) break;
+
+        uint8_t count = packet[0] & 0x1F;
+        uint8_t type = packet[1];
+        size_t length = ((size_t)((packet[2] << 8) | packet[3]) + 1) * 4;
+        if (pos + length > size) break;
+
+        if (type == RTCP_SR || type == RTCP_RR) {
+            /* Header and sender SSRC, then sender info in an SR */
+            size_t offset = type == RTCP_SR ? 28 : 8;
+            for (uint8_t i = 0; i < count && offset + RTCP_REPORT_BLOCK_SIZE <= length; i++) {
+                handle_report_block(wa, packet + offset, now);
+                offset += RTCP_REPORT_BLOCK_SIZE;
+            }
+            handled = true;
+        } else if (type == RTCP_RTPFB && count == RTCP_FMT_TRANSPORT_CC && length > 12) {
+            /* Header, sender and media SSRC, then the FCI */
+            if (congestion_controller_on_transport_feedback(wa->cc, packet + 12, length - 12, now)) {
+                handled = true;
+            } else {
+                LOG_DEBUG("Malformed transport feedback");
+            }
+        }
+
+        pos += length;
+    }
+
+    return handled;
+}
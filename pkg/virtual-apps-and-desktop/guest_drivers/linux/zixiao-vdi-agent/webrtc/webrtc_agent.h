@@ -17,8 +17,17 @@ extern "C" {
 /* WebRTC agent configuration */
 typedef struct {
     const char *signaling_url;
+    const char *video_encoder;  /* backend name; NULL for the best available */
+    uint32_t    video_fps;
 } WebRTCAgentConfig;
 
+/* Capture rate the congestion controller wants */
+typedef void (*WebRTCFpsCallback)(uint32_t fps, void *user_data);
+
+/* Binary message from the signaling channel, the data-channel fallback;
+ * runs on the signaling thread */
+typedef void (*WebRTCDataCallback)(const uint8_t *data, size_t size, void *user_data);
+
 /* WebRTC agent context (opaque) */
 typedef struct WebRTCAgent WebRTCAgent;
 
@@ -38,11 +47,21 @@ bool webrtc_agent_is_connected(WebRTCAgent *wa);
 
 /* Callbacks */
 void webrtc_agent_set_input_callback(WebRTCAgent *wa, InputCallback callback, void *user_data);
+void webrtc_agent_set_fps_callback(WebRTCAgent *wa, WebRTCFpsCallback callback, void *user_data);
+void webrtc_agent_set_data_callback(WebRTCAgent *wa, WebRTCDataCallback callback, void *user_data);
 
 /* Send data to remote */
 bool webrtc_agent_send_frame(WebRTCAgent *wa, const FrameData *frame);
 bool webrtc_agent_send_audio(WebRTCAgent *wa, const AudioData *audio);
 
+/* Binary message over the signaling channel; false when not connected
+ * or too much is already queued. Any thread */
+bool webrtc_agent_send_data(WebRTCAgent *wa, const uint8_t *data, size_t size);
+
+/* Compound RTCP packet from the peer: receiver reports and
+ * transport-wide feedback steer bitrate, frame rate and size */
+bool webrtc_agent_handle_rtcp(WebRTCAgent *wa, const uint8_t *data, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,7 @@
 
 #include "display_capture.h"
 #include <dxgi1_6.h>
+#include <d3d10.h>
 
 #pragma comment(lib, "d3d11.lib")
 #pragma comment(lib, "dxgi.lib")
@@ -17,6 +18,15 @@ DisplayCapture::DisplayCapture() {
     frameInterval_ = std::chrono::microseconds(1000000 / targetFps_);
 }
 
+void DisplayCapture::SetTargetFps(uint32_t fps) {
+    if (fps == 0) {
+        return;
+    }
+
+    targetFps_ = fps;
+    frameInterval_ = std::chrono::microseconds(1000000 / fps);
+}
+
 DisplayCapture::~DisplayCapture() {
     Shutdown();
 }
@@ -46,7 +56,8 @@ bool DisplayCapture::InitializeD3D() {
         D3D_FEATURE_LEVEL_10_0
     };
 
-    UINT createFlags = D3D11_CREATE_DEVICE_BGRA_SUPPORT;
+    // Video support lets the encoder convert frames on this device
+    UINT createFlags = D3D11_CREATE_DEVICE_BGRA_SUPPORT | D3D11_CREATE_DEVICE_VIDEO_SUPPORT;
 #ifdef _DEBUG
     createFlags |= D3D11_CREATE_DEVICE_DEBUG;
 #endif
@@ -80,11 +91,33 @@ bool DisplayCapture::InitializeD3D() {
             &context_);
     }
 
+    if (FAILED(hr)) {
+        // Capture alone does not need video support
+        createFlags &= ~D3D11_CREATE_DEVICE_VIDEO_SUPPORT;
+        hr = D3D11CreateDevice(
+            nullptr,
+            D3D_DRIVER_TYPE_HARDWARE,
+            nullptr,
+            createFlags,
+            featureLevels,
+            ARRAYSIZE(featureLevels),
+            D3D11_SDK_VERSION,
+            &device_,
+            &featureLevel,
+            &context_);
+    }
+
     if (FAILED(hr)) {
         LogF(LogLevel::Error, L"D3D11CreateDevice failed: 0x%08X", hr);
         return false;
     }
 
+    // A hardware encoder uses the device from its own threads
+    ComPtr<ID3D10Multithread> multithread;
+    if (SUCCEEDED(device_.As(&multithread))) {
+        multithread->SetMultithreadProtected(TRUE);
+    }
+
     LogF(LogLevel::Debug, L"D3D11 device created, feature level: 0x%X", featureLevel);
     return true;
 }
@@ -151,6 +184,9 @@ bool DisplayCapture::InitializeDuplication() {
         return false;
     }
 
+    // New textures hold nothing yet
+    haveFrame_ = false;
+
     // Create staging texture for CPU access
     D3D11_TEXTURE2D_DESC stagingDesc = {};
     stagingDesc.Width = monitorInfo_.width;
@@ -168,6 +204,18 @@ bool DisplayCapture::InitializeDuplication() {
         return false;
     }
 
+    // GPU frames outlive the duplicated surface, which goes back to DWM
+    D3D11_TEXTURE2D_DESC gpuDesc = stagingDesc;
+    gpuDesc.Usage = D3D11_USAGE_DEFAULT;
+    gpuDesc.CPUAccessFlags = 0;
+    gpuDesc.BindFlags = D3D11_BIND_SHADER_RESOURCE | D3D11_BIND_RENDER_TARGET;
+
+    hr = device_->CreateTexture2D(&gpuDesc, nullptr, &gpuTexture_);
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"Failed to create frame texture: 0x%08X", hr);
+        return false;
+    }
+
     return true;
 }
 
@@ -176,6 +224,7 @@ void DisplayCapture::Shutdown() {
 
     duplication_.Reset();
     stagingTexture_.Reset();
+    gpuTexture_.Reset();
     context_.Reset();
     device_.Reset();
 
@@ -189,7 +238,6 @@ bool DisplayCapture::Start() {
 
     LOG_INFO(L"Starting display capture...");
 
-    frameInterval_ = std::chrono::microseconds(1000000 / targetFps_);
     stopping_.store(false);
     running_.store(true);
 
@@ -232,8 +280,9 @@ void DisplayCapture::CaptureLoop() {
 
         // Rate limiting
         auto elapsed = std::chrono::steady_clock::now() - frameStart;
-        if (elapsed < frameInterval_) {
-            std::this_thread::sleep_for(frameInterval_ - elapsed);
+        auto interval = frameInterval_.load();
+        if (elapsed < interval) {
+            std::this_thread::sleep_for(interval - elapsed);
         }
     }
 }
@@ -277,8 +326,35 @@ bool DisplayCapture::AcquireFrame(FrameData& frame) {
         return false;
     }
 
-    // Copy to staging texture
-    context_->CopyResource(stagingTexture_.Get(), texture.Get());
+    // Pointer-only updates carry no new desktop image
+    if (frameInfo.LastPresentTime.QuadPart == 0 && haveFrame_) {
+        duplication_->ReleaseFrame();
+        return false;
+    }
+
+    // Bring our copy up to date, only where the desktop changed
+    ID3D11Texture2D* target = gpuFrames_ ? gpuTexture_.Get() : stagingTexture_.Get();
+    if (!haveFrame_ || !CopyChangedRegions(target, texture.Get(), frameInfo)) {
+        context_->CopyResource(target, texture.Get());
+        dirtyRects_.clear();
+        haveFrame_ = true;
+    }
+
+    frame.width = monitorInfo_.width;
+    frame.height = monitorInfo_.height;
+    frame.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+    frame.keyFrame = (frameCount_ % 30 == 0);  // Every 30 frames is a keyframe
+    frame.dirtyRects = dirtyRects_;
+
+    // GPU frames: copies on the GPU, no readback
+    if (gpuFrames_) {
+        duplication_->ReleaseFrame();
+
+        frame.texture = gpuTexture_;
+        frame.stride = 0;
+        return true;
+    }
 
     // Map staging texture for CPU read
     D3D11_MAPPED_SUBRESOURCE mapped;
@@ -289,12 +365,7 @@ bool DisplayCapture::AcquireFrame(FrameData& frame) {
     }
 
     // Copy data to frame
-    frame.width = monitorInfo_.width;
-    frame.height = monitorInfo_.height;
     frame.stride = mapped.RowPitch;
-    frame.timestamp = std::chrono::duration_cast<std::chrono::milliseconds>(
-        std::chrono::steady_clock::now().time_since_epoch()).count();
-    frame.keyFrame = (frameCount_ % 30 == 0);  // Every 30 frames is a keyframe
 
     size_t dataSize = mapped.RowPitch * monitorInfo_.height;
     frame.data.resize(dataSize);
@@ -306,6 +377,72 @@ bool DisplayCapture::AcquireFrame(FrameData& frame) {
     return true;
 }
 
+//
+// Copy the rectangles a frame changed into target
+//
+// The duplicated surface always holds the whole desktop, so a move is
+// copied from its destination like a dirty rectangle. False when the
+// metadata is unavailable and the whole frame must be copied.
+//
+bool DisplayCapture::CopyChangedRegions(ID3D11Texture2D* target, ID3D11Texture2D* desktop,
+                                        const DXGI_OUTDUPL_FRAME_INFO& frameInfo) {
+    dirtyRects_.clear();
+
+    if (frameInfo.TotalMetadataBufferSize == 0) {
+        return false;
+    }
+
+    if (metadata_.size() < frameInfo.TotalMetadataBufferSize) {
+        metadata_.resize(frameInfo.TotalMetadataBufferSize);
+    }
+
+    UINT moveBytes = 0;
+    HRESULT hr = duplication_->GetFrameMoveRects(
+        static_cast<UINT>(metadata_.size()),
+        reinterpret_cast<DXGI_OUTDUPL_MOVE_RECT*>(metadata_.data()),
+        &moveBytes);
+    if (FAILED(hr)) {
+        return false;
+    }
+
+    UINT dirtyBytes = 0;
+    hr = duplication_->GetFrameDirtyRects(
+        static_cast<UINT>(metadata_.size() - moveBytes),
+        reinterpret_cast<RECT*>(metadata_.data() + moveBytes),
+        &dirtyBytes);
+    if (FAILED(hr)) {
+        return false;
+    }
+
+    const auto* moves = reinterpret_cast<const DXGI_OUTDUPL_MOVE_RECT*>(metadata_.data());
+    const auto* dirty = reinterpret_cast<const RECT*>(metadata_.data() + moveBytes);
+
+    for (UINT i = 0; i < moveBytes / sizeof(DXGI_OUTDUPL_MOVE_RECT); i++) {
+        dirtyRects_.push_back(moves[i].DestinationRect);
+    }
+    for (UINT i = 0; i < dirtyBytes / sizeof(RECT); i++) {
+        dirtyRects_.push_back(dirty[i]);
+    }
+
+    if (dirtyRects_.empty()) {
+        return false;
+    }
+
+    for (const RECT& rect : dirtyRects_) {
+        D3D11_BOX box = {};
+        box.left = static_cast<UINT>(rect.left);
+        box.top = static_cast<UINT>(rect.top);
+        box.front = 0;
+        box.right = static_cast<UINT>(rect.right);
+        box.bottom = static_cast<UINT>(rect.bottom);
+        box.back = 1;
+
+        context_->CopySubresourceRegion(target, 0, box.left, box.top, 0, desktop, 0, &box);
+    }
+
+    return true;
+}
+
 void DisplayCapture::ReleaseFrame() {
     if (duplication_) {
         duplication_->ReleaseFrame();
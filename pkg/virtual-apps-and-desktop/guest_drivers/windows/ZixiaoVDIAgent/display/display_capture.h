@@ -31,11 +31,17 @@ public:
     bool IsRunning() const override { return running_.load(); }
     const wchar_t* GetName() const override { return L"DisplayCapture"; }
 
-    // Configuration
-    void SetTargetFps(uint32_t fps) { targetFps_ = fps; }
+    // Configuration; the rate may change while running, as from the
+    // frame callback
+    void SetTargetFps(uint32_t fps);
     void SetMonitor(uint32_t monitorIndex) { monitorIndex_ = monitorIndex; }
     void SetFrameCallback(FrameCallback callback) { frameCallback_ = std::move(callback); }
 
+    // Deliver frames as textures on GetDevice() instead of CPU copies;
+    // set before Start
+    void SetGpuFrames(bool enable) { gpuFrames_ = enable; }
+    ID3D11Device* GetDevice() const { return device_.Get(); }
+
     // Control
     bool Start();
     void Stop();
@@ -52,6 +58,8 @@ private:
     bool InitializeDuplication();
     void CaptureLoop();
     bool AcquireFrame(FrameData& frame);
+    bool CopyChangedRegions(ID3D11Texture2D* target, ID3D11Texture2D* desktop,
+                            const DXGI_OUTDUPL_FRAME_INFO& frameInfo);
     void ReleaseFrame();
 
     // D3D11 objects
@@ -59,6 +67,12 @@ private:
     ComPtr<ID3D11DeviceContext> context_;
     ComPtr<IDXGIOutputDuplication> duplication_;
     ComPtr<ID3D11Texture2D> stagingTexture_;
+    ComPtr<ID3D11Texture2D> gpuTexture_;
+
+    // Changed areas of the last frame, from the duplication metadata
+    std::vector<uint8_t> metadata_;
+    std::vector<RECT> dirtyRects_;
+    bool haveFrame_ = false;
 
     // Configuration
     uint32_t targetFps_ = 30;
@@ -70,11 +84,12 @@ private:
     std::atomic<bool> stopping_{false};
     std::thread captureThread_;
     FrameCallback frameCallback_;
+    bool gpuFrames_ = false;
     uint64_t frameCount_ = 0;
 
     // Timing
     std::chrono::steady_clock::time_point lastFrameTime_;
-    std::chrono::microseconds frameInterval_;
+    std::atomic<std::chrono::microseconds> frameInterval_;
 };
 
 } // namespace zixiao::vdi
@@ -0,0 +1,918 @@
+/*
+ * Zixiao VDI Agent - Video Encoder Implementation
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * H.264 through Media Foundation transforms. GPU vendors ship their
+ * encoders as hardware MFTs (NVENC, Quick Sync, AMF), so one
+ * implementation drives all of them; the Microsoft software MFT is the
+ * fallback.
+ *
+ * A hardware encoder shares the capture device. Captured textures are
+ * converted to NV12 by the video processor into a small ring of
+ * surfaces, each wrapped once in a sample, so a frame never leaves the
+ * GPU and nothing is allocated per frame. The software encoder reads
+ * textures back through one staging texture and converts on the CPU.
+ * A smaller output size is scaled in the same conversion.
+ */
+
+#include "video_encoder.h"
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mftransform.h>
+#include <codecapi.h>
+#include <mferror.h>
+#include <algorithm>
+#include <array>
+
+#pragma comment(lib, "mfplat.lib")
+#pragma comment(lib, "mfuuid.lib")
+#pragma comment(lib, "strmiids.lib")
+
+namespace zixiao::vdi {
+
+using Microsoft::WRL::ComPtr;
+
+namespace {
+
+// NV12 surfaces in flight; async encoders ask for input only while
+// they have room, which is well below this
+constexpr uint32_t kSurfaceCount = 8;
+
+constexpr LONGLONG kTicksPerMs = 10000;     // 100 ns units
+
+//
+// BGRA to NV12, BT.709 limited range; a smaller destination takes the
+// nearest source pixels
+//
+void ConvertBgraToNv12(const uint8_t* src, uint32_t srcStride, uint32_t srcWidth, uint32_t srcHeight,
+                       uint8_t* dst, uint32_t width, uint32_t height) {
+    uint8_t* dstY = dst;
+    uint8_t* dstUV = dst + static_cast<size_t>(width) * height;
+
+    for (uint32_t y = 0; y < height; y += 2) {
+        const uint8_t* row0 = src + static_cast<size_t>(y) * srcHeight / height * srcStride;
+        const uint8_t* row1 = src + static_cast<size_t>(y + 1) * srcHeight / height * srcStride;
+        uint8_t* y0 = dstY + static_cast<size_t>(y) * width;
+        uint8_t* y1 = y0 + width;
+        uint8_t* uv = dstUV + static_cast<size_t>(y / 2) * width;
+
+        for (uint32_t x = 0; x < width; x += 2) {
+            int sumB = 0, sumG = 0, sumR = 0;
+            size_t x0 = static_cast<size_t>(x) * srcWidth / width * 4;
+            size_t x1 = static_cast<size_t>(x + 1) * srcWidth / width * 4;
+            const uint8_t* pixels[4] = { row0 + x0, row0 + x1, row1 + x0, row1 + x1 };
+            uint8_t* lumas[4] = { y0 + x, y0 + x + 1, y1 + x, y1 + x + 1 };
+
+            for (int i = 0; i < 4; i++) {
+                int b = pixels[i][0], g = pixels[i][1], r = pixels[i][2];
+                *lumas[i] = static_cast<uint8_t>(((47 * r + 157 * g + 16 * b + 128) >> 8) + 16);
+                sumB += b;
+                sumG += g;
+                sumR += r;
+            }
+
+            sumB /= 4;
+            sumG /= 4;
+            sumR /= 4;
+            uv[x] = static_cast<uint8_t>(((-26 * sumR - 87 * sumG + 112 * sumB + 128) >> 8) + 128);
+            uv[x + 1] = static_cast<uint8_t>(((112 * sumR - 102 * sumG - 10 * sumB + 128) >> 8) + 128);
+        }
+    }
+}
+
+bool SetCodecValue(ICodecAPI* codecApi, const GUID& property, ULONG value) {
+    if (!codecApi) {
+        return false;
+    }
+
+    VARIANT var;
+    var.vt = VT_UI4;
+    var.ulVal = value;
+    return SUCCEEDED(codecApi->SetValue(&property, &var));
+}
+
+bool SetCodecFlag(ICodecAPI* codecApi, const GUID& property, bool value) {
+    if (!codecApi) {
+        return false;
+    }
+
+    VARIANT var;
+    var.vt = VT_BOOL;
+    var.boolVal = value ? VARIANT_TRUE : VARIANT_FALSE;
+    return SUCCEEDED(codecApi->SetValue(&property, &var));
+}
+
+} // namespace
+
+//
+// Media Foundation H.264 encoder
+//
+class MFVideoEncoder : public VideoEncoder {
+public:
+    MFVideoEncoder(IMFActivate* activate, ID3D11Device* device, bool hardware)
+        : activate_(activate), device_(device), hardware_(hardware) {
+        LPWSTR name = nullptr;
+        UINT32 length = 0;
+        if (SUCCEEDED(activate->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute, &name, &length))) {
+            name_ = name;
+            CoTaskMemFree(name);
+        } else {
+            name_ = hardware ? L"Hardware H.264 MFT" : L"Software H.264 MFT";
+        }
+    }
+
+    ~MFVideoEncoder() override {
+        Shutdown();
+    }
+
+    bool Initialize(const VideoEncoderConfig& config) override;
+    void Shutdown() override;
+    bool EncodeFrame(const FrameData& frame) override;
+    bool SetBitrate(uint32_t bitrate) override;
+
+    const std::wstring& GetName() const override { return name_; }
+    bool IsHardware() const override { return hardware_; }
+
+private:
+    bool ConfigureTypes();
+    bool InitializeVideoProcessor();
+    bool InitializeSystemMemory();
+    bool RefreshOutputInfo();
+
+    IMFSample* PrepareTexture(const FrameData& frame);
+    IMFSample* PrepareSystemMemory(const FrameData& frame);
+
+    bool Submit(IMFSample* sample, const FrameData& frame);
+    bool WaitForEvent(bool block, bool& gotOutput);
+    bool DrainOutput();
+    HRESULT ProcessOneOutput();
+    void DeliverSample(IMFSample* sample);
+
+    // Media Foundation objects
+    ComPtr<IMFActivate> activate_;
+    ComPtr<IMFTransform> transform_;
+    ComPtr<IMFMediaEventGenerator> events_;
+    ComPtr<ICodecAPI> codecApi_;
+    ComPtr<IMFDXGIDeviceManager> deviceManager_;
+    UINT resetToken_ = 0;
+
+    // D3D11 objects
+    ComPtr<ID3D11Device> device_;
+    ComPtr<ID3D11DeviceContext> context_;
+    ComPtr<ID3D11VideoDevice> videoDevice_;
+    ComPtr<ID3D11VideoContext> videoContext_;
+    ComPtr<ID3D11VideoProcessorEnumerator> processorEnum_;
+    ComPtr<ID3D11VideoProcessor> processor_;
+    ComPtr<ID3D11Texture2D> inputTexture_;          // texture behind inputView_
+    ComPtr<ID3D11VideoProcessorInputView> inputView_;
+    ComPtr<ID3D11Texture2D> uploadTexture_;         // system memory frames
+    ComPtr<ID3D11Texture2D> stagingTexture_;        // software readback
+
+    // NV12 surface ring for the hardware encoder
+    std::array<ComPtr<ID3D11Texture2D>, kSurfaceCount> surfaces_;
+    std::array<ComPtr<ID3D11VideoProcessorOutputView>, kSurfaceCount> outputViews_;
+    std::array<ComPtr<IMFSample>, kSurfaceCount> surfaceSamples_;
+    uint32_t nextSurface_ = 0;
+
+    // System memory input for the software encoder
+    ComPtr<IMFSample> inputSample_;
+    ComPtr<IMFMediaBuffer> inputBuffer_;
+
+    // Output sample when the encoder does not allocate its own
+    ComPtr<IMFSample> outputSample_;
+    ComPtr<IMFMediaBuffer> outputBuffer_;
+    bool providesSamples_ = false;
+
+    std::wstring name_;
+    VideoEncoderConfig config_;
+    bool hardware_ = false;
+    bool useTextures_ = false;
+    bool async_ = false;
+    bool initialized_ = false;
+    bool mfStarted_ = false;
+    uint32_t inputRequests_ = 0;
+    LONGLONG lastSampleTime_ = -1;
+    uint64_t framesDropped_ = 0;
+};
+
+bool MFVideoEncoder::Initialize(const VideoEncoderConfig& config) {
+    config_ = config;
+
+    // NV12 needs even dimensions; unscaled, an odd edge column or row
+    // is cropped
+    if (config_.outputWidth == 0 || config_.outputHeight == 0) {
+        config_.width &= ~1u;
+        config_.height &= ~1u;
+        config_.outputWidth = config_.width;
+        config_.outputHeight = config_.height;
+    }
+    config_.outputWidth &= ~1u;
+    config_.outputHeight &= ~1u;
+    if (config_.fps == 0) config_.fps = 30;
+    if (config_.gopSize == 0) config_.gopSize = config_.fps * 2;
+
+    if (config_.width == 0 || config_.height == 0 ||
+        config_.outputWidth == 0 || config_.outputHeight == 0 ||
+        config_.outputWidth > config_.width || config_.outputHeight > config_.height) {
+        return false;
+    }
+
+    HRESULT hr = MFStartup(MF_VERSION);
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"MFStartup failed: 0x%08X", hr);
+        return false;
+    }
+    mfStarted_ = true;
+
+    hr = activate_->ActivateObject(IID_PPV_ARGS(&transform_));
+    if (FAILED(hr)) {
+        LogF(LogLevel::Debug, L"Failed to activate %s: 0x%08X", name_.c_str(), hr);
+        return false;
+    }
+
+    ComPtr<IMFAttributes> attributes;
+    if (SUCCEEDED(transform_->GetAttributes(&attributes))) {
+        UINT32 isAsync = FALSE;
+        if (SUCCEEDED(attributes->GetUINT32(MF_TRANSFORM_ASYNC, &isAsync)) && isAsync) {
+            attributes->SetUINT32(MF_TRANSFORM_ASYNC_UNLOCK, TRUE);
+            async_ = SUCCEEDED(transform_.As(&events_));
+        }
+
+        attributes->SetUINT32(MF_LOW_LATENCY, TRUE);
+
+        UINT32 d3d11Aware = FALSE;
+        attributes->GetUINT32(MF_SA_D3D11_AWARE, &d3d11Aware);
+        useTextures_ = hardware_ && device_ && d3d11Aware;
+    }
+
+    // Hardware encoders are only worth it without a CPU round trip
+    if (hardware_ && !useTextures_) {
+        LogF(LogLevel::Debug, L"%s cannot take D3D11 surfaces", name_.c_str());
+        return false;
+    }
+
+    if (useTextures_) {
+        hr = MFCreateDXGIDeviceManager(&resetToken_, &deviceManager_);
+        if (SUCCEEDED(hr)) {
+            hr = deviceManager_->ResetDevice(device_.Get(), resetToken_);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = transform_->ProcessMessage(MFT_MESSAGE_SET_D3D_MANAGER,
+                                            reinterpret_cast<ULONG_PTR>(deviceManager_.Get()));
+        }
+        if (FAILED(hr)) {
+            LogF(LogLevel::Debug, L"Failed to share the device with %s: 0x%08X", name_.c_str(), hr);
+            return false;
+        }
+    }
+
+    if (SUCCEEDED(transform_.As(&codecApi_))) {
+        SetCodecValue(codecApi_.Get(), CODECAPI_AVEncCommonRateControlMode, eAVEncCommonRateControlMode_CBR);
+        SetCodecValue(codecApi_.Get(), CODECAPI_AVEncCommonMeanBitRate, config_.bitrate);
+        SetCodecValue(codecApi_.Get(), CODECAPI_AVEncMPVGOPSize, config_.gopSize);
+        SetCodecValue(codecApi_.Get(), CODECAPI_AVEncMPVDefaultBPictureCount, 0);
+        SetCodecFlag(codecApi_.Get(), CODECAPI_AVLowLatencyMode, true);
+    }
+
+    if (!ConfigureTypes() || !RefreshOutputInfo()) {
+        return false;
+    }
+
+    if (useTextures_ ? !InitializeVideoProcessor() : !InitializeSystemMemory()) {
+        return false;
+    }
+
+    transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_BEGIN_STREAMING, 0);
+    transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_START_OF_STREAM, 0);
+
+    LogF(LogLevel::Info, L"Video encoder: %s (%s), %ux%u @ %u fps, %u kbps",
+        name_.c_str(), useTextures_ ? L"GPU surfaces" : L"system memory",
+        config_.outputWidth, config_.outputHeight, config_.fps, config_.bitrate / 1000);
+
+    initialized_ = true;
+    return true;
+}
+
+bool MFVideoEncoder::ConfigureTypes() {
+    // Encoders take their output type first
+    ComPtr<IMFMediaType> outputType;
+    HRESULT hr = MFCreateMediaType(&outputType);
+    if (FAILED(hr)) {
+        return false;
+    }
+
+    outputType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+    outputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_H264);
+    outputType->SetUINT32(MF_MT_AVG_BITRATE, config_.bitrate);
+    outputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+    outputType->SetUINT32(MF_MT_MPEG2_PROFILE, eAVEncH264VProfile_Base);
+    MFSetAttributeSize(outputType.Get(), MF_MT_FRAME_SIZE, config_.outputWidth, config_.outputHeight);
+    MFSetAttributeRatio(outputType.Get(), MF_MT_FRAME_RATE, config_.fps, 1);
+    MFSetAttributeRatio(outputType.Get(), MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+
+    hr = transform_->SetOutputType(0, outputType.Get(), 0);
+    if (FAILED(hr)) {
+        LogF(LogLevel::Debug, L"%s rejected the output type: 0x%08X", name_.c_str(), hr);
+        return false;
+    }
+
+    // Take the encoder's own NV12 type, completed with the frame size
+    for (DWORD i = 0; ; i++) {
+        ComPtr<IMFMediaType> inputType;
+        hr = transform_->GetInputAvailableType(0, i, &inputType);
+        if (FAILED(hr)) {
+            break;
+        }
+
+        GUID subtype = GUID_NULL;
+        if (FAILED(inputType->GetGUID(MF_MT_SUBTYPE, &subtype)) || subtype != MFVideoFormat_NV12) {
+            continue;
+        }
+
+        inputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        MFSetAttributeSize(inputType.Get(), MF_MT_FRAME_SIZE, config_.outputWidth, config_.outputHeight);
+        MFSetAttributeRatio(inputType.Get(), MF_MT_FRAME_RATE, config_.fps, 1);
+
+        if (SUCCEEDED(transform_->SetInputType(0, inputType.Get(), 0))) {
+            return true;
+        }
+    }
+
+    LogF(LogLevel::Debug, L"%s has no usable NV12 input type", name_.c_str());
+    return false;
+}
+
+bool MFVideoEncoder::RefreshOutputInfo() {
+    MFT_OUTPUT_STREAM_INFO info = {};
+    HRESULT hr = transform_->GetOutputStreamInfo(0, &info);
+    if (FAILED(hr)) {
+        return false;
+    }
+
+    providesSamples_ = (info.dwFlags & (MFT_OUTPUT_STREAM_PROVIDES_SAMPLES |
+                                        MFT_OUTPUT_STREAM_CAN_PROVIDE_SAMPLES)) != 0;
+    if (providesSamples_) {
+        outputSample_.Reset();
+        outputBuffer_.Reset();
+        return true;
+    }
+
+    // One reused output buffer, large enough for an uncompressed frame
+    DWORD size = std::max<DWORD>(info.cbSize, config_.outputWidth * config_.outputHeight * 3 / 2);
+    outputSample_.Reset();
+    outputBuffer_.Reset();
+    hr = MFCreateSample(&outputSample_);
+    if (SUCCEEDED(hr)) {
+        hr = MFCreateMemoryBuffer(size, &outputBuffer_);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = outputSample_->AddBuffer(outputBuffer_.Get());
+    }
+    return SUCCEEDED(hr);
+}
+
+bool MFVideoEncoder::InitializeVideoProcessor() {
+    device_->GetImmediateContext(&context_);
+
+    HRESULT hr = device_.As(&videoDevice_);
+    if (SUCCEEDED(hr)) {
+        hr = context_.As(&videoContext_);
+    }
+    if (FAILED(hr)) {
+        LOG_ERROR(L"Capture device has no video support");
+        return false;
+    }
+
+    D3D11_VIDEO_PROCESSOR_CONTENT_DESC contentDesc = {};
+    contentDesc.InputFrameFormat = D3D11_VIDEO_FRAME_FORMAT_PROGRESSIVE;
+    contentDesc.InputFrameRate = { config_.fps, 1 };
+    contentDesc.InputWidth = config_.width;
+    contentDesc.InputHeight = config_.height;
+    contentDesc.OutputFrameRate = { config_.fps, 1 };
+    contentDesc.OutputWidth = config_.outputWidth;
+    contentDesc.OutputHeight = config_.outputHeight;
+    contentDesc.Usage = D3D11_VIDEO_USAGE_OPTIMAL_SPEED;
+
+    hr = videoDevice_->CreateVideoProcessorEnumerator(&contentDesc, &processorEnum_);
+    if (SUCCEEDED(hr)) {
+        hr = videoDevice_->CreateVideoProcessor(processorEnum_.Get(), 0, &processor_);
+    }
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"Failed to create video processor: 0x%08X", hr);
+        return false;
+    }
+
+    // Desktop is full-range RGB; the encoder expects BT.709 studio range
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE inputSpace = {};
+    inputSpace.RGB_Range = 0;
+    videoContext_->VideoProcessorSetStreamColorSpace(processor_.Get(), 0, &inputSpace);
+
+    D3D11_VIDEO_PROCESSOR_COLOR_SPACE outputSpace = {};
+    outputSpace.YCbCr_Matrix = 1;
+    outputSpace.Nominal_Range = D3D11_VIDEO_PROCESSOR_NOMINAL_RANGE_16_235;
+    videoContext_->VideoProcessorSetOutputColorSpace(processor_.Get(), &outputSpace);
+
+    D3D11_TEXTURE2D_DESC surfaceDesc = {};
+    surfaceDesc.Width = config_.outputWidth;
+    surfaceDesc.Height = config_.outputHeight;
+    surfaceDesc.MipLevels = 1;
+    surfaceDesc.ArraySize = 1;
+    surfaceDesc.Format = DXGI_FORMAT_NV12;
+    surfaceDesc.SampleDesc.Count = 1;
+    surfaceDesc.Usage = D3D11_USAGE_DEFAULT;
+    surfaceDesc.BindFlags = D3D11_BIND_RENDER_TARGET;
+
+    D3D11_VIDEO_PROCESSOR_OUTPUT_VIEW_DESC viewDesc = {};
+    viewDesc.ViewDimension = D3D11_VPOV_DIMENSION_TEXTURE2D;
+
+    for (uint32_t i = 0; i < kSurfaceCount; i++) {
+        ComPtr<IMFMediaBuffer> buffer;
+        ComPtr<IMF2DBuffer> buffer2d;
+        DWORD length = 0;
+
+        hr = device_->CreateTexture2D(&surfaceDesc, nullptr, &surfaces_[i]);
+        if (SUCCEEDED(hr)) {
+            hr = videoDevice_->CreateVideoProcessorOutputView(
+                surfaces_[i].Get(), processorEnum_.Get(), &viewDesc, &outputViews_[i]);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = MFCreateDXGISurfaceBuffer(__uuidof(ID3D11Texture2D), surfaces_[i].Get(), 0, FALSE, &buffer);
+        }
+        if (SUCCEEDED(hr) && SUCCEEDED(buffer.As(&buffer2d)) &&
+            SUCCEEDED(buffer2d->GetContiguousLength(&length))) {
+            buffer->SetCurrentLength(length);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = MFCreateSample(&surfaceSamples_[i]);
+        }
+        if (SUCCEEDED(hr)) {
+            hr = surfaceSamples_[i]->AddBuffer(buffer.Get());
+        }
+        if (FAILED(hr)) {
+            LogF(LogLevel::Error, L"Failed to create encoder surfaces: 0x%08X", hr);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool MFVideoEncoder::InitializeSystemMemory() {
+    DWORD size = config_.outputWidth * config_.outputHeight * 3 / 2;
+
+    HRESULT hr = MFCreateSample(&inputSample_);
+    if (SUCCEEDED(hr)) {
+        hr = MFCreateMemoryBuffer(size, &inputBuffer_);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = inputBuffer_->SetCurrentLength(size);
+    }
+    if (SUCCEEDED(hr)) {
+        hr = inputSample_->AddBuffer(inputBuffer_.Get());
+    }
+    return SUCCEEDED(hr);
+}
+
+void MFVideoEncoder::Shutdown() {
+    if (transform_) {
+        if (initialized_) {
+            transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_END_OF_STREAM, 0);
+            transform_->ProcessMessage(MFT_MESSAGE_NOTIFY_END_STREAMING, 0);
+        }
+
+        // Async encoders keep a reference to their own event queue
+        ComPtr<IMFShutdown> shutdown;
+        if (SUCCEEDED(transform_.As(&shutdown))) {
+            shutdown->Shutdown();
+        }
+    }
+
+    events_.Reset();
+    codecApi_.Reset();
+    transform_.Reset();
+    if (activate_) {
+        activate_->ShutdownObject();
+        activate_.Reset();
+    }
+    deviceManager_.Reset();
+
+    surfaceSamples_.fill(nullptr);
+    outputViews_.fill(nullptr);
+    surfaces_.fill(nullptr);
+    inputView_.Reset();
+    inputTexture_.Reset();
+    uploadTexture_.Reset();
+    stagingTexture_.Reset();
+    processor_.Reset();
+    processorEnum_.Reset();
+    videoContext_.Reset();
+    videoDevice_.Reset();
+    context_.Reset();
+
+    inputSample_.Reset();
+    inputBuffer_.Reset();
+    outputSample_.Reset();
+    outputBuffer_.Reset();
+
+    if (initialized_ && framesDropped_ > 0) {
+        LogF(LogLevel::Debug, L"%s dropped %llu frames while busy", name_.c_str(), framesDropped_);
+    }
+    initialized_ = false;
+
+    if (mfStarted_) {
+        MFShutdown();
+        mfStarted_ = false;
+    }
+}
+
+//
+// Convert a frame into the next NV12 surface on the GPU
+//
+IMFSample* MFVideoEncoder::PrepareTexture(const FrameData& frame) {
+    ComPtr<ID3D11Texture2D> source = frame.texture;
+
+    if (!source) {
+        // System memory frame: upload it first
+        if (!uploadTexture_) {
+            D3D11_TEXTURE2D_DESC desc = {};
+            desc.Width = frame.width;
+            desc.Height = frame.height;
+            desc.MipLevels = 1;
+            desc.ArraySize = 1;
+            desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+            desc.SampleDesc.Count = 1;
+            desc.Usage = D3D11_USAGE_DEFAULT;
+            desc.BindFlags = D3D11_BIND_SHADER_RESOURCE;
+
+            if (FAILED(device_->CreateTexture2D(&desc, nullptr, &uploadTexture_))) {
+                return nullptr;
+            }
+        }
+
+        context_->UpdateSubresource(uploadTexture_.Get(), 0, nullptr, frame.data.data(), frame.stride, 0);
+        source = uploadTexture_;
+    }
+
+    // Capture reuses its texture, so the view is made once
+    if (source != inputTexture_) {
+        D3D11_VIDEO_PROCESSOR_INPUT_VIEW_DESC viewDesc = {};
+        viewDesc.ViewDimension = D3D11_VPIV_DIMENSION_TEXTURE2D;
+
+        inputView_.Reset();
+        inputTexture_.Reset();
+        HRESULT hr = videoDevice_->CreateVideoProcessorInputView(
+            source.Get(), processorEnum_.Get(), &viewDesc, &inputView_);
+        if (FAILED(hr)) {
+            LogF(LogLevel::Error, L"Failed to create video processor input: 0x%08X", hr);
+            return nullptr;
+        }
+        inputTexture_ = source;
+    }
+
+    RECT sourceRect = { 0, 0, static_cast<LONG>(config_.width), static_cast<LONG>(config_.height) };
+    videoContext_->VideoProcessorSetStreamSourceRect(processor_.Get(), 0, TRUE, &sourceRect);
+
+    D3D11_VIDEO_PROCESSOR_STREAM stream = {};
+    stream.Enable = TRUE;
+    stream.pInputSurface = inputView_.Get();
+
+    uint32_t index = nextSurface_;
+    nextSurface_ = (nextSurface_ + 1) % kSurfaceCount;
+
+    HRESULT hr = videoContext_->VideoProcessorBlt(processor_.Get(), outputViews_[index].Get(), 0, 1, &stream);
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"VideoProcessorBlt failed: 0x%08X", hr);
+        return nullptr;
+    }
+
+    return surfaceSamples_[index].Get();
+}
+
+//
+// Convert a frame into the system memory input sample
+//
+IMFSample* MFVideoEncoder::PrepareSystemMemory(const FrameData& frame) {
+    const uint8_t* pixels = frame.data.data();
+    uint32_t stride = frame.stride;
+    D3D11_MAPPED_SUBRESOURCE mapped = {};
+    ComPtr<ID3D11DeviceContext> context;
+
+    if (frame.texture) {
+        ComPtr<ID3D11Device> device;
+        frame.texture->GetDevice(&device);
+        device->GetImmediateContext(&context);
+
+        if (!stagingTexture_) {
+            D3D11_TEXTURE2D_DESC desc;
+            frame.texture->GetDesc(&desc);
+            desc.Usage = D3D11_USAGE_STAGING;
+            desc.BindFlags = 0;
+            desc.CPUAccessFlags = D3D11_CPU_ACCESS_READ;
+            desc.MiscFlags = 0;
+
+            if (FAILED(device->CreateTexture2D(&desc, nullptr, &stagingTexture_))) {
+                return nullptr;
+            }
+        }
+
+        context->CopyResource(stagingTexture_.Get(), frame.texture.Get());
+        if (FAILED(context->Map(stagingTexture_.Get(), 0, D3D11_MAP_READ, 0, &mapped))) {
+            return nullptr;
+        }
+
+        pixels = static_cast<const uint8_t*>(mapped.pData);
+        stride = mapped.RowPitch;
+    }
+
+    BYTE* dst = nullptr;
+    bool ok = SUCCEEDED(inputBuffer_->Lock(&dst, nullptr, nullptr));
+    if (ok) {
+        ConvertBgraToNv12(pixels, stride, config_.width, config_.height,
+                          dst, config_.outputWidth, config_.outputHeight);
+        inputBuffer_->Unlock();
+    }
+
+    if (frame.texture) {
+        context->Unmap(stagingTexture_.Get(), 0);
+    }
+
+    return ok ? inputSample_.Get() : nullptr;
+}
+
+bool MFVideoEncoder::EncodeFrame(const FrameData& frame) {
+    if (!initialized_) {
+        return false;
+    }
+
+    if (frame.width < config_.width || frame.height < config_.height) {
+        return false;
+    }
+
+    if (!frame.texture && frame.data.size() < static_cast<size_t>(frame.stride) * frame.height) {
+        return false;
+    }
+
+    // An async encoder that has not asked for input is still busy
+    if (async_) {
+        bool gotOutput = false;
+        while (WaitForEvent(false, gotOutput)) {
+        }
+        if (inputRequests_ == 0) {
+            framesDropped_++;
+            return false;
+        }
+    }
+
+    IMFSample* sample = useTextures_ ? PrepareTexture(frame) : PrepareSystemMemory(frame);
+    if (!sample) {
+        return false;
+    }
+
+    return Submit(sample, frame);
+}
+
+bool MFVideoEncoder::SetBitrate(uint32_t bitrate) {
+    // Encoders that support it take the change at the next frame
+    if (!initialized_ || !SetCodecValue(codecApi_.Get(), CODECAPI_AVEncCommonMeanBitRate, bitrate)) {
+        return false;
+    }
+
+    config_.bitrate = bitrate;
+    return true;
+}
+
+bool MFVideoEncoder::Submit(IMFSample* sample, const FrameData& frame) {
+    // Sample times must increase
+    LONGLONG sampleTime = static_cast<LONGLONG>(frame.timestamp) * kTicksPerMs;
+    if (sampleTime <= lastSampleTime_) {
+        sampleTime = lastSampleTime_ + 1;
+    }
+    lastSampleTime_ = sampleTime;
+
+    sample->SetSampleTime(sampleTime);
+    sample->SetSampleDuration(10000000 / config_.fps);
+
+    if (forceKeyFrame_.exchange(false)) {
+        SetCodecValue(codecApi_.Get(), CODECAPI_AVEncVideoForceKeyFrame, 1);
+    }
+
+    HRESULT hr = transform_->ProcessInput(0, sample, 0);
+
+    if (hr == MF_E_NOTACCEPTING && !async_) {
+        DrainOutput();
+        hr = transform_->ProcessInput(0, sample, 0);
+    }
+
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"%s ProcessInput failed: 0x%08X", name_.c_str(), hr);
+        return false;
+    }
+
+    if (!async_) {
+        return DrainOutput();
+    }
+
+    // Wait for this frame's output or the next input request, then
+    // take whatever else is already queued
+    inputRequests_--;
+    bool gotOutput = false;
+    if (!WaitForEvent(true, gotOutput)) {
+        return false;
+    }
+    while (WaitForEvent(false, gotOutput)) {
+    }
+
+    return true;
+}
+
+//
+// Handle one event of an async encoder; false when none was queued
+//
+bool MFVideoEncoder::WaitForEvent(bool block, bool& gotOutput) {
+    ComPtr<IMFMediaEvent> event;
+    HRESULT hr = events_->GetEvent(block ? 0 : MF_EVENT_FLAG_NO_WAIT, &event);
+    if (FAILED(hr)) {
+        if (hr != MF_E_NO_EVENTS_AVAILABLE) {
+            LogF(LogLevel::Error, L"%s GetEvent failed: 0x%08X", name_.c_str(), hr);
+        }
+        return false;
+    }
+
+    MediaEventType type = MEUnknown;
+    event->GetType(&type);
+
+    switch (type) {
+        case METransformNeedInput:
+            inputRequests_++;
+            break;
+
+        case METransformHaveOutput:
+            ProcessOneOutput();
+            gotOutput = true;
+            break;
+
+        default:
+            break;
+    }
+
+    return true;
+}
+
+bool MFVideoEncoder::DrainOutput() {
+    HRESULT hr;
+    while (SUCCEEDED(hr = ProcessOneOutput())) {
+    }
+    return hr == MF_E_TRANSFORM_NEED_MORE_INPUT;
+}
+
+HRESULT MFVideoEncoder::ProcessOneOutput() {
+    MFT_OUTPUT_DATA_BUFFER output = {};
+    output.dwStreamID = 0;
+    output.pSample = providesSamples_ ? nullptr : outputSample_.Get();
+
+    DWORD status = 0;
+    HRESULT hr = transform_->ProcessOutput(0, 1, &output, &status);
+
+    if (output.pEvents) {
+        output.pEvents->Release();
+    }
+
+    if (hr == MF_E_TRANSFORM_STREAM_CHANGE) {
+        // The encoder settled its output format; take it as offered
+        ComPtr<IMFMediaType> type;
+        hr = transform_->GetOutputAvailableType(0, 0, &type);
+        if (SUCCEEDED(hr)) {
+            hr = transform_->SetOutputType(0, type.Get(), 0);
+        }
+        if (SUCCEEDED(hr) && !RefreshOutputInfo()) {
+            hr = E_FAIL;
+        }
+        return hr;
+    }
+
+    if (FAILED(hr)) {
+        if (output.pSample && providesSamples_) {
+            output.pSample->Release();
+        }
+        return hr;
+    }
+
+    if (output.pSample) {
+        DeliverSample(output.pSample);
+        if (providesSamples_) {
+            output.pSample->Release();
+        }
+    }
+
+    return S_OK;
+}
+
+void MFVideoEncoder::DeliverSample(IMFSample* sample) {
+    ComPtr<IMFMediaBuffer> buffer;
+    if (FAILED(sample->ConvertToContiguousBuffer(&buffer))) {
+        return;
+    }
+
+    BYTE* data = nullptr;
+    DWORD length = 0;
+    if (SUCCEEDED(buffer->Lock(&data, nullptr, &length))) {
+        LONGLONG sampleTime = 0;
+        sample->GetSampleTime(&sampleTime);
+
+        EncodedPacket packet;
+        packet.data = std::span<const uint8_t>(data, length);
+        packet.timestamp = static_cast<uint64_t>(sampleTime / kTicksPerMs);
+        packet.keyFrame = MFGetAttributeUINT32(sample, MFSampleExtension_CleanPoint, FALSE) != 0;
+
+        if (packetCallback_ && length > 0) {
+            packetCallback_(packet);
+        }
+
+        buffer->Unlock();
+    }
+
+    // Our own output buffer is reused for the next packet
+    if (!providesSamples_) {
+        buffer->SetCurrentLength(0);
+    }
+}
+
+//
+// Encoder factory
+//
+namespace {
+
+std::unique_ptr<VideoEncoder> OpenFirstEncoder(UINT32 flags, IMFAttributes* filter, ID3D11Device* device,
+                                               bool hardware, const VideoEncoderConfig& config) {
+    MFT_REGISTER_TYPE_INFO inputInfo = { MFMediaType_Video, MFVideoFormat_NV12 };
+    MFT_REGISTER_TYPE_INFO outputInfo = { MFMediaType_Video, MFVideoFormat_H264 };
+    IMFActivate** activates = nullptr;
+    UINT32 count = 0;
+    std::unique_ptr<VideoEncoder> encoder;
+
+    HRESULT hr = MFTEnum2(MFT_CATEGORY_VIDEO_ENCODER, flags, &inputInfo, &outputInfo,
+                          filter, &activates, &count);
+    if (FAILED(hr)) {
+        return nullptr;
+    }
+
+    for (UINT32 i = 0; i < count; i++) {
+        if (!encoder) {
+            auto candidate = std::make_unique<MFVideoEncoder>(activates[i], device, hardware);
+            if (candidate->Initialize(config)) {
+                encoder = std::move(candidate);
+            }
+        }
+        activates[i]->Release();
+    }
+
+    CoTaskMemFree(activates);
+    return encoder;
+}
+
+} // namespace
+
+std::unique_ptr<VideoEncoder> CreateVideoEncoder(ID3D11Device* device, const VideoEncoderConfig& config) {
+    HRESULT hr = MFStartup(MF_VERSION);
+    if (FAILED(hr)) {
+        LogF(LogLevel::Error, L"MFStartup failed: 0x%08X", hr);
+        return nullptr;
+    }
+
+    std::unique_ptr<VideoEncoder> encoder;
+
+    if (config.allowHardware && device) {
+        // Only encoders on the capture adapter can share its textures
+        ComPtr<IDXGIDevice> dxgiDevice;
+        ComPtr<IDXGIAdapter> adapter;
+        ComPtr<IMFAttributes> filter;
+        DXGI_ADAPTER_DESC adapterDesc;
+
+        if (SUCCEEDED(device->QueryInterface(IID_PPV_ARGS(&dxgiDevice))) &&
+            SUCCEEDED(dxgiDevice->GetAdapter(&adapter)) &&
+            SUCCEEDED(adapter->GetDesc(&adapterDesc)) &&
+            SUCCEEDED(MFCreateAttributes(&filter, 1)) &&
+            SUCCEEDED(filter->SetBlob(MFT_ENUM_ADAPTER_LUID,
+                                      reinterpret_cast<const UINT8*>(&adapterDesc.AdapterLuid),
+                                      sizeof(adapterDesc.AdapterLuid)))) {
+            encoder = OpenFirstEncoder(MFT_ENUM_FLAG_HARDWARE | MFT_ENUM_FLAG_SORTANDFILTER,
+                                       filter.Get(), device, true, config);
+        }
+    }
+
+    if (!encoder) {
+        encoder = OpenFirstEncoder(MFT_ENUM_FLAG_SYNCMFT | MFT_ENUM_FLAG_LOCALMFT | MFT_ENUM_FLAG_SORTANDFILTER,
+                                   nullptr, device, false, config);
+    }
+
+    if (!encoder) {
+        LOG_ERROR(L"No H.264 encoder available");
+    }
+
+    MFShutdown();
+    return encoder;
+}
+
+} // namespace zixiao::vdi
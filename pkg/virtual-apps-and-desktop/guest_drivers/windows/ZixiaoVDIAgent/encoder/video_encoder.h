@@ -0,0 +1,76 @@
+/*
+ * Zixiao VDI Agent - Video Encoder
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "../src/common.h"
+
+namespace zixiao::vdi {
+
+//
+// One encoded H.264 access unit, Annex B; valid during the callback
+//
+struct EncodedPacket {
+    std::span<const uint8_t> data;
+    uint64_t timestamp = 0;     // of the frame, in ms
+    bool keyFrame = false;
+};
+
+using PacketCallback = std::function<void(const EncodedPacket&)>;
+
+//
+// Video encoder configuration
+//
+struct VideoEncoderConfig {
+    uint32_t width = 0;         // of the captured frames
+    uint32_t height = 0;
+    uint32_t outputWidth = 0;   // encoded size; 0 for the captured size
+    uint32_t outputHeight = 0;
+    uint32_t fps = 30;
+    uint32_t bitrate = 4000000;
+    uint32_t gopSize = 0;       // frames between key frames; 0 for 2 s
+    bool allowHardware = true;
+};
+
+//
+// H.264 encoder interface
+//
+// Frames carry either a texture on the encoder's device or BGRA system
+// memory. Packets go to the callback before EncodeFrame returns.
+//
+class VideoEncoder {
+public:
+    virtual ~VideoEncoder() = default;
+
+    virtual bool Initialize(const VideoEncoderConfig& config) = 0;
+    virtual void Shutdown() = 0;
+
+    virtual bool EncodeFrame(const FrameData& frame) = 0;
+
+    // Change the target bitrate from the next frame; false when the
+    // encoder cannot while open, and must be created again
+    virtual bool SetBitrate(uint32_t bitrate) = 0;
+
+    virtual const std::wstring& GetName() const = 0;
+    virtual bool IsHardware() const = 0;
+
+    void SetPacketCallback(PacketCallback callback) { packetCallback_ = std::move(callback); }
+    void ForceKeyFrame() { forceKeyFrame_.store(true); }
+
+protected:
+    PacketCallback packetCallback_;
+    std::atomic<bool> forceKeyFrame_{false};
+};
+
+//
+// Best encoder available: a hardware Media Foundation encoder on the
+// device's adapter (the NVENC, Quick Sync or AMF MFT), else the
+// Microsoft software encoder. nullptr when none could be opened.
+//
+std::unique_ptr<VideoEncoder> CreateVideoEncoder(ID3D11Device* device, const VideoEncoderConfig& config);
+
+} // namespace zixiao::vdi
@@ -7,8 +7,19 @@
 
 #include "input_handler.h"
 
+#include <array>
+
 namespace zixiao::vdi {
 
+namespace {
+
+uint64_t NowUs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+} // namespace
+
 InputHandler::InputHandler() = default;
 
 InputHandler::~InputHandler() {
@@ -24,6 +35,9 @@ bool InputHandler::Initialize() {
 
     LogF(LogLevel::Info, L"Screen size: %ux%u", screenWidth_, screenHeight_);
 
+    stopFlush_ = false;
+    flushThread_ = std::thread(&InputHandler::FlushThread, this);
+
     initialized_ = true;
     LOG_INFO(L"Input handler initialized");
     return true;
@@ -31,9 +45,94 @@ bool InputHandler::Initialize() {
 
 void InputHandler::Shutdown() {
     initialized_ = false;
+
+    if (flushThread_.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopFlush_ = true;
+        }
+        cv_.notify_one();
+        flushThread_.join();
+
+        LogF(LogLevel::Info, L"Input: %llu moves in %llu SendInput calls",
+             moves_, sendCalls_);
+    }
+
     LOG_INFO(L"Input handler shutdown");
 }
 
+void InputHandler::SetBatchInterval(uint32_t intervalUs) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        batchIntervalUs_ = intervalUs;
+    }
+    cv_.notify_one();
+}
+
+void InputHandler::FlushThread() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (!stopFlush_) {
+        if (!absPending_ && !relPending_) {
+            cv_.wait(lock);
+            continue;
+        }
+
+        uint64_t now = NowUs();
+        uint64_t deadline = lastMotionUs_ + batchIntervalUs_;
+        if (now < deadline) {
+            cv_.wait_for(lock, std::chrono::microseconds(deadline - now));
+            continue;
+        }
+
+        lastMotionUs_ = now;
+        SendLocked(nullptr, 0);
+    }
+}
+
+// Sends pending motion followed by the given inputs in one call
+bool InputHandler::SendLocked(const INPUT* extra, UINT count) {
+    std::array<INPUT, kMaxBatch> batch{};
+    UINT n = 0;
+
+    if (absPending_) {
+        INPUT& input = batch[n++];
+        input.type = INPUT_MOUSE;
+        input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_ABSOLUTE;
+
+        // Convert to absolute coordinates (0-65535 range)
+        if (screenWidth_ > 0 && screenHeight_ > 0) {
+            input.mi.dx = MulDiv(absX_, 65535, screenWidth_ - 1);
+            input.mi.dy = MulDiv(absY_, 65535, screenHeight_ - 1);
+        } else {
+            input.mi.dx = absX_;
+            input.mi.dy = absY_;
+        }
+        absPending_ = false;
+    }
+
+    if (relPending_) {
+        INPUT& input = batch[n++];
+        input.type = INPUT_MOUSE;
+        input.mi.dwFlags = MOUSEEVENTF_MOVE;
+        input.mi.dx = relX_;
+        input.mi.dy = relY_;
+        relX_ = relY_ = 0;
+        relPending_ = false;
+    }
+
+    for (UINT i = 0; i < count && n < kMaxBatch; i++) {
+        batch[n++] = extra[i];
+    }
+
+    if (n == 0) return true;
+
+    UINT sent = SendInput(n, batch.data(), sizeof(INPUT));
+    lastInjectUs_.store(NowUs(), std::memory_order_release);
+    sendCalls_++;
+    return sent == n;
+}
+
 bool InputHandler::InjectInput(const InputEvent& event) {
     switch (event.type) {
         case InputEventType::MouseMove:
@@ -58,28 +157,29 @@ bool InputHandler::InjectInput(const InputEvent& event) {
 }
 
 bool InputHandler::InjectMouseMove(int32_t x, int32_t y, bool absolute) {
-    INPUT input = {};
-    input.type = INPUT_MOUSE;
-    input.mi.dwFlags = MOUSEEVENTF_MOVE;
+    std::lock_guard<std::mutex> lock(mutex_);
 
+    // Only the latest position matters; relative deltas add up
     if (absolute) {
-        input.mi.dwFlags |= MOUSEEVENTF_ABSOLUTE;
-
-        // Convert to absolute coordinates (0-65535 range)
-        if (screenWidth_ > 0 && screenHeight_ > 0) {
-            input.mi.dx = MulDiv(x, 65535, screenWidth_ - 1);
-            input.mi.dy = MulDiv(y, 65535, screenHeight_ - 1);
-        } else {
-            input.mi.dx = x;
-            input.mi.dy = y;
-        }
+        absX_ = x;
+        absY_ = y;
+        absPending_ = true;
     } else {
-        input.mi.dx = x;
-        input.mi.dy = y;
+        relX_ += x;
+        relY_ += y;
+        relPending_ = true;
     }
+    moves_++;
 
-    UINT sent = SendInput(1, &input, sizeof(INPUT));
-    return sent == 1;
+    // Leading edge: a move after a quiet interval is not held back
+    uint64_t now = NowUs();
+    if (now - lastMotionUs_ >= batchIntervalUs_) {
+        lastMotionUs_ = now;
+        return SendLocked(nullptr, 0);
+    }
+
+    cv_.notify_one();
+    return true;
 }
 
 bool InputHandler::InjectMouseButton(uint32_t button, bool pressed) {
@@ -113,8 +213,8 @@ bool InputHandler::InjectMouseButton(uint32_t button, bool pressed) {
             return false;
     }
 
-    UINT sent = SendInput(1, &input, sizeof(INPUT));
-    return sent == 1;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return SendLocked(&input, 1);
 }
 
 bool InputHandler::InjectMouseWheel(int32_t delta) {
@@ -123,8 +223,8 @@ bool InputHandler::InjectMouseWheel(int32_t delta) {
     input.mi.dwFlags = MOUSEEVENTF_WHEEL;
     input.mi.mouseData = static_cast<DWORD>(delta);
 
-    UINT sent = SendInput(1, &input, sizeof(INPUT));
-    return sent == 1;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return SendLocked(&input, 1);
 }
 
 bool InputHandler::InjectKeyboard(uint32_t scanCode, uint32_t virtualKey, bool pressed, bool extended) {
@@ -157,8 +257,8 @@ bool InputHandler::InjectKeyboard(uint32_t scanCode, uint32_t virtualKey, bool p
         return false;
     }
 
-    UINT sent = SendInput(1, &input, sizeof(INPUT));
-    return sent == 1;
+    std::lock_guard<std::mutex> lock(mutex_);
+    return SendLocked(&input, 1);
 }
 
 void InputHandler::SetScreenSize(uint32_t width, uint32_t height) {
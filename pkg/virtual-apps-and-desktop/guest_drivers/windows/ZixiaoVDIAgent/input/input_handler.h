@@ -14,6 +14,12 @@ namespace zixiao::vdi {
 //
 // Input injection using SendInput API
 //
+// Mouse motion is coalesced: the first move after a quiet interval goes
+// out at once, later ones within the interval collapse into a single
+// position (absolute) or sum (relative) sent when it ends. Buttons,
+// wheel and keys are never delayed and carry any pending motion ahead
+// of them in the same SendInput call.
+//
 class InputHandler : public ISubsystem {
 public:
     InputHandler();
@@ -36,9 +42,38 @@ public:
     void SetScreenSize(uint32_t width, uint32_t height);
     void ConvertToAbsolute(int32_t& x, int32_t& y) const;
 
+    // Motion coalescing window, normally one frame; 0 sends every move
+    void SetBatchInterval(uint32_t intervalUs);
+
+    // Steady-clock microseconds of the last SendInput, 0 before any
+    uint64_t GetLastInjectUs() const { return lastInjectUs_.load(std::memory_order_acquire); }
+
 private:
+    static constexpr size_t kMaxBatch = 4;
+
+    void FlushThread();
+    bool SendLocked(const INPUT* extra, UINT count);
+
     bool initialized_ = false;
 
+    // Pending motion, under mutex_
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::thread flushThread_;
+    bool stopFlush_ = false;
+    uint32_t batchIntervalUs_ = 1000000 / 30;
+    uint64_t lastMotionUs_ = 0;
+    bool absPending_ = false;
+    int32_t absX_ = 0;
+    int32_t absY_ = 0;
+    bool relPending_ = false;
+    int32_t relX_ = 0;
+    int32_t relY_ = 0;
+
+    std::atomic<uint64_t> lastInjectUs_{0};
+    uint64_t moves_ = 0;
+    uint64_t sendCalls_ = 0;
+
     // Screen dimensions for absolute positioning
     uint32_t screenWidth_ = 0;
     uint32_t screenHeight_ = 0;
@@ -12,6 +12,8 @@
 
 #include <windows.h>
 #include <winsvc.h>
+#include <d3d11.h>
+#include <wrl/client.h>
 #include <string>
 #include <memory>
 #include <functional>
@@ -74,6 +76,14 @@ struct FrameData {
     uint32_t stride = 0;
     uint64_t timestamp = 0;
     bool keyFrame = false;
+
+    // GPU frames: a BGRA texture on the capture device instead of data,
+    // valid until the callback returns
+    Microsoft::WRL::ComPtr<ID3D11Texture2D> texture;
+
+    // Areas changed since the previous frame; empty means all of it.
+    // Valid until the callback returns
+    std::span<const RECT> dirtyRects;
 };
 
 //
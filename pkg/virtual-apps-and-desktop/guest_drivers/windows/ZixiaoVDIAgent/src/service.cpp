@@ -13,6 +13,7 @@
 #include "../spice/spice_agent.h"
 #include "../webrtc/webrtc_agent.h"
 
+#include <algorithm>
 #include <iostream>
 #include <fstream>
 #include <cstdarg>
@@ -148,6 +149,7 @@ bool VDIService::InitializeSubsystems() {
     // Create WebRTC agent if enabled
     if (webrtcEnabled_) {
         webrtcAgent_ = std::make_unique<WebRTCAgent>();
+        webrtcAgent_->SetD3DDevice(displayCapture_->GetDevice());
         if (!webrtcAgent_->Initialize()) {
             LOG_WARNING(L"Failed to initialize WebRTC agent");
             webrtcAgent_.reset();
@@ -158,6 +160,7 @@ bool VDIService::InitializeSubsystems() {
     if (spiceAgent_) {
         // Display frames go to SPICE
         displayCapture_->SetFrameCallback([this](const FrameData& frame) {
+            ProbeInputLatency(frame);
             if (spiceAgent_) spiceAgent_->SendFrame(frame);
         });
 
@@ -175,8 +178,10 @@ bool VDIService::InitializeSubsystems() {
     }
 
     if (webrtcAgent_) {
-        // Display frames go to WebRTC
+        // Display frames go to WebRTC, as textures for the encoder
+        displayCapture_->SetGpuFrames(true);
         displayCapture_->SetFrameCallback([this](const FrameData& frame) {
+            ProbeInputLatency(frame);
             if (webrtcAgent_) webrtcAgent_->SendFrame(frame);
         });
 
@@ -187,6 +192,14 @@ bool VDIService::InitializeSubsystems() {
             });
         }
 
+        // Capture rate follows the congestion controller
+        webrtcAgent_->SetFpsCallback([this](uint32_t fps) {
+            if (displayCapture_) displayCapture_->SetTargetFps(fps);
+
+            // Motion finer than a frame would not show
+            if (inputHandler_ && fps > 0) inputHandler_->SetBatchInterval(1000000 / fps);
+        });
+
         // Input from WebRTC
         webrtcAgent_->SetInputCallback([this](const InputEvent& event) {
             if (inputHandler_) inputHandler_->InjectInput(event);
@@ -199,6 +212,11 @@ bool VDIService::InitializeSubsystems() {
 void VDIService::ShutdownSubsystems() {
     LOG_INFO(L"Shutting down subsystems...");
 
+    // No more frames into the agents while they shut down
+    if (displayCapture_) {
+        displayCapture_->Stop();
+    }
+
     if (webrtcAgent_) {
         webrtcAgent_->Shutdown();
         webrtcAgent_.reset();
@@ -229,9 +247,49 @@ void VDIService::ShutdownSubsystems() {
         displayCapture_.reset();
     }
 
+    InputLatencyStats latency = GetInputLatency();
+    if (latency.samples > 0) {
+        LogF(LogLevel::Info, L"Input-to-display latency: avg %.1f ms, max %.1f ms over %llu samples",
+             latency.avgUs / 1000.0, latency.maxUs / 1000.0, latency.samples);
+    }
+
     LOG_INFO(L"Subsystems shutdown complete");
 }
 
+//
+// The first frame with damage after input went in closes one latency
+// sample. Full frames carry no damage list and are skipped; others that
+// change the screen at the same time make the sample optimistic.
+// Runs on the capture thread.
+//
+void VDIService::ProbeInputLatency(const FrameData& frame) {
+    // Changes this long after the last input are not its doing
+    constexpr uint64_t kMaxLatencyUs = 1000000;
+
+    if (!inputHandler_ || frame.keyFrame || frame.dirtyRects.empty()) return;
+
+    uint64_t injected = inputHandler_->GetLastInjectUs();
+    if (injected <= probeInjectUs_) return;
+
+    uint64_t now = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+    probeInjectUs_ = injected;
+    if (now <= injected || now - injected >= kMaxLatencyUs) return;
+
+    uint32_t sample = static_cast<uint32_t>(now - injected);
+
+    std::lock_guard<std::mutex> lock(latencyMutex_);
+    latency_.lastUs = sample;
+    latency_.avgUs = latency_.samples ? latency_.avgUs - latency_.avgUs / 8 + sample / 8 : sample;
+    latency_.maxUs = std::max(latency_.maxUs, sample);
+    latency_.samples++;
+}
+
+InputLatencyStats VDIService::GetInputLatency() {
+    std::lock_guard<std::mutex> lock(latencyMutex_);
+    return latency_;
+}
+
 void VDIService::Run() {
     running_.store(true);
     SetServiceStatus(SERVICE_RUNNING);
@@ -21,6 +21,17 @@ class ClipboardManager;
 class SpiceAgent;
 class WebRTCAgent;
 
+//
+// Input-to-display latency: from SendInput to the first changed frame
+// captured after it
+//
+struct InputLatencyStats {
+    uint64_t samples = 0;
+    uint32_t lastUs = 0;
+    uint32_t avgUs = 0;                 // moving average over about 8 samples
+    uint32_t maxUs = 0;
+};
+
 //
 // VDI Agent Service
 //
@@ -52,6 +63,9 @@ public:
     void SetSpiceEnabled(bool enabled) { spiceEnabled_ = enabled; }
     void SetWebRTCEnabled(bool enabled) { webrtcEnabled_ = enabled; }
 
+    // Input-to-display latency on this side of the network
+    InputLatencyStats GetInputLatency();
+
 private:
     VDIService();
     ~VDIService();
@@ -62,6 +76,7 @@ private:
     bool InitializeSubsystems();
     void ShutdownSubsystems();
     void MainLoop();
+    void ProbeInputLatency(const FrameData& frame);
 
     // Service status
     SERVICE_STATUS_HANDLE statusHandle_ = nullptr;
@@ -81,6 +96,11 @@ private:
     std::unique_ptr<SpiceAgent> spiceAgent_;
     std::unique_ptr<WebRTCAgent> webrtcAgent_;
 
+    // Input-to-display latency probe
+    std::mutex latencyMutex_;
+    uint64_t probeInjectUs_ = 0;        // input already matched to a frame
+    InputLatencyStats latency_;
+
     // Events
     ScopedHandle stopEvent_;
 };
@@ -0,0 +1,476 @@
+/*
+ * Zixiao VDI Agent - Congestion Controller Implementation
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * The delay-based estimate groups packets by send time, compares the
+ * spacing of groups on arrival to their spacing on departure, and fits
+ * a trendline to the accumulated variation. A rising trend past an
+ * adaptive threshold means a queue is building: the rate drops to 85%
+ * of what was delivered. Otherwise it grows, by 8% a second, or by a
+ * packet per round trip close to the last point of congestion.
+ * Queueing delay over the lowest delay seen backs off as well, so
+ * interactive latency stays within budget on links with deep buffers.
+ *
+ * The loss-based estimate cuts above 10% loss and grows below 2%. The
+ * target is spent on frame rate first and then on resolution.
+ */
+
+#include "congestion_controller.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace zixiao::vdi {
+
+namespace {
+
+// Packet statuses taken from one feedback packet
+constexpr size_t kMaxFeedback = 2048;
+
+// Feedback packet status symbols and time units
+constexpr uint8_t kStatusNotReceived = 0;
+constexpr uint8_t kStatusSmallDelta = 1;
+constexpr uint8_t kStatusLargeDelta = 2;
+constexpr int64_t kReferenceTimeUs = 64000;
+constexpr int64_t kDeltaUs = 250;
+
+// Packets sent within this span form one group
+constexpr uint64_t kGroupUs = 5000;
+
+// Trendline estimator
+constexpr double kTrendSmoothing = 0.9;
+constexpr double kTrendGain = 4.0;
+constexpr int kTrendMaxDeltas = 60;
+
+// Adaptive overuse threshold, in ms
+constexpr double kThresholdInit = 12.5;
+constexpr double kThresholdMin = 6.0;
+constexpr double kThresholdMax = 600.0;
+constexpr double kThresholdKUp = 0.0087;
+constexpr double kThresholdKDown = 0.039;
+constexpr double kOveruseTimeMs = 10.0;
+
+// Queueing left to the network out of a 100 ms interactive budget,
+// once capture, encoding and decoding have had theirs
+constexpr int64_t kQueueLimitUs = 50000;
+
+// Lowest one-way delay is kept per window, to follow clock drift
+constexpr uint64_t kBaseDelayWindowUs = 10000000;
+
+// Delivered rate measurement
+constexpr int64_t kAckedWindowUs = 500000;
+
+// Rate control
+constexpr double kDecreaseFactor = 0.85;
+constexpr double kIncreasePerSecond = 0.08;
+constexpr double kPacketBits = 1200 * 8;
+constexpr uint32_t kMinRttMs = 100;
+
+// Bits per pixel a frame needs before frame rate or size give way
+constexpr double kBitsPerPixel = 0.04;
+
+// Resolution steps, in percent
+constexpr uint32_t kScales[] = { 100, 75, 50 };
+
+uint16_t ReadU16(const uint8_t* p) {
+    return static_cast<uint16_t>((p[0] << 8) | p[1]);
+}
+
+} // namespace
+
+CongestionController::CongestionController(const CongestionControllerConfig& config)
+    : config_(config), thresholdMs_(kThresholdInit) {
+    if (config_.maxBitrate < config_.minBitrate) config_.maxBitrate = config_.minBitrate;
+    if (config_.maxFps == 0) config_.maxFps = 30;
+    if (config_.minFps == 0 || config_.minFps > config_.maxFps) {
+        config_.minFps = std::min<uint32_t>(config_.maxFps, 15);
+    }
+
+    baseDelayUs_.fill(std::numeric_limits<int64_t>::max());
+    delayBitrate_ = ClampBitrate(config_.startBitrate);
+    lossBitrate_ = delayBitrate_;
+}
+
+uint32_t CongestionController::ClampBitrate(double rate) const {
+    return static_cast<uint32_t>(std::clamp(rate, static_cast<double>(config_.minBitrate),
+                                            static_cast<double>(config_.maxBitrate)));
+}
+
+// Interval between decreases: long enough to see the last one work
+uint64_t CongestionController::ResponseTimeUs() const {
+    return static_cast<uint64_t>(std::max(rttMs_, kMinRttMs)) * 1000;
+}
+
+void CongestionController::OnPacketSent(uint16_t seq, size_t size, uint64_t sendTimeUs) {
+    std::lock_guard lock(mutex_);
+
+    SentPacket& sent = history_[seq % kHistorySize];
+    sent.seq = seq;
+    sent.size = static_cast<uint32_t>(size);
+    sent.sendTimeUs = sendTimeUs;
+    sent.valid = true;
+}
+
+//
+// Least-squares slope of smoothed delay over arrival time
+//
+double CongestionController::TrendlineSlope() const {
+    double meanX = 0, meanY = 0;
+    for (size_t i = 0; i < trendCount_; i++) {
+        meanX += trendX_[i];
+        meanY += trendY_[i];
+    }
+    meanX /= trendCount_;
+    meanY /= trendCount_;
+
+    double num = 0, den = 0;
+    for (size_t i = 0; i < trendCount_; i++) {
+        double dx = trendX_[i] - meanX;
+        num += dx * (trendY_[i] - meanY);
+        den += dx * dx;
+    }
+
+    return den != 0 ? num / den : prevTrend_;
+}
+
+void CongestionController::UpdateThreshold(double modifiedTrend, int64_t nowMs) {
+    double magnitude = std::abs(modifiedTrend);
+
+    if (!lastThresholdMs_) {
+        lastThresholdMs_ = nowMs;
+    }
+
+    // Spikes, such as a route change, are not followed
+    if (magnitude > thresholdMs_ + 15.0) {
+        lastThresholdMs_ = nowMs;
+        return;
+    }
+
+    double k = magnitude < thresholdMs_ ? kThresholdKDown : kThresholdKUp;
+    int64_t elapsed = std::clamp<int64_t>(nowMs - *lastThresholdMs_, 0, 100);
+
+    thresholdMs_ += k * (magnitude - thresholdMs_) * static_cast<double>(elapsed);
+    thresholdMs_ = std::clamp(thresholdMs_, kThresholdMin, kThresholdMax);
+    lastThresholdMs_ = nowMs;
+}
+
+void CongestionController::DetectOveruse(double trend, double tsDeltaMs, int64_t nowMs) {
+    double modified = std::min(numDeltas_, kTrendMaxDeltas) * trend * kTrendGain;
+
+    if (modified > thresholdMs_) {
+        if (timeOverUsingMs_ < 0) {
+            timeOverUsingMs_ = tsDeltaMs / 2;
+        } else {
+            timeOverUsingMs_ += tsDeltaMs;
+        }
+        overuseCount_++;
+
+        // Sustained and still rising before it counts
+        if (timeOverUsingMs_ > kOveruseTimeMs && overuseCount_ > 1 && trend >= prevTrend_) {
+            timeOverUsingMs_ = 0;
+            overuseCount_ = 0;
+            usage_ = BandwidthUsage::Overusing;
+        }
+    } else if (modified < -thresholdMs_) {
+        timeOverUsingMs_ = -1;
+        overuseCount_ = 0;
+        usage_ = BandwidthUsage::Underusing;
+    } else {
+        timeOverUsingMs_ = -1;
+        overuseCount_ = 0;
+        usage_ = BandwidthUsage::Normal;
+    }
+
+    prevTrend_ = trend;
+    UpdateThreshold(modified, nowMs);
+}
+
+void CongestionController::UpdateTrendline(double delayDeltaMs, double arrivalDeltaMs, int64_t arrivalUs) {
+    if (!firstArrivalUs_) {
+        firstArrivalUs_ = arrivalUs;
+    }
+
+    numDeltas_ = std::min(numDeltas_ + 1, kTrendMaxDeltas);
+
+    accDelayMs_ += delayDeltaMs;
+    smoothedDelayMs_ = kTrendSmoothing * smoothedDelayMs_ + (1 - kTrendSmoothing) * accDelayMs_;
+
+    trendX_[trendPos_] = static_cast<double>(arrivalUs - *firstArrivalUs_) / 1000.0;
+    trendY_[trendPos_] = smoothedDelayMs_;
+    trendPos_ = (trendPos_ + 1) % kTrendWindow;
+    trendCount_ = std::min(trendCount_ + 1, kTrendWindow);
+
+    double trend = trendCount_ == kTrendWindow ? TrendlineSlope() : prevTrend_;
+    DetectOveruse(trend, arrivalDeltaMs, arrivalUs / 1000);
+}
+
+void CongestionController::OnPacketArrival(const SentPacket& sent, int64_t arrivalUs, uint64_t nowUs) {
+    // Delivered rate
+    if (!ackedWindowStartUs_) {
+        ackedWindowStartUs_ = arrivalUs;
+    }
+    ackedBytes_ += sent.size;
+
+    int64_t window = arrivalUs - *ackedWindowStartUs_;
+    if (window >= kAckedWindowUs) {
+        auto rate = static_cast<uint32_t>(ackedBytes_ * 8 * 1000000 / static_cast<uint64_t>(window));
+        ackedBitrate_ = ackedBitrate_ ? (ackedBitrate_ * 3 + rate) / 4 : rate;
+        ackedWindowStartUs_ = arrivalUs;
+        ackedBytes_ = 0;
+    }
+
+    // Queueing: one-way delay over the lowest seen; the clocks differ,
+    // but only the difference is used
+    if (nowUs - baseWindowStartUs_ >= kBaseDelayWindowUs) {
+        baseDelayUs_[1] = baseDelayUs_[0];
+        baseDelayUs_[0] = std::numeric_limits<int64_t>::max();
+        baseWindowStartUs_ = nowUs;
+    }
+
+    int64_t offset = arrivalUs - static_cast<int64_t>(sent.sendTimeUs);
+    baseDelayUs_[0] = std::min(baseDelayUs_[0], offset);
+    queueDelayUs_ = offset - std::min(baseDelayUs_[0], baseDelayUs_[1]);
+
+    // Inter-group delay variation
+    if (!current_.valid) {
+        current_ = { sent.sendTimeUs, sent.sendTimeUs, arrivalUs, true };
+        return;
+    }
+
+    // Reordered behind the group already being built
+    if (sent.sendTimeUs < current_.firstSendUs) {
+        return;
+    }
+
+    if (sent.sendTimeUs - current_.firstSendUs <= kGroupUs) {
+        current_.lastSendUs = std::max(current_.lastSendUs, sent.sendTimeUs);
+        current_.lastArrivalUs = std::max(current_.lastArrivalUs, arrivalUs);
+        return;
+    }
+
+    if (previous_.valid) {
+        double sendDeltaMs = static_cast<double>(current_.lastSendUs - previous_.lastSendUs) / 1000.0;
+        double arrivalDeltaMs = static_cast<double>(current_.lastArrivalUs - previous_.lastArrivalUs) / 1000.0;
+        UpdateTrendline(arrivalDeltaMs - sendDeltaMs, arrivalDeltaMs, current_.lastArrivalUs);
+    }
+
+    previous_ = current_;
+    current_ = { sent.sendTimeUs, sent.sendTimeUs, arrivalUs, true };
+}
+
+void CongestionController::UpdateDelayBitrate(uint64_t nowUs) {
+    double rate = delayBitrate_;
+    double elapsedS = 0;
+
+    if (lastUpdateUs_) {
+        elapsedS = std::min(static_cast<double>(nowUs - lastUpdateUs_) / 1000000.0, 1.0);
+    }
+    lastUpdateUs_ = nowUs;
+
+    bool overusing = usage_ == BandwidthUsage::Overusing || queueDelayUs_ > kQueueLimitUs;
+
+    if (overusing) {
+        if (nowUs - lastDecreaseUs_ >= ResponseTimeUs()) {
+            double basis = ackedBitrate_ ? ackedBitrate_ : rate;
+            rate = std::min(rate, basis * kDecreaseFactor);
+            linkCapacity_ = ackedBitrate_;
+            lastDecreaseUs_ = nowUs;
+
+            LogF(LogLevel::Debug, L"Congestion: %.0f kbps (queue %lld ms, delivered %u kbps)",
+                rate / 1000, queueDelayUs_ / 1000, ackedBitrate_ / 1000);
+        }
+    } else if (usage_ == BandwidthUsage::Normal) {
+        // The link got faster than when it last congested
+        if (linkCapacity_ && ackedBitrate_ > linkCapacity_ * 1.3) {
+            linkCapacity_ = 0;
+        }
+
+        if (linkCapacity_ && rate > linkCapacity_ * 0.9) {
+            double responseMs = static_cast<double>(ResponseTimeUs() / 1000 + 100);
+            rate += kPacketBits * 1000.0 / responseMs * elapsedS;
+        } else {
+            rate += rate * kIncreasePerSecond * elapsedS;
+        }
+
+        // Not far past what the network has shown it delivers
+        if (ackedBitrate_) {
+            double cap = ackedBitrate_ * 1.5 + 10000;
+            if (rate > cap) {
+                rate = std::max<double>(cap, delayBitrate_);
+            }
+        }
+    }
+
+    delayBitrate_ = ClampBitrate(rate);
+}
+
+void CongestionController::UpdateLossBitrate(double fraction, uint64_t nowUs) {
+    double rate = lossBitrate_;
+
+    if (fraction > 0.10) {
+        if (nowUs - lastLossDecreaseUs_ >= ResponseTimeUs()) {
+            rate *= 1.0 - 0.5 * fraction;
+            lastLossDecreaseUs_ = nowUs;
+        }
+    } else if (fraction < 0.02 && lastLossUpdateUs_) {
+        double elapsedS = std::min(static_cast<double>(nowUs - lastLossUpdateUs_) / 1000000.0, 1.0);
+        rate += rate * kIncreasePerSecond * elapsedS;
+    }
+
+    lastLossUpdateUs_ = nowUs;
+    lossBitrate_ = ClampBitrate(rate);
+}
+
+bool CongestionController::OnTransportFeedback(std::span<const uint8_t> fci, uint64_t nowUs) {
+    if (fci.size() < 8) {
+        return false;
+    }
+
+    uint16_t baseSeq = ReadU16(&fci[0]);
+    uint16_t count = ReadU16(&fci[2]);
+    int32_t reference = static_cast<int32_t>((fci[4] << 16) | (fci[5] << 8) | fci[6]);
+    if (reference & 0x800000) {
+        reference -= 0x1000000;
+    }
+
+    if (count == 0 || count > kMaxFeedback) {
+        return false;
+    }
+
+    // Packet status chunks
+    std::array<uint8_t, kMaxFeedback> status;
+    size_t pos = 8;
+    uint32_t n = 0;
+
+    while (n < count) {
+        if (pos + 2 > fci.size()) {
+            return false;
+        }
+        uint16_t chunk = ReadU16(&fci[pos]);
+        pos += 2;
+
+        if (!(chunk & 0x8000)) {
+            // Run length
+            uint8_t symbol = (chunk >> 13) & 0x3;
+            for (uint32_t run = chunk & 0x1FFF; run > 0 && n < count; run--) {
+                status[n++] = symbol;
+            }
+        } else if (!(chunk & 0x4000)) {
+            // Fourteen one-bit symbols
+            for (int bit = 13; bit >= 0 && n < count; bit--) {
+                status[n++] = (chunk >> bit) & 0x1;
+            }
+        } else {
+            // Seven two-bit symbols
+            for (int bit = 12; bit >= 0 && n < count; bit -= 2) {
+                status[n++] = (chunk >> bit) & 0x3;
+            }
+        }
+    }
+
+    // Receive deltas, one per received packet
+    std::array<int64_t, kMaxFeedback> arrival;
+    int64_t arrivalUs = static_cast<int64_t>(reference) * kReferenceTimeUs;
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (status[i] == kStatusSmallDelta) {
+            if (pos + 1 > fci.size()) {
+                return false;
+            }
+            arrivalUs += static_cast<int64_t>(fci[pos]) * kDeltaUs;
+            pos += 1;
+        } else if (status[i] == kStatusLargeDelta) {
+            if (pos + 2 > fci.size()) {
+                return false;
+            }
+            arrivalUs += static_cast<int64_t>(static_cast<int16_t>(ReadU16(&fci[pos]))) * kDeltaUs;
+            pos += 2;
+        } else if (status[i] != kStatusNotReceived) {
+            return false;
+        }
+        arrival[i] = arrivalUs;
+    }
+
+    std::lock_guard lock(mutex_);
+
+    uint32_t received = 0;
+    uint32_t lost = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        auto seq = static_cast<uint16_t>(baseSeq + i);
+        SentPacket& sent = history_[seq % kHistorySize];
+
+        // Not ours, or no longer remembered
+        if (!sent.valid || sent.seq != seq) {
+            continue;
+        }
+
+        if (status[i] == kStatusNotReceived) {
+            lost++;
+            continue;
+        }
+
+        received++;
+        OnPacketArrival(sent, arrival[i], nowUs);
+        sent.valid = false;
+    }
+
+    if (received > 0) {
+        UpdateDelayBitrate(nowUs);
+    }
+    if (received + lost > 0) {
+        UpdateLossBitrate(static_cast<double>(lost) / (received + lost), nowUs);
+    }
+
+    return true;
+}
+
+void CongestionController::OnReceiverReport(uint8_t fractionLost, uint32_t rttMs, uint64_t nowUs) {
+    std::lock_guard lock(mutex_);
+
+    if (rttMs > 0) {
+        rttMs_ = rttMs_ ? (rttMs_ * 7 + rttMs) / 8 : rttMs;
+    }
+    UpdateLossBitrate(fractionLost / 256.0, nowUs);
+}
+
+CongestionTarget CongestionController::GetTarget(uint32_t width, uint32_t height) {
+    std::lock_guard lock(mutex_);
+
+    uint32_t bitrate = std::min(delayBitrate_, lossBitrate_);
+    double pixels = static_cast<double>(width) * height;
+    double fps = config_.maxFps;
+    uint32_t scale = 100;
+
+    // Frame rate gives way first, down to minFps; then the size steps
+    // down. Stepping back up needs a quarter of headroom, so the size
+    // does not flap at a step boundary.
+    if (pixels > 0) {
+        for (uint32_t step : kScales) {
+            scale = step;
+            double frameBits = pixels * scale * scale / 10000.0 * kBitsPerPixel;
+            double need = config_.minFps * (scale > scale_ ? 1.25 : 1.0);
+
+            fps = bitrate / frameBits;
+            if (fps >= need) {
+                break;
+            }
+        }
+    }
+
+    uint32_t rate = fps >= config_.maxFps ? config_.maxFps : static_cast<uint32_t>(fps);
+    if (rate > 5) rate -= rate % 5;
+    rate = std::max(rate, config_.minFps);
+
+    scale_ = scale;
+
+    CongestionTarget target;
+    target.bitrate = bitrate;
+    target.fps = rate;
+    target.scale = scale;
+    return target;
+}
+
+} // namespace zixiao::vdi
@@ -0,0 +1,140 @@
+/*
+ * Zixiao VDI Agent - Congestion Controller
+ *
+ * Copyright (c) 2025 Zixiao System
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#pragma once
+
+#include "../src/common.h"
+#include <array>
+
+namespace zixiao::vdi {
+
+//
+// Congestion controller configuration
+//
+struct CongestionControllerConfig {
+    uint32_t minBitrate = 150000;       // bits per second
+    uint32_t maxBitrate = 8000000;
+    uint32_t startBitrate = 1500000;
+    uint32_t minFps = 15;
+    uint32_t maxFps = 30;
+};
+
+//
+// What the video pipeline should send at
+//
+struct CongestionTarget {
+    uint32_t bitrate = 0;               // encoder target, bits per second
+    uint32_t fps = 0;                   // capture rate
+    uint32_t scale = 0;                 // percent of the captured size to encode
+};
+
+//
+// Send-side bandwidth estimation after Google Congestion Control
+//
+// Transport-wide feedback gives a delay-based estimate, receiver
+// reports a loss-based one; the target is the lower of the two. Times
+// are in microseconds of the local steady clock. Thread-safe.
+//
+class CongestionController {
+public:
+    explicit CongestionController(const CongestionControllerConfig& config = {});
+
+    // A video RTP packet left, with its transport-wide sequence number
+    void OnPacketSent(uint16_t seq, size_t size, uint64_t sendTimeUs);
+
+    // FCI of a transport-wide feedback packet (RTPFB, FMT 15)
+    bool OnTransportFeedback(std::span<const uint8_t> fci, uint64_t nowUs);
+
+    // Report block of an RTCP receiver report; rttMs is 0 when unknown
+    void OnReceiverReport(uint8_t fractionLost, uint32_t rttMs, uint64_t nowUs);
+
+    // Current target for a capture of the given size
+    CongestionTarget GetTarget(uint32_t width, uint32_t height);
+
+private:
+    static constexpr size_t kHistorySize = 4096;
+    static constexpr size_t kTrendWindow = 20;
+
+    struct SentPacket {
+        uint64_t sendTimeUs = 0;
+        uint32_t size = 0;
+        uint16_t seq = 0;
+        bool valid = false;
+    };
+
+    struct PacketGroup {
+        uint64_t firstSendUs = 0;
+        uint64_t lastSendUs = 0;
+        int64_t lastArrivalUs = 0;
+        bool valid = false;
+    };
+
+    enum class BandwidthUsage { Normal, Underusing, Overusing };
+
+    void OnPacketArrival(const SentPacket& sent, int64_t arrivalUs, uint64_t nowUs);
+    void UpdateTrendline(double delayDeltaMs, double arrivalDeltaMs, int64_t arrivalUs);
+    void DetectOveruse(double trend, double tsDeltaMs, int64_t nowMs);
+    void UpdateThreshold(double modifiedTrend, int64_t nowMs);
+    double TrendlineSlope() const;
+    void UpdateDelayBitrate(uint64_t nowUs);
+    void UpdateLossBitrate(double fraction, uint64_t nowUs);
+    uint32_t ClampBitrate(double rate) const;
+    uint64_t ResponseTimeUs() const;
+
+    CongestionControllerConfig config_;
+    std::mutex mutex_;
+
+    // Sent packets awaiting feedback
+    std::array<SentPacket, kHistorySize> history_{};
+
+    // Inter-group delay variation
+    PacketGroup current_;
+    PacketGroup previous_;
+
+    // Trendline over the accumulated variation
+    double accDelayMs_ = 0;
+    double smoothedDelayMs_ = 0;
+    std::array<double, kTrendWindow> trendX_{};
+    std::array<double, kTrendWindow> trendY_{};
+    size_t trendCount_ = 0;
+    size_t trendPos_ = 0;
+    int numDeltas_ = 0;
+    std::optional<int64_t> firstArrivalUs_;
+
+    // Overuse detector
+    double thresholdMs_;
+    double prevTrend_ = 0;
+    double timeOverUsingMs_ = -1;
+    int overuseCount_ = 0;
+    std::optional<int64_t> lastThresholdMs_;
+    BandwidthUsage usage_ = BandwidthUsage::Normal;
+
+    // Queueing over the lowest one-way delay, current and last window
+    std::array<int64_t, 2> baseDelayUs_;
+    uint64_t baseWindowStartUs_ = 0;
+    int64_t queueDelayUs_ = 0;
+
+    // Delivered rate
+    std::optional<int64_t> ackedWindowStartUs_;
+    uint64_t ackedBytes_ = 0;
+    uint32_t ackedBitrate_ = 0;
+
+    // Rate control
+    uint32_t delayBitrate_;
+    uint32_t lossBitrate_;
+    uint32_t linkCapacity_ = 0;         // delivered at the last overuse
+    uint64_t lastUpdateUs_ = 0;
+    uint64_t lastDecreaseUs_ = 0;
+    uint64_t lastLossUpdateUs_ = 0;
+    uint64_t lastLossDecreaseUs_ = 0;
+    uint32_t rttMs_ = 0;
+
+    // Resolution step in use
+    uint32_t scale_ = 100;
+};
+
+} // namespace zixiao::vdi
@@ -10,17 +10,51 @@
 
 #include "webrtc_agent.h"
 #include <winhttp.h>
-#include <mfapi.h>
-#include <mftransform.h>
-#include <codecapi.h>
-#include <mferror.h>
 
 #pragma comment(lib, "winhttp.lib")
-#pragma comment(lib, "mfplat.lib")
-#pragma comment(lib, "mfuuid.lib")
 
 namespace zixiao::vdi {
 
+namespace {
+
+// Video RTP packets: payload per packet, and RTP, extension, SRTP,
+// UDP and IP bytes around it
+constexpr size_t kRtpPayload = 1200;
+constexpr size_t kRtpOverhead = 68;
+
+// RTCP
+constexpr uint8_t kRtcpSenderReport = 200;
+constexpr uint8_t kRtcpReceiverReport = 201;
+constexpr uint8_t kRtcpTransportFeedback = 205;
+constexpr uint8_t kRtcpFmtTransportCc = 15;
+constexpr size_t kRtcpReportBlockSize = 24;
+
+// NTP seconds at the FILETIME epoch (1601)
+constexpr uint64_t kNtpFileTimeOffset = 9435484800ull;
+
+uint64_t NowUs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+uint32_t ReadU32(const uint8_t* p) {
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+// Middle 32 bits of the NTP time, as LSR in receiver reports
+uint32_t NtpShortTime() {
+    FILETIME ft;
+    GetSystemTimePreciseAsFileTime(&ft);
+
+    uint64_t ticks = (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    uint64_t seconds = ticks / 10000000 - kNtpFileTimeOffset;
+    uint64_t fraction = ((ticks % 10000000) << 16) / 10000000;
+    return static_cast<uint32_t>((seconds << 16) | fraction);
+}
+
+} // namespace
+
 //
 // SignalingClient implementation
 //
@@ -203,65 +237,6 @@ void SignalingClient::ReceiveLoop() {
     }
 }
 
-//
-// VideoEncoder implementation (using Media Foundation H.264)
-//
-VideoEncoder::VideoEncoder() = default;
-
-VideoEncoder::~VideoEncoder() {
-    Shutdown();
-}
-
-bool VideoEncoder::Initialize(uint32_t width, uint32_t height, uint32_t fps, uint32_t bitrate) {
-    width_ = width;
-    height_ = height;
-    fps_ = fps;
-    bitrate_ = bitrate;
-
-    // Initialize Media Foundation
-    HRESULT hr = MFStartup(MF_VERSION);
-    if (FAILED(hr)) {
-        LogF(LogLevel::Error, L"MFStartup failed: 0x%08X", hr);
-        return false;
-    }
-
-    // Create H.264 encoder MFT
-    // Note: This is a simplified implementation
-    // In production, use MFTEnumEx to find the encoder
-
-    LogF(LogLevel::Info, L"Video encoder initialized: %ux%u @ %u fps, %u kbps",
-        width, height, fps, bitrate / 1000);
-
-    initialized_ = true;
-    return true;
-}
-
-void VideoEncoder::Shutdown() {
-    if (initialized_) {
-        MFShutdown();
-        initialized_ = false;
-    }
-}
-
-bool VideoEncoder::EncodeFrame(const FrameData& frame, std::vector<uint8_t>& encodedData) {
-    if (!initialized_) {
-        return false;
-    }
-
-    // For now, just pass through raw frame data
-    // In production, use Media Foundation to encode to H.264
-
-    bool isKeyFrame = forceKeyFrame_ || (frameIndex_ % 30 == 0);
-    forceKeyFrame_ = false;
-    lastWasKeyFrame_ = isKeyFrame;
-    frameIndex_++;
-
-    // Simple pass-through for now
-    encodedData = frame.data;
-
-    return true;
-}
-
 //
 // WebRTCAgent implementation
 //
@@ -287,7 +262,9 @@ bool WebRTCAgent::Initialize() {
 
 void WebRTCAgent::Shutdown() {
     Stop();
-    videoEncoder_.Shutdown();
+
+    // Frames come from the capture thread, stopped by now
+    videoEncoder_.reset();
     LOG_INFO(L"WebRTC agent shutdown");
 }
 
@@ -390,10 +367,8 @@ void WebRTCAgent::HandleOffer(const std::string& sdp) {
     // For now, just acknowledge
     peerConnected_.store(true);
 
-    // Initialize video encoder with default settings
-    if (!videoEncoder_.Initialize(1920, 1080, 30, 4000000)) {
-        LOG_WARNING(L"Failed to initialize video encoder");
-    }
+    // A new peer starts decoding at a key frame
+    keyFrameNeeded_.store(true);
 
     // Send a simple answer
     std::string answer = "v=0\r\no=- 0 0 IN IP4 127.0.0.1\r\ns=-\r\nt=0 0\r\n";
@@ -487,21 +462,103 @@ void WebRTCAgent::ProcessDataChannelMessage(const std::vector<uint8_t>& data) {
     }
 }
 
+bool WebRTCAgent::EnsureEncoder(const FrameData& frame) {
+    if (frame.width == encoderWidth_ && frame.height == encoderHeight_ &&
+        target_.scale == encoderScale_) {
+        return videoEncoder_ != nullptr;
+    }
+
+    // A failure is not retried until the size changes
+    videoEncoder_.reset();
+    encoderWidth_ = frame.width;
+    encoderHeight_ = frame.height;
+    encoderScale_ = target_.scale;
+    encoderBitrate_ = target_.bitrate;
+
+    VideoEncoderConfig config;
+    config.width = frame.width;
+    config.height = frame.height;
+    if (target_.scale < 100) {
+        config.outputWidth = frame.width * target_.scale / 100;
+        config.outputHeight = frame.height * target_.scale / 100;
+    }
+    config.fps = target_.fps;
+    config.bitrate = target_.bitrate;
+
+    videoEncoder_ = CreateVideoEncoder(device_.Get(), config);
+    if (!videoEncoder_) {
+        LogF(LogLevel::Warning, L"WebRTC video disabled at %ux%u", frame.width, frame.height);
+        return false;
+    }
+
+    videoEncoder_->SetPacketCallback([this](const EncodedPacket& packet) {
+        OnEncodedPacket(packet);
+    });
+    return true;
+}
+
+//
+// Follow the congestion controller: capture rate, bitrate and size
+//
+void WebRTCAgent::ApplyCongestionTarget(const FrameData& frame) {
+    CongestionTarget target = congestion_.GetTarget(frame.width, frame.height);
+
+    if (target.fps != target_.fps && fpsCallback_) {
+        fpsCallback_(target.fps);
+    }
+
+    if (target_.scale && target.scale != target_.scale) {
+        LogF(LogLevel::Info, L"WebRTC video at %u%% for %u kbps", target.scale, target.bitrate / 1000);
+    }
+
+    // Encoders that cannot change rate while open are created again,
+    // once it is off by a quarter; a new encoder starts on a key frame
+    if (videoEncoder_ && target.bitrate != encoderBitrate_) {
+        if (videoEncoder_->SetBitrate(target.bitrate)) {
+            encoderBitrate_ = target.bitrate;
+        } else {
+            uint32_t low = std::min(target.bitrate, encoderBitrate_);
+            uint32_t high = std::max(target.bitrate, encoderBitrate_);
+            if (high - low > low / 4) {
+                encoderWidth_ = 0;
+            }
+        }
+    }
+
+    target_ = target;
+}
+
+void WebRTCAgent::OnEncodedPacket(const EncodedPacket& packet) {
+    // In a full implementation, packetize (RFC 6184) and send via RTP
+    // over the peer connection, every packet carrying the transport-wide
+    // sequence number extension. The congestion controller learns of
+    // each packet as it leaves
+    uint64_t now = NowUs();
+
+    for (size_t offset = 0; offset < packet.data.size(); offset += kRtpPayload) {
+        size_t payload = std::min(kRtpPayload, packet.data.size() - offset);
+        congestion_.OnPacketSent(transportSeq_++, payload + kRtpOverhead, now);
+    }
+
+    videoBytes_ += packet.data.size();
+}
+
 bool WebRTCAgent::SendFrame(const FrameData& frame) {
     if (!running_.load() || !peerConnected_.load()) {
         return false;
     }
 
-    // Encode frame
-    std::vector<uint8_t> encodedData;
-    if (!videoEncoder_.EncodeFrame(frame, encodedData)) {
+    ApplyCongestionTarget(frame);
+
+    if (!EnsureEncoder(frame)) {
         return false;
     }
 
-    // In a full implementation, send via RTP over the peer connection
-    // For now, this is a placeholder
+    if (keyFrameNeeded_.exchange(false)) {
+        videoEncoder_->ForceKeyFrame();
+    }
 
-    return true;
+    return videoEncoder_->EncodeFrame(frame);
 }
 
 bool WebRTCAgent::SendAudio(const AudioData& audio) {
@@ -517,4 +574,63 @@ bool WebRTCAgent::SendAudio(const AudioData& audio) {
     return true;
 }
 
+void WebRTCAgent::HandleReportBlock(const uint8_t* block, uint64_t nowUs) {
+    uint8_t fractionLost = block[4];
+    uint32_t lsr = ReadU32(block + 16);
+    uint32_t dlsr = ReadU32(block + 20);
+
+    // Round trip from our last sender report, in 1/65536 s
+    uint32_t rttMs = 0;
+    if (lsr != 0) {
+        uint32_t rtt = NtpShortTime() - lsr - dlsr;
+        if (rtt < 0x80000000u) {
+            rttMs = static_cast<uint32_t>((static_cast<uint64_t>(rtt) * 1000) >> 16);
+        }
+    }
+
+    congestion_.OnReceiverReport(fractionLost, rttMs, nowUs);
+}
+
+bool WebRTCAgent::HandleRtcp(std::span<const uint8_t> data) {
+    uint64_t now = NowUs();
+    bool handled = false;
+    size_t pos = 0;
+
+    // Only video is sent, so every report block is about it
+    while (pos + 4 <= data.size()) {
+        const uint8_t* packet = data.data() + pos;
+        if ((packet[0] >> 6) != 2) {
+            break;
+        }
+
+        uint8_t count = packet[0] & 0x1F;
+        uint8_t type = packet[1];
+        size_t length = (static_cast<size_t>((packet[2] << 8) | packet[3]) + 1) * 4;
+        if (pos + length > data.size()) {
+            break;
+        }
+
+        if (type == kRtcpSenderReport || type == kRtcpReceiverReport) {
+            // Header and sender SSRC, then sender info in an SR
+            size_t offset = type == kRtcpSenderReport ? 28 : 8;
+            for (uint8_t i = 0; i < count && offset + kRtcpReportBlockSize <= length; i++) {
+                HandleReportBlock(packet + offset, now);
+                offset += kRtcpReportBlockSize;
+            }
+            handled = true;
+        } else if (type == kRtcpTransportFeedback && count == kRtcpFmtTransportCc && length > 12) {
+            // Header, sender and media SSRC, then the FCI
+            if (congestion_.OnTransportFeedback(std::span(packet + 12, length - 12), now)) {
+                handled = true;
+            } else {
+                LogF(LogLevel::Debug, L"Malformed transport feedback");
+            }
+        }
+
+        pos += length;
+    }
+
+    return handled;
+}
+
 } // namespace zixiao::vdi
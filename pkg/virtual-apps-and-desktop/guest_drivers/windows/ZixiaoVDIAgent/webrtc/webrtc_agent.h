@@ -8,6 +8,8 @@
 #pragma once
 
 #include "../src/common.h"
+#include "../encoder/video_encoder.h"
+#include "congestion_controller.h"
 #include <nlohmann/json_fwd.hpp>
 
 namespace zixiao::vdi {
@@ -42,39 +44,6 @@ private:
     std::function<void(const std::string&)> messageCallback_;
 };
 
-//
-// Video encoder using Media Foundation
-//
-class VideoEncoder {
-public:
-    VideoEncoder();
-    ~VideoEncoder();
-
-    bool Initialize(uint32_t width, uint32_t height, uint32_t fps, uint32_t bitrate);
-    void Shutdown();
-
-    bool EncodeFrame(const FrameData& frame, std::vector<uint8_t>& encodedData);
-
-    bool IsKeyFrame() const { return lastWasKeyFrame_; }
-    void ForceKeyFrame() { forceKeyFrame_ = true; }
-
-private:
-    // Media Foundation objects (opaque pointers)
-    void* transform_ = nullptr;
-    void* inputType_ = nullptr;
-    void* outputType_ = nullptr;
-
-    uint32_t width_ = 0;
-    uint32_t height_ = 0;
-    uint32_t fps_ = 30;
-    uint32_t bitrate_ = 2000000;
-
-    bool initialized_ = false;
-    bool forceKeyFrame_ = false;
-    bool lastWasKeyFrame_ = false;
-    uint64_t frameIndex_ = 0;
-};
-
 //
 // WebRTC peer connection (simplified implementation)
 //
@@ -93,10 +62,20 @@ public:
     void SetSignalingUrl(const std::wstring& url) { signalingUrl_ = url; }
     void SetInputCallback(InputCallback callback) { inputCallback_ = std::move(callback); }
 
+    // Capture rate the congestion controller wants
+    void SetFpsCallback(std::function<void(uint32_t)> callback) { fpsCallback_ = std::move(callback); }
+
+    // Device of the GPU frames, for a hardware encoder; set before Start
+    void SetD3DDevice(ID3D11Device* device) { device_ = device; }
+
     // Send data to remote
     bool SendFrame(const FrameData& frame);
     bool SendAudio(const AudioData& audio);
 
+    // Compound RTCP packet from the peer: receiver reports and
+    // transport-wide feedback steer bitrate, frame rate and size
+    bool HandleRtcp(std::span<const uint8_t> data);
+
     // Control
     bool Start();
     void Stop();
@@ -111,13 +90,30 @@ private:
     void HandleIceCandidate(const std::string& candidate);
     bool SendSignalingMessage(const std::string& type, const std::string& payload);
     void ProcessDataChannelMessage(const std::vector<uint8_t>& data);
+    bool EnsureEncoder(const FrameData& frame);
+    void ApplyCongestionTarget(const FrameData& frame);
+    void OnEncodedPacket(const EncodedPacket& packet);
+    void HandleReportBlock(const uint8_t* block, uint64_t nowUs);
 
     // Signaling
     SignalingClient signaling_;
     std::wstring signalingUrl_;
 
-    // Video encoding
-    VideoEncoder videoEncoder_;
+    // Video encoding, opened for the frame size on the capture thread
+    Microsoft::WRL::ComPtr<ID3D11Device> device_;
+    std::unique_ptr<VideoEncoder> videoEncoder_;
+    uint32_t encoderWidth_ = 0;
+    uint32_t encoderHeight_ = 0;
+    uint32_t encoderScale_ = 0;
+    uint32_t encoderBitrate_ = 0;
+    std::atomic<bool> keyFrameNeeded_{false};
+    uint64_t videoBytes_ = 0;
+
+    // Congestion control, fed from the network and read per frame
+    CongestionController congestion_;
+    CongestionTarget target_;
+    uint16_t transportSeq_ = 0;
+    std::function<void(uint32_t)> fpsCallback_;
 
     // State
     std::atomic<bool> running_{false};